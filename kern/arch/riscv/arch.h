@@ -172,6 +172,11 @@ static inline void prefetchw(void *addr)
 {
 }
 
+static inline void clear_page_nt(void *kva)
+{
+	__builtin_memset(kva, 0, PGSIZE);
+}
+
 /* Resets a stack pointer to sp, then calls f(arg) */
 static inline void __attribute__((noreturn))
 __reset_stack_pointer(void *arg, uintptr_t sp, void (*f)(void *))
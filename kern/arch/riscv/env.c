@@ -152,6 +152,14 @@ env_user_mem_walk(env_t* e, void* start, size_t len,
 	                               NULL, NULL, e->env_pgdir, 0);
 }
 
+/* We never map user jumbos (see pgdir_walk_jumbo), so there's nothing to do. */
+int
+env_user_jumbo_walk(env_t* e, void* start, size_t len,
+                    mem_walk_callback_t callback, void* arg)
+{
+	return 0;
+}
+
 void
 env_pagetable_free(env_t* e)
 {
@@ -84,6 +84,13 @@ pgdir_walk(pgdir_t *pgdir, const void *va, int create)
   return &pt[idx];
 }
 
+/* No user jumbo pages yet; callers fall back to pgdir_walk. */
+pte_t*
+pgdir_walk_jumbo(pgdir_t *pgdir, const void *va, int create)
+{
+	return NULL;
+}
+
 /* Returns the effective permissions for PTE_U, PTE_W, and PTE_P on a given
  * virtual address. */
 int get_va_perms(pgdir_t *pgdir, const void *va)
@@ -62,6 +62,7 @@ void __abandon_core(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	lcr3(boot_cr3);
+	proc_tlb_unmark_core(pcpui->cur_proc);
 	proc_decref(pcpui->cur_proc);
 	pcpui->cur_proc = 0;
 }
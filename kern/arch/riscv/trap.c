@@ -375,6 +375,11 @@ int route_irqs(int cpu_vec, int coreid)
 	return -1;
 }
 
+int irq_lookup_vector(isr_t handler, void *irq_arg)
+{
+	return -1;
+}
+
 void __arch_reflect_trap_hwtf(struct hw_trapframe *hw_tf, unsigned int trap_nr,
                               unsigned int err, unsigned long aux)
 {
@@ -57,6 +57,15 @@ static inline int copy_to_user(void *dst, const void *src, unsigned int count)
 	return err;
 }
 
+static inline int __user_memcpy_bulk(void *dst, const void *src, size_t count)
+{
+#warning "The __user_memcpy_bulk() API is a stub and should be re-implemented"
+
+	memcpy(dst, src, count);
+
+	return 0;
+}
+
 static inline int __get_user(void *dst, const void *src, unsigned int count)
 {
 #warning "The __get_user() API is a stub and should be re-implemented"
@@ -26,6 +26,7 @@ static inline void reboot(void)
               __attribute__((always_inline)) __attribute__((noreturn));
 static inline void prefetch(void *addr);
 static inline void prefetchw(void *addr);
+static inline void clear_page_nt(void *kva);
 static inline void swap_gs(void);
 static inline void __attribute__((noreturn))
 __reset_stack_pointer(void *arg, uintptr_t sp, void (*f)(void *));
@@ -166,6 +167,24 @@ static inline void prefetchw(void *addr)
 	asm volatile("prefetchw (%0)" : : "r"(addr));
 }
 
+/* Zeroes a page with non-temporal stores, which skip the cache.  These are
+ * weakly ordered, so we sfence before anyone else can see the page. */
+static inline void clear_page_nt(void *kva)
+{
+	for (uintptr_t p = (uintptr_t)kva; p < (uintptr_t)kva + PGSIZE; p += 64) {
+		asm volatile("movnti %1, 0(%0);"
+		             "movnti %1, 8(%0);"
+		             "movnti %1, 16(%0);"
+		             "movnti %1, 24(%0);"
+		             "movnti %1, 32(%0);"
+		             "movnti %1, 40(%0);"
+		             "movnti %1, 48(%0);"
+		             "movnti %1, 56(%0);"
+		             : : "r"(p), "r"(0UL) : "memory");
+	}
+	asm volatile("sfence" ::: "memory");
+}
+
 /* Guest VMs have a maximum physical address they can use.  Guest
  * physical addresses are mapped into this MCP 1:1, but limited to
  * this max address *in hardware*.  I.e., the MCP process can address
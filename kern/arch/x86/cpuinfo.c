@@ -187,12 +187,24 @@ void print_cpuinfo(void)
 	#define CPUID_XSAVEOPT_SUPPORT      (1 << 0)
 	#define CPUID_MONITOR_MWAIT         (1 << 3)
 	#define CPUID_MWAIT_PWR_MGMT        (1 << 0)
+	#define CPUID_ADX_SUPPORT           (1 << 19)
+	#define CPUID_ERMS_SUPPORT          (1 << 9)
+	#define CPUID_FSRM_SUPPORT          (1 << 4)
+	#define CPUID_PCLMUL_SUPPORT        (1 << 1)
+	#define CPUID_SSSE3_SUPPORT         (1 << 9)
+	#define CPUID_AESNI_SUPPORT         (1 << 25)
 
 	cpuid(0x01, 0x00, 0, 0, &ecx, &edx);
 	if (CPUID_FXSR_SUPPORT & edx)
 		cpu_set_feat(CPU_FEAT_X86_FXSR);
 	if (CPUID_XSAVE_SUPPORT & ecx)
 		cpu_set_feat(CPU_FEAT_X86_XSAVE);
+	if (CPUID_PCLMUL_SUPPORT & ecx)
+		cpu_set_feat(CPU_FEAT_X86_PCLMUL);
+	if (CPUID_SSSE3_SUPPORT & ecx)
+		cpu_set_feat(CPU_FEAT_X86_SSSE3);
+	if (CPUID_AESNI_SUPPORT & ecx)
+		cpu_set_feat(CPU_FEAT_X86_AESNI);
 
 	cpuid(0x0d, 0x01, &eax, 0, 0, 0);
 	if (CPUID_XSAVEOPT_SUPPORT & eax)
@@ -204,6 +216,18 @@ void print_cpuinfo(void)
 		if (CPUID_MWAIT_PWR_MGMT & ecx)
 			cpu_set_feat(CPU_FEAT_X86_MWAIT);
 	}
+
+	cpuid(0x07, 0x00, 0, &ebx, 0, &edx);
+	if (CPUID_ADX_SUPPORT & ebx)
+		cpu_set_feat(CPU_FEAT_X86_ADX);
+	if (CPUID_ERMS_SUPPORT & ebx)
+		cpu_set_feat(CPU_FEAT_X86_ERMS);
+	if (CPUID_FSRM_SUPPORT & edx)
+		cpu_set_feat(CPU_FEAT_X86_FSRM);
+	printk("Fast rep movsb/stosb (ERMS) %ssupported, fast short rep movsb "
+	       "(FSRM) %ssupported\n",
+	       cpu_has_feat(CPU_FEAT_X86_ERMS) ? "" : "not ",
+	       cpu_has_feat(CPU_FEAT_X86_FSRM) ? "" : "not ");
 }
 
 #define BIT_SPACING "        "
@@ -29,6 +29,7 @@
 #include <arch/ros/msr-index.h>
 #include <arch/msr.h>
 #include <arch/devarch.h>
+#include <arch/uncore.h>
 
 #define REAL_MEM_SIZE (1024 * 1024)
 
@@ -67,6 +68,9 @@ enum {
 	Qperf,
 	Qcstate,
 	Qpstate,
+	Quncore,
+	Qrapl,
+	Qirqstat,
 
 	Qmax,
 };
@@ -88,6 +92,9 @@ static struct dirtab archdir[Qmax] = {
 	{"perf", {Qperf, 0}, 0, 0666},
 	{"c-state", {Qcstate, 0}, 0, 0666},
 	{"p-state", {Qpstate, 0}, 0, 0666},
+	{"uncore", {Quncore, 0}, 0, 0666},
+	{"rapl", {Qrapl, 0}, 0, 0444},
+	{"irqstat", {Qirqstat, 0}, 0, 0666},
 };
 
 /* White list entries must not overlap. */
@@ -478,6 +485,14 @@ static struct chan *archopen(struct chan *c, int omode)
 			assert(!c->aux);
 			c->aux = arch_create_perf_context();
 			break;
+		case Quncore:
+			if (!uncore_imc_supported())
+				error(ENODEV, "no supported uncore PMUs");
+			break;
+		case Qrapl:
+			if (!uncore_rapl_supported())
+				error(ENODEV, "RAPL is not supported");
+			break;
 	}
 
 	return c;
@@ -595,6 +610,12 @@ static size_t archread(struct chan *c, void *a, size_t n, off64_t offset)
 			return readnum_hex(offset, a, n, get_cstate(), NUMSIZE32);
 		case Qpstate:
 			return readnum_hex(offset, a, n, get_pstate(), NUMSIZE32);
+		case Quncore:
+			return uncore_imc_read(a, n, offset);
+		case Qrapl:
+			return uncore_rapl_read(a, n, offset);
+		case Qirqstat:
+			return irqstat_read(a, n, offset);
 		}
 		default:
 			error(EINVAL, ERROR_FIXME);
@@ -654,6 +675,36 @@ static ssize_t pstate_write(void *ubuf, size_t len, off64_t off)
 	return len;
 }
 
+static ssize_t uncore_write(void *ubuf, size_t len)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb = parsecmd(ubuf, len);
+
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	uncore_imc_ctl(cb);
+	poperror();
+	kfree(cb);
+	return len;
+}
+
+static ssize_t irqstat_write(void *ubuf, size_t len)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb = parsecmd(ubuf, len);
+
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	irqstat_ctl(cb);
+	poperror();
+	kfree(cb);
+	return len;
+}
+
 static size_t archwrite(struct chan *c, void *a, size_t n, off64_t offset)
 {
 	char *p;
@@ -735,6 +786,10 @@ static size_t archwrite(struct chan *c, void *a, size_t n, off64_t offset)
 			return cstate_write(a, n, 0);
 		case Qpstate:
 			return pstate_write(a, n, 0);
+		case Quncore:
+			return uncore_write(a, n);
+		case Qirqstat:
+			return irqstat_write(a, n);
 		default:
 			error(EINVAL, ERROR_FIXME);
 	}
@@ -749,6 +804,7 @@ static void archinit(void)
 	assert(!ret);
 	ret = address_range_init(msr_wr_wlist, ARRAY_SIZE(msr_wr_wlist));
 	assert(!ret);
+	uncore_init();
 }
 
 struct dev archdevtab __devtab = {
@@ -3,10 +3,45 @@
 #include <arch/mmu.h>
 #include <cpu_feat.h>
 #include <arch/uaccess.h>
+#include <alarm.h>
 
+/* The deepest C-state we'll use; set_cstate() changes it. */
 static unsigned int x86_cstate;
 
-/* This atomically enables interrupts and halts.  It returns with IRQs off.
+/* Roughly how long we need to be idle for each C-state to be worth it (its
+ * target residency), deepest first.  These are in the ballpark of recent Intel
+ * parts; the exit latencies are a fraction of these. */
+static const struct {
+	unsigned int				hint;
+	uint64_t					min_usec;
+} x86_cstate_residency[] = {
+	{X86_MWAIT_C6,	600},
+	{X86_MWAIT_C3,	200},
+	{X86_MWAIT_C2,	20},
+	{X86_MWAIT_C1,	0},
+};
+
+/* Picks the MWAIT hint for the calling core's idle, no deeper than x86_cstate.
+ * The bottom nibble of a hint is a sub-state, which we keep from x86_cstate. */
+static unsigned int pick_cstate(void)
+{
+	unsigned int max = x86_cstate;
+	unsigned int hint;
+	uint64_t idle_usec = pcpu_idle_usec();
+
+	for (int i = 0; i < ARRAY_SIZE(x86_cstate_residency); i++) {
+		hint = x86_cstate_residency[i].hint;
+		if ((hint & 0xf0) > (max & 0xf0))
+			continue;
+		if (idle_usec < x86_cstate_residency[i].min_usec)
+			continue;
+		return (hint & 0xf0) == (max & 0xf0) ? max : hint;
+	}
+	return X86_MWAIT_C1;
+}
+
+/* This atomically enables interrupts and halts, as deeply as the next alarm
+ * allows.  It returns with IRQs off.
  *
  * Note that sti does not take effect until after the *next* instruction */
 void cpu_halt(void)
@@ -15,7 +50,8 @@ void cpu_halt(void)
 		/* TODO: since we're monitoring anyway, x86 could use monitor/mwait for
 		 * KMSGs, instead of relying on IPIs.  (Maybe only for ROUTINE). */
 		asm volatile("monitor" : : "a"(KERNBASE), "c"(0), "d"(0));
-		asm volatile("sti; mwait" : : "c"(0x0), "a"(x86_cstate) : "memory");
+		asm volatile("sti; mwait" : : "c"(0x0), "a"(pick_cstate())
+		             : "memory");
 	} else {
 		asm volatile("sti; hlt" : : : "memory");
 	}
@@ -34,7 +70,8 @@ void cpu_halt_notif_pending(struct preempt_data *vcpd)
 	/* Note we don't use the ecx=1 setting - we actually want to sti so that we
 	 * handle the IRQ and not just wake from it. */
 	if (cpu_has_feat(CPU_FEAT_X86_MWAIT))
-		asm volatile("sti; mwait" : : "c"(0x0), "a"(x86_cstate) : "memory");
+		asm volatile("sti; mwait" : : "c"(0x0), "a"(pick_cstate())
+		             : "memory");
 	else
 		asm volatile("sti; hlt" : : : "memory");
 	disable_irq();
@@ -71,6 +71,11 @@ static inline void kpte_clear_dirty(kpte_t *kpte)
 	*kpte &= ~PTE_D;
 }
 
+static inline void kpte_clear_accessed(kpte_t *kpte)
+{
+	*kpte &= ~PTE_A;
+}
+
 static inline void kpte_clear(kpte_t *kpte)
 {
 	*kpte = 0;
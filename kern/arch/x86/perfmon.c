@@ -28,7 +28,26 @@
  *
  * You can have multiple sessions, but if you try to install the same counter in
  * multiple, concurrent sessions, the hardware might complain (it definitely
- * will if it is a fixed event). */
+ * will if it is a fixed event).
+ *
+ * Unfixed events are multiplexed.  Each core has up to MAX_PERFMON_COUNTERS
+ * 'vcounters', and cores_counters[] refers to those, not to the hardware.  If
+ * there are more vcounters than hardware counters, a per-core IRQ alarm
+ * rotates which ones are on the hardware every PERFMON_MUX_USEC.  A vcounter
+ * keeps its value while it's off the hardware, and we track how long it was
+ * enabled and how long it was actually counting, so the status of a counting
+ * event is scaled up to its whole enabled time, like Linux's perf.  Sampling
+ * (INTEN) events just sample less often.
+ *
+ * On Intel, sampling events can ask for PEBS (PERFMON_PRECISE_EVENT), which
+ * gets us the exact IP of the sample instead of wherever the PMI landed, and
+ * for the Last Branch Records (PERFMON_LBR_EVENT), which go to the profiler
+ * with the sample.  PEBS counters don't interrupt on overflow.  The hardware
+ * writes a record into the core's DS area and interrupts once the buffer has
+ * a record, and we set the IP of the NMI's sample from that record.  We only
+ * support PEBS record formats 1-3 (Nehalem through Skylake), and only on the
+ * first PERFMON_MAX_PEBS_COUNTERS counters; a precise event that rotates onto
+ * a higher counter samples imprecisely. */
 
 #include <sys/types.h>
 #include <arch/ros/msr-index.h>
@@ -43,18 +62,63 @@
 #include <core_set.h>
 #include <percpu.h>
 #include <kmalloc.h>
+#include <page_alloc.h>
 #include <err.h>
 #include <string.h>
 #include <profiler.h>
+#include <alarm.h>
+#include <time.h>
 #include <arch/perfmon.h>
 
 #define FIXCNTR_NBITS 4
 #define FIXCNTR_MASK (((uint64_t) 1 << FIXCNTR_NBITS) - 1)
 
+#define PERFMON_MUX_USEC 4000
+
+#define PERFMON_MAX_LBR 32
+#define PERFMON_MAX_PEBS_COUNTERS 4
+#define PERF_GLOBAL_STATUS_PEBS_OVF (1ULL << 62)
+
+/* PEBS record fields, as u64 indexes, for formats 1-3 */
+#define PEBS_REC_IP 1
+#define PEBS_REC_STATUS 18
+#define PEBS_REC_REAL_IP 22		/* format 2+ */
+#define PEBS_BUF_OFFSET 256		/* into the DS area's page */
+
+struct perfmon_ds_area {
+	uint64_t bts_buffer_base;
+	uint64_t bts_index;
+	uint64_t bts_absolute_maximum;
+	uint64_t bts_interrupt_threshold;
+	uint64_t pebs_buffer_base;
+	uint64_t pebs_index;
+	uint64_t pebs_absolute_maximum;
+	uint64_t pebs_interrupt_threshold;
+	uint64_t pebs_counter_reset[8];
+};
+
+/* An unfixed event on a core.  ev.event == 0 means it is free. */
+struct perfmon_vcounter {
+	struct perfmon_event ev;
+	int hw_idx;					/* -1 when not on the hardware */
+	uint64_t saved;				/* counter MSR value when not on the hw */
+	uint64_t opened_at;
+	uint64_t loaded_at;
+	uint64_t running_ns;		/* up to the last unload */
+};
+
 struct perfmon_cpu_context {
 	spinlock_t lock;
+	/* Indexed by hardware counter, copies of the vcounters' events */
 	struct perfmon_event counters[MAX_VAR_COUNTERS];
 	struct perfmon_event fixed_counters[MAX_FIX_COUNTERS];
+	struct perfmon_vcounter vcounters[MAX_PERFMON_COUNTERS];
+	int mux_next;
+	bool mux_armed;
+	struct alarm_waiter mux_waiter;
+	struct perfmon_ds_area *ds;
+	uint32_t pebs_mask;			/* hw counters with PEBS on */
+	int nr_lbr_events;
 };
 
 struct perfmon_status_env {
@@ -63,15 +127,23 @@ struct perfmon_status_env {
 };
 
 static struct perfmon_cpu_caps cpu_caps;
+static int lbr_nr;				/* 0 if we don't do LBRs */
+static int pebs_fmt;			/* 0 if we don't do PEBS */
+static size_t pebs_rec_size;
 static DEFINE_PERCPU(struct perfmon_cpu_context, counters_env);
 DEFINE_PERCPU_INIT(perfmon_counters_env_init);
 
+static void perfmon_mux_handler(struct alarm_waiter *waiter,
+                                struct hw_trapframe *hw_tf);
+
 #define PROFILER_BT_DEPTH 16
 
 struct sample_snapshot {
 	struct user_context			ctx;
 	uintptr_t					pc_list[PROFILER_BT_DEPTH];
 	size_t						nr_pcs;
+	struct proftype_branch64	lbr[PERFMON_MAX_LBR];
+	size_t						nr_lbr;
 };
 static DEFINE_PERCPU(struct sample_snapshot, sample_snapshots);
 
@@ -81,6 +153,7 @@ static void perfmon_counters_env_init(void)
 		struct perfmon_cpu_context *cctx = _PERCPU_VARPTR(counters_env, i);
 
 		spinlock_init_irqsave(&cctx->lock);
+		init_awaiter_irq(&cctx->mux_waiter, perfmon_mux_handler);
 	}
 }
 
@@ -98,6 +171,109 @@ static void perfmon_read_cpu_caps(struct perfmon_cpu_caps *pcc)
 	pcc->perfmon_version = a & 0xff;
 }
 
+static int perfmon_model_nr_lbrs(int model)
+{
+	switch (model) {
+	case 0x1c: case 0x26: case 0x27: case 0x35: case 0x36:	/* Bonnell */
+	case 0x37: case 0x4a: case 0x4c: case 0x4d: case 0x5a:	/* Silvermont */
+		return 8;
+	case 0x4e: case 0x5e: case 0x55: case 0x8e: case 0x9e:	/* Skylake */
+	case 0x5c: case 0x5f: case 0x7a:						/* Goldmont */
+		return 32;
+	default:
+		/* Core 2 has 4, with different MSRs */
+		return model >= 0x1a ? 16 : 0;
+	}
+}
+
+static void perfmon_read_lbr_pebs_caps(void)
+{
+	uint32_t a, b, c, d;
+
+	if (!cpu_has_feat(CPU_FEAT_X86_VENDOR_INTEL) || x86_family != 6)
+		return;
+	lbr_nr = perfmon_model_nr_lbrs(x86_model);
+	cpuid(0x01, 0, &a, &b, &c, &d);
+	/* DS area and PERF_CAPABILITIES */
+	if (!(d & (1 << 21)) || !(c & (1 << 15)))
+		return;
+	if (read_msr(MSR_IA32_MISC_ENABLE) & MSR_IA32_MISC_ENABLE_PEBS_UNAVAIL)
+		return;
+	switch ((read_msr(MSR_IA32_PERF_CAPABILITIES) >> 8) & 0xf) {
+	case 1:
+		pebs_rec_size = 0xb0;
+		break;
+	case 2:
+		pebs_rec_size = 0xc0;
+		break;
+	case 3:
+		pebs_rec_size = 0xc8;
+		break;
+	default:
+		return;
+	}
+	pebs_fmt = (read_msr(MSR_IA32_PERF_CAPABILITIES) >> 8) & 0xf;
+}
+
+/* One page per core: the DS area, then the PEBS buffer.  We interrupt after
+ * every record, like a regular sampling counter. */
+static void perfmon_pebs_pcpu_init(struct perfmon_cpu_context *cctx)
+{
+	struct perfmon_ds_area *ds = kpage_zalloc_addr();
+	uintptr_t buf = (uintptr_t)ds + PEBS_BUF_OFFSET;
+
+	ds->pebs_buffer_base = buf;
+	ds->pebs_index = buf;
+	ds->pebs_absolute_maximum =
+		buf + (PGSIZE - PEBS_BUF_OFFSET) / pebs_rec_size * pebs_rec_size;
+	ds->pebs_interrupt_threshold = buf + pebs_rec_size;
+	cctx->ds = ds;
+	write_msr(MSR_IA32_PEBS_ENABLE, 0);
+	write_msr(MSR_IA32_DS_AREA, (uintptr_t)ds);
+}
+
+/* LBRs are shared by all of a core's LBR events.  Hold the cctx lock. */
+static void perfmon_lbr_get(struct perfmon_cpu_context *cctx)
+{
+	if (cctx->nr_lbr_events++)
+		return;
+	write_msr(MSR_LBR_SELECT, 0);
+	write_msr(MSR_IA32_DEBUGCTLMSR, read_msr(MSR_IA32_DEBUGCTLMSR) |
+	          DEBUGCTLMSR_LBR | DEBUGCTLMSR_FREEZE_LBRS_ON_PMI);
+}
+
+static void perfmon_lbr_put(struct perfmon_cpu_context *cctx)
+{
+	if (--cctx->nr_lbr_events)
+		return;
+	write_msr(MSR_IA32_DEBUGCTLMSR, read_msr(MSR_IA32_DEBUGCTLMSR) &
+	          ~(DEBUGCTLMSR_LBR | DEBUGCTLMSR_FREEZE_LBRS_ON_PMI));
+}
+
+/* The LBRs are frozen from the PMI until we clear the overflow status. */
+static void perfmon_read_lbrs(struct sample_snapshot *sample)
+{
+	uint64_t tos = read_msr(MSR_LBR_TOS);
+	uint64_t from, to;
+	struct proftype_branch64 *br;
+	int i;
+
+	for (i = 0; i < lbr_nr; i++) {
+		int idx = (tos - i) & (lbr_nr - 1);
+
+		from = read_msr(MSR_LBR_NHM_FROM + idx);
+		to = read_msr(MSR_LBR_NHM_TO + idx);
+		if (!from)
+			break;
+		br = &sample->lbr[i];
+		/* The top bits are flags; the addresses are 48 bit canonical. */
+		br->flags = from & (1ULL << 63) ? PROF_BRANCH_MISPRED : 0;
+		br->from = (int64_t)(from << 16) >> 16;
+		br->to = (int64_t)(to << 16) >> 16;
+	}
+	sample->nr_lbr = i;
+}
+
 static void perfmon_enable_event(int idx, uint64_t event)
 {
 	uint64_t gctrl;
@@ -194,15 +370,168 @@ static void perfmon_set_fixed_trigger(unsigned int idx, uint64_t count)
 	write_msr(MSR_CORE_PERF_FIXED_CTR0 + idx, write_val);
 }
 
+static uint64_t perfmon_unfixed_trigger_val(uint64_t count)
+{
+	return -(int64_t)count & ((1ULL << cpu_caps.bits_x_counter) - 1);
+}
+
 /* Helper to set a regular perfcounter to trigger/overflow after count events.
  * Anytime you set a perfcounter to something non-zero, you ought to use this
  * helper. */
 static void perfmon_set_unfixed_trigger(unsigned int idx, uint64_t count)
 {
-	int64_t write_val = -(int64_t)count;
+	write_msr(MSR_IA32_PERFCTR0 + idx, perfmon_unfixed_trigger_val(count));
+}
 
-	write_val &= (1ULL << cpu_caps.bits_x_counter) - 1;
-	write_msr(MSR_IA32_PERFCTR0 + idx, write_val);
+/* Helper: Reads an unfixed counter's value.  Returns the max amount possible if
+ * the counter overflowed. */
+static uint64_t perfmon_read_unfixed_counter(int ccno)
+{
+	uint64_t overflow_status = read_msr(MSR_CORE_PERF_GLOBAL_STATUS);
+
+	if (overflow_status & (1ULL << ccno))
+		return (1ULL << cpu_caps.bits_x_counter) - 1;
+	else
+		return read_msr(MSR_IA32_PERFCTR0 + ccno);
+}
+
+/* The vcounter helpers need the cctx lock. */
+static int perfmon_find_free_hw_counter(struct perfmon_cpu_context *cctx)
+{
+	for (int i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
+		if (cctx->counters[i].event == 0) {
+			/* kernel bug if the MSRs don't agree with our bookkeeping */
+			assert(perfmon_event_available(i));
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int perfmon_nr_vcounters(struct perfmon_cpu_context *cctx)
+{
+	int nr = 0;
+
+	for (int i = 0; i < MAX_PERFMON_COUNTERS; i++)
+		nr += cctx->vcounters[i].ev.event != 0;
+	return nr;
+}
+
+static void perfmon_vc_load(struct perfmon_cpu_context *cctx,
+                            struct perfmon_vcounter *vc, int idx)
+{
+	uint64_t event = vc->ev.event;
+
+	cctx->counters[idx] = vc->ev;
+	vc->hw_idx = idx;
+	vc->loaded_at = nsec();
+	write_msr(MSR_IA32_PERFCTR0 + idx, vc->saved);
+	write_msr(MSR_CORE_PERF_GLOBAL_OVF_CTRL, 1ULL << idx);
+	if ((vc->ev.flags & PERFMON_PRECISE_EVENT) &&
+	    idx < PERFMON_MAX_PEBS_COUNTERS) {
+		/* The PEBS assist reloads the counter, and the DS threshold raises
+		 * the PMI, not the counter. */
+		cctx->ds->pebs_counter_reset[idx] =
+			perfmon_unfixed_trigger_val(vc->ev.trigger_count);
+		PMEV_SET_INTEN(event, 0);
+		cctx->pebs_mask |= 1 << idx;
+		write_msr(MSR_IA32_PEBS_ENABLE, cctx->pebs_mask);
+	}
+	perfmon_enable_event(idx, event);
+}
+
+static void perfmon_vc_unload(struct perfmon_cpu_context *cctx,
+                              struct perfmon_vcounter *vc)
+{
+	int idx = vc->hw_idx;
+
+	if (cctx->pebs_mask & (1 << idx)) {
+		cctx->pebs_mask &= ~(1 << idx);
+		write_msr(MSR_IA32_PEBS_ENABLE, cctx->pebs_mask);
+	}
+	perfmon_disable_event(idx);
+	vc->saved = perfmon_read_unfixed_counter(idx);
+	write_msr(MSR_CORE_PERF_GLOBAL_OVF_CTRL, 1ULL << idx);
+	write_msr(MSR_IA32_PERFCTR0 + idx, 0);
+	vc->running_ns += nsec() - vc->loaded_at;
+	perfmon_init_event(&cctx->counters[idx]);
+	vc->hw_idx = -1;
+}
+
+/* Puts waiting vcounters on any free hardware counters. */
+static void perfmon_mux_fill(struct perfmon_cpu_context *cctx)
+{
+	struct perfmon_vcounter *vc;
+	int idx;
+
+	for (int i = 0; i < MAX_PERFMON_COUNTERS; i++) {
+		vc = &cctx->vcounters[(cctx->mux_next + i) % MAX_PERFMON_COUNTERS];
+		if (!vc->ev.event || vc->hw_idx >= 0)
+			continue;
+		idx = perfmon_find_free_hw_counter(cctx);
+		if (idx < 0)
+			return;
+		perfmon_vc_load(cctx, vc, idx);
+	}
+}
+
+/* Takes everyone off the hardware and loads the next batch, round robin. */
+static void perfmon_mux_rotate(struct perfmon_cpu_context *cctx)
+{
+	struct perfmon_vcounter *vc;
+	int nr_loaded = 0, i;
+
+	for (i = 0; i < MAX_PERFMON_COUNTERS; i++) {
+		vc = &cctx->vcounters[i];
+		if (vc->ev.event && vc->hw_idx >= 0)
+			perfmon_vc_unload(cctx, vc);
+	}
+	for (i = 0; i < MAX_PERFMON_COUNTERS; i++) {
+		if (nr_loaded == cpu_caps.counters_x_proc)
+			break;
+		vc = &cctx->vcounters[(cctx->mux_next + i) % MAX_PERFMON_COUNTERS];
+		if (vc->ev.event)
+			perfmon_vc_load(cctx, vc, nr_loaded++);
+	}
+	cctx->mux_next = (cctx->mux_next + i) % MAX_PERFMON_COUNTERS;
+}
+
+static void perfmon_mux_handler(struct alarm_waiter *waiter,
+                                struct hw_trapframe *hw_tf)
+{
+	struct perfmon_cpu_context *cctx =
+		container_of(waiter, struct perfmon_cpu_context, mux_waiter);
+	bool again;
+
+	spin_lock_irqsave(&cctx->lock);
+	again = perfmon_nr_vcounters(cctx) > cpu_caps.counters_x_proc;
+	if (again)
+		perfmon_mux_rotate(cctx);
+	cctx->mux_armed = again;
+	spin_unlock_irqsave(&cctx->lock);
+	if (again) {
+		set_awaiter_rel(waiter, PERFMON_MUX_USEC);
+		set_alarm(&per_cpu_info[core_id()].tchain, waiter);
+	}
+}
+
+/* Scales a counting event's value from the time it was on the hardware to the
+ * time it was open. */
+static uint64_t perfmon_vc_value(struct perfmon_vcounter *vc)
+{
+	uint64_t now = nsec();
+	uint64_t value, running = vc->running_ns;
+	uint64_t enabled = now - vc->opened_at;
+
+	if (vc->hw_idx >= 0) {
+		value = perfmon_read_unfixed_counter(vc->hw_idx);
+		running += now - vc->loaded_at;
+	} else {
+		value = vc->saved;
+	}
+	if (PMEV_GET_INTEN(vc->ev.event) || !running || running >= enabled)
+		return value;
+	return ((unsigned __int128)value * enabled) / running;
 }
 
 /* Helper: sets errno/errstr based on the error code returned from the core.  We
@@ -234,6 +563,7 @@ static void perfmon_do_cores_alloc(void *opaque)
 	struct perfmon_cpu_context *cctx = PERCPU_VARPTR(counters_env);
 	int i;
 	struct perfmon_event *pev;
+	bool arm_mux = FALSE;
 
 	spin_lock_irqsave(&cctx->lock);
 	if (perfmon_is_fixed_event(&pa->ev)) {
@@ -256,28 +586,37 @@ static void perfmon_do_cores_alloc(void *opaque)
 			perfmon_enable_fix_event(i, pev->event, fxctrl_value);
 		}
 	} else {
-		for (i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
-			if (cctx->counters[i].event == 0) {
-				/* kernel bug if the MSRs don't agree with our bookkeeping */
-				assert(perfmon_event_available(i));
+		struct perfmon_vcounter *vc;
+
+		for (i = 0; i < MAX_PERFMON_COUNTERS; i++) {
+			if (cctx->vcounters[i].ev.event == 0)
 				break;
-			}
 		}
-		if (i < (int) cpu_caps.counters_x_proc) {
-			cctx->counters[i] = pa->ev;
-			pev = &cctx->counters[i];
-			if (PMEV_GET_INTEN(pev->event))
-				perfmon_set_unfixed_trigger(i, pev->trigger_count);
-			else
-				write_msr(MSR_IA32_PERFCTR0 + i, 0);
-			write_msr(MSR_CORE_PERF_GLOBAL_OVF_CTRL, 1ULL << i);
-			perfmon_enable_event(i, pev->event);
+		if (i < MAX_PERFMON_COUNTERS) {
+			vc = &cctx->vcounters[i];
+			vc->ev = pa->ev;
+			vc->hw_idx = -1;
+			vc->saved = PMEV_GET_INTEN(vc->ev.event) ?
+			            perfmon_unfixed_trigger_val(vc->ev.trigger_count) : 0;
+			vc->opened_at = nsec();
+			vc->running_ns = 0;
+			perfmon_mux_fill(cctx);
+			if (vc->hw_idx < 0 && !cctx->mux_armed) {
+				cctx->mux_armed = TRUE;
+				arm_mux = TRUE;
+			}
 		} else {
 			i = -ENOSPC;
 		}
 	}
+	if ((i >= 0) && (pa->ev.flags & PERFMON_LBR_EVENT))
+		perfmon_lbr_get(cctx);
 	spin_unlock_irqsave(&cctx->lock);
 
+	if (arm_mux) {
+		set_awaiter_rel(&cctx->mux_waiter, PERFMON_MUX_USEC);
+		set_alarm(&per_cpu_info[core_id()].tchain, &cctx->mux_waiter);
+	}
 	pa->cores_counters[core_id()] = (counter_t) i;
 }
 
@@ -301,14 +640,21 @@ static void perfmon_do_cores_free(void *opaque)
 			write_msr(MSR_CORE_PERF_FIXED_CTR0 + ccno, 0);
 		}
 	} else {
-		if (ccno < (int) cpu_caps.counters_x_proc) {
-			perfmon_init_event(&cctx->counters[ccno]);
-			perfmon_disable_event((int) ccno);
-			write_msr(MSR_IA32_PERFCTR0 + ccno, 0);
+		struct perfmon_vcounter *vc;
+
+		if ((ccno >= 0) && (ccno < MAX_PERFMON_COUNTERS) &&
+		    cctx->vcounters[ccno].ev.event) {
+			vc = &cctx->vcounters[ccno];
+			if (vc->hw_idx >= 0)
+				perfmon_vc_unload(cctx, vc);
+			perfmon_init_event(&vc->ev);
+			perfmon_mux_fill(cctx);
 		} else {
 			err = -ENOENT;
 		}
 	}
+	if (!err && (pa->ev.flags & PERFMON_LBR_EVENT))
+		perfmon_lbr_put(cctx);
 	spin_unlock_irqsave(&cctx->lock);
 
 	pa->cores_counters[coreno] = (counter_t) err;
@@ -326,18 +672,6 @@ static uint64_t perfmon_read_fixed_counter(int ccno)
 		return read_msr(MSR_CORE_PERF_FIXED_CTR0 + ccno);
 }
 
-/* Helper: Reads an unfixed counter's value.  Returns the max amount possible if
- * the counter overflowed. */
-static uint64_t perfmon_read_unfixed_counter(int ccno)
-{
-	uint64_t overflow_status = read_msr(MSR_CORE_PERF_GLOBAL_STATUS);
-
-	if (overflow_status & (1ULL << ccno))
-		return (1ULL << cpu_caps.bits_x_counter) - 1;
-	else
-		return read_msr(MSR_IA32_PERFCTR0 + ccno);
-}
-
 static void perfmon_do_cores_status(void *opaque)
 {
 	struct perfmon_status_env *env = (struct perfmon_status_env *) opaque;
@@ -349,7 +683,8 @@ static void perfmon_do_cores_status(void *opaque)
 	if (perfmon_is_fixed_event(&env->pa->ev))
 		env->pef->cores_values[coreno] = perfmon_read_fixed_counter(ccno);
 	else
-		env->pef->cores_values[coreno] = perfmon_read_unfixed_counter(ccno);
+		env->pef->cores_values[coreno] =
+			perfmon_vc_value(&cctx->vcounters[ccno]);
 	spin_unlock_irqsave(&cctx->lock);
 }
 
@@ -422,6 +757,7 @@ bool perfmon_supported(void)
 void perfmon_global_init(void)
 {
 	perfmon_read_cpu_caps(&cpu_caps);
+	perfmon_read_lbr_pebs_caps();
 }
 
 void perfmon_pcpu_init(void)
@@ -443,6 +779,8 @@ void perfmon_pcpu_init(void)
 	write_msr(MSR_CORE_PERF_FIXED_CTR_CTRL, 0);
 	for (i = 0; i < (int) cpu_caps.fix_counters_x_proc; i++)
 		write_msr(MSR_CORE_PERF_FIXED_CTR0 + i, 0);
+	if (pebs_fmt)
+		perfmon_pebs_pcpu_init(PERCPU_VARPTR(counters_env));
 
 	perfmon_arm_irq();
 }
@@ -483,9 +821,17 @@ void perfmon_snapshot_vmtf(struct vm_trapframe *vm_tf)
 	sample->pc_list[0] = get_vmtf_pc(vm_tf);
 }
 
-static void profiler_add_sample(uint64_t info)
+static void profiler_add_sample(const struct perfmon_event *pev)
 {
 	struct sample_snapshot *sample = PERCPU_VARPTR(sample_snapshots);
+	uint64_t info = perfmon_make_sample_event(pev);
+	struct proftype_branch64 *lbr = NULL;
+	size_t nr_lbr = 0;
+
+	if (pev->flags & PERFMON_LBR_EVENT) {
+		lbr = sample->lbr;
+		nr_lbr = sample->nr_lbr;
+	}
 
 	/* We shouldn't need to worry about another NMI that concurrently mucks with
 	 * the sample.  The PMU won't rearm the interrupt until we're done here.  In
@@ -495,9 +841,10 @@ static void profiler_add_sample(uint64_t info)
 	case ROS_HW_CTX:
 		if (in_kernel(&sample->ctx.tf.hw_tf)) {
 			profiler_push_kernel_backtrace(sample->pc_list, sample->nr_pcs,
-			                               info);
+			                               info, lbr, nr_lbr);
 		} else {
-			profiler_push_user_backtrace(sample->pc_list, sample->nr_pcs, info);
+			profiler_push_user_backtrace(sample->pc_list, sample->nr_pcs, info,
+			                             lbr, nr_lbr);
 		}
 		break;
 	case ROS_VM_CTX:
@@ -505,13 +852,37 @@ static void profiler_add_sample(uint64_t info)
 		 * addr.  Note that the address is a guest-virtual address, not
 		 * guest-physical (which would be host virtual), and our VM_CTXs don't
 		 * make a distinction between user and kernel TFs (yet). */
-		profiler_push_user_backtrace(sample->pc_list, sample->nr_pcs, info);
+		profiler_push_user_backtrace(sample->pc_list, sample->nr_pcs, info,
+		                             lbr, nr_lbr);
 		break;
 	default:
 		warn("Bad perf sample type %d!", sample->ctx.type);
 	}
 }
 
+/* Each PEBS record replaces the IP of the NMI's sample. */
+static void perfmon_drain_pebs(struct perfmon_cpu_context *cctx)
+{
+	struct sample_snapshot *sample = PERCPU_VARPTR(sample_snapshots);
+	struct perfmon_ds_area *ds = cctx->ds;
+	uint64_t *rec, applicable;
+	int idx;
+
+	for (uintptr_t r = ds->pebs_buffer_base; r < ds->pebs_index;
+	     r += pebs_rec_size) {
+		rec = (uint64_t*)r;
+		applicable = rec[PEBS_REC_STATUS] & cctx->pebs_mask;
+		if (!applicable)
+			continue;
+		idx = __builtin_ffsll(applicable) - 1;
+		sample->pc_list[0] = pebs_fmt >= 2 ? rec[PEBS_REC_REAL_IP]
+		                                   : rec[PEBS_REC_IP];
+		sample->nr_pcs = MAX(sample->nr_pcs, 1);
+		profiler_add_sample(cctx->counters + idx);
+	}
+	ds->pebs_index = ds->pebs_buffer_base;
+}
+
 void perfmon_interrupt(struct hw_trapframe *hw_tf, void *data)
 {
 	int i;
@@ -526,11 +897,17 @@ void perfmon_interrupt(struct hw_trapframe *hw_tf, void *data)
 	status = read_msr(MSR_CORE_PERF_GLOBAL_STATUS);
 	gctrl = read_msr(MSR_CORE_PERF_GLOBAL_CTRL);
 	write_msr(MSR_CORE_PERF_GLOBAL_CTRL, 0);
+	if (cctx->nr_lbr_events)
+		perfmon_read_lbrs(PERCPU_VARPTR(sample_snapshots));
+	if (cctx->ds && (status & PERF_GLOBAL_STATUS_PEBS_OVF))
+		perfmon_drain_pebs(cctx);
 	for (i = 0; i < (int) cpu_caps.counters_x_proc; i++) {
+		/* PEBS counters were handled by their records */
+		if (cctx->pebs_mask & (1 << i))
+			continue;
 		if (status & ((uint64_t) 1 << i)) {
 			if (cctx->counters[i].event) {
-				profiler_add_sample(
-				    perfmon_make_sample_event(cctx->counters + i));
+				profiler_add_sample(cctx->counters + i);
 				perfmon_set_unfixed_trigger(i, cctx->counters[i].trigger_count);
 			}
 		}
@@ -538,8 +915,7 @@ void perfmon_interrupt(struct hw_trapframe *hw_tf, void *data)
 	for (i = 0; i < (int) cpu_caps.fix_counters_x_proc; i++) {
 		if (status & ((uint64_t) 1 << (32 + i))) {
 			if (cctx->fixed_counters[i].event) {
-				profiler_add_sample(
-				    perfmon_make_sample_event(cctx->fixed_counters + i));
+				profiler_add_sample(cctx->fixed_counters + i);
 				perfmon_set_fixed_trigger(i,
 				        cctx->fixed_counters[i].trigger_count);
 			}
@@ -596,6 +972,14 @@ int perfmon_open_event(const struct core_set *cset, struct perfmon_session *ps,
 	 * it.  Our tracking of whether or not a counter is in use depends on it
 	 * being enabled, or at least that some bit is set. */
 	PMEV_SET_EN(pa->ev.event, 1);
+	/* PEBS and LBRs only make sense for sampling events */
+	if (!PMEV_GET_INTEN(pa->ev.event))
+		pa->ev.flags &= ~(PERFMON_PRECISE_EVENT | PERFMON_LBR_EVENT);
+	if ((pa->ev.flags & PERFMON_PRECISE_EVENT) &&
+	    (!pebs_fmt || perfmon_is_fixed_event(&pa->ev)))
+		error(ENOTSUP, "PEBS is not supported for this event");
+	if ((pa->ev.flags & PERFMON_LBR_EVENT) && !lbr_nr)
+		error(ENOTSUP, "LBRs are not supported on this machine");
 	smp_do_in_cores(cset, perfmon_do_cores_alloc, pa);
 
 	for (i = 0; i < num_cores; i++) {
@@ -397,6 +397,18 @@ pte_t pgdir_walk(pgdir_t pgdir, const void *va, int create)
 	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
 }
 
+/* Like pgdir_walk, but stops at the PML2, for callers that want to install or
+ * find PTSIZE jumbo pages.  The PTE returned (if any) may be a jumbo, an
+ * intermediate PTE pointing to a PML1, or unmapped. */
+pte_t pgdir_walk_jumbo(pgdir_t pgdir, const void *va, int create)
+{
+	int flags = PML2_SHIFT;
+
+	if (create == 1)
+		flags |= PG_WALK_CREATE;
+	return pml_walk(pgdir_get_kpt(pgdir), (uintptr_t)va, flags);
+}
+
 static int pml_perm_walk(kpte_t *pml, const void *va, int pml_shift)
 {
 	kpte_t *kpte;
@@ -530,6 +542,35 @@ int env_user_mem_walk(struct proc *p, void *start, size_t len,
 	                   trampoline_cb, &local_tp);
 }
 
+/* The jumbo counterpart to env_user_mem_walk: runs 'callback' on every PTSIZE
+ * jumbo PTE that overlaps [start, start + len), passing it the VA of the start
+ * of the jumbo.  Regular PTEs are skipped. */
+int env_user_jumbo_walk(struct proc *p, void *start, size_t len,
+                        mem_walk_callback_t callback, void *arg)
+{
+	struct tramp_package {
+		struct proc *p;
+		mem_walk_callback_t cb;
+		void *cb_arg;
+	};
+	int trampoline_cb(kpte_t *kpte, uintptr_t kva, int shift, bool visited_subs,
+	                  void *data)
+	{
+		struct tramp_package *tp = (struct tramp_package*)data;
+
+		if ((shift != PML2_SHIFT) || !kpte_is_jumbo(kpte))
+			return 0;
+		return tp->cb(tp->p, kpte, (void*)kva, tp->cb_arg);
+	}
+
+	struct tramp_package local_tp;
+	local_tp.p = p;
+	local_tp.cb = callback;
+	local_tp.cb_arg = arg;
+	return pml_for_each(pgdir_get_kpt(p->env_pgdir), (uintptr_t)start, len,
+	                   trampoline_cb, &local_tp);
+}
+
 /* Frees (decrefs) all pages of the process's page table, including the page
  * directory.  Does not free the memory that is actually mapped. */
 void env_pagetable_free(struct proc *p)
@@ -107,6 +107,12 @@ static inline void pte_clear_dirty(pte_t pte)
 	epte_clear_dirty(kpte_to_epte(pte));
 }
 
+static inline void pte_clear_accessed(pte_t pte)
+{
+	kpte_clear_accessed(pte);
+	epte_clear_accessed(kpte_to_epte(pte));
+}
+
 static inline void pte_clear(pte_t pte)
 {
 	kpte_clear(pte);
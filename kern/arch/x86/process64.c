@@ -117,6 +117,7 @@ static void __attribute__((noreturn)) proc_pop_vmtf(struct vm_trapframe *tf)
 			handle_bad_vm_tf(tf);
 		}
 	}
+	vmm_account_vmentry(gpc);
 	vmcs_write(GUEST_RSP, tf->tf_rsp);
 	vmcs_write(GUEST_CR3, tf->tf_cr3);
 	vmcs_write(GUEST_RIP, tf->tf_rip);
@@ -338,6 +339,7 @@ void __abandon_core(void)
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 
 	lcr3(boot_cr3);
+	proc_tlb_unmark_core(pcpui->cur_proc);
 	proc_decref(pcpui->cur_proc);
 	pcpui->cur_proc = 0;
 }
@@ -37,6 +37,9 @@
  *   U32 NUM_VALUES; (always num_cores)
  *   U64 VALUES[NUM_VALUES]; (one value per core - zero if the counter was not
  *                            active in that core)
+ *   Unfixed events beyond the number of hardware counters take turns on the
+ *   hardware.  Their values are scaled up to the time they were open, unless
+ *   they are sampling (INTEN) events.
  *
  * PERFMON_CMD_COUNTER_CLOSE request
  *   U8 CMD; (= PERFMON_CMD_COUNTER_CLOSE)
@@ -61,6 +64,10 @@
 #define PERFMON_CMD_CPU_CAPS 4
 
 #define PERFMON_FIXED_EVENT (1 << 0)
+/* Sampling unfixed events only: use PEBS for the exact IP of the sample */
+#define PERFMON_PRECISE_EVENT (1 << 1)
+/* Sampling events only: attach the Last Branch Records to each sample */
+#define PERFMON_LBR_EVENT (1 << 2)
 
 #define PMEV_EVENT MKBITFIELD(0, 8)
 #define PMEV_MASK MKBITFIELD(8, 8)
@@ -18,6 +18,58 @@ struct vmm_gpcore_init {
 	uintptr_t				gsbase;
 };
 
+/* Segment registers, in the order of their VMCS fields */
+enum {
+	VMM_SEG_ES,
+	VMM_SEG_CS,
+	VMM_SEG_SS,
+	VMM_SEG_DS,
+	VMM_SEG_FS,
+	VMM_SEG_GS,
+	VMM_SEG_LDTR,
+	VMM_SEG_TR,
+	VMM_NR_SEGS,
+};
+
+struct vmm_seg {
+	uint64_t				base;
+	uint32_t				limit;
+	uint32_t				ar;
+	uint16_t				sel;
+	uint16_t				padding[3];
+};
+
+/* The parts of a guest pcore's state that aren't in its vm_trapframe: what the
+ * VMCS and the kernel hold.  For VMM_CTL_GET_GPC_STATE and _SET_. */
+struct vmm_gpc_state {
+	uint64_t				cr0;
+	uint64_t				cr0_shadow;
+	uint64_t				cr4;
+	uint64_t				cr4_shadow;
+	uint64_t				efer;
+	uint64_t				pat;
+	uint64_t				dr7;
+	uint64_t				pending_dbg;
+	uint64_t				sysenter_cs;
+	uint64_t				sysenter_esp;
+	uint64_t				sysenter_eip;
+	struct vmm_seg			segs[VMM_NR_SEGS];
+	uint64_t				gdtr_base;
+	uint64_t				idtr_base;
+	uint32_t				gdtr_limit;
+	uint32_t				idtr_limit;
+	uint32_t				interruptibility;
+	uint32_t				activity;
+	/* RVI and SVI, for virtual interrupt delivery */
+	uint16_t				intr_status;
+	uint16_t				padding[3];
+	uint64_t				xcr0;
+	uint64_t				msr_kern_gs_base;
+	uint64_t				msr_star;
+	uint64_t				msr_lstar;
+	uint64_t				msr_sfmask;
+};
+
 /* Intel VM Trap Injection Fields */
 #define VM_TRAP_VALID               (1 << 31)
 #define VM_TRAP_ERROR_CODE          (1 << 11)
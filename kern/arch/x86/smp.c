@@ -117,8 +117,7 @@ static int smp_call_function(uint8_t type, uint32_t dest, isr_t handler,
 	} else {
 		/* we're replacing the old one.  hope it was ours, and the IRQ is firing
 		 * concurrently (if it is, there's an smp_call bug)! */
-		irq_handlers[wrapper->vector]->isr = handler;
-		irq_handlers[wrapper->vector]->data = data;
+		irq_replace_handler(wrapper->vector, handler, data);
 	}
 
 	// WRITE MEMORY BARRIER HERE
@@ -33,6 +33,9 @@ int x86_num_cores_booted = 1;
 uintptr_t smp_stack_top;
 barrier_t generic_barrier;
 
+/* How long we wait for the APs to show up after the SIPI. */
+#define SMP_BOOT_TIMEOUT_USEC	500000
+
 #define DECLARE_HANDLER_CHECKLISTS(vector)                          \
 	INIT_CHECKLIST(f##vector##_cpu_list, MAX_NUM_CORES);
 
@@ -127,6 +130,7 @@ void smp_boot(void)
 {
 	struct per_cpu_info *pcpui0 = &per_cpu_info[0];
 	page_t *smp_stack;
+	uint64_t deadline;
 
 	// NEED TO GRAB A LOWMEM FREE PAGE FOR AP BOOTUP CODE
 	// page1 (2nd page) is reserved, hardcoded in pmap.c
@@ -157,7 +161,13 @@ void smp_boot(void)
 	udelay(200);
 	send_startup_ipi(0x01);
 	*/
-	udelay(500000);
+	/* The APs come up one at a time, since they share smp_stack.  We used to
+	 * always wait out the timeout here, but once every core that ACPI told us
+	 * about has booted, no one else is coming. */
+	deadline = read_tsc() + usec2tsc(SMP_BOOT_TIMEOUT_USEC);
+	while (READ_ONCE(x86_num_cores_booted) < num_cores &&
+	       read_tsc() < deadline)
+		cpu_relax();
 
 	// Each core will also increment smp_semaphore, and decrement when it is done,
 	// all in smp_entry.  It's purpose is to keep Core0 from competing for the
@@ -20,6 +20,10 @@
 #include <ex_table.h>
 #include <arch/mptables.h>
 #include <ros/procinfo.h>
+#include <latency.h>
+#include <percpu.h>
+#include <err.h>
+#include <ns.h>
 
 enum {
 	NMI_NORMAL_OPN = 0,
@@ -38,6 +42,30 @@ pseudodesc_t idt_pd;
 struct irq_handler *irq_handlers[NUM_IRQS];
 spinlock_t irq_handler_wlock = SPINLOCK_INITIALIZER_IRQSAVE;
 
+/* What irq_dispatch() needs for each vector, packed together so an IRQ only
+ * touches its vector's line of this table.  Almost every vector (and every
+ * MSI-X vector) has one handler, which is in isr and data.  Shared vectors have
+ * isr == 0, and we walk their irq_handlers chain.  The spurious check and EOI
+ * are the same for the whole chain.  Protected like irq_handlers. */
+struct irq_vector {
+	isr_t						isr;
+	void						*data;
+	bool						(*check_spurious)(int);
+	void						(*eoi)(int);
+};
+static struct irq_vector irq_vectors[NUM_IRQS] __attribute__((aligned(64)));
+
+/* Per-core counts and TSC ticks spent in irq_dispatch() for each vector.  See
+ * #arch/irqstat. */
+struct irq_stat {
+	uint64_t					nr;
+	uint64_t					ticks;
+};
+struct irq_stats {
+	struct irq_stat				vec[NUM_IRQS];
+};
+static DEFINE_PERCPU(struct irq_stats, irq_stats);
+
 static bool try_handle_exception_fixup(struct hw_trapframe *hw_tf)
 {
 	if (in_kernel(hw_tf)) {
@@ -694,6 +722,10 @@ static void irq_dispatch(struct hw_trapframe *hw_tf)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
 	struct irq_handler *irq_h;
+	struct irq_vector *vec = &irq_vectors[hw_tf->tf_trapno];
+	struct irq_stat *stat;
+	uint64_t start = read_tsc(), ticks;
+	isr_t isr;
 
 	if (!in_irq_ctx(pcpui))
 		__set_cpu_state(pcpui, CPU_STATE_IRQ);
@@ -705,8 +737,7 @@ static void irq_dispatch(struct hw_trapframe *hw_tf)
 		printd("Incoming IRQ, ISR: %d on core %d\n", hw_tf->tf_trapno,
 		       core_id());
 	/* TODO: RCU read lock */
-	irq_h = irq_handlers[hw_tf->tf_trapno];
-	if (!irq_h) {
+	if (!vec->eoi) {
 		warn_once("Received IRQ %d, had no handler registered!",
 		          hw_tf->tf_trapno);
 		/* If we don't have an IRQ handler, we don't know how to EOI.  Odds are,
@@ -715,14 +746,18 @@ static void irq_dispatch(struct hw_trapframe *hw_tf)
 			lapic_send_eoi(hw_tf->tf_trapno);
 		goto out_no_eoi;
 	}
-	if (irq_h->check_spurious(hw_tf->tf_trapno))
+	if (vec->check_spurious(hw_tf->tf_trapno))
 		goto out_no_eoi;
 	/* Can now be interrupted/nested by higher priority IRQs, but not by our
 	 * current IRQ vector, til we EOI. */
 	enable_irq();
-	while (irq_h) {
-		irq_h->isr(hw_tf, irq_h->data);
-		irq_h = irq_h->next;
+	isr = READ_ONCE(vec->isr);
+	if (isr) {
+		isr(hw_tf, READ_ONCE(vec->data));
+	} else {
+		for (irq_h = irq_handlers[hw_tf->tf_trapno]; irq_h;
+		     irq_h = irq_h->next)
+			irq_h->isr(hw_tf, irq_h->data);
 	}
 	// if we're a general purpose IPI function call, down the cpu_list
 	extern handler_wrapper_t handler_wrappers[NUM_HANDLER_WRAPPERS];
@@ -731,9 +766,15 @@ static void irq_dispatch(struct hw_trapframe *hw_tf)
 		down_checklist(handler_wrappers[hw_tf->tf_trapno & 0x0f].cpu_list);
 	disable_irq();
 	/* Keep in sync with ipi_is_pending */
-	irq_handlers[hw_tf->tf_trapno]->eoi(hw_tf->tf_trapno);
+	vec->eoi(hw_tf->tf_trapno);
 	/* Fall-through */
 out_no_eoi:
+	ticks = read_tsc() - start;
+	lat_record(LAT_IRQ_HANDLER, ticks);
+	/* IRQs are off, so nothing else on this core touches our stats */
+	stat = &PERCPU_VAR(irq_stats).vec[hw_tf->tf_trapno];
+	stat->nr++;
+	stat->ticks += ticks;
 	dec_irq_depth(pcpui);
 	if (!in_irq_ctx(pcpui))
 		__set_cpu_state(pcpui, CPU_STATE_KERNEL);
@@ -765,6 +806,42 @@ void handle_irq(struct hw_trapframe *hw_tf)
 	assert(0);
 }
 
+/* Syncs vector's fast path with its irq_handlers chain.  Hold the wlock.
+ *
+ * IRQs on the vector might be running concurrently.  The chain only grows, and
+ * when it does, we turn off the fast path (isr = 0) before anyone could see
+ * isr without data. */
+static void __irq_vector_update(int vector)
+{
+	struct irq_handler *irq_h = irq_handlers[vector];
+	struct irq_vector *vec = &irq_vectors[vector];
+
+	if (irq_h->next) {
+		WRITE_ONCE(vec->isr, NULL);
+		return;
+	}
+	vec->check_spurious = irq_h->check_spurious;
+	WRITE_ONCE(vec->data, irq_h->data);
+	wmb();	/* data before isr, and both before eoi (the 'registered' flag) */
+	WRITE_ONCE(vec->isr, irq_h->isr);
+	WRITE_ONCE(vec->eoi, irq_h->eoi);
+}
+
+/* Changes the handler of vector, which must have exactly one.  The IRQ
+ * shouldn't be firing, o/w it might get the new handler with the old data. */
+void irq_replace_handler(int vector, isr_t handler, void *data)
+{
+	struct irq_handler *irq_h;
+
+	spin_lock_irqsave(&irq_handler_wlock);
+	irq_h = irq_handlers[vector];
+	assert(irq_h && !irq_h->next);
+	irq_h->isr = handler;
+	irq_h->data = data;
+	__irq_vector_update(vector);
+	spin_unlock_irqsave(&irq_handler_wlock);
+}
+
 /* The irq field may be ignored based on the type of Bus. */
 int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf)
 {
@@ -790,6 +867,7 @@ int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf)
 	irq_h->next = irq_handlers[vector];
 	wmb();	/* make sure irq_h is done before publishing to readers */
 	irq_handlers[vector] = irq_h;
+	__irq_vector_update(vector);
 	spin_unlock_irqsave(&irq_handler_wlock);
 	/* Most IRQs other than the BusIPI should need their irq unmasked.
 	 * Might need to pass the irq_h, in case unmask needs more info.
@@ -843,6 +921,85 @@ int route_irqs(int apic_vec, int os_coreid)
 	return ret;
 }
 
+/* Returns the apic_vector that register_irq() picked for handler and irq_arg,
+ * or -1 if there isn't one.  Drivers with an MSI-X vector per queue use this to
+ * route_irqs() each queue to its own core. */
+int irq_lookup_vector(isr_t handler, void *irq_arg)
+{
+	struct irq_handler *irq_h;
+	int ret = -1;
+
+	spin_lock_irqsave(&irq_handler_wlock);
+	for (int i = 0; i < NUM_IRQS && ret < 0; i++) {
+		for (irq_h = irq_handlers[i]; irq_h; irq_h = irq_h->next) {
+			if (irq_h->isr == handler && irq_h->data == irq_arg) {
+				ret = irq_h->apic_vector;
+				break;
+			}
+		}
+	}
+	spin_unlock_irqsave(&irq_handler_wlock);
+	return ret;
+}
+
+/* Writes to #arch/irqstat: reset clears the counts.  Racy with IRQs coming in,
+ * which is fine. */
+void irqstat_ctl(struct cmdbuf *cb)
+{
+	if (cb->nf < 1 || strcmp(cb->f[0], "reset"))
+		error(EINVAL, "reset");
+	for_each_core(i)
+		memset(_PERCPU_VARPTR(irq_stats, i), 0, sizeof(struct irq_stats));
+}
+
+/* Every vector that has fired: how often, how long it took in irq_dispatch()
+ * (including all of its handlers), and which core took the most of them. */
+size_t irqstat_read(void *va, size_t n, off64_t offset)
+{
+	size_t bufsz = NUM_IRQS * 128;
+	struct irq_handler *irq_h;
+	struct irq_stat *stat;
+	uint64_t nr, ticks, top_nr;
+	int top_core, nr_cores;
+	char *buf, *p, *end_p;
+
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	p = buf;
+	end_p = buf + bufsz;
+	p = seprintf(p, end_p, "%4s %-7s %-20s %12s %12s %9s %9s %6s\n", "vec",
+	             "type", "name", "count", "total(us)", "avg(ns)", "top-core",
+	             "cores");
+	for (int v = 0; v < NUM_IRQS; v++) {
+		nr = ticks = top_nr = 0;
+		top_core = nr_cores = 0;
+		for_each_core(i) {
+			stat = &_PERCPU_VARPTR(irq_stats, i)->vec[v];
+			if (!stat->nr)
+				continue;
+			nr += stat->nr;
+			ticks += stat->ticks;
+			nr_cores++;
+			if (stat->nr > top_nr) {
+				top_nr = stat->nr;
+				top_core = i;
+			}
+		}
+		if (!nr)
+			continue;
+		spin_lock_irqsave(&irq_handler_wlock);
+		irq_h = irq_handlers[v];
+		p = seprintf(p, end_p, "%4d %-7s %-20s %12lu %12lu %9lu %9d %6d\n", v,
+		             irq_h ? irq_h->type : "-",
+		             irq_h && irq_h->name[0] ? irq_h->name : "-", nr,
+		             tsc2usec(ticks), tsc2nsec(ticks / nr), top_core,
+		             nr_cores);
+		spin_unlock_irqsave(&irq_handler_wlock);
+	}
+	n = readstr(offset, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
 /* It's a moderate pain in the ass to put these in bit-specific files (header
  * hell with the set_current_ helpers) */
 void sysenter_callwrapper(struct syscall *sysc, unsigned long count,
@@ -1081,7 +1238,7 @@ static bool handle_vmexit_xsetbv(struct vm_trapframe *tf)
 	return TRUE;
 }
 
-static void vmexit_dispatch(struct vm_trapframe *tf)
+static void vmexit_dispatch(struct vm_trapframe *tf, uint64_t start_tsc)
 {
 	bool handled = FALSE;
 
@@ -1126,6 +1283,8 @@ static void vmexit_dispatch(struct vm_trapframe *tf)
 		printd("Unhandled vmexit: reason 0x%x, exit qualification 0x%x\n",
 		       tf->tf_exit_reason, tf->tf_exit_qual);
 	}
+	vmm_account_vmexit(lookup_guest_pcore(current, tf->tf_guest_pcoreid), tf,
+	                   start_tsc, !handled);
 	if (!handled) {
 		tf->tf_flags |= VMCTX_FL_HAS_FAULT;
 		if (reflect_current_context()) {
@@ -1141,6 +1300,7 @@ static void vmexit_dispatch(struct vm_trapframe *tf)
 void handle_vmexit(struct vm_trapframe *tf)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	uint64_t start_tsc = read_tsc();
 
 	tf->tf_rip = vmcs_read(GUEST_RIP);
 	tf->tf_rflags = vmcs_read(GUEST_RFLAGS);
@@ -1160,7 +1320,7 @@ void handle_vmexit(struct vm_trapframe *tf)
 	set_current_ctx_vm(pcpui, tf);
 	__set_cpu_state(pcpui, CPU_STATE_KERNEL);
 	tf = &pcpui->cur_ctx->tf.vm_tf;
-	vmexit_dispatch(tf);
+	vmexit_dispatch(tf, start_tsc);
 	/* We're either restarting a partial VM ctx (vmcs was launched, loaded on
 	 * the core, etc) or a SW vc ctx for the reflected trap.  Or the proc is
 	 * dying and we'll handle a __death KMSG shortly. */
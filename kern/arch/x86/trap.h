@@ -155,6 +155,13 @@ extern gatedesc_t idt[];
 extern pseudodesc_t idt_pd;
 extern taskstate_t ts;
 int bus_irq_setup(struct irq_handler *irq_h);	/* ioapic.c */
+void irq_replace_handler(int vector,
+                         void (*handler)(struct hw_trapframe *, void *),
+                         void *data);
+/* For #arch/irqstat */
+struct cmdbuf;
+void irqstat_ctl(struct cmdbuf *cb);
+size_t irqstat_read(void *va, size_t n, off64_t offset);
 extern const char *x86_trapname(int trapno);
 extern void sysenter_handler(void);
 
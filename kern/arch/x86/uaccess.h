@@ -16,6 +16,7 @@
 #include <compiler.h>
 #include <stdint.h>
 #include <umem.h>
+#include <cpu_feat.h>
 #include <arch/fixup.h>
 
 #define __m(x) *(x)
@@ -91,6 +92,45 @@ struct extable_ip_fixup {
 				 : "i" (errret), "0" (err)								\
 				 : "memory")
 
+/* rep movsq for the qwords, then rep movsb for the rest.  Either can fault. */
+#define __user_memcpy_q(dst, src, qwords, bytes, err, errret)			\
+	asm volatile(ASM_STAC "\n"											\
+				 "  		cld\n"										\
+				 "1:		rep movsq\n"								\
+				 "  		mov %4,%%rcx\n"								\
+				 "2:		rep movsb\n"								\
+				 "3: " ASM_CLAC "\n"									\
+				 ".section .fixup,\"ax\"\n"								\
+				 "4:		mov %5,%0\n"								\
+				 "	jmp 3b\n"											\
+				 ".previous\n"											\
+				 _ASM_EXTABLE(1b, 4b)									\
+				 _ASM_EXTABLE(2b, 4b)									\
+				 : "=r"(err), "+D" (dst), "+S" (src), "+c" (qwords)		\
+				 : "r" (bytes), "i" (errret), "0" (err)					\
+				 : "memory")
+
+/* Below this, the string ops' startup cost dominates, and byte moves are as
+ * good as any. */
+#define USER_MEMCPY_BULK_MIN	64
+
+/* Bulk copy for variable-sized copies.  With ERMS, rep movsb is the fastest
+ * thing we have at any size.  Without it, rep movsb moves a byte per cycle or
+ * so, and we're much better off moving qwords. */
+static inline int __user_memcpy_bulk(void *dst, const void *src, size_t count)
+{
+	int err = 0;
+	size_t qwords;
+
+	if (count < USER_MEMCPY_BULK_MIN || cpu_has_feat(CPU_FEAT_X86_ERMS)) {
+		__user_memcpy(dst, src, count, err, -EFAULT);
+	} else {
+		qwords = count / 8;
+		__user_memcpy_q(dst, src, qwords, count % 8, err, -EFAULT);
+	}
+	return err;
+}
+
 static inline int __put_user(void *dst, const void *src, unsigned int count)
 {
 	int err = 0;
@@ -113,7 +153,7 @@ static inline int __put_user(void *dst, const void *src, unsigned int count)
 		               "", "er", -EFAULT);
 		break;
 	default:
-		__user_memcpy(dst, src, count, err, -EFAULT);
+		err = __user_memcpy_bulk(dst, src, count);
 	}
 
 	return err;
@@ -126,7 +166,7 @@ static inline int copy_to_user(void *dst, const void *src, unsigned int count)
 	if (unlikely(!is_user_rwaddr(dst, count))) {
 		err = -EFAULT;
 	} else if (!__builtin_constant_p(count)) {
-		__user_memcpy(dst, src, count, err, -EFAULT);
+		err = __user_memcpy_bulk(dst, src, count);
 	} else {
 		err = __put_user(dst, src, count);
 	}
@@ -156,7 +196,7 @@ static inline int __get_user(void *dst, const void *src, unsigned int count)
 		               "", "=r", -EFAULT);
 		break;
 	default:
-		__user_memcpy(dst, src, count, err, -EFAULT);
+		err = __user_memcpy_bulk(dst, src, count);
 	}
 
 	return err;
@@ -170,7 +210,7 @@ static inline int copy_from_user(void *dst, const void *src,
 	if (unlikely(!is_user_raddr((void *) src, count))) {
 		err = -EFAULT;
 	} else if (!__builtin_constant_p(count)) {
-		__user_memcpy(dst, src, count, err, -EFAULT);
+		err = __user_memcpy_bulk(dst, src, count);
 	} else {
 		err = __get_user(dst, src, count);
 	}
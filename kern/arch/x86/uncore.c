@@ -0,0 +1,435 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Uncore (per-socket) performance monitoring.
+ *
+ * IMC: on SNB-EP, IVB-EP and HSX, each memory channel has a PMON box in PCI
+ * config space with four 48 bit counters.  The counters are programmed the
+ * same on every channel of every socket, and reads sum over a socket's
+ * channels.  Config space from any core gets to any socket, so none of this
+ * needs to run on a particular core.  Unlike the core PMCs, the boxes are
+ * global, so there's only one set of selections, and whoever writes to
+ * #arch/uncore last wins.
+ *
+ * RAPL: the energy status MSRs are per-package, 32 bit, and wrap every few
+ * minutes under load.  We read them on a core of each socket, and a ktask
+ * folds the raw values into 64 bit totals often enough to not miss a wrap. */
+
+#include <ros/common.h>
+#include <kmalloc.h>
+#include <kthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <err.h>
+#include <ns.h>
+#include <cpu_feat.h>
+#include <arch/arch.h>
+#include <arch/pci.h>
+#include <arch/topology.h>
+#include <arch/msr.h>
+#include <arch/ros/msr-index.h>
+#include <arch/uncore.h>
+
+/* PMON box registers in each IMC channel's config space. */
+#define IMC_BOX_CTL				0xf4
+#define IMC_CTL0				0xd8
+#define IMC_CTR0				0xa0
+
+#define IMC_BOX_CTL_RST_CTRL	(1 << 0)
+#define IMC_BOX_CTL_RST_CTRS	(1 << 1)
+#define IMC_BOX_CTL_FRZ			(1 << 8)
+#define IMC_BOX_CTL_FRZ_EN		(1 << 16)
+
+#define IMC_CTL_UMASK_SHIFT		8
+#define IMC_CTL_EN				(1 << 22)
+
+#define IMC_CTR_MASK			((1ULL << 48) - 1)
+
+/* Channel devices: SNB-EP, IVB-EP (both IMCs), HSX (both IMCs). */
+static const uint16_t imc_dev_ids[] = {
+	0x3cb0, 0x3cb1, 0x3cb4, 0x3cb5,
+	0x0eb0, 0x0eb1, 0x0eb4, 0x0eb5, 0x0ef0, 0x0ef1, 0x0ef4, 0x0ef5,
+	0x2fb0, 0x2fb1, 0x2fb4, 0x2fb5, 0x2fd0, 0x2fd1, 0x2fd4, 0x2fd5,
+};
+
+struct imc_box {
+	struct pci_device			*pcidev;
+	int							socket;
+};
+
+static struct imc_box *imc_boxes;
+static int nr_imc_boxes;
+/* Selections for each counter, 0 if unused.  Protected by imc_qlock. */
+static uint32_t imc_ctls[UNCORE_IMC_NR_CTRS];
+static bool imc_running;
+static qlock_t imc_qlock;
+
+enum {
+	RAPL_PKG,
+	RAPL_PP0,
+	RAPL_PP1,
+	RAPL_DRAM,
+	RAPL_NR_DOMAINS,
+};
+
+static const struct {
+	const char					*name;
+	uint32_t					msr;
+} rapl_domains[RAPL_NR_DOMAINS] = {
+	[RAPL_PKG]	= {"pkg", MSR_PKG_ENERGY_STATUS},
+	[RAPL_PP0]	= {"pp0", MSR_PP0_ENERGY_STATUS},
+	[RAPL_PP1]	= {"pp1", MSR_PP1_ENERGY_STATUS},
+	[RAPL_DRAM]	= {"dram", MSR_DRAM_ENERGY_STATUS},
+};
+
+struct rapl_socket {
+	int							core;
+	uint32_t					last[RAPL_NR_DOMAINS];
+	uint64_t					total[RAPL_NR_DOMAINS];
+};
+
+/* At the smallest unit (15.3 uJ), a 32 bit counter wraps after 65 kJ, which a
+ * 200 W package gets through in about five minutes. */
+#define RAPL_POLL_USEC			(60 * 1000000)
+
+static struct rapl_socket *rapl_sockets;
+static int rapl_nr_sockets;
+static unsigned int rapl_domain_mask;
+/* Energy units are 1 / 2^esu joules. */
+static unsigned int rapl_esu[RAPL_NR_DOMAINS];
+static qlock_t rapl_qlock;
+
+static bool imc_is_channel(struct pci_device *pcidev)
+{
+	if (pcidev->ven_id != 0x8086)
+		return FALSE;
+	for (int i = 0; i < ARRAY_SIZE(imc_dev_ids); i++) {
+		if (pcidev->dev_id == imc_dev_ids[i])
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* The uncore devices of each socket are on their own bus, and the BIOS numbers
+ * those buses in socket order (e.g. 0x3f, 0x7f).  The UBOX has the real node
+ * ID mapping, but the bus order is all we need to tell the sockets apart. */
+static int imc_bus_to_socket(uint8_t bus)
+{
+	int socket = 0;
+	int prev = -1;
+
+	/* Count the distinct buses below ours.  Boxes are in bus order, since
+	 * that's how pci_init() scanned them. */
+	for (int i = 0; i < nr_imc_boxes; i++) {
+		uint8_t b = imc_boxes[i].pcidev->bus;
+
+		if (b >= bus)
+			break;
+		if (b != prev) {
+			socket++;
+			prev = b;
+		}
+	}
+	return MIN(socket, cpu_topology_info.num_sockets - 1);
+}
+
+static void imc_init(void)
+{
+	struct pci_device *i;
+	int nr = 0;
+
+	qlock_init(&imc_qlock);
+	STAILQ_FOREACH(i, &pci_devices, all_dev) {
+		if (imc_is_channel(i))
+			nr++;
+	}
+	if (!nr)
+		return;
+	imc_boxes = kzmalloc(sizeof(struct imc_box) * nr, MEM_WAIT);
+	STAILQ_FOREACH(i, &pci_devices, all_dev) {
+		if (imc_is_channel(i))
+			imc_boxes[nr_imc_boxes++].pcidev = i;
+	}
+	for (int j = 0; j < nr_imc_boxes; j++)
+		imc_boxes[j].socket = imc_bus_to_socket(imc_boxes[j].pcidev->bus);
+	printk("uncore: %d IMC channels\n", nr_imc_boxes);
+}
+
+bool uncore_imc_supported(void)
+{
+	return nr_imc_boxes != 0;
+}
+
+static uint64_t imc_read_ctr(struct pci_device *pcidev, int ctr)
+{
+	uint32_t off = IMC_CTR0 + ctr * 8;
+	uint32_t lo, hi, hi2;
+
+	/* The counters are live, so make sure the high half didn't change while we
+	 * read the low half. */
+	hi = pcidev_read32(pcidev, off + 4);
+	do {
+		lo = pcidev_read32(pcidev, off);
+		hi2 = hi;
+		hi = pcidev_read32(pcidev, off + 4);
+	} while (hi != hi2);
+	return (((uint64_t)hi << 32) | lo) & IMC_CTR_MASK;
+}
+
+static void imc_start(void)
+{
+	struct pci_device *pcidev;
+
+	for (int i = 0; i < nr_imc_boxes; i++) {
+		pcidev = imc_boxes[i].pcidev;
+		pcidev_write32(pcidev, IMC_BOX_CTL,
+		               IMC_BOX_CTL_RST_CTRL | IMC_BOX_CTL_RST_CTRS |
+		               IMC_BOX_CTL_FRZ_EN | IMC_BOX_CTL_FRZ);
+		for (int j = 0; j < UNCORE_IMC_NR_CTRS; j++)
+			pcidev_write32(pcidev, IMC_CTL0 + j * 4,
+			               imc_ctls[j] ? imc_ctls[j] | IMC_CTL_EN : 0);
+		pcidev_write32(pcidev, IMC_BOX_CTL, IMC_BOX_CTL_FRZ_EN);
+	}
+	imc_running = TRUE;
+}
+
+static void imc_stop(void)
+{
+	struct pci_device *pcidev;
+
+	/* Freezing leaves the counts readable until the next start. */
+	for (int i = 0; i < nr_imc_boxes; i++) {
+		pcidev = imc_boxes[i].pcidev;
+		pcidev_write32(pcidev, IMC_BOX_CTL,
+		               IMC_BOX_CTL_FRZ_EN | IMC_BOX_CTL_FRZ);
+		for (int j = 0; j < UNCORE_IMC_NR_CTRS; j++)
+			pcidev_write32(pcidev, IMC_CTL0 + j * 4, 0);
+	}
+	imc_running = FALSE;
+}
+
+static const char imc_ctl_usage[] =
+	"imc CTR EVENT UMASK|imc CTR off|start|stop";
+
+/* Commands for #arch/uncore:
+ * - imc CTR EVENT UMASK: count EVENT/UMASK on counter CTR of every channel
+ * - imc CTR off: stop using counter CTR
+ * - start: reset the counters and start counting
+ * - stop: stop counting, leaving the counts readable */
+void uncore_imc_ctl(struct cmdbuf *cb)
+{
+	ERRSTACK(1);
+	unsigned long ctr, event, umask;
+
+	if (cb->nf < 1)
+		error(EINVAL, imc_ctl_usage);
+	qlock(&imc_qlock);
+	if (waserror()) {
+		qunlock(&imc_qlock);
+		nexterror();
+	}
+	if (!strcmp(cb->f[0], "imc")) {
+		if (cb->nf < 3)
+			error(EINVAL, imc_ctl_usage);
+		ctr = strtoul(cb->f[1], 0, 0);
+		if (ctr >= UNCORE_IMC_NR_CTRS)
+			error(EINVAL, "IMC counter %lu out of range (0-%d)", ctr,
+			      UNCORE_IMC_NR_CTRS - 1);
+		if (!strcmp(cb->f[2], "off")) {
+			imc_ctls[ctr] = 0;
+		} else {
+			if (cb->nf < 4)
+				error(EINVAL, imc_ctl_usage);
+			event = strtoul(cb->f[2], 0, 0);
+			umask = strtoul(cb->f[3], 0, 0);
+			if (!event || event > 0xff || umask > 0xff)
+				error(EINVAL, "Bad IMC event 0x%lx umask 0x%lx", event,
+				      umask);
+			imc_ctls[ctr] = event | (umask << IMC_CTL_UMASK_SHIFT);
+		}
+		if (imc_running)
+			imc_start();
+	} else if (!strcmp(cb->f[0], "start")) {
+		imc_start();
+	} else if (!strcmp(cb->f[0], "stop")) {
+		imc_stop();
+	} else {
+		error(EINVAL, imc_ctl_usage);
+	}
+	poperror();
+	qunlock(&imc_qlock);
+}
+
+/* One line per socket: "socket N imc0 X imc1 Y ...", summed over the socket's
+ * channels.  Unused counters are left out. */
+size_t uncore_imc_read(void *va, size_t n, off64_t offset)
+{
+	int nr_sockets = cpu_topology_info.num_sockets;
+	size_t bufsz = nr_sockets * 128;
+	uint64_t *sums;
+	char *buf, *p, *e;
+
+	sums = kzmalloc(sizeof(uint64_t) * nr_sockets * UNCORE_IMC_NR_CTRS,
+	                MEM_WAIT);
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	qlock(&imc_qlock);
+	for (int i = 0; i < nr_imc_boxes; i++) {
+		for (int j = 0; j < UNCORE_IMC_NR_CTRS; j++) {
+			if (!imc_ctls[j])
+				continue;
+			sums[imc_boxes[i].socket * UNCORE_IMC_NR_CTRS + j] +=
+				imc_read_ctr(imc_boxes[i].pcidev, j);
+		}
+	}
+	p = buf;
+	e = buf + bufsz;
+	for (int s = 0; s < nr_sockets; s++) {
+		p = seprintf(p, e, "socket %d", s);
+		for (int j = 0; j < UNCORE_IMC_NR_CTRS; j++) {
+			if (imc_ctls[j])
+				p = seprintf(p, e, " imc%d %llu", j,
+				             sums[s * UNCORE_IMC_NR_CTRS + j]);
+		}
+		p = seprintf(p, e, "\n");
+	}
+	qunlock(&imc_qlock);
+	n = readstr(offset, va, n, buf);
+	kfree(buf);
+	kfree(sums);
+	return n;
+}
+
+static unsigned int rapl_model_dram_esu(int model, unsigned int esu)
+{
+	/* The server parts from HSX on count DRAM in fixed 15.3 uJ units, no
+	 * matter what MSR_RAPL_POWER_UNIT says. */
+	switch (model) {
+	case 0x3f:	/* HSX */
+	case 0x4f:	/* BDX */
+	case 0x56:	/* BDX-DE */
+	case 0x55:	/* SKX */
+		return 16;
+	}
+	return esu;
+}
+
+/* Folds the current raw counts into the totals.  Caller holds rapl_qlock. */
+static void rapl_update(void)
+{
+	uint64_t val;
+	uint32_t raw;
+
+	for (int s = 0; s < rapl_nr_sockets; s++) {
+		struct rapl_socket *rs = &rapl_sockets[s];
+
+		for (int d = 0; d < RAPL_NR_DOMAINS; d++) {
+			if (!(rapl_domain_mask & (1 << d)))
+				continue;
+			if (msr_core_read(rs->core, rapl_domains[d].msr, &val))
+				continue;
+			raw = val;
+			rs->total[d] += (uint32_t)(raw - rs->last[d]);
+			rs->last[d] = raw;
+		}
+	}
+}
+
+static void rapl_poller(void *arg)
+{
+	for (;;) {
+		kthread_usleep(RAPL_POLL_USEC);
+		qlock(&rapl_qlock);
+		rapl_update();
+		qunlock(&rapl_qlock);
+	}
+}
+
+static void rapl_init(void)
+{
+	uint64_t units, val;
+	unsigned int esu;
+
+	qlock_init(&rapl_qlock);
+	if (!cpu_has_feat(CPU_FEAT_X86_VENDOR_INTEL) || x86_family != 6)
+		return;
+	if (msr_core_read(0, MSR_RAPL_POWER_UNIT, &units))
+		return;
+	rapl_nr_sockets = cpu_topology_info.num_sockets;
+	rapl_sockets = kzmalloc(sizeof(struct rapl_socket) * rapl_nr_sockets,
+	                        MEM_WAIT);
+	for (int s = 0; s < rapl_nr_sockets; s++)
+		rapl_sockets[s].core = -1;
+	for (int i = 0; i < num_cores; i++) {
+		int s = cpu_topology_info.core_list[i].socket_id;
+
+		if (s < rapl_nr_sockets && rapl_sockets[s].core < 0)
+			rapl_sockets[s].core = i;
+	}
+	esu = (units >> 8) & 0x1f;
+	for (int d = 0; d < RAPL_NR_DOMAINS; d++) {
+		rapl_esu[d] = d == RAPL_DRAM ? rapl_model_dram_esu(x86_model, esu)
+		                             : esu;
+		/* Domains the part doesn't have fault. */
+		if (!msr_core_read(0, rapl_domains[d].msr, &val))
+			rapl_domain_mask |= 1 << d;
+	}
+	for (int s = 0; s < rapl_nr_sockets; s++) {
+		if (rapl_sockets[s].core < 0)
+			rapl_sockets[s].core = 0;
+		for (int d = 0; d < RAPL_NR_DOMAINS; d++) {
+			if (msr_core_read(rapl_sockets[s].core, rapl_domains[d].msr,
+			                  &val))
+				continue;
+			rapl_sockets[s].last[d] = val;
+		}
+	}
+	ktask("rapl_poller", rapl_poller, NULL);
+	printk("uncore: RAPL energy units 2^-%u J\n", esu);
+}
+
+bool uncore_rapl_supported(void)
+{
+	return rapl_domain_mask != 0;
+}
+
+static uint64_t rapl_to_uj(uint64_t count, unsigned int esu)
+{
+	uint64_t frac = count & ((1ULL << esu) - 1);
+
+	return (count >> esu) * 1000000 + ((frac * 1000000) >> esu);
+}
+
+/* One line per socket: "socket N pkg UJ pp0 UJ ...", with the energy used
+ * since boot in microjoules.  Domains the part doesn't have are left out. */
+size_t uncore_rapl_read(void *va, size_t n, off64_t offset)
+{
+	size_t bufsz = rapl_nr_sockets * 128 + 1;
+	char *buf, *p, *e;
+
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	p = buf;
+	e = buf + bufsz;
+	qlock(&rapl_qlock);
+	rapl_update();
+	for (int s = 0; s < rapl_nr_sockets; s++) {
+		p = seprintf(p, e, "socket %d", s);
+		for (int d = 0; d < RAPL_NR_DOMAINS; d++) {
+			if (rapl_domain_mask & (1 << d))
+				p = seprintf(p, e, " %s %llu", rapl_domains[d].name,
+				             rapl_to_uj(rapl_sockets[s].total[d],
+				                        rapl_esu[d]));
+		}
+		p = seprintf(p, e, "\n");
+	}
+	qunlock(&rapl_qlock);
+	n = readstr(offset, va, n, buf);
+	kfree(buf);
+	return n;
+}
+
+void uncore_init(void)
+{
+	imc_init();
+	rapl_init();
+}
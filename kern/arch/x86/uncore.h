@@ -0,0 +1,25 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Per-socket performance monitoring outside the cores: the memory controller
+ * (IMC) PMON boxes of the "-EP" server parts and the RAPL energy counters.
+ * #arch/uncore and #arch/rapl are the interfaces. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <ns.h>
+
+#define UNCORE_IMC_NR_CTRS		4
+
+/* CAS_COUNT.RD and .WR: each CAS is a 64 byte line. */
+#define UNCORE_IMC_CAS_EVENT	0x04
+#define UNCORE_IMC_CAS_RD		0x03
+#define UNCORE_IMC_CAS_WR		0x0c
+
+void uncore_init(void);
+bool uncore_imc_supported(void);
+bool uncore_rapl_supported(void);
+void uncore_imc_ctl(struct cmdbuf *cb);
+size_t uncore_imc_read(void *va, size_t n, off64_t offset);
+size_t uncore_rapl_read(void *va, size_t n, off64_t offset);
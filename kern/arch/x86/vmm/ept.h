@@ -101,6 +101,9 @@ static inline int __pte_to_epte_perm(int perm)
 	}
 }
 
+/* Jumbo KPTEs (PTE_PS) become jumbo EPTEs at the same level, so guest memory
+ * backed by jumbo pages (e.g. MAP_HUGEPAGE) gets large EPT mappings for free.
+ * vmx_init() makes sure the EPT supports our largest jumbo size. */
 static inline void epte_write(epte_t *epte, physaddr_t pa, int settings)
 {
 	/* Could put in a check against the max physaddr len */
@@ -123,6 +126,11 @@ static inline void epte_clear_dirty(epte_t *epte)
 	*epte &= ~EPTE_D;
 }
 
+static inline void epte_clear_accessed(epte_t *epte)
+{
+	*epte &= ~EPTE_A;
+}
+
 static inline void epte_clear(epte_t *epte)
 {
 	*epte = 0;
@@ -1474,3 +1474,82 @@ int vmx_ctl_set_exits(struct vmx_vmm *vmx, int vmm_exits)
 	WRITE_ONCE(vmx->cpu_exec_ctls, vmx->cpu_exec_ctls ^ vmx_toggle_do);
 	return 0;
 }
+
+/* The segment fields are in the same order for each part of the segment */
+#define SEG_FIELD(first, i) ((first) + (i) * 2)
+
+/* The gpc's VMCS must be loaded, and the gpc not running. */
+void vmx_get_gpc_state(struct guest_pcore *gpc, struct vmm_gpc_state *st)
+{
+	struct vmm_seg *seg;
+
+	st->cr0 = vmcs_readl(GUEST_CR0);
+	st->cr0_shadow = vmcs_readl(CR0_READ_SHADOW);
+	st->cr4 = vmcs_readl(GUEST_CR4);
+	st->cr4_shadow = vmcs_readl(CR4_READ_SHADOW);
+	st->efer = vmcs_read64(GUEST_IA32_EFER);
+	st->pat = vmcs_read64(GUEST_IA32_PAT);
+	st->dr7 = vmcs_readl(GUEST_DR7);
+	st->pending_dbg = vmcs_readl(GUEST_PENDING_DBG_EXCEPTIONS);
+	st->sysenter_cs = vmcs_read32(GUEST_SYSENTER_CS);
+	st->sysenter_esp = vmcs_readl(GUEST_SYSENTER_ESP);
+	st->sysenter_eip = vmcs_readl(GUEST_SYSENTER_EIP);
+	for (int i = 0; i < VMM_NR_SEGS; i++) {
+		seg = &st->segs[i];
+		seg->sel = vmcs_read16(SEG_FIELD(GUEST_ES_SELECTOR, i));
+		seg->base = vmcs_readl(SEG_FIELD(GUEST_ES_BASE, i));
+		seg->limit = vmcs_read32(SEG_FIELD(GUEST_ES_LIMIT, i));
+		seg->ar = vmcs_read32(SEG_FIELD(GUEST_ES_AR_BYTES, i));
+	}
+	st->gdtr_base = vmcs_readl(GUEST_GDTR_BASE);
+	st->gdtr_limit = vmcs_read32(GUEST_GDTR_LIMIT);
+	st->idtr_base = vmcs_readl(GUEST_IDTR_BASE);
+	st->idtr_limit = vmcs_read32(GUEST_IDTR_LIMIT);
+	st->interruptibility = vmcs_read32(GUEST_INTERRUPTIBILITY_INFO);
+	st->activity = vmcs_read32(GUEST_ACTIVITY_STATE);
+	st->intr_status = vmcs_read16(GUEST_INTR_STATUS);
+	st->xcr0 = gpc->xcr0;
+	st->msr_kern_gs_base = gpc->msr_kern_gs_base;
+	st->msr_star = gpc->msr_star;
+	st->msr_lstar = gpc->msr_lstar;
+	st->msr_sfmask = gpc->msr_sfmask;
+}
+
+/* The caller checked the parts that we load into the host's registers (xcr0
+ * and the MSRs).  If any of the rest are bad, the next VM entry fails and the
+ * VMM hears about it. */
+void vmx_set_gpc_state(struct guest_pcore *gpc, struct vmm_gpc_state *st)
+{
+	struct vmm_seg *seg;
+
+	vmcs_writel(GUEST_CR0, st->cr0);
+	vmcs_writel(CR0_READ_SHADOW, st->cr0_shadow);
+	vmcs_writel(GUEST_CR4, st->cr4);
+	vmcs_writel(CR4_READ_SHADOW, st->cr4_shadow);
+	vmcs_write64(GUEST_IA32_EFER, st->efer);
+	vmcs_write64(GUEST_IA32_PAT, st->pat);
+	vmcs_writel(GUEST_DR7, st->dr7);
+	vmcs_writel(GUEST_PENDING_DBG_EXCEPTIONS, st->pending_dbg);
+	vmcs_write32(GUEST_SYSENTER_CS, st->sysenter_cs);
+	vmcs_writel(GUEST_SYSENTER_ESP, st->sysenter_esp);
+	vmcs_writel(GUEST_SYSENTER_EIP, st->sysenter_eip);
+	for (int i = 0; i < VMM_NR_SEGS; i++) {
+		seg = &st->segs[i];
+		vmcs_write16(SEG_FIELD(GUEST_ES_SELECTOR, i), seg->sel);
+		vmcs_writel(SEG_FIELD(GUEST_ES_BASE, i), seg->base);
+		vmcs_write32(SEG_FIELD(GUEST_ES_LIMIT, i), seg->limit);
+		vmcs_write32(SEG_FIELD(GUEST_ES_AR_BYTES, i), seg->ar);
+	}
+	vmcs_writel(GUEST_GDTR_BASE, st->gdtr_base);
+	vmcs_write32(GUEST_GDTR_LIMIT, st->gdtr_limit);
+	vmcs_writel(GUEST_IDTR_BASE, st->idtr_base);
+	vmcs_write32(GUEST_IDTR_LIMIT, st->idtr_limit);
+	vmcs_write32(GUEST_INTERRUPTIBILITY_INFO, st->interruptibility);
+	vmcs_write32(GUEST_ACTIVITY_STATE, st->activity);
+	vmcs_write16(GUEST_INTR_STATUS, st->intr_status);
+	gpc->xcr0 = st->xcr0;
+	gpc->msr_kern_gs_base = st->msr_kern_gs_base;
+	gpc->msr_star = st->msr_star;
+	gpc->msr_lstar = st->msr_lstar;
+	gpc->msr_sfmask = st->msr_sfmask;
+}
@@ -58,6 +58,21 @@ struct vmcs_config {
 	uint32_t vmentry_ctrl;
 };
 
+#define VMM_VMEXIT_NR_TYPES		65
+
+/* Per-GPC exit profile, indexed by basic exit reason.  Only the core that has
+ * the GPC loaded writes these.  User ticks run from reflecting an exit to the
+ * next vmentry, which includes any time the VMM left the GPC idle (e.g. HLT).
+ */
+struct gpc_exit_stats {
+	uint64_t nr_exits[VMM_VMEXIT_NR_TYPES];
+	uint64_t nr_reflected[VMM_VMEXIT_NR_TYPES];
+	uint64_t kern_ticks[VMM_VMEXIT_NR_TYPES];
+	uint64_t user_ticks[VMM_VMEXIT_NR_TYPES];
+	uint64_t refl_tsc;
+	int refl_reason;
+};
+
 struct guest_pcore {
 	int cpu;
 	struct proc *proc;
@@ -70,6 +85,7 @@ struct guest_pcore {
 	uint64_t msr_star;
 	uint64_t msr_lstar;
 	uint64_t msr_sfmask;
+	struct gpc_exit_stats exit_stats;
 };
 
 #define NR_AUTOLOAD_MSRS 8
@@ -405,3 +421,5 @@ void vmx_clear_vmcs(void);
 void vmx_setup_vmx_vmm(struct vmx_vmm *vmx);
 int vmx_ctl_get_exits(struct vmx_vmm *vmx);
 int vmx_ctl_set_exits(struct vmx_vmm *vmx, int vmm_exits);
+void vmx_get_gpc_state(struct guest_pcore *gpc, struct vmm_gpc_state *st);
+void vmx_set_gpc_state(struct guest_pcore *gpc, struct vmm_gpc_state *st);
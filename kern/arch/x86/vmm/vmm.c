@@ -13,6 +13,10 @@
 #include <pmap.h>
 #include <smp.h>
 #include <kmalloc.h>
+#include <bitmask.h>
+#include <page_alloc.h>
+#include <process.h>
+#include <err.h>
 
 #include <ros/vmm.h>
 #include "intel/vmx.h"
@@ -79,8 +83,6 @@ void __vmm_struct_init(struct proc *p)
 	vmm->vmmcp = TRUE;
 	vmm->amd = 0;
 	vmx_setup_vmx_vmm(&vmm->vmx);
-	for (int i = 0; i < VMM_VMEXIT_NR_TYPES; i++)
-		vmm->vmexits[i] = 0;
 	vmm->nr_guest_pcores = 0;
 	vmm->guest_pcores = NULL;
 	vmm->gpc_array_elem = 0;
@@ -173,6 +175,186 @@ int vmm_poke_guest(struct proc *p, int guest_pcoreid)
 	return 0;
 }
 
+static bool is_canonical(uint64_t addr)
+{
+	return (int64_t)(addr << 16) >> 16 == (int64_t)addr;
+}
+
+/* We load these into the host's registers, where bad values would fault. */
+static void check_gpc_state(struct vmm_gpc_state *st)
+{
+	if (st->xcr0 & ~__proc_global_info.x86_default_xcr0)
+		error(EINVAL, "Bad xcr0 0x%lx", st->xcr0);
+	if (safe_lxcr0(st->xcr0)) {
+		lxcr0(__proc_global_info.x86_default_xcr0);
+		error(EINVAL, "Bad xcr0 0x%lx", st->xcr0);
+	}
+	lxcr0(__proc_global_info.x86_default_xcr0);
+	if (!is_canonical(st->msr_kern_gs_base) || !is_canonical(st->msr_lstar))
+		error(EINVAL, "Non-canonical kern_gs_base or lstar");
+	if (st->msr_sfmask >> 32)
+		error(EINVAL, "Bad sfmask 0x%lx", st->msr_sfmask);
+}
+
+/* Gets or sets the parts of a guest pcore's state that aren't in its
+ * vm_trapframe, e.g. so the VMM can snapshot and restore a guest.  The gpc
+ * can't be running.  We take dibs on it like load_guest_pcore(), but only load
+ * its VMCS; the MSRs and xcr0 we get and set in the gpc. */
+void vmm_gpc_state(struct proc *p, int guest_pcoreid, void *u_st, bool set)
+{
+	struct vmm_gpc_state st;
+	struct guest_pcore *gpc;
+	int8_t irq_state = 0;
+
+	gpc = lookup_guest_pcore(p, guest_pcoreid);
+	if (!gpc)
+		error(ENOENT, "Bad guest_pcoreid %d", guest_pcoreid);
+	/* Someone's VMCS is current here, for a partial context */
+	if (PERCPU_VAR(guest_pcoreid) != -1)
+		error(EBUSY, "Core has a guest pcore loaded");
+	if (set) {
+		if (memcpy_from_user(p, &st, u_st, sizeof(st)))
+			error(EFAULT, "Bad gpc state %p", u_st);
+		check_gpc_state(&st);
+	}
+	spin_lock(&p->vmm.lock);
+	if (gpc->cpu != -1) {
+		spin_unlock(&p->vmm.lock);
+		error(EBUSY, "Guest pcore %d is running", guest_pcoreid);
+	}
+	gpc->cpu = core_id();
+	spin_unlock(&p->vmm.lock);
+
+	disable_irqsave(&irq_state);
+	vmx_load_guest_pcore(gpc);
+	if (set)
+		vmx_set_gpc_state(gpc, &st);
+	else
+		vmx_get_gpc_state(gpc, &st);
+	vmx_unload_guest_pcore(gpc);
+	enable_irqsave(&irq_state);
+
+	spin_lock(&p->vmm.lock);
+	gpc->cpu = -1;
+	spin_unlock(&p->vmm.lock);
+	if (!set && memcpy_to_user(p, u_st, &st, sizeof(st)))
+		error(EFAULT, "Bad gpc state %p", u_st);
+}
+
+/* One page of bitmap at a time, i.e. 128 MB of guest memory */
+#define HARVEST_CHUNK_PGS		(PGSIZE * 8)
+
+struct harvest_ctx {
+	uintptr_t					start;
+	uintptr_t					end;
+	uint8_t						*bitmap;
+	int							which;
+	size_t						nr_set;
+};
+
+static int __harvest_pte(struct proc *p, pte_t pte, void *va, size_t pgsz,
+                         struct harvest_ctx *hc)
+{
+	struct page *page;
+	uintptr_t start, end;
+
+	if (!pte_is_present(pte))
+		return 0;
+	if (hc->which == VMM_HARVEST_DIRTY) {
+		if (!pte_is_dirty(pte))
+			return 0;
+		/* Like the PM's writeback, the page remembers it was dirty, in case
+		 * this is a file page. */
+		page = pa2page(pte_get_paddr(pte));
+		if (!(atomic_read(&page->pg_flags) & PG_DIRTY))
+			atomic_or(&page->pg_flags, PG_DIRTY);
+		pte_clear_dirty(pte);
+	} else {
+		if (!pte_is_accessed(pte))
+			return 0;
+		pte_clear_accessed(pte);
+	}
+	/* Jumbos only have one bit, so they count as a whole.  If one straddles
+	 * the range, the part outside the range loses its bit. */
+	start = MAX((uintptr_t)va, hc->start);
+	end = MIN((uintptr_t)va + pgsz, hc->end);
+	for (uintptr_t i = start; i < end; i += PGSIZE) {
+		SET_BITMASK_BIT(hc->bitmap, (i - hc->start) >> PGSHIFT);
+		hc->nr_set++;
+	}
+	return 0;
+}
+
+static int __harvest_cb(struct proc *p, pte_t pte, void *va, void *arg)
+{
+	return __harvest_pte(p, pte, va, PGSIZE, arg);
+}
+
+static int __harvest_jumbo_cb(struct proc *p, pte_t pte, void *va, void *arg)
+{
+	return __harvest_pte(p, pte, va, PTSIZE, arg);
+}
+
+/* Collects and clears the accessed or dirty bits for guest memory [gpa, gpa +
+ * len), one bit per page in u_bitmap, and returns how many pages had them.
+ * Guest physical addresses are our virtual addresses, and the EPT is in
+ * lockstep with the KPT, so we get the VMM's own accesses too (e.g. virtio
+ * buffers), which is what snapshots want.
+ *
+ * The CPU only sets A/D bits on a page walk, so we shoot down the range before
+ * returning.  A write that hits a stale TLB entry before then was to a page
+ * that was already dirty, and whose bit we're returning.
+ *
+ * Machines without EPT A/D bits report every present page. */
+size_t vmm_harvest_ad(struct proc *p, uintptr_t gpa, size_t len,
+                      void *u_bitmap, int which)
+{
+	struct harvest_ctx hc;
+	uint8_t *bitmap;
+	size_t chunk, nr_bytes, total = 0;
+	bool faulted = FALSE;
+
+	if (PGOFF(gpa) || PGOFF(len))
+		error(EINVAL, "gpa %p and len %p must be page aligned", gpa, len);
+	if (!__is_user_addr((void*)gpa, len, UMAPTOP))
+		error(EINVAL, "Bad guest memory range %p + %p", gpa, len);
+	if (which != VMM_HARVEST_ACCESSED && which != VMM_HARVEST_DIRTY)
+		error(EINVAL, "Bad harvest type 0x%x", which);
+	if (!len)
+		return 0;
+	/* The user's bitmap is bytes, so chunks must be too */
+	static_assert(HARVEST_CHUNK_PGS % 8 == 0);
+	bitmap = kmalloc(PGSIZE, MEM_WAIT);
+	hc.bitmap = bitmap;
+	hc.which = which;
+	for (uintptr_t off = 0; off < len; off += chunk) {
+		chunk = MIN(len - off, HARVEST_CHUNK_PGS << PGSHIFT);
+		nr_bytes = BYTES_FOR_BITMASK(chunk >> PGSHIFT);
+		memset(bitmap, 0, nr_bytes);
+		hc.start = gpa + off;
+		hc.end = gpa + off + chunk;
+		hc.nr_set = 0;
+		spin_lock(&p->pte_lock);
+		env_user_mem_walk(p, (void*)hc.start, chunk, __harvest_cb, &hc);
+		env_user_jumbo_walk(p, (void*)hc.start, chunk, __harvest_jumbo_cb,
+		                    &hc);
+		spin_unlock(&p->pte_lock);
+		total += hc.nr_set;
+		if (memcpy_to_user(p, u_bitmap + (off >> PGSHIFT) / 8, bitmap,
+		                   nr_bytes)) {
+			faulted = TRUE;
+			break;
+		}
+	}
+	/* Even if we faulted, we cleared some bits */
+	if (total)
+		proc_tlbshootdown(p, gpa, gpa + len);
+	kfree(bitmap);
+	if (faulted)
+		error(EFAULT, "Bad bitmap %p", u_bitmap);
+	return total;
+}
+
 struct guest_pcore *lookup_guest_pcore(struct proc *p, int guest_pcoreid)
 {
 	struct guest_pcore **array;
@@ -560,3 +742,64 @@ bool vmm_emulate_msr(struct vm_trapframe *vm_tf, int op)
 	}
 	return FALSE;
 }
+
+/* Called on every vmexit, once we know whether the kernel handled it or will
+ * reflect it to the VMM. */
+void vmm_account_vmexit(struct guest_pcore *gpc, struct vm_trapframe *tf,
+                        uint64_t start_tsc, bool reflected)
+{
+	struct gpc_exit_stats *es;
+	unsigned int reason = tf->tf_exit_reason & 0xffff;
+
+	if (!gpc || reason >= VMM_VMEXIT_NR_TYPES)
+		return;
+	es = &gpc->exit_stats;
+	es->nr_exits[reason]++;
+	es->kern_ticks[reason] += read_tsc() - start_tsc;
+	if (reflected) {
+		es->nr_reflected[reason]++;
+		es->refl_reason = reason;
+		es->refl_tsc = read_tsc();
+	}
+}
+
+/* Called with the GPC loaded, right before we enter the guest. */
+void vmm_account_vmentry(struct guest_pcore *gpc)
+{
+	struct gpc_exit_stats *es = &gpc->exit_stats;
+
+	if (!es->refl_tsc)
+		return;
+	es->user_ticks[es->refl_reason] += read_tsc() - es->refl_tsc;
+	es->refl_tsc = 0;
+}
+
+/* Prints the exit profile of every GPC, skipping reasons that never happened.
+ * The counters are read without any locks, so it's only a snapshot.  Returns
+ * the length of the string. */
+size_t vmm_exit_stats_print(struct proc *p, char *buf, size_t buflen)
+{
+	struct vmm *vmm = &p->vmm;
+	struct guest_pcore *gpc;
+	struct gpc_exit_stats *es;
+	char *s = buf, *e = buf + buflen;
+
+	for (int i = 0; i < ACCESS_ONCE(vmm->nr_guest_pcores); i++) {
+		gpc = lookup_guest_pcore(p, i);
+		if (!gpc)
+			continue;
+		es = &gpc->exit_stats;
+		s = seprintf(s, e, "GPC %d:\n%-26s %12s %12s %16s %16s\n", i,
+		             "reason", "exits", "reflected", "kern cycles",
+		             "user cycles");
+		for (int j = 0; j < VMM_VMEXIT_NR_TYPES; j++) {
+			if (!es->nr_exits[j])
+				continue;
+			s = seprintf(s, e, "%-26s %12llu %12llu %16llu %16llu\n",
+			             VMX_EXIT_REASON_NAMES[j] ?: "unknown",
+			             es->nr_exits[j], es->nr_reflected[j],
+			             es->kern_ticks[j], es->user_ticks[j]);
+		}
+	}
+	return s - buf;
+}
@@ -15,8 +15,6 @@ static inline int cpu_has_svm(const char **msg)
 	return 0;
 }
 
-#define VMM_VMEXIT_NR_TYPES		65
-
 struct vmm {
 	spinlock_t lock;	/* protects guest_pcore assignment */
 	qlock_t qlock;
@@ -44,7 +42,6 @@ struct vmm {
 	};
 	struct guest_pcore **guest_pcores;
 	size_t gpc_array_elem;
-	unsigned long vmexits[VMM_VMEXIT_NR_TYPES];
 };
 
 void vmm_init(void);
@@ -55,6 +52,9 @@ void __vmm_add_gpcs(struct proc *p, unsigned int nr_more_gpcs,
                     struct vmm_gpcore_init *u_gpcis);
 void __vmm_struct_cleanup(struct proc *p);
 int vmm_poke_guest(struct proc *p, int guest_pcoreid);
+size_t vmm_harvest_ad(struct proc *p, uintptr_t gpa, size_t len,
+                      void *u_bitmap, int which);
+void vmm_gpc_state(struct proc *p, int guest_pcoreid, void *u_st, bool set);
 
 struct guest_pcore *create_guest_pcore(struct proc *p,
                                        struct vmm_gpcore_init *gpci);
@@ -69,3 +69,8 @@ void unload_guest_pcore(struct proc *p, int guest_pcoreid);
 #define VMM_MSR_EMU_READ		1
 #define VMM_MSR_EMU_WRITE		2
 bool vmm_emulate_msr(struct vm_trapframe *vm_tf, int op);
+
+void vmm_account_vmexit(struct guest_pcore *gpc, struct vm_trapframe *tf,
+                        uint64_t start_tsc, bool reflected);
+void vmm_account_vmentry(struct guest_pcore *gpc);
+size_t vmm_exit_stats_print(struct proc *p, char *buf, size_t buflen);
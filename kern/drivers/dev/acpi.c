@@ -909,6 +909,22 @@ static struct Atable *parsesrat(struct Atable *parent,
 	return srat;
 }
 
+/* Calls cb on each enabled memory range in the SRAT, with its proximity
+ * domain.  The ranges can include holes and reserved memory. */
+void acpi_srat_foreach_mem(void (*cb)(int dom, uint64_t addr, uint64_t len,
+                                      void *arg), void *arg)
+{
+	struct Srat *st;
+
+	if (!srat)
+		return;
+	for (int i = 0; i < srat->nchildren; i++) {
+		st = srat->children[i]->tbl;
+		if (st && st->type == SRmem)
+			cb(st->mem.dom, st->mem.addr, st->mem.len, arg);
+	}
+}
+
 static char *dumpslit(char *start, char *end, struct Slit *sl)
 {
 	int i;
@@ -1453,7 +1453,7 @@ static int readtime(uint32_t off, char *buf, int n)
 	nsec = todget(&ticks);
 #endif
 	ticks = read_tsc();
-	nsec = tsc2nsec(ticks);
+	nsec = tsc_to_epoch_nsec(ticks);
 	sec = nsec / 1000000000ULL;
 	snprintf(str, sizeof(str), "%*lud %*llud %*llud %*llud ",
 			 NUMSIZE - 1, sec,
@@ -1478,9 +1478,7 @@ static int writetime(char *buf, int n)
 	if (i <= 0)
 		error(EINVAL, "Bad time in write");
 	now = i * 1000000000LL;
-#if 0
-	todset(now, 0, 0);
-#endif
+	set_walltime(now);
 	return n;
 }
 
@@ -1502,7 +1500,7 @@ static int readbintime(char *buf, int n)
 	nsec = todget(&ticks);
 #endif
 	ticks = read_tsc();
-	nsec = tsc2nsec(ticks);
+	nsec = tsc_to_epoch_nsec(ticks);
 	if (n >= 3 * sizeof(uint64_t)) {
 		int64_t2le(b + 2 * sizeof(uint64_t), fasthz);
 		i += sizeof(uint64_t);
@@ -1537,9 +1535,9 @@ static int writebintime(char *buf, int n)
 			if (n < sizeof(int64_t))
 				error(EINVAL, ERROR_FIXME);
 			le2int64_t(&delta, p);
-#if 0
-			todset(delta, 0, 0);
-#endif
+			if (delta <= 0)
+				error(EINVAL, "Bad time in write");
+			set_walltime(delta);
 			break;
 		case 'd':
 			if (n < sizeof(int64_t) + sizeof(long))
@@ -37,6 +37,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <net/ip.h>
+#include <hash.h>
 
 struct dev etherdevtab;
 
@@ -116,6 +117,20 @@ static void ethershutdown(void)
 	}
 }
 
+/* Busy polls the rx ring of the device behind c, a chan on one of our files,
+ * for up to budget packets.  Returns how many it got, or -1 if the device can't
+ * be polled. */
+int etherpoll(struct chan *c, int budget)
+{
+	struct ether *ether = c->aux;
+
+	if (ether->vlanid)
+		ether = ether->ctlr;
+	if (!ether->poll)
+		return -1;
+	return ether->poll(ether, budget);
+}
+
 static struct walkqid *etherwalk(struct chan *chan, struct chan *nchan,
 								 char **name, unsigned int nname)
 {
@@ -300,12 +315,98 @@ static inline int eaddrcmp(uint8_t *x, uint8_t *y)
 	return (a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]);
 }
 
-struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
+enum {
+	ETIP4 = 0x0800,
+	ETIP6 = 0x86DD,
+	FLOW_TCP = 6,
+	FLOW_UDP = 17,
+};
+
+/* Hashes an IP packet's flow (addresses and TCP/UDP ports), so that all of a
+ * flow's packets go to the same rx queue.  Fragments and anything we can't
+ * parse from the block's main body hash to 0, which is queue 0. */
+static uint32_t etherflowhash(struct block *bp, uint16_t type)
+{
+	uint8_t *ip = bp->rp + ETHERHDRSIZE;
+	uint8_t *l4;
+	uint32_t addrs = 0;
+	int proto;
+
+	switch (type) {
+	case ETIP4:
+		if (bp->wp - ip < 20)
+			return 0;
+		/* MF, or any fragment offset */
+		if ((nhgets(ip + 6) & 0x3fff) != 0)
+			return 0;
+		for (int i = 12; i < 20; i += 4)
+			addrs ^= nhgetl(ip + i);
+		proto = ip[9];
+		l4 = ip + ((ip[0] & 0xf) << 2);
+		break;
+	case ETIP6:
+		if (bp->wp - ip < 40)
+			return 0;
+		for (int i = 8; i < 40; i += 4)
+			addrs ^= nhgetl(ip + i);
+		/* extension headers don't get their ports hashed */
+		proto = ip[6];
+		l4 = ip + 40;
+		break;
+	default:
+		return 0;
+	}
+	if ((proto == FLOW_TCP || proto == FLOW_UDP) && (bp->wp - l4 >= 4))
+		addrs ^= nhgetl(l4);
+	return hash_32(addrs, 32);
+}
+
+static void etherrxoverflow(struct ether *ether, int rxq)
+{
+	ether->soverflows++;
+	if (rxq >= 0 && ether->rxqs)
+		ether->rxqs[rxq].overflows++;
+}
+
+/* rxq is the hardware queue bp came in on, or -1 if we don't know. */
+/* Returns how much of bp f wants: all of it, unless f has a filter. */
+static unsigned int etherfilter(struct netfile *f, struct block *bp)
+{
+	struct bpf_prog *prog;
+	unsigned int keep = BLEN(bp);
+
+	rcu_read_lock();
+	prog = rcu_dereference(f->filter);
+	if (prog)
+		keep = bpf_run(prog, bp);
+	rcu_read_unlock();
+	return keep;
+}
+
+/* Copies keep bytes of bp into f's mapped rings, if it has them.  Either way,
+ * the caller still owns bp.  Returns FALSE if f doesn't have rings. */
+static bool etherxskrx(struct netfile *f, struct block *bp, unsigned int keep)
+{
+	struct netxsk *xsk;
+
+	rcu_read_lock();
+	xsk = rcu_dereference(f->xsk);
+	if (xsk)
+		xsk_rx(xsk, bp, keep);
+	rcu_read_unlock();
+	return xsk != NULL;
+}
+
+static struct block *__etheriq(struct ether *ether, struct block *bp,
+                               int fromwire, int rxq)
 {
 	struct etherpkt *pkt;
 	uint16_t type;
 	int multi, tome, fromme, vlanid, i;
+	uint32_t flowhash = 0;
+	bool have_flowhash = FALSE;
 	struct netfile **ep, *f, **fp, *fx;
+	unsigned int keep, fx_keep = 0;
 	struct block *xbp;
 	struct ether *vlan;
 
@@ -326,7 +427,7 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 					assert(BHLEN(bp) >= 4 + 2 * Eaddrlen);
 					memmove(bp->rp + 4, bp->rp, 2 * Eaddrlen);
 					bp->rp += 4;
-					return etheriq(vlan, bp, fromwire);
+					return __etheriq(vlan, bp, fromwire, rxq);
 				}
 			}
 			/* allow normal type handling to accept or discard it */
@@ -362,6 +463,20 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	for (fp = ether->f; fp < ep; fp++) {
 		if ((f = *fp) && (f->type == type || f->type < 0))
 			if (tome || multi || f->prom) {
+				/* Rx queue groups split a type's flows among their files.  A
+				 * group with one file per hardware queue gets the hardware's
+				 * split (e.g. RSS). */
+				if (f->rxq_nr && rxq >= 0 && f->rxq_nr == ether->nr_rxq) {
+					if (rxq != f->rxq_idx)
+						continue;
+				} else if (f->rxq_nr) {
+					if (!have_flowhash) {
+						flowhash = etherflowhash(bp, type);
+						have_flowhash = TRUE;
+					}
+					if (flowhash % f->rxq_nr != f->rxq_idx)
+						continue;
+				}
 				/* Don't want to hear bridged packets */
 				if (f->bridge && !fromwire && !fromme)
 					continue;
@@ -369,23 +484,35 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 					etherrtrace(f, pkt, BHLEN(bp));
 					continue;
 				}
+				/* Filter before we copy, so files that don't want the frame
+				 * cost us nothing but the program. */
+				keep = etherfilter(f, bp);
+				if (!keep)
+					continue;
+				if (etherxskrx(f, bp, keep))
+					continue;
 				if (fromwire && fx == 0) {
 					fx = f;
+					fx_keep = keep;
 					continue;
 				}
 				xbp = copyblock(bp, MEM_ATOMIC);
 				if (xbp == 0) {
-					ether->soverflows++;
+					etherrxoverflow(ether, rxq);
 					continue;
 				}
+				if (keep < BLEN(xbp))
+					xbp = adjustblock(xbp, keep);
 				if (qpass(f->in, xbp) < 0)
-					ether->soverflows++;
+					etherrxoverflow(ether, rxq);
 			}
 	}
 
 	if (fx) {
+		if (fx_keep < BLEN(bp))
+			bp = adjustblock(bp, fx_keep);
 		if (qpass(fx->in, bp) < 0)
-			ether->soverflows++;
+			etherrxoverflow(ether, rxq);
 		return 0;
 	}
 	if (fromwire) {
@@ -396,17 +523,55 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	return bp;
 }
 
+/* Delivers bp, which came in on the hardware queue rxq. */
+struct block *etheriq_q(struct ether *ether, int rxq, struct block *bp,
+                        int fromwire)
+{
+	struct ether_queue *eq = &ether->rxqs[rxq];
+
+	eq->packets++;
+	eq->bytes += BLEN(bp);
+	return __etheriq(ether, bp, fromwire, rxq);
+}
+
+struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
+{
+	/* vlans and loopback don't have their own queues */
+	if (ether->rxqs) {
+		ether->rxqs[0].packets++;
+		ether->rxqs[0].bytes += BLEN(bp);
+	}
+	return __etheriq(ether, bp, fromwire, -1);
+}
+
+/* Picks the tx queue for bp, before it gets any vlan tag. */
+static int etherselecttxq(struct ether *ether, struct block *bp)
+{
+	struct etherpkt *pkt = (struct etherpkt *)bp->rp;
+
+	if (ether->nr_txq <= 1)
+		return 0;
+	if (ether->select_txq)
+		return ether->select_txq(ether, bp) % ether->nr_txq;
+	return etherflowhash(bp, (pkt->type[0] << 8) | pkt->type[1]) %
+	       ether->nr_txq;
+}
+
 static int etheroq(struct ether *ether, struct block *bp)
 {
-	int len, loopback;
+	int len, loopback, txq;
 	struct etherpkt *pkt;
+	struct ether_queue *eq;
 	int8_t irq_state = 0;
+	bool more = bp->flag & Bxmore;
 
 	ether->outpackets++;
 
+	bp->flag &= ~Bxmore;
 	if (!(ether->feat & NETF_SG))
-		bp = linearizeblock(bp);
-	ptclcsum_finalize(bp, ether->feat);
+		bp = linearize_csum_finalize(bp, ether->feat);
+	else
+		ptclcsum_finalize(bp, ether->feat);
 	/*
 	 * Check if the packet has to be placed back onto the input queue,
 	 * i.e. if it's a loopback or broadcast packet or the interface is
@@ -429,6 +594,7 @@ static int etheroq(struct ether *ether, struct block *bp)
 		}
 	}
 
+	txq = etherselecttxq(ether->vlanid ? ether->ctlr : ether, bp);
 	if (ether->vlanid) {
 		/* add tag */
 		bp = padblock(bp, 2 + 2);
@@ -441,13 +607,42 @@ static int etheroq(struct ether *ether, struct block *bp)
 	if ((ether->feat & NETF_PADMIN) == 0 && BLEN(bp) < ether->min_mtu)
 		bp = adjustblock(bp, ether->min_mtu);
 
-	qbwrite(ether->oq, bp);
-	if (ether->transmit != NULL)
+	eq = &ether->txqs[txq];
+	eq->packets++;
+	eq->bytes += BLEN(bp);
+	qbwrite(eq->oq, bp);
+	/* Racy, but whoever sent the held blocks kicks when their last one goes
+	 * out, and a lost reset just means an extra kick. */
+	if (more && ++eq->nr_held < ETHER_MAX_HELD)
+		return len;
+	eq->nr_held = 0;
+	eq->kicks++;
+	if (ether->transmit_q != NULL)
+		ether->transmit_q(ether, txq);
+	else if (ether->transmit != NULL)
 		ether->transmit(ether);
 
 	return len;
 }
 
+static void etherxskxmit(struct block *bp, void *arg)
+{
+	struct ether *ether = arg;
+
+	if (BLEN(bp) < ETHERHDRSIZE || BLEN(bp) > ether->mtu + ETHERHDRSIZE) {
+		freeb(bp);
+		return;
+	}
+	memmove(bp->rp + Eaddrlen, ether->ea, Eaddrlen);
+	etheroq(ether, bp);
+}
+
+/* The conversation's rings, which can't go away while chan is open. */
+static struct netxsk *etherxsk(struct ether *ether, struct chan *chan)
+{
+	return READ_ONCE(ether->f[NETID(chan->qid.path)]->xsk);
+}
+
 static size_t etherwrite(struct chan *chan, void *buf, size_t n, off64_t unused)
 {
 	ERRSTACK(2);
@@ -463,6 +658,14 @@ static size_t etherwrite(struct chan *chan, void *buf, size_t n, off64_t unused)
 		runlock(&ether->rwlock);
 		nexterror();
 	}
+	/* Any write to xsk sends what's on its tx ring. */
+	if (NETTYPE(chan->qid.path) == Nxskqid) {
+		if (!etherxsk(ether, chan))
+			error(ENXIO, "no xsk rings, see ros/xsk.h");
+		xsk_tx(etherxsk(ether, chan), etherxskxmit, ether);
+		l = n;
+		goto out;
+	}
 	if (NETTYPE(chan->qid.path) != Ndataqid) {
 		l = netifwrite(ether, chan, buf, n);
 		if (l >= 0)
@@ -477,8 +680,8 @@ static size_t etherwrite(struct chan *chan, void *buf, size_t n, off64_t unused)
 				onoff = 1;
 			else
 				onoff = atoi(cb->f[1]);
-			if (ether->oq != NULL)
-				qdropoverflow(ether->oq, onoff);
+			for (int i = 0; i < ether->nr_txq; i++)
+				qdropoverflow(ether->txqs[i].oq, onoff);
 			kfree(cb);
 			goto out;
 		}
@@ -542,6 +745,38 @@ static size_t etherbwrite(struct chan *chan, struct block *bp, off64_t unused)
 	return n;
 }
 
+static struct fs_file *ethermmap(struct chan *chan, struct vm_region *vmr,
+                                 int prot, int flags)
+{
+	struct ether *ether = chan->aux;
+
+	if (NETTYPE(chan->qid.path) != Nxskqid) {
+		set_error(ENODEV, "only xsk can be mmapped");
+		return NULL;
+	}
+	if (!etherxsk(ether, chan)) {
+		set_error(ENXIO, "no xsk rings, see ros/xsk.h");
+		return NULL;
+	}
+	return xsk_mmap(etherxsk(ether, chan), prot, flags);
+}
+
+static int ethertapfd(struct chan *chan, struct fd_tap *tap, int cmd)
+{
+	struct ether *ether = chan->aux;
+
+	if (NETTYPE(chan->qid.path) != Nxskqid) {
+		set_error(ENOSYS, "Can't tap #%s file type %d", devname(),
+		          NETTYPE(chan->qid.path));
+		return -1;
+	}
+	if (!etherxsk(ether, chan)) {
+		set_error(ENXIO, "no xsk rings, see ros/xsk.h");
+		return -1;
+	}
+	return xsk_tapfd(etherxsk(ether, chan), tap, cmd);
+}
+
 static void nop(struct ether *unused)
 {
 }
@@ -681,6 +916,24 @@ int parseether(uint8_t * to, char *from)
 	return 0;
 }
 
+/* Sets up the hardware queues, once reset() told us how many there are.  The
+ * first tx queue is the one single-queue drivers use, ether->oq. */
+static void etherqinit(struct ether *ether, int qsize)
+{
+	ether->nr_txq = MAX(ether->nr_txq, 1);
+	ether->nr_rxq = MAX(ether->nr_rxq, 1);
+	ether->txqs = kzmalloc(sizeof(struct ether_queue) * ether->nr_txq,
+	                       MEM_WAIT);
+	ether->rxqs = kzmalloc(sizeof(struct ether_queue) * ether->nr_rxq,
+	                       MEM_WAIT);
+	ether->txqs[0].oq = ether->oq;
+	for (int i = 1; i < ether->nr_txq; i++) {
+		ether->txqs[i].oq = qopen(qsize, Qmsg, 0, 0);
+		if (!ether->txqs[i].oq)
+			panic("etherreset %s txq %d", ether->name, i);
+	}
+}
+
 static void etherreset(void)
 {
 	struct ether *ether;
@@ -771,6 +1024,7 @@ static void etherreset(void)
 				ether->oq = qopen(qsize, Qmsg, 0, 0);
 			if (ether->oq == 0)
 				panic("etherreset %s", name);
+			etherqinit(ether, qsize);
 			ether->alen = Eaddrlen;
 			memmove(ether->addr, ether->ea, Eaddrlen);
 			memset(ether->bcast, 0xFF, Eaddrlen);
@@ -859,4 +1113,6 @@ struct dev etherdevtab __devtab = {
 	.wstat = etherwstat,
 	.power = etherpower,
 	.chaninfo = devchaninfo,
+	.mmap = ethermmap,
+	.tapfd = ethertapfd,
 };
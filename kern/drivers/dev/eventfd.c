@@ -6,7 +6,11 @@
  *
  * Unlike the Linux interface, which takes host-endian u64s, we read and write
  * strings.  It's a little slower, but it maintains the distributed-system
- * nature of Plan 9 devices. */
+ * nature of Plan 9 devices.
+ *
+ * The counter lives in a page that the user can mmap from the efd file, so
+ * cooperating processes can signal each other without syscalls.  See
+ * ros/eventfd.h for the protocol.  Writing 0 is the doorbell. */
 
 #include <ns.h>
 #include <kmalloc.h>
@@ -19,6 +23,12 @@
 #include <sys/queue.h>
 #include <fdtap.h>
 #include <syscall.h>
+#include <page_alloc.h>
+#include <pmap.h>
+#include <pagemap.h>
+#include <fs_file.h>
+#include <ros/eventfd.h>
+#include <ros/mman.h>
 
 struct dev efd_devtab;
 
@@ -40,14 +50,17 @@ static struct dirtab efd_dir[] = {
 };
 
 enum {
-	EFD_SEMAPHORE = 			1 << 0,
-	EFD_MAX_VAL =				(unsigned long)(-2), // i.e. 0xfffffffffffffffe
+	EFD_SEMAPHORE = 			EFD_SHM_SEMAPHORE,
+	EFD_MAX_VAL =				EFD_SHM_MAX_VAL,
 };
 
 
 struct eventfd {
 	int 						flags;
-	atomic_t					counter;
+	/* Points into shm, which userspace can change at any time */
+	atomic_t					*counter;
+	struct efd_shm				*shm;
+	struct fs_file				file;
 	struct fdtap_slist			fd_taps;
 	spinlock_t					tap_lock;
 	struct rendez				rv_readers;
@@ -61,16 +74,78 @@ static void efd_release(struct kref *kref)
 	struct eventfd *efd = container_of(kref, struct eventfd, refcnt);
 	/* All FDs with taps should be closed before we decreffed all the chans */
 	assert(SLIST_EMPTY(&efd->fd_taps));
+	/* Drops the PM's ref, which frees the page.  Anyone who had it mapped held
+	 * a chan, so they are gone too. */
+	cleanup_fs_file(&efd->file);
 	kfree(efd);
 }
 
+static int efd_readpage(struct page_map *pm, struct page *pg)
+{
+	/* The only page of the file is in the PM from the start. */
+	return -EIO;
+}
+
+static int efd_writepage(struct page_map *pm, struct page *pg)
+{
+	return 0;
+}
+
+static void efd_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
+{
+	error(EINVAL, "can't punch holes in #%s", devname());
+}
+
+static bool efd_can_grow_to(struct fs_file *f, size_t len)
+{
+	return len <= fs_file_get_length(f);
+}
+
+static struct fs_file_ops efd_fs_ops = {
+	.readpage = efd_readpage,
+	.writepage = efd_writepage,
+	.punch_hole = efd_punch_hole,
+	.can_grow_to = efd_can_grow_to,
+};
+
+/* Every eventfd gets its page up front, whether or not anyone maps it, so the
+ * counter never has to move. */
+static void efd_init_shm(struct eventfd *efd)
+{
+	struct page *pg = kva2page(kpage_zalloc_addr());
+	int ret;
+
+	atomic_set(&pg->pg_flags, PG_UPTODATE | PG_PAGEMAP);
+	atomic_set(&pg->pg_ext_refs, 1);	/* the PM's ref */
+	sem_init(&pg->pg_sem, 1);
+	efd->shm = page2kva(pg);
+	efd->counter = (atomic_t*)&efd->shm->counter;
+	fs_file_init(&efd->file, "eventfd", &efd_fs_ops);
+	fs_file_init_dir(&efd->file, 0, 0, &eve, 0600);
+	efd->file.dir.length = PGSIZE;
+	ret = pm_insert_pages(efd->file.pm, 0, &pg, 1);
+	if (ret) {
+		atomic_set(&pg->pg_flags, 0);
+		page_decref(pg);
+		cleanup_fs_file(&efd->file);
+		error(-ret, "#%s: couldn't set up the counter page", devname());
+	}
+}
+
 static struct chan *efd_attach(char *spec)
 {
+	ERRSTACK(1);
 	struct chan *c;
 	struct eventfd *efd;
 
-	c = devattach(devname(), spec);
 	efd = kzmalloc(sizeof(struct eventfd), MEM_WAIT);
+	if (waserror()) {
+		kfree(efd);
+		nexterror();
+	}
+	efd_init_shm(efd);
+	poperror();
+	c = devattach(devname(), spec);
 	SLIST_INIT(&efd->fd_taps);
 	spinlock_init(&efd->tap_lock);
 	rendez_init(&efd->rv_readers);
@@ -86,6 +161,7 @@ static struct chan *efd_attach(char *spec)
 	 * we'll treat them as being in semaphore mode. */
 	if (!strcmp(spec, "sem"))
 		efd->flags |= EFD_SEMAPHORE;
+	efd->shm->flags = efd->flags;
 	return c;
 }
 
@@ -151,7 +227,27 @@ static void efd_fire_taps(struct eventfd *efd, int filter)
 static int has_counts(void *arg)
 {
 	struct eventfd *efd = arg;
-	return atomic_read(&efd->counter) != 0;
+	return atomic_read(efd->counter) != 0;
+}
+
+/* Sleeps on rv until cond, counted in nr_waiters so that userspace knows to
+ * ring the doorbell.  The count goes up before cond reads the counter, and
+ * userspace changes the counter before it reads the count, so one of us sees
+ * the other. */
+static void efd_sleep(struct eventfd *efd, struct rendez *rv,
+                      uint64_t *nr_waiters, int (*cond)(void *))
+{
+	ERRSTACK(1);
+
+	atomic_inc((atomic_t*)nr_waiters);
+	mb();
+	if (waserror()) {
+		atomic_dec((atomic_t*)nr_waiters);
+		nexterror();
+	}
+	rendez_sleep(rv, cond, efd);
+	poperror();
+	atomic_dec((atomic_t*)nr_waiters);
 }
 
 /* The heart of reading an eventfd */
@@ -159,11 +255,12 @@ static unsigned long efd_read_efd(struct eventfd *efd, struct chan *c)
 {
 	unsigned long old_count, new_count, ret;
 	while (1) {
-		old_count = atomic_read(&efd->counter);
+		old_count = atomic_read(efd->counter);
 		if (!old_count) {
 			if (c->flag & O_NONBLOCK)
 				error(EAGAIN, "Would block on #%s read", devname());
-			rendez_sleep(&efd->rv_readers, has_counts, efd);
+			efd_sleep(efd, &efd->rv_readers, &efd->shm->nr_readers,
+			          has_counts);
 		} else {
 			if (efd->flags & EFD_SEMAPHORE) {
 				new_count = old_count - 1;
@@ -172,7 +269,7 @@ static unsigned long efd_read_efd(struct eventfd *efd, struct chan *c)
 				new_count = 0;
 				ret = old_count;
 			}
-			if (atomic_cas(&efd->counter, old_count, new_count))
+			if (atomic_cas(efd->counter, old_count, new_count))
 				goto success;
 		}
 	}
@@ -205,7 +302,20 @@ static size_t efd_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 static int has_room(void *arg)
 {
 	struct eventfd *efd = arg;
-	return atomic_read(&efd->counter) != EFD_MAX_VAL;
+	/* Userspace could have left anything in there */
+	return (unsigned long)atomic_read(efd->counter) < EFD_MAX_VAL;
+}
+
+/* Someone changed the counter from userspace and saw a waiter.  We don't know
+ * which way it went, so wake whoever can make progress. */
+static void efd_doorbell(struct eventfd *efd)
+{
+	rendez_wakeup(&efd->rv_readers);
+	rendez_wakeup(&efd->rv_writers);
+	if (has_counts(efd))
+		efd_fire_taps(efd, FDTAP_FILT_READABLE);
+	if (has_room(efd))
+		efd_fire_taps(efd, FDTAP_FILT_WRITABLE);
 }
 
 /* The heart of writing an eventfd */
@@ -214,14 +324,15 @@ static void efd_write_efd(struct eventfd *efd, unsigned long add_to,
 {
 	unsigned long old_count, new_count;
 	while (1) {
-		old_count = atomic_read(&efd->counter);
+		old_count = atomic_read(efd->counter);
 		new_count = old_count + add_to;
-		if (new_count > EFD_MAX_VAL) {
+		if (new_count > EFD_MAX_VAL || new_count < old_count) {
 			if (c->flag & O_NONBLOCK)
 				error(EAGAIN, "Would block on #%s write", devname());
-			rendez_sleep(&efd->rv_writers, has_room, efd);
+			efd_sleep(efd, &efd->rv_writers, &efd->shm->nr_writers,
+			          has_room);
 		} else {
-			if (atomic_cas(&efd->counter, old_count, new_count))
+			if (atomic_cas(efd->counter, old_count, new_count))
 				goto success;
 		}
 	}
@@ -253,6 +364,10 @@ static size_t efd_write(struct chan *c, void *ubuf, size_t n, off64_t offset)
 			write_val = strtoul(num64, 0, 0);
 			if (write_val == (unsigned long)(-1))
 				error(EFAIL, "Eventfd write must not be -1");
+			if (!write_val) {
+				efd_doorbell(efd);
+				break;
+			}
 			efd_write_efd(efd, write_val, c);
 			break;
 		default:
@@ -265,11 +380,23 @@ static char *efd_chaninfo(struct chan *c, char *ret, size_t ret_l)
 {
 	struct eventfd *efd = c->aux;
 
-	snprintf(ret, ret_l, "QID type %s, flags %p, counter %p",
-	         efd_dir[c->qid.path].name, efd->flags, atomic_read(&efd->counter));
+	snprintf(ret, ret_l,
+	         "QID type %s, flags %p, counter %p, readers %lu, writers %lu",
+	         efd_dir[c->qid.path].name, efd->flags, atomic_read(efd->counter),
+	         ACCESS_ONCE(efd->shm->nr_readers),
+	         ACCESS_ONCE(efd->shm->nr_writers));
 	return ret;
 }
 
+/* Tapped FDs count as waiters, since they want to hear about every change. */
+static void efd_count_tap(struct eventfd *efd, struct fd_tap *tap, long amt)
+{
+	if (tap->filter & FDTAP_FILT_READABLE)
+		atomic_add((atomic_t*)&efd->shm->nr_readers, amt);
+	if (tap->filter & FDTAP_FILT_WRITABLE)
+		atomic_add((atomic_t*)&efd->shm->nr_writers, amt);
+}
+
 static int efd_tapfd(struct chan *c, struct fd_tap *tap, int cmd)
 {
 	struct eventfd *efd = c->aux;
@@ -294,10 +421,12 @@ static int efd_tapfd(struct chan *c, struct fd_tap *tap, int cmd)
 			switch (cmd) {
 				case (FDTAP_CMD_ADD):
 					SLIST_INSERT_HEAD(&efd->fd_taps, tap, link);
+					efd_count_tap(efd, tap, 1);
 					ret = 0;
 					break;
 				case (FDTAP_CMD_REM):
 					SLIST_REMOVE(&efd->fd_taps, tap, fd_tap, link);
+					efd_count_tap(efd, tap, -1);
 					ret = 0;
 					break;
 				default:
@@ -314,6 +443,22 @@ static int efd_tapfd(struct chan *c, struct fd_tap *tap, int cmd)
 	}
 }
 
+static struct fs_file *efd_mmap(struct chan *c, struct vm_region *vmr,
+                                int prot, int flags)
+{
+	struct eventfd *efd = c->aux;
+
+	if (c->qid.path != Qefd) {
+		set_error(ENODEV, "only #%s/efd can be mmapped", devname());
+		return NULL;
+	}
+	if (!(flags & MAP_SHARED)) {
+		set_error(EINVAL, "The #%s counter must be MAP_SHARED", devname());
+		return NULL;
+	}
+	return &efd->file;
+}
+
 struct dev efd_devtab __devtab = {
 	.name = "eventfd",
 	.reset = devreset,
@@ -334,4 +479,5 @@ struct dev efd_devtab __devtab = {
 	.power = devpower,
 	.chaninfo = efd_chaninfo,
 	.tapfd = efd_tapfd,
+	.mmap = efd_mmap,
 };
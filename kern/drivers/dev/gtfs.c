@@ -15,6 +15,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <tree_file.h>
+#include <writeback.h>
 
 struct dev gtfs_devtab;
 
@@ -23,9 +24,24 @@ static char *devname(void)
 	return gtfs_devtab.name;
 }
 
+/* The 9p server's files can change without us knowing, so we only trust that a
+ * name doesn't exist for a little while. */
+#define GTFS_NEG_TTL_NSEC	(10ULL * 1000000000)
+
+/* Children we learn about from a directory listing are trusted for a little
+ * while before we check with the backend again.  See gtfs_check_lease(). */
+#define GTFS_LEASE_NSEC		(10ULL * 1000000000)
+
+/* Most we'll read from a directory at once, since we buffer it */
+#define GTFS_DIR_READ_MAX	(64 * 1024)
+
+/* Most unused files we'll try to free per memory pressure callback */
+#define GTFS_LRU_PRUNE_BATCH	256
+
 struct gtfs {
 	struct tree_filesystem		tfs;
 	struct kref					users;
+	struct wb_domain			wb;
 };
 
 /* Blob hanging off the fs_file->priv.  The backend chans are only accessed,
@@ -49,17 +65,38 @@ struct gtfs {
  * about mtime, since some 9p servers just change that on their own.
  *
  * Also note that you can't trust be_length for directories.  You'll often get
- * 4096 or 0, depending on the 9p server you're talking to. */
+ * 4096 or 0, depending on the 9p server you're talking to.
+ *
+ * Files we learned about from a directory listing (readdir-plus) don't have a
+ * be_walk until someone needs one, so that ls -l doesn't cost a walk and a stat
+ * per entry.  Use gtfs_be_walk() to get it.  Until then, the file's metadata is
+ * a lease from the listing that runs out at lease_expiry. */
 struct gtfs_priv {
 	struct chan					*be_walk;	/* never opened */
+	qlock_t						walk_qlock;	/* for setting be_walk */
+	uint64_t					lease_expiry;
 	struct chan					*be_read;
 	struct chan					*be_write;
 	uint64_t					be_length;
 	uint32_t					be_mode;
 	struct timespec				be_mtime;
 	bool						was_removed;
+	/* Readahead.  Sequential misses grow the window.  When someone first uses
+	 * the ra_trigger page, we read the next window asynchronously. */
+	spinlock_t					ra_lock;
+	unsigned long				ra_next;	/* first page we haven't read */
+	unsigned long				ra_trigger;
+	unsigned int				ra_window;	/* in pages */
+	unsigned long				nr_ra_pages;
+	unsigned long				nr_ra_hits;
+	/* Write-behind, through the gtfs's flushers */
+	struct tree_file			*tf;
+	struct wb_file				wbf;
 };
 
+#define GTFS_RA_INIT_PAGES		4
+#define GTFS_RA_MAX_PAGES		32
+
 static inline struct gtfs_priv *fsf_to_gtfs_priv(struct fs_file *f)
 {
 	return f->priv;
@@ -70,6 +107,56 @@ static inline struct gtfs_priv *tf_to_gtfs_priv(struct tree_file *tf)
 	return fsf_to_gtfs_priv(&tf->file);
 }
 
+/* Returns tf's be_walk, walking to it from the parent's if tf came from a
+ * directory listing.  Throws if the backend doesn't have it anymore.
+ *
+ * The walk_qlock nests inside the file qlocks, and children's walk_qlocks nest
+ * inside their parent's.  Renames and unlinks get the be_walk first, so tf's
+ * parent and name don't change while we walk. */
+static struct chan *gtfs_be_walk(struct tree_file *tf)
+{
+	ERRSTACK(1);
+	struct gtfs_priv *gp = tf_to_gtfs_priv(tf);
+	struct chan *parent_c, *c;
+	struct walkqid *wq;
+	char *name = tree_file_to_name(tf);
+
+	c = READ_ONCE(gp->be_walk);
+	if (c)
+		return c;
+	qlock(&gp->walk_qlock);
+	if (gp->be_walk) {
+		qunlock(&gp->walk_qlock);
+		return gp->be_walk;
+	}
+	if (waserror()) {
+		qunlock(&gp->walk_qlock);
+		nexterror();
+	}
+	parent_c = gtfs_be_walk(tf->parent);
+	wq = devtab[parent_c->type].walk(parent_c, NULL, &name, 1);
+	if (!wq || !wq->clone) {
+		kfree(wq);
+		error(ENOENT, "%s is gone from the backend", name);
+	}
+	c = wq->clone;
+	kfree(wq);
+	if (c->qid.path != tf->file.dir.qid.path) {
+		cclose(c);
+		error(ESTALE, "%s changed in the backend", name);
+	}
+	wmb();	/* the chan is set up before others can see it */
+	WRITE_ONCE(gp->be_walk, c);
+	qunlock(&gp->walk_qlock);
+	poperror();
+	return c;
+}
+
+static struct chan *fsf_be_walk(struct fs_file *f)
+{
+	return gtfs_be_walk((struct tree_file*)f);
+}
+
 /* Helper.  Clones the chan (walks to itself) and then opens with omode. */
 static struct chan *cclone_and_open(struct chan *c, int omode)
 {
@@ -90,7 +177,7 @@ static struct chan *cclone_and_open(struct chan *c, int omode)
 static void wstat_dir(struct fs_file *f, struct dir *dir)
 {
 	ERRSTACK(1);
-	struct gtfs_priv *gp = fsf_to_gtfs_priv(f);
+	struct chan *be_walk;
 	size_t sz;
 	uint8_t *buf;
 
@@ -101,7 +188,8 @@ static void wstat_dir(struct fs_file *f, struct dir *dir)
 		kfree(buf);
 		nexterror();
 	}
-	devtab[gp->be_walk->type].wstat(gp->be_walk, buf, sz);
+	be_walk = fsf_be_walk(f);
+	devtab[be_walk->type].wstat(be_walk, buf, sz);
 	kfree(buf);
 	poperror();
 }
@@ -194,6 +282,8 @@ static void __gtfs_destroy(uint32_t srcid, long a0, long a1, long a2)
 {
 	struct gtfs *gtfs = (struct gtfs*)a0;
 
+	/* The flushers hold refs on the files they have queued */
+	wb_domain_destroy(&gtfs->wb);
 	tfs_frontend_purge(&gtfs->tfs, purge_cb);
 	/* this is the ref from attach */
 	assert(kref_refcnt(&gtfs->tfs.root->kref) == 1);
@@ -261,15 +351,19 @@ static void setup_be_chans(struct chan *c, int omode)
 	 * writable-only file, since we need to load the page into the page cache,
 	 * which is a readpage. */
 	if (!gp->be_read)
-		gp->be_read = cclone_and_open(gp->be_walk, O_READ);
+		gp->be_read = cclone_and_open(fsf_be_walk(f), O_READ);
 	if (!gp->be_write && (omode & O_WRITE))
-		gp->be_write = cclone_and_open(gp->be_walk, O_WRITE);
+		gp->be_write = cclone_and_open(fsf_be_walk(f), O_WRITE);
 	qunlock(&f->qlock);
 	poperror();
 }
 
+static void gtfs_check_lease(struct tree_file *tf);
+
 static struct chan *gtfs_open(struct chan *c, int omode)
 {
+	/* Don't trust an old listing's length for a file we're about to read */
+	gtfs_check_lease(chan_to_tree_file(c));
 	/* truncate can happen before we setup the be_chans.  if we need those, we
 	 * can swap the order */
 	c = tree_chan_open(c, omode);
@@ -327,7 +421,7 @@ static size_t __gtfs_fsf_read(struct fs_file *f, void *ubuf, size_t n,
 	struct gtfs_priv *gp = fsf_to_gtfs_priv(f);
 
 	if (!gp->be_read)
-		gp->be_read = cclone_and_open(gp->be_walk, O_READ);
+		gp->be_read = cclone_and_open(fsf_be_walk(f), O_READ);
 	return devtab[gp->be_read->type].read(gp->be_read, ubuf, n, off);
 }
 
@@ -357,9 +451,9 @@ static size_t __gtfs_fsf_write(struct fs_file *f, void *ubuf, size_t n,
 	size_t ret;
 
 	if (!gp->be_write)
-		gp->be_write = cclone_and_open(gp->be_walk, O_WRITE);
+		gp->be_write = cclone_and_open(fsf_be_walk(f), O_WRITE);
 	ret = devtab[gp->be_write->type].write(gp->be_write, ubuf, n, off);
-	gp->be_length = MAX(gp->be_length, n + ret);
+	gp->be_length = MAX(gp->be_length, off + ret);
 	return ret;
 }
 
@@ -381,35 +475,206 @@ static size_t gtfs_fsf_write(struct fs_file *f, void *ubuf, size_t n,
 	return ret;
 }
 
+static void gtfs_tf_prime(struct tree_file *child, void *arg);
+
+/* The backend's directory entries have everything a lookup would get, so we add
+ * the children to the tree while we have them (readdir-plus).  Then a walk and
+ * stat of each child, e.g. ls -l, doesn't go to the backend.  Failures just
+ * mean a later lookup has to do the work. */
+static void gtfs_prime_children(struct tree_file *parent, uint8_t *buf,
+                                size_t len)
+{
+	ERRSTACK(1);
+	struct dir *dir;
+	size_t m_sz;
+
+	dir = kmalloc(sizeof(struct dir) + len, MEM_WAIT);
+	while (len >= BIT16SZ) {
+		m_sz = GBIT16(buf) + BIT16SZ;
+		if (m_sz > len || statcheck(buf, m_sz))
+			break;
+		convM2D(buf, m_sz, dir, (char*)&dir[1]);
+		buf += m_sz;
+		len -= m_sz;
+		if (!dir->name[0] || strchr(dir->name, '/') ||
+		    !strcmp(dir->name, ".") || !strcmp(dir->name, ".."))
+			continue;
+		if (!waserror())
+			tree_file_prime_child(parent, dir->name, gtfs_tf_prime, dir);
+		poperror();
+	}
+	kfree(dir);
+}
+
+static size_t gtfs_dir_read(struct tree_file *tf, void *ubuf, size_t n,
+                            off64_t off)
+{
+	ERRSTACK(1);
+	uint8_t *buf;
+	size_t ret;
+
+	/* Directory reads can be short, so long as they're whole entries, which
+	 * the backend ensures.  We read into our own buffer, since the user could
+	 * change theirs while we parse it. */
+	n = MIN(n, GTFS_DIR_READ_MAX);
+	buf = kmalloc(n, MEM_WAIT);
+	if (waserror()) {
+		kfree(buf);
+		nexterror();
+	}
+	ret = gtfs_fsf_read(&tf->file, buf, n, off);
+	gtfs_prime_children(tf, buf, ret);
+	memcpy(ubuf, buf, ret);
+	poperror();
+	kfree(buf);
+	return ret;
+}
+
 static size_t gtfs_read(struct chan *c, void *ubuf, size_t n, off64_t off)
 {
 	struct tree_file *tf = chan_to_tree_file(c);
 
 	if (tree_file_is_dir(tf))
-		return gtfs_fsf_read(&tf->file, ubuf, n, off);
+		return gtfs_dir_read(tf, ubuf, n, off);
 	return fs_file_read(&tf->file, ubuf, n, off);
 }
 
+static struct tree_file *wbf_to_tf(struct wb_file *wf)
+{
+	return container_of(wf, struct gtfs_priv, wbf)->tf;
+}
+
+static void gtfs_wb_writeback(struct wb_file *wf)
+{
+	writeback_file(&wbf_to_tf(wf)->file);
+}
+
+static bool gtfs_wb_get(struct wb_file *wf)
+{
+	return tf_kref_get(wbf_to_tf(wf));
+}
+
+static void gtfs_wb_put(struct wb_file *wf)
+{
+	tf_kref_put(wbf_to_tf(wf));
+}
+
+static struct wb_ops gtfs_wb_ops = {
+	.writeback = gtfs_wb_writeback,
+	.get = gtfs_wb_get,
+	.put = gtfs_wb_put,
+};
+
+/* The flushers write the data back once it ages or there's a lot of it, and
+ * throttle us if we get too far ahead of them. */
+static size_t gtfs_write(struct chan *c, void *ubuf, size_t n, off64_t off)
+{
+	struct tree_file *tf = chan_to_tree_file(c);
+	size_t ret;
+
+	ret = tree_chan_write(c, ubuf, n, off);
+	wb_mark_dirty(&chan_to_gtfs(c)->wb, &tf_to_gtfs_priv(tf)->wbf, ret);
+	return ret;
+}
+
+static struct gtfs_priv *gtfs_tf_alloc_priv(struct tree_file *tf)
+{
+	struct gtfs_priv *gp = kzmalloc(sizeof(struct gtfs_priv), MEM_WAIT);
+
+	tf->file.priv = gp;
+	gp->tf = tf;
+	wb_file_init(&gp->wbf);
+	qlock_init(&gp->walk_qlock);
+	spinlock_init(&gp->ra_lock);
+	return gp;
+}
+
+/* Sets the file's metadata to what the backend told us */
+static void gtfs_tf_copy_from_dir(struct tree_file *tf, struct dir *dir)
+{
+	struct gtfs_priv *gp = tf_to_gtfs_priv(tf);
+
+	fs_file_copy_from_dir(&tf->file, dir);
+	/* For sync_metadata */
+	gp->be_length = tf->file.dir.length;
+	gp->be_mode = tf->file.dir.mode;
+	gp->be_mtime = tf->file.dir.mtime;
+}
+
 /* Given a file (with dir->name set), couple it and sync to the backend chan.
  * This will store/consume the ref for backend, in the TF (freed with
  * gtfs_tf_free), even on error, unless you zero out the be_walk field. */
 static void gtfs_tf_couple_backend(struct tree_file *tf, struct chan *backend)
 {
 	struct dir *dir;
-	struct gtfs_priv *gp = kzmalloc(sizeof(struct gtfs_priv), MEM_WAIT);
+	struct gtfs_priv *gp = gtfs_tf_alloc_priv(tf);
 
-	tf->file.priv = gp;
 	tf->file.dir.qid = backend->qid;
 	gp->be_walk = backend;
 	dir = chandirstat(backend);
 	if (!dir)
 		error(ENOMEM, "chandirstat failed");
-	fs_file_copy_from_dir(&tf->file, dir);
+	gtfs_tf_copy_from_dir(tf, dir);
 	kfree(dir);
-	/* For sync_metadata */
-	gp->be_length = tf->file.dir.length;
-	gp->be_mode = tf->file.dir.mode;
-	gp->be_mtime = tf->file.dir.mtime;
+}
+
+/* tree_file_prime_child() callback, for a child from its parent's listing.  We
+ * don't walk to it until someone needs the be_walk. */
+static void gtfs_tf_prime(struct tree_file *child, void *arg)
+{
+	struct dir *dir = arg;
+	struct gtfs_priv *gp = gtfs_tf_alloc_priv(child);
+
+	gtfs_tf_copy_from_dir(child, dir);
+	gp->lease_expiry = nsec() + GTFS_LEASE_NSEC;
+}
+
+/* A file from a listing that no one has used has metadata from the listing.
+ * Once that lease runs out, a stat walks to the file and gets its metadata
+ * from the backend, like a lookup would.  After that, the file is like any
+ * other.
+ *
+ * Until the file has a be_walk, it can't have changed on our side: writes,
+ * truncates, and wstats all need the be_walk first.  They also hold the file
+ * qlock, which we hold while we check. */
+static void gtfs_check_lease(struct tree_file *tf)
+{
+	ERRSTACK(1);
+	struct fs_file *f = &tf->file;
+	struct gtfs_priv *gp = tf_to_gtfs_priv(tf);
+	struct dir *dir;
+
+	if (READ_ONCE(gp->be_walk) || nsec() < gp->lease_expiry)
+		return;
+	qlock(&f->qlock);
+	if (gp->be_walk) {
+		qunlock(&f->qlock);
+		return;
+	}
+	if (waserror()) {
+		qunlock(&f->qlock);
+		nexterror();
+	}
+	dir = chandirstat(gtfs_be_walk(tf));
+	if (!dir)
+		error(ENOMEM, "chandirstat failed");
+	f->dir.length = dir->length;
+	f->dir.mode = dir->mode;
+	f->dir.atime = dir->atime;
+	f->dir.mtime = dir->mtime;
+	f->dir.ctime = dir->ctime;
+	gp->be_length = f->dir.length;
+	gp->be_mode = f->dir.mode;
+	gp->be_mtime = f->dir.mtime;
+	kfree(dir);
+	qunlock(&f->qlock);
+	poperror();
+}
+
+static size_t gtfs_stat(struct chan *c, uint8_t *m_buf, size_t m_buf_sz)
+{
+	gtfs_check_lease(chan_to_tree_file(c));
+	return tree_chan_stat(c, m_buf, m_buf_sz);
 }
 
 static void gtfs_tf_free(struct tree_file *tf)
@@ -420,6 +685,7 @@ static void gtfs_tf_free(struct tree_file *tf)
 	if (!gp)
 		return;
 	if (gp->was_removed) {
+		/* Remove walked to the file, so there's a be_walk */
 		gp->be_walk->type = -1;
 		/* sanity */
 		assert(kref_refcnt(&gp->be_walk->ref) == 1);
@@ -434,7 +700,7 @@ static void gtfs_tf_free(struct tree_file *tf)
 static void gtfs_tf_unlink(struct tree_file *parent, struct tree_file *child)
 {
 	struct gtfs_priv *gp = tf_to_gtfs_priv(child);
-	struct chan *be_walk = gp->be_walk;
+	struct chan *be_walk = gtfs_be_walk(child);
 
 	/* Remove clunks the be_walk chan/fid.  if it succeeded (and I think even if
 	 * it didn't), we shouldn't close that fid again, which is what will happen
@@ -466,7 +732,7 @@ static void gtfs_tf_unlink(struct tree_file *parent, struct tree_file *child)
 static void gtfs_tf_lookup(struct tree_file *parent, struct tree_file *child)
 {
 	struct walkqid *wq;
-	struct chan *be_walk = tf_to_gtfs_priv(parent)->be_walk;
+	struct chan *be_walk = gtfs_be_walk(parent);
 	struct chan *child_be_walk;
 
 	wq = devtab[be_walk->type].walk(be_walk, NULL, &child->file.dir.name, 1);
@@ -492,7 +758,7 @@ static void gtfs_tf_create(struct tree_file *parent, struct tree_file *child,
                            int perm)
 {
 	ERRSTACK(1);
-	struct chan *c = cclone(tf_to_gtfs_priv(parent)->be_walk);
+	struct chan *c = cclone(gtfs_be_walk(parent));
 
 	if (waserror()) {
 		cclose(c);
@@ -529,8 +795,8 @@ static void gtfs_tf_rename(struct tree_file *tf, struct tree_file *old_parent,
                            struct tree_file *new_parent, const char *name,
                            int flags)
 {
-	struct chan *tf_c = tf_to_gtfs_priv(tf)->be_walk;
-	struct chan *np_c = tf_to_gtfs_priv(new_parent)->be_walk;
+	struct chan *tf_c = gtfs_be_walk(tf);
+	struct chan *np_c = gtfs_be_walk(new_parent);
 
 	if (!devtab[tf_c->type].rename) {
 		/* 9p can handle intra-directory renames, though some Akaros #devices
@@ -567,30 +833,193 @@ struct tree_file_ops gtfs_tf_ops = {
 	.has_children = gtfs_tf_has_children,
 };
 
-/* Fills page with its contents from its backing store file.
+/* Fills the locked, contiguous pages with one backend read, which #mnt splits
+ * into msize Treads.  Throws on error.
+ *
+ * If offset is beyond the length of the file, the 9p device/server should
+ * return 0.  We'll just init an empty page.  The length on the frontend (in the
+ * fsf->dir.length) will be adjusted.  The backend will hear about it on the
+ * next sync. */
+static void gtfs_fill_pages(struct fs_file *f, struct page **pgs, size_t nr)
+{
+	ERRSTACK(1);
+	off64_t offset = pgs[0]->pg_index << PGSHIFT;
+	size_t ret, amt = nr * PGSIZE;
+	uint8_t *buf;
+
+	buf = nr == 1 ? page2kva(pgs[0]) : kmalloc(amt, MEM_WAIT);
+	if (waserror()) {
+		if (nr > 1)
+			kfree(buf);
+		nexterror();
+	}
+	ret = gtfs_fsf_read(f, buf, amt, offset);
+	poperror();
+	if (ret < amt)
+		memset(buf + ret, 0, amt - ret);
+	if (nr > 1) {
+		for (int i = 0; i < nr; i++)
+			memcpy(page2kva(pgs[i]), buf + i * PGSIZE, PGSIZE);
+		kfree(buf);
+	}
+}
+
+/* Grabs up to nr new pages starting at index, stopping at EOF or the first page
+ * the PM already has.  Returns how many we got. */
+static size_t gtfs_grab_ra_pages(struct fs_file *f, unsigned long index,
+                                 struct page **pgs, size_t nr)
+{
+	unsigned long eof_idx = DIV_ROUND_UP(fs_file_get_length(f), PGSIZE);
+	size_t i;
+
+	for (i = 0; i < nr && index + i < eof_idx; i++) {
+		pgs[i] = pm_grab_new_page(f->pm, index + i);
+		if (!pgs[i])
+			break;
+	}
+	return i;
+}
+
+static void gtfs_release_ra_pages(struct fs_file *f, struct page **pgs,
+                                  size_t nr, bool filled)
+{
+	struct gtfs_priv *gp = fsf_to_gtfs_priv(f);
+
+	for (int i = 0; i < nr; i++) {
+		if (filled)
+			atomic_or(&pgs[i]->pg_flags, PG_UPTODATE | PG_READAHEAD);
+		unlock_page(pgs[i]);
+		pm_put_page(pgs[i]);
+	}
+	if (filled) {
+		spin_lock(&gp->ra_lock);
+		gp->nr_ra_pages += nr;
+		spin_unlock(&gp->ra_lock);
+	}
+}
+
+struct gtfs_ra_work {
+	struct tree_file			*tf;
+	unsigned long				index;
+	size_t						nr;
+};
+
+static void gtfs_ra_ktask(void *arg)
+{
+	ERRSTACK(1);
+	struct gtfs_ra_work *w = arg;
+	struct fs_file *f = &w->tf->file;
+	struct page *pgs[GTFS_RA_MAX_PAGES];
+	size_t nr;
+
+	nr = gtfs_grab_ra_pages(f, w->index, pgs, w->nr);
+	if (nr) {
+		if (waserror()) {
+			gtfs_release_ra_pages(f, pgs, nr, false);
+		} else {
+			gtfs_fill_pages(f, pgs, nr);
+			gtfs_release_ra_pages(f, pgs, nr, true);
+		}
+		poperror();
+	}
+	tf_kref_put(w->tf);
+	kfree_sized(w, sizeof(struct gtfs_ra_work));
+}
+
+/* Caller holds the ra_lock.  Reads the next window, async, and sets the trigger
+ * for the one after. */
+static void __gtfs_ra_start_async(struct fs_file *f, struct gtfs_priv *gp,
+                                  struct gtfs_ra_work *w)
+{
+	gp->ra_window = MIN(gp->ra_window * 2, GTFS_RA_MAX_PAGES);
+	w->index = gp->ra_next;
+	w->nr = gp->ra_window;
+	gp->ra_trigger = gp->ra_next;
+	gp->ra_next += gp->ra_window;
+}
+
+/* The first use of a page we read ahead.  If it's the trigger, we're still
+ * sequential, and we start reading the next window before they get there. */
+static void gtfs_pm_readahead_hit(struct page_map *pm, struct page *pg)
+{
+	struct fs_file *f = pm->pm_file;
+	struct gtfs_priv *gp = fsf_to_gtfs_priv(f);
+	struct gtfs_ra_work *w = NULL;
+
+	spin_lock(&gp->ra_lock);
+	gp->nr_ra_hits++;
+	if (pg->pg_index == gp->ra_trigger) {
+		w = kmalloc_sized(sizeof(struct gtfs_ra_work), MEM_ATOMIC);
+		if (w)
+			__gtfs_ra_start_async(f, gp, w);
+	}
+	spin_unlock(&gp->ra_lock);
+	if (!w)
+		return;
+	/* The ktask needs the TF (and thus the PM) to stay around */
+	w->tf = (struct tree_file*)f;
+	if (!tf_kref_get(w->tf)) {
+		kfree_sized(w, sizeof(struct gtfs_ra_work));
+		return;
+	}
+	ktask("gtfs_ra", gtfs_ra_ktask, w);
+}
+
+/* Returns how many pages to read for a miss at index, including that page.
+ * Misses at ra_next are sequential and grow the window; anything else resets
+ * it, unless the PM's hint (PM_RA_*) says otherwise.  The trigger is halfway
+ * into what we read, so the async read of the next window overlaps with the
+ * reader using this one. */
+static size_t gtfs_ra_on_miss(struct gtfs_priv *gp, unsigned long index,
+                              int hint)
+{
+	size_t nr;
+
+	spin_lock(&gp->ra_lock);
+	if (hint == PM_RA_RANDOM)
+		gp->ra_window = 1;
+	else if (hint == PM_RA_SEQUENTIAL)
+		gp->ra_window = GTFS_RA_MAX_PAGES;
+	else if (index == 0 || index == gp->ra_next)
+		gp->ra_window = MIN(MAX(gp->ra_window * 2, GTFS_RA_INIT_PAGES),
+		                    GTFS_RA_MAX_PAGES);
+	else
+		gp->ra_window = 1;
+	nr = gp->ra_window;
+	gp->ra_next = index + nr;
+	gp->ra_trigger = nr > 1 ? index + nr / 2 : -1UL;
+	spin_unlock(&gp->ra_lock);
+	return nr;
+}
+
+/* Fills page with its contents from its backing store file, along with the
+ * readahead window if the access looks sequential.
  *
  * Note the page/offset might be beyond the current file length, based on the
  * current pagemap code. */
 static int gtfs_pm_readpage(struct page_map *pm, struct page *pg)
 {
 	ERRSTACK(1);
-	void *kva = page2kva(pg);
-	off64_t offset = pg->pg_index << PGSHIFT;
-	size_t ret;
-
+	struct fs_file *f = pm->pm_file;
+	struct page *pgs[GTFS_RA_MAX_PAGES];
+	size_t nr;
+
+	/* We grab the extra pages, which locks them, before the file qlock, same
+	 * as our caller did for pg. */
+	pgs[0] = pg;
+	nr = 1 + gtfs_grab_ra_pages(f, pg->pg_index + 1, pgs + 1,
+	                            gtfs_ra_on_miss(fsf_to_gtfs_priv(f),
+	                                            pg->pg_index,
+	                                            READ_ONCE(pm->pm_ra_hint)) - 1);
 	if (waserror()) {
+		gtfs_release_ra_pages(f, pgs + 1, nr - 1, false);
 		poperror();
 		return -get_errno();
 	}
-	/* If offset is beyond the length of the file, the 9p device/server should
-	 * return 0.  We'll just init an empty page.  The length on the frontend (in
-	 * the fsf->dir.length) will be adjusted.  The backend will hear about it on
-	 * the next sync. */
-	ret = gtfs_fsf_read(pm->pm_file, kva, PGSIZE, offset);
+	gtfs_fill_pages(f, pgs, nr);
 	poperror();
-	if (ret < PGSIZE)
-		memset(kva + ret, 0, PGSIZE - ret);
 	atomic_or(&pg->pg_flags, PG_UPTODATE);
+	gtfs_release_ra_pages(f, pgs + 1, nr - 1, true);
 	return 0;
 }
 
@@ -613,6 +1042,7 @@ static int gtfs_pm_writepage(struct page_map *pm, struct page *pg)
 	 * comes up is when the len is in the middle of the last page. */
 	if (offset >= fs_file_get_length(f)) {
 		qunlock(&f->qlock);
+		poperror();
 		return 0;
 	}
 	amt = MIN(PGSIZE, fs_file_get_length(f) - offset);
@@ -622,6 +1052,44 @@ static int gtfs_pm_writepage(struct page_map *pm, struct page *pg)
 	return 0;
 }
 
+/* Flushes a run of contiguous pages with one backend write, which #mnt splits
+ * into msize Twrites. */
+static int gtfs_pm_writepages(struct page_map *pm, struct page **pgs,
+                              size_t nr)
+{
+	ERRSTACK(1);
+	struct fs_file *f = pm->pm_file;
+	off64_t offset = pgs[0]->pg_index << PGSHIFT;
+	size_t amt, len;
+	uint8_t *buf;
+
+	if (nr == 1)
+		return gtfs_pm_writepage(pm, pgs[0]);
+	buf = kmalloc(nr * PGSIZE, MEM_WAIT);
+	qlock(&f->qlock);
+	if (waserror()) {
+		qunlock(&f->qlock);
+		kfree(buf);
+		poperror();
+		return -get_errno();
+	}
+	len = fs_file_get_length(f);
+	if (offset >= len) {
+		qunlock(&f->qlock);
+		poperror();
+		kfree(buf);
+		return 0;
+	}
+	amt = MIN(nr * PGSIZE, len - offset);
+	for (int i = 0; i < DIV_ROUND_UP(amt, PGSIZE); i++)
+		memcpy(buf + i * PGSIZE, page2kva(pgs[i]), PGSIZE);
+	__gtfs_fsf_write(f, buf, amt, offset);
+	qunlock(&f->qlock);
+	poperror();
+	kfree(buf);
+	return 0;
+}
+
 /* Caller holds the file's qlock */
 static void __trunc_to(struct fs_file *f, off64_t begin)
 {
@@ -704,7 +1172,9 @@ static bool gtfs_fs_can_grow_to(struct fs_file *f, size_t len)
 
 struct fs_file_ops gtfs_fs_ops = {
 	.readpage = gtfs_pm_readpage,
+	.readahead_hit = gtfs_pm_readahead_hit,
 	.writepage = gtfs_pm_writepage,
+	.writepages = gtfs_pm_writepages,
 	.punch_hole = gtfs_fs_punch_hole,
 	.can_grow_to = gtfs_fs_can_grow_to,
 };
@@ -729,7 +1199,8 @@ struct fs_file_ops gtfs_fs_ops = {
  * mchan.
  *
  * All gtfs *tree_files* have at least one refcounted chan corresponding to the
- * file/FID on the backend server.  Think of it as a 1:1 connection, even though
+ * file/FID on the backend server, once they have been used (see
+ * gtfs_be_walk()).  Think of it as a 1:1 connection, even though
  * there is more than one chan.  The gtfs device can have many chans pointing to
  * the same TF, which is kreffed.  That TF is 1:1 on a backend object.
  *
@@ -773,6 +1244,8 @@ static struct chan *gtfs_attach(char *arg)
 	poperror();
 	tfs->tf_ops = gtfs_tf_ops;
 	tfs->fs_ops = gtfs_fs_ops;
+	tfs->neg_ttl_nsec = GTFS_NEG_TTL_NSEC;
+	wb_domain_init(&gtfs->wb, "gtfs_wb", &gtfs_wb_ops, WB_NR_FLUSHERS);
 	/* need another ref on root for the frontend chan */
 	tf_kref_get(tfs->root);
 	chan_set_tree_file(frontend, tfs->root);
@@ -805,17 +1278,22 @@ static void pressure_dfs_cb(struct tree_file *tf)
 /* Under memory pressure, there are a bunch of things we can do. */
 static void gtfs_free_memory(struct gtfs *gtfs)
 {
-	/* This attempts to remove every file from the LRU.  It'll write back dirty
-	 * files, then if they haven't been used since we started, it'll delete the
-	 * frontend TF, which will delete the entire page cache entry.  The heavy
-	 * lifting is done by TF code. */
-	tfs_lru_for_each(&gtfs->tfs, lru_prune_cb, -1);
+	size_t nr_freed;
+
+	/* This attempts to remove a batch of files from the LRU.  It'll write back
+	 * dirty files, then if they haven't been used since we started, it'll
+	 * delete the frontend TF, which will delete the entire page cache entry.
+	 * The heavy lifting is done by TF code.  Each call picks up where the last
+	 * one left off, so repeated pressure works through the whole LRU. */
+	nr_freed = tfs_lru_for_each(&gtfs->tfs, lru_prune_cb, GTFS_LRU_PRUNE_BATCH);
 	/* This drops the negative TFs.  It's not a huge deal, since they are small,
 	 * but perhaps it'll help. */
-	tfs_lru_prune_neg(&gtfs->tfs);
-	/* This will attempt to free memory from all files in the frontend,
-	 * regardless of whether or not they are in use.  This might help if you
-	 * have some large files that happened to be open. */
+	tfs_lru_prune_neg(&gtfs->tfs, GTFS_LRU_PRUNE_BATCH);
+	if (nr_freed)
+		return;
+	/* Nothing was idle.  This will attempt to free memory from all files in the
+	 * frontend, regardless of whether or not they are in use.  This might help
+	 * if you have some large files that happened to be open. */
 	tfs_frontend_for_each(&gtfs->tfs, pressure_dfs_cb);
 }
 
@@ -824,9 +1302,23 @@ static void gtfs_sync_tf(struct tree_file *tf)
 	writeback_file(&tf->file);
 }
 
+/* Directories only have metadata, so we do them here.  Files go to the
+ * flushers, which write back several at once. */
+static void gtfs_sync_queue_tf(struct tree_file *tf)
+{
+	struct gtfs *gtfs = (struct gtfs*)tf->tfs;
+
+	if (tree_file_is_dir(tf))
+		writeback_file(&tf->file);
+	else
+		wb_queue_file(&gtfs->wb, &tf_to_gtfs_priv(tf)->wbf);
+}
+
 static void gtfs_sync_gtfs(struct gtfs *gtfs)
 {
-	tfs_frontend_for_each(&gtfs->tfs, gtfs_sync_tf);
+	tfs_frontend_for_each(&gtfs->tfs, gtfs_sync_queue_tf);
+	if (wb_sync(&gtfs->wb))
+		error(EIO, "#%s: some files failed to sync", devname());
 }
 
 /* chan_ctl or something can hook into these functions */
@@ -864,13 +1356,13 @@ struct dev gtfs_devtab __devtab = {
 	.shutdown = devshutdown,
 	.attach = gtfs_attach,
 	.walk = gtfs_walk,
-	.stat = tree_chan_stat,
+	.stat = gtfs_stat,
 	.open = gtfs_open,
 	.create = gtfs_create,
 	.close = gtfs_close,
 	.read = gtfs_read,
-	.bread = devbread,
-	.write = tree_chan_write,
+	.bread = tree_chan_bread,
+	.write = gtfs_write,
 	.bwrite = devbwrite,
 	.remove = gtfs_remove,
 	.rename = tree_chan_rename,
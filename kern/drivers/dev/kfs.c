@@ -3,6 +3,12 @@
  * See LICENSE for details.
  *
  * #kfs, in-memory ram filesystem, pulling from the kernel's embedded CPIO
+ *
+ * We don't copy the CPIO's files into the page cache at boot.  Each regular file
+ * points at its data in the CPIO, and readpage copies a page the first time
+ * someone touches it.  The CPIO stays around for as long as the kernel does.
+ * If the CPIO is gzipped, we inflate it once at boot and free the compressed
+ * copy.
  */
 
 #include <ns.h>
@@ -14,6 +20,7 @@
 #include <tree_file.h>
 #include <pmap.h>
 #include <cpio.h>
+#include <zlib.h>
 
 struct dev kfs_devtab;
 
@@ -32,9 +39,16 @@ static char *devname(void)
 	return kfs_devtab.name;
 }
 
+/* A regular file's original contents, hanging off fs_file->priv.  Pages past len
+ * are zeros.  Once a page is in the page cache, the page cache is the truth. */
+struct kfs_cpio_data {
+	const uint8_t				*data;
+	size_t						len;
+};
+
 static void kfs_tf_free(struct tree_file *tf)
 {
-	/* We have nothing special hanging off the TF */
+	kfree(tf->file.priv);
 }
 
 static void kfs_tf_unlink(struct tree_file *parent, struct tree_file *child)
@@ -89,13 +103,24 @@ struct tree_file_ops kfs_tf_ops = {
 	.has_children = kfs_tf_has_children,
 };
 
-/* Fills page with its contents from its backing store file.  For KFS, that
- * means we're creating or extending a file, and the contents are 0.  Note the
- * page/offset might be beyond the current file length, based on the current
- * pagemap code. */
+/* Fills page with its contents from its backing store file.  For KFS, that is
+ * the file's data in the CPIO, if any.  Otherwise, we're creating or extending
+ * a file, and the contents are 0.  Note the page/offset might be beyond the
+ * current file length, based on the current pagemap code. */
 static int kfs_pm_readpage(struct page_map *pm, struct page *pg)
 {
-	memset(page2kva(pg), 0, PGSIZE);
+	struct kfs_cpio_data *cd = pm->pm_file->priv;
+	size_t off = pg->pg_index << PGSHIFT;
+	size_t len, amt = 0;
+
+	if (cd) {
+		len = READ_ONCE(cd->len);
+		if (off < len) {
+			amt = MIN(PGSIZE, len - off);
+			memcpy(page2kva(pg), cd->data + off, amt);
+		}
+	}
+	memset(page2kva(pg) + amt, 0, PGSIZE - amt);
 	atomic_or(&pg->pg_flags, PG_UPTODATE);
 	/* Pretend that we blocked while filing this page.  This catches a lot of
 	 * bugs.  It does slightly slow down the kernel, but it's only when filling
@@ -112,8 +137,15 @@ static int kfs_pm_writepage(struct page_map *pm, struct page *pg)
 	return 0;
 }
 
+/* The only punches are truncates, from begin to the end of the file.  The page
+ * cache has the edge pages, so we just forget the CPIO data from begin on,
+ * lest we read it back in when regrowing the file. */
 static void kfs_fs_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 {
+	struct kfs_cpio_data *cd = f->priv;
+
+	if (cd && begin < cd->len)
+		WRITE_ONCE(cd->len, begin);
 }
 
 static bool kfs_fs_can_grow_to(struct fs_file *f, size_t len)
@@ -173,9 +205,8 @@ static struct chan *__add_kfs_file(struct chan *root, char *path,
 {
 	ERRSTACK(1);
 	struct chan *c;
-	off64_t offset = 0;
-	size_t ret, amt = c_bhdr->c_filesize;
-	void *buf = c_bhdr->c_filestart;
+	struct fs_file *f;
+	struct kfs_cpio_data *cd;
 
 	if (waserror()) {
 		warn("failed to add %s", path);
@@ -185,18 +216,15 @@ static struct chan *__add_kfs_file(struct chan *root, char *path,
 	}
 	c = namec_from(root, path, Acreate, O_EXCL | O_RDWR, c_bhdr->c_mode, NULL);
 	poperror();
-	if (waserror()) {
-		warn("failed to modify %s", path);
-		cclose(c);
-		poperror();
-		return NULL;
-	}
-	while (amt) {
-		ret = devtab[c->type].write(c, buf + offset, amt, offset);
-		amt -= ret;
-		offset += ret;
-	}
-	poperror();
+	if (!c_bhdr->c_filesize)
+		return c;
+	cd = kmalloc(sizeof(struct kfs_cpio_data), MEM_WAIT);
+	cd->data = c_bhdr->c_filestart;
+	cd->len = c_bhdr->c_filesize;
+	/* No one else can see the file yet; we're still in devtabinit. */
+	f = &chan_to_tree_file(c)->file;
+	f->priv = cd;
+	WRITE_ONCE(f->dir.length, cd->len);
 	return c;
 }
 
@@ -275,6 +303,64 @@ static void kfs_free_cpio(struct cpio_info *ci)
 	arena_add(base_arena, base, sz, MEM_WAIT);
 }
 
+#define GZIP_FHCRC		(1 << 1)
+#define GZIP_FEXTRA		(1 << 2)
+#define GZIP_FNAME		(1 << 3)
+#define GZIP_FCOMMENT	(1 << 4)
+
+/* Returns the offset of the deflate stream in a gzip file, or 0 if it isn't
+ * one we can handle. */
+static size_t gzip_payload_off(const uint8_t *gz, size_t sz)
+{
+	size_t off = 10;
+	uint8_t flags;
+
+	if (sz < 18 || gz[0] != 0x1f || gz[1] != 0x8b || gz[2] != 8)
+		return 0;
+	flags = gz[3];
+	if (flags & GZIP_FEXTRA)
+		off += 2 + (gz[off] | (gz[off + 1] << 8));
+	if (flags & GZIP_FNAME)
+		off += strnlen((char*)gz + off, sz - off) + 1;
+	if (flags & GZIP_FCOMMENT)
+		off += strnlen((char*)gz + off, sz - off) + 1;
+	if (flags & GZIP_FHCRC)
+		off += 2;
+	/* The trailer is the CRC and the inflated size. */
+	if (off + 8 > sz)
+		return 0;
+	return off;
+}
+
+/* If the CPIO is gzipped, inflates it into its own pages, which we'll keep
+ * forever, and frees the compressed copy. */
+static void kfs_inflate_cpio(struct cpio_info *ci)
+{
+	const uint8_t *gz = ci->base;
+	size_t off = gzip_payload_off(gz, ci->sz);
+
+	if (!off)
+		return;
+#ifdef CONFIG_KFS_GZIP
+	size_t isize;
+	void *buf;
+	int ret;
+
+	isize = gz[ci->sz - 4] | (gz[ci->sz - 3] << 8) | (gz[ci->sz - 2] << 16) |
+	        ((size_t)gz[ci->sz - 1] << 24);
+	buf = kpages_alloc(ROUNDUP(isize, PGSIZE), MEM_WAIT);
+	ret = zlib_inflate_blob(buf, isize, gz + off, ci->sz - off - 8);
+	if (ret != isize)
+		panic("Failed to inflate the KFS CPIO: %d", ret);
+	printk("Inflated %d MB of CPIO from %d MB\n", isize >> 20, ci->sz >> 20);
+	kfs_free_cpio(ci);
+	ci->base = buf;
+	ci->sz = isize;
+#else
+	panic("The KFS CPIO is gzipped, but CONFIG_KFS_GZIP is off");
+#endif
+}
+
 static void kfs_init(void)
 {
 	struct tree_filesystem *tfs = &kfs.tfs;
@@ -289,8 +375,9 @@ static void kfs_init(void)
 	/* Other devices might want to create things like kthreads that run the LRU
 	 * pruner or PM sweeper. */
 	kfs_get_cpio_info(ci);
+	kfs_inflate_cpio(ci);
+	/* The files point into the CPIO, so we never free it. */
 	kfs_extract_cpio(ci);
-	kfs_free_cpio(ci);
 	/* This has another kref.  Note that each attach gets a ref and each new
 	 * process gets a ref. */
 	kern_slash = tree_file_alloc_chan(kfs.tfs.root, &kfs_devtab, "/");
@@ -318,6 +405,8 @@ struct dev kfs_devtab __devtab = {
 	.name = "kfs",
 	.reset = devreset,
 	.init = kfs_init,
+	/* Walking, and maybe inflating, a big CPIO takes a while. */
+	.init_async = TRUE,
 	.shutdown = devshutdown,
 	.attach = kfs_attach,
 	.walk = tree_chan_walk,
@@ -326,7 +415,7 @@ struct dev kfs_devtab __devtab = {
 	.create = tree_chan_create,
 	.close = tree_chan_close,
 	.read = tree_chan_read,
-	.bread = devbread,
+	.bread = tree_chan_bread,
 	.write = tree_chan_write,
 	.bwrite = devbwrite,
 	.remove = tree_chan_remove,
@@ -14,6 +14,7 @@
 #include <kref.h>
 #include <atomic.h>
 #include <kthread.h>
+#include <alarm.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
@@ -27,6 +28,11 @@
 #include <kprof.h>
 #include <ros/procinfo.h>
 #include <init.h>
+#include <lockstat.h>
+#include <latency.h>
+#include <taskqueue.h>
+#include <zpool.h>
+#include <zstore.h>
 
 #define KTRACE_BUFFER_SIZE (128 * 1024)
 #define TRACE_PRINTK_BUFFER_SIZE (8 * 1024)
@@ -40,6 +46,13 @@ enum {
 	Kprintxqid,
 	Kmpstatqid,
 	Kmpstatrawqid,
+	Kmpstreamqid,
+	Klockstatqid,
+	Klatencyqid,
+	Kwqstatqid,
+	Kzpoolqid,
+	Kzstoreqid,
+	Kpringqid,
 };
 
 struct trace_printk_buffer {
@@ -54,6 +67,46 @@ struct kprof {
 	bool opened;
 };
 
+/* mpstat-stream: while anyone has it open, an alarm takes the per-core state
+ * ticks every interval and keeps the last MPSTREAM_NR_HIST deltas.  Readers
+ * block for the next sample, and ones that fall behind skip to the oldest.
+ *
+ * The alarm only reads the other cores' counters (under their seq ctrs), so
+ * there's no IPI.  A delta that goes backwards means someone reset the ticks,
+ * which we don't sync with, so we take the new count as the delta. */
+#define MPSTREAM_NR_HIST		64
+#define MPSTREAM_DEF_USEC		(1000 * 1000)
+/* seq, core, interval, and the states, up to 20 digits each */
+#define MPSTREAM_LINE_LEN		((3 + NR_CPU_STATES) * 21 + 1)
+
+struct mpstream_sample {
+	uint64_t					seq;
+	uint64_t					interval;		/* usec */
+	uint64_t					*ticks;			/* [core][state] deltas */
+};
+
+struct mpstream {
+	qlock_t						qlock;			/* opens and closes */
+	unsigned int				nr_open;
+	struct alarm_waiter			waiter;
+	struct timer_chain			*tchain;
+	/* The cv's lock protects the rest */
+	struct cond_var				cv;
+	bool						running;
+	uint64_t					interval_usec;
+	uint64_t					seq;			/* latest sample, 0 for none */
+	uint64_t					last_tsc;
+	uint64_t					*prev;			/* [core][state] totals */
+	struct mpstream_sample		hist[MPSTREAM_NR_HIST];
+};
+
+struct mpstream_reader {
+	uint64_t					seq;			/* next sample to read */
+	char						*buf;			/* text of the last one */
+	size_t						len;
+	size_t						off;
+};
+
 struct dev kprofdevtab;
 struct dirtab kproftab[] = {
 	{".",			{Kprofdirqid,		0, QTDIR}, 0,	DMDIR|0550},
@@ -64,9 +117,17 @@ struct dirtab kproftab[] = {
 	{"kprintx",		{Kprintxqid},		0,	0600},
 	{"mpstat",		{Kmpstatqid},		0,	0600},
 	{"mpstat-raw",	{Kmpstatrawqid},	0,	0600},
+	{"mpstat-stream",	{Kmpstreamqid},	0,	0600},
+	{"lockstat",	{Klockstatqid},		0,	0600},
+	{"latency",		{Klatencyqid},		0,	0600},
+	{"wqstat",		{Kwqstatqid},		0,	0600},
+	{"zpool",		{Kzpoolqid},		0,	0600},
+	{"zstore",		{Kzstoreqid},		0,	0600},
+	{"kpring",		{Kpringqid},		0,	0600},
 };
 
 static struct kprof kprof;
+static struct mpstream mpstream;
 static bool ktrace_init_done = FALSE;
 static spinlock_t ktrace_lock = SPINLOCK_INITIALIZER_IRQSAVE;
 static struct circular_buffer ktrace_data;
@@ -88,6 +149,175 @@ static size_t mpstatraw_len(void)
 	return header_row + cpu_row * num_cores + 1;
 }
 
+/* Caller holds the cv lock.  Takes the totals for every core into out. */
+static void __mpstream_snapshot(uint64_t *out)
+{
+	for (int i = 0; i < num_cores; i++)
+		get_cpu_state_ticks(i, &out[i * NR_CPU_STATES]);
+}
+
+static void mpstream_alarm(struct alarm_waiter *waiter)
+{
+	struct mpstream *ms = container_of(waiter, struct mpstream, waiter);
+	struct mpstream_sample *s;
+	uint64_t now = read_tsc();
+	uint64_t cur[NR_CPU_STATES], *prev;
+
+	cv_lock(&ms->cv);
+	s = &ms->hist[(ms->seq + 1) % MPSTREAM_NR_HIST];
+	for (int i = 0; i < num_cores; i++) {
+		get_cpu_state_ticks(i, cur);
+		prev = &ms->prev[i * NR_CPU_STATES];
+		for (int j = 0; j < NR_CPU_STATES; j++) {
+			s->ticks[i * NR_CPU_STATES + j] = cur[j] >= prev[j] ?
+			                                  cur[j] - prev[j] : cur[j];
+			prev[j] = cur[j];
+		}
+	}
+	s->interval = tsc2usec(now - ms->last_tsc);
+	ms->last_tsc = now;
+	s->seq = ++ms->seq;
+	__cv_broadcast(&ms->cv);
+	/* Unlike set_awaiter_rel(), _inc doesn't drift by the time we took */
+	if (ms->running) {
+		set_awaiter_inc(waiter, ms->interval_usec);
+		set_alarm(ms->tchain, waiter);
+	}
+	cv_unlock(&ms->cv);
+}
+
+static void mpstream_alloc(struct mpstream *ms)
+{
+	size_t sz = num_cores * NR_CPU_STATES * sizeof(uint64_t);
+
+	ms->prev = kzmalloc(sz, MEM_WAIT);
+	for (int i = 0; i < MPSTREAM_NR_HIST; i++)
+		ms->hist[i].ticks = kzmalloc(sz, MEM_WAIT);
+}
+
+static void mpstream_open(struct chan *c)
+{
+	struct mpstream *ms = &mpstream;
+	struct mpstream_reader *r;
+
+	r = kzmalloc(sizeof(struct mpstream_reader), MEM_WAIT);
+	r->buf = kmalloc(num_cores * MPSTREAM_LINE_LEN + 1, MEM_WAIT);
+	/* The first read gets the oldest sample we still have */
+	r->seq = 1;
+	c->aux = r;
+	qlock(&ms->qlock);
+	if (ms->nr_open++) {
+		qunlock(&ms->qlock);
+		return;
+	}
+	/* The history sticks around, so it's only allocated once */
+	if (!ms->prev)
+		mpstream_alloc(ms);
+	cv_lock(&ms->cv);
+	ms->last_tsc = read_tsc();
+	__mpstream_snapshot(ms->prev);
+	ms->running = TRUE;
+	cv_unlock(&ms->cv);
+	ms->tchain = &per_cpu_info[core_id()].tchain;
+	init_awaiter(&ms->waiter, mpstream_alarm);
+	set_awaiter_rel(&ms->waiter, ms->interval_usec);
+	set_alarm(ms->tchain, &ms->waiter);
+	qunlock(&ms->qlock);
+}
+
+static void mpstream_close(struct chan *c)
+{
+	struct mpstream *ms = &mpstream;
+	struct mpstream_reader *r = c->aux;
+
+	qlock(&ms->qlock);
+	if (!--ms->nr_open) {
+		/* The alarm only rearms while running, and unset waits for one that's
+		 * in progress, so it's off once we return. */
+		cv_lock(&ms->cv);
+		ms->running = FALSE;
+		cv_unlock(&ms->cv);
+		unset_alarm(ms->tchain, &ms->waiter);
+	}
+	qunlock(&ms->qlock);
+	kfree(r->buf);
+	kfree(r);
+}
+
+/* Caller holds the cv lock.  One line per core: seq, core, the interval, then
+ * usec in each state, in the order of cpu_state_names. */
+static size_t __mpstream_format(struct mpstream_sample *s, char *buf)
+{
+	size_t bufsz = num_cores * MPSTREAM_LINE_LEN + 1;
+	size_t len = 0;
+	uint64_t *ticks;
+
+	for (int i = 0; i < num_cores; i++) {
+		ticks = &s->ticks[i * NR_CPU_STATES];
+		len += snprintf(buf + len, bufsz - len, "%llu %d %llu", s->seq, i,
+		                s->interval);
+		for (int j = 0; j < NR_CPU_STATES; j++)
+			len += snprintf(buf + len, bufsz - len, " %llu",
+			                tsc2usec(ticks[j]));
+		len += snprintf(buf + len, bufsz - len, "\n");
+	}
+	return len;
+}
+
+/* Blocks until there's a sample r hasn't seen, then formats it into r->buf */
+static void mpstream_next(struct chan *c, struct mpstream_reader *r)
+{
+	ERRSTACK(1);
+	struct mpstream *ms = &mpstream;
+	struct cv_lookup_elm cle;
+
+	cv_lock(&ms->cv);
+	__reg_abortable_cv(&cle, &ms->cv);
+	if (waserror()) {
+		cv_unlock(&ms->cv);
+		dereg_abortable_cv(&cle);
+		nexterror();
+	}
+	while (ms->seq < r->seq) {
+		if (c->flag & O_NONBLOCK)
+			error(EAGAIN, "no new mpstat sample");
+		if (should_abort(&cle))
+			error(EINTR, "syscall aborted");
+		cv_wait(&ms->cv);
+	}
+	if (ms->seq - r->seq >= MPSTREAM_NR_HIST)
+		r->seq = ms->seq - MPSTREAM_NR_HIST + 1;
+	r->len = __mpstream_format(&ms->hist[r->seq % MPSTREAM_NR_HIST], r->buf);
+	r->off = 0;
+	r->seq++;
+	cv_unlock(&ms->cv);
+	dereg_abortable_cv(&cle);
+	poperror();
+}
+
+/* It's a stream, so we ignore the offset.  A read gets at most one sample. */
+static size_t mpstream_read(struct chan *c, void *va, size_t n)
+{
+	struct mpstream_reader *r = c->aux;
+
+	if (r->off == r->len)
+		mpstream_next(c, r);
+	n = MIN(n, r->len - r->off);
+	memmove(va, r->buf + r->off, n);
+	r->off += n;
+	return n;
+}
+
+/* Takes effect after the next sample */
+static void mpstream_set_interval(unsigned long msec)
+{
+	if (!msec)
+		error(EINVAL, "mpstat-stream interval must be at least 1 msec");
+	cv_lock(&mpstream.cv);
+	mpstream.interval_usec = msec * 1000;
+	cv_unlock(&mpstream.cv);
+}
+
 static char *devname(void)
 {
 	return kprofdevtab.name;
@@ -173,6 +403,10 @@ static void kprof_init(void)
 	kproftab[Kmpstatqid].length = mpstat_len();
 	kproftab[Kmpstatrawqid].length = mpstatraw_len();
 
+	qlock_init(&mpstream.qlock);
+	cv_init(&mpstream.cv);
+	mpstream.interval_usec = MPSTREAM_DEF_USEC;
+
 	strlcpy(kprof_control_usage, "start|stop|flush",
 	        sizeof(kprof_control_usage));
 	profiler_append_configure_usage(kprof_control_usage,
@@ -203,6 +437,7 @@ static size_t kprof_stat(struct chan *c, uint8_t *db, size_t n)
 {
 	kproftab[Kprofdataqid].length = kprof_profdata_size();
 	kproftab[Kptraceqid].length = kprof_tracedata_size();
+	kproftab[Kpringqid].length = profiler_ring_size();
 
 	return devstat(c, db, n, kproftab, ARRAY_SIZE(kproftab), devgen);
 }
@@ -228,6 +463,9 @@ static struct chan *kprof_open(struct chan *c, int omode)
 		profiler_setup();
 		qunlock(&kprof.lock);
 		break;
+	case Kmpstreamqid:
+		mpstream_open(c);
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -246,10 +484,23 @@ static void kprof_close(struct chan *c)
 			kprof.opened = FALSE;
 			qunlock(&kprof.lock);
 			break;
+		case Kmpstreamqid:
+			mpstream_close(c);
+			break;
 		}
 	}
 }
 
+static struct fs_file *kprof_mmap(struct chan *c, struct vm_region *vmr,
+                                  int prot, int flags)
+{
+	if (c->qid.path != Kpringqid) {
+		set_error(ENODEV, "only kpring can be mmapped");
+		return NULL;
+	}
+	return profiler_ring_mmap(prot, flags);
+}
+
 static long mpstat_read(void *va, long n, int64_t off)
 {
 	size_t bufsz = mpstat_len();
@@ -344,6 +595,24 @@ static size_t kprof_read(struct chan *c, void *va, size_t n, off64_t off)
 	case Kmpstatrawqid:
 		n = mpstatraw_read(va, n, offset);
 		break;
+	case Kmpstreamqid:
+		n = mpstream_read(c, va, n);
+		break;
+	case Klockstatqid:
+		n = lockstat_read(va, n, offset);
+		break;
+	case Klatencyqid:
+		n = lat_read(va, n, offset);
+		break;
+	case Kwqstatqid:
+		n = wqstat_read(va, n, offset);
+		break;
+	case Kzpoolqid:
+		n = zpool_read(va, n, offset);
+		break;
+	case Kzstoreqid:
+		n = zstore_read(va, n, offset);
+		break;
 	default:
 		n = 0;
 		break;
@@ -431,6 +700,26 @@ static size_t kprof_write(struct chan *c, void *a, size_t n, off64_t unused)
 			error(EFAIL, "Bad mpstat option (reset|ipi|on|off)");
 		}
 		break;
+	case Kmpstreamqid:
+		if (cb->nf < 2 || strcmp(cb->f[0], "interval"))
+			error(EFAIL, "Bad mpstat-stream option (interval MSEC)");
+		mpstream_set_interval(strtoul(cb->f[1], NULL, 0));
+		break;
+	case Klockstatqid:
+		lockstat_ctl(cb);
+		break;
+	case Klatencyqid:
+		lat_ctl(cb);
+		break;
+	case Kwqstatqid:
+		wqstat_ctl(cb);
+		break;
+	case Kzpoolqid:
+		zpool_ctl(cb);
+		break;
+	case Kzstoreqid:
+		zstore_ctl(cb);
+		break;
 	default:
 		error(EBADFD, ERROR_FIXME);
 	}
@@ -592,4 +881,5 @@ struct dev kprofdevtab __devtab = {
 	.bwrite = devbwrite,
 	.remove = devremove,
 	.wstat = devwstat,
+	.mmap = kprof_mmap,
 };
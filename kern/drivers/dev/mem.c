@@ -13,6 +13,7 @@
 #include <error.h>
 #include <syscall.h>
 #include <sys/queue.h>
+#include <alloc_prof.h>
 
 struct dev mem_devtab;
 
@@ -27,6 +28,8 @@ enum {
 	Qslab_stats,
 	Qfree,
 	Qkmemstat,
+	Qalloc_prof,
+	Qreclaim,
 };
 
 static struct dirtab mem_dir[] = {
@@ -35,6 +38,8 @@ static struct dirtab mem_dir[] = {
 	{"slab_stats", {Qslab_stats, 0, QTFILE}, 0, 0444},
 	{"free", {Qfree, 0, QTFILE}, 0, 0444},
 	{"kmemstat", {Qkmemstat, 0, QTFILE}, 0, 0444},
+	{"alloc_prof", {Qalloc_prof, 0, QTFILE}, 0, 0644},
+	{"reclaim", {Qreclaim, 0, QTFILE}, 0, 0644},
 };
 
 static struct chan *mem_attach(char *spec)
@@ -170,6 +175,7 @@ static size_t fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza,
 {
 	struct kmem_slab *s_i;
 	struct kmem_bufctl *bc_i;
+	struct kmem_cache_stats st;
 
 	size_t nr_unalloc_objs = 0;
 	size_t empty_hash_chain = 0;
@@ -208,14 +214,34 @@ static size_t fetch_slab_stats(struct kmem_cache *kc, struct sized_alloc *sza,
 	                  kc->hh.nr_hash_lists, empty_hash_chain,
 					  longest_hash_chain, kc->hh.load_limit);
 	spin_unlock_irqsave(&kc->cache_lock);
-	spin_lock_irqsave(&kc->depot.lock);
+	kmem_cache_get_stats(kc, &st);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
-	                  "Depot magsize: %d\n", kc->depot.magsize);
+	                  "Allocs: %lu, frees: %lu, mag hits: %lu (%u%%)\n",
+	                  st.nr_allocs, st.nr_frees, st.nr_mag_hits,
+	                  kmem_stats_hit_pct(&st));
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
-	                  "Nr empty mags: %d\n", kc->depot.nr_empty);
-	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
-	                  "Nr non-empty mags: %d\n", kc->depot.nr_not_empty);
-	spin_unlock_irqsave(&kc->depot.lock);
+	                  "Depot mags: %lu, slab allocs: %lu, slab frees: %lu\n",
+	                  st.nr_depot_trips, st.nr_slab_allocs, st.nr_slab_frees);
+	for (int i = 0; i < kc->nr_depots; i++) {
+		struct kmem_depot *depot = &kc->depots[i];
+
+		spin_lock_irqsave(&depot->lock);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "Depot %d magsize: %d\n", i, depot->magsize);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\tNr empty mags: %d\n", depot->nr_empty);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\tNr non-empty mags: %d\n", depot->nr_not_empty);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\tLocal hits: %lu, remote hits: %lu, misses: %lu\n",
+		                  depot->nr_local_hits, depot->nr_remote_hits,
+		                  depot->nr_misses);
+		sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+		                  "\tContended: %lu, mag grows: %lu, mag shrinks: %lu\n",
+		                  depot->nr_contended, depot->nr_mag_grows,
+		                  depot->nr_mag_shrinks);
+		spin_unlock_irqsave(&depot->lock);
+	}
 	return sofar;
 }
 
@@ -228,7 +254,7 @@ static struct sized_alloc *build_slab_stats(void)
 
 	qlock(&arenas_and_slabs_lock);
 	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
-		alloc_amt += 500;
+		alloc_amt += 700 + 200 * kc_i->nr_depots;
 	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
 	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
 		sofar = fetch_slab_stats(kc_i, sza, sofar);
@@ -267,11 +293,18 @@ static struct sized_alloc *build_free(void)
 #define KMEMSTAT_TOTAL			15
 #define KMEMSTAT_ALLOCED		15
 #define KMEMSTAT_NR_ALLOCS		12
-#define KMEMSTAT_LINE_LN (8 + KMEMSTAT_NAME + KMEMSTAT_OBJSIZE + KMEMSTAT_TOTAL\
-                          + KMEMSTAT_ALLOCED + KMEMSTAT_NR_ALLOCS)
-
-const char kmemstat_fmt[]     = "%-*s: %c :%*llu:%*llu:%*llu:%*llu\n";
-const char kmemstat_hdr_fmt[] = "%-*s:Typ:%*s:%*s:%*s:%*s\n";
+#define KMEMSTAT_RATE			10
+#define KMEMSTAT_HIT_PCT		4
+#define KMEMSTAT_CONTENDED		9
+#define KMEMSTAT_LINE_LN (11 + KMEMSTAT_NAME + KMEMSTAT_OBJSIZE \
+                          + KMEMSTAT_TOTAL + KMEMSTAT_ALLOCED \
+                          + KMEMSTAT_NR_ALLOCS + KMEMSTAT_RATE \
+                          + KMEMSTAT_HIT_PCT + KMEMSTAT_CONTENDED)
+
+/* Arenas only have the first set of columns */
+const char kmemstat_fmt[]      = "%-*s: %c :%*llu:%*llu:%*llu:%*llu";
+const char kmemstat_slab_fmt[] = ":%*llu:%*u:%*llu\n";
+const char kmemstat_hdr_fmt[]  = "%-*s:Typ:%*s:%*s:%*s:%*s:%*s:%*s:%*s\n";
 
 static size_t fetch_arena_line(struct arena *arena, struct sized_alloc *sza,
                                size_t sofar, int indent)
@@ -286,29 +319,33 @@ static size_t fetch_arena_line(struct arena *arena, struct sized_alloc *sza,
 					  KMEMSTAT_TOTAL, arena->amt_total_segs,
 					  KMEMSTAT_ALLOCED, arena->amt_alloc_segs,
 					  KMEMSTAT_NR_ALLOCS, arena->nr_allocs_ever);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar, "\n");
 	return sofar;
 }
 
+/* The rate is allocs per second since the last time someone read kmemstat.
+ * Hold arenas_and_slabs_lock. */
 static size_t fetch_slab_line(struct kmem_cache *kc, struct sized_alloc *sza,
                               size_t sofar, int indent)
 {
-	struct kmem_pcpu_cache *pcc;
 	struct kmem_slab *s_i;
+	struct kmem_cache_stats st;
 	size_t nr_unalloc_objs = 0;
-	size_t nr_allocs_ever = 0;
+	uint64_t now, usec, rate = 0;
 
 	spin_lock_irqsave(&kc->cache_lock);
 	TAILQ_FOREACH(s_i, &kc->empty_slab_list, link)
 		nr_unalloc_objs += s_i->num_total_obj;
 	TAILQ_FOREACH(s_i, &kc->partial_slab_list, link)
 		nr_unalloc_objs += s_i->num_total_obj - s_i->num_busy_obj;
-	nr_allocs_ever = kc->nr_direct_allocs_ever;
 	spin_unlock_irqsave(&kc->cache_lock);
-	/* Lockless peak at the pcpu state */
-	for (int i = 0; i < kmc_nr_pcpu_caches(); i++) {
-		pcc = &kc->pcpu_caches[i];
-		nr_allocs_ever += pcc->nr_allocs_ever;
-	}
+	kmem_cache_get_stats(kc, &st);
+	now = read_tsc();
+	usec = tsc2usec(now - kc->stat_tsc);
+	if (usec && st.nr_allocs >= kc->stat_nr_allocs)
+		rate = (st.nr_allocs - kc->stat_nr_allocs) * 1000000 / usec;
+	kc->stat_tsc = now;
+	kc->stat_nr_allocs = st.nr_allocs;
 
 	for (int i = 0; i < indent; i++)
 		sofar += snprintf(sza->buf + sofar, sza->size - sofar, "    ");
@@ -320,7 +357,12 @@ static size_t fetch_slab_line(struct kmem_cache *kc, struct sized_alloc *sza,
 					  KMEMSTAT_TOTAL, kc->obj_size * (nr_unalloc_objs +
 					                                  kc->nr_cur_alloc),
 					  KMEMSTAT_ALLOCED, kc->obj_size * kc->nr_cur_alloc,
-					  KMEMSTAT_NR_ALLOCS, nr_allocs_ever);
+					  KMEMSTAT_NR_ALLOCS, st.nr_allocs);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  kmemstat_slab_fmt,
+	                  KMEMSTAT_RATE, rate,
+	                  KMEMSTAT_HIT_PCT, kmem_stats_hit_pct(&st),
+	                  KMEMSTAT_CONTENDED, st.nr_contended);
 	return sofar;
 }
 
@@ -344,13 +386,13 @@ static struct sized_alloc *build_kmemstat(void)
 	struct kmem_cache *kc_i;
 	struct sized_alloc *sza;
 	size_t sofar = 0;
-	size_t alloc_amt = 100;
+	size_t alloc_amt = 200;
 
 	qlock(&arenas_and_slabs_lock);
 	TAILQ_FOREACH(a_i, &all_arenas, next)
-		alloc_amt += 100;
+		alloc_amt += 150;
 	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link)
-		alloc_amt += 100;
+		alloc_amt += 150;
 	sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
 	                  kmemstat_hdr_fmt,
@@ -358,7 +400,10 @@ static struct sized_alloc *build_kmemstat(void)
 					  KMEMSTAT_OBJSIZE, "Objsize",
 					  KMEMSTAT_TOTAL, "Total Amt",
 					  KMEMSTAT_ALLOCED, "Alloc Amt",
-					  KMEMSTAT_NR_ALLOCS, "Allocs Ever");
+					  KMEMSTAT_NR_ALLOCS, "Allocs Ever",
+					  KMEMSTAT_RATE, "Allocs/s",
+					  KMEMSTAT_HIT_PCT, "Hit%",
+					  KMEMSTAT_CONTENDED, "Contended");
 	for (int i = 0; i < KMEMSTAT_LINE_LN; i++)
 		sofar += snprintf(sza->buf + sofar, sza->size - sofar, "-");
 	sofar += snprintf(sza->buf + sofar, sza->size - sofar, "\n");
@@ -371,6 +416,29 @@ static struct sized_alloc *build_kmemstat(void)
 	return sza;
 }
 
+static struct sized_alloc *build_reclaim(void)
+{
+	struct kmem_reclaim_stats *st = &kmem_reclaim_stats;
+	struct sized_alloc *sza;
+	size_t sofar = 0;
+
+	sza = sized_kzmalloc(500, MEM_WAIT);
+	qlock(&arenas_and_slabs_lock);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Low watermark: %u%% free\n", kmem_reclaim_low_pct);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Passes: %llu, pokes: %llu\n", st->nr_passes,
+	                  st->nr_pokes);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Total reclaimed: %llu\n", st->total_bytes);
+	sofar += snprintf(sza->buf + sofar, sza->size - sofar,
+	                  "Last pass: reclaimed %llu, slabs freed %llu, mags freed %llu, took %llu nsec\n",
+	                  st->last_bytes, st->last_slab_bytes, st->last_nr_mags,
+	                  st->last_nsec);
+	qunlock(&arenas_and_slabs_lock);
+	return sza;
+}
+
 static struct chan *mem_open(struct chan *c, int omode)
 {
 	if (c->qid.type & QTDIR) {
@@ -390,6 +458,14 @@ static struct chan *mem_open(struct chan *c, int omode)
 	case Qkmemstat:
 		c->synth_buf = build_kmemstat();
 		break;
+	case Qalloc_prof:
+		if (openmode(omode) != O_WRITE)
+			c->synth_buf = alloc_prof_build_report();
+		break;
+	case Qreclaim:
+		if (openmode(omode) != O_WRITE)
+			c->synth_buf = build_reclaim();
+		break;
 	}
 	c->mode = openmode(omode);
 	c->flag |= COPEN;
@@ -406,6 +482,8 @@ static void mem_close(struct chan *c)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qalloc_prof:
+	case Qreclaim:
 		kfree(c->synth_buf);
 		break;
 	}
@@ -423,6 +501,8 @@ static size_t mem_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 	case Qslab_stats:
 	case Qfree:
 	case Qkmemstat:
+	case Qalloc_prof:
+	case Qreclaim:
 		sza = c->synth_buf;
 		return readmem(offset, ubuf, n, sza->buf, sza->size);
 	default:
@@ -431,9 +511,51 @@ static size_t mem_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 	return -1;
 }
 
+static const char alloc_prof_usage[] = "rate N|reset";
+
+static void alloc_prof_write(struct cmdbuf *cb)
+{
+	unsigned long rate;
+	char *end;
+
+	if (cb->nf < 1)
+		error(EINVAL, alloc_prof_usage);
+	if (!strcmp(cb->f[0], "rate")) {
+		if (cb->nf < 2)
+			error(EINVAL, alloc_prof_usage);
+		rate = strtoul(cb->f[1], &end, 0);
+		if (*end || (rate > UINT32_MAX))
+			error(EINVAL, "Bad sample rate %s", cb->f[1]);
+		if (alloc_prof_set_rate(rate))
+			error(EAGAIN, "Allocation profiling is not set up yet");
+	} else if (!strcmp(cb->f[0], "reset")) {
+		alloc_prof_reset();
+	} else {
+		error(EINVAL, alloc_prof_usage);
+	}
+}
+
 static size_t mem_write(struct chan *c, void *ubuf, size_t n, off64_t offset)
 {
+	ERRSTACK(1);
+	struct cmdbuf *cb;
+
 	switch (c->qid.path) {
+	case Qalloc_prof:
+		cb = parsecmd(ubuf, n);
+		if (waserror()) {
+			kfree(cb);
+			nexterror();
+		}
+		alloc_prof_write(cb);
+		kfree(cb);
+		poperror();
+		break;
+	case Qreclaim:
+		if ((n < 3) || strncmp(ubuf, "now", 3))
+			error(EINVAL, "Write 'now' to run a reclaim pass");
+		kmem_reclaim();
+		break;
 	default:
 		error(EFAIL, "Unable to write to %s", devname());
 	}
@@ -60,6 +60,11 @@ static char *devname(void)
 #define MAXRPC (IOHDRSZ+8192)
 #define MAXTAG MAX_U16_POOL_SZ
 
+/* Large reads and writes keep up to this many RPCs in flight at once */
+#define MNT_RPC_WINDOW_MAX 16
+static unsigned int mnt_rpc_window = CONFIG_MNT_RPC_WINDOW;
+DEVVARS_ENTRY(mnt_rpc_window, "uw");
+
 static __inline int isxdigit(int c)
 {
 	if ((c >= '0') && (c <= '9'))
@@ -119,6 +124,8 @@ int mntrpcread(struct mnt *, struct mntrpc *);
 void mountio(struct mnt *, struct mntrpc *);
 void mountmux(struct mnt *, struct mntrpc *);
 void mountrpc(struct mnt *, struct mntrpc *);
+static void mountrpc_start(struct mnt *, struct mntrpc *);
+static void mountrpc_finish(struct mnt *, struct mntrpc *);
 int rpcattn(void *);
 struct chan *mntchan(void);
 
@@ -127,7 +134,7 @@ void (*mntstats) (int unused_int, struct chan *, uint64_t, uint32_t);
 static void mntinit(void)
 {
 	mntalloc.id = 1;
-	mntalloc.tags = create_u16_pool(MAXTAG);
+	mntalloc.tags = create_u16_pool_pcpu(MAXTAG);
 	(void) get_u16(mntalloc.tags);	/* don't allow 0 as a tag */
 	//fmtinstall('F', fcallfmt);
 /*	fmtinstall('D', dirfmt); */
@@ -712,6 +719,104 @@ static size_t mntwrite(struct chan *c, void *buf, size_t n, off64_t off)
 	return mntrdwr(Twrite, c, buf, n, off);
 }
 
+static struct mntrpc *mntrdwr_start(int type, struct chan *c, struct mnt *m,
+                                    char *uba, uint32_t nr, off64_t off)
+{
+	ERRSTACK(1);
+	struct mntrpc *r = mntralloc(c, m->msize);
+
+	if (waserror()) {
+		mntfree(r);
+		nexterror();
+	}
+	r->request.type = type;
+	r->request.fid = c->fid;
+	r->request.offset = off;
+	r->request.data = uba;
+	r->request.count = nr;
+	mountrpc_start(m, r);
+	poperror();
+	return r;
+}
+
+/* Waits for an RPC from mntrdwr_start(), throwing on error.  Returns how much
+ * the server read or wrote.  For reads, the data lands at request.data. */
+static uint32_t mntrdwr_finish(struct mnt *m, struct mntrpc *r)
+{
+	uint32_t nr, nreq;
+
+	mountrpc_finish(m, r);
+	nreq = r->request.count;
+	nr = r->reply.count;
+	if (nr > nreq)
+		nr = nreq;
+	if (r->request.type == Tread)
+		r->b = bl2mem((uint8_t *) r->request.data, r->b, nr);
+	return nr;
+}
+
+/* Splits a big read or write into a window of msize RPCs that are in flight at
+ * the same time.  We retire them in order, so a short read or write stops us at
+ * the same place the serial loop would: anything we issued past that point is
+ * waited on and dropped.  For writes, the server might have applied some of
+ * those, but we only report the contiguous part.
+ *
+ * On an error, we wait for everything else still in flight before rethrowing,
+ * since the RPCs own their tags and buffers until the server answers. */
+static size_t mntrdwr_pipelined(int type, struct chan *c, struct mnt *m,
+                                char *uba, size_t n, off64_t off)
+{
+	ERRSTACK(2);
+	struct mntrpc *win[MNT_RPC_WINDOW_MAX];
+	unsigned int window = MIN(mnt_rpc_window, MNT_RPC_WINDOW_MAX);
+	uint32_t chunk = m->msize - IOHDRSZ;
+	volatile unsigned int head = 0, tail = 0;
+	volatile size_t issued = 0;
+	volatile bool finishing = FALSE;
+	size_t cnt = 0;
+	uint32_t nr, nreq;
+	bool stop = FALSE;
+
+	if (waserror()) {
+		/* If win[head] threw, mountio already pulled it off the queue */
+		if (finishing) {
+			mntfree(win[head % window]);
+			head++;
+		}
+		for (; head != tail; head++) {
+			if (!waserror())
+				mountrpc_finish(m, win[head % window]);
+			poperror();
+			mntfree(win[head % window]);
+		}
+		nexterror();
+	}
+	while (!stop || head != tail) {
+		while (!stop && tail - head < window && issued < n) {
+			nreq = MIN(chunk, n - issued);
+			win[tail % window] = mntrdwr_start(type, c, m, uba + issued, nreq,
+			                                   off + issued);
+			issued += nreq;
+			tail++;
+		}
+		if (head == tail)
+			break;
+		nreq = win[head % window]->request.count;
+		finishing = TRUE;
+		nr = mntrdwr_finish(m, win[head % window]);
+		finishing = FALSE;
+		mntfree(win[head % window]);
+		head++;
+		if (!stop) {
+			cnt += nr;
+			if (nr != nreq)
+				stop = TRUE;
+		}
+	}
+	poperror();
+	return cnt;
+}
+
 size_t mntrdwr(int type, struct chan *c, void *buf, size_t n, off64_t off)
 {
 	ERRSTACK(1);
@@ -721,6 +826,8 @@ size_t mntrdwr(int type, struct chan *c, void *buf, size_t n, off64_t off)
 	uint32_t cnt, nr, nreq;
 
 	m = mntchk(c);
+	if (mnt_rpc_window > 1 && n > m->msize - IOHDRSZ)
+		return mntrdwr_pipelined(type, c, m, buf, n, off);
 	uba = buf;
 	cnt = 0;
 	for (;;) {
@@ -758,17 +865,12 @@ size_t mntrdwr(int type, struct chan *c, void *buf, size_t n, off64_t off)
 	return cnt;
 }
 
-void mountrpc(struct mnt *m, struct mntrpc *r)
+static void mountrpc_reply(struct mnt *m, struct mntrpc *r)
 {
 	char *sn, *cn;
 	int t;
 	char *e;
 
-	r->reply.tag = 0;
-	r->reply.type = Tmax;	/* can't ever be a valid message type */
-
-	mountio(m, r);
-
 	t = r->reply.type;
 	switch (t) {
 		case Rerror:
@@ -806,32 +908,19 @@ void mountrpc(struct mnt *m, struct mntrpc *r)
 	}
 }
 
-void mountio(struct mnt *m, struct mntrpc *r)
+void mountrpc(struct mnt *m, struct mntrpc *r)
 {
-	ERRSTACK(1);
-	int n;
+	r->reply.tag = 0;
+	r->reply.type = Tmax;	/* can't ever be a valid message type */
 
-	while (waserror()) {
-		if (m->rip == current)
-			mntgate(m);
-		/* Syscall aborts are like Plan 9 Eintr.  For those, we need to change
-		 * the old request to a flsh (mntflushalloc) and try again.  We'll
-		 * always try to flush, and you can't get out until the flush either
-		 * succeeds or errors out with a non-abort/Eintr error.
-		 *
-		 * This all means that regular aborts cannot break us out of here!  We
-		 * can consider that policy in the future, if we need to.  Regardless,
-		 * if the process is dying, we really do need to abort. */
-		if ((get_errno() != EINTR) || proc_is_dying(current)) {
-			/* all other errors or dying, bail out! */
-			mntflushfree(m, r);
-			nexterror();
-		}
-		/* try again.  this is where you can get the "rpc tags" errstr. */
-		r = mntflushalloc(r, m->msize);
-		/* need one for every waserror call (so this plus one outside) */
-		poperror();
-	}
+	mountio(m, r);
+	mountrpc_reply(m, r);
+}
+
+/* Puts r on the mount's queue and transmits it */
+static void mountio_send(struct mnt *m, struct mntrpc *r)
+{
+	int n;
 
 	spin_lock(&m->lock);
 	r->m = m;
@@ -849,7 +938,11 @@ void mountio(struct mnt *m, struct mntrpc *r)
 		error(EIO, ERROR_FIXME);
 /*	r->stime = fastticks(NULL); */
 	r->reqlen = n;
+}
 
+/* Waits for r's reply.  Whoever holds the gate reads replies for everyone. */
+static void mountio_recv(struct mnt *m, struct mntrpc *r)
+{
 	/* Gate readers onto the mount point one at a time */
 	for (;;) {
 		spin_lock(&m->lock);
@@ -857,11 +950,8 @@ void mountio(struct mnt *m, struct mntrpc *r)
 			break;
 		spin_unlock(&m->lock);
 		rendez_sleep(&r->r, rpcattn, r);
-		if (r->done) {
-			poperror();
-			mntflushfree(m, r);
+		if (r->done)
 			return;
-		}
 	}
 	m->rip = current;
 	spin_unlock(&m->lock);
@@ -871,10 +961,70 @@ void mountio(struct mnt *m, struct mntrpc *r)
 		mountmux(m, r);
 	}
 	mntgate(m);
+}
+
+/* If 'sent', r is already on the wire and we just wait for it.  Either way, an
+ * abort turns into a flush of r. */
+static void __mountio(struct mnt *m, struct mntrpc *r, bool sent)
+{
+	ERRSTACK(1);
+
+	while (waserror()) {
+		if (m->rip == current)
+			mntgate(m);
+		/* Syscall aborts are like Plan 9 Eintr.  For those, we need to change
+		 * the old request to a flsh (mntflushalloc) and try again.  We'll
+		 * always try to flush, and you can't get out until the flush either
+		 * succeeds or errors out with a non-abort/Eintr error.
+		 *
+		 * This all means that regular aborts cannot break us out of here!  We
+		 * can consider that policy in the future, if we need to.  Regardless,
+		 * if the process is dying, we really do need to abort. */
+		if ((get_errno() != EINTR) || proc_is_dying(current)) {
+			/* all other errors or dying, bail out! */
+			mntflushfree(m, r);
+			nexterror();
+		}
+		/* try again.  this is where you can get the "rpc tags" errstr. */
+		r = mntflushalloc(r, m->msize);
+		sent = FALSE;
+		/* need one for every waserror call (so this plus one outside) */
+		poperror();
+	}
+	if (!sent)
+		mountio_send(m, r);
+	mountio_recv(m, r);
 	poperror();
 	mntflushfree(m, r);
 }
 
+void mountio(struct mnt *m, struct mntrpc *r)
+{
+	__mountio(m, r, FALSE);
+}
+
+/* Sends r without waiting for the reply, so the caller can have several in
+ * flight.  Every started RPC must be finished with mountrpc_finish(). */
+static void mountrpc_start(struct mnt *m, struct mntrpc *r)
+{
+	ERRSTACK(1);
+
+	r->reply.tag = 0;
+	r->reply.type = Tmax;	/* can't ever be a valid message type */
+	if (waserror()) {
+		mntqrm(m, r);
+		nexterror();
+	}
+	mountio_send(m, r);
+	poperror();
+}
+
+static void mountrpc_finish(struct mnt *m, struct mntrpc *r)
+{
+	__mountio(m, r, TRUE);
+	mountrpc_reply(m, r);
+}
+
 static int doread(struct mnt *m, int len)
 {
 	struct block *b;
@@ -36,6 +36,8 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <mm.h>
+#include <umem.h>
 #include <net/ip.h>
 
 struct dev pipedevtab;
@@ -57,8 +59,15 @@ struct Pipe {
 	char *user;
 	struct fdtap_slist data_taps;
 	spinlock_t tap_lock;
+	bool oneblock;
 };
 
+/* Blocking writes of at least this much page-aligned user memory share the
+ * writer's pages with the pipe instead of copying them.  Each block gets up to
+ * PIPE_FLIP_BLK_PGS. */
+#define PIPE_FLIP_MIN_PGS	16
+#define PIPE_FLIP_BLK_PGS	16
+
 static struct {
 	spinlock_t lock;
 	uint32_t path;
@@ -127,10 +136,10 @@ static struct chan *pipeattach(char *spec)
 	kref_init(&p->ref, pipe_release, 1);
 	qlock_init(&p->qlock);
 
-	p->q[0] = qopen(pipealloc.pipeqsize, Qcoalesce, 0, 0);
+	p->q[0] = qopen(pipealloc.pipeqsize, Qcoalesce | Qspsc, 0, 0);
 	if (p->q[0] == 0)
 		error(ENOMEM, ERROR_FIXME);
-	p->q[1] = qopen(pipealloc.pipeqsize, Qcoalesce, 0, 0);
+	p->q[1] = qopen(pipealloc.pipeqsize, Qcoalesce | Qspsc, 0, 0);
 	if (p->q[1] == 0)
 		error(ENOMEM, ERROR_FIXME);
 	poperror();
@@ -391,6 +400,98 @@ static struct block *pipebread(struct chan *c, size_t n, off64_t offset)
 	return devbread(c, n, offset);
 }
 
+static size_t pipereadv(struct chan *c, struct iovec *iov, int iovcnt,
+                        off64_t offset)
+{
+	Pipe *p = c->aux;
+	struct queue *q;
+
+	switch (NETTYPE(c->qid.path)) {
+		case Qdata0:
+			q = p->q[0];
+			break;
+		case Qdata1:
+			q = p->q[1];
+			break;
+		default:
+			error(EINVAL, "can only readv the pipe's data files");
+	}
+	if (c->flag & O_NONBLOCK)
+		return qreadv_nonblock(q, iov, iovcnt);
+	return qreadv(q, iov, iovcnt);
+}
+
+/* Queues blocks that point at the pages of a big write, which are shared CoW
+ * with the writer (see uva_share_pages_cow()).  The reader does the only copy,
+ * and the writer only pays for another one if it writes to a page before the
+ * reader gets to it.
+ *
+ * Returns how much we wrote.  That can be less than n, e.g. if we hit memory we
+ * can't share, and the caller copies the rest the usual way. */
+static size_t pipe_write_flip(struct queue *q, uintptr_t va, size_t n)
+{
+	ERRSTACK(1);
+	struct page *pages[PIPE_FLIP_BLK_PGS];
+	size_t nr_pgs, nr_shared;
+	volatile size_t done = 0;
+	struct block *b;
+
+	if (waserror()) {
+		if (!done)
+			nexterror();
+		poperror();
+		return done;
+	}
+	while (n - done >= PGSIZE) {
+		nr_pgs = MIN((n - done) >> PGSHIFT, PIPE_FLIP_BLK_PGS);
+		b = block_alloc(0, MEM_WAIT);
+		nr_shared = uva_share_pages_cow(current, va + done, nr_pgs, pages);
+		for (int i = 0; i < nr_shared; i++) {
+			if (block_append_extra(b, (uintptr_t)page2kva(pages[i]), 0,
+			                       PGSIZE, MEM_WAIT)) {
+				for (int j = i; j < nr_shared; j++)
+					page_decref(pages[j]);
+				break;
+			}
+		}
+		if (!BLEN(b)) {
+			freeb(b);
+			break;
+		}
+		/* qbwrite frees the block if it throws */
+		done += qbwrite(q, b);
+		if (nr_shared < nr_pgs)
+			break;
+	}
+	poperror();
+	return done;
+}
+
+static size_t pipe_qwrite(Pipe *p, struct queue *q, struct chan *c, void *va,
+                          size_t n)
+{
+	ERRSTACK(1);
+	volatile size_t done = 0;
+
+	if (c->flag & O_NONBLOCK)
+		return qwrite_nonblock(q, va, n);
+	if (!p->oneblock && !PGOFF(va) && (n >= PIPE_FLIP_MIN_PGS * PGSIZE) &&
+	    current && is_user_raddr(va, n))
+		done = pipe_write_flip(q, (uintptr_t)va, n);
+	if (!done)
+		return qwrite(q, va, n);
+	if (done == n)
+		return n;
+	/* The reader might already have the flipped part; report it. */
+	if (waserror()) {
+		poperror();
+		return done;
+	}
+	done += qwrite(q, va + done, n - done);
+	poperror();
+	return done;
+}
+
 /*
  *  A write to a closed pipe causes an EPIPE error to be thrown.
  */
@@ -412,6 +513,7 @@ static size_t pipewrite(struct chan *c, void *va, size_t n, off64_t ignored)
 			if (cb->nf < 1)
 				error(EFAIL, "short control request");
 			if (strcmp(cb->f[0], "oneblock") == 0) {
+				p->oneblock = TRUE;
 				q_toggle_qmsg(p->q[0], TRUE);
 				q_toggle_qcoalesce(p->q[0], TRUE);
 				q_toggle_qmsg(p->q[1], TRUE);
@@ -424,17 +526,11 @@ static size_t pipewrite(struct chan *c, void *va, size_t n, off64_t ignored)
 			break;
 
 		case Qdata0:
-			if (c->flag & O_NONBLOCK)
-				n = qwrite_nonblock(p->q[1], va, n);
-			else
-				n = qwrite(p->q[1], va, n);
+			n = pipe_qwrite(p, p->q[1], c, va, n);
 			break;
 
 		case Qdata1:
-			if (c->flag & O_NONBLOCK)
-				n = qwrite_nonblock(p->q[0], va, n);
-			else
-				n = qwrite(p->q[0], va, n);
+			n = pipe_qwrite(p, p->q[0], c, va, n);
 			break;
 
 		default:
@@ -444,6 +540,27 @@ static size_t pipewrite(struct chan *c, void *va, size_t n, off64_t ignored)
 	return n;
 }
 
+static size_t pipewritev(struct chan *c, struct iovec *iov, int iovcnt,
+                         off64_t ignored)
+{
+	Pipe *p = c->aux;
+	struct queue *q;
+
+	switch (NETTYPE(c->qid.path)) {
+		case Qdata0:
+			q = p->q[1];
+			break;
+		case Qdata1:
+			q = p->q[0];
+			break;
+		default:
+			error(EINVAL, "can only writev the pipe's data files");
+	}
+	if (c->flag & O_NONBLOCK)
+		return qwritev_nonblock(q, iov, iovcnt);
+	return qwritev(q, iov, iovcnt);
+}
+
 static size_t pipebwrite(struct chan *c, struct block *bp, off64_t offset)
 {
 	long n;
@@ -673,6 +790,8 @@ struct dev pipedevtab __devtab = {
 	.bread = pipebread,
 	.write = pipewrite,
 	.bwrite = pipebwrite,
+	.readv = pipereadv,
+	.writev = pipewritev,
 	.remove = devremove,
 	.wstat = pipewstat,
 	.power = devpower,
@@ -61,12 +61,17 @@ enum {
 	Qstatus,
 	Qstrace,
 	Qstrace_traceset,
+	Qstrace_bin,
 	Qvmstatus,
+	Qvmexits,
+	Qvcorestats,
+	Qmmstat,
 	Qtext,
 	Qwait,
 	Qprofile,
 	Qsyscall,
 	Qcore,
+	Qsnapshot,
 };
 
 enum {
@@ -76,6 +81,10 @@ enum {
 	CMstraceme,
 	CMstraceall,
 	CMstrace_drop,
+	CMjumbo,
+	CMcoreshare,
+	CMfaultaround,
+	CMmempolicy,
 };
 
 enum {
@@ -109,7 +118,11 @@ struct dirtab procdir[] = {
 	{"status", {Qstatus}, STATSIZE, 0444},
 	{"strace", {Qstrace}, 0, 0444},
 	{"strace_traceset", {Qstrace_traceset}, 0, 0666},
+	{"strace_bin", {Qstrace_bin}, 0, 0444},
 	{"vmstatus", {Qvmstatus}, 0, 0444},
+	{"vmexits", {Qvmexits}, 0, 0444},
+	{"vcorestats", {Qvcorestats}, 0, 0444},
+	{"mmstat", {Qmmstat}, 0, 0444},
 	{"text", {Qtext}, 0, 0000},
 	{"wait", {Qwait}, 0, 0400},
 	{"profile", {Qprofile}, 0, 0400},
@@ -125,17 +138,21 @@ struct cmdtab proccmd[] = {
 	{CMstraceme, "straceme", 0},
 	{CMstraceall, "straceall", 0},
 	{CMstrace_drop, "strace_drop", 2},
+	{CMjumbo, "jumbo", 2},
+	{CMcoreshare, "coreshare", 4},
+	{CMfaultaround, "faultaround", 2},
+	{CMmempolicy, "mempolicy", 0},
 };
 
 /*
  * struct qids are, in path:
- *	 5 bits of file type (qids above) (old comment said 4 here)
+ *	 6 bits of file type (qids above) (old comment said 4 here)
  *	23 bits of process slot number + 1 (pid + 1 is stored)
  *	     in vers,
  *	32 bits of pid, for consistency checking
  * If notepg, c->pgrpid.path is pgrp slot, .vers is noteid.
  */
-#define	QSHIFT	5	/* location in qid of proc slot # */
+#define	QSHIFT	6	/* location in qid of proc slot # */
 #define	SLOTBITS 23	/* number of bits in the slot */
 #define	QIDMASK	((1<<QSHIFT)-1)
 #define	SLOTMASK	(((1<<SLOTBITS)-1) << QSHIFT)
@@ -207,13 +224,19 @@ procgen(struct chan *c, char *name, struct dirtab *tab, int unused, int s,
 			return 1;
 		}
 		if (s == 2) {
+			strlcpy(get_cur_genbuf(), "snapshot", GENBUF_SZ);
+			mkqid(&qid, Qsnapshot, -1, QTFILE);
+			devdir(c, qid, get_cur_genbuf(), 0, eve.name, 0444, dp);
+			return 1;
+		}
+		if (s == 3) {
 			p = current;
 			strlcpy(get_cur_genbuf(), "self", GENBUF_SZ);
 			mkqid(&qid, (p->pid + 1) << QSHIFT, p->pid, QTDIR);
 			devdir(c, qid, get_cur_genbuf(), 0, p->user.name, DMDIR | 0555, dp);
 			return 1;
 		}
-		s -= 3;
+		s -= 4;
 		if (name != NULL) {
 			/* ignore s and use name to find pid */
 			pid = strtol(name, &ename, 10);
@@ -261,6 +284,12 @@ procgen(struct chan *c, char *name, struct dirtab *tab, int unused, int s,
 		devdir(c, qid, get_cur_genbuf(), 0, eve.name, 0444, dp);
 		return 1;
 	}
+	if (c->qid.path == Qsnapshot) {
+		strlcpy(get_cur_genbuf(), "snapshot", GENBUF_SZ);
+		mkqid(&qid, Qsnapshot, -1, QTFILE);
+		devdir(c, qid, get_cur_genbuf(), 0, eve.name, 0444, dp);
+		return 1;
+	}
 	if (s >= ARRAY_SIZE(procdir))
 		return -1;
 	if (tab)
@@ -454,6 +483,22 @@ static struct sized_alloc *build_maps(struct proc *p)
 	return sza;
 }
 
+/* Snapshots every process at open time, so that all of the reads see the same
+ * processes. */
+static struct sized_alloc *build_snapshot(void)
+{
+	struct sized_alloc *sza;
+	size_t max, nr;
+
+	/* Room for a few procs that show up while we allocate.  Any beyond that
+	 * just miss this snapshot. */
+	max = rhashtable_count(&pid_hash) + 16;
+	sza = sized_kzmalloc(max * sizeof(struct proc_snapshot), MEM_WAIT);
+	nr = proc_get_snapshots(sza->buf, max);
+	sza->size = nr * sizeof(struct proc_snapshot);
+	return sza;
+}
+
 static struct chan *procopen(struct chan *c, int omode)
 {
 	ERRSTACK(2);
@@ -515,6 +560,15 @@ static struct chan *procopen(struct chan *c, int omode)
 		return c;
 #endif
 	}
+	if (QID(c->qid) == Qsnapshot) {
+		if (omode != O_READ)
+			error(EPERM, "snapshot is read-only");
+		c->aux = build_snapshot();
+		c->mode = openmode(omode);
+		c->flag |= COPEN;
+		c->offset = 0;
+		return c;
+	}
 	if ((p = pid2proc(SLOT(c->qid))) == NULL)
 		error(ESRCH, ERROR_FIXME);
 	//qlock(&p->debug);
@@ -581,6 +635,9 @@ static struct chan *procopen(struct chan *c, int omode)
 		case Quser:
 		case Qstatus:
 		case Qvmstatus:
+		case Qvmexits:
+		case Qvcorestats:
+		case Qmmstat:
 		case Qctl:
 			break;
 
@@ -610,6 +667,13 @@ static struct chan *procopen(struct chan *c, int omode)
 			kref_get(&p->strace->users, 1);
 			c->aux = p->strace;
 			break;
+		case Qstrace_bin:
+			if (!p->strace)
+				error(ENOENT, "Process does not have tracing enabled");
+			strace_bin_open(p->strace);
+			kref_get(&p->strace->users, 1);
+			c->aux = p->strace;
+			break;
 		case Qmaps:
 			c->aux = build_maps(p);
 			break;
@@ -816,6 +880,8 @@ static void procclose(struct chan *c)
 		kfree(c->aux);
 	if (QID(c->qid) == Qmaps && c->aux != 0)
 		kfree(c->aux);
+	if (QID(c->qid) == Qsnapshot && c->aux != 0)
+		kfree(c->aux);
 	if (QID(c->qid) == Qstrace && c->aux != 0) {
 		struct strace *s = c->aux;
 
@@ -832,6 +898,14 @@ static void procclose(struct chan *c)
 		kref_put(&s->users);
 		c->aux = NULL;
 	}
+	if (QID(c->qid) == Qstrace_bin && c->aux != 0) {
+		struct strace *s = c->aux;
+
+		assert(c->flag & COPEN);
+		strace_bin_close(s);
+		kref_put(&s->users);
+		c->aux = NULL;
+	}
 }
 
 void int2flag(int flag, char *s)
@@ -936,6 +1010,11 @@ static size_t procread(struct chan *c, void *va, size_t n, off64_t off)
 		s = c->aux;
 		return readmem(offset, va, n, s->trace_set,
 		               bitmap_size(MAX_SYSCALL_NR));
+	case Qstrace_bin:
+		return strace_bin_read(c->aux, va, n);
+	case Qsnapshot:
+		sza = c->aux;
+		return readmem(offset, va, n, sza->buf, sza->size);
 	}
 
 	if ((p = pid2proc(SLOT(c->qid))) == NULL)
@@ -977,19 +1056,82 @@ static size_t procread(struct chan *c, void *va, size_t n, off64_t off)
 				return i;
 			}
 
+		case Qmmstat:
+			{
+				static const char *policies[] = {
+					[MM_JUMBO_MADVISE] = "madvise",
+					[MM_JUMBO_NEVER] = "never",
+					[MM_JUMBO_ALWAYS] = "always",
+				};
+				static const char *mpols[] = {
+					[MPOL_DEFAULT] = "default",
+					[MPOL_BIND] = "bind",
+					[MPOL_INTERLEAVE] = "interleave",
+				};
+				char buf[512];
+
+				snprintf(buf, sizeof(buf),
+				         "jumbo policy: %s\n"
+				         "mem policy: %s 0x%lx\n"
+				         "fault-around: %u pages\n"
+				         "anon 4K pages mapped: %lu\n"
+				         "anon 2M pages mapped: %lu\n"
+				         "2M demotions: %lu\n"
+				         "fault-around maps: %lu\n"
+				         "CoW breaks: %lu\n"
+				         "CoW reuses: %lu\n"
+				         "munmaps: %lu\n"
+				         "TLB shootdowns: %lu\n"
+				         "TLB shootdown IPIs: %lu (%lu.%02lu per munmap)\n",
+				         policies[p->jumbo_policy], mpols[p->mpol.mode],
+				         p->mpol.nodes, p->fault_around,
+				         p->nr_anon_pgs, p->nr_anon_jumbos,
+				         p->nr_jumbo_demotions, p->nr_fault_around_maps,
+				         p->nr_cow_breaks, p->nr_cow_reuses,
+				         p->nr_munmaps, p->nr_tlb_shootdowns, p->nr_tlb_ipis,
+				         p->nr_tlb_ipis / MAX(p->nr_munmaps, 1),
+				         p->nr_tlb_ipis * 100 / MAX(p->nr_munmaps, 1) % 100);
+				proc_decref(p);
+				return readstr(off, va, n, buf);
+			}
+
+		case Qvcorestats:
+			{
+				/* Binary, one struct vcore_stats per vcore, so a tool can
+				 * grab them all in one read. */
+				size_t nr_vc = p->procinfo->max_vcores;
+				size_t sz = sizeof(struct vcore_stats) * nr_vc;
+				struct vcore_stats *vs = kmalloc(sz, MEM_WAIT);
+
+				for (int i = 0; i < nr_vc; i++)
+					vcore_get_stats(p, i, &vs[i]);
+				proc_decref(p);
+				n = readmem(off, va, n, vs, sz);
+				kfree(vs);
+				return n;
+			}
+
 		case Qvmstatus:
 			{
-				size_t buflen = 50 * 65 + 2;
+				size_t buflen = 50 * VMM_VMEXIT_NR_TYPES + 2;
 				char *buf = kmalloc(buflen, MEM_WAIT);
+				struct guest_pcore *gpc;
+				uint64_t nr_exits;
 				int i, offset;
 				offset = 0;
 				offset += snprintf(buf + offset, buflen - offset, "{\n");
-				for (i = 0; i < 65; i++) {
-					if (p->vmm.vmexits[i] != 0) {
+				for (i = 0; i < VMM_VMEXIT_NR_TYPES; i++) {
+					nr_exits = 0;
+					for (int j = 0; j < p->vmm.nr_guest_pcores; j++) {
+						gpc = lookup_guest_pcore(p, j);
+						if (gpc)
+							nr_exits += gpc->exit_stats.nr_exits[i];
+					}
+					if (nr_exits != 0) {
 						offset += snprintf(buf + offset, buflen - offset,
 						                   "\"%s\":\"%lld\",\n",
 						                   VMX_EXIT_REASON_NAMES[i],
-						                   p->vmm.vmexits[i]);
+						                   nr_exits);
 					}
 				}
 				offset += snprintf(buf + offset, buflen - offset, "}\n");
@@ -998,6 +1140,20 @@ static size_t procread(struct chan *c, void *va, size_t n, off64_t off)
 				kfree(buf);
 				return n;
 			}
+		case Qvmexits:
+			{
+				/* Header plus every reason, at ~90 chars a line */
+				size_t buflen = (p->vmm.nr_guest_pcores *
+				                 (VMM_VMEXIT_NR_TYPES + 2) + 1) * 96;
+				char *buf = kmalloc(buflen, MEM_WAIT);
+
+				buf[0] = 0;
+				vmm_exit_stats_print(p, buf, buflen);
+				proc_decref(p);
+				n = readstr(off, va, n, buf);
+				kfree(buf);
+				return n;
+			}
 		case Qns:
 			//qlock(&p->debug);
 			if (waserror()) {
@@ -1056,7 +1212,7 @@ static void mntscan(struct mntwalk *mw, struct proc *p)
 	int best, i, last, nxt;
 
 	pg = p->pgrp;
-	rlock(&pg->ns);
+	br_rlock(&pg->ns);
 
 	nxt = 0;
 	best = (int)(~0U >> 1);	/* largest 2's complement int */
@@ -1080,7 +1236,7 @@ static void mntscan(struct mntwalk *mw, struct proc *p)
 	if (nxt == 0)
 		mw->mh = 0;
 
-	runlock(&pg->ns);
+	br_runlock(&pg->ns);
 }
 
 static size_t procwrite(struct chan *c, void *va, size_t n, off64_t off)
@@ -1301,6 +1457,7 @@ static void strace_shutdown(struct kref *a)
 		         atomic_read(&strace->nr_drops));
 	qhangup(strace->q, msg);
 	kfree(msg);
+	strace_bin_hangup(strace);
 }
 
 static void strace_release(struct kref *a)
@@ -1308,6 +1465,7 @@ static void strace_release(struct kref *a)
 	struct strace *strace = container_of(a, struct strace, users);
 
 	qfree(strace->q);
+	strace_bin_free(strace);
 	kfree(strace);
 }
 
@@ -1316,6 +1474,9 @@ static void procctlreq(struct proc *p, char *va, int n)
 	ERRSTACK(1);
 	int8_t irq_state = 0;
 	int npc, pri, core;
+	int class;
+	long min_cores, weight, nr_pgs;
+	int mode;
 	struct cmdbuf *cb;
 	struct cmdtab *ct;
 	int64_t time;
@@ -1338,6 +1499,8 @@ static void procctlreq(struct proc *p, char *va, int n)
 		if (!p->strace) {
 			strace = kzmalloc(sizeof(*p->strace), MEM_WAIT);
 			spinlock_init(&strace->lock);
+			qlock_init(&strace->bin_qlock);
+			rendez_init(&strace->bin_rv);
 			bitmap_set(strace->trace_set, 0, MAX_SYSCALL_NR);
 			strace->q = qopen(65536, Qmsg, NULL, NULL);
 			/* The queue is reopened and hungup whenever we open the Qstrace
@@ -1393,6 +1556,55 @@ static void procctlreq(struct proc *p, char *va, int n)
 		else
 			error(EINVAL, "strace_drop takes on|off %s", cb->f[1]);
 		break;
+	case CMjumbo:
+		/* Only affects future faults and mmaps; existing jumbos stay */
+		if (!strcmp(cb->f[1], "madvise"))
+			p->jumbo_policy = MM_JUMBO_MADVISE;
+		else if (!strcmp(cb->f[1], "never"))
+			p->jumbo_policy = MM_JUMBO_NEVER;
+		else if (!strcmp(cb->f[1], "always"))
+			p->jumbo_policy = MM_JUMBO_ALWAYS;
+		else
+			error(EINVAL, "jumbo takes madvise|never|always %s", cb->f[1]);
+		break;
+	case CMcoreshare:
+		/* coreshare lc|batch MIN_CORES WEIGHT */
+		if (!strcmp(cb->f[1], "lc"))
+			class = KSCHED_CLASS_LC;
+		else if (!strcmp(cb->f[1], "batch"))
+			class = KSCHED_CLASS_BATCH;
+		else
+			error(EINVAL, "coreshare takes lc|batch, got %s", cb->f[1]);
+		min_cores = strtol(cb->f[2], 0, 0);
+		weight = strtol(cb->f[3], 0, 0);
+		if (min_cores < 0 || weight <= 0)
+			error(EINVAL, "coreshare needs min >= 0 and weight > 0");
+		if (sched_set_coreshare(p, class, min_cores, weight))
+			error(EBUSY, "can't guarantee %ld cores", min_cores);
+		break;
+	case CMfaultaround:
+		/* faultaround NR_PAGES, 0 turns it off */
+		nr_pgs = strtol(cb->f[1], 0, 0);
+		if (nr_pgs < 0 || nr_pgs > MM_FAULT_AROUND_MAX)
+			error(EINVAL, "faultaround takes 0-%d pages, got %s",
+			      MM_FAULT_AROUND_MAX, cb->f[1]);
+		p->fault_around = nr_pgs;
+		break;
+	case CMmempolicy:
+		/* mempolicy default | bind NODE_MASK | interleave NODE_MASK.  Like
+		 * mbind(), this is for future allocations. */
+		if (cb->nf == 2 && !strcmp(cb->f[1], "default"))
+			mode = MPOL_DEFAULT;
+		else if (cb->nf == 3 && !strcmp(cb->f[1], "bind"))
+			mode = MPOL_BIND;
+		else if (cb->nf == 3 && !strcmp(cb->f[1], "interleave"))
+			mode = MPOL_INTERLEAVE;
+		else
+			error(EINVAL, "mempolicy takes default|bind MASK|interleave MASK");
+		if (mpol_set(&p->mpol, mode,
+		             mode ? strtoul(cb->f[2], 0, 0) : 0))
+			error(EINVAL, "bad node mask %s", cb->f[2]);
+		break;
 	}
 	poperror();
 	kfree(cb);
@@ -19,9 +19,25 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <random/fortuna.h>
+#include <percpu.h>
+#include <time.h>
+#include <ros/chacha.h>
 
 static qlock_t rl;
 
+/* urandom is a per-core ChaCha20 generator, so that readers on different cores
+ * don't serialize on rl.  Each core's key is mixed with fresh bytes from
+ * fortuna every URANDOM_RESEED_NSEC, and every read replaces the key (fast key
+ * erasure) before making its output with a key only it knows. */
+#define URANDOM_RESEED_NSEC		(60ULL * 1000000000)
+
+struct urandom_pcpu {
+	uint32_t					key[CHACHA_KEY_WORDS];
+	uint64_t					reseed_at;
+};
+
+static DEFINE_PERCPU(struct urandom_pcpu, urandom_pcpu);
+
 /*
  * Add entropy. This is not currently used but we might want to hook it into a
  * hardware entropy source.
@@ -64,31 +80,55 @@ uint32_t random_read(void *xp, uint32_t n)
 	return n;
 }
 
+/* We might block in random_read(), so the core we mix into might not be the
+ * one that needed it.  That's fine, that core will reseed on its own. */
+static void urandom_reseed(void)
+{
+	uint32_t seed[CHACHA_KEY_WORDS];
+	struct urandom_pcpu *up;
+	int8_t irq_state = 0;
+
+	random_read(seed, sizeof(seed));
+	disable_irqsave(&irq_state);
+	up = PERCPU_VARPTR(urandom_pcpu);
+	for (int i = 0; i < CHACHA_KEY_WORDS; i++)
+		up->key[i] ^= seed[i];
+	up->reseed_at = nsec() + URANDOM_RESEED_NSEC;
+	enable_irqsave(&irq_state);
+	memset(seed, 0, sizeof(seed));
+}
+
 /**
  * Fast random generator
  **/
 uint32_t urandom_read(void *xp, uint32_t n)
 {
-	uint64_t seed[16];
-	uint8_t *e, *p;
-	uint32_t x = 0;
-	uint64_t s0;
-	uint64_t s1;
-
-	if (n <= sizeof(seed))
-		return random_read(xp, n);
-	// The initial seed is from a good random pool.
-	random_read(seed, sizeof(seed));
-	p = xp;
-	for (e = p + n; p < e;) {
-		s0 = seed[x];
-		s1 = seed[x = (x + 1) & 15];
-		s1 ^= s1 << 31;
-		s1 ^= s1 >> 11;
-		s0 ^= s0 >> 30;
-		*p++ = (seed[x] = s0 ^ s1) * 1181783497276652981LL;
+	uint32_t block[CHACHA_BLOCK_WORDS];
+	uint32_t key[CHACHA_KEY_WORDS];
+	struct urandom_pcpu *up;
+	int8_t irq_state = 0;
+	uint8_t *p = xp;
+	size_t amt;
+
+	/* Racy peek, reseed_at starts at 0 */
+	if (nsec() > PERCPU_VAR(urandom_pcpu).reseed_at)
+		urandom_reseed();
+	disable_irqsave(&irq_state);
+	up = PERCPU_VARPTR(urandom_pcpu);
+	chacha20_block(up->key, 0, 0, block);
+	memcpy(up->key, block, sizeof(up->key));
+	memcpy(key, block + CHACHA_KEY_WORDS, sizeof(key));
+	enable_irqsave(&irq_state);
+
+	/* xp could be a user pointer, so we fill it with IRQs enabled. */
+	for (uint64_t ctr = 0; p < (uint8_t*)xp + n; ctr++) {
+		chacha20_block(key, ctr, 0, block);
+		amt = MIN(CHACHA_BLOCK_SIZE, (uint8_t*)xp + n - p);
+		memcpy(p, block, amt);
+		p += amt;
 	}
-
+	memset(block, 0, sizeof(block));
+	memset(key, 0, sizeof(key));
 	return n;
 }
 
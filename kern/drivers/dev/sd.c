@@ -28,12 +28,13 @@
 
 extern struct dev sddevtab;
 struct sdifc sdiahciifc;
+struct sdifc sdnvmeifc;
 
 /* In Plan 9, this array is auto-generated. That's almost certainly not
  * necessary;
  * we can use linker sets at some point, as we do elsewhere in Akaros. */
 struct sdifc *sdifc[] = {
-    &sdiahciifc, NULL,
+    &sdiahciifc, &sdnvmeifc, NULL,
 };
 
 static const char Echange[] = "media or partition has changed";
@@ -159,6 +160,7 @@ void sdaddpart(struct sdunit *unit, char *name, uint64_t start, uint64_t end)
 	kstrdup(&pp->sdperm.user, eve.name);
 	pp->sdperm.perm = 0640;
 	pp->valid = 1;
+	pp->cache = sdcachealloc(unit, name, start, end);
 }
 
 static void sddelpart(struct sdunit *unit, char *name)
@@ -182,6 +184,10 @@ static void sddelpart(struct sdunit *unit, char *name)
 	// if (strcmp(current->user.name, pp->SDperm.user) && !iseve())
 		// error(Eperm);
 
+	if (pp->cache) {
+		sdcachedrop(pp->cache, 1);
+		pp->cache = NULL;
+	}
 	pp->valid = 0;
 	pp->vers++;
 }
@@ -193,6 +199,11 @@ static void sdincvers(struct sdunit *unit)
 	unit->vers++;
 	if (unit->part) {
 		for (i = 0; i < unit->npart; i++) {
+			/* the old media's dirty pages have nowhere to go */
+			if (unit->part[i].cache) {
+				sdcachedrop(unit->part[i].cache, 0);
+				unit->part[i].cache = NULL;
+			}
 			unit->part[i].valid = 0;
 			unit->part[i].vers++;
 		}
@@ -345,6 +356,7 @@ static struct sdunit *sdgetunit(struct sdev *sdev, int subno)
 			kfree(unit);
 			return NULL;
 		}
+		sdqinit(unit);
 		sdev->unit[subno] = unit;
 	}
 	qunlock(&sdev->unitlock);
@@ -724,6 +736,8 @@ static struct chan *sdopen(struct chan *c, int omode)
 		}
 		pp = &unit->part[PART(c->qid)];
 		c->qid.vers = unit->vers + pp->vers;
+		if (pp->cache)
+			c->aux = sdcacheget(pp->cache);
 		qunlock(&unit->ctl);
 		poperror();
 		break;
@@ -753,6 +767,12 @@ static void sdclose(struct chan *c)
 			kref_put(&sdev->r);
 		}
 		break;
+	case Qpart:
+		if (c->aux) {
+			sdcacheput(c->aux);
+			c->aux = NULL;
+		}
+		break;
 	}
 }
 
@@ -766,7 +786,8 @@ static size_t sdbio(struct chan *c, int write, char *a, size_t len,
 	struct sdunit *unit;
 	struct sdev *sdev;
 	int64_t bno;
-	size_t l, max, nb, offset;
+	int32_t l;
+	size_t max, nb, offset;
 
 	sdev = sdgetdev(DEV(c->qid));
 	if (sdev == NULL) {
@@ -803,6 +824,20 @@ static size_t sdbio(struct chan *c, int write, char *a, size_t len,
 	if (unit->vers + pp->vers != c->qid.vers)
 		error(EIO, "disk changed");
 
+	/* Cached partitions are on fixed disks, so we don't hold ctl. */
+	if (c->aux) {
+		qunlock(&unit->ctl);
+		poperror();
+		if (waserror()) {
+			kref_put(&sdev->r);
+			nexterror();
+		}
+		len = sdcacherw(c->aux, write, a, len, off);
+		poperror();
+		kref_put(&sdev->r);
+		return len;
+	}
+
 	/*
 	 * Check the request is within bounds.
 	 * Removeable drives are locked throughout the I/O
@@ -850,7 +885,7 @@ static size_t sdbio(struct chan *c, int write, char *a, size_t len,
 		len = nb * unit->secsize - offset;
 	if (write) {
 		if (offset || (len % unit->secsize)) {
-			l = unit->dev->ifc->bio(unit, 0, 0, b, nb, bno);
+			l = sdqbio(unit, 0, b, nb, bno);
 			if (l < 0)
 				error(EIO, "IO Error");
 			if (l < (nb * unit->secsize)) {
@@ -861,7 +896,7 @@ static size_t sdbio(struct chan *c, int write, char *a, size_t len,
 			}
 		}
 		memmove(b + offset, a, len);
-		l = unit->dev->ifc->bio(unit, 0, 1, b, nb, bno);
+		l = sdqbio(unit, 1, b, nb, bno);
 		if (l < 0)
 			error(EIO, "IO Error");
 		if (l < offset)
@@ -869,7 +904,7 @@ static size_t sdbio(struct chan *c, int write, char *a, size_t len,
 		else if (len > l - offset)
 			len = l - offset;
 	} else {
-		l = unit->dev->ifc->bio(unit, 0, 0, b, nb, bno);
+		l = sdqbio(unit, 0, b, nb, bno);
 		if (l < 0)
 			error(EIO, "IO Error");
 		if (l < offset)
@@ -1184,6 +1219,7 @@ static size_t sdread(struct chan *c, void *a, size_t n, off64_t off)
 				pp++;
 			}
 		}
+		l = sdqstats(unit, p + l, p + mm) - p;
 		qunlock(&unit->ctl);
 		kref_put(&sdev->r);
 		l = readstr(offset, a, n, p);
@@ -1459,6 +1495,32 @@ static size_t sdwstat(struct chan *c, uint8_t *dp, size_t n)
 	return n;
 }
 
+/* Uncached I/O is synchronous, so there's only something to do for partitions
+ * with a cache. */
+static unsigned long sdchanctl(struct chan *c, int op, unsigned long a1,
+                               unsigned long a2, unsigned long a3,
+                               unsigned long a4)
+{
+	switch (op) {
+	case CCTL_SYNC:
+		if (TYPE(c->qid) == Qpart && c->aux)
+			sdcachesync(c->aux);
+		return 0;
+	default:
+		error(EINVAL, "%s does not support %d", __func__, op);
+	}
+}
+
+static struct fs_file *sdmmap(struct chan *c, struct vm_region *vmr, int prot,
+                              int flags)
+{
+	if (TYPE(c->qid) != Qpart || c->aux == NULL) {
+		set_error(ENODEV, "only cached partitions can be mmapped");
+		return NULL;
+	}
+	return sdcachemmap(c->aux, prot, flags);
+}
+
 static int configure(char *spec, struct devconf *cf)
 {
 	struct sdev *s, *sdev;
@@ -1557,6 +1619,8 @@ struct dev sddevtab __devtab = {
     .remove = devremove,
     .wstat = sdwstat,
     .power = devpower,
+    .chan_ctl = sdchanctl,
+    .mmap = sdmmap,
 };
 
 /*
@@ -0,0 +1,425 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Page cache for #sd partitions.
+ *
+ * Each partition of a fixed disk gets an fs_file, whose page map holds the
+ * partition's contents.  Opened partition chans point at the cache (c->aux),
+ * and reads, writes and mmaps go through the page map.  Misses read a window
+ * of pages with one bio, and sequential readers trigger async readahead, same
+ * as gtfs.  Dirty pages go back to the disk in runs of contiguous pages, one
+ * bio per run, from write-behind, sync or when the partition is deleted.
+ *
+ * The partition and each open chan hold a kref.  When the partition goes away
+ * (delpart or a media change), the partition's ref is dropped and the cache is
+ * marked gone, so that chans that still have it open don't touch the disk.
+ * Those chans fail the vers check in sdbio anyway.
+ *
+ * Qraw (SCSI commands) doesn't go through the cache, so don't mix raw writes
+ * with cached access to the same blocks. */
+
+#include <assert.h>
+#include <error.h>
+#include <fs_file.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <kthread.h>
+#include <ns.h>
+#include <pagemap.h>
+#include <pmap.h>
+#include <ros/mman.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sd.h>
+
+#define SDC_RA_INIT_PAGES		4
+#define SDC_RA_MAX_PAGES		32
+
+/* Dirty bytes before we kick async writeback, and before the writer has to do
+ * it itself. */
+#define SDC_WB_START_BYTES		(1UL << 20)
+#define SDC_WB_THROTTLE_BYTES	(8UL << 20)
+
+struct sdcache {
+	struct fs_file file;
+	struct kref kref;
+	struct sdunit *unit;
+	uint64_t start; /* sectors */
+	uint64_t end;
+	bool gone;
+
+	spinlock_t ra_lock;
+	unsigned long ra_next;    /* first page after the last window */
+	unsigned long ra_trigger; /* a hit here starts the next window */
+	size_t ra_window;
+
+	atomic_t wb_dirty;
+	atomic_t wb_running;
+};
+
+static inline struct sdcache *fsf_to_sdcache(struct fs_file *f)
+{
+	return container_of(f, struct sdcache, file);
+}
+
+static void sdcache_release(struct kref *kref)
+{
+	struct sdcache *sc = container_of(kref, struct sdcache, kref);
+
+	cleanup_fs_file(&sc->file);
+	kfree(sc);
+}
+
+void sdcacheput(struct sdcache *sc)
+{
+	kref_put(&sc->kref);
+}
+
+struct sdcache *sdcacheget(struct sdcache *sc)
+{
+	kref_get(&sc->kref, 1);
+	return sc;
+}
+
+/* One bio for a run of pages starting at offset, clipped at the end of the
+ * partition.  Returns the bytes transferred, which is less than amt at the
+ * end, or throws. */
+static size_t sdc_bio(struct sdcache *sc, int write, void *buf, size_t amt,
+                      off64_t offset)
+{
+	struct sdunit *unit = sc->unit;
+	size_t len = fs_file_get_length(&sc->file);
+	int32_t nb, l;
+
+	if (sc->gone)
+		error(EIO, "disk changed");
+	if (offset >= len)
+		return 0;
+	amt = MIN(amt, len - offset);
+	nb = amt / unit->secsize;
+	l = sdqbio(unit, write, buf, nb, sc->start + offset / unit->secsize);
+	if (l < 0)
+		error(EIO, "IO Error");
+	return l;
+}
+
+/* Fills the locked, contiguous pages with one read.  Throws on error. */
+static void sdc_fill_pages(struct sdcache *sc, struct page **pgs, size_t nr)
+{
+	ERRSTACK(1);
+	off64_t offset = pgs[0]->pg_index << PGSHIFT;
+	size_t ret, amt = nr * PGSIZE;
+	uint8_t *buf;
+
+	buf = nr == 1 ? page2kva(pgs[0]) : kmalloc(amt, MEM_WAIT);
+	if (waserror()) {
+		if (nr > 1)
+			kfree(buf);
+		nexterror();
+	}
+	ret = sdc_bio(sc, 0, buf, amt, offset);
+	poperror();
+	if (ret < amt)
+		memset(buf + ret, 0, amt - ret);
+	if (nr > 1) {
+		for (int i = 0; i < nr; i++)
+			memcpy(page2kva(pgs[i]), buf + i * PGSIZE, PGSIZE);
+		kfree(buf);
+	}
+}
+
+/* Grabs up to nr new pages starting at index, stopping at the end of the
+ * partition or the first page the PM already has.  Returns how many we got. */
+static size_t sdc_grab_ra_pages(struct sdcache *sc, unsigned long index,
+                                struct page **pgs, size_t nr)
+{
+	unsigned long eof_idx = nr_pages(fs_file_get_length(&sc->file));
+	size_t i;
+
+	for (i = 0; i < nr && index + i < eof_idx; i++) {
+		pgs[i] = pm_grab_new_page(sc->file.pm, index + i);
+		if (!pgs[i])
+			break;
+	}
+	return i;
+}
+
+static void sdc_release_ra_pages(struct page **pgs, size_t nr, bool filled)
+{
+	for (int i = 0; i < nr; i++) {
+		if (filled)
+			atomic_or(&pgs[i]->pg_flags, PG_UPTODATE | PG_READAHEAD);
+		unlock_page(pgs[i]);
+		pm_put_page(pgs[i]);
+	}
+}
+
+struct sdc_ra_work {
+	struct sdcache *sc;
+	unsigned long index;
+	size_t nr;
+};
+
+static void sdc_ra_ktask(void *arg)
+{
+	ERRSTACK(1);
+	struct sdc_ra_work *w = arg;
+	struct page *pgs[SDC_RA_MAX_PAGES];
+	size_t nr;
+
+	nr = sdc_grab_ra_pages(w->sc, w->index, pgs, w->nr);
+	if (nr) {
+		if (waserror()) {
+			sdc_release_ra_pages(pgs, nr, false);
+		} else {
+			sdc_fill_pages(w->sc, pgs, nr);
+			sdc_release_ra_pages(pgs, nr, true);
+		}
+		poperror();
+	}
+	sdcacheput(w->sc);
+	kfree_sized(w, sizeof(struct sdc_ra_work));
+}
+
+/* The first use of a page we read ahead.  If it's the trigger, the reader is
+ * still sequential, and we start on the next window. */
+static void sdc_pm_readahead_hit(struct page_map *pm, struct page *pg)
+{
+	struct sdcache *sc = fsf_to_sdcache(pm->pm_file);
+	struct sdc_ra_work *w = NULL;
+
+	spin_lock(&sc->ra_lock);
+	if (pg->pg_index == sc->ra_trigger) {
+		w = kmalloc_sized(sizeof(struct sdc_ra_work), MEM_ATOMIC);
+		if (w) {
+			sc->ra_window = MIN(sc->ra_window * 2, SDC_RA_MAX_PAGES);
+			w->index = sc->ra_next;
+			w->nr = sc->ra_window;
+			sc->ra_trigger = sc->ra_next;
+			sc->ra_next += sc->ra_window;
+		}
+	}
+	spin_unlock(&sc->ra_lock);
+	if (!w)
+		return;
+	/* The ktask needs the cache (and thus the PM) to stay around.  Our caller
+	 * has a page ref, so someone has the cache. */
+	w->sc = sdcacheget(sc);
+	ktask("sd_ra", sdc_ra_ktask, w);
+}
+
+/* Returns how many pages to read for a miss at index, including that page.
+ * Misses at ra_next are sequential and grow the window; anything else resets
+ * it.  The PM's hint overrides the guess. */
+static size_t sdc_ra_on_miss(struct sdcache *sc, unsigned long index)
+{
+	int hint = READ_ONCE(sc->file.pm->pm_ra_hint);
+	size_t nr;
+
+	spin_lock(&sc->ra_lock);
+	if (hint == PM_RA_RANDOM)
+		sc->ra_window = 1;
+	else if (hint == PM_RA_SEQUENTIAL)
+		sc->ra_window = SDC_RA_MAX_PAGES;
+	else if (index == 0 || index == sc->ra_next)
+		sc->ra_window = MIN(MAX(sc->ra_window * 2, SDC_RA_INIT_PAGES),
+		                    SDC_RA_MAX_PAGES);
+	else
+		sc->ra_window = 1;
+	nr = sc->ra_window;
+	sc->ra_next = index + nr;
+	sc->ra_trigger = nr > 1 ? index + nr / 2 : -1UL;
+	spin_unlock(&sc->ra_lock);
+	return nr;
+}
+
+static int sdc_pm_readpage(struct page_map *pm, struct page *pg)
+{
+	ERRSTACK(1);
+	struct sdcache *sc = fsf_to_sdcache(pm->pm_file);
+	struct page *pgs[SDC_RA_MAX_PAGES];
+	size_t nr;
+
+	pgs[0] = pg;
+	nr = 1 + sdc_grab_ra_pages(sc, pg->pg_index + 1, pgs + 1,
+	                           sdc_ra_on_miss(sc, pg->pg_index) - 1);
+	if (waserror()) {
+		sdc_release_ra_pages(pgs + 1, nr - 1, false);
+		poperror();
+		return -get_errno();
+	}
+	sdc_fill_pages(sc, pgs, nr);
+	poperror();
+	atomic_or(&pg->pg_flags, PG_UPTODATE);
+	sdc_release_ra_pages(pgs + 1, nr - 1, true);
+	return 0;
+}
+
+static int sdc_pm_writepages(struct page_map *pm, struct page **pgs, size_t nr)
+{
+	ERRSTACK(1);
+	struct sdcache *sc = fsf_to_sdcache(pm->pm_file);
+	off64_t offset = pgs[0]->pg_index << PGSHIFT;
+	uint8_t *buf;
+
+	/* Once the partition is gone, there's nowhere for the data to go. */
+	if (sc->gone)
+		return 0;
+	buf = nr == 1 ? page2kva(pgs[0]) : kmalloc(nr * PGSIZE, MEM_WAIT);
+	if (waserror()) {
+		if (nr > 1)
+			kfree(buf);
+		poperror();
+		return -get_errno();
+	}
+	if (nr > 1) {
+		for (int i = 0; i < nr; i++)
+			memcpy(buf + i * PGSIZE, page2kva(pgs[i]), PGSIZE);
+	}
+	sdc_bio(sc, 1, buf, nr * PGSIZE, offset);
+	poperror();
+	if (nr > 1)
+		kfree(buf);
+	return 0;
+}
+
+static int sdc_pm_writepage(struct page_map *pm, struct page *pg)
+{
+	return sdc_pm_writepages(pm, &pg, 1);
+}
+
+static void sdc_fs_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
+{
+	error(EINVAL, "can't punch holes in a disk");
+}
+
+static bool sdc_fs_can_grow_to(struct fs_file *f, size_t len)
+{
+	return len <= fs_file_get_length(f);
+}
+
+static struct fs_file_ops sdc_fs_ops = {
+	.readpage = sdc_pm_readpage,
+	.readahead_hit = sdc_pm_readahead_hit,
+	.writepage = sdc_pm_writepage,
+	.writepages = sdc_pm_writepages,
+	.punch_hole = sdc_fs_punch_hole,
+	.can_grow_to = sdc_fs_can_grow_to,
+};
+
+/*
+ * Returns a cache for the sectors [start, end) of unit, with one ref for the
+ * partition, or NULL if the unit shouldn't be cached.  Removable media is
+ * locked for the whole I/O in sdbio, which the cache can't do, and sectors
+ * have to tile pages.
+ */
+struct sdcache *sdcachealloc(struct sdunit *unit, char *name, uint64_t start,
+                             uint64_t end)
+{
+	struct sdcache *sc;
+
+	if (unit->inquiry[1] & SDinq1removable)
+		return NULL;
+	if (!unit->secsize || unit->secsize > PGSIZE || PGSIZE % unit->secsize)
+		return NULL;
+	sc = kzmalloc(sizeof(struct sdcache), MEM_WAIT);
+	kref_init(&sc->kref, sdcache_release, 1);
+	sc->unit = unit;
+	sc->start = start;
+	sc->end = end;
+	spinlock_init(&sc->ra_lock);
+	sc->ra_trigger = -1UL;
+	fs_file_init(&sc->file, name, &sdc_fs_ops);
+	fs_file_init_dir(&sc->file, 0, 0, &eve, 0640);
+	sc->file.dir.length = (end - start) * unit->secsize;
+	return sc;
+}
+
+/* Caller holds unit->ctl.  Drops the partition's ref.  If the partition is just
+ * being deleted, the dirty data goes to disk first; after a media change, it is
+ * discarded. */
+void sdcachedrop(struct sdcache *sc, int writeback)
+{
+	ERRSTACK(1);
+
+	if (writeback) {
+		if (!waserror())
+			sdcachesync(sc);
+		poperror();
+	}
+	sc->gone = TRUE;
+	sdcacheput(sc);
+}
+
+/* Throws on error, from a writepage. */
+void sdcachesync(struct sdcache *sc)
+{
+	/* Lockless peek, like gtfs's writeback_file.  Once dirtied, the file stays
+	 * dirty; pm_writeback_pages() scans for the dirty pages. */
+	if (sc->file.flags & FSF_DIRTY)
+		pm_writeback_pages(sc->file.pm);
+}
+
+static void sdc_wb_ktask(void *arg)
+{
+	struct sdcache *sc = arg;
+
+	atomic_set(&sc->wb_dirty, 0);
+	pm_writeback_pages(sc->file.pm);
+	atomic_set(&sc->wb_running, 0);
+	sdcacheput(sc);
+}
+
+/* Paces the dirty data, same as gtfs_write_behind(). */
+static void sdc_write_behind(struct sdcache *sc, size_t amt)
+{
+	unsigned long dirty;
+
+	dirty = atomic_fetch_and_add(&sc->wb_dirty, amt) + amt;
+	if (dirty < SDC_WB_START_BYTES)
+		return;
+	if (dirty >= SDC_WB_THROTTLE_BYTES) {
+		atomic_set(&sc->wb_dirty, 0);
+		pm_writeback_pages(sc->file.pm);
+		return;
+	}
+	if (!atomic_cas(&sc->wb_running, 0, 1))
+		return;
+	ktask("sd_wb", sdc_wb_ktask, sdcacheget(sc));
+}
+
+/* sdbio for cached partitions: off and len are in bytes from the start of the
+ * partition.  Like the direct path, I/O is clipped at the end of the partition
+ * and writes that start past it fail. */
+size_t sdcacherw(struct sdcache *sc, int write, void *a, size_t len,
+                 off64_t off)
+{
+	size_t plen = fs_file_get_length(&sc->file);
+	size_t ret;
+
+	if (off >= plen) {
+		if (write)
+			error(EIO, "offset %lld is past the end of the partition",
+			      off);
+		return 0;
+	}
+	len = MIN(len, plen - off);
+	if (!write)
+		return fs_file_read(&sc->file, a, len, off);
+	ret = fs_file_write(&sc->file, a, len, off);
+	sdc_write_behind(sc, ret);
+	return ret;
+}
+
+/* The devtab mmap for cached partitions.  Returns the fs_file for the VMR. */
+struct fs_file *sdcachemmap(struct sdcache *sc, int prot, int flags)
+{
+	struct fs_file *f = &sc->file;
+
+	qlock(&f->qlock);
+	if ((prot & PROT_WRITE) && (flags & MAP_SHARED))
+		f->flags |= FSF_DIRTY;
+	qunlock(&f->qlock);
+	return f;
+}
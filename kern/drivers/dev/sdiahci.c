@@ -120,7 +120,7 @@ static char *descmode[] = {
 };
 
 static char *flagname[] = {
-    "llba", "smart", "power", "nop", "atapi", "atapi16",
+    "llba", "smart", "power", "nop", "atapi", "atapi16", "ncq",
 };
 
 struct drive {
@@ -159,6 +159,8 @@ struct drive {
 
 	uint32_t lastintr0;
 	uint32_t intrs;
+
+	int ncqslots; /* HBA command slots, 0 if it can't do NCQ */
 };
 
 struct ctlr {
@@ -673,6 +675,13 @@ static int64_t ahciidentify(struct aportc *pc, uint16_t *id)
 			pm->feat |= Datapi16;
 	}
 
+	/* word 76 bit 8: NCQ, word 75: queue depth - 1 */
+	pm->ncqdepth = 0;
+	if (!(pm->feat & Datapi) && gbit16(id + 76) & (1 << 8)) {
+		pm->feat |= Dncq;
+		pm->ncqdepth = (gbit16(id + 75) & 0x1f) + 1;
+	}
+
 	i = gbit16(id + 83);
 	if ((i >> 14) == 1) {
 		if (i & (1 << 3))
@@ -864,8 +873,9 @@ static int ahciconfigdrive(struct drive *d)
 	pm = d->portc.pm;
 	if (pm->list == 0) {
 		setupfis(&pm->fis);
-		pm->list = malign(ALIST_SIZE, 1024);
+		pm->list = malign(ALIST_SIZE * SDqmax, 1024);
 		pm->ctab = malign(ACTAB_PRDT + APRDT_SIZE, 128);
+		pm->ncqctab = malign(ANCQ_CTAB_SIZE * SDqmax, 128);
 	}
 
 	if (d->unit)
@@ -874,6 +884,7 @@ static int ahciconfigdrive(struct drive *d)
 		name = NULL;
 	sstatus = ahci_port_read32(port, PORT_SSTS);
 	cap = ahci_hba_read32(hba, HBA_CAP);
+	d->ncqslots = cap & Hsncq ? ((cap >> 8) & 0x1f) + 1 : 0;
 	if (sstatus & (Devphycomm | Devpresent) && cap & Hsss) {
 		/* device connected & staggered spin-up */
 		printd("ahci: configdrive: %s: spinning up ... [%#lx]\n", name,
@@ -1046,6 +1057,32 @@ static void clearci(void *p)
 	}
 }
 
+/*
+ * Completes the NCQ commands in done, all of them on an error.  Called with the
+ * drive's Lock held, usually from the interrupt handler.
+ */
+static void ncqcomplete(struct drive *d, uint32_t done, int status)
+{
+	struct aportm *pm = &d->portm;
+	struct sdbreq *r;
+	int tag;
+
+	done &= pm->ncqbusy;
+	if (done == 0)
+		return;
+	while (done) {
+		tag = __builtin_ctz(done);
+		done &= ~(1U << tag);
+		r = pm->ncqreq[tag];
+		pm->ncqreq[tag] = NULL;
+		pm->ncqbusy &= ~(1U << tag);
+		sdqcomplete(r, status);
+	}
+	sdqwakeup(d->unit);
+	if (pm->ncqbusy == 0)
+		rendez_wakeup(&pm->Rendez);
+}
+
 static void updatedrive(struct drive *d)
 {
 	uint32_t cause, serr, task, sstatus, ie, s0, pr, ewake;
@@ -1069,6 +1106,11 @@ static void updatedrive(struct drive *d)
 		pr = 0;
 	} else if (cause & Adps)
 		pr = 0;
+	/* the drive clears SACT bits (set device bits fis) as tags finish */
+	if (d->portm.ncqbusy) {
+		ncqcomplete(d, ~ahci_port_read32(port, PORT_SACT), SDok);
+		pr = 0;
+	}
 	if (cause & Ifatal) {
 		ewake = 1;
 		printd("ahci: updatedrive: %s: fatal\n", name);
@@ -1123,6 +1165,8 @@ static void updatedrive(struct drive *d)
 	}
 	ahci_port_write32(port, PORT_SERR, serr);
 	if (ewake) {
+		/* clearci stops the port, which drops whatever is still queued */
+		ncqcomplete(d, ~0U, SDeio);
 		clearci(port);
 		rendez_wakeup(&d->portm.Rendez);
 	}
@@ -1193,6 +1237,7 @@ static void resetdisk(struct drive *d)
 	if (d->state != Dready || d->state != Dnew)
 		d->portm.flag |= Ferror;
 	clearci(port); /* satisfy sleep condition. */
+	ncqcomplete(d, ~0U, SDeio);
 	rendez_wakeup(&d->portm.Rendez);
 	if (stat != (Devpresent | Devphycomm)) {
 		/* device absent or phy not communicating */
@@ -1655,6 +1700,39 @@ static int iaonline(struct sdunit *unit)
 	return r;
 }
 
+static int ncqidle(void *v)
+{
+	struct aportm *pm = v;
+
+	return pm->ncqbusy == 0;
+}
+
+/*
+ * Non-queued commands can't be issued while NCQ commands are outstanding.
+ * Call with the port's ql, which keeps iasubmit from queueing more.  If the
+ * drive sits on them, we give up on them, like iario does with its commands.
+ */
+static void ncqdrain(struct drive *d)
+{
+	ERRSTACK(1);
+	struct aportm *pm = &d->portm;
+
+	if (ncqidle(pm))
+		return;
+	while (waserror())
+		poperror();
+	rendez_sleep_timeout(&pm->Rendez, ncqidle, pm, (3 * 1000) * 1000);
+	poperror();
+	if (ncqidle(pm))
+		return;
+	printd("%s: ncq commands not done after 3 seconds\n",
+	       d->unit->sdperm.name);
+	spin_lock_irqsave(&d->Lock);
+	ncqcomplete(d, ~0U, SDeio);
+	clearci(d->port);
+	spin_unlock_irqsave(&d->Lock);
+}
+
 /* returns locked list! */
 static void *ahcibuild(struct drive *d, unsigned char *cmd, void *data, int n,
                        int64_t lba)
@@ -1672,6 +1750,7 @@ static void *ahcibuild(struct drive *d, unsigned char *cmd, void *data, int n,
 	llba = pm->feat & Dllba ? 1 : 0;
 	acmd = tab[dir][llba];
 	qlock(&pm->ql);
+	ncqdrain(d);
 	list = pm->list;
 	ctab = pm->ctab;
 	cfis = ctab;
@@ -1813,6 +1892,8 @@ static int lockready(struct drive *d)
 		esleep(1);
 		qlock(&d->portm.ql);
 	}
+	if (i == 0)
+		ncqdrain(d);
 	return i;
 }
 
@@ -2072,6 +2153,115 @@ retry:
 	return SDok;
 }
 
+static int iaqdepth(struct sdunit *unit)
+{
+	struct ctlr *c;
+	struct drive *d;
+
+	c = unit->dev->ctlr;
+	d = c->drive[unit->subno];
+	if (d->state != Dready || !(d->portm.feat & Dncq))
+		return 0;
+	return MIN(d->portm.ncqdepth, d->ncqslots);
+}
+
+/*
+ * Issues r, and the requests merged behind it, as one READ/WRITE FPDMA QUEUED
+ * command.  sdqueue keeps no more than iaqdepth() of these outstanding, so
+ * there's a free tag.  The tags are completed in updatedrive.
+ */
+static int iasubmit(struct sdunit *unit, struct sdbreq *r)
+{
+	struct ctlr *c;
+	struct drive *d;
+	struct aportm *pm;
+	struct sdbreq *i;
+	void *cfis, *list, *ctab, *prdt;
+	uint32_t flags, free;
+	uint64_t lba;
+	int tag, depth, nseg;
+
+	c = unit->dev->ctlr;
+	d = c->drive[unit->subno];
+	pm = &d->portm;
+	qlock(&pm->ql);
+	depth = iaqdepth(unit);
+	free = ~pm->ncqbusy;
+	if (depth < 32)
+		free &= (1U << depth) - 1;
+	if (free == 0) {
+		qunlock(&pm->ql);
+		return SDeio;
+	}
+	tag = __builtin_ctz(free);
+	list = pm->list + tag * ALIST_SIZE;
+	ctab = pm->ncqctab + tag * ANCQ_CTAB_SIZE;
+	cfis = ctab;
+	lba = r->bno;
+
+	ahci_cfis_write8(cfis, 0, 0x27);
+	ahci_cfis_write8(cfis, 1, 0x80);
+	ahci_cfis_write8(cfis, 2, r->write ? 0x61 : 0x60);
+	ahci_cfis_write8(cfis, 3, r->cmdnb); /* features: sector count */
+
+	ahci_cfis_write8(cfis, 4, lba);
+	ahci_cfis_write8(cfis, 5, lba >> 8);
+	ahci_cfis_write8(cfis, 6, lba >> 16);
+	ahci_cfis_write8(cfis, 7, 0x40); /* lba */
+
+	ahci_cfis_write8(cfis, 8, lba >> 24);
+	ahci_cfis_write8(cfis, 9, lba >> 32);
+	ahci_cfis_write8(cfis, 10, lba >> 40);
+	ahci_cfis_write8(cfis, 11, r->cmdnb >> 8); /* features (exp) */
+
+	ahci_cfis_write8(cfis, 12, tag << 3); /* sector count: tag */
+	ahci_cfis_write8(cfis, 13, 0);
+	ahci_cfis_write8(cfis, 14, 0);
+	ahci_cfis_write8(cfis, 15, 0);
+
+	ahci_cfis_write8(cfis, 16, 0);
+	ahci_cfis_write8(cfis, 17, 0);
+	ahci_cfis_write8(cfis, 18, 0);
+	ahci_cfis_write8(cfis, 19, 0);
+
+	/* no interrupt bits: the set device bits fis tells us when it's done */
+	prdt = ctab + ACTAB_PRDT;
+	nseg = 0;
+	for (i = r; i; i = i->merged) {
+		ahci_prdt_write32(prdt, APRDT_DBA, paddr_low32(i->data));
+		ahci_prdt_write32(prdt, APRDT_DBAHI, paddr_high32(i->data));
+		ahci_prdt_write32(prdt, APRDT_COUNT,
+		                  (unit->secsize * i->nb - 2) | 1);
+		prdt += APRDT_SIZE;
+		nseg++;
+	}
+
+	/* Lpref isn't allowed for queued commands */
+	flags = nseg << 16 | 0x5;
+	if (r->write)
+		flags |= Lwrite;
+	ahci_list_write32(list, ALIST_FLAGS, flags);
+	ahci_list_write32(list, ALIST_LEN, 0);
+	ahci_list_write32(list, ALIST_CTAB, paddr_low32(ctab));
+	ahci_list_write32(list, ALIST_CTABHI, paddr_high32(ctab));
+
+	/* updatedrive treats busy tags without SACT bits as done, so these go
+	 * together. */
+	spin_lock_irqsave(&d->Lock);
+	if (d->state != Dready) {
+		spin_unlock_irqsave(&d->Lock);
+		qunlock(&pm->ql);
+		return SDeio;
+	}
+	pm->ncqreq[tag] = r;
+	pm->ncqbusy |= 1U << tag;
+	ahci_port_write32(d->port, PORT_SACT, 1U << tag);
+	ahci_port_write32(d->port, PORT_CI, 1U << tag);
+	spin_unlock_irqsave(&d->Lock);
+	qunlock(&pm->ql);
+	return SDok;
+}
+
 /*
  * configure drives 0-5 as ahci sata (c.f. errata).
  * what about 6 & 7, as claimed by marvell 0x9123?
@@ -2591,4 +2781,7 @@ struct sdifc sdiahciifc = {
     NULL, /* clear */
     iartopctl,
     iawtopctl,
+
+    iaqdepth,
+    iasubmit,
 };
@@ -0,0 +1,872 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * NVMe driver for #sd.  Each namespace is a unit.
+ *
+ * Every core gets its own I/O queue pair (or shares one, if the controller
+ * gives us fewer than num_cores), and with MSI-X each completion queue has its
+ * own vector, routed to its core.  A request goes on the SQ of whatever core
+ * the caller is on, so submitters on different cores never touch the same
+ * queue, and the completion interrupt comes back to that core.
+ *
+ * Callers sleep on their queue's rendez, which is shared by all of the queue's
+ * commands: like sdqueue, commands live on the caller's stack, and we can't
+ * have the completion side touch the command after it marks it done.
+ *
+ * A unit can be put in polled mode ("poll on" in its ctl), for latency-critical
+ * MCPs: callers then spin on their CQ instead of sleeping for the interrupt.
+ *
+ * These do their own per-core queueing, so they don't use sdqueue (no
+ * qdepth/submit).  The admin queue is only used during setup, polled. */
+
+#include <arch/arch.h>
+#include <assert.h>
+#include <cpio.h>
+#include <error.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <page_alloc.h>
+#include <pmap.h>
+#include <rendez.h>
+#include <sd.h>
+#include <smp.h>
+#include <stdio.h>
+#include <string.h>
+#include <trap.h>
+
+#include <nvme.h>
+
+#define NVME_NCTLR				4
+#define NVME_MAXNS				16
+#define NVME_MAXQ				64
+#define NVME_ADMIN_DEPTH		16
+#define NVME_IO_DEPTH			64		/* one cid mask per queue */
+#define NVME_PRPS_PER_CMD		(PGSIZE / sizeof(uint64_t))
+#define NVME_ADMIN_TIMEOUT_US	(5 * 1000 * 1000)
+
+struct nvme_ctlr;
+
+/* A command in flight.  It's on the submitter's stack. */
+struct nvme_cmd {
+	struct nvme_cqe				cqe;
+	bool						done;
+};
+
+struct nvme_queue {
+	spinlock_t					lock;	/* both halves */
+	struct nvme_ctlr			*ctlr;
+	int							qid;
+	int							core;	/* its MSI-X vector goes here */
+	uint16_t					depth;
+	struct nvme_sqe				*sq;
+	struct nvme_cqe				*cq;
+	void						*sq_db;
+	void						*cq_db;
+	uint16_t					sq_tail;
+	uint16_t					cq_head;
+	uint16_t					cq_phase;
+	uint64_t					cid_free;
+	struct nvme_cmd				*cmds[NVME_IO_DEPTH];
+	uint64_t					*prps;	/* a page of PRPs per cid */
+	struct rendez				rv;
+	bool						no_irq;	/* always poll */
+
+	uint64_t					nr_cmds;
+	uint64_t					nr_irqs;
+	uint64_t					nr_polls;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct nvme_ns {
+	uint32_t					nsid;
+	uint64_t					sectors;
+	uint32_t					secsize;
+	bool						changed;	/* not told to sd yet */
+	bool						poll;
+};
+
+struct nvme_ctlr {
+	struct pci_device			*pci;
+	struct sdev					*sdev;
+	void						*regs;
+	uintptr_t					physio;
+	uint64_t					cap;
+	uint32_t					timeout_us;	/* CAP.TO */
+	size_t						maxxfer;	/* bytes per command */
+	bool						enabled;
+	bool						msix;		/* a vector per I/O queue */
+	int							nvec;
+
+	char						serial[20 + 1];
+	char						model[40 + 1];
+	char						firmware[8 + 1];
+
+	struct nvme_queue			*adminq;
+	struct nvme_queue			*ioq;
+	int							nr_ioq;
+	struct nvme_ns				ns[NVME_MAXNS];
+	int							nr_ns;
+};
+
+struct sdifc sdnvmeifc;
+
+static struct nvme_ctlr *nvme_ctlrs[NVME_NCTLR];
+static int nr_nvme_ctlrs;
+
+static inline uint32_t nvme_read32(struct nvme_ctlr *c, uint32_t reg)
+{
+	return read_mmreg32((uintptr_t)c->regs + reg);
+}
+
+static inline void nvme_write32(struct nvme_ctlr *c, uint32_t reg, uint32_t val)
+{
+	write_mmreg32((uintptr_t)c->regs + reg, val);
+}
+
+static inline uint64_t nvme_read64(struct nvme_ctlr *c, uint32_t reg)
+{
+	return nvme_read32(c, reg) | (uint64_t)nvme_read32(c, reg + 4) << 32;
+}
+
+static inline void nvme_write64(struct nvme_ctlr *c, uint32_t reg, uint64_t val)
+{
+	nvme_write32(c, reg, val);
+	nvme_write32(c, reg + 4, val >> 32);
+}
+
+static struct nvme_ctlr *unit_to_ctlr(struct sdunit *unit)
+{
+	return unit->dev->ctlr;
+}
+
+static struct nvme_ns *unit_to_ns(struct sdunit *unit)
+{
+	return &unit_to_ctlr(unit)->ns[unit->subno];
+}
+
+/* Copies an ascii identify field, trimming the trailing spaces. */
+static void nvme_idstr(char *to, uint8_t *from, size_t len)
+{
+	memcpy(to, from, len);
+	to[len] = 0;
+	while (len && to[len - 1] == ' ')
+		to[--len] = 0;
+}
+
+static int nvme_queue_init(struct nvme_ctlr *c, struct nvme_queue *q, int qid,
+                           int depth, int core)
+{
+	uint32_t stride = 4 << NVME_CAP_DSTRD(c->cap);
+
+	spinlock_init_irqsave(&q->lock);
+	rendez_init(&q->rv);
+	q->ctlr = c;
+	q->qid = qid;
+	q->core = core;
+	q->depth = depth;
+	q->sq = kpages_zalloc(ROUNDUP(depth * sizeof(struct nvme_sqe), PGSIZE),
+	                      MEM_WAIT);
+	q->cq = kpages_zalloc(ROUNDUP(depth * sizeof(struct nvme_cqe), PGSIZE),
+	                      MEM_WAIT);
+	q->prps = kpages_zalloc(depth * PGSIZE, MEM_WAIT);
+	q->sq_db = c->regs + NVME_DBS + (2 * qid) * stride;
+	q->cq_db = c->regs + NVME_DBS + (2 * qid + 1) * stride;
+	q->sq_tail = 0;
+	q->cq_head = 0;
+	q->cq_phase = NVME_CQE_PHASE;
+	/* One less cid than entries, so the SQ can't fill up. */
+	q->cid_free = (1ULL << (depth - 1)) - 1;
+	return 0;
+}
+
+/* Reaps q's completions.  Called with q->lock held.  Returns how many. */
+static int __nvme_reap(struct nvme_queue *q)
+{
+	struct nvme_cqe *cqe;
+	struct nvme_cmd *cmd;
+	int nr = 0;
+
+	for (;;) {
+		cqe = &q->cq[q->cq_head];
+		if ((ACCESS_ONCE(cqe->status) & NVME_CQE_PHASE) != q->cq_phase)
+			break;
+		rmb();	/* read the rest of the CQE after the phase */
+		if (cqe->cid >= q->depth - 1) {
+			warn_once("nvme: q %d: completion for bad cid %d", q->qid,
+			          cqe->cid);
+		} else if ((cmd = q->cmds[cqe->cid])) {
+			q->cmds[cqe->cid] = NULL;
+			cmd->cqe = *cqe;
+			wmb();
+			cmd->done = TRUE;
+		}
+		/* No cmd means its submitter timed out, and the cid is free now. */
+		if (cqe->cid < q->depth - 1)
+			q->cid_free |= 1ULL << cqe->cid;
+		if (++q->cq_head == q->depth) {
+			q->cq_head = 0;
+			q->cq_phase ^= NVME_CQE_PHASE;
+		}
+		nr++;
+	}
+	if (nr)
+		write_mmreg32((uintptr_t)q->cq_db, q->cq_head);
+	return nr;
+}
+
+static int nvme_reap(struct nvme_queue *q)
+{
+	int nr;
+
+	spin_lock_irqsave(&q->lock);
+	nr = __nvme_reap(q);
+	spin_unlock_irqsave(&q->lock);
+	if (nr)
+		rendez_wakeup(&q->rv);
+	return nr;
+}
+
+static void nvme_ioq_irq(struct hw_trapframe *hw_tf, void *arg)
+{
+	struct nvme_queue *q = arg;
+
+	q->nr_irqs++;
+	nvme_reap(q);
+}
+
+/* Without a vector per queue, everything comes in here. */
+static void nvme_irq(struct hw_trapframe *hw_tf, void *arg)
+{
+	struct nvme_ctlr *c = arg;
+
+	nvme_reap(c->adminq);
+	if (c->msix)
+		return;
+	for (int i = 0; i < c->nr_ioq; i++) {
+		c->ioq[i].nr_irqs++;
+		nvme_reap(&c->ioq[i]);
+	}
+}
+
+static int nvme_has_cid(void *arg)
+{
+	struct nvme_queue *q = arg;
+
+	return q->cid_free != 0;
+}
+
+static int nvme_cmd_done(void *arg)
+{
+	struct nvme_cmd *cmd = arg;
+
+	return cmd->done;
+}
+
+/*
+ * Points sqe at len bytes of data with PRPs.  The first one can be anywhere in
+ * a page, the rest are whole pages.  If there are more than two, PRP2 points at
+ * a list, which is one page per cid, big enough for maxxfer.
+ */
+static void nvme_set_prps(struct nvme_queue *q, struct nvme_sqe *sqe, int cid,
+                          void *data, size_t len)
+{
+	uintptr_t va = (uintptr_t)data;
+	size_t first = MIN(len, PGSIZE - PGOFF(va));
+	uint64_t *prps;
+	int i;
+
+	sqe->prp1 = PADDR(va);
+	sqe->prp2 = 0;
+	len -= first;
+	va += first;
+	if (!len)
+		return;
+	if (len <= PGSIZE) {
+		sqe->prp2 = PADDR(va);
+		return;
+	}
+	prps = q->prps + cid * NVME_PRPS_PER_CMD;
+	for (i = 0; len; i++) {
+		assert(i < NVME_PRPS_PER_CMD);
+		prps[i] = PADDR(va);
+		va += PGSIZE;
+		len -= MIN(len, PGSIZE);
+	}
+	sqe->prp2 = PADDR(prps);
+}
+
+/*
+ * Issues sqe on q and waits for it.  Returns the NVMe status, with the result in
+ * *result, or -1 on a timeout (only when polling with a timeout).
+ */
+static int nvme_submit(struct nvme_queue *q, struct nvme_sqe *sqe, void *data,
+                       size_t len, bool poll, uint64_t timeout_us,
+                       uint32_t *result)
+{
+	ERRSTACK(1);
+	struct nvme_cmd cmd;
+	uint64_t start;
+	int cid;
+
+	memset(&cmd, 0, sizeof(cmd));
+	spin_lock_irqsave(&q->lock);
+	while (!q->cid_free) {
+		spin_unlock_irqsave(&q->lock);
+		if (poll) {
+			nvme_reap(q);
+			cpu_relax();
+		} else {
+			rendez_sleep(&q->rv, nvme_has_cid, q);
+		}
+		spin_lock_irqsave(&q->lock);
+	}
+	cid = __builtin_ctzll(q->cid_free);
+	q->cid_free &= ~(1ULL << cid);
+	q->cmds[cid] = &cmd;
+	sqe->cid = cid;
+	if (data)
+		nvme_set_prps(q, sqe, cid, data, len);
+	q->sq[q->sq_tail] = *sqe;
+	if (++q->sq_tail == q->depth)
+		q->sq_tail = 0;
+	wmb();	/* SQE and PRPs before the doorbell */
+	write_mmreg32((uintptr_t)q->sq_db, q->sq_tail);
+	q->nr_cmds++;
+	spin_unlock_irqsave(&q->lock);
+
+	if (poll) {
+		start = nsec();
+		while (!cmd.done) {
+			if (nvme_reap(q))
+				continue;
+			if (timeout_us && nsec() - start > timeout_us * 1000) {
+				spin_lock_irqsave(&q->lock);
+				if (!cmd.done) {
+					/* The controller might still DMA to data, but we're
+					 * giving up on it anyway. */
+					q->cmds[cid] = NULL;
+					spin_unlock_irqsave(&q->lock);
+					return -1;
+				}
+				spin_unlock_irqsave(&q->lock);
+			}
+			cpu_relax();
+		}
+		q->nr_polls++;
+	} else {
+		/* cmd is on our stack and the device might still write it, so we
+		 * can't bail out early, even if we're aborted. */
+		while (waserror())
+			poperror();
+		rendez_sleep(&q->rv, nvme_cmd_done, &cmd);
+		poperror();
+	}
+	rmb();
+	if (result)
+		*result = cmd.cqe.result;
+	return NVME_CQE_STATUS(cmd.cqe.status);
+}
+
+static int nvme_admin(struct nvme_ctlr *c, struct nvme_sqe *sqe, void *data,
+                      size_t len, uint32_t *result)
+{
+	return nvme_submit(c->adminq, sqe, data, len, TRUE, NVME_ADMIN_TIMEOUT_US,
+	                   result);
+}
+
+static int nvme_identify(struct nvme_ctlr *c, uint32_t nsid, int cns,
+                         void *page)
+{
+	struct nvme_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = NVME_ADM_IDENTIFY;
+	sqe.nsid = nsid;
+	sqe.cdw10 = cns;
+	return nvme_admin(c, &sqe, page, PGSIZE, NULL);
+}
+
+static int nvme_wait_ready(struct nvme_ctlr *c, bool ready)
+{
+	uint64_t start = nsec();
+	uint32_t csts;
+
+	for (;;) {
+		csts = nvme_read32(c, NVME_CSTS);
+		if (csts == 0xffffffff)
+			return -1;
+		if (!!(csts & NVME_CSTS_RDY) == ready)
+			return 0;
+		if (nsec() - start > c->timeout_us * 1000ULL)
+			return -1;
+		udelay(1000);
+	}
+}
+
+/* Disables the controller, sets up the admin queue and turns it back on. */
+static int nvme_reset(struct nvme_ctlr *c)
+{
+	struct nvme_queue *aq = c->adminq;
+	uint32_t cc;
+
+	cc = nvme_read32(c, NVME_CC);
+	if (cc & NVME_CC_EN) {
+		nvme_write32(c, NVME_CC, cc & ~NVME_CC_EN);
+		if (nvme_wait_ready(c, FALSE)) {
+			printk("nvme: controller won't disable\n");
+			return -1;
+		}
+	}
+	nvme_write32(c, NVME_AQA, (aq->depth - 1) << 16 | (aq->depth - 1));
+	nvme_write64(c, NVME_ASQ, PADDR(aq->sq));
+	nvme_write64(c, NVME_ACQ, PADDR(aq->cq));
+	cc = NVME_CC_EN | NVME_CC_CSS_NVM | NVME_CC_MPS(PGSHIFT) | NVME_CC_AMS_RR
+	     | NVME_CC_IOSQES | NVME_CC_IOCQES;
+	nvme_write32(c, NVME_CC, cc);
+	if (nvme_wait_ready(c, TRUE)) {
+		printk("nvme: controller won't enable, csts %#x\n",
+		       nvme_read32(c, NVME_CSTS));
+		return -1;
+	}
+	return 0;
+}
+
+static int nvme_create_ioq(struct nvme_ctlr *c, struct nvme_queue *q, int iv)
+{
+	struct nvme_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = NVME_ADM_CREATE_CQ;
+	sqe.prp1 = PADDR(q->cq);
+	sqe.cdw10 = (q->depth - 1) << 16 | q->qid;
+	sqe.cdw11 = iv << 16 | NVME_CQ_IRQ_EN | NVME_Q_PHYS_CONTIG;
+	if (nvme_admin(c, &sqe, NULL, 0, NULL))
+		return -1;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = NVME_ADM_CREATE_SQ;
+	sqe.prp1 = PADDR(q->sq);
+	sqe.cdw10 = (q->depth - 1) << 16 | q->qid;
+	sqe.cdw11 = q->qid << 16 | NVME_Q_PHYS_CONTIG;
+	if (nvme_admin(c, &sqe, NULL, 0, NULL))
+		return -1;
+	return 0;
+}
+
+/*
+ * Asks for a queue pair per core, within what the controller and our vectors
+ * allow.  With MSI-X, vector 0 is for the admin queue and I/O queue i gets
+ * vector i + 1.  Otherwise they share vector 0.
+ */
+static int nvme_setup_ioqs(struct nvme_ctlr *c)
+{
+	struct nvme_sqe sqe;
+	uint32_t result;
+	int nr, depth;
+
+	nr = MIN(num_cores, NVME_MAXQ);
+	if (c->msix)
+		nr = MIN(nr, c->nvec - 1);
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = NVME_ADM_SET_FEATURES;
+	sqe.cdw10 = NVME_FEAT_NR_QUEUES;
+	sqe.cdw11 = (nr - 1) << 16 | (nr - 1);
+	if (nvme_admin(c, &sqe, NULL, 0, &result))
+		return -1;
+	nr = MIN(nr, (result & 0xffff) + 1);
+	nr = MIN(nr, (result >> 16) + 1);
+
+	depth = MIN(NVME_IO_DEPTH, NVME_CAP_MQES(c->cap) + 1);
+	c->ioq = kzmalloc(sizeof(struct nvme_queue) * nr, MEM_WAIT);
+	for (int i = 0; i < nr; i++) {
+		nvme_queue_init(c, &c->ioq[i], i + 1, depth, i);
+		if (nvme_create_ioq(c, &c->ioq[i], c->msix ? i + 1 : 0)) {
+			printk("nvme: couldn't create I/O queue %d\n", i + 1);
+			if (i == 0)
+				return -1;
+			nr = i;
+			break;
+		}
+	}
+	c->nr_ioq = nr;
+	return 0;
+}
+
+static void nvme_setup_ns(struct nvme_ctlr *c, uint32_t nn, uint8_t *page)
+{
+	struct nvme_ns *ns;
+	uint32_t lbaf;
+
+	for (uint32_t nsid = 1; nsid <= nn && c->nr_ns < NVME_MAXNS; nsid++) {
+		memset(page, 0, PGSIZE);
+		if (nvme_identify(c, nsid, NVME_ID_CNS_NS, page))
+			continue;
+		ns = &c->ns[c->nr_ns];
+		memcpy(&ns->sectors, page + NVME_IDNS_NSZE, sizeof(uint64_t));
+		if (!ns->sectors)
+			continue;	/* inactive */
+		memcpy(&lbaf, page + NVME_IDNS_LBAF
+		              + 4 * (page[NVME_IDNS_FLBAS] & 0xf), sizeof(lbaf));
+		ns->secsize = 1 << ((lbaf >> 16) & 0xff);
+		if (ns->secsize < 512 || ns->secsize > PGSIZE) {
+			printk("nvme: ns %d: unsupported block size %d\n", nsid,
+			       ns->secsize);
+			continue;
+		}
+		ns->nsid = nsid;
+		ns->changed = TRUE;
+		c->nr_ns++;
+	}
+}
+
+/* Brings up the controller with polled admin commands.  IRQs come in enable. */
+static int nvme_ctlr_init(struct nvme_ctlr *c)
+{
+	uint8_t *page;
+	uint32_t nn;
+	int ret = -1;
+
+	c->cap = nvme_read64(c, NVME_CAP);
+	c->timeout_us = MAX(NVME_CAP_TO(c->cap), 1) * 500 * 1000;
+	if (NVME_CAP_MPSMIN(c->cap) + 12 > PGSHIFT) {
+		printk("nvme: min page size too big, cap %p\n", c->cap);
+		return -1;
+	}
+	if (pci_msix_init(c->pci) == 0 && c->pci->msix_nr_vec > 1) {
+		c->msix = TRUE;
+		c->nvec = c->pci->msix_nr_vec;
+	} else {
+		c->nvec = 1;
+	}
+	c->adminq = kzmalloc(sizeof(struct nvme_queue), MEM_WAIT);
+	nvme_queue_init(c, c->adminq, 0, NVME_ADMIN_DEPTH, 0);
+	pci_set_bus_master(c->pci);
+	if (nvme_reset(c))
+		return -1;
+
+	page = kpage_zalloc_addr();
+	if (nvme_identify(c, 0, NVME_ID_CNS_CTRL, page)) {
+		printk("nvme: identify controller failed\n");
+		goto out;
+	}
+	nvme_idstr(c->serial, page + NVME_IDC_SN, 20);
+	nvme_idstr(c->model, page + NVME_IDC_MN, 40);
+	nvme_idstr(c->firmware, page + NVME_IDC_FR, 8);
+	c->maxxfer = SDmaxio;
+	if (page[NVME_IDC_MDTS])
+		c->maxxfer = MIN(c->maxxfer,
+		                 (size_t)PGSIZE << page[NVME_IDC_MDTS]);
+	/* The PRP list for a command is one page. */
+	c->maxxfer = MIN(c->maxxfer, NVME_PRPS_PER_CMD * PGSIZE);
+	memcpy(&nn, page + NVME_IDC_NN, sizeof(nn));
+
+	if (nvme_setup_ioqs(c)) {
+		printk("nvme: couldn't set up I/O queues\n");
+		goto out;
+	}
+	nvme_setup_ns(c, nn, page);
+	ret = 0;
+out:
+	kpages_free(page, PGSIZE);
+	return ret;
+}
+
+static int nvme_is_nvme(struct pci_device *p)
+{
+	/* mass storage, non-volatile memory, nvme */
+	return p->class == 0x01 && p->subclass == 0x08 && p->progif == 0x02;
+}
+
+static struct sdev *nvmepnp(void)
+{
+	struct pci_device *p;
+	struct nvme_ctlr *c;
+	struct sdev *s, *head = NULL, *tail = NULL;
+
+	STAILQ_FOREACH(p, &pci_devices, all_dev) {
+		if (!nvme_is_nvme(p))
+			continue;
+		if (nr_nvme_ctlrs == NVME_NCTLR) {
+			printk("nvme: too many controllers\n");
+			break;
+		}
+		c = kzmalloc(sizeof(struct nvme_ctlr), MEM_WAIT);
+		c->pci = p;
+		c->physio = pci_get_membar(p, 0);
+		c->regs = (void*)pci_map_membar(p, 0);
+		if (!c->regs) {
+			printk("nvme: %x:%x.%x: can't map BAR 0\n", p->bus, p->dev,
+			       p->func);
+			kfree(c);
+			continue;
+		}
+		if (nvme_ctlr_init(c) || !c->nr_ns) {
+			printk("nvme: %x:%x.%x: no usable namespaces\n", p->bus, p->dev,
+			       p->func);
+			/* The queues might still be live, so we leak c. */
+			continue;
+		}
+		s = kzmalloc(sizeof(struct sdev), MEM_WAIT);
+		kref_init(&s->r, fake_release, 1);
+		qlock_init(&s->ql);
+		qlock_init(&s->unitlock);
+		s->ifc = &sdnvmeifc;
+		s->idno = 'n' + nr_nvme_ctlrs;
+		s->ctlr = c;
+		s->nunit = c->nr_ns;
+		c->sdev = s;
+		nvme_ctlrs[nr_nvme_ctlrs++] = c;
+		printk("nvme: %x:%x.%x: %s, %d namespaces, %d I/O queues%s\n",
+		       p->bus, p->dev, p->func, c->model, c->nr_ns, c->nr_ioq,
+		       c->msix ? " with MSI-X" : "");
+		if (head)
+			tail->next = s;
+		else
+			head = s;
+		tail = s;
+	}
+	return head;
+}
+
+static int nvmeenable(struct sdev *s)
+{
+	struct nvme_ctlr *c = s->ctlr;
+	struct nvme_queue *q;
+	unsigned int tbdf = pci_to_tbdf(c->pci);
+	int vec;
+
+	if (c->enabled)
+		return 1;
+	c->enabled = TRUE;
+	/* The first register_irq grabs MSI-X entry 0, and so on in order. */
+	if (register_irq(c->pci->irqline, nvme_irq, c, tbdf)) {
+		printk("nvme: couldn't register an IRQ, polling only\n");
+		for (int i = 0; i < c->nr_ioq; i++)
+			c->ioq[i].no_irq = TRUE;
+		return 1;
+	}
+	if (!c->msix)
+		return 1;
+	for (int i = 0; i < c->nr_ioq; i++) {
+		q = &c->ioq[i];
+		/* The CQs were made for vectors i + 1, so without them, poll. */
+		if (!c->pci->msix_ready ||
+		    register_irq(c->pci->irqline, nvme_ioq_irq, q, tbdf)) {
+			printk("nvme: no IRQ for queue %d, polling it\n", q->qid);
+			q->no_irq = TRUE;
+			continue;
+		}
+		vec = irq_lookup_vector(nvme_ioq_irq, q);
+		if (vec < 0 || route_irqs(vec, q->core))
+			printk("nvme: couldn't route queue %d to core %d\n", q->qid,
+			       q->core);
+	}
+	return 1;
+}
+
+static int nvmeverify(struct sdunit *unit)
+{
+	struct nvme_ns *ns = unit_to_ns(unit);
+
+	memset(unit->inquiry, 0, sizeof(unit->inquiry));
+	unit->inquiry[2] = 2;
+	unit->inquiry[3] = 2;
+	unit->inquiry[4] = sizeof(unit->inquiry) - 4;
+	memmove(unit->inquiry + 8, unit_to_ctlr(unit)->model, 40);
+	return ns->nsid != 0;
+}
+
+static int nvmeonline(struct sdunit *unit)
+{
+	struct nvme_ns *ns = unit_to_ns(unit);
+
+	if (ns->changed) {
+		ns->changed = FALSE;
+		unit->sectors = ns->sectors;
+		unit->secsize = ns->secsize;
+		return 2;
+	}
+	return 1;
+}
+
+static struct nvme_queue *nvme_my_queue(struct nvme_ctlr *c)
+{
+	return &c->ioq[core_id() % c->nr_ioq];
+}
+
+static int nvme_rw(struct sdunit *unit, int write, void *data, uint32_t nb,
+                   uint64_t bno)
+{
+	struct nvme_ns *ns = unit_to_ns(unit);
+	struct nvme_queue *q = nvme_my_queue(unit_to_ctlr(unit));
+	struct nvme_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+	sqe.nsid = ns->nsid;
+	sqe.cdw10 = bno;
+	sqe.cdw11 = bno >> 32;
+	sqe.cdw12 = nb - 1;
+	return nvme_submit(q, &sqe, data, nb * unit->secsize,
+	                   ns->poll || q->no_irq, 0, NULL);
+}
+
+static int nvme_flush(struct sdunit *unit)
+{
+	struct nvme_ns *ns = unit_to_ns(unit);
+	struct nvme_queue *q = nvme_my_queue(unit_to_ctlr(unit));
+	struct nvme_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = NVME_CMD_FLUSH;
+	sqe.nsid = ns->nsid;
+	return nvme_submit(q, &sqe, NULL, 0, ns->poll || q->no_irq, 0, NULL);
+}
+
+static int32_t nvmebio(struct sdunit *unit, int lun, int write, void *data,
+                       int32_t nb, uint64_t bno)
+{
+	struct nvme_ctlr *c = unit_to_ctlr(unit);
+	uint32_t max = c->maxxfer / unit->secsize;
+	uint8_t *p = data;
+	uint32_t n;
+	int status;
+
+	while (nb > 0) {
+		n = MIN(nb, max);
+		status = nvme_rw(unit, write, p, n, bno);
+		if (status) {
+			printd("nvme: %s: %s error %#x at %llu\n", unit->sdperm.name,
+			       write ? "write" : "read", status, bno);
+			break;
+		}
+		p += n * unit->secsize;
+		bno += n;
+		nb -= n;
+	}
+	if (p == data && nb)
+		return -1;
+	return p - (uint8_t*)data;
+}
+
+static int nvmerio(struct sdreq *r)
+{
+	struct sdunit *unit = r->unit;
+	uint8_t *cmd = r->cmd;
+	uint64_t lba;
+	uint32_t count;
+	int32_t len;
+	int i;
+
+	if (cmd[0] == 0x35 || cmd[0] == 0x91) {
+		if (nvme_flush(unit) == 0)
+			return sdsetsense(r, SDok, 0, 0, 0);
+		return sdsetsense(r, SDcheck, 3, 0xc, 2);
+	}
+	if ((i = sdfakescsi(r, NULL, 0)) != SDnostatus) {
+		r->status = i;
+		return i;
+	}
+	switch (cmd[0]) {
+	case 0x28:
+	case 0x2a:
+		lba = (uint32_t)(cmd[2] << 24) | cmd[3] << 16 | cmd[4] << 8 | cmd[5];
+		count = cmd[7] << 8 | cmd[8];
+		break;
+	default:
+		lba = 0;
+		for (i = 2; i < 10; i++)
+			lba = lba << 8 | cmd[i];
+		count = (uint32_t)cmd[10] << 24 | cmd[11] << 16 | cmd[12] << 8
+		        | cmd[13];
+		break;
+	}
+	if (r->data == NULL)
+		return SDok;
+	count = MIN(count, r->dlen / unit->secsize);
+	len = nvmebio(unit, 0, r->write, r->data, count, lba);
+	if (len < 0) {
+		r->status = SDeio;
+		return SDeio;
+	}
+	r->rlen = len;
+	r->status = SDok;
+	return SDok;
+}
+
+static int nvmerctl(struct sdunit *unit, char *p, int l)
+{
+	struct nvme_ctlr *c = unit_to_ctlr(unit);
+	struct nvme_ns *ns = unit_to_ns(unit);
+	char *e = p + l, *op = p;
+	uint64_t cmds = 0, irqs = 0, polls = 0;
+
+	for (int i = 0; i < c->nr_ioq; i++) {
+		cmds += c->ioq[i].nr_cmds;
+		irqs += c->ioq[i].nr_irqs;
+		polls += c->ioq[i].nr_polls;
+	}
+	p = seprintf(p, e, "model\t%s\n", c->model);
+	p = seprintf(p, e, "serial\t%s\n", c->serial);
+	p = seprintf(p, e, "firm\t%s\n", c->firmware);
+	p = seprintf(p, e, "nsid\t%d\n", ns->nsid);
+	p = seprintf(p, e, "queues\t%d%s, depth %d, poll %s\n", c->nr_ioq,
+	             c->msix ? " msi-x" : "", c->ioq[0].depth,
+	             ns->poll ? "on" : "off");
+	p = seprintf(p, e, "stats\tcmds %llu irqs %llu polls %llu\n", cmds, irqs,
+	             polls);
+	p = seprintf(p, e, "geometry %llu %lu\n", ns->sectors, ns->secsize);
+	return p - op;
+}
+
+static int nvmewctl(struct sdunit *unit, struct cmdbuf *cmd)
+{
+	struct nvme_ns *ns = unit_to_ns(unit);
+	char **f = cmd->f;
+
+	if (strcmp(f[0], "poll") == 0) {
+		if (cmd->nf != 2)
+			error(EINVAL, "usage: poll on|off");
+		if (strcmp(f[1], "on") == 0)
+			ns->poll = TRUE;
+		else if (strcmp(f[1], "off") == 0)
+			ns->poll = FALSE;
+		else
+			error(EINVAL, "usage: poll on|off");
+	} else if (strcmp(f[0], "flushcache") == 0) {
+		if (nvme_flush(unit))
+			error(EIO, "nvme: flush failed");
+	} else {
+		error(EINVAL, "%s: unknown control '%s'", __func__, f[0]);
+	}
+	return 0;
+}
+
+static char *nvmertopctl(struct sdev *sdev, char *p, char *e)
+{
+	struct nvme_ctlr *c = sdev->ctlr;
+
+	return seprintf(p, e, "sd%c nvme %#p: vs %#x, %d I/O queues, %d vectors, maxxfer %lu\n",
+	                sdev->idno, c->physio, nvme_read32(c, NVME_VS), c->nr_ioq,
+	                c->nvec, c->maxxfer);
+}
+
+struct sdifc sdnvmeifc = {
+    "nvme",
+
+    nvmepnp,
+    NULL, /* legacy */
+    nvmeenable,
+    NULL, /* disable */
+
+    nvmeverify,
+    nvmeonline,
+    nvmerio,
+    nvmerctl,
+    nvmewctl,
+
+    nvmebio,
+    NULL, /* probe */
+    NULL, /* clear */
+    nvmertopctl,
+    NULL, /* wtopctl */
+};
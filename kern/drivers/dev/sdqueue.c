@@ -0,0 +1,272 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Block request queues for #sd units whose ifc can have several commands in
+ * flight (qdepth/submit, e.g. AHCI with NCQ).
+ *
+ * Callers put their requests on their core's submission queue, so submitters
+ * on different cores don't fight over a lock.  Whoever wins the 'dispatching'
+ * flag moves everything from the submission queues into the pending list,
+ * which is sorted by block, and issues commands until the unit is full.  While
+ * issuing, runs of pending requests that are adjacent on disk (and in the same
+ * direction) are merged into one command, up to SDnseg requests or SDmaxio.
+ *
+ * The ifc completes commands from its interrupt handler, as many as it finds
+ * at once, and then wakes all of the waiters with one sdqwakeup().  Waiters
+ * that wake up run the dispatcher again, which is how the rest of the pending
+ * requests get issued.
+ *
+ * If the unit can't queue right now (qdepth() == 0), the dispatcher just runs
+ * the pending requests through the ifc's bio, one at a time. */
+
+#include <assert.h>
+#include <error.h>
+#include <kmalloc.h>
+#include <pmap.h>
+#include <rendez.h>
+#include <smp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sd.h>
+
+struct sdsubq {
+	spinlock_t lock;
+	struct sdbreq_tailq reqs;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct sdqueue {
+	struct sdsubq *subqs; /* one per core */
+	atomic_t nqueued;     /* requests in the subqs */
+	atomic_t dispatching;
+	atomic_t inflight;    /* commands */
+	struct rendez rv;
+
+	/* owned by the dispatcher */
+	struct sdbreq_tailq pending;
+	uint64_t nreqs;
+	uint64_t ncmds;
+};
+
+void sdqinit(struct sdunit *unit)
+{
+	struct sdqueue *q;
+
+	if (unit->dev->ifc->submit == NULL || unit->q)
+		return;
+	q = kzmalloc(sizeof(struct sdqueue), MEM_WAIT);
+	q->subqs = kzmalloc(sizeof(struct sdsubq) * num_cores, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		spinlock_init(&q->subqs[i].lock);
+		TAILQ_INIT(&q->subqs[i].reqs);
+	}
+	TAILQ_INIT(&q->pending);
+	rendez_init(&q->rv);
+	unit->q = q;
+}
+
+/* Most requests come in ascending order, so we look from the back. */
+static void sdqsort(struct sdqueue *q, struct sdbreq *r)
+{
+	struct sdbreq *i;
+
+	TAILQ_FOREACH_REVERSE(i, &q->pending, sdbreq_tailq, link) {
+		if (i->bno <= r->bno) {
+			TAILQ_INSERT_AFTER(&q->pending, i, r, link);
+			return;
+		}
+	}
+	TAILQ_INSERT_HEAD(&q->pending, r, link);
+}
+
+static void sdqgather(struct sdqueue *q)
+{
+	struct sdsubq *sq;
+	struct sdbreq *r;
+
+	for (int i = 0; i < num_cores && atomic_read(&q->nqueued); i++) {
+		sq = &q->subqs[i];
+		if (TAILQ_EMPTY(&sq->reqs))
+			continue;
+		spin_lock(&sq->lock);
+		while ((r = TAILQ_FIRST(&sq->reqs))) {
+			TAILQ_REMOVE(&sq->reqs, r, link);
+			atomic_dec(&q->nqueued);
+			sdqsort(q, r);
+		}
+		spin_unlock(&sq->lock);
+	}
+}
+
+/* Pulls the pending requests that continue r's command behind it. */
+static void sdqmerge(struct sdqueue *q, struct sdbreq *r)
+{
+	struct sdbreq *next, *tail = r;
+	uint32_t maxnb = SDmaxio / r->unit->secsize;
+
+	r->cmdnb = r->nb;
+	r->cmdnseg = 1;
+	while ((next = TAILQ_FIRST(&q->pending))) {
+		if (next->write != r->write || next->bno != r->bno + r->cmdnb)
+			break;
+		if (r->cmdnseg == SDnseg || r->cmdnb + next->nb > maxnb)
+			break;
+		TAILQ_REMOVE(&q->pending, next, link);
+		tail->merged = next;
+		tail = next;
+		r->cmdnb += next->nb;
+		r->cmdnseg++;
+	}
+	tail->merged = NULL;
+}
+
+static void sdqissue(struct sdqueue *q, struct sdunit *unit)
+{
+	ERRSTACK(1);
+	struct sdifc *ifc = unit->dev->ifc;
+	struct sdbreq *r;
+	int depth, wake = 0;
+	int32_t l;
+
+	depth = MIN(ifc->qdepth(unit), SDqmax);
+	while ((r = TAILQ_FIRST(&q->pending))) {
+		if (depth && atomic_read(&q->inflight) >= depth)
+			break;
+		TAILQ_REMOVE(&q->pending, r, link);
+		q->ncmds++;
+		if (depth == 0) {
+			/* bio can throw, and it only takes one buffer, so no merging.
+			 * Partial transfers are OK, like with a direct bio. */
+			q->nreqs++;
+			if (waserror()) {
+				l = -1;
+			} else {
+				l = ifc->bio(unit, 0, r->write, r->data, r->nb, r->bno);
+			}
+			poperror();
+			r->rlen = l;
+			r->status = l < 0 ? SDeio : SDok;
+			wmb();
+			r->done = TRUE;
+			wake = 1;
+			continue;
+		}
+		sdqmerge(q, r);
+		q->nreqs += r->cmdnseg;
+		atomic_inc(&q->inflight);
+		if (ifc->submit(unit, r) != SDok) {
+			sdqcomplete(r, SDeio);
+			wake = 1;
+		}
+	}
+	if (wake)
+		sdqwakeup(unit);
+}
+
+static int sdqhaswork(struct sdqueue *q, struct sdunit *unit)
+{
+	int depth = MIN(unit->dev->ifc->qdepth(unit), SDqmax);
+
+	if (depth && atomic_read(&q->inflight) >= depth)
+		return 0;
+	return atomic_read(&q->nqueued) || !TAILQ_EMPTY(&q->pending);
+}
+
+static void sdqdispatch(struct sdqueue *q, struct sdunit *unit)
+{
+	do {
+		if (!atomic_cas(&q->dispatching, 0, 1))
+			return;
+		sdqgather(q);
+		sdqissue(q, unit);
+		/* the swap is a full barrier, so we'll see anything queued by
+		 * someone who lost the CAS to us. */
+		atomic_swap(&q->dispatching, 0);
+	} while (sdqhaswork(q, unit));
+}
+
+/*
+ * Called by the ifc, possibly from IRQ context, when a command is done.
+ * Don't touch the requests after this; their waiters might be gone.
+ */
+void sdqcomplete(struct sdbreq *r, int status)
+{
+	struct sdunit *unit = r->unit;
+	struct sdbreq *next;
+
+	for (; r; r = next) {
+		next = r->merged;
+		r->rlen = status == SDok ? r->nb * unit->secsize : -1;
+		r->status = status;
+		wmb();
+		r->done = TRUE;
+	}
+	atomic_dec(&unit->q->inflight);
+}
+
+void sdqwakeup(struct sdunit *unit)
+{
+	rendez_wakeup(&unit->q->rv);
+}
+
+static int sdqdone(void *arg)
+{
+	struct sdbreq *r = arg;
+
+	return r->done;
+}
+
+/*
+ * Same as the ifc's bio, but through the unit's queue.  Returns the number of
+ * bytes transferred, or -1 on error.
+ */
+int32_t sdqbio(struct sdunit *unit, int write, void *data, int32_t nb,
+               uint64_t bno)
+{
+	ERRSTACK(1);
+	struct sdqueue *q = unit->q;
+	struct sdsubq *sq;
+	struct sdbreq r;
+
+	if (q == NULL)
+		return unit->dev->ifc->bio(unit, 0, write, data, nb, bno);
+	memset(&r, 0, sizeof(r));
+	r.unit = unit;
+	r.write = write;
+	r.data = data;
+	r.nb = nb;
+	r.bno = bno;
+
+	sq = &q->subqs[core_id()];
+	spin_lock(&sq->lock);
+	TAILQ_INSERT_TAIL(&sq->reqs, &r, link);
+	atomic_inc(&q->nqueued);
+	spin_unlock(&sq->lock);
+	sdqdispatch(q, unit);
+
+	/* r is on our stack and the hardware might be DMAing into it, so we
+	 * can't bail out early, even if we're aborted. */
+	while (waserror())
+		poperror();
+	rendez_sleep(&q->rv, sdqdone, &r);
+	poperror();
+	rmb();
+	/* we might have been woken for someone else's completion, but either
+	 * way there might be room for more. */
+	if (sdqhaswork(q, unit))
+		sdqdispatch(q, unit);
+	if (r.status != SDok)
+		return -1;
+	return r.rlen;
+}
+
+char *sdqstats(struct sdunit *unit, char *p, char *e)
+{
+	struct sdqueue *q = unit->q;
+
+	if (q == NULL)
+		return p;
+	return seprintf(p, e, "queue depth %d inflight %d reqs %llu cmds %llu\n",
+	                unit->dev->ifc->qdepth(unit), atomic_read(&q->inflight),
+	                q->nreqs, q->ncmds);
+}
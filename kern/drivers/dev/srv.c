@@ -33,6 +33,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <sys/queue.h>
+#include <rhashtable.h>
 
 struct dev srvdevtab;
 
@@ -52,6 +53,8 @@ struct srvfile {
 	char *user;
 	uint32_t perm;
 	atomic_t opens;				/* used for exclusive open checks */
+	struct rhash_node hash_link;
+	struct rcu_head rcu;
 };
 
 struct srvfile *top_dir;
@@ -59,22 +62,46 @@ TAILQ_HEAD(srvfilelist, srvfile) srvfiles = TAILQ_HEAD_INITIALIZER(srvfiles);
 /* the lock protects the list and its members.  we don't incref from a list ref
  * without the lock. (if you're on the list, we can grab a ref). */
 spinlock_t srvlock = SPINLOCK_INITIALIZER;
+/* The same srvfiles, hashed by address, for checking an uncounted ref without
+ * the lock.  srvfiles are RCU-freed. */
+static struct rhashtable srv_hash;
+
+static uint32_t srv_hash_key(const void *key)
+{
+	return (uintptr_t)key >> 4;
+}
+
+static uint32_t srv_hash_obj(const void *obj)
+{
+	return (uintptr_t)obj >> 4;
+}
+
+static bool srv_key_eq(const void *key, const void *obj)
+{
+	return key == obj;
+}
+
+static const struct rhashtable_params srv_hash_params = {
+	.node_offset = offsetof(struct srvfile, hash_link),
+	.hash_key = srv_hash_key,
+	.hash_obj = srv_hash_obj,
+	.key_eq = srv_key_eq,
+};
 
 atomic_t nr_srvs = 0;			/* debugging - concerned about leaking mem */
 
-/* Given a pointer (internal ref), we attempt to get a kref */
+/* Given a pointer (internal ref), we attempt to get a kref.  We don't touch srv
+ * unless it is in the hash: it might have been freed. */
 static bool grab_ref(struct srvfile *srv)
 {
 	bool ret = FALSE;
 	struct srvfile *srv_i;
-	spin_lock(&srvlock);
-	TAILQ_FOREACH(srv_i, &srvfiles, link) {
-		if (srv_i == srv) {
-			ret = kref_get_not_zero(&srv_i->ref, 1);
-			break;
-		}
-	}
-	spin_unlock(&srvlock);
+
+	rcu_read_lock();
+	srv_i = rhashtable_lookup(&srv_hash, srv);
+	if (srv_i)
+		ret = kref_get_not_zero(&srv_i->ref, 1);
+	rcu_read_unlock();
 	return ret;
 }
 
@@ -85,7 +112,8 @@ static void srv_release(struct kref *kref)
 	kfree(srv->name);
 	if (srv->chan)
 		cclose(srv->chan);
-	kfree(srv);
+	/* grab_ref() could be looking at our kref */
+	kfree_rcu(srv, rcu);
 	atomic_dec(&nr_srvs);
 }
 
@@ -124,6 +152,7 @@ static int srvgen(struct chan *c, char *name, struct dirtab *tab,
 
 static void __srvinit(void)
 {
+	rhashtable_init(&srv_hash, &srv_hash_params);
 	top_dir = kzmalloc(sizeof(struct srvfile), MEM_WAIT);
 	/* kstrdup, just in case we free this later */
 	kstrdup(&top_dir->name, "srv");
@@ -238,6 +267,7 @@ static void srvcreate(struct chan *c, char *name, int omode, uint32_t perm,
 	kref_init(&srv->ref, srv_release, 1);
 	spin_lock(&srvlock);
 	TAILQ_INSERT_TAIL(&srvfiles, srv, link);
+	rhashtable_insert(&srv_hash, srv);
 	spin_unlock(&srvlock);
 	atomic_inc(&nr_srvs);
 }
@@ -250,6 +280,7 @@ static void srvremove(struct chan *c)
 	TAILQ_FOREACH_SAFE(srv_i, &srvfiles, link, temp) {
 		if (srv_i == c->aux) {
 			TAILQ_REMOVE(&srvfiles, srv_i, link);
+			rhashtable_remove(&srv_hash, srv_i);
 			break;
 		}
 	}
@@ -16,7 +16,13 @@
  * - The root tree_file will not be deleted so long as you have an open chan.
  *   Any open chan on a subdir/subfile will hold refs on the root.  The mount
  *   point will also hold those refs.  We also hold an additional +1 on the root
- *   TF, which we drop once we have no users and we've purged the tree. */
+ *   TF, which we drop once we have no users and we've purged the tree.
+ * - Attach with #tmpfs.huge to back files with jumbo pages.  The page cache is
+ *   filled a jumbo at a time, and shared mmaps of aligned ranges get jumbo
+ *   PTEs.  Small files will eat 2MB each, so this is for big ones.
+ * - Under memory pressure, regular (not huge) instances evict their cold pages
+ *   into the compressed page store (zstore.h).  writepage stores the page,
+ *   readpage gets it back.  Each file's zstore_map hangs off its fs_file. */
 
 #include <ns.h>
 #include <kmalloc.h>
@@ -27,6 +33,7 @@
 #include <tree_file.h>
 #include <pmap.h>
 #include <cpio.h>
+#include <zstore.h>
 
 struct dev tmpfs_devtab;
 
@@ -34,8 +41,22 @@ struct tmpfs {
 	struct tree_filesystem		tfs;
 	atomic_t					qid;
 	struct kref					users;
+	bool						huge;
+	struct zstore_evictor		evictor;
+	size_t						evict_budget;
+	size_t						nr_evicted;
+	/* Eviction's clock hand over the files, in DFS order.  Files come and go
+	 * between passes, so this is only approximately where we left off. */
+	size_t						evict_pos;
+	size_t						evict_seen;
+	size_t						evict_lo;
+	size_t						evict_hi;
 };
 
+#define TMPFS_JUMBO_NR_PGS		(PML2_PTE_REACH >> PGSHIFT)
+/* Most pages an instance looks at per eviction pass */
+#define TMPFS_EVICT_BATCH		4096
+
 static uint64_t tmpfs_get_qid_path(struct tmpfs *tmpfs)
 {
 	return atomic_fetch_and_add(&tmpfs->qid, 1);
@@ -48,7 +69,7 @@ static char *devname(void)
 
 static void tmpfs_tf_free(struct tree_file *tf)
 {
-	/* We have nothing special hanging off the TF */
+	zstore_map_free(tf->file.priv);
 }
 
 static void tmpfs_tf_unlink(struct tree_file *parent, struct tree_file *child)
@@ -104,11 +125,18 @@ struct tree_file_ops tmpfs_tf_ops = {
 };
 
 /* Fills page with its contents from its backing store file.  For KFS, that
- * means we're creating or extending a file, and the contents are 0.  Note the
- * page/offset might be beyond the current file length, based on the current
- * pagemap code. */
+ * means we're creating or extending a file, and the contents are 0, unless we
+ * evicted the page into the zstore.  Note the page/offset might be beyond the
+ * current file length, based on the current pagemap code. */
 static int tmpfs_pm_readpage(struct page_map *pm, struct page *pg)
 {
+	struct fs_file *f = pm->pm_file;
+
+	if (zstore_load(READ_ONCE(f->priv), pg->pg_index, page2kva(pg))) {
+		/* The zstore forgot its copy, so this page is the only one. */
+		atomic_or(&pg->pg_flags, PG_UPTODATE | PG_DIRTY);
+		return 0;
+	}
 	memset(page2kva(pg), 0, PGSIZE);
 	atomic_or(&pg->pg_flags, PG_UPTODATE);
 	/* Pretend that we blocked while filing this page.  This catches a lot of
@@ -120,14 +148,77 @@ static int tmpfs_pm_readpage(struct page_map *pm, struct page *pg)
 }
 
 /* Meant to take the page from PM and flush to backing store.  There is no
- * backing store. */
+ * backing store, other than the zstore when the page is being evicted.  Either
+ * way, if we fail, the page stays dirty in the PM.
+ *
+ * The PM is qlocked, so no one else is setting up f's zstore_map. */
 static int tmpfs_pm_writepage(struct page_map *pm, struct page *pg)
 {
-	return 0;
+	struct fs_file *f = pm->pm_file;
+	struct zstore_map *zm = f->priv;
+
+	if (!(atomic_read(&pg->pg_flags) & PG_RECLAIM))
+		return -EAGAIN;
+	if (!zstore_is_on())
+		return -EOPNOTSUPP;
+	if (!zm) {
+		zm = zstore_map_alloc(MEM_ATOMIC);
+		if (!zm)
+			return -ENOMEM;
+		WRITE_ONCE(f->priv, zm);
+	}
+	return zstore_store(zm, pg->pg_index, page2kva(pg));
+}
+
+/* For huge tmpfs, we fill the PM with the pieces of a zeroed jumbo page,
+ * aligned so that mm.c can map the whole thing with one PTE.  If any of the
+ * pages are already there (e.g. someone raced with us or part of it was
+ * evicted), we bail and the PM will fall back to readpage. */
+static int tmpfs_pm_populate(struct page_map *pm, unsigned long index)
+{
+	struct tree_file *tf = (struct tree_file*)pm->pm_file;
+	struct tmpfs *tmpfs = (struct tmpfs*)tf->tfs;
+	unsigned long base = ROUNDDOWN(index, TMPFS_JUMBO_NR_PGS);
+	struct page **pgs, *head;
+	void *kva;
+	int ret;
+
+	if (!tmpfs->huge)
+		return -EOPNOTSUPP;
+	pgs = kmalloc(sizeof(struct page*) * TMPFS_JUMBO_NR_PGS, MEM_ATOMIC);
+	if (!pgs)
+		return -ENOMEM;
+	kva = jumbo_page_alloc(1, MEM_ATOMIC);
+	if (!kva) {
+		kfree(pgs);
+		return -ENOMEM;
+	}
+	memset(kva, 0, PML2_PTE_REACH);
+	jumbo_page_split(kva);
+	head = kva2page(kva);
+	for (int i = 0; i < TMPFS_JUMBO_NR_PGS; i++) {
+		pgs[i] = &head[i];
+		atomic_set(&pgs[i]->pg_flags, PG_JUMBO | PG_UPTODATE | PG_PAGEMAP);
+		atomic_set(&pgs[i]->pg_ext_refs, 1);	/* the PM's ref */
+		sem_init(&pgs[i]->pg_sem, 1);
+	}
+	ret = pm_insert_pages(pm, base, pgs, TMPFS_JUMBO_NR_PGS);
+	for (int i = 0; i < TMPFS_JUMBO_NR_PGS; i++) {
+		if (ret) {
+			atomic_set(&pgs[i]->pg_flags, PG_JUMBO);
+			page_decref(pgs[i]);
+		} else {
+			pm_put_page(pgs[i]);
+		}
+	}
+	kfree(pgs);
+	return ret;
 }
 
 static void tmpfs_fs_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
 {
+	zstore_drop_range(READ_ONCE(f->priv), begin >> PGSHIFT,
+	                  (end - begin) >> PGSHIFT);
 }
 
 static bool tmpfs_fs_can_grow_to(struct fs_file *f, size_t len)
@@ -139,6 +230,7 @@ static bool tmpfs_fs_can_grow_to(struct fs_file *f, size_t len)
 struct fs_file_ops tmpfs_fs_ops = {
 	.readpage = tmpfs_pm_readpage,
 	.writepage = tmpfs_pm_writepage,
+	.populate = tmpfs_pm_populate,
 	.punch_hole = tmpfs_fs_punch_hole,
 	.can_grow_to = tmpfs_fs_can_grow_to,
 };
@@ -149,10 +241,59 @@ static void purge_cb(struct tree_file *tf)
 	tf_kref_put(tf);
 }
 
+static void evict_dfs_cb(struct tree_file *tf)
+{
+	struct tmpfs *tmpfs = (struct tmpfs*)tf->tfs;
+	size_t nr, pos;
+
+	if (tree_file_is_dir(tf))
+		return;
+	pos = tmpfs->evict_seen++;
+	if (!tmpfs->evict_budget || pos < tmpfs->evict_lo ||
+	    pos >= tmpfs->evict_hi)
+		return;
+	nr = MIN(tmpfs->evict_budget, tf->file.pm->pm_num_pages);
+	tmpfs->evict_budget -= nr;
+	tmpfs->nr_evicted += pm_evict_cold_pages(tf->file.pm, nr);
+	/* If we ran out partway through this file, its PM remembers where, and
+	 * the next pass resumes with it.  Otherwise we resume with the next file. */
+	if (!tmpfs->evict_budget)
+		tmpfs->evict_pos = nr < tf->file.pm->pm_num_pages ? pos : pos + 1;
+}
+
+static void tmpfs_evict_range(struct tmpfs *tmpfs, size_t lo, size_t hi)
+{
+	tmpfs->evict_seen = 0;
+	tmpfs->evict_lo = lo;
+	tmpfs->evict_hi = hi;
+	tfs_frontend_for_each(&tmpfs->tfs, evict_dfs_cb);
+}
+
+/* Called by the zstore's ktask, one pass at a time. */
+static size_t tmpfs_evict(struct zstore_evictor *ze)
+{
+	struct tmpfs *tmpfs = container_of(ze, struct tmpfs, evictor);
+
+	size_t start = tmpfs->evict_pos;
+
+	tmpfs->evict_budget = TMPFS_EVICT_BATCH;
+	tmpfs->nr_evicted = 0;
+	tmpfs_evict_range(tmpfs, start, SIZE_MAX);
+	if (tmpfs->evict_budget && start)
+		tmpfs_evict_range(tmpfs, 0, start);
+	/* Leftover budget means we looked at every file; start over next time. */
+	if (tmpfs->evict_budget)
+		tmpfs->evict_pos = 0;
+	return tmpfs->nr_evicted;
+}
+
 static void tmpfs_release(struct kref *kref)
 {
 	struct tmpfs *tmpfs = container_of(kref, struct tmpfs, users);
 
+	/* Waits out any eviction pass that is walking our tree */
+	if (!tmpfs->huge)
+		zstore_unregister_evictor(&tmpfs->evictor);
 	tfs_frontend_purge(&tmpfs->tfs, purge_cb);
 	/* this is the ref from attach */
 	assert(kref_refcnt(&tmpfs->tfs.root->kref) == 1);
@@ -188,6 +329,7 @@ static struct chan *tmpfs_attach(char *spec)
 	/* All distinct chans get a ref on the filesystem, so that we can destroy it
 	 * when the last user disconnects/closes. */
 	kref_init(&tmpfs->users, tmpfs_release, 1);
+	tmpfs->huge = spec && !strcmp(spec, "huge");
 
 	/* This gives us one ref on root, dropped during tmpfs_release(). */
 	tfs_init(tfs);
@@ -197,6 +339,12 @@ static struct chan *tmpfs_attach(char *spec)
 	/* This gives us an extra refcnt on tfs->root.  This is "+1 for existing."
 	 * It is decreffed during the purge CB. */
 	__tmpfs_tf_init(tfs->root, &tmpfs_devtab - devtab, 0, &eve, DMDIR | 0777);
+	/* Huge instances' pages are pieces of jumbo pages, which we can't free one
+	 * at a time. */
+	if (!tmpfs->huge) {
+		tmpfs->evictor.evict = tmpfs_evict;
+		zstore_register_evictor(&tmpfs->evictor);
+	}
 	/* This also increfs, copying tfs->root's ref for the chan it returns. */
 	return tree_file_alloc_chan(tfs->root, &tmpfs_devtab, "#tmpfs");
 }
@@ -270,7 +418,7 @@ struct dev tmpfs_devtab __devtab = {
 	.create = tree_chan_create,
 	.close = tmpfs_close,
 	.read = tree_chan_read,
-	.bread = devbread,
+	.bread = tree_chan_bread,
 	.write = tree_chan_write,
 	.bwrite = devbwrite,
 	.remove = tmpfs_remove,
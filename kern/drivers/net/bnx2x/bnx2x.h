@@ -585,6 +585,7 @@ struct bnx2x_fastpath {
 	__le16			*rx_cons_sb;
 	unsigned long		rx_pkt,
 				rx_calls;
+	int			core;		/* AKAROS_PORT: where our MSI-X vector goes */
 
 	/* TPA related */
 	struct bnx2x_agg_info	*tpa_info;
@@ -1781,6 +1781,15 @@ static int bnx2x_req_msix_irqs(struct bnx2x *bp)
 			bnx2x_free_msix_irqs(bp, offset);
 			return -EBUSY;
 		}
+		/* AKAROS_PORT: each fastpath's IRQ, and thus its poll KMSG, goes to
+		 * its own core.  Its tx queue is the one that core's sends use. */
+		fp->core = i % num_cores;
+		rc = irq_lookup_vector(bnx2x_msix_fp_int, fp);
+		if (rc < 0 || route_irqs(rc, fp->core)) {
+			BNX2X_ERR("couldn't route fp #%d irq to core %d\n", i,
+				  fp->core);
+			fp->core = 0;
+		}
 
 		offset++;
 	}
@@ -3818,7 +3827,6 @@ netdev_tx_t bnx2x_start_xmit(struct block *block,
 #endif
 
 	txq_index = txdata->txq_index;
-	assert(txq_index == 0);	// AKAROS_PORT til we get multi-queue working
 	assert(txdata == &bp->bnx2x_txq[txq_index]);
 
 	assert(!(txq_index >= MAX_ETH_TXQ_IDX(bp) + (CNIC_LOADED(bp) ? 1 : 0)));
@@ -1125,8 +1125,13 @@ static inline void bnx2x_init_txdata(struct bnx2x *bp,
 	/* Poke function - ghetto extern from bnx2x_dev.c */
 	extern void __bnx2x_tx_queue(void *txdata_arg);
 	poke_init(&txdata->poker, __bnx2x_tx_queue);
-	/* TODO: AKAROS_PORT multi queue: assign proper oq */
-	txdata->oq = bp->edev->oq;
+	/* AKAROS_PORT: devether has an oq for each eth txq, and hashes each flow
+	 * to one of them.  Only this txq's poker drains it, so a flow stays in
+	 * order on one ring.  The other CoS txqs and FCoE get no oq. */
+	if (!IS_FCOE_FP(fp) && txq_index < bp->edev->nr_txq)
+		txdata->oq = bp->edev->txqs[txq_index].oq;
+	else
+		txdata->oq = NULL;
 
 	DP(NETIF_MSG_IFUP, "created tx data cid %d, txq %d\n",
 	   txdata->cid, txdata->txq_index);
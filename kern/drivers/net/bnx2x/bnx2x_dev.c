@@ -82,6 +82,14 @@ static long bnx2x_ifstat(struct ether *edev, void *a, long n, uint32_t offset)
 	/* TODO: then print out the software-only (ctlr) stats */
 //	l += snprintf(p + l, READSTR - l, "lintr: %ud %ud\n",
 //				  ctlr->lintr, ctlr->lsleep);
+	for_each_eth_queue(ctlr, i) {
+		struct bnx2x_fastpath *fp = &ctlr->fp[i];
+
+		l += snprintf(p + l, READSTR - l,
+		              "fp %d core %d: rx_pkt %lu rx_calls %lu tx_pkt %lu\n",
+		              i, fp->core, fp->rx_pkt, fp->rx_calls,
+		              fp->txdata_ptr[0] ? fp->txdata_ptr[0]->tx_pkt : 0);
+	}
 	n = readstr(offset, a, n, p);
 	kfree(p);
 	qunlock(&ctlr->slock);
@@ -161,10 +169,9 @@ void __bnx2x_tx_queue(void *txdata_arg)
 	struct block *block;
 	struct queue *oq = txdata->oq;
 
-	/* TODO: avoid bugs til multi-queue is working */
-	assert(oq);
-	assert(txdata->txq_index == 0);
-
+	/* tx_int pokes txqs that devether never sends on */
+	if (!oq)
+		return;
 	while ((block = qget(oq))) {
 		if ((bnx2x_start_xmit(block, txdata) != NETDEV_TX_OK)) {
 			/* all queue readers are sync'd by the poke, so we can putback
@@ -184,17 +191,28 @@ void __bnx2x_tx_queue(void *txdata_arg)
 	}
 }
 
-static void bnx2x_transmit(struct ether *edev)
+/* devether put a block on its txq's oq, which belongs to eth txq txq_index.
+ * Each flow hashes to one txq, so its blocks go out in order on one ring. */
+static void bnx2x_transmit_q(struct ether *edev, int txq_index)
 {
 	struct bnx2x *ctlr = edev->ctlr;
 	struct bnx2x_fp_txdata *txdata;
-	/* TODO: determine the tx queue we're supposed to work on */
-	int txq_index = 0;
 
+	if (txq_index >= BNX2X_NUM_ETH_QUEUES(ctlr))
+		txq_index = 0;
 	txdata = &ctlr->bnx2x_txq[txq_index];
 	poke(&txdata->poker, txdata);
 }
 
+/* Kicks every eth txq */
+static void bnx2x_transmit(struct ether *edev)
+{
+	struct bnx2x *ctlr = edev->ctlr;
+
+	for (int i = 0; i < BNX2X_NUM_ETH_QUEUES(ctlr); i++)
+		poke(&ctlr->bnx2x_txq[i].poker, &ctlr->bnx2x_txq[i]);
+}
+
 /* Not mandatory.  Called to make sure there are free blocks available for
  * incoming packets */
 static void bnx2x_replenish(struct bnx2x *ctlr)
@@ -435,6 +453,7 @@ static int bnx2x_pnp(struct ether *edev)
 	 */
 	edev->attach = bnx2x_attach;
 	edev->transmit = bnx2x_transmit;
+	edev->transmit_q = bnx2x_transmit_q;
 	edev->ifstat = bnx2x_ifstat;
 	edev->ctl = bnx2x_ctl;
 	edev->shutdown = bnx2x_shutdown;
@@ -444,6 +463,8 @@ static int bnx2x_pnp(struct ether *edev)
 	edev->multicast = NULL;
 
 	bnx2x_reset(ctlr);
+	/* init_one picked the number of queues.  devether opens an oq for each. */
+	edev->nr_txq = BNX2X_NUM_ETH_QUEUES(ctlr);
 
 	return 0;
 }
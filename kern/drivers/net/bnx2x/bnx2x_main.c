@@ -12223,6 +12223,7 @@ static int bnx2x_init_bp(struct bnx2x *bp)
 	bp->current_interval = CHIP_REV_IS_SLOW(bp) ? 5*HZ : HZ;
 
 	init_awaiter(&bp->timer, bnx2x_timer_wrapper);
+	set_awaiter_slack(&bp->timer, ALARM_SLACK_LAZY);
 
 	if (SHMEM2_HAS(bp, dcbx_lldp_params_offset) &&
 	    SHMEM2_HAS(bp, dcbx_lldp_dcbx_stat_offset) &&
@@ -508,6 +508,23 @@ enum {
 	Slop = 32,	/* for vlan headers, crcs, etc. */
 };
 
+/*
+ * Interrupt moderation.  Under load, the rproc polls the ring with rx
+ * interrupts off, Rxbudget packets at a time, until a pass comes up short.
+ * In adaptive mode, the interrupt rate (Itr) follows the packet rate, which
+ * we measure every Rateus.
+ */
+enum {
+	Rxbudget = 64,
+	Rateus = 100000,
+	Itradaptive = -1,
+	Itrlowlat = 70000,	/* interrupts/sec, below Pktlowlat */
+	Itrmid = 20000,
+	Itrbulk = 4000,	/* above Pktbulk */
+	Pktlowlat = 10000,	/* packets/sec */
+	Pktbulk = 100000,
+};
+
 enum {
 	Iany = -1,
 	i82563,
@@ -623,6 +640,14 @@ struct ctlr {
 	unsigned int rdt;			/* receive descriptor tail */
 	int rdtr;					/* receive delay timer ring value */
 	int radv;					/* receive interrupt absolute delay timer */
+	unsigned int rbudget;		/* rproc passes that used up the budget */
+	int itrmode;				/* Itradaptive, or a fixed interrupts/sec */
+	unsigned int itr;			/* current interrupts/sec, 0 for no limit */
+	uint64_t ratetsc;			/* start of the rate interval */
+	unsigned int ratepkts;
+	unsigned int rateintr;		/* rintr at ratetsc */
+	unsigned int pktrate;		/* packets/sec, last interval */
+	unsigned int intrrate;		/* rx interrupts/sec, last interval */
 
 	struct rendez trendez;
 	qlock_t tlock;
@@ -789,6 +814,11 @@ static long i82563ifstat(struct ether *edev, void *a, long n, uint32_t offset)
 
 	p = seprintf(p, e, "lintr: %ud %ud\n", ctlr->lintr, ctlr->lsleep);
 	p = seprintf(p, e, "rintr: %ud %ud\n", ctlr->rintr, ctlr->rsleep);
+	p = seprintf(p, e, "rbudget: %ud\n", ctlr->rbudget);
+	p = seprintf(p, e, "rate: %ud pkts/s %ud intr/s\n", ctlr->pktrate,
+				 ctlr->intrrate);
+	p = seprintf(p, e, "itr: %ud%s\n", ctlr->itr,
+				 ctlr->itrmode == Itradaptive ? " adaptive" : "");
 	p = seprintf(p, e, "tintr: %ud %ud\n", ctlr->tintr, ctlr->txdw);
 	p = seprintf(p, e, "ixcs: %ud %ud %ud\n", ctlr->ixsm, ctlr->ipcs,
 				 ctlr->tcpcs);
@@ -820,11 +850,51 @@ static long i82563ifstat(struct ether *edev, void *a, long n, uint32_t offset)
 	return n;
 }
 
+/* Sets the interrupt throttling rate, in interrupts/sec, 0 for no limit. */
+static void i82563setitr(struct ctlr *ctlr, unsigned int itr)
+{
+	ctlr->itr = itr;
+	/* Itr counts the minimum interval in 256ns units */
+	csr32w(ctlr, Itr, itr ? 1000000000 / (itr * 256) : 0);
+}
+
+/*
+ * Called by the rproc after each batch.  Every Rateus, updates the packet and
+ * interrupt rates and, in adaptive mode, picks the Itr for the packet rate.
+ */
+static void i82563rate(struct ctlr *ctlr, int n)
+{
+	uint64_t now, us;
+	unsigned int itr;
+
+	ctlr->ratepkts += n;
+	now = read_tsc();
+	us = tsc2usec(now - ctlr->ratetsc);
+	if (us < Rateus)
+		return;
+	ctlr->pktrate = (uint64_t)ctlr->ratepkts * 1000000 / us;
+	ctlr->intrrate = (uint64_t)(ctlr->rintr - ctlr->rateintr) * 1000000 / us;
+	ctlr->ratepkts = 0;
+	ctlr->rateintr = ctlr->rintr;
+	ctlr->ratetsc = now;
+	if (ctlr->itrmode != Itradaptive)
+		return;
+	if (ctlr->pktrate < Pktlowlat)
+		itr = Itrlowlat;
+	else if (ctlr->pktrate < Pktbulk)
+		itr = Itrmid;
+	else
+		itr = Itrbulk;
+	if (itr != ctlr->itr)
+		i82563setitr(ctlr, itr);
+}
+
 enum {
 	CMrdtr,
 	CMradv,
 	CMpause,
 	CMan,
+	CMitr,
 };
 
 static struct cmdtab i82563ctlmsg[] = {
@@ -832,6 +902,7 @@ static struct cmdtab i82563ctlmsg[] = {
 	{CMradv, "radv", 2},
 	{CMpause, "pause", 1},
 	{CMan, "an", 1},
+	{CMitr, "itr", 2},
 };
 
 static long i82563ctl(struct ether *edev, void *buf, long n)
@@ -875,6 +946,18 @@ static long i82563ctl(struct ether *edev, void *buf, long n)
 		case CMan:
 			csr32w(ctlr, Ctrl, csr32r(ctlr, Ctrl) | Lrst | Phyrst);
 			break;
+		case CMitr:
+			/* "itr adaptive", or a fixed interrupts/sec, 0 for no limit */
+			if (!strcmp(cb->f[1], "adaptive")) {
+				ctlr->itrmode = Itradaptive;
+				break;
+			}
+			v = strtoul(cb->f[1], &p, 0);
+			if (*p || p == cb->f[1] || v > 1000000)
+				error(EINVAL, ERROR_FIXME);
+			ctlr->itrmode = v;
+			i82563setitr(ctlr, v);
+			break;
 	}
 	kfree(cb);
 	poperror();
@@ -1189,9 +1272,15 @@ static void i82563rxinit(struct ctlr *ctlr)
 	csr32w(ctlr, Rdh, 0);
 	csr32w(ctlr, Rdt, 0);
 
-	/* to hell with interrupt moderation, we want low latency */
+	/* to hell with interrupt moderation, we want low latency.  Itr, in
+	 * adaptive mode, only backs off as the packet rate goes up. */
 	csr32w(ctlr, Rdtr, 0);
 	csr32w(ctlr, Radv, 0);
+	if (ctlr->itrmode == Itradaptive)
+		i82563setitr(ctlr, Itrlowlat);
+	else
+		i82563setitr(ctlr, ctlr->itrmode);
+	ctlr->ratetsc = read_tsc();
 
 	for (i = 0; i < Nrd; i++) {
 		bp = ctlr->rb[i];
@@ -1260,7 +1349,7 @@ static void i82563rproc(void *arg)
 	struct rd *rd;
 	struct block *bp;
 	struct ctlr *ctlr;
-	int rdh, rim, passed;
+	int rdh, rim, passed, n;
 	struct ether *edev;
 
 	edev = arg;
@@ -1280,14 +1369,30 @@ static void i82563rproc(void *arg)
 		ctlr->rsleep++;
 		rendez_sleep(&ctlr->rrendez, i82563rim, ctlr);
 
+		/*
+		 * The interrupt handler masked the rx interrupts.  They stay off
+		 * while each pass fills its budget; other kthreads get to run
+		 * between passes.
+		 */
 		rdh = ctlr->rdh;
 		passed = 0;
+		n = 0;
 		for (;;) {
 			rim = ctlr->rim;
 			ctlr->rim = 0;
 			rd = &ctlr->rdba[rdh];
-			if (!(rd->status & Rdd))
+			if (!(rd->status & Rdd)) {
+				i82563rate(ctlr, n);
 				break;
+			}
+			if (n == Rxbudget) {
+				i82563rate(ctlr, n);
+				n = 0;
+				ctlr->rbudget++;
+				kthread_yield();
+				continue;
+			}
+			n++;
 
 			/*
 			 * Accept eop packets with no errors.
@@ -2152,6 +2257,7 @@ static void i82563pci(void)
 		ctlr->type = type;
 		ctlr->nic = mem;
 		ctlr->phynum = -1;	/* not yet known */
+		ctlr->itrmode = Itradaptive;
 
 		qlock_init(&ctlr->alock);
 		spinlock_init_irqsave(&ctlr->imlock);
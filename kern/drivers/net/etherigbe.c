@@ -80,6 +80,7 @@ enum {
 	Icr		= 0x000000C0,	/* Interrupt Cause Read */
 	Ics		= 0x000000C8,	/* Interrupt Cause Set */
 	Ims		= 0x000000D0,	/* Interrupt Mask Set/Read */
+	Itr		= 0x000000C4,	/* Interrupt Throttling Rate */
 	Imc		= 0x000000D8,	/* Interrupt mask Clear */
 	Rctl		= 0x00000100,	/* Receive Control */
 	Fcttv		= 0x00000170,	/* Flow Control Transmit Timer Value */
@@ -468,6 +469,23 @@ enum {
 	Rbsz		= 2048,
 };
 
+/*
+ * Interrupt moderation.  Under load, the rproc polls the ring with rx
+ * interrupts off, Rxbudget packets at a time, until a pass comes up short.
+ * In adaptive mode, the interrupt rate (Itr) follows the packet rate, which
+ * we measure every Rateus.
+ */
+enum {
+	Rxbudget	= 64,
+	Rateus		= 100000,
+	Itradaptive	= -1,
+	Itrlowlat	= 70000,	/* interrupts/sec, below Pktlowlat */
+	Itrmid		= 20000,
+	Itrbulk		= 4000,		/* above Pktbulk */
+	Pktlowlat	= 10000,	/* packets/sec */
+	Pktbulk		= 100000,
+};
+
 struct ctlr {
 	int	port;
 	struct pci_device *pci;
@@ -511,6 +529,17 @@ struct ctlr {
 
 	struct rendez	rrendez;
 	int	rim;
+	qlock_t	rlock;			/* rx ring: rproc vs. busy pollers */
+	int	rxon;			/* rx ring is set up, for pollers */
+	unsigned int	rpoll;		/* packets received by busy pollers */
+	unsigned int	rbudget;	/* rproc passes that used up the budget */
+	int	itrmode;		/* Itradaptive, or a fixed interrupts/sec */
+	unsigned int	itr;		/* current interrupts/sec, 0 for no limit */
+	uint64_t	ratetsc;		/* start of the rate interval */
+	unsigned int	ratepkts;
+	unsigned int	rateintr;		/* rintr at ratetsc */
+	unsigned int	pktrate;		/* packets/sec, last interval */
+	unsigned int	intrrate;		/* rx interrupts/sec, last interval */
 	int	rdfree;
 	Rd*	rdba;			/* receive descriptor base address */
 	struct block**	rb;			/* receive buffers */
@@ -677,6 +706,12 @@ igbeifstat(struct ether* edev, void* a, long n, uint32_t offset)
 		ctlr->lintr, ctlr->lsleep);
 	l += snprintf(p+l, READSTR-l, "rintr: %ud %ud\n",
 		ctlr->rintr, ctlr->rsleep);
+	l += snprintf(p+l, READSTR-l, "rpoll: %ud\n", ctlr->rpoll);
+	l += snprintf(p+l, READSTR-l, "rbudget: %ud\n", ctlr->rbudget);
+	l += snprintf(p+l, READSTR-l, "rate: %ud pkts/s %ud intr/s\n",
+		ctlr->pktrate, ctlr->intrrate);
+	l += snprintf(p+l, READSTR-l, "itr: %ud%s\n", ctlr->itr,
+		ctlr->itrmode == Itradaptive ? " adaptive" : "");
 	l += snprintf(p+l, READSTR-l, "tintr: %ud %ud\n",
 		ctlr->tintr, ctlr->txdw);
 	l += snprintf(p+l, READSTR-l, "ixcs: %ud %ud %ud\n",
@@ -709,12 +744,71 @@ igbeifstat(struct ether* edev, void* a, long n, uint32_t offset)
 	return n;
 }
 
+static int
+igbehasitr(struct ctlr* ctlr)
+{
+	switch(ctlr->id){
+	case i82542:
+	case i82543gc:
+	case i82544ei:
+	case i82544eif:
+	case i82544gc:
+		return 0;
+	}
+	return 1;
+}
+
+/* Sets the interrupt throttling rate, in interrupts/sec, 0 for no limit. */
+static void
+igbesetitr(struct ctlr* ctlr, unsigned int itr)
+{
+	ctlr->itr = itr;
+	if(!igbehasitr(ctlr))
+		return;
+	/* Itr counts the minimum interval in 256ns units */
+	csr32w(ctlr, Itr, itr ? 1000000000 / (itr * 256) : 0);
+}
+
+/*
+ * Called by the rproc after each batch.  Every Rateus, updates the packet and
+ * interrupt rates and, in adaptive mode, picks the Itr for the packet rate.
+ */
+static void
+igberate(struct ctlr* ctlr, int n)
+{
+	uint64_t now, us;
+	unsigned int itr;
+
+	ctlr->ratepkts += n;
+	now = read_tsc();
+	us = tsc2usec(now - ctlr->ratetsc);
+	if(us < Rateus)
+		return;
+	ctlr->pktrate = (uint64_t)ctlr->ratepkts * 1000000 / us;
+	ctlr->intrrate = (uint64_t)(ctlr->rintr - ctlr->rateintr) * 1000000 / us;
+	ctlr->ratepkts = 0;
+	ctlr->rateintr = ctlr->rintr;
+	ctlr->ratetsc = now;
+	if(ctlr->itrmode != Itradaptive)
+		return;
+	if(ctlr->pktrate < Pktlowlat)
+		itr = Itrlowlat;
+	else if(ctlr->pktrate < Pktbulk)
+		itr = Itrmid;
+	else
+		itr = Itrbulk;
+	if(itr != ctlr->itr)
+		igbesetitr(ctlr, itr);
+}
+
 enum {
 	CMrdtr,
+	CMitr,
 };
 
 static struct cmdtab igbectlmsg[] = {
 	{CMrdtr,	"rdtr",	2},
+	{CMitr,		"itr",	2},
 };
 
 static long
@@ -745,6 +839,20 @@ igbectl(struct ether* edev, void* buf, long n)
 		ctlr->rdtr = v;
 		csr32w(ctlr, Rdtr, Fpd|v);
 		break;
+	case CMitr:
+		/* "itr adaptive", or a fixed interrupts/sec, 0 for no limit */
+		if(strcmp(cb->f[1], "adaptive") == 0){
+			ctlr->itrmode = Itradaptive;
+			break;
+		}
+		if(!igbehasitr(ctlr))
+			error(ENOTSUP, "igbe: no interrupt throttling on this chip");
+		v = strtol(cb->f[1], &p, 0);
+		if(v < 0 || *p || p == cb->f[1])
+			error(EINVAL, ERROR_FIXME);
+		ctlr->itrmode = v;
+		igbesetitr(ctlr, v);
+		break;
 	}
 	kfree(cb);
 	poperror();
@@ -1014,7 +1122,8 @@ igbetransmit(struct ether* edev)
 	ctlr->tdh = tdh;
 
 	/*
-	 * Try to fill the ring back up.
+	 * Try to fill the ring back up, and tell the card about all of them
+	 * at once.
 	 */
 	tdt = ctlr->tdt;
 	while(NEXT_RING(tdt, ctlr->ntd) != tdh){
@@ -1030,12 +1139,13 @@ igbetransmit(struct ether* edev)
 		if(NEXT_RING(tdt, ctlr->ntd) == tdh){
 			td->control |= Rs;
 			ctlr->txdw++;
-			ctlr->tdt = tdt;
-			csr32w(ctlr, Tdt, tdt);
 			igbeim(ctlr, Txdw);
 			break;
 		}
+	}
+	if(ctlr->tdt != tdt){
 		ctlr->tdt = tdt;
+		wmb_f();
 		csr32w(ctlr, Tdt, tdt);
 	}
 
@@ -1090,6 +1200,11 @@ igberxinit(struct ctlr* ctlr)
 	csr32w(ctlr, Rdt, 0);
 	ctlr->rdtr = 0;
 	csr32w(ctlr, Rdtr, Fpd|0);
+	if(ctlr->itrmode == Itradaptive)
+		igbesetitr(ctlr, Itrlowlat);
+	else
+		igbesetitr(ctlr, ctlr->itrmode);
+	ctlr->ratetsc = read_tsc();
 
 	for(i = 0; i < ctlr->nrd; i++){
 		if((bp = ctlr->rb[i]) != NULL){
@@ -1127,22 +1242,91 @@ igberim(void* ctlr)
 	return ((struct ctlr*)ctlr)->rim != 0;
 }
 
-static void
-igberproc(void* arg)
+/* Receives up to budget packets off the rx ring, replenishing it as needed.
+ * Called with the rlock held.  Returns the number of descriptors consumed. */
+static int
+igberxring(struct ether* edev, int budget)
 {
 	Rd *rd;
 	struct block *bp;
+	struct ctlr *ctlr = edev->ctlr;
+	int rdh, n;
+
+	rdh = ctlr->rdh;
+	for(n = 0; n < budget; n++){
+		rd = &ctlr->rdba[rdh];
+
+		if(!(rd->status & Rdd))
+			break;
+
+		/*
+		 * Accept eop packets with no errors.
+		 * With no errors and the Ixsm bit set,
+		 * the descriptor status Tpcs and Ipcs bits give
+		 * an indication of whether the checksums were
+		 * calculated and valid.
+		 */
+		if((rd->status & Reop) && rd->errors == 0){
+			bp = ctlr->rb[rdh];
+			ctlr->rb[rdh] = NULL;
+			bp->wp += rd->length;
+			bp->next = NULL;
+			if(!(rd->status & Ixsm)){
+				ctlr->ixsm++;
+				if(rd->status & Ipcs){
+					/*
+					 * IP checksum calculated
+					 * (and valid as errors == 0).
+					 */
+					ctlr->ipcs++;
+					bp->flag |= Bipck;
+				}
+				if(rd->status & Tcpcs){
+					/*
+					 * TCP/UDP checksum calculated
+					 * (and valid as errors == 0).
+					 */
+					ctlr->tcpcs++;
+					bp->flag |= Btcpck|Budpck;
+				}
+				bp->flag |= Bpktck;
+			}
+			etheriq(edev, bp, 1);
+		}
+		else if(ctlr->rb[rdh] != NULL){
+			freeb(ctlr->rb[rdh]);
+			ctlr->rb[rdh] = NULL;
+		}
+
+		memset(rd, 0, sizeof(Rd));
+		wmb();	/* make sure the zeroing happens before free (i think) */
+		ctlr->rdfree--;
+		rdh = NEXT_RING(rdh, ctlr->nrd);
+	}
+	ctlr->rdh = rdh;
+
+	if(ctlr->rdfree < ctlr->nrd/2 || (ctlr->rim & Rxdmt0))
+		igbereplenish(ctlr);
+	return n;
+}
+
+static void
+igberproc(void* arg)
+{
 	struct ctlr *ctlr;
-	int r, rdh;
+	int r, n;
 	struct ether *edev;
 
 	edev = arg;
 	ctlr = edev->ctlr;
 
+	qlock(&ctlr->rlock);
 	igberxinit(ctlr);
 	r = csr32r(ctlr, Rctl);
 	r |= Ren;
 	csr32w(ctlr, Rctl, r);
+	ctlr->rxon = 1;
+	qunlock(&ctlr->rlock);
 
 	for(;;){
 		ctlr->rim = 0;
@@ -1150,64 +1334,43 @@ igberproc(void* arg)
 		ctlr->rsleep++;
 		rendez_sleep(&ctlr->rrendez, igberim, ctlr);
 
-		rdh = ctlr->rdh;
+		/*
+		 * The interrupt handler masked the rx interrupts.  They stay
+		 * off while each pass fills its budget; other kthreads get to run
+		 * between passes.
+		 */
 		for(;;){
-			rd = &ctlr->rdba[rdh];
-
-			if(!(rd->status & Rdd))
+			qlock(&ctlr->rlock);
+			n = igberxring(edev, Rxbudget);
+			qunlock(&ctlr->rlock);
+			igberate(ctlr, n);
+			if(n < Rxbudget)
 				break;
-
-			/*
-			 * Accept eop packets with no errors.
-			 * With no errors and the Ixsm bit set,
-			 * the descriptor status Tpcs and Ipcs bits give
-			 * an indication of whether the checksums were
-			 * calculated and valid.
-			 */
-			if((rd->status & Reop) && rd->errors == 0){
-				bp = ctlr->rb[rdh];
-				ctlr->rb[rdh] = NULL;
-				bp->wp += rd->length;
-				bp->next = NULL;
-				if(!(rd->status & Ixsm)){
-					ctlr->ixsm++;
-					if(rd->status & Ipcs){
-						/*
-						 * IP checksum calculated
-						 * (and valid as errors == 0).
-						 */
-						ctlr->ipcs++;
-						bp->flag |= Bipck;
-					}
-					if(rd->status & Tcpcs){
-						/*
-						 * TCP/UDP checksum calculated
-						 * (and valid as errors == 0).
-						 */
-						ctlr->tcpcs++;
-						bp->flag |= Btcpck|Budpck;
-					}
-					bp->flag |= Bpktck;
-				}
-				etheriq(edev, bp, 1);
-			}
-			else if(ctlr->rb[rdh] != NULL){
-				freeb(ctlr->rb[rdh]);
-				ctlr->rb[rdh] = NULL;
-			}
-
-			memset(rd, 0, sizeof(Rd));
-			wmb();	/* make sure the zeroing happens before free (i think) */
-			ctlr->rdfree--;
-			rdh = NEXT_RING(rdh, ctlr->nrd);
+			ctlr->rbudget++;
+			kthread_yield();
 		}
-		ctlr->rdh = rdh;
-
-		if(ctlr->rdfree < ctlr->nrd/2 || (ctlr->rim & Rxdmt0))
-			igbereplenish(ctlr);
 	}
 }
 
+/*
+ * Busy poll: a reader spinning for a packet takes the ring from the rproc.
+ * The rproc's interrupts stay on, so it picks up whatever we leave.
+ */
+static int
+igbepoll(struct ether* edev, int budget)
+{
+	struct ctlr *ctlr;
+	int n;
+
+	ctlr = edev->ctlr;
+	if(!ctlr->rxon || !canqlock(&ctlr->rlock))
+		return 0;
+	n = igberxring(edev, budget);
+	ctlr->rpoll += n;
+	qunlock(&ctlr->rlock);
+	return n;
+}
+
 static void
 igbeattach(struct ether* edev)
 {
@@ -1986,6 +2149,7 @@ igbepci(void)
 		spinlock_init_irqsave(&ctlr->tlock);
 		qlock_init(&ctlr->alock);
 		qlock_init(&ctlr->slock);
+		qlock_init(&ctlr->rlock);
 		rendez_init(&ctlr->lrendez);
 		rendez_init(&ctlr->rrendez);
 		/* port seems to be unused, and only used for some comparison with edev.
@@ -1995,6 +2159,7 @@ igbepci(void)
 		ctlr->id = id;
 		ctlr->cls = pcidev_read8(pcidev, PCI_CLSZ_REG);
 		ctlr->nic = mem;
+		ctlr->itrmode = Itradaptive;
 
 		if(igbereset(ctlr)){
 			kfree(ctlr);
@@ -2052,6 +2217,7 @@ igbepnp(struct ether* edev)
 	edev->ifstat = igbeifstat;
 	edev->ctl = igbectl;
 	edev->shutdown = igbeshutdown;
+	edev->poll = igbepoll;
 
 	edev->arg = edev;
 	edev->promiscuous = igbepromiscuous;
@@ -36,7 +36,65 @@
 #include <linux/mlx4/qp.h>
 #include "mlx4_en.h"
 
+/* Takes a page from the ring's pool, if it has one big enough.  Those pages are
+ * still mapped, and we hold their only reference. */
+static bool mlx4_en_pool_get(struct mlx4_en_priv *priv,
+			     struct mlx4_en_rx_ring *ring,
+			     struct mlx4_en_rx_alloc *page_alloc,
+			     const struct mlx4_en_frag_info *frag_info)
+{
+	struct mlx4_en_rx_alloc *pooled;
+
+	while (ring->pool_count) {
+		pooled = &ring->page_pool[--ring->pool_count];
+		if (pooled->page_size < frag_info->frag_stride) {
+			dma_unmap_page(priv->ddev, pooled->dma, pooled->page_size,
+				       PCI_DMA_FROMDEVICE);
+			refd_pages_decref(pooled->page);
+			continue;
+		}
+		*page_alloc = *pooled;
+		page_alloc->page_offset = 0;
+		atomic_set(&page_alloc->page->rp_kref.refcount,
+			   page_alloc->page_size / frag_info->frag_stride);
+		ring->pool_recycled++;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Gives a page, whose frags have all been freed, back to the ring's pool.
+ * Returns FALSE if the pool is full. */
+static bool mlx4_en_pool_put(struct mlx4_en_rx_ring *ring,
+			     struct mlx4_en_rx_alloc *frag)
+{
+	struct mlx4_en_rx_alloc *pooled;
+
+	if (ring->pool_count == MLX4_EN_RX_POOL_SIZE)
+		return FALSE;
+	pooled = &ring->page_pool[ring->pool_count++];
+	pooled->page = frag->page;
+	pooled->dma = frag->dma;
+	pooled->page_offset = 0;
+	pooled->page_size = frag->page_size;
+	return TRUE;
+}
+
+static void mlx4_en_pool_drain(struct mlx4_en_priv *priv,
+			       struct mlx4_en_rx_ring *ring)
+{
+	struct mlx4_en_rx_alloc *pooled;
+
+	while (ring->pool_count) {
+		pooled = &ring->page_pool[--ring->pool_count];
+		dma_unmap_page(priv->ddev, pooled->dma, pooled->page_size,
+			       PCI_DMA_FROMDEVICE);
+		refd_pages_decref(pooled->page);
+	}
+}
+
 static int mlx4_alloc_pages(struct mlx4_en_priv *priv,
+			    struct mlx4_en_rx_ring *ring,
 			    struct mlx4_en_rx_alloc *page_alloc,
 			    const struct mlx4_en_frag_info *frag_info,
 			    gfp_t _gfp)
@@ -45,6 +103,8 @@ static int mlx4_alloc_pages(struct mlx4_en_priv *priv,
 	struct refd_pages *page;
 	dma_addr_t dma;
 
+	if (mlx4_en_pool_get(priv, ring, page_alloc, frag_info))
+		return 0;
 	for (order = MLX4_EN_ALLOC_PREFER_ORDER; ;) {
 		gfp_t gfp = _gfp;
 
@@ -72,15 +132,17 @@ static int mlx4_alloc_pages(struct mlx4_en_priv *priv,
 	 */
 	atomic_add(&page->rp_kref.refcount,
 		   page_alloc->page_size / frag_info->frag_stride - 1);
+	ring->pool_fresh++;
 	return 0;
 }
 
 static int mlx4_en_alloc_frags(struct mlx4_en_priv *priv,
+			       struct mlx4_en_rx_ring *ring,
 			       struct mlx4_en_rx_desc *rx_desc,
 			       struct mlx4_en_rx_alloc *frags,
-			       struct mlx4_en_rx_alloc *ring_alloc,
 			       gfp_t gfp)
 {
+	struct mlx4_en_rx_alloc *ring_alloc = ring->page_alloc;
 	struct mlx4_en_rx_alloc page_alloc[MLX4_EN_MAX_RX_FRAGS];
 	const struct mlx4_en_frag_info *frag_info;
 	struct refd_pages *page;
@@ -96,7 +158,7 @@ static int mlx4_en_alloc_frags(struct mlx4_en_priv *priv,
 		    ring_alloc[i].page_size)
 			continue;
 
-		if (mlx4_alloc_pages(priv, &page_alloc[i], frag_info, gfp))
+		if (mlx4_alloc_pages(priv, ring, &page_alloc[i], frag_info, gfp))
 			goto out;
 	}
 
@@ -112,30 +174,37 @@ static int mlx4_en_alloc_frags(struct mlx4_en_priv *priv,
 out:
 	while (i--) {
 		if (page_alloc[i].page != ring_alloc[i].page) {
-			dma_unmap_page(priv->ddev, page_alloc[i].dma,
-				page_alloc[i].page_size, PCI_DMA_FROMDEVICE);
 			page = page_alloc[i].page;
 			atomic_set(&page->rp_kref.refcount, 1);
+			if (mlx4_en_pool_put(ring, &page_alloc[i]))
+				continue;
+			dma_unmap_page(priv->ddev, page_alloc[i].dma,
+				page_alloc[i].page_size, PCI_DMA_FROMDEVICE);
 			refd_pages_decref(page);
 		}
 	}
 	return -ENOMEM;
 }
 
+/* Each frag holds a ref on its page.  The frag holding the last one gets to
+ * recycle the page.  Our receive path copies frames out of the frags, so the
+ * only refs are the ring's. */
 static void mlx4_en_free_frag(struct mlx4_en_priv *priv,
+			      struct mlx4_en_rx_ring *ring,
 			      struct mlx4_en_rx_alloc *frags,
 			      int i)
 {
-	const struct mlx4_en_frag_info *frag_info = &priv->frag_info[i];
-	uint32_t next_frag_end = frags[i].page_offset + 2 * frag_info->frag_stride;
-
+	struct refd_pages *page = frags[i].page;
 
-	if (next_frag_end > frags[i].page_size)
+	if (!page)
+		return;
+	if (kref_refcnt(&page->rp_kref) == 1) {
+		if (mlx4_en_pool_put(ring, &frags[i]))
+			return;
 		dma_unmap_page(priv->ddev, frags[i].dma, frags[i].page_size,
 			       PCI_DMA_FROMDEVICE);
-
-	if (frags[i].page)
-		refd_pages_decref(frags[i].page);
+	}
+	refd_pages_decref(page);
 }
 
 static int mlx4_en_init_allocator(struct mlx4_en_priv *priv,
@@ -147,7 +216,7 @@ static int mlx4_en_init_allocator(struct mlx4_en_priv *priv,
 	for (i = 0; i < priv->num_frags; i++) {
 		const struct mlx4_en_frag_info *frag_info = &priv->frag_info[i];
 
-		if (mlx4_alloc_pages(priv, &ring->page_alloc[i],
+		if (mlx4_alloc_pages(priv, ring, &ring->page_alloc[i],
 				     frag_info, MEM_WAIT | __GFP_COLD))
 			goto out;
 
@@ -232,7 +301,7 @@ static int mlx4_en_prepare_rx_desc(struct mlx4_en_priv *priv,
 	struct mlx4_en_rx_alloc *frags = ring->rx_info +
 					(index << priv->log_rx_info);
 
-	return mlx4_en_alloc_frags(priv, rx_desc, frags, ring->page_alloc, gfp);
+	return mlx4_en_alloc_frags(priv, ring, rx_desc, frags, gfp);
 }
 
 static inline bool mlx4_en_is_ring_empty(struct mlx4_en_rx_ring *ring)
@@ -256,7 +325,7 @@ static void mlx4_en_free_rx_desc(struct mlx4_en_priv *priv,
 	frags = ring->rx_info + (index << priv->log_rx_info);
 	for (nr = 0; nr < priv->num_frags; nr++) {
 		en_dbg(DRV, priv, "Freeing fragment:%d\n", nr);
-		mlx4_en_free_frag(priv, frags, nr);
+		mlx4_en_free_frag(priv, ring, frags, nr);
 	}
 }
 
@@ -318,6 +387,7 @@ static void mlx4_en_free_rx_buf(struct mlx4_en_priv *priv,
 		mlx4_en_free_rx_desc(priv, ring, index);
 		++ring->cons;
 	}
+	mlx4_en_pool_drain(priv, ring);
 }
 
 void mlx4_en_set_num_rx_rings(struct mlx4_en_dev *mdev)
@@ -1057,7 +1127,7 @@ int mlx4_en_process_rx_cq(struct ether *dev, struct mlx4_en_cq *cq,
 
 next:
 		for (nr = 0; nr < priv->num_frags; nr++)
-			mlx4_en_free_frag(priv, frags, nr);
+			mlx4_en_free_frag(priv, ring, frags, nr);
 
 		++cq->mcq.cons_index;
 		index = (cq->mcq.cons_index) & ring->size_mask;
@@ -1144,6 +1214,35 @@ static void mlx4_en_poll_rx_cq(uint32_t srcid, long a0, long a1, long a2)
 	mlx4_en_arm_cq(priv, cq);
 }
 
+/* Akaros busy poll (ether->poll): a reader spinning for a packet processes the
+ * rx CQs on its own core, sharing them with the IRQ's kmsg via the poll lock.
+ * If the kmsg ran while we had a CQ, it backed off without rearming, so we
+ * send it again to finish up and rearm. */
+int mlx4_en_busy_poll(struct ether *dev, int budget)
+{
+	struct mlx4_en_priv *priv = netdev_priv(dev);
+	struct mlx4_en_cq *cq;
+	int n, done = 0;
+
+	if (!priv->port_up)
+		return 0;
+	for (int i = 0; i < priv->rx_ring_num && done < budget; i++) {
+		cq = priv->rx_cq[i];
+		if (!mlx4_en_cq_lock_poll(cq))
+			continue;
+		n = mlx4_en_process_rx_cq(dev, cq, budget - done);
+		if (n)
+			priv->rx_ring[i]->cleaned += n;
+		else
+			priv->rx_ring[i]->misses++;
+		done += n;
+		if (mlx4_en_cq_unlock_poll(cq))
+			send_kernel_message(core_id(), mlx4_en_poll_rx_cq, (long)cq,
+			                    0, 0, KMSG_ROUTINE);
+	}
+	return done;
+}
+
 static const int frag_sizes[] = {
 	FRAG_SZ0,
 	FRAG_SZ1,
@@ -1390,3 +1489,22 @@ void mlx4_en_release_rss_steer(struct mlx4_en_priv *priv)
 	}
 	mlx4_qp_release_range(mdev->dev, rss_map->base_qpn, priv->rx_ring_num);
 }
+
+/* Formats the per-ring RX stats into p, for ifstat. */
+size_t mlx4_en_rx_ring_stats(struct ether *edev, char *p, size_t sz)
+{
+	struct mlx4_en_priv *priv = netdev_priv(edev);
+	struct mlx4_en_rx_ring *ring;
+	size_t sofar = 0;
+
+	for (int i = 0; i < priv->rx_ring_num; i++) {
+		ring = priv->rx_ring[i];
+		if (!ring)
+			continue;
+		sofar += snprintf(p + sofar, sz - sofar,
+		                  "rx ring %3d: pkts %lu bytes %lu pages fresh %lu recycled %lu pooled %u\n",
+		                  i, ring->packets, ring->bytes, ring->pool_fresh,
+		                  ring->pool_recycled, ring->pool_count);
+	}
+	return sofar;
+}
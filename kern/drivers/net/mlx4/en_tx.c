@@ -507,6 +507,24 @@ static bool mlx4_en_process_tx_cq(struct ether *dev,
 
 static void mlx4_en_poll_tx_cq(uint32_t srcid, long a0, long a1, long a2);
 
+/* Each core transmits on its own ring, see mlx4_en_xps_ring().  Ring i, for i
+ * < num_tx_rings_p_up, belongs to core i (and every core i mod
+ * num_tx_rings_p_up).  The other rings are for the other user priorities, which
+ * we don't use. */
+static int mlx4_en_xps_ring(struct mlx4_en_priv *priv)
+{
+	return core_id() % priv->num_tx_rings_p_up;
+}
+
+/* The core whose ring this is, which is where we process its completions, so
+ * the ring's cons side stays in that core's cache. */
+static int mlx4_en_ring_core(struct mlx4_en_priv *priv, int ring)
+{
+	if (ring < priv->num_tx_rings_p_up && ring < num_cores)
+		return ring;
+	return core_id();
+}
+
 void mlx4_en_tx_irq(struct mlx4_cq *mcq)
 {
 	struct mlx4_en_cq *cq = container_of(mcq, struct mlx4_en_cq, mcq);
@@ -516,8 +534,8 @@ void mlx4_en_tx_irq(struct mlx4_cq *mcq)
 #if 0 // AKAROS_PORT
 		napi_schedule_irqoff(&cq->napi);
 #else
-		send_kernel_message(core_id(), mlx4_en_poll_tx_cq, (long)cq,
-				    0, 0, KMSG_ROUTINE);
+		send_kernel_message(mlx4_en_ring_core(priv, cq->ring),
+				    mlx4_en_poll_tx_cq, (long)cq, 0, 0, KMSG_ROUTINE);
 #endif
 	else
 		mlx4_en_arm_cq(priv, cq);
@@ -710,7 +728,7 @@ uint16_t mlx4_en_select_queue(struct ether *dev, struct sk_buff *skb,
 			      void *accel_priv,
 			      select_queue_fallback_t fallback)
 {
-	panic("Disabled");
+	return mlx4_en_xps_ring(netdev_priv(dev));
 #if 0 // AKAROS_PORT
 	struct mlx4_en_priv *priv = netdev_priv(dev);
 	uint16_t rings_p_up = priv->num_tx_rings_p_up;
@@ -744,6 +762,24 @@ static size_t get_lso_hdr_size(struct block *block)
 	return block->transport_offset + tcp_hdrlen(block);
 }
 
+static void mlx4_en_tx_doorbell(struct mlx4_en_tx_ring *ring)
+{
+	wmb();
+	/* Since there is no iowrite*_native() that writes the
+	 * value as is, without byteswapping - using the one
+	 * the doesn't do byteswapping in the relevant arch
+	 * endianness.
+	 */
+#if defined(__LITTLE_ENDIAN)
+	write32(ring->doorbell_qpn, ring->bf.uar->map + MLX4_SEND_DOORBELL);
+#else
+	iowrite32be(ring->doorbell_qpn,
+		    ring->bf.uar->map + MLX4_SEND_DOORBELL);
+#endif
+}
+
+/* Posts block's descriptor, but doesn't tell the NIC.  Call
+ * mlx4_en_tx_doorbell() when you're done posting. */
 netdev_tx_t mlx4_send_packet(struct block *block, struct mlx4_en_priv *priv,
                              struct mlx4_en_tx_ring *ring)
 {
@@ -944,19 +980,8 @@ netdev_tx_t mlx4_send_packet(struct block *block, struct mlx4_en_priv *priv,
 	 */
 	bus_wmb();
 	tx_desc->ctrl.owner_opcode = op_own;
-	wmb();
-	/* Since there is no iowrite*_native() that writes the
-	 * value as is, without byteswapping - using the one
-	 * the doesn't do byteswapping in the relevant arch
-	 * endianness.
-	 */
-#if defined(__LITTLE_ENDIAN)
-	write32(ring->doorbell_qpn, ring->bf.uar->map + MLX4_SEND_DOORBELL);
-#else
-	iowrite32be(ring->doorbell_qpn,
-		    ring->bf.uar->map + MLX4_SEND_DOORBELL);
-#endif
 
+	/* The caller rings the doorbell, once for everything it posted. */
 	return NETDEV_TX_OK;
 
 tx_drop_unmap:
@@ -1294,8 +1319,15 @@ void __mlx4_xmit_poke(void *args)
 	struct mlx4_en_priv *priv = ((struct mlx4_poke_args*)args)->priv;
 	struct mlx4_en_tx_ring *ring = ((struct mlx4_poke_args*)args)->ring;
 	struct block *block;
+	uint32_t prod = ring->prod;
+	unsigned long nr_posted = 0;
 
-	while (!mlx4_en_ring_is_full(ring)) {
+	while (1) {
+		if (mlx4_en_ring_is_full(ring)) {
+			/* The TX completion will poke us again */
+			ring->queue_stopped++;
+			break;
+		}
 		block = qget(edev->oq);
 		if (!block)
 			break;
@@ -1305,6 +1337,13 @@ void __mlx4_xmit_poke(void *args)
 		if (block->nr_extra_bufs > MAX_SKB_FRAGS)
 			block = linearizeblock(block);
 		mlx4_send_packet(block, priv, ring);
+		nr_posted++;
+	}
+	/* One doorbell for the lot, like Linux's xmit_more.  prod only moves if
+	 * we posted something (drops don't). */
+	if (ring->prod != prod) {
+		mlx4_en_tx_doorbell(ring);
+		ring->xmit_more += nr_posted - 1;
 	}
 }
 
@@ -1314,10 +1353,29 @@ void mlx4_transmit(struct ether *edev)
 	struct mlx4_en_tx_ring *ring;
 	struct mlx4_poke_args args;
 
-	/* TODO multi-queue support. */
-	ring = priv->tx_ring[0];
+	ring = priv->tx_ring[mlx4_en_xps_ring(priv)];
 	args.edev = edev;
 	args.priv = priv;
 	args.ring = ring;
 	poke(&ring->poker, &args);
 }
+
+/* Formats the per-ring TX stats of the rings we use into p, for ifstat. */
+size_t mlx4_en_tx_ring_stats(struct ether *edev, char *p, size_t sz)
+{
+	struct mlx4_en_priv *priv = netdev_priv(edev);
+	struct mlx4_en_tx_ring *ring;
+	size_t sofar = 0;
+
+	for (int i = 0; i < priv->num_tx_rings_p_up && i < num_cores; i++) {
+		ring = priv->tx_ring[i];
+		if (!ring)
+			continue;
+		sofar += snprintf(p + sofar, sz - sofar,
+		                  "tx ring %3d core %3d: pkts %lu bytes %lu tso %lu csum %lu full %lu\n",
+		                  i, mlx4_en_ring_core(priv, i), ring->packets,
+		                  ring->bytes, ring->tso_packets, ring->tx_csum,
+		                  ring->queue_stopped);
+	}
+	return sofar;
+}
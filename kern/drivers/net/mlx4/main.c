@@ -3859,6 +3859,7 @@ module_exit(mlx4_cleanup);
 
 extern int mlx4_en_init(void);
 extern int mlx4_en_open(struct ether *dev);
+extern int mlx4_en_busy_poll(struct ether *dev, int budget);
 
 static const struct pci_device_id *search_pci_table(struct pci_device *needle)
 {
@@ -3882,12 +3883,28 @@ static void mlx4_attach(struct ether *edev)
 /* The organization of this driver is a fucking catastrophe */
 extern void mlx4_transmit(struct ether *edev);
 
+/* The Linux-style stats, then ethtool-style per-ring stats. */
 static long mlx4_ifstat(struct ether *edev, void *a, long n, uint32_t offset)
 {
 	/* From Linux's net_device_ops */
 	extern struct netif_stats *mlx4_en_get_stats(struct ether *dev);
-
-	return linux_ifstat(mlx4_en_get_stats(edev), a, n, offset);
+	extern size_t mlx4_en_tx_ring_stats(struct ether *edev, char *p,
+	                                    size_t sz);
+	extern size_t mlx4_en_rx_ring_stats(struct ether *edev, char *p,
+	                                    size_t sz);
+	size_t sz = READSTR + num_cores * 256;
+	size_t sofar;
+	char *p;
+	long ret;
+
+	p = kzmalloc(sz, MEM_WAIT);
+	sofar = linux_ifstat_fmt(mlx4_en_get_stats(edev), p);
+	sofar += snprintf(p + sofar, sz - sofar, "\n");
+	sofar += mlx4_en_tx_ring_stats(edev, p + sofar, sz - sofar);
+	mlx4_en_rx_ring_stats(edev, p + sofar, sz - sofar);
+	ret = readstr(offset, a, n, p);
+	kfree(p);
+	return ret;
 }
 
 static long mlx4_ctl(struct ether *edev, void *buf, long n)
@@ -3970,6 +3987,7 @@ static int mlx4_pnp(struct ether *edev)
 	edev->ifstat = mlx4_ifstat;
 	edev->ctl = mlx4_ctl;
 	edev->shutdown = mlx4_shutdown;
+	edev->poll = mlx4_en_busy_poll;
 
 	edev->arg = edev;
 	edev->promiscuous = NULL;
@@ -98,6 +98,8 @@ enum {
 	FRAG_SZ3 = MLX4_EN_ALLOC_SIZE
 };
 #define MLX4_EN_MAX_RX_FRAGS	4
+/* RX pages kept mapped, per ring, once all of their frags are freed */
+#define MLX4_EN_RX_POOL_SIZE	32
 
 /* Maximum ring sizes */
 #define MLX4_EN_MAX_TX_SIZE	8192
@@ -313,7 +315,7 @@ struct mlx4_en_rx_ring {
 	void *rx_info;
 	unsigned long bytes;
 	unsigned long packets;
-#ifdef CONFIG_NET_RX_BUSY_POLL
+#if 1 // AKAROS_PORT, for ether->poll (was CONFIG_NET_RX_BUSY_POLL)
 	unsigned long yields;
 	unsigned long misses;
 	unsigned long cleaned;
@@ -323,6 +325,12 @@ struct mlx4_en_rx_ring {
 	unsigned long csum_complete;
 	int hwtstamp_rx_filter;
 	cpumask_var_t affinity_mask;
+	/* Recycled pages, still DMA mapped.  Only touched by whoever owns the
+	 * ring's CQ, like page_alloc. */
+	struct mlx4_en_rx_alloc page_pool[MLX4_EN_RX_POOL_SIZE];
+	unsigned int pool_count;
+	unsigned long pool_recycled;
+	unsigned long pool_fresh;
 };
 
 struct mlx4_en_cq {
@@ -340,7 +348,7 @@ struct mlx4_en_cq {
 	struct mlx4_cqe *buf;
 #define MLX4_EN_OPCODE_ERROR	0x1e
 
-#ifdef CONFIG_NET_RX_BUSY_POLL
+#if 1 // AKAROS_PORT, for ether->poll (was CONFIG_NET_RX_BUSY_POLL)
 	unsigned int state;
 #define MLX4_EN_CQ_STATE_IDLE        0
 #define MLX4_EN_CQ_STATE_NAPI     1    /* NAPI owns this CQ */
@@ -631,7 +639,7 @@ static inline bool mlx4_en_ring_is_full(struct mlx4_en_tx_ring *ring)
 	       ring->size - HEADROOM - MAX_DESC_TXBBS;
 }
 
-#ifdef CONFIG_NET_RX_BUSY_POLL
+#if 1 // AKAROS_PORT, for ether->poll (was CONFIG_NET_RX_BUSY_POLL)
 static inline void mlx4_en_cq_init_lock(struct mlx4_en_cq *cq)
 {
 	spinlock_init(&cq->poll_lock);
@@ -696,7 +704,9 @@ static inline bool mlx4_en_cq_unlock_poll(struct mlx4_en_cq *cq)
 	spin_lock(&cq->poll_lock);
 	warn_on(cq->state & (MLX4_EN_CQ_STATE_NAPI));
 
-	if (cq->state & MLX4_EN_CQ_STATE_POLL_YIELD)
+	/* AKAROS_PORT: our 'napi' doesn't get rescheduled when it yields, so the
+	 * poller needs to know. */
+	if (cq->state & (MLX4_EN_CQ_STATE_POLL_YIELD | MLX4_EN_CQ_STATE_NAPI_YIELD))
 		rc = true;
 	cq->state = MLX4_EN_CQ_STATE_IDLE;
 	spin_unlock(&cq->poll_lock);
@@ -771,6 +781,8 @@ int mlx4_en_set_cq_moder(struct mlx4_en_priv *priv, struct mlx4_en_cq *cq);
 int mlx4_en_arm_cq(struct mlx4_en_priv *priv, struct mlx4_en_cq *cq);
 
 void mlx4_en_tx_irq(struct mlx4_cq *mcq);
+size_t mlx4_en_tx_ring_stats(struct ether *edev, char *p, size_t sz);
+size_t mlx4_en_rx_ring_stats(struct ether *edev, char *p, size_t sz);
 uint16_t mlx4_en_select_queue(struct ether *dev, struct sk_buff *skb,
 			      void *accel_priv,
 			      select_queue_fallback_t fallback);
@@ -815,6 +827,7 @@ int mlx4_en_create_drop_qp(struct mlx4_en_priv *priv);
 void mlx4_en_destroy_drop_qp(struct mlx4_en_priv *priv);
 int mlx4_en_free_tx_buf(struct ether *dev, struct mlx4_en_tx_ring *ring);
 void mlx4_en_rx_irq(struct mlx4_cq *mcq);
+int mlx4_en_busy_poll(struct ether *dev, int budget);
 
 int mlx4_SET_MCAST_FLTR(struct mlx4_dev *dev, uint8_t port, uint64_t mac,
 			uint64_t clear, uint8_t mode);
@@ -7214,7 +7214,6 @@ static netdev_tx_t rtl8169_start_xmit(struct block *bp, struct ether *dev)
 	struct rtl8169_private *tp = netdev_priv(dev);
 	unsigned int entry = tp->cur_tx % NUM_TX_DESC;
 	struct TxDesc *txd = tp->TxDescArray + entry;
-	void __iomem *ioaddr = tp->mmio_addr;
 	struct device *d = &tp->pci_dev->device;
 	dma_addr_t mapping;
 	uint32_t status, len;
@@ -7279,11 +7278,10 @@ static netdev_tx_t rtl8169_start_xmit(struct block *bp, struct ether *dev)
 
 	tp->cur_tx += frags + 1;
 
-	RTL_W8(TxPoll, NPQ);
-
-	bus_wmb();
-
-	/* Linux calls netif_stop_queue if (!TX_FRAGS_READY_FOR(tp, MAX_SKB_FRAGS))
+	/* Linux rings TxPoll here, unless skb->xmit_more.  We post everything on
+	 * the oq first, and __rtl_xmit_poke rings it once.
+	 *
+	 * Linux calls netif_stop_queue if (!TX_FRAGS_READY_FOR(tp, MAX_SKB_FRAGS))
 	 *
 	 * We do our backpressure in __rtl_xmit_poke. */
 
@@ -8677,6 +8675,8 @@ static void __rtl_xmit_poke(void *args)
 {
 	struct ether *edev = ((struct rtl_poke_args*)args)->edev;
 	struct rtl8169_private *tp = ((struct rtl_poke_args*)args)->tp;
+	void __iomem *ioaddr = tp->mmio_addr;
+	unsigned int cur_tx = tp->cur_tx;
 	struct block *bp;
 
 	while (TX_FRAGS_READY_FOR(tp, MAX_SKB_FRAGS)) {
@@ -8694,6 +8694,10 @@ static void __rtl_xmit_poke(void *args)
 			bp = linearizeblock(bp);
 		rtl8169_start_xmit(bp, edev);
 	}
+	if (tp->cur_tx != cur_tx) {
+		RTL_W8(TxPoll, NPQ);
+		bus_wmb();
+	}
 }
 
 static void rtl8169_transmit(struct ether *edev)
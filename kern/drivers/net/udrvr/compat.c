@@ -72,6 +72,8 @@ int map_upage_at_addr(struct proc *p, physaddr_t paddr, uintptr_t addr, int ptep
 	 * path (page_insert() does not handle PG_PAGEMAP refcnt's).
 	 */
 	rv = page_insert(p->env_pgdir, pp, (void *)addr, pteprot);
+	if (!rv)
+		p->nr_anon_pgs++;
 	spin_unlock(&p->pte_lock);
 	return rv;
 }
@@ -81,11 +83,15 @@ void set_page_dirty_lock(struct page *pagep)
 	atomic_or(&pagep->pg_flags, PG_DIRTY);
 }
 
+/*
+ * get_user_page() doesn't take a ref; the page belongs to the PTE, and munmap
+ * frees it.  Dropping a ref here would free pages the user still has mapped
+ * (or that munmap already freed), e.g. when a cached umem gets dropped.
+ */
 void put_page(struct page *pagep)
 {
 	if (atomic_read(&pagep->pg_flags) & PG_PAGEMAP)
 		printk("[akaros]: put_page() on pagemap page!!!\n");
-	page_decref(pagep);
 }
 
 int get_user_page(struct proc *p, unsigned long uvastart, int write, int force,
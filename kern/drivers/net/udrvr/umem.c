@@ -55,6 +55,206 @@
 #define	ib_umem_odp_get(c, u)	({ BUG(); -1; })
 #endif	/* AKAROS */
 
+#if 1	/* AKAROS */
+/*
+ * Registration cache.  RDMA apps register the same buffers over and over, and
+ * each ib_umem_get() walks and translates every page and builds the SG list.
+ * Instead, each ucontext keeps the umems it made, keyed by their range and
+ * writability.  Released umems stay on the list, up to
+ * UMEM_CACHE_MAX_IDLE_PAGES, and the oldest idle ones get dropped first.  Note
+ * the MR itself (the HCA's MTT entries and keys) is still made from scratch;
+ * reusing a dereg'd MR would let peers keep using its rkey.
+ *
+ * get_user_page() doesn't hold a page ref, so after an munmap, a cached umem's
+ * pages might be freed or belong to someone else.  A cached umem is only valid
+ * if the PTEs still point at its pages (with write perms, if it is writable).
+ * We check an entry before handing it out if the proc's VMRs changed since we
+ * last looked, and after an munmap, we check all of the idle ones and drop the
+ * stale ones.
+ */
+#define UMEM_CACHE_MAX_IDLE_PAGES	16384
+
+static bool umem_access_writable(int access)
+{
+	return !!(access &
+		(IB_ACCESS_LOCAL_WRITE   | IB_ACCESS_REMOTE_WRITE |
+		 IB_ACCESS_REMOTE_ATOMIC | IB_ACCESS_MW_BIND));
+}
+
+static bool umem_cache_usable(struct ib_ucontext *context)
+{
+	return !context->closing && current &&
+	       current->pid == context->umem_cache_pid;
+}
+
+static bool umem_still_mapped(struct ib_umem *umem)
+{
+	struct proc *p = current;
+	struct scatterlist *sg;
+	uintptr_t va = ib_umem_start(umem);
+	bool ret = TRUE;
+	pte_t pte;
+	int i;
+
+	spin_lock(&p->pte_lock);
+	for_each_sg(umem->sg_head.sgl, sg, umem->npages, i) {
+		pte = pgdir_walk(p->env_pgdir, (void*)va, FALSE);
+		if (!pte_walk_okay(pte) || !pte_is_present(pte) ||
+		    pte_get_paddr(pte) != page2pa(sg_page(sg)) ||
+		    (umem->writable && !pte_has_perm_urw(pte))) {
+			ret = FALSE;
+			break;
+		}
+		va += PAGE_SIZE;
+	}
+	spin_unlock(&p->pte_lock);
+	umem->vmr_history = p->vmr_history;
+	return ret;
+}
+
+static void __ib_umem_release(struct ib_device *dev, struct ib_umem *umem,
+			      int dirty);
+
+static void umem_cache_drop(struct ib_umem *umem)
+{
+	__ib_umem_release(umem->context->device, umem, 1);
+	kfree(umem);
+}
+
+/* Drops idle umems: the stale ones, if check, and the oldest ones past our
+ * limit.  Caller holds the cache lock.  Returns a list to drop. */
+static void __umem_cache_trim(struct ib_ucontext *context, bool check,
+			      struct list_head *to_drop)
+{
+	struct ib_umem *umem, *tmp;
+
+	list_for_each_entry_safe(umem, tmp, &context->umem_cache, cache_link) {
+		if (umem->cache_refs)
+			continue;
+		if (context->umem_cache_idle_pages > UMEM_CACHE_MAX_IDLE_PAGES ||
+		    (check && !umem_still_mapped(umem))) {
+			list_del(&umem->cache_link);
+			context->umem_cache_idle_pages -= umem->npages;
+			list_add_tail(&umem->cache_link, to_drop);
+		}
+	}
+}
+
+static void umem_cache_drop_list(struct list_head *to_drop)
+{
+	struct ib_umem *umem, *tmp;
+
+	list_for_each_entry_safe(umem, tmp, to_drop, cache_link)
+		umem_cache_drop(umem);
+}
+
+static struct ib_umem *umem_cache_get(struct ib_ucontext *context,
+				      unsigned long addr, size_t size,
+				      int access)
+{
+	struct ib_umem *umem, *ret = NULL;
+	bool writable = umem_access_writable(access);
+	bool munmapped;
+	LINUX_LIST_HEAD(to_drop);
+
+	if (!umem_cache_usable(context) || (access & IB_ACCESS_ON_DEMAND))
+		return NULL;
+	qlock(&context->umem_cache_lock);
+	munmapped = current->nr_munmaps != context->umem_cache_munmaps;
+	context->umem_cache_munmaps = current->nr_munmaps;
+	if (munmapped)
+		__umem_cache_trim(context, TRUE, &to_drop);
+	list_for_each_entry(umem, &context->umem_cache, cache_link) {
+		if (umem->address != addr || umem->length != size)
+			continue;
+		/* A writable umem is fine for a read-only registration too */
+		if (writable && !umem->writable)
+			continue;
+		if (umem->vmr_history != current->vmr_history &&
+		    !umem_still_mapped(umem))
+			continue;
+		ret = umem;
+		break;
+	}
+	if (ret) {
+		if (!ret->cache_refs++)
+			context->umem_cache_idle_pages -= ret->npages;
+		list_del(&ret->cache_link);
+		list_add_tail(&ret->cache_link, &context->umem_cache);
+	}
+	qunlock(&context->umem_cache_lock);
+	umem_cache_drop_list(&to_drop);
+	return ret;
+}
+
+/* Tracks a freshly made umem */
+static void umem_cache_add(struct ib_umem *umem)
+{
+	struct ib_ucontext *context = umem->context;
+
+	umem->cache_refs = 1;
+	INIT_LIST_HEAD(&umem->cache_link);
+	if (!umem_cache_usable(context) || umem->odp_data)
+		return;
+	umem->vmr_history = current->vmr_history;
+	qlock(&context->umem_cache_lock);
+	list_add_tail(&umem->cache_link, &context->umem_cache);
+	qunlock(&context->umem_cache_lock);
+}
+
+/* Returns TRUE if the cache kept umem, o/w the caller drops it. */
+static bool umem_cache_put(struct ib_umem *umem)
+{
+	struct ib_ucontext *context = umem->context;
+	LINUX_LIST_HEAD(to_drop);
+
+	if (list_empty(&umem->cache_link))
+		return FALSE;
+	qlock(&context->umem_cache_lock);
+	if (--umem->cache_refs) {
+		qunlock(&context->umem_cache_lock);
+		return TRUE;
+	}
+	if (context->closing) {
+		list_del(&umem->cache_link);
+		qunlock(&context->umem_cache_lock);
+		return FALSE;
+	}
+	context->umem_cache_idle_pages += umem->npages;
+	__umem_cache_trim(context, FALSE, &to_drop);
+	qunlock(&context->umem_cache_lock);
+	umem_cache_drop_list(&to_drop);
+	return TRUE;
+}
+
+void ib_umem_cache_init(struct ib_ucontext *context)
+{
+	qlock_init(&context->umem_cache_lock);
+	INIT_LIST_HEAD(&context->umem_cache);
+	context->umem_cache_idle_pages = 0;
+	context->umem_cache_munmaps = current->nr_munmaps;
+	context->umem_cache_pid = current->pid;
+}
+
+/* Drops the idle umems.  Call once the context is closing and its MRs, CQs,
+ * etc. have released theirs. */
+void ib_umem_cache_flush(struct ib_ucontext *context)
+{
+	struct ib_umem *umem, *tmp;
+	LINUX_LIST_HEAD(to_drop);
+
+	qlock(&context->umem_cache_lock);
+	list_for_each_entry_safe(umem, tmp, &context->umem_cache, cache_link) {
+		warn_on(umem->cache_refs);
+		list_del(&umem->cache_link);
+		list_add_tail(&umem->cache_link, &to_drop);
+	}
+	context->umem_cache_idle_pages = 0;
+	qunlock(&context->umem_cache_lock);
+	umem_cache_drop_list(&to_drop);
+}
+#endif	/* AKAROS */
+
 static void __ib_umem_release(struct ib_device *dev, struct ib_umem *umem, int dirty)
 {
 	struct scatterlist *sg;
@@ -124,6 +324,12 @@ struct ib_umem *ib_umem_get(struct ib_ucontext *context, unsigned long addr,
 	if (!can_do_mlock())
 		return ERR_PTR(-EPERM);
 
+#if 1	/* AKAROS */
+	umem = umem_cache_get(context, addr, size, access);
+	if (umem)
+		return umem;
+#endif	/* AKAROS */
+
 	umem = kzalloc(sizeof *umem, GFP_KERNEL);
 	if (!umem)
 		return ERR_PTR(-ENOMEM);
@@ -249,6 +455,8 @@ out:
 		put_pid(umem->pid);
 		kfree(umem);
 #if 1	/* AKAROS */
+	} else {
+		umem_cache_add(umem);
 	}
 #else	/* AKAROS */
 	} else
@@ -335,8 +543,9 @@ EXPORT_SYMBOL(ib_umem_release);
 #else	/* AKAROS */
 void ib_umem_release(struct ib_umem *umem)
 {
-	__ib_umem_release(umem->context->device, umem, 1);
-	kfree(umem);
+	if (umem_cache_put(umem))
+		return;
+	umem_cache_drop(umem);
 }
 #endif	/* AKAROS */
 
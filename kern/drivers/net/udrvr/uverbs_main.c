@@ -335,6 +335,9 @@ static int ib_uverbs_cleanup_ucontext(struct ib_uverbs_file *file,
 		kfree(uobj);
 	}
 
+#if 1	/* AKAROS */
+	ib_umem_cache_flush(context);
+#endif	/* AKAROS */
 	put_pid(context->tgid);
 
 	return context->device->dealloc_ucontext(context);
@@ -510,6 +510,8 @@ struct Atable *mkatable(struct Atable *parent,
 struct Atable *finatable(struct Atable *t, struct slice *slice);
 struct Atable *finatable_nochildren(struct Atable *t);
 int get_early_num_cores(void);
+void acpi_srat_foreach_mem(void (*cb)(int dom, uint64_t addr, uint64_t len,
+                                      void *arg), void *arg);
 
 extern struct Atable *apics;
 extern struct Atable *dmar;
@@ -0,0 +1,34 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * AES-GCM (NIST SP 800-38D) with a 96 bit IV and a 128 bit tag, for 128 and
+ * 256 bit keys.  On x86 with AES-NI and PCLMULQDQ we use those, otherwise we
+ * fall back to the rijndael code and a bitwise GHASH, which is slow but right.
+ *
+ * Encryption and decryption are in place.  A context is just the key; it can
+ * be used by many callers at once. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <random/rijndael.h>
+
+#define AES_GCM_IV_LEN			12
+#define AES_GCM_TAG_LEN			16
+
+struct aes_gcm_ctx {
+	/* Round keys for AES-NI, in the order aesenc wants them. */
+	uint8_t						rk[15][16] __attribute__((aligned(16)));
+	int							nr_rounds;
+	uint8_t						h[16];		/* hash key, E(K, 0^128) */
+	bool						ni;
+	rijndaelCtx					sw;
+};
+
+int aes_gcm_setkey(struct aes_gcm_ctx *ctx, const uint8_t *key, size_t len);
+void aes_gcm_encrypt(struct aes_gcm_ctx *ctx, const uint8_t *iv,
+                     const uint8_t *aad, size_t aad_len, uint8_t *buf,
+                     size_t len, uint8_t *tag);
+bool aes_gcm_decrypt(struct aes_gcm_ctx *ctx, const uint8_t *iv,
+                     const uint8_t *aad, size_t aad_len, uint8_t *buf,
+                     size_t len, const uint8_t *tag);
@@ -271,6 +271,9 @@ enum {
 #define ACTAB_RES   0x50 // Reserved
 #define ACTAB_PRDT  0x80 // PRDT (up to 65,535 entries in spec, this has one)
 
+// NCQ command tables, one per slot, with a PRDT entry per merged request
+#define ANCQ_CTAB_SIZE (ACTAB_PRDT + APRDT_SIZE * SDnseg)
+
 // Portm flags (status flags?)
 enum {
 	Ferror = 1,
@@ -285,6 +288,7 @@ enum {
 	Dnop = 1 << 3,
 	Datapi = 1 << 4,
 	Datapi16 = 1 << 5,
+	Dncq = 1 << 6,
 };
 
 struct aportm {
@@ -294,8 +298,14 @@ struct aportm {
 	unsigned char feat;
 	unsigned char smart;
 	struct afis fis;
-	void *list;
+	void *list; /* SDqmax headers, slot 0 is for the non-queued commands */
 	void *ctab;
+
+	/* NCQ, slot bits are protected by the drive's Lock */
+	void *ncqctab;
+	int ncqdepth;
+	uint32_t ncqbusy;
+	struct sdbreq *ncqreq[SDqmax];
 };
 
 struct aportc {
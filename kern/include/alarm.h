@@ -56,7 +56,28 @@
  * Don't forget to manage your memory at some (safe) point:
  * 	kfree(waiter);
  * In the future, we might have a slab for these.  You can get it from wherever
- * you want, just be careful if you use the stack. */
+ * you want, just be careful if you use the stack.
+ *
+ * Each tchain is a hierarchical timing wheel, so setting and unsetting are
+ * O(1), no matter how many alarms are pending.  Level L has TCHAIN_NR_SLOTS
+ * slots, each 2^(TCHAIN_SHIFT_0 + L * TCHAIN_SLOT_BITS) TSC ticks wide.  An
+ * alarm goes in the lowest level whose window, around the wheel's base time,
+ * has the alarm in it, and it cascades down as the base catches up.  Alarms
+ * past the top level's window go in a plain list.
+ *
+ * The wheel still knows exactly when its earliest alarm is: it's in the first
+ * slot of the lowest nonempty level, so finding it is a bitmap search and a
+ * scan of one slot.  The interrupt is programmed for that time, not for the
+ * slot's boundary.
+ *
+ * Slack: an alarm can have some, with set_awaiter_slack(), meaning it's OK to
+ * fire anywhere from its wake_up_time to slack later.  The wheel sorts alarms
+ * by the end of that window, their deadline, and the interrupt is for the
+ * earliest deadline.  When it goes off, every alarm whose window has opened
+ * fires, so alarms that are close together share an interrupt.  The defaults
+ * are by kind of alarm: none for user alarms (#alarm, and thus pvcalarms) and
+ * anything else that asked for a precise time, a little for kernel sleeps, and a
+ * lot for housekeeping, like TCP's timer tick. */
 
 #pragma once
 
@@ -65,7 +86,7 @@
 #include <kthread.h>
 
 /* These structures allow code to defer work for a certain amount of time.
- * Timer chains (like off a per-core timer) are made of lists/trees of these. */
+ * Timer chains (like off a per-core timer) are made of lists of these. */
 struct alarm_waiter {
 	uint64_t 					wake_up_time;	/* ugh, this is a TSC for now */
 	union {
@@ -74,25 +95,41 @@ struct alarm_waiter {
 		                  struct hw_trapframe *hw_tf);
 	};
 	void						*data;
-	TAILQ_ENTRY(alarm_waiter)	next;
+	uint64_t					slack;			/* TSC ticks */
+	BSD_LIST_ENTRY(alarm_waiter) next;
+	struct awaiter_list			*slot;		/* the list we're on */
 	bool						on_tchain;
 	bool						irq_ok;
 	bool						holds_tchain_lock;
 	bool						rkm_pending;
 	struct cond_var				rkm_cv;
 };
-TAILQ_HEAD(awaiters_tailq, alarm_waiter);		/* ideally not a LL */
+BSD_LIST_HEAD(awaiter_list, alarm_waiter);
 
 typedef void (*alarm_handler)(struct alarm_waiter *waiter);
 
+/* Level 0's slots are 1024 ticks, and the top level's window is 2^52 ticks,
+ * which is weeks. */
+#define TCHAIN_SLOT_BITS			6
+#define TCHAIN_NR_SLOTS				(1 << TCHAIN_SLOT_BITS)
+#define TCHAIN_NR_LEVELS			7
+#define TCHAIN_SHIFT_0				10
+
 /* One of these per alarm source, such as a per-core timer.  All tchains come
  * with a lock, even if its rarely needed (like the pcpu tchains).
  * set_interrupt() is a method for setting the interrupt source. */
 struct timer_chain {
 	spinlock_t					lock;
-	struct awaiters_tailq		waiters;
-	uint64_t					earliest_time;
-	uint64_t					latest_time;
+	unsigned int				nr_waiters;
+	uint64_t					earliest_time;	/* earliest deadline */
+	/* Base is never later than now.  Alarms before base file as if at base. */
+	uint64_t					base;
+	uint64_t					max_slack;		/* since last empty */
+	uint64_t					slot_map[TCHAIN_NR_LEVELS];
+	struct awaiter_list			slots[TCHAIN_NR_LEVELS][TCHAIN_NR_SLOTS];
+	struct awaiter_list			far;
+	/* Due, and about to have their handlers run by __trigger_tchain() */
+	struct awaiter_list			expired;
 	void (*set_interrupt)(struct timer_chain *);
 };
 
@@ -109,6 +146,13 @@ void init_awaiter_irq(struct alarm_waiter *waiter,
 void set_awaiter_abs(struct alarm_waiter *waiter, uint64_t abs_time);
 void set_awaiter_rel(struct alarm_waiter *waiter, uint64_t usleep);
 void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep);
+/* How much later than its time the alarm may fire, in usec.  Default 0. */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec);
+
+/* Slack defaults, in usec, by kind of alarm */
+#define ALARM_SLACK_PRECISE		0			/* user alarms, pacing, preemption */
+#define ALARM_SLACK_SLEEP		50			/* kthread sleeps and timeouts */
+#define ALARM_SLACK_LAZY		10000		/* housekeeping ticks and sweeps */
 /* Arms/disarms the alarm.  Can be called from within a handler.*/
 void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter);
 /* Unset and reset may block if the alarm is not IRQ.  Do not call from within a
@@ -126,6 +170,9 @@ bool reset_alarm_rel(struct timer_chain *tchain, struct alarm_waiter *waiter,
 void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf);
 /* Sets the timer chain interrupt according to the next timer in the chain. */
 void set_pcpu_alarm_interrupt(struct timer_chain *tchain);
+/* How long the calling core should be idle, in usec, judging by its alarms */
+#define ALARM_IDLE_FOREVER ((uint64_t)-1)
+uint64_t pcpu_idle_usec(void);
 
 /* Debugging */
 #define ALARM_POISON_TIME 12345				/* could use some work */
@@ -0,0 +1,49 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Sampled allocation-site profiling for the slab and kmalloc layers.
+ *
+ * When the sample rate is N, one in every N allocations on a core records a
+ * kernel backtrace.  Samples are aggregated by backtrace (the 'site'), and we
+ * track the sampled objects so that their frees come off the site's live
+ * count.  Each sample stands for N allocations, so the sizes of the site are
+ * scaled by the rate at which they were sampled.
+ *
+ * The report is in #mem/alloc_prof.  Write "rate N" to start sampling, "rate 0"
+ * to stop, and "reset" to throw away the sites.
+ *
+ * With the rate at 0, the only cost to the allocators is a read of a global
+ * that is never written. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <compiler.h>
+
+struct sized_alloc;
+
+extern unsigned int alloc_prof_rate;
+extern bool alloc_prof_tracking;
+
+void alloc_prof_init(void);
+void __alloc_prof_alloc(void *key, void *obj, size_t size);
+void __alloc_prof_free(void *key, void *obj);
+int alloc_prof_set_rate(unsigned int rate);
+void alloc_prof_reset(void);
+struct sized_alloc *alloc_prof_build_report(void);
+
+/* key disambiguates objects with the same address from different sources,
+ * e.g. arena qcaches.  Slabs use their kmem_cache. */
+static inline void alloc_prof_alloc(void *key, void *obj, size_t size)
+{
+	if (unlikely(alloc_prof_rate))
+		__alloc_prof_alloc(key, obj, size);
+}
+
+/* We need to catch frees of sampled objects even after sampling stopped, or we
+ * would attribute a reused address to a stale site. */
+static inline void alloc_prof_free(void *key, void *obj)
+{
+	if (unlikely(alloc_prof_tracking))
+		__alloc_prof_free(key, obj);
+}
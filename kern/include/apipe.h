@@ -47,7 +47,26 @@
  *
  * Likewise, we can make this a little more complicated and optimize for copying
  * many elements at once (like sys_pipe).  But we can hold off til we see how
- * people use this.  For now, this is built for one copy at a time. */
+ * people use this.  For now, this is built for one copy at a time.
+ *
+ * SPSC pipes:
+ *
+ * If you know there's only ever one reader and one writer at a time, use
+ * apipe_init_spsc().  Reads and writes don't lock; each side owns its offset
+ * and only grabs the lock to sleep on an empty/full ring, or to wake the other
+ * side if it went to sleep.  You can't use apipe_read_cond(), and you must not
+ * open more readers or writers.
+ *
+ * SPSC writers can also fill slots in place, instead of copying from a buffer:
+ *
+ * 		nr = apipe_write_reserve(&ap, 16);
+ * 		for (int i = 0; i < nr; i++)
+ * 			fill_in(apipe_write_slot(&ap, i));
+ * 		apipe_write_commit(&ap, nr);
+ *
+ * reserve blocks like write, and returns how many slots you got (maybe less
+ * than you asked for, 0 if there are no readers).  The reader doesn't see any
+ * of them until the commit, and each commit wakes the reader at most once. */
 
 #pragma once
 
@@ -67,6 +86,10 @@ struct atomic_pipe {
 	struct cond_var				ap_general_readers;
 	struct cond_var				ap_writers;
 	bool						ap_has_priority_reader;
+	bool						ap_spsc;
+	/* SPSC only: the side that's sleeping on the lock */
+	bool						ap_rd_waiting;
+	bool						ap_wr_waiting;
 };
 
 void apipe_init(struct atomic_pipe *ap, void *buf, size_t buf_sz,
@@ -77,6 +100,12 @@ int apipe_read_cond(struct atomic_pipe *ap,
 int apipe_write(struct atomic_pipe *ap, void *buf, size_t nr_elem);
 void *apipe_head(struct atomic_pipe *ap);
 
+void apipe_init_spsc(struct atomic_pipe *ap, void *buf, size_t buf_sz,
+                     size_t elem_sz);
+size_t apipe_write_reserve(struct atomic_pipe *ap, size_t nr_elem);
+void *apipe_write_slot(struct atomic_pipe *ap, size_t i);
+void apipe_write_commit(struct atomic_pipe *ap, size_t nr_elem);
+
 void apipe_open_reader(struct atomic_pipe *ap);
 void apipe_open_writer(struct atomic_pipe *ap);
 void apipe_close_reader(struct atomic_pipe *ap);
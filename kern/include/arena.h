@@ -107,6 +107,10 @@ void arena_free(struct arena *arena, void *addr, size_t size);
 void *arena_xalloc(struct arena *arena, size_t size, size_t align, size_t phase,
                    size_t nocross, void *minaddr, void *maxaddr, int flags);
 void arena_xfree(struct arena *arena, void *addr, size_t size);
+size_t arena_alloc_batch(struct arena *arena, void **addrs, size_t size,
+                         size_t nr, int flags);
+void arena_free_batch(struct arena *arena, void **addrs, size_t size,
+                      size_t nr);
 
 size_t arena_amt_free(struct arena *arena);
 size_t arena_amt_total(struct arena *arena);
@@ -46,6 +46,9 @@ struct spinlock {
 	uint32_t calling_core;
 	bool irq_okay;
 #endif
+#ifdef CONFIG_LOCK_STAT
+	uint64_t lockstat_tsc;
+#endif
 };
 typedef struct spinlock spinlock_t;
 #define SPINLOCK_INITIALIZER {0}
@@ -141,6 +144,21 @@ static inline void write_sequnlock(seqlock_t *lock);
 static inline seq_ctr_t read_seqbegin(seqlock_t *lock);
 static inline bool read_seqretry(seqlock_t *lock, seq_ctr_t ctr);
 
+/* Spinning reader-writer locks, for readers that can't sleep (e.g. page faults,
+ * some of which run with IRQs off).  Writers wait for the readers to drain.
+ * Once a writer is waiting, new readers wait for it, so writers don't starve,
+ * but that means readers can't nest. */
+struct spin_rwlock {
+	atomic_t			val;
+};
+#define SPIN_RWLOCK_INITIALIZER {0}
+
+static inline void spin_rwlock_init(struct spin_rwlock *rw);
+static inline void spin_rlock(struct spin_rwlock *rw);
+static inline void spin_runlock(struct spin_rwlock *rw);
+static inline void spin_wlock(struct spin_rwlock *rw);
+static inline void spin_wunlock(struct spin_rwlock *rw);
+
 /* Post work and poke synchronization.  This is a wait-free way to make sure
  * some code is run, usually by the calling core, but potentially by any core.
  * Under contention, everyone just posts work, and one core will carry out the
@@ -252,6 +270,9 @@ static inline void spinlock_init(spinlock_t *lock)
 	lock->calling_core = 0;
 	lock->irq_okay = FALSE;
 #endif
+#ifdef CONFIG_LOCK_STAT
+	lock->lockstat_tsc = 0;
+#endif
 }
 
 static inline void spinlock_init_irqsave(spinlock_t *lock)
@@ -262,6 +283,9 @@ static inline void spinlock_init_irqsave(spinlock_t *lock)
 	lock->calling_core = 0;
 	lock->irq_okay = TRUE;
 #endif
+#ifdef CONFIG_LOCK_STAT
+	lock->lockstat_tsc = 0;
+#endif
 }
 
 // If ints are enabled, disable them and note it in the top bit of the lock
@@ -361,3 +385,47 @@ static inline bool read_seqretry(seqlock_t *lock, seq_ctr_t ctr)
 {
 	return seqctr_retry(lock->r_ctr, ctr);
 }
+
+/* The low bits count readers; the writer sets the high bit. */
+#define SPIN_RWLOCK_WRITER		(1L << 31)
+
+static inline void spin_rwlock_init(struct spin_rwlock *rw)
+{
+	atomic_init(&rw->val, 0);
+}
+
+static inline void spin_rlock(struct spin_rwlock *rw)
+{
+	long old;
+
+	do {
+		while ((old = atomic_read(&rw->val)) & SPIN_RWLOCK_WRITER)
+			cpu_relax();
+	} while (!atomic_cas(&rw->val, old, old + 1));
+	cmb();
+}
+
+static inline void spin_runlock(struct spin_rwlock *rw)
+{
+	cmb();
+	atomic_dec(&rw->val);
+}
+
+static inline void spin_wlock(struct spin_rwlock *rw)
+{
+	long old;
+
+	do {
+		while ((old = atomic_read(&rw->val)) & SPIN_RWLOCK_WRITER)
+			cpu_relax();
+	} while (!atomic_cas(&rw->val, old, old | SPIN_RWLOCK_WRITER));
+	while (atomic_read(&rw->val) != SPIN_RWLOCK_WRITER)
+		cpu_relax();
+	cmb();
+}
+
+static inline void spin_wunlock(struct spin_rwlock *rw)
+{
+	wmb();
+	atomic_set(&rw->val, 0);
+}
@@ -0,0 +1,41 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Big-reader locks (sleeping locks).
+ *
+ * A reader-writer lock for data that is read much more often than it is
+ * written.  Readers only touch their own core's count, so they don't bounce a
+ * shared cache line around the machine.  In exchange, writers are slow: they
+ * have to look at every core's count, and each lock costs a cache line per
+ * core.
+ *
+ * Like the rwlock, readers favor readers: a writer waits for the readers to
+ * drain, and new readers can still come in while it waits.  Readers only block
+ * once the writer is in.  So if a thread holds an rlock, it can grab it again.
+ * Writers can starve. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <kthread.h>
+#include <atomic.h>
+
+struct br_count {
+	atomic_t					nr;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct brlock {
+	struct br_count				*counts;		/* one per core */
+	int							state;
+	/* Readers wait for the writer to leave, the writer for readers to drain */
+	struct cond_var				cv;
+	qlock_t						writer;
+};
+
+void br_init(struct brlock *br);
+void br_destroy(struct brlock *br);
+void br_rlock(struct brlock *br);
+bool br_canrlock(struct brlock *br);
+void br_runlock(struct brlock *br);
+void br_wlock(struct brlock *br);
+void br_wunlock(struct brlock *br);
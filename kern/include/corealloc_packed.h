@@ -31,6 +31,7 @@ struct core_request_data {
 	struct sched_pcore_tailq  alloc_me;           /* cores alloced to us */
 	struct sched_pcore_tailq  prov_alloc_me;      /* prov cores alloced us */
 	struct sched_pcore_tailq  prov_not_alloc_me;  /* maybe alloc to others */
+	int                       *node_counts;       /* our cores, per pnode */
 };
 
 static inline uint32_t spc2pcoreid(struct sched_pcore *spc)
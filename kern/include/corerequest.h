@@ -23,6 +23,10 @@ void corealloc_init(void);
 /* Initialize any data associated with allocating cores to a process. */
 void corealloc_proc_init(struct proc *p);
 
+/* Free any data associated with allocating cores to a process.  Called when p
+ * is freed, so it has no cores allocated. */
+void corealloc_proc_free(struct proc *p);
+
 /* Find the best core to allocate to a process as dictated by the core
  * allocation algorithm. If no core is found, return -1. This code assumes
  * that the scheduler that uses it holds a lock for the duration of the call.
@@ -81,13 +85,13 @@ static inline struct proc *get_prov_proc(uint32_t pcoreid)
 	return all_pcores[pcoreid].prov_proc;
 }
 
-/* TODO: need more thorough CG/LL management.  For now, core0 is the only LL
- * core.  This won't play well with the ghetto shit in schedule_init() if you do
- * anything like 'DEDICATED_MONITOR' or the ARSC server.  All that needs an
- * overhaul. */
+/* TODO: need more thorough CG/LL management.  For now, the first
+ * CONFIG_NR_LL_CORES cores are the LL cores, and core 0 always is.  This won't
+ * play well with the ghetto shit in schedule_init() if you do anything like
+ * 'DEDICATED_MONITOR' or the ARSC server.  All that needs an overhaul. */
 static inline bool is_ll_core(uint32_t pcoreid)
 {
-	if (pcoreid == 0)
+	if (pcoreid == 0 || pcoreid < CONFIG_NR_LL_CORES)
 		return TRUE;
 	return FALSE;
 }
@@ -99,6 +103,7 @@ static inline uint32_t max_vcores(struct proc *p)
 #ifdef CONFIG_DISABLE_SMT
 	return num_cores >> 1;
 #else
-	return num_cores - 1;	/* reserving core 0 */
+	/* reserving the LL cores */
+	return num_cores - MIN(CONFIG_NR_LL_CORES, num_cores - 1);
 #endif /* CONFIG_DISABLE_SMT */
 }
@@ -17,9 +17,11 @@
 #include <sys/queue.h>
 #include <atomic.h>
 #include <mm.h>
+#include <core_set.h>
 #include <schedule.h>
 #include <devalarm.h>
 #include <ns.h>
+#include <rhashtable.h>
 #include <arch/vmm/vmm.h>
 
 TAILQ_HEAD(vcore_tailq, vcore);
@@ -62,6 +64,8 @@ struct proc {
 	struct cond_var child_wait;	/* signal for dying or o/w waitable child */
 	uint32_t state;				// Status of the process
 	struct kref p_kref;		/* Refcnt */
+	struct rhash_node pid_link;	/* in the pid_hash */
+	struct rcu_head rcu;		/* freed after a grace period, for pid2proc */
 	uint32_t env_flags;
 	/* Lists of vcores */
 	struct vcore_tailq online_vcs;
@@ -79,10 +83,37 @@ struct proc {
 	// Address space
 	pgdir_t env_pgdir;			// Kernel virtual address of page dir
 	physaddr_t env_cr3;			// Physical address of page dir
-	spinlock_t vmr_lock;		/* Protects VMR tree (mem mgmt) */
+	/* Protects the VMRs.  Faults only read them, so they share it. */
+	struct spin_rwlock vmr_lock;
 	spinlock_t pte_lock;		/* Protects page tables (mem mgmt) */
-	struct vmr_tailq vm_regions;
+	struct vmr_tailq vm_regions;	/* sorted by address */
+	struct rb_root vm_tree;			/* same VMRs, by address (see mm.c) */
 	int vmr_history;
+	int jumbo_policy;			/* MM_JUMBO_*, for anonymous memory */
+	unsigned int fault_around;	/* pages, see MM_FAULT_AROUND_* */
+	struct mempolicy mpol;		/* for VMRs without their own (see numa.c) */
+	unsigned long mpol_ilv_next;	/* interleave rotor, for pages without a va */
+	/* Anon memory currently mapped, in 4K and 2M PTEs, and how many anon jumbos
+	 * were ever broken up.  Protected by the pte_lock. */
+	unsigned long nr_anon_pgs;
+	unsigned long nr_anon_jumbos;
+	unsigned long nr_jumbo_demotions;
+	/* CoW write faults that copied the page, and that just got it back */
+	unsigned long nr_cow_breaks;
+	unsigned long nr_cow_reuses;
+	/* Pages mapped by fault-around, under the pte_lock */
+	unsigned long nr_fault_around_maps;
+	/* Cores that might have our TLB entries (see proc_tlbshootdown()) */
+	struct core_set tlb_cores;
+	/* Sum of the VMRs' sizes, under the vmr_lock.  Readers are racy. */
+	size_t vm_bytes;
+	/* TLB stats: munmaps are protected by the vmr_lock, the others are racy */
+	unsigned long nr_munmaps;
+	unsigned long nr_tlb_shootdowns;
+	unsigned long nr_tlb_ipis;
+	/* Per-vcore counters, max_vcores of them.  Each is changed by the pcore
+	 * the vcore is on, or under the proc lock; readers are racy. */
+	struct vcore_stats *vcore_stats;
 
 	// Per process info and data pages
  	procinfo_t *procinfo;       // KVA of per-process shared info table (RO)
@@ -102,6 +133,9 @@ struct proc {
 	struct pgrp					*pgrp;
 	struct chan					*slash;
 	struct chan					*dot;
+	/* User pointer, see FDTAP_CMD_TABLE */
+	struct fd_tap_slot			*tap_slots;
+	unsigned int				nr_tap_slots;
 
 
 	/* UCQ hashlocks */
@@ -111,6 +145,10 @@ struct proc {
 	struct proc_alarm_set		alarmset;
 	struct cv_lookup_tailq		abortable_sleepers;
 	spinlock_t					abort_list_lock;
+	/* Syscall ring, see sysc_ring.c */
+	spinlock_t					sysc_ring_lock;
+	uint32_t					sysc_ring_cons;
+	atomic_t					sysc_ring_pollers;
 
 	/* VMMCP */
 	struct vmm vmm;
@@ -134,6 +172,8 @@ void	env_pagetable_free(env_t* e);
 
 typedef int (*mem_walk_callback_t)(env_t* e, pte_t pte, void* va, void* arg);
 int		env_user_mem_walk(env_t* e, void* start, size_t len, mem_walk_callback_t callback, void* arg);
+int		env_user_jumbo_walk(env_t *e, void *start, size_t len,
+		                    mem_walk_callback_t callback, void *arg);
 
 static inline void set_traced_proc(struct proc *p, bool traced)
 {
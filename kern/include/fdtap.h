@@ -28,8 +28,10 @@ struct fd_tap {
 	struct event_queue			*ev_q;
 	int							ev_id;
 	void						*data;
+	bool						has_slot;	/* tap table slot was set up */
 };
 
 int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req);
 int remove_fd_tap(struct proc *p, int fd);
+int set_fd_tap_table(struct proc *p, struct fd_tap_req *tap_req);
 int fire_tap(struct fd_tap *tap, int filter);
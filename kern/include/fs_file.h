@@ -129,6 +129,7 @@ size_t fs_file_stat(struct fs_file *f, uint8_t *m_buf, size_t m_buf_sz);
 void fs_file_truncate(struct fs_file *f, off64_t to);
 size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
                     off64_t offset);
+struct block *fs_file_bread(struct fs_file *f, size_t count, off64_t offset);
 size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
                      off64_t offset);
 size_t fs_file_wstat(struct fs_file *f, uint8_t *m_buf, size_t m_buf_sz);
@@ -32,5 +32,9 @@ extern bool booting;
 const char *get_boot_option(const char *base, const char *option, char *param,
 							size_t max_param);
 
+/* Marks the end of a boot phase named name, which must be static.  We print how
+ * long each phase took when we're done booting. */
+void boot_phase(const char *name);
+
 void _panic(const char *file, int line, const char *fmt, ...);
 void _warn(const char *file, int line, const char *fmt, ...);
@@ -10,10 +10,12 @@
 #include <ros/common.h>
 #include <kref.h>
 
-#define NUM_KMALLOC_CACHES 6
+/* kmalloc's slab caches, one per size class.  The sizes (see kmalloc.c) are
+ * multiples of the alignment, with classes at 1.25x, 1.5x, and 1.75x between
+ * the powers of two.  Anything bigger than the LARGEST comes from kpages. */
+#define NUM_KMALLOC_CACHES 24
 #define KMALLOC_ALIGNMENT 16
-#define KMALLOC_SMALLEST (sizeof(struct kmalloc_tag) << 1)
-#define KMALLOC_LARGEST KMALLOC_SMALLEST << NUM_KMALLOC_CACHES
+#define KMALLOC_LARGEST 2048
 
 void kmalloc_init(void);
 void *kmalloc(size_t size, int flags);
@@ -26,6 +28,10 @@ void *kreallocarray(void *buf, size_t nmemb, size_t size, int flags);
 int kmalloc_refcnt(void *buf);
 void kmalloc_incref(void *buf);
 void kfree(void *buf);
+void *kmalloc_sized(size_t size, int flags);
+void *kzmalloc_sized(size_t size, int flags);
+void kfree_sized(void *buf, size_t size);
+void *kmalloc_frag(size_t size, int flags);
 void kmalloc_canary_check(char *str);
 void *debug_canary;
 
@@ -43,6 +49,7 @@ void *debug_canary;
 #define KMALLOC_TAG_CACHE		1	/* memory came from slabs */
 #define KMALLOC_TAG_PAGES		2	/* memory came from page allocator */
 #define KMALLOC_TAG_UNALIGN		3	/* not a real tag, jump back by offset */
+#define KMALLOC_TAG_FRAG		4	/* memory is a piece of a frag chunk */
 #define KMALLOC_ALIGN_SHIFT		4	/* max flag is 16 */
 #define KMALLOC_FLAG_MASK		((1 << KMALLOC_ALIGN_SHIFT) - 1)
 
@@ -54,6 +61,7 @@ struct kmalloc_tag {
 	union {
 		struct kmem_cache *my_cache;
 		size_t amt_alloc;
+		struct kmalloc_frag_chunk *frag_chunk;
 		uint64_t unused_force_align;
 	};
 	struct kref kref;
@@ -61,6 +69,17 @@ struct kmalloc_tag {
 	int flags;
 };
 
+/* Frags are carved out of per-core chunks of pages.  Each frag holds a ref on
+ * its chunk, and the chunk is freed when the last frag goes away.  Requests
+ * bigger than KMALLOC_FRAG_MAX are regular kmallocs. */
+#define KMALLOC_FRAG_CHUNK_SZ	(4 * PGSIZE)
+#define KMALLOC_FRAG_MAX		PGSIZE
+
+struct kmalloc_frag_chunk {
+	struct kref					kref;
+	size_t						size;
+};
+
 /* This is aligned so that the buf is aligned to the usual kmalloc alignment. */
 struct sized_alloc {
 	void						*buf;
@@ -13,6 +13,7 @@
 #include <trap.h>
 #include <sys/queue.h>
 #include <atomic.h>
+#include <lockstat.h>
 #include <setjmp.h>
 
 struct errbuf {
@@ -22,6 +23,7 @@ struct errbuf {
 struct proc;
 struct kthread;
 struct semaphore;
+struct lb_defer;
 TAILQ_HEAD(kthread_tailq, kthread);
 TAILQ_HEAD(semaphore_tailq, semaphore);
 
@@ -30,6 +32,8 @@ TAILQ_HEAD(semaphore_tailq, semaphore);
 #define KTH_IS_KTASK			(1 << 0)
 #define KTH_SAVE_ADDR_SPACE		(1 << 1)
 #define KTH_IS_RCU_KTASK		(1 << 2)
+#define KTH_HOME_CORE			(1 << 3)	/* wakes up on kth->home_core */
+#define KTH_WAIT_EXCL			(1 << 4)	/* in cv_wait_excl() */
 
 /* These flag sets are for toggling between ktasks and default/process ktasks */
 /* These are the flags for *any* ktask */
@@ -54,6 +58,24 @@ struct kthread {
 	int							errno;
 	char						errstr[MAX_ERRSTR_LEN];
 	struct systrace_record		*strace;
+	uint64_t					strace_bin_tsc;	/* binary strace entry */
+	unsigned int				strace_bin_num;
+	uint32_t					home_core;
+	char						*sysc_str;	/* name points here for syscalls */
+	uint64_t					block_tsc;
+	uint64_t					runnable_tsc;
+	uint64_t					offcpu_tsc;	/* last sleep, for the profiler */
+	struct lb_defer				*lb_defer;	/* local packets to deliver */
+	struct kthread				*batch_next;	/* kthread_batch */
+};
+
+/* Kthreads to make runnable together: everyone headed for the same core goes
+ * in one kmsg.  Add them with kthread_batch_add() instead of calling
+ * kthread_runnable(), then kthread_batch_flush().  Like kthread_runnable(),
+ * you can't touch a kthread once it's flushed. */
+struct kthread_batch {
+	struct kthread				*head;
+	struct kthread				**tail;
 };
 
 /* Semaphore for kthreads to sleep on.  0 or less means you need to sleep */
@@ -66,6 +88,9 @@ struct semaphore {
 	TAILQ_ENTRY(semaphore)		link;
 	bool						is_on_list;	/* would like better sys/queue.h */
 #endif
+#ifdef CONFIG_LOCK_STAT
+	uint64_t					lockstat_tsc;	/* when it was qlocked */
+#endif
 };
 
 /* omitted elements (the sem debug stuff) are initialized to 0 */
@@ -112,9 +137,15 @@ struct kthread *__kthread_zalloc(void);
 void __use_real_kstack(void (*f)(void *arg));
 void restart_kthread(struct kthread *kthread);
 void kthread_runnable(struct kthread *kthread);
+void kthread_batch_init(struct kthread_batch *kb);
+void kthread_batch_add(struct kthread_batch *kb, struct kthread *kthread);
+void kthread_batch_flush(struct kthread_batch *kb);
 void kthread_yield(void);
 void kthread_usleep(uint64_t usec);
+void kthread_usleep_slack(uint64_t usec, uint64_t slack_usec);
 void ktask(char *name, void (*fn)(void*), void *arg);
+void ktask_on(uint32_t coreid, char *name, void (*fn)(void*), void *arg);
+void kthread_set_home_core(uint32_t coreid);
 
 static inline bool is_ktask(struct kthread *kthread)
 {
@@ -141,6 +172,7 @@ void sem_down_bulk_irqsave(struct semaphore *sem, int nr_signals,
 void sem_down_irqsave(struct semaphore *sem, int8_t *irq_state);
 bool sem_up_irqsave(struct semaphore *sem, int8_t *irq_state);
 void print_all_sem_info(pid_t pid);
+void print_kthread_stats(void);
 
 void cv_init(struct cond_var *cv);
 void cv_init_irqsave(struct cond_var *cv);
@@ -152,8 +184,10 @@ void cv_lock_irqsave(struct cond_var *cv, int8_t *irq_state);
 void cv_unlock_irqsave(struct cond_var *cv, int8_t *irq_state);
 void cv_wait_and_unlock(struct cond_var *cv);	/* does not mess with irqs */
 void cv_wait(struct cond_var *cv);
+void cv_wait_excl(struct cond_var *cv);
 void __cv_signal(struct cond_var *cv);
 void __cv_broadcast(struct cond_var *cv);
+void __cv_wakeup(struct cond_var *cv);
 void cv_signal(struct cond_var *cv);
 void cv_broadcast(struct cond_var *cv);
 void cv_signal_irqsave(struct cond_var *cv, int8_t *irq_state);
@@ -173,7 +207,13 @@ void switch_back_from_ktask(uintptr_t old_ret);
  * Not sure if they'll need irqsave or normal sems. */
 typedef struct semaphore qlock_t;
 #define qlock_init(x) sem_init((x), 1)
+#ifdef CONFIG_LOCK_STAT
+#define qlock(x) lockstat_qlock(x)
+#define qunlock(x) lockstat_qunlock(x)
+#define canqlock(x) lockstat_canqlock(x)
+#else
 #define qlock(x) sem_down(x)
 #define qunlock(x) sem_up(x)
 #define canqlock(x) sem_trydown(x)
+#endif
 #define QLOCK_INITIALIZER(name) SEMAPHORE_INITIALIZER(name, 1)
@@ -0,0 +1,36 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Latency histograms for scheduling and IRQ events, per core, always on.
+ *
+ * The histograms are log-linear in TSC ticks: each power of two is split into
+ * LAT_NR_SUB linear buckets, so a bucket's width is at most 1/LAT_NR_SUB of its
+ * value.  Recording is a bucket computation and an increment.  Each event is
+ * recorded from only one context (IRQ or not), so the increments don't need
+ * to be atomic.  #kprof/latency has the sum over all cores. */
+
+#pragma once
+
+#include <ros/common.h>
+
+enum {
+	LAT_KTHREAD_WAKEUP,		/* kthread_runnable() until it runs */
+	LAT_MCP_WAKEUP,			/* __sched_mcp_wakeup() until __proc_run_m() */
+	LAT_SCP_WAKEUP,			/* __sched_scp_wakeup() until proc_run_s() */
+	LAT_IRQ_HANDLER,		/* irq_dispatch() until the ISRs are done */
+	LAT_TIMER_IRQ,			/* an alarm's deadline until its IRQ runs */
+	LAT_WORK_WAIT,			/* queueing work until a worker starts it */
+	LAT_ZERO_PAGE,			/* getting a zeroed user page, alloc and zero */
+	NR_LAT_EVENTS,
+};
+
+#define LAT_SUB_BITS			2
+#define LAT_NR_SUB				(1 << LAT_SUB_BITS)
+/* Anything past 2^41 ticks (minutes) goes in the last bucket. */
+#define LAT_NR_BUCKETS			(40 * LAT_NR_SUB)
+
+struct cmdbuf;
+
+void lat_record(int event, uint64_t tsc_delta);
+void lat_ctl(struct cmdbuf *cb);
+size_t lat_read(void *va, size_t n, off64_t offset);
@@ -59,6 +59,13 @@ struct ib_umem {
 	struct sg_table sg_head;
 	int             nmap;
 	int             npages;
+#if 1	/* AKAROS */
+	/* Registration cache, see umem.c.  Protected by the context's
+	 * umem_cache_lock. */
+	struct list_head	cache_link;
+	int			cache_refs;
+	int			vmr_history;
+#endif	/* AKAROS */
 };
 
 /* Returns the offset of the umem start relative to the first page. */
@@ -92,6 +99,10 @@ void ib_umem_release(struct ib_umem *umem);
 int ib_umem_page_count(struct ib_umem *umem);
 int ib_umem_copy_from(void *dst, struct ib_umem *umem, size_t offset,
 		      size_t length);
+#if 1	/* AKAROS */
+void ib_umem_cache_init(struct ib_ucontext *context);
+void ib_umem_cache_flush(struct ib_ucontext *context);
+#endif	/* AKAROS */
 
 #else /* CONFIG_INFINIBAND_USER_MEM */
 
@@ -1142,6 +1142,14 @@ struct ib_ucontext {
 	int			closing;
 
 	struct pid             *tgid;
+#if 1	/* AKAROS */
+	/* Pinned umems, in use or idle, in order of last use.  See umem.c. */
+	qlock_t			umem_cache_lock;
+	struct list_head	umem_cache;
+	unsigned long		umem_cache_idle_pages;
+	unsigned long		umem_cache_munmaps;
+	pid_t			umem_cache_pid;
+#endif	/* AKAROS */
 #ifdef CONFIG_INFINIBAND_ON_DEMAND_PAGING
 	struct rb_root      umem_tree;
 	/*
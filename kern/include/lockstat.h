@@ -0,0 +1,35 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Lock contention statistics (CONFIG_LOCK_STAT).
+ *
+ * Spinlocks and qlocks report every acquisition and release here while the
+ * stats are on.  We track each lock by its address: how often it was grabbed,
+ * how often someone had to wait, how long they waited and how long it was
+ * held.  #kprof/lockstat lists the locks we waited on the most. */
+
+#pragma once
+
+#include <ros/common.h>
+
+struct spinlock;
+struct semaphore;
+struct cmdbuf;
+
+#ifdef CONFIG_LOCK_STAT
+
+extern bool lockstat_enabled;
+
+void lockstat_spin_lock(struct spinlock *lock, uintptr_t pc);
+void lockstat_spin_trylocked(struct spinlock *lock, uintptr_t pc);
+void lockstat_spin_unlock(struct spinlock *lock);
+
+void lockstat_qlock(struct semaphore *sem);
+bool lockstat_canqlock(struct semaphore *sem);
+void lockstat_qunlock(struct semaphore *sem);
+
+#endif /* CONFIG_LOCK_STAT */
+
+/* For #kprof/lockstat.  These error() if CONFIG_LOCK_STAT is off. */
+void lockstat_ctl(struct cmdbuf *cb);
+size_t lockstat_read(void *va, size_t n, off64_t offset);
@@ -16,6 +16,6 @@ static inline bool management_core(void);
 
 static inline bool management_core(void)
 {
-	// currently returns true for only core 0
-	return !core_id();
+	/* the LL cores, which run the ksched and SCPs */
+	return core_id() < CONFIG_NR_LL_CORES;
 }
@@ -14,9 +14,12 @@
 #include <slab.h>
 #include <kref.h>
 #include <rcu.h>
+#include <rbtree.h>
+#include <numa.h>
 
 struct chan;
 struct fd_table;
+struct page;
 struct proc;								/* preprocessor games */
 
 #define F_OR_C_CHAN 2
@@ -46,6 +49,9 @@ size_t foc_get_len(struct file_or_chan *foc);
  * VMRs. */
 struct vm_region {
 	TAILQ_ENTRY(vm_region)		vm_link;
+	struct rb_node				vm_rb;
+	/* Largest gap after a VMR in our subtree (see vmr_gap()) */
+	uintptr_t					vm_max_gap;
 	TAILQ_ENTRY(vm_region)		vm_pm_link;
 	struct proc					*vm_proc;	/* owning process, for now */
 	uintptr_t					vm_base;
@@ -54,6 +60,7 @@ struct vm_region {
 	int							vm_flags;
 	struct file_or_chan			*__vm_foc;
 	size_t						vm_foff;
+	struct mempolicy			vm_mpol;	/* MPOL_DEFAULT: use the proc's */
 	bool						vm_ready;	/* racy, for the PM checks */
 	bool						vm_shootdown_needed;
 };
@@ -78,6 +85,16 @@ void enumerate_vmrs(struct proc *p,
 					void (*func)(struct vm_region *vmr, void *opaque),
 					void *opaque);
 
+/* Per-process policy for backing anonymous VMRs with jumbo (PTSIZE) pages. */
+#define MM_JUMBO_MADVISE		0	/* only MAP_HUGEPAGE VMRs (default) */
+#define MM_JUMBO_NEVER			1
+#define MM_JUMBO_ALWAYS			2
+
+/* Fault-around: a fault on a shared file VMR also maps up to this many of the
+ * cached pages around it (per process, 0 for off). */
+#define MM_FAULT_AROUND_DEFAULT	16
+#define MM_FAULT_AROUND_MAX		64
+
 /* mmap() related functions.  These manipulate VMRs and change the hardware page
  * tables.  Any requests below the LOWEST_VA will silently be upped.  This may
  * be a dynamic proc-specific variable later. */
@@ -92,6 +109,11 @@ int munmap(struct proc *p, uintptr_t addr, size_t len);
 int handle_page_fault(struct proc *p, uintptr_t va, int prot);
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot);
 unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs);
+int madvise(struct proc *p, uintptr_t addr, size_t len, int advice);
+int mbind(struct proc *p, uintptr_t addr, size_t len, int mode,
+          unsigned long nodes);
+size_t uva_share_pages_cow(struct proc *p, uintptr_t uva, size_t nr_pgs,
+                           struct page **pages);
 
 /* These assume the mm_lock is held already */
 int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
@@ -29,13 +29,23 @@
 
 #pragma once
 #include <ns.h>
+#include <rcu.h>
+#include <rhashtable.h>
+#include <percpu.h>
+#include <smp.h>
+#include <kmalloc.h>
+#include <ros/bpf.h>
 
 enum {
 	Addrlen = 64,
 	Maxproto = 20,
-	Nhash = 64,
 	Maxincall = 500,
+	Convcache = 16,	/* free conv hints per core, see Fsconvfree() */
 	Nchans = 256,
+	/* Convs per proto for TCP and UDP; the conv arrays start at Nchans and
+	 * grow.  devip's qids have Logconv bits for the conv. */
+	Logmaxconv = 18,
+	Maxconv = 1 << Logmaxconv,
 	MAClen = 16,	/* longest mac address */
 
 	MAXTTL = 255,
@@ -87,6 +97,10 @@ struct conv {
 	uint32_t ttl;				/* max time to live */
 	uint32_t tos;				/* type of service */
 	int ignoreadvice;			/* don't terminate connection on icmp errors */
+	uint32_t busypoll_usec;		/* spin on the NIC before blocking reads */
+	bool batch;					/* data file reads/writes many messages */
+	struct tls *tls_tx;			/* kernel TLS, see tls.c, set under qlock */
+	struct tls *tls_rx;
 
 	uint8_t ipversion;
 	uint8_t laddr[IPaddrlen];	/* local IP address */
@@ -106,7 +120,9 @@ struct conv {
 	int headers;				/* data src/dst headers in udp */
 	int reliable;				/* true if reliable udp */
 
-	struct conv *incall;		/* calls waiting to be listened for */
+	struct conv *incall;		/* calls waiting to be listened for, */
+	struct conv *incall_new;	/* and newer ones, LIFO, see Fsnewcall() */
+	atomic_t nr_incall;
 	struct conv *next;
 
 	struct queue *rq;			/* queued data waiting to be read */
@@ -173,7 +189,11 @@ struct medium {
 	/* v6 address generation */
 	void (*pref2addr) (uint8_t * pref, uint8_t * ea);
 
+	/* busy poll the device's rx and run input inline, returns nr packets */
+	int (*poll) (struct Ipifc * ifc, int budget);
+
 	int unbindonclose;			/* if non-zero, unbind on last close */
+	int gso;					/* bwrite segments Btso blocks */
 };
 
 /* logical interface associated with a physical one */
@@ -219,7 +239,7 @@ struct routerparams {
 };
 
 struct Ipifc {
-	rwlock_t rwlock;
+	struct brlock rwlock;
 
 	struct conv *conv;			/* link to its conversation structure */
 	char dev[64];				/* device we're attached to */
@@ -244,6 +264,9 @@ struct Ipifc {
 	uint32_t in, out;			/* message statistics */
 	uint32_t inerr, outerr;		/* ... */
 	uint32_t tracedrop;
+	atomic_t gro_merged;		/* segments merged into a predecessor */
+	atomic_t gro_chains;		/* merged datagrams delivered */
+	atomic_t gro_passed;		/* packets delivered unmerged */
 
 	uint8_t sendra6;			/* == 1 => send router advs on this ifc */
 	uint8_t recvra6;			/* == 1 => recv router advs on this ifc */
@@ -264,8 +287,6 @@ struct Ipmulti {
  *  hash table for 2 ip addresses + 2 ports
  */
 enum {
-	Nipht = 521,				/* convenient prime */
-
 	IPmatchexact = 0,	/* match on 4 tuple */
 	IPmatchany,	/* *!* */
 	IPmatchport,	/* *!port */
@@ -273,25 +294,36 @@ enum {
 	IPmatchpa,	/* addr!port */
 };
 struct Iphash {
-	struct Iphash *next;
+	struct rhash_node link;
 	struct conv *c;
 	int match;
+	struct rcu_head rcu;
 };
 
-struct Iphash;
+/* Lookups are RCU.  Adds and removes lock a bucket. */
 struct Ipht {
-	spinlock_t lock;
-	struct Iphash *tab[Nipht];
+	struct rhashtable ht;
 };
+void ipht_init(struct Ipht *ht);
 void iphtadd(struct Ipht *, struct conv *);
 void iphtrem(struct Ipht *, struct conv *);
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp);
+struct conv *iphtfind(struct Ipht *ht, struct conv *skip, uint8_t *raddr,
+                      uint16_t rport, uint8_t *laddr, uint16_t lport);
 void dump_ipht(struct Ipht *ht);
 
 /*
  *  one per multiplexed Protocol
  */
+/* Convs we saw get freed on this core, which Fsprotoclonecached() tries before
+ * it falls back to the proto qlock.  Only hints: they could be reused by the
+ * time we look. */
+struct conv_cache {
+	struct conv *convs[Convcache];
+	int nr;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 struct Proto {
 	qlock_t qlock;
 	char *name;					/* protocol name */
@@ -316,10 +348,14 @@ struct Proto {
 	int (*gc) (struct Proto *);	/* returns true if any conversations are freed */
 
 	struct Fs *f;				/* file system this proto is part of */
-	struct conv **conv;			/* array of conversations */
+	struct conv **conv;			/* array of conversations, RCU */
 	int ptclsize;				/* size of per protocol ctl block */
 	int nc;						/* number of conversations */
 	int ac;
+	int maxnc;					/* conv can grow to this, 0 for nc */
+	int nextconv;				/* where Fsprotoclone looks first */
+	struct conv_cache *conv_cache;	/* per core, free conv hints */
+	struct Ipht *ht;			/* proto's demux table, if any */
 	struct qid qid;				/* qid for protocol directory */
 	uint16_t nextport;
 	uint16_t nextrport;
@@ -396,6 +432,19 @@ int Fspcolstats(char *unused_char_p_t, int);
 int Fsproto(struct Fs *, struct Proto *);
 int Fsbuiltinproto(struct Fs *, uint8_t unused_uint8_t);
 struct conv *Fsprotoclone(struct Proto *, char *unused_char_p_t);
+struct conv *Fsprotoclonecached(struct Proto *p, char *user);
+void Fsconvfree(struct conv *c);
+
+/* Convs are never freed, but the array of them is replaced when it grows. */
+static inline struct conv *proto_conv(struct Proto *p, int x)
+{
+	struct conv *c;
+
+	rcu_read_lock();
+	c = rcu_dereference(p->conv)[x];
+	rcu_read_unlock();
+	return c;
+}
 struct Proto *Fsrcvpcol(struct Fs *, uint8_t unused_uint8_t);
 struct Proto *Fsrcvpcolx(struct Fs *, uint8_t unused_uint8_t);
 void Fsstdconnect(struct conv *, char **, int);
@@ -547,6 +596,7 @@ struct arpent {
 	uint8_t rxtsrem;
 	struct Ipifc *ifc;
 	uint8_t ifcid;				/* must match ifc->id */
+	seq_ctr_t seq;				/* for lockless readers, see arp.c */
 };
 
 extern void arpinit(struct Fs *);
@@ -651,6 +701,46 @@ extern void ipifc_trace_block(struct Ipifc *ifc, struct block *bp);
 extern long ipselftabread(struct Fs *, char *a, uint32_t offset, int n);
 extern void ipsendra6(struct Fs *f, int on);
 
+/*
+ *  gro.c
+ */
+enum {
+	GRO_MAX_FLOWS = 8,
+};
+
+struct gro_flow {
+	struct block *head;			/* first segment, with the headers */
+	struct block *tail;
+	uint32_t next_seq;
+	unsigned int seg_len;		/* payload of the first segment */
+	unsigned int ip_len;		/* of the merged datagram */
+	unsigned int nr_segs;
+	bool done;					/* can't take more segments */
+};
+
+/* One per receive queue; not thread safe. */
+struct gro {
+	struct Fs *f;
+	struct Ipifc *ifc;			/* for stats */
+	void (*deliver)(void *arg, struct block *bp);
+	void *arg;
+	unsigned int victim;
+	unsigned int nr_merged;		/* since the last flush */
+	unsigned int nr_chains;
+	unsigned int nr_passed;
+	struct gro_flow flows[GRO_MAX_FLOWS];
+};
+
+extern void gro_init(struct gro *g, struct Fs *f, struct Ipifc *ifc,
+                     void (*deliver)(void *arg, struct block *bp), void *arg);
+extern void gro_receive(struct gro *g, struct block *bp);
+extern void gro_flush(struct gro *g);
+
+/*
+ *  gso.c
+ */
+extern struct block *gso_segment(struct block *bp);
+
 /*
  *  ip.c
  */
@@ -669,7 +759,40 @@ extern int ipoput4(struct Fs *,
 extern int ipoput6(struct Fs *,
 				   struct block *, int unused_int, int, int, struct conv *);
 extern int ipstats(struct Fs *, char *unused_char_p_t, int);
+
+/* Stack-wide MIB counters.  Each core bumps its own copy, so packets on
+ * different cores don't bounce the counters' cache lines, and readers sum the
+ * copies.  Gauges like CurrEstab work too, since the per-core deltas add up.
+ * The increments aren't atomic; the stack doesn't count from IRQ context. */
+static inline uint64_t *netstats_alloc(size_t nr_stats)
+{
+	return __percpu_zalloc(nr_stats * sizeof(uint64_t), __alignof__(uint64_t),
+	                       MEM_WAIT);
+}
+
+#define netstat_add(stats, idx, amt) (PERCPU_VARPTR(*(stats))[(idx)] += (amt))
+#define netstat_inc(stats, idx) netstat_add(stats, idx, 1)
+#define netstat_dec(stats, idx) netstat_add(stats, idx, -1)
+
+static inline uint64_t netstat_read(uint64_t *stats, int idx)
+{
+	uint64_t sum = 0;
+
+	for_each_core(i)
+		sum += _PERCPU_VARPTR(*stats, i)[idx];
+	return sum;
+}
+
+/* For the stats that are settings, not counts. */
+static inline void netstat_set(uint64_t *stats, int idx, uint64_t val)
+{
+	for_each_core(i)
+		_PERCPU_VARPTR(*stats, i)[idx] = 0;
+	_PERCPU_VARPTR(*stats, 0)[idx] = val;
+}
 extern uint16_t ptclbsum(uint8_t * unused_uint8_p_t, int);
+extern uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len);
+extern int ptclbsum_copy_from_user(uint8_t *dst, const uint8_t *src, int len);
 extern uint16_t ptclcsum(struct block *, int unused_int, int);
 extern void ip_init(struct Fs *);
 extern void update_mtucache(uint8_t * unused_uint8_p_t, uint32_t);
@@ -701,6 +824,8 @@ static inline void ptclcsum_finalize(struct block *bp, unsigned int feat)
 	}
 }
 
+struct block *linearize_csum_finalize(struct block *bp, unsigned int feat);
+
 /*
  *  iprouter.c
  */
@@ -962,6 +1087,9 @@ enum {
 	Nstatqid,
 	Ntypeqid,
 	Nifstatqid,
+	Nqstatqid,
+	Nfilterqid,
+	Nxskqid,
 };
 
 /*
@@ -988,12 +1116,62 @@ struct netfile {
 	int scan;					/* base station scanning interval */
 	int bridge;					/* bridge mode */
 	int headersonly;			/* headers only - no data */
+	int rxq_idx;				/* our flows in the rx queue group, */
+	int rxq_nr;					/* if rxq_nr, see etheriq() */
 	uint8_t maddr[8];			/* bitmask of multicast addresses requested */
 	int nmaddr;					/* number of multicast addresses */
+	struct bpf_prog *filter;	/* RCU, set under qlock */
+	struct netxsk *xsk;			/* mapped rings, RCU, set under qlock */
 
 	struct queue *in;			/* input buffer */
 };
 
+/* bpf.c */
+struct bpf_prog {
+	struct rcu_head rcu;
+	unsigned int len;
+	struct bpf_insn insns[];
+};
+
+struct bpf_prog *bpf_prog_load(const void *buf, size_t n);
+unsigned int bpf_run(struct bpf_prog *prog, struct block *bp);
+
+/* loopbackmedium.c */
+struct lb_defer {
+	bool active;
+	struct Ipifc *ifc;
+	struct block *head;
+	struct block **tail;
+};
+
+void loopback_defer_begin(struct lb_defer *ld);
+void loopback_defer_end(struct lb_defer *ld);
+
+/* tls.c */
+struct tls;
+
+void tlsctlmsg(struct conv *c, struct cmdbuf *cb);
+void tls_free(struct tls *t);
+size_t tls_write(struct conv *c, struct iovec *iov, int iovcnt, bool nonblock);
+size_t tls_bwrite(struct conv *c, struct block *bp, bool nonblock);
+size_t tls_read(struct conv *c, void *va, size_t n, bool nonblock);
+int tls_state(struct conv *c, char *buf, int len);
+
+/* xsk.c */
+struct netxsk;
+struct fd_tap;
+struct fs_file;
+
+struct netxsk *xsk_create(uint32_t nr_frames, uint32_t frame_size,
+                          uint32_t ring_size);
+void xsk_destroy(struct netxsk *x);
+struct fs_file *xsk_mmap(struct netxsk *x, int prot, int flags);
+bool xsk_rx(struct netxsk *x, struct block *bp, size_t len);
+size_t xsk_tx(struct netxsk *x, void (*xmit)(struct block *bp, void *arg),
+              void *arg);
+long xsk_read_stats(struct netxsk *x, void *a, long n, uint32_t offset);
+int xsk_tapfd(struct netxsk *x, struct fd_tap *tap, int cmd);
+
 /*
  *  a network address
  */
@@ -1123,6 +1301,7 @@ struct block *netifbread(struct ether *, struct chan *, long, uint32_t);
 long netifwrite(struct ether *, struct chan *, void *, long);
 int netifwstat(struct ether *, struct chan *, uint8_t *, int);
 int netifstat(struct ether *, struct chan *, uint8_t *, int);
+size_t linux_ifstat_fmt(struct netif_stats *stats, char *p);
 ssize_t linux_ifstat(struct netif_stats *stats, void *va, size_t amt,
                      off_t offset);
 int activemulti(struct ether *, uint8_t *, int);
@@ -1149,6 +1328,20 @@ enum {
 	Ntypes = 8,
 };
 
+/* One of a NIC's hardware queues.  Only tx queues have an oq.  The counters
+ * aren't locked, like the rest of the 9ns stats. */
+/* Most Bxmore blocks devether queues before it kicks the driver anyway */
+#define ETHER_MAX_HELD	32
+
+struct ether_queue {
+	struct queue *oq;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t overflows;			/* rx only: no room in a conversation */
+	uint64_t kicks;				/* tx only: calls to transmit */
+	unsigned int nr_held;		/* tx only: Bxmore blocks since a kick */
+};
+
 struct ether {
 	rwlock_t rwlock;
 	int ctlrno;
@@ -1170,6 +1363,23 @@ struct ether {
 	long (*ctl) (struct ether *, void *, long);	/* custom ctl messages */
 	void (*power) (struct ether *, int);	/* power on/off */
 	void (*shutdown) (struct ether *);	/* shutdown hardware before reboot */
+	int (*poll) (struct ether *, int);	/* busy poll the rx ring */
+	/* Multiqueue drivers set nr_txq and nr_rxq in their reset routine.  devether
+	 * then allocates the queues, with txqs[0].oq == oq, and calls transmit_q()
+	 * with the queue it put a block on.  They pass received blocks to
+	 * etheriq_q() with their hardware queue.  select_txq() is optional; the
+	 * default spreads the flows by their hash.
+	 *
+	 * Blocks with Bxmore have more coming right behind them, so devether
+	 * queues them without calling transmit.  The next block without it (or
+	 * every ETHER_MAX_HELD blocks) kicks the driver once for all of them, and
+	 * the driver should post them all and ring its doorbell once. */
+	void (*transmit_q) (struct ether *, int);
+	int (*select_txq) (struct ether *, struct block *);
+	int nr_txq;
+	int nr_rxq;
+	struct ether_queue *txqs;
+	struct ether_queue *rxqs;
 	void *ctlr;
 	int pcmslot;				/* PCMCIA */
 	int fullduplex;				/* non-zero if full duplex */
@@ -1206,6 +1416,8 @@ static void netif_wait_for_carrier(struct ether *edev)
 }
 
 extern struct block *etheriq(struct ether *, struct block *, int);
+extern struct block *etheriq_q(struct ether *, int, struct block *, int);
+extern int etherpoll(struct chan *c, int budget);
 extern void addethercard(char *unused_char_p_t, int (*)(struct ether *));
 extern int archether(int unused_int, struct ether *);
 
@@ -51,6 +51,9 @@ enum {
 	TcptimerDONE = 2,
 	MAX_TIME = (1 << 20),	/* Forever */
 	TCP_ACK = 50,	/* Timed ack sequence in ms */
+	TCP_ACK_EVERY = 2,	/* default segs per ACK, RFC 1122 */
+	Maxackevery = 64,	/* most segs a bulk receiver may stretch an ACK over */
+	Quickacks = 16,	/* segs ACKed right away at the start of a message */
 	MAXBACKMS = 9 * 60 * 1000,	/* longest backoff time (ms) before hangup */
 
 	URG = 0x20,	/* Data marked urgent */
@@ -92,6 +95,8 @@ enum {
 	FAST_RETRANS_RECOVERY = 2,
 	RTO_RETRANS_RECOVERY = 3,
 	CWIND_SCALE = 10,	/* initial CWIND will be MSS * this */
+	RACK_NR_SEGS = 1024,	/* sent ranges in the RACK scoreboard */
+	TLP_DELACK_MS = 200,	/* worst case delayed ACK, for a lone segment */
 
 	FORCE			= 1 << 0,
 	CLONE			= 1 << 1,
@@ -113,13 +118,21 @@ enum {
 	Last_ack,
 	Time_wait,
 
-	Maxlimbo = 1000,	/* maximum procs waiting for response to SYN ACK */
-	NLHT = 256,	/* hash table size, must be a power of 2 */
-	LHTMASK = NLHT - 1,
+	Limbocookie = 4096,	/* past this many calls in limbo, use SYN cookies */
+	NLHT = 256,	/* initial limbo hash buckets, must be a power of 2 */
+	Maxlht = 1 << 14,	/* the limbo hash grows up to this many buckets */
+	SYNCOOKIE_PERIOD = 64000,	/* ms a cookie's timestamp counts for */
 
 	HaveWS = 1 << 8,
 };
 
+/* Quick-ack modes, the "quickack" ctl */
+enum {
+	TCP_QUICKACK_AUTO = 0,
+	TCP_QUICKACK_ON,
+	TCP_QUICKACK_OFF,
+};
+
 typedef struct tcptimer Tcptimer;
 struct tcptimer {
 	Tcptimer *next;
@@ -127,11 +140,25 @@ struct tcptimer {
 	Tcptimer *readynext;
 	int state;
 	uint64_t start;
-	uint64_t count;
+	uint64_t expires;			/* in ticks, see tcppriv */
+	struct tcp_wheel *wheel;	/* the one we were last armed on */
 	void (*func) (void *);
 	void *arg;
 };
 
+/* TCP timers are on per-core hashed timer wheels.  A timer sits in the slot
+ * for its expiry tick, mod the number of slots, so arming and halting are O(1).
+ * Every tick, tcpackproc only looks at each wheel's current slot.  Timers more
+ * than a lap out just stay put til their lap comes around. */
+enum {
+	TCP_WHEEL_SLOTS = 512,		/* power of 2, about 25 sec of MSPTICKs */
+};
+
+struct tcp_wheel {
+	spinlock_t lock;
+	Tcptimer *slots[TCP_WHEEL_SLOTS];
+};
+
 struct tcphdr {
 	uint8_t tcpsport[2];
 	uint8_t tcpdport[2];
@@ -183,6 +210,78 @@ struct sack_block {
 	uint32_t right;
 };
 
+/* A range of sent seq space in the RACK scoreboard: when we last sent it and
+ * what we know about it since. */
+struct rack_seg {
+	uint32_t seq;
+	uint32_t end;
+	uint64_t xmit_us;			/* last (re)transmission */
+	uint8_t flags;
+};
+
+enum {
+	RACK_SACKED = 1 << 0,
+	RACK_LOST = 1 << 1,			/* needs a retransmission */
+	RACK_RTX = 1 << 2,			/* we sent it more than once */
+};
+
+/* RACK-TLP and PRR state, and the per-conv loss counters.  The scoreboard,
+ * segs[lo, hi), covers snd.una to snd.nxt, sorted by seq. */
+struct tcp_rack {
+	struct rack_seg *segs;
+	unsigned int lo;
+	unsigned int hi;
+	bool failed;				/* couldn't allocate segs */
+	uint64_t xmit_us;			/* most recently sent seg that was delivered */
+	uint32_t end;				/* and its end */
+	uint64_t rtt_us;			/* and its RTT */
+	uint64_t min_rtt_us;
+	uint32_t fack;				/* highest end delivered */
+	bool reordering_seen;
+	uint32_t sacked_bytes;
+	bool tlp_pending;			/* send a probe on the next output */
+	bool tlp_out;				/* a probe is unacked */
+	uint32_t tlp_end;			/* snd.nxt after the probe */
+	uint32_t prr_delivered;
+	uint32_t prr_out;
+	uint32_t prr_sndcnt;
+	uint32_t recover_fs;
+	uint32_t rto_ms;			/* when we last timed out */
+	bool rto_check;				/* check the next ACK for a spurious RTO */
+	uint32_t nr_rto;
+	uint32_t nr_spurious_rto;
+	uint32_t nr_lost;
+	uint32_t nr_tlp;
+};
+
+/* State for the BBR-style congestion control, in tcp_cc.c.  Rates are bytes per
+ * sec, gains are in BBR_UNITs. */
+enum {
+	BBR_BW_ROUNDS = 10,			/* the bw filter's window, in round trips */
+};
+
+struct tcp_bbr {
+	uint8_t mode;
+	uint64_t bw;				/* max of bw_rounds */
+	uint64_t bw_rounds[BBR_BW_ROUNDS];
+	uint64_t delivered;			/* total bytes delivered */
+	uint32_t round;
+	uint32_t round_end;			/* snd.nxt when the round started */
+	uint64_t round_start_us;
+	uint64_t round_delivered;	/* delivered when the round started */
+	uint64_t min_rtt_us;
+	uint64_t min_rtt_stamp_ms;
+	uint64_t full_bw;
+	uint8_t full_bw_cnt;
+	bool full_bw_reached;
+	uint8_t cycle_idx;
+	uint64_t cycle_stamp_us;
+	uint64_t probe_rtt_done_ms;
+	uint32_t prior_cwnd;
+	uint32_t pacing_gain;
+	uint32_t cwnd_gain;
+};
+
 /*
  *  this represents the control info
  *  for a single packet.  It is derived from
@@ -273,6 +372,8 @@ struct tcpctl {
 	Tcptimer acktimer;			/* Acknowledge timer */
 	Tcptimer rtt_timer;			/* Round trip timer */
 	Tcptimer katimer;			/* keep alive timer */
+	Tcptimer rack_timer;		/* RACK reordering window */
+	Tcptimer tlp_timer;			/* tail loss probe */
 	uint32_t rttseq;			/* Round trip sequence */
 	int srtt;					/* Shortened round trip */
 	int mdev;					/* Mean deviation of round trip */
@@ -285,6 +386,25 @@ struct tcpctl {
 	uint32_t last_ack_sent;		/* to determine when to update timestamp */
 	bool sack_ok;				/* Can use SACK for this connection */
 	struct Ipifc *ifc;			/* Uncounted ref */
+	struct tcp_rack rack;
+	struct tcp_cc_ops *cc;		/* congestion control */
+	struct tcp_cc_ops *cc_next;	/* picked before the conv started */
+	struct {
+		uint8_t mode;			/* TCP_QUICKACK_* */
+		uint8_t every;			/* ACK at least every this many segs */
+		uint8_t quickacks;		/* segs left to ACK right away */
+		bool sent_data;			/* we sent data since some last came in */
+		uint64_t last_rcv;		/* NOW when data last came in */
+		uint32_t nr_quickacks;
+		uint32_t nr_delacks;	/* ACKs the acktimer sent */
+	} ack;						/* delayed ACK policy, tcp_rcv_ack() */
+	union {
+		struct tcp_bbr bbr;
+	} cc_priv;
+	uint64_t pacing_rate;		/* bytes per sec, 0 for no pacing */
+	uint64_t pace_next_us;		/* when the next segment may leave */
+	struct tcp_pacer *pacer;	/* outlives the tcb, see tcpcreate() */
+	uint32_t nr_paced;			/* times output waited on the pacer */
 
 	union {
 		Tcp4hdr tcp4hdr;
@@ -300,13 +420,16 @@ struct tcpctl {
  *  In particular they aren't on a listener's queue so that they don't figure in
  *  the input queue limit.
  *
- *  If 1/2 of a T3 was attacking SYN packets, we'ld have a permanent queue of
- *  70000 limbo'd calls.  Not great for a linear list but doable.  Therefore
- *  there is no hashing of this list.
+ *  Limbo is a hash table with a qlock per bucket, so SYNs for different calls
+ *  don't serialize on the proto qlock.  The table doubles when it gets crowded;
+ *  the rwlock keeps it from moving out from under us.  Once Limbocookie calls
+ *  are in limbo, we stop adding more and answer SYNs with a SYN cookie: the
+ *  call's state is encoded in our ISS, and we rebuild it from the ACK.
  */
 typedef struct limbo Limbo;
 struct limbo {
 	Limbo *next;
+	uint32_t hash;				/* of the 4-tuple, picks the bucket */
 
 	uint8_t laddr[IPaddrlen];
 	uint8_t raddr[IPaddrlen];
@@ -344,28 +467,71 @@ enum {
 	HlenErrs,
 	LenErrs,
 	OutOfOrder,
+	SynCookiesSent,
+	SynCookiesRecv,
+	SynCookiesFailed,
 
 	Nstats
 };
 
+/* What an ACK told us, for a congestion control's ack(). */
+struct tcp_cc_sample {
+	uint32_t acked;				/* snd.una advanced this much */
+	uint32_t delivered;			/* acked or sacked for the first time */
+	uint64_t rtt_us;			/* 0 if the ACK had no RTT sample */
+};
+
+/* Congestion control ops.  Every conv has one, picked with the "cc" ctl, Reno by
+ * default.  These are called with the conv qlocked.
+ *
+ * init() is called when the connection starts or switches to the ops.  ack() is
+ * called for every ACK that advances snd.una, including during recovery, and
+ * adjusts cwind.  loss() is called when we detect a loss (dupacks, RACK, or an
+ * RTO) and sets ssthresh and cwind.  An ops that paces sets tcb->pacing_rate;
+ * tcpoutput() spaces segments so as to not exceed it. */
+struct tcp_cc_ops {
+	const char *name;
+	void (*init)(struct conv *s, Tcpctl *tcb);
+	void (*ack)(struct conv *s, Tcpctl *tcb, struct tcp_cc_sample *cs);
+	void (*loss)(struct conv *s, Tcpctl *tcb, bool rto);
+};
+
+extern struct tcp_cc_ops tcp_cc_reno;
+extern struct tcp_cc_ops tcp_cc_bbr;
+struct tcp_cc_ops *tcp_cc_lookup(const char *name);
+
+struct limbo_bucket {
+	qlock_t qlock;
+	Limbo *head;
+};
+
+struct limbo_ht {
+	unsigned int nr_buckets;	/* power of 2 */
+	struct limbo_bucket buckets[];
+};
+
 typedef struct tcppriv Tcppriv;
 struct tcppriv {
-	/* List of active timers */
-	qlock_t tl;
-	Tcptimer *timers;
+	/* Timer wheels, one per core, and the ticks tcpackproc has done */
+	struct tcp_wheel *wheels;
+	uint64_t ticks;
 
 	/* hash table for matching conversations */
 	struct Ipht ht;
 
 	/* calls in limbo waiting for an ACK to our SYN ACK */
-	int nlimbo;
-	Limbo *lht[NLHT];
+	atomic_t nlimbo;
+	rwlock_t lht_rwl;			/* write locked to resize lht */
+	struct limbo_ht *lht;
+	uint64_t lht_key[2];		/* keys the bucket hash */
+	uint64_t syncookie_key[2];
+	uint64_t last_syncookie;	/* NOW when we last sent one */
 
 	/* for keeping track of tcpackproc */
 	qlock_t apl;
 	int ackprocstarted;
 
-	uint32_t stats[Nstats];
+	uint64_t *stats;			/* percpu, see netstats_alloc() */
 };
 
 static inline int seq_within(uint32_t x, uint32_t low, uint32_t high)
@@ -32,6 +32,7 @@
 #include <err.h>
 #include <rendez.h>
 #include <rwlock.h>
+#include <brlock.h>
 #include <linker_func.h>
 #include <fdtap.h>
 #include <ros/fs.h>
@@ -416,7 +417,8 @@ enum {
 #define NS_TCPCK_SHIFT 4
 #define NS_PKTCK_SHIFT 5
 #define NS_TSO_SHIFT 6
-#define NS_SHIFT_MAX 6
+#define NS_XMORE_SHIFT 7
+#define NS_SHIFT_MAX 7
 
 enum {
 	BFREE = (1 << 1),
@@ -425,8 +427,9 @@ enum {
 	Btcpck = (1 << NS_TCPCK_SHIFT),	/* tcp checksum (rx), needed (tx) */
 	Bpktck = (1 << NS_PKTCK_SHIFT),	/* packet checksum (rx, maybe) */
 	Btso = (1 << NS_TSO_SHIFT),		/* TSO desired (tx) */
+	Bxmore = (1 << NS_XMORE_SHIFT),	/* more packets follow (tx) */
 };
-#define BLOCK_META_FLAGS (Bipck | Budpck | Btcpck | Bpktck | Btso)
+#define BLOCK_META_FLAGS (Bipck | Budpck | Btcpck | Bpktck | Btso | Bxmore)
 #define BLOCK_TRANS_TX_CSUM (Budpck | Btcpck)
 #define BLOCK_RX_CSUM (Bipck | Budpck | Btcpck)
 
@@ -503,20 +506,27 @@ struct chan {
 
 extern struct chan *kern_slash;
 
+#define CNAME_INLINE_SZ		64
+
 struct cname {
 	struct kref ref;
 	int alen;					/* allocated length */
 	int len;					/* strlen(s) */
 	char *s;
+	char sbuf[CNAME_INLINE_SZ];	/* s, until it outgrows this */
 };
 
 struct fs_file;
+struct page;
 
 struct dev {
 	char *name;
 
 	void (*reset)(void);
 	void (*init)(void);
+	/* init doesn't depend on the other devices, and can run in parallel with
+	 * their inits.  devtabinit() still returns only after all of them ran. */
+	bool init_async;
 	void (*shutdown)(void);
 	struct chan *(*attach)(char *muxattach);
 	struct walkqid *(*walk)(struct chan *, struct chan *, char **name,
@@ -529,6 +539,10 @@ struct dev {
 	struct block *(*bread)(struct chan *, size_t, off64_t);
 	size_t (*write)(struct chan *, void *, size_t, off64_t);
 	size_t (*bwrite)(struct chan *, struct block *, off64_t);
+	/* Optional scatter/gather, for devices that can do better than a read or
+	 * write per iovec.  sysfile falls back to read/write when these are 0. */
+	size_t (*readv)(struct chan *, struct iovec *, int, off64_t);
+	size_t (*writev)(struct chan *, struct iovec *, int, off64_t);
 	void (*remove)(struct chan *);
 	void (*rename)(struct chan *, struct chan *, const char *, int);
 	size_t (*wstat)(struct chan *, uint8_t *, size_t);
@@ -620,13 +634,27 @@ struct mntparam {
 	char *spec;
 };
 
+/* A chan that findmount() saw had nothing mounted on it.  The entry is only
+ * good while the pgrp's mnt_gen matches.  seq is odd during a write. */
+struct mnt_miss {
+	seq_ctr_t seq;
+	uint32_t gen;
+	int type;
+	int dev;
+	uint64_t path;
+};
+
+#define MNT_MISS_NR		64		/* power of two */
+
 struct pgrp {
 	struct kref ref;			/* also used as a lock when mounting */
 	uint32_t pgrpid;
 	qlock_t debug;				/* single access via devproc.c */
-	struct rwlock ns;			/* Namespace n read/one write lock */
+	struct brlock ns;			/* Namespace n read/one write lock */
 	qlock_t nsh;
 	struct mhead *mnthash[MNTHASH];
+	uint32_t mnt_gen;			/* bumped on every mount change, under ns */
+	struct mnt_miss mnt_miss[MNT_MISS_NR];
 	int progmode;
 	int nodevs;
 	int pin;
@@ -706,6 +734,7 @@ enum {
 	Qcoalesce		= (1 << 3),	/* coalesce empty packets on read */
 	Qkick			= (1 << 4),	/* always call the kick routine after qwrite */
 	Qdropoverflow	= (1 << 5),	/* writes that would block will be dropped */
+	Qspsc			= (1 << 6),	/* lock-free ring for one writer, one reader */
 };
 
 /* Per-process structs */
@@ -740,7 +769,9 @@ struct file_desc {
 	struct fd_tap				*fd_tap;
 };
 
-/* All open files for a process */
+/* All open files for a process.  The lock protects changes.  lookup_fd() reads
+ * fd and fd_chan under RCU, so changes publish them with rcu_assign_pointer(),
+ * and grown fd arrays are freed after a grace period. */
 struct fd_table {
 	spinlock_t					lock;
 	bool						closed;
@@ -781,6 +812,12 @@ struct block *block_alloc(size_t, int);
 int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags);
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
                        uint32_t len, int mem_flags);
+void *block_append_frag(struct block *b, size_t len, int mem_flags);
+struct block *block_alloc_frag(size_t size, int mem_flags);
+void block_extra_incref(uintptr_t base);
+void block_extra_decref(uintptr_t base);
+int block_append_pm_page(struct block *b, struct page *page, uint32_t off,
+                         uint32_t len, int mem_flags);
 void block_copy_metadata(struct block *new_b, struct block *old_b);
 void block_reset_metadata(struct block *b);
 int anyhigher(void);
@@ -792,6 +829,7 @@ char *channame(struct chan *);
 void cclose(struct chan *);
 void chan_incref(struct chan *);
 void chandevinit(void);
+void chan_init(void);
 void chandevreset(void);
 void chandevshutdown(void);
 void chanfree(struct chan *);
@@ -956,6 +994,7 @@ void qflush(struct queue *);
 void qfree(struct queue *);
 int qfull(struct queue *);
 struct block *qget(struct queue *);
+struct block *qget_fits(struct queue *q, size_t len);
 void qhangup(struct queue *, char *unused_char_p_t);
 int qisclosed(struct queue *);
 ssize_t qiwrite(struct queue *, void *, int);
@@ -970,12 +1009,17 @@ ssize_t qpassnolim(struct queue *, struct block *);
 void qputback(struct queue *, struct block *);
 size_t qread(struct queue *q, void *va, size_t len);
 size_t qread_nonblock(struct queue *q, void *va, size_t len);
+size_t qreadv(struct queue *q, struct iovec *iov, int iovcnt);
+size_t qreadv_nonblock(struct queue *q, struct iovec *iov, int iovcnt);
 void qreopen(struct queue *);
 void qsetlimit(struct queue *, size_t);
+int qstate(struct queue *);
 size_t qgetlimit(struct queue *);
 int qwindow(struct queue *);
 ssize_t qwrite(struct queue *, void *, int);
 ssize_t qwrite_nonblock(struct queue *, void *, int);
+ssize_t qwritev(struct queue *q, struct iovec *iov, int iovcnt);
+ssize_t qwritev_nonblock(struct queue *q, struct iovec *iov, int iovcnt);
 typedef void (*qio_wake_cb_t)(struct queue *q, void *data, int filter);
 void qio_set_wake_cb(struct queue *q, qio_wake_cb_t func, void *data);
 bool qreadable(struct queue *q);
@@ -1100,6 +1144,7 @@ long unionread(struct chan *c, void *va, long n);
 void read_exactly_n(struct chan *c, void *vp, long n);
 long sysread(int fd, void *va, long n);
 long syspread(int fd, void *va, long n, int64_t off);
+long sysreadv(int fd, struct iovec *iov, int iovcnt);
 int sysremove(char *path);
 int sysrename(char *from_path, char *to_path);
 int64_t sysseek(int fd, int64_t off, int whence);
@@ -1109,6 +1154,8 @@ int syslstat(char *path, uint8_t*, int n);
 int sysstatakaros(char *path, struct kstat *, int flags);
 long syswrite(int fd, void *va, long n);
 long syspwrite(int fd, void *va, long n, int64_t off);
+long syswritev(int fd, struct iovec *iov, int iovcnt);
+long syssplice(int fd_in, int fd_out, long len);
 int syswstat(char *path, uint8_t * buf, int n);
 struct dir *chandirstat(struct chan *c);
 struct dir *sysdirstat(char *name);
@@ -0,0 +1,50 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * NUMA memory placement.  Each node with memory in the SRAT gets its own base
+ * and kpages arenas, and page allocations prefer a node picked by a memory
+ * policy (ros/mman.h): the faulting core's node by default, or a set of nodes
+ * to bind to or interleave across, per process or per VMR.
+ *
+ * Without an SRAT (or with one node), numa_nr_nodes is 0 and everything comes
+ * from kpages_arena, just like before. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <ros/mman.h>
+
+#define NUMA_MAX_NODES			16
+#define NUMA_NODE_LOCAL			(-1)
+
+struct arena;
+struct proc;
+struct vm_region;
+
+struct numa_node {
+	struct arena				*base;
+	struct arena				*kpages;
+	size_t						nr_bytes;
+};
+
+struct mempolicy {
+	int							mode;		/* MPOL_* */
+	unsigned long				nodes;		/* bitmask, for BIND/INTERLEAVE */
+};
+
+extern int numa_nr_nodes;
+extern unsigned long numa_mem_nodes;
+extern struct numa_node numa_nodes[NUMA_MAX_NODES];
+
+void numa_init(void);
+int numa_local_node(void);
+void *numa_kpages_alloc(unsigned long nodes, int pref, size_t size,
+                        int flags);
+size_t numa_kpages_alloc_batch(unsigned long nodes, int pref, void **addrs,
+                               size_t size, size_t nr, int flags);
+void numa_kpages_free(void *addr, size_t size);
+void numa_kpages_free_batch(void **addrs, size_t size, size_t nr);
+
+int mpol_set(struct mempolicy *mpol, int mode, unsigned long nodes);
+void mpol_pick(struct proc *p, struct vm_region *vmr, uintptr_t va,
+               unsigned long *nodes, int *pref);
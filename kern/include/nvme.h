@@ -0,0 +1,103 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * NVMe controller registers, queue entries and the few commands sdnvme uses.
+ * Section numbers are from the NVMe 1.2 spec. */
+
+#pragma once
+
+#include <ros/common.h>
+
+/* Controller registers (3.1) */
+#define NVME_CAP			0x00	/* 64 bit */
+#define NVME_VS				0x08
+#define NVME_INTMS			0x0c
+#define NVME_INTMC			0x10
+#define NVME_CC				0x14
+#define NVME_CSTS			0x1c
+#define NVME_AQA			0x24
+#define NVME_ASQ			0x28	/* 64 bit */
+#define NVME_ACQ			0x30	/* 64 bit */
+#define NVME_DBS			0x1000	/* doorbells, CAP.DSTRD apart */
+
+#define NVME_CAP_MQES(cap)		((cap) & 0xffff)		/* 0's based */
+#define NVME_CAP_TO(cap)		(((cap) >> 24) & 0xff)	/* 500 msec units */
+#define NVME_CAP_DSTRD(cap)		(((cap) >> 32) & 0xf)
+#define NVME_CAP_MPSMIN(cap)	(((cap) >> 48) & 0xf)
+
+#define NVME_CC_EN				(1 << 0)
+#define NVME_CC_CSS_NVM			(0 << 4)
+#define NVME_CC_MPS(shift)		(((shift) - 12) << 7)
+#define NVME_CC_AMS_RR			(0 << 11)
+#define NVME_CC_SHN_NORMAL		(1 << 14)
+#define NVME_CC_IOSQES			(6 << 16)	/* 2^6 byte SQ entries */
+#define NVME_CC_IOCQES			(4 << 20)	/* 2^4 byte CQ entries */
+
+#define NVME_CSTS_RDY			(1 << 0)
+#define NVME_CSTS_CFS			(1 << 1)
+#define NVME_CSTS_SHST_MASK		(3 << 2)
+#define NVME_CSTS_SHST_DONE		(2 << 2)
+
+/* Admin commands (5) */
+#define NVME_ADM_CREATE_SQ		0x01
+#define NVME_ADM_CREATE_CQ		0x05
+#define NVME_ADM_IDENTIFY		0x06
+#define NVME_ADM_SET_FEATURES	0x09
+
+#define NVME_FEAT_NR_QUEUES		0x07
+
+#define NVME_ID_CNS_NS			0x00
+#define NVME_ID_CNS_CTRL		0x01
+
+/* cdw11 of the create queue commands */
+#define NVME_Q_PHYS_CONTIG		(1 << 0)
+#define NVME_CQ_IRQ_EN			(1 << 1)
+
+/* NVM commands (6) */
+#define NVME_CMD_FLUSH			0x00
+#define NVME_CMD_WRITE			0x01
+#define NVME_CMD_READ			0x02
+
+/* Identify controller, byte offsets (figure 90) */
+#define NVME_IDC_SN				4		/* 20 bytes of ascii */
+#define NVME_IDC_MN				24		/* 40 */
+#define NVME_IDC_FR				64		/* 8 */
+#define NVME_IDC_MDTS			77		/* 2^n min pages, 0 = no limit */
+#define NVME_IDC_NN				516		/* 32 bit */
+
+/* Identify namespace (figure 92) */
+#define NVME_IDNS_NSZE			0		/* 64 bit, in blocks */
+#define NVME_IDNS_FLBAS			26		/* 3:0 is the LBAF in use */
+#define NVME_IDNS_LBAF			128		/* 4 bytes each, 23:16 is LBADS */
+
+/* Status field of a CQE, with the phase tag in bit 0 */
+#define NVME_CQE_PHASE			(1 << 0)
+#define NVME_CQE_STATUS(s)		(((s) >> 1) & 0x7fff)
+
+/* Submission queue entry (4.2) */
+struct nvme_sqe {
+	uint8_t						opcode;
+	uint8_t						flags;
+	uint16_t					cid;
+	uint32_t					nsid;
+	uint64_t					rsvd2;
+	uint64_t					mptr;
+	uint64_t					prp1;
+	uint64_t					prp2;
+	uint32_t					cdw10;
+	uint32_t					cdw11;
+	uint32_t					cdw12;
+	uint32_t					cdw13;
+	uint32_t					cdw14;
+	uint32_t					cdw15;
+} __attribute__((packed));
+
+/* Completion queue entry (4.6) */
+struct nvme_cqe {
+	uint32_t					result;
+	uint32_t					rsvd1;
+	uint16_t					sq_head;
+	uint16_t					sq_id;
+	uint16_t					cid;
+	uint16_t					status;
+} __attribute__((packed));
@@ -32,6 +32,11 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_JUMBO		0x040	/* 4K piece of a split jumbo page */
+#define PG_READAHEAD	0x080	/* page map, read ahead and not used yet */
+#define PG_COW_BUF		0x100	/* anon page, CoW shared with a block */
+#define PG_REFERENCED	0x200	/* page map, used since the last eviction scan */
+#define PG_RECLAIM		0x400	/* page map, writepage is for eviction */
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -47,6 +52,10 @@ struct page {
 	void						*pg_private;	/* type depends on page usage */
 	struct semaphore 			pg_sem;		/* for blocking on IO */
 	uint64_t				gpa;		/* physical address in guest */
+	atomic_t					pg_jumbo_refs;	/* split jumbo head: live pieces */
+	atomic_t					pg_ext_refs;	/* PM page: the PM + blocks */
+	atomic_t					pg_cow_refs;	/* anon page: extra CoW PTEs */
+	uint8_t						pg_node;	/* kpages: node it came from */
 
 	bool						pg_is_free;	/* TODO: will remove */
 };
@@ -58,7 +67,10 @@ extern page_list_t page_free_list;
 /*************** Functional Interface *******************/
 void base_arena_init(struct multiboot_info *mbi);
 
+struct vm_region;
 error_t upage_alloc(struct proc *p, page_t **page, bool zero);
+error_t upage_alloc_vmr(struct proc *p, struct vm_region *vmr, uintptr_t va,
+                        page_t **page, bool zero);
 error_t kpage_alloc(page_t **page);
 void *kpage_alloc_addr(void);
 void *kpage_zalloc_addr(void);
@@ -68,11 +80,22 @@ void *kpage_zalloc_addr(void);
 void *kpages_alloc(size_t size, int flags);
 void *kpages_zalloc(size_t size, int flags);
 void kpages_free(void *addr, size_t size);
+size_t kpages_alloc_batch(void **addrs, size_t size, size_t nr, int flags);
+void kpages_free_batch(void **addrs, size_t size, size_t nr);
 
 void *get_cont_pages(size_t order, int flags);
 void free_cont_pages(void *buf, size_t order);
 
+/* PML2-sized (PTSIZE) pages, e.g. for backing user jumbo mappings. */
+void jumbo_arena_init(void);
+void *jumbo_page_alloc(size_t nr, int flags);
+void jumbo_page_free(void *buf, size_t nr);
+void jumbo_page_split(void *buf);
+
 void page_decref(page_t *page);
+void page_cow_share(struct page *page);
+bool page_cow_unshare(struct page *page);
+bool page_is_cow_shared(struct page *page);
 
 int page_is_free(size_t ppn);
 void lock_page(struct page *page);
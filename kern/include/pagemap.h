@@ -29,17 +29,32 @@ struct page_map {
 	struct page_map_operations	*pm_op;
 	spinlock_t					pm_lock;		/* for the VMR list */
 	struct vmr_tailq			pm_vmrs;
+	int							pm_ra_hint;		/* PM_RA_*, from madvise */
+	unsigned long				pm_evict_idx;	/* clock hand, under pm_qlock */
 };
 
+/* Readahead hints, for FSs that read ahead on a miss.  Normal lets the FS
+ * guess; sequential reads the biggest window right away; random reads just the
+ * page that missed. */
+#define PM_RA_NORMAL			0
+#define PM_RA_SEQUENTIAL		1
+#define PM_RA_RANDOM			2
+
 /* Operations performed on a page_map.  These are usually FS specific, which
  * get assigned when the inode is created.
  * Will fill these in as they are created/needed/used. */
 struct page_map_operations {
 	int (*readpage) (struct page_map *, struct page *);
 	int (*writepage) (struct page_map *, struct page *);
+	/* Optional: the first use of a PG_READAHEAD page */
+	void (*readahead_hit) (struct page_map *, struct page *);
+	/* Optional: write a run of contiguous pages, at most PM_WB_BATCH_PAGES */
+	int (*writepages) (struct page_map *, struct page **, size_t);
+	/* Optional: on a miss, fill the range around the index (pm_insert_pages).
+	 * Returns 0 if the page at index is now in the PM. */
+	int (*populate) (struct page_map *, unsigned long);
 /*	readpages: read a list of pages
 	writepage: write from a page to its backing store
-	writepages: write a list of pages
 	sync_page: start the IO of already scheduled ops
 	set_page_dirty: mark the given page dirty
 	prepare_write: prepare to write (disk backed pages)
@@ -50,18 +65,32 @@ struct page_map_operations {
 	direct_io: bypass the page cache */
 };
 
+/* Most pages pm_writeback_pages() will hand to ->writepages() at once */
+#define PM_WB_BATCH_PAGES		32
+
 /* Page cache functions */
 void pm_init(struct page_map *pm, struct page_map_operations *op, void *host);
 int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp);
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp);
+size_t pm_load_pages_nowait(struct page_map *pm, unsigned long index,
+                            size_t nr, struct page **pps);
+ssize_t pm_load_pages(struct page_map *pm, unsigned long index, size_t nr,
+                      struct page **pps);
+int pm_insert_pages(struct page_map *pm, unsigned long index,
+                    struct page **pgs, size_t nr);
+struct page *pm_grab_new_page(struct page_map *pm, unsigned long index);
+bool pm_has_page(struct page_map *pm, unsigned long index);
 void pm_put_page(struct page *page);
+void pm_get_page_ext(struct page *page);
+void pm_put_page_ext(struct page *page);
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_vmr(struct page_map *pm, struct vm_region *vmr);
 void pm_remove_or_zero_pages(struct page_map *pm, unsigned long start_idx,
                              unsigned long nr_pgs);
 void pm_writeback_pages(struct page_map *pm);
 void pm_free_unused_pages(struct page_map *pm);
+size_t pm_evict_cold_pages(struct page_map *pm, size_t nr);
 void pm_destroy(struct page_map *pm);
 void pm_page_asserter(struct page *page, char *str);
 void print_page_map_info(struct page_map *pm);
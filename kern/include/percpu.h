@@ -66,7 +66,7 @@
 #define PERCPU_START_VAR PASTE(__start_, PERCPU_SECTION)
 #define PERCPU_STOP_VAR PASTE(__stop_, PERCPU_SECTION)
 
-#define PERCPU_DYN_SIZE 1024
+#define PERCPU_DYN_SIZE 4096
 #define PERCPU_STATIC_SIZE (PERCPU_STOP_VAR - PERCPU_START_VAR)
 #define PERCPU_SIZE (PERCPU_STATIC_SIZE + PERCPU_DYN_SIZE)
 #define PERCPU_OFFSET(var) ((char *) &(var) - PERCPU_START_VAR)
@@ -73,9 +73,8 @@ struct process_set {
 	struct proc **procs;
 };
 
-/* Can use a htable iterator to iterate through all active procs */
-extern struct hashtable *pid_hash;
-extern spinlock_t pid_hash_lock;
+/* Use rhashtable_for_each() to iterate through all active procs */
+extern struct rhashtable pid_hash;
 
 /* Initialization */
 void proc_init(void);
@@ -88,6 +87,7 @@ void proc_init_procdata(struct proc* p);
 
 /* Process management: */
 struct proc *pid_nth(unsigned int n);
+size_t proc_get_snapshots(struct proc_snapshot *ps, size_t max);
 error_t proc_alloc(struct proc **pp, struct proc *parent, int flags);
 void __proc_ready(struct proc *p);
 struct proc *proc_create(struct file_or_chan *prog, char **argv, char **envp);
@@ -147,6 +147,8 @@ void __unmap_vcore(struct proc *p, uint32_t vcoreid);
 void vcore_account_online(struct proc *p, uint32_t vcoreid);
 void vcore_account_offline(struct proc *p, uint32_t vcoreid);
 uint64_t vcore_account_gettotal(struct proc *p, uint32_t vcoreid);
+void vcore_account_kmsg(void);
+void vcore_get_stats(struct proc *p, uint32_t vcoreid, struct vcore_stats *vs);
 
 /* Preemption management.  Some of these will change */
 void __proc_preempt_warn(struct proc *p, uint32_t vcoreid, uint64_t when);
@@ -154,6 +156,7 @@ void __proc_preempt_warnall(struct proc *p, uint64_t when);
 void __proc_preempt_core(struct proc *p, uint32_t pcoreid);
 uint32_t __proc_preempt_all(struct proc *p, uint32_t *pc_arr);
 bool proc_preempt_core(struct proc *p, uint32_t pcoreid, uint64_t usec);
+bool proc_preempt_warn_core(struct proc *p, uint32_t pcoreid, uint64_t usec);
 void proc_preempt_all(struct proc *p, uint64_t usec);
 
 /* Current / cr3 / context management */
@@ -162,6 +165,8 @@ void switch_back(struct proc *new_p, uintptr_t old_ret);
 void abandon_core(void);
 void clear_owning_proc(uint32_t coreid);
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end);
+void proc_tlb_mark_core(struct proc *p);
+void proc_tlb_unmark_core(struct proc *p);
 
 /* Kernel message handlers for process management */
 void __startcore(uint32_t srcid, long a0, long a1, long a2);
@@ -12,6 +12,7 @@ struct hw_trapframe;
 struct proc;
 struct file_or_chan;
 struct cmdbuf;
+struct fs_file;
 
 int profiler_configure(struct cmdbuf *cb);
 void profiler_append_configure_usage(char *msgbuf, size_t buflen);
@@ -21,12 +22,19 @@ void profiler_cleanup(void);
 void profiler_start(void);
 void profiler_stop(void);
 void profiler_push_kernel_backtrace(uintptr_t *pc_list, size_t nr_pcs,
-                                    uint64_t info);
+                                    uint64_t info,
+                                    const struct proftype_branch64 *branches,
+                                    size_t nr_branches);
 void profiler_push_user_backtrace(uintptr_t *pc_list, size_t nr_pcs,
-                                  uint64_t info);
+                                  uint64_t info,
+                                  const struct proftype_branch64 *branches,
+                                  size_t nr_branches);
+void profiler_notify_offcpu(uint64_t blocked_tsc);
 void profiler_trace_data_flush(void);
 int profiler_size(void);
 int profiler_read(void *va, int n);
+size_t profiler_ring_size(void);
+struct fs_file *profiler_ring_mmap(int prot, int flags);
 void profiler_notify_mmap(struct proc *p, uintptr_t addr, size_t size, int prot,
 						  int flags, struct file_or_chan *foc, size_t offset);
 void profiler_notify_new_process(struct proc *p);
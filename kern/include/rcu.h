@@ -56,6 +56,17 @@ struct rcu_state {
 	/* TODO: make a ktask struct and use a read-only pointer. */
 	struct rendez				gp_ktask_rv;
 	int							gp_ktask_ctl;
+	/* Threads in synchronize_rcu_expedited(), atomically updated */
+	int							nr_exp_waiters;
+	/* Whether the GP kthread kicked the tardy cores for the current GP */
+	bool						gp_expedited;
+
+	/* GP stats, written by the GP kthread */
+	unsigned long				nr_gps;
+	uint64_t					gp_total_nsec;
+	uint64_t					gp_max_nsec;
+	uint64_t					gp_last_nsec;
+	unsigned long				nr_exp_gps;
 };
 
 struct rcu_pcpui {
@@ -73,16 +84,23 @@ struct rcu_pcpui {
 
 	struct rendez				mgmt_ktask_rv;
 	int							mgmt_ktask_ctl;
+
+	/* CB stats: max_nr_cbs is racy, nr_cbs_run is protected by the lock */
+	unsigned int				max_nr_cbs;
+	unsigned long				nr_cbs_run;
 };
 DECLARE_PERCPU(struct rcu_pcpui, rcu_pcpui);
+extern struct rcu_state rcu_state;
 
 void rcu_init(void);
 void rcu_report_qs(void);
 void rcu_barrier(void);
+void synchronize_rcu_expedited(void);
 void rcu_force_quiescent_state(void);
 unsigned long get_state_synchronize_rcu(void);
 void cond_synchronize_rcu(unsigned long oldstate);
 void kfree_call_rcu(struct rcu_head *head, rcu_callback_t off);
+void print_rcu_stats(void);
 
 /* Internal Helpers (rcu.c) */
 void rcu_init_pcpui(struct rcu_state *rsp, struct rcu_pcpui *rpi, int coreid);
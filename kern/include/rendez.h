@@ -18,6 +18,16 @@
  * 		// set the condition to TRUE, then:
  * 		rendez_wakeup(&rv);
  *
+ * Exclusive sleepers:
+ * 		rendez_sleep_excl(&rv, some_func_taking_void*, void *arg);
+ *
+ * 		rendez_wakeup() wakes every regular sleeper, but only one exclusive
+ * 		sleeper.  That's for conditions only one of them can use, like data in
+ * 		a queue with several readers, where waking all of them is a thundering
+ * 		herd.  An exclusive sleeper that leaves the condition true should call
+ * 		rendez_wakeup() to pass it on.  rendez_wakeup_all() wakes everyone, for
+ * 		conditions that are true for all of them, like a closed queue.
+ *
  * Some notes:
  * - Some_func checks some condition and returns TRUE when we want to wake up.
  * - Sleep returns when the condition is true and when it has been woken up.
@@ -31,6 +41,9 @@
  *   only have one sleeper and one waker.  So your code around the rendez needs
  *   to take that into account.  The old plan9 code should already do this.
  *
+ * - Wakeups go out in one kmsg per core, no matter how many sleepers there are
+ *   for that core.
+ *
  * - TODO: i dislike the int vs bool on the func pointer.  prob would need to
  *   change all 9ns rendez functions
  */
@@ -48,6 +61,11 @@ typedef int (*rendez_cond_t)(void *arg);
 
 void rendez_init(struct rendez *rv);
 void rendez_sleep(struct rendez *rv, int (*cond)(void*), void *arg);
+void rendez_sleep_excl(struct rendez *rv, int (*cond)(void*), void *arg);
 void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
                           uint64_t usec);
+/* slack_usec is the alarm's slack; the default is ALARM_SLACK_SLEEP. */
+void rendez_sleep_timeout_slack(struct rendez *rv, int (*cond)(void*),
+                                void *arg, uint64_t usec, uint64_t slack_usec);
 bool rendez_wakeup(struct rendez *rv);
+bool rendez_wakeup_all(struct rendez *rv);
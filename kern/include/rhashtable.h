@@ -0,0 +1,130 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Resizable, concurrent hash table.  Lookups are lockless (RCU), writers lock
+ * one bucket at a time, and the table grows and shrinks incrementally, a few
+ * buckets at a time, so no one ever waits for the whole table to be rehashed.
+ *
+ * Objects embed a struct rhash_node.  The table doesn't own them: the caller
+ * frees them, and since lookups are lockless, it must wait a grace period
+ * (call_rcu, kfree_rcu) between removing an object and freeing or reinserting
+ * it.  The caller tells us how to hash and compare with a struct
+ * rhashtable_params:
+ *
+ *		struct foo {
+ *			int						id;
+ *			struct rhash_node		link;
+ *		};
+ *
+ *		static uint32_t foo_hash_key(const void *key)
+ *		{
+ *			return *(const int*)key;
+ *		}
+ *
+ *		static uint32_t foo_hash_obj(const void *obj)
+ *		{
+ *			return ((const struct foo*)obj)->id;
+ *		}
+ *
+ *		static bool foo_key_eq(const void *key, const void *obj)
+ *		{
+ *			return *(const int*)key == ((const struct foo*)obj)->id;
+ *		}
+ *
+ *		static const struct rhashtable_params foo_params = {
+ *			.node_offset = offsetof(struct foo, link),
+ *			.hash_key = foo_hash_key,
+ *			.hash_obj = foo_hash_obj,
+ *			.key_eq = foo_key_eq,
+ *		};
+ *
+ *		rhashtable_init(&foo_ht, &foo_params);
+ *		rhashtable_insert(&foo_ht, foo);
+ *
+ *		rcu_read_lock();
+ *		foo = rhashtable_lookup(&foo_ht, &id);
+ *		if (foo && !kref_get_not_zero(&foo->ref, 1))
+ *			foo = NULL;
+ *		rcu_read_unlock();
+ *
+ * The hash functions don't need to mix their bits; we run the hash through
+ * hash_32() to pick a bucket.  Keys don't need to be unique.  A lookup returns
+ * the first object whose key_eq() says yes, so a key can carry more than the
+ * hashed fields (e.g. an object to skip).
+ *
+ * Resizing: when the table gets too full or too empty, a writer publishes a
+ * new bucket array as the old one's 'future'.  From then on, inserts go into
+ * the future table, and every insert and remove moves a few of the old
+ * table's buckets into it.  When the last bucket is moved, the future table
+ * becomes the table, and the old array is RCU-freed.  Lookups search the old
+ * table and then the future.  Buckets are moved one entry at a time, from the
+ * tail: the tail is linked into its new bucket before it is cut from the old
+ * chain, so a lookup that is racing with the move might walk into the new
+ * chain, but it never misses an entry.
+ *
+ * Insert and remove never block, and they can be called with spinlocks held,
+ * but not from IRQ context. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <atomic.h>
+#include <rcu.h>
+
+struct rhash_node {
+	struct rhash_node			*next;
+};
+
+struct rhashtable_params {
+	size_t						node_offset;
+	uint32_t					(*hash_key)(const void *key);
+	uint32_t					(*hash_obj)(const void *obj);
+	bool						(*key_eq)(const void *key, const void *obj);
+	/* log2 of the smallest and largest number of buckets.  0 for defaults. */
+	unsigned int				min_bits;
+	unsigned int				max_bits;
+};
+
+#define RHT_DEFAULT_MIN_BITS	4
+#define RHT_DEFAULT_MAX_BITS	20
+
+struct rhash_bucket {
+	spinlock_t					lock;
+	struct rhash_node			*first;
+};
+
+struct rhash_tbl {
+	unsigned int				bits;
+	struct rhash_tbl			*future;
+	unsigned int				next_to_move;	/* protected by resize_lock */
+	struct rcu_head				rcu;
+	struct rhash_bucket			buckets[];
+};
+
+struct rhashtable {
+	struct rhashtable_params	p;
+	struct rhash_tbl			*tbl;
+	atomic_t					nr_elems;
+	/* Serializes the moving of buckets, the table swap, and walkers */
+	spinlock_t					resize_lock;
+};
+
+void rhashtable_init(struct rhashtable *ht,
+                     const struct rhashtable_params *params);
+/* Frees the buckets, not the objects.  No one can use the table anymore. */
+void rhashtable_destroy(struct rhashtable *ht);
+void rhashtable_insert(struct rhashtable *ht, void *obj);
+/* Removes obj (this object, not a key), returning FALSE if it wasn't there. */
+bool rhashtable_remove(struct rhashtable *ht, void *obj);
+/* Call with rcu_read_lock held. */
+void *rhashtable_lookup(struct rhashtable *ht, const void *key);
+/* Calls f on every object.  f can't block or touch the table.  Objects
+ * inserted or removed during the walk may or may not be seen, but those that
+ * are in the table for the whole walk are seen exactly once. */
+void rhashtable_for_each(struct rhashtable *ht, void (*f)(void *obj, void *arg),
+                         void *arg);
+
+static inline unsigned int rhashtable_count(struct rhashtable *ht)
+{
+	return atomic_read(&ht->nr_elems);
+}
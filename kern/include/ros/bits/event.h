@@ -19,6 +19,7 @@
 #define EVENT_ROUNDROBIN		0x00080	/* pick a vcore, RR style */
 #define EVENT_VCORE_APPRO		0x00100	/* send to where the kernel wants */
 #define EVENT_WAKEUP			0x00200	/* wake up the process after sending */
+#define EVENT_COALESCE			0x00400	/* one IPI til user clears alert_pend */
 
 /* Event Message Types */
 #define EV_NONE					 0
@@ -43,6 +43,9 @@
 #define SYS_vmm_poke_guest			38
 #define SYS_send_event				39
 #define SYS_vmm_ctl					40
+#define SYS_sysc_ring_kick			41
+#define SYS_madvise					42
+#define SYS_mbind					43
 
 /* FS Syscalls */
 #define SYS_read				100
@@ -73,6 +76,11 @@
 #define SYS_fchdir				124
 #define SYS_dup_fds_to			125
 #define SYS_tap_fds				126
+#define SYS_readv				127
+#define SYS_writev				128
+#define SYS_splice				129
+#define SYS_pread				130
+#define SYS_pwrite				131
 
 /* Misc syscalls */
 /* was #define SYS_gettimeofday	140 */
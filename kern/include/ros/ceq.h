@@ -25,8 +25,14 @@
  * ceq_events with activity.  This is the "dense array."
  *
  * The ring buffer is actually an optimization.  If anything goes wrong, we can
- * tell the consumer to scan the entire array.  Likewise, spurious entries in
- * the ring are safe; the consumer just does an extra check.
+ * tell the consumer to go look in the array.  Likewise, spurious entries in the
+ * ring are safe; the consumer just does an extra check.
+ *
+ * So that the consumer doesn't have to scan the entire array when the ring
+ * overflows, the producer also sets the event's bit in a two-level bitmap: one
+ * bit per event in ovf_bits, and one bit per word of ovf_bits in ovf_summary.
+ * The word's bit is set before the summary's bit, and both are set before
+ * ring_overflowed.  Recovery only touches the words whose summary bits are set.
  *
  * In general, every time we have an event, we make sure there's a pointer in
  * the ring.  That's the purposed of 'idx_posted' - whether or not we think our
@@ -65,11 +71,14 @@ struct ceq_event {
  * number of entries filled is prod - pub.  The number of available entries
  * (nr_empty) is the size - (prod - pub). */
 
+#define CEQ_OVF_WORD_BITS		(sizeof(atomic_t) * 8)
+
 struct ceq {
 	struct ceq_event			*events;		/* consumer pointer */
 	unsigned int				nr_events;
-	unsigned int				last_recovered;
 	atomic_t					max_event_ever;
+	atomic_t					*ovf_bits;		/* consumer ptr, bit per event */
+	atomic_t					*ovf_summary;	/* consumer ptr, bit per word */
 	int32_t						*ring;			/* consumer pointer */
 	uint32_t					ring_sz;		/* size (power of 2) */
 	uint8_t						operation;		/* e.g. CEQ_OR */
@@ -0,0 +1,63 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * ChaCha20 block function (RFC 7539, with a 64 bit counter and nonce), shared
+ * by the kernel's urandom and parlib's random number generator.
+ *
+ * Both of them use it the same way: the caller holds a 256 bit key, and each
+ * block is the keystream for (ctr, nonce).  Overwriting the key with part of a
+ * block ("fast key erasure") means the old outputs can't be recovered from the
+ * current key. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define CHACHA_KEY_WORDS		8
+#define CHACHA_BLOCK_WORDS		16
+#define CHACHA_BLOCK_SIZE		(CHACHA_BLOCK_WORDS * sizeof(uint32_t))
+
+#define __CHACHA_ROTL(x, n)		(((x) << (n)) | ((x) >> (32 - (n))))
+
+#define __CHACHA_QR(a, b, c, d)							\
+do {												\
+	a += b; d ^= a; d = __CHACHA_ROTL(d, 16);		\
+	c += d; b ^= c; b = __CHACHA_ROTL(b, 12);		\
+	a += b; d ^= a; d = __CHACHA_ROTL(d, 8);		\
+	c += d; b ^= c; b = __CHACHA_ROTL(b, 7);		\
+} while (0)
+
+static inline void chacha20_block(const uint32_t key[CHACHA_KEY_WORDS],
+                                  uint64_t ctr, uint64_t nonce,
+                                  uint32_t out[CHACHA_BLOCK_WORDS])
+{
+	uint32_t in[CHACHA_BLOCK_WORDS];
+	uint32_t *x = out;
+
+	/* "expand 32-byte k" */
+	in[0] = 0x61707865;
+	in[1] = 0x3320646e;
+	in[2] = 0x79622d32;
+	in[3] = 0x6b206574;
+	for (int i = 0; i < CHACHA_KEY_WORDS; i++)
+		in[4 + i] = key[i];
+	in[12] = (uint32_t)ctr;
+	in[13] = (uint32_t)(ctr >> 32);
+	in[14] = (uint32_t)nonce;
+	in[15] = (uint32_t)(nonce >> 32);
+
+	for (int i = 0; i < CHACHA_BLOCK_WORDS; i++)
+		x[i] = in[i];
+	for (int i = 0; i < 10; i++) {
+		__CHACHA_QR(x[0], x[4], x[8], x[12]);
+		__CHACHA_QR(x[1], x[5], x[9], x[13]);
+		__CHACHA_QR(x[2], x[6], x[10], x[14]);
+		__CHACHA_QR(x[3], x[7], x[11], x[15]);
+		__CHACHA_QR(x[0], x[5], x[10], x[15]);
+		__CHACHA_QR(x[1], x[6], x[11], x[12]);
+		__CHACHA_QR(x[2], x[7], x[8], x[13]);
+		__CHACHA_QR(x[3], x[4], x[9], x[14]);
+	}
+	for (int i = 0; i < CHACHA_BLOCK_WORDS; i++)
+		x[i] += in[i];
+}
@@ -9,7 +9,15 @@
 
 #include <ros/bits/event.h>
 
+#define EVBITMAP_WORD_BITS		(sizeof(unsigned long) * 8)
+#define EVBITMAP_NR_WORDS		((MAX_NR_EVENT - 1) / EVBITMAP_WORD_BITS + 1)
+#define EVBITMAP_NR_BYTES		(EVBITMAP_NR_WORDS * sizeof(unsigned long))
+
+/* The kernel sets bits a byte at a time, but the bitmap is sized and aligned in
+ * whole words, so the consumer can skip empty words with one load.
+ * check_bits is the summary: it's set after any bit. */
 struct evbitmap {
 	bool						check_bits;
-	uint8_t						bitmap[(MAX_NR_EVENT - 1) / 8 + 1];
+	uint8_t						bitmap[EVBITMAP_NR_BYTES]
+	                        __attribute__((aligned(sizeof(unsigned long))));
 };
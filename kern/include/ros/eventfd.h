@@ -0,0 +1,35 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Mapped #eventfd counters.  mmap an eventfd's efd file, one page, MAP_SHARED
+ * and read-write, and you get its struct efd_shm.  The counter in there is the
+ * eventfd's count, so you can add to it and take from it with atomics instead
+ * of writing and reading the file.
+ *
+ * The kernel counts anyone who needs to hear about a change: readers asleep
+ * waiting for a count and taps for FDTAP_FILT_READABLE in nr_readers, writers
+ * asleep waiting for room and taps for FDTAP_FILT_WRITABLE in nr_writers.  It
+ * bumps them before it checks the counter.  So after you add to the counter,
+ * check nr_readers, and if it's set, write 0 to the file, which is the
+ * doorbell.  Likewise after you take from the counter and find nr_writers.
+ * With no one waiting, neither side makes a syscall.
+ *
+ * The counter never goes above EFD_SHM_MAX_VAL.  If adding would go past it,
+ * write to the file instead, which blocks (or fails with EAGAIN). */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define EFD_SHM_MAX_VAL			((uint64_t)-2)
+
+/* efd_shm flags */
+#define EFD_SHM_SEMAPHORE		(1 << 0)	/* reads take 1, not everything */
+
+struct efd_shm {
+	uint64_t					counter;
+	uint64_t					flags;
+	/* Written by the kernel */
+	uint64_t					nr_readers;
+	uint64_t					nr_writers;
+};
@@ -11,6 +11,7 @@
 #define FDTAP_CMD_ADD 			1
 #define FDTAP_CMD_REM 			2
 #define FDTAP_CMD_MOD 			3
+#define FDTAP_CMD_TABLE			4	/* register a tap table, see below */
 
 /* FD Tap Event/Filter types.  These are somewhat a mix of kqueue and epoll
  * filters and are in flux.  For instance, we don't support things like
@@ -42,3 +43,18 @@ struct fd_tap_req {
 	struct event_queue			*ev_q;
 	void						*data;
 };
+
+/* Optional shared-memory tap state, one slot per FD, registered per process
+ * with FDTAP_CMD_TABLE: data is the array of slots, ev_id is the number of
+ * them, and fd is ignored.  A NULL data unregisters the table.
+ *
+ * When a tapped FD has a slot, the kernel ORs every filter that fires into
+ * ready, whether or not it sends an event.  It only sends the event if the
+ * filter is also in interest.  Adding a tap sets interest to the tap's filter
+ * and clears ready.  After that, userspace can turn interest off and on and
+ * check ready without a syscall.  Turn interest on before checking ready, or
+ * you could miss an event. */
+struct fd_tap_slot {
+	uint32_t					interest;
+	uint32_t					ready;
+};
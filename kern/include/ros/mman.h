@@ -35,9 +35,26 @@
 #define MAP_POPULATE	0x08000
 #define MAP_NONBLOCK	0x10000
 #define MAP_STACK		0x20000
+/* Akaros: back anonymous memory with jumbo pages when we can.  This is Linux's
+ * MAP_HUGETLB bit, but we quietly fall back to normal pages. */
+#define MAP_HUGEPAGE	0x40000
 
 #define MAP_FAILED		((void*)-1)
 
+/* madvise() advice */
+#define MADV_NORMAL		0
+#define MADV_RANDOM		1
+#define MADV_SEQUENTIAL	2
+#define MADV_WILLNEED	3
+#define MADV_DONTNEED	4
+
+/* Memory placement policies, for mbind() and #proc/PID/ctl "mempolicy".  The
+ * nodes are a bitmask of NUMA node IDs. */
+#define MPOL_DEFAULT	0	/* the proc's policy, or the faulting core's node */
+#define MPOL_BIND		1	/* only these nodes, closest first */
+#define MPOL_INTERLEAVE	2	/* spread pages across these nodes */
+#define MPOL_MAX		MPOL_INTERLEAVE
+
 /* Other mmap flags, which we probably won't support
 #define MAP_32BIT
 */
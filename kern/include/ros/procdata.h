@@ -6,6 +6,7 @@
 #include <ros/memlayout.h>
 #include <ros/ring_syscall.h>
 #include <ros/sysevent.h>
+#include <ros/sysc_ring.h>
 #include <ros/arch/arch.h>
 #include <ros/common.h>
 #include <ros/procinfo.h>
@@ -25,6 +26,7 @@ typedef struct procdata {
 	uint32_t				pad32;
 	struct resource_req		res_req[MAX_NUM_RESOURCES];
 	struct event_queue		*kernel_evts[MAX_NR_EVENT];
+	struct sysc_ring		sysc_ring;
 	/* Long range, would like these to be mapped in lazily, as the vcores are
 	 * requested.  Sharing MAX_NUM_CORES is a bit weird too. */
 	struct preempt_data		vcore_preempt_data[MAX_NUM_CORES];
@@ -26,9 +26,11 @@ struct vcore;
 struct vcore {
 #ifdef ROS_KERNEL
 	TAILQ_ENTRY(vcore)	list;
+	uint64_t			fpu_save_seq;		/* see save_vc_fp_state() */
 #else /* userspace */
 	void				*dummy_ptr1;
 	void				*dummy_ptr2;
+	uint64_t			dummy_u64;
 #endif /* ROS_KERNEL */
 	uint32_t			pcoreid;
 	bool				valid;
@@ -46,6 +48,31 @@ struct pcore {
 	bool 				valid;
 };
 
+/* #proc/PID/vcorestats is an array of these, one per vcore up to max_vcores */
+struct vcore_stats {
+	uint64_t			online_ns;			/* total time on a pcore */
+	uint64_t			nr_runs;			/* times it got a pcore */
+	uint64_t			nr_preempts;
+	uint64_t			nr_migrations;		/* got a different pcore */
+	uint64_t			nr_notifs;			/* notifs delivered */
+	uint64_t			nr_kmsgs;			/* handled while on a pcore */
+};
+
+#define PROC_SNAPSHOT_NAME_SZ	24
+
+/* #proc/snapshot is an array of these, one per process, so a monitor can get
+ * every process's stats in one read.  state is a PROC_ state, and vm_bytes is
+ * the size of the process's mappings, not how much of them is resident. */
+struct proc_snapshot {
+	int32_t				pid;
+	int32_t				ppid;
+	uint32_t			state;
+	uint32_t			num_vcores;
+	uint64_t			cpu_ns;				/* total time on pcores */
+	uint64_t			vm_bytes;
+	char				progname[PROC_SNAPSHOT_NAME_SZ];
+};
+
 typedef struct procinfo {
 	pid_t pid;
 	pid_t ppid;
@@ -61,6 +88,9 @@ typedef struct procinfo {
 	uint32_t			num_vcores;
 	struct pcore		pcoremap[MAX_NUM_CORES];
 	seq_ctr_t			coremap_seqctr;
+	/* Unique to each process, including forked children.  parlib seeds its
+	 * random number generator with this. */
+	uint8_t				rand_seed[32];
 } procinfo_t;
 #define PROCINFO_NUM_PAGES  ((sizeof(procinfo_t)-1)/PGSIZE + 1)
 
@@ -71,8 +101,16 @@ struct proc_global_info {
 	uint64_t tsc_freq;
 	uint64_t tsc_overhead;
 	uint64_t bus_freq;
+	/* The wall clock was walltime_ns_last when the TSC was tsc_cycles_last.
+	 * The kernel changes them when someone sets the time, in a write section
+	 * of walltime_seq, so readers in userspace need to retry on changes. */
 	uint64_t walltime_ns_last;
 	uint64_t tsc_cycles_last;
+	seq_ctr_t walltime_seq;
+	/* The wall clock at boot, which never changes.  CLOCK_MONOTONIC counts up
+	 * from it, so it agrees with CLOCK_REALTIME until someone sets the time. */
+	uint64_t walltime_ns_boot;
+	uint64_t tsc_cycles_boot;
 } __attribute__((aligned(PGSIZE)));
 #define PROCGINFO_NUM_PAGES  (sizeof(struct proc_global_info) / PGSIZE)
 
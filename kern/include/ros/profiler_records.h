@@ -47,3 +47,77 @@ struct proftype_new_process {
 	uint32_t pid;
 	uint8_t path[0];
 } __attribute__((packed));
+
+/* In aggregation mode (prof_aggregate), each core counts identical traces and
+ * emits one of these per distinct trace when flushed.  tstamp is the flush
+ * time. */
+#define PROFTYPE_TRACE_AGG64	5
+
+struct proftype_trace_agg64 {
+	uint64_t info;
+	uint64_t tstamp;
+	uint64_t count;
+	uint32_t pid;
+	uint16_t cpu;
+	uint16_t num_traces;
+	uint8_t user;
+	uint64_t trace[0];
+} __attribute__((packed));
+
+/* Follows the KERN or USER trace it belongs to, for samples from events with
+ * LBRs.  branches[0] is the most recent. */
+#define PROFTYPE_BRANCH_STACK64	6
+
+#define PROF_BRANCH_MISPRED		(1 << 0)
+
+struct proftype_branch64 {
+	uint64_t from;
+	uint64_t to;
+	uint64_t flags;
+} __attribute__((packed));
+
+struct proftype_branch_stack64 {
+	uint64_t info;
+	uint64_t tstamp;
+	uint16_t cpu;
+	uint16_t nr_branches;
+	struct proftype_branch64 branches[0];
+} __attribute__((packed));
+
+/* With prof_offcpu, a kthread that slept in sem_down() for at least the
+ * threshold emits one of these when it runs again.  The trace is the kernel
+ * stack it blocked on, tstamp is when it got a core back, and blocked is how
+ * long it was off the core (asleep and then runnable) in nsec.  Blocking
+ * syscalls are charged to pid, like a kernel trace. */
+#define PROFTYPE_OFFCPU64		7
+
+struct proftype_offcpu64 {
+	uint64_t tstamp;
+	uint64_t blocked;
+	uint32_t pid;
+	uint16_t cpu;
+	uint16_t num_traces;
+	uint64_t trace[0];
+} __attribute__((packed));
+
+/* With prof_ring, each core's samples go into a ring in #kprof/kpring instead
+ * of kpdata.  The file is one area per core, in core order: a header page,
+ * followed by data_size bytes of data.  The data is the same record stream as
+ * kpdata, but records can wrap around the end of the ring.
+ *
+ * data_head and data_tail are byte counts that never wrap; the ring offset is
+ * the count modulo data_size, which is a power of 2.  The kernel writes
+ * records and then advances data_head.  The reader reads up to data_head, then
+ * advances data_tail to release the space.  Records that don't fit are
+ * dropped and counted in nr_lost.  Mmap and process records stay in kpdata. */
+#define PROF_RING_VERSION		1
+
+struct prof_ring_header {
+	uint32_t version;
+	uint32_t core;
+	uint64_t data_offset;	/* from the start of the header */
+	uint64_t data_size;
+	uint64_t data_head;		/* written by the kernel */
+	uint64_t data_tail;		/* written by the reader */
+	uint64_t nr_lost;
+};
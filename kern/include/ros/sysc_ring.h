@@ -0,0 +1,32 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Syscall submission ring, in procdata.  An MCP puts pointers to its struct
+ * syscalls in sq[] and bumps prod; the kernel's ring pollers run them and
+ * advance cons.  Completion is the same as any async syscall: SC_DONE, plus an
+ * event on the syscall's ev_q if it has SC_UEVENT set.  Userspace normally
+ * points them all at one ev_q with a UCQ, which is the completion ring.
+ *
+ * When the pollers go idle, the kernel sets SYSC_RING_NEED_KICK.  Userspace
+ * checks it after bumping prod, and if it is set, calls SYS_sysc_ring_kick.
+ * Any other syscall trap starts a poller too, if there is work waiting. */
+
+#pragma once
+
+#include <ros/common.h>
+
+#define SYSC_RING_SZ			256		/* power of two */
+#define SYSC_RING_MASK			(SYSC_RING_SZ - 1)
+
+#define SYSC_RING_NEED_KICK		(1 << 0)
+
+struct syscall;
+
+struct sysc_ring {
+	uint32_t					prod;		/* written by userspace */
+	uint8_t						pad1[60];
+	uint32_t					cons;		/* written by the kernel */
+	uint32_t					flags;		/* written by the kernel */
+	uint8_t						pad2[56];
+	struct syscall				*sq[SYSC_RING_SZ];
+};
@@ -15,6 +15,24 @@
 #define MAX_ERRSTR_LEN			128
 #define SYSTR_BUF_SZ			PGSIZE
 
+/* Binary strace records, read from /proc/PID/strace_bin.  A syscall gets an
+ * entry record, then an exit record with SYSTR_BIN_EXIT set.  Timestamps are
+ * in TSC ticks. */
+#define SYSTR_BIN_EXIT			(1 << 0)
+
+struct systrace_bin_record {
+	uint64_t					start_tsc;
+	uint64_t					end_tsc;		/* 0 for an entry */
+	uint64_t					args[6];		/* 0s for an exit */
+	uint64_t					retval;
+	uint32_t					syscallno;
+	uint32_t					pid;
+	uint32_t					coreid;
+	uint32_t					vcoreid;
+	int32_t						err;
+	uint32_t					flags;
+};
+
 struct syscall {
 	unsigned int				num;
 	int							err;			/* errno */
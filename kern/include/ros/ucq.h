@@ -5,8 +5,9 @@
  * Unbounded concurrent queues.  Linked buffers/arrays of elements, in page
  * size chunks.  The pages/buffers are linked together by an info struct at the
  * beginning of the page.  Producers and consumers sync on the idxes when
- * operating in a page, and page swaps are synced via the proc* for the kernel
- * and via the ucq's u_lock for the user.
+ * operating in a page, and page swaps are synced via the proc* for the kernel.
+ * Userspace consumers swap pages lock-free, using u_nr_pins to know when no one
+ * is still looking at the old page.
  *
  * There's a bunch of details and issues discussed in the Documentation.
  *
@@ -38,8 +39,8 @@ struct ucq {
 	atomic_t					cons_idx;		/* cons pg and slot nr */
 	bool						prod_overflow;	/* flag to prevent wraparound */
 	bool						ucq_ready;		/* ucq is ready to be used */
-	/* Userspace lock for modifying the UCQ */
-	uint32_t					u_lock[2];
+	/* Userspace consumers in the middle of a page swap */
+	atomic_t					u_nr_pins;
 };
 
 /* Struct at the beginning of every page/buffer, tracking consumers and
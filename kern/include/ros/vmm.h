@@ -13,11 +13,19 @@
 #define VMCALL_SMPBOOT		0x2
 #define VMCALL_GET_TSCFREQ	0x3
 #define VMCALL_TRACE_TF		0x4
+#define VMCALL_SNAPSHOT		0x5
 
 #define VMM_CTL_GET_EXITS		1
 #define VMM_CTL_SET_EXITS		2
 #define VMM_CTL_GET_FLAGS		3
 #define VMM_CTL_SET_FLAGS		4
+#define VMM_CTL_HARVEST_AD		5
+#define VMM_CTL_GET_GPC_STATE	6
+#define VMM_CTL_SET_GPC_STATE	7
+
+/* What VMM_CTL_HARVEST_AD collects.  Pick one. */
+#define VMM_HARVEST_ACCESSED	(1 << 0)
+#define VMM_HARVEST_DIRTY		(1 << 1)
 
 #define VMM_CTL_EXIT_HALT		(1 << 0)
 #define VMM_CTL_EXIT_PAUSE		(1 << 1)
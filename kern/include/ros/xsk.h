@@ -0,0 +1,79 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Mapped packet rings for #ether conversations, along the lines of Linux's
+ * AF_XDP.  Write "xsk NR_FRAMES FRAME_SIZE RING_SIZE" to a conversation's ctl,
+ * then open and mmap its xsk file, MAP_SHARED and read-write.  The file has:
+ *
+ * - a header page, struct xsk_hdr, which says where everything else is
+ * - the rx and tx rings, of struct xsk_desc
+ * - the fill and completion rings, of umem offsets (uint64_t)
+ * - the umem: NR_FRAMES frames of FRAME_SIZE bytes
+ *
+ * Each ring has one producer and one consumer.  You produce on fill and tx and
+ * consume from rx and completion; the kernel does the rest.  Indexes are free
+ * running, mod 2^32: a ring has prod - cons entries, and entry i is at
+ * ring[i & (ring_size - 1)].  Write an entry before you advance prod (wmb), and
+ * read prod before the entry (rmb).
+ *
+ * To receive, put the offsets of empty frames on the fill ring.  Frames for
+ * this conversation (its type, filter, etc.) get copied into the next fill
+ * frame and show up on the rx ring.  If there is no fill frame or the rx ring
+ * is full, the frame is dropped and counted.  To send, put the frame's offset
+ * and length on the tx ring and write anything to the xsk file.  The frame's
+ * offset comes back on the completion ring once the kernel is done with it.
+ *
+ * The xsk file takes FD taps: it is readable when the rx ring goes from empty
+ * to not, and writable when the kernel completes tx frames.  The data file
+ * stops getting frames while the rings are set up. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <ros/arch/mmu.h>
+
+#define XSK_VERSION				1
+
+#define XSK_MIN_FRAME_SIZE		2048
+#define XSK_MAX_FRAME_SIZE		PGSIZE
+#define XSK_MAX_FRAMES			(1 << 18)
+#define XSK_MAX_RING_SIZE		(1 << 15)
+
+struct xsk_desc {
+	uint64_t					addr;	/* offset in the umem */
+	uint32_t					len;
+	uint32_t					flags;
+};
+
+/* prod and cons on their own cache lines, since each side writes one. */
+struct xsk_ring {
+	uint32_t					prod;
+	uint8_t						pad0[60];
+	uint32_t					cons;
+	uint8_t						pad1[60];
+};
+
+struct xsk_hdr {
+	uint32_t					version;
+	uint32_t					ring_size;
+	uint32_t					nr_frames;
+	uint32_t					frame_size;
+	/* File offsets */
+	uint64_t					rx_off;
+	uint64_t					tx_off;
+	uint64_t					fill_off;
+	uint64_t					comp_off;
+	uint64_t					umem_off;
+	/* Stats, written by the kernel */
+	uint64_t					rx_packets;
+	uint64_t					rx_no_fill;
+	uint64_t					rx_ring_full;
+	uint64_t					tx_packets;
+	uint64_t					bad_descs;
+	uint8_t						pad[32];
+
+	struct xsk_ring				rx;
+	struct xsk_ring				tx;
+	struct xsk_ring				fill;
+	struct xsk_ring				comp;
+};
@@ -13,13 +13,27 @@
 #include <corerequest.h>
 
 struct proc;	/* process.h includes us, but we need pointers now */
+
+/* Latency-critical MCPs can preempt batch MCPs to get their share of cores. */
+#define KSCHED_CLASS_BATCH		0
+#define KSCHED_CLASS_LC			1
 TAILQ_HEAD(proc_list, proc);		/* Declares 'struct proc_list' */
+struct scp_runq;
 
 /* One of these embedded in every struct proc */
 struct sched_proc_data {
 	TAILQ_ENTRY(proc)			proc_link;			/* tailq linkage */
 	struct proc_list 			*cur_list;			/* which tailq we're on */
+	struct scp_runq				*scp_runq;			/* if on an SCP run queue */
+	uint32_t					scp_core;			/* SCP last ran here */
 	struct core_request_data	crd;				/* prov/alloc cores */
+	uint64_t					req_tsc;			/* oldest unmet request */
+	bool						starved;			/* ran out of cores */
+	int							class;				/* KSCHED_CLASS_* */
+	uint32_t					min_cores;			/* guaranteed */
+	uint32_t					weight;				/* share of the rest */
+	bool						mcp_counted;		/* in nr_mcps */
+	uint64_t					wakeup_tsc;			/* woke, hasn't run */
 	/* count of lists? */
 	/* other accounting info */
 };
@@ -72,8 +86,18 @@ void avail_res_changed(int res_type, long change);
  * schedulers. */
 int provision_core(struct proc *p, uint32_t pcoreid);
 
+/* Sets p's class, its guaranteed number of cores, and its weight for sharing
+ * the rest.  Returns -1 if we can't guarantee that many cores. */
+int sched_set_coreshare(struct proc *p, int class, uint32_t min_cores,
+                        uint32_t weight);
+
+/* With a notice period, the ksched asks MCPs to yield cores it wants back, and
+ * only preempts them if they don't within usec.  0 preempts right away. */
+void sched_set_preempt_notice(uint64_t usec);
+
 /************** Debugging **************/
 void sched_diag(void);
+void print_ksched_latency(void);
 void print_resources(struct proc *p);
 void print_all_resources(void);
 void next_core_to_alloc(uint32_t pcoreid);
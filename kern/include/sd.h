@@ -14,10 +14,14 @@ struct devconf;
 struct sdev;
 struct sdifc;
 struct sdio;
+struct fs_file;
+struct sdcache;
 struct sdpart;
 struct sdperm;
+struct sdqueue;
 struct sdreq;
 struct sdunit;
+struct sdbreq;
 
 struct sdperm {
 	char *name;
@@ -31,6 +35,7 @@ struct sdpart {
 	struct sdperm sdperm;
 	int valid;
 	uint32_t vers;
+	struct sdcache *cache; /* nil if not cached */
 };
 
 struct sdunit {
@@ -53,6 +58,8 @@ struct sdunit {
 	int state;
 	struct sdreq *req;
 	struct sdperm rawperm;
+
+	struct sdqueue *q; /* nil if the ifc can't queue */
 };
 
 /*
@@ -93,6 +100,16 @@ struct sdifc {
 	void (*clear)(struct sdev *);
 	char *(*rtopctl)(struct sdev *, char *, char *);
 	int (*wtopctl)(struct sdev *, struct cmdbuf *);
+
+	/*
+	 * Optional: queued block I/O, see sdqueue.c.  qdepth returns how
+	 * many commands the unit can have in flight right now (0 means use
+	 * bio).  submit starts a command, possibly several merged sdbreqs,
+	 * and returns SDok or an error.  The ifc calls sdqcomplete() for
+	 * each command when it's done, then sdqwakeup() once per batch.
+	 */
+	int (*qdepth)(struct sdunit *);
+	int (*submit)(struct sdunit *, struct sdbreq *);
 };
 
 struct sdreq {
@@ -111,6 +128,30 @@ struct sdreq {
 	unsigned char sense[256];
 };
 
+/*
+ * A block read or write in a unit's request queue.  Adjacent requests are
+ * merged into one command: the first one heads the command and the rest
+ * hang off ->merged, in block order.
+ */
+struct sdbreq {
+	TAILQ_ENTRY(sdbreq) link;
+	struct sdbreq *merged;
+	struct sdunit *unit;
+	int write;
+	uint64_t bno;
+	uint32_t nb;
+	void *data;
+
+	/* set on the head of a command */
+	uint32_t cmdnb;
+	int cmdnseg;
+
+	int status;
+	int32_t rlen;
+	bool done;
+};
+TAILQ_HEAD(sdbreq_tailq, sdbreq);
+
 enum {
 	SDnosense = 0x00000001,
 	SDvalidsense = 0x00010000,
@@ -143,6 +184,9 @@ enum {
 
 	SDmaxio = 2048 * 1024,
 	SDnpart = 16,
+
+	SDqmax = 32,  /* most commands in flight per unit */
+	SDnseg = 16,  /* most requests merged into one command */
 };
 
 /*
@@ -170,6 +214,23 @@ extern int sdsetsense(struct sdreq *, int, int, int, int);
 extern int sdmodesense(struct sdreq *, unsigned char *, void *, int);
 extern int sdfakescsi(struct sdreq *, void *, int);
 
+/* sdcache.c */
+extern struct sdcache *sdcachealloc(struct sdunit *, char *, uint64_t,
+                                    uint64_t);
+extern struct sdcache *sdcacheget(struct sdcache *);
+extern void sdcacheput(struct sdcache *);
+extern void sdcachedrop(struct sdcache *, int);
+extern void sdcachesync(struct sdcache *);
+extern size_t sdcacherw(struct sdcache *, int, void *, size_t, off64_t);
+extern struct fs_file *sdcachemmap(struct sdcache *, int, int);
+
+/* sdqueue.c */
+extern void sdqinit(struct sdunit *);
+extern int32_t sdqbio(struct sdunit *, int, void *, int32_t, uint64_t);
+extern void sdqcomplete(struct sdbreq *, int);
+extern void sdqwakeup(struct sdunit *);
+extern char *sdqstats(struct sdunit *, char *, char *);
+
 /* sdscsi.c */
 extern int scsiverify(struct sdunit *);
 extern int scsionline(struct sdunit *);
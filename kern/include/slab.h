@@ -45,6 +45,7 @@
 /* Cache creation flags: */
 #define KMC_NOTOUCH				0x0001	/* Can't use source/object's memory */
 #define KMC_QCACHE				0x0002	/* Cache is an arena's qcache */
+#define KMC_NOPROF				0x0004	/* Skip allocation-site profiling */
 #define __KMC_USE_BUFCTL		0x1000	/* Internal use */
 
 struct kmem_magazine {
@@ -54,14 +55,23 @@ struct kmem_magazine {
 } __attribute__((aligned(ARCH_CL_SIZE)));
 SLIST_HEAD(kmem_mag_slist, kmem_magazine);
 
+struct kmem_depot;
+
 struct kmem_pcpu_cache {
 	int8_t						irq_state;
 	unsigned int				magsize;
 	struct kmem_magazine		*loaded;
 	struct kmem_magazine		*prev;
+	struct kmem_depot			*depot;		/* our NUMA node's depot */
+	/* Ops the mags handled, and how many mags we got from the depot */
 	size_t						nr_allocs_ever;
+	size_t						nr_frees_ever;
+	size_t						nr_depot_trips;
 } __attribute__((aligned(ARCH_CL_SIZE)));
 
+/* There is one depot per NUMA node.  The pcpu caches on a node swap magazines
+ * with their node's depot, and only steal from other nodes when their depot
+ * has no not-empty mags.  The hit/miss counters are protected by the lock. */
 struct kmem_depot {
 	spinlock_t					lock;
 	struct kmem_mag_slist		not_empty;
@@ -71,7 +81,15 @@ struct kmem_depot {
 	unsigned int				nr_not_empty;
 	unsigned int				busy_count;
 	uint64_t					busy_start;
-};
+	uint64_t					last_contention;
+	size_t						nr_contended;
+	size_t						nr_mag_grows;
+	size_t						nr_mag_shrinks;
+	unsigned int				node_id;
+	size_t						nr_local_hits;
+	size_t						nr_remote_hits;
+	size_t						nr_misses;
+} __attribute__((aligned(ARCH_CL_SIZE)));
 
 struct kmem_slab;
 
@@ -102,7 +120,8 @@ TAILQ_HEAD(kmem_slab_list, kmem_slab);
 struct kmem_cache {
 	TAILQ_ENTRY(kmem_cache) all_kmc_link;
 	struct kmem_pcpu_cache *pcpu_caches;
-	struct kmem_depot depot;
+	struct kmem_depot *depots;
+	unsigned int nr_depots;
 	spinlock_t cache_lock;
 	size_t obj_size;
 	size_t import_amt;
@@ -117,6 +136,10 @@ struct kmem_cache {
 	void *priv;
 	unsigned long nr_cur_alloc;
 	unsigned long nr_direct_allocs_ever;
+	unsigned long nr_direct_frees_ever;
+	/* For #mem/kmemstat's rates, protected by arenas_and_slabs_lock */
+	uint64_t stat_tsc;
+	size_t stat_nr_allocs;
 	struct hash_helper hh;
 	struct kmem_bufctl_list *alloc_hash;
 	struct kmem_bufctl_list static_hash[HASH_INIT_SZ];
@@ -126,6 +149,25 @@ struct kmem_cache {
 
 extern struct kmem_cache_tailq all_kmem_caches;
 
+/* A cache's counters, summed over its pcpu caches and depots.  Racy. */
+struct kmem_cache_stats {
+	size_t						nr_allocs;
+	size_t						nr_frees;
+	/* Allocs and frees that didn't leave the pcpu cache */
+	size_t						nr_mag_hits;
+	size_t						nr_depot_trips;
+	size_t						nr_slab_allocs;
+	size_t						nr_slab_frees;
+	size_t						nr_contended;
+};
+
+static inline unsigned int kmem_stats_hit_pct(struct kmem_cache_stats *st)
+{
+	size_t nr_ops = st->nr_allocs + st->nr_frees;
+
+	return nr_ops ? st->nr_mag_hits * 100 / nr_ops : 100;
+}
+
 /* Cache management */
 struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
                                      int align, int flags,
@@ -137,13 +179,38 @@ void kmem_cache_destroy(struct kmem_cache *cp);
 /* Front end: clients of caches use these */
 void *kmem_cache_alloc(struct kmem_cache *cp, int flags);
 void kmem_cache_free(struct kmem_cache *cp, void *buf);
+size_t kmem_cache_alloc_batch(struct kmem_cache *cp, void **objs, size_t nr,
+                              int flags);
+void kmem_cache_free_batch(struct kmem_cache *cp, void **objs, size_t nr);
+void kmem_cache_get_stats(struct kmem_cache *kc, struct kmem_cache_stats *st);
 /* Back end: internal functions */
 void kmem_cache_init(void);
-void kmem_cache_reap(struct kmem_cache *cp);
+size_t kmem_cache_reap(struct kmem_cache *cp);
 unsigned int kmc_nr_pcpu_caches(void);
+unsigned int kmc_nr_depots(void);
+void kmem_cache_numa_init(void);
 /* Low-level interface for initializing a cache. */
 void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                          size_t obj_size, int align, int flags,
                          struct arena *source,
                          int (*ctor)(void *, void *, int),
                          void (*dtor)(void *, void *), void *priv);
+void __kmem_cache_destroy(struct kmem_cache *kc);
+
+/* System-wide reclaim of idle slab memory, run by a ktask when the base arenas
+ * are low on free memory.  Protected by the arenas_and_slabs_lock. */
+struct kmem_reclaim_stats {
+	uint64_t					nr_passes;
+	uint64_t					nr_pokes;
+	uint64_t					total_bytes;
+	uint64_t					last_bytes;
+	uint64_t					last_nr_mags;
+	uint64_t					last_slab_bytes;
+	uint64_t					last_nsec;
+};
+extern struct kmem_reclaim_stats kmem_reclaim_stats;
+extern unsigned int kmem_reclaim_low_pct;
+
+void kmem_reclaim_init(void);
+void kmem_reclaim_poke(void);
+size_t kmem_reclaim(void);
@@ -22,7 +22,23 @@
  * We can hand out u16s in the range [0, 65535].
  *
  * The check array is used instead of a bitfield because these architectures
- * suck at those. */
+ * suck at those.
+ *
+ * Pools from create_u16_pool_pcpu() also have a small cache of IDs per core,
+ * which get and put use first.  They move IDs from and to the stack
+ * U16_PCPU_BATCH at a time, so busy pools (e.g. 9p tags) mostly don't touch
+ * the global lock.  An ID can be in some other core's cache, so once the stack
+ * is empty, get steals from the other cores before giving up.  tos only counts
+ * the IDs that made it out of the stack. */
+
+#define U16_PCPU_CACHE_SZ 32
+#define U16_PCPU_BATCH (U16_PCPU_CACHE_SZ / 2)
+
+struct u16_pcpu_cache {
+	spinlock_t lock;
+	unsigned int nr;
+	uint16_t ids[U16_PCPU_CACHE_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
 
 struct u16_pool {
 	spinlock_t lock;
@@ -30,8 +46,10 @@ struct u16_pool {
 	uint16_t *ids;
 	uint8_t *check;
 	int size;
+	struct u16_pcpu_cache *pcpu;	/* num_cores of them, or 0 */
 };
 
 struct u16_pool *create_u16_pool(unsigned int size);
+struct u16_pool *create_u16_pool_pcpu(unsigned int size);
 int get_u16(struct u16_pool *id);
 void put_u16(struct u16_pool *id, int v);
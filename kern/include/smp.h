@@ -25,6 +25,8 @@
 #define CPU_STATE_IDLE			3
 #define NR_CPU_STATES			4
 
+#define KTH_CACHE_NR			8		/* cached kthreads per core */
+
 static char *cpu_state_names[NR_CPU_STATES] =
 {
 	"irq",
@@ -48,16 +50,21 @@ struct per_cpu_info {
 	struct proc *cur_proc;		/* which process context is loaded */
 	struct proc *owning_proc;	/* proc owning the core / cur_ctx */
 	uint32_t owning_vcoreid;	/* vcoreid of owning proc (if applicable */
+	struct vcore *fpu_vc;		/* vcore whose saved FPU state is loaded */
+	uint64_t nr_fpu_saves;		/* makes save seqs, see process.c */
 	struct user_context *cur_ctx;	/* user ctx we came in on (can be 0) */
 	struct user_context actual_ctx;	/* storage for cur_ctx */
 	uint32_t __ctx_depth;		/* don't access directly.  see trap.h. */
 	int __lock_checking_enabled;/* == 1, enables spinlock depth checking */
 	struct kthread *cur_kthread;/* tracks the running kernel context */
-	struct kthread *spare;		/* useful when restarting */
+	/* kthreads (with stacks) for sem_down and restart_kthread to swap in */
+	struct kthread *kth_cache[KTH_CACHE_NR];
+	unsigned int nr_kth_cache;
 	struct timer_chain tchain;	/* for the per-core alarm */
 	unsigned int lock_depth;
 	struct trace_ring traces;
 	int cpu_state;
+	seq_ctr_t state_seq;		/* for reading the ticks from other cores */
 	uint64_t last_tick_cnt;
 	uint64_t state_ticks[NR_CPU_STATES];
 	/* TODO: 64b (not sure if we'll need these at all */
@@ -66,10 +73,11 @@ struct per_cpu_info {
 	segdesc_t *gdt;
 #endif
 	/* KMSGs */
-	spinlock_t immed_amsg_lock;
-	struct kernel_msg_list immed_amsgs;
-	spinlock_t routine_amsg_lock;
-	struct kernel_msg_list routine_amsgs;
+	struct kmsg_queue immed_amsgs;
+	struct kmsg_queue routine_amsgs;
+	atomic_t kmsg_ipi_pending;	/* an I_KERNEL_MSG is on its way to us */
+	uint64_t nr_kmsg_ipis;		/* sent by this core */
+	uint64_t nr_kmsg_ipis_saved;	/* not sent, since one was pending */
 	/* profiling -- opaque to all but the profiling code. */
 	void *profiling;
 }__attribute__((aligned(ARCH_CL_SIZE)));
@@ -103,6 +111,7 @@ void __arch_pcpu_init(uint32_t coreid);	/* each arch has one of these */
 
 void __set_cpu_state(struct per_cpu_info *pcpui, int state);
 void reset_cpu_state_ticks(int coreid);
+void get_cpu_state_ticks(int coreid, uint64_t *ticks);
 
 /* SMP utility functions */
 int smp_call_function_self(isr_t handler, void *data,
@@ -37,6 +37,9 @@ void	vprintfmt(void (*putch)(int, void**), void **putdat, const char *fmt, va_li
 // lib/printf.c
 int	( cprintf)(const char *fmt, ...);
 int	vcprintf(const char *fmt, va_list);
+void	printk_flush(void);
+void	printk_emergency(void);
+void	printk_drain_init(void);
 
 // lib/sprintf.c
 
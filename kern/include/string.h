@@ -38,6 +38,14 @@ void *sigscan(uint8_t *address, int length, char *signature);
 /* In arch/support64.S */
 void bcopy(const void *src, void *dst, size_t len);
 
+#ifdef CONFIG_X86
+/* memcpy and memset with rep movsb/stosb, fast with ERMS */
+void *memcpy_erms(void *dst, const void *src, size_t len);
+void *memset_erms(void *dst, int c, size_t len);
+/* memcpy with non-temporal stores, for copies too big for the cache */
+void *memcpy_nt(void *dst, const void *src, size_t len);
+#endif
+
 #ifdef CONFIG_RISCV
 #warning Implement bcopy
 #endif
@@ -16,12 +16,24 @@ enum uio_seg {
 	UIO_NOCOPY		/* don't copy, already in object */
 };
 
+#define UIO_MAXIOV		1024	/* max iovecs per readv/writev */
+
 // Straight out of bsd definition
 struct iovec {
     void    *iov_base;  /* Base address. */
     size_t   iov_len;   /* Length. */
 };
 
+/* Total length of the iovecs. */
+static inline size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t ret = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		ret += iov[i].iov_len;
+	return ret;
+}
+
 struct uio {
 	struct	iovec *uio_iov;		/* scatter/gather list */
 	int	uio_iovcnt;		/* length of scatter/gather list */
@@ -0,0 +1,14 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Kernel side of the syscall submission ring. */
+
+#pragma once
+
+#include <ros/sysc_ring.h>
+
+struct proc;
+
+void sysc_ring_init(struct proc *p);
+void sysc_ring_poke(struct proc *p);
+int sysc_ring_kick(struct proc *p);
@@ -44,10 +44,14 @@ struct systrace_record {
 	uint8_t			data[SYSTR_RECORD_SZ - sizeof(struct systrace_record_anon)];
 };
 
+struct strace_bin_ring;
+
 struct strace {
 	bool tracing;
 	bool inherit;
 	bool drop_overflow;
+	bool binary;
+	bool bin_hungup;
 	atomic_t nr_drops;
 	unsigned long appx_nr_sysc;
 	struct kref procs; /* when procs goes to zero, q is hung up. */
@@ -55,6 +59,11 @@ struct strace {
 	struct queue *q;
 	spinlock_t lock;
 	DECLARE_BITMAP(trace_set, MAX_SYSCALL_NR);
+	/* Binary tracing, one ring per core.  Allocated on the first open of
+	 * strace_bin, and kept until the strace is freed. */
+	struct strace_bin_ring *bin_rings;
+	qlock_t bin_qlock;		/* one reader at a time */
+	struct rendez bin_rv;
 };
 
 extern bool systrace_loud;
@@ -71,6 +80,7 @@ extern const int max_syscall;
 /* Syscall invocation */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_calls);
 void run_local_syscall(struct syscall *sysc);
+void fail_sysc(struct syscall *sysc, struct proc *p, int err);
 intreg_t syscall(struct proc *p, uintreg_t sc_num, uintreg_t a0, uintreg_t a1,
                  uintreg_t a2, uintreg_t a3, uintreg_t a4, uintreg_t a5);
 void set_errno(int errno);
@@ -89,3 +99,10 @@ void __signal_syscall(struct syscall *sysc, struct proc *p);
 bool syscall_uses_fd(struct syscall *sysc, int fd);
 void print_sysc(struct proc *p, struct syscall *sysc);
 void kth_panic_sysc(struct kthread *kth);
+
+/* Binary strace, for devproc */
+void strace_bin_open(struct strace *s);
+void strace_bin_close(struct strace *s);
+size_t strace_bin_read(struct strace *s, void *va, size_t n);
+void strace_bin_hangup(struct strace *s);
+void strace_bin_free(struct strace *s);
@@ -7,18 +7,45 @@
  * change the implementation if we need more control.
  *
  *
- * Linux workqueue wrappers:
+ * Linux workqueues:
+ *
+ * Work runs in worker ktasks, out of per-core pools.  A bound workqueue runs
+ * work on the core that queued it (or the core you ask for with
+ * queue_work_on()).  An WQ_UNBOUND workqueue runs work on whichever LL core
+ * looks the least busy, preferring one with an idle worker.
+ * create_singlethread_workqueue() and the system workqueue (schedule_work())
+ * are unbound, so that work stays off the CG cores.
+ *
+ * Each pool has a concurrency target: the most workers it will have at a time.
+ * Our kthreads don't get preempted, so only one of them is running on the core
+ * at a time; the others are blocked.  When a worker blocks with work still
+ * queued, another worker picks it up, up to the target.  Workers also yield
+ * between work items if the core has routine kmsgs waiting, so a long worklist
+ * doesn't starve the core's other kernel work.
+ *
+ * max_active limits how many of a workqueue's items run at once, across all of
+ * its pools (Linux's is per-core).  Single threaded workqueues have a
+ * max_active of 1, so they run their work one at a time, in order.
+ *
+ * #kprof/wqstat has latency stats for every workqueue: how long work waited to
+ * start and how long it ran.
  *
  * Caveats:
- * - Workqueues have no core affinity or anything.  queued work goes to the
- * calling core.  Scheduled work goes to core 0.
- * - There are no extra delays in time.  All work are RKMs.
- * - You can't cancel a message.  The differences btw work and delayed_work
- * aren't entirely clear.
- */
+ * - flush_workqueue() waits until the workqueue is empty, not just for the
+ *   work that was queued when you called it.  Work that always requeues itself
+ *   will keep you waiting.
+ * - Delayed work's delay is in jiffies, and we pretend to be a 1000 HZ machine.
+ * - Don't destroy a workqueue with delayed work pending. */
 
 #pragma once
 
+#include <ros/common.h>
+#include <sys/queue.h>
+#include <atomic.h>
+#include <bitops.h>
+#include <rendez.h>
+#include <alarm.h>
+
 typedef void (*task_fn_t)(void *context, int pending);
 struct taskqueue {};
 struct task {
@@ -39,20 +66,59 @@ int taskqueue_enqueue(struct taskqueue *queue, struct task *task);
 	(str)->ta_func = func;                                                     \
 	(str)->ta_context = (void*)arg;
 
-struct workqueue_struct {
-};
+#define WQ_UNBOUND					(1 << 1)
+#define WQ_MAX_ACTIVE				512
+#define WQ_DFL_ACTIVE				(WQ_MAX_ACTIVE / 2)
+#define WQ_NAME_SZ					32
+
+#define WORK_STRUCT_PENDING_BIT		0
+
+struct wq_pool;
+struct workqueue_struct;
+struct cmdbuf;
 
 struct work_struct {
 	void (*func)(struct work_struct *);
-	/* TODO: args and bookkeeping to support cancel{,_sync}. */
-	void *arg;
+	unsigned long				flags;
+	TAILQ_ENTRY(work_struct)	link;
+	/* The rest are only valid while the work is pending */
+	struct workqueue_struct		*wq;
+	struct wq_pool				*pool;		/* on its worklist */
+	bool						inactive;	/* on wq's inactive list */
+	int							coreid;		/* for bound wqs */
+	uint64_t					queued_at;	/* TSC */
 };
+TAILQ_HEAD(work_tailq, work_struct);
 
 /* Delayed work is embedded in other structs.  Handlers will expect to get a
  * work_struct pointer. */
 struct delayed_work {
 	struct work_struct 			work;
-	/* TODO: support for the actual alarm / timer */
+	struct alarm_waiter			timer;
+	struct timer_chain			*tchain;
+};
+
+struct wq_stats {
+	uint64_t					nr_queued;
+	uint64_t					nr_done;
+	uint64_t					nr_cancelled;
+	uint64_t					wait_ticks;
+	uint64_t					max_wait_ticks;
+	uint64_t					run_ticks;
+	uint64_t					max_run_ticks;
+};
+
+struct workqueue_struct {
+	char						name[WQ_NAME_SZ];
+	int							flags;
+	spinlock_t					lock;
+	unsigned int				max_active;
+	unsigned int				nr_active;
+	unsigned int				nr_in_flight;	/* active or inactive */
+	struct work_tailq			inactive;
+	struct rendez				done_rv;
+	struct wq_stats				stats;
+	TAILQ_ENTRY(workqueue_struct) link;
 };
 
 static inline struct delayed_work *to_delayed_work(struct work_struct *work)
@@ -60,19 +126,47 @@ static inline struct delayed_work *to_delayed_work(struct work_struct *work)
 	return container_of(work, struct delayed_work, work);
 }
 
-#define INIT_DELAYED_WORK(dwp, funcp) (dwp)->work.func = (funcp)
-#define INIT_WORK(wp, funcp) (wp)->func = (funcp)
+static inline void __init_work(struct work_struct *work,
+                               void (*func)(struct work_struct *))
+{
+	work->func = func;
+	work->flags = 0;
+	work->wq = NULL;
+	work->pool = NULL;
+	work->inactive = FALSE;
+}
+
+void __init_delayed_work(struct delayed_work *dwork,
+                         void (*func)(struct work_struct *));
+
+#define INIT_WORK(wp, funcp) __init_work(wp, funcp)
+#define INIT_DELAYED_WORK(dwp, funcp) __init_delayed_work(dwp, funcp)
+
+#define work_pending(wp) test_bit(WORK_STRUCT_PENDING_BIT, &(wp)->flags)
+#define delayed_work_pending(dwp) work_pending(&(dwp)->work)
+
+void workqueue_init(void);
+
+struct workqueue_struct *alloc_workqueue(const char *name, int flags,
+                                         int max_active);
+#define create_workqueue(name) alloc_workqueue(name, 0, 1)
+#define create_singlethread_workqueue(name) alloc_workqueue(name, WQ_UNBOUND, 1)
 void flush_workqueue(struct workqueue_struct *wq);
 void destroy_workqueue(struct workqueue_struct *wq);
-struct workqueue_struct *create_singlethread_workqueue(char *name);
 
-bool queue_work(struct workqueue_struct *wq, struct work_struct *dwork);
-bool schedule_work(struct work_struct *dwork);
-bool cancel_work(struct work_struct *dwork);
-bool cancel_work_sync(struct work_struct *dwork);
+bool queue_work_on(int coreid, struct workqueue_struct *wq,
+                   struct work_struct *work);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+bool schedule_work(struct work_struct *work);
+bool cancel_work(struct work_struct *work);
+bool cancel_work_sync(struct work_struct *work);
 
 bool queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
                         unsigned long delay);
 bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay);
 bool cancel_delayed_work(struct delayed_work *dwork);
 bool cancel_delayed_work_sync(struct delayed_work *dwork);
+
+/* For #kprof/wqstat */
+void wqstat_ctl(struct cmdbuf *cb);
+size_t wqstat_read(void *va, size_t n, off64_t offset);
@@ -43,7 +43,9 @@ static inline uint64_t sec2tsc(uint64_t sec)
 	return nsec2tsc(sec * NSEC_PER_SEC);
 }
 
+uint64_t tsc_to_epoch_nsec(uint64_t tsc);
 uint64_t epoch_nsec(void);
+void set_walltime(uint64_t epoch_ns);
 
 static inline struct timespec nsec2timespec(uint64_t ns)
 {
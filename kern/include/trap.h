@@ -9,6 +9,7 @@
 #include <arch/mmu.h>
 #include <sys/queue.h>
 #include <arch/trap.h>
+#include <core_set.h>
 
 // func ptr for interrupt service routines
 typedef void (*isr_t)(struct hw_trapframe *hw_tf, void *data);
@@ -16,6 +17,7 @@ typedef void (*isr_t)(struct hw_trapframe *hw_tf, void *data);
 void idt_init(void);
 int register_irq(int irq, isr_t handler, void *irq_arg, uint32_t tbdf);
 int route_irqs(int cpu_vec, int coreid);
+int irq_lookup_vector(isr_t handler, void *irq_arg);
 void print_trapframe(struct hw_trapframe *hw_tf);
 void print_swtrapframe(struct sw_trapframe *sw_tf);
 void print_vmtrapframe(struct vm_trapframe *vm_tf);
@@ -99,7 +101,7 @@ typedef void (*amr_t)(uint32_t srcid, long a0, long a1, long a2);
 
 struct kernel_message
 {
-	STAILQ_ENTRY(kernel_message) link;
+	struct kernel_message *next;
 	uint32_t srcid;
 	uint32_t dstid;
 	amr_t pc;
@@ -108,12 +110,42 @@ struct kernel_message
 	long arg2;
 }__attribute__((aligned(8)));
 
-STAILQ_HEAD(kernel_msg_list, kernel_message);
 typedef struct kernel_message kernel_message_t;
 
+/* Lock-free, multi-producer, single-consumer queue of kmsgs (Vyukov's intrusive
+ * MPSC queue).  Senders swap themselves in as the tail, then link the old tail
+ * to themselves, so each sender's kmsgs stay in order.  Only the destination
+ * core pops.  The stub keeps the queue from ever being empty, so that a push is
+ * just the swap.  The queue is empty when the stub is the tail. */
+struct kmsg_queue {
+	struct kernel_message		*head;
+	struct kernel_message		stub;
+	struct kernel_message		*tail __attribute__((aligned(ARCH_CL_SIZE)));
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+void kmsg_queue_init(struct kmsg_queue *q);
+
+static inline bool kmsg_queue_empty(struct kmsg_queue *q)
+{
+	return ACCESS_ONCE(q->tail) == &q->stub;
+}
+
 void kernel_msg_init(void);
 uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
                              long arg2, int type);
+
+/* For sending a burst of kmsgs: add them all, then flush, which sends each
+ * destination at most one IPI.  Either way, a core that already has a kmsg IPI
+ * on its way doesn't get another. */
+struct kmsg_batch {
+	struct core_set				dsts;
+};
+
+void kmsg_batch_init(struct kmsg_batch *kb);
+void kmsg_batch_add(struct kmsg_batch *kb, uint32_t dst, amr_t pc, long arg0,
+                    long arg1, long arg2, int type);
+void kmsg_batch_flush(struct kmsg_batch *kb);
+void print_kmsg_ipi_stats(void);
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data);
 bool has_routine_kmsg(void);
 void process_routine_kmsg(void);
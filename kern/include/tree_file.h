@@ -19,22 +19,27 @@ struct tree_filesystem;
 /* The walk cache encapsulates a couple things related to caching, similar to
  * the dentry cache in the VFS.
  * - the parent -> child links in a hash table
- * - the LRU list, consisting of all tree files with kref == 0
+ * - the LRU list, a CLOCK of tree files that have had kref == 0
  *
  * LRU notes.  Once a TF gets linked into a tree:
- * - a TF is on the LRU IFF its refcnt == 0
+ * - a TF with refcnt == 0 is on the LRU.  A TF on the LRU might be in use.
  * - a TF is on the LRU only if it is in the tree
  * - any time kref gets set to 0, we consider putting it on the LRU (if not
- *   DISCONNECTED / in the tree).  anytime it is increffed from 0, we yank it.
+ *   DISCONNECTED / in the tree).  Increffing from 0 does not touch the LRU; it
+ *   just sets HAS_BEEN_USED, the clock's reference bit.  The pruner yanks TFs
+ *   that are in use when it finds them.
  * - NEG entries are always kref == 0, and are on the LRU list if they are in
  *   the tree.  They are never increffed, only rcu-read.
  */
 struct walk_cache {
 	spinlock_t					lru_lock;
 	struct list_head			lru;
+	size_t						nr_lru;		/* protected by lru_lock */
+	size_t						nr_lru_neg;
 	spinlock_t					ht_lock;
 	struct hash_helper			hh;		/* parts are rcu-read */
 	struct hlist_head			*ht;
+	seq_ctr_t					ht_seq;		/* changes during resizes */
 	struct hlist_head			static_ht[HASH_INIT_SZ];
 };
 
@@ -82,6 +87,9 @@ struct tree_filesystem {
 	qlock_t						rename_mtx;
 	struct tree_file			*root;
 	void						*priv;
+	/* TFSs with a backend that can change behind our back can have negative
+	 * entries expire, so we'll ask the backend again.  0 = never expire. */
+	uint64_t					neg_ttl_nsec;
 };
 
 /* The tree_file is an fs_file (i.e. the first struct field) that exists in a
@@ -169,6 +177,7 @@ struct tree_file {
 	struct list_head			lru;
 	bool						can_have_children;
 	struct tree_filesystem		*tfs;
+	uint64_t					neg_expiry;		/* nsec(), if neg_ttl */
 };
 
 #define TF_F_DISCONNECTED		(1 << 0)
@@ -244,6 +253,9 @@ struct walkqid *tree_file_walk(struct tree_file *from, char **name,
 struct tree_file *tree_file_create(struct tree_file *parent, const char *name,
                                    uint32_t perm, char *ext);
 void tree_file_remove(struct tree_file *child);
+void tree_file_prime_child(struct tree_file *parent, const char *name,
+                           void (*prime)(struct tree_file *child, void *arg),
+                           void *arg);
 void tree_file_rename(struct tree_file *tf, struct tree_file *new_parent,
                       const char *name, int flags);
 ssize_t tree_file_readdir(struct tree_file *parent, void *ubuf, size_t n,
@@ -260,6 +272,7 @@ void tree_chan_remove(struct chan *c);
 void tree_chan_rename(struct chan *c, struct chan *new_p_c, const char *name,
                       int flags);
 size_t tree_chan_read(struct chan *c, void *ubuf, size_t n, off64_t offset);
+struct block *tree_chan_bread(struct chan *c, size_t n, off64_t offset);
 size_t tree_chan_write(struct chan *c, void *ubuf, size_t n, off64_t offset);
 size_t tree_chan_stat(struct chan *c, uint8_t *m_buf, size_t m_buf_sz);
 size_t tree_chan_wstat(struct chan *c, uint8_t *m_buf, size_t m_buf_sz);
@@ -276,6 +289,6 @@ void tfs_frontend_purge(struct tree_filesystem *tfs,
                         void (*cb)(struct tree_file *tf));
 void __tfs_dump(struct tree_filesystem *tfs);
 
-void tfs_lru_for_each(struct tree_filesystem *tfs, bool cb(struct tree_file *),
-                      size_t max_tfs);
-void tfs_lru_prune_neg(struct tree_filesystem *tfs);
+size_t tfs_lru_for_each(struct tree_filesystem *tfs,
+                        bool cb(struct tree_file *), size_t max_tfs);
+void tfs_lru_prune_neg(struct tree_filesystem *tfs, size_t max_tfs);
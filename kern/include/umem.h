@@ -9,6 +9,7 @@
 
 #include <ros/common.h>
 #include <process.h>
+#include <sys/uio.h>
 
 /* Is this a valid user pointer for read/write?  It doesn't care if the address
  * is paged out or even an unmapped region: simply if it is in part of the
@@ -52,6 +53,14 @@ int memcpy_from_user(struct proc *p, void *dest, const void *va, size_t len);
  */
 int memcpy_to_user(struct proc *p, void *dest, const void *src, size_t len);
 
+/* Batched versions for iovec arrays: the iovecs are in the kernel, their
+ * buffers in the user.  memcpy_to_user_iov() fills the iovecs in order with len
+ * bytes of src.  Same return values as above. */
+int memcpy_from_user_iov(struct proc *p, void *dst, const struct iovec *iov,
+                         int iovcnt);
+int memcpy_to_user_iov(struct proc *p, const struct iovec *iov, int iovcnt,
+                       const void *src, size_t len);
+
 /* Same as above, but sets errno */
 int memcpy_from_user_errno(struct proc *p, void *dst, const void *src, int len);
 int memcpy_to_user_errno(struct proc *p, void *dst, const void *src, int len);
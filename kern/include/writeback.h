@@ -0,0 +1,78 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Writeback engine: per-filesystem flusher ktasks that write back many files
+ * at once.
+ *
+ * A filesystem has a wb_domain, and each of its files has a wb_file.  Writers
+ * tell the domain how much they dirtied with wb_mark_dirty(), which queues the
+ * file, oldest first.  The flushers write back a file once its oldest dirty
+ * data is older than WB_EXPIRE_NSEC, or right away when the domain has more
+ * than bg_thresh dirty.  Writers that push the domain past dirty_limit sleep
+ * until the flushers catch up (or WB_THROTTLE_USEC passes), instead of doing
+ * the writeback themselves.
+ *
+ * wb_sync() hands everything queued to the flushers and waits, so a sync of
+ * the whole FS writes back nr_flushers files at a time.  Queue files that
+ * weren't dirtied by write (e.g. mmaps) with wb_queue_file() first. */
+
+#pragma once
+
+#include <sys/queue.h>
+#include <atomic.h>
+#include <rendez.h>
+
+#define WB_NR_FLUSHERS			4
+#define WB_EXPIRE_NSEC			(5ULL * 1000000000)
+#define WB_PERIOD_USEC			(1000 * 1000)
+#define WB_THROTTLE_USEC		(100 * 1000)
+
+struct wb_file;
+
+struct wb_ops {
+	/* Writes back the file.  Can throw. */
+	void (*writeback)(struct wb_file *wf);
+	/* A queued file holds a ref.  get can fail if the file is going away. */
+	bool (*get)(struct wb_file *wf);
+	void (*put)(struct wb_file *wf);
+};
+
+struct wb_file {
+	TAILQ_ENTRY(wb_file)		link;
+	bool						queued;
+	bool						on_sync;
+	uint64_t					dirtied_at;		/* tsc, when queued */
+	size_t						nr_dirty;		/* bytes since queued */
+};
+TAILQ_HEAD(wb_file_tailq, wb_file);
+
+struct wb_domain {
+	char						*name;
+	struct wb_ops				*ops;
+	spinlock_t					lock;
+	struct wb_file_tailq		dirty;			/* oldest first */
+	struct wb_file_tailq		sync;
+	/* Bytes queued or being written back */
+	size_t						nr_dirty;
+	size_t						bg_thresh;
+	size_t						dirty_limit;
+	unsigned int				nr_sync_left;	/* on sync or in flight */
+	unsigned long				nr_sync_errors;
+	unsigned int				nr_flushers;
+	bool						dying;
+	struct rendez				rv_flush;
+	struct rendez				rv_throttle;
+	struct rendez				rv_sync;
+	struct rendez				rv_exit;
+	/* Stats, racy */
+	unsigned long				nr_written;
+	unsigned long				nr_throttled;
+};
+
+void wb_domain_init(struct wb_domain *d, char *name, struct wb_ops *ops,
+                    unsigned int nr_flushers);
+void wb_domain_destroy(struct wb_domain *d);
+void wb_file_init(struct wb_file *wf);
+void wb_mark_dirty(struct wb_domain *d, struct wb_file *wf, size_t amt);
+void wb_queue_file(struct wb_domain *d, struct wb_file *wf);
+unsigned long wb_sync(struct wb_domain *d);
@@ -0,0 +1,34 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Pools of pre-zeroed pages, one per NUMA node (or just one, without NUMA).
+ *
+ * Page faults on anonymous memory need zeroed pages, and zeroing a page on the
+ * fault path is a good chunk of the fault.  Idle cores zero pages ahead of time
+ * and stash them here; zeroed allocations (upage_alloc(..., TRUE),
+ * kpage_zalloc_addr(), populating anon VMRs) take from the pool first and only
+ * zero pages themselves when it's empty.
+ *
+ * Pages are zeroed with non-temporal stores, so the idle core doesn't fill its
+ * cache with zeros that someone else will use.
+ *
+ * The pools give their pages back when kmem reclaim runs, and don't refill while
+ * a node is low on memory.  #kprof/zpool has their stats, and you can turn them
+ * off to compare: zero-page in #kprof/latency is the time to get a zeroed page
+ * for a fault. */
+
+#pragma once
+
+#include <ros/common.h>
+
+struct cmdbuf;
+
+void zpool_init(void);
+void *zpool_get(unsigned long nodes, int pref);
+size_t zpool_get_batch(unsigned long nodes, int pref, void **addrs, size_t nr);
+bool zpool_idle_refill(void);
+size_t zpool_drain(void);
+
+/* For #kprof/zpool */
+void zpool_ctl(struct cmdbuf *cb);
+size_t zpool_read(void *va, size_t n, off64_t offset);
@@ -0,0 +1,129 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Compressed page store, a la zswap.
+ *
+ * FSs without a backing store (#tmpfs) can't give their page cache back under
+ * memory pressure; there's nowhere to write the pages.  The store is that
+ * somewhere: the FS's writepage compresses the page into the store, and its
+ * readpage decompresses it on the next use.  Pages that are all one word (e.g.
+ * zeros) are just remembered, not compressed.
+ *
+ * The compressed data lives in the zstore arena, which imports from
+ * kpages_arena, so it shows up in #mem/arenastats.
+ *
+ * Each file gets a zstore_map, which maps page indexes to stored pages.  Loads
+ * are exclusive: once a page comes back, the store forgets it, and the FS needs
+ * to mark the page dirty so that the next writepage stores it again.  Pages
+ * that don't compress to ZSTORE_MAX_LEN or less get rejected, and stay in
+ * memory.
+ *
+ * Eviction is driven by kmem reclaim: when the base arenas are low, reclaim
+ * pokes the store's ktask, which asks each registered evictor (e.g. a #tmpfs
+ * instance) to push its cold pages out with pm_evict_cold_pages().
+ *
+ * #kprof/zstore has the stats, and you can turn the store off. */
+
+#pragma once
+
+#include <ros/common.h>
+#include <sys/queue.h>
+#include <kthread.h>
+#include <radix.h>
+#include <err.h>
+
+struct cmdbuf;
+
+struct zstore_map {
+	qlock_t						qlock;
+	struct radix_tree			tree;
+	unsigned long				nr_pages;
+};
+
+/* Returns how many pages it freed.  Called from the store's ktask, so it can
+ * block. */
+struct zstore_evictor {
+	size_t (*evict)(struct zstore_evictor *ze);
+	TAILQ_ENTRY(zstore_evictor)	link;
+};
+TAILQ_HEAD(zstore_evictor_tailq, zstore_evictor);
+
+#ifdef CONFIG_TMPFS_ZSTORE
+
+void zstore_init(void);
+void zstore_reclaim_poke(void);
+void zstore_register_evictor(struct zstore_evictor *ze);
+void zstore_unregister_evictor(struct zstore_evictor *ze);
+
+struct zstore_map *zstore_map_alloc(int flags);
+void zstore_map_free(struct zstore_map *zm);
+bool zstore_is_on(void);
+int zstore_store(struct zstore_map *zm, unsigned long index, void *kva);
+bool zstore_load(struct zstore_map *zm, unsigned long index, void *kva);
+void zstore_drop_range(struct zstore_map *zm, unsigned long index,
+                       unsigned long nr);
+
+/* For #kprof/zstore */
+void zstore_ctl(struct cmdbuf *cb);
+size_t zstore_read(void *va, size_t n, off64_t offset);
+
+#else
+
+static inline void zstore_init(void)
+{
+}
+
+static inline void zstore_reclaim_poke(void)
+{
+}
+
+static inline void zstore_register_evictor(struct zstore_evictor *ze)
+{
+}
+
+static inline void zstore_unregister_evictor(struct zstore_evictor *ze)
+{
+}
+
+static inline struct zstore_map *zstore_map_alloc(int flags)
+{
+	return NULL;
+}
+
+static inline void zstore_map_free(struct zstore_map *zm)
+{
+}
+
+static inline bool zstore_is_on(void)
+{
+	return FALSE;
+}
+
+static inline int zstore_store(struct zstore_map *zm, unsigned long index,
+                               void *kva)
+{
+	return -EOPNOTSUPP;
+}
+
+static inline bool zstore_load(struct zstore_map *zm, unsigned long index,
+                               void *kva)
+{
+	return FALSE;
+}
+
+static inline void zstore_drop_range(struct zstore_map *zm, unsigned long index,
+                                     unsigned long nr)
+{
+}
+
+static inline void zstore_ctl(struct cmdbuf *cb)
+{
+	error(EOPNOTSUPP, "zstore is not built in");
+}
+
+static inline size_t zstore_read(void *va, size_t n, off64_t offset)
+{
+	return 0;
+}
+
+#endif /* CONFIG_TMPFS_ZSTORE */
@@ -0,0 +1,464 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * AES-GCM, see aes_gcm.h.
+ *
+ * GCM is CTR mode plus GHASH, a polynomial MAC over GF(2^128), of the AAD and
+ * the ciphertext.  The counter starts at J0 = IV || 1; J0 encrypts the tag and
+ * the data starts at J0 + 1.
+ *
+ * The AES-NI path follows Intel's white paper (Gueron and Kounavis, "Intel
+ * Carry-Less Multiplication Instruction and its Usage for Computing the GCM
+ * Mode"): we keep GHASH state byte-reflected, so that PCLMULQDQ's bit order
+ * works out, and do the reduction with shifts.  The kernel is built without
+ * SSE, so those functions ask for it with a target attribute, and the callers
+ * save the XMM registers around them, since they belong to whoever was running
+ * in userspace.  Legacy SSE instructions don't touch the upper halves of the
+ * YMM/ZMM registers, so the XMMs are all we need to save. */
+
+#include <aes_gcm.h>
+#include <string.h>
+#include <error.h>
+#include <arch/arch.h>
+
+#ifdef CONFIG_X86
+#include <cpu_feat.h>
+#endif
+
+static void be64_store(uint8_t *p, uint64_t x)
+{
+	for (int i = 7; i >= 0; i--, x >>= 8)
+		p[i] = x;
+}
+
+static uint64_t be64_load(const uint8_t *p)
+{
+	uint64_t x = 0;
+
+	for (int i = 0; i < 8; i++)
+		x = (x << 8) | p[i];
+	return x;
+}
+
+/* Compares tags without bailing out early, so a forger can't time it. */
+static bool tag_equal(const uint8_t *a, const uint8_t *b)
+{
+	uint8_t diff = 0;
+
+	for (int i = 0; i < AES_GCM_TAG_LEN; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
+/* Software: x = x * h in GF(2^128), bit by bit (SP 800-38D, algorithm 1). */
+static void gf128_mul(uint8_t *x, const uint8_t *h)
+{
+	uint64_t zh = 0, zl = 0;
+	uint64_t vh = be64_load(h), vl = be64_load(h + 8);
+	uint64_t xh = be64_load(x), xl = be64_load(x + 8);
+	uint64_t bit, lsb;
+
+	for (int i = 0; i < 128; i++) {
+		bit = i < 64 ? xh >> (63 - i) : xl >> (127 - i);
+		if (bit & 1) {
+			zh ^= vh;
+			zl ^= vl;
+		}
+		lsb = vl & 1;
+		vl = (vl >> 1) | (vh << 63);
+		vh >>= 1;
+		if (lsb)
+			vh ^= 0xe100000000000000ULL;
+	}
+	be64_store(x, zh);
+	be64_store(x + 8, zl);
+}
+
+static void ghash_sw(const uint8_t *h, uint8_t *x, const uint8_t *p, size_t len)
+{
+	size_t amt;
+
+	while (len) {
+		amt = MIN(len, 16);
+		for (int i = 0; i < amt; i++)
+			x[i] ^= p[i];
+		gf128_mul(x, h);
+		p += amt;
+		len -= amt;
+	}
+}
+
+static void ctr_inc(uint8_t *ctr)
+{
+	for (int i = 15; i >= 12; i--) {
+		if (++ctr[i])
+			break;
+	}
+}
+
+/* CTR over buf, starting at ctr + 1.  Hashes the ciphertext into x, before we
+ * decrypt or after we encrypt. */
+static void gcm_ctr_sw(struct aes_gcm_ctx *ctx, uint8_t *ctr, uint8_t *x,
+                       uint8_t *buf, size_t len, bool enc)
+{
+	uint8_t ks[16];
+	size_t amt;
+
+	while (len) {
+		amt = MIN(len, 16);
+		ctr_inc(ctr);
+		memcpy(ks, ctr, 16);
+		aes_ecb_encrypt(&ctx->sw, ks, 16);
+		if (!enc)
+			ghash_sw(ctx->h, x, buf, amt);
+		for (int i = 0; i < amt; i++)
+			buf[i] ^= ks[i];
+		if (enc)
+			ghash_sw(ctx->h, x, buf, amt);
+		buf += amt;
+		len -= amt;
+	}
+}
+
+static void gcm_sw(struct aes_gcm_ctx *ctx, const uint8_t *iv,
+                   const uint8_t *aad, size_t aad_len, uint8_t *buf,
+                   size_t len, uint8_t *tag, bool enc)
+{
+	uint8_t j0[16], ctr[16], x[16] = {0}, lens[16];
+
+	memcpy(j0, iv, AES_GCM_IV_LEN);
+	j0[12] = j0[13] = j0[14] = 0;
+	j0[15] = 1;
+	memcpy(ctr, j0, 16);
+	ghash_sw(ctx->h, x, aad, aad_len);
+	gcm_ctr_sw(ctx, ctr, x, buf, len, enc);
+	be64_store(lens, (uint64_t)aad_len * 8);
+	be64_store(lens + 8, (uint64_t)len * 8);
+	ghash_sw(ctx->h, x, lens, 16);
+	aes_ecb_encrypt(&ctx->sw, j0, 16);
+	for (int i = 0; i < 16; i++)
+		tag[i] = x[i] ^ j0[i];
+}
+
+#ifdef CONFIG_X86
+
+typedef long long v2di __attribute__((vector_size(16)));
+typedef int v4si __attribute__((vector_size(16)));
+typedef char v16qi __attribute__((vector_size(16)));
+
+#define AESNI __attribute__((target("sse2,ssse3,aes,pclmul")))
+
+struct xmm_save {
+	uint8_t						regs[16][16];
+	int8_t						irq_state;
+};
+
+/* No interrupts while we hold the XMMs: an IRQ could save the user's FP state,
+ * e.g. for a preemption, and it would get ours. */
+static void xmm_begin(struct xmm_save *s)
+{
+	s->irq_state = 0;
+	disable_irqsave(&s->irq_state);
+	asm volatile("movdqu %%xmm0,  0x00(%0);  movdqu %%xmm1,  0x10(%0);"
+	             "movdqu %%xmm2,  0x20(%0);  movdqu %%xmm3,  0x30(%0);"
+	             "movdqu %%xmm4,  0x40(%0);  movdqu %%xmm5,  0x50(%0);"
+	             "movdqu %%xmm6,  0x60(%0);  movdqu %%xmm7,  0x70(%0);"
+	             "movdqu %%xmm8,  0x80(%0);  movdqu %%xmm9,  0x90(%0);"
+	             "movdqu %%xmm10, 0xa0(%0);  movdqu %%xmm11, 0xb0(%0);"
+	             "movdqu %%xmm12, 0xc0(%0);  movdqu %%xmm13, 0xd0(%0);"
+	             "movdqu %%xmm14, 0xe0(%0);  movdqu %%xmm15, 0xf0(%0);"
+	             : : "r"(s->regs) : "memory");
+}
+
+static void xmm_end(struct xmm_save *s)
+{
+	asm volatile("movdqu 0x00(%0), %%xmm0;  movdqu 0x10(%0), %%xmm1;"
+	             "movdqu 0x20(%0), %%xmm2;  movdqu 0x30(%0), %%xmm3;"
+	             "movdqu 0x40(%0), %%xmm4;  movdqu 0x50(%0), %%xmm5;"
+	             "movdqu 0x60(%0), %%xmm6;  movdqu 0x70(%0), %%xmm7;"
+	             "movdqu 0x80(%0), %%xmm8;  movdqu 0x90(%0), %%xmm9;"
+	             "movdqu 0xa0(%0), %%xmm10; movdqu 0xb0(%0), %%xmm11;"
+	             "movdqu 0xc0(%0), %%xmm12; movdqu 0xd0(%0), %%xmm13;"
+	             "movdqu 0xe0(%0), %%xmm14; movdqu 0xf0(%0), %%xmm15;"
+	             : : "r"(s->regs) : "memory");
+	enable_irqsave(&s->irq_state);
+}
+
+static inline AESNI v2di ni_load(const void *p)
+{
+	return (v2di)__builtin_ia32_loaddqu(p);
+}
+
+static inline AESNI void ni_store(void *p, v2di x)
+{
+	__builtin_ia32_storedqu(p, (v16qi)x);
+}
+
+static inline AESNI v2di ni_bswap(v2di x)
+{
+	const v16qi mask = {15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0};
+
+	return (v2di)__builtin_ia32_pshufb128((v16qi)x, mask);
+}
+
+/* Expands the previous round key a with the keygenassist output b. */
+static inline AESNI v2di ni_expand(v2di a, v2di b)
+{
+	a ^= __builtin_ia32_pslldqi128(a, 32);
+	a ^= __builtin_ia32_pslldqi128(a, 64);
+	return a ^ b;
+}
+
+#define NI_ASSIST(x, rcon, sel) \
+	((v2di)__builtin_ia32_pshufd((v4si)__builtin_ia32_aeskeygenassist128(x, \
+	                                                                   rcon), \
+	                             sel))
+
+#define NI_KEY128(i, rcon)                                                     \
+	k[i] = ni_expand(k[i - 1], NI_ASSIST(k[i - 1], rcon, 0xff))
+
+#define NI_KEY256(i, rcon)                                                     \
+do {                                                                           \
+	k[i] = ni_expand(k[i - 2], NI_ASSIST(k[i - 1], rcon, 0xff));               \
+	if (i + 1 < 15)                                                            \
+		k[i + 1] = ni_expand(k[i - 1], NI_ASSIST(k[i], 0, 0xaa));              \
+} while (0)
+
+static AESNI __attribute__((__noinline__))
+void ni_setkey(struct aes_gcm_ctx *ctx, const uint8_t *key)
+{
+	v2di k[15];
+
+	k[0] = ni_load(key);
+	if (ctx->nr_rounds == 10) {
+		NI_KEY128(1, 0x01);
+		NI_KEY128(2, 0x02);
+		NI_KEY128(3, 0x04);
+		NI_KEY128(4, 0x08);
+		NI_KEY128(5, 0x10);
+		NI_KEY128(6, 0x20);
+		NI_KEY128(7, 0x40);
+		NI_KEY128(8, 0x80);
+		NI_KEY128(9, 0x1b);
+		NI_KEY128(10, 0x36);
+	} else {
+		k[1] = ni_load(key + 16);
+		NI_KEY256(2, 0x01);
+		NI_KEY256(4, 0x02);
+		NI_KEY256(6, 0x04);
+		NI_KEY256(8, 0x08);
+		NI_KEY256(10, 0x10);
+		NI_KEY256(12, 0x20);
+		NI_KEY256(14, 0x40);
+	}
+	for (int i = 0; i <= ctx->nr_rounds; i++)
+		ni_store(ctx->rk[i], k[i]);
+}
+
+static inline AESNI v2di ni_aes(const v2di *rk, int nr, v2di x)
+{
+	x ^= rk[0];
+	for (int i = 1; i < nr; i++)
+		x = __builtin_ia32_aesenc128(x, rk[i]);
+	return __builtin_ia32_aesenclast128(x, rk[nr]);
+}
+
+/* Four blocks at once, so the AES units stay busy. */
+static inline AESNI void ni_aes4(const v2di *rk, int nr, v2di *x)
+{
+	for (int j = 0; j < 4; j++)
+		x[j] ^= rk[0];
+	for (int i = 1; i < nr; i++) {
+		for (int j = 0; j < 4; j++)
+			x[j] = __builtin_ia32_aesenc128(x[j], rk[i]);
+	}
+	for (int j = 0; j < 4; j++)
+		x[j] = __builtin_ia32_aesenclast128(x[j], rk[nr]);
+}
+
+/* a * b in GF(2^128), both byte-reflected.  This is the white paper's gfmul:
+ * a schoolbook carry-less multiply, a shift left by one (reflection leaves the
+ * product off by one bit), and the reduction. */
+static inline AESNI v2di ni_gfmul(v2di a, v2di b)
+{
+	v2di lo, mid, hi, t7, t8, t9;
+
+	lo = __builtin_ia32_pclmulqdq128(a, b, 0x00);
+	mid = __builtin_ia32_pclmulqdq128(a, b, 0x10) ^
+	      __builtin_ia32_pclmulqdq128(a, b, 0x01);
+	hi = __builtin_ia32_pclmulqdq128(a, b, 0x11);
+	lo ^= __builtin_ia32_pslldqi128(mid, 64);
+	hi ^= __builtin_ia32_psrldqi128(mid, 64);
+
+	t7 = (v2di)__builtin_ia32_psrldi128((v4si)lo, 31);
+	t8 = (v2di)__builtin_ia32_psrldi128((v4si)hi, 31);
+	lo = (v2di)__builtin_ia32_pslldi128((v4si)lo, 1);
+	hi = (v2di)__builtin_ia32_pslldi128((v4si)hi, 1);
+	t9 = __builtin_ia32_psrldqi128(t7, 96);
+	t8 = __builtin_ia32_pslldqi128(t8, 32);
+	t7 = __builtin_ia32_pslldqi128(t7, 32);
+	lo |= t7;
+	hi |= t8 | t9;
+
+	t7 = (v2di)__builtin_ia32_pslldi128((v4si)lo, 31) ^
+	     (v2di)__builtin_ia32_pslldi128((v4si)lo, 30) ^
+	     (v2di)__builtin_ia32_pslldi128((v4si)lo, 25);
+	t8 = __builtin_ia32_psrldqi128(t7, 32);
+	t7 = __builtin_ia32_pslldqi128(t7, 96);
+	lo ^= t7;
+	t9 = (v2di)__builtin_ia32_psrldi128((v4si)lo, 1) ^
+	     (v2di)__builtin_ia32_psrldi128((v4si)lo, 2) ^
+	     (v2di)__builtin_ia32_psrldi128((v4si)lo, 7) ^ t8;
+	lo ^= t9;
+	return hi ^ lo;
+}
+
+/* Loads up to 16 bytes, zero padded. */
+static inline AESNI v2di ni_load_partial(const uint8_t *p, size_t len)
+{
+	uint8_t tmp[16] = {0};
+
+	memcpy(tmp, p, len);
+	return ni_load(tmp);
+}
+
+static inline AESNI v2di ni_ghash(v2di x, v2di h, const uint8_t *p,
+                                  size_t len)
+{
+	for (; len >= 16; p += 16, len -= 16)
+		x = ni_gfmul(x ^ ni_bswap(ni_load(p)), h);
+	if (len)
+		x = ni_gfmul(x ^ ni_bswap(ni_load_partial(p, len)), h);
+	return x;
+}
+
+static AESNI __attribute__((__noinline__))
+void gcm_ni(struct aes_gcm_ctx *ctx, const uint8_t *iv, const uint8_t *aad,
+            size_t aad_len, uint8_t *buf, size_t len, uint8_t *tag, bool enc)
+{
+	const v4si one = {1, 0, 0, 0};
+	v2di rk[15], h, x = {0, 0}, j0, ctr, ks[4], d;
+	int nr = ctx->nr_rounds;
+	size_t total = len;
+	uint8_t tmp[16];
+
+	for (int i = 0; i <= nr; i++)
+		rk[i] = ni_load(ctx->rk[i]);
+	h = ni_bswap(ni_load(ctx->h));
+	memcpy(tmp, iv, AES_GCM_IV_LEN);
+	tmp[12] = tmp[13] = tmp[14] = 0;
+	tmp[15] = 1;
+	j0 = ni_load(tmp);
+	/* Reflected, so the big-endian low word of the counter is lane 0. */
+	ctr = ni_bswap(j0);
+
+	x = ni_ghash(x, h, aad, aad_len);
+	for (; len >= 64; buf += 64, len -= 64) {
+		for (int j = 0; j < 4; j++) {
+			ctr = (v2di)((v4si)ctr + one);
+			ks[j] = ni_bswap(ctr);
+		}
+		ni_aes4(rk, nr, ks);
+		for (int j = 0; j < 4; j++) {
+			d = ni_load(buf + j * 16);
+			if (!enc)
+				x = ni_gfmul(x ^ ni_bswap(d), h);
+			d ^= ks[j];
+			if (enc)
+				x = ni_gfmul(x ^ ni_bswap(d), h);
+			ni_store(buf + j * 16, d);
+		}
+	}
+	for (; len; buf += 16, len -= MIN(len, 16)) {
+		ctr = (v2di)((v4si)ctr + one);
+		ks[0] = ni_aes(rk, nr, ni_bswap(ctr));
+		if (len >= 16) {
+			d = ni_load(buf);
+			if (!enc)
+				x = ni_gfmul(x ^ ni_bswap(d), h);
+			d ^= ks[0];
+			if (enc)
+				x = ni_gfmul(x ^ ni_bswap(d), h);
+			ni_store(buf, d);
+			continue;
+		}
+		/* The last, partial block.  Only its len bytes get hashed. */
+		d = ni_load_partial(buf, len);
+		if (!enc)
+			x = ni_gfmul(x ^ ni_bswap(d), h);
+		ni_store(tmp, d ^ ks[0]);
+		memset(tmp + len, 0, 16 - len);
+		if (enc)
+			x = ni_gfmul(x ^ ni_bswap(ni_load(tmp)), h);
+		memcpy(buf, tmp, len);
+		break;
+	}
+	be64_store(tmp, (uint64_t)aad_len * 8);
+	be64_store(tmp + 8, (uint64_t)total * 8);
+	x = ni_gfmul(x ^ ni_bswap(ni_load(tmp)), h);
+	ni_store(tag, ni_bswap(x) ^ ni_aes(rk, nr, j0));
+}
+
+#endif /* CONFIG_X86 */
+
+/* Returns -1 if len isn't a 128 or 256 bit key. */
+int aes_gcm_setkey(struct aes_gcm_ctx *ctx, const uint8_t *key, size_t len)
+{
+	if (len != 16 && len != 32)
+		return -1;
+	memset(ctx, 0, sizeof(struct aes_gcm_ctx));
+	ctx->nr_rounds = len == 16 ? 10 : 14;
+	aes_set_key(&ctx->sw, key, len * 8, 1);
+	aes_ecb_encrypt(&ctx->sw, ctx->h, 16);
+#ifdef CONFIG_X86
+	if (cpu_has_feat(CPU_FEAT_X86_AESNI) && cpu_has_feat(CPU_FEAT_X86_PCLMUL)
+	    && cpu_has_feat(CPU_FEAT_X86_SSSE3)) {
+		struct xmm_save s;
+
+		xmm_begin(&s);
+		ni_setkey(ctx, key);
+		xmm_end(&s);
+		ctx->ni = TRUE;
+	}
+#endif
+	return 0;
+}
+
+static void gcm(struct aes_gcm_ctx *ctx, const uint8_t *iv, const uint8_t *aad,
+                size_t aad_len, uint8_t *buf, size_t len, uint8_t *tag,
+                bool enc)
+{
+#ifdef CONFIG_X86
+	if (ctx->ni) {
+		struct xmm_save s;
+
+		xmm_begin(&s);
+		gcm_ni(ctx, iv, aad, aad_len, buf, len, tag, enc);
+		xmm_end(&s);
+		return;
+	}
+#endif
+	gcm_sw(ctx, iv, aad, aad_len, buf, len, tag, enc);
+}
+
+void aes_gcm_encrypt(struct aes_gcm_ctx *ctx, const uint8_t *iv,
+                     const uint8_t *aad, size_t aad_len, uint8_t *buf,
+                     size_t len, uint8_t *tag)
+{
+	gcm(ctx, iv, aad, aad_len, buf, len, tag, TRUE);
+}
+
+/* Returns FALSE if the tag doesn't match, in which case buf is zeroed. */
+bool aes_gcm_decrypt(struct aes_gcm_ctx *ctx, const uint8_t *iv,
+                     const uint8_t *aad, size_t aad_len, uint8_t *buf,
+                     size_t len, const uint8_t *tag)
+{
+	uint8_t computed[AES_GCM_TAG_LEN];
+
+	gcm(ctx, iv, aad, aad_len, buf, len, computed, FALSE);
+	if (!tag_equal(computed, tag)) {
+		memset(buf, 0, len);
+		return FALSE;
+	}
+	return TRUE;
+}
@@ -19,28 +19,133 @@
 #include <stdio.h>
 #include <smp.h>
 #include <kmalloc.h>
+#include <latency.h>
 
-/* Helper, resets the earliest/latest times, based on the elements of the list.
- * If the list is empty, we set the times to be the 12345 poison time.  Since
- * the list is empty, the alarm shouldn't be going off. */
+/* The width of a slot in level, as a shift */
+static unsigned int tchain_shift(int level)
+{
+	return TCHAIN_SHIFT_0 + level * TCHAIN_SLOT_BITS;
+}
+
+/* The latest the waiter may fire, which is what the wheel sorts by */
+static uint64_t awaiter_deadline(struct alarm_waiter *waiter)
+{
+	uint64_t deadline = waiter->wake_up_time + waiter->slack;
+
+	return deadline < waiter->wake_up_time ? UINT64_MAX : deadline;
+}
+
+static uint64_t tchain_slot_start(struct timer_chain *tchain, int level,
+                                  unsigned int idx)
+{
+	unsigned int shift = tchain_shift(level + 1);
+
+	return ((tchain->base >> shift) << shift) |
+	       ((uint64_t)idx << tchain_shift(level));
+}
+
+/* Files the waiter in the wheel, in the lowest level whose window around base
+ * has the waiter's deadline in it.  Deadlines from the past go in base's level
+ * 0 slot. */
+static void __tchain_add(struct timer_chain *tchain,
+                         struct alarm_waiter *waiter)
+{
+	uint64_t time = MAX(awaiter_deadline(waiter), tchain->base);
+	uint64_t diff = time ^ tchain->base;
+	int level = 0;
+	unsigned int idx;
+
+	if (diff >> TCHAIN_SHIFT_0)
+		level = (LOG2_DOWN(diff) - TCHAIN_SHIFT_0) / TCHAIN_SLOT_BITS;
+	if (level >= TCHAIN_NR_LEVELS) {
+		waiter->slot = &tchain->far;
+	} else {
+		idx = (time >> tchain_shift(level)) % TCHAIN_NR_SLOTS;
+		waiter->slot = &tchain->slots[level][idx];
+		tchain->slot_map[level] |= 1ULL << idx;
+	}
+	BSD_LIST_INSERT_HEAD(waiter->slot, waiter, next);
+}
+
+static void __tchain_del(struct timer_chain *tchain,
+                         struct alarm_waiter *waiter)
+{
+	struct awaiter_list *slot = waiter->slot;
+	size_t off;
+
+	BSD_LIST_REMOVE(waiter, next);
+	waiter->slot = NULL;
+	if (slot == &tchain->far || slot == &tchain->expired ||
+	    !BSD_LIST_EMPTY(slot))
+		return;
+	off = slot - &tchain->slots[0][0];
+	tchain->slot_map[off / TCHAIN_NR_SLOTS] &=
+	        ~(1ULL << (off % TCHAIN_NR_SLOTS));
+}
+
+/* Returns the slot with the earliest waiter, or 0 if the wheel is empty.  A
+ * level's waiters are all within base's slot of the next level up, so they are
+ * earlier than anything in the levels above it. */
+static struct awaiter_list *tchain_first_slot(struct timer_chain *tchain,
+                                              int *level_p)
+{
+	for (int i = 0; i < TCHAIN_NR_LEVELS; i++) {
+		if (tchain->slot_map[i]) {
+			*level_p = i;
+			return &tchain->slots[i][__builtin_ctzll(tchain->slot_map[i])];
+		}
+	}
+	*level_p = TCHAIN_NR_LEVELS;
+	return BSD_LIST_EMPTY(&tchain->far) ? NULL : &tchain->far;
+}
+
+static uint64_t slot_min_time(struct awaiter_list *slot)
+{
+	struct alarm_waiter *i;
+	uint64_t ret = UINT64_MAX;
+
+	BSD_LIST_FOREACH(i, slot, next)
+		ret = MIN(ret, awaiter_deadline(i));
+	return ret;
+}
+
+/* Helper, resets the earliest time, based on the elements of the wheel.  If the
+ * wheel is empty, we set the time to be the 12345 poison time.  Since the wheel
+ * is empty, the alarm shouldn't be going off. */
 static void reset_tchain_times(struct timer_chain *tchain)
 {
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = ALARM_POISON_TIME;
-		tchain->latest_time = ALARM_POISON_TIME;
+	struct awaiter_list *slot;
+	int level;
+
+	slot = tchain_first_slot(tchain, &level);
+	if (slot) {
+		tchain->earliest_time = slot_min_time(slot);
 	} else {
-		tchain->earliest_time = TAILQ_FIRST(&tchain->waiters)->wake_up_time;
-		tchain->latest_time =
-		        TAILQ_LAST(&tchain->waiters, awaiters_tailq)->wake_up_time;
+		tchain->earliest_time = ALARM_POISON_TIME;
+		tchain->max_slack = 0;
 	}
 }
 
+static bool tchain_is_empty(struct timer_chain *tchain)
+{
+	return tchain->earliest_time == ALARM_POISON_TIME;
+}
+
 /* One time set up of a tchain, currently called in per_cpu_init() */
 void init_timer_chain(struct timer_chain *tchain,
                       void (*set_interrupt)(struct timer_chain *))
 {
 	spinlock_init_irqsave(&tchain->lock);
-	TAILQ_INIT(&tchain->waiters);
+	tchain->nr_waiters = 0;
+	tchain->base = read_tsc();
+	tchain->max_slack = 0;
+	for (int i = 0; i < TCHAIN_NR_LEVELS; i++) {
+		tchain->slot_map[i] = 0;
+		for (int j = 0; j < TCHAIN_NR_SLOTS; j++)
+			BSD_LIST_INIT(&tchain->slots[i][j]);
+	}
+	BSD_LIST_INIT(&tchain->far);
+	BSD_LIST_INIT(&tchain->expired);
 	tchain->set_interrupt = set_interrupt;
 	reset_tchain_times(tchain);
 }
@@ -48,6 +153,7 @@ void init_timer_chain(struct timer_chain *tchain,
 static void __init_awaiter(struct alarm_waiter *waiter)
 {
 	waiter->wake_up_time = ALARM_POISON_TIME;
+	waiter->slack = 0;
 	waiter->on_tchain = FALSE;
 	waiter->holds_tchain_lock = FALSE;
 }
@@ -101,12 +207,19 @@ void set_awaiter_inc(struct alarm_waiter *waiter, uint64_t usleep)
 	waiter->wake_up_time += usec2tsc(usleep);
 }
 
+/* Don't change this while the alarm is set. */
+void set_awaiter_slack(struct alarm_waiter *waiter, uint64_t usec)
+{
+	assert(!waiter->on_tchain);
+	waiter->slack = usec2tsc(usec);
+}
+
 /* Helper, makes sure the interrupt is turned on at the right time.  Most of the
  * heavy lifting is in the timer-source specific function pointer. */
 static void reset_tchain_interrupt(struct timer_chain *tchain)
 {
 	assert(!irq_is_enabled());
-	if (TAILQ_EMPTY(&tchain->waiters)) {
+	if (tchain_is_empty(tchain)) {
 		/* Turn it off */
 		printd("Turning alarm off\n");
 		tchain->set_interrupt(tchain);
@@ -150,11 +263,91 @@ static void wake_awaiter(struct alarm_waiter *waiter,
 	}
 }
 
+static void __tchain_expire(struct timer_chain *tchain,
+                            struct alarm_waiter *waiter,
+                            struct alarm_waiter **last)
+{
+	if (*last)
+		BSD_LIST_INSERT_AFTER(*last, waiter, next);
+	else
+		BSD_LIST_INSERT_HEAD(&tchain->expired, waiter, next);
+	waiter->slot = &tchain->expired;
+	*last = waiter;
+}
+
+/* Coalescing: waiters whose deadline is later than now, but whose time is up,
+ * fire now instead of taking an interrupt of their own.  They are no further
+ * than max_slack past now in the wheel.  Base doesn't move, so this doesn't
+ * cascade anything. */
+static void __tchain_collect_slack(struct timer_chain *tchain, uint64_t now,
+                                   struct alarm_waiter **last)
+{
+	struct alarm_waiter *i, *temp;
+	uint64_t horizon = now + tchain->max_slack;
+	uint64_t map;
+	unsigned int idx;
+
+	for (int level = 0; level < TCHAIN_NR_LEVELS; level++) {
+		for (map = tchain->slot_map[level]; map; map &= map - 1) {
+			idx = __builtin_ctzll(map);
+			if (tchain_slot_start(tchain, level, idx) > horizon)
+				break;
+			BSD_LIST_FOREACH_SAFE(i, &tchain->slots[level][idx], next, temp) {
+				if (i->wake_up_time > now)
+					continue;
+				__tchain_del(tchain, i);
+				__tchain_expire(tchain, i, last);
+			}
+		}
+	}
+}
+
+/* Moves everyone whose time is up to the expired list, advancing base towards
+ * now.  Only level 0 waiters expire: a higher level's slot, or the far list,
+ * gets cascaded down once base reaches it.  The expired list is in slot order,
+ * which is deadline order, give or take a level 0 slot. */
+static void __tchain_collect(struct timer_chain *tchain, uint64_t now)
+{
+	struct awaiter_list *slot, cascade;
+	struct alarm_waiter *i, *temp, *last = NULL;
+	uint64_t start;
+	int level;
+
+	while ((slot = tchain_first_slot(tchain, &level))) {
+		if (level == TCHAIN_NR_LEVELS)
+			start = slot_min_time(slot);
+		else
+			start = tchain_slot_start(tchain, level,
+			                          slot - tchain->slots[level]);
+		if (start > now)
+			break;
+		/* Base's level 0 slot starts before base */
+		tchain->base = MAX(tchain->base, start);
+		BSD_LIST_INIT(&cascade);
+		BSD_LIST_SWAP(&cascade, slot, alarm_waiter, next);
+		if (level < TCHAIN_NR_LEVELS)
+			tchain->slot_map[level] &=
+			        ~(1ULL << (slot - tchain->slots[level]));
+		BSD_LIST_FOREACH_SAFE(i, &cascade, next, temp) {
+			if (level || i->wake_up_time > now)
+				__tchain_add(tchain, i);
+			else
+				__tchain_expire(tchain, i, &last);
+		}
+		/* Whatever is left in a level 0 slot isn't due, and it's the earliest
+		 * in the wheel. */
+		if (!level && !BSD_LIST_EMPTY(slot))
+			break;
+	}
+	if (tchain->max_slack)
+		__tchain_collect_slack(tchain, now, &last);
+}
+
 /* This is called when an interrupt triggers a tchain, and needs to wake up
  * everyone whose time is up.  Called from IRQ context. */
 void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 {
-	struct alarm_waiter *i, *temp;
+	struct alarm_waiter *i;
 	uint64_t now = read_tsc();
 
 	/* why do we disable irqs here?  the lock is irqsave, but we (think we) know
@@ -163,24 +356,26 @@ void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 	 * and we can't make the debugger ignore irq context code either in the
 	 * general case.  it might be nice for handlers to have IRQs disabled too.*/
 	spin_lock_irqsave(&tchain->lock);
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		printd("Trying to wake up %p who is due at %llu and now is %llu\n",
+	if (tchain->earliest_time != ALARM_POISON_TIME &&
+	    tchain->earliest_time <= now)
+		lat_record(LAT_TIMER_IRQ, now - tchain->earliest_time);
+	__tchain_collect(tchain, now);
+	/* Handlers can set alarms, which need the earliest time to be right. */
+	reset_tchain_times(tchain);
+	/* Expired waiters are still on the tchain, so handlers can unset them.
+	 * Any that a handler sets again go in the wheel, not here, so they won't
+	 * run again until the next interrupt. */
+	while ((i = BSD_LIST_FIRST(&tchain->expired))) {
+		printd("Waking up %p who is due at %llu and now is %llu\n",
 		       i, i->wake_up_time, now);
-		/* TODO: Could also do something in cases where we're close to now */
-		if (i->wake_up_time <= now) {
-			i->on_tchain = FALSE;
-			TAILQ_REMOVE(&tchain->waiters, i, next);
-			/* Need to reset after each removal, in case the handler sets the
-			 * alarm again and the earliest/latest times are wrong. */
-			reset_tchain_times(tchain);
-			cmb();	/* enforce waking after removal */
-			/* Don't touch the waiter after waking it, since it could be in use
-			 * on another core (and the waiter can be clobbered as the kthread
-			 * unwinds its stack).  Or it could be kfreed */
-			wake_awaiter(i, hw_tf);
-		} else {
-			break;
-		}
+		__tchain_del(tchain, i);
+		tchain->nr_waiters--;
+		i->on_tchain = FALSE;
+		cmb();	/* enforce waking after removal */
+		/* Don't touch the waiter after waking it, since it could be in use
+		 * on another core (and the waiter can be clobbered as the kthread
+		 * unwinds its stack).  Or it could be kfreed */
+		wake_awaiter(i, hw_tf);
 	}
 	/* Need to reset the interrupt no matter what */
 	reset_tchain_interrupt(tchain);
@@ -192,45 +387,23 @@ void __trigger_tchain(struct timer_chain *tchain, struct hw_trapframe *hw_tf)
 static bool __insert_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *i, *temp;
 	/* This will fail if you don't set a time */
 	assert(waiter->wake_up_time != ALARM_POISON_TIME);
 	assert(!waiter->on_tchain);
 	waiter->on_tchain = TRUE;
-	/* Either the list is empty, or not. */
-	if (TAILQ_EMPTY(&tchain->waiters)) {
-		tchain->earliest_time = waiter->wake_up_time;
-		tchain->latest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
-		/* Need to turn on the timer interrupt later */
-		return TRUE;
-	}
-	/* If not, either we're first, last, or in the middle.  Reset the interrupt
-	 * and adjust the tchain's times accordingly. */
-	if (waiter->wake_up_time < tchain->earliest_time) {
-		tchain->earliest_time = waiter->wake_up_time;
-		TAILQ_INSERT_HEAD(&tchain->waiters, waiter, next);
+	tchain->nr_waiters++;
+	/* An empty wheel can catch up to now, so the waiter lands low. */
+	if (tchain_is_empty(tchain))
+		tchain->base = MAX(tchain->base, read_tsc());
+	__tchain_add(tchain, waiter);
+	tchain->max_slack = MAX(tchain->max_slack, waiter->slack);
+	if (tchain_is_empty(tchain) ||
+	    awaiter_deadline(waiter) < tchain->earliest_time) {
+		tchain->earliest_time = awaiter_deadline(waiter);
 		/* Changed the first entry; we'll need to reset the interrupt later */
 		return TRUE;
 	}
-	/* If there is a tie for last, the newer one will really go last.  We need
-	 * to handle equality here since the loop later won't catch it. */
-	if (waiter->wake_up_time >= tchain->latest_time) {
-		tchain->latest_time = waiter->wake_up_time;
-		/* Proactively put it at the end if we know we're last */
-		TAILQ_INSERT_TAIL(&tchain->waiters, waiter, next);
-		return FALSE;
-	}
-	/* Insert before the first one you are earlier than.  This won't scale well
-	 * (TODO) if we have a lot of inserts.  The proactive insert_tail up above
-	 * will help a bit. */
-	TAILQ_FOREACH_SAFE(i, &tchain->waiters, next, temp) {
-		if (waiter->wake_up_time < i->wake_up_time) {
-			TAILQ_INSERT_BEFORE(i, waiter, next);
-			return FALSE;
-		}
-	}
-	panic("Could not find a spot for awaiter %p\n", waiter);
+	return FALSE;
 }
 
 static void __set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
@@ -277,22 +450,18 @@ void set_alarm(struct timer_chain *tchain, struct alarm_waiter *waiter)
 static bool __remove_awaiter(struct timer_chain *tchain,
                              struct alarm_waiter *waiter)
 {
-	struct alarm_waiter *temp;
-	bool reset_int = FALSE;		/* whether or not to reset the interrupt */
-	/* Need to make sure earliest and latest are set, in case we're mucking with
-	 * the first and/or last element of the chain. */
-	if (TAILQ_FIRST(&tchain->waiters) == waiter) {
-		temp = TAILQ_NEXT(waiter, next);
-		tchain->earliest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-		reset_int = TRUE;		/* we'll need to reset the timer later */
-	}
-	if (TAILQ_LAST(&tchain->waiters, awaiters_tailq) == waiter) {
-		temp = TAILQ_PREV(waiter, awaiters_tailq, next);
-		tchain->latest_time = (temp) ? temp->wake_up_time : ALARM_POISON_TIME;
-	}
-	TAILQ_REMOVE(&tchain->waiters, waiter, next);
+	/* Expired waiters aren't in the wheel, and don't count for its time */
+	bool in_wheel = waiter->slot != &tchain->expired;
+
+	__tchain_del(tchain, waiter);
+	tchain->nr_waiters--;
 	waiter->on_tchain = FALSE;
-	return reset_int;
+	if (!in_wheel || awaiter_deadline(waiter) != tchain->earliest_time)
+		return FALSE;
+	/* We might have been tied with another for first.  Either way, we need to
+	 * find the new first. */
+	reset_tchain_times(tchain);
+	return TRUE;
 }
 
 static bool __unset_alarm_irq(struct timer_chain *tchain,
@@ -429,7 +598,7 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 		send_ipi(rem_pcpui - &per_cpu_info[0], IdtLAPIC_TIMER);
 		return;
 	}
-	time = TAILQ_EMPTY(&tchain->waiters) ? 0 : tchain->earliest_time;
+	time = tchain_is_empty(tchain) ? 0 : tchain->earliest_time;
 	if (time) {
 		/* Arm the alarm.  For times in the past, we just need to make sure it
 		 * goes off. */
@@ -448,19 +617,34 @@ void set_pcpu_alarm_interrupt(struct timer_chain *tchain)
 	}
 }
 
+/* Returns how long until the calling core's next alarm, in usec, or
+ * ALARM_IDLE_FOREVER if it has none.  Something else, like an IPI or a device
+ * IRQ, could wake the core sooner.  Call with IRQs disabled.
+ *
+ * We peek without the lock.  Other cores can change our chain, but they IPI us
+ * when they do, which wakes us anyway.  At worst, we pick a poor sleep state. */
+uint64_t pcpu_idle_usec(void)
+{
+	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
+	uint64_t time = tchain->earliest_time;
+	uint64_t now;
+
+	if (time == ALARM_POISON_TIME)
+		return ALARM_IDLE_FOREVER;
+	now = read_tsc();
+	if (time <= now)
+		return 0;
+	return tsc2usec(time - now);
+}
+
 /* Debug helpers */
 
-void print_chain(struct timer_chain *tchain)
+static void print_slot(struct awaiter_list *slot)
 {
 	struct alarm_waiter *i;
-	spin_lock_irqsave(&tchain->lock);
-	printk("Chain %p is%s empty, early: %llu latest: %llu\n", tchain,
-	       TAILQ_EMPTY(&tchain->waiters) ? "" : " not",
-	       tchain->earliest_time,
-	       tchain->latest_time);
-	TAILQ_FOREACH(i, &tchain->waiters, next) {
-		uintptr_t f;
+	uintptr_t f;
 
+	BSD_LIST_FOREACH(i, slot, next) {
 		if (i->irq_ok)
 			f = (uintptr_t)i->func_irq;
 		else
@@ -468,6 +652,19 @@ void print_chain(struct timer_chain *tchain)
 		printk("\tWaiter %p, time %llu, func %p (%s)\n", i,
 		       i->wake_up_time, f, get_fn_name(f));
 	}
+}
+
+/* Waiters are in wheel order, which is only roughly time order. */
+void print_chain(struct timer_chain *tchain)
+{
+	spin_lock_irqsave(&tchain->lock);
+	printk("Chain %p has %u waiters, early: %llu base: %llu\n", tchain,
+	       tchain->nr_waiters, tchain->earliest_time, tchain->base);
+	for (int i = 0; i < TCHAIN_NR_LEVELS; i++)
+		for (int j = 0; j < TCHAIN_NR_SLOTS; j++)
+			print_slot(&tchain->slots[i][j]);
+	print_slot(&tchain->far);
+	print_slot(&tchain->expired);
 	spin_unlock_irqsave(&tchain->lock);
 }
 
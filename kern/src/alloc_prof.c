@@ -0,0 +1,375 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Sampled allocation-site profiling.  See alloc_prof.h for the overview.
+ *
+ * Sampling is decided per core: each core counts down from the rate, so the
+ * fast path never touches shared memory.  A sample is rare, so the samples
+ * themselves go into a global site table and object hash under one lock.
+ *
+ * Lock ordering: we can't call into the allocators while holding ap_lock,
+ * since they call back into us (e.g. kmem_cache_free() allocates magazines,
+ * which get sampled).  Our own caches are KMC_NOPROF, so they don't call back,
+ * but we still do all of the record allocs and frees outside the lock. */
+
+#include <alloc_prof.h>
+#include <kmalloc.h>
+#include <slab.h>
+#include <arena.h>
+#include <kdebug.h>
+#include <percpu.h>
+#include <atomic.h>
+#include <hash.h>
+#include <sort.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/queue.h>
+
+#define AP_SITE_HASH_BITS		10
+#define AP_OBJ_HASH_BITS		12
+
+struct ap_site {
+	BSD_LIST_ENTRY(ap_site)		link;
+	unsigned long				hash;
+	size_t						nr_pcs;
+	uintptr_t					pcs[MAX_BT_DEPTH];
+	/* Estimates: each sample counts as 'rate' allocations */
+	uint64_t					nr_ever;
+	uint64_t					bytes_ever;
+	uint64_t					nr_live;
+	uint64_t					bytes_live;
+};
+BSD_LIST_HEAD(ap_site_list, ap_site);
+
+struct ap_obj {
+	BSD_LIST_ENTRY(ap_obj)		link;
+	void						*key;
+	void						*obj;
+	struct ap_site				*site;
+	unsigned int				weight;
+	size_t						size;
+};
+BSD_LIST_HEAD(ap_obj_list, ap_obj);
+
+unsigned int alloc_prof_rate;
+bool alloc_prof_tracking;
+
+struct ap_pcpu {
+	unsigned int				countdown;
+	bool						busy;
+};
+
+static DEFINE_PERCPU(struct ap_pcpu, ap_pcpu);
+
+static spinlock_t ap_lock = SPINLOCK_INITIALIZER_IRQSAVE;
+static struct ap_site_list ap_sites[1 << AP_SITE_HASH_BITS];
+static struct ap_obj_list ap_objs[1 << AP_OBJ_HASH_BITS];
+static size_t ap_nr_sites;
+static size_t ap_nr_objs;
+static uint64_t ap_nr_samples;
+static uint64_t ap_nr_dropped;
+
+static struct kmem_cache *ap_site_cache;
+static struct kmem_cache *ap_obj_cache;
+
+/* Our caches pull straight from the base arena.  We can be sampling from within
+ * a slab grow, with that cache's lock held, and we don't want our own grows to
+ * go through any qcaches that might be the ones locked. */
+void alloc_prof_init(void)
+{
+	/* Small objects, so our grows don't need the slab or bufctl caches */
+	static_assert(sizeof(struct ap_site) <= SLAB_LARGE_CUTOFF);
+	static_assert(sizeof(struct ap_obj) <= SLAB_LARGE_CUTOFF);
+	ap_site_cache = kmem_cache_create("alloc_prof_site", sizeof(struct ap_site),
+	                                  __alignof__(struct ap_site), KMC_NOPROF,
+	                                  base_arena, NULL, NULL, NULL);
+	ap_obj_cache = kmem_cache_create("alloc_prof_obj", sizeof(struct ap_obj),
+	                                 __alignof__(struct ap_obj), KMC_NOPROF,
+	                                 base_arena, NULL, NULL, NULL);
+}
+
+static unsigned long ap_site_hash(uintptr_t *pcs, size_t nr_pcs)
+{
+	unsigned long h = 0;
+
+	for (size_t i = 0; i < nr_pcs; i++)
+		h = h * 31 + pcs[i];
+	return h;
+}
+
+static struct ap_obj_list *ap_obj_bucket(void *key, void *obj)
+{
+	return &ap_objs[hash_long((unsigned long)obj ^ (unsigned long)key,
+	                          AP_OBJ_HASH_BITS)];
+}
+
+static struct ap_site *__ap_site_lookup(unsigned long hash, uintptr_t *pcs,
+                                        size_t nr_pcs)
+{
+	struct ap_site *site;
+
+	BSD_LIST_FOREACH(site, &ap_sites[hash_long(hash, AP_SITE_HASH_BITS)],
+	                 link) {
+		if ((site->hash == hash) && (site->nr_pcs == nr_pcs) &&
+		    !memcmp(site->pcs, pcs, nr_pcs * sizeof(uintptr_t)))
+			return site;
+	}
+	return NULL;
+}
+
+/* Returns TRUE if this core should sample this allocation. */
+static bool ap_should_sample(struct ap_pcpu *ap_pc, unsigned int rate)
+{
+	/* A countdown above the rate is left over from a larger rate. */
+	if (ap_pc->countdown && (ap_pc->countdown <= rate) && --ap_pc->countdown)
+		return FALSE;
+	ap_pc->countdown = rate;
+	return TRUE;
+}
+
+static void __ap_sample(void *key, void *obj, size_t size, unsigned int rate,
+                        uintptr_t *pcs, size_t nr_pcs)
+{
+	unsigned long hash;
+	struct ap_obj *rec;
+	struct ap_site *site, *new_site = NULL;
+
+	hash = ap_site_hash(pcs, nr_pcs);
+	rec = kmem_cache_alloc(ap_obj_cache, MEM_ATOMIC);
+	if (!rec)
+		goto drop;
+	rec->key = key;
+	rec->obj = obj;
+	rec->weight = rate;
+	rec->size = size;
+
+	spin_lock_irqsave(&ap_lock);
+	site = __ap_site_lookup(hash, pcs, nr_pcs);
+	if (!site) {
+		/* Rare: only the first sample from a site. */
+		spin_unlock_irqsave(&ap_lock);
+		new_site = kmem_cache_alloc(ap_site_cache, MEM_ATOMIC);
+		if (!new_site) {
+			kmem_cache_free(ap_obj_cache, rec);
+			goto drop;
+		}
+		memset(new_site, 0, sizeof(struct ap_site));
+		new_site->hash = hash;
+		new_site->nr_pcs = nr_pcs;
+		memcpy(new_site->pcs, pcs, nr_pcs * sizeof(uintptr_t));
+		spin_lock_irqsave(&ap_lock);
+		site = __ap_site_lookup(hash, pcs, nr_pcs);
+		if (!site) {
+			site = new_site;
+			new_site = NULL;
+			BSD_LIST_INSERT_HEAD(&ap_sites[hash_long(hash, AP_SITE_HASH_BITS)],
+			                     site, link);
+			ap_nr_sites++;
+		}
+	}
+	/* A reset that raced with us turned off tracking; our sample is stale. */
+	if (!alloc_prof_tracking) {
+		spin_unlock_irqsave(&ap_lock);
+		kmem_cache_free(ap_obj_cache, rec);
+		if (new_site)
+			kmem_cache_free(ap_site_cache, new_site);
+		return;
+	}
+	rec->site = site;
+	site->nr_ever += rate;
+	site->bytes_ever += (uint64_t)rate * size;
+	site->nr_live += rate;
+	site->bytes_live += (uint64_t)rate * size;
+	BSD_LIST_INSERT_HEAD(ap_obj_bucket(key, obj), rec, link);
+	ap_nr_objs++;
+	ap_nr_samples++;
+	spin_unlock_irqsave(&ap_lock);
+	if (new_site)
+		kmem_cache_free(ap_site_cache, new_site);
+	return;
+drop:
+	spin_lock_irqsave(&ap_lock);
+	ap_nr_dropped++;
+	spin_unlock_irqsave(&ap_lock);
+}
+
+void __alloc_prof_alloc(void *key, void *obj, size_t size)
+{
+	unsigned int rate = READ_ONCE(alloc_prof_rate);
+	struct ap_pcpu *ap_pc;
+	uintptr_t pcs[MAX_BT_DEPTH];
+	size_t nr_pcs;
+
+	if (!rate)
+		return;
+	ap_pc = PERCPU_VARPTR(ap_pcpu);
+	/* Our record allocs can recurse into the allocators, e.g. a slab grow of
+	 * our cache, with its lock held, that pulls from a sampled qcache.  We just
+	 * skip those, and anything from an IRQ that interrupts a sample. */
+	if (ap_pc->busy || !ap_should_sample(ap_pc, rate))
+		return;
+	ap_pc->busy = TRUE;
+	/* Skip our own frame; the first PC is in whoever called the allocator. */
+	nr_pcs = backtrace_list(get_caller_pc(), *(uintptr_t*)read_bp(), pcs,
+	                        MAX_BT_DEPTH);
+	__ap_sample(key, obj, size, rate, pcs, nr_pcs);
+	ap_pc->busy = FALSE;
+}
+
+void __alloc_prof_free(void *key, void *obj)
+{
+	struct ap_obj_list *bucket = ap_obj_bucket(key, obj);
+	struct ap_obj *rec;
+
+	/* Most frees are of unsampled objects.  This peek is racy, but no one can
+	 * be inserting obj concurrently: we own it until it is freed. */
+	if (BSD_LIST_EMPTY(bucket))
+		return;
+	spin_lock_irqsave(&ap_lock);
+	BSD_LIST_FOREACH(rec, bucket, link) {
+		if ((rec->obj == obj) && (rec->key == key))
+			break;
+	}
+	if (!rec) {
+		spin_unlock_irqsave(&ap_lock);
+		return;
+	}
+	BSD_LIST_REMOVE(rec, link);
+	ap_nr_objs--;
+	rec->site->nr_live -= rec->weight;
+	rec->site->bytes_live -= (uint64_t)rec->weight * rec->size;
+	spin_unlock_irqsave(&ap_lock);
+	kmem_cache_free(ap_obj_cache, rec);
+}
+
+/* Sets the sampling rate, one in every @rate allocations per core.  0 turns off
+ * sampling, but we keep tracking the frees of objects we already sampled. */
+int alloc_prof_set_rate(unsigned int rate)
+{
+	if (!ap_obj_cache)
+		return -EAGAIN;
+	spin_lock_irqsave(&ap_lock);
+	if (rate)
+		alloc_prof_tracking = TRUE;
+	spin_unlock_irqsave(&ap_lock);
+	/* Tracking must be on before anyone samples, which the lock ensures. */
+	WRITE_ONCE(alloc_prof_rate, rate);
+	return 0;
+}
+
+/* Throws away all sites and tracked objects. */
+void alloc_prof_reset(void)
+{
+	struct ap_site_list sites = BSD_LIST_HEAD_INITIALIZER(sites);
+	struct ap_obj_list objs = BSD_LIST_HEAD_INITIALIZER(objs);
+	struct ap_site *site;
+	struct ap_obj *rec;
+
+	spin_lock_irqsave(&ap_lock);
+	for (int i = 0; i < ARRAY_SIZE(ap_sites); i++) {
+		while ((site = BSD_LIST_FIRST(&ap_sites[i]))) {
+			BSD_LIST_REMOVE(site, link);
+			BSD_LIST_INSERT_HEAD(&sites, site, link);
+		}
+	}
+	for (int i = 0; i < ARRAY_SIZE(ap_objs); i++) {
+		while ((rec = BSD_LIST_FIRST(&ap_objs[i]))) {
+			BSD_LIST_REMOVE(rec, link);
+			BSD_LIST_INSERT_HEAD(&objs, rec, link);
+		}
+	}
+	ap_nr_sites = 0;
+	ap_nr_objs = 0;
+	ap_nr_samples = 0;
+	ap_nr_dropped = 0;
+	alloc_prof_tracking = READ_ONCE(alloc_prof_rate) != 0;
+	spin_unlock_irqsave(&ap_lock);
+	while ((site = BSD_LIST_FIRST(&sites))) {
+		BSD_LIST_REMOVE(site, link);
+		kmem_cache_free(ap_site_cache, site);
+	}
+	while ((rec = BSD_LIST_FIRST(&objs))) {
+		BSD_LIST_REMOVE(rec, link);
+		kmem_cache_free(ap_obj_cache, rec);
+	}
+}
+
+/* Biggest live users first */
+static int ap_site_cmp(const void *a, const void *b)
+{
+	const struct ap_site *sa = a, *sb = b;
+
+	if (sa->bytes_live != sb->bytes_live)
+		return sa->bytes_live < sb->bytes_live ? 1 : -1;
+	if (sa->bytes_ever != sb->bytes_ever)
+		return sa->bytes_ever < sb->bytes_ever ? 1 : -1;
+	return 0;
+}
+
+struct ap_printer {
+	struct sized_alloc			*sza;
+	size_t						sofar;
+};
+
+static void ap_print_bt_line(void *opaque, const char *str)
+{
+	struct ap_printer *ap = opaque;
+
+	ap->sofar += snprintf(ap->sza->buf + ap->sofar, ap->sza->size - ap->sofar,
+	                      "\t%s", str);
+}
+
+/* Snapshots the sites, so we can print without holding the lock (the printing
+ * allocates).  Returns the number of sites in *sites, which the caller frees.
+ * The table can grow while we allocate, so we might miss a few new sites. */
+static size_t ap_snapshot_sites(struct ap_site **sites_p)
+{
+	struct ap_site *sites, *site;
+	size_t nr_slots, nr = 0;
+
+	nr_slots = READ_ONCE(ap_nr_sites) + 16;
+	sites = kmalloc_array(nr_slots, sizeof(struct ap_site), MEM_WAIT);
+	spin_lock_irqsave(&ap_lock);
+	for (int i = 0; i < ARRAY_SIZE(ap_sites); i++) {
+		BSD_LIST_FOREACH(site, &ap_sites[i], link) {
+			if (nr == nr_slots)
+				break;
+			sites[nr++] = *site;
+		}
+	}
+	spin_unlock_irqsave(&ap_lock);
+	*sites_p = sites;
+	return nr;
+}
+
+struct sized_alloc *alloc_prof_build_report(void)
+{
+	struct ap_printer ap[1];
+	struct ap_site *sites, *site;
+	size_t nr_sites, alloc_amt = 500;
+
+	nr_sites = ap_snapshot_sites(&sites);
+	sort(sites, nr_sites, sizeof(struct ap_site), ap_site_cmp);
+	for (size_t i = 0; i < nr_sites; i++)
+		alloc_amt += 200 + sites[i].nr_pcs * 140;
+	ap->sza = sized_kzmalloc(alloc_amt, MEM_WAIT);
+	ap->sofar = 0;
+	ap->sofar += snprintf(ap->sza->buf + ap->sofar, ap->sza->size - ap->sofar,
+	                      "Sample rate: 1/%u, samples: %llu, dropped: %llu\n",
+	                      alloc_prof_rate, ap_nr_samples, ap_nr_dropped);
+	ap->sofar += snprintf(ap->sza->buf + ap->sofar, ap->sza->size - ap->sofar,
+	                      "Sites: %lu, tracked objects: %lu\n\n", ap_nr_sites,
+	                      ap_nr_objs);
+	for (size_t i = 0; i < nr_sites; i++) {
+		site = &sites[i];
+		ap->sofar += snprintf(ap->sza->buf + ap->sofar,
+		                      ap->sza->size - ap->sofar,
+		                      "Site %lu: live %llu bytes in %llu objs, total %llu bytes in %llu allocs\n",
+		                      i, site->bytes_live, site->nr_live,
+		                      site->bytes_ever, site->nr_ever);
+		print_backtrace_list(site->pcs, site->nr_pcs, ap_print_bt_line, ap);
+	}
+	kfree(sites);
+	return ap->sza;
+}
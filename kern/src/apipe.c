@@ -33,6 +33,16 @@ void apipe_init(struct atomic_pipe *ap, void *buf, size_t buf_sz,
 	cv_init_with_lock(&ap->ap_general_readers, &ap->ap_lock);
 	cv_init_with_lock(&ap->ap_writers, &ap->ap_lock);
 	ap->ap_has_priority_reader = FALSE;
+	ap->ap_spsc = FALSE;
+	ap->ap_rd_waiting = FALSE;
+	ap->ap_wr_waiting = FALSE;
+}
+
+void apipe_init_spsc(struct atomic_pipe *ap, void *buf, size_t buf_sz,
+                     size_t elem_sz)
+{
+	apipe_init(ap, buf, buf_sz, elem_sz);
+	ap->ap_spsc = TRUE;
 }
 
 void apipe_open_reader(struct atomic_pipe *ap)
@@ -106,11 +116,144 @@ int apipe_read_locked(struct atomic_pipe *ap, void *buf, size_t nr_elem)
 }
 
 
+static void *__apipe_slot(struct atomic_pipe *ap, size_t off)
+{
+	return ap->ap_buf + (off & (ap->ap_ring_sz - 1)) * ap->ap_elem_sz;
+}
+
+/* SPSC helpers.  Each side writes its own offset without the lock.  A side that
+ * finds the ring full/empty sets its waiting flag under the lock, then checks
+ * again before sleeping.  The other side updates its offset, then checks the
+ * flag; the mb()s on both sides make sure at least one of them sees the other.
+ * If the waker sees the flag, grabbing the lock means the sleeper is already
+ * in cv_wait() (or has seen the new offset and left). */
+
+static size_t __spsc_nr_full(struct atomic_pipe *ap)
+{
+	return READ_ONCE(ap->ap_wr_off) - READ_ONCE(ap->ap_rd_off);
+}
+
+/* Returns how many elements the reader can read (up to nr_elem), blocking
+ * until there's at least one.  Returns 0 if there are no writers. */
+static size_t __spsc_wait_full(struct atomic_pipe *ap, size_t nr_elem)
+{
+	size_t nr;
+
+	while (!(nr = __spsc_nr_full(ap))) {
+		spin_lock(&ap->ap_lock);
+		ap->ap_rd_waiting = TRUE;
+		mb();
+		if (!__spsc_nr_full(ap)) {
+			if (!ap->ap_nr_writers) {
+				ap->ap_rd_waiting = FALSE;
+				spin_unlock(&ap->ap_lock);
+				return 0;
+			}
+			cv_wait(&ap->ap_general_readers);
+		}
+		ap->ap_rd_waiting = FALSE;
+		spin_unlock(&ap->ap_lock);
+	}
+	/* Don't read the slots until we've seen the writer's commit */
+	rmb();
+	return MIN(nr, nr_elem);
+}
+
+/* Same, but for the writer and empty slots. */
+static size_t __spsc_wait_empty(struct atomic_pipe *ap, size_t nr_elem)
+{
+	size_t nr;
+
+	while (!(nr = ap->ap_ring_sz - __spsc_nr_full(ap))) {
+		spin_lock(&ap->ap_lock);
+		ap->ap_wr_waiting = TRUE;
+		mb();
+		if (__spsc_nr_full(ap) == ap->ap_ring_sz) {
+			if (!ap->ap_nr_readers) {
+				ap->ap_wr_waiting = FALSE;
+				spin_unlock(&ap->ap_lock);
+				return 0;
+			}
+			cv_wait(&ap->ap_writers);
+		}
+		ap->ap_wr_waiting = FALSE;
+		spin_unlock(&ap->ap_lock);
+	}
+	/* Don't write the slots until the reader is done with them */
+	mb();
+	return MIN(nr, nr_elem);
+}
+
+static void __spsc_wake(struct atomic_pipe *ap, bool *waiting,
+                        struct cond_var *cv)
+{
+	mb();
+	if (!READ_ONCE(*waiting))
+		return;
+	spin_lock(&ap->ap_lock);
+	__cv_broadcast(cv);
+	spin_unlock(&ap->ap_lock);
+}
+
+static int __spsc_read(struct atomic_pipe *ap, void *buf, size_t nr_elem)
+{
+	size_t nr = __spsc_wait_full(ap, nr_elem);
+
+	for (size_t i = 0; i < nr; i++) {
+		memcpy(buf, __apipe_slot(ap, ap->ap_rd_off + i), ap->ap_elem_sz);
+		buf += ap->ap_elem_sz;
+	}
+	/* Our copies must be done before the writer can reuse the slots */
+	mb();
+	WRITE_ONCE(ap->ap_rd_off, ap->ap_rd_off + nr);
+	__spsc_wake(ap, &ap->ap_wr_waiting, &ap->ap_writers);
+	return nr;
+}
+
+/* Reserves up to nr_elem slots for an SPSC writer, blocking on a full ring.
+ * Returns 0 if there are no readers.  Fill them with apipe_write_slot(), then
+ * apipe_write_commit(). */
+size_t apipe_write_reserve(struct atomic_pipe *ap, size_t nr_elem)
+{
+	assert(ap->ap_spsc);
+	return __spsc_wait_empty(ap, nr_elem);
+}
+
+/* Returns the i'th slot of the current reservation. */
+void *apipe_write_slot(struct atomic_pipe *ap, size_t i)
+{
+	return __apipe_slot(ap, ap->ap_wr_off + i);
+}
+
+/* Hands the first nr_elem reserved slots to the reader. */
+void apipe_write_commit(struct atomic_pipe *ap, size_t nr_elem)
+{
+	if (!nr_elem)
+		return;
+	wmb();
+	WRITE_ONCE(ap->ap_wr_off, ap->ap_wr_off + nr_elem);
+	__spsc_wake(ap, &ap->ap_rd_waiting, &ap->ap_general_readers);
+}
+
+static int __spsc_write(struct atomic_pipe *ap, void *buf, size_t nr_elem)
+{
+	size_t nr = apipe_write_reserve(ap, nr_elem);
+
+	for (size_t i = 0; i < nr; i++) {
+		memcpy(apipe_write_slot(ap, i), buf, ap->ap_elem_sz);
+		buf += ap->ap_elem_sz;
+	}
+	apipe_write_commit(ap, nr);
+	return nr;
+}
+
 int apipe_read(struct atomic_pipe *ap, void *buf, size_t nr_elem)
 {
 	size_t rd_idx;
 	int nr_copied = 0;
 
+	if (ap->ap_spsc)
+		return __spsc_read(ap, buf, nr_elem);
 	spin_lock(&ap->ap_lock);
 	/* Need to wait til the priority reader is gone, and the ring isn't empty.
 	 * If we do this as two steps, (either of priority check or empty check
@@ -141,6 +284,8 @@ int apipe_write(struct atomic_pipe *ap, void *buf, size_t nr_elem)
 	size_t wr_idx;
 	int nr_copied = 0;
 
+	if (ap->ap_spsc)
+		return __spsc_write(ap, buf, nr_elem);
 	spin_lock(&ap->ap_lock);
 	/* not sure if we want to check for readers first or not */
 	while (__ring_full(ap->ap_ring_sz, ap->ap_wr_off, ap->ap_rd_off)) {
@@ -191,6 +336,7 @@ int apipe_read_cond(struct atomic_pipe *ap,
 	size_t rd_idx;
 	int ret;
 
+	assert(!ap->ap_spsc);
 	spin_lock(&ap->ap_lock);
 	/* Can only have one priority reader at a time.  Wait our turn. */
 	while (ap->ap_has_priority_reader) {
@@ -49,8 +49,10 @@
  *   help us get out of OOM.  So we might block when we're at low-mem, not at 0.
  *   We probably should have a sorted list of desired amounts, and unblockers
  *   poke the CV if the first waiter is likely to succeed.
- * - Reclaim: have a ktask that sleeps on a rendez.  We poke it, even from IRQ
- *   context.  It qlocks arenas_and_slabs_lock, then does the reclaim.
+ * - Reclaim: the slab layer has a ktask that sleeps on a rendez, and we poke it
+ *   when a base arena gets low (kmem_reclaim_poke()).  It gives back idle
+ *   magazines and empty slabs.  We still don't block waiting for it, and arenas
+ *   don't give back their own free spans.
  *
  * FAQ:
  * - Does allocating memory from an arena require it to take a btag?  Yes -
@@ -101,9 +103,13 @@ void print_arena_stats(struct arena *arena, bool verbose);
  * arena. */
 static struct arena *find_my_base(struct arena *arena)
 {
-	/* TODO: could walk down sources until is_base is set.  But barring that,
-	 * we'd still need a way to find a base arena for some other allocator that
-	 * just wants a page.  arena may be NULL, so handle that. */
+	/* Walk down the sources, so a NUMA node's arenas use their node's base.
+	 * Other allocators that just want a page (arena may be NULL) get
+	 * base_arena. */
+	for (struct arena *a = arena; a; a = a->source) {
+		if (a->is_base)
+			return a;
+	}
 	return base_arena;
 }
 
@@ -210,6 +216,14 @@ void arena_destroy(struct arena *arena)
 	qunlock(&arenas_and_slabs_lock);
 	if (arena->source)
 		del_importing_arena(arena->source, arena);
+	/* The qcaches hold segments from us, so they need to give them back before
+	 * we can check for leaks. */
+	if (arena->qcaches) {
+		for (int i = 0; i < arena->qcache_max / arena->quantum; i++)
+			__kmem_cache_destroy(&arena->qcaches[i]);
+		base_free(arena, arena->qcaches, (arena->qcache_max / arena->quantum)
+		                                 * sizeof(struct kmem_cache));
+	}
 
 	for (int i = 0; i < arena->hh.nr_hash_lists; i++)
 		assert(BSD_LIST_EMPTY(&arena->alloc_hash[i]));
@@ -661,6 +675,16 @@ void *arena_add(struct arena *arena, void *base, size_t size, int flags)
 	return __arena_add(arena, base, size, flags);
 }
 
+/* Lockless peek at whether a base arena is running low, at which point we want
+ * the slab reclaim ktask to give back what it can. */
+static bool base_arena_is_low(struct arena *arena)
+{
+	size_t total = READ_ONCE(arena->amt_total_segs);
+	size_t alloc = READ_ONCE(arena->amt_alloc_segs);
+
+	return (total - alloc) < total / 100 * kmem_reclaim_low_pct;
+}
+
 /* Attempt to get more resources, either from a source or by blocking.  Returns
  * TRUE if we got something.  FALSE on failure (e.g. MEM_ATOMIC). */
 static bool get_more_resources(struct arena *arena, size_t size, int flags)
@@ -671,6 +695,9 @@ static bool get_more_resources(struct arena *arena, size_t size, int flags)
 	/* MAX check, in case size << scale overflows */
 	import_size = MAX(size, size << arena->import_scale);
 	if (arena->source) {
+		/* The source hands out whole quanta, so we might as well use them.
+		 * Otherwise the tail of the span is lost until the span is freed. */
+		import_size = ROUNDUP(import_size, arena->source->quantum);
 		span = arena->afunc(arena->source, import_size, flags);
 		if (!span)
 			return FALSE;
@@ -680,10 +707,13 @@ static bool get_more_resources(struct arena *arena, size_t size, int flags)
 			arena->ffunc(arena->source, span, import_size);
 			return FALSE;
 		}
+		if (arena->source->is_base && base_arena_is_low(arena->source))
+			kmem_reclaim_poke();
 	} else {
 		/* TODO: allow blocking */
 		if (!(flags & MEM_ATOMIC))
 			panic("OOM!");
+		kmem_reclaim_poke();
 		return FALSE;
 	}
 	return TRUE;
@@ -1127,6 +1157,42 @@ void arena_xfree(struct arena *arena, void *addr, size_t size)
 	free_from_arena(arena, addr, size);
 }
 
+/* Allocates up to @nr segments of @size into @addrs, returning how many we got.
+ * Sizes that are qcached come straight out of the qcache's magazines in bulk,
+ * which is core-local unless the magazines run dry. */
+size_t arena_alloc_batch(struct arena *arena, void **addrs, size_t size,
+                         size_t nr, int flags)
+{
+	size_t i;
+
+	size = ROUNDUP(size, arena->quantum);
+	if (!size)
+		panic("Arena %s, request for zero", arena->name);
+	if (size <= arena->qcache_max) {
+		if (flags & ARENA_NEXTFIT)
+			panic("Arena %s, NEXTFIT, but has qcaches.  Use xalloc.",
+			      arena->name);
+		return kmem_cache_alloc_batch(size_to_qcache(arena, size), addrs, nr,
+		                              flags);
+	}
+	for (i = 0; i < nr; i++) {
+		addrs[i] = arena_alloc(arena, size, flags);
+		if (!addrs[i])
+			break;
+	}
+	return i;
+}
+
+/* Frees @nr segments of @size from @addrs, from arena_alloc_batch(). */
+void arena_free_batch(struct arena *arena, void **addrs, size_t size, size_t nr)
+{
+	size = ROUNDUP(size, arena->quantum);
+	if (size <= arena->qcache_max)
+		return kmem_cache_free_batch(size_to_qcache(arena, size), addrs, nr);
+	for (size_t i = 0; i < nr; i++)
+		free_from_arena(arena, addrs[i], size);
+}
+
 /* Low-level arena builder.  Pass in a page address, and this will build an
  * arena in that memory.
  *
@@ -10,6 +10,7 @@
 #include <smp.h>
 #include <kmalloc.h>
 #include <kdebug.h>
+#include <lockstat.h>
 
 static void increase_lock_depth(uint32_t coreid)
 {
@@ -75,6 +76,13 @@ void spin_lock(spinlock_t *lock)
 		}
 	}
 lock:
+#ifdef CONFIG_LOCK_STAT
+	if (lockstat_enabled) {
+		lockstat_spin_lock(lock, get_caller_pc());
+		post_lock(lock, coreid);
+		return;
+	}
+#endif
 	__spin_lock(lock);
 	/* Memory barriers are handled by the particular arches */
 	post_lock(lock, coreid);
@@ -86,8 +94,13 @@ bool spin_trylock(spinlock_t *lock)
 {
 	uint32_t coreid = core_id_early();
 	bool ret = __spin_trylock(lock);
-	if (ret)
+	if (ret) {
+#ifdef CONFIG_LOCK_STAT
+		if (lockstat_enabled)
+			lockstat_spin_trylocked(lock, get_caller_pc());
+#endif
 		post_lock(lock, coreid);
+	}
 	return ret;
 }
 
@@ -96,6 +109,10 @@ void spin_unlock(spinlock_t *lock)
 	decrease_lock_depth(lock->calling_core);
 	/* Memory barriers are handled by the particular arches */
 	assert(spin_locked(lock));
+#ifdef CONFIG_LOCK_STAT
+	if (lock->lockstat_tsc)
+		lockstat_spin_unlock(lock);
+#endif
 	__spin_unlock(lock);
 }
 
@@ -0,0 +1,119 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Big-reader locks.  See brlock.h.
+ *
+ * A reader holds the lock by having incremented a count.  It can unlock on a
+ * different core than it locked on (kthreads move when they block), so a core's
+ * count can go negative.  Only the sum means anything.
+ *
+ * The writer goes through two states.  While it is BR_PENDING, it is waiting
+ * for the sum to hit 0, and readers can still get in.  Then it sets BR_ACTIVE
+ * and checks the sum again.  Readers increment and then check the state, and
+ * the writer sets the state and then checks the counts, each with an mb in
+ * between.  So either the writer sees the reader and goes back to waiting, or
+ * the reader sees BR_ACTIVE and backs off.  A reader that backs off waits
+ * until the writer leaves, under the cv lock, which the writer holds when it
+ * changes the state. */
+
+#include <brlock.h>
+#include <kmalloc.h>
+#include <smp.h>
+#include <assert.h>
+
+enum {
+	BR_NONE,
+	BR_PENDING,
+	BR_ACTIVE,
+};
+
+void br_init(struct brlock *br)
+{
+	br->counts = kzmalloc_align(sizeof(struct br_count) * num_cores,
+	                            MEM_WAIT, ARCH_CL_SIZE);
+	br->state = BR_NONE;
+	cv_init(&br->cv);
+	qlock_init(&br->writer);
+}
+
+void br_destroy(struct brlock *br)
+{
+	kfree(br->counts);
+	br->counts = NULL;
+}
+
+static long br_nr_readers(struct brlock *br)
+{
+	long sum = 0;
+
+	for_each_core(i)
+		sum += atomic_read(&br->counts[i].nr);
+	return sum;
+}
+
+/* Returns TRUE if we got in without the writer. */
+static bool __br_try_fast(struct brlock *br)
+{
+	atomic_inc(&br->counts[core_id()].nr);
+	/* Pairs with the mb in br_wlock(). */
+	mb();
+	if (likely(READ_ONCE(br->state) != BR_ACTIVE))
+		return TRUE;
+	br_runlock(br);
+	return FALSE;
+}
+
+void br_rlock(struct brlock *br)
+{
+	if (__br_try_fast(br))
+		return;
+	cv_lock(&br->cv);
+	while (br->state == BR_ACTIVE)
+		cv_wait(&br->cv);
+	/* We might have moved while we slept.  Any core's count will do. */
+	atomic_inc(&br->counts[core_id()].nr);
+	cv_unlock(&br->cv);
+}
+
+bool br_canrlock(struct brlock *br)
+{
+	return __br_try_fast(br);
+}
+
+void br_runlock(struct brlock *br)
+{
+	atomic_dec(&br->counts[core_id()].nr);
+	mb();
+	/* A writer might be waiting for us to drain. */
+	if (unlikely(READ_ONCE(br->state) != BR_NONE))
+		cv_broadcast(&br->cv);
+}
+
+void br_wlock(struct brlock *br)
+{
+	qlock(&br->writer);
+	cv_lock(&br->cv);
+	WRITE_ONCE(br->state, BR_PENDING);
+	for (;;) {
+		while (br_nr_readers(br))
+			cv_wait(&br->cv);
+		WRITE_ONCE(br->state, BR_ACTIVE);
+		/* Pairs with the mb in __br_try_fast(). */
+		mb();
+		if (!br_nr_readers(br))
+			break;
+		/* A reader raced in.  It'll either back off or finish. */
+		WRITE_ONCE(br->state, BR_PENDING);
+		__cv_broadcast(&br->cv);
+	}
+	cv_unlock(&br->cv);
+}
+
+void br_wunlock(struct brlock *br)
+{
+	cv_lock(&br->cv);
+	WRITE_ONCE(br->state, BR_NONE);
+	__cv_broadcast(&br->cv);
+	cv_unlock(&br->cv);
+	qunlock(&br->writer);
+}
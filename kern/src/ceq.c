@@ -31,6 +31,29 @@ static void ceq_update_max_event(struct ceq *ceq, unsigned int new_max)
 	} while (!atomic_cas(&ceq->max_event_ever, old_max, new_max));
 }
 
+/* The ring is full (or busy), so we tell the consumer to look for idx in the
+ * overflow bitmaps.  Word, then summary, then the overflow flag, so that a
+ * consumer that sees a summary bit will see the word bit. */
+static void ceq_post_overflow(struct ceq *ceq, struct proc *p, unsigned int idx)
+{
+	unsigned int word_idx = idx / CEQ_OVF_WORD_BITS;
+	atomic_t *word, *summary;
+
+	word = &(ACCESS_ONCE(ceq->ovf_bits))[word_idx];
+	summary = &(ACCESS_ONCE(ceq->ovf_summary))[word_idx / CEQ_OVF_WORD_BITS];
+	if (!is_user_rwaddr(word, sizeof(atomic_t))) {
+		error_addr(ceq, p, word);
+	} else if (!is_user_rwaddr(summary, sizeof(atomic_t))) {
+		error_addr(ceq, p, summary);
+	} else {
+		atomic_or(word, 1UL << (idx % CEQ_OVF_WORD_BITS));
+		wmb();
+		atomic_or(summary, 1UL << (word_idx % CEQ_OVF_WORD_BITS));
+	}
+	wmb();
+	ceq->ring_overflowed = TRUE;
+}
+
 void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 {
 	struct ceq_event *ceq_ev;
@@ -108,11 +131,11 @@ void send_ceq_msg(struct ceq *ceq, struct proc *p, struct event_msg *msg)
 		my_slot = atomic_read(&ceq->prod_idx);
 		if (__ring_full(ceq->ring_sz, my_slot,
 		                atomic_read(&ceq->cons_pub_idx))) {
-			ceq->ring_overflowed = TRUE;
+			ceq_post_overflow(ceq, p, msg->ev_type);
 			return;
 		}
 		if (loops++ == NR_RING_TRIES) {
-			ceq->ring_overflowed = TRUE;
+			ceq_post_overflow(ceq, p, msg->ev_type);
 			return;
 		}
 	} while (!atomic_cas(&ceq->prod_idx, my_slot, my_slot + 1));
@@ -149,8 +172,9 @@ void ceq_dumper(int pid, struct event_queue *ev_q)
 	printk("CEQ %p\n---------------\n"
 	       "\tevents ptr %p\n"
 	       "\tnr_events %d\n"
-	       "\tlast_recovered %d\n"
 	       "\tmax_event_ever %ld\n"
+	       "\tovf_bits %p\n"
+	       "\tovf_summary %p\n"
 	       "\tring %p\n"
 	       "\tring_sz %d\n"
 	       "\toperation %d\n"
@@ -163,8 +187,9 @@ void ceq_dumper(int pid, struct event_queue *ev_q)
 		   ceq,
 	       ceq->events,
 	       ceq->nr_events,
-	       ceq->last_recovered,
 	       atomic_read(&ceq->max_event_ever),
+	       ceq->ovf_bits,
+	       ceq->ovf_summary,
 	       ceq->ring,
 	       ceq->ring_sz,
 	       ceq->operation,
@@ -44,6 +44,11 @@ void corealloc_proc_init(struct proc *p)
 	TAILQ_INIT(&p->ksched_data.crd.prov_not_alloc_me);
 }
 
+/* Free any data associated with allocating cores to a process. */
+void corealloc_proc_free(struct proc *p)
+{
+}
+
 /* Find the best core to allocate to a process as dictated by the core
  * allocation algorithm. This code assumes that the scheduler that uses it
  * holds a lock for the duration of the call. */
@@ -28,9 +28,14 @@ struct sched_pnode {
 	struct sched_pnode *parent;
 
 	/* Refcount is used to track how many cores have been allocated beneath the
-	 * current node in the hierarchy. */
+	 * current node in the hierarchy.  Cores we never hand out (LL cores, etc.)
+	 * count as allocated. */
 	int refcount;
 
+	/* CPUs only: the idle cores beneath us, so that finding an idle core near a
+	 * proc's cores is a walk down the hierarchy, not a scan of every core. */
+	struct sched_pcore_tailq idle;
+
 	/* All nodes except cores have children. Cores have a sched_pcore. */
 	union {
 		struct sched_pnode *children;
@@ -53,15 +58,9 @@ struct sched_pnode {
 /* The pcores in the system. (array gets alloced in init()).  */
 struct sched_pcore *all_pcores;
 
-/* TAILQ of all unallocated, idle (CG) cores */
-struct sched_pcore_tailq idlecores = TAILQ_HEAD_INITIALIZER(idlecores);
-
 /* An array containing the number of nodes at each level. */
 static int num_nodes[NUM_NODE_TYPES];
 
-/* A 2D array containing for all core i its distance from a core j. */
-static int **core_distance;
-
 /* An array containing the number of children at each level. */
 static int num_descendants[NUM_NODE_TYPES][NUM_NODE_TYPES];
 
@@ -114,6 +113,7 @@ static void init_nodes(int type, int num, int nchildren)
 		n->type = type;
 		n->refcount = 0;
 		n->parent = NULL;
+		TAILQ_INIT(&n->idle);
 
 		/* If we are a core node, initialize the sched_pcore field. */
 		if (n->type == CORE) {
@@ -135,32 +135,21 @@ static void init_nodes(int type, int num, int nchildren)
 	}
 }
 
-/* Helper: Two cores have the same level id (and thus are at distance k, below)
- * if their IDs divided by the number of cores per level are the same, due to
- * how we number our cores. */
-static int get_level_id(int coreid, int level)
+/* The number of idle cores beneath n. */
+static int node_nr_idle(struct sched_pnode *n)
 {
-	return coreid / num_descendants[level][CORE];
+	return num_descendants[n->type][CORE] - n->refcount;
 }
 
-/* Allocate a table of distances from one core to an other. Cores on the same
- * cpu have a distance of 1; same socket have a distance of 2; same numa -> 3;
- * same machine -> 4; */
-static void init_core_distances(void)
+static int node_nr_children(struct sched_pnode *n)
 {
-	core_distance = kzmalloc(num_cores * sizeof(int*), MEM_WAIT);
-	for (int i = 0; i < num_cores; i++)
-		core_distance[i] = kzmalloc(num_cores * sizeof(int), MEM_WAIT);
-	for (int i = 0; i < num_cores; i++) {
-		for (int j = 0; j < num_cores; j++) {
-			for (int k = CPU; k <= MACHINE; k++) {
-				if (get_level_id(i, k) == get_level_id(j, k)) {
-					core_distance[i][j] = k;
-					break;
-				}
-			}
-		}
-	}
+	return num_descendants[n->type][child_node_type(n->type)];
+}
+
+/* The number of cores p has beneath n, which is not a core. */
+static int *proc_node_count(struct proc *p, struct sched_pnode *n)
+{
+	return &p->ksched_data.crd.node_counts[n - node_lookup[CPU]];
 }
 
 /* Initialize any data assocaited with doing core allocation. */
@@ -195,9 +184,6 @@ void corealloc_init(void)
 	init_nodes(NUMA, num_numa, sockets_per_numa);
 	init_nodes(MACHINE, 1, num_numa);
 
-	/* Initialize our table of core_distances */
-	init_core_distances();
-
 	for (int i = 0; i < num_cores; i++) {
 		/* Remove all ll_cores from consideration for allocation. */
 		if (is_ll_core(i)) {
@@ -211,43 +197,66 @@ void corealloc_init(void)
 			continue;
 		}
 #endif /* CONFIG_DISABLE_SMT */
-		/* Fill the idlecores array. */
-		TAILQ_INSERT_HEAD(&idlecores, &all_pcores[i], alloc_next);
+		/* Fill the idle lists. */
+		TAILQ_INSERT_TAIL(&all_pcores[i].sched_pnode->parent->idle,
+		                  &all_pcores[i], alloc_next);
 	}
 }
 
-/* Initialize any data associated with allocating cores to a process. */
+/* Initialize any data associated with allocating cores to a process.  This
+ * can block, and is called before p is visible to the ksched. */
 void corealloc_proc_init(struct proc *p)
 {
 	TAILQ_INIT(&p->ksched_data.crd.alloc_me);
 	TAILQ_INIT(&p->ksched_data.crd.prov_alloc_me);
 	TAILQ_INIT(&p->ksched_data.crd.prov_not_alloc_me);
+	p->ksched_data.crd.node_counts =
+		kzmalloc((total_nodes - num_cores) * sizeof(int), MEM_WAIT);
 }
 
-/* Returns the sum of the distances from one core to all cores in a list.
- *
- * This assumes cl is the allocated list, or possibly the idlecores, since it
- * uses alloc_next. */
-static int cumulative_core_distance(struct sched_pcore *c,
-                                    struct sched_pcore_tailq cl)
+/* Free whatever corealloc_proc_init() set up.  p has no cores left, and it might
+ * never have been initialized, if proc creation failed. */
+void corealloc_proc_free(struct proc *p)
 {
-	int d = 0;
-	struct sched_pcore *temp = NULL;
+	kfree(p->ksched_data.crd.node_counts);
+	p->ksched_data.crd.node_counts = NULL;
+}
 
-	TAILQ_FOREACH(temp, &cl, alloc_next) {
-		d += core_distance[c->core_info->core_id][temp->core_info->core_id];
-	}
-	return d;
+/* The distance between two cores is 1 if they share a CPU, 2 for a socket, 3
+ * for a numa node, and 4 otherwise.  The distance from c to all of p's cores is
+ * then 4 * nr_cores, minus p's count for each of c's CPU, socket, and numa
+ * node.  We don't need the 4 * nr_cores to compare cores, so this returns the
+ * sum of the counts: the higher, the closer c is to p's cores. */
+static int proc_core_affinity(struct proc *p, struct sched_pcore *c)
+{
+	struct sched_pnode *n = c->sched_pnode->parent;
+	int score = 0;
+
+	for (; n->type != MACHINE; n = n->parent)
+		score += *proc_node_count(p, n);
+	return score;
 }
 
-/* Returns the first core in the hierarchy under node n. */
-static struct sched_pcore *first_core_in_node(struct sched_pnode *n)
+/* Returns the first idle core beneath n, taking the least allocated child at
+ * each level. */
+static struct sched_pcore *least_loaded_core_in_node(struct sched_pnode *n)
 {
-	struct sched_pnode *first_child = n;
+	struct sched_pnode *bestn;
 
-	while (first_child->type != CORE)
-		first_child = &first_child->children[0];
-	return first_child->sched_pcore;
+	while (n->type != CPU) {
+		bestn = NULL;
+		for (int i = 0; i < node_nr_children(n); i++) {
+			if (!node_nr_idle(&n->children[i]))
+				continue;
+			if (!bestn || n->children[i].refcount < bestn->refcount) {
+				bestn = &n->children[i];
+				if (!bestn->refcount)
+					break;
+			}
+		}
+		n = bestn;
+	}
+	return TAILQ_FIRST(&n->idle);
 }
 
 /* Return the first provisioned core available. Otherwise, return NULL. */
@@ -262,9 +271,6 @@ static struct sched_pcore *find_first_core(struct proc *p)
 {
 	struct sched_pcore *c;
 	struct sched_pnode *n;
-	struct sched_pnode *nodes;
-	struct sched_pnode *bestn;
-	int best_refcount;
 
 	/* Find the best, first provisioned core if there are any. Even if the
 	 * whole machine is allocated, we still give out provisioned cores, because
@@ -275,83 +281,83 @@ static struct sched_pcore *find_first_core(struct proc *p)
 
 	/* Otherwise, if the whole machine is already allocated, there are no
 	 * cores left to allocate, and we are done. */
-	bestn = &node_lookup[MACHINE][0];
-	if (bestn->refcount == num_descendants[MACHINE][CORE])
+	n = &node_lookup[MACHINE][0];
+	if (!node_nr_idle(n))
 		return NULL;
 
 	/* Otherwise, we know at least one core is still available, so let's find
-	 * the best one to allocate first. We start at NUMA, and loop through the
-	 * topology to find it. */
-	for (int i = NUMA; i >= CORE; i--) {
-		nodes = bestn->children;
-		best_refcount = total_nodes;
-		bestn = NULL;
-
-		for (int j = 0; j < num_nodes[i]; j++) {
-			n = &nodes[j];
-			if (n->refcount == 0)
-				return first_core_in_node(n);
-			if (n->refcount == num_descendants[i][CORE])
-				continue;
-			if (n->refcount < best_refcount) {
-				best_refcount = n->refcount;
-				bestn = n;
-			}
-		}
-	}
-	return bestn->sched_pcore;
+	 * the best one to allocate first: walk down the least allocated nodes. */
+	return least_loaded_core_in_node(n);
 }
 
 /* Return the closest core from the list of provisioned cores to cores we
  * already own. If no cores are available we return NULL.*/
 static struct sched_pcore *find_closest_provisioned_core(struct proc *p)
 {
-	struct sched_pcore_tailq provisioned = p->ksched_data.crd.prov_not_alloc_me;
-	struct sched_pcore_tailq allocated = p->ksched_data.crd.alloc_me;
 	struct sched_pcore *bestc = NULL;
 	struct sched_pcore *c = NULL;
-	int bestd = 0;
+	int bests = -1;
 
-	TAILQ_FOREACH(c, &provisioned, prov_next) {
-		int currd = cumulative_core_distance(c, allocated);
+	TAILQ_FOREACH(c, &p->ksched_data.crd.prov_not_alloc_me, prov_next) {
+		int currs = proc_core_affinity(p, c);
 
-		if ((bestd == 0) || (currd < bestd)) {
-			bestd = currd;
+		if (currs > bests) {
+			bests = currs;
 			bestc = c;
 		}
 	}
 	return bestc;
 }
 
-/* Return the closest core from the list of idlecores to cores we already own.
- * If no cores are available we return NULL.*/
+/* Helper: finds the CPU beneath n, with idle cores, whose cores are closest to
+ * p's.  score is p's affinity for n's ancestors.  The best so far is in
+ * bestn/bests; a subtree that can't beat it is skipped. */
+static void closest_idle_cpu(struct proc *p, struct sched_pnode *n, int score,
+                             struct sched_pnode **bestn, int *bests)
+{
+	int count = 0;
+
+	if (n->type != MACHINE) {
+		count = *proc_node_count(p, n);
+		score += count;
+	}
+	if (n->type == CPU) {
+		if (score > *bests) {
+			*bests = score;
+			*bestn = n;
+		}
+		return;
+	}
+	/* At best, every one of p's cores under n is also under each of the
+	 * nodes below n on the way to the CPU. */
+	if (n->type != MACHINE && score + count * (n->type - CPU) <= *bests)
+		return;
+	for (int i = 0; i < node_nr_children(n); i++) {
+		if (node_nr_idle(&n->children[i]))
+			closest_idle_cpu(p, &n->children[i], score, bestn, bests);
+	}
+}
+
+/* Return the idle core closest to the cores we already own, popping it from
+ * the best CPU's idle list.  If no cores are available we return NULL. */
 static struct sched_pcore *find_closest_idle_core(struct proc *p)
 {
-	struct sched_pcore_tailq allocated = p->ksched_data.crd.alloc_me;
-	struct sched_pcore *bestc = NULL;
-	struct sched_pcore *c = NULL;
-	int bestd = 0;
+	struct sched_pnode *bestn = NULL;
+	int bests = -1;
 
 	/* TODO: Add optimization to hand out core at equivalent distance if the
 	 * best core found is provisioned to someone else. */
-	TAILQ_FOREACH(c, &idlecores, alloc_next) {
-		int currd = cumulative_core_distance(c, allocated);
-
-		if ((bestd == 0) || (currd < bestd)) {
-			bestd = currd;
-			bestc = c;
-		}
-	}
-	return bestc;
+	if (!node_nr_idle(&node_lookup[MACHINE][0]))
+		return NULL;
+	closest_idle_cpu(p, &node_lookup[MACHINE][0], 0, &bestn, &bests);
+	return TAILQ_FIRST(&bestn->idle);
 }
 
-/* Consider the first core provisioned to a proc by calling
- * find_best_provisioned_core(). Then check siblings of the cores the proc
- * already owns. Calculate for every possible node its
- * cumulative_core_distance() (sum of the distances from this core to all of
- * the cores the proc owns). Allocate the core that has the lowest
- * core_distance.  This code assumes that the scheduler that uses it holds a
- * lock for the duration of the call. */
+/* Consider the provisioned core closest to the cores the proc already owns,
+ * then the closest idle core.  Closeness is the sum of the distances from a
+ * core to all of the cores the proc owns, which we get from the proc's per-node
+ * core counts (see proc_core_affinity()).  This code assumes that the
+ * scheduler that uses it holds a lock for the duration of the call. */
 static struct sched_pcore *find_closest_core(struct proc *p)
 {
 	struct sched_pcore *bestc;
@@ -396,9 +402,11 @@ void __track_core_alloc(struct proc *p, uint32_t pcoreid)
 		TAILQ_INSERT_TAIL(&p->ksched_data.crd.prov_alloc_me, spc, prov_next);
 	}
 	/* Actually allocate the core, removing it from the idle core list. */
-	TAILQ_REMOVE(&idlecores, spc, alloc_next);
+	TAILQ_REMOVE(&spc->sched_pnode->parent->idle, spc, alloc_next);
 	TAILQ_INSERT_TAIL(&p->ksched_data.crd.alloc_me, spc, alloc_next);
 	incref_nodes(spc->sched_pnode);
+	for (struct sched_pnode *n = spc->sched_pnode->parent; n; n = n->parent)
+		(*proc_node_count(p, n))++;
 }
 
 /* Track the pcore properly when it is deallocated from p. This code assumes
@@ -423,8 +431,10 @@ void __track_core_dealloc(struct proc *p, uint32_t pcoreid)
 	}
 	/* Actually dealloc the core, putting it back on the idle core list. */
 	TAILQ_REMOVE(&(p->ksched_data.crd.alloc_me), spc, alloc_next);
-	TAILQ_INSERT_HEAD(&idlecores, spc, alloc_next);
+	TAILQ_INSERT_HEAD(&spc->sched_pnode->parent->idle, spc, alloc_next);
 	decref_nodes(spc->sched_pnode);
+	for (struct sched_pnode *n = spc->sched_pnode->parent; n; n = n->parent)
+		(*proc_node_count(p, n))--;
 }
 
 /* Bulk interface for __track_core_dealloc */
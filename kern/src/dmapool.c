@@ -10,37 +10,30 @@
  * Free Software Foundation.
  *
  * This allocator returns small blocks of a given size which are DMA-able by
- * the given device.  It uses the dma_alloc_coherent page allocator to get
- * new pages, then splits them up into blocks of the required size.
- * Many older drivers still have their own code to do this.
+ * the given device.
  *
- * The current design of this allocator is fairly simple.  The pool is
- * represented by the 'struct dma_pool' which keeps a doubly-linked list of
- * allocated pages.  Each page in the page_list is split into blocks of at
- * least 'size' bytes.  Free blocks are tracked in an unsorted singly-linked
- * list of free blocks within the page.  Used blocks aren't tracked, but we
- * keep a count of how many are currently allocated from each page.
+ * Unlike Linux's, ours is a thin wrapper around a kmem_cache: kpages are
+ * physically contiguous and the device can use their PADDR, so the slab
+ * allocator can hand out the blocks.  That gets us the per-core magazines, so
+ * drivers allocating descriptors on their datapaths mostly don't touch a shared
+ * lock, and the slab's depot moves blocks between cores a magazine at a time.
+ * Free blocks also go back to the system when kmem reclaim runs.
+ *
+ * Blocks can't cross 'boundary', which defaults to a page.  The slab packs small
+ * objects into a single page, so they're fine; for other blocks, we align them
+ * to their size rounded up to a power of two, which keeps them from crossing
+ * any power of two boundary at least that big.  Blocks bigger than a page are
+ * too big for that, so those come straight from get_cont_pages(), which
+ * aligns them to their size.
  */
 
 #include <linux_compat.h>
 
 struct dma_pool {
-	struct list_head page_list;
-	spinlock_t lock;
+	struct kmem_cache *cache;	/* 0 for blocks bigger than a page */
 	size_t size;
 	void *dev;
-	size_t allocation;
-	size_t boundary;
 	char name[32];
-	struct list_head pools;
-};
-
-struct dma_page {
-	struct list_head page_list;
-	void *vaddr;
-	dma_addr_t dma;
-	unsigned int in_use;
-	unsigned int offset;
 };
 
 /**
@@ -50,7 +43,6 @@ struct dma_pool *dma_pool_create(const char *name, void *dev,
 				 size_t size, size_t align, size_t boundary)
 {
 	struct dma_pool *retval;
-	size_t allocation;
 
 	if (align == 0)
 		align = 1;
@@ -65,10 +57,8 @@ struct dma_pool *dma_pool_create(const char *name, void *dev,
 	if ((size % align) != 0)
 		size = ALIGN(size, align);
 
-	allocation = MAX_T(size_t, size, PAGE_SIZE);
-
 	if (!boundary)
-		boundary = allocation;
+		boundary = MAX_T(size_t, size, PAGE_SIZE);
 	else if ((boundary < size) || (boundary & (boundary - 1)))
 		return NULL;
 
@@ -79,89 +69,50 @@ struct dma_pool *dma_pool_create(const char *name, void *dev,
 	strlcpy(retval->name, name, sizeof(retval->name));
 
 	retval->dev = dev;	/* FIXME */
-
-	INIT_LIST_HEAD(&retval->page_list);
-	spinlock_init(&retval->lock);
 	retval->size = size;
-	retval->boundary = boundary;
-	retval->allocation = allocation;
-
-	INIT_LIST_HEAD(&retval->pools);
+	retval->cache = NULL;
+	if (size > PAGE_SIZE)
+		return retval;
+	if ((boundary < PAGE_SIZE) || (size > SLAB_LARGE_CUTOFF))
+		align = MAX_T(size_t, align, ROUNDUPPWR2(size));
+	retval->cache = kmem_cache_create(retval->name, size, align, 0, NULL,
+					  NULL, NULL, NULL);
 
 	/* TODO device_create_file */
 
 	return retval;
 }
 
+/* The caller must have freed all of the pool's blocks. */
 void dma_pool_destroy(struct dma_pool *pool)
 {
-	/* TODO */
-}
-
-static void pool_initialise_page(struct dma_pool *pool, struct dma_page *page)
-{
-	unsigned int offset = 0;
-	unsigned int next_boundary = pool->boundary;
-
-	do {
-		unsigned int next = offset + pool->size;
-		if (unlikely((next + pool->size) >= next_boundary)) {
-			next = next_boundary;
-			next_boundary += pool->boundary;
-		}
-		*(int *)(page->vaddr + offset) = next;
-		offset = next;
-	} while (offset < pool->allocation);
-}
-
-static struct dma_page *pool_alloc_page(struct dma_pool *pool, int mem_flags)
-{
-	struct dma_page *page;
-
-	page = kmalloc(sizeof(*page), mem_flags);
-	if (!page)
-		return NULL;
-	page->vaddr = dma_alloc_coherent(pool->dev, pool->allocation,
-					 &page->dma, mem_flags);
-	if (page->vaddr) {
-		pool_initialise_page(pool, page);
-		page->in_use = 0;
-		page->offset = 0;
-	} else {
-		kfree(page);
-		page = NULL;
-	}
-	return page;
+	if (!pool)
+		return;
+	if (pool->cache)
+		kmem_cache_destroy(pool->cache);
+	kfree(pool);
 }
 
 void *dma_pool_alloc(struct dma_pool *pool, int mem_flags, dma_addr_t *handle)
 {
-	struct dma_page *page;
-	size_t offset;
 	void *retval;
 
-	/* FIXME take care of locks */
-
-	list_for_each_entry(page, &pool->page_list, page_list) {
-		if (page->offset < pool->allocation)
-			goto ready;
-	}
-
-	page = pool_alloc_page(pool, mem_flags);
-	if (!page)
+	if (pool->cache)
+		retval = kmem_cache_alloc(pool->cache, mem_flags);
+	else
+		retval = get_cont_pages(LOG2_UP(nr_pages(pool->size)), mem_flags);
+	if (!retval)
 		return NULL;
-
-	list_add(&page->page_list, &pool->page_list);
-ready:
-	page->in_use++;
-	offset = page->offset;
-	page->offset = *(int *)(page->vaddr + offset);	/* "next" */
-	retval = offset + page->vaddr;
-	*handle = offset + page->dma;
+	*handle = PADDR(retval);
 	return retval;
 }
 
 void dma_pool_free(struct dma_pool *pool, void *vaddr, dma_addr_t addr)
 {
-	/* TODO */
+	if (!vaddr)
+		return;
+	if (pool->cache)
+		kmem_cache_free(pool->cache, vaddr);
+	else
+		free_cont_pages(vaddr, LOG2_UP(nr_pages(pool->size)));
 }
@@ -7,6 +7,8 @@
 #include <smp.h>
 #include <arch/arch.h>
 #include <umem.h>
+#include <kref.h>
+#include <ns.h>
 
 #ifdef CONFIG_64BIT
 # define elf_field(obj, field) (elf64 ? (obj##64)->field : (obj##32)->field)
@@ -34,6 +36,214 @@ fail:
 	return FALSE;
 }
 
+/* Parsed ELF and program headers.  We cache these by file, so launching the
+ * same program over and over doesn't reread and reparse them.  The segments
+ * are mmapped from the file's page map, so the text is already shared and the
+ * writable parts are already COW; the cache saves the rest of the work.
+ *
+ * Entries are keyed by the chan's device and qid path.  We stat the file on
+ * every lookup and only use an entry if the version, length and mtime haven't
+ * changed. */
+struct elf_image {
+	struct kref					kref;
+	int							type;
+	uint32_t					dev;
+	uint64_t					qid_path;
+	uint32_t					qid_vers;
+	uint64_t					length;
+	struct timespec				mtime;
+	unsigned long				last_use;
+
+	bool						elf64;
+	uintptr_t					entry;
+	uint16_t					phnum;
+	uint64_t					phoff;
+	size_t						phsz;
+	void						*phdrs;
+	bool						dynamic;
+	char						interp[256];
+};
+
+#define ELF_CACHE_NR			32
+
+static struct elf_image *elf_cache[ELF_CACHE_NR];
+static spinlock_t elf_cache_lock = SPINLOCK_INITIALIZER;
+static unsigned long elf_cache_clock;
+
+static void elf_image_release(struct kref *kref)
+{
+	struct elf_image *img = container_of(kref, struct elf_image, kref);
+
+	kfree(img->phdrs);
+	kfree(img);
+}
+
+static void elf_image_put(struct elf_image *img)
+{
+	kref_put(&img->kref);
+}
+
+/* Reads and checks the headers.  Returns an image with one ref, or NULL. */
+static struct elf_image *elf_image_parse(struct file_or_chan *foc)
+{
+	struct elf_image *img;
+	elf64_t elfhdr_storage;
+	elf32_t* elfhdr32 = (elf32_t*)&elfhdr_storage;
+	elf64_t* elfhdr64 = &elfhdr_storage;
+	bool elf32, elf64;
+
+	img = kzmalloc(sizeof(struct elf_image), MEM_WAIT);
+	kref_init(&img->kref, elf_image_release, 1);
+	if (foc_read(foc, (char*)elfhdr64, sizeof(elf64_t), 0)
+	        != sizeof(elf64_t)) {
+		/* if you ever debug this, be sure to 0 out elfhrd_storage in advance */
+		printk("[kernel] load_one_elf: failed to read file\n");
+		goto fail;
+	}
+	if (elfhdr64->e_magic != ELF_MAGIC) {
+		printk("[kernel] load_one_elf: file is not an elf!\n");
+		goto fail;
+	}
+	elf32 = elfhdr32->e_ident[ELF_IDENT_CLASS] == ELFCLASS32;
+	elf64 = elfhdr64->e_ident[ELF_IDENT_CLASS] == ELFCLASS64;
+	if (elf64 == elf32) {
+		printk("[kernel] load_one_elf: ID as both 32 and 64 bit\n");
+		goto fail;
+	}
+	#ifndef CONFIG_64BIT
+	if (elf64) {
+		printk("[kernel] load_one_elf: 64 bit elf on 32 bit kernel\n");
+		goto fail;
+	}
+	#endif
+	/* Not sure what RISCV's 64 bit kernel can do here, so this check is x86
+	 * only */
+	#ifdef CONFIG_X86
+	if (elf32) {
+		printk("[kernel] load_one_elf: 32 bit elf on 64 bit kernel\n");
+		goto fail;
+	}
+	#endif
+	img->elf64 = elf64;
+	img->phsz = elf64 ? sizeof(proghdr64_t) : sizeof(proghdr32_t);
+	img->phnum = elf_field(elfhdr, e_phnum);
+	img->phoff = elf_field(elfhdr, e_phoff);
+	img->entry = elf_field(elfhdr, e_entry);
+
+	/* Read in program headers. */
+	if (img->phnum > 10000 || img->phoff % (elf32 ? 4 : 8) != 0) {
+		printk("[kernel] load_one_elf: Bad program headers\n");
+		goto fail;
+	}
+	img->phdrs = kmalloc(img->phnum * img->phsz, 0);
+	if (!img->phdrs || foc_read(foc, img->phdrs, img->phnum * img->phsz,
+	                            img->phoff) != img->phnum * img->phsz) {
+		printk("[kernel] load_one_elf: could not get program headers\n");
+		goto fail;
+	}
+	for (int i = 0; i < img->phnum; i++) {
+		proghdr32_t* ph32 = (proghdr32_t*)img->phdrs + i;
+		proghdr64_t* ph64 = (proghdr64_t*)img->phdrs + i;
+		ssize_t maxlen = sizeof(img->interp);
+		ssize_t bytes;
+
+		if (elf_field(ph, p_type) != ELF_PROG_INTERP)
+			continue;
+		bytes = foc_read(foc, img->interp, maxlen, elf_field(ph, p_offset));
+		/* trying to catch errors.  don't know how big it could be, but it
+		 * should be at least 0. */
+		if (bytes <= 0) {
+			printk("[kernel] load_one_elf: could not read ei->interp\n");
+			goto fail;
+		}
+		maxlen = MIN(maxlen, bytes);
+		if (strnlen(img->interp, maxlen) == maxlen) {
+			printk("[kernel] load_one_elf: interpreter name too long\n");
+			goto fail;
+		}
+		img->dynamic = TRUE;
+	}
+	return img;
+fail:
+	elf_image_put(img);
+	return NULL;
+}
+
+static bool elf_image_is(struct elf_image *img, struct chan *c)
+{
+	return img->type == c->type && img->dev == c->dev &&
+	       img->qid_path == c->qid.path;
+}
+
+static bool elf_image_is_current(struct elf_image *img, struct dir *d)
+{
+	return img->qid_vers == d->qid.vers && img->length == d->length &&
+	       img->mtime.tv_sec == d->mtime.tv_sec &&
+	       img->mtime.tv_nsec == d->mtime.tv_nsec;
+}
+
+/* Puts img in the cache, replacing an old version of the same file, or else an
+ * empty slot, or else the least recently used entry. */
+static void elf_cache_insert(struct elf_image *img, struct chan *c)
+{
+	struct elf_image *old;
+	int victim = 0;
+
+	kref_get(&img->kref, 1);
+	spin_lock(&elf_cache_lock);
+	img->last_use = ++elf_cache_clock;
+	for (int i = 0; i < ELF_CACHE_NR; i++) {
+		if (!elf_cache[i] || elf_image_is(elf_cache[i], c)) {
+			victim = i;
+			break;
+		}
+		if (elf_cache[i]->last_use < elf_cache[victim]->last_use)
+			victim = i;
+	}
+	old = elf_cache[victim];
+	elf_cache[victim] = img;
+	spin_unlock(&elf_cache_lock);
+	if (old)
+		elf_image_put(old);
+}
+
+/* Returns the parsed headers for foc, with a ref, or NULL on error. */
+static struct elf_image *elf_image_get(struct file_or_chan *foc)
+{
+	struct chan *c = foc->chan;
+	struct elf_image *img;
+	struct dir *d;
+
+	/* If we can't stat it, we can't tell if a cached copy is current. */
+	d = chandirstat(c);
+	if (!d)
+		return elf_image_parse(foc);
+	spin_lock(&elf_cache_lock);
+	for (int i = 0; i < ELF_CACHE_NR; i++) {
+		img = elf_cache[i];
+		if (img && elf_image_is(img, c) && elf_image_is_current(img, d)) {
+			kref_get(&img->kref, 1);
+			img->last_use = ++elf_cache_clock;
+			spin_unlock(&elf_cache_lock);
+			kfree(d);
+			return img;
+		}
+	}
+	spin_unlock(&elf_cache_lock);
+	img = elf_image_parse(foc);
+	if (img) {
+		img->type = c->type;
+		img->dev = c->dev;
+		img->qid_path = c->qid.path;
+		img->qid_vers = d->qid.vers;
+		img->length = d->length;
+		img->mtime = d->mtime;
+		elf_cache_insert(img, c);
+	}
+	kfree(d);
+	return img;
+}
+
 static uintptr_t populate_stack(struct proc *p, int argc, char *argv[],
                                                 int envc, char *envp[],
                                                 int auxc, elf_aux_t auxv[])
@@ -139,68 +349,24 @@ static int load_one_elf(struct proc *p, struct file_or_chan *foc,
 	ei->phdr = -1;
 	ei->dynamic = 0;
 	ei->highest_addr = 0;
-	off64_t f_off = 0;
-	void* phdrs = 0;
+	struct elf_image *img;
 	int mm_perms, mm_flags;
 
 	/* When reading on behalf of the kernel, we need to switch to a ktask so
 	 * the VFS (and maybe other places) know. (TODO: KFOP) */
 	uintptr_t old_ret = switch_to_ktask();
 
-	/* Read in ELF header. */
-	elf64_t elfhdr_storage;
-	elf32_t* elfhdr32 = (elf32_t*)&elfhdr_storage;
-	elf64_t* elfhdr64 = &elfhdr_storage;
-	if (foc_read(foc, (char*)elfhdr64, sizeof(elf64_t), f_off)
-	        != sizeof(elf64_t)) {
-		/* if you ever debug this, be sure to 0 out elfhrd_storage in advance */
-		printk("[kernel] load_one_elf: failed to read file\n");
-		goto fail;
-	}
-	if (elfhdr64->e_magic != ELF_MAGIC) {
-		printk("[kernel] load_one_elf: file is not an elf!\n");
+	img = elf_image_get(foc);
+	if (!img)
 		goto fail;
-	}
-	bool elf32 = elfhdr32->e_ident[ELF_IDENT_CLASS] == ELFCLASS32;
-	bool elf64 = elfhdr64->e_ident[ELF_IDENT_CLASS] == ELFCLASS64;
-	if (elf64 == elf32) {
-		printk("[kernel] load_one_elf: ID as both 32 and 64 bit\n");
-		goto fail;
-	}
-	#ifndef CONFIG_64BIT
-	if (elf64) {
-		printk("[kernel] load_one_elf: 64 bit elf on 32 bit kernel\n");
-		goto fail;
-	}
-	#endif
-	/* Not sure what RISCV's 64 bit kernel can do here, so this check is x86
-	 * only */
-	#ifdef CONFIG_X86
-	if (elf32) {
-		printk("[kernel] load_one_elf: 32 bit elf on 64 bit kernel\n");
-		goto fail;
-	}
-	#endif
+	bool elf64 = img->elf64;
+	size_t phsz = img->phsz;
+	uint16_t e_phnum = img->phnum;
+	uint64_t e_phoff = img->phoff;
 
-	size_t phsz = elf64 ? sizeof(proghdr64_t) : sizeof(proghdr32_t);
-	uint16_t e_phnum = elf_field(elfhdr, e_phnum);
-	uint16_t e_phoff = elf_field(elfhdr, e_phoff);
-
-	/* Read in program headers. */
-	if (e_phnum > 10000 || e_phoff % (elf32 ? 4 : 8) != 0) {
-		printk("[kernel] load_one_elf: Bad program headers\n");
-		goto fail;
-	}
-	phdrs = kmalloc(e_phnum * phsz, 0);
-	f_off = e_phoff;
-	if (!phdrs || foc_read(foc, phdrs, e_phnum * phsz, f_off) !=
-	              e_phnum * phsz) {
-		printk("[kernel] load_one_elf: could not get program headers\n");
-		goto fail;
-	}
 	for (int i = 0; i < e_phnum; i++) {
-		proghdr32_t* ph32 = (proghdr32_t*)phdrs + i;
-		proghdr64_t* ph64 = (proghdr64_t*)phdrs + i;
+		proghdr32_t* ph32 = (proghdr32_t*)img->phdrs + i;
+		proghdr64_t* ph64 = (proghdr64_t*)img->phdrs + i;
 		uint16_t p_type = elf_field(ph, p_type);
 		uintptr_t p_va = elf_field(ph, p_va);
 		uintptr_t p_offset = elf_field(ph, p_offset);
@@ -219,22 +385,8 @@ static int load_one_elf(struct proc *p, struct file_or_chan *foc,
 		if (p_type == ELF_PROG_PHDR)
 			ei->phdr = p_va;
 		else if (p_type == ELF_PROG_INTERP) {
-			f_off = p_offset;
-			ssize_t maxlen = sizeof(ei->interp);
-			ssize_t bytes = foc_read(foc, ei->interp, maxlen, f_off);
-			/* trying to catch errors.  don't know how big it could be, but it
-			 * should be at least 0. */
-			if (bytes <= 0) {
-				printk("[kernel] load_one_elf: could not read ei->interp\n");
-				goto fail;
-			}
-
-			maxlen = MIN(maxlen, bytes);
-			if (strnlen(ei->interp, maxlen) == maxlen) {
-				printk("[kernel] load_one_elf: interpreter name too long\n");
-				goto fail;
-			}
-
+			/* elf_image_parse() checked the name */
+			memcpy(ei->interp, img->interp, sizeof(ei->interp));
 			ei->dynamic = 1;
 		}
 		else if (p_type == ELF_PROG_LOAD && p_memsz) {
@@ -342,14 +494,14 @@ static int load_one_elf(struct proc *p, struct file_or_chan *foc,
 		}
 		ei->phdr = (long)phdr_addr + e_phoff;
 	}
-	ei->entry = elf_field(elfhdr, e_entry) + pg_num * PGSIZE;
+	ei->entry = img->entry + pg_num * PGSIZE;
 	ei->phnum = e_phnum;
 	ei->elf64 = elf64;
 	ret = 0;
 	/* Fall-through */
 fail:
-	if (phdrs)
-		kfree(phdrs);
+	if (img)
+		elf_image_put(img);
 	switch_back_from_ktask(old_ret);
 	return ret;
 }
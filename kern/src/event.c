@@ -443,6 +443,16 @@ void send_event(struct proc *p, struct event_queue *ev_q, struct event_msg *msg,
 	 * call try_notify (IPI) later */
 	if (ev_q->ev_flags & EVENT_INDIR) {
 		send_indir(p, ev_q, vcoreid);
+	} else if (ev_q->ev_flags & EVENT_COALESCE) {
+		/* Like INDIR throttling: the consumer hasn't caught up with the alert
+		 * we already sent, and it will clear ev_alert_pending before draining
+		 * the mbox, so it'll see this message too.  Under load, this turns
+		 * thousands of notifs into one per pass over the mbox. */
+		if (!ev_q->ev_alert_pending) {
+			ev_q->ev_alert_pending = TRUE;
+			wmb();	/* pairs with the user's clear, then drain */
+			try_notify(p, vcoreid, ev_q->ev_flags);
+		}
 	} else {
 		/* they may want an IPI despite not wanting an INDIR */
 		try_notify(p, vcoreid, ev_q->ev_flags);
@@ -11,6 +11,7 @@
 #include <syscall.h>
 #include <error.h>
 #include <umem.h>
+#include <process.h>
 
 static void tap_min_release(struct kref *kref)
 {
@@ -26,6 +27,47 @@ static void tap_full_release(struct kref *kref)
 	tap_min_release(kref);
 }
 
+/* Returns fd's tap table slot, if there is one, as a user pointer.  Only
+ * dereference it in p's address space. */
+static struct fd_tap_slot *fd_tap_slot(struct proc *p, int fd)
+{
+	unsigned int nr_slots = ACCESS_ONCE(p->nr_tap_slots);
+
+	rmb();	/* pairs with set_fd_tap_table() */
+	if (fd < 0 || fd >= nr_slots)
+		return NULL;
+	return ACCESS_ONCE(p->tap_slots) + fd;
+}
+
+/* Registers (or with NULL data, unregisters) p's tap table.  We don't allow
+ * swapping one table for another, since fire_tap() reads the pointer and length
+ * without a lock. */
+int set_fd_tap_table(struct proc *p, struct fd_tap_req *tap_req)
+{
+	struct fd_tap_slot *slots = tap_req->data;
+	unsigned int nr_slots = tap_req->ev_id;
+
+	if (!slots) {
+		p->nr_tap_slots = 0;
+		wmb();
+		p->tap_slots = NULL;
+		return 0;
+	}
+	if (p->tap_slots) {
+		set_error(EBUSY, "Proc already has a tap table");
+		return -1;
+	}
+	if (!nr_slots || nr_slots > NR_FILE_DESC_MAX ||
+	    !is_user_rwaddr(slots, sizeof(struct fd_tap_slot) * nr_slots)) {
+		set_error(EINVAL, "Bad tap table %p, %u slots", slots, nr_slots);
+		return -1;
+	}
+	p->tap_slots = slots;
+	wmb();
+	p->nr_tap_slots = nr_slots;
+	return 0;
+}
+
 /* Adds a tap with the file/qid of the underlying device for the requested FD.
  * The FD must be a chan, and the device must support the filter requested.
  *
@@ -38,6 +80,8 @@ int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
 	int ret = 0;
 	struct chan *chan;
 	int fd = tap_req->fd;
+	struct fd_tap_slot *slot;
+	struct fd_tap_slot new_slot;
 
 	if (fd < 0) {
 		set_errno(EBADF);
@@ -93,6 +137,16 @@ int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req)
 	 * devices should be able to handle multiple, distinct taps, even if they
 	 * happen to have the same {proc, fd} tuple. */
 	spin_unlock(&fdt->lock);
+	/* The slot is ours now that we're the FD's tap, and the device can't fire
+	 * until we register.  We're in p's address space, and this touches the
+	 * page so fire_tap() won't fault.  If the slot is bad, the tap just works
+	 * without it. */
+	slot = fd_tap_slot(p, fd);
+	if (slot) {
+		new_slot.interest = tap->filter;
+		new_slot.ready = 0;
+		tap->has_slot = !memcpy_to_user(p, slot, &new_slot, sizeof(new_slot));
+	}
 	/* For refcnting fans, the tap ref is weak/uncounted.  We'll protect the
 	 * memory and call the device when tap is being released. */
 	ret = devtab[chan->type].tapfd(chan, tap, FDTAP_CMD_ADD);
@@ -150,9 +204,23 @@ int fire_tap(struct fd_tap *tap, int filter)
 	ERRSTACK(1);
 	struct event_msg ev_msg = {0};
 	int fire_filt = tap->filter & filter;
+	struct fd_tap_slot *slot;
+	uintptr_t old_proc;
 
 	if (!fire_filt)
 		return 0;
+	/* Taps from before the table was registered don't have a slot */
+	slot = tap->has_slot ? fd_tap_slot(tap->proc, tap->fd) : NULL;
+	if (slot) {
+		/* Record readiness even if they aren't interested right now, so they
+		 * can check for it later.  The slot is a user pointer. */
+		old_proc = switch_to(tap->proc);
+		__sync_fetch_and_or(&slot->ready, fire_filt);
+		fire_filt &= ACCESS_ONCE(slot->interest);
+		switch_back(tap->proc, old_proc);
+		if (!fire_filt)
+			return 0;
+	}
 	if (waserror()) {
 		/* The process owning the tap could trigger a kernel PF, as with any
 		 * send_event() call.  Eventually we'll catch that with waserror. */
@@ -24,6 +24,7 @@
 #include <manager.h>
 #include <testing.h>
 #include <kmalloc.h>
+#include <alloc_prof.h>
 #include <hashtable.h>
 #include <radix.h>
 #include <mm.h>
@@ -39,6 +40,10 @@
 #include <acpi.h>
 #include <coreboot_tables.h>
 #include <rcu.h>
+#include <numa.h>
+#include <taskqueue.h>
+#include <zpool.h>
+#include <zstore.h>
 
 #define MAX_BOOT_CMDLINE_SIZE 4096
 
@@ -58,6 +63,36 @@ static char boot_cmdline[MAX_BOOT_CMDLINE_SIZE];
 static void run_linker_funcs(void);
 static int run_init_script(void);
 
+#define MAX_BOOT_PHASES 32
+
+/* When each boot phase ended.  We can't convert TSC ticks to time until
+ * time_init(), so we print them all at the end. */
+static struct boot_phase {
+	const char *name;
+	uint64_t tsc;
+} boot_phases[MAX_BOOT_PHASES];
+static int nr_boot_phases;
+
+void boot_phase(const char *name)
+{
+	if (nr_boot_phases == MAX_BOOT_PHASES)
+		return;
+	boot_phases[nr_boot_phases].name = name;
+	boot_phases[nr_boot_phases].tsc = read_tsc();
+	nr_boot_phases++;
+}
+
+static void print_boot_phases(void)
+{
+	uint64_t start = boot_phases[0].tsc;
+
+	printk("Boot phases (usec, usec since start):\n");
+	for (int i = 1; i < nr_boot_phases; i++)
+		printk("\t%-16s %10llu %10llu\n", boot_phases[i].name,
+		       tsc2usec(boot_phases[i].tsc - boot_phases[i - 1].tsc),
+		       tsc2usec(boot_phases[i].tsc - start));
+}
+
 const char *get_boot_option(const char *base, const char *option, char *param,
 							size_t max_param)
 {
@@ -119,6 +154,7 @@ void kernel_init(multiboot_info_t *mboot_info)
 	extern char __start_bss[], __stop_bss[];
 
 	memset(__start_bss, 0, __stop_bss - __start_bss);
+	boot_phase("start");
 	/* mboot_info is a physical address.  while some arches currently have the
 	 * lower memory mapped, everyone should have it mapped at kernbase by now.
 	 * also, it might be in 'free' memory, so once we start dynamically using
@@ -131,21 +167,30 @@ void kernel_init(multiboot_info_t *mboot_info)
 	print_cpuinfo();
 
 	printk("Boot Command Line: '%s'\n", boot_cmdline);
+	boot_phase("console");
 
 	exception_table_init();
 	num_cores = get_early_num_cores();
 	pmem_init(multiboot_kaddr);
 	kmalloc_init();
+	alloc_prof_init();
+	jumbo_arena_init();
 	vmap_init();
+	boot_phase("memory");
 	hashtable_init();
 	radix_init();
 	acpiinit();
 	topology_init();
+	boot_phase("acpi");
+	kmem_cache_numa_init();
+	numa_init();
+	zpool_init();
 	percpu_init();
 	kthread_init();					/* might need to tweak when this happens */
 	vmr_init();
 	page_check();
 	idt_init();
+	boot_phase("kthreads");
 	/* After kthread_init and idt_init, we can use a real kstack. */
 	__use_real_kstack(__kernel_init_part_deux);
 }
@@ -155,19 +200,30 @@ static void __kernel_init_part_deux(void *arg)
 	kernel_msg_init();
 	timer_init();
 	time_init();
+	boot_phase("timers");
 	arch_init();
+	boot_phase("arch and smp");
 	rcu_init();
+	kmem_reclaim_init();
+	workqueue_init();
+	zstore_init();
 	enable_irq();
 	run_linker_funcs();
+	boot_phase("linker funcs");
 	/* reset/init devtab after linker funcs 3 and 4.  these run NIC and medium
 	 * pre-inits, which need to happen before devether. */
 	devtabreset();
+	boot_phase("devtab reset");
 	devtabinit();
+	boot_phase("devtab init");
 
 #ifdef CONFIG_ETH_AUDIO
 	eth_audio_init();
 #endif /* CONFIG_ETH_AUDIO */
 	get_coreboot_info(&sysinfo);
+	printk_drain_init();
+	boot_phase("done");
+	print_boot_phases();
 	booting = FALSE;
 
 #ifdef CONFIG_RUN_INIT_SCRIPT
@@ -250,6 +306,7 @@ void _panic(const char *file, int line, const char *fmt,...)
 	pcpui = &per_cpu_info[core_id_early()];
 	pcpui->__lock_checking_enabled--;
 
+	printk_emergency();
 	if (!PERCPU_VAR(panic_depth)) {
 		spin_lock_irqsave(&panic_lock);
 		panic_printing = true;
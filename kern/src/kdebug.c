@@ -164,24 +164,24 @@ void set_printx(int mode)
 void debug_addr_proc(struct proc *p, unsigned long addr)
 {
 	struct vm_region *vmr;
-	spin_lock(&p->vmr_lock);
+	spin_rlock(&p->vmr_lock);
 	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
 		if ((vmr->vm_base <= addr) && (addr < vmr->vm_end))
 			break;
 	}
 	if (!vmr) {
-		spin_unlock(&p->vmr_lock);
+		spin_runlock(&p->vmr_lock);
 		printk("Addr %p has no VMR\n", addr);
 		return;
 	}
 	if (!vmr_has_file(vmr)) {
-		spin_unlock(&p->vmr_lock);
+		spin_runlock(&p->vmr_lock);
 		printk("Addr %p's VMR has no file\n", addr);
 		return;
 	}
 	printk("Addr %p is in %s at offset %p\n", addr, vmr_to_filename(vmr),
 	       addr - vmr->vm_base + vmr->vm_foff);
-	spin_unlock(&p->vmr_lock);
+	spin_runlock(&p->vmr_lock);
 }
 
 void debug_addr_pid(int pid, unsigned long addr)
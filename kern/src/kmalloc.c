@@ -12,6 +12,8 @@
 #include <stdio.h>
 #include <slab.h>
 #include <assert.h>
+#include <alloc_prof.h>
+#include <percpu.h>
 
 #define kmallocdebug(args...)  //printk(args)
 
@@ -21,11 +23,28 @@ static page_list_t pages_list;
 
 struct kmem_cache *kmalloc_caches[NUM_KMALLOC_CACHES];
 
+/* Object sizes of the kmalloc caches.  For normal kmallocs, these include the
+ * kmalloc_tag.  The powers of two alone waste up to half of an object, and a
+ * lot of our hot objects are in the 72-200 byte range, which is where that
+ * hurts the most. */
+static const size_t kmalloc_sizes[NUM_KMALLOC_CACHES] = {
+	16, 32, 48, 64,
+	80, 96, 112, 128,
+	160, 192, 224, 256,
+	320, 384, 448, 512,
+	640, 768, 896, 1024,
+	1280, 1536, 1792, 2048,
+};
+
+/* Maps a size, in units of KMALLOC_ALIGNMENT (rounded up), to its cache. */
+static uint8_t kmalloc_size_to_id[KMALLOC_LARGEST / KMALLOC_ALIGNMENT + 1];
+
 static void __kfree_release(struct kref *kref);
 
 void kmalloc_init(void)
 {
 	char kc_name[KMC_NAME_SZ];
+	size_t ksize;
 
 	/* we want at least a 16 byte alignment of the tag so that the bufs kmalloc
 	 * returns are 16 byte aligned.  we used to check the actual size == 16,
@@ -33,15 +52,31 @@ void kmalloc_init(void)
 	static_assert(ALIGNED(sizeof(struct kmalloc_tag), 16));
 	/* build caches of common sizes.  this size will later include the tag and
 	 * the actual returned buffer. */
-	size_t ksize = KMALLOC_SMALLEST;
 	for (int i = 0; i < NUM_KMALLOC_CACHES; i++) {
+		ksize = kmalloc_sizes[i];
+		assert(ALIGNED(ksize, KMALLOC_ALIGNMENT));
+		assert(ksize <= KMALLOC_LARGEST);
 		snprintf(kc_name, KMC_NAME_SZ, "kmalloc_%d", ksize);
 		kmalloc_caches[i] = kmem_cache_create(kc_name, ksize, KMALLOC_ALIGNMENT,
 		                                      0, NULL, 0, 0, NULL);
-		ksize <<= 1;
+	}
+	/* each slot gets the smallest cache that fits (the sizes are sorted). */
+	for (int slot = 0, i = 0; slot < ARRAY_SIZE(kmalloc_size_to_id); slot++) {
+		while (kmalloc_sizes[i] < slot * KMALLOC_ALIGNMENT)
+			i++;
+		kmalloc_size_to_id[slot] = i;
 	}
 }
 
+/* Returns the kmalloc cache for an object of size ksize, or -1 if it is too big
+ * for the caches. */
+static int __kmalloc_cache_id(size_t ksize)
+{
+	if (ksize > KMALLOC_LARGEST)
+		return -1;
+	return kmalloc_size_to_id[DIV_ROUND_UP(ksize, KMALLOC_ALIGNMENT)];
+}
+
 void *kmalloc(size_t size, int flags)
 {
 	// reserve space for bookkeeping and preserve alignment
@@ -49,12 +84,9 @@ void *kmalloc(size_t size, int flags)
 	void *buf;
 	int cache_id;
 	// determine cache to pull from
-	if (ksize <= KMALLOC_SMALLEST)
-		cache_id = 0;
-	else
-		cache_id = LOG2_UP(ksize) - LOG2_UP(KMALLOC_SMALLEST);
+	cache_id = __kmalloc_cache_id(ksize);
 	// if we don't have a cache to handle it, alloc cont pages
-	if (cache_id >= NUM_KMALLOC_CACHES) {
+	if (cache_id < 0) {
 		/* The arena allocator will round up too, but we want to know in advance
 		 * so that krealloc can avoid extra allocations. */
 		size_t amt_alloc = ROUNDUP(size + sizeof(struct kmalloc_tag), PGSIZE);
@@ -68,6 +100,8 @@ void *kmalloc(size_t size, int flags)
 		tag->amt_alloc = amt_alloc;
 		tag->canary = KMALLOC_CANARY;
 		kref_init(&tag->kref, __kfree_release, 1);
+		/* slab allocs are profiled by the slab layer */
+		alloc_prof_alloc(NULL, buf, amt_alloc);
 		return buf + sizeof(struct kmalloc_tag);
 	}
 	// else, alloc from the appropriate cache
@@ -170,6 +204,8 @@ void *krealloc(void* buf, size_t size, int flags)
 			osize = tag->my_cache->obj_size - sizeof(struct kmalloc_tag);
 		} else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_PAGES) {
 			osize = tag->amt_alloc - sizeof(struct kmalloc_tag);
+		} else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_FRAG) {
+			osize = tag->flags >> KMALLOC_ALIGN_SHIFT;
 		} else {
 			panic("Probably a bad tag, flags %p\n", tag->flags);
 		}
@@ -220,8 +256,12 @@ static void __kfree_release(struct kref *kref)
 	struct kmalloc_tag *tag = container_of(kref, struct kmalloc_tag, kref);
 	if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_CACHE)
 		kmem_cache_free(tag->my_cache, tag);
-	else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_PAGES)
+	else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_PAGES) {
+		alloc_prof_free(NULL, tag);
 		kpages_free(tag, tag->amt_alloc);
+	}
+	else if ((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_FRAG)
+		kref_put(&tag->frag_chunk->kref);
 	else
 		panic("Bad flag 0x%x in %s", tag->flags, __FUNCTION__);
 }
@@ -236,6 +276,134 @@ void kfree(void *buf)
 	kref_put(&__get_km_tag(buf)->kref);
 }
 
+/* Tagless allocations, for callers who know the size of the object when they
+ * free it.  We skip the kmalloc_tag, so the object is smaller (often a smaller
+ * size class), and kfree_sized() doesn't need to touch the object's memory.
+ *
+ * These are not kmalloc buffers: don't kfree(), krealloc(), or
+ * kmalloc_incref() them.  Free with kfree_sized(), passing the same size.
+ * Unlike kmalloc(), these return 0 on failure. */
+void *kmalloc_sized(size_t size, int flags)
+{
+	int cache_id = __kmalloc_cache_id(size);
+	void *buf;
+
+	if (cache_id < 0) {
+		buf = kpages_alloc(ROUNDUP(size, PGSIZE), flags);
+		if (buf)
+			alloc_prof_alloc(NULL, buf, ROUNDUP(size, PGSIZE));
+		return buf;
+	}
+	return kmem_cache_alloc(kmalloc_caches[cache_id], flags);
+}
+
+void *kzmalloc_sized(size_t size, int flags)
+{
+	void *v = kmalloc_sized(size, flags);
+
+	if (!v)
+		return v;
+	memset(v, 0, size);
+	return v;
+}
+
+void kfree_sized(void *buf, size_t size)
+{
+	int cache_id;
+
+	if (!buf)
+		return;
+	cache_id = __kmalloc_cache_id(size);
+	if (cache_id < 0) {
+		alloc_prof_free(NULL, buf);
+		kpages_free(buf, ROUNDUP(size, PGSIZE));
+	} else
+		kmem_cache_free(kmalloc_caches[cache_id], buf);
+}
+
+/* Page frags: small buffers carved out of per-core chunks of pages, with a bump
+ * pointer.  They are kmalloc buffers as far as everyone else is concerned:
+ * kfree(), kmalloc_incref(), and krealloc() work.  Each frag holds a ref on its
+ * chunk, and so does the core's pool until it moves on to a new chunk.
+ *
+ * These are meant for things like network buffers, which are mostly the same
+ * size, allocated and freed on different cores, and don't need their own
+ * slab objects.  A long-lived frag will pin its whole chunk, so don't use these
+ * for things that stick around.  Like kmalloc_sized(), this returns 0 on
+ * failure. */
+struct kmalloc_frag_pool {
+	struct kmalloc_frag_chunk	*chunk;
+	size_t						off;
+};
+
+static DEFINE_PERCPU(struct kmalloc_frag_pool, kmalloc_frag_pools);
+
+static void __frag_chunk_release(struct kref *kref)
+{
+	struct kmalloc_frag_chunk *chunk = container_of(kref,
+	                                                struct kmalloc_frag_chunk,
+	                                                kref);
+
+	kpages_free(chunk, chunk->size);
+}
+
+/* Returns the offset of a frag of @size in the pool's chunk, or 0 if it won't
+ * fit.  The data after the tag is cache-line aligned, for DMA. */
+static size_t __frag_fits(struct kmalloc_frag_pool *pool, size_t size)
+{
+	size_t start;
+
+	if (!pool->chunk)
+		return 0;
+	start = ROUNDUP(pool->off + sizeof(struct kmalloc_tag), ARCH_CL_SIZE)
+	        - sizeof(struct kmalloc_tag);
+	if (start + sizeof(struct kmalloc_tag) + size > pool->chunk->size)
+		return 0;
+	return start;
+}
+
+void *kmalloc_frag(size_t size, int flags)
+{
+	struct kmalloc_frag_pool *pool;
+	struct kmalloc_frag_chunk *chunk, *old_chunk;
+	struct kmalloc_tag *tag;
+	size_t start;
+	int8_t irq_state = 0;
+
+	if (size > KMALLOC_FRAG_MAX)
+		return kmalloc(size, flags);
+	/* IRQ handlers allocate frags too (NIC rx), so the pool is irqsave. */
+	disable_irqsave(&irq_state);
+	pool = PERCPU_VARPTR(kmalloc_frag_pools);
+	while (!(start = __frag_fits(pool, size))) {
+		/* The alloc might block, and we might come back on another core. */
+		enable_irqsave(&irq_state);
+		chunk = kpages_alloc(KMALLOC_FRAG_CHUNK_SZ, flags);
+		if (!chunk)
+			return 0;
+		chunk->size = KMALLOC_FRAG_CHUNK_SZ;
+		kref_init(&chunk->kref, __frag_chunk_release, 1);
+		disable_irqsave(&irq_state);
+		pool = PERCPU_VARPTR(kmalloc_frag_pools);
+		old_chunk = pool->chunk;
+		pool->chunk = chunk;
+		pool->off = sizeof(struct kmalloc_frag_chunk);
+		if (old_chunk)
+			kref_put(&old_chunk->kref);
+	}
+	chunk = pool->chunk;
+	pool->off = start + sizeof(struct kmalloc_tag) + size;
+	kref_get(&chunk->kref, 1);
+	enable_irqsave(&irq_state);
+
+	tag = (void*)chunk + start;
+	tag->flags = (size << KMALLOC_ALIGN_SHIFT) | KMALLOC_TAG_FRAG;
+	tag->frag_chunk = chunk;
+	tag->canary = KMALLOC_CANARY;
+	kref_init(&tag->kref, __kfree_release, 1);
+	return tag + 1;
+}
+
 void kmalloc_canary_check(char *str)
 {
 	if (!debug_canary)
@@ -0,0 +1,325 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Arena allocation benchmarks.
+ *
+ * These run fixed allocation/free mixes against private arenas built with
+ * arena_create(), once per allocation policy (and with and without qcaches),
+ * and report the cost per op, the fragmentation left behind, and how many
+ * btags the arena needed.  The arenas manage a fake address range; arenas never
+ * touch the memory they hand out, and qcaches are always KMC_NOTOUCH, so
+ * nothing is ever dereferenced.
+ *
+ * Fragmentation is reported as the percentage of free space that is not in
+ * the largest free segment: 0% means all free space is contiguous. */
+
+#include <arena.h>
+#include <slab.h>
+#include <smp.h>
+#include <core_set.h>
+#include <ktest.h>
+#include <linker_func.h>
+
+KTEST_SUITE("ARENA")
+
+#define AB_BASE				((void*)0x10000000000)
+#define AB_QUANTUM			PGSIZE
+#define AB_SIZE				(1UL << 30)
+#define AB_NR_OBJS			4096
+#define AB_NR_ROUNDS		16
+
+struct arena_bench_cfg {
+	char						*name;
+	int							policy;
+	size_t						qcache_max;
+};
+
+/* NEXTFIT can't be used with qcaches; see arena_alloc(). */
+static struct arena_bench_cfg ab_cfgs[] = {
+	{"bestfit",		ARENA_BESTFIT,		0},
+	{"instantfit",	ARENA_INSTANTFIT,	0},
+	{"nextfit",		ARENA_NEXTFIT,		0},
+	{"bestfit+qc",	ARENA_BESTFIT,		8 * AB_QUANTUM},
+	{"instfit+qc",	ARENA_INSTANTFIT,	8 * AB_QUANTUM},
+};
+
+struct arena_bench_obj {
+	void						*addr;
+	size_t						size;
+};
+
+/* Cheap, deterministic PRNG, so runs are repeatable. */
+static uint32_t ab_rand(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static struct arena *ab_arena_create(struct arena_bench_cfg *cfg)
+{
+	return arena_create("arena_bench", AB_BASE, AB_SIZE, AB_QUANTUM, NULL,
+	                    NULL, NULL, cfg->qcache_max, MEM_WAIT);
+}
+
+static size_t ab_nr_btags(struct arena *arena)
+{
+	struct rb_node *rb_i;
+	struct btag *bt_i;
+	size_t nr = 0;
+
+	spin_lock_irqsave(&arena->lock);
+	for (rb_i = rb_first(&arena->all_segs); rb_i; rb_i = rb_next(rb_i))
+		nr++;
+	BSD_LIST_FOREACH(bt_i, &arena->unused_btags, misc_link)
+		nr++;
+	spin_unlock_irqsave(&arena->lock);
+	return nr;
+}
+
+static size_t ab_largest_free(struct arena *arena)
+{
+	struct btag *bt_i;
+	size_t largest = 0;
+
+	spin_lock_irqsave(&arena->lock);
+	for (int i = ARENA_NR_FREE_LISTS - 1; i >= 0; i--) {
+		BSD_LIST_FOREACH(bt_i, &arena->free_segs[i], misc_link)
+			largest = MAX(largest, bt_i->size);
+		if (largest)
+			break;
+	}
+	spin_unlock_irqsave(&arena->lock);
+	return largest;
+}
+
+static void ab_report(const char *test, struct arena_bench_cfg *cfg,
+                      struct arena *arena, uint64_t tsc, size_t nr_ops)
+{
+	size_t amt_free = arena_amt_free(arena);
+	size_t frag_pct = 0;
+
+	if (amt_free)
+		frag_pct = 100 - (ab_largest_free(arena) * 100) / amt_free;
+	printk("\t%-12s %-11s: %6llu ns/op, frag %3lu%%, btags %lu\n", test,
+	       cfg->name, tsc2nsec(tsc) / MAX(nr_ops, 1), frag_pct,
+	       ab_nr_btags(arena));
+}
+
+static size_t ab_free_all(struct arena *arena, struct arena_bench_obj *objs,
+                          size_t nr)
+{
+	for (int i = 0; i < nr; i++) {
+		if (!objs[i].addr)
+			continue;
+		arena_free(arena, objs[i].addr, objs[i].size);
+		objs[i].addr = NULL;
+	}
+	return nr;
+}
+
+static bool ab_alloc_one(struct arena *arena, struct arena_bench_cfg *cfg,
+                         struct arena_bench_obj *obj, size_t size)
+{
+	obj->size = size;
+	obj->addr = arena_alloc(arena, size, cfg->policy | MEM_ATOMIC);
+	return obj->addr != NULL;
+}
+
+/* Without qcaches, everything we freed must be back in the arena. */
+static bool ab_all_returned(struct arena *arena, struct arena_bench_cfg *cfg)
+{
+	if (cfg->qcache_max)
+		return TRUE;
+	return arena_amt_free(arena) == arena_amt_total(arena);
+}
+
+/* Allocate a burst of same-sized objects, then free them all, repeatedly.  This
+ * is the qcache's best case. */
+bool test_arena_bench_bursty(void)
+{
+	struct arena_bench_obj *objs;
+	struct arena *arena;
+	uint64_t start, tsc;
+	size_t nr_ops;
+
+	objs = kzmalloc(sizeof(struct arena_bench_obj) * AB_NR_OBJS, MEM_WAIT);
+	for (int c = 0; c < ARRAY_SIZE(ab_cfgs); c++) {
+		arena = ab_arena_create(&ab_cfgs[c]);
+		KT_ASSERT_M("Failed to create arena", arena);
+		nr_ops = 0;
+		start = read_tsc();
+		for (int r = 0; r < AB_NR_ROUNDS; r++) {
+			for (int i = 0; i < AB_NR_OBJS; i++, nr_ops++)
+				KT_ASSERT_M("Bursty alloc failed",
+				            ab_alloc_one(arena, &ab_cfgs[c], &objs[i],
+				                         AB_QUANTUM));
+			nr_ops += ab_free_all(arena, objs, AB_NR_OBJS);
+		}
+		tsc = read_tsc() - start;
+		ab_report("bursty", &ab_cfgs[c], arena, tsc, nr_ops);
+		KT_ASSERT_M("Arena leaked segments", ab_all_returned(arena,
+		                                                     &ab_cfgs[c]));
+		arena_destroy(arena);
+	}
+	kfree(objs);
+	return true;
+}
+
+/* Mostly small objects, with the occasional large one.  Objects are replaced
+ * at random, so the arena sees a steady-state mix. */
+bool test_arena_bench_size_skewed(void)
+{
+	struct arena_bench_obj *objs;
+	struct arena *arena;
+	uint64_t start, tsc;
+	uint32_t seed, idx;
+	size_t nr_ops, size;
+
+	objs = kzmalloc(sizeof(struct arena_bench_obj) * AB_NR_OBJS, MEM_WAIT);
+	for (int c = 0; c < ARRAY_SIZE(ab_cfgs); c++) {
+		arena = ab_arena_create(&ab_cfgs[c]);
+		KT_ASSERT_M("Failed to create arena", arena);
+		seed = 0xdecafbad;
+		nr_ops = 0;
+		start = read_tsc();
+		for (int i = 0; i < AB_NR_ROUNDS * AB_NR_OBJS; i++, nr_ops++) {
+			idx = ab_rand(&seed) % AB_NR_OBJS;
+			if (objs[idx].addr) {
+				arena_free(arena, objs[idx].addr, objs[idx].size);
+				objs[idx].addr = NULL;
+				nr_ops++;
+			}
+			/* 15/16 are 1-4 pages, the rest are 16-64 pages */
+			if (ab_rand(&seed) % 16)
+				size = (1 + ab_rand(&seed) % 4) * AB_QUANTUM;
+			else
+				size = (16 + ab_rand(&seed) % 49) * AB_QUANTUM;
+			KT_ASSERT_M("Skewed alloc failed",
+			            ab_alloc_one(arena, &ab_cfgs[c], &objs[idx], size));
+		}
+		tsc = read_tsc() - start;
+		ab_report("size_skewed", &ab_cfgs[c], arena, tsc, nr_ops);
+		ab_free_all(arena, objs, AB_NR_OBJS);
+		KT_ASSERT_M("Arena leaked segments", ab_all_returned(arena,
+		                                                     &ab_cfgs[c]));
+		arena_destroy(arena);
+	}
+	kfree(objs);
+	return true;
+}
+
+/* Fill the arena with small objects, free every other one, then ask for
+ * objects that can't fit in the holes.  The report is taken while the holes
+ * are still there, so it shows how much the policy fragmented the arena. */
+bool test_arena_bench_fragmenting(void)
+{
+	struct arena_bench_obj *objs, *big;
+	struct arena *arena;
+	uint64_t start, tsc;
+	size_t nr_ops;
+
+	objs = kzmalloc(sizeof(struct arena_bench_obj) * AB_NR_OBJS, MEM_WAIT);
+	big = kzmalloc(sizeof(struct arena_bench_obj) * AB_NR_OBJS / 2, MEM_WAIT);
+	for (int c = 0; c < ARRAY_SIZE(ab_cfgs); c++) {
+		arena = ab_arena_create(&ab_cfgs[c]);
+		KT_ASSERT_M("Failed to create arena", arena);
+		nr_ops = 0;
+		start = read_tsc();
+		for (int i = 0; i < AB_NR_OBJS; i++, nr_ops++)
+			KT_ASSERT_M("Fragmenting alloc failed",
+			            ab_alloc_one(arena, &ab_cfgs[c], &objs[i],
+			                         (1 + i % 3) * AB_QUANTUM));
+		for (int i = 0; i < AB_NR_OBJS; i += 2, nr_ops++) {
+			arena_free(arena, objs[i].addr, objs[i].size);
+			objs[i].addr = NULL;
+		}
+		for (int i = 0; i < AB_NR_OBJS / 2; i++, nr_ops++)
+			KT_ASSERT_M("Fragmenting big alloc failed",
+			            ab_alloc_one(arena, &ab_cfgs[c], &big[i],
+			                         16 * AB_QUANTUM));
+		tsc = read_tsc() - start;
+		ab_report("fragmenting", &ab_cfgs[c], arena, tsc, nr_ops);
+		ab_free_all(arena, objs, AB_NR_OBJS);
+		ab_free_all(arena, big, AB_NR_OBJS / 2);
+		KT_ASSERT_M("Arena leaked segments", ab_all_returned(arena,
+		                                                     &ab_cfgs[c]));
+		arena_destroy(arena);
+	}
+	kfree(big);
+	kfree(objs);
+	return true;
+}
+
+#define AB_MC_NR_OBJS		256
+
+struct arena_bench_mc {
+	struct arena				*arena;
+	struct arena_bench_cfg		*cfg;
+	atomic_t					nr_failed;
+};
+
+static void __arena_bench_mc(void *opaque)
+{
+	struct arena_bench_mc *mc = opaque;
+	struct arena_bench_obj *objs;
+	uint32_t seed = 0xfeed0000 + core_id();
+
+	objs = kzmalloc(sizeof(struct arena_bench_obj) * AB_MC_NR_OBJS, MEM_WAIT);
+
+	for (int r = 0; r < AB_NR_ROUNDS; r++) {
+		for (int i = 0; i < AB_MC_NR_OBJS; i++) {
+			if (!ab_alloc_one(mc->arena, mc->cfg, &objs[i],
+			                  (1 + ab_rand(&seed) % 4) * AB_QUANTUM)) {
+				atomic_inc(&mc->nr_failed);
+				objs[i].addr = NULL;
+			}
+		}
+		ab_free_all(mc->arena, objs, AB_MC_NR_OBJS);
+	}
+	kfree(objs);
+}
+
+/* Every core hammers the same arena with small allocs and frees.  ns/op is the
+ * wall-clock time divided by the total ops across all cores. */
+bool test_arena_bench_concurrent(void)
+{
+	struct arena_bench_mc mc;
+	struct core_set cset;
+	uint64_t start, tsc;
+	size_t nr_ops;
+
+	core_set_init(&cset);
+	core_set_fill_available(&cset);
+	for (int c = 0; c < ARRAY_SIZE(ab_cfgs); c++) {
+		mc.arena = ab_arena_create(&ab_cfgs[c]);
+		KT_ASSERT_M("Failed to create arena", mc.arena);
+		mc.cfg = &ab_cfgs[c];
+		atomic_init(&mc.nr_failed, 0);
+		nr_ops = (size_t)num_cores * AB_NR_ROUNDS * AB_MC_NR_OBJS * 2;
+		start = read_tsc();
+		smp_do_in_cores(&cset, __arena_bench_mc, &mc);
+		tsc = read_tsc() - start;
+		ab_report("concurrent", &ab_cfgs[c], mc.arena, tsc, nr_ops);
+		KT_ASSERT_M("Concurrent alloc failed", !atomic_read(&mc.nr_failed));
+		KT_ASSERT_M("Arena leaked segments", ab_all_returned(mc.arena,
+		                                                     &ab_cfgs[c]));
+		arena_destroy(mc.arena);
+	}
+	return true;
+}
+
+static struct ktest ktests[] = {
+	KTEST_REG(arena_bench_bursty,		CONFIG_TEST_arena_bench_bursty),
+	KTEST_REG(arena_bench_size_skewed,	CONFIG_TEST_arena_bench_size_skewed),
+	KTEST_REG(arena_bench_fragmenting,	CONFIG_TEST_arena_bench_fragmenting),
+	KTEST_REG(arena_bench_concurrent,	CONFIG_TEST_arena_bench_concurrent),
+};
+
+static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
+
+linker_func_1(register_arena_ktests)
+{
+	REGISTER_KTESTS(ktests, num_ktests);
+}
@@ -0,0 +1,144 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Kmem cache regression gates.
+ *
+ * Each test runs a fixed alloc/free workload against its own kmem cache and
+ * measures the magazine hit rate (see kmem_cache_get_stats()) and the average
+ * time for an alloc and its free.  The cache is warmed up first, so we don't
+ * count building the first mags and slabs.
+ *
+ * A test fails if the hit rate drops below CONFIG_KMEM_KTESTS_MIN_HIT_PCT, or
+ * if the time goes over CONFIG_KMEM_KTESTS_MAX_NSEC, when those are set. */
+
+#include <slab.h>
+#include <time.h>
+#include <ktest.h>
+#include <linker_func.h>
+
+KTEST_SUITE("KMEM")
+
+#define KMEM_GATE_OBJSZ			64
+#define KMEM_GATE_ROUNDS		1000
+#define KMEM_GATE_BURST			256
+
+struct kmem_gate {
+	char						*name;
+	/* Does one round of the workload, returns how many objects it alloced */
+	size_t (*run)(struct kmem_cache *kc);
+};
+
+static bool kmem_gate_test(struct kmem_gate *kg)
+{
+	struct kmem_cache *kc;
+	struct kmem_cache_stats before, after;
+	uint64_t t0, nsec;
+	size_t nr = 0;
+	unsigned int hit_pct;
+
+	kc = kmem_cache_create(kg->name, KMEM_GATE_OBJSZ, 8, 0, NULL, NULL, NULL,
+	                       NULL);
+	kg->run(kc);
+	kmem_cache_get_stats(kc, &before);
+	t0 = read_tsc();
+	for (int i = 0; i < KMEM_GATE_ROUNDS; i++)
+		nr += kg->run(kc);
+	nsec = tsc2nsec(read_tsc() - t0) / MAX(nr, 1);
+	kmem_cache_get_stats(kc, &after);
+	kmem_cache_destroy(kc);
+
+	after.nr_allocs -= before.nr_allocs;
+	after.nr_frees -= before.nr_frees;
+	after.nr_mag_hits -= before.nr_mag_hits;
+	after.nr_depot_trips -= before.nr_depot_trips;
+	after.nr_slab_allocs -= before.nr_slab_allocs;
+	hit_pct = kmem_stats_hit_pct(&after);
+	printk("kmem %s: %lu nsec/alloc+free, %u%% mag hits, %lu depot mags, ",
+	       kg->name, nsec, hit_pct, after.nr_depot_trips);
+	printk("%lu slab allocs\n", after.nr_slab_allocs);
+	KT_ASSERT_M("Hit rate fell below CONFIG_KMEM_KTESTS_MIN_HIT_PCT",
+	            hit_pct >= CONFIG_KMEM_KTESTS_MIN_HIT_PCT);
+	KT_ASSERT_M("Alloc+free took longer than CONFIG_KMEM_KTESTS_MAX_NSEC",
+	            !CONFIG_KMEM_KTESTS_MAX_NSEC ||
+	            nsec <= CONFIG_KMEM_KTESTS_MAX_NSEC);
+	return true;
+}
+
+/* pairs: the common case, where everything stays in the loaded mag. */
+static size_t kmem_gate_pairs_run(struct kmem_cache *kc)
+{
+	void *obj;
+
+	for (int i = 0; i < KMEM_GATE_BURST; i++) {
+		obj = kmem_cache_alloc(kc, MEM_WAIT);
+		kmem_cache_free(kc, obj);
+	}
+	return KMEM_GATE_BURST;
+}
+
+static struct kmem_gate kmem_gate_pairs = {
+	.name = "kmem_gate_pairs",
+	.run = kmem_gate_pairs_run,
+};
+
+static bool test_kmem_gate_pairs(void)
+{
+	return kmem_gate_test(&kmem_gate_pairs);
+}
+
+/* burst: more objects than the pcc's two mags hold, so we trade full and
+ * empty mags with the depot on the way up and back down. */
+static void *kmem_gate_objs[KMEM_GATE_BURST];
+
+static size_t kmem_gate_burst_run(struct kmem_cache *kc)
+{
+	for (int i = 0; i < KMEM_GATE_BURST; i++)
+		kmem_gate_objs[i] = kmem_cache_alloc(kc, MEM_WAIT);
+	for (int i = 0; i < KMEM_GATE_BURST; i++)
+		kmem_cache_free(kc, kmem_gate_objs[i]);
+	return KMEM_GATE_BURST;
+}
+
+static struct kmem_gate kmem_gate_burst = {
+	.name = "kmem_gate_burst",
+	.run = kmem_gate_burst_run,
+};
+
+static bool test_kmem_gate_burst(void)
+{
+	return kmem_gate_test(&kmem_gate_burst);
+}
+
+/* batch: the same burst through the batch interface. */
+static size_t kmem_gate_batch_run(struct kmem_cache *kc)
+{
+	size_t nr;
+
+	nr = kmem_cache_alloc_batch(kc, kmem_gate_objs, KMEM_GATE_BURST,
+	                            MEM_WAIT);
+	kmem_cache_free_batch(kc, kmem_gate_objs, nr);
+	return nr;
+}
+
+static struct kmem_gate kmem_gate_batch = {
+	.name = "kmem_gate_batch",
+	.run = kmem_gate_batch_run,
+};
+
+static bool test_kmem_gate_batch(void)
+{
+	return kmem_gate_test(&kmem_gate_batch);
+}
+
+static struct ktest ktests[] = {
+	KTEST_REG(kmem_gate_pairs,	CONFIG_TEST_kmem_gate_pairs),
+	KTEST_REG(kmem_gate_burst,	CONFIG_TEST_kmem_gate_burst),
+	KTEST_REG(kmem_gate_batch,	CONFIG_TEST_kmem_gate_batch),
+};
+
+static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
+
+linker_func_1(register_kmem_ktests)
+{
+	REGISTER_KTESTS(ktests, num_ktests);
+}
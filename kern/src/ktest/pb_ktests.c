@@ -44,10 +44,20 @@
 
 #include <apipe.h>
 #include <rwlock.h>
+#include <brlock.h>
 #include <rendez.h>
 #include <ktest.h>
 #include <smallidpool.h>
 #include <linker_func.h>
+#include <alloc_prof.h>
+#include <net/ip.h>
+#include <radix.h>
+#include <rhashtable.h>
+#include <aes_gcm.h>
+#include <taskqueue.h>
+#include <zpool.h>
+#include <numa.h>
+#include <zstore.h>
 
 KTEST_SUITE("POSTBOOT")
 
@@ -1452,6 +1462,71 @@ bool test_rwlock(void)
 	return true;
 }
 
+static struct brlock brlock, *brl = &brlock;
+static atomic_t brlock_counter;
+static atomic_t brlock_readers;
+static bool brlock_writing;
+static bool brlock_broken;
+
+bool test_brlock(void)
+{
+	br_init(brl);
+	/* Recursive reads, including while a writer might be waiting */
+	br_rlock(brl);
+	KT_ASSERT(br_canrlock(brl));
+	br_runlock(brl);
+	br_runlock(brl);
+	br_wlock(brl);
+	br_wunlock(brl);
+
+	/* Readers and writers check that they never overlap. */
+	void __test_brlock(uint32_t srcid, long a0, long a1, long a2)
+	{
+		int rand = read_tsc() & 0xff;
+		int op;
+
+		for (int i = 0; i < 10000; i++) {
+			op = (rand * i) % 8;
+			if (op == 7) {
+				br_wlock(brl);
+				if (atomic_read(&brlock_readers) || brlock_writing)
+					brlock_broken = TRUE;
+				brlock_writing = TRUE;
+				kthread_yield();
+				brlock_writing = FALSE;
+				br_wunlock(brl);
+				continue;
+			}
+			if (op == 6) {
+				if (!br_canrlock(brl))
+					continue;
+			} else {
+				br_rlock(brl);
+			}
+			atomic_inc(&brlock_readers);
+			if (READ_ONCE(brlock_writing))
+				brlock_broken = TRUE;
+			/* Readers block too, and might wake up on another core. */
+			if (!(i % 64))
+				kthread_yield();
+			atomic_dec(&brlock_readers);
+			br_runlock(brl);
+		}
+		atomic_dec(&brlock_counter);
+	}
+
+	atomic_init(&brlock_readers, 0);
+	atomic_init(&brlock_counter, (num_cores - 1) * 4);
+	for (int i = 1; i < num_cores; i++)
+		for (int j = 0; j < 4; j++)
+			send_kernel_message(i, __test_brlock, 0, 0, 0, KMSG_ROUTINE);
+	while (atomic_read(&brlock_counter))
+		cpu_relax();
+	KT_ASSERT_M("Readers and writers overlapped", !brlock_broken);
+	br_destroy(brl);
+	return true;
+}
+
 /* Funcs and global vars for test_rv() */
 static struct rendez local_rv;
 static struct rendez *rv = &local_rv;
@@ -1800,6 +1875,42 @@ static bool uaccess_unmapped(void *addr, char *buf, char *buf2)
 	return TRUE;
 }
 
+/* The bulk copies, at an odd size so we copy qwords and bytes, and the iovec
+ * and checksum versions.  addr has at least a page. */
+static bool uaccess_bulk(struct proc *p, void *addr, bool mapped)
+{
+	size_t len = PGSIZE - 3;
+	uint8_t *buf = kmalloc(PGSIZE, MEM_WAIT);
+	uint8_t *buf2 = kzmalloc(PGSIZE, MEM_WAIT);
+	struct iovec iov[2] = {{addr, 1001}, {addr + 1001, len - 1001}};
+	int want = mapped ? 0 : -EFAULT;
+	bool passed = FALSE;
+
+	for (int i = 0; i < PGSIZE; i++)
+		buf[i] = i * 7;
+	if (copy_to_user(addr, buf, len) != want)
+		goto out;
+	if (copy_from_user(buf2, addr, len) != want)
+		goto out;
+	if (mapped && memcmp(buf, buf2, len))
+		goto out;
+	memset(buf2, 0, PGSIZE);
+	if (memcpy_to_user_iov(p, iov, 2, buf + 1, len) != want)
+		goto out;
+	if (memcpy_from_user_iov(p, buf2, iov, 2) != want)
+		goto out;
+	if (mapped && memcmp(buf + 1, buf2, len))
+		goto out;
+	if (ptclbsum_copy_from_user(buf2, addr, len) !=
+	    (mapped ? ptclbsum(buf + 1, len) : -1))
+		goto out;
+	passed = TRUE;
+out:
+	kfree(buf);
+	kfree(buf2);
+	return passed;
+}
+
 bool test_uaccess(void)
 {
 	char buf[128] = { 0 };
@@ -1820,10 +1931,12 @@ bool test_uaccess(void)
 	if (addr == MAP_FAILED)
 		goto out;
 	passed = uaccess_mapped(addr, buf, buf2);
+	passed = passed && uaccess_bulk(tmp, addr, TRUE);
 	munmap(tmp, (uintptr_t) addr, mmap_size);
 	if (!passed)
 		goto out;
 	passed = uaccess_unmapped(addr, buf, buf2);
+	passed = passed && uaccess_bulk(tmp, addr, FALSE);
 out:
 	switch_back(tmp, switch_tmp);
 	proc_decref(tmp);
@@ -2014,6 +2127,1628 @@ static bool test_percpu_increment(void)
 	return true;
 }
 
+static bool test_kmem_cache_batch(void)
+{
+	#define KMCB_NR 200
+	struct kmem_cache *kc;
+	void **objs;
+	size_t got;
+
+	objs = kzmalloc(sizeof(void*) * KMCB_NR, MEM_WAIT);
+	kc = kmem_cache_create("test_batch", 64, 8, 0, NULL, NULL, NULL, NULL);
+	/* Enough objects to span several magazines, and to put full mags in the
+	 * depot on the free. */
+	for (int round = 0; round < 3; round++) {
+		got = kmem_cache_alloc_batch(kc, objs, KMCB_NR, MEM_WAIT);
+		KT_ASSERT(got == KMCB_NR);
+		for (int i = 0; i < KMCB_NR; i++) {
+			KT_ASSERT(objs[i]);
+			*(long*)objs[i] = i;
+		}
+		for (int i = 0; i < KMCB_NR; i++)
+			KT_ASSERT_M("Batch handed out an object twice",
+			            *(long*)objs[i] == i);
+		kmem_cache_free_batch(kc, objs, KMCB_NR);
+	}
+	kmem_cache_destroy(kc);
+
+	/* kpages goes through the kpages qcaches for this size */
+	got = kpages_alloc_batch(objs, 2 * PGSIZE, 20, MEM_WAIT);
+	KT_ASSERT(got == 20);
+	for (int i = 0; i < 20; i++) {
+		KT_ASSERT(PGOFF(objs[i]) == 0);
+		memset(objs[i], i, 2 * PGSIZE);
+	}
+	for (int i = 0; i < 20; i++)
+		KT_ASSERT(((uint8_t*)objs[i])[2 * PGSIZE - 1] == i);
+	kpages_free_batch(objs, 2 * PGSIZE, 20);
+	kfree(objs);
+	return true;
+}
+
+static bool test_kmalloc_sized(void)
+{
+	struct kmalloc_tag *tag;
+	size_t ksize, obj_size;
+	void *buf;
+
+	/* The size classes should never waste more than a quarter of an object,
+	 * once we're past the tiny sizes. */
+	for (size_t sz = 40; sz + sizeof(struct kmalloc_tag) <= 2048; sz += 8) {
+		buf = kmalloc(sz, MEM_WAIT);
+		tag = (struct kmalloc_tag*)(buf - sizeof(struct kmalloc_tag));
+		ksize = sz + sizeof(struct kmalloc_tag);
+		obj_size = tag->my_cache->obj_size;
+		KT_ASSERT_M("kmalloc obj too small", obj_size >= ksize);
+		KT_ASSERT_M("kmalloc size class too big",
+		            obj_size - ksize <= ksize / 4);
+		kfree(buf);
+	}
+	/* Sized allocs, including the ones that come from kpages */
+	for (size_t sz = 0; sz <= 3 * PGSIZE; sz += 24) {
+		buf = kmalloc_sized(sz, MEM_WAIT);
+		KT_ASSERT(buf);
+		KT_ASSERT(ALIGNED(buf, KMALLOC_ALIGNMENT));
+		memset(buf, 0xaa, sz);
+		kfree_sized(buf, sz);
+	}
+	buf = kzmalloc_sized(100, MEM_WAIT);
+	for (int i = 0; i < 100; i++)
+		KT_ASSERT(((uint8_t*)buf)[i] == 0);
+	kfree_sized(buf, 100);
+	return true;
+}
+
+static bool test_alloc_prof(void)
+{
+	struct kmem_cache *kc;
+	struct sized_alloc *sza;
+	void *objs[64];
+
+	/* Don't stomp on someone who is already profiling */
+	if (alloc_prof_rate)
+		return true;
+	kc = kmem_cache_create("test_alloc_prof", 100, 8, 0, NULL, NULL, NULL,
+	                       NULL);
+	/* At 1/1, every alloc on this core is sampled */
+	KT_ASSERT(!alloc_prof_set_rate(1));
+	for (int i = 0; i < ARRAY_SIZE(objs); i++)
+		objs[i] = kmem_cache_alloc(kc, MEM_WAIT);
+	alloc_prof_set_rate(0);
+
+	sza = alloc_prof_build_report();
+	KT_ASSERT_M("Missing the test's alloc site",
+	            strstr(sza->buf, "in test_alloc_prof"));
+	KT_ASSERT_M("Wrong live count for the site",
+	            strstr(sza->buf, "live 6656 bytes in 64 objs"));
+	kfree(sza);
+
+	for (int i = 0; i < ARRAY_SIZE(objs); i++)
+		kmem_cache_free(kc, objs[i]);
+	sza = alloc_prof_build_report();
+	KT_ASSERT_M("Frees didn't drop the live count",
+	            strstr(sza->buf, "live 0 bytes in 0 objs, "
+	                             "total 6656 bytes in 64 allocs"));
+	kfree(sza);
+
+	alloc_prof_reset();
+	KT_ASSERT(!alloc_prof_tracking);
+	kmem_cache_destroy(kc);
+	return true;
+}
+
+static bool test_kmem_reclaim(void)
+{
+	struct kmem_cache *kc;
+	void **objs;
+	size_t nr_objs = 1000;
+
+	kc = kmem_cache_create("test_kmem_reclaim", 64, 8, 0, NULL, NULL, NULL,
+	                       NULL);
+	objs = kmalloc_array(nr_objs, sizeof(void*), MEM_WAIT);
+	for (int i = 0; i < nr_objs; i++)
+		objs[i] = kmem_cache_alloc(kc, MEM_WAIT);
+	/* More than fit in the pcc, so some end up in depot mags */
+	for (int i = 0; i < nr_objs; i++)
+		kmem_cache_free(kc, objs[i]);
+	kfree(objs);
+	KT_ASSERT(kc->depots[0].nr_not_empty);
+
+	kmem_reclaim();
+	for (int i = 0; i < kc->nr_depots; i++) {
+		KT_ASSERT_M("Reclaim left mags in the depot",
+		            !kc->depots[i].nr_not_empty && !kc->depots[i].nr_empty);
+	}
+	KT_ASSERT_M("Reclaim left empty slabs", TAILQ_EMPTY(&kc->empty_slab_list));
+	/* At most the pcc's two mags are still holding objects */
+	KT_ASSERT(kc->nr_cur_alloc <= 2 * KMC_MAG_MAX_SZ);
+	KT_ASSERT(kmem_reclaim_stats.last_nr_mags);
+	KT_ASSERT(kmem_reclaim_stats.last_slab_bytes);
+	kmem_cache_destroy(kc);
+	return true;
+}
+
+static bool test_kmalloc_frag(void)
+{
+	struct kmalloc_tag *tag;
+	struct kmalloc_frag_chunk *chunk;
+	struct block *b;
+	void *buf, *buf2;
+
+	buf = kmalloc_frag(100, MEM_WAIT);
+	KT_ASSERT(buf);
+	KT_ASSERT(ALIGNED(buf, ARCH_CL_SIZE));
+	tag = buf - sizeof(struct kmalloc_tag);
+	KT_ASSERT((tag->flags & KMALLOC_FLAG_MASK) == KMALLOC_TAG_FRAG);
+	chunk = tag->frag_chunk;
+	/* The frag and our core's pool */
+	KT_ASSERT(kref_refcnt(&chunk->kref) >= 2);
+	KT_ASSERT(krealloc(buf, 50, MEM_WAIT) == buf);
+	kmalloc_incref(buf);
+	KT_ASSERT(kmalloc_refcnt(buf) == 2);
+	kfree(buf);
+	memset(buf, 0xaa, 100);
+	kfree(buf);
+
+	/* Too big for a frag: a normal kmalloc */
+	buf2 = kmalloc_frag(KMALLOC_FRAG_MAX + 1, MEM_WAIT);
+	tag = buf2 - sizeof(struct kmalloc_tag);
+	KT_ASSERT((tag->flags & KMALLOC_FLAG_MASK) != KMALLOC_TAG_FRAG);
+	kfree(buf2);
+
+	b = block_alloc_frag(1500, MEM_WAIT);
+	KT_ASSERT(b);
+	KT_ASSERT(BLEN(b) == 1500);
+	KT_ASSERT(BHLEN(b) == 0);
+	memset((void*)b->extra_data[0].base, 0x55, 1500);
+	checkb(b, "test_kmalloc_frag");
+	b = adjustblock(b, 64);
+	KT_ASSERT(b && BLEN(b) == 64);
+	freeb(b);
+	return true;
+}
+
+/* Helper: reads everything from q into buf, checking that we get exactly len
+ * bytes. */
+static bool qio_spsc_drain(struct queue *q, char *buf, size_t len)
+{
+	size_t sofar = 0;
+
+	while (qlen(q))
+		sofar += qread(q, buf + sofar, len - sofar);
+	return sofar == len;
+}
+
+/* Mixes the Qspsc fast paths with the locked paths.  The bytes must come out in
+ * the order they went in. */
+static bool test_qio_spsc(void)
+{
+	struct queue *q;
+	struct block *b;
+	char buf[64];
+
+	q = qopen(4096, Qcoalesce | Qspsc, NULL, NULL);
+	KT_ASSERT(q);
+	KT_ASSERT(qstate(q) & Qspsc);
+	KT_ASSERT(qwrite(q, "abc", 3) == 3);
+	/* Coalesced on the way out */
+	qibwrite(q, block_alloc(0, MEM_WAIT));
+	/* A blist takes the locked path */
+	b = block_alloc(2, MEM_WAIT);
+	memcpy(b->wp, "de", 2);
+	b->wp += 2;
+	b->next = block_alloc(1, MEM_WAIT);
+	*b->next->wp++ = 'f';
+	KT_ASSERT(qibwrite(q, b) == 3);
+	KT_ASSERT(qwrite(q, "ghi", 3) == 3);
+	KT_ASSERT(qlen(q) == 9);
+	KT_ASSERT(qcanread(q));
+	KT_ASSERT(qio_spsc_drain(q, buf, 9));
+	KT_ASSERT(!strncmp(buf, "abcdefghi", 9));
+	KT_ASSERT(q_bytes_read(q) == 9);
+
+	/* Splitting a block needs the locked path */
+	KT_ASSERT(qwrite(q, "0123456789", 10) == 10);
+	KT_ASSERT(qread(q, buf, 4) == 4);
+	KT_ASSERT(!strncmp(buf, "0123", 4));
+	KT_ASSERT(qio_spsc_drain(q, buf, 6));
+	KT_ASSERT(!strncmp(buf, "456789", 6));
+
+	/* Flow control */
+	b = block_alloc(4096, MEM_WAIT);
+	b->wp += 4096;
+	qibwrite(q, b);
+	KT_ASSERT(!qwritable(q));
+	b = qbread(q, 4096);
+	KT_ASSERT(b && BLEN(b) == 4096);
+	freeb(b);
+	KT_ASSERT(qwritable(q));
+	KT_ASSERT(!qlen(q));
+	qfree(q);
+
+	q = qopen(4096, Qmsg | Qspsc, NULL, NULL);
+	KT_ASSERT(q);
+	KT_ASSERT(qwrite(q, "hello", 5) == 5);
+	KT_ASSERT(qwrite(q, "world", 5) == 5);
+	KT_ASSERT(qread(q, buf, sizeof(buf)) == 5);
+	KT_ASSERT(!strncmp(buf, "hello", 5));
+	KT_ASSERT(qread(q, buf, sizeof(buf)) == 5);
+	KT_ASSERT(!strncmp(buf, "world", 5));
+	qfree(q);
+	return true;
+}
+
+static bool test_qio_iov(void)
+{
+	struct queue *q;
+	char a[2], b[10], src[] = "abcde";
+	struct iovec wr[3] = {{src, 2}, {src, 0}, {src + 2, 3}};
+	struct iovec rd[2] = {{a, sizeof(a)}, {b, sizeof(b)}};
+
+	q = qopen(4096, Qcoalesce, NULL, NULL);
+	KT_ASSERT(q);
+	KT_ASSERT(qwritev(q, wr, 3) == 5);
+	KT_ASSERT(qlen(q) == 5);
+	KT_ASSERT(qreadv(q, rd, 2) == 5);
+	KT_ASSERT(!strncmp(a, "ab", 2));
+	KT_ASSERT(!strncmp(b, "cde", 3));
+	qfree(q);
+
+	/* Qmsg: the writev is one message, and a short readv drops the rest */
+	q = qopen(4096, Qmsg, NULL, NULL);
+	KT_ASSERT(q);
+	KT_ASSERT(qwritev(q, wr, 3) == 5);
+	rd[1].iov_len = 1;
+	KT_ASSERT(qreadv(q, rd, 2) == 3);
+	KT_ASSERT(!strncmp(a, "ab", 2));
+	KT_ASSERT(b[0] == 'c');
+	KT_ASSERT(!qlen(q));
+	qfree(q);
+	return true;
+}
+
+/* The RFC 1071 checksum, one byte at a time */
+static uint16_t ref_ptclbsum(uint8_t *p, int len)
+{
+	uint32_t sum = 0;
+
+	for (int i = 0; i < len; i++)
+		sum += i & 1 ? p[i] : p[i] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+static bool test_ptclbsum(void)
+{
+	size_t sz = 512;
+	uint8_t *buf = kmalloc(sz, MEM_WAIT);
+	uint8_t *dst = kmalloc(sz, MEM_WAIT);
+
+	for (int i = 0; i < sz; i++)
+		buf[i] = (i * 37 + 11) ^ (i >> 3);
+	/* All ones is the worst case for carries */
+	memset(buf + 400, 0xff, 100);
+	for (int off = 0; off < 8; off++) {
+		for (int len = 0; len <= 300; len++) {
+			KT_ASSERT_M("ptclbsum mismatch",
+			            ptclbsum(buf + off, len) ==
+			            ref_ptclbsum(buf + off, len));
+			memset(dst, 0, sz);
+			KT_ASSERT_M("ptclbsum_copy mismatch",
+			            ptclbsum_copy(dst + (off ^ 3), buf + off, len) ==
+			            ref_ptclbsum(buf + off, len));
+			KT_ASSERT(!memcmp(dst + (off ^ 3), buf + off, len));
+		}
+	}
+	KT_ASSERT(ptclbsum(buf + 400, 100) == ref_ptclbsum(buf + 400, 100));
+	KT_ASSERT(ptclbsum(buf + 401, 99) == ref_ptclbsum(buf + 401, 99));
+	kfree(buf);
+	kfree(dst);
+	return true;
+}
+
+/* Builds a private Fs with one ifc that matches everything, so the lookups
+ * bind their routes, and times lookups of 100k /24s with and without the
+ * per-core route cache hitting. */
+static bool test_v4route(void)
+{
+	const uint32_t nr_routes = 100000, nr_hot = 64, nr_iters = 1 << 20;
+	struct Fs *f = kzmalloc(sizeof(struct Fs), MEM_WAIT);
+	struct Proto *pr = kzmalloc(sizeof(struct Proto), MEM_WAIT);
+	struct conv *cv = kzmalloc(sizeof(struct conv), MEM_WAIT);
+	struct Ipifc *ifc = kzmalloc(sizeof(struct Ipifc), MEM_WAIT);
+	struct Iplifc *lifc = kzmalloc(sizeof(struct Iplifc), MEM_WAIT);
+	uint8_t a[IPv4addrlen], mask[IPv4addrlen], gate[IPv4addrlen];
+	char tag[4] = "none";
+	struct route *r;
+	uint32_t addr;
+	uint64_t t0, cold, hot;
+
+	/* Zero mask and net: the ifc is on-link for everything */
+	ifc->lifc = lifc;
+	cv->ptcl = ifc;
+	pr->nc = 1;
+	pr->conv = kzmalloc(sizeof(struct conv *) * 2, MEM_WAIT);
+	pr->conv[0] = cv;
+	f->ipifc = pr;
+
+	hnputl(mask, 0xffffff00);
+	hnputl(gate, 0x0a000001);
+	for (uint32_t i = 0; i < nr_routes; i++) {
+		hnputl(a, 0x0a000000 + (i << 8));
+		v4addroute(f, tag, a, mask, gate, 0);
+	}
+
+	/* Every lookup misses the cache: the working set is bigger than it is */
+	t0 = read_tsc();
+	for (uint32_t i = 0; i < nr_iters; i++) {
+		addr = 0x0a000000 + ((i * 7919) % nr_routes << 8) + 5;
+		hnputl(a, addr);
+		r = v4lookup(f, a, NULL);
+		KT_ASSERT_M("missing route", r && r->v4.address == (addr & ~0xff));
+	}
+	cold = tsc2nsec(read_tsc() - t0);
+	/* The same few destinations over and over */
+	t0 = read_tsc();
+	for (uint32_t i = 0; i < nr_iters; i++) {
+		addr = 0x0a000000 + ((i % nr_hot) * 1543 << 8) + 5;
+		hnputl(a, addr);
+		r = v4lookup(f, a, NULL);
+		KT_ASSERT_M("missing route", r && r->v4.address == (addr & ~0xff));
+	}
+	hot = tsc2nsec(read_tsc() - t0);
+	printk("v4lookup, %u routes: %lu nsec uncached, %lu nsec cached\n",
+	       nr_routes, cold / nr_iters, hot / nr_iters);
+
+	/* A route change must be seen by the next lookup */
+	hnputl(a, 0x0a000000);
+	v4delroute(f, a, mask, 1);
+	hnputl(a, 0x0a000005);
+	KT_ASSERT(v4lookup(f, a, NULL) == NULL);
+
+	for (uint32_t i = 1; i < nr_routes; i++) {
+		hnputl(a, 0x0a000000 + (i << 8));
+		v4delroute(f, a, mask, 1);
+	}
+	kfree(pr->conv);
+	kfree(lifc);
+	kfree(ifc);
+	kfree(cv);
+	kfree(pr);
+	kfree(f);
+	return true;
+}
+
+/* Allocates every core we can to a fake proc, one at a time, and frees them,
+ * over and over, timing the core allocator's choices. */
+static bool test_corealloc(void)
+{
+	const int nr_rounds = 1000;
+	struct proc *p = kzmalloc(sizeof(struct proc), MEM_WAIT);
+	uint32_t *got = kmalloc(num_cores * sizeof(uint32_t), MEM_WAIT);
+	uint32_t pcoreid, nr_got, nr_first = 0;
+	uint64_t t0, ticks = 0, nr_finds = 0;
+
+	/* No MCPs exist while the ktests run, so no one else is allocating cores,
+	 * and we don't need the ksched's lock. */
+	corealloc_proc_init(p);
+	for (int r = 0; r < nr_rounds; r++) {
+		nr_got = 0;
+		while (1) {
+			t0 = read_tsc();
+			pcoreid = __find_best_core_to_alloc(p);
+			ticks += read_tsc() - t0;
+			nr_finds++;
+			if (pcoreid == -1)
+				break;
+			KT_ASSERT_M("Got an allocated core",
+			            !pcoreid2spc(pcoreid)->alloc_proc);
+			KT_ASSERT_M("Got too many cores", nr_got < num_cores);
+			__track_core_alloc(p, pcoreid);
+			got[nr_got++] = pcoreid;
+		}
+		if (!r)
+			nr_first = nr_got;
+		KT_ASSERT_M("Lost cores", nr_got == nr_first);
+		__track_core_dealloc_bulk(p, got, nr_got);
+	}
+	printk("corealloc: %u cores, %lu nsec per __find_best_core_to_alloc\n",
+	       nr_first, tsc2nsec(ticks) / nr_finds);
+	corealloc_proc_free(p);
+	kfree(got);
+	kfree(p);
+	return true;
+}
+
+#define KMSG_LAT_PER_SENDER 1000
+
+static uint64_t kmsg_lat_ticks;
+static uint64_t kmsg_lat_nr;
+static long kmsg_lat_last_seq[MAX_NUM_CORES];
+static bool kmsg_lat_misordered;
+
+/* Runs on the receiver, in IRQ context, so it doesn't need a lock */
+static void __kmsg_lat_handler(uint32_t srcid, long a0, long a1, long a2)
+{
+	kmsg_lat_ticks += read_tsc() - a0;
+	if (a1 != kmsg_lat_last_seq[srcid] + 1)
+		kmsg_lat_misordered = TRUE;
+	kmsg_lat_last_seq[srcid] = a1;
+	WRITE_ONCE(kmsg_lat_nr, kmsg_lat_nr + 1);
+}
+
+static void __kmsg_lat_sender(void *opaque)
+{
+	uint32_t dst = (uint32_t)(long)opaque;
+
+	for (long i = 1; i <= KMSG_LAT_PER_SENDER; i++)
+		send_kernel_message(dst, __kmsg_lat_handler, read_tsc(), i, 0,
+		                    KMSG_IMMEDIATE);
+}
+
+/* Has 1, 8, and 64 cores (as many as we have) blast immediate kmsgs at us.
+ * Each sender's kmsgs must arrive in order. */
+static bool test_kmsg_latency(void)
+{
+	static const int nr_senders[] = {1, 8, 64};
+	struct core_set cset;
+	int me = core_id();
+	int nr, prev_nr = 0, total;
+
+	for (int t = 0; t < ARRAY_SIZE(nr_senders); t++) {
+		nr = MIN(nr_senders[t], num_cores - 1);
+		/* Out of cores, or already ran with all of them */
+		if (nr == prev_nr)
+			break;
+		prev_nr = nr;
+		core_set_init(&cset);
+		for (int i = 0, j = 0; j < nr; i++) {
+			if (i == me)
+				continue;
+			core_set_setcpu(&cset, i);
+			j++;
+		}
+		kmsg_lat_ticks = 0;
+		kmsg_lat_nr = 0;
+		memset(kmsg_lat_last_seq, 0, sizeof(kmsg_lat_last_seq));
+		kmsg_lat_misordered = FALSE;
+		total = nr * KMSG_LAT_PER_SENDER;
+		smp_do_in_cores(&cset, __kmsg_lat_sender, (void*)(long)me);
+		while (READ_ONCE(kmsg_lat_nr) < total)
+			cpu_relax();
+		KT_ASSERT_M("A sender's kmsgs arrived out of order",
+		            !kmsg_lat_misordered);
+		printk("kmsg latency, %d senders: %lu nsec\n", nr,
+		       tsc2nsec(kmsg_lat_ticks) / total);
+	}
+	return true;
+}
+
+#define ALARM_WHEEL_NR 100000
+
+static unsigned int alarm_wheel_nr_fired;
+static bool alarm_wheel_early;
+
+static void __alarm_wheel_noop_int(struct timer_chain *tchain)
+{
+}
+
+static void __alarm_wheel_fire(struct alarm_waiter *waiter,
+                               struct hw_trapframe *hw_tf)
+{
+	if (waiter->wake_up_time > read_tsc())
+		alarm_wheel_early = TRUE;
+	alarm_wheel_nr_fired++;
+}
+
+/* Times set, reset, unset and expiry for 100k alarms, spread over a second, on
+ * a private tchain that never interrupts.  Then checks that slack coalesces. */
+static bool test_alarm_wheel(void)
+{
+	struct timer_chain *tchain;
+	struct alarm_waiter *waiters;
+	uint64_t t0, now, spread = usec2tsc(1000000), seed = 1;
+	uint64_t ticks;
+	int8_t irq_state = 0;
+
+	tchain = kzmalloc(sizeof(struct timer_chain), MEM_WAIT);
+	waiters = kzmalloc(ALARM_WHEEL_NR * sizeof(struct alarm_waiter), MEM_WAIT);
+	init_timer_chain(tchain, __alarm_wheel_noop_int);
+	for (int i = 0; i < ALARM_WHEEL_NR; i++)
+		init_awaiter_irq(&waiters[i], __alarm_wheel_fire);
+
+	now = read_tsc();
+	t0 = read_tsc();
+	for (int i = 0; i < ALARM_WHEEL_NR; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		set_awaiter_abs(&waiters[i], now + spread + seed % spread);
+		set_alarm(tchain, &waiters[i]);
+	}
+	ticks = read_tsc() - t0;
+	printk("alarm wheel: %lu nsec per set_alarm\n",
+	       tsc2nsec(ticks) / ALARM_WHEEL_NR);
+	KT_ASSERT(tchain->nr_waiters == ALARM_WHEEL_NR);
+
+	/* Like a retransmit timer, pushed back each time it's used */
+	t0 = read_tsc();
+	for (int i = 0; i < ALARM_WHEEL_NR; i++)
+		reset_alarm_abs(tchain, &waiters[i],
+		                waiters[i].wake_up_time + usec2tsc(1000));
+	ticks = read_tsc() - t0;
+	printk("alarm wheel: %lu nsec per reset_alarm_abs\n",
+	       tsc2nsec(ticks) / ALARM_WHEEL_NR);
+
+	/* Unset every other one, in reverse order of setting */
+	t0 = read_tsc();
+	for (int i = ALARM_WHEEL_NR - 1; i >= 0; i--) {
+		if (i % 2)
+			KT_ASSERT(unset_alarm(tchain, &waiters[i]));
+	}
+	ticks = read_tsc() - t0;
+	printk("alarm wheel: %lu nsec per unset_alarm\n",
+	       tsc2nsec(ticks) / (ALARM_WHEEL_NR / 2));
+	KT_ASSERT(tchain->nr_waiters == ALARM_WHEEL_NR / 2);
+
+	/* Make the rest due and fire them all at once */
+	for (int i = 0; i < ALARM_WHEEL_NR; i += 2)
+		reset_alarm_abs(tchain, &waiters[i], now + i);
+	alarm_wheel_nr_fired = 0;
+	alarm_wheel_early = FALSE;
+	t0 = read_tsc();
+	disable_irqsave(&irq_state);
+	__trigger_tchain(tchain, NULL);
+	enable_irqsave(&irq_state);
+	ticks = read_tsc() - t0;
+	printk("alarm wheel: %lu nsec per expiry\n",
+	       tsc2nsec(ticks) / (ALARM_WHEEL_NR / 2));
+	KT_ASSERT(alarm_wheel_nr_fired == ALARM_WHEEL_NR / 2);
+	KT_ASSERT(!alarm_wheel_early);
+	KT_ASSERT(!tchain->nr_waiters);
+	KT_ASSERT(tchain->earliest_time == ALARM_POISON_TIME);
+
+	/* Slack: 1's window is open when 0 goes off, so it fires too.  2's isn't,
+	 * and it'll go off at the end of its window. */
+	now = read_tsc();
+	set_awaiter_abs(&waiters[0], now);
+	set_alarm(tchain, &waiters[0]);
+	set_awaiter_slack(&waiters[1], 1000000);
+	set_awaiter_abs(&waiters[1], now + 1);
+	set_alarm(tchain, &waiters[1]);
+	set_awaiter_slack(&waiters[2], 1000000);
+	set_awaiter_abs(&waiters[2], now + usec2tsc(500000));
+	set_alarm(tchain, &waiters[2]);
+	KT_ASSERT(tchain->earliest_time == now);
+	alarm_wheel_nr_fired = 0;
+	disable_irqsave(&irq_state);
+	__trigger_tchain(tchain, NULL);
+	enable_irqsave(&irq_state);
+	KT_ASSERT(alarm_wheel_nr_fired == 2);
+	KT_ASSERT(!alarm_wheel_early);
+	KT_ASSERT(tchain->earliest_time ==
+	          waiters[2].wake_up_time + waiters[2].slack);
+	KT_ASSERT(unset_alarm(tchain, &waiters[2]));
+
+	kfree(waiters);
+	kfree(tchain);
+	return true;
+}
+
+#define RHT_TEST_NR 100000
+
+struct rht_test_obj {
+	uint32_t key;
+	struct rhash_node link;
+};
+
+static uint32_t __rht_test_hash_key(const void *key)
+{
+	return *(const uint32_t*)key;
+}
+
+static uint32_t __rht_test_hash_obj(const void *obj)
+{
+	return ((const struct rht_test_obj*)obj)->key;
+}
+
+static bool __rht_test_key_eq(const void *key, const void *obj)
+{
+	return *(const uint32_t*)key == ((const struct rht_test_obj*)obj)->key;
+}
+
+static void __rht_test_count(void *obj, void *arg)
+{
+	(*(unsigned int*)arg)++;
+}
+
+static bool __rht_test_look(struct rhashtable *ht, uint32_t key)
+{
+	struct rht_test_obj *o;
+
+	rcu_read_lock();
+	o = rhashtable_lookup(ht, &key);
+	rcu_read_unlock();
+	return o && o->key == key;
+}
+
+/* Grows a table to 100k entries and shrinks it back down.  Lookups happen
+ * while the table is in the middle of resizing, and each resize moves a few
+ * buckets per insert or remove. */
+static bool test_rhashtable(void)
+{
+	static const struct rhashtable_params params = {
+		.node_offset = offsetof(struct rht_test_obj, link),
+		.hash_key = __rht_test_hash_key,
+		.hash_obj = __rht_test_hash_obj,
+		.key_eq = __rht_test_key_eq,
+	};
+	struct rhashtable *ht;
+	struct rht_test_obj *objs;
+	unsigned int nr_seen = 0, grown_bits;
+	uint64_t t0;
+
+	ht = kzmalloc(sizeof(struct rhashtable), MEM_WAIT);
+	objs = kzmalloc(RHT_TEST_NR * sizeof(struct rht_test_obj), MEM_WAIT);
+	rhashtable_init(ht, &params);
+	t0 = read_tsc();
+	for (int i = 0; i < RHT_TEST_NR; i++) {
+		objs[i].key = i * 3;
+		rhashtable_insert(ht, &objs[i]);
+		/* Look up an old one, which may be in a bucket that's moving */
+		KT_ASSERT(__rht_test_look(ht, objs[i / 2].key));
+	}
+	printk("rhashtable: %lu nsec per insert and lookup\n",
+	       tsc2nsec(read_tsc() - t0) / RHT_TEST_NR);
+	KT_ASSERT(rhashtable_count(ht) == RHT_TEST_NR);
+	grown_bits = ht->tbl->bits;
+	KT_ASSERT(grown_bits > RHT_DEFAULT_MIN_BITS);
+	rhashtable_for_each(ht, __rht_test_count, &nr_seen);
+	KT_ASSERT(nr_seen == RHT_TEST_NR);
+
+	t0 = read_tsc();
+	for (int i = 0; i < RHT_TEST_NR; i++)
+		KT_ASSERT(__rht_test_look(ht, i * 3));
+	printk("rhashtable: %lu nsec per lookup\n",
+	       tsc2nsec(read_tsc() - t0) / RHT_TEST_NR);
+	for (int i = 0; i < RHT_TEST_NR; i++)
+		KT_ASSERT(!__rht_test_look(ht, i * 3 + 1));
+
+	for (int i = 0; i < RHT_TEST_NR; i += 2)
+		KT_ASSERT(rhashtable_remove(ht, &objs[i]));
+	KT_ASSERT(!rhashtable_remove(ht, &objs[0]));
+	for (int i = 0; i < RHT_TEST_NR; i++)
+		KT_ASSERT(__rht_test_look(ht, i * 3) == (i & 1));
+	for (int i = 1; i < RHT_TEST_NR; i += 2)
+		KT_ASSERT(rhashtable_remove(ht, &objs[i]));
+	KT_ASSERT(rhashtable_count(ht) == 0);
+	/* Shrinking has at least started */
+	KT_ASSERT(ht->tbl->future || ht->tbl->bits < grown_bits);
+	nr_seen = 0;
+	rhashtable_for_each(ht, __rht_test_count, &nr_seen);
+	KT_ASSERT(nr_seen == 0);
+
+	/* No readers, and the removed objects were never freed. */
+	rhashtable_destroy(ht);
+	kfree(objs);
+	kfree(ht);
+	return true;
+}
+
+#define STRING_BENCH_BUF_SZ (4 << 20)
+
+/* Prints the time per op and MB/s, for nr_iters ops of sz bytes in ticks. */
+static void string_bench_report(const char *name, size_t sz, size_t nr_iters,
+                                uint64_t ticks)
+{
+	uint64_t nsec = MAX(tsc2nsec(ticks), 1);
+
+	printk("%-14s %8lu bytes: %8lu nsec per op, %6lu MB/s\n", name, sz,
+	       nsec / nr_iters, sz * nr_iters * 1000 / nsec);
+}
+
+/* Throughput of memcpy, memset, memmove and memcmp from 64 bytes to 4 MB, and
+ * of each x86 memcpy variant directly, to pick thresholds.  Checks the copies
+ * along the way. */
+static bool test_microb_string(void)
+{
+	static const size_t sizes[] = {64, 256, 1500, 4096, 65536, 1 << 20,
+	                               STRING_BENCH_BUF_SZ};
+	uint8_t *src, *dst;
+	size_t sz, nr;
+	uint64_t t0;
+
+	src = kmalloc(STRING_BENCH_BUF_SZ + 64, MEM_WAIT);
+	dst = kmalloc(STRING_BENCH_BUF_SZ + 64, MEM_WAIT);
+	for (int i = 0; i < STRING_BENCH_BUF_SZ + 64; i++)
+		src[i] = i * 7;
+	for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+		sz = sizes[i];
+		nr = MAX((256 << 20) / sz, 16);
+
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			memcpy(dst, src, sz);
+		string_bench_report("memcpy", sz, nr, read_tsc() - t0);
+		KT_ASSERT(!memcmp(dst, src, sz));
+
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			memcpy(dst + 1, src + 3, sz);
+		string_bench_report("memcpy-unalgn", sz, nr, read_tsc() - t0);
+		KT_ASSERT(!memcmp(dst + 1, src + 3, sz));
+
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			memmove(dst, src, sz);
+		string_bench_report("memmove", sz, nr, read_tsc() - t0);
+
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			memcmp(dst, src, sz);
+		string_bench_report("memcmp", sz, nr, read_tsc() - t0);
+
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			memset(dst, j, sz);
+		string_bench_report("memset", sz, nr, read_tsc() - t0);
+		KT_ASSERT(dst[0] == (uint8_t)(nr - 1) && dst[sz - 1] == dst[0]);
+
+#ifdef CONFIG_X86
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			bcopy(src, dst, sz);
+		string_bench_report("bcopy", sz, nr, read_tsc() - t0);
+
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			memcpy_erms(dst, src, sz);
+		string_bench_report("memcpy_erms", sz, nr, read_tsc() - t0);
+		KT_ASSERT(!memcmp(dst, src, sz));
+
+		memset(dst, 0, sz + 1);
+		t0 = read_tsc();
+		for (int j = 0; j < nr; j++)
+			memcpy_nt(dst + 1, src, sz);
+		string_bench_report("memcpy_nt", sz, nr, read_tsc() - t0);
+		KT_ASSERT(!memcmp(dst + 1, src, sz));
+#endif
+	}
+	kfree(src);
+	kfree(dst);
+	return true;
+}
+
+/* tcpdump -dd 'udp dst port 53', minus the IPv6 and fragment checks, keeping
+ * 96 bytes.  Runs it on a DNS query and on a frame that isn't one, and makes
+ * sure we reject a program that jumps off the end. */
+static bool test_bpf(void)
+{
+	ERRSTACK(1);
+	struct bpf_insn udp53[] = {
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x0800, 0, 6),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 17, 0, 4),
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 53, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 96),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct bpf_insn bad[] = {
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 5, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct bpf_prog *prog;
+	struct block *bp;
+	uint8_t *pkt;
+
+	bp = block_alloc(128, MEM_WAIT);
+	pkt = bp->wp;
+	memset(pkt, 0, 128);
+	bp->wp += 128;
+	hnputs(pkt + 12, 0x0800);
+	pkt[14] = 0x45;
+	pkt[23] = 17;
+	hnputs(pkt + 14 + 20 + 2, 53);
+
+	prog = bpf_prog_load(udp53, sizeof(udp53));
+	KT_ASSERT_M("DNS query should keep 96 bytes", bpf_run(prog, bp) == 96);
+	hnputs(pkt + 14 + 20 + 2, 54);
+	KT_ASSERT_M("port 54 should be dropped", bpf_run(prog, bp) == 0);
+	/* Options push the UDP header back, past the end of the frame */
+	pkt[14] = 0x4f;
+	bp->wp = bp->rp + 64;
+	KT_ASSERT_M("short frame should be dropped", bpf_run(prog, bp) == 0);
+	kfree(prog);
+	freeb(bp);
+
+	if (!waserror()) {
+		prog = bpf_prog_load(bad, sizeof(bad));
+		kfree(prog);
+		poperror();
+		KT_ASSERT_M("loaded a jump off the end", false);
+	}
+	poperror();
+	return true;
+}
+
+static void __aes_gcm_unhex(const char *s, uint8_t *out)
+{
+	char byte[3] = {0};
+
+	for (; s[0] && s[1]; s += 2) {
+		byte[0] = s[0];
+		byte[1] = s[1];
+		*out++ = strtoul(byte, NULL, 16);
+	}
+}
+
+/* Test cases 4 and 16 from the GCM spec (McGrew and Viega), through AES-NI if
+ * we have it and through the software path. */
+static bool test_aes_gcm(void)
+{
+	static const char *keys[] = {
+		"feffe9928665731c6d6a8f9467308308",
+		"feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+	};
+	static const char *cts[] = {
+		"42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+		"21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+		"522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+		"8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+	};
+	static const char *tags[] = {
+		"5bc94fbc3221a5db94fae95ae7121a47",
+		"76fc6ece0f4e1768cddf8853bb2d551b",
+	};
+	const char *pt_hex =
+		"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+		"1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39";
+	struct aes_gcm_ctx *ctx = kmalloc(sizeof(struct aes_gcm_ctx), MEM_WAIT);
+	uint8_t key[32], iv[12], aad[20], pt[60], ct[60], tag[16], buf[60];
+	uint8_t out_tag[16];
+
+	__aes_gcm_unhex("cafebabefacedbaddecaf888", iv);
+	__aes_gcm_unhex("feedfacedeadbeeffeedfacedeadbeefabaddad2", aad);
+	__aes_gcm_unhex(pt_hex, pt);
+	for (int i = 0; i < 4; i++) {
+		__aes_gcm_unhex(keys[i / 2], key);
+		__aes_gcm_unhex(cts[i / 2], ct);
+		__aes_gcm_unhex(tags[i / 2], tag);
+		KT_ASSERT(!aes_gcm_setkey(ctx, key, i < 2 ? 16 : 32));
+		if (i & 1)
+			ctx->ni = FALSE;
+		memcpy(buf, pt, sizeof(pt));
+		aes_gcm_encrypt(ctx, iv, aad, sizeof(aad), buf, sizeof(buf), out_tag);
+		KT_ASSERT_M("ciphertext should match", !memcmp(buf, ct, sizeof(ct)));
+		KT_ASSERT_M("tag should match", !memcmp(out_tag, tag, sizeof(tag)));
+		KT_ASSERT_M("should decrypt",
+		            aes_gcm_decrypt(ctx, iv, aad, sizeof(aad), buf,
+		                            sizeof(buf), tag));
+		KT_ASSERT_M("plaintext should match", !memcmp(buf, pt, sizeof(pt)));
+		memcpy(buf, ct, sizeof(ct));
+		buf[7] ^= 1;
+		KT_ASSERT_M("should reject a forgery",
+		            !aes_gcm_decrypt(ctx, iv, aad, sizeof(aad), buf,
+		                             sizeof(buf), tag));
+	}
+	KT_ASSERT(aes_gcm_setkey(ctx, key, 24) == -1);
+	kfree(ctx);
+	return true;
+}
+
+#define PRIM_NR_SAMPLES 10000
+
+static uint64_t *prim_samples;
+
+static int __prim_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Sorts the samples, in TSC ticks, and prints their percentiles. */
+static void prim_report(const char *name, uint64_t *samples, size_t nr)
+{
+	sort(samples, nr, sizeof(uint64_t), __prim_cmp);
+	printk("%-24s cycles: p50 %6lu, p90 %6lu, p99 %6lu, max %8lu\n", name,
+	       samples[nr / 2], samples[nr * 90 / 100], samples[nr * 99 / 100],
+	       samples[nr - 1]);
+}
+
+static void __prim_kmsg_handler(uint32_t srcid, long a0, long a1, long a2)
+{
+	WRITE_ONCE(prim_samples[a1], read_tsc() - a0);
+}
+
+static struct semaphore prim_ping, prim_pong;
+
+static void __prim_sem_ponger(void *arg)
+{
+	for (int i = 0; i < PRIM_NR_SAMPLES; i++) {
+		sem_down(&prim_ping);
+		sem_up(&prim_pong);
+	}
+}
+
+/* Per-op costs of the kernel's core primitives, one sample per op.  These are
+ * for eyeballing regressions, not for pass or fail.  The user side (syscalls
+ * and context switches) is in tests/prim_bench.c. */
+static bool test_microb_prims(void)
+{
+	static const size_t blk_sizes[] = {64, 1500, 9000};
+	uint64_t *s, t0;
+	struct semaphore sem;
+	struct queue *q;
+	struct block *b;
+	char name[32];
+	int dst;
+
+	s = kmalloc(PRIM_NR_SAMPLES * sizeof(uint64_t), MEM_WAIT);
+	prim_samples = s;
+
+	/* One immediate kmsg at a time, from its send until its handler runs. */
+	if (num_cores > 1) {
+		dst = (core_id() + 1) % num_cores;
+		for (long i = 0; i < PRIM_NR_SAMPLES; i++) {
+			s[i] = 0;
+			send_kernel_message(dst, __prim_kmsg_handler, read_tsc(), i, 0,
+			                    KMSG_IMMEDIATE);
+			while (!READ_ONCE(s[i]))
+				cpu_relax();
+		}
+		prim_report("kmsg IPI", s, PRIM_NR_SAMPLES);
+	}
+
+	for (int i = 0; i < PRIM_NR_SAMPLES; i++) {
+		t0 = read_tsc();
+		kthread_yield();
+		s[i] = read_tsc() - t0;
+	}
+	prim_report("kthread_yield", s, PRIM_NR_SAMPLES);
+
+	sem_init(&sem, 0);
+	for (int i = 0; i < PRIM_NR_SAMPLES; i++) {
+		t0 = read_tsc();
+		sem_up(&sem);
+		sem_down(&sem);
+		s[i] = read_tsc() - t0;
+	}
+	prim_report("sem_up/sem_down", s, PRIM_NR_SAMPLES);
+
+	/* Each round trip blocks twice and switches kthreads twice. */
+	sem_init(&prim_ping, 0);
+	sem_init(&prim_pong, 0);
+	ktask("prim_ponger", __prim_sem_ponger, NULL);
+	for (int i = 0; i < PRIM_NR_SAMPLES; i++) {
+		t0 = read_tsc();
+		sem_up(&prim_ping);
+		sem_down(&prim_pong);
+		s[i] = read_tsc() - t0;
+	}
+	prim_report("sem ping-pong", s, PRIM_NR_SAMPLES);
+
+	for (int j = 0; j < ARRAY_SIZE(blk_sizes); j++) {
+		for (int i = 0; i < PRIM_NR_SAMPLES; i++) {
+			t0 = read_tsc();
+			freeb(block_alloc(blk_sizes[j], MEM_WAIT));
+			s[i] = read_tsc() - t0;
+		}
+		snprintf(name, sizeof(name), "block_alloc/freeb %lu", blk_sizes[j]);
+		prim_report(name, s, PRIM_NR_SAMPLES);
+	}
+
+	/* The same block goes around and around, so there's no allocation. */
+	q = qopen(4096, 0, NULL, NULL);
+	KT_ASSERT(q);
+	b = block_alloc(64, MEM_WAIT);
+	b->wp += 64;
+	for (int i = 0; i < PRIM_NR_SAMPLES; i++) {
+		t0 = read_tsc();
+		qbwrite(q, b);
+		b = qbread(q, 64);
+		s[i] = read_tsc() - t0;
+	}
+	KT_ASSERT(BLEN(b) == 64);
+	freeb(b);
+	qfree(q);
+	prim_report("qbwrite/qbread", s, PRIM_NR_SAMPLES);
+
+	kfree(s);
+	return true;
+}
+
+static atomic_t smp_tree_hits[MAX_NUM_CORES];
+
+static void __smp_tree_hit(void *opaque)
+{
+	atomic_inc(&smp_tree_hits[core_id()]);
+}
+
+/* smp_do_in_cores() has to run on every core in the set exactly once, and be
+ * done everywhere when it returns, whether or not we're in the set. */
+static bool test_smp_do_in_cores(void)
+{
+	const int nr_rounds = 100;
+	struct core_set cset;
+	uint64_t t0, ticks;
+
+	for (int with_me = 0; with_me < 2; with_me++) {
+		core_set_init(&cset);
+		core_set_fill_available(&cset);
+		if (!with_me)
+			core_set_clearcpu(&cset, core_id());
+		for (int i = 0; i < num_cores; i++)
+			atomic_set(&smp_tree_hits[i], 0);
+		t0 = read_tsc();
+		for (int r = 0; r < nr_rounds; r++)
+			smp_do_in_cores(&cset, __smp_tree_hit, NULL);
+		ticks = read_tsc() - t0;
+		for (int i = 0; i < num_cores; i++)
+			KT_ASSERT_M("A core ran the work the wrong number of times",
+			            atomic_read(&smp_tree_hits[i]) ==
+			            (core_set_getcpu(&cset, i) ? nr_rounds : 0));
+		printk("smp_do_in_cores, %d cores: %lu nsec\n",
+		       core_set_count(&cset), tsc2nsec(ticks) / nr_rounds);
+	}
+	return true;
+}
+
+#define RADIX_BENCH_NR_KEYS		(1 << 20)
+#define RADIX_BENCH_STRIDE		7919	/* prime, so we hit every key */
+#define RADIX_BENCH_GANG		64
+
+static struct radix_tree radix_bench_tree;
+static atomic_t radix_bench_misses;
+static uint64_t radix_bench_ticks[MAX_NUM_CORES];
+
+static void *radix_bench_item(unsigned long key)
+{
+	return (void*)((key << 1) | 1);
+}
+
+/* Every core looks up every key, in a different order, concurrently */
+static void __radix_bench_lookups(void *opaque)
+{
+	unsigned long key = core_id();
+	uint64_t t0 = read_tsc();
+
+	rcu_read_lock();
+	for (unsigned long i = 0; i < RADIX_BENCH_NR_KEYS; i++) {
+		key = (key + RADIX_BENCH_STRIDE) % RADIX_BENCH_NR_KEYS;
+		if (radix_lookup(&radix_bench_tree, key) != radix_bench_item(key))
+			atomic_inc(&radix_bench_misses);
+	}
+	rcu_read_unlock();
+	radix_bench_ticks[core_id()] = read_tsc() - t0;
+}
+
+/* Times inserts (with radix_preload(), like the page cache), gang lookups, and
+ * lockless lookups from one core and then all of them, with 1M keys. */
+static bool test_radix(void)
+{
+	struct radix_tree *tree = &radix_bench_tree;
+	void *results[RADIX_BENCH_GANG];
+	unsigned long key, nr_found = 0;
+	struct core_set cset;
+	uint64_t t0, ticks, sum;
+	int nr;
+
+	radix_tree_init(tree);
+	t0 = read_tsc();
+	for (key = 0; key < RADIX_BENCH_NR_KEYS; key++) {
+		radix_preload(tree, MEM_WAIT);
+		KT_ASSERT(!radix_insert(tree, key, radix_bench_item(key), NULL));
+	}
+	ticks = read_tsc() - t0;
+	KT_ASSERT(radix_insert(tree, 0, radix_bench_item(0), NULL) == -EEXIST);
+	printk("radix, %d keys: %lu nsec per insert\n", RADIX_BENCH_NR_KEYS,
+	       tsc2nsec(ticks) / RADIX_BENCH_NR_KEYS);
+
+	t0 = read_tsc();
+	rcu_read_lock();
+	for (key = 0; ; key += nr) {
+		nr = radix_gang_lookup(tree, results, key, RADIX_BENCH_GANG);
+		if (!nr)
+			break;
+		for (int i = 0; i < nr; i++)
+			KT_ASSERT_M("Gang lookup out of order",
+			            results[i] == radix_bench_item(key + i));
+		nr_found += nr;
+	}
+	rcu_read_unlock();
+	ticks = read_tsc() - t0;
+	KT_ASSERT_M("Gang lookup missed keys", nr_found == RADIX_BENCH_NR_KEYS);
+	printk("radix, gangs of %d: %lu nsec per item\n", RADIX_BENCH_GANG,
+	       tsc2nsec(ticks) / RADIX_BENCH_NR_KEYS);
+
+	atomic_set(&radix_bench_misses, 0);
+	__radix_bench_lookups(NULL);
+	printk("radix, 1 core: %lu nsec per lookup\n",
+	       tsc2nsec(radix_bench_ticks[core_id()]) / RADIX_BENCH_NR_KEYS);
+	core_set_init(&cset);
+	core_set_fill_available(&cset);
+	memset(radix_bench_ticks, 0, sizeof(radix_bench_ticks));
+	smp_do_in_cores(&cset, __radix_bench_lookups, NULL);
+	sum = 0;
+	for (int i = 0; i < num_cores; i++)
+		sum += radix_bench_ticks[i];
+	printk("radix, %d cores: %lu nsec per lookup\n", core_set_count(&cset),
+	       tsc2nsec(sum) / (RADIX_BENCH_NR_KEYS * core_set_count(&cset)));
+	KT_ASSERT_M("Lookups got the wrong items",
+	            !atomic_read(&radix_bench_misses));
+
+	/* Deletes free the rnodes with RCU, as they empty */
+	for (key = 0; key < RADIX_BENCH_NR_KEYS; key++)
+		KT_ASSERT(radix_delete(tree, key) == radix_bench_item(key));
+	KT_ASSERT(!radix_lookup(tree, RADIX_BENCH_NR_KEYS / 2));
+	radix_tree_destroy(tree);
+	rcu_barrier();
+	return true;
+}
+
+#define WQ_TEST_NR_WORKS		64
+
+struct wq_test_work {
+	struct work_struct			work;
+	int							idx;
+};
+
+static struct wq_test_work wq_test_works[WQ_TEST_NR_WORKS];
+static int wq_test_order[WQ_TEST_NR_WORKS];
+static atomic_t wq_test_nr_done;
+static struct semaphore wq_test_gate;
+
+static void __wq_test_order(struct work_struct *work)
+{
+	struct wq_test_work *w = container_of(work, struct wq_test_work, work);
+
+	wq_test_order[atomic_fetch_and_add(&wq_test_nr_done, 1)] = w->idx;
+}
+
+static void __wq_test_sleep(struct work_struct *work)
+{
+	kthread_usleep(1000);
+	atomic_inc(&wq_test_nr_done);
+}
+
+static void __wq_test_gate(struct work_struct *work)
+{
+	sem_down(&wq_test_gate);
+}
+
+static void __wq_test_count(struct work_struct *work)
+{
+	atomic_inc(&wq_test_nr_done);
+}
+
+/* Single threaded workqueues run in order, bound ones let workers step in when
+ * one blocks, and cancels get work that hasn't started. */
+static bool test_workqueue(void)
+{
+	struct workqueue_struct *wq;
+	struct work_struct gate, count;
+	struct delayed_work dwork;
+	uint64_t t0;
+
+	wq = create_singlethread_workqueue("ktest_ordered");
+	atomic_set(&wq_test_nr_done, 0);
+	for (int i = 0; i < WQ_TEST_NR_WORKS; i++) {
+		INIT_WORK(&wq_test_works[i].work, __wq_test_order);
+		wq_test_works[i].idx = i;
+		KT_ASSERT(queue_work(wq, &wq_test_works[i].work));
+	}
+	flush_workqueue(wq);
+	KT_ASSERT(atomic_read(&wq_test_nr_done) == WQ_TEST_NR_WORKS);
+	for (int i = 0; i < WQ_TEST_NR_WORKS; i++)
+		KT_ASSERT_M("Ordered work ran out of order", wq_test_order[i] == i);
+
+	/* With the gate up, nothing else on wq can start. */
+	sem_init(&wq_test_gate, 0);
+	INIT_WORK(&gate, __wq_test_gate);
+	INIT_WORK(&count, __wq_test_count);
+	INIT_DELAYED_WORK(&dwork, __wq_test_count);
+	atomic_set(&wq_test_nr_done, 0);
+	KT_ASSERT(queue_work(wq, &gate));
+	KT_ASSERT(queue_work(wq, &count));
+	KT_ASSERT_M("Queued pending work twice", !queue_work(wq, &count));
+	KT_ASSERT(work_pending(&count));
+	KT_ASSERT(cancel_work(&count));
+	KT_ASSERT(!work_pending(&count));
+	KT_ASSERT(!cancel_work(&count));
+	KT_ASSERT(queue_delayed_work(wq, &dwork, 1000));
+	KT_ASSERT(cancel_delayed_work(&dwork));
+	KT_ASSERT(!delayed_work_pending(&dwork));
+	sem_up(&wq_test_gate);
+	flush_workqueue(wq);
+	KT_ASSERT(atomic_read(&wq_test_nr_done) == 0);
+
+	KT_ASSERT(queue_delayed_work(wq, &dwork, 5));
+	kthread_usleep(20000);
+	flush_workqueue(wq);
+	KT_ASSERT_M("Delayed work didn't run", atomic_read(&wq_test_nr_done) == 1);
+	destroy_workqueue(wq);
+
+	/* They all sleep for a msec.  One worker at a time would take 64 msec. */
+	wq = alloc_workqueue("ktest_bound", 0, 0);
+	atomic_set(&wq_test_nr_done, 0);
+	t0 = read_tsc();
+	for (int i = 0; i < WQ_TEST_NR_WORKS; i++) {
+		INIT_WORK(&wq_test_works[i].work, __wq_test_sleep);
+		KT_ASSERT(queue_work(wq, &wq_test_works[i].work));
+	}
+	flush_workqueue(wq);
+	KT_ASSERT(atomic_read(&wq_test_nr_done) == WQ_TEST_NR_WORKS);
+	printk("%d sleeping work items on one core: %lu usec\n",
+	       WQ_TEST_NR_WORKS, tsc2usec(read_tsc() - t0));
+	destroy_workqueue(wq);
+	return true;
+}
+
+#define REXCL_NR_SLEEPERS		8
+
+static struct rendez rexcl_rv;
+static atomic_t rexcl_tokens;
+static atomic_t rexcl_nr_woke;
+
+static int rexcl_has_token(void *arg)
+{
+	return atomic_read(&rexcl_tokens) > 0;
+}
+
+static void __rexcl_sleeper(void *arg)
+{
+	rendez_sleep_excl(&rexcl_rv, rexcl_has_token, NULL);
+	atomic_inc(&rexcl_nr_woke);
+	atomic_dec(&rexcl_tokens);
+}
+
+/* A wakeup gets one exclusive sleeper, and wakeup_all gets the rest. */
+static bool test_rendez_excl(void)
+{
+	rendez_init(&rexcl_rv);
+	atomic_set(&rexcl_tokens, 0);
+	atomic_set(&rexcl_nr_woke, 0);
+	for (int i = 0; i < REXCL_NR_SLEEPERS; i++)
+		ktask("rexcl", __rexcl_sleeper, NULL);
+	/* Wait until they're all asleep */
+	while (rexcl_rv.cv.nr_waiters != REXCL_NR_SLEEPERS)
+		kthread_usleep(1000);
+	atomic_set(&rexcl_tokens, 1);
+	KT_ASSERT(rendez_wakeup(&rexcl_rv));
+	kthread_usleep(10000);
+	KT_ASSERT_M("Wakeup woke more than one exclusive sleeper",
+	            atomic_read(&rexcl_nr_woke) == 1);
+	KT_ASSERT(rexcl_rv.cv.nr_waiters == REXCL_NR_SLEEPERS - 1);
+	atomic_set(&rexcl_tokens, REXCL_NR_SLEEPERS);
+	KT_ASSERT(rendez_wakeup_all(&rexcl_rv));
+	while (atomic_read(&rexcl_nr_woke) != REXCL_NR_SLEEPERS)
+		kthread_usleep(1000);
+	KT_ASSERT(!rexcl_rv.cv.nr_waiters);
+	KT_ASSERT(!rendez_wakeup(&rexcl_rv));
+	return true;
+}
+
+static bool page_is_zero(void *kva)
+{
+	uint64_t *p = kva;
+
+	for (int i = 0; i < PGSIZE / sizeof(uint64_t); i++) {
+		if (p[i])
+			return false;
+	}
+	return true;
+}
+
+/* Pages from the zero pool are zeroed, even if they were dirty when the pool
+ * got them.  Other cores might be refilling or using the pool too. */
+static bool test_zpool(void)
+{
+	void *kvas[16];
+	void *kva;
+	bool filled;
+
+	zpool_drain();
+	/* Dirty some pages; the refill will probably get them back from the
+	 * kpages magazines. */
+	for (int i = 0; i < ARRAY_SIZE(kvas); i++) {
+		kvas[i] = kpages_alloc(PGSIZE, MEM_WAIT);
+		memset(kvas[i], 0xab, PGSIZE);
+	}
+	kpages_free_batch(kvas, PGSIZE, ARRAY_SIZE(kvas));
+	disable_irq();
+	filled = zpool_idle_refill();
+	enable_irq();
+	for (int i = 0; i < ARRAY_SIZE(kvas); i++) {
+		kvas[i] = zpool_get(numa_mem_nodes, NUMA_NODE_LOCAL);
+		if (!kvas[i])
+			break;
+		KT_ASSERT_M("Zero pool page wasn't zeroed", page_is_zero(kvas[i]));
+		kpages_free(kvas[i], PGSIZE);
+	}
+	if (!filled)
+		printk("zpool: didn't refill (off, full, or memory is low)\n");
+	/* With the pool empty, kpage_zalloc_addr() zeroes the page itself */
+	zpool_drain();
+	kva = kpage_zalloc_addr();
+	KT_ASSERT(kva);
+	KT_ASSERT(page_is_zero(kva));
+	kpages_free(kva, PGSIZE);
+	return true;
+}
+
+static bool rcu_exp_cb_ran;
+
+static void __rcu_exp_cb(struct rcu_head *head)
+{
+	WRITE_ONCE(rcu_exp_cb_ran, TRUE);
+}
+
+/* An expedited GP waits for CBs queued before it, actually gets expedited, and
+ * hopefully beats a normal one. */
+static bool test_rcu_expedited(void)
+{
+	struct rcu_head head;
+	unsigned long completed = READ_ONCE(rcu_state.completed);
+	unsigned long nr_exp = READ_ONCE(rcu_state.nr_exp_gps);
+	uint64_t t0, norm, exp;
+	int nr_rounds = 10;
+
+	init_rcu_head_on_stack(&head);
+	rcu_exp_cb_ran = FALSE;
+	call_rcu(&head, __rcu_exp_cb);
+	synchronize_rcu_expedited();
+	KT_ASSERT_M("Expedited GP didn't wait for an earlier CB",
+	            READ_ONCE(rcu_exp_cb_ran));
+	KT_ASSERT(ULONG_CMP_LT(completed, READ_ONCE(rcu_state.completed)));
+	KT_ASSERT_M("GP kthread didn't expedite",
+	            READ_ONCE(rcu_state.nr_exp_gps) != nr_exp);
+
+	t0 = read_tsc();
+	for (int i = 0; i < nr_rounds; i++)
+		synchronize_rcu();
+	norm = read_tsc() - t0;
+	t0 = read_tsc();
+	for (int i = 0; i < nr_rounds; i++)
+		synchronize_rcu_expedited();
+	exp = read_tsc() - t0;
+	printk("synchronize_rcu: %lu usec, expedited: %lu usec\n",
+	       tsc2usec(norm) / nr_rounds, tsc2usec(exp) / nr_rounds);
+	return true;
+}
+
+#define U16_BENCH_ROUNDS		10000
+#define U16_BENCH_HELD			8
+
+static struct u16_pool *u16_bench_pool;
+static atomic_t u16_bench_fails;
+static uint64_t u16_bench_ticks[MAX_NUM_CORES];
+
+/* Every core holds a few IDs at a time, like RPCs in flight */
+static void __u16_bench(void *opaque)
+{
+	int held[U16_BENCH_HELD];
+	uint64_t t0 = read_tsc();
+
+	for (int r = 0; r < U16_BENCH_ROUNDS; r++) {
+		for (int i = 0; i < U16_BENCH_HELD; i++) {
+			held[i] = get_u16(u16_bench_pool);
+			if (held[i] < 0)
+				atomic_inc(&u16_bench_fails);
+		}
+		for (int i = 0; i < U16_BENCH_HELD; i++) {
+			if (held[i] >= 0)
+				put_u16(u16_bench_pool, held[i]);
+		}
+	}
+	u16_bench_ticks[core_id()] = read_tsc() - t0;
+}
+
+/* After a run, every ID is free exactly once, wherever it's cached */
+static bool u16_pool_all_free(struct u16_pool *id)
+{
+	uint8_t *seen = kzmalloc(id->size, MEM_WAIT);
+	bool ret = TRUE;
+	int v;
+
+	for (int i = 0; i < id->size; i++) {
+		v = get_u16(id);
+		if (v < 0 || seen[v]) {
+			ret = FALSE;
+			break;
+		}
+		seen[v] = 1;
+	}
+	if (ret && get_u16(id) != -1)
+		ret = FALSE;
+	for (int i = 0; i < id->size; i++) {
+		if (seen[i])
+			put_u16(id, i);
+	}
+	kfree(seen);
+	return ret;
+}
+
+/* Compares get/put on the plain pool and the per-core pool, with every core
+ * hammering on it. */
+static bool test_u16pool_pcpu(void)
+{
+	struct u16_pool *pools[2];
+	const char *names[2] = {"plain", "pcpu"};
+	struct core_set cset;
+	uint64_t sum;
+
+	pools[0] = create_u16_pool(MAX_U16_POOL_SZ);
+	pools[1] = create_u16_pool_pcpu(MAX_U16_POOL_SZ);
+	KT_ASSERT(pools[0] && pools[1]);
+	core_set_init(&cset);
+	core_set_fill_available(&cset);
+	for (int p = 0; p < 2; p++) {
+		u16_bench_pool = pools[p];
+		atomic_set(&u16_bench_fails, 0);
+		memset(u16_bench_ticks, 0, sizeof(u16_bench_ticks));
+		smp_do_in_cores(&cset, __u16_bench, NULL);
+		KT_ASSERT_M("get_u16 failed with IDs to spare",
+		            !atomic_read(&u16_bench_fails));
+		sum = 0;
+		for (int i = 0; i < num_cores; i++)
+			sum += u16_bench_ticks[i];
+		printk("u16 pool, %s, %d cores: %lu nsec per get/put\n", names[p],
+		       core_set_count(&cset), tsc2nsec(sum) / (core_set_count(&cset) *
+		       U16_BENCH_ROUNDS * U16_BENCH_HELD));
+		KT_ASSERT_M("Lost or duplicated an ID", u16_pool_all_free(pools[p]));
+	}
+	/* u16 pools cannot be freed, so these leak, like in test_u16pool */
+	return true;
+}
+
+#define APIPE_BENCH_NR			(1 << 20)
+#define APIPE_BENCH_BATCH		16
+
+static struct atomic_pipe apipe_bench_pipe;
+static bool apipe_bench_bulk;
+
+/* Writes the sequence [0, APIPE_BENCH_NR), with reserve/commit if we can */
+static void __apipe_bench_writer(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct atomic_pipe *ap = &apipe_bench_pipe;
+	unsigned long batch[APIPE_BENCH_BATCH];
+	unsigned long seq = 0;
+	size_t nr;
+
+	while (seq < APIPE_BENCH_NR) {
+		if (apipe_bench_bulk) {
+			nr = apipe_write_reserve(ap, APIPE_BENCH_BATCH);
+			for (size_t i = 0; i < nr; i++)
+				*(unsigned long*)apipe_write_slot(ap, i) = seq + i;
+			apipe_write_commit(ap, nr);
+		} else {
+			for (int i = 0; i < APIPE_BENCH_BATCH; i++)
+				batch[i] = seq + i;
+			nr = apipe_write(ap, batch, APIPE_BENCH_BATCH);
+		}
+		if (!nr)
+			break;
+		seq += nr;
+	}
+	apipe_close_writer(ap);
+}
+
+/* Runs a writer on another core (if we have one) and reads back the sequence,
+ * returning the ticks it took or 0 if anything was out of order. */
+static uint64_t apipe_bench_run(bool spsc, bool bulk, void *buf)
+{
+	struct atomic_pipe *ap = &apipe_bench_pipe;
+	unsigned long batch[APIPE_BENCH_BATCH];
+	unsigned long seq = 0;
+	uint64_t t0;
+	int nr;
+
+	if (spsc)
+		apipe_init_spsc(ap, buf, PGSIZE, sizeof(unsigned long));
+	else
+		apipe_init(ap, buf, PGSIZE, sizeof(unsigned long));
+	apipe_bench_bulk = bulk;
+	t0 = read_tsc();
+	send_kernel_message(num_cores > 1 ? 1 : 0, __apipe_bench_writer, 0, 0, 0,
+	                    KMSG_ROUTINE);
+	while ((nr = apipe_read(ap, batch, APIPE_BENCH_BATCH))) {
+		for (int i = 0; i < nr; i++) {
+			if (batch[i] != seq++) {
+				/* The writer will bail once the pipe fills */
+				apipe_close_reader(ap);
+				return 0;
+			}
+		}
+	}
+	if (seq != APIPE_BENCH_NR)
+		return 0;
+	return read_tsc() - t0;
+}
+
+/* SPSC pipes pass everything along in order, with and without reserve/commit,
+ * and how they compare to the locked pipe. */
+static bool test_apipe_spsc(void)
+{
+	void *buf = kpage_alloc_addr();
+	uint64_t locked, spsc, bulk;
+
+	KT_ASSERT(buf);
+	locked = apipe_bench_run(FALSE, FALSE, buf);
+	KT_ASSERT_M("Locked pipe lost or reordered elems", locked);
+	spsc = apipe_bench_run(TRUE, FALSE, buf);
+	KT_ASSERT_M("SPSC pipe lost or reordered elems", spsc);
+	bulk = apipe_bench_run(TRUE, TRUE, buf);
+	KT_ASSERT_M("SPSC reserve/commit lost or reordered elems", bulk);
+	printk("apipe, nsec per elem: locked %lu, spsc %lu, spsc reserve %lu\n",
+	       tsc2nsec(locked) / APIPE_BENCH_NR, tsc2nsec(spsc) / APIPE_BENCH_NR,
+	       tsc2nsec(bulk) / APIPE_BENCH_NR);
+	kpages_free(buf, PGSIZE);
+	return true;
+}
+
+/* Stores a text-ish page, a same-filled page, and a page of noise, then checks
+ * what comes back. */
+static bool test_zstore(void)
+{
+	struct zstore_map *zm;
+	uint8_t *orig, *kva;
+	uint64_t x = 88172645463325252ULL;
+	uint64_t *words;
+
+	if (!zstore_is_on()) {
+		printk("zstore is off, skipping\n");
+		return true;
+	}
+	zm = zstore_map_alloc(MEM_WAIT);
+	orig = kpages_alloc(PGSIZE, MEM_WAIT);
+	kva = kpages_alloc(PGSIZE, MEM_WAIT);
+
+	for (int i = 0; i < PGSIZE; i++)
+		orig[i] = "compress me, please "[i % 20];
+	KT_ASSERT(!zstore_store(zm, 3, orig));
+	/* Storing the same index again replaces the old copy */
+	KT_ASSERT(!zstore_store(zm, 3, orig));
+	KT_ASSERT(zm->nr_pages == 1);
+	KT_ASSERT(zstore_load(zm, 3, kva));
+	KT_ASSERT_M("Page didn't survive the store", !memcmp(orig, kva, PGSIZE));
+	KT_ASSERT_M("Loads should be exclusive", !zstore_load(zm, 3, kva));
+
+	memset(orig, 0x5a, PGSIZE);
+	KT_ASSERT(!zstore_store(zm, 7, orig));
+	memset(kva, 0, PGSIZE);
+	KT_ASSERT(zstore_load(zm, 7, kva));
+	KT_ASSERT(!memcmp(orig, kva, PGSIZE));
+
+	words = (uint64_t*)orig;
+	for (int i = 0; i < PGSIZE / sizeof(uint64_t); i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		words[i] = x;
+	}
+	KT_ASSERT_M("Noise shouldn't compress", zstore_store(zm, 9, orig) != 0);
+	KT_ASSERT(!zstore_load(zm, 9, kva));
+
+	memset(orig, 0, PGSIZE);
+	for (int i = 10; i < 20; i++)
+		KT_ASSERT(!zstore_store(zm, i, orig));
+	zstore_drop_range(zm, 12, 4);
+	KT_ASSERT(zm->nr_pages == 6);
+	KT_ASSERT(!zstore_load(zm, 13, kva));
+	KT_ASSERT(zstore_load(zm, 16, kva));
+	/* Frees the rest */
+	zstore_map_free(zm);
+
+	kpages_free(orig, PGSIZE);
+	kpages_free(kva, PGSIZE);
+	return true;
+}
+
 static struct ktest ktests[] = {
 #ifdef CONFIG_X86
 	KTEST_REG(ipi_sending,        CONFIG_TEST_ipi_sending),
@@ -2041,6 +3776,7 @@ static struct ktest ktests[] = {
 	KTEST_REG(setjmp,             CONFIG_TEST_setjmp),
 	KTEST_REG(apipe,              CONFIG_TEST_apipe),
 	KTEST_REG(rwlock,             CONFIG_TEST_rwlock),
+	KTEST_REG(brlock,             CONFIG_TEST_brlock),
 	KTEST_REG(rv,                 CONFIG_TEST_rv),
 	KTEST_REG(alarm,              CONFIG_TEST_alarm),
 	KTEST_REG(kmalloc_incref,     CONFIG_TEST_kmalloc_incref),
@@ -2050,6 +3786,32 @@ static struct ktest ktests[] = {
 	KTEST_REG(cmdline_parse,      CONFIG_TEST_cmdline_parse),
 	KTEST_REG(percpu_zalloc,      CONFIG_TEST_percpu_zalloc),
 	KTEST_REG(percpu_increment,   CONFIG_TEST_percpu_increment),
+	KTEST_REG(kmem_cache_batch,   CONFIG_TEST_kmem_cache_batch),
+	KTEST_REG(kmalloc_sized,      CONFIG_TEST_kmalloc_sized),
+	KTEST_REG(alloc_prof,         CONFIG_TEST_alloc_prof),
+	KTEST_REG(kmem_reclaim,       CONFIG_TEST_kmem_reclaim),
+	KTEST_REG(kmalloc_frag,       CONFIG_TEST_kmalloc_frag),
+	KTEST_REG(qio_spsc,           CONFIG_TEST_qio_spsc),
+	KTEST_REG(qio_iov,            CONFIG_TEST_qio_iov),
+	KTEST_REG(ptclbsum,           CONFIG_TEST_ptclbsum),
+	KTEST_REG(v4route,            CONFIG_TEST_v4route),
+	KTEST_REG(corealloc,          CONFIG_TEST_corealloc),
+	KTEST_REG(kmsg_latency,       CONFIG_TEST_kmsg_latency),
+	KTEST_REG(smp_do_in_cores,    CONFIG_TEST_smp_do_in_cores),
+	KTEST_REG(radix,              CONFIG_TEST_radix),
+	KTEST_REG(alarm_wheel,        CONFIG_TEST_alarm_wheel),
+	KTEST_REG(microb_prims,       CONFIG_TEST_microb_prims),
+	KTEST_REG(rhashtable,         CONFIG_TEST_rhashtable),
+	KTEST_REG(microb_string,      CONFIG_TEST_microb_string),
+	KTEST_REG(bpf,                CONFIG_TEST_bpf),
+	KTEST_REG(aes_gcm,            CONFIG_TEST_aes_gcm),
+	KTEST_REG(workqueue,          CONFIG_TEST_workqueue),
+	KTEST_REG(rendez_excl,        CONFIG_TEST_rendez_excl),
+	KTEST_REG(zpool,              CONFIG_TEST_zpool),
+	KTEST_REG(rcu_expedited,      CONFIG_TEST_rcu_expedited),
+	KTEST_REG(u16pool_pcpu,       CONFIG_TEST_u16pool_pcpu),
+	KTEST_REG(apipe_spsc,         CONFIG_TEST_apipe_spsc),
+	KTEST_REG(zstore,             CONFIG_TEST_zstore),
 };
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
 linker_func_1(register_pb_ktests)
@@ -0,0 +1,374 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Core-scaling benchmarks.
+ *
+ * Each test runs one primitive on 1, 2, 4, ... cores, up to all of them, and
+ * reports the throughput per core at each count, along with how that compares
+ * to one core.  A primitive that scales perfectly stays at 100%.  Every core
+ * in a run waits for the others before it starts, then does batches of ops for
+ * SCALE_MSEC.
+ *
+ * With CONFIG_SCALE_KTESTS_MIN_PCT set, a test fails if any core count falls
+ * below that percentage of the one-core throughput, so a scalability
+ * regression shows up as a failed ktest. */
+
+#include <smp.h>
+#include <core_set.h>
+#include <atomic.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <page_alloc.h>
+#include <rcu.h>
+#include <ns.h>
+#include <net/ip.h>
+#include <trap.h>
+#include <ktest.h>
+#include <linker_func.h>
+
+KTEST_SUITE("SCALE")
+
+#define SCALE_MSEC				100
+#define SCALE_BATCH				64
+
+struct scale_bench {
+	char						*name;
+	void (*setup)(void);
+	void (*cleanup)(void);
+	/* Optional, called before each run with the cores in it */
+	void (*prep)(struct core_set *cset);
+	/* Does a batch of ops on this core, returns how many */
+	unsigned long (*run)(int coreid);
+};
+
+struct scale_run {
+	struct scale_bench			*sb;
+	int							nr_cores;
+	atomic_t					nr_arrived;
+	uint64_t					duration;
+};
+
+static uint64_t scale_ops[MAX_NUM_CORES];
+static uint64_t scale_ticks[MAX_NUM_CORES];
+
+static void __scale_core(void *arg)
+{
+	struct scale_run *sr = arg;
+	int coreid = core_id();
+	uint64_t t0, end, ops = 0;
+
+	/* Start together, or the first cores get the primitive to themselves */
+	atomic_inc(&sr->nr_arrived);
+	while (atomic_read(&sr->nr_arrived) < sr->nr_cores)
+		cpu_relax();
+	t0 = read_tsc();
+	end = t0 + sr->duration;
+	do {
+		ops += sr->sb->run(coreid);
+	} while (read_tsc() < end);
+	scale_ticks[coreid] = read_tsc() - t0;
+	scale_ops[coreid] = ops;
+}
+
+/* Us, then the lowest core ids */
+static void scale_fill_cores(struct core_set *cset, int nr)
+{
+	core_set_init(cset);
+	core_set_setcpu(cset, core_id());
+	for (int i = 0; core_set_count(cset) < nr; i++)
+		core_set_setcpu(cset, i);
+}
+
+/* Ops per msec per core, averaged over the cores in cset */
+static uint64_t scale_one(struct scale_bench *sb, int nr)
+{
+	struct scale_run sr;
+	struct core_set cset;
+	uint64_t ops = 0, ticks = 0;
+
+	scale_fill_cores(&cset, nr);
+	if (sb->prep)
+		sb->prep(&cset);
+	sr.sb = sb;
+	sr.nr_cores = nr;
+	atomic_init(&sr.nr_arrived, 0);
+	sr.duration = msec2tsc(SCALE_MSEC);
+	smp_do_in_cores(&cset, __scale_core, &sr);
+	for (int i = 0; i < num_cores; i++) {
+		if (!core_set_getcpu(&cset, i))
+			continue;
+		ops += scale_ops[i];
+		ticks += scale_ticks[i];
+	}
+	return ops / MAX(tsc2msec(ticks), 1);
+}
+
+static bool scale_test(struct scale_bench *sb)
+{
+	uint64_t base = 0, per_core;
+	unsigned int pct;
+	bool ok = true;
+
+	if (sb->setup)
+		sb->setup();
+	for (int nr = 1; ; nr = MIN(nr * 2, num_cores)) {
+		per_core = scale_one(sb, nr);
+		if (nr == 1)
+			base = MAX(per_core, 1);
+		pct = per_core * 100 / base;
+		printk("scale %s, %3d cores: %lu ops/msec/core, %u%% of 1 core\n",
+		       sb->name, nr, per_core, pct);
+		if (pct < CONFIG_SCALE_KTESTS_MIN_PCT)
+			ok = false;
+		if (nr == num_cores)
+			break;
+	}
+	if (sb->cleanup)
+		sb->cleanup();
+	KT_ASSERT_M("Scaling fell below CONFIG_SCALE_KTESTS_MIN_PCT", ok);
+	return true;
+}
+
+/* slab: every core allocs and frees batches from one shared cache, so this
+ * mostly exercises the per-core magazines and the depot behind them. */
+static struct kmem_cache *scale_kc;
+
+static void scale_slab_setup(void)
+{
+	scale_kc = kmem_cache_create("scale_ktest", 64, 0, 0, NULL, NULL, NULL,
+	                             NULL);
+}
+
+static void scale_slab_cleanup(void)
+{
+	kmem_cache_destroy(scale_kc);
+}
+
+static unsigned long scale_slab_run(int coreid)
+{
+	void *objs[SCALE_BATCH];
+
+	for (int i = 0; i < SCALE_BATCH; i++)
+		objs[i] = kmem_cache_alloc(scale_kc, MEM_WAIT);
+	for (int i = 0; i < SCALE_BATCH; i++)
+		kmem_cache_free(scale_kc, objs[i]);
+	return SCALE_BATCH;
+}
+
+static struct scale_bench scale_slab = {
+	.name = "slab",
+	.setup = scale_slab_setup,
+	.cleanup = scale_slab_cleanup,
+	.run = scale_slab_run,
+};
+
+static bool test_scale_slab(void)
+{
+	return scale_test(&scale_slab);
+}
+
+/* qio: each core writes and reads back small messages on its own queue.
+ * Nothing is shared but the block allocator. */
+#define SCALE_QIO_MSG			64
+
+static struct queue *scale_qs[MAX_NUM_CORES];
+
+static void scale_qio_setup(void)
+{
+	for (int i = 0; i < num_cores; i++)
+		scale_qs[i] = qopen(2 * SCALE_BATCH * SCALE_QIO_MSG, Qmsg, NULL,
+		                    NULL);
+}
+
+static void scale_qio_cleanup(void)
+{
+	for (int i = 0; i < num_cores; i++)
+		qfree(scale_qs[i]);
+}
+
+static unsigned long scale_qio_run(int coreid)
+{
+	struct queue *q = scale_qs[coreid];
+	uint8_t buf[SCALE_QIO_MSG];
+
+	memset(buf, coreid, sizeof(buf));
+	for (int i = 0; i < SCALE_BATCH; i++)
+		qwrite(q, buf, sizeof(buf));
+	for (int i = 0; i < SCALE_BATCH; i++)
+		qread(q, buf, sizeof(buf));
+	return SCALE_BATCH;
+}
+
+static struct scale_bench scale_qio = {
+	.name = "qio",
+	.setup = scale_qio_setup,
+	.cleanup = scale_qio_cleanup,
+	.run = scale_qio_run,
+};
+
+static bool test_scale_qio(void)
+{
+	return scale_test(&scale_qio);
+}
+
+/* rcu: read-side critical sections, plus a call_rcu() whenever this core's
+ * last one ran.  The other cores don't pass through quiescent states until the
+ * run ends, so there's only one callback in flight per core, not a pile of
+ * memory waiting on a grace period. */
+static struct rcu_head scale_rcu_heads[MAX_NUM_CORES];
+static bool scale_rcu_pending[MAX_NUM_CORES];
+
+static void __scale_rcu_cb(struct rcu_head *head)
+{
+	WRITE_ONCE(scale_rcu_pending[head - scale_rcu_heads], FALSE);
+}
+
+static void scale_rcu_cleanup(void)
+{
+	rcu_barrier();
+}
+
+static unsigned long scale_rcu_run(int coreid)
+{
+	for (int i = 0; i < SCALE_BATCH; i++) {
+		rcu_read_lock();
+		cmb();
+		rcu_read_unlock();
+	}
+	if (!READ_ONCE(scale_rcu_pending[coreid])) {
+		scale_rcu_pending[coreid] = TRUE;
+		call_rcu(&scale_rcu_heads[coreid], __scale_rcu_cb);
+	}
+	return SCALE_BATCH;
+}
+
+static struct scale_bench scale_rcu = {
+	.name = "rcu",
+	.cleanup = scale_rcu_cleanup,
+	.run = scale_rcu_run,
+};
+
+static bool test_scale_rcu(void)
+{
+	return scale_test(&scale_rcu);
+}
+
+/* kmsg: every core sends immediate kmsgs to the next core in the run, in a
+ * ring, and waits for its batch to land.  Only the receiver of a core's kmsgs
+ * writes its done count.  The other cores run us from a routine kmsg, with
+ * IRQs off, so turn them on to receive. */
+static uint32_t scale_kmsg_dst[MAX_NUM_CORES];
+static unsigned long scale_kmsg_done[MAX_NUM_CORES];
+
+static void __scale_kmsg_handler(uint32_t srcid, long a0, long a1, long a2)
+{
+	WRITE_ONCE(scale_kmsg_done[srcid], scale_kmsg_done[srcid] + 1);
+}
+
+static void scale_kmsg_prep(struct core_set *cset)
+{
+	int first = -1, prev = -1;
+
+	for (int i = 0; i < num_cores; i++) {
+		if (!core_set_getcpu(cset, i))
+			continue;
+		if (first < 0)
+			first = i;
+		else
+			scale_kmsg_dst[prev] = i;
+		prev = i;
+	}
+	scale_kmsg_dst[prev] = first;
+	memset(scale_kmsg_done, 0, sizeof(scale_kmsg_done));
+}
+
+static unsigned long scale_kmsg_run(int coreid)
+{
+	unsigned long goal = READ_ONCE(scale_kmsg_done[coreid]) + SCALE_BATCH;
+	int8_t irq_state = 0;
+
+	enable_irqsave(&irq_state);
+	for (int i = 0; i < SCALE_BATCH; i++)
+		send_kernel_message(scale_kmsg_dst[coreid], __scale_kmsg_handler, 0,
+		                    0, 0, KMSG_IMMEDIATE);
+	while (READ_ONCE(scale_kmsg_done[coreid]) < goal)
+		cpu_relax();
+	disable_irqsave(&irq_state);
+	return SCALE_BATCH;
+}
+
+static struct scale_bench scale_kmsg = {
+	.name = "kmsg",
+	.prep = scale_kmsg_prep,
+	.run = scale_kmsg_run,
+};
+
+static bool test_scale_kmsg(void)
+{
+	return scale_test(&scale_kmsg);
+}
+
+/* page allocator: batches of single pages, allocated and freed. */
+static unsigned long scale_pages_run(int coreid)
+{
+	void *pgs[SCALE_BATCH];
+	size_t nr;
+
+	nr = kpages_alloc_batch(pgs, PGSIZE, SCALE_BATCH, MEM_WAIT);
+	kpages_free_batch(pgs, PGSIZE, nr);
+	return nr;
+}
+
+static struct scale_bench scale_pages = {
+	.name = "pages",
+	.run = scale_pages_run,
+};
+
+static bool test_scale_pages(void)
+{
+	return scale_test(&scale_pages);
+}
+
+/* net: the per-packet work that doesn't depend on a NIC: allocate an MTU
+ * block, fill it, checksum it, free it. */
+#define SCALE_NET_MTU			1500
+
+static unsigned long scale_net_run(int coreid)
+{
+	struct block *bp;
+
+	for (int i = 0; i < SCALE_BATCH; i++) {
+		bp = block_alloc(SCALE_NET_MTU, MEM_WAIT);
+		memset(bp->wp, i, SCALE_NET_MTU);
+		bp->wp += SCALE_NET_MTU;
+		ptclbsum(bp->rp, BLEN(bp));
+		freeb(bp);
+	}
+	return SCALE_BATCH;
+}
+
+static struct scale_bench scale_net = {
+	.name = "net",
+	.run = scale_net_run,
+};
+
+static bool test_scale_net(void)
+{
+	return scale_test(&scale_net);
+}
+
+static struct ktest ktests[] = {
+	KTEST_REG(scale_slab,		CONFIG_TEST_scale_slab),
+	KTEST_REG(scale_qio,		CONFIG_TEST_scale_qio),
+	KTEST_REG(scale_rcu,		CONFIG_TEST_scale_rcu),
+	KTEST_REG(scale_kmsg,		CONFIG_TEST_scale_kmsg),
+	KTEST_REG(scale_pages,		CONFIG_TEST_scale_pages),
+	KTEST_REG(scale_net,		CONFIG_TEST_scale_net),
+};
+
+static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
+
+linker_func_1(register_scale_ktests)
+{
+	REGISTER_KTESTS(ktests, num_ktests);
+}
@@ -13,6 +13,9 @@
 #include <schedule.h>
 #include <kstack.h>
 #include <kmalloc.h>
+#include <percpu.h>
+#include <latency.h>
+#include <profiler.h>
 #include <arch/uaccess.h>
 
 #define KSTACK_NR_GUARD_PGS		1
@@ -104,6 +107,112 @@ struct kthread *__kthread_zalloc(void)
 	return kthread;
 }
 
+#define KTH_LAT_BUCKETS			20
+
+struct kthread_stats {
+	uint64_t					nr_cache_hits;
+	uint64_t					nr_allocs;
+	uint64_t					nr_frees;
+	uint64_t					lat_hist[KTH_LAT_BUCKETS];
+};
+
+static DEFINE_PERCPU(struct kthread_stats, kth_stats);
+
+/* Frees kth and its stack.  kth can't be the kthread whose stack we're on. */
+static void __kthread_free(struct kthread *kth)
+{
+	put_kstack(kth->stacktop);
+	kfree(kth->sysc_str);
+	kmem_cache_free(kthread_kcache, kth);
+	PERCPU_VARPTR(kth_stats)->nr_frees++;
+}
+
+/* Returns a kthread, with a stack, that can take over for the current one.  We
+ * only go to the slabs if the core's cache is empty.  IRQs must be disabled,
+ * which protects the cache. */
+static struct kthread *__kthread_get(struct per_cpu_info *pcpui)
+{
+	struct kthread *kth;
+
+	if (pcpui->nr_kth_cache) {
+		kth = pcpui->kth_cache[--pcpui->nr_kth_cache];
+		/* The old flags could have KTH_IS_KTASK set.  The reason is that the
+		 * launching of blocked kthreads also uses PRKM, and that KMSG
+		 * (__launch_kthread) doesn't return.  Thus the soon-to-be cached
+		 * kthread, that is launching another, has flags & KTH_IS_KTASK set. */
+		kth->flags = KTH_DEFAULT_FLAGS;
+		kth->proc = 0;
+		kth->name = 0;
+		PERCPU_VARPTR(kth_stats)->nr_cache_hits++;
+		return kth;
+	}
+	kth = __kthread_zalloc();
+	kth->flags = KTH_DEFAULT_FLAGS;
+	kth->stacktop = get_kstack();
+	PERCPU_VARPTR(kth_stats)->nr_allocs++;
+	return kth;
+}
+
+/* Puts kth in the core's cache.  If the cache is full, we free one of the
+ * others, never kth: restart_kthread gives us the kthread whose stack we're
+ * still on.  IRQs must be disabled. */
+static void __kthread_put(struct per_cpu_info *pcpui, struct kthread *kth)
+{
+	if (pcpui->nr_kth_cache == KTH_CACHE_NR)
+		__kthread_free(pcpui->kth_cache[--pcpui->nr_kth_cache]);
+	pcpui->kth_cache[pcpui->nr_kth_cache++] = kth;
+}
+
+/* Tracks how long kth slept in sem_down, measured when it gets a core back. */
+static void __note_kthread_restart(struct kthread *kth)
+{
+	uint64_t usec;
+	int bucket;
+
+	if (kth->runnable_tsc) {
+		lat_record(LAT_KTHREAD_WAKEUP, read_tsc() - kth->runnable_tsc);
+		kth->runnable_tsc = 0;
+	}
+	if (!kth->block_tsc)
+		return;
+	kth->offcpu_tsc = read_tsc() - kth->block_tsc;
+	usec = tsc2usec(kth->offcpu_tsc);
+	kth->block_tsc = 0;
+	bucket = usec ? LOG2_DOWN(usec) + 1 : 0;
+	PERCPU_VARPTR(kth_stats)->lat_hist[MIN(bucket, KTH_LAT_BUCKETS - 1)]++;
+}
+
+void print_kthread_stats(void)
+{
+	struct kthread_stats *stats;
+	uint64_t hits = 0, allocs = 0, frees = 0;
+	uint64_t hist[KTH_LAT_BUCKETS] = {0};
+
+	for_each_core(i) {
+		stats = _PERCPU_VARPTR(kth_stats, i);
+		hits += stats->nr_cache_hits;
+		allocs += stats->nr_allocs;
+		frees += stats->nr_frees;
+		for (int j = 0; j < KTH_LAT_BUCKETS; j++)
+			hist[j] += stats->lat_hist[j];
+	}
+	printk("Kthread cache: %lu hits, %lu allocs, %lu frees\n", hits, allocs,
+	       frees);
+	printk("Cached kthreads per core:");
+	for_each_core(i)
+		printk(" %u", pcpui_var(i, nr_kth_cache));
+	printk("\n");
+	printk("Block to restart latency:\n");
+	for (int i = 0; i < KTH_LAT_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == KTH_LAT_BUCKETS - 1)
+			printk("\t>= %8lu usec: %lu\n", 1UL << (i - 1), hist[i]);
+		else
+			printk("\t<  %8lu usec: %lu\n", 1UL << i, hist[i]);
+	}
+}
+
 /* Helper during early boot, where we jump from the bootstack to a real kthread
  * stack, then run f().  Note that we don't have a kthread yet (done in smp.c).
  *
@@ -130,19 +239,14 @@ void restart_kthread(struct kthread *kthread)
 	/* Avoid messy complications.  The kthread will enable_irqsave() when it
 	 * comes back up. */
 	disable_irq();
-	/* Free any spare, since we need the current to become the spare.  Without
-	 * the spare, we can't free our current kthread/stack (we could free the
-	 * kthread, but not the stack, since we're still on it).  And we can't free
-	 * anything after popping kthread, since we never return. */
-	if (pcpui->spare) {
-		put_kstack(pcpui->spare->stacktop);
-		kmem_cache_free(kthread_kcache, pcpui->spare);
-	}
+	__note_kthread_restart(kthread);
 	cur_kth = pcpui->cur_kthread;
 	current_stacktop = cur_kth->stacktop;
 	assert(!cur_kth->sysc);	/* catch bugs, prev user should clear */
-	/* Set the spare stuff (current kthread, which includes its stacktop) */
-	pcpui->spare = cur_kth;
+	/* The current kthread goes in the cache.  We can't free it and its stack,
+	 * since we're still on it, and we can't free anything after popping
+	 * kthread, since we never return. */
+	__kthread_put(pcpui, cur_kth);
 	/* When a kthread runs, its stack is the default kernel stack */
 	set_stack_top(kthread->stacktop);
 	pcpui->cur_kthread = kthread;
@@ -161,11 +265,14 @@ void restart_kthread(struct kthread *kthread)
 			 * thus *need* a different EPT) without first removing the old GPC,
 			 * which ultimately will result in a flushed EPT (on x86, this
 			 * actually happens when we clear_owning_proc()). */
+			proc_tlb_mark_core(kthread->proc);
 			lcr3(kthread->proc->env_cr3);
 			/* Might have to clear out an existing current.  If they need to be
 			 * set later (like in restartcore), it'll be done on demand. */
-			if (pcpui->cur_proc)
+			if (pcpui->cur_proc) {
+				proc_tlb_unmark_core(pcpui->cur_proc);
 				proc_decref(pcpui->cur_proc);
+			}
 			/* Transfer our counted ref from kthread->proc to cur_proc. */
 			pcpui->cur_proc = kthread->proc;
 			kthread->proc = 0;
@@ -205,11 +312,34 @@ static void __launch_kthread(uint32_t srcid, long a0, long a1, long a2)
 	assert(0);
 }
 
+/* Kmsg handler to launch a list of kthreads, from kthread_batch_flush().  We
+ * run the first one and pass the rest back to ourselves, which doesn't need an
+ * IPI.  They'll run when this one blocks or finishes. */
+static void __launch_kthread_list(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct kthread *kthread = (struct kthread*)a0;
+
+	if (kthread->batch_next)
+		send_kernel_message(core_id(), __launch_kthread_list,
+		                    (long)kthread->batch_next, 0, 0, KMSG_ROUTINE);
+	__launch_kthread(srcid, (long)kthread, 0, 0);
+	assert(0);
+}
+
+static uint32_t kthread_dst(struct kthread *kthread)
+{
+	if (kthread->flags & KTH_HOME_CORE)
+		return kthread->home_core;
+	return core_id();
+}
+
 /* Call this when a kthread becomes runnable/unblocked.  We don't do anything
  * particularly smart yet, but when we do, we can put it here. */
 void kthread_runnable(struct kthread *kthread)
 {
-	uint32_t dst = core_id();
+	uint32_t dst = kthread_dst(kthread);
+
+	kthread->runnable_tsc = read_tsc();
 	#if 0
 	/* turn this block on if you want to test migrating non-core0 kthreads */
 	switch (dst) {
@@ -227,6 +357,49 @@ void kthread_runnable(struct kthread *kthread)
 	                    KMSG_ROUTINE);
 }
 
+void kthread_batch_init(struct kthread_batch *kb)
+{
+	kb->head = NULL;
+	kb->tail = &kb->head;
+}
+
+void kthread_batch_add(struct kthread_batch *kb, struct kthread *kthread)
+{
+	kthread->runnable_tsc = read_tsc();
+	kthread->batch_next = NULL;
+	*kb->tail = kthread;
+	kb->tail = &kthread->batch_next;
+}
+
+/* Sends each core its kthreads, in the order they were added.  Batches are
+ * usually a handful of kthreads going to a core or two, so we just make a pass
+ * over the list per core. */
+void kthread_batch_flush(struct kthread_batch *kb)
+{
+	struct kthread *kth, *list, **list_tail, **pp;
+	uint32_t dst;
+
+	while (kb->head) {
+		dst = kthread_dst(kb->head);
+		list_tail = &list;
+		pp = &kb->head;
+		while ((kth = *pp)) {
+			if (kthread_dst(kth) != dst) {
+				pp = &kth->batch_next;
+				continue;
+			}
+			*pp = kth->batch_next;
+			*list_tail = kth;
+			list_tail = &kth->batch_next;
+		}
+		*list_tail = NULL;
+		/* Once this goes out, the kthreads on list can run */
+		send_kernel_message(dst, __launch_kthread_list, (long)list, 0, 0,
+		                    KMSG_ROUTINE);
+	}
+	kb->tail = &kb->head;
+}
+
 /* Kmsg helper for kthread_yield */
 static void __wake_me_up(uint32_t srcid, long a0, long a1, long a2)
 {
@@ -245,11 +418,10 @@ void kthread_yield(void)
 	sem_down(sem);
 }
 
-void kthread_usleep(uint64_t usec)
+void kthread_usleep_slack(uint64_t usec, uint64_t slack_usec)
 {
 	ERRSTACK(1);
 	/* TODO: classic ksched issue: where do we want the wake up to happen? */
-	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
 	struct rendez rv;
 
 	int ret_zero(void *ignored)
@@ -260,11 +432,16 @@ void kthread_usleep(uint64_t usec)
 	/* "discard the error" style (we run the conditional code) */
 	if (!waserror()) {
 		rendez_init(&rv);
-		rendez_sleep_timeout(&rv, ret_zero, 0, usec);
+		rendez_sleep_timeout_slack(&rv, ret_zero, 0, usec, slack_usec);
 	}
 	poperror();
 }
 
+void kthread_usleep(uint64_t usec)
+{
+	kthread_usleep_slack(usec, ALARM_SLACK_SLEEP);
+}
+
 static void __ktask_wrapper(uint32_t srcid, long a0, long a1, long a2)
 {
 	ERRSTACK(1);
@@ -285,6 +462,7 @@ static void __ktask_wrapper(uint32_t srcid, long a0, long a1, long a2)
 out:
 	disable_irq();
 	pcpui->cur_kthread->name = 0;
+	pcpui->cur_kthread->flags &= ~KTH_HOME_CORE;
 	poperror();
 	/* if we blocked, when we return, PRKM will smp_idle() */
 }
@@ -296,10 +474,35 @@ out:
  * storage for *name. */
 void ktask(char *name, void (*fn)(void*), void *arg)
 {
-	send_kernel_message(core_id(), __ktask_wrapper, (long)fn, (long)arg,
+	ktask_on(core_id(), name, fn, arg);
+}
+
+/* Same as ktask(), but starts it on coreid, for work we want to run in parallel
+ * with the caller. */
+void ktask_on(uint32_t coreid, char *name, void (*fn)(void*), void *arg)
+{
+	send_kernel_message(coreid, __ktask_wrapper, (long)fn, (long)arg,
 	                    (long)name, KMSG_ROUTINE);
 }
 
+/* Pins the calling ktask to coreid: whenever it blocks, it will wake up there
+ * instead of on the waker's core.  This is for long-lived ktasks that want to
+ * keep their work on one core, such as per-rx-queue network readers.  The pin
+ * lasts until the ktask returns.
+ *
+ * We move over right away by yielding; the yield's wakeup goes to coreid. */
+void kthread_set_home_core(uint32_t coreid)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+
+	assert(is_ktask(kth));
+	assert(coreid < num_cores);
+	kth->home_core = coreid;
+	kth->flags |= KTH_HOME_CORE;
+	if (coreid != core_id())
+		kthread_yield();
+}
+
 /* Semaphores, using kthreads directly */
 static void debug_downed_sem(struct semaphore *sem);
 static void debug_upped_sem(struct semaphore *sem);
@@ -313,6 +516,9 @@ static void sem_init_common(struct semaphore *sem, int signals)
 #ifdef CONFIG_SEMAPHORE_DEBUG
 	sem->is_on_list = FALSE;
 #endif
+#ifdef CONFIG_LOCK_STAT
+	sem->lockstat_tsc = 0;
+#endif
 }
 
 void sem_init(struct semaphore *sem, int signals)
@@ -392,29 +598,13 @@ void sem_down(struct semaphore *sem)
 	assert(pcpui->cur_kthread);
 	/* We're probably going to sleep, so get ready.  We'll check again later. */
 	kthread = pcpui->cur_kthread;
-	/* We need to have a spare slot for restart, so we also use it when
-	 * sleeping.  Right now, we need a new kthread to take over if/when our
-	 * current kthread sleeps.  Use the spare, and if not, get a new one.
+	/* We need a new kthread to take over if/when our current kthread sleeps.
+	 * restart_kthread fills the core's cache, so we usually get one from there.
 	 *
 	 * Note we do this with interrupts disabled (which protects us from
 	 * concurrent modifications). */
-	if (pcpui->spare) {
-		new_kthread = pcpui->spare;
-		new_stacktop = new_kthread->stacktop;
-		pcpui->spare = 0;
-		/* The old flags could have KTH_IS_KTASK set.  The reason is that the
-		 * launching of blocked kthreads also uses PRKM, and that KMSG
-		 * (__launch_kthread) doesn't return.  Thus the soon-to-be spare
-		 * kthread, that is launching another, has flags & KTH_IS_KTASK set. */
-		new_kthread->flags = KTH_DEFAULT_FLAGS;
-		new_kthread->proc = 0;
-		new_kthread->name = 0;
-	} else {
-		new_kthread = __kthread_zalloc();
-		new_kthread->flags = KTH_DEFAULT_FLAGS;
-		new_stacktop = get_kstack();
-		new_kthread->stacktop = new_stacktop;
-	}
+	new_kthread = __kthread_get(pcpui);
+	new_stacktop = new_kthread->stacktop;
 	/* Set the core's new default stack and kthread */
 	set_stack_top(new_stacktop);
 	pcpui->cur_kthread = new_kthread;
@@ -445,6 +635,7 @@ void sem_down(struct semaphore *sem)
 	if (sem->nr_signals < 0) {
 		TAILQ_INSERT_TAIL(&sem->waiters, kthread, link);
 		debug_downed_sem(sem);	/* need to debug after inserting */
+		kthread->block_tsc = read_tsc();
 		/* At this point, we know we'll sleep and change stacks.  Once we unlock
 		 * the sem, we could have the kthread restarted (possibly on another
 		 * core), so we need to leave the old stack before unlocking.  If we
@@ -468,11 +659,17 @@ void sem_down(struct semaphore *sem)
 	}
 	set_stack_top(kthread->stacktop);
 	pcpui->cur_kthread = kthread;
-	/* Save the allocs as the spare */
-	assert(!pcpui->spare);
-	pcpui->spare = new_kthread;
+	/* Save the allocs for next time */
+	__kthread_put(pcpui, new_kthread);
 block_return_path:
 	printd("[kernel] Returning from being 'blocked'! at %llu\n", read_tsc());
+	/* We might be on another core now, so don't trust pcpui.  If we didn't
+	 * actually sleep, offcpu_tsc is 0. */
+	kthread = this_pcpui_var(cur_kthread);
+	if (kthread && kthread->offcpu_tsc) {
+		profiler_notify_offcpu(kthread->offcpu_tsc);
+		kthread->offcpu_tsc = 0;
+	}
 	/* restart_kthread and longjmp did not reenable IRQs.  We need to make sure
 	 * irqs are on if they were on when we started to block.  If they were
 	 * already on and we short-circuited the block, it's harmless to reenable
@@ -775,6 +972,20 @@ void cv_wait(struct cond_var *cv)
 	cv_lock(cv);
 }
 
+/* Like cv_wait(), but __cv_wakeup() only wakes one exclusive waiter at a time.
+ * Use this when only one waiter can make progress per wakeup, e.g. readers of a
+ * queue, and have whoever wakes pass the wakeup along if it didn't use it up.
+ * Signals and broadcasts treat us like anyone else. */
+void cv_wait_excl(struct cond_var *cv)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+
+	/* We're the same kthread when we wake up, even if we move cores */
+	kth->flags |= KTH_WAIT_EXCL;
+	cv_wait(cv);
+	kth->flags &= ~KTH_WAIT_EXCL;
+}
+
 /* Helper, wakes exactly one, and there should have been at least one waiter. */
 static void sem_wake_one(struct semaphore *sem)
 {
@@ -808,14 +1019,55 @@ void __cv_signal(struct cond_var *cv)
 	}
 }
 
+/* Helper, wakes all of sem's waiters, or with excl, all of them but the
+ * exclusive waiters after the first one.  The waiters can come out of the
+ * middle of the sem's list: the CV just needs the counts to match.  They go out
+ * in one kmsg per core.  Returns how many we woke. */
+static unsigned long sem_wake_waiters(struct semaphore *sem, bool excl)
+{
+	struct kthread_batch kb;
+	struct kthread *kthread, *temp;
+	bool woke_excl = FALSE;
+	unsigned long nr_woken = 0;
+
+	kthread_batch_init(&kb);
+	debug_lock_semlist();
+	spin_lock(&sem->lock);
+	TAILQ_FOREACH_SAFE(kthread, &sem->waiters, link, temp) {
+		if (excl && (kthread->flags & KTH_WAIT_EXCL)) {
+			if (woke_excl)
+				continue;
+			woke_excl = TRUE;
+		}
+		assert(sem->nr_signals < 0);
+		sem->nr_signals++;
+		TAILQ_REMOVE(&sem->waiters, kthread, link);
+		kthread_batch_add(&kb, kthread);
+		nr_woken++;
+	}
+	debug_upped_sem(sem);
+	spin_unlock(&sem->lock);
+	debug_unlock_semlist();
+	kthread_batch_flush(&kb);
+	return nr_woken;
+}
+
 void __cv_broadcast(struct cond_var *cv)
 {
 	while (cv->nr_waiters != nr_sem_waiters(&cv->sem))
 		cpu_relax();
-	while (cv->nr_waiters) {
-		cv->nr_waiters--;
-		sem_wake_one(&cv->sem);
-	}
+	if (cv->nr_waiters)
+		cv->nr_waiters -= sem_wake_waiters(&cv->sem, FALSE);
+}
+
+/* Wakes all of the waiters, except for those in cv_wait_excl(): only one of them
+ * wakes up. */
+void __cv_wakeup(struct cond_var *cv)
+{
+	while (cv->nr_waiters != nr_sem_waiters(&cv->sem))
+		cpu_relax();
+	if (cv->nr_waiters)
+		cv->nr_waiters -= sem_wake_waiters(&cv->sem, TRUE);
 }
 
 void cv_signal(struct cond_var *cv)
@@ -0,0 +1,149 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Latency histograms.  See latency.h. */
+
+#include <latency.h>
+#include <percpu.h>
+#include <kmalloc.h>
+#include <smp.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <ns.h>
+#include <time.h>
+
+struct lat_hists {
+	uint64_t					buckets[NR_LAT_EVENTS][LAT_NR_BUCKETS];
+};
+
+static DEFINE_PERCPU(struct lat_hists, lat_hists);
+
+static const char *lat_names[NR_LAT_EVENTS] = {
+	[LAT_KTHREAD_WAKEUP]	= "kthread-wakeup",
+	[LAT_MCP_WAKEUP]		= "mcp-wakeup",
+	[LAT_SCP_WAKEUP]		= "scp-wakeup",
+	[LAT_IRQ_HANDLER]		= "irq-handler",
+	[LAT_TIMER_IRQ]			= "timer-irq",
+	[LAT_WORK_WAIT]			= "work-wait",
+	[LAT_ZERO_PAGE]			= "zero-page",
+};
+
+static unsigned int lat_bucket(uint64_t val)
+{
+	unsigned int msb;
+
+	if (val < LAT_NR_SUB)
+		return val;
+	msb = LOG2_DOWN(val);
+	return MIN((msb - LAT_SUB_BITS + 1) * LAT_NR_SUB +
+	           ((val >> (msb - LAT_SUB_BITS)) & (LAT_NR_SUB - 1)),
+	           LAT_NR_BUCKETS - 1);
+}
+
+/* The smallest value in bucket b. */
+static uint64_t lat_bucket_min(unsigned int b)
+{
+	unsigned int msb;
+
+	if (b < LAT_NR_SUB)
+		return b;
+	msb = b / LAT_NR_SUB + LAT_SUB_BITS - 1;
+	return (uint64_t)(LAT_NR_SUB + b % LAT_NR_SUB) << (msb - LAT_SUB_BITS);
+}
+
+void lat_record(int event, uint64_t tsc_delta)
+{
+	PERCPU_VARPTR(lat_hists)->buckets[event][lat_bucket(tsc_delta)]++;
+}
+
+static void lat_reset(void)
+{
+	for_each_core(i)
+		memset(_PERCPU_VARPTR(lat_hists, i), 0, sizeof(struct lat_hists));
+}
+
+void lat_ctl(struct cmdbuf *cb)
+{
+	if (cb->nf < 1 || strcmp(cb->f[0], "reset"))
+		error(EINVAL, "latency: reset");
+	lat_reset();
+}
+
+/* Returns the bucket that the pct'th percentile sample is in. */
+static unsigned int lat_percentile(uint64_t *buckets, uint64_t total,
+                                   unsigned int pct_x10)
+{
+	uint64_t want = (total * pct_x10 + 999) / 1000;
+	uint64_t sum = 0;
+
+	for (int b = 0; b < LAT_NR_BUCKETS; b++) {
+		sum += buckets[b];
+		if (sum >= want)
+			return b;
+	}
+	return LAT_NR_BUCKETS - 1;
+}
+
+/* The worst case for bucket b, in nsec */
+static uint64_t lat_bucket_max_ns(unsigned int b)
+{
+	return tsc2nsec(lat_bucket_min(b + 1) - 1);
+}
+
+static char *lat_print_event(char *p, char *e, int event, uint64_t *buckets)
+{
+	static const unsigned int pcts[] = {500, 900, 990, 999};
+	uint64_t total = 0;
+	int max_b = 0;
+
+	for (int b = 0; b < LAT_NR_BUCKETS; b++) {
+		total += buckets[b];
+		if (buckets[b])
+			max_b = b;
+	}
+	p = seprintf(p, e, "%s: %lu samples", lat_names[event], total);
+	if (!total)
+		return seprintf(p, e, "\n");
+	for (int i = 0; i < ARRAY_SIZE(pcts); i++)
+		p = seprintf(p, e, ", p%u.%u <= %lu ns", pcts[i] / 10, pcts[i] % 10,
+		             lat_bucket_max_ns(lat_percentile(buckets, total,
+		                                              pcts[i])));
+	p = seprintf(p, e, ", max <= %lu ns\n", lat_bucket_max_ns(max_b));
+	for (int b = 0; b < LAT_NR_BUCKETS; b++) {
+		if (!buckets[b])
+			continue;
+		if (b == LAT_NR_BUCKETS - 1)
+			p = seprintf(p, e, "\t%12lu ns and up: %lu\n",
+			             tsc2nsec(lat_bucket_min(b)), buckets[b]);
+		else
+			p = seprintf(p, e, "\t%12lu - %12lu ns: %lu\n",
+			             tsc2nsec(lat_bucket_min(b)), lat_bucket_max_ns(b),
+			             buckets[b]);
+	}
+	return p;
+}
+
+size_t lat_read(void *va, size_t n, off64_t offset)
+{
+	size_t bufsz = NR_LAT_EVENTS * (LAT_NR_BUCKETS + 2) * 64;
+	struct lat_hists *sum, *hists;
+	char *buf, *p, *e;
+
+	sum = kzmalloc(sizeof(struct lat_hists), MEM_WAIT);
+	for_each_core(i) {
+		hists = _PERCPU_VARPTR(lat_hists, i);
+		for (int j = 0; j < NR_LAT_EVENTS; j++)
+			for (int b = 0; b < LAT_NR_BUCKETS; b++)
+				sum->buckets[j][b] += hists->buckets[j][b];
+	}
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	p = buf;
+	e = buf + bufsz;
+	for (int j = 0; j < NR_LAT_EVENTS; j++)
+		p = lat_print_event(p, e, j, sum->buckets[j]);
+	n = readstr(offset, va, n, buf);
+	kfree(buf);
+	kfree(sum);
+	return n;
+}
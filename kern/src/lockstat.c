@@ -0,0 +1,357 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Lock contention statistics.  See lockstat.h.
+ *
+ * Each core has its own table of locks, keyed by the lock's address, which only
+ * that core writes, with IRQs off.  That way the lock paths don't take any
+ * locks or bounce any cache lines.  Reads merge the tables from every core,
+ * since a lock is usually grabbed from many of them.
+ *
+ * Resetting bumps a generation counter; each core clears its own table the
+ * next time it records something. */
+
+#include <lockstat.h>
+#include <atomic.h>
+#include <kthread.h>
+#include <kmalloc.h>
+#include <smp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sort.h>
+#include <hash.h>
+#include <err.h>
+#include <ns.h>
+#include <time.h>
+#include <kdebug.h>
+#include <arch/arch.h>
+
+#ifdef CONFIG_LOCK_STAT
+
+#define LOCKSTAT_TBL_ORDER		10
+#define LOCKSTAT_TBL_SZ			(1 << LOCKSTAT_TBL_ORDER)
+#define LOCKSTAT_NR_PROBES		16
+#define LOCKSTAT_MERGE_ORDER	12
+#define LOCKSTAT_MERGE_SZ		(1 << LOCKSTAT_MERGE_ORDER)
+#define LOCKSTAT_DEFAULT_TOP	20
+
+struct lockstat_entry {
+	uintptr_t					lock;
+	/* Where we last waited for the lock, or where we first grabbed it */
+	uintptr_t					pc;
+	bool						is_qlock;
+	uint64_t					nr_acquired;
+	uint64_t					nr_contended;
+	uint64_t					wait_tsc;
+	uint64_t					max_wait_tsc;
+	uint64_t					hold_tsc;
+};
+
+struct lockstat_table {
+	unsigned long				gen;
+	uint64_t					nr_dropped;
+	struct lockstat_entry		entries[LOCKSTAT_TBL_SZ];
+};
+
+bool lockstat_enabled;
+static struct lockstat_table *lockstat_tables[MAX_NUM_CORES];
+static unsigned long lockstat_gen;
+static int lockstat_top = LOCKSTAT_DEFAULT_TOP;
+
+/* Finds or adds lock's entry in our core's table.  Call with IRQs off. */
+static struct lockstat_entry *lockstat_get(void *lock, bool is_qlock,
+                                           uintptr_t pc)
+{
+	struct lockstat_table *t = lockstat_tables[core_id_early()];
+	struct lockstat_entry *e;
+	unsigned long idx;
+
+	if (!t)
+		return NULL;
+	if (t->gen != lockstat_gen) {
+		memset(t->entries, 0, sizeof(t->entries));
+		t->nr_dropped = 0;
+		t->gen = lockstat_gen;
+	}
+	idx = hash_ptr(lock, LOCKSTAT_TBL_ORDER);
+	for (int i = 0; i < LOCKSTAT_NR_PROBES; i++) {
+		e = &t->entries[(idx + i) & (LOCKSTAT_TBL_SZ - 1)];
+		if (e->lock == (uintptr_t)lock)
+			return e;
+		if (!e->lock) {
+			e->lock = (uintptr_t)lock;
+			e->pc = pc;
+			e->is_qlock = is_qlock;
+			return e;
+		}
+	}
+	t->nr_dropped++;
+	return NULL;
+}
+
+static void lockstat_acquired(void *lock, bool is_qlock, uintptr_t pc,
+                              bool contended, uint64_t wait)
+{
+	struct lockstat_entry *e;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	e = lockstat_get(lock, is_qlock, pc);
+	if (e) {
+		e->nr_acquired++;
+		if (contended) {
+			e->nr_contended++;
+			e->wait_tsc += wait;
+			e->max_wait_tsc = MAX(e->max_wait_tsc, wait);
+			e->pc = pc;
+		}
+	}
+	enable_irqsave(&irq_state);
+}
+
+static void lockstat_released(void *lock, bool is_qlock, uint64_t hold)
+{
+	struct lockstat_entry *e;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	e = lockstat_get(lock, is_qlock, 0);
+	if (e)
+		e->hold_tsc += hold;
+	enable_irqsave(&irq_state);
+}
+
+/* Called by spin_lock() instead of __spin_lock() when the stats are on. */
+void lockstat_spin_lock(struct spinlock *lock, uintptr_t pc)
+{
+	uint64_t start;
+
+	if (__spin_trylock(lock)) {
+		lockstat_acquired(lock, FALSE, pc, FALSE, 0);
+	} else {
+		start = read_tsc();
+		__spin_lock(lock);
+		lockstat_acquired(lock, FALSE, pc, TRUE, read_tsc() - start);
+	}
+	lock->lockstat_tsc = read_tsc();
+}
+
+void lockstat_spin_trylocked(struct spinlock *lock, uintptr_t pc)
+{
+	lockstat_acquired(lock, FALSE, pc, FALSE, 0);
+	lock->lockstat_tsc = read_tsc();
+}
+
+/* Called by spin_unlock() while we still hold the lock. */
+void lockstat_spin_unlock(struct spinlock *lock)
+{
+	uint64_t acquired = lock->lockstat_tsc;
+
+	lock->lockstat_tsc = 0;
+	lockstat_released(lock, FALSE, read_tsc() - acquired);
+}
+
+void lockstat_qlock(struct semaphore *sem)
+{
+	uintptr_t pc = get_caller_pc();
+	uint64_t start;
+
+	if (!lockstat_enabled) {
+		sem_down(sem);
+		return;
+	}
+	if (sem_trydown(sem)) {
+		lockstat_acquired(sem, TRUE, pc, FALSE, 0);
+	} else {
+		/* For qlocks, the wait is mostly time spent asleep. */
+		start = read_tsc();
+		sem_down(sem);
+		lockstat_acquired(sem, TRUE, pc, TRUE, read_tsc() - start);
+	}
+	sem->lockstat_tsc = read_tsc();
+}
+
+bool lockstat_canqlock(struct semaphore *sem)
+{
+	if (!sem_trydown(sem))
+		return FALSE;
+	if (lockstat_enabled) {
+		lockstat_acquired(sem, TRUE, get_caller_pc(), FALSE, 0);
+		sem->lockstat_tsc = read_tsc();
+	}
+	return TRUE;
+}
+
+void lockstat_qunlock(struct semaphore *sem)
+{
+	uint64_t acquired = sem->lockstat_tsc;
+
+	if (acquired) {
+		sem->lockstat_tsc = 0;
+		lockstat_released(sem, TRUE, read_tsc() - acquired);
+	}
+	sem_up(sem);
+}
+
+static void lockstat_start(void)
+{
+	for_each_core(i) {
+		if (!lockstat_tables[i]) {
+			lockstat_tables[i] = kzmalloc(sizeof(struct lockstat_table),
+			                              MEM_WAIT);
+			lockstat_tables[i]->gen = lockstat_gen;
+		}
+	}
+	wmb();	/* tables are ready before anyone sees enabled */
+	lockstat_enabled = TRUE;
+}
+
+static const char lockstat_usage[] = "start|stop|reset|top N";
+
+/* Commands for #kprof/lockstat:
+ * - start: start recording
+ * - stop: stop recording, keeping what we have
+ * - reset: throw away what we have
+ * - top N: list the N most waited-on locks */
+void lockstat_ctl(struct cmdbuf *cb)
+{
+	long top;
+
+	if (cb->nf < 1)
+		error(EINVAL, lockstat_usage);
+	if (!strcmp(cb->f[0], "start")) {
+		lockstat_start();
+	} else if (!strcmp(cb->f[0], "stop")) {
+		lockstat_enabled = FALSE;
+	} else if (!strcmp(cb->f[0], "reset")) {
+		lockstat_gen++;
+	} else if (!strcmp(cb->f[0], "top")) {
+		if (cb->nf < 2)
+			error(EINVAL, lockstat_usage);
+		top = strtol(cb->f[1], 0, 0);
+		if (top < 1 || top > LOCKSTAT_MERGE_SZ)
+			error(EINVAL, "top must be 1-%d", LOCKSTAT_MERGE_SZ);
+		lockstat_top = top;
+	} else {
+		error(EINVAL, lockstat_usage);
+	}
+}
+
+/* Adds src into the merged table.  Returns FALSE if it is full. */
+static bool lockstat_merge(struct lockstat_entry *merged,
+                           struct lockstat_entry *src)
+{
+	unsigned long idx = hash_ptr((void*)src->lock, LOCKSTAT_MERGE_ORDER);
+	struct lockstat_entry *e;
+
+	for (int i = 0; i < LOCKSTAT_MERGE_SZ; i++) {
+		e = &merged[(idx + i) & (LOCKSTAT_MERGE_SZ - 1)];
+		if (!e->lock) {
+			*e = *src;
+			return TRUE;
+		}
+		if (e->lock != src->lock)
+			continue;
+		e->nr_acquired += src->nr_acquired;
+		e->nr_contended += src->nr_contended;
+		e->wait_tsc += src->wait_tsc;
+		e->max_wait_tsc = MAX(e->max_wait_tsc, src->max_wait_tsc);
+		e->hold_tsc += src->hold_tsc;
+		/* Prefer a site where someone waited. */
+		if (src->nr_contended || !e->pc)
+			e->pc = src->pc;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static int lockstat_cmp_wait(const void *a, const void *b)
+{
+	const struct lockstat_entry *ea = a, *eb = b;
+
+	if (ea->wait_tsc != eb->wait_tsc)
+		return ea->wait_tsc < eb->wait_tsc ? 1 : -1;
+	if (ea->nr_acquired != eb->nr_acquired)
+		return ea->nr_acquired < eb->nr_acquired ? 1 : -1;
+	return 0;
+}
+
+/* Names locks that are (or are in) a global.  Other addresses would just find
+ * whatever symbol is below them. */
+static const char *lockstat_lock_name(uintptr_t lock)
+{
+	extern char end[];
+
+	if (lock < KERN_LOAD_ADDR || lock >= (uintptr_t)end)
+		return "-";
+	return get_fn_name(lock) ?: "-";
+}
+
+size_t lockstat_read(void *va, size_t n, off64_t offset)
+{
+	struct lockstat_entry *merged, *e;
+	struct lockstat_table *t;
+	uint64_t nr_dropped = 0;
+	size_t bufsz, nr_merged = 0;
+	char *buf, *p, *end_p;
+	int top = lockstat_top;
+
+	merged = kzmalloc(sizeof(struct lockstat_entry) * LOCKSTAT_MERGE_SZ,
+	                  MEM_WAIT);
+	for_each_core(i) {
+		t = lockstat_tables[i];
+		if (!t || t->gen != lockstat_gen)
+			continue;
+		nr_dropped += t->nr_dropped;
+		for (int j = 0; j < LOCKSTAT_TBL_SZ; j++) {
+			e = &t->entries[j];
+			if (!e->lock)
+				continue;
+			if (!lockstat_merge(merged, e))
+				nr_dropped++;
+		}
+	}
+	/* Squeeze out the empty slots, then sort. */
+	for (int i = 0; i < LOCKSTAT_MERGE_SZ; i++) {
+		if (merged[i].lock)
+			merged[nr_merged++] = merged[i];
+	}
+	sort(merged, nr_merged, sizeof(struct lockstat_entry), lockstat_cmp_wait);
+
+	bufsz = (top + 4) * 192;
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	p = buf;
+	end_p = buf + bufsz;
+	p = seprintf(p, end_p, "Lock stats %s, %lu locks, %lu dropped\n",
+	             lockstat_enabled ? "on" : "off", nr_merged, nr_dropped);
+	p = seprintf(p, end_p, "%12s %12s %12s %12s %12s %5s %18s %s\n",
+	             "wait(us)", "maxwait(us)", "hold(us)", "acquired",
+	             "contended", "type", "lock", "name / site");
+	for (int i = 0; i < MIN(top, nr_merged); i++) {
+		e = &merged[i];
+		p = seprintf(p, end_p, "%12lu %12lu %12lu %12lu %12lu %5s %18p %s / %s\n",
+		             tsc2usec(e->wait_tsc), tsc2usec(e->max_wait_tsc),
+		             tsc2usec(e->hold_tsc), e->nr_acquired, e->nr_contended,
+		             e->is_qlock ? "qlock" : "spin", e->lock,
+		             lockstat_lock_name(e->lock),
+		             e->pc ? get_fn_name(e->pc) ?: "?" : "?");
+	}
+	n = readstr(offset, va, n, buf);
+	kfree(buf);
+	kfree(merged);
+	return n;
+}
+
+#else /* CONFIG_LOCK_STAT */
+
+void lockstat_ctl(struct cmdbuf *cb)
+{
+	error(ENOTSUP, "Lock stats need CONFIG_LOCK_STAT");
+}
+
+size_t lockstat_read(void *va, size_t n, off64_t offset)
+{
+	error(ENOTSUP, "Lock stats need CONFIG_LOCK_STAT");
+}
+
+#endif /* CONFIG_LOCK_STAT */
@@ -26,14 +26,19 @@
 #include <umem.h>
 #include <ns.h>
 #include <tree_file.h>
+#include <rbtree_augmented.h>
+#include <zpool.h>
 
 /* These are the only mmap flags that are saved in the VMR.  If we implement
  * more of the mmap interface, we may need to grow this. */
-#define MAP_PERSIST_FLAGS		(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS)
+#define MAP_PERSIST_FLAGS		(MAP_SHARED | MAP_PRIVATE | MAP_ANONYMOUS | \
+		                         MAP_HUGEPAGE)
 
 struct kmem_cache *vmr_kcache;
 
 static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg);
+static int __vmr_free_jumbo(struct proc *p, pte_t pte, void *va, void *arg);
+static void __demote_jumbo(struct proc *p, uintptr_t va, bool split_page);
 static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
                           int pte_prot, struct page_map *pm, size_t offset,
                           int flags, bool exec);
@@ -255,58 +260,176 @@ static void vmr_free(struct vm_region *vmr)
 	kmem_cache_free(vmr_kcache, vmr);
 }
 
+/* A process's VMRs are on its vm_regions list, in address order, and in its
+ * vm_tree, an rbtree keyed by vm_base.  The list is for walking neighbors; the
+ * tree is for lookups, so faults don't walk the list.
+ *
+ * The tree is augmented: each VMR tracks the largest gap after any VMR in its
+ * subtree, where a VMR's gap is the free space between it and the next VMR (or
+ * UMAPTOP).  Finding a hole for an mmap is then a tree descent.  Whenever a
+ * gap changes (a VMR comes or goes, or an end moves), call vmr_gap_update() on
+ * the VMR before the gap.  vmr_link() and vmr_unlink() do that for you. */
+static uintptr_t vmr_gap(struct vm_region *vmr)
+{
+	struct vm_region *next = TAILQ_NEXT(vmr, vm_link);
+
+	return (next ? next->vm_base : UMAPTOP) - vmr->vm_end;
+}
+
+static uintptr_t vmr_compute_max_gap(struct vm_region *vmr)
+{
+	uintptr_t max_gap = vmr_gap(vmr);
+	struct vm_region *child;
+
+	if (vmr->vm_rb.rb_left) {
+		child = rb_entry(vmr->vm_rb.rb_left, struct vm_region, vm_rb);
+		max_gap = MAX(max_gap, child->vm_max_gap);
+	}
+	if (vmr->vm_rb.rb_right) {
+		child = rb_entry(vmr->vm_rb.rb_right, struct vm_region, vm_rb);
+		max_gap = MAX(max_gap, child->vm_max_gap);
+	}
+	return max_gap;
+}
+
+RB_DECLARE_CALLBACKS(static, vmr_gap_cbs, struct vm_region, vm_rb, uintptr_t,
+                     vm_max_gap, vmr_compute_max_gap)
+
+/* Recomputes the max gaps from vmr up to the root.  Unlike the rbtree's
+ * propagate, we don't stop early: we usually change two VMRs' gaps at a time,
+ * and the first walk could stop at an ancestor that's only stale because of the
+ * second. */
+static void vmr_gap_update(struct vm_region *vmr)
+{
+	struct vm_region *i;
+
+	for (struct rb_node *rb = &vmr->vm_rb; rb; rb = rb_parent(rb)) {
+		i = rb_entry(rb, struct vm_region, vm_rb);
+		i->vm_max_gap = vmr_compute_max_gap(i);
+	}
+}
+
+/* Adds vmr to p's list and tree, after prev (0 for the front).  Set its base
+ * and end first. */
+static void vmr_link(struct proc *p, struct vm_region *vmr,
+                     struct vm_region *prev)
+{
+	struct rb_node **link = &p->vm_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct vm_region *i;
+
+	if (prev)
+		TAILQ_INSERT_AFTER(&p->vm_regions, prev, vmr, vm_link);
+	else
+		TAILQ_INSERT_HEAD(&p->vm_regions, vmr, vm_link);
+	while (*link) {
+		parent = *link;
+		i = rb_entry(parent, struct vm_region, vm_rb);
+		link = vmr->vm_base < i->vm_base ? &parent->rb_left
+		                                 : &parent->rb_right;
+	}
+	rb_link_node(&vmr->vm_rb, parent, link);
+	p->vm_bytes += vmr->vm_end - vmr->vm_base;
+	vmr->vm_max_gap = vmr_gap(vmr);
+	rb_insert_augmented(&vmr->vm_rb, &p->vm_tree, &vmr_gap_cbs);
+	vmr_gap_update(vmr);
+	if (prev)
+		vmr_gap_update(prev);
+}
+
+static void vmr_unlink(struct proc *p, struct vm_region *vmr)
+{
+	struct vm_region *prev = TAILQ_PREV(vmr, vmr_tailq, vm_link);
+
+	/* Erase while vmr is still on the list, so the gaps match the tree */
+	rb_erase_augmented(&vmr->vm_rb, &p->vm_tree, &vmr_gap_cbs);
+	TAILQ_REMOVE(&p->vm_regions, vmr, vm_link);
+	p->vm_bytes -= vmr->vm_end - vmr->vm_base;
+	if (prev)
+		vmr_gap_update(prev);
+}
+
+/* Returns the last VMR that starts at or below va, or 0. */
+static struct vm_region *find_vmr_below(struct proc *p, uintptr_t va)
+{
+	struct rb_node *rb = p->vm_tree.rb_node;
+	struct vm_region *vmr, *ret = NULL;
+
+	while (rb) {
+		vmr = rb_entry(rb, struct vm_region, vm_rb);
+		if (vmr->vm_base <= va) {
+			ret = vmr;
+			rb = rb->rb_right;
+		} else {
+			rb = rb->rb_left;
+		}
+	}
+	return ret;
+}
+
+/* Returns the first VMR, in address order, that starts at or above base and
+ * whose gap is at least len. */
+static struct vm_region *__find_gap(struct rb_node *rb, uintptr_t base,
+                                    size_t len)
+{
+	struct vm_region *vmr, *ret;
+
+	if (!rb)
+		return NULL;
+	vmr = rb_entry(rb, struct vm_region, vm_rb);
+	if (vmr->vm_max_gap < len)
+		return NULL;
+	if (vmr->vm_base >= base) {
+		ret = __find_gap(rb->rb_left, base, len);
+		if (ret)
+			return ret;
+		if (vmr_gap(vmr) >= len)
+			return vmr;
+	}
+	return __find_gap(rb->rb_right, base, len);
+}
+
 /* The caller will set the prot, flags, file, and offset.  We find a spot for it
  * in p's address space, set proc, base, and end.  Caller holds p's vmr_lock.
  *
- * TODO: take a look at solari's vmem alloc.  And consider keeping these in a
- * tree of some sort for easier lookups. */
+ * We take the first gap big enough for len that ends above va, and use va if
+ * it fits there.  The only room we consider before the first VMR is at va. */
 static bool vmr_insert(struct vm_region *vmr, struct proc *p, uintptr_t va,
                        size_t len)
 {
-	struct vm_region *vm_i, *vm_next;
+	struct vm_region *vm_i;
 	uintptr_t gap_end;
-	bool ret = false;
 
 	assert(!PGOFF(va));
 	assert(!PGOFF(len));
 	assert(__is_user_addr((void*)va, len, UMAPTOP));
+	vmr->vm_proc = p;
 	/* Is there room before the first one: */
 	vm_i = TAILQ_FIRST(&p->vm_regions);
 	/* This works for now, but if all we have is BRK_END ones, we'll start
 	 * growing backwards (TODO) */
 	if (!vm_i || (va + len <= vm_i->vm_base)) {
 		vmr->vm_base = va;
-		TAILQ_INSERT_HEAD(&p->vm_regions, vmr, vm_link);
-		ret = true;
-	} else {
-		TAILQ_FOREACH(vm_i, &p->vm_regions, vm_link) {
-			vm_next = TAILQ_NEXT(vm_i, vm_link);
-			gap_end = vm_next ? vm_next->vm_base : UMAPTOP;
-			/* skip til we get past the 'hint' va */
-			if (va >= gap_end)
-				continue;
-			/* Find a gap that is big enough */
-			if (gap_end - vm_i->vm_end >= len) {
-				/* if we can put it at va, let's do that.  o/w, put it so it
-				 * fits */
-				if ((gap_end >= va + len) && (va >= vm_i->vm_end))
-					vmr->vm_base = va;
-				else
-					vmr->vm_base = vm_i->vm_end;
-				TAILQ_INSERT_AFTER(&p->vm_regions, vm_i, vmr, vm_link);
-				ret = true;
-				break;
-			}
-		}
-	}
-	/* Finalize the creation, if we got one */
-	if (ret) {
-		vmr->vm_proc = p;
-		vmr->vm_end = vmr->vm_base + len;
+		vmr->vm_end = va + len;
+		vmr_link(p, vmr, NULL);
+		return true;
 	}
-	if (!ret)
+	/* Gaps after VMRs below the one at or before va end at or before va. */
+	vm_i = __find_gap(p->vm_tree.rb_node,
+	                  (find_vmr_below(p, va) ?: vm_i)->vm_base, len);
+	if (!vm_i) {
 		warn("Not making a VMR, wanted %p, + %p = %p", va, len, va + len);
-	return ret;
+		return false;
+	}
+	gap_end = vm_i->vm_end + vmr_gap(vm_i);
+	/* if we can put it at va, let's do that.  o/w, put it so it fits */
+	if ((gap_end >= va + len) && (va >= vm_i->vm_end))
+		vmr->vm_base = va;
+	else
+		vmr->vm_base = vm_i->vm_end;
+	vmr->vm_end = vmr->vm_base + len;
+	vmr_link(p, vmr, vm_i);
+	return true;
 }
 
 /* Split a VMR at va, returning the new VMR.  It is set up the same way, with
@@ -319,16 +442,25 @@ static struct vm_region *split_vmr(struct vm_region *old_vmr, uintptr_t va)
 	assert(!PGOFF(va));
 	if ((old_vmr->vm_base >= va) || (old_vmr->vm_end <= va))
 		return 0;
+	/* A jumbo can't straddle two VMRs; break it into regular pages.  A file's
+	 * jumbo is already split into pieces in the PM. */
+	if (va % PTSIZE) {
+		spin_lock(&old_vmr->vm_proc->pte_lock);
+		__demote_jumbo(old_vmr->vm_proc, va, !vmr_has_file(old_vmr));
+		spin_unlock(&old_vmr->vm_proc->pte_lock);
+	}
 	new_vmr = kmem_cache_alloc(vmr_kcache, 0);
 	assert(new_vmr);
-	TAILQ_INSERT_AFTER(&old_vmr->vm_proc->vm_regions, old_vmr, new_vmr,
-	                   vm_link);
 	new_vmr->vm_proc = old_vmr->vm_proc;
 	new_vmr->vm_base = va;
 	new_vmr->vm_end = old_vmr->vm_end;
+	/* vmr_link() adds new_vmr's part back */
+	old_vmr->vm_proc->vm_bytes -= old_vmr->vm_end - va;
 	old_vmr->vm_end = va;
+	vmr_link(old_vmr->vm_proc, new_vmr, old_vmr);
 	new_vmr->vm_prot = old_vmr->vm_prot;
 	new_vmr->vm_flags = old_vmr->vm_flags;
+	new_vmr->vm_mpol = old_vmr->vm_mpol;
 	if (vmr_has_file(old_vmr)) {
 		foc_incref(old_vmr->__vm_foc);
 		new_vmr->__vm_foc = old_vmr->__vm_foc;
@@ -350,7 +482,7 @@ static void destroy_vmr(struct vm_region *vmr)
 		pm_remove_vmr(vmr_to_pm(vmr), vmr);
 		foc_decref(vmr->__vm_foc);
 	}
-	TAILQ_REMOVE(&vmr->vm_proc->vm_regions, vmr, vm_link);
+	vmr_unlink(vmr->vm_proc, vmr);
 	vmr_free(vmr);
 }
 
@@ -362,11 +494,15 @@ static int merge_vmr(struct vm_region *first, struct vm_region *second)
 	if ((first->vm_end != second->vm_base) ||
 	    (first->vm_prot != second->vm_prot) ||
 	    (first->vm_flags != second->vm_flags) ||
-	    (first->__vm_foc != second->__vm_foc))
+	    (first->__vm_foc != second->__vm_foc) ||
+	    (first->vm_mpol.mode != second->vm_mpol.mode) ||
+	    (first->vm_mpol.nodes != second->vm_mpol.nodes))
 		return -1;
 	if (vmr_has_file(first) && (second->vm_foff != first->vm_foff +
 	                            first->vm_end - first->vm_base))
 		return -1;
+	/* destroy_vmr() subtracts second's part */
+	first->vm_proc->vm_bytes += second->vm_end - first->vm_end;
 	first->vm_end = second->vm_end;
 	destroy_vmr(second);
 	return 0;
@@ -400,7 +536,9 @@ static int grow_vmr(struct vm_region *vmr, uintptr_t va)
 		return -1;
 	if (va <= vmr->vm_end)
 		return -1;
+	vmr->vm_proc->vm_bytes += va - vmr->vm_end;
 	vmr->vm_end = va;
+	vmr_gap_update(vmr);
 	return 0;
 }
 
@@ -411,7 +549,9 @@ static int shrink_vmr(struct vm_region *vmr, uintptr_t va)
 	assert(!PGOFF(va));
 	if ((va < vmr->vm_base) || (va > vmr->vm_end))
 		return -1;
+	vmr->vm_proc->vm_bytes -= vmr->vm_end - va;
 	vmr->vm_end = va;
+	vmr_gap_update(vmr);
 	return 0;
 }
 
@@ -419,10 +559,16 @@ static int shrink_vmr(struct vm_region *vmr, uintptr_t va)
  * if there is none. */
 static struct vm_region *find_vmr(struct proc *p, uintptr_t va)
 {
+	struct rb_node *rb = p->vm_tree.rb_node;
 	struct vm_region *vmr;
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
+
+	while (rb) {
+		vmr = rb_entry(rb, struct vm_region, vm_rb);
+		if (va < vmr->vm_base)
+			rb = rb->rb_left;
+		else if (va >= vmr->vm_end)
+			rb = rb->rb_right;
+		else
 			return vmr;
 	}
 	return 0;
@@ -432,15 +578,21 @@ static struct vm_region *find_vmr(struct proc *p, uintptr_t va)
  * none. */
 static struct vm_region *find_first_vmr(struct proc *p, uintptr_t va)
 {
-	struct vm_region *vmr;
-	/* ugly linear seach */
-	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link) {
-		if ((vmr->vm_base <= va) && (vmr->vm_end > va))
-			return vmr;
-		if (vmr->vm_base > va)
+	struct rb_node *rb = p->vm_tree.rb_node;
+	struct vm_region *vmr, *ret = NULL;
+
+	while (rb) {
+		vmr = rb_entry(rb, struct vm_region, vm_rb);
+		if (va < vmr->vm_base) {
+			ret = vmr;
+			rb = rb->rb_left;
+		} else if (va >= vmr->vm_end) {
+			rb = rb->rb_right;
+		} else {
 			return vmr;
+		}
 	}
-	return 0;
+	return ret;
 }
 
 /* Makes sure that no VMRs cross either the start or end of the given region
@@ -450,7 +602,6 @@ static void isolate_vmrs(struct proc *p, uintptr_t va, size_t len)
 	struct vm_region *vmr;
 	if ((vmr = find_vmr(p, va)))
 		split_vmr(vmr, va);
-	/* TODO: don't want to do another find (linear search) */
 	if ((vmr = find_vmr(p, va + len)))
 		split_vmr(vmr, va + len);
 }
@@ -460,29 +611,35 @@ void unmap_and_destroy_vmrs(struct proc *p)
 	struct vm_region *vmr_i, *vmr_temp;
 	/* this only gets called from __proc_free, so there should be no sync
 	 * concerns.  still, better safe than sorry. */
-	spin_lock(&p->vmr_lock);
+	spin_wlock(&p->vmr_lock);
 	p->vmr_history++;
 	spin_lock(&p->pte_lock);
 	TAILQ_FOREACH(vmr_i, &p->vm_regions, vm_link) {
 		/* note this CB sets the PTE = 0, regardless of if it was P or not */
 		env_user_mem_walk(p, (void*)vmr_i->vm_base,
 		                  vmr_i->vm_end - vmr_i->vm_base, __vmr_free_pgs, 0);
+		env_user_jumbo_walk(p, (void*)vmr_i->vm_base,
+		                    vmr_i->vm_end - vmr_i->vm_base, __vmr_free_jumbo, 0);
 	}
 	spin_unlock(&p->pte_lock);
 	/* need the safe style, since destroy_vmr modifies the list.  also, we want
 	 * to do this outside the pte lock, since it grabs the pm lock. */
 	TAILQ_FOREACH_SAFE(vmr_i, &p->vm_regions, vm_link, vmr_temp)
 		destroy_vmr(vmr_i);
-	spin_unlock(&p->vmr_lock);
+	spin_wunlock(&p->vmr_lock);
 }
 
-/* Helper: copies the contents of pages from p to new p.  For pages that aren't
- * present, once we support swapping or CoW, we can do something more
- * intelligent.  0 on success, -ERROR on failure.  Can't handle jumbos. */
+/* Helper: gives new_p the pages of p in the range.  Regular pages are shared
+ * copy-on-write: both PTEs are made read-only, and the first write from either
+ * side gets its own copy (see __hpf_cow()).  Jumbos are copied into jumbos if
+ * we can get them, o/w into regular pages.  0 on success, -ERROR on failure. */
 static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
                       uintptr_t va_end)
 {
 	int ret;
+	bool parent_changed = FALSE;
+	/* new_p's PTEs we made, added to its stats under its own lock */
+	unsigned long nr_new_pgs = 0, nr_new_jumbos = 0;
 
 	/* Sanity checks.  If these fail, we had a screwed up VMR.
 	 * Check for: alignment, wraparound, or userspace addresses */
@@ -497,19 +654,40 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 	int copy_page(struct proc *p, pte_t pte, void *va, void *arg) {
 		struct proc *new_p = (struct proc*)arg;
 		struct page *pp;
+		pte_t new_pte;
+		int settings;
+
 		if (pte_is_unmapped(pte))
 			return 0;
 		/* pages could be !P, but right now that's only for file backed VMRs
 		 * undergoing page removal, which isn't the caller of copy_pages. */
 		if (pte_is_mapped(pte)) {
-			/* TODO: check for jumbos */
-			if (upage_alloc(new_p, &pp, 0))
-				return -ENOMEM;
-			memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
-			if (page_insert(new_p->env_pgdir, pp, va, pte_get_settings(pte))) {
-				page_decref(pp);
+			pp = pa2page(pte_get_paddr(pte));
+			if (page_is_pagemap(pp)) {
+				/* Private VMRs don't map PM pages, but just in case */
+				if (upage_alloc(new_p, &pp, 0))
+					return -ENOMEM;
+				memcpy(page2kva(pp), KADDR(pte_get_paddr(pte)), PGSIZE);
+				if (page_insert(new_p->env_pgdir, pp, va,
+				                pte_get_settings(pte))) {
+					page_decref(pp);
+					return -ENOMEM;
+				}
+				nr_new_pgs++;
+				return 0;
+			}
+			new_pte = pgdir_walk(new_p->env_pgdir, va, TRUE);
+			if (!pte_walk_okay(new_pte))
 				return -ENOMEM;
+			settings = pte_get_settings(pte);
+			if (settings & PTE_W) {
+				pte_replace_perm(pte, PTE_USER_RO);
+				settings = pte_get_settings(pte);
+				parent_changed = TRUE;
 			}
+			page_cow_share(pp);
+			pte_write(new_pte, page2pa(pp), settings);
+			nr_new_pgs++;
 		} else if (pte_is_paged_out(pte)) {
 			/* TODO: (SWAP) will need to either make a copy or CoW/refcnt the
 			 * backend store.  For now, this PTE will be the same as the
@@ -520,10 +698,54 @@ static int copy_pages(struct proc *p, struct proc *new_p, uintptr_t va_start,
 		}
 		return 0;
 	}
+	int copy_jumbo(struct proc *p, pte_t pte, void *va, void *arg) {
+		struct proc *new_p = (struct proc*)arg;
+		void *old_kva = KADDR(pte_get_paddr(pte));
+		int settings = pte_get_settings(pte);
+		struct page *pp;
+		pte_t new_pte;
+		void *kva;
+
+		kva = jumbo_page_alloc(1, MEM_ATOMIC);
+		if (kva) {
+			new_pte = pgdir_walk_jumbo(new_p->env_pgdir, va, TRUE);
+			if (!pte_walk_okay(new_pte)) {
+				jumbo_page_free(kva, 1);
+				return -ENOMEM;
+			}
+			memcpy(kva, old_kva, PTSIZE);
+			pte_write(new_pte, PADDR(kva), settings);
+			nr_new_jumbos++;
+			return 0;
+		}
+		/* Low on memory, or too fragmented for a jumbo.  Regular pages work. */
+		for (uintptr_t off = 0; off < PTSIZE; off += PGSIZE) {
+			if (upage_alloc(new_p, &pp, 0))
+				return -ENOMEM;
+			memcpy(page2kva(pp), old_kva + off, PGSIZE);
+			if (page_insert(new_p->env_pgdir, pp, va + off,
+			                settings & ~PTE_PS)) {
+				page_decref(pp);
+				return -ENOMEM;
+			}
+			nr_new_pgs++;
+		}
+		return 0;
+	}
 	spin_lock(&p->pte_lock);	/* walking and changing PTEs */
 	ret = env_user_mem_walk(p, (void*)va_start, va_end - va_start, &copy_page,
 	                        new_p);
+	if (!ret)
+		ret = env_user_jumbo_walk(p, (void*)va_start, va_end - va_start,
+		                          &copy_jumbo, new_p);
 	spin_unlock(&p->pte_lock);
+	spin_lock(&new_p->pte_lock);
+	new_p->nr_anon_pgs += nr_new_pgs;
+	new_p->nr_anon_jumbos += nr_new_jumbos;
+	spin_unlock(&new_p->pte_lock);
+	/* The parent can't keep writing through old TLB entries */
+	if (parent_changed)
+		proc_tlbshootdown(p, va_start, va_end);
 	return ret;
 }
 
@@ -578,6 +800,7 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 		vmr->vm_end = vm_i->vm_end;
 		vmr->vm_prot = vm_i->vm_prot;
 		vmr->vm_flags = vm_i->vm_flags;
+		vmr->vm_mpol = vm_i->vm_mpol;
 		vmr->__vm_foc = vm_i->__vm_foc;
 		vmr->vm_foff = vm_i->vm_foff;
 		if (vmr_has_file(vm_i)) {
@@ -593,7 +816,7 @@ int duplicate_vmrs(struct proc *p, struct proc *new_p)
 			vmr_free(vmr);
 			return ret;
 		}
-		TAILQ_INSERT_TAIL(&new_p->vm_regions, vmr, vm_link);
+		vmr_link(new_p, vmr, TAILQ_LAST(&new_p->vm_regions, vmr_tailq));
 	}
 	return 0;
 }
@@ -621,10 +844,10 @@ void enumerate_vmrs(struct proc *p,
 {
 	struct vm_region *vmr;
 
-	spin_lock(&p->vmr_lock);
+	spin_rlock(&p->vmr_lock);
 	TAILQ_FOREACH(vmr, &p->vm_regions, vm_link)
 		func(vmr, opaque);
-	spin_unlock(&p->vmr_lock);
+	spin_runlock(&p->vmr_lock);
 }
 
 static bool mmap_flags_priv_ok(int flags)
@@ -739,10 +962,249 @@ static int map_page_at_addr(struct proc *p, struct page *page, uintptr_t addr,
 	prot |= (pte_is_dirty(pte) ? PTE_D : 0);
 	/* We have a ref to page (for non PMs), which we are storing in the PTE */
 	pte_write(pte, page2pa(page), prot);
+	if (!page_is_pagemap(page))
+		p->nr_anon_pgs++;
+	spin_unlock(&p->pte_lock);
+	return 0;
+}
+
+/* Jumbo pages for anonymous memory.
+ *
+ * Anonymous VMRs can be backed by PTSIZE jumbo pages, either because they were
+ * mmapped with MAP_HUGEPAGE or because the process's jumbo_policy says so.  We
+ * only map a jumbo when its PTSIZE-aligned range is entirely within the VMR and
+ * nothing else is mapped there yet.  If we can't get a jumbo page (memory is
+ * tight or fragmented), we just use regular pages.
+ *
+ * VMRs never share a jumbo.  When a VMR gets split (munmap, mprotect,
+ * MAP_FIXED) in the middle of a jumbo, we demote the jumbo to regular PTEs
+ * pointing at the same memory (see jumbo_page_split()).  The rest of the VM
+ * code just needs to free jumbos when it tears down a VMR's PTEs.
+ *
+ * Shared file mappings can get jumbo PTEs too, if the FS fills its page cache
+ * with the pieces of a jumbo page (#tmpfs.huge, via the PM's populate op).
+ * Those pages belong to the PM, just like regular file pages: the PTE holds no
+ * refs, and tearing it down just clears it.  Demoting one doesn't split the
+ * page, since the FS already did.  Note the PM's dirty tracking skips jumbo
+ * PTEs, so only FSs without a backing store should do this. */
+static int vmr_pte_prot(struct vm_region *vmr)
+{
+	return (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
+	       (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
+}
+
+static bool __jumbo_policy_allows(struct vm_region *vmr)
+{
+	switch (vmr->vm_proc->jumbo_policy) {
+	case MM_JUMBO_NEVER:
+		return FALSE;
+	case MM_JUMBO_ALWAYS:
+		return TRUE;
+	default:
+		return vmr->vm_flags & MAP_HUGEPAGE ? TRUE : FALSE;
+	}
+}
+
+static bool vmr_wants_jumbo(struct vm_region *vmr)
+{
+	if (vmr_has_file(vmr))
+		return FALSE;
+	return __jumbo_policy_allows(vmr);
+}
+
+static bool vmr_jumbo_fits(struct vm_region *vmr, uintptr_t va)
+{
+	uintptr_t jumbo_va = ROUNDDOWN(va, PTSIZE);
+
+	return vmr_wants_jumbo(vmr) && (jumbo_va >= vmr->vm_base) &&
+	       (jumbo_va + PTSIZE <= vmr->vm_end);
+}
+
+/* For file VMRs, the jumbo also needs to line up with a PTSIZE-aligned chunk of
+ * the file, and the FS needs to be able to give us one. */
+static bool vmr_pm_jumbo_fits(struct vm_region *vmr, uintptr_t va)
+{
+	uintptr_t jumbo_va = ROUNDDOWN(va, PTSIZE);
+
+	if (!(vmr->vm_flags & MAP_SHARED) || (vmr->vm_flags & MAP_PRIVATE))
+		return FALSE;
+	if (!__jumbo_policy_allows(vmr))
+		return FALSE;
+	if ((jumbo_va < vmr->vm_base) || (jumbo_va + PTSIZE > vmr->vm_end))
+		return FALSE;
+	if ((vmr->vm_foff + jumbo_va - vmr->vm_base) % PTSIZE)
+		return FALSE;
+	return vmr_to_pm(vmr)->pm_op->populate ? TRUE : FALSE;
+}
+
+/* Helper, maps a zeroed jumbo at va (PTSIZE aligned), but only if nothing is
+ * mapped there.  Returns 0 if a jumbo is mapped at va, possibly by someone
+ * else.  On error, the caller should use regular pages.
+ *
+ * Once there is a PML1 for va, even an empty one, we'll stick with regular
+ * pages for that range. */
+static int map_jumbo_at_addr(struct proc *p, uintptr_t va, int prot)
+{
+	pte_t pte;
+	void *kva;
+
+	/* Don't bother allocating (and zeroing!) a jumbo if we can't use it */
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+	if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
+		spin_unlock(&p->pte_lock);
+		return pte_is_jumbo(pte) ? 0 : -EEXIST;
+	}
+	spin_unlock(&p->pte_lock);
+	kva = jumbo_page_alloc(1, MEM_ATOMIC);
+	if (!kva)
+		return -ENOMEM;
+	memset(kva, 0, PTSIZE);
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, TRUE);
+	if (!pte_walk_okay(pte) || pte_is_mapped(pte)) {
+		spin_unlock(&p->pte_lock);
+		jumbo_page_free(kva, 1);
+		if (pte_walk_okay(pte) && pte_is_jumbo(pte))
+			return 0;
+		return -ENOMEM;
+	}
+	pte_write(pte, PADDR(kva), prot | PTE_PS);
+	p->nr_anon_jumbos++;
 	spin_unlock(&p->pte_lock);
 	return 0;
 }
 
+/* Maps a jumbo PTE for the file's pages backing va (PTSIZE aligned), if they
+ * are all in the page cache and are the pieces of one jumbo page, in order.
+ * Returns 0 on success.  On error, the caller should use regular pages; the
+ * regular fault path will ask the FS to populate the range.  Hold the vmr_lock,
+ * and check vmr_pm_jumbo_fits() first. */
+static int map_pm_jumbo_at_addr(struct proc *p, struct vm_region *vmr,
+                                uintptr_t va, int prot)
+{
+	struct page_map *pm = vmr_to_pm(vmr);
+	unsigned long idx = (vmr->vm_foff + va - vmr->vm_base) >> PGSHIFT;
+	size_t nr_pgs = PTSIZE >> PGSHIFT;
+	struct page **pps;
+	size_t nr_got;
+	int ret = -EAGAIN;
+	pte_t pte;
+
+	/* This is a racy check - see the comments in fs_file.c */
+	if (idx + nr_pgs > nr_pages(foc_get_len(vmr->__vm_foc)))
+		return -ESPIPE;
+	pps = kmalloc(sizeof(struct page*) * nr_pgs, MEM_ATOMIC);
+	if (!pps)
+		return -ENOMEM;
+	nr_got = pm_load_pages_nowait(pm, idx, nr_pgs, pps);
+	if ((nr_got != nr_pgs) || (page2pa(pps[0]) % PTSIZE))
+		goto out;
+	for (size_t i = 1; i < nr_pgs; i++) {
+		if (pps[i] != pps[0] + i)
+			goto out;
+	}
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, TRUE);
+	if (pte_walk_okay(pte) && !pte_is_mapped(pte)) {
+		pte_write(pte, page2pa(pps[0]), prot | PTE_PS);
+		ret = 0;
+	} else if (pte_walk_okay(pte) && pte_is_jumbo(pte)) {
+		ret = 0;
+	}
+	spin_unlock(&p->pte_lock);
+out:
+	for (size_t i = 0; i < nr_got; i++)
+		pm_put_page(pps[i]);
+	kfree(pps);
+	return ret;
+}
+
+/* Fault-around: after a fault on a shared file VMR maps va, we also map the
+ * pages around it that are already in the page cache, up to p->fault_around of
+ * them, in a window aligned to its size.  Sequential readers of a mapped file
+ * then fault once per window instead of once per page.
+ *
+ * We don't load anything, and we skip pages that are already mapped or that the
+ * FS read ahead and no one has used yet: touching one of those should fault, so
+ * the FS hears about the hit and reads the next window.  Private VMRs don't map
+ * PM pages, so they don't get this.  Hold the vmr_lock. */
+static void __hpf_fault_around(struct proc *p, struct vm_region *vmr,
+                               uintptr_t va, int prot)
+{
+	struct page_map *pm = vmr_to_pm(vmr);
+	unsigned int nr = MIN(READ_ONCE(p->fault_around), MM_FAULT_AROUND_MAX);
+	struct page *pps[MM_FAULT_AROUND_MAX];
+	unsigned long idx, eof_idx;
+	uintptr_t start, end;
+	size_t nr_got;
+	pte_t pte;
+
+	if (nr < 2)
+		return;
+	start = MAX(ROUNDDOWN(va, nr * PGSIZE), vmr->vm_base);
+	end = MIN(start + nr * PGSIZE, vmr->vm_end);
+	eof_idx = nr_pages(foc_get_len(vmr->__vm_foc));
+	for (uintptr_t va_i = start; va_i < end; va_i += (nr_got + 1) * PGSIZE) {
+		idx = (va_i - vmr->vm_base + vmr->vm_foff) >> PGSHIFT;
+		if (idx >= eof_idx)
+			break;
+		nr_got = pm_load_pages_nowait(pm, idx,
+		                              MIN((end - va_i) >> PGSHIFT,
+		                                  eof_idx - idx), pps);
+		spin_lock(&p->pte_lock);
+		for (size_t i = 0; i < nr_got; i++) {
+			if (atomic_read(&pps[i]->pg_flags) & PG_READAHEAD)
+				continue;
+			/* The fault made va's page table; we don't make more */
+			pte = pgdir_walk(p->env_pgdir, (void*)(va_i + i * PGSIZE), FALSE);
+			if (!pte_walk_okay(pte) || pte_is_mapped(pte))
+				continue;
+			if (vmr->vm_prot & PROT_EXEC)
+				icache_flush_page((void*)(va_i + i * PGSIZE),
+				                  page2kva(pps[i]));
+			pte_write(pte, page2pa(pps[i]), prot);
+			p->nr_fault_around_maps++;
+		}
+		spin_unlock(&p->pte_lock);
+		for (size_t i = 0; i < nr_got; i++)
+			pm_put_page(pps[i]);
+	}
+}
+
+/* Breaks the jumbo mapped at va (if any) into regular PTEs for the same memory.
+ * The TLB is still fine: the translations are the same.  Hold the pte_lock.
+ *
+ * Anonymous jumbos need their page split, so the pieces can be freed on their
+ * own.  File jumbos are already split. */
+static void __demote_jumbo(struct proc *p, uintptr_t va, bool split_page)
+{
+	pte_t pte;
+	physaddr_t pa;
+	int settings;
+
+	va = ROUNDDOWN(va, PTSIZE);
+	pte = pgdir_walk_jumbo(p->env_pgdir, (void*)va, FALSE);
+	if (!pte_walk_okay(pte) || !pte_is_jumbo(pte))
+		return;
+	pa = pte_get_paddr(pte);
+	settings = pte_get_settings(pte) & ~PTE_PS;
+	pte_clear(pte);
+	if (split_page)
+		jumbo_page_split(KADDR(pa));
+	for (uintptr_t off = 0; off < PTSIZE; off += PGSIZE) {
+		/* Only the first walk allocates; the PML1 is MEM_WAIT. */
+		pte = pgdir_walk(p->env_pgdir, (void*)(va + off), TRUE);
+		assert(pte_walk_okay(pte));
+		pte_write(pte, pa + off, settings);
+	}
+	if (split_page) {
+		p->nr_anon_jumbos--;
+		p->nr_anon_pgs += PTSIZE / PGSIZE;
+		p->nr_jumbo_demotions++;
+	}
+}
+
 /* Helper: copies *pp's contents to a new page, replacing your page pointer.  If
  * this succeeds, you'll have a non-PM page, which matters for how you put it.*/
 static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
@@ -756,20 +1218,58 @@ static int __copy_and_swap_pmpg(struct proc *p, struct page **pp)
 	return 0;
 }
 
+/* Pages are grabbed from the kpages magazines in batches of this many. */
+#define POPULATE_BATCH_SZ 16
+
 /* Hold the VMR lock when you call this - it'll assume the entire VA range is
  * mappable, which isn't true if there are concurrent changes to the VMRs. */
-static int populate_anon_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
-                            int pte_prot)
-{
-	struct page *page;
-	int ret;
-	for (long i = 0; i < nr_pgs; i++) {
-		if (upage_alloc(p, &page, TRUE))
+static int populate_anon_va(struct proc *p, struct vm_region *vmr,
+                            uintptr_t va, unsigned long nr_pgs, int pte_prot,
+                            bool jumbo_ok)
+{
+	void *kvas[POPULATE_BATCH_SZ];
+	size_t nr_got, nr_want, nr_zeroed;
+	unsigned long nodes;
+	uintptr_t va_i;
+	int ret, pref;
+
+	for (long i = 0; i < nr_pgs; i += nr_got) {
+		va_i = va + i * PGSIZE;
+		if (jumbo_ok && !(va_i % PTSIZE) && (nr_pgs - i >= PTSIZE / PGSIZE) &&
+		    !map_jumbo_at_addr(p, va_i, pte_prot)) {
+			nr_got = PTSIZE / PGSIZE;
+			continue;
+		}
+		nr_want = MIN(nr_pgs - i, POPULATE_BATCH_SZ);
+		/* Stop at the next jumbo boundary, so we can try a jumbo there. */
+		if (jumbo_ok)
+			nr_want = MIN(nr_want,
+			              (ROUNDUP(va_i + 1, PTSIZE) - va_i) >> PGSHIFT);
+		mpol_pick(p, vmr, va_i, &nodes, &pref);
+		/* Interleaving picks a node per page */
+		if (pref != NUMA_NODE_LOCAL)
+			nr_want = 1;
+		/* Pre-zeroed pages first, then we zero the rest ourselves */
+		nr_zeroed = zpool_get_batch(nodes, pref, kvas, nr_want);
+		nr_got = nr_zeroed;
+		if (nr_got < nr_want)
+			nr_got += numa_kpages_alloc_batch(nodes, pref, kvas + nr_got,
+			                                  PGSIZE, nr_want - nr_got,
+			                                  MEM_ATOMIC);
+		if (!nr_got)
 			return -ENOMEM;
-		/* could imagine doing a memwalk instead of a for loop */
-		ret = map_page_at_addr(p, page, va + i * PGSIZE, pte_prot);
-		if (ret)
-			return ret;
+		for (int j = 0; j < nr_got; j++) {
+			if (j >= nr_zeroed)
+				memset(kvas[j], 0, PGSIZE);
+			/* could imagine doing a memwalk instead of a for loop */
+			ret = map_page_at_addr(p, kva2page(kvas[j]), va_i + j * PGSIZE,
+			                       pte_prot);
+			if (ret) {
+				/* map_page_at_addr() dropped kvas[j] already */
+				kpages_free_batch(&kvas[j + 1], PGSIZE, nr_got - j - 1);
+				return ret;
+			}
+		}
 	}
 	return 0;
 }
@@ -796,10 +1296,10 @@ static int populate_pm_va(struct proc *p, uintptr_t va, unsigned long nr_pgs,
 		if (ret) {
 			if (ret != -EAGAIN)
 				break;
-			spin_unlock(&p->vmr_lock);
+			spin_wunlock(&p->vmr_lock);
 			/* might block here, can't hold the spinlock */
 			ret = pm_load_page(pm, pm_idx0 + i, &page);
-			spin_lock(&p->vmr_lock);
+			spin_wlock(&p->vmr_lock);
 			if (ret)
 				break;
 			/* while we were sleeping, the VMRs could have changed on us. */
@@ -884,7 +1384,7 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 		}
 	}
 	/* read/write vmr lock (will change the tree) */
-	spin_lock(&p->vmr_lock);
+	spin_wlock(&p->vmr_lock);
 	p->vmr_history++;
 	/* Need to make sure nothing is in our way when we want a FIXED location.
 	 * We just need to split on the end points (if they exist), and then remove
@@ -893,7 +1393,7 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 	if (flags & MAP_FIXED)
 		__do_munmap(p, addr, len);
 	if (!vmr_insert(vmr, p, addr, len)) {
-		spin_unlock(&p->vmr_lock);
+		spin_wunlock(&p->vmr_lock);
 		if (vmr_has_file(vmr)) {
 			pm_remove_vmr(vmr_to_pm(vmr), vmr);
 			foc_decref(vmr->__vm_foc);
@@ -915,7 +1415,8 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 		unsigned long nr_pgs = len >> PGSHIFT;
 		int ret = 0;
 		if (!file) {
-			ret = populate_anon_va(p, addr, nr_pgs, pte_prot);
+			ret = populate_anon_va(p, vmr, addr, nr_pgs, pte_prot,
+			                       vmr_wants_jumbo(vmr));
 		} else {
 			/* Note: this will unlock if it blocks.  our refcnt on the file
 			 * keeps the pm alive when we unlock */
@@ -923,19 +1424,58 @@ void *do_mmap(struct proc *p, uintptr_t addr, size_t len, int prot, int flags,
 			                     offset, flags, prot & PROT_EXEC);
 		}
 		if (ret == -ENOMEM) {
-			spin_unlock(&p->vmr_lock);
+			spin_wunlock(&p->vmr_lock);
 			printk("[kernel] ENOMEM, killing %d\n", p->pid);
 			proc_destroy(p);
 			return MAP_FAILED;	/* will never make it back to userspace */
 		}
 	}
-	spin_unlock(&p->vmr_lock);
+	spin_wunlock(&p->vmr_lock);
 
 	profiler_notify_mmap(p, addr, len, prot, flags, file, offset);
 
 	return (void*)addr;
 }
 
+/* Gathers the TLB shootdowns of one munmap or mprotect, like Linux's
+ * mmu_gather: we send one round of IPIs for all of the op's VMRs, covering only
+ * what was actually mapped.  A gather lives on the op's stack and must be
+ * finished before the op frees any pages or returns, so no one can use a stale
+ * TLB entry once the syscall is done.  That includes dropping a CoW share: the
+ * other sharer may then make the page writable in place. */
+struct tlb_gather {
+	struct proc					*p;
+	uintptr_t					start;
+	uintptr_t					end;
+};
+
+static void tlb_gather_init(struct tlb_gather *tg, struct proc *p)
+{
+	tg->p = p;
+	tg->start = 0;
+	tg->end = 0;
+}
+
+static void tlb_gather_add(struct tlb_gather *tg, uintptr_t va, size_t len)
+{
+	if (tg->start == tg->end) {
+		tg->start = va;
+		tg->end = va + len;
+		return;
+	}
+	tg->start = MIN(tg->start, va);
+	tg->end = MAX(tg->end, va + len);
+}
+
+static void tlb_gather_finish(struct tlb_gather *tg)
+{
+	if (tg->start == tg->end)
+		return;
+	proc_tlbshootdown(tg->p, tg->start, tg->end);
+	tg->start = 0;
+	tg->end = 0;
+}
+
 int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 {
 	int ret;
@@ -953,10 +1493,10 @@ int mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 		return -1;
 	}
 	/* read/write lock, will probably change the tree and settings */
-	spin_lock(&p->vmr_lock);
+	spin_wlock(&p->vmr_lock);
 	p->vmr_history++;
 	ret = __do_mprotect(p, addr, len, prot);
-	spin_unlock(&p->vmr_lock);
+	spin_wunlock(&p->vmr_lock);
 	return ret;
 }
 
@@ -967,7 +1507,7 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 {
 	struct vm_region *vmr, *next_vmr;
 	pte_t pte;
-	bool shootdown_needed = FALSE;
+	struct tlb_gather tg;
 	bool file_access_failure = FALSE;
 	int pte_prot = (prot & PROT_WRITE) ? PTE_USER_RW :
 	               (prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : PTE_NONE;
@@ -976,6 +1516,7 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 	 * prots are the same as the previous.  Plus, there are three excessive
 	 * scans. */
 	isolate_vmrs(p, addr, len);
+	tlb_gather_init(&tg, p);
 	vmr = find_first_vmr(p, addr);
 	while (vmr && vmr->vm_base < addr + len) {
 		if (vmr->vm_prot == prot)
@@ -994,8 +1535,20 @@ int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot)
 		for (uintptr_t va = vmr->vm_base; va < vmr->vm_end; va += PGSIZE) {
 			pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
 			if (pte_walk_okay(pte) && pte_is_mapped(pte)) {
-				pte_replace_perm(pte, pte_prot);
-				shootdown_needed = TRUE;
+				/* Shared CoW pages stay read-only; a write will fault and
+				 * break the share. */
+				if ((pte_prot == PTE_USER_RW) &&
+				    page_is_cow_shared(pa2page(pte_get_paddr(pte))))
+					pte_replace_perm(pte, PTE_USER_RO);
+				else
+					pte_replace_perm(pte, pte_prot);
+				/* jumbos are entirely within the VMR; skip the rest of it */
+				if (pte_is_jumbo(pte)) {
+					tlb_gather_add(&tg, ROUNDDOWN(va, PTSIZE), PTSIZE);
+					va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+				} else {
+					tlb_gather_add(&tg, va, PGSIZE);
+				}
 			}
 		}
 		spin_unlock(&p->pte_lock);
@@ -1009,8 +1562,7 @@ next_vmr:
 		next_vmr = TAILQ_NEXT(vmr, vm_link);
 		vmr = next_vmr;
 	}
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_gather_finish(&tg);
 	if (file_access_failure) {
 		set_errno(EACCES);
 		return -1;
@@ -1035,16 +1587,16 @@ int munmap(struct proc *p, uintptr_t addr, size_t len)
 		return -1;
 	}
 	/* read/write: changing the vmrs (trees, properties, and whatnot) */
-	spin_lock(&p->vmr_lock);
+	spin_wlock(&p->vmr_lock);
 	p->vmr_history++;
 	ret = __do_munmap(p, addr, len);
-	spin_unlock(&p->vmr_lock);
+	spin_wunlock(&p->vmr_lock);
 	return ret;
 }
 
 static int __munmap_pte(struct proc *p, pte_t pte, void *va, void *arg)
 {
-	bool *shootdown_needed = (bool*)arg;
+	struct tlb_gather *tg = (struct tlb_gather*)arg;
 	struct page *page;
 
 	/* could put in some checks here for !P and also !0 */
@@ -1055,7 +1607,7 @@ static int __munmap_pte(struct proc *p, pte_t pte, void *va, void *arg)
 		atomic_or(&page->pg_flags, PG_DIRTY);
 	}
 	pte_clear_present(pte);
-	*shootdown_needed = TRUE;
+	tlb_gather_add(tg, (uintptr_t)va, pte_is_jumbo(pte) ? PTSIZE : PGSIZE);
 	return 0;
 }
 
@@ -1079,35 +1631,58 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 		return 0;
 	page = pa2page(pte_get_paddr(pte));
 	pte_clear(pte);
-	if (!page_is_pagemap(page))
-		page_decref(page);
+	if (page_is_pagemap(page))
+		return 0;
+	p->nr_anon_pgs--;
+	/* If someone else still has a CoW share, this just drops ours, and they can
+	 * write to it in place.  Callers shoot down our TLB entries first. */
+	page_decref(page);
 	return 0;
 }
 
+/* Jumbos in a PM belong to the PM, just like regular PM pages. */
+static int __vmr_free_jumbo(struct proc *p, pte_t pte, void *va, void *arg)
+{
+	physaddr_t pa = pte_get_paddr(pte);
+
+	pte_clear(pte);
+	if (page_is_pagemap(pa2page(pa)))
+		return 0;
+	p->nr_anon_jumbos--;
+	jumbo_page_free(KADDR(pa), 1);
+	return 0;
+}
+
+/* All of the VMRs in the range get one shootdown, after their PTEs are cleared
+ * and before any of their pages are freed or their VMRs are unhooked from a PM
+ * (which could evict a page we still have TLB entries for). */
 int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 {
 	struct vm_region *vmr, *next_vmr, *first_vmr;
-	bool shootdown_needed = FALSE;
+	struct tlb_gather tg;
 
 	/* TODO: this will be a bit slow, since we end up doing three linear
 	 * searches (two in isolate, one in find_first). */
 	isolate_vmrs(p, addr, len);
 	first_vmr = find_first_vmr(p, addr);
 	vmr = first_vmr;
+	tlb_gather_init(&tg, p);
 	spin_lock(&p->pte_lock);	/* changing PTEs */
 	while (vmr && vmr->vm_base < addr + len) {
 		/* It's important that we call __munmap_pte and sync the PG_DIRTY bit
 		 * before we unhook the VMR from the PM (in destroy_vmr). */
 		env_user_mem_walk(p, (void*)vmr->vm_base, vmr->vm_end - vmr->vm_base,
-		                  __munmap_pte, &shootdown_needed);
+		                  __munmap_pte, &tg);
+		env_user_jumbo_walk(p, (void*)vmr->vm_base,
+		                    vmr->vm_end - vmr->vm_base, __munmap_pte, &tg);
 		vmr = TAILQ_NEXT(vmr, vm_link);
 	}
 	spin_unlock(&p->pte_lock);
+	p->nr_munmaps++;
 	/* we haven't freed the pages yet; still using the PTEs to store the them.
 	 * There should be no races with inserts/faults, since we still hold the mm
 	 * lock since the previous CB. */
-	if (shootdown_needed)
-		proc_tlbshootdown(p, addr, addr + len);
+	tlb_gather_finish(&tg);
 	vmr = first_vmr;
 	while (vmr && vmr->vm_base < addr + len) {
 		/* there is rarely more than one VMR in this loop.  o/w, we'll need to
@@ -1115,6 +1690,8 @@ int __do_munmap(struct proc *p, uintptr_t addr, size_t len)
 		spin_lock(&p->pte_lock);	/* changing PTEs */
 		env_user_mem_walk(p, (void*)vmr->vm_base, vmr->vm_end - vmr->vm_base,
 			              __vmr_free_pgs, 0);
+		env_user_jumbo_walk(p, (void*)vmr->vm_base,
+		                    vmr->vm_end - vmr->vm_base, __vmr_free_jumbo, 0);
 		spin_unlock(&p->pte_lock);
 		next_vmr = TAILQ_NEXT(vmr, vm_link);
 		destroy_vmr(vmr);
@@ -1132,9 +1709,50 @@ static void __put_page(struct page *page)
 		page_decref(page);
 }
 
-static int __hpf_load_page(struct proc *p, struct page_map *pm,
+struct hpf_load {
+	struct file_or_chan			*foc;
+	unsigned long				idx;
+};
+
+static void __hpf_load_ktask(void *arg)
+{
+	struct hpf_load *hl = arg;
+	struct page *page;
+
+	if (!pm_load_page(foc_to_pm(hl->foc), hl->idx, &page))
+		pm_put_page(page);
+	foc_decref(hl->foc);
+	kfree_sized(hl, sizeof(struct hpf_load));
+}
+
+/* MCPs don't wait in the kernel for file pages: we reflect the fault, and the
+ * 2LS runs other uthreads while the faulting one waits on a populate_va().  So
+ * that the I/O is already going by the time populate_va() gets to run, we
+ * start the load here, in a ktask.  populate_va()'s pm_load_page() will find
+ * the page in flight and wait on it.
+ *
+ * If the page is already in the PM, someone is loading it, and we don't bother.
+ * If we can't get the memory to start a load, we don't either; populate_va()
+ * will do it. */
+static void __hpf_start_load(struct file_or_chan *foc, unsigned long idx)
+{
+	struct hpf_load *hl;
+
+	if (pm_has_page(foc_to_pm(foc), idx))
+		return;
+	hl = kmalloc_sized(sizeof(struct hpf_load), MEM_ATOMIC);
+	if (!hl)
+		return;
+	foc_incref(foc);
+	hl->foc = foc;
+	hl->idx = idx;
+	ktask("hpf_load", __hpf_load_ktask, hl);
+}
+
+static int __hpf_load_page(struct proc *p, struct file_or_chan *foc,
                            unsigned long idx, struct page **page, bool first)
 {
+	struct page_map *pm = foc_to_pm(foc);
 	int ret = 0;
 	int coreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
@@ -1161,6 +1779,7 @@ static int __hpf_load_page(struct proc *p, struct page_map *pm,
 		case (PROC_RUNNABLE_M):
 		case (PROC_RUNNING_M):
 			spin_unlock(&p->proc_lock);
+			__hpf_start_load(foc, idx);
 			return -EAGAIN;	/* will get reflected back to userspace */
 		case (PROC_DYING):
 		case (PROC_DYING_ABORT):
@@ -1186,6 +1805,65 @@ static int __hpf_load_page(struct proc *p, struct page_map *pm,
 	return 0;
 }
 
+/* Handles a write fault on a page that might be shared copy-on-write.  If no
+ * one else has the page anymore, we just make it writable.  O/w we get our own
+ * copy and drop our share of the old one.  Hold the vmr_lock, which keeps the
+ * VMR around.  Other faults can still change our PTE while we copy, so we check
+ * it again before installing the copy.
+ *
+ * Returns -ENOENT if there is no page, meaning it's a regular fault. */
+static int __hpf_cow(struct proc *p, struct vm_region *vmr, uintptr_t va)
+{
+	struct page *old_pg, *new_pg;
+	int pte_prot = vmr_pte_prot(vmr);
+	pte_t pte;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+	if (!pte_walk_okay(pte) || !pte_is_present(pte)) {
+		spin_unlock(&p->pte_lock);
+		return -ENOENT;
+	}
+	/* Already writable: someone else fixed it, or we raced with mprotect */
+	if (pte_is_jumbo(pte) || (pte_get_settings(pte) & PTE_W)) {
+		spin_unlock(&p->pte_lock);
+		return 0;
+	}
+	old_pg = pa2page(pte_get_paddr(pte));
+	if (page_is_pagemap(old_pg)) {
+		/* Private VMRs don't map PM pages; something is wrong */
+		spin_unlock(&p->pte_lock);
+		warn_once("RO PM page %p in a private VMR at %p", old_pg, va);
+		return -EPERM;
+	}
+	if (!page_is_cow_shared(old_pg)) {
+		pte_replace_perm(pte, pte_prot);
+		p->nr_cow_reuses++;
+		spin_unlock(&p->pte_lock);
+		return 0;
+	}
+	spin_unlock(&p->pte_lock);
+	if (upage_alloc_vmr(p, vmr, va, &new_pg, FALSE))
+		return -ENOMEM;
+	memcpy(page2kva(new_pg), page2kva(old_pg), PGSIZE);
+	spin_lock(&p->pte_lock);
+	/* Someone else broke the share first.  Our copy could be of a page they
+	 * already freed, but we're not using it. */
+	if (!pte_is_present(pte) || (pte_get_paddr(pte) != page2pa(old_pg)) ||
+	    (pte_get_settings(pte) & PTE_W)) {
+		spin_unlock(&p->pte_lock);
+		page_decref(new_pg);
+		return 0;
+	}
+	pte_write(pte, page2pa(new_pg), pte_prot);
+	p->nr_cow_breaks++;
+	spin_unlock(&p->pte_lock);
+	/* An MCP's other cores could still be reading the old page */
+	proc_tlbshootdown(p, va, va + PGSIZE);
+	page_decref(old_pg);
+	return 0;
+}
+
 /* Returns 0 on success, or an appropriate -error code.
  *
  * Notes: if your TLB caches negative results, you'll need to flush the
@@ -1205,8 +1883,10 @@ static int __hpf(struct proc *p, uintptr_t va, int prot, bool file_ok)
 	va = ROUNDDOWN(va,PGSIZE);
 
 refault:
-	/* read access to the VMRs TODO: RCU */
-	spin_lock(&p->vmr_lock);
+	/* We only read the VMRs, so other cores can fault at the same time.  Our
+	 * PTE changes are under the pte_lock, and the map helpers handle someone
+	 * else having mapped the page first. */
+	spin_rlock(&p->vmr_lock);
 	/* Check the vmr's protection */
 	vmr = find_vmr(p, va);
 	if (!vmr) {							/* not mapped at all */
@@ -1218,9 +1898,19 @@ refault:
 		ret = -EPERM;
 		goto out;
 	}
+	if ((prot & PROT_WRITE) &&
+	    (!vmr_has_file(vmr) || (vmr->vm_flags & MAP_PRIVATE))) {
+		ret = __hpf_cow(p, vmr, va);
+		if (ret != -ENOENT)
+			goto out;
+		ret = 0;
+	}
 	if (!vmr_has_file(vmr)) {
 		/* No file - just want anonymous memory */
-		if (upage_alloc(p, &a_page, TRUE)) {
+		if (vmr_jumbo_fits(vmr, va) &&
+		    !map_jumbo_at_addr(p, ROUNDDOWN(va, PTSIZE), vmr_pte_prot(vmr)))
+			goto out;
+		if (upage_alloc_vmr(p, vmr, va, &a_page, TRUE)) {
 			ret = -ENOMEM;
 			goto out;
 		}
@@ -1247,15 +1937,18 @@ refault:
 			ret = -ESPIPE; /* linux sends a SIGBUS at access time */
 			goto out;
 		}
+		if (vmr_pm_jumbo_fits(vmr, va) &&
+		    !map_pm_jumbo_at_addr(p, vmr, ROUNDDOWN(va, PTSIZE),
+		                          vmr_pte_prot(vmr)))
+			goto out;
 		ret = pm_load_page_nowait(foc_to_pm(file), f_idx, &a_page);
 		if (ret) {
 			if (ret != -EAGAIN)
 				goto out;
 			/* keep the file alive after we unlock */
 			foc_incref(file);
-			spin_unlock(&p->vmr_lock);
-			ret = __hpf_load_page(p, foc_to_pm(file), f_idx, &a_page,
-			                      first);
+			spin_runlock(&p->vmr_lock);
+			ret = __hpf_load_page(p, file, f_idx, &a_page, first);
 			first = FALSE;
 			foc_decref(file);
 			if (ret)
@@ -1282,6 +1975,8 @@ refault:
 	int pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW :
 	               (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 	ret = map_page_at_addr(p, a_page, va, pte_prot);
+	if (!ret && vmr_has_file(vmr) && !(vmr->vm_flags & MAP_PRIVATE))
+		__hpf_fault_around(p, vmr, va, pte_prot);
 	/* fall through, even for errors */
 out_put_pg:
 	/* the VMR's existence in the PM (via the mmap) allows us to have PTE point
@@ -1290,7 +1985,7 @@ out_put_pg:
 	if (page_is_pagemap(a_page))
 		pm_put_page(a_page);
 out:
-	spin_unlock(&p->vmr_lock);
+	spin_runlock(&p->vmr_lock);
 	return ret;
 }
 
@@ -1304,6 +1999,58 @@ int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot)
 	return __hpf(p, va, prot, FALSE);
 }
 
+/* Shares the pages backing [uva, uva + nr_pgs * PGSIZE) with the kernel,
+ * copy-on-write, so that e.g. a pipe can queue them instead of copying.  The
+ * PTEs become read-only, so a later write from userspace gets its own copy (see
+ * __hpf_cow()).  Each page in @pages gets a CoW ref, which the caller drops with
+ * page_decref().  The pages are marked PG_COW_BUF, so blocks know what kind of
+ * buffer they are.
+ *
+ * Only works on present, regular pages of private memory.  Stops at the first
+ * page that isn't, and returns the number of pages shared. */
+size_t uva_share_pages_cow(struct proc *p, uintptr_t uva, size_t nr_pgs,
+                           struct page **pages)
+{
+	struct vm_region *vmr = NULL;
+	struct page *pp;
+	uintptr_t va;
+	pte_t pte;
+	size_t i;
+	bool changed = FALSE;
+
+	assert(!PGOFF(uva));
+	spin_wlock(&p->vmr_lock);
+	spin_lock(&p->pte_lock);
+	for (i = 0; i < nr_pgs; i++) {
+		va = uva + i * PGSIZE;
+		if (!vmr || (va >= vmr->vm_end)) {
+			vmr = find_vmr(p, va);
+			if (!vmr || !(vmr->vm_prot & PROT_READ))
+				break;
+			if (vmr_has_file(vmr) && !(vmr->vm_flags & MAP_PRIVATE))
+				break;
+		}
+		pte = pgdir_walk(p->env_pgdir, (void*)va, 0);
+		if (!pte_walk_okay(pte) || !pte_is_present(pte) || pte_is_jumbo(pte))
+			break;
+		pp = pa2page(pte_get_paddr(pte));
+		if (page_is_pagemap(pp))
+			break;
+		if (pte_get_settings(pte) & PTE_W) {
+			pte_replace_perm(pte, PTE_USER_RO);
+			changed = TRUE;
+		}
+		atomic_or(&pp->pg_flags, PG_COW_BUF);
+		page_cow_share(pp);
+		pages[i] = pp;
+	}
+	spin_unlock(&p->pte_lock);
+	if (changed)
+		proc_tlbshootdown(p, uva, uva + i * PGSIZE);
+	spin_wunlock(&p->vmr_lock);
+	return i;
+}
+
 /* Attempts to populate the pages, as if there was a page faults.  Bails on
  * errors, and returns the number of pages populated.  */
 unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
@@ -1319,7 +2066,7 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 	/* we can screw around with ways to limit the find_vmr calls (can do the
 	 * next in line if we didn't unlock, etc., but i don't expect us to do this
 	 * for more than a single VMR in most cases. */
-	spin_lock(&p->vmr_lock);
+	spin_wlock(&p->vmr_lock);
 	while (nr_pgs) {
 		vmr = find_vmr(p, va);
 		if (!vmr)
@@ -1330,7 +2077,8 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 		           (vmr->vm_prot & (PROT_READ|PROT_EXEC)) ? PTE_USER_RO : 0;
 		nr_pgs_this_vmr = MIN(nr_pgs, (vmr->vm_end - va) >> PGSHIFT);
 		if (!vmr_has_file(vmr)) {
-			if (populate_anon_va(p, va, nr_pgs_this_vmr, pte_prot)) {
+			if (populate_anon_va(p, vmr, va, nr_pgs_this_vmr, pte_prot,
+			                     vmr_wants_jumbo(vmr))) {
 				/* on any error, we can just bail.  we might be underestimating
 				 * nr_filled. */
 				break;
@@ -1356,10 +2104,174 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 		va += nr_pgs_this_vmr << PGSHIFT;
 		nr_pgs -= nr_pgs_this_vmr;
 	}
-	spin_unlock(&p->vmr_lock);
+	spin_wunlock(&p->vmr_lock);
 	return nr_filled;
 }
 
+struct madv_work {
+	struct proc					*p;
+	uintptr_t					va;
+	unsigned long				nr_pgs;
+};
+
+static void __madv_willneed_ktask(void *arg)
+{
+	struct madv_work *w = arg;
+
+	populate_va(w->p, w->va, w->nr_pgs);
+	proc_decref(w->p);
+	kfree_sized(w, sizeof(struct madv_work));
+}
+
+/* Populates the range in the background, like a populate_va() that the caller
+ * doesn't wait for.  This is just advice; if we can't get the memory for the
+ * ktask, we don't bother. */
+static void madv_willneed(struct proc *p, uintptr_t addr, size_t len)
+{
+	struct madv_work *w;
+
+	w = kmalloc_sized(sizeof(struct madv_work), MEM_ATOMIC);
+	if (!w)
+		return;
+	proc_incref(p, 1);
+	w->p = p;
+	w->va = addr;
+	w->nr_pgs = len >> PGSHIFT;
+	ktask("madv_willneed", __madv_willneed_ktask, w);
+}
+
+/* Drops the pages in the range, but keeps the VMRs.  The next touch faults
+ * like it's the first one: anonymous memory comes back zeroed, and file pages
+ * come back from the PM (for private maps, without our changes).  Anonymous
+ * pages (and private copies) are freed.
+ *
+ * Like __do_munmap(), we clear the PTEs, shoot down, then free, all under the
+ * vmr_lock, so faults can't race with us. */
+static void madv_dontneed(struct proc *p, uintptr_t addr, size_t len)
+{
+	struct vm_region *vmr;
+	uintptr_t start, end;
+	struct tlb_gather tg;
+
+	spin_wlock(&p->vmr_lock);
+	tlb_gather_init(&tg, p);
+	vmr = find_first_vmr(p, addr);
+	for (struct vm_region *i = vmr; i && i->vm_base < addr + len;
+	     i = TAILQ_NEXT(i, vm_link)) {
+		start = MAX(i->vm_base, addr);
+		end = MIN(i->vm_end, addr + len);
+		spin_lock(&p->pte_lock);
+		/* We can only drop the parts of a jumbo that are in the range */
+		if (start % PTSIZE)
+			__demote_jumbo(p, start, !vmr_has_file(i));
+		if (end % PTSIZE)
+			__demote_jumbo(p, end, !vmr_has_file(i));
+		env_user_mem_walk(p, (void*)start, end - start, __munmap_pte, &tg);
+		env_user_jumbo_walk(p, (void*)start, end - start, __munmap_pte, &tg);
+		spin_unlock(&p->pte_lock);
+	}
+	tlb_gather_finish(&tg);
+	for (struct vm_region *i = vmr; i && i->vm_base < addr + len;
+	     i = TAILQ_NEXT(i, vm_link)) {
+		start = MAX(i->vm_base, addr);
+		end = MIN(i->vm_end, addr + len);
+		spin_lock(&p->pte_lock);
+		env_user_mem_walk(p, (void*)start, end - start, __vmr_free_pgs, 0);
+		env_user_jumbo_walk(p, (void*)start, end - start, __vmr_free_jumbo,
+		                    0);
+		spin_unlock(&p->pte_lock);
+	}
+	spin_wunlock(&p->vmr_lock);
+}
+
+/* Sets the readahead hint for the files mapped in the range.  Readahead state
+ * is per file, so the hint is too: the last madvise on any mapping of a file
+ * wins. */
+static void madv_ra_hint(struct proc *p, uintptr_t addr, size_t len, int hint)
+{
+	struct vm_region *vmr;
+
+	spin_rlock(&p->vmr_lock);
+	for (vmr = find_first_vmr(p, addr); vmr && vmr->vm_base < addr + len;
+	     vmr = TAILQ_NEXT(vmr, vm_link)) {
+		if (vmr_has_file(vmr))
+			WRITE_ONCE(vmr_to_pm(vmr)->pm_ra_hint, hint);
+	}
+	spin_runlock(&p->vmr_lock);
+}
+
+int madvise(struct proc *p, uintptr_t addr, size_t len, int advice)
+{
+	if (PGOFF(addr)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	len = ROUNDUP(len, PGSIZE);
+	if (!len)
+		return 0;
+	if (!__is_user_addr((void*)addr, len, UMAPTOP)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
+	switch (advice) {
+	case MADV_NORMAL:
+		madv_ra_hint(p, addr, len, PM_RA_NORMAL);
+		break;
+	case MADV_RANDOM:
+		madv_ra_hint(p, addr, len, PM_RA_RANDOM);
+		break;
+	case MADV_SEQUENTIAL:
+		madv_ra_hint(p, addr, len, PM_RA_SEQUENTIAL);
+		break;
+	case MADV_WILLNEED:
+		madv_willneed(p, addr, len);
+		break;
+	case MADV_DONTNEED:
+		madv_dontneed(p, addr, len);
+		break;
+	default:
+		set_errno(EINVAL);
+		return -1;
+	}
+	return 0;
+}
+
+/* Sets the memory policy for the VMRs in the range.  Only future allocations
+ * follow it; pages that are already there stay where they are. */
+int mbind(struct proc *p, uintptr_t addr, size_t len, int mode,
+          unsigned long nodes)
+{
+	struct mempolicy mpol;
+	struct vm_region *vmr, *next_vmr;
+
+	if (PGOFF(addr)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	len = ROUNDUP(len, PGSIZE);
+	if (!len)
+		return 0;
+	if (!__is_user_addr((void*)addr, len, UMAPTOP)) {
+		set_errno(ENOMEM);
+		return -1;
+	}
+	if (mpol_set(&mpol, mode, nodes)) {
+		set_errno(EINVAL);
+		return -1;
+	}
+	spin_wlock(&p->vmr_lock);
+	isolate_vmrs(p, addr, len);
+	vmr = find_first_vmr(p, addr);
+	while (vmr && vmr->vm_base < addr + len) {
+		mpol_set(&vmr->vm_mpol, mpol.mode, mpol.nodes);
+		vmr = merge_me(vmr);
+		next_vmr = TAILQ_NEXT(vmr, vm_link);
+		vmr = next_vmr;
+	}
+	spin_wunlock(&p->vmr_lock);
+	return 0;
+}
+
 /* Kernel Dynamic Memory Mappings */
 
 static struct arena *vmap_addr_arena;
@@ -729,6 +729,7 @@ int mon_trace(int argc, char **argv, struct hw_trapframe *hw_tf)
 		printk("\tcoretf COREID: prints PC, -1 for all cores, verbose => TF\n");
 		printk("\tpcpui [type [coreid]]: runs pcpui trace ring handlers\n");
 		printk("\tpcpui-reset [noclear]: resets/clears pcpui trace ring\n");
+		printk("\tkmsg: prints kmsg IPIs sent and coalesced, per core\n");
 		printk("\tverbose: toggles verbosity, depends on trace command\n");
 		return 1;
 	}
@@ -797,6 +798,8 @@ int mon_trace(int argc, char **argv, struct hw_trapframe *hw_tf)
 			printk("Turning trace verbosity on\n");
 			mon_verbose_trace = TRUE;
 		}
+	} else if (!strcmp(argv[1], "kmsg")) {
+		print_kmsg_ipi_stats();
 	} else if (!strcmp(argv[1], "opt2")) {
 		if (argc != 3) {
 			printk("ERRRRRRRRRR.\n");
@@ -1004,6 +1007,8 @@ int mon_db(int argc, char **argv, struct hw_trapframe *hw_tf)
 	if (argc < 2) {
 		printk("Usage: db OPTION\n");
 		printk("\tsem [PID]: print all semaphore info\n");
+		printk("\tkth: kthread cache and block to restart latency\n");
+		printk("\trcu: grace period times and callback backlog\n");
 		printk("\taddr PID 0xADDR: for PID lookup ADDR's file/vmr info\n");
 		return 1;
 	}
@@ -1011,6 +1016,10 @@ int mon_db(int argc, char **argv, struct hw_trapframe *hw_tf)
 		if (argc > 2)
 			pid = strtol(argv[2], 0, 0);
 		print_all_sem_info(pid);
+	} else if (!strcmp(argv[1], "kth")) {
+		print_kthread_stats();
+	} else if (!strcmp(argv[1], "rcu")) {
+		print_rcu_stats();
 	} else if (!strcmp(argv[1], "addr")) {
 		if (argc < 4) {
 			printk("Usage: db addr PID 0xADDR\n");
@@ -1108,6 +1117,8 @@ usage:
 		printk("Usage: ks OPTION\n");
 		printk("\tidles: show idle core map\n");
 		printk("\tdiag: scheduler diagnostic report\n");
+		printk("\tlat: core request to grant latency histogram\n");
+		printk("\tnotice USEC: warn MCPs USEC before preempting them\n");
 		printk("\tresources: show resources wanted/granted for all procs\n");
 		printk("\tsort: sorts the idlecoremap, 1..n\n");
 		printk("\tnc PCOREID: sets the next CG core allocated\n");
@@ -1117,6 +1128,14 @@ usage:
 		print_idle_core_map();
 	} else if (!strcmp(argv[1], "diag")) {
 		sched_diag();
+	} else if (!strcmp(argv[1], "lat")) {
+		print_ksched_latency();
+	} else if (!strcmp(argv[1], "notice")) {
+		if (argc != 3) {
+			printk("Need a time in usec.\n");
+			return 1;
+		}
+		sched_set_preempt_notice(strtol(argv[2], 0, 0));
 	} else if (!strcmp(argv[1], "resources")) {
 		print_all_resources();
 	} else if (!strcmp(argv[1], "sort")) {
@@ -48,6 +48,8 @@ enum {
 
 	AOK = 1,
 	AWAIT = 2,
+
+	Arpstale = 15 * 60 * 1000,	/* msec until we drop an OK entry */
 };
 
 char *arpstate[] = {
@@ -58,6 +60,13 @@ char *arpstate[] = {
 
 /*
  *  one per Fs
+ *
+ *  Updates are serialized by the qlock.  arpget() looks up resolved entries
+ *  without it: the hash chains are published with rcu_assign_pointer(), and
+ *  since entries are recycled in place instead of freed, each entry has a seq
+ *  counter that writers bump around changes to its address, state, medium, or
+ *  mac.  A reader that races with a writer, or is walking a chain while an
+ *  entry moves to another chain, just misses and takes the lock.
  */
 struct arp {
 	qlock_t qlock;
@@ -134,11 +143,14 @@ static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
 		}
 	}
 
+	__seq_start_write(&a->seq);
+	a->state = 0;
+
 	/* take out of current chain */
 	l = &arp->hash[haship(a->ip)];
 	for (f = *l; f; f = f->hash) {
 		if (f == a) {
-			*l = a->hash;
+			rcu_assign_pointer(*l, a->hash);
 			break;
 		}
 		l = &f->hash;
@@ -147,12 +159,13 @@ static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
 	/* insert into new chain */
 	l = &arp->hash[haship(ip)];
 	a->hash = *l;
-	*l = a;
+	rcu_assign_pointer(*l, a);
 
 	memmove(a->ip, ip, sizeof(a->ip));
 	a->utime = NOW;
 	a->ctime = 0;	/* somewhat of a "last sent time".  0, to trigger a send. */
 	a->type = m;
+	__seq_end_write(&a->seq);
 
 	a->rtime = NOW + ReTransTimer;
 	a->rxtsrem = MAX_MULTICAST_SOLICIT;
@@ -190,16 +203,18 @@ void cleanarpent(struct arp *arp, struct arpent *a)
 {
 	struct arpent *f, **l;
 
+	__seq_start_write(&a->seq);
 	a->utime = 0;
 	a->ctime = 0;
 	a->type = 0;
 	a->state = 0;
+	__seq_end_write(&a->seq);
 
 	/* take out of current chain */
 	l = &arp->hash[haship(a->ip)];
 	for (f = *l; f; f = f->hash) {
 		if (f == a) {
-			*l = a->hash;
+			rcu_assign_pointer(*l, a->hash);
 			break;
 		}
 		l = &f->hash;
@@ -221,6 +236,40 @@ void cleanarpent(struct arp *arp, struct arpent *a)
 	a->ifc = NULL;
 }
 
+/* Copies out the mac for ip, if we have a fresh, resolved entry for it,
+ * without the arp lock.  Returns FALSE if the caller needs to take the lock,
+ * including when we race with an update. */
+static bool arpget_lockless(struct arp *arp, struct medium *type, uint8_t *ip,
+                            uint8_t *mac)
+{
+	struct arpent *a;
+	seq_ctr_t seq;
+	uint64_t now = NOW;
+	bool ret = FALSE;
+
+	rcu_read_lock();
+	for (a = rcu_dereference(arp->hash[haship(ip)]); a;
+	     a = rcu_dereference(a->hash)) {
+		seq = READ_ONCE(a->seq);
+		rmb();	/* read seq before the entry */
+		if (a->state != AOK || a->type != type || ipcmp(ip, a->ip) != 0)
+			continue;
+		if (now - a->ctime > Arpstale)
+			break;
+		memmove(mac, a->mac, type->maclen);
+		if (seqctr_retry(seq, READ_ONCE(a->seq)))
+			break;
+		/* utime is just for picking a victim; racy writes are fine.  Only
+		 * writing when it changes keeps the line clean for other readers. */
+		if (a->utime != now)
+			a->utime = now;
+		ret = TRUE;
+		break;
+	}
+	rcu_read_unlock();
+	return ret;
+}
+
 /*
  *  fill in the media address if we have it.  Otherwise return an
  *  arpent that represents the state of the address resolution FSM
@@ -241,6 +290,9 @@ struct arpent *arpget(struct arp *arp, struct block *bp, int version,
 		ip = v6ip;
 	}
 
+	if (arpget_lockless(arp, type, ip, mac))
+		return NULL;
+
 	qlock(&arp->qlock);
 	hash = haship(ip);
 	for (a = arp->hash[hash]; a; a = a->hash) {
@@ -251,6 +303,7 @@ struct arpent *arpget(struct arp *arp, struct block *bp, int version,
 
 	if (a == NULL) {
 		a = newarp6(arp, ip, ifc, (version != V4));
+		/* newarp6() cleared the state, and lockless readers only want AOK */
 		a->state = AWAIT;
 	}
 	a->utime = NOW;
@@ -275,7 +328,7 @@ struct arpent *arpget(struct arp *arp, struct block *bp, int version,
 	}
 
 	/* remove old entries */
-	if (NOW - a->ctime > 15 * 60 * 1000)
+	if (NOW - a->ctime > Arpstale)
 		cleanarpent(arp, a);
 
 	qunlock(&arp->qlock);
@@ -313,9 +366,11 @@ struct block *arpresolve(struct arp *arp, struct arpent *a, struct medium *type,
 		}
 	}
 
+	__seq_start_write(&a->seq);
 	memmove(a->mac, mac, type->maclen);
 	a->type = type;
 	a->state = AOK;
+	__seq_end_write(&a->seq);
 	a->utime = NOW;
 	bp = a->hold;
 	a->hold = NULL;
@@ -373,8 +428,11 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 			continue;
 
 		if (ipcmp(a->ip, ip) == 0) {
+			__seq_start_write(&a->seq);
 			a->state = AOK;
 			memmove(a->mac, mac, type->maclen);
+			a->ctime = NOW;
+			__seq_end_write(&a->seq);
 
 			if (version == V6) {
 				/* take out of re-transmit chain */
@@ -394,23 +452,22 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 			a->hold = NULL;
 			if (version == V4)
 				ip += IPv4off;
-			a->utime = NOW;
-			a->ctime = a->utime;
+			a->utime = a->ctime;
 			qunlock(&arp->qlock);
 
 			while (bp) {
 				next = bp->list;
 				if (ifc != NULL) {
-					rlock(&ifc->rwlock);
+					br_rlock(&ifc->rwlock);
 					if (waserror()) {
-						runlock(&ifc->rwlock);
+						br_runlock(&ifc->rwlock);
 						nexterror();
 					}
 					if (ifc->m != NULL)
 						ifc->m->bwrite(ifc, bp, version, ip);
 					else
 						freeb(bp);
-					runlock(&ifc->rwlock);
+					br_runlock(&ifc->rwlock);
 					poperror();
 				} else
 					freeb(bp);
@@ -422,10 +479,12 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 
 	if (refresh == 0) {
 		a = newarp6(arp, ip, ifc, 0);
+		__seq_start_write(&a->seq);
 		a->state = AOK;
 		a->type = type;
 		a->ctime = NOW;
 		memmove(a->mac, mac, type->maclen);
+		__seq_end_write(&a->seq);
 	}
 
 	qunlock(&arp->qlock);
@@ -456,10 +515,12 @@ int arpwrite(struct Fs *fs, char *s, long len)
 	if (strcmp(f[0], "flush") == 0) {
 		qlock(&arp->qlock);
 		for (a = arp->cache; a < &arp->cache[NCACHE]; a++) {
+			__seq_start_write(&a->seq);
 			memset(a->ip, 0, sizeof(a->ip));
 			memset(a->mac, 0, sizeof(a->mac));
 			a->hash = NULL;
 			a->state = 0;
+			__seq_end_write(&a->seq);
 			a->utime = 0;
 			while (a->hold != NULL) {
 				bp = a->hold->list;
@@ -511,7 +572,7 @@ int arpwrite(struct Fs *fs, char *s, long len)
 		l = &arp->hash[haship(ip)];
 		for (a = *l; a; a = a->hash) {
 			if (memcmp(ip, a->ip, sizeof(a->ip)) == 0) {
-				*l = a->hash;
+				rcu_assign_pointer(*l, a->hash);
 				break;
 			}
 			l = &a->hash;
@@ -533,8 +594,11 @@ int arpwrite(struct Fs *fs, char *s, long len)
 			a->hold = NULL;
 			a->last = NULL;
 			a->ifc = NULL;
+			__seq_start_write(&a->seq);
+			a->state = 0;
 			memset(a->ip, 0, sizeof(a->ip));
 			memset(a->mac, 0, sizeof(a->mac));
+			__seq_end_write(&a->seq);
 		}
 		qunlock(&arp->qlock);
 	} else
@@ -608,7 +672,7 @@ static uint64_t rxmitsols(struct arp *arp)
 	for (; a; a = a->nextrxt) {
 		ifc = a->ifc;
 		assert(ifc != NULL);
-		if ((a->rxtsrem <= 0) || !(canrlock(&ifc->rwlock))
+		if ((a->rxtsrem <= 0) || !(br_canrlock(&ifc->rwlock))
 			|| (a->ifcid != ifc->ifcid)) {
 			xp = a->hold;
 			a->hold = NULL;
@@ -631,7 +695,7 @@ static uint64_t rxmitsols(struct arp *arp)
 	if ((sflag = ipv6anylocal(ifc, ipsrc)) != SRC_UNSPEC)
 		icmpns(f, ipsrc, sflag, a->ip, TARG_MULTI, ifc->mac);
 
-	runlock(&ifc->rwlock);
+	br_runlock(&ifc->rwlock);
 	qlock(&arp->qlock);
 
 	/* put to the end of re-transmit chain */
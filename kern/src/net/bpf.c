@@ -0,0 +1,312 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Classic BPF, for filtering frames in etheriq() before we copy them to a
+ * netfile.  See ros/bpf.h.
+ *
+ * We check programs when they are loaded, like Linux's sk_chk_filter(): every
+ * jump goes forward and stays in the program, and the last instruction is a
+ * ret.  So a program always finishes, in at most len steps.  A load past the
+ * end of the frame drops it, as does dividing by a zero X.  We don't do
+ * Linux's ancillary loads at negative offsets, which would just be out of
+ * bounds. */
+
+#include <net/ip.h>
+#include <ros/bpf.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <error.h>
+
+static bool bpf_code_ok(uint16_t code)
+{
+	switch (code) {
+	case BPF_LD | BPF_W | BPF_ABS:
+	case BPF_LD | BPF_H | BPF_ABS:
+	case BPF_LD | BPF_B | BPF_ABS:
+	case BPF_LD | BPF_W | BPF_IND:
+	case BPF_LD | BPF_H | BPF_IND:
+	case BPF_LD | BPF_B | BPF_IND:
+	case BPF_LD | BPF_W | BPF_LEN:
+	case BPF_LD | BPF_IMM:
+	case BPF_LD | BPF_MEM:
+	case BPF_LDX | BPF_W | BPF_LEN:
+	case BPF_LDX | BPF_B | BPF_MSH:
+	case BPF_LDX | BPF_IMM:
+	case BPF_LDX | BPF_MEM:
+	case BPF_ST:
+	case BPF_STX:
+	case BPF_ALU | BPF_NEG:
+	case BPF_JMP | BPF_JA:
+	case BPF_RET | BPF_K:
+	case BPF_RET | BPF_A:
+	case BPF_MISC | BPF_TAX:
+	case BPF_MISC | BPF_TXA:
+		return TRUE;
+	}
+	switch (BPF_CLASS(code)) {
+	case BPF_ALU:
+		switch (BPF_OP(code)) {
+		case BPF_ADD:
+		case BPF_SUB:
+		case BPF_MUL:
+		case BPF_DIV:
+		case BPF_OR:
+		case BPF_AND:
+		case BPF_LSH:
+		case BPF_RSH:
+		case BPF_MOD:
+		case BPF_XOR:
+			return (code & ~(BPF_OP(code) | BPF_SRC(code))) == BPF_ALU;
+		}
+		return FALSE;
+	case BPF_JMP:
+		switch (BPF_OP(code)) {
+		case BPF_JEQ:
+		case BPF_JGT:
+		case BPF_JGE:
+		case BPF_JSET:
+			return (code & ~(BPF_OP(code) | BPF_SRC(code))) == BPF_JMP;
+		}
+		return FALSE;
+	}
+	return FALSE;
+}
+
+static void bpf_check(struct bpf_insn *insns, unsigned int len)
+{
+	struct bpf_insn *in;
+
+	for (unsigned int pc = 0; pc < len; pc++) {
+		in = &insns[pc];
+		if (!bpf_code_ok(in->code))
+			error(EINVAL, "bpf: bad opcode 0x%x at %u", in->code, pc);
+		switch (BPF_CLASS(in->code)) {
+		case BPF_LD:
+		case BPF_LDX:
+			if (BPF_MODE(in->code) == BPF_MEM && in->k >= BPF_MEMWORDS)
+				error(EINVAL, "bpf: bad scratch word at %u", pc);
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			if (in->k >= BPF_MEMWORDS)
+				error(EINVAL, "bpf: bad scratch word at %u", pc);
+			break;
+		case BPF_ALU:
+			if ((BPF_OP(in->code) == BPF_DIV || BPF_OP(in->code) == BPF_MOD)
+			    && BPF_SRC(in->code) == BPF_K && !in->k)
+				error(EINVAL, "bpf: divide by zero at %u", pc);
+			break;
+		case BPF_JMP:
+			if (BPF_OP(in->code) == BPF_JA) {
+				if (in->k >= len - pc - 1)
+					error(EINVAL, "bpf: jump out of range at %u", pc);
+			} else if (in->jt >= len - pc - 1 || in->jf >= len - pc - 1) {
+				error(EINVAL, "bpf: jump out of range at %u", pc);
+			}
+			break;
+		}
+	}
+	if (BPF_CLASS(insns[len - 1].code) != BPF_RET)
+		error(EINVAL, "bpf: program doesn't end with a ret");
+}
+
+/* Copies and checks the program in buf, throwing on a bad one. */
+struct bpf_prog *bpf_prog_load(const void *buf, size_t n)
+{
+	ERRSTACK(1);
+	struct bpf_prog *prog;
+	unsigned int len = n / sizeof(struct bpf_insn);
+
+	if (!len || n % sizeof(struct bpf_insn) || len > BPF_MAXINSNS)
+		error(EINVAL, "bpf: bad program size %lu", n);
+	prog = kmalloc(sizeof(struct bpf_prog) + n, MEM_WAIT);
+	if (waserror()) {
+		kfree(prog);
+		nexterror();
+	}
+	prog->len = len;
+	memcpy(prog->insns, buf, n);
+	bpf_check(prog->insns, len);
+	poperror();
+	return prog;
+}
+
+/* Loads len bytes from off in bp, big endian, into *val.  Headers are almost
+ * always in the main body; the rest is in the extra bufs. */
+static bool bpf_load(struct block *bp, uint32_t off, int len, uint32_t *val)
+{
+	struct extra_bdata *ebd;
+	uint64_t pos;
+	uint32_t ret = 0;
+	uint8_t *p;
+
+	if ((uint64_t)off + len > BLEN(bp))
+		return FALSE;
+	if ((uint64_t)off + len <= BHLEN(bp)) {
+		p = bp->rp + off;
+		for (int i = 0; i < len; i++)
+			ret = (ret << 8) | p[i];
+		*val = ret;
+		return TRUE;
+	}
+	for (int i = 0; i < len; i++) {
+		pos = (uint64_t)off + i;
+		if (pos < BHLEN(bp)) {
+			ret = (ret << 8) | bp->rp[pos];
+			continue;
+		}
+		pos -= BHLEN(bp);
+		for (int j = 0; j < bp->nr_extra_bufs; j++) {
+			ebd = &bp->extra_data[j];
+			if (!ebd->base || !ebd->len)
+				continue;
+			if (pos < ebd->len) {
+				ret = (ret << 8) | ((uint8_t*)(ebd->base + ebd->off))[pos];
+				break;
+			}
+			pos -= ebd->len;
+		}
+	}
+	*val = ret;
+	return TRUE;
+}
+
+static int bpf_size(uint16_t code)
+{
+	switch (BPF_SIZE(code)) {
+	case BPF_W:
+		return 4;
+	case BPF_H:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/* Returns how many bytes of bp the program wants to keep, 0 to drop it. */
+unsigned int bpf_run(struct bpf_prog *prog, struct block *bp)
+{
+	struct bpf_insn *in;
+	uint32_t A = 0, X = 0, src, val;
+	uint32_t mem[BPF_MEMWORDS] = {0};
+
+	for (in = prog->insns; ; in++) {
+		switch (BPF_CLASS(in->code)) {
+		case BPF_LD:
+			switch (BPF_MODE(in->code)) {
+			case BPF_ABS:
+				if (!bpf_load(bp, in->k, bpf_size(in->code), &A))
+					return 0;
+				break;
+			case BPF_IND:
+				if (!bpf_load(bp, X + in->k, bpf_size(in->code), &A))
+					return 0;
+				break;
+			case BPF_LEN:
+				A = BLEN(bp);
+				break;
+			case BPF_IMM:
+				A = in->k;
+				break;
+			case BPF_MEM:
+				A = mem[in->k];
+				break;
+			}
+			break;
+		case BPF_LDX:
+			switch (BPF_MODE(in->code)) {
+			case BPF_LEN:
+				X = BLEN(bp);
+				break;
+			case BPF_MSH:
+				if (!bpf_load(bp, in->k, 1, &val))
+					return 0;
+				X = (val & 0xf) << 2;
+				break;
+			case BPF_IMM:
+				X = in->k;
+				break;
+			case BPF_MEM:
+				X = mem[in->k];
+				break;
+			}
+			break;
+		case BPF_ST:
+			mem[in->k] = A;
+			break;
+		case BPF_STX:
+			mem[in->k] = X;
+			break;
+		case BPF_ALU:
+			src = BPF_SRC(in->code) == BPF_X ? X : in->k;
+			switch (BPF_OP(in->code)) {
+			case BPF_ADD:
+				A += src;
+				break;
+			case BPF_SUB:
+				A -= src;
+				break;
+			case BPF_MUL:
+				A *= src;
+				break;
+			case BPF_DIV:
+				if (!src)
+					return 0;
+				A /= src;
+				break;
+			case BPF_MOD:
+				if (!src)
+					return 0;
+				A %= src;
+				break;
+			case BPF_OR:
+				A |= src;
+				break;
+			case BPF_AND:
+				A &= src;
+				break;
+			case BPF_XOR:
+				A ^= src;
+				break;
+			case BPF_LSH:
+				A = src < 32 ? A << src : 0;
+				break;
+			case BPF_RSH:
+				A = src < 32 ? A >> src : 0;
+				break;
+			case BPF_NEG:
+				A = -A;
+				break;
+			}
+			break;
+		case BPF_JMP:
+			src = BPF_SRC(in->code) == BPF_X ? X : in->k;
+			switch (BPF_OP(in->code)) {
+			case BPF_JA:
+				in += in->k;
+				break;
+			case BPF_JEQ:
+				in += A == src ? in->jt : in->jf;
+				break;
+			case BPF_JGT:
+				in += A > src ? in->jt : in->jf;
+				break;
+			case BPF_JGE:
+				in += A >= src ? in->jt : in->jf;
+				break;
+			case BPF_JSET:
+				in += A & src ? in->jt : in->jf;
+				break;
+			}
+			break;
+		case BPF_RET:
+			return BPF_RVAL(in->code) == BPF_A ? A : in->k;
+		case BPF_MISC:
+			if (BPF_MISCOP(in->code) == BPF_TAX)
+				X = A;
+			else
+				A = X;
+			break;
+		}
+	}
+}
@@ -73,7 +73,7 @@ enum {
 
 	Logtype = 5,
 	Masktype = (1 << Logtype) - 1,
-	Logconv = 12,
+	Logconv = Logmaxconv,
 	Maskconv = (1 << Logconv) - 1,
 	Shiftconv = Logtype,
 	Logproto = 8,
@@ -81,6 +81,10 @@ enum {
 	Shiftproto = Logtype + Logconv,
 
 	Nfs = 32,
+	Clonescan = 32,		/* convs Fsprotoclone() checks before making one */
+	Busypollmax = 10000,	/* usec */
+	Busypollbudget = 16,	/* packets per poll of the NIC */
+	Batchhdr = 2,		/* length prefix of each message in a batch */
 	BYPASS_QMAX = 64 * MiB,
 	IPROUTE_LEN = 2 * PGSIZE,
 };
@@ -106,7 +110,7 @@ static int connected(void *a);
 static struct conv *chan2conv(struct chan *chan)
 {
 	/* That's a lot of pointers to get to the conv! */
-	return ipfs[chan->dev]->p[PROTO(chan->qid)]->conv[CONV(chan->qid)];
+	return proto_conv(ipfs[chan->dev]->p[PROTO(chan->qid)], CONV(chan->qid));
 }
 
 static inline int founddevdir(struct chan *c, struct qid q, char *n,
@@ -128,6 +132,35 @@ static int topdirgen(struct chan *c, struct dir *dp)
 /* Computes the perm field for a stat for Qdata.  Since select() polls the
  * 'actionability' of a socket via the qdata FD, we'll also report listenable
  * and connected conversations.  It's a minor hack.  =( */
+/* Lockless peek at cv's accept queue, two lists: see Fsnewcall(). */
+static bool conv_has_incall(struct conv *cv)
+{
+	return READ_ONCE(cv->incall) || READ_ONCE(cv->incall_new);
+}
+
+/* Dequeues the oldest incoming call.  Only one dequeuer at a time: the
+ * listener holds listenq, and closeconv() only runs once there are none. */
+static struct conv *conv_pop_incall(struct conv *cv)
+{
+	struct conv *nc, *list, *next;
+
+	if (!cv->incall) {
+		/* The pushers' list is newest first, so flip it onto ours. */
+		list = atomic_swap_ptr((void**)&cv->incall_new, NULL);
+		for (; list; list = next) {
+			next = list->next;
+			list->next = cv->incall;
+			cv->incall = list;
+		}
+	}
+	nc = cv->incall;
+	if (nc) {
+		cv->incall = nc->next;
+		atomic_dec(&cv->nr_incall);
+	}
+	return nc;
+}
+
 static int qdata_stat_perm(struct conv *cv)
 {
 	int perm;
@@ -137,7 +170,7 @@ static int qdata_stat_perm(struct conv *cv)
 	 * report this on the Qlisten file (which we also do).  The socket crap
 	 * should never use a listening socket for data, so there shouldn't be any
 	 * confusion when a Qdata shows up as readable. */
-	perm |= cv->incall ? DMREADABLE : 0;
+	perm |= conv_has_incall(cv) ? DMREADABLE : 0;
 	/* For connectable convs, they need to be both connected and qio
 	 * readable/writable.  The way to think about this is that the convs are not
 	 * truly writable/readable until they are connected.  Conveniently, this
@@ -185,7 +218,7 @@ static int ip3gen(struct chan *c, int i, struct dir *dp)
 							   cv->owner, perm, dp);
 		case Qlisten:
 			perm = cv->perm;
-			perm |= cv->incall ? DMREADABLE : 0;
+			perm |= conv_has_incall(cv) ? DMREADABLE : 0;
 			return founddevdir(c, q, "listen", 0, cv->owner, perm, dp);
 		case Qlocal:
 			p = "local";
@@ -297,7 +330,7 @@ ipgen(struct chan *c, char *unused_char_p_t, struct dirtab *d, int unused_int,
 			if (s == DEVDOTDOT)
 				return topdirgen(c, dp);
 			else if (s < f->p[PROTO(c->qid)]->ac) {
-				cv = f->p[PROTO(c->qid)]->conv[s];
+				cv = proto_conv(f->p[PROTO(c->qid)], s);
 				snprintf(get_cur_genbuf(), GENBUF_SZ, "%d", s);
 				mkqid(&q, QID(PROTO(c->qid), s, Qconvdir), 0, QTDIR);
 				return
@@ -433,7 +466,7 @@ static int should_wake(void *arg)
 	/* signal that the conv is closed */
 	if (qisclosed(cv->rq))
 		return TRUE;
-	return cv->incall != NULL;
+	return conv_has_incall(cv);
 }
 
 static struct chan *ipopen(struct chan *c, int omode)
@@ -484,21 +517,24 @@ static struct chan *ipopen(struct chan *c, int omode)
 				error(EPERM, ERROR_FIXME);
 			/* might be racy.  note the lack of a proto lock, unlike Qdata */
 			p = f->p[PROTO(c->qid)];
-			cv = p->conv[CONV(c->qid)];
+			cv = proto_conv(p, CONV(c->qid));
 			if (strcmp(ATTACHER(c), cv->owner) != 0 && !iseve())
 				error(EPERM, ERROR_FIXME);
 			atomic_inc(&cv->snoopers);
 			break;
 		case Qclone:
 			p = f->p[PROTO(c->qid)];
-			qlock(&p->qlock);
-			if (waserror()) {
+			cv = Fsprotoclonecached(p, ATTACHER(c));
+			if (cv == NULL) {
+				qlock(&p->qlock);
+				if (waserror()) {
+					qunlock(&p->qlock);
+					nexterror();
+				}
+				cv = Fsprotoclone(p, ATTACHER(c));
 				qunlock(&p->qlock);
-				nexterror();
+				poperror();
 			}
-			cv = Fsprotoclone(p, ATTACHER(c));
-			qunlock(&p->qlock);
-			poperror();
 			if (cv == NULL) {
 				error(ENODEV, "Null conversation from Fsprotoclone");
 				break;
@@ -508,13 +544,13 @@ static struct chan *ipopen(struct chan *c, int omode)
 		case Qdata:
 		case Qctl:
 		case Qerr:
+			/* The cv qlock is enough to keep Fsprotoclone() from handing
+			 * out the conv while we open it. */
 			p = f->p[PROTO(c->qid)];
-			qlock(&p->qlock);
-			cv = p->conv[CONV(c->qid)];
+			cv = proto_conv(p, CONV(c->qid));
 			qlock(&cv->qlock);
 			if (waserror()) {
 				qunlock(&cv->qlock);
-				qunlock(&p->qlock);
 				nexterror();
 			}
 			if ((perm & (cv->perm >> 6)) != perm) {
@@ -530,11 +566,10 @@ static struct chan *ipopen(struct chan *c, int omode)
 				cv->perm = 0660;
 			}
 			qunlock(&cv->qlock);
-			qunlock(&p->qlock);
 			poperror();
 			break;
 		case Qlisten:
-			cv = f->p[PROTO(c->qid)]->conv[CONV(c->qid)];
+			cv = proto_conv(f->p[PROTO(c->qid)], CONV(c->qid));
 			/* No permissions or Announce checks required.  We'll see if that's
 			 * a good idea or not. (the perm check would do nothing, as is,
 			 * since an O_PATH perm is 0).
@@ -584,7 +619,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 				/* we can peek at incall without grabbing the cv qlock.  if
 				 * anything is there, it'll remain there until we dequeue it.
 				 * no one else can, since we hold the listenq lock */
-				if ((c->flag & O_NONBLOCK) && !cv->incall)
+				if ((c->flag & O_NONBLOCK) && !conv_has_incall(cv))
 					error(EAGAIN, "listen queue empty");
 				/* wait for a connect */
 				rendez_sleep(&cv->listenr, should_wake, cv);
@@ -592,9 +627,8 @@ static struct chan *ipopen(struct chan *c, int omode)
 				/* if there is a concurrent hangup, they will hold the qlock
 				 * until the hangup is complete, including closing the cv->rq */
 				qlock(&cv->qlock);
-				nc = cv->incall;
+				nc = conv_pop_incall(cv);
 				if (nc != NULL) {
-					cv->incall = nc->next;
 					mkqid(&c->qid, QID(PROTO(c->qid), nc->x, Qctl), 0, QTFILE);
 					kstrdup(&cv->owner, ATTACHER(c));
 				}
@@ -640,7 +674,7 @@ static size_t ipwstat(struct chan *c, uint8_t *dp, size_t n)
 	if (n == 0)
 		error(ENODATA, ERROR_FIXME);
 	p = f->p[PROTO(c->qid)];
-	cv = p->conv[CONV(c->qid)];
+	cv = proto_conv(p, CONV(c->qid));
 	if (!iseve() && strcmp(ATTACHER(c), cv->owner) != 0)
 		error(EPERM, ERROR_FIXME);
 	if (!emptystr(d->uid))
@@ -668,7 +702,7 @@ static char *ipchaninfo(struct chan *ch, char *ret, size_t ret_l)
 			break;
 		case Qdata:
 			proto = f->p[PROTO(ch->qid)];
-			conv = proto->conv[CONV(ch->qid)];
+			conv = proto_conv(proto, CONV(ch->qid));
 			snprintf(ret, ret_l,
 			         "Qdata, %s, proto %s, conv idx %d, rq len %d, wq len %d, total read %llu",
 			         SLIST_EMPTY(&conv->data_taps) ? "untapped" : "tapped",
@@ -683,11 +717,11 @@ static char *ipchaninfo(struct chan *ch, char *ret, size_t ret_l)
 			break;
 		case Qlisten:
 			proto = f->p[PROTO(ch->qid)];
-			conv = proto->conv[CONV(ch->qid)];
+			conv = proto_conv(proto, CONV(ch->qid));
 			snprintf(ret, ret_l,
 			         "Qlisten, %s proto %s, conv idx %d, has %sincalls",
 			         SLIST_EMPTY(&conv->listen_taps) ? "untapped" : "tapped",
-			         proto->name, conv->x, conv->incall ? "" : "no ");
+			         proto->name, conv->x, conv_has_incall(conv) ? "" : "no ");
 			break;
 		case Qlog:
 			ret = "Qlog";
@@ -697,7 +731,7 @@ static char *ipchaninfo(struct chan *ch, char *ret, size_t ret_l)
 			break;
 		case Qctl:
 			proto = f->p[PROTO(ch->qid)];
-			conv = proto->conv[CONV(ch->qid)];
+			conv = proto_conv(proto, CONV(ch->qid));
 			snprintf(ret, ret_l, "Qctl, proto %s, conv idx %d", proto->name,
 					 conv->x);
 			break;
@@ -721,13 +755,6 @@ static void closeconv(struct conv *cv)
 		qunlock(&cv->qlock);
 		nexterror();
 	}
-	/* close all incoming calls since no listen will ever happen */
-	for (nc = cv->incall; nc; nc = cv->incall) {
-		cv->incall = nc->next;
-		closeconv(nc);
-	}
-	cv->incall = NULL;
-
 	kstrdup(&cv->owner, network);
 	cv->perm = 0660;
 
@@ -740,6 +767,17 @@ static void closeconv(struct conv *cv)
 		undo_proto_qio_bypass(cv);
 	cv->p->close(cv);
 	cv->state = Idle;
+	tls_free(cv->tls_tx);
+	cv->tls_tx = NULL;
+	tls_free(cv->tls_rx);
+	cv->tls_rx = NULL;
+	/* Close all incoming calls since no listen will ever happen.  After the
+	 * close, so that the proto can't push any more. */
+	while ((nc = conv_pop_incall(cv)))
+		closeconv(nc);
+	/* Protos with an inuse() say when their convs are free. */
+	if (!cv->p->inuse)
+		Fsconvfree(cv);
 	qunlock(&cv->qlock);
 	poperror();
 }
@@ -765,11 +803,12 @@ static void ipclose(struct chan *c)
 		case Qerr:
 		case Qlisten:
 			if (c->flag & COPEN)
-				closeconv(f->p[PROTO(c->qid)]->conv[CONV(c->qid)]);
+				closeconv(proto_conv(f->p[PROTO(c->qid)], CONV(c->qid)));
 			break;
 		case Qsnoop:
 			if (c->flag & COPEN)
-				atomic_dec(&f->p[PROTO(c->qid)]->conv[CONV(c->qid)]->snoopers);
+				atomic_dec(&proto_conv(f->p[PROTO(c->qid)],
+				                       CONV(c->qid))->snoopers);
 			break;
 		case Qiproute:
 			if (c->flag & COPEN)
@@ -784,6 +823,118 @@ enum {
 	Statelen = 32 * 1024,
 };
 
+/* Spins for up to c->busypoll_usec, polling the NIC that c's route goes out
+ * (and presumably comes in) on and running its protocol input inline, until c
+ * has something to read.  This is for latency-critical readers on their own
+ * cores: it skips the IRQ, the rx kthreads, and the reader's wakeup. */
+static void ipbusypoll(struct conv *c)
+{
+	struct route *r;
+	struct Ipifc *ifc;
+	uint64_t end;
+
+	if (!c->busypoll_usec || qlen(c->rq) || qisclosed(c->rq))
+		return;
+	if (ipcmp(c->raddr, IPnoaddr) == 0)
+		return;
+	r = v6lookup(c->p->f, c->raddr, c);
+	if (!r || !r->rt.ifc)
+		return;
+	ifc = r->rt.ifc;
+	end = nsec() + c->busypoll_usec * 1000ULL;
+	do {
+		if (!br_canrlock(&ifc->rwlock))
+			return;
+		if (!ifc->m || !ifc->m->poll) {
+			br_runlock(&ifc->rwlock);
+			return;
+		}
+		ifc->m->poll(ifc, Busypollbudget);
+		br_runlock(&ifc->rwlock);
+		if (qlen(c->rq) || qisclosed(c->rq))
+			return;
+		cpu_relax();
+	} while (nsec() < end);
+}
+
+/* Batched reads: fills a with as many messages as fit, each preceded by its
+ * length as a Batchhdr-byte, big-endian integer.  Only the first message can
+ * block, and it is truncated if it doesn't fit, like any other read of a
+ * message queue.  The rest are only taken if they fit whole. */
+static size_t ipbatchread(struct chan *ch, struct conv *c, uint8_t *a, size_t n)
+{
+	struct block *b;
+	size_t sofar = 0, len;
+
+	if (n <= Batchhdr)
+		error(EINVAL, "batch read needs more than %d bytes", Batchhdr);
+	if (ch->flag & O_NONBLOCK) {
+		b = qbread_nonblock(c->rq, n - Batchhdr);
+	} else {
+		ipbusypoll(c);
+		b = qbread(c->rq, n - Batchhdr);
+	}
+	while (b) {
+		len = MIN(blocklen(b), n - sofar - Batchhdr);
+		hnputs(a + sofar, len);
+		sofar += Batchhdr;
+		freeblist(bl2mem(a + sofar, b, len));
+		sofar += len;
+		if (n - sofar <= Batchhdr)
+			break;
+		b = qget_fits(c->rq, n - sofar - Batchhdr);
+	}
+	return sofar;
+}
+
+/* Batched writes: a holds messages, each preceded by its length, like a batched
+ * read.  Each message is its own write to the conv, so it gets its own headers,
+ * if the protocol takes any.  A partial batch returns the length of the
+ * messages we sent, like a short write.
+ *
+ * UDP sends each message straight down to the device, so all but the last get
+ * Bxmore, and the NIC gets one kick for the batch. */
+static size_t ipbatchwrite(struct chan *ch, struct conv *c, uint8_t *a,
+                           size_t n)
+{
+	ERRSTACK(1);
+	size_t volatile sofar = 0;
+	size_t len;
+	struct block *b;
+	bool xmore = c->p->ipproto == UDP;
+
+	if (waserror()) {
+		if (!sofar)
+			nexterror();
+		poperror();
+		return sofar;
+	}
+	while (sofar < n) {
+		if (n - sofar < Batchhdr)
+			error(EINVAL, "short batch length");
+		len = nhgets(a + sofar);
+		if (len > n - sofar - Batchhdr)
+			error(EINVAL, "batch message overruns the write");
+		if (xmore && sofar + Batchhdr + len < n) {
+			b = block_alloc(len, MEM_WAIT);
+			memmove(b->wp, a + sofar + Batchhdr, len);
+			b->wp += len;
+			b->flag |= Bxmore;
+			if (ch->flag & O_NONBLOCK)
+				qbwrite_nonblock(c->wq, b);
+			else
+				qbwrite(c->wq, b);
+		} else if (ch->flag & O_NONBLOCK) {
+			qwrite_nonblock(c->wq, a + sofar + Batchhdr, len);
+		} else {
+			qwrite(c->wq, a + sofar + Batchhdr, len);
+		}
+		sofar += Batchhdr + len;
+	}
+	poperror();
+	return sofar;
+}
+
 static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 {
 	struct conv *c;
@@ -821,7 +972,7 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 		case Qremote:
 			buf = kzmalloc(Statelen, 0);
 			x = f->p[PROTO(ch->qid)];
-			c = x->conv[CONV(ch->qid)];
+			c = proto_conv(x, CONV(ch->qid));
 			if (x->remote == NULL) {
 				snprintf(buf, Statelen, "%I!%d\n", c->raddr, c->rport);
 			} else {
@@ -833,7 +984,7 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 		case Qlocal:
 			buf = kzmalloc(Statelen, 0);
 			x = f->p[PROTO(ch->qid)];
-			c = x->conv[CONV(ch->qid)];
+			c = proto_conv(x, CONV(ch->qid));
 			if (x->local == NULL) {
 				snprintf(buf, Statelen, "%I!%d\n", c->laddr, c->lport);
 			} else {
@@ -850,25 +1001,36 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 			 * changed sizes, it'll reprint the end of the buffer slightly. */
 			buf = kzmalloc(Statelen, 0);
 			x = f->p[PROTO(ch->qid)];
-			c = x->conv[CONV(ch->qid)];
+			c = proto_conv(x, CONV(ch->qid));
 			if (c->state == Bypass)
 				snprintf(buf, Statelen, "Bypassed\n");
 			else
 				(*x->state)(c, buf, Statelen - 2);
+			if (c->tls_tx || c->tls_rx) {
+				rv = strlen(buf);
+				tls_state(c, buf + rv, Statelen - 2 - rv);
+			}
 			rv = readstr(offset, p, n, buf);
 			kfree(buf);
 			return rv;
 		case Qdata:
-			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			c = proto_conv(f->p[PROTO(ch->qid)], CONV(ch->qid));
+			if (c->batch)
+				return ipbatchread(ch, c, a, n);
+			if (c->tls_rx) {
+				if (!(ch->flag & O_NONBLOCK))
+					ipbusypoll(c);
+				return tls_read(c, a, n, ch->flag & O_NONBLOCK);
+			}
 			if (ch->flag & O_NONBLOCK)
 				return qread_nonblock(c->rq, a, n);
-			else
-				return qread(c->rq, a, n);
+			ipbusypoll(c);
+			return qread(c->rq, a, n);
 		case Qerr:
-			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			c = proto_conv(f->p[PROTO(ch->qid)], CONV(ch->qid));
 			return qread(c->eq, a, n);
 		case Qsnoop:
-			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			c = proto_conv(f->p[PROTO(ch->qid)], CONV(ch->qid));
 			return qread(c->sq, a, n);
 		case Qstats:
 			x = f->p[PROTO(ch->qid)];
@@ -882,6 +1044,38 @@ static size_t ipread(struct chan *ch, void *a, size_t n, off64_t off)
 	}
 }
 
+/* Only the data file gets scatter/gather, everything else is a read per iovec,
+ * like the syscall would do for devices without readv. */
+static size_t ipreadv(struct chan *ch, struct iovec *iov, int iovcnt,
+                      off64_t offset)
+{
+	struct conv *c;
+	size_t sofar = 0, n;
+
+	switch (TYPE(ch->qid)) {
+		case Qdata:
+			c = chan2conv(ch);
+			if (!c->batch && !c->tls_rx) {
+				if (ch->flag & O_NONBLOCK)
+					return qreadv_nonblock(c->rq, iov, iovcnt);
+				ipbusypoll(c);
+				return qreadv(c->rq, iov, iovcnt);
+			}
+			/* Batches and TLS records don't span iovecs: each one is its own
+			 * read. */
+			/* fall through */
+		default:
+			for (int i = 0; i < iovcnt; i++) {
+				n = ipread(ch, iov[i].iov_base, iov[i].iov_len,
+				           offset + sofar);
+				sofar += n;
+				if (n < iov[i].iov_len)
+					break;
+			}
+			return sofar;
+	}
+}
+
 static struct block *ipbread(struct chan *ch, size_t n, off64_t offset)
 {
 	struct conv *c;
@@ -889,10 +1083,12 @@ static struct block *ipbread(struct chan *ch, size_t n, off64_t offset)
 	switch (TYPE(ch->qid)) {
 		case Qdata:
 			c = chan2conv(ch);
+			if (c->batch || c->tls_rx)
+				return devbread(ch, n, offset);
 			if (ch->flag & O_NONBLOCK)
 				return qbread_nonblock(c->rq, n);
-			else
-				return qbread(c->rq, n);
+			ipbusypoll(c);
+			return qbread(c->rq, n);
 		default:
 			return devbread(ch, n, offset);
 	}
@@ -917,6 +1113,14 @@ static void setluniqueport(struct conv *c, int lport)
 
 	p = c->p;
 
+	/* Protos with a hash table have all of their connected, announced, and
+	 * bypassed convs in it. */
+	if (p->ht) {
+		if (iphtfind(p->ht, c, c->raddr, c->rport, c->laddr, lport))
+			error(EFAIL, "address in use");
+		c->lport = lport;
+		return;
+	}
 	qlock(&p->qlock);
 	for (x = 0; x < p->nc; x++) {
 		xp = p->conv[x];
@@ -1381,6 +1585,24 @@ static void ttlctlmsg(struct conv *c, struct cmdbuf *cb)
 		c->ttl = atoi(cb->f[1]);
 }
 
+/* busypoll usec: blocking reads of the data file first spin on the NIC for up
+ * to usec (0 turns it off). */
+static void busypollctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (cb->nf < 2)
+		error(EINVAL, "busypoll needs a time in usec");
+	c->busypoll_usec = MIN(strtoul(cb->f[1], 0, 0), Busypollmax);
+}
+
+/* batch [off]: reads and writes of the data file carry many messages, each
+ * preceded by its length.  See ipbatchread(). */
+static void batchctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (!(qstate(c->rq) & Qmsg))
+		error(EINVAL, "batch needs a message protocol");
+	c->batch = cb->nf < 2 || strcmp(cb->f[1], "off") != 0;
+}
+
 /* Binds a conversation, as if the user wrote "bind *" into ctl. */
 static void autobind(struct conv *cv)
 {
@@ -1416,11 +1638,18 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 			error(EPERM, ERROR_FIXME);
 		case Qdata:
 			x = f->p[PROTO(ch->qid)];
-			c = x->conv[CONV(ch->qid)];
+			c = proto_conv(x, CONV(ch->qid));
 			/* connection-less protocols (UDP) can write without manually
 			 * binding. */
 			if (c->lport == 0)
 				autobind(c);
+			if (c->batch)
+				return ipbatchwrite(ch, c, (uint8_t*)a, n);
+			if (c->tls_tx) {
+				struct iovec iov = {a, n};
+
+				return tls_write(c, &iov, 1, ch->flag & O_NONBLOCK);
+			}
 			if (ch->flag & O_NONBLOCK)
 				qwrite_nonblock(c->wq, a, n);
 			else
@@ -1437,7 +1666,7 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 			return ndbwrite(f, a, off, n);
 		case Qctl:
 			x = f->p[PROTO(ch->qid)];
-			c = x->conv[CONV(ch->qid)];
+			c = proto_conv(x, CONV(ch->qid));
 			cb = parsecmd(a, n);
 
 			qlock(&c->qlock);
@@ -1464,6 +1693,12 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 				tosctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "ignoreadvice") == 0)
 				c->ignoreadvice = 1;
+			else if (strcmp(cb->f[0], "busypoll") == 0)
+				busypollctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "batch") == 0)
+				batchctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "tls") == 0)
+				tlsctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "addmulti") == 0) {
 				if (cb->nf < 2)
 					error(EFAIL, "addmulti needs interface address");
@@ -1497,6 +1732,39 @@ static size_t ipwrite(struct chan *ch, void *v, size_t n, off64_t off)
 	return n;
 }
 
+static size_t ipwritev(struct chan *ch, struct iovec *iov, int iovcnt,
+                       off64_t offset)
+{
+	struct conv *c;
+	size_t sofar = 0, n;
+
+	switch (TYPE(ch->qid)) {
+		case Qdata:
+			c = chan2conv(ch);
+			if (c->tls_tx)
+				return tls_write(c, iov, iovcnt, ch->flag & O_NONBLOCK);
+			if (!c->batch) {
+				if (c->lport == 0)
+					autobind(c);
+				if (ch->flag & O_NONBLOCK)
+					qwritev_nonblock(c->wq, iov, iovcnt);
+				else
+					qwritev(c->wq, iov, iovcnt);
+				return iov_length(iov, iovcnt);
+			}
+			/* fall through */
+		default:
+			for (int i = 0; i < iovcnt; i++) {
+				n = ipwrite(ch, iov[i].iov_base, iov[i].iov_len,
+				            offset + sofar);
+				sofar += n;
+				if (n < iov[i].iov_len)
+					break;
+			}
+			return sofar;
+	}
+}
+
 static size_t ipbwrite(struct chan *ch, struct block *bp, off64_t offset)
 {
 	struct conv *c;
@@ -1505,6 +1773,10 @@ static size_t ipbwrite(struct chan *ch, struct block *bp, off64_t offset)
 	switch (TYPE(ch->qid)) {
 		case Qdata:
 			c = chan2conv(ch);
+			if (c->batch)
+				return devbwrite(ch, bp, offset);
+			if (c->tls_tx)
+				return tls_bwrite(c, bp, ch->flag & O_NONBLOCK);
 			if (bp->next)
 				bp = concatblock(bp);
 			n = BLEN(bp);
@@ -1666,6 +1938,8 @@ struct dev ipdevtab __devtab = {
 	.bread = ipbread,
 	.write = ipwrite,
 	.bwrite = ipbwrite,
+	.readv = ipreadv,
+	.writev = ipwritev,
 	.remove = devremove,
 	.wstat = ipwstat,
 	.power = devpower,
@@ -1693,6 +1967,11 @@ int Fsproto(struct Fs *f, struct Proto *p)
 	p->conv = kzmalloc(sizeof(struct conv *) * (p->nc + 1), 0);
 	if (p->conv == NULL)
 		panic("Fsproto");
+	p->conv_cache = kzmalloc_align(sizeof(struct conv_cache) * num_cores,
+	                               MEM_WAIT, ARCH_CL_SIZE);
+	if (p->maxnc < p->nc)
+		p->maxnc = p->nc;
+	assert(p->maxnc <= Maxconv);
 
 	p->x = f->np;
 	p->nextport = 0;
@@ -1711,67 +1990,80 @@ int Fsbuiltinproto(struct Fs *f, uint8_t proto)
 	return f->t2p[proto] != NULL;
 }
 
-/*
- *  called with protocol locked
- */
-struct conv *Fsprotoclone(struct Proto *p, char *user)
+/* Makes conv x of p, returning it qlocked.  Called with p locked. */
+static struct conv *Fsprotonewconv(struct Proto *p, int x)
 {
-	struct conv *c, **pp, **ep;
-
-retry:
-	c = NULL;
-	ep = &p->conv[p->nc];
-	for (pp = p->conv; pp < ep; pp++) {
-		c = *pp;
-		if (c == NULL) {
-			c = kzmalloc(sizeof(struct conv), 0);
-			if (c == NULL)
-				error(ENOMEM,
-				      "conv kzmalloc(%d, 0) failed in Fsprotoclone",
-				      sizeof(struct conv));
-			qlock_init(&c->qlock);
-			qlock_init(&c->listenq);
-			rendez_init(&c->cr);
-			rendez_init(&c->listenr);
-			SLIST_INIT(&c->data_taps);	/* already = 0; set to be futureproof */
-			SLIST_INIT(&c->listen_taps);
-			spinlock_init(&c->tap_lock);
-			qlock(&c->qlock);
-			c->p = p;
-			c->x = pp - p->conv;
-			if (p->ptclsize != 0) {
-				c->ptcl = kzmalloc(p->ptclsize, 0);
-				if (c->ptcl == NULL) {
-					kfree(c);
-					error(ENOMEM,
-					      "ptcl kzmalloc(%d, 0) failed in Fsprotoclone",
-					      p->ptclsize);
-				}
-			}
-			*pp = c;
-			p->ac++;
-			c->eq = qopen(1024, Qmsg, 0, 0);
-			(*p->create) (c);
-			assert(c->rq && c->wq);
-			break;
-		}
-		if (canqlock(&c->qlock)) {
-			/*
-			 *  make sure both processes and protocol
-			 *  are done with this Conv
-			 */
-			if (c->inuse == 0 && (p->inuse == NULL || (*p->inuse) (c) == 0))
-				break;
+	struct conv *c;
 
-			qunlock(&c->qlock);
+	c = kzmalloc(sizeof(struct conv), 0);
+	if (c == NULL)
+		error(ENOMEM, "conv kzmalloc(%d, 0) failed in Fsprotoclone",
+		      sizeof(struct conv));
+	qlock_init(&c->qlock);
+	qlock_init(&c->listenq);
+	rendez_init(&c->cr);
+	rendez_init(&c->listenr);
+	SLIST_INIT(&c->data_taps);	/* already = 0; set to be futureproof */
+	SLIST_INIT(&c->listen_taps);
+	spinlock_init(&c->tap_lock);
+	qlock(&c->qlock);
+	c->p = p;
+	c->x = x;
+	if (p->ptclsize != 0) {
+		c->ptcl = kzmalloc(p->ptclsize, 0);
+		if (c->ptcl == NULL) {
+			kfree(c);
+			error(ENOMEM, "ptcl kzmalloc(%d, 0) failed in Fsprotoclone",
+			      p->ptclsize);
 		}
 	}
-	if (pp >= ep) {
-		if (p->gc != NULL && (*p->gc) (p))
-			goto retry;
-		return NULL;
-	}
+	p->conv[x] = c;
+	p->ac++;
+	c->eq = qopen(1024, Qmsg, 0, 0);
+	(*p->create) (c);
+	assert(c->rq && c->wq);
+	return c;
+}
+
+/* Returns TRUE if c is free, with c qlocked. */
+static bool Fsprotoconvfree(struct Proto *p, struct conv *c)
+{
+	if (!canqlock(&c->qlock))
+		return FALSE;
+	/*
+	 *  make sure both processes and protocol
+	 *  are done with this Conv
+	 */
+	if (c->inuse == 0 && (p->inuse == NULL || (*p->inuse) (c) == 0))
+		return TRUE;
+	qunlock(&c->qlock);
+	return FALSE;
+}
 
+/* Doubles p's conv array, up to maxnc.  Lockless readers (proto_conv()) might
+ * still be looking at the old array, so we wait out RCU before freeing it.
+ * Called with p locked. */
+static bool Fsprotogrow(struct Proto *p)
+{
+	struct conv **old = p->conv, **new;
+	int nc;
+
+	if (p->nc >= p->maxnc)
+		return FALSE;
+	nc = MIN(p->nc * 2, p->maxnc);
+	new = kzmalloc(sizeof(struct conv *) * (nc + 1), MEM_WAIT);
+	memcpy(new, old, sizeof(struct conv *) * p->nc);
+	rcu_assign_pointer(p->conv, new);
+	wmb();	/* the array is visible before the new nc */
+	p->nc = nc;
+	synchronize_rcu();
+	kfree(old);
+	return TRUE;
+}
+
+/* Resets c, which is free and qlocked, for user, and unlocks it. */
+static void Fsprotoclaim(struct conv *c, char *user)
+{
 	c->inuse = 1;
 	kstrdup(&c->owner, user);
 	c->perm = 0660;
@@ -1785,11 +2077,101 @@ retry:
 	c->restricted = 0;
 	c->ttl = MAXTTL;
 	c->tos = DFLTTOS;
+	c->busypoll_usec = 0;
+	c->batch = FALSE;
 	qreopen(c->rq);
 	qreopen(c->wq);
 	qreopen(c->eq);
 
 	qunlock(&c->qlock);
+}
+
+/* Tells Fsprotoclonecached() that c just became free on this core.  Call it
+ * when the last user closes c, or when c's proto is done with it, whichever is
+ * later.  It's fine to call it more than once, and from any context that can
+ * take a spinlock. */
+void Fsconvfree(struct conv *c)
+{
+	struct conv_cache *cc;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	cc = &c->p->conv_cache[core_id()];
+	/* If we're full, Fsprotoclone() will find it. */
+	if (cc->nr < Convcache)
+		cc->convs[cc->nr++] = c;
+	enable_irqsave(&irq_state);
+}
+
+/* Clones a conv from this core's cache without the proto qlock, or returns
+ * NULL.  The cache's convs could have been reused since they were freed, so we
+ * check them like Fsprotoclone() does: the conv qlock is what settles who gets
+ * a conv, not the proto qlock. */
+struct conv *Fsprotoclonecached(struct Proto *p, char *user)
+{
+	struct conv_cache *cc;
+	struct conv *c = NULL;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	cc = &p->conv_cache[core_id()];
+	while (cc->nr) {
+		c = cc->convs[--cc->nr];
+		if (Fsprotoconvfree(p, c))
+			break;
+		c = NULL;
+	}
+	enable_irqsave(&irq_state);
+	if (c)
+		Fsprotoclaim(c, user);
+	return c;
+}
+
+/*
+ *  called with protocol locked
+ *
+ *  We try this core's free convs, then look for a free conv near the last one
+ *  we handed out, then make a new one (growing the array if needed), and only
+ *  scan all of them once we're at maxnc.  That keeps clones cheap with tens of
+ *  thousands of convs.
+ */
+struct conv *Fsprotoclone(struct Proto *p, char *user)
+{
+	struct conv *c;
+	int x, nr_scan;
+
+	c = Fsprotoclonecached(p, user);
+	if (c)
+		return c;
+retry:
+	c = NULL;
+	nr_scan = MIN(p->ac, Clonescan);
+	for (int i = 0; i < nr_scan; i++) {
+		x = (p->nextconv + i) % p->ac;
+		if (Fsprotoconvfree(p, p->conv[x])) {
+			c = p->conv[x];
+			break;
+		}
+	}
+	if (!c && p->ac == p->nc)
+		Fsprotogrow(p);
+	if (!c && p->ac < p->nc) {
+		x = p->ac;
+		c = Fsprotonewconv(p, x);
+	}
+	for (x = 0; !c && x < p->ac; x++) {
+		if (Fsprotoconvfree(p, p->conv[x])) {
+			c = p->conv[x];
+			break;
+		}
+	}
+	if (!c) {
+		if (p->gc != NULL && (*p->gc) (p))
+			goto retry;
+		return NULL;
+	}
+	p->nextconv = x + 1;
+	Fsprotoclaim(c, user);
 	return c;
 }
 
@@ -1840,39 +2222,40 @@ static void fire_listener_taps(struct conv *conv)
 
 /*
  *  called with protocol locked
+ *
+ *  The accept queue is two lists, so we don't need the listener's qlock, which
+ *  its owner can hold for a while.  We push new calls on incall_new with a CAS.
+ *  The one dequeuer (conv_pop_incall()) takes the whole list when its own runs
+ *  dry and flips it, so calls still come out in order.
  */
 struct conv *Fsnewcall(struct conv *c, uint8_t * raddr, uint16_t rport,
 					   uint8_t * laddr, uint16_t lport, uint8_t version)
 {
-	struct conv *nc;
-	struct conv **l;
-	int i;
+	struct conv *nc, *old;
 
-	qlock(&c->qlock);
-	i = 0;
-	for (l = &c->incall; *l; l = &(*l)->next)
-		i++;
-	if (i >= Maxincall) {
-		qunlock(&c->qlock);
+	if (atomic_fetch_and_add(&c->nr_incall, 1) >= Maxincall) {
+		atomic_dec(&c->nr_incall);
 		return NULL;
 	}
 
 	/* find a free conversation */
 	nc = Fsprotoclone(c->p, network);
 	if (nc == NULL) {
-		qunlock(&c->qlock);
+		atomic_dec(&c->nr_incall);
 		return NULL;
 	}
 	ipmove(nc->raddr, raddr);
 	nc->rport = rport;
 	ipmove(nc->laddr, laddr);
 	nc->lport = lport;
-	nc->next = NULL;
-	*l = nc;
 	nc->state = Connected;
 	nc->ipversion = version;
-
-	qunlock(&c->qlock);
+	/* Servers set busypoll once, on the listener */
+	nc->busypoll_usec = c->busypoll_usec;
+	do {
+		old = READ_ONCE(c->incall_new);
+		nc->next = old;
+	} while (!atomic_cas_ptr((void**)&c->incall_new, old, nc));
 
 	rendez_wakeup(&c->listenr);
 	fire_listener_taps(c);
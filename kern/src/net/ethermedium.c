@@ -54,8 +54,8 @@ static uint8_t ipbroadcast[IPaddrlen] = {
 
 static uint8_t etherbroadcast[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
 
-static void etherread4(void *a);
-static void etherread6(void *a);
+static void etherread(void *a);
+static void etherdeliver(void *arg, struct block *bp);
 static void etherbind(struct Ipifc *ifc, int argc, char **argv);
 static void etherunbind(struct Ipifc *ifc);
 static void etherbwrite(struct Ipifc *ifc, struct block *bp, int version,
@@ -70,6 +70,7 @@ static int multicastea(uint8_t * ea, uint8_t * ip);
 static void recvarpproc(void *);
 static void resolveaddr6(struct Ipifc *ifc, struct arpent *a);
 static void etherpref2addr(uint8_t * pref, uint8_t * ea);
+static int etherbusypoll(struct Ipifc *ifc, int budget);
 
 struct medium ethermedium = {
 	.name = "ether",
@@ -85,6 +86,8 @@ struct medium ethermedium = {
 	.ares = arpenter,
 	.areg = sendgarp,
 	.pref2addr = etherpref2addr,
+	.poll = etherbusypoll,
+	.gso = 1,
 };
 
 struct medium trexmedium = {
@@ -101,19 +104,51 @@ struct medium trexmedium = {
 	.ares = arpenter,
 	.areg = sendgarp,
 	.pref2addr = etherpref2addr,
+	.poll = etherbusypoll,
+	.gso = 1,
+};
+
+enum {
+	Maxrxq = 16,				/* v4 rx queues per interface */
+	Rxbudget = 64,				/* packets per GRO batch */
+};
+
+/* One reader per v4 rx queue, and one for v6.  With more than one v4 queue,
+ * they are an rx queue group in devether, which splits the flows among them
+ * (etheriq()), and each reader does its flows' IP and TCP input on its own
+ * core.
+ *
+ * The reader sleeps on mchan for the first packet of a batch, then drains the
+ * rest through nbchan, a nonblocking chan on the same data file, running it
+ * all through GRO.  Held segments are flushed when the queue is empty or the
+ * batch hits its budget, so GRO never delays a packet waiting for more.
+ *
+ * Busy pollers (etherbusypoll()) also drain the queues, on their own cores.  The
+ * qlock keeps a queue's batches, and its GRO state, to one core at a time. */
+typedef struct Etherrxq Etherrxq;
+struct Etherrxq {
+	struct Ipifc *ifc;
+	struct proc *readp;			/* reading process */
+	struct chan *mchan;			/* Data channel for this queue */
+	struct chan *cchan;			/* Control channel for this queue */
+	struct chan *nbchan;		/* Nonblocking data channel */
+	int core;					/* reader's home core, or -1 */
+	qlock_t qlock;				/* processing the queue */
+	struct gro gro;
 };
 
 typedef struct Etherrock Etherrock;
 struct Etherrock {
 	struct Fs *f;				/* file system we belong to */
 	struct proc *arpp;			/* arp process */
-	struct proc *read4p;		/* reading process (v4) */
-	struct proc *read6p;		/* reading process (v6) */
-	struct chan *mchan4;		/* Data channel for v4 */
+	struct chan *mchan4;		/* Data channel for v4 (rxq4[0]'s) */
 	struct chan *achan;			/* Arp channel */
 	struct chan *cchan4;		/* Control channel for v4 */
 	struct chan *mchan6;		/* Data channel for v6 */
 	struct chan *cchan6;		/* Control channel for v6 */
+	int nrxq4;
+	Etherrxq rxq4[Maxrxq];
+	Etherrxq rxq6;
 };
 
 /*
@@ -168,24 +203,73 @@ static unsigned int parsefeat(char *ptr)
 	return feat;
 }
 
+/* Opens a nonblocking chan on the data file of the conversation in dir. */
+static struct chan *etheropennb(char *dir)
+{
+	char path[Maxpath];
+	struct chan *c;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/data", dir);
+	fd = sysopen(path, O_READ | O_NONBLOCK);
+	if (fd < 0)
+		error(EFAIL, "can't open %s: %s", path, get_cur_errbuf());
+	c = commonfdtochan(fd, O_READ, 0, 1);
+	sysclose(fd);
+	return c;
+}
+
+/* Dials v4 rx queue idx (of nrxq) as a member of an rx queue group, returning
+ * the data chan and the control chan in cchan. */
+static struct chan *etherdialrxq(char *dev, int idx, int nrxq, char *dir,
+                                 struct chan **cchan)
+{
+	char addr[KNAMELEN * 2], local[32];
+	struct chan *mchan;
+	int fd, cfd;
+
+	snprintf(addr, sizeof(addr), "%s!0x800", dev);
+	snprintf(local, sizeof(local), "rxq %d %d", idx, nrxq);
+	fd = kdial(addr, local, dir, &cfd);
+	if (fd < 0)
+		error(EFAIL, "dial 0x800 rxq %d failed: %s", idx, get_cur_errbuf());
+	mchan = commonfdtochan(fd, O_RDWR, 0, 1);
+	*cchan = commonfdtochan(cfd, O_RDWR, 0, 1);
+	sysclose(fd);
+	sysclose(cfd);
+	devtab[(*cchan)->type].write(*cchan, nbmsg, strlen(nbmsg), 0);
+	return mchan;
+}
+
 /*
  *  called to bind an IP ifc to an ethernet device
  *  called with ifc wlock'd
+ *
+ *  bind ether <dev> [nrxq]: nrxq v4 rx queues, each with its own reader.
  */
 static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 {
 	ERRSTACK(1);
 	struct chan *mchan4, *cchan4, *achan, *mchan6, *cchan6;
 	char *addr, *dir, *buf;
-	int fd, cfd, n;
+	int fd, cfd, n, nrxq;
 	char *ptr;
 	Etherrock *er;
+	Etherrxq *rxq;
 
 	if (argc < 2)
 		error(EINVAL, ERROR_FIXME);
+	nrxq = 1;
+	if (argc > 3) {
+		nrxq = strtol(argv[3], 0, 0);
+		if (nrxq < 1 || nrxq > Maxrxq)
+			error(EINVAL, "bad number of rx queues %s (max %d)", argv[3],
+			      Maxrxq);
+	}
 
 	addr = kmalloc(Maxpath, MEM_WAIT);	//char addr[2*KNAMELEN];
 	dir = kmalloc(Maxpath, MEM_WAIT);	//char addr[2*KNAMELEN];
+	er = kzmalloc(sizeof(*er), MEM_WAIT);
 	mchan4 = cchan4 = achan = mchan6 = cchan6 = NULL;
 	buf = NULL;
 	if (waserror()) {
@@ -199,8 +283,21 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 			cclose(mchan6);
 		if (cchan6 != NULL)
 			cclose(cchan6);
+		for (int i = 0; i < nrxq; i++) {
+			if (er->rxq4[i].nbchan)
+				cclose(er->rxq4[i].nbchan);
+			if (i == 0)
+				continue;
+			if (er->rxq4[i].mchan)
+				cclose(er->rxq4[i].mchan);
+			if (er->rxq4[i].cchan)
+				cclose(er->rxq4[i].cchan);
+		}
+		if (er->rxq6.nbchan)
+			cclose(er->rxq6.nbchan);
 		if (buf != NULL)
 			kfree(buf);
+		kfree(er);
 		kfree(addr);
 		kfree(dir);
 		nexterror();
@@ -211,20 +308,33 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	 *
 	 *  the dial will fail if the type is already open on
 	 *  this device.
+	 *
+	 *  with rx queues, queue 0 is the main v4 conversation, which we also use
+	 *  for output.
 	 */
-	snprintf(addr, Maxpath, "%s!0x800", argv[2]);
-	fd = kdial(addr, NULL, dir, &cfd);
-	if (fd < 0)
-		error(EFAIL, "dial 0x800 failed: %s", get_cur_errbuf());
-	mchan4 = commonfdtochan(fd, O_RDWR, 0, 1);
-	cchan4 = commonfdtochan(cfd, O_RDWR, 0, 1);
-	sysclose(fd);
-	sysclose(cfd);
-
-	/*
-	 *  make it non-blocking
-	 */
-	devtab[cchan4->type].write(cchan4, nbmsg, strlen(nbmsg), 0);
+	if (nrxq > 1) {
+		mchan4 = etherdialrxq(argv[2], 0, nrxq, dir, &cchan4);
+	} else {
+		snprintf(addr, Maxpath, "%s!0x800", argv[2]);
+		fd = kdial(addr, NULL, dir, &cfd);
+		if (fd < 0)
+			error(EFAIL, "dial 0x800 failed: %s", get_cur_errbuf());
+		mchan4 = commonfdtochan(fd, O_RDWR, 0, 1);
+		cchan4 = commonfdtochan(cfd, O_RDWR, 0, 1);
+		sysclose(fd);
+		sysclose(cfd);
+
+		/*
+		 *  make it non-blocking
+		 */
+		devtab[cchan4->type].write(cchan4, nbmsg, strlen(nbmsg), 0);
+	}
+	er->rxq4[0].nbchan = etheropennb(dir);
+	for (int i = 1; i < nrxq; i++) {
+		er->rxq4[i].mchan = etherdialrxq(argv[2], i, nrxq, addr,
+		                                 &er->rxq4[i].cchan);
+		er->rxq4[i].nbchan = etheropennb(addr);
+	}
 
 	/*
 	 *  get mac address and speed
@@ -283,14 +393,32 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	 *  make it non-blocking
 	 */
 	devtab[cchan6->type].write(cchan6, nbmsg, strlen(nbmsg), 0);
+	er->rxq6.nbchan = etheropennb(dir);
 
-	er = kzmalloc(sizeof(*er), 0);
 	er->mchan4 = mchan4;
 	er->cchan4 = cchan4;
 	er->achan = achan;
 	er->mchan6 = mchan6;
 	er->cchan6 = cchan6;
 	er->f = ifc->conv->p->f;
+	er->nrxq4 = nrxq;
+	er->rxq4[0].mchan = mchan4;
+	er->rxq4[0].cchan = cchan4;
+	for (int i = 0; i < nrxq; i++) {
+		rxq = &er->rxq4[i];
+		rxq->ifc = ifc;
+		/* Queue 0 runs wherever it is woken, like a lone reader. */
+		rxq->core = i ? i % num_cores : -1;
+		qlock_init(&rxq->qlock);
+		gro_init(&rxq->gro, er->f, ifc, etherdeliver, rxq);
+	}
+	rxq = &er->rxq6;
+	rxq->ifc = ifc;
+	rxq->mchan = mchan6;
+	rxq->cchan = cchan6;
+	rxq->core = -1;
+	qlock_init(&rxq->qlock);
+	gro_init(&rxq->gro, er->f, ifc, etherdeliver, rxq);
 	ifc->arg = er;
 
 	kfree(buf);
@@ -298,9 +426,10 @@ static void etherbind(struct Ipifc *ifc, int argc, char **argv)
 	kfree(dir);
 	poperror();
 
-	ktask("etherread4", etherread4, ifc);
+	for (int i = 0; i < nrxq; i++)
+		ktask("etherread4", etherread, &er->rxq4[i]);
 	ktask("recvarpproc", recvarpproc, ifc);
-	ktask("etherread6", etherread6, ifc);
+	ktask("etherread6", etherread, &er->rxq6);
 }
 
 /*
@@ -313,19 +442,30 @@ static void etherunbind(struct Ipifc *ifc)
 
 	// we'll need to tell the ktasks to exit, maybe via flags and a wakeup
 #if 0
-	if (er->read4p)
-		postnote(er->read4p, 1, "unbind", 0);
-	if (er->read6p)
-		postnote(er->read6p, 1, "unbind", 0);
+	for (int i = 0; i < er->nrxq4; i++)
+		postnote(er->rxq4[i].readp, 1, "unbind", 0);
+	if (er->rxq6.readp)
+		postnote(er->rxq6.readp, 1, "unbind", 0);
 	if (er->arpp)
 		postnote(er->arpp, 1, "unbind", 0);
 #endif
 
 	/* wait for readers to die */
-	while (er->arpp != 0 || er->read4p != 0 || er->read6p != 0)
+	for (int i = 0; i < er->nrxq4; i++)
+		while (er->rxq4[i].readp != 0)
+			cpu_relax();
+	while (er->arpp != 0 || er->rxq6.readp != 0)
 		cpu_relax();
 	kthread_usleep(300 * 1000);
 
+	for (int i = 0; i < er->nrxq4; i++) {
+		cclose(er->rxq4[i].nbchan);
+		if (i == 0)
+			continue;
+		cclose(er->rxq4[i].mchan);
+		cclose(er->rxq4[i].cchan);
+	}
+	cclose(er->rxq6.nbchan);
 	if (er->mchan4 != NULL)
 		cclose(er->mchan4);
 	if (er->achan != NULL)
@@ -353,6 +493,35 @@ static inline void etherfilladdr(uint16_t *pkt, uint16_t *dst, uint16_t *src)
 	*pkt = *src;
 }
 
+/*
+ *  segments a TSO block for a device that can't, and writes the pieces.  all
+ *  but the last say more are coming, so the device gets one kick for the lot.
+ */
+static void ethergso(struct Ipifc *ifc, struct block *bp, int version,
+                     uint8_t *ip)
+{
+	ERRSTACK(1);
+	struct block *segs, *nb;
+
+	segs = gso_segment(bp);
+	if (waserror()) {
+		for (; segs; segs = nb) {
+			nb = segs->list;
+			freeblist(segs);
+		}
+		nexterror();
+	}
+	while (segs) {
+		bp = segs;
+		segs = bp->list;
+		bp->list = NULL;
+		if (segs)
+			bp->flag |= Bxmore;
+		etherbwrite(ifc, bp, version, ip);
+	}
+	poperror();
+}
+
 /*
  *  called by ipoput with a single block to write with ifc rlock'd
  */
@@ -363,8 +532,17 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 	struct arpent *a;
 	uint8_t mac[6];
 	Etherrock *er = ifc->arg;
+	int more;
 
+	if ((bp->flag & Btso) && !(ifc->feat & NETF_TSO)) {
+		ethergso(ifc, bp, version, ip);
+		return;
+	}
 	ipifc_trace_block(ifc, bp);
+	/* a block held for arp goes out on its own later, with no one behind it
+	 * to kick the device. */
+	more = bp->flag & Bxmore;
+	bp->flag &= ~Bxmore;
 	/* get mac address of destination.
 	 *
 	 * Locking is tricky here.  If we get arpent 'a' back, the f->arp is
@@ -388,6 +566,8 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 			}
 			return;
 		}
+		/* might not be our bp */
+		more = 0;
 	}
 
 	/* make it a single block with space for the ether header */
@@ -398,6 +578,7 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 
 	/* copy in mac addresses and ether type */
 	etherfilladdr((uint16_t *)bp->rp, (uint16_t *)mac, (uint16_t *)ifc->mac);
+	bp->flag |= more;
 
 	switch (version) {
 		case V4:
@@ -417,89 +598,142 @@ etherbwrite(struct Ipifc *ifc, struct block *bp, int version, uint8_t * ip)
 }
 
 /*
- *  process to read from the ethernet
+ *  GRO's output: hands an IP packet to IP (ipiput4() passes v6 on)
  */
-static void etherread4(void *a)
+static void etherdeliver(void *arg, struct block *bp)
 {
-	ERRSTACK(2);
-	struct Ipifc *ifc;
-	struct block *bp;
-	Etherrock *er;
+	ERRSTACK(1);
+	Etherrxq *rxq = arg;
+	struct Ipifc *ifc = rxq->ifc;
+	Etherrock *er = ifc->arg;
 
-	ifc = a;
-	er = ifc->arg;
-	er->read4p = current;	/* hide identity under a rock for unbind */
-	if (waserror()) {
-		er->read4p = 0;
-		poperror();
-		warn("etherread4 returns, probably unexpectedly\n");
+	if (!br_canrlock(&ifc->rwlock)) {
+		freeb(bp);
 		return;
 	}
-	for (;;) {
-		bp = devtab[er->mchan4->type].bread(er->mchan4, 128 * 1024, 0);
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(er->f, ifc, bp);
-		}
-		runlock(&ifc->rwlock);
+	if (waserror()) {
+		br_runlock(&ifc->rwlock);
+		nexterror();
+	}
+	if (ifc->lifc == NULL)
+		freeb(bp);
+	else
+		ipiput4(er->f, ifc, bp);
+	br_runlock(&ifc->rwlock);
+	poperror();
+}
+
+/* Reads the next packet on the queue without blocking, or returns NULL. */
+static struct block *etherread_nb(Etherrxq *rxq)
+{
+	ERRSTACK(1);
+	struct block *bp;
+
+	if (waserror()) {
 		poperror();
+		return NULL;
 	}
+	bp = devtab[rxq->nbchan->type].bread(rxq->nbchan, 128 * 1024, 0);
 	poperror();
+	return bp;
+}
+
+/* Strips the ether header off bp and runs it through GRO. */
+static void etherrecv(Etherrxq *rxq, struct block *bp)
+{
+	struct Ipifc *ifc = rxq->ifc;
+
+	ifc->in++;
+	bp->rp += ifc->m->hsize;
+	ipifc_trace_block(ifc, bp);
+	gro_receive(&rxq->gro, bp);
 }
 
 /*
- *  process to read from the ethernet, IPv6
+ *  process to read from the ethernet, one per rx queue
  */
-static void etherread6(void *a)
+static void etherread(void *a)
 {
 	ERRSTACK(2);
-	struct Ipifc *ifc;
 	struct block *bp;
-	Etherrock *er;
+	Etherrxq *rxq;
 
-	ifc = a;
-	er = ifc->arg;
-	er->read6p = current;	/* hide identity under a rock for unbind */
+	rxq = a;
+	rxq->readp = current;	/* hide identity under a rock for unbind */
 	if (waserror()) {
-		er->read6p = 0;
-		warn("etherread6 returns, probably unexpectedly\n");
+		rxq->readp = 0;
 		poperror();
+		warn("etherread returns, probably unexpectedly\n");
 		return;
 	}
+	if (rxq->core >= 0)
+		kthread_set_home_core(rxq->core);
 	for (;;) {
-		bp = devtab[er->mchan6->type].bread(er->mchan6, ifc->maxtu, 0);
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
-		ifc->in++;
-		bp->rp += ifc->m->hsize;
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput6(er->f, ifc, bp);
+		bp = devtab[rxq->mchan->type].bread(rxq->mchan, 128 * 1024, 0);
+		qlock(&rxq->qlock);
+		etherrecv(rxq, bp);
+		for (int i = 1; i < Rxbudget; i++) {
+			bp = etherread_nb(rxq);
+			if (!bp)
+				break;
+			etherrecv(rxq, bp);
 		}
-		runlock(&ifc->rwlock);
+		gro_flush(&rxq->gro);
+		qunlock(&rxq->qlock);
+	}
+	poperror();
+}
+
+/* Drains up to budget packets off rxq, if no one else is.  Returns the number
+ * of packets. */
+static int etherpollrxq(Etherrxq *rxq, int budget)
+{
+	ERRSTACK(1);
+	struct block *bp;
+	int n;
+
+	if (!canqlock(&rxq->qlock))
+		return 0;
+	if (waserror()) {
+		qunlock(&rxq->qlock);
+		nexterror();
+	}
+	for (n = 0; n < budget; n++) {
+		bp = etherread_nb(rxq);
+		if (!bp)
+			break;
+		etherrecv(rxq, bp);
+	}
+	gro_flush(&rxq->gro);
+	qunlock(&rxq->qlock);
+	poperror();
+	return n;
+}
+
+/*
+ *  busy poll: pull packets off the device's rx ring into our queues, then
+ *  run the queues through IP on the caller's core, instead of waiting for the
+ *  readers.  Called with ifc rlocked.
+ */
+static int etherbusypoll(struct Ipifc *ifc, int budget)
+{
+	ERRSTACK(1);
+	Etherrock *er = ifc->arg;
+	int n = 0;
+
+	/* Devices that can't be polled still fill our queues from their IRQs */
+	etherpoll(er->mchan4, budget);
+	/* Protocol input errors are the packet's problem, not the poller's */
+	if (waserror()) {
 		poperror();
+		return n;
 	}
+	for (int i = 0; i < er->nrxq4 && n < budget; i++)
+		n += etherpollrxq(&er->rxq4[i], budget - n);
+	if (n < budget)
+		n += etherpollrxq(&er->rxq6, budget - n);
 	poperror();
+	return n;
 }
 
 static void etheraddmulti(struct Ipifc *ifc, uint8_t * a, uint8_t * unused)
@@ -0,0 +1,334 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Generic receive offload: merges consecutive, in-order TCP segments of
+ * the same flow, over v4 or v6, into one large datagram (a block chain), so that IP and TCP
+ * input run once for the lot instead of once per MSS.
+ *
+ * A medium's reader passes every received IP packet to gro_receive().  Packets
+ * we can merge are held, per flow, until gro_flush(), which the reader calls
+ * once it has drained its queue (or hit its budget).  Everything else is
+ * delivered right away, after flushing the packet's flow, if held, so that a
+ * flow's packets are always delivered in order.
+ *
+ * We only merge the simple, common case, similar to Linux's rules:
+ * - A plain 20 byte IP header, not a fragment, or a 40 byte v6 header with no
+ *   extension headers, and for us (no forwarding).
+ * - Only ACK and PSH are set, there is payload, and the IP and TCP headers
+ *   are in the block's main body.
+ * - The NIC checked the TCP checksum (Btcpck).  The merged datagram's
+ *   checksum is meaningless; TCP trusts the flag.  Without it, segments pass
+ *   through.
+ * - The segment follows the held ones: same addresses, ports, TOS and TTL (v6:
+ *   traffic class, flow label and hop limit), ACK and TCP options, and its seq is the next one.  It can't be bigger than the
+ *   first segment.  A smaller one or a PSH ends the datagram.
+ *
+ * The merged datagram is the first segment's block, with the IP length and
+ * checksum (v6: payload length) fixed up, followed by the other segments' payloads. */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <net/ip.h>
+
+enum {
+	GRO_IP_HLEN = 20,
+	GRO_IP6_HLEN = 40,
+	GRO_TCP_HLEN = 20,
+	GRO_TCPPROTO = 6,
+	GRO_MAX_IP_LEN = 0xffff,
+	GRO_MAX_SEGS = 64,
+
+	GRO_TCP_PSH = 0x08,
+	GRO_TCP_ACK = 0x10,
+};
+
+/* Offsets into the IP and TCP headers */
+#define IPH_TOS(ip)		((ip)[1])
+#define IPH_LEN(ip)		((ip) + 2)
+#define IPH_FRAG(ip)	((ip) + 6)
+#define IPH_TTL(ip)		((ip)[8])
+#define IPH_PROTO(ip)	((ip)[9])
+#define IPH_CKSUM(ip)	((ip) + 10)
+#define IPH_ADDRS(ip)	((ip) + 12)		/* src and dst, 8 bytes */
+#define IP6H_PLEN(ip)	((ip) + 4)
+#define IP6H_NH(ip)		((ip)[6])
+#define IP6H_HOP(ip)	((ip)[7])
+#define IP6H_ADDRS(ip)	((ip) + 8)		/* src and dst, 32 bytes */
+#define IP6H_DST(ip)	((ip) + 24)
+#define TCPH_SEQ(th)	((th) + 4)
+#define TCPH_ACK(th)	((th) + 8)
+#define TCPH_HLEN(th)	(((th)[12] >> 4) << 2)
+#define TCPH_FLAGS(th)	((th)[13])
+#define TCPH_WIN(th)	((th) + 14)
+
+struct gro_seg {
+	uint8_t						*ip;
+	uint8_t						*th;
+	unsigned int				ip_hlen;
+	unsigned int				hlen;		/* IP + TCP */
+	unsigned int				ip_len;
+	unsigned int				payload;
+	uint32_t					seq;
+	bool						mergeable;
+};
+
+void gro_init(struct gro *g, struct Fs *f, struct Ipifc *ifc,
+              void (*deliver)(void *arg, struct block *bp), void *arg)
+{
+	memset(g, 0, sizeof(struct gro));
+	g->f = f;
+	g->ifc = ifc;
+	g->deliver = deliver;
+	g->arg = arg;
+}
+
+/* Held flows and segments are either v4 or v6; the header tells. */
+static bool gro_is_v6(uint8_t *ip)
+{
+	return (ip[0] >> 4) == 6;
+}
+
+static unsigned int gro_ip_hlen(uint8_t *ip)
+{
+	return gro_is_v6(ip) ? GRO_IP6_HLEN : GRO_IP_HLEN;
+}
+
+/* Parses bp's IP header.  Returns FALSE if it isn't a plain TCP datagram. */
+static bool gro_parse_ip(struct block *bp, struct gro_seg *s)
+{
+	uint8_t *ip = bp->rp;
+
+	if (bp->next || BHLEN(bp) < GRO_IP_HLEN + GRO_TCP_HLEN)
+		return FALSE;
+	if (gro_is_v6(ip)) {
+		if (BHLEN(bp) < GRO_IP6_HLEN + GRO_TCP_HLEN)
+			return FALSE;
+		if (IP6H_NH(ip) != GRO_TCPPROTO)
+			return FALSE;
+		s->ip_hlen = GRO_IP6_HLEN;
+		s->ip_len = GRO_IP6_HLEN + nhgets(IP6H_PLEN(ip));
+		return TRUE;
+	}
+	if (ip[0] != (IP_VER4 | (GRO_IP_HLEN >> 2)))
+		return FALSE;
+	if (IPH_PROTO(ip) != GRO_TCPPROTO)
+		return FALSE;
+	/* MF, or any fragment offset */
+	if (nhgets(IPH_FRAG(ip)) & 0x3fff)
+		return FALSE;
+	s->ip_hlen = GRO_IP_HLEN;
+	s->ip_len = nhgets(IPH_LEN(ip));
+	return TRUE;
+}
+
+/* Whether the datagram at ip is addressed to us. */
+static bool gro_for_me(struct gro *g, uint8_t *ip)
+{
+	uint8_t v6dst[IPaddrlen];
+
+	if (gro_is_v6(ip))
+		return ipforme(g->f, IP6H_DST(ip));
+	v4tov6(v6dst, ip + 16);
+	return ipforme(g->f, v6dst);
+}
+
+/* Parses bp as a TCP segment.  Returns FALSE if it isn't one we can even
+ * associate with a flow. */
+static bool gro_parse(struct gro *g, struct block *bp, struct gro_seg *s)
+{
+	uint8_t *ip = bp->rp;
+	unsigned int thlen;
+
+	if (!gro_parse_ip(bp, s))
+		return FALSE;
+	s->ip = ip;
+	s->th = ip + s->ip_hlen;
+	thlen = TCPH_HLEN(s->th);
+	if (thlen < GRO_TCP_HLEN || s->ip_hlen + thlen > BHLEN(bp))
+		return FALSE;
+	s->hlen = s->ip_hlen + thlen;
+	s->seq = nhgetl(TCPH_SEQ(s->th));
+	s->mergeable = FALSE;
+	s->payload = 0;
+	/* Ether pads short frames, so the block can be longer than the datagram.
+	 * Those are never worth merging. */
+	if (s->ip_len != BLEN(bp) || s->ip_len <= s->hlen)
+		return TRUE;
+	s->payload = s->ip_len - s->hlen;
+	if ((TCPH_FLAGS(s->th) & ~GRO_TCP_PSH) != GRO_TCP_ACK)
+		return TRUE;
+	if (!(bp->flag & Btcpck))
+		return TRUE;
+	if (!gro_for_me(g, ip))
+		return TRUE;
+	s->mergeable = TRUE;
+	return TRUE;
+}
+
+/* Whether s is in the same flow as fl's held segments. */
+static bool gro_same_flow(struct gro_flow *fl, struct gro_seg *s)
+{
+	uint8_t *ip = fl->head->rp;
+	uint8_t *th = ip + gro_ip_hlen(ip);
+
+	if (gro_ip_hlen(ip) != s->ip_hlen)
+		return FALSE;
+	if (s->ip_hlen == GRO_IP6_HLEN) {
+		if (memcmp(IP6H_ADDRS(ip), IP6H_ADDRS(s->ip), 2 * IPaddrlen))
+			return FALSE;
+	} else {
+		if (memcmp(IPH_ADDRS(ip), IPH_ADDRS(s->ip), 8))
+			return FALSE;
+	}
+	return !memcmp(th, s->th, 4);
+}
+
+/* Whether s can be appended to fl.  They are in the same flow. */
+static bool gro_can_merge(struct gro_flow *fl, struct gro_seg *s)
+{
+	uint8_t *ip = fl->head->rp;
+	uint8_t *th = ip + s->ip_hlen;
+	unsigned int thlen = TCPH_HLEN(th);
+
+	if (!s->mergeable || fl->done)
+		return FALSE;
+	if (s->seq != fl->next_seq || s->payload > fl->seg_len)
+		return FALSE;
+	if (fl->ip_len + s->payload > GRO_MAX_IP_LEN ||
+	    fl->nr_segs >= GRO_MAX_SEGS)
+		return FALSE;
+	if (s->ip_hlen == GRO_IP6_HLEN) {
+		if (memcmp(ip, s->ip, 4) || IP6H_HOP(ip) != IP6H_HOP(s->ip))
+			return FALSE;
+	} else {
+		if (IPH_TOS(ip) != IPH_TOS(s->ip) || IPH_TTL(ip) != IPH_TTL(s->ip))
+			return FALSE;
+	}
+	if (memcmp(TCPH_ACK(th), TCPH_ACK(s->th), 4))
+		return FALSE;
+	if (thlen != TCPH_HLEN(s->th) ||
+	    memcmp(th + GRO_TCP_HLEN, s->th + GRO_TCP_HLEN, thlen - GRO_TCP_HLEN))
+		return FALSE;
+	return TRUE;
+}
+
+static void gro_flush_flow(struct gro *g, struct gro_flow *fl)
+{
+	uint8_t *ip;
+
+	if (!fl->head)
+		return;
+	if (fl->nr_segs > 1) {
+		ip = fl->head->rp;
+		if (gro_is_v6(ip)) {
+			hnputs(IP6H_PLEN(ip), fl->ip_len - GRO_IP6_HLEN);
+		} else {
+			hnputs(IPH_LEN(ip), fl->ip_len);
+			IPH_CKSUM(ip)[0] = IPH_CKSUM(ip)[1] = 0;
+			hnputs(IPH_CKSUM(ip), ipcsum(ip));
+		}
+		g->nr_chains++;
+	} else {
+		g->nr_passed++;
+	}
+	g->deliver(g->arg, fl->head);
+	fl->head = fl->tail = NULL;
+	fl->done = FALSE;
+}
+
+static void gro_start_flow(struct gro *g, struct block *bp, struct gro_seg *s)
+{
+	struct gro_flow *fl = NULL;
+
+	for (int i = 0; i < GRO_MAX_FLOWS; i++) {
+		if (!g->flows[i].head) {
+			fl = &g->flows[i];
+			break;
+		}
+	}
+	if (!fl) {
+		fl = &g->flows[g->victim];
+		g->victim = (g->victim + 1) % GRO_MAX_FLOWS;
+		gro_flush_flow(g, fl);
+	}
+	fl->head = fl->tail = bp;
+	fl->ip_len = s->ip_len;
+	fl->seg_len = s->payload;
+	fl->next_seq = s->seq + s->payload;
+	fl->nr_segs = 1;
+	fl->done = !!(TCPH_FLAGS(s->th) & GRO_TCP_PSH);
+}
+
+static void gro_append(struct gro_flow *fl, struct block *bp,
+                       struct gro_seg *s)
+{
+	uint8_t *th = fl->head->rp + s->ip_hlen;
+
+	/* The latest window and PSH win; the rest of the header is the same. */
+	memcpy(TCPH_WIN(th), TCPH_WIN(s->th), 2);
+	TCPH_FLAGS(th) |= TCPH_FLAGS(s->th);
+	bp->rp += s->hlen;
+	bp->flag &= ~BLOCK_META_FLAGS;
+	fl->tail->next = bp;
+	fl->tail = bp;
+	fl->ip_len += s->payload;
+	fl->next_seq += s->payload;
+	fl->nr_segs++;
+	/* A short segment or a PSH is the end of what the sender had. */
+	if (s->payload < fl->seg_len || (TCPH_FLAGS(s->th) & GRO_TCP_PSH))
+		fl->done = TRUE;
+}
+
+/* Takes an IP packet, starting at its IP header, and either holds it for
+ * merging or delivers it (and maybe some held packets) via g->deliver. */
+void gro_receive(struct gro *g, struct block *bp)
+{
+	struct gro_seg s[1];
+	struct gro_flow *fl = NULL;
+
+	if (!gro_parse(g, bp, s)) {
+		g->nr_passed++;
+		g->deliver(g->arg, bp);
+		return;
+	}
+	for (int i = 0; i < GRO_MAX_FLOWS; i++) {
+		if (g->flows[i].head && gro_same_flow(&g->flows[i], s)) {
+			fl = &g->flows[i];
+			break;
+		}
+	}
+	if (fl && gro_can_merge(fl, s)) {
+		gro_append(fl, bp, s);
+		g->nr_merged++;
+		if (fl->done)
+			gro_flush_flow(g, fl);
+		return;
+	}
+	if (fl)
+		gro_flush_flow(g, fl);
+	if (!s->mergeable) {
+		g->nr_passed++;
+		g->deliver(g->arg, bp);
+		return;
+	}
+	gro_start_flow(g, bp, s);
+}
+
+/* Delivers everything we are holding.  The stats are batched up to here, so
+ * that several readers don't bounce the ifc's cache lines per packet. */
+void gro_flush(struct gro *g)
+{
+	for (int i = 0; i < GRO_MAX_FLOWS; i++)
+		gro_flush_flow(g, &g->flows[i]);
+	if (g->nr_merged)
+		atomic_add(&g->ifc->gro_merged, g->nr_merged);
+	if (g->nr_chains)
+		atomic_add(&g->ifc->gro_chains, g->nr_chains);
+	if (g->nr_passed)
+		atomic_add(&g->ifc->gro_passed, g->nr_passed);
+	g->nr_merged = g->nr_chains = g->nr_passed = 0;
+}
@@ -0,0 +1,137 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Generic segmentation offload: TSO in software, for media whose device can't
+ * do it.
+ *
+ * TCP builds large segments (Btso, with bp->mss) regardless of the device, so
+ * it builds headers and takes its locks once per large send.  If the device
+ * can't segment, the medium calls gso_segment() right before its output, which
+ * slices the datagram into MSS-sized packets.  The payloads aren't copied: each
+ * packet is a copy of the headers, pointing at its slice of the original's
+ * data, like qclone().  Each packet gets its own IP length (and for v4, ID and
+ * checksum), and its own TCP seq and pseudo-header checksum.  PSH and FIN only
+ * go on the last one.  The rest of the TCP checksum is left to the NIC, or to
+ * ptclcsum_finalize() in devether, as for any other packet.
+ *
+ * v6 datagrams from ipoput6() have no extension headers, so TCP is right after
+ * the fixed header. */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+/* Sets the pseudo-header part of the TCP checksum, which is what the NIC and
+ * ptclcsum_finalize() expect, for a segment with tcplen bytes of TCP. */
+static void gso_set_ph_csum4(struct Ip4hdr *ip, struct tcphdr *th,
+                             unsigned int tcplen)
+{
+	uint8_t ph[TCP4_PHDRSIZE];
+
+	ph[0] = 0;
+	ph[1] = IP_TCPPROTO;
+	hnputs(ph + 2, tcplen);
+	memcpy(ph + 4, ip->src, 4);
+	memcpy(ph + 8, ip->dst, 4);
+	hnputs(th->tcpcksum, ptclbsum(ph, sizeof(ph)));
+}
+
+static void gso_set_ph_csum6(struct ip6hdr *ip, struct tcphdr *th,
+                             unsigned int tcplen)
+{
+	uint8_t ph[TCP6_PHDRSIZE];
+
+	memcpy(ph, ip->src, IPaddrlen);
+	memcpy(ph + IPaddrlen, ip->dst, IPaddrlen);
+	hnputl(ph + 2 * IPaddrlen, tcplen);
+	ph[36] = ph[37] = ph[38] = 0;
+	ph[39] = IP_TCPPROTO;
+	hnputs(th->tcpcksum, ptclbsum(ph, sizeof(ph)));
+}
+
+/* Takes a Btso TCP datagram, as it comes out of ipoput4() or ipoput6(), and
+ * returns a list, linked by b->list, of packets of at most bp->mss bytes of
+ * payload.  Consumes bp.  Returns NULL if the datagram is malformed. */
+struct block *gso_segment(struct block *bp)
+{
+	struct block *segs = NULL, **tail = &segs, *nb;
+	struct tcphdr *th, *nth;
+	unsigned int ip_hlen, hlen, payload, mss, chunk;
+	uint8_t proto;
+	uint32_t seq;
+	uint16_t id = 0;
+	bool v6;
+
+	bp = pullupblock(bp, 1);
+	if (!bp)
+		return NULL;
+	v6 = (bp->rp[0] >> 4) == 6;
+	ip_hlen = v6 ? IPV6HDR_LEN : IPV4HDR_LEN;
+	bp = pullupblock(bp, ip_hlen + TCP4_HDRSIZE);
+	if (!bp)
+		return NULL;
+	th = (struct tcphdr *)(bp->rp + ip_hlen);
+	hlen = ip_hlen + ((nhgets(th->tcpflag) >> 10) & ~3);
+	bp = pullupblock(bp, hlen);
+	if (!bp)
+		return NULL;
+	th = (struct tcphdr *)(bp->rp + ip_hlen);
+	if (v6) {
+		proto = ((struct ip6hdr *)bp->rp)->proto;
+	} else {
+		proto = ((struct Ip4hdr *)bp->rp)->proto;
+		id = nhgets(((struct Ip4hdr *)bp->rp)->id);
+	}
+	mss = bp->mss;
+	if (proto != IP_TCPPROTO || !mss || BLEN(bp) <= hlen) {
+		freeblist(bp);
+		return NULL;
+	}
+	payload = BLEN(bp) - hlen;
+	if (payload <= mss) {
+		bp->flag &= ~Btso;
+		bp->mss = 0;
+		return bp;
+	}
+	seq = nhgetl(th->tcpseq);
+	for (unsigned int off = 0; off < payload; off += chunk) {
+		chunk = MIN(mss, payload - off);
+		nb = blist_clone(bp, hlen, chunk, hlen + off);
+		memcpy(nb->wp, bp->rp, hlen);
+		nb->wp += hlen;
+		block_copy_metadata(nb, bp);
+		nb->flag &= ~Btso;
+		nb->mss = 0;
+
+		nth = (struct tcphdr *)(nb->rp + ip_hlen);
+		hnputl(nth->tcpseq, seq + off);
+		if (off + chunk < payload)
+			nth->tcpflag[1] &= ~(PSH | FIN);
+		if (v6) {
+			struct ip6hdr *nip = (struct ip6hdr *)nb->rp;
+
+			hnputs(nip->ploadlen, hlen - ip_hlen + chunk);
+			if (nb->flag & Btcpck)
+				gso_set_ph_csum6(nip, nth, hlen - ip_hlen + chunk);
+		} else {
+			struct Ip4hdr *nip = (struct Ip4hdr *)nb->rp;
+
+			hnputs(nip->length, hlen + chunk);
+			hnputs(nip->id, id++);
+			nip->cksum[0] = nip->cksum[1] = 0;
+			hnputs(nip->cksum, ipcsum(&nip->vihl));
+			if (nb->flag & Btcpck)
+				gso_set_ph_csum4(nip, nth, hlen - ip_hlen + chunk);
+		}
+
+		*tail = nb;
+		tail = &nb->list;
+	}
+	freeblist(bp);
+	return segs;
+}
@@ -487,12 +487,12 @@ void icmphostunr(struct Fs *f, struct Ipifc *ifc,
 	nbp = newIPICMP(sz);
 	np = (struct IPICMP *)nbp->rp;
 
-	rlock(&ifc->rwlock);
+	br_rlock(&ifc->rwlock);
 	if (ipv6anylocal(ifc, np->src)) {
 		netlog(f, Logicmp, "send icmphostunr -> s%I d%I\n", p->src, p->dst);
 	} else {
 		netlog(f, Logicmp, "icmphostunr fail -> s%I d%I\n", p->src, p->dst);
-		runlock(&ifc->rwlock);
+		br_runlock(&ifc->rwlock);
 		freeblist(nbp);
 		goto freebl;
 	}
@@ -511,7 +511,7 @@ void icmphostunr(struct Fs *f, struct Ipifc *ifc,
 		ipiput6(f, ifc, nbp);
 	else
 		ipoput6(f, nbp, 0, MAXTTL, DFLTTOS, NULL);
-	runlock(&ifc->rwlock);
+	br_runlock(&ifc->rwlock);
 freebl:
 	if (free)
 		freeblist(bp);
@@ -739,21 +739,21 @@ static int targettype(struct Fs *f, struct Ipifc *ifc, uint8_t * target)
 	struct Iplifc *lifc;
 	int t;
 
-	rlock(&ifc->rwlock);
+	br_rlock(&ifc->rwlock);
 	if (ipproxyifc(f, ifc, target)) {
-		runlock(&ifc->rwlock);
+		br_runlock(&ifc->rwlock);
 		return t_uniproxy;
 	}
 
 	for (lifc = ifc->lifc; lifc; lifc = lifc->next) {
 		if (ipcmp(lifc->local, target) == 0) {
 			t = (lifc->tentative) ? t_unitent : t_unirany;
-			runlock(&ifc->rwlock);
+			br_runlock(&ifc->rwlock);
 			return t;
 		}
 	}
 
-	runlock(&ifc->rwlock);
+	br_runlock(&ifc->rwlock);
 	return 0;
 }
 
@@ -36,6 +36,8 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <alarm.h>
+#include <hash.h>
 #include <net/ip.h>
 
 typedef struct IP IP;
@@ -87,9 +89,36 @@ struct fragment4 {
 	uint32_t src;
 	uint32_t dst;
 	uint16_t id;
+	uint8_t proto;
 	uint64_t age;
 };
 
+/* v4 reassembly.  Reassemblies are hashed by (src, dst, id, proto), with a
+ * qlock per bucket, so unrelated datagrams don't contend.  Descriptors come
+ * from a kmem cache, whose per-core magazines keep allocs off any shared lock,
+ * and an alarm sweeps out the ones that waited too long. */
+enum {
+	NR_FRAG4_HASH_BITS = 8,
+	NR_FRAG4_HASH = 1 << NR_FRAG4_HASH_BITS,
+	Maxfrag4 = 1024,			/* reassemblies in progress, at most */
+	Frag4age = 30000,			/* ms a reassembly can take */
+	Frag4sweep = 1000,			/* ms between sweeps for old ones */
+};
+
+struct frag4_bucket {
+	qlock_t qlock;
+	struct fragment4 *head;
+};
+
+struct frag4_table {
+	struct frag4_bucket ht[NR_FRAG4_HASH];
+	atomic_t nr_frags;
+	struct alarm_waiter sweeper;
+	struct IP *ip;
+};
+
+static struct kmem_cache *frag4_kcache;
+
 struct fragment6 {
 	struct block *blist;
 	struct fragment6 *next;
@@ -106,11 +135,9 @@ struct Ipfrag {
 
 /* an instance of IP */
 struct IP {
-	uint32_t stats[Nstats];
+	uint64_t *stats;			/* percpu, see netstats_alloc() */
 
-	qlock_t fraglock4;
-	struct fragment4 *flisthead4;
-	struct fragment4 *fragfree4;
+	struct frag4_table *frag4;
 	int id4;
 
 	qlock_t fraglock6;
@@ -153,8 +180,9 @@ static char *statnames[] = {
 uint16_t ipcsum(uint8_t * unused_uint8_p_t);
 struct block *ip4reassemble(struct IP *, int unused_int,
 							struct block *, struct Ip4hdr *);
-void ipfragfree4(struct IP *, struct fragment4 *);
-struct fragment4 *ipfragallo4(struct IP *);
+void ipfragfree4(struct IP *, struct frag4_bucket *, struct fragment4 *);
+struct fragment4 *ipfragallo4(struct IP *, struct frag4_bucket *);
+static void frag4_sweep(struct alarm_waiter *waiter);
 
 void ip_init_6(struct Fs *f)
 {
@@ -180,21 +208,31 @@ void ip_init_6(struct Fs *f)
 
 }
 
+static void initfrag4(struct IP *ip)
+{
+	struct frag4_table *ft;
+
+	if (!frag4_kcache)
+		frag4_kcache = kmem_cache_create("ip_frag4", sizeof(struct fragment4),
+		                                 __alignof__(struct fragment4), 0,
+		                                 NULL, NULL, NULL, NULL);
+	ft = kzmalloc(sizeof(struct frag4_table), MEM_WAIT);
+	for (int i = 0; i < NR_FRAG4_HASH; i++)
+		qlock_init(&ft->ht[i].qlock);
+	atomic_init(&ft->nr_frags, 0);
+	ft->ip = ip;
+	ip->frag4 = ft;
+	init_awaiter(&ft->sweeper, frag4_sweep);
+	set_awaiter_slack(&ft->sweeper, ALARM_SLACK_LAZY);
+	set_awaiter_rel(&ft->sweeper, Frag4sweep * 1000);
+	set_alarm(&per_cpu_info[core_id()].tchain, &ft->sweeper);
+}
+
 void initfrag(struct IP *ip, int size)
 {
-	struct fragment4 *fq4, *eq4;
 	struct fragment6 *fq6, *eq6;
 
-	ip->fragfree4 =
-		(struct fragment4 *)kzmalloc(sizeof(struct fragment4) * size, 0);
-	if (ip->fragfree4 == NULL)
-		panic("initfrag");
-
-	eq4 = &ip->fragfree4[size];
-	for (fq4 = ip->fragfree4; fq4 < eq4; fq4++)
-		fq4->next = fq4 + 1;
-
-	ip->fragfree4[size - 1].next = NULL;
+	initfrag4(ip);
 
 	ip->fragfree6 =
 		(struct fragment6 *)kzmalloc(sizeof(struct fragment6) * size, 0);
@@ -213,7 +251,7 @@ void ip_init(struct Fs *f)
 	struct IP *ip;
 
 	ip = kzmalloc(sizeof(struct IP), 0);
-	qlock_init(&ip->fraglock4);
+	ip->stats = netstats_alloc(Nstats);
 	qlock_init(&ip->fraglock6);
 	initfrag(ip, 100);
 	f->ip = ip;
@@ -225,9 +263,9 @@ void iprouting(struct Fs *f, int on)
 {
 	f->ip->iprouting = on;
 	if (f->ip->iprouting == 0)
-		f->ip->stats[Forwarding] = 2;
+		netstat_set(f->ip->stats, Forwarding, 2);
 	else
-		f->ip->stats[Forwarding] = 1;
+		netstat_set(f->ip->stats, Forwarding, 1);
 }
 
 int
@@ -253,7 +291,7 @@ ipoput4(struct Fs *f,
 	/* Fill out the ip header */
 	eh = (struct Ip4hdr *)(bp->rp);
 
-	ip->stats[OutRequests]++;
+	netstat_inc(ip->stats, OutRequests);
 
 	/* Number of uint8_ts in data and ip header to write */
 	len = blocklen(bp);
@@ -261,7 +299,7 @@ ipoput4(struct Fs *f,
 	if (gating) {
 		chunk = nhgets(eh->length);
 		if (chunk > len) {
-			ip->stats[OutDiscards]++;
+			netstat_inc(ip->stats, OutDiscards);
 			netlog(f, Logip, "short gated packet\n");
 			goto free;
 		}
@@ -269,14 +307,14 @@ ipoput4(struct Fs *f,
 			len = chunk;
 	}
 	if (len >= IP_MAX) {
-		ip->stats[OutDiscards]++;
+		netstat_inc(ip->stats, OutDiscards);
 		netlog(f, Logip, "exceeded ip max size %V\n", eh->dst);
 		goto free;
 	}
 
 	r = v4lookup(f, eh->dst, c);
 	if (r == NULL) {
-		ip->stats[OutNoRoutes]++;
+		netstat_inc(ip->stats, OutNoRoutes);
 		netlog(f, Logip, "no interface %V\n", eh->dst);
 		rv = -1;
 		goto free;
@@ -299,10 +337,10 @@ ipoput4(struct Fs *f,
 	if (!gating)
 		eh->tos = tos;
 
-	if (!canrlock(&ifc->rwlock))
+	if (!br_canrlock(&ifc->rwlock))
 		goto free;
 	if (waserror()) {
-		runlock(&ifc->rwlock);
+		br_runlock(&ifc->rwlock);
 		nexterror();
 	}
 	if (ifc->m == NULL)
@@ -322,7 +360,7 @@ ipoput4(struct Fs *f,
 		eh->cksum[1] = 0;
 		hnputs(eh->cksum, ipcsum(&eh->vihl));
 		ifc->m->bwrite(ifc, bp, V4, gate);
-		runlock(&ifc->rwlock);
+		br_runlock(&ifc->rwlock);
 		poperror();
 		return 0;
 	}
@@ -331,8 +369,8 @@ ipoput4(struct Fs *f,
 		printd("%V: DF set\n", eh->dst);
 
 	if (eh->frag[0] & (IP_DF >> 8)) {
-		ip->stats[FragFails]++;
-		ip->stats[OutDiscards]++;
+		netstat_inc(ip->stats, FragFails);
+		netstat_inc(ip->stats, OutDiscards);
 		icmpcantfrag(f, bp, medialen);
 		netlog(f, Logip, "%V: eh->frag[0] & (IP_DF>>8)\n", eh->dst);
 		goto raise;
@@ -340,8 +378,8 @@ ipoput4(struct Fs *f,
 
 	seglen = (medialen - IP4HDR) & ~7;
 	if (seglen < 8) {
-		ip->stats[FragFails]++;
-		ip->stats[OutDiscards]++;
+		netstat_inc(ip->stats, FragFails);
+		netstat_inc(ip->stats, OutDiscards);
 		netlog(f, Logip, "%V seglen < 8\n", eh->dst);
 		goto raise;
 	}
@@ -390,11 +428,11 @@ ipoput4(struct Fs *f,
 		feh->cksum[1] = 0;
 		hnputs(feh->cksum, ipcsum(&feh->vihl));
 		ifc->m->bwrite(ifc, nb, V4, gate);
-		ip->stats[FragCreates]++;
+		netstat_inc(ip->stats, FragCreates);
 	}
-	ip->stats[FragOKs]++;
+	netstat_inc(ip->stats, FragOKs);
 raise:
-	runlock(&ifc->rwlock);
+	br_runlock(&ifc->rwlock);
 	poperror();
 free:
 	freeblist(bp);
@@ -420,7 +458,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	}
 
 	ip = f->ip;
-	ip->stats[InReceives]++;
+	netstat_inc(ip->stats, InReceives);
 
 	/*
 	 *  Ensure we have all the header info in the first
@@ -442,7 +480,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 
 	/* dump anything that whose header doesn't checksum */
 	if ((bp->flag & Bipck) == 0 && ipcsum(&h->vihl)) {
-		ip->stats[InHdrErrors]++;
+		netstat_inc(ip->stats, InHdrErrors);
 		netlog(f, Logip, "ip: checksum error %V\n", h->src);
 		freeblist(bp);
 		return;
@@ -454,7 +492,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	if ((h->vihl & 0x0F) != IP_HLEN4) {
 		hl = (h->vihl & 0xF) << 2;
 		if (hl < (IP_HLEN4 << 2)) {
-			ip->stats[InHdrErrors]++;
+			netstat_inc(ip->stats, InHdrErrors);
 			netlog(f, Logip, "ip: %V bad hivl 0x%x\n", h->src, h->vihl);
 			freeblist(bp);
 			return;
@@ -484,7 +522,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		conv.r = NULL;
 		r = v4lookup(f, h->dst, &conv);
 		if (r == NULL || r->rt.ifc == ifc) {
-			ip->stats[OutDiscards]++;
+			netstat_inc(ip->stats, OutDiscards);
 			freeblist(bp);
 			return;
 		}
@@ -492,7 +530,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		/* don't forward if packet has timed out */
 		hop = h->ttl;
 		if (hop < 1) {
-			ip->stats[InHdrErrors]++;
+			netstat_inc(ip->stats, InHdrErrors);
 			icmpttlexceeded(f, ifc->lifc->local, bp);
 			freeblist(bp);
 			return;
@@ -514,7 +552,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 			}
 		}
 
-		ip->stats[ForwDatagrams]++;
+		netstat_inc(ip->stats, ForwDatagrams);
 		tos = h->tos;
 		hop = h->ttl;
 		ipoput4(f, bp, 1, hop - 1, tos, &conv);
@@ -539,12 +577,12 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	proto = h->proto;
 	p = Fsrcvpcol(f, proto);
 	if (p != NULL && p->rcv != NULL) {
-		ip->stats[InDelivers]++;
+		netstat_inc(ip->stats, InDelivers);
 		(*p->rcv) (p, ifc, bp);
 		return;
 	}
-	ip->stats[InDiscards]++;
-	ip->stats[InUnknownProtos]++;
+	netstat_inc(ip->stats, InDiscards);
+	netstat_inc(ip->stats, InUnknownProtos);
 	freeblist(bp);
 }
 
@@ -555,21 +593,33 @@ int ipstats(struct Fs *f, char *buf, int len)
 	int i;
 
 	ip = f->ip;
-	ip->stats[DefaultTTL] = MAXTTL;
+	netstat_set(ip->stats, DefaultTTL, MAXTTL);
 
 	p = buf;
 	e = p + len;
 	for (i = 0; i < Nstats; i++)
-		p = seprintf(p, e, "%s: %u\n", statnames[i], ip->stats[i]);
+		p = seprintf(p, e, "%s: %lu\n", statnames[i],
+		             netstat_read(ip->stats, i));
 	return p - buf;
 }
 
+static struct frag4_bucket *frag4_bucket(struct IP *ip, uint32_t src,
+                                         uint32_t dst, uint16_t id,
+                                         uint8_t proto)
+{
+	uint32_t key = src ^ dst ^ ((uint32_t)id << 8 | proto);
+
+	return &ip->frag4->ht[hash_32(key, NR_FRAG4_HASH_BITS)];
+}
+
 struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 							struct Ip4hdr *ih)
 {
 	int fend;
 	uint16_t id;
-	struct fragment4 *f, *fnext;
+	uint8_t proto;
+	struct fragment4 *f;
+	struct frag4_bucket *b;
 	uint32_t src, dst;
 	struct block *bl, **l, *last, *prev;
 	int ovlap, len, fragsize, pktposn;
@@ -577,6 +627,8 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 	src = nhgetl(ih->src);
 	dst = nhgetl(ih->dst);
 	id = nhgets(ih->id);
+	proto = ih->proto;
+	b = frag4_bucket(ip, src, dst, id, proto);
 
 	/*
 	 *  block lists are too hard, pullupblock into a single block
@@ -586,19 +638,14 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 		ih = (struct Ip4hdr *)(bp->rp);
 	}
 
-	qlock(&ip->fraglock4);
+	qlock(&b->qlock);
 
 	/*
 	 *  find a reassembly queue for this fragment
 	 */
-	for (f = ip->flisthead4; f; f = fnext) {
-		fnext = f->next;	/* because ipfragfree4 changes the list */
-		if (f->src == src && f->dst == dst && f->id == id)
+	for (f = b->head; f; f = f->next) {
+		if (f->src == src && f->dst == dst && f->id == id && f->proto == proto)
 			break;
-		if (f->age < NOW) {
-			ip->stats[ReasmTimeout]++;
-			ipfragfree4(ip, f);
-		}
 	}
 
 	/*
@@ -608,10 +655,10 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 	 */
 	if (!ih->tos && (offset & ~(IP_MF | IP_DF)) == 0) {
 		if (f != NULL) {
-			ipfragfree4(ip, f);
-			ip->stats[ReasmFails]++;
+			ipfragfree4(ip, b, f);
+			netstat_inc(ip->stats, ReasmFails);
 		}
-		qunlock(&ip->fraglock4);
+		qunlock(&b->qlock);
 		return bp;
 	}
 
@@ -625,15 +672,22 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 
 	/* First fragment allocates a reassembly queue */
 	if (f == NULL) {
-		f = ipfragallo4(ip);
+		f = ipfragallo4(ip, b);
+		if (!f) {
+			qunlock(&b->qlock);
+			freeblist(bp);
+			netstat_inc(ip->stats, ReasmFails);
+			return NULL;
+		}
 		f->id = id;
 		f->src = src;
 		f->dst = dst;
+		f->proto = proto;
 
 		f->blist = bp;
 
-		qunlock(&ip->fraglock4);
-		ip->stats[ReasmReqds]++;
+		qunlock(&b->qlock);
+		netstat_inc(ip->stats, ReasmReqds);
 		return NULL;
 	}
 
@@ -655,7 +709,7 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 		if (ovlap > 0) {
 			if (ovlap >= BKFG(bp)->flen) {
 				freeblist(bp);
-				qunlock(&ip->fraglock4);
+				qunlock(&b->qlock);
 				return NULL;
 			}
 			BKFG(prev)->flen -= ovlap;
@@ -715,34 +769,30 @@ struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 
 			bl = f->blist;
 			f->blist = NULL;
-			ipfragfree4(ip, f);
+			ipfragfree4(ip, b, f);
 			ih = BLKIP(bl);
 			hnputs(ih->length, len);
-			qunlock(&ip->fraglock4);
-			ip->stats[ReasmOKs]++;
+			qunlock(&b->qlock);
+			netstat_inc(ip->stats, ReasmOKs);
 			return bl;
 		}
 		pktposn += BKFG(bl)->flen;
 	}
-	qunlock(&ip->fraglock4);
+	qunlock(&b->qlock);
 	return NULL;
 }
 
 /*
- * ipfragfree4 - Free a list of fragments - assume hold fraglock4
+ * ipfragfree4 - Free a list of fragments - assume hold b's qlock
  */
-void ipfragfree4(struct IP *ip, struct fragment4 *frag)
+void ipfragfree4(struct IP *ip, struct frag4_bucket *b, struct fragment4 *frag)
 {
 	struct fragment4 *fl, **l;
 
 	if (frag->blist)
 		freeblist(frag->blist);
 
-	frag->src = 0;
-	frag->id = 0;
-	frag->blist = NULL;
-
-	l = &ip->flisthead4;
+	l = &b->head;
 	for (fl = *l; fl; fl = fl->next) {
 		if (fl == frag) {
 			*l = frag->next;
@@ -751,32 +801,66 @@ void ipfragfree4(struct IP *ip, struct fragment4 *frag)
 		l = &fl->next;
 	}
 
-	frag->next = ip->fragfree4;
-	ip->fragfree4 = frag;
-
+	kmem_cache_free(frag4_kcache, frag);
+	atomic_dec(&ip->frag4->nr_frags);
 }
 
 /*
- * ipfragallo4 - allocate a reassembly queue - assume hold fraglock4
+ * ipfragallo4 - allocate a reassembly queue - assume hold b's qlock
+ *
+ * Past Maxfrag4, we make room in b by dropping its oldest (the last one), or
+ * fail if b has none.
  */
-struct fragment4 *ipfragallo4(struct IP *ip)
+struct fragment4 *ipfragallo4(struct IP *ip, struct frag4_bucket *b)
 {
 	struct fragment4 *f;
 
-	while (ip->fragfree4 == NULL) {
-		/* free last entry on fraglist */
-		for (f = ip->flisthead4; f->next; f = f->next) ;
-		ipfragfree4(ip, f);
+	if (atomic_read(&ip->frag4->nr_frags) >= Maxfrag4) {
+		if (!b->head)
+			return NULL;
+		for (f = b->head; f->next; f = f->next) ;
+		ipfragfree4(ip, b, f);
 	}
-	f = ip->fragfree4;
-	ip->fragfree4 = f->next;
-	f->next = ip->flisthead4;
-	ip->flisthead4 = f;
-	f->age = NOW + 30000;
+	f = kmem_cache_alloc(frag4_kcache, MEM_ATOMIC);
+	if (!f)
+		return NULL;
+	atomic_inc(&ip->frag4->nr_frags);
+	memset(f, 0, sizeof(struct fragment4));
+	f->next = b->head;
+	b->head = f;
+	f->age = NOW + Frag4age;
 
 	return f;
 }
 
+/* Drops the reassemblies that are too old, so that lookups don't have to.  RKM
+ * alarm, so we can qlock. */
+static void frag4_sweep(struct alarm_waiter *waiter)
+{
+	struct frag4_table *ft = container_of(waiter, struct frag4_table, sweeper);
+	struct IP *ip = ft->ip;
+	struct frag4_bucket *b;
+	struct fragment4 *f, *fnext;
+	uint64_t now = NOW;
+
+	for (int i = 0; i < NR_FRAG4_HASH && atomic_read(&ft->nr_frags); i++) {
+		b = &ft->ht[i];
+		if (!b->head)
+			continue;
+		qlock(&b->qlock);
+		for (f = b->head; f; f = fnext) {
+			fnext = f->next;	/* because ipfragfree4 changes the list */
+			if (f->age < now) {
+				netstat_inc(ip->stats, ReasmTimeout);
+				ipfragfree4(ip, b, f);
+			}
+		}
+		qunlock(&b->qlock);
+	}
+	set_awaiter_rel(waiter, Frag4sweep * 1000);
+	set_alarm(&per_cpu_info[core_id()].tchain, waiter);
+}
+
 /* coreboot.c among other things needs this
  * type of checksum.
  */
@@ -38,6 +38,8 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <endian.h>
+#include <rcu.h>
+#include <hash.h>
 
 /*
  *  well known IP addresses
@@ -355,6 +357,61 @@ uint16_t ptclcsum(struct block *bp, int offset, int len)
 	return ~losum & 0xffff;
 }
 
+/* linearizeblock() followed by ptclcsum_finalize(), in one pass over the data:
+ * if bp needs a software transport checksum, we compute it while copying the
+ * data into the new block, instead of reading it all again afterwards. */
+struct block *linearize_csum_finalize(struct block *bp, unsigned int feat)
+{
+	unsigned int flag = bp->flag & BLOCK_TRANS_TX_CSUM;
+	struct block *newb;
+	struct extra_bdata *ebd;
+	uint32_t losum, hisum;
+	uint16_t csum;
+	uint8_t *dst;
+	int off, x, odd;
+
+	if (!bp->extra_len || !flag || (flag & feat) == flag ||
+	    bp->transport_offset > BHLEN(bp)) {
+		bp = linearizeblock(bp);
+		ptclcsum_finalize(bp, feat);
+		return bp;
+	}
+	newb = block_alloc(BLEN(bp), MEM_WAIT);
+	dst = newb->wp;
+	off = bp->transport_offset;
+	memcpy(dst, bp->rp, off);
+	dst += off;
+	x = BHLEN(bp) - off;
+	losum = ptclbsum_copy(dst, bp->rp + off, x);
+	hisum = 0;
+	dst += x;
+	odd = x & 1;
+	for (int i = 0; i < bp->nr_extra_bufs; i++) {
+		ebd = &bp->extra_data[i];
+		if (!ebd->base || !ebd->len)
+			continue;
+		x = ptclbsum_copy(dst, (uint8_t *)ebd->base + ebd->off, ebd->len);
+		if (odd)
+			hisum += x;
+		else
+			losum += x;
+		odd = (odd + ebd->len) & 1;
+		dst += ebd->len;
+	}
+	newb->wp = dst;
+	block_copy_metadata(newb, bp);
+	freeb(bp);
+
+	losum += hisum >> 8;
+	losum += (hisum & 0xff) << 8;
+	while ((csum = losum >> 16) != 0)
+		losum = csum + (losum & 0xffff);
+	hnputs(newb->rp + newb->transport_offset + newb->tx_csum_offset,
+	       ~losum & 0xffff);
+	newb->flag &= ~BLOCK_TRANS_TX_CSUM;
+	return newb;
+}
+
 enum {
 	Isprefix = 16,
 };
@@ -594,65 +651,153 @@ int parsemac(uint8_t * to, char *from, int len)
 
 /*
  *  hashing tcp, udp, ... connections
- *  gcc weirdness: it gave a bogus result until ron split the %= out.
+ *
+ *  Each entry is hashed on the part of the 4-tuple its match cares about, so a
+ *  lookup hashes the packet's tuple once per match type.  The table is an
+ *  rhashtable: lookups are lockless (RCU), so TCP input on many cores doesn't
+ *  fight over a lock, and the table resizes a few buckets at a time.
  */
-uint32_t iphash(uint8_t * sa, uint16_t sp, uint8_t * da, uint16_t dp)
+static uint32_t iphash(uint8_t *sa, uint16_t sp, uint8_t *da, uint16_t dp)
 {
-	uint32_t ret;
-	ret = (sa[IPaddrlen - 1] << 24) ^ (sp << 16) ^ (da[IPaddrlen - 1] << 8)
-		^ dp;
-	ret %= Nhash;
-	return ret;
+	uint32_t a = 0, b = 0;
+
+	for (int i = 0; i < IPaddrlen; i += 4) {
+		a ^= nhgetl(sa + i);
+		b ^= nhgetl(da + i);
+	}
+	return a ^ hash_32(b ^ ((uint32_t)sp << 16 | dp), 32);
+}
+
+/* Hashes the parts of the tuple that match type match looks at. */
+static uint32_t iphash_match(int match, uint8_t *sa, uint16_t sp, uint8_t *da,
+                             uint16_t dp)
+{
+	switch (match) {
+	case IPmatchpa:
+		return iphash(IPnoaddr, 0, da, dp);
+	case IPmatchport:
+		return iphash(IPnoaddr, 0, IPnoaddr, dp);
+	case IPmatchaddr:
+		return iphash(IPnoaddr, 0, da, 0);
+	case IPmatchany:
+		return iphash(IPnoaddr, 0, IPnoaddr, 0);
+	default:
+		return iphash(sa, sp, da, dp);
+	}
+}
+
+/* IPmatchfind looks for an exact 4-tuple, regardless of the entry's match. */
+#define IPmatchfind -1
+
+struct iph_key {
+	int match;
+	uint8_t *sa;
+	uint16_t sp;
+	uint8_t *da;
+	uint16_t dp;
+	struct conv *want;			/* if set, only this conv's entry */
+	struct conv *skip;			/* if set, never this conv's entry */
+};
+
+static uint32_t iph_hash_key(const void *key)
+{
+	const struct iph_key *k = key;
+
+	if (k->match == IPmatchfind)
+		return iphash(k->sa, k->sp, k->da, k->dp);
+	return iphash_match(k->match, k->sa, k->sp, k->da, k->dp);
+}
+
+static uint32_t iph_hash_obj(const void *obj)
+{
+	const struct Iphash *h = obj;
+	struct conv *c = h->c;
+
+	return iphash_match(h->match, c->raddr, c->rport, c->laddr, c->lport);
+}
+
+static bool iph_key_eq(const void *key, const void *obj)
+{
+	const struct iph_key *k = key;
+	const struct Iphash *h = obj;
+	struct conv *c = h->c;
+
+	if (k->want && c != k->want)
+		return FALSE;
+	if (k->skip && c == k->skip)
+		return FALSE;
+	if (k->match == IPmatchfind)
+		return k->sp == c->rport && k->dp == c->lport
+		       && ipcmp(k->sa, c->raddr) == 0 && ipcmp(k->da, c->laddr) == 0;
+	if (h->match != k->match)
+		return FALSE;
+	switch (k->match) {
+	case IPmatchexact:
+		return k->sp == c->rport && k->dp == c->lport
+		       && ipcmp(k->sa, c->raddr) == 0 && ipcmp(k->da, c->laddr) == 0;
+	case IPmatchpa:
+		return k->dp == c->lport && ipcmp(k->da, c->laddr) == 0;
+	case IPmatchport:
+		return k->dp == c->lport;
+	case IPmatchaddr:
+		return ipcmp(k->da, c->laddr) == 0;
+	case IPmatchany:
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static const struct rhashtable_params iph_params = {
+	.node_offset = offsetof(struct Iphash, link),
+	.hash_key = iph_hash_key,
+	.hash_obj = iph_hash_obj,
+	.key_eq = iph_key_eq,
+	.min_bits = 6,
+};
+
+void ipht_init(struct Ipht *ht)
+{
+	rhashtable_init(&ht->ht, &iph_params);
+}
+
+static int iph_conv_match(struct conv *c)
+{
+	if (ipcmp(c->raddr, IPnoaddr) != 0)
+		return IPmatchexact;
+	if (ipcmp(c->laddr, IPnoaddr) != 0)
+		return c->lport == 0 ? IPmatchaddr : IPmatchpa;
+	return c->lport == 0 ? IPmatchany : IPmatchport;
 }
 
 void iphtadd(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
 	struct Iphash *h;
 
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	h = kzmalloc(sizeof(*h), 0);
-	if (ipcmp(c->raddr, IPnoaddr) != 0)
-		h->match = IPmatchexact;
-	else {
-		if (ipcmp(c->laddr, IPnoaddr) != 0) {
-			if (c->lport == 0)
-				h->match = IPmatchaddr;
-			else
-				h->match = IPmatchpa;
-		} else {
-			if (c->lport == 0)
-				h->match = IPmatchany;
-			else
-				h->match = IPmatchport;
-		}
-	}
+	h = kzmalloc(sizeof(*h), MEM_WAIT);
+	h->match = iph_conv_match(c);
 	h->c = c;
-
-	spin_lock(&ht->lock);
-	h->next = ht->tab[hv];
-	ht->tab[hv] = h;
-	spin_unlock(&ht->lock);
+	rhashtable_insert(&ht->ht, h);
 }
 
 void iphtrem(struct Ipht *ht, struct conv *c)
 {
-	uint32_t hv;
-	struct Iphash **l, *h;
-
-	hv = iphash(c->raddr, c->rport, c->laddr, c->lport);
-	spin_lock(&ht->lock);
-	for (l = &ht->tab[hv]; (*l) != NULL; l = &(*l)->next)
-		if ((*l)->c == c) {
-			h = *l;
-			(*l) = h->next;
-			kfree(h);
-			break;
-		}
-	spin_unlock(&ht->lock);
+	struct iph_key k = {.match = iph_conv_match(c), .sa = c->raddr,
+	                    .sp = c->rport, .da = c->laddr, .dp = c->lport,
+	                    .want = c};
+	struct Iphash *h;
+
+	rcu_read_lock();
+	h = rhashtable_lookup(&ht->ht, &k);
+	if (h && rhashtable_remove(&ht->ht, h))
+		kfree_rcu(h, rcu);
+	rcu_read_unlock();
 }
 
-/* look for a matching conversation with the following precedence
+/* Convs are never freed, so the caller can use the conv after we're out of the
+ * RCU read section, though it might have been closed or reused for another
+ * connection in the meantime.
+ *
+ * look for a matching conversation with the following precedence
  *	connected && raddr,rport,laddr,lport
  *	announced && laddr,lport
  *	announced && *,lport
@@ -662,85 +807,52 @@ void iphtrem(struct Ipht *ht, struct conv *c)
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp)
 {
-	uint32_t hv;
-	struct Iphash *h;
-	struct conv *c;
-
-	/* exact 4 pair match (connection) */
-	hv = iphash(sa, sp, da, dp);
-	spin_lock(&ht->lock);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchexact)
-			continue;
-		c = h->c;
-		if (sp == c->rport && dp == c->lport
-			&& ipcmp(sa, c->raddr) == 0 && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
+	static const int order[] = {IPmatchexact, IPmatchpa, IPmatchport,
+	                            IPmatchaddr, IPmatchany};
+	struct iph_key k = {.sa = sa, .sp = sp, .da = da, .dp = dp};
+	struct Iphash *h = NULL;
+	struct conv *c = NULL;
+
+	rcu_read_lock();
+	for (int i = 0; i < ARRAY_SIZE(order); i++) {
+		k.match = order[i];
+		h = rhashtable_lookup(&ht->ht, &k);
+		if (h) {
+			c = h->c;
+			break;
 		}
 	}
+	rcu_read_unlock();
+	return c;
+}
 
-	/* match local address and port */
-	hv = iphash(IPnoaddr, 0, da, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchpa)
-			continue;
-		c = h->c;
-		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+/* Returns a conv other than skip whose 4-tuple is exactly the given one. */
+struct conv *iphtfind(struct Ipht *ht, struct conv *skip, uint8_t *raddr,
+                      uint16_t rport, uint8_t *laddr, uint16_t lport)
+{
+	struct iph_key k = {.match = IPmatchfind, .sa = raddr, .sp = rport,
+	                    .da = laddr, .dp = lport, .skip = skip};
+	struct Iphash *h;
+	struct conv *c = NULL;
 
-	/* match just port */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, dp);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchport)
-			continue;
+	rcu_read_lock();
+	h = rhashtable_lookup(&ht->ht, &k);
+	if (h)
 		c = h->c;
-		if (dp == c->lport) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+	rcu_read_unlock();
+	return c;
+}
 
-	/* match local address */
-	hv = iphash(IPnoaddr, 0, da, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchaddr)
-			continue;
-		c = h->c;
-		if (ipcmp(da, c->laddr) == 0) {
-			spin_unlock(&ht->lock);
-			return c;
-		}
-	}
+static void dump_iph(void *obj, void *arg)
+{
+	struct conv *c = ((struct Iphash*)obj)->c;
 
-	/* look for something that matches anything */
-	hv = iphash(IPnoaddr, 0, IPnoaddr, 0);
-	for (h = ht->tab[hv]; h != NULL; h = h->next) {
-		if (h->match != IPmatchany)
-			continue;
-		c = h->c;
-		spin_unlock(&ht->lock);
-		return c;
-	}
-	spin_unlock(&ht->lock);
-	return NULL;
+	printk("Conv proto %s, idx %d: local %I:%d, remote %I:%d\n",
+	       c->p->name, c->x, c->laddr, c->lport, c->raddr, c->rport);
 }
 
 void dump_ipht(struct Ipht *ht)
 {
-	struct Iphash *h;
-	struct conv *c;
-
-	spin_lock(&ht->lock);
-	for (int i = 0; i < Nipht; i++) {
-		for (h = ht->tab[i]; h != NULL; h = h->next) {
-			c = h->c;
-			printk("Conv proto %s, idx %d: local %I:%d, remote %I:%d\n",
-			       c->p->name, c->x, c->laddr, c->lport, c->raddr, c->rport);
-		}
-	}
-	spin_unlock(&ht->lock);
+	printk("%u entries\n", rhashtable_count(&ht->ht));
+	rhashtable_for_each(&ht->ht, dump_iph, NULL);
 }
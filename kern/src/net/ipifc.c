@@ -146,13 +146,13 @@ static void ipifcbind(struct conv *c, char **argv, int argc)
 	if (m == NULL)
 		error(EFAIL, "unknown interface type");
 
-	wlock(&ifc->rwlock);
+	br_wlock(&ifc->rwlock);
 	if (ifc->m != NULL) {
-		wunlock(&ifc->rwlock);
+		br_wunlock(&ifc->rwlock);
 		error(EFAIL, "interfacr already bound");
 	}
 	if (waserror()) {
-		wunlock(&ifc->rwlock);
+		br_wunlock(&ifc->rwlock);
 		nexterror();
 	}
 
@@ -189,7 +189,7 @@ static void ipifcbind(struct conv *c, char **argv, int argc)
 	qreopen(c->eq);
 	qreopen(c->sq);
 
-	wunlock(&ifc->rwlock);
+	br_wunlock(&ifc->rwlock);
 	poperror();
 }
 
@@ -202,9 +202,9 @@ static void ipifcunbind(struct Ipifc *ifc)
 	ERRSTACK(1);
 	char *err;
 
-	wlock(&ifc->rwlock);
+	br_wlock(&ifc->rwlock);
 	if (waserror()) {
-		wunlock(&ifc->rwlock);
+		br_wunlock(&ifc->rwlock);
 		nexterror();
 	}
 
@@ -230,12 +230,12 @@ static void ipifcunbind(struct Ipifc *ifc)
 		ipifcremlifc(ifc, ifc->lifc);
 
 	ifc->m = NULL;
-	wunlock(&ifc->rwlock);
+	br_wunlock(&ifc->rwlock);
 	poperror();
 }
 
 char sfixedformat[] =
-	"device %s maxtu %d sendra %d recvra %d mflag %d oflag %d maxraint %d minraint %d linkmtu %d reachtime %d rxmitra %d ttl %d routerlt %d pktin %lu pktout %lu errin %lu errout %lu tracedrop %lu\n";
+	"device %s maxtu %d sendra %d recvra %d mflag %d oflag %d maxraint %d minraint %d linkmtu %d reachtime %d rxmitra %d ttl %d routerlt %d pktin %lu pktout %lu errin %lu errout %lu tracedrop %lu gromerged %lu grochains %lu gropassed %lu\n";
 
 char slineformat[] = "	%-40I %-10M %-40I %-12lu %-12lu\n";
 
@@ -252,16 +252,18 @@ static int ipifcstate(struct conv *c, char *state, int n)
 				 ifc->rp.mflag, ifc->rp.oflag, ifc->rp.maxraint,
 				 ifc->rp.minraint, ifc->rp.linkmtu, ifc->rp.reachtime,
 				 ifc->rp.rxmitra, ifc->rp.ttl, ifc->rp.routerlt,
-				 ifc->in, ifc->out, ifc->inerr, ifc->outerr, ifc->tracedrop);
+				 ifc->in, ifc->out, ifc->inerr, ifc->outerr, ifc->tracedrop,
+				 atomic_read(&ifc->gro_merged), atomic_read(&ifc->gro_chains),
+				 atomic_read(&ifc->gro_passed));
 
-	rlock(&ifc->rwlock);
+	br_rlock(&ifc->rwlock);
 	for (lifc = ifc->lifc; lifc && n > m; lifc = lifc->next)
 		m += snprintf(state + m, n - m, slineformat,
 					  lifc->local, lifc->mask, lifc->remote,
 					  lifc->validlt, lifc->preflt);
 	if (ifc->lifc == NULL)
 		m += snprintf(state + m, n - m, "\n");
-	runlock(&ifc->rwlock);
+	br_runlock(&ifc->rwlock);
 	return m;
 }
 
@@ -276,14 +278,14 @@ static int ipifclocal(struct conv *c, char *state, int n)
 
 	m = 0;
 
-	rlock(&ifc->rwlock);
+	br_rlock(&ifc->rwlock);
 	for (lifc = ifc->lifc; lifc; lifc = lifc->next) {
 		m += snprintf(state + m, n - m, "%-40.40I ->", lifc->local);
 		for (link = lifc->link; link; link = link->lifclink)
 			m += snprintf(state + m, n - m, " %-40.40I", link->self->a);
 		m += snprintf(state + m, n - m, "\n");
 	}
-	runlock(&ifc->rwlock);
+	br_runlock(&ifc->rwlock);
 	return m;
 }
 
@@ -310,19 +312,19 @@ static void ipifckick(void *x)
 		return;
 
 	ifc = (struct Ipifc *)c->ptcl;
-	if (!canrlock(&ifc->rwlock)) {
+	if (!br_canrlock(&ifc->rwlock)) {
 		freeb(bp);
 		return;
 	}
 	if (waserror()) {
-		runlock(&ifc->rwlock);
+		br_runlock(&ifc->rwlock);
 		nexterror();
 	}
 	if (ifc->m == NULL || ifc->m->pktin == NULL)
 		freeb(bp);
 	else
 		(*ifc->m->pktin) (c->p->f, ifc, bp);
-	runlock(&ifc->rwlock);
+	br_runlock(&ifc->rwlock);
 	poperror();
 }
 
@@ -341,7 +343,7 @@ static void ipifccreate(struct conv *c)
 	ifc->unbinding = 0;
 	ifc->m = NULL;
 	ifc->reassemble = 0;
-	rwinit(&ifc->rwlock);
+	br_init(&ifc->rwlock);
 	/* These are never used, but we might need them if we ever do "unbind on the
 	 * fly" (see ip.h).  Not sure where the code went that used these vars. */
 	spinlock_init(&ifc->idlock);
@@ -437,10 +439,10 @@ static void ipifcadd(struct Ipifc *ifc, char **argv, int argc, int tentative,
 	}
 	if (isv4(ip))
 		tentative = 0;
-	wlock(&ifc->rwlock);
+	br_wlock(&ifc->rwlock);
 	if (waserror()) {
 		warn("Unexpected error thrown: %s", current_errstr());
-		wunlock(&ifc->rwlock);
+		br_wunlock(&ifc->rwlock);
 		nexterror();
 	}
 
@@ -555,7 +557,7 @@ static void ipifcadd(struct Ipifc *ifc, char **argv, int argc, int tentative,
 		(*ifc->m->areg) (ifc, ip);
 
 out:
-	wunlock(&ifc->rwlock);
+	br_wunlock(&ifc->rwlock);
 	if (tentative && sendnbrdisc)
 		icmpns(f, 0, SRC_UNSPEC, ip, TARG_MULTI, ifc->mac);
 	poperror();
@@ -624,9 +626,9 @@ static void ipifcrem(struct Ipifc *ifc, char **argv, int argc)
 	else
 		parseip(rem, argv[3]);
 
-	wlock(&ifc->rwlock);
+	br_wlock(&ifc->rwlock);
 	if (waserror()) {
-		wunlock(&ifc->rwlock);
+		br_wunlock(&ifc->rwlock);
 		nexterror();
 	}
 
@@ -644,7 +646,7 @@ static void ipifcrem(struct Ipifc *ifc, char **argv, int argc)
 
 	ipifcremlifc(ifc, lifc);
 	poperror();
-	wunlock(&ifc->rwlock);
+	br_wunlock(&ifc->rwlock);
 }
 
 /*
@@ -707,14 +709,14 @@ static void ipifcconnect(struct conv *c, char **argv, int argc)
 	if (ifc->m == NULL)
 		error(EFAIL, "ipifc not yet bound to device");
 
-	wlock(&ifc->rwlock);
+	br_wlock(&ifc->rwlock);
 	if (waserror()) {
-		wunlock(&ifc->rwlock);
+		br_wunlock(&ifc->rwlock);
 		nexterror();
 	}
 	while (ifc->lifc)
 		ipifcremlifc(ifc, ifc->lifc);
-	wunlock(&ifc->rwlock);
+	br_wunlock(&ifc->rwlock);
 	poperror();
 
 	ipifcadd(ifc, argv, argc, 0, NULL);
@@ -1509,15 +1511,15 @@ void ipifcaddmulti(struct conv *c, uint8_t * ma, uint8_t * ia)
 		if ((*p)->inuse == 0)
 			continue;
 		ifc = (struct Ipifc *)(*p)->ptcl;
-		wlock(&ifc->rwlock);
+		br_wlock(&ifc->rwlock);
 		if (waserror()) {
-			wunlock(&ifc->rwlock);
+			br_wunlock(&ifc->rwlock);
 			nexterror();
 		}
 		for (lifc = ifc->lifc; lifc; lifc = lifc->next)
 			if (ipcmp(ia, lifc->local) == 0)
 				addselfcache(f, ifc, lifc, ma, Rmulti);
-		wunlock(&ifc->rwlock);
+		br_wunlock(&ifc->rwlock);
 		poperror();
 	}
 }
@@ -1568,15 +1570,15 @@ void ipifcremmulti(struct conv *c, uint8_t * ma, uint8_t * ia)
 			continue;
 
 		ifc = (struct Ipifc *)(*p)->ptcl;
-		wlock(&ifc->rwlock);
+		br_wlock(&ifc->rwlock);
 		if (waserror()) {
-			wunlock(&ifc->rwlock);
+			br_wunlock(&ifc->rwlock);
 			nexterror();
 		}
 		for (lifc = ifc->lifc; lifc; lifc = lifc->next)
 			if (ipcmp(ia, lifc->local) == 0)
 				remselfcache(f, ifc, lifc, ma);
-		wunlock(&ifc->rwlock);
+		br_wunlock(&ifc->rwlock);
 		poperror();
 	}
 
@@ -1615,10 +1617,10 @@ static void ipifcregisterproxy(struct Fs *f, struct Ipifc *ifc, uint8_t * ip)
 			if (nifc == ifc)
 				continue;
 
-			rlock(&nifc->rwlock);
+			br_rlock(&nifc->rwlock);
 			m = nifc->m;
 			if (m == NULL || m->addmulti == NULL) {
-				runlock(&nifc->rwlock);
+				br_runlock(&nifc->rwlock);
 				continue;
 			}
 			for (lifc = nifc->lifc; lifc; lifc = lifc->next) {
@@ -1631,7 +1633,7 @@ static void ipifcregisterproxy(struct Fs *f, struct Ipifc *ifc, uint8_t * ip)
 					break;
 				}
 			}
-			runlock(&nifc->rwlock);
+			br_runlock(&nifc->rwlock);
 		}
 		return;
 	} else {	// V4
@@ -1642,10 +1644,10 @@ static void ipifcregisterproxy(struct Fs *f, struct Ipifc *ifc, uint8_t * ip)
 			if (nifc == ifc)
 				continue;
 
-			rlock(&nifc->rwlock);
+			br_rlock(&nifc->rwlock);
 			m = nifc->m;
 			if (m == NULL || m->areg == NULL) {
-				runlock(&nifc->rwlock);
+				br_runlock(&nifc->rwlock);
 				continue;
 			}
 			for (lifc = nifc->lifc; lifc; lifc = lifc->next) {
@@ -1655,7 +1657,7 @@ static void ipifcregisterproxy(struct Fs *f, struct Ipifc *ifc, uint8_t * ip)
 					break;
 				}
 			}
-			runlock(&nifc->rwlock);
+			br_runlock(&nifc->rwlock);
 		}
 	}
 }
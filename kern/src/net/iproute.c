@@ -36,6 +36,8 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <hash.h>
+#include <percpu.h>
 #include <net/ip.h>
 
 static void walkadd(struct Fs *, struct route **, struct route *);
@@ -48,6 +50,43 @@ struct route *v6freelist;
 rwlock_t routelock;
 uint32_t v4routegeneration, v6routegeneration;
 
+/* Each core caches its recent v4 and v6 lookups in front of the route forests,
+ * mostly for packets whose conv doesn't cache its route (UDP without a connect,
+ * forwarding, ICMP).  Entries are good for one v4routegeneration (or
+ * v6routegeneration), which every route change bumps, and while the route's
+ * ifc binding is current.  We only touch our own core's cache, and lookups
+ * neither block nor happen in IRQ context, so there's no locking. */
+enum {
+	Lv4rcache = 8,
+	Lv6rcache = 8,
+};
+
+struct v4rcache_ent {
+	struct Fs					*f;
+	uint32_t					addr;
+	uint32_t					gen;
+	struct route				*r;
+};
+
+struct v4rcache {
+	struct v4rcache_ent			ents[1 << Lv4rcache];
+};
+
+static DEFINE_PERCPU(struct v4rcache, v4rcache);
+
+struct v6rcache_ent {
+	struct Fs					*f;
+	uint8_t						addr[IPaddrlen];
+	uint32_t					gen;
+	struct route				*r;
+};
+
+struct v6rcache {
+	struct v6rcache_ent			ents[1 << Lv6rcache];
+};
+
+static DEFINE_PERCPU(struct v6rcache, v6rcache);
+
 /*
  * TODO: Change this to a proper release.
  * At the moment this is difficult to do since deleting
@@ -524,15 +563,26 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
 	struct route *p, *q;
-	uint32_t la;
+	uint32_t la, gen;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
+	struct v4rcache_ent *ce;
 
 	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
 		&& c->rgen == v4routegeneration)
 		return c->r;
 
 	la = nhgetl(a);
+	/* Read the generation before walking, so a concurrent change invalidates
+	 * what we cache. */
+	gen = READ_ONCE(v4routegeneration);
+	ce = &PERCPU_VAR(v4rcache).ents[hash_32(la, Lv4rcache)];
+	if (ce->f == f && ce->addr == la && ce->gen == gen) {
+		q = ce->r;
+		if (q->rt.ifc != NULL && q->rt.ifcid == q->rt.ifc->ifcid)
+			goto out;
+	}
+
 	q = NULL;
 	for (p = f->v4root[V4H(la)]; p;)
 		if (la >= p->v4.address) {
@@ -556,10 +606,17 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 		q->rt.ifc = ifc;
 		q->rt.ifcid = ifc->ifcid;
 	}
+	if (q) {
+		ce->f = f;
+		ce->addr = la;
+		ce->gen = gen;
+		ce->r = q;
+	}
 
+out:
 	if (c != NULL) {
 		c->r = q;
-		c->rgen = v4routegeneration;
+		c->rgen = gen;
 	}
 
 	return q;
@@ -568,11 +625,12 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 {
 	struct route *p, *q;
-	uint32_t la[IPllen];
+	uint32_t la[IPllen], gen;
 	int h;
 	uint32_t x, y;
 	uint8_t gate[IPaddrlen];
 	struct Ipifc *ifc;
+	struct v6rcache_ent *ce;
 
 	if (memcmp(a, v4prefix, IPv4off) == 0) {
 		q = v4lookup(f, a + IPv4off, c);
@@ -587,6 +645,15 @@ struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 	for (h = 0; h < IPllen; h++)
 		la[h] = nhgetl(a + 4 * h);
 
+	gen = READ_ONCE(v6routegeneration);
+	ce = &PERCPU_VAR(v6rcache).ents[hash_32(la[0] ^ la[1] ^ la[2] ^ la[3],
+	                                        Lv6rcache)];
+	if (ce->f == f && ce->gen == gen && !memcmp(ce->addr, a, IPaddrlen)) {
+		q = ce->r;
+		if (q->rt.ifc != NULL && q->rt.ifcid == q->rt.ifc->ifcid)
+			goto out;
+	}
+
 	q = 0;
 	for (p = f->v6root[V6H(la)]; p;) {
 		for (h = 0; h < IPllen; h++) {
@@ -628,9 +695,17 @@ next:	;
 		q->rt.ifc = ifc;
 		q->rt.ifcid = ifc->ifcid;
 	}
+	if (q) {
+		ce->f = f;
+		memcpy(ce->addr, a, IPaddrlen);
+		ce->gen = gen;
+		ce->r = q;
+	}
+
+out:
 	if (c != NULL) {
 		c->r = q;
-		c->rgen = v6routegeneration;
+		c->rgen = gen;
 	}
 
 	return q;
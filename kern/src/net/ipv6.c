@@ -38,7 +38,7 @@ enum {
 	IP_DF = 0x4000,	/* Don't fragment */
 	IP_MF = 0x2000,	/* More fragments */
 	IP6FHDR = 8,	/* sizeof(Fraghdr6) */
-	IP_MAX = (32 * 1024),	/* Maximum Internet packet size */
+	IP_MAX = (64 * 1024),	/* Maximum Internet packet size */
 };
 
 #define IPV6CLASS(hdr) ((hdr->vcf[0]&0x0F)<<2 | (hdr->vcf[1]&0xF0)>>2)
@@ -54,6 +54,7 @@ struct block *ip6reassemble(struct IP *, int unused_int, struct block *,
                             struct ip6hdr *);
 void ipfragfree6(struct IP *, struct fragment6 *);
 struct fragment6 *ipfragallo6(struct IP *);
+static bool ip6_has_xtns(uint8_t nexthdr);
 static struct block *procxtns(struct IP *ip, struct block *bp, int doreasm);
 int unfraglen(struct block *bp, uint8_t * nexthdr, int setfh);
 struct block *procopts(struct block *bp);
@@ -130,11 +131,9 @@ struct Ipfrag {
 
 /* an instance of IP */
 struct IP {
-	uint32_t stats[Nstats];
+	uint64_t *stats;			/* percpu, see netstats_alloc() */
 
-	qlock_t fraglock4;
-	struct fragment4 *flisthead4;
-	struct fragment4 *fragfree4;
+	struct frag4_table *frag4;
 	int id4;
 
 	qlock_t fraglock6;
@@ -169,7 +168,7 @@ int ipoput6(struct Fs *f, struct block *bp,
 	/* Fill out the ip header */
 	eh = (struct ip6hdr *)(bp->rp);
 
-	ip->stats[OutRequests]++;
+	netstat_inc(ip->stats, OutRequests);
 
 	/* Number of uint8_ts in data and ip header to write */
 	len = blocklen(bp);
@@ -183,7 +182,7 @@ int ipoput6(struct Fs *f, struct block *bp,
 	if (gating) {
 		chunk = nhgets(eh->ploadlen);
 		if (chunk > len) {
-			ip->stats[OutDiscards]++;
+			netstat_inc(ip->stats, OutDiscards);
 			netlog(f, Logip, "short gated packet\n");
 			goto free;
 		}
@@ -192,14 +191,14 @@ int ipoput6(struct Fs *f, struct block *bp,
 	}
 
 	if (len >= IP_MAX) {
-		ip->stats[OutDiscards]++;
+		netstat_inc(ip->stats, OutDiscards);
 		netlog(f, Logip, "exceeded ip max size %I\n", eh->dst);
 		goto free;
 	}
 
 	r = v6lookup(f, eh->dst, c);
 	if (r == NULL) {
-		ip->stats[OutNoRoutes]++;
+		netstat_inc(ip->stats, OutNoRoutes);
 		netlog(f, Logip, "no interface %I\n", eh->dst);
 		rv = -1;
 		goto free;
@@ -224,12 +223,12 @@ int ipoput6(struct Fs *f, struct block *bp,
 		eh->vcf[1] = (tos << 4);
 	}
 
-	if (!canrlock(&ifc->rwlock)) {
+	if (!br_canrlock(&ifc->rwlock)) {
 		goto free;
 	}
 
 	if (waserror()) {
-		runlock(&ifc->rwlock);
+		br_runlock(&ifc->rwlock);
 		nexterror();
 	}
 
@@ -237,12 +236,13 @@ int ipoput6(struct Fs *f, struct block *bp,
 		goto raise;
 	}
 
-	/* If we dont need to fragment just send it */
+	/* If we dont need to fragment just send it.  TSO blocks get cut up by the
+	 * device or the medium. */
 	medialen = ifc->maxtu - ifc->m->hsize;
-	if (len <= medialen) {
+	if (bp->flag & Btso || len <= medialen) {
 		hnputs(eh->ploadlen, len - IPV6HDR_LEN);
 		ifc->m->bwrite(ifc, bp, V6, gate);
-		runlock(&ifc->rwlock);
+		br_runlock(&ifc->rwlock);
 		poperror();
 		return 0;
 	}
@@ -254,17 +254,20 @@ int ipoput6(struct Fs *f, struct block *bp,
 			 * we fragment if ifc->reassemble is turned on; an exception
 			 * needed for nat.
 			 */
-			ip->stats[OutDiscards]++;
+			netstat_inc(ip->stats, OutDiscards);
 			icmppkttoobig6(f, ifc, bp);
 			netlog(f, Logip, "%I: gated pkts not fragmented\n", eh->dst);
 			goto raise;
 		}
 
+	/* compute tcp/udp checksum in software before fragmenting */
+	ptclcsum_finalize(bp, 0);
+
 	/* start v6 fragmentation */
 	uflen = unfraglen(bp, &nexthdr, 1);
 	if (uflen > medialen) {
-		ip->stats[FragFails]++;
-		ip->stats[OutDiscards]++;
+		netstat_inc(ip->stats, FragFails);
+		netstat_inc(ip->stats, OutDiscards);
 		netlog(f, Logip, "%I: unfragmentable part too big\n", eh->dst);
 		goto raise;
 	}
@@ -272,8 +275,8 @@ int ipoput6(struct Fs *f, struct block *bp,
 	flen = len - uflen;
 	seglen = (medialen - (uflen + IP6FHDR)) & ~7;
 	if (seglen < 8) {
-		ip->stats[FragFails]++;
-		ip->stats[OutDiscards]++;
+		netstat_inc(ip->stats, FragFails);
+		netstat_inc(ip->stats, OutDiscards);
 		netlog(f, Logip, "%I: seglen < 8\n", eh->dst);
 		goto raise;
 	}
@@ -315,8 +318,8 @@ int ipoput6(struct Fs *f, struct block *bp,
 		chunk = seglen;
 		while (chunk) {
 			if (!xp) {
-				ip->stats[OutDiscards]++;
-				ip->stats[FragFails]++;
+				netstat_inc(ip->stats, OutDiscards);
+				netstat_inc(ip->stats, FragFails);
 				freeblist(nb);
 				netlog(f, Logip, "!xp: chunk in v6%d\n", chunk);
 				goto raise;
@@ -334,12 +337,12 @@ int ipoput6(struct Fs *f, struct block *bp,
 		}
 
 		ifc->m->bwrite(ifc, nb, V6, gate);
-		ip->stats[FragCreates]++;
+		netstat_inc(ip->stats, FragCreates);
 	}
-	ip->stats[FragOKs]++;
+	netstat_inc(ip->stats, FragOKs);
 
 raise:
-	runlock(&ifc->rwlock);
+	br_runlock(&ifc->rwlock);
 	poperror();
 free:
 	freeblist(bp);
@@ -357,10 +360,10 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	int tentative;
 	uint8_t v6dst[IPaddrlen];
 	struct IP *ip;
-	struct route *r, *sr;
+	struct route *r;
 
 	ip = f->ip;
-	ip->stats[InReceives]++;
+	netstat_inc(ip->stats, InReceives);
 
 	/*
 	 *  Ensure we have all the header info in the first
@@ -392,7 +395,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 
 	/* Check header version */
 	if (BLKIPVER(bp) != IP_VER6) {
-		ip->stats[InHdrErrors]++;
+		netstat_inc(ip->stats, InHdrErrors);
 		netlog(f, Logip, "ip: bad version 0x%x\n", (h->vcf[0] & 0xF0) >> 2);
 		freeblist(bp);
 		return;
@@ -400,16 +403,17 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 
 	/* route */
 	if (notforme) {
+		struct conv conv;
+
 		if (!ip->iprouting) {
 			freeb(bp);
 			return;
 		}
 		/* don't forward to source's network */
-		sr = v6lookup(f, h->src, NULL);
-		r = v6lookup(f, h->dst, NULL);
-
-		if (r == NULL || sr == r) {
-			ip->stats[OutDiscards]++;
+		conv.r = NULL;
+		r = v6lookup(f, h->dst, &conv);
+		if (r == NULL || r->rt.ifc == ifc) {
+			netstat_inc(ip->stats, OutDiscards);
 			freeblist(bp);
 			return;
 		}
@@ -417,7 +421,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		/* don't forward if packet has timed out */
 		hop = h->ttl;
 		if (hop < 1) {
-			ip->stats[InHdrErrors]++;
+			netstat_inc(ip->stats, InHdrErrors);
 			icmpttlexceeded6(f, ifc, bp);
 			freeblist(bp);
 			return;
@@ -429,31 +433,32 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		if (bp == NULL)
 			return;
 
-		ip->stats[ForwDatagrams]++;
+		netstat_inc(ip->stats, ForwDatagrams);
 		h = (struct ip6hdr *)(bp->rp);
 		tos = IPV6CLASS(h);
 		hop = h->ttl;
-		ipoput6(f, bp, 1, hop - 1, tos, NULL);
+		ipoput6(f, bp, 1, hop - 1, tos, &conv);
 		return;
 	}
 
-	/* reassemble & process headers if needed */
-	bp = procxtns(ip, bp, 1);
-
-	if (bp == NULL)
-		return;
-
-	h = (struct ip6hdr *)(bp->rp);
+	/* reassemble & process headers if needed.  Most packets have none, and
+	 * go straight to their protocol. */
+	if (ip6_has_xtns(h->proto)) {
+		bp = procxtns(ip, bp, 1);
+		if (bp == NULL)
+			return;
+		h = (struct ip6hdr *)(bp->rp);
+	}
 	proto = h->proto;
 	p = Fsrcvpcol(f, proto);
 	if (p != NULL && p->rcv != NULL) {
-		ip->stats[InDelivers]++;
+		netstat_inc(ip->stats, InDelivers);
 		(*p->rcv) (p, ifc, bp);
 		return;
 	}
 
-	ip->stats[InDiscards]++;
-	ip->stats[InUnknownProtos]++;
+	netstat_inc(ip->stats, InDiscards);
+	netstat_inc(ip->stats, InUnknownProtos);
 	freeblist(bp);
 }
 
@@ -506,6 +511,13 @@ struct fragment6 *ipfragallo6(struct IP *ip)
 	return f;
 }
 
+/* Whether a packet whose first next header is nexthdr has headers for
+ * procxtns() to deal with. */
+static bool ip6_has_xtns(uint8_t nexthdr)
+{
+	return nexthdr == HBH || nexthdr == RH || nexthdr == FH || nexthdr == DOH;
+}
+
 static struct block *procxtns(struct IP *ip, struct block *bp, int doreasm)
 {
 
@@ -606,7 +618,7 @@ struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
 		if (ipcmp(f->src, src) == 0 && ipcmp(f->dst, dst) == 0 && f->id == id)
 			break;
 		if (f->age < NOW) {
-			ip->stats[ReasmTimeout]++;
+			netstat_inc(ip->stats, ReasmTimeout);
 			ipfragfree6(ip, f);
 		}
 	}
@@ -619,7 +631,7 @@ struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
 	if (nhgets(fraghdr->offsetRM) == 0) {	// first frag is also the last
 		if (f != NULL) {
 			ipfragfree6(ip, f);
-			ip->stats[ReasmFails]++;
+			netstat_inc(ip->stats, ReasmFails);
 		}
 		qunlock(&ip->fraglock6);
 		return bp;
@@ -643,7 +655,7 @@ struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
 		f->blist = bp;
 
 		qunlock(&ip->fraglock6);
-		ip->stats[ReasmReqds]++;
+		netstat_inc(ip->stats, ReasmReqds);
 		return NULL;
 	}
 
@@ -739,7 +751,7 @@ struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
 			ih = (struct ip6hdr *)(bl->rp);
 			hnputs(ih->ploadlen, len);
 			qunlock(&ip->fraglock6);
-			ip->stats[ReasmOKs]++;
+			netstat_inc(ip->stats, ReasmOKs);
 			return bl;
 		}
 		pktposn += BKFG(bl)->flen;
@@ -40,6 +40,7 @@
 
 enum {
 	Maxtu = 16 * 1024,
+	Maxread = 64 * 1024,		/* TSO blocks are bigger than Maxtu */
 };
 
 typedef struct LB LB;
@@ -51,6 +52,22 @@ struct LB {
 
 static void loopbackread(void *a);
 
+/* Both ends of a loopback packet are us, so there's no point in checksums or in
+ * segmenting: we advertise TSO, and pass the Btcpck/Budpck the protocols set
+ * on output to their input, which takes them to mean the checksum is good.
+ *
+ * We also deliver packets from TCP sends in the sender's context, instead of
+ * waking loopbackread.  tcpkick() brackets its output with
+ * loopback_defer_begin() and loopback_defer_end(), and our bwrite puts packets
+ * on the kthread's lb_defer list in between.  We can't call ipiput4() from
+ * bwrite itself: the sender holds its conv's qlock, which the receiver's
+ * replies need, and some other sender could be holding the receiver's while it
+ * sends to us.  loopback_defer_end() runs after tcpkick() unlocks, so it holds
+ * nothing.  Whatever the receivers send while it delivers goes on the same
+ * list, so a localhost request and its ACKs and response can all run without a
+ * context switch.  Everything else (timers, replies from loopbackread) goes
+ * through the queue as before. */
+
 static void
 loopbackbind(struct Ipifc *ifc, int unused_int, char **unused_char_pp_t)
 {
@@ -61,6 +78,7 @@ loopbackbind(struct Ipifc *ifc, int unused_int, char **unused_char_pp_t)
 	/* TO DO: make queue size a function of kernel memory */
 	lb->q = qopen(128 * 1024, Qmsg, NULL, NULL);
 	ifc->arg = lb;
+	ifc->feat = NETF_TSO;
 
 	ktask("loopbackread", loopbackread, ifc);
 
@@ -90,12 +108,86 @@ loopbackbwrite(struct Ipifc *ifc, struct block *bp, int unused_int,
 			   uint8_t * unused_uint8_p_t)
 {
 	LB *lb;
+	struct lb_defer *ld = current_kthread->lb_defer;
 
-	ptclcsum_finalize(bp, 0);
+	/* A TSO block is already its own single segment. */
+	bp->flag &= ~Btso;
+	bp->mss = 0;
+	ifc->out++;
+	if (ld && (!ld->ifc || ld->ifc == ifc)) {
+		ld->ifc = ifc;
+		*ld->tail = bp;
+		ld->tail = &bp->list;
+		return;
+	}
 	lb = ifc->arg;
 	if (qpass(lb->q, bp) < 0)
 		ifc->outerr++;
-	ifc->out++;
+}
+
+/* Hands bp to IP, like a device's reader would. */
+static void loopbackiput(struct Ipifc *ifc, struct block *bp)
+{
+	ERRSTACK(1);
+	LB *lb = ifc->arg;
+
+	ifc->in++;
+	if (!br_canrlock(&ifc->rwlock)) {
+		freeb(bp);
+		return;
+	}
+	if (waserror()) {
+		br_runlock(&ifc->rwlock);
+		nexterror();
+	}
+	if (ifc->lifc == NULL) {
+		freeb(bp);
+	} else {
+		ipifc_trace_block(ifc, bp);
+		ipiput4(lb->f, ifc, bp);
+	}
+	br_runlock(&ifc->rwlock);
+	poperror();
+}
+
+/* Starts collecting this kthread's loopback packets on ld, unless an outer
+ * caller already is. */
+void loopback_defer_begin(struct lb_defer *ld)
+{
+	struct kthread *kth = current_kthread;
+
+	ld->active = !kth->lb_defer;
+	if (!ld->active)
+		return;
+	ld->ifc = NULL;
+	ld->head = NULL;
+	ld->tail = &ld->head;
+	kth->lb_defer = ld;
+}
+
+/* Delivers ld's packets, and whatever they lead to.  Call with no locks held,
+ * even on error paths, so that ld doesn't outlive its frame. */
+void loopback_defer_end(struct lb_defer *ld)
+{
+	ERRSTACK(1);
+	struct block *bp;
+
+	if (!ld->active)
+		return;
+	while ((bp = ld->head)) {
+		ld->head = bp->list;
+		if (!ld->head)
+			ld->tail = &ld->head;
+		bp->list = NULL;
+		/* Input errors are the packet's problem, not the sender's. */
+		if (waserror()) {
+			poperror();
+			continue;
+		}
+		loopbackiput(ld->ifc, bp);
+		poperror();
+	}
+	current_kthread->lb_defer = NULL;
 }
 
 static void loopbackread(void *a)
@@ -115,26 +207,10 @@ static void loopbackread(void *a)
 		poperror();
 	}
 	for (;;) {
-		bp = qbread(lb->q, Maxtu);
+		bp = qbread(lb->q, Maxread);
 		if (bp == NULL)
 			continue;
-		ifc->in++;
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(lb->f, ifc, bp);
-		}
-		runlock(&ifc->rwlock);
-		poperror();
+		loopbackiput(ifc, bp);
 	}
 	poperror();
 }
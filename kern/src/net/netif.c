@@ -155,8 +155,12 @@ netifgen(struct chan *c, char *unused_char_p_t, struct dirtab *vp,
 				q.path = Nifstatqid;
 				devdir(c, q, "ifstats", 0, eve.name, 0444, dp);
 				break;
+			case 4:
+				q.path = Nqstatqid;
+				devdir(c, q, "qstats", 0, eve.name, 0444, dp);
+				break;
 			default:
-				i -= 4;
+				i -= 5;
 				if (i >= nif->nfile)
 					return -1;
 				if (nif->f[i] == 0)
@@ -208,6 +212,14 @@ netifgen(struct chan *c, char *unused_char_p_t, struct dirtab *vp,
 			q.path = NETQID(NETID(c->qid.path), Nifstatqid);
 			devdir(c, q, "ifstats", 0, eve.name, 0444, dp);
 			break;
+		case 5:
+			q.path = NETQID(NETID(c->qid.path), Nfilterqid);
+			devdir(c, q, "filter", 0, o, perm, dp);
+			break;
+		case 6:
+			q.path = NETQID(NETID(c->qid.path), Nxskqid);
+			devdir(c, q, "xsk", 0, o, perm, dp);
+			break;
 		default:
 			return -1;
 	}
@@ -233,6 +245,8 @@ struct chan *netifopen(struct ether *nif, struct chan *c, int omode)
 		switch (NETTYPE(c->qid.path)) {
 			case Ndataqid:
 			case Nctlqid:
+			case Nfilterqid:
+			case Nxskqid:
 				id = NETID(c->qid.path);
 				openfile(nif, id);
 				break;
@@ -247,6 +261,8 @@ struct chan *netifopen(struct ether *nif, struct chan *c, int omode)
 		switch (NETTYPE(c->qid.path)) {
 			case Ndataqid:
 			case Nctlqid:
+			case Nfilterqid:
+			case Nxskqid:
 				f = nif->f[id];
 				if (netown(f, current->user.name, omode & 7) < 0)
 					error(EPERM, ERROR_FIXME);
@@ -282,6 +298,89 @@ static int feature_appender(int features, char *p, int sofar)
 	return sofar;
 }
 
+/* Hands back the program that was written, if any. */
+static long netifreadfilter(struct netfile *f, void *a, long n, uint32_t offset)
+{
+	struct bpf_prog *prog;
+	long ret = 0;
+
+	qlock(&f->qlock);
+	prog = f->filter;
+	if (prog)
+		ret = readmem(offset, a, n, prog->insns,
+		              prog->len * sizeof(struct bpf_insn));
+	qunlock(&f->qlock);
+	return ret;
+}
+
+static void netifsetfilter(struct netfile *f, struct bpf_prog *prog)
+{
+	struct bpf_prog *old;
+
+	qlock(&f->qlock);
+	old = f->filter;
+	rcu_assign_pointer(f->filter, prog);
+	qunlock(&f->qlock);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+static long netifreadxsk(struct netfile *f, void *a, long n, uint32_t offset)
+{
+	long ret = 0;
+
+	qlock(&f->qlock);
+	if (f->xsk)
+		ret = xsk_read_stats(f->xsk, a, n, offset);
+	qunlock(&f->qlock);
+	return ret;
+}
+
+/* "xsk NR_FRAMES FRAME_SIZE RING_SIZE", see ros/xsk.h */
+static void netifsetxsk(struct netfile *f, char *p)
+{
+	uint32_t nr_frames, frame_size, ring_size;
+	struct netxsk *x;
+
+	nr_frames = strtoul(p, &p, 0);
+	frame_size = strtoul(p, &p, 0);
+	ring_size = strtoul(p, 0, 0);
+	x = xsk_create(nr_frames, frame_size, ring_size);
+	qlock(&f->qlock);
+	if (f->xsk) {
+		qunlock(&f->qlock);
+		xsk_destroy(x);
+		error(EBUSY, "already have xsk rings");
+	}
+	rcu_assign_pointer(f->xsk, x);
+	qunlock(&f->qlock);
+}
+
+/* One line per hardware queue */
+static long netifqstats(struct ether *nif, void *a, long n, uint32_t offset)
+{
+	struct ether_queue *eq;
+	char *p;
+	int j = 0;
+
+	p = kzmalloc(READSTR, MEM_WAIT);
+	for (int i = 0; i < nif->nr_txq; i++) {
+		eq = &nif->txqs[i];
+		j += snprintf(p + j, READSTR - j,
+		              "txq %d: packets %lu bytes %lu kicks %lu\n", i,
+		              eq->packets, eq->bytes, eq->kicks);
+	}
+	for (int i = 0; i < nif->nr_rxq; i++) {
+		eq = &nif->rxqs[i];
+		j += snprintf(p + j, READSTR - j,
+		              "rxq %d: packets %lu bytes %lu overflows %lu\n", i,
+		              eq->packets, eq->bytes, eq->overflows);
+	}
+	n = readstr(offset, a, n, p);
+	kfree(p);
+	return n;
+}
+
 long
 netifread(struct ether *nif, struct chan *c, void *a, long n,
 	  uint32_t offset)
@@ -296,7 +395,10 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 	switch (NETTYPE(c->qid.path)) {
 		case Ndataqid:
 			f = nif->f[NETID(c->qid.path)];
-			return qread(f->in, a, n);
+			if (c->flag & O_NONBLOCK)
+				return qread_nonblock(f->in, a, n);
+			else
+				return qread(f->in, a, n);
 		case Nctlqid:
 			return readnum(offset, a, n, NETID(c->qid.path), NUMSIZE);
 		case Nstatqid:
@@ -350,6 +452,12 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 			return readnum(offset, a, n, f->type, NUMSIZE);
 		case Nifstatqid:
 			return 0;
+		case Nqstatqid:
+			return netifqstats(nif, a, n, offset);
+		case Nfilterqid:
+			return netifreadfilter(nif->f[NETID(c->qid.path)], a, n, offset);
+		case Nxskqid:
+			return netifreadxsk(nif->f[NETID(c->qid.path)], a, n, offset);
 	}
 	error(EINVAL, ERROR_FIXME);
 	return -1;	/* not reached */
@@ -361,13 +469,17 @@ struct block *netifbread(struct ether *nif, struct chan *c, long n,
 	if ((c->qid.type & QTDIR) || NETTYPE(c->qid.path) != Ndataqid)
 		return devbread(c, n, offset);
 
+	if (c->flag & O_NONBLOCK)
+		return qbread_nonblock(nif->f[NETID(c->qid.path)]->in, n);
 	return qbread(nif->f[NETID(c->qid.path)]->in, n);
 }
 
 /*
  *  make sure this type isn't already in use on this device
  */
-static int typeinuse(struct ether *nif, int type)
+/* Files can share a type if they are all in the same rx queue group (same
+ * rxq_nr), each with its own slice of the flows (rxq_idx). */
+static int typeinuse(struct ether *nif, int type, int rxq_idx, int rxq_nr)
 {
 	struct netfile *f, **fp, **efp;
 
@@ -379,7 +491,9 @@ static int typeinuse(struct ether *nif, int type)
 		f = *fp;
 		if (f == 0)
 			continue;
-		if (f->type == type)
+		if (f->type != type)
+			continue;
+		if (!rxq_nr || f->rxq_nr != rxq_nr || f->rxq_idx == rxq_idx)
 			return 1;
 	}
 	return 0;
@@ -392,10 +506,15 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 {
 	ERRSTACK(1);
 	struct netfile *f;
-	int type;
+	int type, rxq_idx, rxq_nr;
 	char *p, buf[64];
 	uint8_t binaddr[Nmaxaddr];
 
+	/* A whole BPF program, see ros/bpf.h */
+	if (NETTYPE(c->qid.path) == Nfilterqid) {
+		netifsetfilter(nif->f[NETID(c->qid.path)], bpf_prog_load(a, n));
+		return n;
+	}
 	if (NETTYPE(c->qid.path) != Nctlqid)
 		error(EPERM, ERROR_FIXME);
 
@@ -404,6 +523,17 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 	memmove(buf, a, n);
 	buf[n] = 0;
 
+	/* These take the netfile's qlock, which nests outside the nif's. */
+	f = nif->f[NETID(c->qid.path)];
+	if (matchtoken(buf, "nofilter")) {
+		netifsetfilter(f, NULL);
+		return n;
+	}
+	if ((p = matchtoken(buf, "xsk")) != 0) {
+		netifsetxsk(f, p);
+		return n;
+	}
+
 	qlock(&nif->qlock);
 	if (waserror()) {
 		qunlock(&nif->qlock);
@@ -416,10 +546,22 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 		 * auto-negotiation is done and packets will get sent out.  This is
 		 * about the best place to do it. */
 		netif_wait_for_carrier(nif);
-		type = strtol(p, 0, 0);	/* allows any base, though usually hex */
-		if (typeinuse(nif, type))
+		type = strtol(p, &p, 0);	/* allows any base, though usually hex */
+		/* "connect type rxq idx nr": join an rx queue group */
+		rxq_idx = rxq_nr = 0;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if ((p = matchtoken(p, "rxq")) != 0) {
+			rxq_idx = strtol(p, &p, 0);
+			rxq_nr = strtol(p, 0, 0);
+			if (rxq_nr <= 0 || rxq_idx < 0 || rxq_idx >= rxq_nr || type <= 0)
+				error(EINVAL, "bad rx queue %d of %d", rxq_idx, rxq_nr);
+		}
+		if (typeinuse(nif, type, rxq_idx, rxq_nr))
 			error(EBUSY, ERROR_FIXME);
 		f->type = type;
+		f->rxq_idx = rxq_idx;
+		f->rxq_nr = rxq_nr;
 		if (f->type < 0)
 			nif->all++;
 	} else if (matchtoken(buf, "promiscuous")) {
@@ -507,12 +649,13 @@ void netifclose(struct ether *nif, struct chan *c)
 	struct netfile *f;
 	int t;
 	struct netaddr *ap;
+	struct netxsk *xsk = NULL;
 
 	if ((c->flag & COPEN) == 0)
 		return;
 
 	t = NETTYPE(c->qid.path);
-	if (t != Ndataqid && t != Nctlqid)
+	if (t != Ndataqid && t != Nctlqid && t != Nfilterqid && t != Nxskqid)
 		return;
 
 	f = nif->f[NETID(c->qid.path)];
@@ -552,9 +695,22 @@ void netifclose(struct ether *nif, struct chan *c)
 		f->type = 0;
 		f->bridge = 0;
 		f->headersonly = 0;
+		f->rxq_idx = 0;
+		f->rxq_nr = 0;
+		if (f->filter) {
+			kfree_rcu(f->filter, rcu);
+			rcu_assign_pointer(f->filter, NULL);
+		}
+		xsk = f->xsk;
+		rcu_assign_pointer(f->xsk, NULL);
 		qclose(f->in);
 	}
 	qunlock(&f->qlock);
+	if (xsk) {
+		/* etheriq() could still be copying into the rings */
+		synchronize_rcu();
+		xsk_destroy(xsk);
+	}
 }
 
 spinlock_t netlock = SPINLOCK_INITIALIZER;
@@ -776,15 +932,12 @@ static char *netmulti(struct ether *nif, struct netfile *f, uint8_t * addr,
 	return 0;
 }
 
-/* Prints the contents of stats to [va + offset, va + offset + amt). */
-ssize_t linux_ifstat(struct netif_stats *stats, void *va, size_t amt,
-                     off_t offset)
+/* Formats stats into p, which is at least READSTR bytes.  Returns the length,
+ * so drivers can add their own stats after it. */
+size_t linux_ifstat_fmt(struct netif_stats *stats, char *p)
 {
-	char *p;
 	size_t sofar = 0;
-	ssize_t ret;
 
-	p = kzmalloc(READSTR, MEM_WAIT);
 	sofar += snprintf(p + sofar, READSTR - sofar,
 	                  "rx pkts            : %lu\n", stats->rx_packets);
 	sofar += snprintf(p + sofar, READSTR - sofar,
@@ -839,6 +992,18 @@ ssize_t linux_ifstat(struct netif_stats *stats, void *va, size_t amt,
 	                  "tx compressed      : %lu\n", stats->tx_compressed);
 	sofar += snprintf(p + sofar, READSTR - sofar,
 	                  "rx nohandler       : %lu\n", stats->rx_nohandler);
+	return sofar;
+}
+
+/* Prints the contents of stats to [va + offset, va + offset + amt). */
+ssize_t linux_ifstat(struct netif_stats *stats, void *va, size_t amt,
+                     off_t offset)
+{
+	char *p;
+	ssize_t ret;
+
+	p = kzmalloc(READSTR, MEM_WAIT);
+	linux_ifstat_fmt(stats, p);
 	ret = readstr(offset, va, amt, p);
 	kfree(p);
 	return ret;
@@ -38,6 +38,7 @@
 #include <smp.h>
 #include <net/ip.h>
 #include <endian.h>
+#include <umem.h>
 
 static short endian = 1;
 static uint8_t *aendian = (uint8_t *) & endian;
@@ -46,175 +47,169 @@ static uint8_t *aendian = (uint8_t *) & endian;
 
 #ifdef CONFIG_X86
 
-/* $NetBSD: in_cksum.c,v 1.7 1997/09/02 13:18:15 thorpej Exp $ */
+#include <cpu_feat.h>
 
-/*-
- * Copyright (c) 1988, 1992, 1993
- *	The Regents of the University of California.  All rights reserved.
- * Copyright (c) 1996
- *	Matt Thomas <matt@3am-software.com>
+/* x86-64 checksums.  We add 64 bits at a time with adc, which folds the end
+ * around carry into the next add for free.  With ADX, we run two independent
+ * carry chains (adcx on CF, adox on OF), so each add doesn't wait on the
+ * previous one's carry.  Which one we use is decided by the cpu features found
+ * at boot.
  *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce the above copyright
- *    notice, this list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the distribution.
- * 3. All advertising materials mentioning features or use of this software
- *    must display the following acknowledgement:
- *	This product includes software developed by the University of
- *	California, Berkeley and its contributors.
- * 4. Neither the name of the University nor the names of its contributors
- *    may be used to endorse or promote products derived from this software
- *    without specific prior written permission.
+ * The kernel doesn't save the vector registers for itself, so no SSE/AVX.
  *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
- *
- *	@(#)in_cksum.c	8.1 (Berkeley) 6/10/93
- */
+ * x86 doesn't care about alignment, so we sum the buffer in 16 bit words
+ * starting from addr, which is what our callers want, even for odd addrs.  The
+ * words are little endian, so we swap the final sum. */
 
-/*
- * Checksum routine for Internet Protocol family headers
- *    (Portable Alpha version).
- *
- * This routine is very heavily used in the network
- * code and should be modified for each CPU to be as fast as possible.
- */
+/* Adds nr_blks blocks of 64 bytes at p to sum. */
+static uint64_t csum_adc_blocks(const uint8_t *p, size_t nr_blks, uint64_t sum)
+{
+	if (!nr_blks)
+		return sum;
+	asm volatile("	clc\n"
+	             "1:	adcq 0(%[p]), %[sum]\n"
+	             "	adcq 8(%[p]), %[sum]\n"
+	             "	adcq 16(%[p]), %[sum]\n"
+	             "	adcq 24(%[p]), %[sum]\n"
+	             "	adcq 32(%[p]), %[sum]\n"
+	             "	adcq 40(%[p]), %[sum]\n"
+	             "	adcq 48(%[p]), %[sum]\n"
+	             "	adcq 56(%[p]), %[sum]\n"
+	             "	leaq 64(%[p]), %[p]\n"
+	             "	decq %[n]\n"		/* dec leaves CF alone */
+	             "	jnz 1b\n"
+	             "	adcq $0, %[sum]\n"
+	             : [sum] "+r" (sum), [p] "+r" (p), [n] "+r" (nr_blks)
+	             :
+	             : "memory", "cc");
+	return sum;
+}
+
+/* Same, with two carry chains.  The loop control can't touch CF or OF. */
+static uint64_t csum_adx_blocks(const uint8_t *p, size_t nr_blks, uint64_t sum)
+{
+	uint64_t sum2 = 0, zero;
 
-#define ADDCARRY(x)  (x > 65535 ? x -= 65535 : x)
-#define REDUCE32							  \
-    {									  \
-	q_util.q = sum;							  \
-	sum = q_util.s[0] + q_util.s[1] + q_util.s[2] + q_util.s[3];	  \
-    }
-#define REDUCE16							  \
-    {									  \
-	q_util.q = sum;							  \
-	l_util.l = q_util.s[0] + q_util.s[1] + q_util.s[2] + q_util.s[3]; \
-	sum = l_util.s[0] + l_util.s[1];				  \
-	ADDCARRY(sum);							  \
-    }
+	if (!nr_blks)
+		return sum;
+	asm volatile("	xorl %k[zero], %k[zero]\n"	/* clears CF and OF */
+	             "1:	adcxq 0(%[p]), %[sum]\n"
+	             "	adoxq 8(%[p]), %[sum2]\n"
+	             "	adcxq 16(%[p]), %[sum]\n"
+	             "	adoxq 24(%[p]), %[sum2]\n"
+	             "	adcxq 32(%[p]), %[sum]\n"
+	             "	adoxq 40(%[p]), %[sum2]\n"
+	             "	adcxq 48(%[p]), %[sum]\n"
+	             "	adoxq 56(%[p]), %[sum2]\n"
+	             "	leaq 64(%[p]), %[p]\n"
+	             "	leaq -1(%[n]), %[n]\n"
+	             "	jrcxz 2f\n"
+	             "	jmp 1b\n"
+	             "2:	adcxq %[zero], %[sum]\n"
+	             "	adoxq %[zero], %[sum2]\n"
+	             : [sum] "+r" (sum), [sum2] "+r" (sum2), [p] "+r" (p),
+	               [n] "+c" (nr_blks), [zero] "=&r" (zero)
+	             :
+	             : "memory", "cc");
+	sum += sum2;
+	return sum + (sum < sum2);
+}
 
-static const uint32_t in_masks[] = {
-	/*0 bytes*/ /*1 byte*/	/*2 bytes*/ /*3 bytes*/
-	0x00000000, 0x000000FF, 0x0000FFFF, 0x00FFFFFF,	/* offset 0 */
-	0x00000000, 0x0000FF00, 0x00FFFF00, 0xFFFFFF00,	/* offset 1 */
-	0x00000000, 0x00FF0000, 0xFFFF0000, 0xFFFF0000,	/* offset 2 */
-	0x00000000, 0xFF000000, 0xFF000000, 0xFF000000,	/* offset 3 */
-};
+/* Copies nr_blks blocks of 32 bytes from src to dst, adding them to sum. */
+static uint64_t csum_copy_adc_blocks(uint8_t *dst, const uint8_t *src,
+                                     size_t nr_blks, uint64_t sum)
+{
+	uint64_t t0, t1, t2, t3;
 
-union l_util {
-	uint16_t s[2];
-	uint32_t l;
-};
-union q_util {
-	uint16_t s[4];
-	uint32_t l[2];
-	uint64_t q;
-};
+	if (!nr_blks)
+		return sum;
+	asm volatile("	clc\n"
+	             "1:	movq 0(%[src]), %[t0]\n"
+	             "	movq 8(%[src]), %[t1]\n"
+	             "	movq 16(%[src]), %[t2]\n"
+	             "	movq 24(%[src]), %[t3]\n"
+	             "	movq %[t0], 0(%[dst])\n"
+	             "	movq %[t1], 8(%[dst])\n"
+	             "	movq %[t2], 16(%[dst])\n"
+	             "	movq %[t3], 24(%[dst])\n"
+	             "	adcq %[t0], %[sum]\n"
+	             "	adcq %[t1], %[sum]\n"
+	             "	adcq %[t2], %[sum]\n"
+	             "	adcq %[t3], %[sum]\n"
+	             "	leaq 32(%[src]), %[src]\n"
+	             "	leaq 32(%[dst]), %[dst]\n"
+	             "	decq %[n]\n"
+	             "	jnz 1b\n"
+	             "	adcq $0, %[sum]\n"
+	             : [sum] "+r" (sum), [src] "+r" (src), [dst] "+r" (dst),
+	               [n] "+r" (nr_blks), [t0] "=&r" (t0), [t1] "=&r" (t1),
+	               [t2] "=&r" (t2), [t3] "=&r" (t3)
+	             :
+	             : "memory", "cc");
+	return sum;
+}
 
-static uint64_t
-in_cksumdata(const void *buf, int len)
+static inline uint64_t csum_add64(uint64_t sum, uint64_t x)
 {
-	const uint32_t *lw = (const uint32_t *) buf;
-	uint64_t sum = 0;
-	uint64_t prefilled;
-	int offset;
-	union q_util q_util;
+	sum += x;
+	return sum + (sum < x);
+}
 
-	if ((3 & (long) lw) == 0 && len == 20) {
-	     sum = (uint64_t) lw[0] + lw[1] + lw[2] + lw[3] + lw[4];
-	     REDUCE32;
-	     return sum;
-	}
+/* Sums the last len < 64 bytes, copying them to dst, if dst. */
+static uint64_t csum_tail(uint8_t *dst, const uint8_t *p, size_t len,
+                          uint64_t sum)
+{
+	uint64_t w;
 
-	if ((offset = 3 & (long) lw) != 0) {
-		const uint32_t *masks = in_masks + (offset << 2);
-		lw = (uint32_t *) (((long) lw) - offset);
-		sum = *lw++ & masks[len >= 3 ? 3 : len];
-		len -= 4 - offset;
-		if (len <= 0) {
-			REDUCE32;
-			return sum;
-		}
-	}
-#if 0
-	/*
-	 * Force to cache line boundary.
-	 */
-	offset = 32 - (0x1f & (long) lw);
-	if (offset < 32 && len > offset) {
-		len -= offset;
-		if (4 & offset) {
-			sum += (uint64_t) lw[0];
-			lw += 1;
-		}
-		if (8 & offset) {
-			sum += (uint64_t) lw[0] + lw[1];
-			lw += 2;
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		if (dst) {
+			memcpy(dst, &w, 8);
+			dst += 8;
 		}
-		if (16 & offset) {
-			sum += (uint64_t) lw[0] + lw[1] + lw[2] + lw[3];
-			lw += 4;
-		}
-	}
-#endif
-	/*
-	 * access prefilling to start load of next cache line.
-	 * then add current cache line
-	 * save result of prefilling for loop iteration.
-	 */
-	prefilled = lw[0];
-	while ((len -= 32) >= 4) {
-		uint64_t prefilling = lw[8];
-		sum += prefilled + lw[1] + lw[2] + lw[3]
-			+ lw[4] + lw[5] + lw[6] + lw[7];
-		lw += 8;
-		prefilled = prefilling;
-	}
-	if (len >= 0) {
-		sum += prefilled + lw[1] + lw[2] + lw[3]
-			+ lw[4] + lw[5] + lw[6] + lw[7];
-		lw += 8;
-	} else {
-		len += 32;
+		sum = csum_add64(sum, w);
 	}
-	while ((len -= 16) >= 0) {
-		sum += (uint64_t) lw[0] + lw[1] + lw[2] + lw[3];
-		lw += 4;
+	if (len) {
+		w = 0;
+		memcpy(&w, p, len);
+		if (dst)
+			memcpy(dst, p, len);
+		sum = csum_add64(sum, w);
 	}
-	len += 16;
-	while ((len -= 4) >= 0) {
-		sum += (uint64_t) *lw++;
-	}
-	len += 4;
-	if (len > 0)
-		sum += (uint64_t) (in_masks[len] & *lw);
-	REDUCE32;
 	return sum;
 }
-uint16_t ptclbsum(uint8_t * addr, int len)
+
+static uint16_t csum_fold64(uint64_t sum)
 {
-	uint64_t sum = in_cksumdata(addr, len);
-	union q_util q_util;
-	union l_util l_util;
-	if ((uintptr_t)addr & 1)
-		sum <<= 8;
-	REDUCE16;
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
 	return cpu_to_be16(sum);
 }
+
+uint16_t ptclbsum(uint8_t *addr, int len)
+{
+	uint64_t sum;
+
+	if (cpu_has_feat(CPU_FEAT_X86_ADX))
+		sum = csum_adx_blocks(addr, len / 64, 0);
+	else
+		sum = csum_adc_blocks(addr, len / 64, 0);
+	sum = csum_tail(NULL, addr + ROUNDDOWN(len, 64), len % 64, sum);
+	return csum_fold64(sum);
+}
+
+/* Copies len bytes from src to dst, returning ptclbsum(src, len). */
+uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len)
+{
+	uint64_t sum;
+
+	sum = csum_copy_adc_blocks(dst, src, len / 32, 0);
+	sum = csum_tail(dst + ROUNDDOWN(len, 32), src + ROUNDDOWN(len, 32),
+	                len % 32, sum);
+	return csum_fold64(sum);
+}
 #else
 uint16_t ptclbsum(uint8_t * addr, int len)
 {
@@ -282,4 +277,37 @@ uint16_t ptclbsum(uint8_t * addr, int len)
 
 	return losum & 0xffff;
 }
+
+uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len)
+{
+	memcpy(dst, src, len);
+	return ptclbsum(src, len);
+}
 #endif
+
+/* Must be even, so every chunk's sum lines up with the first's. */
+#define CSUM_USER_CHUNK		2048
+
+/* Copies len bytes from the user's src to dst, returning ptclbsum(dst, len), or
+ * -1 if src faults.  Call it in the user's address space.  The copy needs the
+ * fault-safe string ops, so we can't fold it into the summing loop like
+ * ptclbsum_copy() does.  Instead, we copy a chunk at a time and sum it while it
+ * is still in the cache. */
+int ptclbsum_copy_from_user(uint8_t *dst, const uint8_t *src, int len)
+{
+	uint64_t sum = 0;
+	int x;
+
+	while (len) {
+		x = MIN(len, CSUM_USER_CHUNK);
+		if (copy_from_user(dst, src, x))
+			return -1;
+		sum += ptclbsum(dst, x);
+		dst += x;
+		src += x;
+		len -= x;
+	}
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
@@ -36,6 +36,7 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <alarm.h>
 #include <net/ip.h>
 #include <net/tcp.h>
 
@@ -66,6 +67,9 @@ static char *statnames[] = {
 	[HlenErrs] "HlenErrs",
 	[LenErrs] "LenErrs",
 	[OutOfOrder] "OutOfOrder",
+	[SynCookiesSent] "SynCookiesSent",
+	[SynCookiesRecv] "SynCookiesRecv",
+	[SynCookiesFailed] "SynCookiesFailed",
 };
 
 /*
@@ -98,9 +102,27 @@ static void tcprxmit(struct conv *);
 static void tcpsettimer(Tcpctl *);
 static void tcpsynackrtt(struct conv *);
 static void tcpsetscale(struct conv *, Tcpctl *, uint16_t, uint16_t);
-static void tcp_loss_event(struct conv *s, Tcpctl *tcb);
+static void tcp_loss_event(struct conv *s, Tcpctl *tcb, bool rto);
 static uint16_t derive_payload_mss(Tcpctl *tcb);
 static void set_in_flight(Tcpctl *tcb);
+static void tcp_rack_timeout(void *arg);
+static void tcp_tlp_timeout(void *arg);
+static void rack_free(Tcpctl *tcb);
+static void tcp_cc_set(struct conv *s, Tcpctl *tcb, struct tcp_cc_ops *cc);
+static void tcp_pacer_alarm(struct alarm_waiter *waiter);
+static uint64_t tcptimer_left(struct tcppriv *priv, Tcptimer *t);
+static bool tcp_pace_wait(struct conv *s, Tcpctl *tcb);
+static void tcp_pace_sent(Tcpctl *tcb, uint32_t ssize);
+static uint32_t tcp_pace_tso_max(Tcpctl *tcb, uint16_t payload_mss);
+
+/* The pacer's alarm, which kicks tcpoutput() when the next paced segment may
+ * leave.  Since the alarm can still be on a tchain when the conv is reused, this
+ * lives outside the tcb.  Convs (and these) are never freed. */
+struct tcp_pacer {
+	struct alarm_waiter waiter;
+	struct conv *s;
+	bool armed;					/* protected by the conv's qlock */
+};
 
 static void limborexmit(struct Proto *);
 static void limbo(struct conv *, uint8_t *unused_uint8_p_t, uint8_t *, Tcp *,
@@ -121,9 +143,9 @@ static void tcpsetstate(struct conv *s, uint8_t newstate)
 		return;
 
 	if (oldstate == Established)
-		tpriv->stats[CurrEstab]--;
+		netstat_dec(tpriv->stats, CurrEstab);
 	if (newstate == Established)
-		tpriv->stats[CurrEstab]++;
+		netstat_inc(tpriv->stats, CurrEstab);
 
 	/**
 	print( "%d/%d %s->%s CurrEstab=%d\n", s->lport, s->rport,
@@ -154,6 +176,12 @@ static void tcpconnect(struct conv *c, char **argv, int argc)
 	tcpstart(c, TCP_CONNECT);
 }
 
+static char *tcp_quickack_modes[] = {
+	[TCP_QUICKACK_AUTO] "auto",
+	[TCP_QUICKACK_ON] "on",
+	[TCP_QUICKACK_OFF] "off",
+};
+
 static int tcpstate(struct conv *c, char *state, int n)
 {
 	Tcpctl *s;
@@ -161,14 +189,20 @@ static int tcpstate(struct conv *c, char *state, int n)
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %llu rto %u spurious_rto %u rack_lost %u tlp %u cc %s pacing_rate %llu paced %u quickack %s ackevery %u quickacks %u delacks %u\n",
 					tcpstates[s->state],
 					c->rq ? qlen(c->rq) : 0,
 					c->wq ? qlen(c->wq) : 0,
 					s->srtt, s->mdev,
 					s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
-					s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-					s->katimer.start, s->katimer.count);
+					s->snd.scale, s->timer.start,
+					tcptimer_left(c->p->priv, &s->timer), s->rerecv,
+					s->katimer.start, tcptimer_left(c->p->priv, &s->katimer),
+					s->rack.nr_rto,
+					s->rack.nr_spurious_rto, s->rack.nr_lost, s->rack.nr_tlp,
+					s->cc ? s->cc->name : "none", s->pacing_rate, s->nr_paced,
+					tcp_quickack_modes[s->ack.mode], s->ack.every,
+					s->ack.nr_quickacks, s->ack.nr_delacks);
 }
 
 static int tcpinuse(struct conv *c)
@@ -258,12 +292,16 @@ static void tcpkick(void *x)
 	ERRSTACK(1);
 	struct conv *s = x;
 	Tcpctl *tcb;
+	struct lb_defer ld;
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	/* Segments to a local conv get delivered once we unlock. */
+	loopback_defer_begin(&ld);
 	qlock(&s->qlock);
 	if (waserror()) {
 		qunlock(&s->qlock);
+		loopback_defer_end(&ld);
 		nexterror();
 	}
 
@@ -284,6 +322,7 @@ static void tcpkick(void *x)
 
 	qunlock(&s->qlock);
 	poperror();
+	loopback_defer_end(&ld);
 }
 
 static void tcprcvwin(struct conv *s)
@@ -314,6 +353,50 @@ static void tcprcvwin(struct conv *s)
 		tcb->rcv.blocked = 1;
 }
 
+/* Decides whether the data segment we just got needs an ACK now.  By default
+ * (RFC 1122), we ACK every other segment, and the acktimer gets the rest.
+ *
+ * Quick-ack mode ACKs right away for the first few segments of each message,
+ * which we detect by a turnaround (we sent data since data last came in) or by
+ * the receive side having been idle for an RTO.  That's when the sender is most
+ * likely stuck on our ACK: Nagle holding the tail of a message, or a cwnd that
+ * restarted after idle.  A short, pushed segment is the end of a message, and
+ * our reply can carry its ACK, so that one still waits.
+ *
+ * Bulk receivers, once out of quick-ack, can stretch to an ACK every ack.every
+ * segments.  We don't stretch past half our window, or the sender would stall
+ * waiting for us. */
+static void tcp_rcv_ack(Tcpctl *tcb, Tcp *seg, uint16_t length)
+{
+	uint64_t now = NOW;
+	unsigned int every;
+
+	tcb->rcv.una++;
+	switch (tcb->ack.mode) {
+	case TCP_QUICKACK_ON:
+		tcb->flags |= FORCE;
+		return;
+	case TCP_QUICKACK_AUTO:
+		if (tcb->ack.sent_data ||
+		    now - tcb->ack.last_rcv > tcb->timer.start * MSPTICK)
+			tcb->ack.quickacks = Quickacks;
+		tcb->ack.sent_data = FALSE;
+		tcb->ack.last_rcv = now;
+		if (tcb->ack.quickacks && !((seg->flags & PSH) && length < tcb->mss)) {
+			tcb->ack.quickacks--;
+			tcb->ack.nr_quickacks++;
+			tcb->flags |= FORCE;
+			return;
+		}
+		break;
+	}
+	every = tcb->ack.every;
+	if (every > TCP_ACK_EVERY)
+		every = MAX(TCP_ACK_EVERY, MIN(every, tcb->rcv.wnd / (2 * tcb->mss)));
+	if (tcb->rcv.una >= every)
+		tcb->flags |= FORCE;
+}
+
 static void tcpacktimer(void *v)
 {
 	ERRSTACK(1);
@@ -329,6 +412,13 @@ static void tcpacktimer(void *v)
 		nexterror();
 	}
 	if (tcb->state != Closed) {
+		/* The other side may be waiting on the ACK we delayed, so ACK its next
+		 * few segments right away. */
+		if (tcb->rcv.una) {
+			tcb->ack.nr_delacks++;
+			if (tcb->ack.mode == TCP_QUICKACK_AUTO)
+				tcb->ack.quickacks = Quickacks;
+		}
 		tcb->flags |= FORCE;
 		tcprcvwin(s);
 		tcpoutput(s);
@@ -339,19 +429,27 @@ static void tcpacktimer(void *v)
 
 static void tcpcreate(struct conv *c)
 {
+	Tcpctl *tcb = (Tcpctl *) c->ptcl;
+
 	/* We don't use qio limits.  Instead, TCP manages flow control on its own.
 	 * We only use qpassnolim().  Note for qio that 0 doesn't mean no limit. */
-	c->rq = qopen(0, Qcoalesce, 0, 0);
+	c->rq = qopen(0, Qcoalesce | Qspsc, 0, 0);
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
+	tcb->pacer = kzmalloc(sizeof(struct tcp_pacer), MEM_WAIT);
+	tcb->pacer->s = c;
+	init_awaiter(&tcb->pacer->waiter, tcp_pacer_alarm);
 }
 
-static void timerstate(struct tcppriv *priv, Tcptimer *t, int newstate)
+/* Called with w locked.  Timers that are ON are on w's slot for t->expires. */
+static void timerstate(struct tcp_wheel *w, Tcptimer *t, int newstate)
 {
+	Tcptimer **slot = &w->slots[t->expires & (TCP_WHEEL_SLOTS - 1)];
+
 	if (newstate != TcptimerON) {
 		if (t->state == TcptimerON) {
 			// unchain
-			if (priv->timers == t) {
-				priv->timers = t->next;
+			if (*slot == t) {
+				*slot = t->next;
 				if (t->prev != NULL)
 					panic("timerstate1");
 			}
@@ -367,51 +465,55 @@ static void timerstate(struct tcppriv *priv, Tcptimer *t, int newstate)
 			if (t->prev != NULL || t->next != NULL)
 				panic("timerstate2");
 			t->prev = NULL;
-			t->next = priv->timers;
+			t->next = *slot;
 			if (t->next)
 				t->next->prev = t;
-			priv->timers = t;
+			*slot = t;
 		}
 	}
 	t->state = newstate;
 }
 
+/* Pulls the timers that expire by now off w's current slot, onto timeo. */
+static Tcptimer *tcp_wheel_expire(struct tcp_wheel *w, uint64_t now,
+                                  Tcptimer *timeo)
+{
+	Tcptimer *t, *tp;
+
+	spin_lock(&w->lock);
+	for (t = w->slots[now & (TCP_WHEEL_SLOTS - 1)]; t != NULL; t = tp) {
+		tp = t->next;
+		if (t->expires <= now) {
+			timerstate(w, t, TcptimerDONE);
+			t->readynext = timeo;
+			timeo = t;
+		}
+	}
+	spin_unlock(&w->lock);
+	return timeo;
+}
+
 static void tcpackproc(void *a)
 {
 	ERRSTACK(1);
-	Tcptimer *t, *tp, *timeo;
+	Tcptimer *t, *timeo;
 	struct Proto *tcp;
 	struct tcppriv *priv;
-	int loop;
+	uint64_t now;
 
 	tcp = a;
 	priv = tcp->priv;
 
 	for (;;) {
-		kthread_usleep(MSPTICK * 1000);
+		/* The timers are in units of ticks anyway */
+		kthread_usleep_slack(MSPTICK * 1000, ALARM_SLACK_LAZY);
 
-		qlock(&priv->tl);
+		now = ++priv->ticks;
 		timeo = NULL;
-		loop = 0;
-		for (t = priv->timers; t != NULL; t = tp) {
-			if (loop++ > 10000)
-				panic("tcpackproc1");
-			tp = t->next;
-			if (t->state == TcptimerON) {
-				t->count--;
-				if (t->count == 0) {
-					timerstate(priv, t, TcptimerDONE);
-					t->readynext = timeo;
-					timeo = t;
-				}
-			}
-		}
-		qunlock(&priv->tl);
+		for_each_core(i)
+			timeo = tcp_wheel_expire(&priv->wheels[i], now, timeo);
 
-		loop = 0;
 		for (t = timeo; t != NULL; t = t->readynext) {
-			if (loop++ > 10000)
-				panic("tcpackproc2");
 			if (t->state == TcptimerDONE && t->func != NULL) {
 				/* discard error style */
 				if (!waserror())
@@ -424,25 +526,50 @@ static void tcpackproc(void *a)
 	}
 }
 
+/* Timers stay on the wheel of the core that first armed them, til the tcb is
+ * reset.  That's usually the core handling the conv, and it keeps a timer from
+ * being on two wheels at once. */
 static void tcpgo(struct tcppriv *priv, Tcptimer *t)
 {
+	struct tcp_wheel *w;
+
 	if (t == NULL || t->start == 0)
 		return;
 
-	qlock(&priv->tl);
-	t->count = t->start;
-	timerstate(priv, t, TcptimerON);
-	qunlock(&priv->tl);
+	if (!t->wheel)
+		t->wheel = &priv->wheels[core_id()];
+	w = t->wheel;
+	spin_lock(&w->lock);
+	timerstate(w, t, TcptimerOFF);
+	t->expires = priv->ticks + t->start;
+	timerstate(w, t, TcptimerON);
+	spin_unlock(&w->lock);
 }
 
 static void tcphalt(struct tcppriv *priv, Tcptimer *t)
 {
+	struct tcp_wheel *w;
+
 	if (t == NULL)
 		return;
 
-	qlock(&priv->tl);
-	timerstate(priv, t, TcptimerOFF);
-	qunlock(&priv->tl);
+	w = t->wheel;
+	if (!w) {
+		/* Never armed */
+		t->state = TcptimerOFF;
+		return;
+	}
+	spin_lock(&w->lock);
+	timerstate(w, t, TcptimerOFF);
+	spin_unlock(&w->lock);
+}
+
+/* Ticks til t expires (or would have, if it was halted). */
+static uint64_t tcptimer_left(struct tcppriv *priv, Tcptimer *t)
+{
+	uint64_t now = priv->ticks;
+
+	return t->expires > now ? t->expires - now : 0;
 }
 
 static int backoff(int n)
@@ -466,6 +593,12 @@ static void localclose(struct conv *s, char *reason)
 	tcphalt(tpriv, &tcb->rtt_timer);
 	tcphalt(tpriv, &tcb->acktimer);
 	tcphalt(tpriv, &tcb->katimer);
+	tcphalt(tpriv, &tcb->rack_timer);
+	tcphalt(tpriv, &tcb->tlp_timer);
+	rack_free(tcb);
+	tcb->cc_next = NULL;
+	tcb->ack.mode = TCP_QUICKACK_AUTO;
+	tcb->ack.every = 0;
 
 	/* Flush reassembly queue; nothing more can arrive */
 	for (rp = tcb->reseq; rp != NULL; rp = rp1) {
@@ -486,6 +619,9 @@ static void localclose(struct conv *s, char *reason)
 	/* listener will check the rq state */
 	if (s->state == Announced)
 		rendez_wakeup(&s->listenr);
+	/* If the user is long gone, s is free now (see tcpinuse()). */
+	if (!s->inuse)
+		Fsconvfree(s);
 }
 
 /* mtu (- TCP + IP hdr len) of 1st hop */
@@ -511,12 +647,17 @@ static int tcpmtu(struct Ipifc *ifc, int version, int *scale)
 	return mtu;
 }
 
-static void tcb_check_tso(Tcpctl *tcb)
+/* We build large segments if the device can split them, or if the medium can
+ * do it for the device (GSO). */
+static void tcb_check_tso(struct conv *s, Tcpctl *tcb)
 {
+	struct medium *m;
+
 	/* This can happen if the netdev isn't up yet. */
 	if (!tcb->ifc)
 		return;
-	if (tcb->ifc->feat & NETF_TSO)
+	m = tcb->ifc->m;
+	if ((tcb->ifc->feat & NETF_TSO) || (m && m->gso))
 		tcb->flags |= TSO;
 	else
 		tcb->flags &= ~TSO;
@@ -528,10 +669,24 @@ static void inittcpctl(struct conv *s, int mode)
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
 	int mss;
+	struct tcp_cc_ops *cc;
+	struct tcp_pacer *pacer;
+	uint8_t ack_mode, ack_every;
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	/* Convs are reused.  localclose() frees this, but not every conv gets
+	 * there. */
+	rack_free(tcb);
+	cc = tcb->cc_next ? tcb->cc_next : &tcp_cc_reno;
+	pacer = tcb->pacer;
+	/* The ACK policy could have been set before the conv started */
+	ack_mode = tcb->ack.mode;
+	ack_every = tcb->ack.every ? tcb->ack.every : TCP_ACK_EVERY;
 	memset(tcb, 0, sizeof(Tcpctl));
+	tcb->pacer = pacer;
+	tcb->ack.mode = ack_mode;
+	tcb->ack.every = ack_every;
 
 	tcb->ssthresh = UINT32_MAX;
 	tcb->srtt = tcp_irtt;
@@ -548,6 +703,10 @@ static void inittcpctl(struct conv *s, int mode)
 	tcb->katimer.start = DEF_KAT / MSPTICK;
 	tcb->katimer.func = tcpkeepalive;
 	tcb->katimer.arg = s;
+	tcb->rack_timer.func = tcp_rack_timeout;
+	tcb->rack_timer.arg = s;
+	tcb->tlp_timer.func = tcp_tlp_timeout;
+	tcb->tlp_timer.arg = s;
 
 	mss = DEF_MSS;
 
@@ -591,7 +750,8 @@ static void inittcpctl(struct conv *s, int mode)
 	tcb->rcv.wnd = QMAX;
 	tcb->rcv.scale = 0;
 	tcb->snd.scale = 0;
-	tcb_check_tso(tcb);
+	tcb_check_tso(s, tcb);
+	tcp_cc_set(s, tcb, cc);
 }
 
 /*
@@ -624,13 +784,13 @@ static void tcpstart(struct conv *s, int mode)
 	iphtadd(&tpriv->ht, s);
 	switch (mode) {
 		case TCP_LISTEN:
-			tpriv->stats[PassiveOpens]++;
+			netstat_inc(tpriv->stats, PassiveOpens);
 			tcb->flags |= CLONE;
 			tcpsetstate(s, Listen);
 			break;
 
 		case TCP_CONNECT:
-			tpriv->stats[ActiveOpens]++;
+			netstat_inc(tpriv->stats, ActiveOpens);
 			tcb->flags |= ACTIVE;
 			tcpsndsyn(s, tcb);
 			tcpsetstate(s, Syn_sent);
@@ -806,8 +966,13 @@ static struct block *htontcp6(Tcp *tcph, struct block *data, Tcp6hdr *ph,
 	if (tcb != NULL && tcb->nochecksum) {
 		h->tcpcksum[0] = h->tcpcksum[1] = 0;
 	} else {
-		csum = ptclcsum(data, TCP6_IPLEN, hdrlen + dlen + TCP6_PHDRSIZE);
+		/* Just the pseudo header, like v4.  The NIC or ptclcsum_finalize()
+		 * does the rest. */
+		assert(data->transport_offset == TCP6_IPLEN + TCP6_PHDRSIZE);
+		csum = ~ptclcsum(data, TCP6_IPLEN, TCP6_PHDRSIZE);
 		hnputs(h->tcpcksum, csum);
+		data->tx_csum_offset = ph->tcpcksum - ph->tcpsport;
+		data->flag |= Btcpck;
 	}
 
 	/* move from pseudo header back to normal ip header */
@@ -1069,7 +1234,7 @@ static void sndrst(struct Proto *tcp, uint8_t *source, uint8_t *dest,
 			panic("sndrst: version %d", version);
 	}
 
-	tpriv->stats[OutRsts]++;
+	netstat_inc(tpriv->stats, OutRsts);
 	rflags = RST;
 
 	/* convince the other end that this reset is in band */
@@ -1240,50 +1405,258 @@ static int sndsynack(struct Proto *tcp, Limbo *lp)
 	return 0;
 }
 
-#define hashipa(a, p) ( ( (a)[IPaddrlen-2] + (a)[IPaddrlen-1] + p )&LHTMASK )
+static inline uint64_t rotl64(uint64_t x, int b)
+{
+	return (x << b) | (x >> (64 - b));
+}
+
+#define SIPROUND(v0, v1, v2, v3)                                               \
+do {                                                                           \
+	v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32);              \
+	v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2;                                   \
+	v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0;                                   \
+	v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32);              \
+} while (0)
+
+/* SipHash-2-4 of nr words.  It's cheap enough to do per SYN, and with a secret
+ * key, a flood can't aim at one limbo bucket or forge a cookie. */
+static uint64_t siphash24(const uint64_t *key, const uint64_t *m, int nr)
+{
+	uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+	uint64_t b = (uint64_t)(nr * 8) << 56;
+
+	for (int i = 0; i < nr; i++) {
+		v3 ^= m[i];
+		SIPROUND(v0, v1, v2, v3);
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m[i];
+	}
+	v3 ^= b;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	for (int i = 0; i < 4; i++)
+		SIPROUND(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint64_t tcp_tuple_hash(const uint64_t *key, uint8_t *raddr,
+                               uint16_t rport, uint8_t *laddr, uint16_t lport,
+                               uint64_t extra)
+{
+	uint64_t m[6];
+
+	memcpy(&m[0], raddr, IPaddrlen);
+	memcpy(&m[2], laddr, IPaddrlen);
+	m[4] = ((uint64_t)rport << 16) | lport;
+	m[5] = extra;
+	return siphash24(key, m, ARRAY_SIZE(m));
+}
+
+static uint32_t limbo_hash(struct tcppriv *tpriv, uint8_t *raddr,
+                           uint16_t rport, uint8_t *laddr, uint16_t lport)
+{
+	return tcp_tuple_hash(tpriv->lht_key, raddr, rport, laddr, lport, 0);
+}
+
+static struct limbo_ht *limbo_ht_alloc(unsigned int nr_buckets, int flags)
+{
+	struct limbo_ht *ht;
+
+	ht = kzmalloc(sizeof(struct limbo_ht) +
+	              nr_buckets * sizeof(struct limbo_bucket), flags);
+	if (!ht)
+		return NULL;
+	ht->nr_buckets = nr_buckets;
+	for (int i = 0; i < nr_buckets; i++)
+		qlock_init(&ht->buckets[i].qlock);
+	return ht;
+}
+
+/* Returns hash's bucket, qlocked.  The table won't move til limbo_unlock(). */
+static struct limbo_bucket *limbo_lock(struct tcppriv *tpriv, uint32_t hash)
+{
+	struct limbo_bucket *b;
+
+	rlock(&tpriv->lht_rwl);
+	b = &tpriv->lht->buckets[hash & (tpriv->lht->nr_buckets - 1)];
+	qlock(&b->qlock);
+	return b;
+}
+
+static void limbo_unlock(struct tcppriv *tpriv, struct limbo_bucket *b)
+{
+	qunlock(&b->qlock);
+	runlock(&tpriv->lht_rwl);
+}
+
+/* Returns the link to the call in b, or to the NULL at the end of b. */
+static Limbo **limbo_find(struct limbo_bucket *b, uint8_t *raddr,
+                          uint16_t rport, uint8_t *laddr, uint16_t lport,
+                          uint8_t version)
+{
+	Limbo **l, *lp;
+
+	for (l = &b->head; (lp = *l) != NULL; l = &lp->next) {
+		if (lp->lport == lport && lp->rport == rport && lp->version == version
+		    && !ipcmp(lp->raddr, raddr) && !ipcmp(lp->laddr, laddr))
+			break;
+	}
+	return l;
+}
+
+/* Doubles the limbo hash once it averages two calls a bucket.  Only limborexmit
+ * calls this, so we can look at lht without the lock. */
+static void limbo_grow(struct tcppriv *tpriv)
+{
+	struct limbo_ht *old = tpriv->lht, *new;
+	struct limbo_bucket *b;
+	Limbo *lp;
+
+	if (old->nr_buckets >= Maxlht ||
+	    atomic_read(&tpriv->nlimbo) <= 2 * old->nr_buckets)
+		return;
+	new = limbo_ht_alloc(old->nr_buckets * 2, 0);
+	if (!new)
+		return;
+	wlock(&tpriv->lht_rwl);
+	for (int i = 0; i < old->nr_buckets; i++) {
+		while ((lp = old->buckets[i].head)) {
+			old->buckets[i].head = lp->next;
+			b = &new->buckets[lp->hash & (new->nr_buckets - 1)];
+			lp->next = b->head;
+			b->head = lp;
+		}
+	}
+	tpriv->lht = new;
+	wunlock(&tpriv->lht_rwl);
+	kfree(old);
+}
+
+/* The MSSs a SYN cookie can tell us the other side asked for */
+static const uint16_t syncookie_mss[] = {
+	536, 1220, 1300, 1440, 1460, 4312, 8960, 9000
+};
+
+/* A SYN cookie is the ISS of our SYN ACK:
+ *	bits 31-27: the low bits of the period, NOW / SYNCOOKIE_PERIOD
+ *	bits 26-24: the index in syncookie_mss
+ *	bits 23-0: a keyed hash of the 4-tuple, the whole period, and their ISS
+ * There's no room for window scaling or SACK, so cookie calls go without. */
+static uint32_t syncookie_make(struct tcppriv *tpriv, uint8_t *raddr,
+                               uint16_t rport, uint8_t *laddr, uint16_t lport,
+                               uint32_t irs, uint64_t period, int mss_idx)
+{
+	uint64_t h;
+
+	h = tcp_tuple_hash(tpriv->syncookie_key, raddr, rport, laddr, lport,
+	                   (period << 32) | irs);
+	return ((period & 0x1f) << 27) | (mss_idx << 24) | (h & 0xffffff);
+}
+
+/* Answers a SYN with a cookie, instead of putting the call in limbo. */
+static void syncookie_synack(struct Proto *tcp, uint8_t *source, uint8_t *dest,
+                             Tcp *seg, int version)
+{
+	struct tcppriv *tpriv = tcp->priv;
+	Limbo lp;
+	int mss_idx;
+
+	for (mss_idx = ARRAY_SIZE(syncookie_mss) - 1; mss_idx > 0; mss_idx--) {
+		if (seg->mss >= syncookie_mss[mss_idx])
+			break;
+	}
+	memset(&lp, 0, sizeof(lp));
+	lp.version = version;
+	ipmove(lp.laddr, dest);
+	ipmove(lp.raddr, source);
+	lp.lport = seg->dest;
+	lp.rport = seg->source;
+	lp.irs = seg->seq;
+	lp.ts_val = seg->ts_val;
+	lp.iss = syncookie_make(tpriv, source, seg->source, dest, seg->dest,
+	                        seg->seq, NOW / SYNCOOKIE_PERIOD, mss_idx);
+	if (sndsynack(tcp, &lp) < 0)
+		return;
+	tpriv->last_syncookie = lp.lastsend;
+	netstat_inc(tpriv->stats, SynCookiesSent);
+}
+
+/* If segp ACKs one of our cookies, fills in lp as if the call was in limbo. */
+static bool syncookie_check(struct Proto *tcp, Tcp *segp, uint8_t *src,
+                            uint8_t *dst, uint8_t version, Limbo *lp)
+{
+	struct tcppriv *tpriv = tcp->priv;
+	uint32_t cookie = segp->ack - 1;
+	uint32_t irs = segp->seq - 1;
+	int mss_idx = (cookie >> 24) & 0x7;
+	uint64_t now = NOW;
+	uint64_t period, age;
+
+	/* Don't hash every stray ACK when we haven't sent cookies lately. */
+	if (now - tpriv->last_syncookie > 2 * SYNCOOKIE_PERIOD)
+		return FALSE;
+	now /= SYNCOOKIE_PERIOD;
+	age = (now - (cookie >> 27)) & 0x1f;
+	period = now - age;
+	if (age > 1 || syncookie_make(tpriv, src, segp->source, dst, segp->dest,
+	                              irs, period, mss_idx) != cookie) {
+		netstat_inc(tpriv->stats, SynCookiesFailed);
+		return FALSE;
+	}
+	memset(lp, 0, sizeof(Limbo));
+	lp->version = version;
+	ipmove(lp->laddr, dst);
+	ipmove(lp->raddr, src);
+	lp->lport = segp->dest;
+	lp->rport = segp->source;
+	lp->irs = irs;
+	lp->iss = cookie;
+	lp->mss = syncookie_mss[mss_idx];
+	lp->ifc = findipifc(tcp->f, dst, 0);
+	netstat_inc(tpriv->stats, SynCookiesRecv);
+	return TRUE;
+}
 
 /*
  *  put a call into limbo and respond with a SYN ACK
  *
- *  called with proto locked
+ *  called without the proto qlock; the bucket's qlock covers the call
  */
 static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
                   int version)
 {
 	Limbo *lp, **l;
 	struct tcppriv *tpriv;
-	int h;
+	struct limbo_bucket *b;
+	uint32_t hash;
 
 	tpriv = s->p->priv;
-	h = hashipa(source, seg->source);
-
-	for (l = &tpriv->lht[h]; *l != NULL; l = &lp->next) {
-		lp = *l;
-		if (lp->lport != seg->dest || lp->rport != seg->source
-			|| lp->version != version)
-			continue;
-		if (ipcmp(lp->raddr, source) != 0)
-			continue;
-		if (ipcmp(lp->laddr, dest) != 0)
-			continue;
-
+	hash = limbo_hash(tpriv, source, seg->source, dest, seg->dest);
+	b = limbo_lock(tpriv, hash);
+	l = limbo_find(b, source, seg->source, dest, seg->dest, version);
+	lp = *l;
+	if (lp != NULL) {
 		/* each new SYN restarts the retransmits */
 		lp->irs = seg->seq;
-		break;
-	}
-	lp = *l;
-	if (lp == NULL) {
-		if (tpriv->nlimbo >= Maxlimbo && tpriv->lht[h]) {
-			lp = tpriv->lht[h];
-			tpriv->lht[h] = lp->next;
-			lp->next = NULL;
-		} else {
-			lp = kzmalloc(sizeof(*lp), 0);
-			if (lp == NULL)
-				return;
-			tpriv->nlimbo++;
+	} else {
+		if (atomic_read(&tpriv->nlimbo) >= Limbocookie) {
+			limbo_unlock(tpriv, b);
+			syncookie_synack(s->p, source, dest, seg, version);
+			return;
 		}
+		lp = kzmalloc(sizeof(*lp), 0);
+		if (lp == NULL) {
+			limbo_unlock(tpriv, b);
+			return;
+		}
+		atomic_inc(&tpriv->nlimbo);
 		*l = lp;
+		lp->hash = hash;
 		lp->version = version;
 		ipmove(lp->laddr, dest);
 		ipmove(lp->raddr, source);
@@ -1299,9 +1672,10 @@ static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
 
 	if (sndsynack(s->p, lp) < 0) {
 		*l = lp->next;
-		tpriv->nlimbo--;
+		atomic_dec(&tpriv->nlimbo);
 		kfree(lp);
 	}
+	limbo_unlock(tpriv, b);
 }
 
 /*
@@ -1310,38 +1684,49 @@ static void limbo(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
 static void limborexmit(struct Proto *tcp)
 {
 	struct tcppriv *tpriv;
+	struct limbo_ht *ht;
+	struct limbo_bucket *b;
 	Limbo **l, *lp;
-	int h;
-	int seen;
+	int seen, nlimbo;
 	uint64_t now;
 
 	tpriv = tcp->priv;
 
-	if (!canqlock(&tcp->qlock))
-		return;
+	limbo_grow(tpriv);
+	rlock(&tpriv->lht_rwl);
+	ht = tpriv->lht;
 	seen = 0;
 	now = NOW;
-	for (h = 0; h < NLHT && seen < tpriv->nlimbo; h++) {
-		for (l = &tpriv->lht[h]; *l != NULL && seen < tpriv->nlimbo;) {
+	nlimbo = atomic_read(&tpriv->nlimbo);
+	for (int h = 0; h < ht->nr_buckets && seen < nlimbo; h++) {
+		b = &ht->buckets[h];
+		/* Racy peek.  We'll get to a call added after it next time. */
+		if (!b->head || !canqlock(&b->qlock))
+			continue;
+		for (l = &b->head; *l != NULL;) {
 			lp = *l;
 			seen++;
-			if (now - lp->lastsend < (lp->rexmits + 1) * SYNACK_RXTIMER)
+			if (now - lp->lastsend < (lp->rexmits + 1) * SYNACK_RXTIMER) {
+				l = &lp->next;
 				continue;
+			}
 
 			/* time it out after 1 second */
 			if (++(lp->rexmits) > 5) {
-				tpriv->nlimbo--;
+				atomic_dec(&tpriv->nlimbo);
 				*l = lp->next;
 				kfree(lp);
 				continue;
 			}
 
 			/* if we're being attacked, don't bother resending SYN ACK's */
-			if (tpriv->nlimbo > 100)
+			if (nlimbo > 100) {
+				l = &lp->next;
 				continue;
+			}
 
 			if (sndsynack(tcp, lp) < 0) {
-				tpriv->nlimbo--;
+				atomic_dec(&tpriv->nlimbo);
 				*l = lp->next;
 				kfree(lp);
 				continue;
@@ -1349,44 +1734,37 @@ static void limborexmit(struct Proto *tcp)
 
 			l = &lp->next;
 		}
+		qunlock(&b->qlock);
 	}
-	qunlock(&tcp->qlock);
+	runlock(&tpriv->lht_rwl);
 }
 
 /*
  *  lookup call in limbo.  if found, throw it out.
  *
- *  called with proto locked
+ *  called without the proto qlock
  */
 static void limborst(struct conv *s, Tcp *segp, uint8_t *src, uint8_t *dst,
                      uint8_t version)
 {
 	Limbo *lp, **l;
-	int h;
 	struct tcppriv *tpriv;
+	struct limbo_bucket *b;
 
 	tpriv = s->p->priv;
 
 	/* find a call in limbo */
-	h = hashipa(src, segp->source);
-	for (l = &tpriv->lht[h]; *l != NULL; l = &lp->next) {
-		lp = *l;
-		if (lp->lport != segp->dest || lp->rport != segp->source
-			|| lp->version != version)
-			continue;
-		if (ipcmp(lp->laddr, dst) != 0)
-			continue;
-		if (ipcmp(lp->raddr, src) != 0)
-			continue;
-
-		/* RST can only follow the SYN */
-		if (segp->seq == lp->irs + 1) {
-			tpriv->nlimbo--;
-			*l = lp->next;
-			kfree(lp);
-		}
-		break;
+	b = limbo_lock(tpriv, limbo_hash(tpriv, src, segp->source, dst,
+	                                 segp->dest));
+	l = limbo_find(b, src, segp->source, dst, segp->dest, version);
+	lp = *l;
+	/* RST can only follow the SYN */
+	if (lp != NULL && segp->seq == lp->irs + 1) {
+		atomic_dec(&tpriv->nlimbo);
+		*l = lp->next;
+		kfree(lp);
 	}
+	limbo_unlock(tpriv, b);
 }
 
 /* The advertised MSS (e.g. 1460) includes any per-packet TCP options, such as
@@ -1417,8 +1795,9 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	struct tcppriv *tpriv;
 	Tcp4hdr *h4;
 	Tcp6hdr *h6;
-	Limbo *lp, **l;
-	int h;
+	Limbo *lp, **l, cookie_lp;
+	struct limbo_bucket *b;
+	struct tcp_pacer *pacer;
 
 	/* unless it's just an ack, it can't be someone coming out of limbo */
 	if ((segp->flags & SYN) || (segp->flags & ACK) == 0)
@@ -1427,41 +1806,50 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	tpriv = s->p->priv;
 
 	/* find a call in limbo */
-	h = hashipa(src, segp->source);
-	for (l = &tpriv->lht[h]; (lp = *l) != NULL; l = &lp->next) {
-		netlog(s->p->f, Logtcp,
-			   "tcpincoming s %I!%d/%I!%d d %I!%d/%I!%d v %d/%d\n", src,
-			   segp->source, lp->raddr, lp->rport, dst, segp->dest, lp->laddr,
-			   lp->lport, version, lp->version);
-
-		if (lp->lport != segp->dest || lp->rport != segp->source
-			|| lp->version != version)
-			continue;
-		if (ipcmp(lp->laddr, dst) != 0)
-			continue;
-		if (ipcmp(lp->raddr, src) != 0)
-			continue;
-
+	b = limbo_lock(tpriv, limbo_hash(tpriv, src, segp->source, dst,
+	                                 segp->dest));
+	l = limbo_find(b, src, segp->source, dst, segp->dest, version);
+	lp = *l;
+	if (lp != NULL) {
 		/* we're assuming no data with the initial SYN */
 		if (segp->seq != lp->irs + 1 || segp->ack != lp->iss + 1) {
 			netlog(s->p->f, Logtcp, "tcpincoming s 0x%lx/0x%lx a 0x%lx 0x%lx\n",
 				   segp->seq, lp->irs + 1, segp->ack, lp->iss + 1);
 			lp = NULL;
 		} else {
-			tpriv->nlimbo--;
+			atomic_dec(&tpriv->nlimbo);
 			*l = lp->next;
 		}
-		break;
+		limbo_unlock(tpriv, b);
+		if (lp == NULL)
+			return NULL;
+	} else {
+		limbo_unlock(tpriv, b);
+		/* Maybe we answered its SYN with a cookie */
+		if (!syncookie_check(s->p, segp, src, dst, version, &cookie_lp)) {
+			netlog(s->p->f, Logtcp, "tcpincoming no limbo: %I!%d/%I!%d\n",
+			       src, segp->source, dst, segp->dest);
+			return NULL;
+		}
+		lp = &cookie_lp;
 	}
-	if (lp == NULL)
-		return NULL;
 
 	new = Fsnewcall(s, src, segp->source, dst, segp->dest, version);
-	if (new == NULL)
+	if (new == NULL) {
+		if (lp != &cookie_lp)
+			kfree(lp);
 		return NULL;
+	}
 
-	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb = (Tcpctl *) new->ptcl;
+	rack_free(tcb);
+	pacer = tcb->pacer;
+	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
+	memset(&tcb->rack, 0, sizeof(tcb->rack));
+	tcb->pacer = pacer;
+	tcb->cc_next = NULL;
+	tcb->pace_next_us = 0;
+	tcb->nr_paced = 0;
 	tcb->flags &= ~CLONE;
 	tcb->timer.arg = new;
 	tcb->timer.state = TcptimerOFF;
@@ -1471,6 +1859,10 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	tcb->katimer.state = TcptimerOFF;
 	tcb->rtt_timer.arg = new;
 	tcb->rtt_timer.state = TcptimerOFF;
+	tcb->rack_timer.arg = new;
+	tcb->rack_timer.state = TcptimerOFF;
+	tcb->tlp_timer.arg = new;
+	tcb->tlp_timer.state = TcptimerOFF;
 
 	tcb->irs = lp->irs;
 	tcb->rcv.nxt = tcb->irs + 1;
@@ -1500,16 +1892,22 @@ static struct conv *tcpincoming(struct conv *s, Tcp *segp, uint8_t *src,
 	tcb->sack_ok = lp->sack_ok;
 	/* window scaling */
 	tcpsetscale(new, tcb, lp->rcvscale, lp->sndscale);
-	tcb_check_tso(tcb);
+	tcb_check_tso(new, tcb);
 
 	tcb->snd.wnd = segp->wnd;
 	tcb->cwind = tcb->typical_mss * CWIND_SCALE;
 
-	/* set initial round trip time */
-	tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
-	tcpsynackrtt(new);
+	/* set initial round trip time.  We don't know when we sent a cookie, so
+	 * those calls start with the listener's. */
+	if (lp != &cookie_lp) {
+		tcb->sndsyntime = lp->lastsend + lp->rexmits * SYNACK_RXTIMER;
+		tcpsynackrtt(new);
+	}
+	/* Same algorithm as the listener, with its own state */
+	tcp_cc_set(new, tcb, tcb->cc);
 
-	kfree(lp);
+	if (lp != &cookie_lp)
+		kfree(lp);
 
 	/* set up proto header */
 	switch (version) {
@@ -1586,6 +1984,538 @@ static void adjust_tx_qio_limit(struct conv *s)
 	 * actual threshold was.  We want the limit to be the 'stable' cwnd * 2. */
 }
 
+/* RACK-TLP (RFC 8985) loss detection, and PRR (RFC 6937).
+ *
+ * For SACK connections, we keep a scoreboard of the seq space we sent, in the
+ * ranges we sent it, with when we last sent each one and whether it was sacked,
+ * retransmitted, or deemed lost.  Each ACK tells us the most recently sent
+ * range that got delivered.  Anything sent sufficiently earlier than that and
+ * not yet sacked is lost, where sufficiently is an RTT plus a reordering
+ * window.  Unlike counting dupacks or SACKs, that works the same for any size
+ * window, and it catches lost retransmissions too.  Ranges that might be lost
+ * once the reordering window passes are checked again by the RACK timer.
+ *
+ * Losses at the tail of a flight don't get any SACKs, and used to wait for the
+ * RTO.  Instead, after about two RTTs of silence, we send a tail loss probe
+ * (TLP): new data if we have some, o/w the last segment again.  The ACK for the
+ * probe gives RACK something to go on.
+ *
+ * In recovery, PRR paces the sending: we send in proportion to what the
+ * receiver says it got, converging on ssthresh, instead of sending a burst of
+ * retransmits as soon as cwnd allows.
+ *
+ * The scoreboard is allocated on a send when nothing is outstanding.  If that
+ * fails or the conv doesn't do SACK, we use the older dupack and SACK hole
+ * heuristics.  The timers tick every MSPTICK, so RACK's timer is coarse, but it
+ * is only the backstop for reordering. */
+
+static bool rack_on(Tcpctl *tcb)
+{
+	return tcb->rack.segs != NULL;
+}
+
+static uint64_t rack_now(void)
+{
+	return tsc2usec(read_tsc());
+}
+
+static void rack_maybe_init(Tcpctl *tcb)
+{
+	struct tcp_rack *r = &tcb->rack;
+
+	if (r->segs || r->failed || !tcb->sack_ok)
+		return;
+	if (!(tcb->flags & SYNACK) || tcb->snd.una != tcb->snd.nxt)
+		return;
+	r->segs = kmalloc(sizeof(struct rack_seg) * RACK_NR_SEGS, MEM_ATOMIC);
+	if (!r->segs) {
+		r->failed = TRUE;
+		return;
+	}
+	r->lo = r->hi = 0;
+	r->fack = tcb->snd.una;
+	r->end = tcb->snd.una;
+}
+
+static void rack_free(Tcpctl *tcb)
+{
+	kfree(tcb->rack.segs);
+	tcb->rack.segs = NULL;
+}
+
+/* Whether (t1, seq1) was sent after (t2, seq2).  Ranges sent at the same time
+ * (TSO) are ordered by seq. */
+static bool rack_sent_after(uint64_t t1, uint32_t seq1, uint64_t t2,
+                            uint32_t seq2)
+{
+	return t1 > t2 || (t1 == t2 && seq_gt(seq1, seq2));
+}
+
+/* Returns the index of the seg containing seq, or hi if there is none. */
+static unsigned int rack_find(struct tcp_rack *r, uint32_t seq)
+{
+	unsigned int lo = r->lo, hi = r->hi, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (seq_lt(seq, r->segs[mid].seq))
+			hi = mid;
+		else if (seq_ge(seq, r->segs[mid].end))
+			lo = mid + 1;
+		else
+			return mid;
+	}
+	return r->hi;
+}
+
+/* Makes sure there is a free slot at the end.  Returns FALSE if we're full. */
+static bool rack_make_room(struct tcp_rack *r)
+{
+	if (r->hi < RACK_NR_SEGS)
+		return TRUE;
+	if (!r->lo)
+		return FALSE;
+	memmove(r->segs, r->segs + r->lo, sizeof(struct rack_seg) * (r->hi - r->lo));
+	r->hi -= r->lo;
+	r->lo = 0;
+	return TRUE;
+}
+
+/* Splits the seg containing seq, so that one starts at seq.  If we're out of
+ * room, we don't split, and we'll treat the whole seg as one. */
+static void rack_split(struct tcp_rack *r, uint32_t seq)
+{
+	unsigned int i = rack_find(r, seq);
+
+	if (i == r->hi || r->segs[i].seq == seq)
+		return;
+	if (!rack_make_room(r))
+		return;
+	i = rack_find(r, seq);
+	memmove(&r->segs[i + 1], &r->segs[i],
+	        sizeof(struct rack_seg) * (r->hi - i));
+	r->hi++;
+	r->segs[i].end = seq;
+	r->segs[i + 1].seq = seq;
+}
+
+/* Records that we sent [from, to).  New data goes on the end.  If we're out of
+ * room, it joins the last seg, which is only less precise. */
+static void rack_sent(Tcpctl *tcb, uint32_t from, uint32_t to, bool retrans)
+{
+	struct tcp_rack *r = &tcb->rack;
+	struct rack_seg *rs;
+	uint64_t now = rack_now();
+
+	if (!retrans) {
+		if (!rack_make_room(r)) {
+			rs = &r->segs[r->hi - 1];
+			if (rs->flags & RACK_SACKED)
+				r->sacked_bytes -= rs->end - rs->seq;
+		} else {
+			rs = &r->segs[r->hi++];
+			rs->seq = from;
+		}
+		rs->end = to;
+		rs->xmit_us = now;
+		rs->flags = 0;
+		return;
+	}
+	rack_split(r, from);
+	rack_split(r, to);
+	for (unsigned int i = rack_find(r, from); i < r->hi; i++) {
+		rs = &r->segs[i];
+		if (seq_ge(rs->seq, to))
+			break;
+		rs->xmit_us = now;
+		rs->flags = (rs->flags | RACK_RTX) & ~RACK_LOST;
+	}
+}
+
+/* Finds the first run of lost segs, which is what we retransmit next. */
+static bool rack_next_lost(Tcpctl *tcb, uint32_t *from, uint32_t *len)
+{
+	struct tcp_rack *r = &tcb->rack;
+	unsigned int i;
+
+	for (i = r->lo; i < r->hi; i++) {
+		if (r->segs[i].flags & RACK_LOST)
+			break;
+	}
+	if (i == r->hi)
+		return FALSE;
+	*from = r->segs[i].seq;
+	for (; i < r->hi; i++) {
+		if (!(r->segs[i].flags & RACK_LOST))
+			break;
+	}
+	*len = r->segs[i - 1].end - *from;
+	return TRUE;
+}
+
+/* Takes an RTT sample from rs, which was just delivered, and advances RACK's
+ * notion of the most recently sent delivered seg. */
+static void rack_delivered(struct tcp_rack *r, struct rack_seg *rs,
+                           uint64_t now)
+{
+	uint64_t rtt = now - rs->xmit_us;
+
+	if (rs->flags & RACK_RTX) {
+		/* The ACK might be for the original.  If it came back faster than
+		 * possible, it was. */
+		if (!r->min_rtt_us || rtt < r->min_rtt_us)
+			return;
+	} else {
+		if (!r->min_rtt_us || rtt < r->min_rtt_us)
+			r->min_rtt_us = rtt;
+		/* Something below the highest delivered seq arrived, without our
+		 * help: the network reorders. */
+		if (seq_lt(rs->end, r->fack))
+			r->reordering_seen = TRUE;
+	}
+	r->fack = seq_max(r->fack, rs->end);
+	if (rack_sent_after(rs->xmit_us, rs->end, r->xmit_us, r->end)) {
+		r->xmit_us = rs->xmit_us;
+		r->end = rs->end;
+		r->rtt_us = rtt;
+	}
+}
+
+static uint64_t rack_reo_wnd(Tcpctl *tcb)
+{
+	struct tcp_rack *r = &tcb->rack;
+
+	/* Until we've seen reordering, be as quick as the dupack threshold. */
+	if (!r->reordering_seen && (tcb->snd.recovery ||
+	    r->sacked_bytes >= TCPREXMTTHRESH * tcb->typical_mss))
+		return 0;
+	return MIN(r->min_rtt_us / 4, tcb->srtt * 1000ULL);
+}
+
+/* Marks segs lost that were sent an RTT plus the reordering window before the
+ * most recently delivered one.  Arms the RACK timer for any that might be lost
+ * later.  Returns TRUE if we marked any. */
+static bool rack_detect_loss(struct conv *s, Tcpctl *tcb)
+{
+	struct tcp_rack *r = &tcb->rack;
+	struct tcppriv *tpriv = s->p->priv;
+	struct rack_seg *rs;
+	uint64_t now = rack_now();
+	uint64_t reo_wnd = rack_reo_wnd(tcb);
+	uint64_t deadline, timeout = 0;
+	bool lost = FALSE;
+
+	for (unsigned int i = r->lo; i < r->hi; i++) {
+		rs = &r->segs[i];
+		if (rs->flags & (RACK_SACKED | RACK_LOST))
+			continue;
+		if (!rack_sent_after(r->xmit_us, r->end, rs->xmit_us, rs->end))
+			continue;
+		deadline = rs->xmit_us + r->rtt_us + reo_wnd;
+		if (deadline <= now) {
+			rs->flags |= RACK_LOST;
+			r->nr_lost++;
+			lost = TRUE;
+		} else {
+			timeout = MAX(timeout, deadline - now);
+		}
+	}
+	if (timeout) {
+		tcb->rack_timer.start = MAX(DIV_ROUND_UP(timeout, MSPTICK * 1000), 1);
+		tcpgo(tpriv, &tcb->rack_timer);
+	} else {
+		tcphalt(tpriv, &tcb->rack_timer);
+	}
+	return lost;
+}
+
+static void rack_enter_recovery(struct conv *s, Tcpctl *tcb)
+{
+	struct tcp_rack *r = &tcb->rack;
+
+	netlog(s->p->f, Logtcprxmt,
+	       "%I.%d -> %I.%d: rack loss, nxt %u, una %u, cwnd %u\n",
+	       s->laddr, s->lport, s->raddr, s->rport,
+	       tcb->snd.nxt, tcb->snd.una, tcb->cwind);
+	tcp_loss_event(s, tcb, FALSE);
+	tcb->snd.recovery = SACK_RETRANS_RECOVERY;
+	tcb->snd.recovery_pt = tcb->snd.nxt;
+	r->recover_fs = tcb->snd.nxt - tcb->snd.una;
+	r->prr_delivered = 0;
+	r->prr_out = 0;
+	r->prr_sndcnt = 0;
+}
+
+/* Runs the scoreboard for an ACK, once update() took in its ack and sacks.
+ * Returns how much the ACK newly delivered. */
+static uint32_t rack_ack(struct conv *s, Tcpctl *tcb)
+{
+	struct tcp_rack *r = &tcb->rack;
+	struct rack_seg *rs;
+	struct sack_block *tcb_sack;
+	uint64_t now = rack_now();
+	uint32_t delivered = 0, len;
+	int sack_i = 0;
+
+	for (; r->lo < r->hi; r->lo++) {
+		rs = &r->segs[r->lo];
+		if (seq_le(rs->end, tcb->snd.una)) {
+			len = rs->end - rs->seq;
+		} else if (seq_lt(rs->seq, tcb->snd.una)) {
+			len = tcb->snd.una - rs->seq;
+		} else {
+			break;
+		}
+		if (rs->flags & RACK_SACKED) {
+			r->sacked_bytes -= len;
+		} else {
+			delivered += len;
+			rack_delivered(r, rs, now);
+		}
+		if (seq_gt(rs->end, tcb->snd.una)) {
+			rs->seq = tcb->snd.una;
+			break;
+		}
+	}
+	if (r->lo == r->hi)
+		r->lo = r->hi = 0;
+	for (int i = 0; i < tcb->snd.nr_sacks; i++) {
+		rack_split(r, tcb->snd.sacks[i].left);
+		rack_split(r, tcb->snd.sacks[i].right);
+	}
+	for (unsigned int i = r->lo; i < r->hi; i++) {
+		rs = &r->segs[i];
+		while (sack_i < tcb->snd.nr_sacks &&
+		       seq_le(tcb->snd.sacks[sack_i].right, rs->seq))
+			sack_i++;
+		if (sack_i == tcb->snd.nr_sacks)
+			break;
+		tcb_sack = &tcb->snd.sacks[sack_i];
+		if (rs->flags & RACK_SACKED)
+			continue;
+		if (seq_lt(rs->seq, tcb_sack->left) || seq_gt(rs->end, tcb_sack->right))
+			continue;
+		rs->flags = (rs->flags | RACK_SACKED) & ~RACK_LOST;
+		len = rs->end - rs->seq;
+		r->sacked_bytes += len;
+		delivered += len;
+		rack_delivered(r, rs, now);
+	}
+	if (r->tlp_out && seq_ge(tcb->snd.una, r->tlp_end))
+		r->tlp_out = FALSE;
+	if (rack_detect_loss(s, tcb) && !tcb->snd.recovery)
+		rack_enter_recovery(s, tcb);
+	return delivered;
+}
+
+/* The segs we think are in the network: neither sacked nor lost. */
+static uint32_t rack_pipe(Tcpctl *tcb)
+{
+	struct tcp_rack *r = &tcb->rack;
+	uint32_t pipe = 0;
+
+	for (unsigned int i = r->lo; i < r->hi; i++) {
+		if (!(r->segs[i].flags & (RACK_SACKED | RACK_LOST)))
+			pipe += r->segs[i].end - r->segs[i].seq;
+	}
+	return pipe;
+}
+
+static bool rack_in_prr(Tcpctl *tcb)
+{
+	return rack_on(tcb) && tcb->snd.recovery == SACK_RETRANS_RECOVERY;
+}
+
+/* Computes how much PRR lets us send for this ACK.  Call after in_flight is
+ * up to date. */
+static void rack_prr_ack(Tcpctl *tcb, uint32_t delivered)
+{
+	struct tcp_rack *r = &tcb->rack;
+	uint32_t pipe = tcb->snd.in_flight;
+	int64_t sndcnt;
+
+	r->prr_delivered += delivered;
+	if (pipe > tcb->ssthresh) {
+		sndcnt = DIV_ROUND_UP((uint64_t)r->prr_delivered * tcb->ssthresh,
+		                      MAX(r->recover_fs, 1));
+		sndcnt -= r->prr_out;
+	} else {
+		/* Slow start back up to ssthresh (PRR-SSRB) */
+		sndcnt = MAX((int64_t)r->prr_delivered - r->prr_out,
+		             (int64_t)delivered) + tcb->typical_mss;
+		sndcnt = MIN(sndcnt, (int64_t)(tcb->ssthresh - pipe));
+	}
+	r->prr_sndcnt = MAX(sndcnt, 0);
+}
+
+/* Bookkeeping for something we just sent, whether or not it was picked by
+ * RACK. */
+static void rack_output(Tcpctl *tcb, uint32_t ssize)
+{
+	struct tcp_rack *r = &tcb->rack;
+
+	if (!rack_in_prr(tcb))
+		return;
+	r->prr_out += ssize;
+	r->prr_sndcnt -= MIN(r->prr_sndcnt, ssize);
+}
+
+/* Picks the probe for the TLP: new data if the window allows, o/w the last
+ * segment again.  Same contract as get_xmit_segment(). */
+static bool rack_tlp_segment(struct conv *s, Tcpctl *tcb, uint16_t payload_mss,
+                             uint32_t *from_seq_p, uint32_t *ssize_p)
+{
+	struct tcp_rack *r = &tcb->rack;
+	struct tcppriv *tpriv = s->p->priv;
+	struct rack_seg *rs;
+	uint32_t avail, from_seq, ssize;
+
+	r->tlp_pending = FALSE;
+	avail = qlen(s->wq) + tcb->flgcnt - (tcb->snd.nxt - tcb->snd.una);
+	if (avail && tcb->snd.wnd) {
+		from_seq = tcb->snd.nxt;
+		ssize = MIN(avail, payload_mss);
+		tcb->snd.nxt += ssize;
+		tcb->snd.rtx = tcb->snd.nxt;
+		rack_sent(tcb, from_seq, from_seq + ssize, FALSE);
+	} else {
+		if (r->lo == r->hi)
+			return FALSE;
+		rs = &r->segs[r->hi - 1];
+		if (rs->flags & RACK_SACKED)
+			return FALSE;
+		from_seq = tcb->snd.nxt - MIN(rs->end - rs->seq, payload_mss);
+		ssize = tcb->snd.nxt - from_seq;
+		rack_sent(tcb, from_seq, from_seq + ssize, TRUE);
+		netstat_inc(tpriv->stats, RetransSegs);
+	}
+	tcb->snd.in_flight += ssize;
+	r->tlp_out = TRUE;
+	r->tlp_end = tcb->snd.nxt;
+	r->nr_tlp++;
+	netlog(s->p->f, Logtcprxmt,
+	       "%I.%d -> %I.%d: tail loss probe, seq %u amt %u, una %u, nxt %u\n",
+	       s->laddr, s->lport, s->raddr, s->rport,
+	       from_seq, ssize, tcb->snd.una, tcb->snd.nxt);
+	*from_seq_p = from_seq;
+	*ssize_p = ssize;
+	return TRUE;
+}
+
+/* Arms the TLP timer for about two RTTs from now, if a probe would beat the
+ * RTO.  We rearm on every send and ACK, so it only fires if things go quiet. */
+static void rack_arm_tlp(struct conv *s, Tcpctl *tcb)
+{
+	struct tcppriv *tpriv = s->p->priv;
+	struct tcp_rack *r = &tcb->rack;
+	uint32_t pto;
+
+	if (!rack_on(tcb) || tcb->snd.recovery || r->tlp_out ||
+	    tcb->snd.una == tcb->snd.nxt) {
+		tcphalt(tpriv, &tcb->tlp_timer);
+		return;
+	}
+	pto = 2 * tcb->srtt;
+	if (tcb->snd.nxt - tcb->snd.una <= tcb->typical_mss)
+		pto += TLP_DELACK_MS;
+	pto = DIV_ROUND_UP(pto, MSPTICK);
+	if (pto >= tcb->timer.start) {
+		tcphalt(tpriv, &tcb->tlp_timer);
+		return;
+	}
+	tcb->tlp_timer.start = MAX(pto, 1);
+	tcpgo(tpriv, &tcb->tlp_timer);
+}
+
+/* An RTO means everything not sacked is lost.  If the sacks were flushed, the
+ * receiver might have reneged, so that's everything. */
+static void rack_rto(struct conv *s, Tcpctl *tcb)
+{
+	struct tcppriv *tpriv = s->p->priv;
+	struct tcp_rack *r = &tcb->rack;
+
+	r->nr_rto++;
+	r->rto_ms = milliseconds();
+	r->rto_check = TRUE;
+	r->tlp_out = FALSE;
+	r->tlp_pending = FALSE;
+	tcphalt(tpriv, &tcb->tlp_timer);
+	tcphalt(tpriv, &tcb->rack_timer);
+	if (!rack_on(tcb))
+		return;
+	if (!tcb->snd.nr_sacks)
+		r->sacked_bytes = 0;
+	for (unsigned int i = r->lo; i < r->hi; i++) {
+		if (!tcb->snd.nr_sacks)
+			r->segs[i].flags &= ~RACK_SACKED;
+		if (!(r->segs[i].flags & RACK_SACKED))
+			r->segs[i].flags |= RACK_LOST;
+	}
+}
+
+/* Eifel detection (RFC 3522): if the first ACK after an RTO echoes a timestamp
+ * from before it, the original got there and the RTO was spurious. */
+static void rack_check_spurious_rto(Tcpctl *tcb, Tcp *seg)
+{
+	struct tcp_rack *r = &tcb->rack;
+
+	if (!r->rto_check)
+		return;
+	r->rto_check = FALSE;
+	if (tcb->ts_recent && seg->ts_ecr && seq_lt(seg->ts_ecr, r->rto_ms))
+		r->nr_spurious_rto++;
+}
+
+static void tcp_rack_timeout(void *arg)
+{
+	ERRSTACK(1);
+	struct conv *s = arg;
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+
+	qlock(&s->qlock);
+	if (waserror()) {
+		qunlock(&s->qlock);
+		nexterror();
+	}
+	if (tcb->state != Closed && rack_on(tcb) && rack_detect_loss(s, tcb)) {
+		if (!tcb->snd.recovery)
+			rack_enter_recovery(s, tcb);
+		set_in_flight(tcb);
+		/* No ACK is clocking us out, so PRR would send nothing */
+		if (rack_in_prr(tcb))
+			tcb->rack.prr_sndcnt = MAX(tcb->rack.prr_sndcnt,
+			                           tcb->typical_mss);
+		tcpoutput(s);
+	}
+	qunlock(&s->qlock);
+	poperror();
+}
+
+static void tcp_tlp_timeout(void *arg)
+{
+	ERRSTACK(1);
+	struct conv *s = arg;
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+	struct tcppriv *tpriv = s->p->priv;
+
+	qlock(&s->qlock);
+	if (waserror()) {
+		qunlock(&s->qlock);
+		nexterror();
+	}
+	if (tcb->state != Closed && rack_on(tcb) && !tcb->snd.recovery &&
+	    !tcb->rack.tlp_out && tcb->snd.una != tcb->snd.nxt) {
+		tcb->rack.tlp_pending = TRUE;
+		tcpoutput(s);
+		tcb->rack.tlp_pending = FALSE;
+		/* The probe gets a full RTO before we give up on it */
+		if (tcb->rack.tlp_out)
+			tcpgo(tpriv, &tcb->timer);
+	}
+	qunlock(&s->qlock);
+	poperror();
+}
+
 /* Attempts to merge later sacks into sack 'into' (index in the array) */
 static void merge_sacks_into(Tcpctl *tcb, int into)
 {
@@ -1675,6 +2605,9 @@ static void sack_has_changed(struct conv *s, Tcpctl *tcb,
 	 * it to the right edge. */
 	if (sack_contains(tcb_sack, tcb->snd.rtx))
 		tcb->snd.rtx = tcb_sack->right;
+	/* RACK finds lost retransmits on its own */
+	if (rack_on(tcb))
+		return;
 
 	/* This is a sack for something we retransed and we think it means there was
 	 * another loss.  Instead of waiting for the RTO, we can take action. */
@@ -1686,7 +2619,7 @@ static void sack_has_changed(struct conv *s, Tcpctl *tcb,
 			       tcb->snd.rtx, tcb_sack->left, tcb_sack->right, tcb->snd.una,
 			       tcb->snd.recovery_pt);
 			/* Redo retrans, but keep the sacks and recovery point */
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, FALSE);
 			tcb->snd.rtx = tcb->snd.una;
 			tcb->snd.sack_loss_hint = 0;
 			/* Act like an RTO.  We just detected it earlier.  This prevents us
@@ -1836,6 +2769,10 @@ static void set_in_flight(Tcpctl *tcb)
 	uint32_t in_flight = 0;
 	uint32_t from;
 
+	if (rack_on(tcb)) {
+		tcb->snd.in_flight = rack_pipe(tcb);
+		return;
+	}
 	if (!tcb->snd.nr_sacks) {
 		tcb->snd.in_flight = tcb->snd.rtx - tcb->snd.una;
 		return;
@@ -1945,8 +2882,9 @@ static void update(struct conv *s, Tcp *seg)
 {
 	int rtt;
 	Tcpctl *tcb;
-	uint32_t acked, expand;
+	uint32_t acked, delivered = 0;
 	struct tcppriv *tpriv;
+	struct tcp_cc_sample cs[1];
 
 	tpriv = s->p->priv;
 	tcb = (Tcpctl *) s->ptcl;
@@ -1960,19 +2898,24 @@ static void update(struct conv *s, Tcp *seg)
 		tcb->snd.rtx = seg->ack;
 
 	update_sacks(s, tcb, seg);
+	if (rack_on(tcb))
+		delivered = rack_ack(s, tcb);
 	set_in_flight(tcb);
+	if (rack_in_prr(tcb))
+		rack_prr_ack(tcb, delivered);
 
 	/* We treat either a dupack or forward SACKs as a hint that there is a loss.
 	 * The RFCs suggest three dupacks before treating it as a loss (alternative
-	 * is reordered packets).  We'll treat three SACKs the same way. */
-	if (is_potential_loss(tcb, seg) && !tcb->snd.recovery) {
+	 * is reordered packets).  We'll treat three SACKs the same way.  With RACK,
+	 * rack_ack() already decided. */
+	if (!rack_on(tcb) && is_potential_loss(tcb, seg) && !tcb->snd.recovery) {
 		tcb->snd.loss_hint++;
 		if (tcb->snd.loss_hint == TCPREXMTTHRESH) {
 			netlog(s->p->f, Logtcprxmt,
 			       "%I.%d -> %I.%d: loss hint thresh, nr sacks %u, nxt %u, una %u, cwnd %u\n",
 			       s->laddr, s->lport, s->raddr, s->rport,
 			       tcb->snd.nr_sacks, tcb->snd.nxt, tcb->snd.una, tcb->cwind);
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, FALSE);
 			tcb->snd.recovery_pt = tcb->snd.nxt;
 			if (tcb->snd.nr_sacks) {
 				tcb->snd.recovery = SACK_RETRANS_RECOVERY;
@@ -2011,6 +2954,7 @@ static void update(struct conv *s, Tcp *seg)
 		tcb->snd.loss_hint = 0;
 	else if (seq_ge(seg->ack, tcb->snd.recovery_pt))
 		reset_recovery(s, tcb);
+	rack_check_spurious_rto(tcb, seg);
 
 	/* avoid slow start and timers for SYN acks */
 	if ((tcb->flags & SYNACK) == 0) {
@@ -2020,49 +2964,32 @@ static void update(struct conv *s, Tcp *seg)
 		goto done;
 	}
 
-	/* slow start as long as we're not recovering from lost packets */
-	if (tcb->cwind < tcb->snd.wnd && !tcb->snd.recovery) {
-		if (tcb->cwind < tcb->ssthresh) {
-			/* We increase the cwind by every byte we receive.  We want to
-			 * increase the cwind by one MSS for every MSS that gets ACKed.
-			 * Note that multiple MSSs can be ACKed in a single ACK.  If we had
-			 * a remainder of acked / MSS, we'd add just that remainder - not 0
-			 * or 1 MSS. */
-			expand = acked;
-		} else {
-			/* Every RTT, which consists of CWND bytes, we're supposed to expand
-			 * by MSS bytes.  The classic algorithm was
-			 * 		expand = (tcb->mss * tcb->mss) / tcb->cwind;
-			 * which assumes the ACK was for MSS bytes.  Instead, for every
-			 * 'acked' bytes, we increase the window by acked / CWND (in units
-			 * of MSS). */
-			expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss
-			         / tcb->cwind;
-		}
-
-		if (tcb->cwind + expand < tcb->cwind)
-			expand = tcb->snd.wnd - tcb->cwind;
-		if (tcb->cwind + expand > tcb->snd.wnd)
-			expand = tcb->snd.wnd - tcb->cwind;
-		tcb->cwind += expand;
-	}
-	adjust_tx_qio_limit(s);
-
+	cs->acked = acked;
+	cs->delivered = rack_on(tcb) ? delivered : acked;
+	cs->rtt_us = 0;
 	if (tcb->ts_recent) {
-		update_rtt(tcb, abs(milliseconds() - seg->ts_ecr),
-		           expected_samples_ts(tcb, acked));
+		rtt = abs(milliseconds() - seg->ts_ecr);
+		update_rtt(tcb, rtt, expected_samples_ts(tcb, acked));
+		cs->rtt_us = rtt * 1000ULL;
 	} else if (tcb->rtt_timer.state == TcptimerON &&
 	           seq_ge(seg->ack, tcb->rttseq)) {
 		/* Adjust the timers according to the round trip time */
 		tcphalt(tpriv, &tcb->rtt_timer);
 		if (!tcb->snd.recovery) {
-			rtt = tcb->rtt_timer.start - tcb->rtt_timer.count;
+			rtt = tcb->rtt_timer.start -
+			      tcptimer_left(tpriv, &tcb->rtt_timer);
 			if (rtt == 0)
 				rtt = 1;	/* o/w all close systems will rexmit in 0 time */
 			rtt *= MSPTICK;
 			update_rtt(tcb, rtt, 1);
+			cs->rtt_us = rtt * 1000ULL;
 		}
 	}
+	/* RACK's sample is in usec, and for the most recently sent seg. */
+	if (rack_on(tcb) && tcb->rack.rtt_us)
+		cs->rtt_us = tcb->rack.rtt_us;
+	tcb->cc->ack(s, tcb, cs);
+	adjust_tx_qio_limit(s);
 
 done:
 	if (qdiscard(s->wq, acked) < acked) {
@@ -2081,6 +3008,7 @@ done:
 		tcpgo(tpriv, &tcb->timer);
 	else
 		tcphalt(tpriv, &tcb->timer);
+	rack_arm_tlp(s, tcb);
 
 	tcb->backoff = 0;
 	tcb->backedoff = 0;
@@ -2170,6 +3098,15 @@ static void drop_old_rcv_sacks(Tcpctl *tcb)
 	}
 }
 
+/* Whether conv s is the connection for this segment's 4-tuple.  Call with s
+ * qlocked. */
+static bool tcp_conv_is_tuple(struct conv *s, uint8_t *source, uint16_t sport,
+                              uint8_t *dest, uint16_t dport)
+{
+	return s->rport == sport && s->lport == dport &&
+	       !ipcmp(s->raddr, source) && !ipcmp(s->laddr, dest);
+}
+
 static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 {
 	ERRSTACK(1);
@@ -2188,7 +3125,7 @@ static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 	f = tcp->f;
 	tpriv = tcp->priv;
 
-	tpriv->stats[InSegs]++;
+	netstat_inc(tpriv->stats, InSegs);
 
 	h4 = (Tcp4hdr *) (bp->rp);
 	h6 = (Tcp6hdr *) (bp->rp);
@@ -2207,8 +3144,8 @@ static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 		hnputs(h4->tcplen, length - TCP4_PKT);
 		if (!(bp->flag & Btcpck) && (h4->tcpcksum[0] || h4->tcpcksum[1]) &&
 			ptclcsum(bp, TCP4_IPLEN, length - TCP4_IPLEN)) {
-			tpriv->stats[CsumErrs]++;
-			tpriv->stats[InErrs]++;
+			netstat_inc(tpriv->stats, CsumErrs);
+			netstat_inc(tpriv->stats, InErrs);
 			netlog(f, Logtcp, "bad tcp proto cksum\n");
 			freeblist(bp);
 			return;
@@ -2217,8 +3154,8 @@ static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 
 		hdrlen = ntohtcp4(&seg, &bp);
 		if (hdrlen < 0) {
-			tpriv->stats[HlenErrs]++;
-			tpriv->stats[InErrs]++;
+			netstat_inc(tpriv->stats, HlenErrs);
+			netstat_inc(tpriv->stats, InErrs);
 			netlog(f, Logtcp, "bad tcp hdr len\n");
 			return;
 		}
@@ -2233,8 +3170,8 @@ static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 		length -= hdrlen + TCP4_PKT;
 		bp = trimblock(bp, hdrlen + TCP4_PKT, length);
 		if (bp == NULL) {
-			tpriv->stats[LenErrs]++;
-			tpriv->stats[InErrs]++;
+			netstat_inc(tpriv->stats, LenErrs);
+			netstat_inc(tpriv->stats, InErrs);
 			netlog(f, Logtcp, "tcp len < 0 after trim\n");
 			return;
 		}
@@ -2250,10 +3187,10 @@ static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 		h6->ploadlen[0] = h6->ploadlen[1] = h6->proto = 0;
 		h6->ttl = proto;
 		hnputl(h6->vcf, length);
-		if ((h6->tcpcksum[0] || h6->tcpcksum[1]) &&
+		if (!(bp->flag & Btcpck) && (h6->tcpcksum[0] || h6->tcpcksum[1]) &&
 			ptclcsum(bp, TCP6_IPLEN, length + TCP6_PHDRSIZE)) {
-			tpriv->stats[CsumErrs]++;
-			tpriv->stats[InErrs]++;
+			netstat_inc(tpriv->stats, CsumErrs);
+			netstat_inc(tpriv->stats, InErrs);
 			netlog(f, Logtcp, "bad tcp proto cksum\n");
 			freeblist(bp);
 			return;
@@ -2264,8 +3201,8 @@ static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 
 		hdrlen = ntohtcp6(&seg, &bp);
 		if (hdrlen < 0) {
-			tpriv->stats[HlenErrs]++;
-			tpriv->stats[InErrs]++;
+			netstat_inc(tpriv->stats, HlenErrs);
+			netstat_inc(tpriv->stats, InErrs);
 			netlog(f, Logtcp, "bad tcp hdr len\n");
 			return;
 		}
@@ -2280,8 +3217,8 @@ static void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 		length -= hdrlen;
 		bp = trimblock(bp, hdrlen + TCP6_PKT, length);
 		if (bp == NULL) {
-			tpriv->stats[LenErrs]++;
-			tpriv->stats[InErrs]++;
+			netstat_inc(tpriv->stats, LenErrs);
+			netstat_inc(tpriv->stats, InErrs);
 			netlog(f, Logtcp, "tcp len < 0 after trim\n");
 			return;
 		}
@@ -2297,9 +3234,42 @@ reset:
 		return;
 	}
 
+	/* Connected convs don't need the protocol qlock, which would serialize TCP
+	 * input from every rx queue.  The conv could have been closed or reused
+	 * since iphtlook, so once we hold its qlock, we check that it is still
+	 * ours.  If not, we look again the slow way. */
+	tcb = (Tcpctl *) s->ptcl;
+	if (tcb->state != Listen) {
+		qlock(&s->qlock);
+		if (tcb->state != Listen && tcp_conv_is_tuple(s, source, seg.source,
+		                                              dest, seg.dest))
+			goto have_conv;
+		qunlock(&s->qlock);
+	}
+
+	/* SYNs and RSTs for a listener only touch limbo, which has its own locks.
+	 * If s stops listening meanwhile, the call just times out of limbo. */
+	if (tcb->state == Listen) {
+		if (seg.flags & RST) {
+			limborst(s, &seg, source, dest, version);
+			freeblist(bp);
+			return;
+		}
+		if ((seg.flags & SYN) && (seg.flags & ACK) == 0) {
+			limbo(s, source, dest, &seg, version);
+			freeblist(bp);
+			return;
+		}
+	}
+
 	/* lock protocol for unstate Plan 9 invariants.  funcs like limbo or
 	 * incoming might rely on it. */
 	qlock(&tcp->qlock);
+	s = iphtlook(&tpriv->ht, source, seg.source, dest, seg.dest);
+	if (s == NULL) {
+		qunlock(&tcp->qlock);
+		goto reset;
+	}
 
 	/* if it's a listener, look for the right flags and get a new conv */
 	tcb = (Tcpctl *) s->ptcl;
@@ -2332,12 +3302,13 @@ reset:
 	 * Out-of-band data is ignored - it was always a bad idea.
 	 */
 	tcb = (Tcpctl *) s->ptcl;
+	qlock(&s->qlock);
+	qunlock(&tcp->qlock);
+have_conv:
 	if (waserror()) {
 		qunlock(&s->qlock);
 		nexterror();
 	}
-	qlock(&s->qlock);
-	qunlock(&tcp->qlock);
 
 	update_tcb_ts(tcb, &seg);
 	/* fix up window */
@@ -2460,7 +3431,7 @@ reset:
 	for (;;) {
 		if (seg.flags & RST) {
 			if (tcb->state == Established) {
-				tpriv->stats[EstabResets]++;
+				netstat_inc(tpriv->stats, EstabResets);
 				if (tcb->rcv.nxt != seg.seq)
 					printd
 						("out of order RST rcvd: %I.%d -> %I.%d, rcv.nxt 0x%lx seq 0x%lx\n",
@@ -2559,8 +3530,7 @@ reset:
 						 *  but under a real stream is equivalent since
 						 *  every packet has a max seg in it.
 						 */
-						if (++(tcb->rcv.una) >= 2)
-							tcb->flags |= FORCE;
+						tcp_rcv_ack(tcb, &seg, length);
 					}
 					tcb->rcv.nxt += length;
 					drop_old_rcv_sacks(tcb);
@@ -2688,6 +3658,7 @@ static uint32_t throttle_for_mss(Tcpctl *tcb, uint32_t ssize,
 			/* Don't send too much.  32K is arbitrary.. */
 			if (ssize > 32 * 1024)
 				ssize = 32 * 1024;
+			ssize = MIN(ssize, tcp_pace_tso_max(tcb, payload_mss));
 			if (!retrans) {
 				/* Clamp xmit to an integral MSS to avoid ragged tail segments
 				 * causing poor link utilization. */
@@ -2715,6 +3686,9 @@ static bool throttle_ssize(struct conv *s, Tcpctl *tcb, uint32_t *ssize_p,
 				return FALSE;
 		}
 		usable = 1;
+	} else if (rack_in_prr(tcb)) {
+		/* PRR decides, see rack_prr_ack() */
+		usable = MIN(tcb->rack.prr_sndcnt, tcb->snd.wnd);
 	} else {
 		usable = tcb->cwind;
 		if (tcb->snd.wnd < usable)
@@ -2780,6 +3754,25 @@ static bool get_xmit_segment(struct conv *s, Tcpctl *tcb, uint16_t payload_mss,
 	bool sack_retrans = FALSE;
 	struct sack_block *tcb_sack = 0;
 
+	if (rack_on(tcb)) {
+		if (tcb->rack.tlp_pending) {
+			if (!rack_tlp_segment(s, tcb, payload_mss, from_seq_p, ssize_p))
+				return FALSE;
+			*sent_p = *from_seq_p - tcb->snd.una;
+			return TRUE;
+		}
+		/* RACK's lost segs have first dibs.  O/w, we send new data from nxt,
+		 * even in an RTO: rack_rto() marked what needs to go again. */
+		sack_retrans = rack_next_lost(tcb, &from_seq, &ssize);
+		if (!sack_retrans) {
+			from_seq = tcb->snd.nxt;
+			sent = from_seq - tcb->snd.una;
+			ssize = qlen(s->wq) + tcb->flgcnt - sent;
+		} else {
+			sent = from_seq - tcb->snd.una;
+		}
+		goto throttle;
+	}
 	for (int i = 0; i < tcb->snd.nr_sacks; i++) {
 		tcb_sack = &tcb->snd.sacks[i];
 		if (seq_lt(tcb->snd.rtx, tcb_sack->left)) {
@@ -2835,6 +3828,7 @@ static bool get_xmit_segment(struct conv *s, Tcpctl *tcb, uint16_t payload_mss,
 		ssize = qlen(s->wq) + tcb->flgcnt - sent;
 	}
 
+throttle:
 	if (!throttle_ssize(s, tcb, &ssize, payload_mss, sack_retrans))
 		return FALSE;
 
@@ -2842,15 +3836,27 @@ static bool get_xmit_segment(struct conv *s, Tcpctl *tcb, uint16_t payload_mss,
 	 * gets reset on each ACK */
 	tcb->snd.in_flight += ssize;
 	/* Log and track rxmit.  This covers both SACK (retrans) and fast rxmit. */
-	if (ssize && seq_lt(tcb->snd.rtx, tcb->snd.nxt)) {
+	if (ssize && seq_lt(from_seq, tcb->snd.nxt)) {
 		netlog(f, Logtcpverbose,
 		       "%I.%d -> %I.%d: rxmit: rtx %u amt %u, nxt %u\n",
 		       s->laddr, s->lport, s->raddr, s->rport,
-		       tcb->snd.rtx, MIN(tcb->snd.nxt - tcb->snd.rtx, ssize),
+		       from_seq, MIN(tcb->snd.nxt - from_seq, ssize),
 		       tcb->snd.nxt);
-		tpriv->stats[RetransSegs]++;
+		netstat_inc(tpriv->stats, RetransSegs);
 	}
-	if (sack_retrans) {
+	if (rack_on(tcb)) {
+		if (ssize) {
+			if (sack_retrans) {
+				rack_sent(tcb, from_seq, from_seq + ssize, TRUE);
+				tcpsettimer(tcb);
+			} else {
+				rack_sent(tcb, from_seq, from_seq + ssize, FALSE);
+				tcb->snd.nxt += ssize;
+				tcb->snd.rtx = tcb->snd.nxt;
+			}
+			rack_output(tcb, ssize);
+		}
+	} else if (sack_retrans) {
 		/* If we'll send up to the left edge, advance snd.rtx to the right.
 		 *
 		 * This includes the largest sack.  It might get removed later, in which
@@ -2942,6 +3948,10 @@ static void tcpoutput(struct conv *s)
 		 * sometimes SACKs) */
 		payload_mss = derive_payload_mss(tcb);
 
+		rack_maybe_init(tcb);
+		/* A FORCE is usually an ACK; it can't wait. */
+		if (!(tcb->flags & FORCE) && tcp_pace_wait(s, tcb))
+			break;
 		if (!get_xmit_segment(s, tcb, payload_mss, &from_seq, &sent, &ssize))
 			break;
 
@@ -2961,6 +3971,8 @@ static void tcpoutput(struct conv *s)
 		if (!tcb->rcv.blocked)
 			tcphalt(tpriv, &tcb->acktimer);
 		tcb->rcv.una = 0;
+		if (ssize)
+			tcb->ack.sent_data = TRUE;
 		seg.source = s->lport;
 		seg.dest = s->rport;
 		seg.flags = ACK;
@@ -3045,9 +4057,10 @@ static void tcpoutput(struct conv *s)
 				tcpgo(tpriv, &tcb->rtt_timer);
 				tcb->rttseq = from_seq + ssize;
 			}
+			rack_arm_tlp(s, tcb);
 		}
 
-		tpriv->stats[OutSegs]++;
+		netstat_inc(tpriv->stats, OutSegs);
 
 		/* put off the next keep alive */
 		tcpgo(tpriv, &tcb->katimer);
@@ -3069,6 +4082,7 @@ static void tcpoutput(struct conv *s)
 				panic("tcpoutput2: version %d", version);
 		}
 		if (ssize) {
+			tcp_pace_sent(tcb, ssize);
 			/* The outer loop thinks we sent one packet.  If we used TSO, we
 			 * might have sent several.  Minus one for the loop increment. */
 			msgs += DIV_ROUND_UP(ssize, payload_mss) - 1;
@@ -3212,19 +4226,97 @@ static void tcpsetchecksum(struct conv *s, char **f, int unused)
 	tcb->nochecksum = !atoi(f[1]);
 }
 
-static void tcp_loss_event(struct conv *s, Tcpctl *tcb)
+static void tcp_loss_event(struct conv *s, Tcpctl *tcb, bool rto)
 {
 	uint32_t old_cwnd = tcb->cwind;
 
-	/* Reno */
-	tcb->ssthresh = tcb->cwind / 2;
-	tcb->cwind = tcb->ssthresh;
+	tcb->cc->loss(s, tcb, rto);
 	netlog(s->p->f, Logtcprxmt,
-	       "%I.%d -> %I.%d: loss event, cwnd was %d, now %d\n",
-	       s->laddr, s->lport, s->raddr, s->rport,
+	       "%I.%d -> %I.%d: %s loss event, cwnd was %d, now %d\n",
+	       s->laddr, s->lport, s->raddr, s->rport, tcb->cc->name,
 	       old_cwnd, tcb->cwind);
 }
 
+/* Switches s to congestion control cc, or starts it up. */
+static void tcp_cc_set(struct conv *s, Tcpctl *tcb, struct tcp_cc_ops *cc)
+{
+	tcb->cc = cc;
+	tcb->pacing_rate = 0;
+	tcb->pace_next_us = 0;
+	cc->init(s, tcb);
+}
+
+/* With pacing, a segment may leave no earlier than pace_next_us.  Returns TRUE
+ * if tcpoutput() needs to wait, and arms the pacer to kick it. */
+static bool tcp_pace_wait(struct conv *s, Tcpctl *tcb)
+{
+	struct tcp_pacer *p = tcb->pacer;
+	uint64_t now;
+
+	if (!tcb->pacing_rate)
+		return FALSE;
+	now = tsc2usec(read_tsc());
+	if (now >= tcb->pace_next_us)
+		return FALSE;
+	tcb->nr_paced++;
+	if (!p->armed) {
+		p->armed = TRUE;
+		set_awaiter_rel(&p->waiter, tcb->pace_next_us - now);
+		set_alarm(&per_cpu_info[core_id()].tchain, &p->waiter);
+	}
+	return TRUE;
+}
+
+/* Pushes out the next departure by how long ssize takes at the pacing rate. */
+static void tcp_pace_sent(Tcpctl *tcb, uint32_t ssize)
+{
+	uint64_t now;
+
+	if (!tcb->pacing_rate)
+		return;
+	now = tsc2usec(read_tsc());
+	tcb->pace_next_us = MAX(tcb->pace_next_us, now) +
+	                    ssize * 1000000ULL / tcb->pacing_rate;
+}
+
+/* TSO segments go out as one burst, so with pacing, we only build about a msec
+ * worth at a time. */
+static uint32_t tcp_pace_tso_max(Tcpctl *tcb, uint16_t payload_mss)
+{
+	if (!tcb->pacing_rate)
+		return UINT32_MAX;
+	return MAX(tcb->pacing_rate / 1000, 2 * payload_mss);
+}
+
+/* RKM, not IRQ, so we can qlock.  Note that unset_alarm() would wait on us, and
+ * we wait on the qlock, so we never unset: if the conv closed, there's nothing
+ * to send. */
+static void tcp_pacer_alarm(struct alarm_waiter *waiter)
+{
+	ERRSTACK(1);
+	struct tcp_pacer *p = container_of(waiter, struct tcp_pacer, waiter);
+	struct conv *s = p->s;
+	Tcpctl *tcb = (Tcpctl *) s->ptcl;
+
+	qlock(&s->qlock);
+	p->armed = FALSE;
+	/* discard error style */
+	if (!waserror()) {
+		switch (tcb->state) {
+		case Syn_sent:
+		case Established:
+		case Close_wait:
+		case Finwait1:
+		case Closing:
+		case Last_ack:
+			tcpoutput(s);
+			break;
+		}
+	}
+	poperror();
+	qunlock(&s->qlock);
+}
+
 /* Called when we need to retrans the entire outstanding window (everything
  * previously sent, but unacknowledged). */
 static void tcprxmit(struct conv *s)
@@ -3308,15 +4400,16 @@ static void tcptimeout(void *arg)
 			       tcb->snd.una, tcb->snd.rtx, tcb->snd.nxt, tcb->snd.in_flight,
 			       tcb->timer.start);
 			tcpsettimer(tcb);
-			tcp_loss_event(s, tcb);
+			tcp_loss_event(s, tcb, TRUE);
 			/* Advance the recovery point.  Any dupacks/sacks below this won't
 			 * trigger a new loss, since we won't reset_recovery() until we ack
 			 * past recovery_pt. */
 			tcb->snd.recovery = RTO_RETRANS_RECOVERY;
 			tcb->snd.recovery_pt = tcb->snd.nxt;
 			timeout_handle_sacks(tcb);
+			rack_rto(s, tcb);
 			tcprxmit(s);
-			tpriv->stats[RetransTimeouts]++;
+			netstat_inc(tpriv->stats, RetransTimeouts);
 			break;
 		case Time_wait:
 			localclose(s, NULL);
@@ -3381,7 +4474,7 @@ static int addreseq(Tcpctl *tcb, struct tcppriv *tpriv, Tcp *seg,
 		rp->next = rp1;
 		tcb->reseq = rp;
 		if (rp->next != NULL)
-			tpriv->stats[OutOfOrder]++;
+			netstat_inc(tpriv->stats, OutOfOrder);
 		return 0;
 	}
 
@@ -3392,7 +4485,7 @@ static int addreseq(Tcpctl *tcb, struct tcppriv *tpriv, Tcp *seg,
 			rp->next = rp1->next;
 			rp1->next = rp;
 			if (rp->next != NULL)
-				tpriv->stats[OutOfOrder]++;
+				netstat_inc(tpriv->stats, OutOfOrder);
 			break;
 		}
 		rp1 = rp1->next;
@@ -3519,7 +4612,7 @@ static void tcpadvise(struct Proto *tcp, struct block *bp, char *msg)
 	uint8_t source[IPaddrlen];
 	uint8_t dest[IPaddrlen];
 	uint16_t psource, pdest;
-	struct conv *s, **p;
+	struct conv *s;
 
 	h4 = (Tcp4hdr *) (bp->rp);
 	h6 = (Tcp6hdr *) (bp->rp);
@@ -3537,28 +4630,35 @@ static void tcpadvise(struct Proto *tcp, struct block *bp, char *msg)
 	}
 
 	/* Look for a connection */
-	for (p = tcp->conv; *p; p++) {
-		s = *p;
+	s = iphtfind(tcp->ht, NULL, dest, pdest, source, psource);
+	if (s) {
 		tcb = (Tcpctl *) s->ptcl;
-		if (s->rport == pdest)
-			if (s->lport == psource)
-				if (tcb->state != Closed)
-					if (ipcmp(s->raddr, dest) == 0)
-						if (ipcmp(s->laddr, source) == 0) {
-							qlock(&s->qlock);
-							switch (tcb->state) {
-								case Syn_sent:
-									localclose(s, msg);
-									break;
-							}
-							qunlock(&s->qlock);
-							freeblist(bp);
-							return;
-						}
+		qlock(&s->qlock);
+		if (tcb->state == Syn_sent)
+			localclose(s, msg);
+		qunlock(&s->qlock);
 	}
 	freeblist(bp);
 }
 
+/* "cc <name>" picks the congestion control.  Before connect or announce, it
+ * applies once the conv starts.  Calls accepted by a listener inherit its cc. */
+static void tcpccctl(struct conv *c, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) c->ptcl;
+	struct tcp_cc_ops *cc;
+
+	if (n != 2)
+		error(EINVAL, "usage: cc reno|bbr");
+	cc = tcp_cc_lookup(f[1]);
+	if (!cc)
+		error(EINVAL, "unknown congestion control %s", f[1]);
+	if (tcb->state == Closed)
+		tcb->cc_next = cc;
+	else
+		tcp_cc_set(c, tcb, cc);
+}
+
 static void tcpporthogdefensectl(char *val)
 {
 	if (strcmp(val, "on") == 0)
@@ -3569,6 +4669,38 @@ static void tcpporthogdefensectl(char *val)
 		error(EINVAL, "unknown value for tcpporthogdefense");
 }
 
+/* "quickack auto|on|off" sets when we ACK data right away, and "ackevery N"
+ * how many segments a bulk receiver may ACK at once.  See tcp_rcv_ack(). */
+static void tcpquickackctl(struct conv *c, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) c->ptcl;
+
+	if (n != 2)
+		error(EINVAL, "usage: quickack auto|on|off");
+	if (!strcmp(f[1], "auto"))
+		tcb->ack.mode = TCP_QUICKACK_AUTO;
+	else if (!strcmp(f[1], "on"))
+		tcb->ack.mode = TCP_QUICKACK_ON;
+	else if (!strcmp(f[1], "off"))
+		tcb->ack.mode = TCP_QUICKACK_OFF;
+	else
+		error(EINVAL, "unknown quickack mode %s", f[1]);
+	tcb->ack.quickacks = 0;
+}
+
+static void tcpackeveryctl(struct conv *c, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl *) c->ptcl;
+	long every;
+
+	if (n != 2)
+		error(EINVAL, "usage: ackevery N");
+	every = strtol(f[1], 0, 0);
+	if (every < 1 || every > Maxackevery)
+		error(EINVAL, "ackevery must be 1 to %d", Maxackevery);
+	tcb->ack.every = every;
+}
+
 /* called with c qlocked */
 static void tcpctl(struct conv *c, char **f, int n)
 {
@@ -3580,6 +4712,12 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpsetchecksum(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
+	else if (n >= 1 && strcmp(f[0], "cc") == 0)
+		tcpccctl(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "quickack") == 0)
+		tcpquickackctl(c, f, n);
+	else if (n >= 1 && strcmp(f[0], "ackevery") == 0)
+		tcpackeveryctl(c, f, n);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -3594,7 +4732,8 @@ static int tcpstats(struct Proto *tcp, char *buf, int len)
 	p = buf;
 	e = p + len;
 	for (i = 0; i < Nstats; i++)
-		p = seprintf(p, e, "%s: %u\n", statnames[i], priv->stats[i]);
+		p = seprintf(p, e, "%s: %lu\n", statnames[i],
+		             netstat_read(priv->stats, i));
 	return p - buf;
 }
 
@@ -3668,8 +4807,17 @@ void tcpinit(struct Fs *fs)
 	tcp = kzmalloc(sizeof(struct Proto), 0);
 	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), 0);
 	debug_priv = tpriv;
-	qlock_init(&tpriv->tl);
+	tpriv->wheels = kzmalloc(sizeof(struct tcp_wheel) * num_cores, MEM_WAIT);
+	for_each_core(i)
+		spinlock_init(&tpriv->wheels[i].lock);
 	qlock_init(&tpriv->apl);
+	ipht_init(&tpriv->ht);
+	atomic_init(&tpriv->nlimbo, 0);
+	rwinit(&tpriv->lht_rwl);
+	tpriv->lht = limbo_ht_alloc(NLHT, MEM_WAIT);
+	urandom_read(tpriv->lht_key, sizeof(tpriv->lht_key));
+	urandom_read(tpriv->syncookie_key, sizeof(tpriv->syncookie_key));
+	tpriv->stats = netstats_alloc(Nstats);
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
 	tcp->announce = tcpannounce;
@@ -3686,8 +4834,10 @@ void tcpinit(struct Fs *fs)
 	tcp->gc = tcpgc;
 	tcp->ipproto = IP_TCPPROTO;
 	tcp->nc = 4096;
+	tcp->maxnc = Maxconv;
+	tcp->ht = &tpriv->ht;
 	tcp->ptclsize = sizeof(Tcpctl);
-	tpriv->stats[MaxConn] = tcp->nc;
+	netstat_set(tpriv->stats, MaxConn, tcp->maxnc);
 
 	Fsproto(fs, tcp);
 }
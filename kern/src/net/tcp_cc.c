@@ -0,0 +1,324 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * TCP congestion control.  TCP calls these ops through tcb->cc; see struct
+ * tcp_cc_ops.
+ *
+ * Reno is the classic slow start and congestion avoidance, and halves the
+ * window on a loss.  It was hard-wired into tcp.c until now.
+ *
+ * BBR is a simplified take on BBR (v1).  It doesn't treat loss as congestion.
+ * Instead, it measures the bottleneck bandwidth (the max delivery rate over the
+ * last BBR_BW_ROUNDS round trips) and the min RTT (over the last 10 sec), and
+ * paces at about that bandwidth, with a cwind of twice their product.  That
+ * keeps the bottleneck's queue short, and pacing keeps us from bursting a full
+ * window into shallow switch buffers.  The modes are the usual ones:
+ * - STARTUP: pace at 2.89x the bandwidth, til it stops growing by 25% for three
+ *   rounds.
+ * - DRAIN: pace below the bandwidth, til in_flight is down to the BDP.
+ * - PROBE_BW: cycle the pacing gain through 1.25, 0.75, then 1 for six rounds,
+ *   one min RTT each.
+ * - PROBE_RTT: every 10 sec without a new min RTT, cut cwind to BBR_MIN_CWND
+ *   segments for 200 msec, to drain the queue and see the real RTT.
+ *
+ * We measure the delivery rate per round trip, not per ACK, and skip BBR's
+ * app-limited tracking; the windowed max filter covers most of that. */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <time.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+static void reno_init(struct conv *s, Tcpctl *tcb)
+{
+}
+
+static void reno_ack(struct conv *s, Tcpctl *tcb, struct tcp_cc_sample *cs)
+{
+	uint32_t acked = cs->acked;
+	uint32_t expand;
+
+	/* slow start as long as we're not recovering from lost packets */
+	if (tcb->cwind >= tcb->snd.wnd || tcb->snd.recovery)
+		return;
+	if (tcb->cwind < tcb->ssthresh) {
+		/* We increase the cwind by every byte we receive.  We want to increase
+		 * the cwind by one MSS for every MSS that gets ACKed.  Note that
+		 * multiple MSSs can be ACKed in a single ACK.  If we had a remainder of
+		 * acked / MSS, we'd add just that remainder - not 0 or 1 MSS. */
+		expand = acked;
+	} else {
+		/* Every RTT, which consists of CWND bytes, we're supposed to expand by
+		 * MSS bytes.  The classic algorithm was
+		 * 		expand = (tcb->mss * tcb->mss) / tcb->cwind;
+		 * which assumes the ACK was for MSS bytes.  Instead, for every 'acked'
+		 * bytes, we increase the window by acked / CWND (in units of MSS). */
+		expand = MAX(acked, tcb->typical_mss) * tcb->typical_mss / tcb->cwind;
+	}
+
+	if (tcb->cwind + expand < tcb->cwind)
+		expand = tcb->snd.wnd - tcb->cwind;
+	if (tcb->cwind + expand > tcb->snd.wnd)
+		expand = tcb->snd.wnd - tcb->cwind;
+	tcb->cwind += expand;
+}
+
+static void reno_loss(struct conv *s, Tcpctl *tcb, bool rto)
+{
+	tcb->ssthresh = tcb->cwind / 2;
+	tcb->cwind = tcb->ssthresh;
+}
+
+struct tcp_cc_ops tcp_cc_reno = {
+	.name = "reno",
+	.init = reno_init,
+	.ack = reno_ack,
+	.loss = reno_loss,
+};
+
+enum {
+	BBR_STARTUP,
+	BBR_DRAIN,
+	BBR_PROBE_BW,
+	BBR_PROBE_RTT,
+};
+
+#define BBR_UNIT				256
+#define BBR_HIGH_GAIN			(BBR_UNIT * 2885 / 1000 + 1)
+#define BBR_DRAIN_GAIN			(BBR_UNIT * 1000 / 2885)
+#define BBR_CWND_GAIN			(BBR_UNIT * 2)
+#define BBR_FULL_BW_THRESH		(BBR_UNIT * 5 / 4)
+#define BBR_FULL_BW_CNT			3
+#define BBR_MIN_RTT_WIN_MS		10000
+#define BBR_PROBE_RTT_MS		200
+#define BBR_MIN_CWND			4		/* in segments */
+#define BBR_NR_CYCLES			8
+
+static const uint32_t bbr_cycle_gains[BBR_NR_CYCLES] = {
+	BBR_UNIT * 5 / 4, BBR_UNIT * 3 / 4,
+	BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT,
+};
+
+static uint32_t bbr_min_cwnd(Tcpctl *tcb)
+{
+	return BBR_MIN_CWND * tcb->typical_mss;
+}
+
+/* The bandwidth-delay product, scaled by gain.  0 if we don't know it yet. */
+static uint64_t bbr_bdp(struct tcp_bbr *b, uint32_t gain)
+{
+	if (!b->bw || b->min_rtt_us == UINT64_MAX)
+		return 0;
+	return b->bw * b->min_rtt_us / 1000000 * gain / BBR_UNIT;
+}
+
+static void bbr_set_pacing_rate(Tcpctl *tcb, struct tcp_bbr *b)
+{
+	uint64_t rate, srtt_us;
+
+	if (b->bw) {
+		rate = b->bw * b->pacing_gain / BBR_UNIT;
+	} else {
+		/* No samples yet; go by the initial cwind and the SYN's RTT. */
+		srtt_us = MAX(tcb->srtt, 1) * 1000ULL;
+		rate = tcb->cwind * 1000000ULL / srtt_us * b->pacing_gain / BBR_UNIT;
+	}
+	/* In STARTUP, the bw samples might lag the real rate.  Don't slow down. */
+	if (!b->full_bw_reached && rate < tcb->pacing_rate)
+		return;
+	tcb->pacing_rate = MAX(rate, 1);
+}
+
+static void bbr_set_mode(struct tcp_bbr *b, uint8_t mode, uint64_t now_us)
+{
+	b->mode = mode;
+	switch (mode) {
+	case BBR_STARTUP:
+		b->pacing_gain = BBR_HIGH_GAIN;
+		b->cwnd_gain = BBR_HIGH_GAIN;
+		break;
+	case BBR_DRAIN:
+		b->pacing_gain = BBR_DRAIN_GAIN;
+		b->cwnd_gain = BBR_HIGH_GAIN;
+		break;
+	case BBR_PROBE_BW:
+		/* Don't start in the drain phase, 1, right after DRAIN. */
+		b->cycle_idx = 2 + b->round % (BBR_NR_CYCLES - 2);
+		b->cycle_stamp_us = now_us;
+		b->pacing_gain = bbr_cycle_gains[b->cycle_idx];
+		b->cwnd_gain = BBR_CWND_GAIN;
+		break;
+	case BBR_PROBE_RTT:
+		b->pacing_gain = BBR_UNIT;
+		b->cwnd_gain = BBR_UNIT;
+		break;
+	}
+}
+
+static void bbr_init(struct conv *s, Tcpctl *tcb)
+{
+	struct tcp_bbr *b = &tcb->cc_priv.bbr;
+	uint64_t now_us = tsc2usec(read_tsc());
+
+	memset(b, 0, sizeof(struct tcp_bbr));
+	b->min_rtt_us = UINT64_MAX;
+	b->min_rtt_stamp_ms = now_us / 1000;
+	b->round_end = tcb->snd.nxt;
+	b->round_start_us = now_us;
+	bbr_set_mode(b, BBR_STARTUP, now_us);
+	tcb->pacing_rate = 0;
+	bbr_set_pacing_rate(tcb, b);
+}
+
+/* Returns TRUE if this ACK ended a round trip, and takes the round's delivery
+ * rate as a bandwidth sample. */
+static bool bbr_update_round(Tcpctl *tcb, struct tcp_bbr *b, uint64_t now_us)
+{
+	uint64_t interval = now_us - b->round_start_us;
+	uint64_t sample = 0;
+	unsigned int slot;
+
+	if (seq_lt(tcb->snd.una, b->round_end))
+		return FALSE;
+	if (interval)
+		sample = (b->delivered - b->round_delivered) * 1000000 / interval;
+	b->round++;
+	slot = b->round % BBR_BW_ROUNDS;
+	b->bw_rounds[slot] = sample;
+	b->bw = 0;
+	for (int i = 0; i < BBR_BW_ROUNDS; i++)
+		b->bw = MAX(b->bw, b->bw_rounds[i]);
+	b->round_end = tcb->snd.nxt;
+	b->round_start_us = now_us;
+	b->round_delivered = b->delivered;
+	return TRUE;
+}
+
+static void bbr_check_full_bw(struct tcp_bbr *b)
+{
+	if (b->full_bw_reached)
+		return;
+	if (b->bw >= b->full_bw * BBR_FULL_BW_THRESH / BBR_UNIT) {
+		b->full_bw = b->bw;
+		b->full_bw_cnt = 0;
+		return;
+	}
+	if (++b->full_bw_cnt >= BBR_FULL_BW_CNT)
+		b->full_bw_reached = TRUE;
+}
+
+static void bbr_update_min_rtt(Tcpctl *tcb, struct tcp_bbr *b,
+                               struct tcp_cc_sample *cs, uint64_t now_us)
+{
+	uint64_t now_ms = now_us / 1000;
+	bool expired = now_ms - b->min_rtt_stamp_ms > BBR_MIN_RTT_WIN_MS;
+
+	if (cs->rtt_us && (cs->rtt_us <= b->min_rtt_us || expired)) {
+		b->min_rtt_us = cs->rtt_us;
+		b->min_rtt_stamp_ms = now_ms;
+	}
+	if (expired && b->mode != BBR_PROBE_RTT) {
+		b->prior_cwnd = tcb->cwind;
+		b->probe_rtt_done_ms = now_ms + BBR_PROBE_RTT_MS;
+		bbr_set_mode(b, BBR_PROBE_RTT, now_us);
+	}
+	if (b->mode == BBR_PROBE_RTT && now_ms >= b->probe_rtt_done_ms) {
+		b->min_rtt_stamp_ms = now_ms;
+		tcb->cwind = MAX(tcb->cwind, b->prior_cwnd);
+		bbr_set_mode(b, b->full_bw_reached ? BBR_PROBE_BW : BBR_STARTUP,
+		             now_us);
+	}
+}
+
+static void bbr_update_mode(Tcpctl *tcb, struct tcp_bbr *b, uint64_t now_us)
+{
+	switch (b->mode) {
+	case BBR_STARTUP:
+		if (b->full_bw_reached)
+			bbr_set_mode(b, BBR_DRAIN, now_us);
+		break;
+	case BBR_DRAIN:
+		if (tcb->snd.in_flight <= bbr_bdp(b, BBR_UNIT))
+			bbr_set_mode(b, BBR_PROBE_BW, now_us);
+		break;
+	case BBR_PROBE_BW:
+		if (b->min_rtt_us != UINT64_MAX &&
+		    now_us - b->cycle_stamp_us > b->min_rtt_us) {
+			b->cycle_idx = (b->cycle_idx + 1) % BBR_NR_CYCLES;
+			b->cycle_stamp_us = now_us;
+			b->pacing_gain = bbr_cycle_gains[b->cycle_idx];
+		}
+		break;
+	}
+}
+
+static void bbr_set_cwnd(Tcpctl *tcb, struct tcp_bbr *b,
+                         struct tcp_cc_sample *cs)
+{
+	uint64_t target = bbr_bdp(b, b->cwnd_gain);
+	uint64_t cwnd = tcb->cwind;
+
+	if (target) {
+		/* Room for the TSO segments and delayed ACKs in flight */
+		target += 3 * tcb->typical_mss;
+	}
+	if (b->full_bw_reached)
+		cwnd = MIN(cwnd + cs->delivered, target);
+	else if ((!target || cwnd < target) && cwnd < tcb->snd.wnd)
+		cwnd += cs->delivered;
+	cwnd = MAX(cwnd, bbr_min_cwnd(tcb));
+	if (b->mode == BBR_PROBE_RTT)
+		cwnd = MIN(cwnd, bbr_min_cwnd(tcb));
+	tcb->cwind = MIN(cwnd, UINT32_MAX);
+}
+
+static void bbr_ack(struct conv *s, Tcpctl *tcb, struct tcp_cc_sample *cs)
+{
+	struct tcp_bbr *b = &tcb->cc_priv.bbr;
+	uint64_t now_us = tsc2usec(read_tsc());
+
+	b->delivered += cs->delivered;
+	if (bbr_update_round(tcb, b, now_us))
+		bbr_check_full_bw(b);
+	bbr_update_min_rtt(tcb, b, cs, now_us);
+	bbr_update_mode(tcb, b, now_us);
+	bbr_set_cwnd(tcb, b, cs);
+	bbr_set_pacing_rate(tcb, b);
+}
+
+/* Loss isn't a congestion signal for BBR, and the pacing rate already keeps
+ * the queue down.  We keep cwind, which lets PRR (or SACK recovery) send what
+ * gets delivered.  After an RTO, we can't trust in_flight, so we start small
+ * and let bbr_set_cwnd() grow it back. */
+static void bbr_loss(struct conv *s, Tcpctl *tcb, bool rto)
+{
+	if (rto)
+		tcb->cwind = bbr_min_cwnd(tcb);
+	tcb->ssthresh = tcb->cwind;
+}
+
+struct tcp_cc_ops tcp_cc_bbr = {
+	.name = "bbr",
+	.init = bbr_init,
+	.ack = bbr_ack,
+	.loss = bbr_loss,
+};
+
+static struct tcp_cc_ops *tcp_ccs[] = {
+	&tcp_cc_reno,
+	&tcp_cc_bbr,
+};
+
+struct tcp_cc_ops *tcp_cc_lookup(const char *name)
+{
+	for (int i = 0; i < COUNT_OF(tcp_ccs); i++) {
+		if (!strcmp(tcp_ccs[i]->name, name))
+			return tcp_ccs[i];
+	}
+	return NULL;
+}
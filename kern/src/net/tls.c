@@ -0,0 +1,522 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Kernel TLS records for TCP conversations.
+ *
+ * The user does the handshake, then hands us the traffic keys for either
+ * direction with a ctl message:
+ *
+ * 	tls tx|rx 1.2|1.3 aes128gcm|aes256gcm KEY SALT IV SEQ
+ *
+ * in hex, like Linux's tls12_crypto_info: a 4 byte salt, an 8 byte IV, and the
+ * 8 byte record sequence number to start at.  From then on, writes to the data
+ * file are cut into application data records and sealed as they are queued
+ * toward tcpoutput(), and reads of the data file return the plaintext of the
+ * records coming in.  Writes can come from splice, so a file can go out
+ * encrypted without a trip through userspace.
+ *
+ * 	tls closenotify
+ *
+ * sends a close_notify alert.  An incoming close_notify is EOF.  We don't pass
+ * other control records up: a received alert or post-handshake message (such as
+ * a TLS 1.3 KeyUpdate) is an error for good, as is a bad MAC.  We can't rekey,
+ * either: each direction can be set up once.
+ *
+ * Each direction has a qlock, held while we build and queue a record, or read
+ * one in.  That keeps records and sequence numbers in order.  Reads return the
+ * plaintext of at most one record.
+ *
+ * Records are sealed in software, with AES-NI if we have it.  A NIC that can
+ * do the crypto could take the keys and the sequence numbers from here. */
+
+#include <net/ip.h>
+#include <aes_gcm.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <error.h>
+
+#define TLS_HDR_LEN				5
+#define TLS_EXPLICIT_IV_LEN		8
+#define TLS_SALT_LEN			4
+#define TLS_MAX_PLAINTEXT		16384
+/* 1.3 allows 256 bytes of expansion, 1.2 allows more, but GCM only needs 24. */
+#define TLS_MAX_REC_LEN			(TLS_MAX_PLAINTEXT + 256)
+
+#define TLS_ALERT				21
+#define TLS_APPLICATION_DATA	23
+
+#define TLS_ALERT_WARNING		1
+#define TLS_ALERT_CLOSE_NOTIFY	0
+
+#define TLS_WIRE_VERSION		0x0303
+
+enum {
+	TLS_1_2 = 0x0303,
+	TLS_1_3 = 0x0304,
+};
+
+struct tls {
+	qlock_t						qlock;
+	int							version;
+	struct aes_gcm_ctx			gcm;
+	/* salt || IV.  For 1.2, the IV is the explicit nonce we send, and we only
+	 * use the salt on receive. */
+	uint8_t						iv[AES_GCM_IV_LEN];
+	uint64_t					seq;
+	/* rx: the record coming in, and what's left of the last one's plaintext */
+	uint8_t						*buf;
+	size_t						have;
+	size_t						off;
+	size_t						len;
+	int							err;
+	const char					*why;
+	bool						eof;
+};
+
+static int tls_hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static void tls_hex(const char *s, uint8_t *out, size_t len, const char *what)
+{
+	int hi, lo;
+
+	if (strlen(s) != len * 2)
+		error(EINVAL, "tls %s needs %d hex digits", what, len * 2);
+	for (int i = 0; i < len; i++) {
+		hi = tls_hexval(s[i * 2]);
+		lo = tls_hexval(s[i * 2 + 1]);
+		if (hi < 0 || lo < 0)
+			error(EINVAL, "tls %s is not hex: %s", what, s);
+		out[i] = (hi << 4) | lo;
+	}
+}
+
+/* The per-record nonce.  1.2: salt || explicit IV, 1.3: IV ^ seq. */
+static void tls_nonce(struct tls *t, const uint8_t *explicit, uint8_t *nonce)
+{
+	uint8_t seq[8];
+
+	memcpy(nonce, t->iv, AES_GCM_IV_LEN);
+	if (t->version == TLS_1_2) {
+		memcpy(nonce + TLS_SALT_LEN, explicit, TLS_EXPLICIT_IV_LEN);
+		return;
+	}
+	hnputv(seq, t->seq);
+	for (int i = 0; i < 8; i++)
+		nonce[4 + i] ^= seq[i];
+}
+
+/* 1.2's AAD is the pseudo-header seq || type || version || plaintext length. */
+static void tls12_aad(struct tls *t, uint8_t type, size_t len, uint8_t *aad)
+{
+	hnputv(aad, t->seq);
+	aad[8] = type;
+	hnputs(aad + 9, TLS_WIRE_VERSION);
+	hnputs(aad + 11, len);
+}
+
+static void tls_advance(struct tls *t)
+{
+	t->seq++;
+	if (t->version != TLS_1_2)
+		return;
+	for (int i = AES_GCM_IV_LEN - 1; i >= TLS_SALT_LEN; i--) {
+		if (++t->iv[i])
+			break;
+	}
+}
+
+/* Builds a sealed record of type, from len bytes of the iovecs. */
+static struct block *tls_seal(struct tls *t, uint8_t type, struct iovec *iov,
+                              int iovcnt, int *idx, size_t *off, size_t len)
+{
+	struct block *b;
+	uint8_t *p, *data, nonce[AES_GCM_IV_LEN], aad[13];
+	size_t hdr_len = TLS_HDR_LEN, ct_len = len, amt, left;
+
+	if (t->version == TLS_1_2)
+		hdr_len += TLS_EXPLICIT_IV_LEN;
+	else
+		ct_len++;	/* the real content type */
+	b = block_alloc(hdr_len + ct_len + AES_GCM_TAG_LEN, MEM_WAIT);
+	p = b->wp;
+	p[0] = t->version == TLS_1_2 ? type : TLS_APPLICATION_DATA;
+	hnputs(p + 1, TLS_WIRE_VERSION);
+	hnputs(p + 3, hdr_len - TLS_HDR_LEN + ct_len + AES_GCM_TAG_LEN);
+	data = p + hdr_len;
+	for (left = len; left; left -= amt) {
+		assert(*idx < iovcnt);
+		amt = MIN(iov[*idx].iov_len - *off, left);
+		memcpy(data + len - left, iov[*idx].iov_base + *off, amt);
+		*off += amt;
+		if (*off == iov[*idx].iov_len) {
+			(*idx)++;
+			*off = 0;
+		}
+	}
+	if (t->version == TLS_1_2) {
+		memcpy(p + TLS_HDR_LEN, t->iv + TLS_SALT_LEN, TLS_EXPLICIT_IV_LEN);
+		tls_nonce(t, t->iv + TLS_SALT_LEN, nonce);
+		tls12_aad(t, type, len, aad);
+		aes_gcm_encrypt(&t->gcm, nonce, aad, 13, data, ct_len, data + ct_len);
+	} else {
+		data[len] = type;
+		tls_nonce(t, NULL, nonce);
+		aes_gcm_encrypt(&t->gcm, nonce, p, TLS_HDR_LEN, data, ct_len,
+		                data + ct_len);
+	}
+	b->wp += hdr_len + ct_len + AES_GCM_TAG_LEN;
+	tls_advance(t);
+	return b;
+}
+
+/* Seals and queues one record.  Caller holds the qlock.  If we don't queue it,
+ * the sequence number goes back, so the peer won't see a gap. */
+static void tls_send_record(struct conv *c, struct tls *t, uint8_t type,
+                            struct iovec *iov, int iovcnt, int *idx,
+                            size_t *off, size_t len, bool nonblock)
+{
+	ERRSTACK(1);
+	struct block *b;
+	uint64_t seq = t->seq;
+	uint8_t iv[AES_GCM_IV_LEN];
+
+	memcpy(iv, t->iv, AES_GCM_IV_LEN);
+	b = tls_seal(t, type, iov, iovcnt, idx, off, len);
+	/* A blocking qbwrite can fail after the block is queued, waiting for the
+	 * queue to drain, so the record is out.  Nonblocking fails before. */
+	if (!nonblock) {
+		qbwrite(c->wq, b);
+		return;
+	}
+	if (waserror()) {
+		t->seq = seq;
+		memcpy(t->iv, iv, AES_GCM_IV_LEN);
+		nexterror();
+	}
+	qbwrite_nonblock(c->wq, b);
+	poperror();
+}
+
+/* Writes the iovecs to c as application data records.  Like qwrite, an error
+ * after some records went out is a short write. */
+size_t tls_write(struct conv *c, struct iovec *iov, int iovcnt, bool nonblock)
+{
+	ERRSTACK(1);
+	struct tls *t = c->tls_tx;
+	size_t len = iov_length(iov, iovcnt), n;
+	volatile size_t sofar = 0;
+	int idx = 0;
+	size_t off = 0;
+
+	qlock(&t->qlock);
+	if (waserror()) {
+		qunlock(&t->qlock);
+		if (sofar) {
+			poperror();
+			return sofar;
+		}
+		nexterror();
+	}
+	while (sofar < len) {
+		n = MIN(len - sofar, TLS_MAX_PLAINTEXT);
+		tls_send_record(c, t, TLS_APPLICATION_DATA, iov, iovcnt, &idx, &off,
+		                n, nonblock);
+		sofar += n;
+	}
+	poperror();
+	qunlock(&t->qlock);
+	return sofar;
+}
+
+/* Writes the contents of the block list bp, e.g. from splice, and frees it. */
+size_t tls_bwrite(struct conv *c, struct block *bp, bool nonblock)
+{
+	ERRSTACK(1);
+	struct iovec *iov;
+	struct extra_bdata *ebd;
+	int nr = 0;
+	size_t ret;
+
+	for (struct block *b = bp; b; b = b->next)
+		nr += 1 + b->nr_extra_bufs;
+	iov = kmalloc(nr * sizeof(struct iovec), MEM_WAIT);
+	nr = 0;
+	for (struct block *b = bp; b; b = b->next) {
+		if (BHLEN(b)) {
+			iov[nr].iov_base = b->rp;
+			iov[nr++].iov_len = BHLEN(b);
+		}
+		for (int i = 0; i < b->nr_extra_bufs; i++) {
+			ebd = &b->extra_data[i];
+			if (!ebd->base || !ebd->len)
+				continue;
+			iov[nr].iov_base = (void*)(ebd->base + ebd->off);
+			iov[nr++].iov_len = ebd->len;
+		}
+	}
+	if (waserror()) {
+		kfree(iov);
+		freeblist(bp);
+		nexterror();
+	}
+	ret = tls_write(c, iov, nr, nonblock);
+	poperror();
+	kfree(iov);
+	freeblist(bp);
+	return ret;
+}
+
+/* Rx errors stick, since we can't find the next record after a bad one. */
+static void tls_rx_fail(struct tls *t, int err, const char *why)
+{
+	t->err = err;
+	t->why = why;
+	error(err, why);
+}
+
+/* Reads until we have want bytes of the record.  Returns FALSE on EOF. */
+static bool tls_rx_fill(struct conv *c, struct tls *t, size_t want,
+                        bool nonblock)
+{
+	size_t amt;
+
+	while (t->have < want) {
+		if (nonblock)
+			amt = qread_nonblock(c->rq, t->buf + t->have, want - t->have);
+		else
+			amt = qread(c->rq, t->buf + t->have, want - t->have);
+		if (!amt)
+			return FALSE;
+		t->have += amt;
+	}
+	return TRUE;
+}
+
+/* Reads in and opens the next record.  Returns FALSE on a clean EOF. */
+static bool tls_rx_record(struct conv *c, struct tls *t, bool nonblock)
+{
+	uint8_t nonce[AES_GCM_IV_LEN], aad[13], *data, type;
+	size_t rec_len, ct_len, min_len = AES_GCM_TAG_LEN;
+
+	if (t->version == TLS_1_2)
+		min_len += TLS_EXPLICIT_IV_LEN;
+	else
+		min_len++;
+	if (!tls_rx_fill(c, t, TLS_HDR_LEN, nonblock)) {
+		if (t->have)
+			tls_rx_fail(t, EIO, "tls: truncated record header");
+		return FALSE;
+	}
+	type = t->buf[0];
+	rec_len = nhgets(t->buf + 3);
+	if (nhgets(t->buf + 1) != TLS_WIRE_VERSION)
+		tls_rx_fail(t, EPROTO, "tls: bad record version");
+	if (rec_len > TLS_MAX_REC_LEN)
+		tls_rx_fail(t, EMSGSIZE, "tls: record too long");
+	if (rec_len < min_len)
+		tls_rx_fail(t, EPROTO, "tls: record too short");
+	if (t->version == TLS_1_3 && type != TLS_APPLICATION_DATA)
+		tls_rx_fail(t, EPROTO, "tls: unprotected record");
+	if (!tls_rx_fill(c, t, TLS_HDR_LEN + rec_len, nonblock))
+		tls_rx_fail(t, EIO, "tls: truncated record");
+	t->have = 0;
+
+	if (t->version == TLS_1_2) {
+		data = t->buf + TLS_HDR_LEN + TLS_EXPLICIT_IV_LEN;
+		ct_len = rec_len - TLS_EXPLICIT_IV_LEN - AES_GCM_TAG_LEN;
+		tls_nonce(t, t->buf + TLS_HDR_LEN, nonce);
+		tls12_aad(t, type, ct_len, aad);
+		if (!aes_gcm_decrypt(&t->gcm, nonce, aad, 13, data, ct_len,
+		                     data + ct_len))
+			tls_rx_fail(t, EBADMSG, "tls: bad record MAC");
+	} else {
+		data = t->buf + TLS_HDR_LEN;
+		ct_len = rec_len - AES_GCM_TAG_LEN;
+		tls_nonce(t, NULL, nonce);
+		if (!aes_gcm_decrypt(&t->gcm, nonce, t->buf, TLS_HDR_LEN, data,
+		                     ct_len, data + ct_len))
+			tls_rx_fail(t, EBADMSG, "tls: bad record MAC");
+		/* The real type is the last nonzero byte, then padding. */
+		while (ct_len && !data[ct_len - 1])
+			ct_len--;
+		if (!ct_len)
+			tls_rx_fail(t, EPROTO, "tls: record has no content type");
+		type = data[--ct_len];
+	}
+	t->seq++;
+
+	switch (type) {
+	case TLS_APPLICATION_DATA:
+		t->off = data - t->buf;
+		t->len = ct_len;
+		return TRUE;
+	case TLS_ALERT:
+		if (ct_len == 2 && data[1] == TLS_ALERT_CLOSE_NOTIFY) {
+			t->eof = TRUE;
+			return FALSE;
+		}
+		tls_rx_fail(t, ECONNRESET, "tls: received an alert");
+		break;
+	default:
+		tls_rx_fail(t, EPROTO, "tls: received a control record");
+	}
+	return FALSE;
+}
+
+/* Reads plaintext from c, at most the rest of one record. */
+size_t tls_read(struct conv *c, void *va, size_t n, bool nonblock)
+{
+	ERRSTACK(1);
+	struct tls *t = c->tls_rx;
+	size_t ret = 0;
+
+	qlock(&t->qlock);
+	if (waserror()) {
+		qunlock(&t->qlock);
+		nexterror();
+	}
+	while (!t->len) {
+		if (t->err)
+			error(t->err, t->why);
+		if (t->eof || !tls_rx_record(c, t, nonblock))
+			goto out;
+	}
+	ret = MIN(n, t->len);
+	memcpy(va, t->buf + t->off, ret);
+	t->off += ret;
+	t->len -= ret;
+out:
+	poperror();
+	qunlock(&t->qlock);
+	return ret;
+}
+
+static void tls_close_notify(struct conv *c)
+{
+	ERRSTACK(1);
+	struct tls *t = c->tls_tx;
+	uint8_t alert[2] = {TLS_ALERT_WARNING, TLS_ALERT_CLOSE_NOTIFY};
+	struct iovec iov = {alert, sizeof(alert)};
+	int idx = 0;
+	size_t off = 0;
+
+	if (!t)
+		error(EINVAL, "tls closenotify needs tls tx");
+	qlock(&t->qlock);
+	if (waserror()) {
+		qunlock(&t->qlock);
+		nexterror();
+	}
+	/* Nonblocking: we might hold the conv's qlock, which TCP needs to drain
+	 * the queue. */
+	tls_send_record(c, t, TLS_ALERT, &iov, 1, &idx, &off, sizeof(alert), TRUE);
+	poperror();
+	qunlock(&t->qlock);
+}
+
+/* tls tx|rx 1.2|1.3 aes128gcm|aes256gcm KEY SALT IV SEQ, or tls closenotify.
+ * Caller holds c's qlock. */
+void tlsctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	ERRSTACK(1);
+	struct tls *t, **dir;
+	uint8_t key[32], seq[8];
+	int version, key_len;
+
+	if (strcmp(c->p->name, "tcp"))
+		error(EPROTONOSUPPORT, "tls needs a tcp conversation");
+	if (c->state == Bypass)
+		error(EINVAL, "tls can't be used on a bypassed conversation");
+	if (cb->nf == 2 && !strcmp(cb->f[1], "closenotify")) {
+		tls_close_notify(c);
+		return;
+	}
+	if (cb->nf != 8)
+		error(EINVAL, "usage: tls tx|rx 1.2|1.3 aes128gcm|aes256gcm key salt iv seq");
+	if (!strcmp(cb->f[1], "tx"))
+		dir = &c->tls_tx;
+	else if (!strcmp(cb->f[1], "rx"))
+		dir = &c->tls_rx;
+	else
+		error(EINVAL, "tls direction must be tx or rx, not %s", cb->f[1]);
+	if (*dir)
+		error(EBUSY, "tls %s is already set, and we can't rekey", cb->f[1]);
+	if (!strcmp(cb->f[2], "1.2"))
+		version = TLS_1_2;
+	else if (!strcmp(cb->f[2], "1.3"))
+		version = TLS_1_3;
+	else
+		error(EINVAL, "tls version must be 1.2 or 1.3, not %s", cb->f[2]);
+	if (!strcmp(cb->f[3], "aes128gcm"))
+		key_len = 16;
+	else if (!strcmp(cb->f[3], "aes256gcm"))
+		key_len = 32;
+	else
+		error(EINVAL, "unsupported tls cipher %s", cb->f[3]);
+	tls_hex(cb->f[4], key, key_len, "key");
+	tls_hex(cb->f[7], seq, sizeof(seq), "seq");
+
+	t = kzmalloc(sizeof(struct tls), MEM_WAIT);
+	qlock_init(&t->qlock);
+	t->version = version;
+	t->seq = nhgetv(seq);
+	if (waserror()) {
+		memset(key, 0, sizeof(key));
+		tls_free(t);
+		nexterror();
+	}
+	tls_hex(cb->f[5], t->iv, TLS_SALT_LEN, "salt");
+	tls_hex(cb->f[6], t->iv + TLS_SALT_LEN, TLS_EXPLICIT_IV_LEN, "iv");
+	aes_gcm_setkey(&t->gcm, key, key_len);
+	if (dir == &c->tls_rx)
+		t->buf = kmalloc(TLS_HDR_LEN + TLS_MAX_REC_LEN, MEM_WAIT);
+	poperror();
+	memset(key, 0, sizeof(key));
+	/* Readers and writers look at the pointer without the conv's qlock. */
+	wmb();
+	*dir = t;
+}
+
+/* Frees t, which no one else can see, and wipes its keys. */
+void tls_free(struct tls *t)
+{
+	if (!t)
+		return;
+	if (t->buf) {
+		memset(t->buf, 0, TLS_HDR_LEN + TLS_MAX_REC_LEN);
+		kfree(t->buf);
+	}
+	memset(t, 0, sizeof(struct tls));
+	kfree(t);
+}
+
+static int tls_dir_state(struct tls *t, const char *name, char *buf, int len)
+{
+	if (!t)
+		return 0;
+	return snprintf(buf, len, "tls %s %s %s seq %llu%s\n", name,
+	                t->version == TLS_1_2 ? "1.2" : "1.3",
+	                t->gcm.nr_rounds == 10 ? "aes128gcm" : "aes256gcm",
+	                t->seq, t->err ? " failed" : t->eof ? " eof" : "");
+}
+
+/* Appends c's TLS state to a Qstatus buffer.  Returns the length added. */
+int tls_state(struct conv *c, char *buf, int len)
+{
+	int n = 0;
+
+	n += tls_dir_state(c->tls_tx, "tx", buf + n, len - n);
+	if (n < len)
+		n += tls_dir_state(c->tls_rx, "rx", buf + n, len - n);
+	return MIN(n, len);
+}
@@ -110,20 +110,28 @@ struct Udp6hdr {
 };
 
 /* MIB II counters */
-typedef struct Udpstats Udpstats;
-struct Udpstats {
-	uint32_t udpInDatagrams;
-	uint32_t udpNoPorts;
-	uint32_t udpInErrors;
-	uint32_t udpOutDatagrams;
+enum {
+	InDatagrams,
+	NoPorts,
+	InErrors,
+	OutDatagrams,
+
+	Nstats,
+};
+
+static char *statnames[] = {
+	[InDatagrams] "InDatagrams",
+	[NoPorts] "NoPorts",
+	[InErrors] "InErrors",
+	[OutDatagrams] "OutDatagrams",
 };
 
 typedef struct Udppriv Udppriv;
 struct Udppriv {
 	struct Ipht ht;
 
-	/* MIB counters */
-	Udpstats ustats;
+	/* MIB counters, percpu, see netstats_alloc() */
+	uint64_t *stats;
 
 	/* non-MIB stats */
 	uint32_t csumerr;			/* checksum errors */
@@ -363,12 +371,14 @@ void udpkick(void *x, struct block *bp)
 			hnputs(uh6->udplen, ptcllen);
 			uh6->udpcksum[0] = 0;
 			uh6->udpcksum[1] = 0;
-			hnputs(uh6->udpcksum,
-				   ptclcsum(bp, UDP6_PHDR_OFF,
-							dlen + UDP_UDPHDR_SZ + UDP6_PHDR_SZ));
-			memset(uh6, 0, 8);
 			bp->network_offset = 0;
 			bp->transport_offset = offsetof(Udp6hdr, udpsport);
+			assert(bp->transport_offset == UDP6_IPHDR_SZ);
+			hnputs(uh6->udpcksum,
+				   ~ptclcsum(bp, UDP6_PHDR_OFF, UDP6_PHDR_SZ));
+			bp->tx_csum_offset = uh6->udpcksum - uh6->udpsport;
+			bp->flag |= Budpck;
+			memset(uh6, 0, 8);
 			uh6->viclfl[0] = IP_VER6;
 			hnputs(uh6->len, ptcllen);
 			uh6->nextheader = IP_UDPPROTO;
@@ -378,7 +388,7 @@ void udpkick(void *x, struct block *bp)
 		default:
 			panic("udpkick: version %d", version);
 	}
-	upriv->ustats.udpOutDatagrams++;
+	netstat_inc(upriv->stats, OutDatagrams);
 }
 
 void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
@@ -398,7 +408,7 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 
 	upriv = udp->priv;
 	f = udp->f;
-	upriv->ustats.udpInDatagrams++;
+	netstat_inc(upriv->stats, InDatagrams);
 
 	uh4 = (Udp4hdr *) (bp->rp);
 	version = ((uh4->vihl & 0xF0) == IP_VER6) ? V6 : V4;
@@ -423,7 +433,7 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 			if (!(bp->flag & Budpck) &&
 			    (uh4->udpcksum[0] || uh4->udpcksum[1]) &&
 			    ptclcsum(bp, UDP4_PHDR_OFF, len + UDP4_PHDR_SZ)) {
-				upriv->ustats.udpInErrors++;
+				netstat_inc(upriv->stats, InErrors);
 				netlog(f, Logudp, "udp: checksum error %I\n",
 				       raddr);
 				printd("udp: checksum error %I\n", raddr);
@@ -446,8 +456,9 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 			memset(uh6, 0, 8);
 			hnputl(uh6->viclfl, len);
 			uh6->hoplimit = IP_UDPPROTO;
-			if (ptclcsum(bp, UDP6_PHDR_OFF, len + UDP6_PHDR_SZ)) {
-				upriv->ustats.udpInErrors++;
+			if (!(bp->flag & Budpck) &&
+			    ptclcsum(bp, UDP6_PHDR_OFF, len + UDP6_PHDR_SZ)) {
+				netstat_inc(upriv->stats, InErrors);
 				netlog(f, Logudp, "udp: checksum error %I\n", raddr);
 				printd("udp: checksum error %I\n", raddr);
 				freeblist(bp);
@@ -466,7 +477,7 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 	c = iphtlook(&upriv->ht, raddr, rport, laddr, lport);
 	if (c == NULL) {
 		/* no converstation found */
-		upriv->ustats.udpNoPorts++;
+		netstat_inc(upriv->stats, NoPorts);
 		netlog(f, Logudp, "udp: no conv %I!%d -> %I!%d\n", raddr, rport,
 			   laddr, lport);
 
@@ -610,7 +621,7 @@ void udpadvise(struct Proto *udp, struct block *bp, char *msg)
 	Udp6hdr *h6;
 	uint8_t source[IPaddrlen], dest[IPaddrlen];
 	uint16_t psource, pdest;
-	struct conv *s, **p;
+	struct conv *s;
 	int version;
 
 	h4 = (Udp4hdr *) (bp->rp);
@@ -636,21 +647,12 @@ void udpadvise(struct Proto *udp, struct block *bp, char *msg)
 	}
 
 	/* Look for a connection */
-	for (p = udp->conv; *p; p++) {
-		s = *p;
-		if (s->rport == pdest)
-			if (s->lport == psource)
-				if (ipcmp(s->raddr, dest) == 0)
-					if (ipcmp(s->laddr, source) == 0) {
-						if (s->ignoreadvice)
-							break;
-						qlock(&s->qlock);
-						qhangup(s->rq, msg);
-						qhangup(s->wq, msg);
-						qunlock(&s->qlock);
-						freeblist(bp);
-						return;
-					}
+	s = iphtfind(udp->ht, NULL, dest, pdest, source, psource);
+	if (s && !s->ignoreadvice) {
+		qlock(&s->qlock);
+		qhangup(s->rq, msg);
+		qhangup(s->wq, msg);
+		qunlock(&s->qlock);
 	}
 	freeblist(bp);
 }
@@ -663,10 +665,9 @@ int udpstats(struct Proto *udp, char *buf, int len)
 	upriv = udp->priv;
 	p = buf;
 	e = p + len;
-	p = seprintf(p, e, "InDatagrams: %u\n", upriv->ustats.udpInDatagrams);
-	p = seprintf(p, e, "NoPorts: %u\n", upriv->ustats.udpNoPorts);
-	p = seprintf(p, e, "InErrors: %u\n", upriv->ustats.udpInErrors);
-	p = seprintf(p, e, "OutDatagrams: %u\n", upriv->ustats.udpOutDatagrams);
+	for (int i = 0; i < Nstats; i++)
+		p = seprintf(p, e, "%s: %lu\n", statnames[i],
+		             netstat_read(upriv->stats, i));
 	return p - buf;
 }
 
@@ -676,6 +677,8 @@ void udpinit(struct Fs *fs)
 
 	udp = kzmalloc(sizeof(struct Proto), 0);
 	udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	ipht_init(&((Udppriv *)udp->priv)->ht);
+	((Udppriv *)udp->priv)->stats = netstats_alloc(Nstats);
 	udp->name = "udp";
 	udp->connect = udpconnect;
 	udp->bind = udpbind;
@@ -690,6 +693,8 @@ void udpinit(struct Fs *fs)
 	udp->stats = udpstats;
 	udp->ipproto = IP_UDPPROTO;
 	udp->nc = 4096;
+	udp->maxnc = Maxconv;
+	udp->ht = &((Udppriv *)udp->priv)->ht;
 	udp->ptclsize = sizeof(Udpcb);
 
 	Fsproto(fs, udp);
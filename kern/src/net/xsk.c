@@ -0,0 +1,400 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Mapped packet rings for #ether conversations, see ros/xsk.h.
+ *
+ * The rings and umem are one fs_file, so the user mmaps them like any other
+ * file.  Every page is in the PM from the start and stays there until the
+ * conversation closes, which can't happen while it is mapped: the VMR holds a
+ * ref on the chan.  The pages are allocated one at a time, so the PM can free
+ * them one at a time, and we get at them through the page array.  Nothing in
+ * the file crosses a page, other than rings, whose entries don't.
+ *
+ * The user can scribble on the whole file, so we keep our own copies of the
+ * indexes we own, clamp the ones the user owns, and check every umem offset we
+ * are handed.
+ *
+ * The rx side is under the spinlock, since frames can come in on several cores
+ * at once.  The tx side is under the qlock, since we block in the middle of it.
+ *
+ * This copies frames in and out of the umem, like AF_XDP's copy mode.  That's
+ * one copy each way instead of a syscall and a copy per frame. */
+
+#include <net/ip.h>
+#include <ros/xsk.h>
+#include <ros/mman.h>
+#include <kmalloc.h>
+#include <page_alloc.h>
+#include <pmap.h>
+#include <pagemap.h>
+#include <fs_file.h>
+#include <fdtap.h>
+#include <string.h>
+#include <error.h>
+
+struct netxsk {
+	struct fs_file				file;
+	struct page					**pages;
+	size_t						nr_pages;
+	struct xsk_hdr				*hdr;
+	uint32_t					mask;
+	uint32_t					nr_frames;
+	uint32_t					frame_size;
+
+	spinlock_t					rx_lock;
+	uint32_t					rx_prod;
+	uint32_t					fill_cons;
+
+	qlock_t						tx_qlock;
+	uint32_t					tx_cons;
+	uint32_t					comp_prod;
+
+	spinlock_t					tap_lock;
+	struct fdtap_slist			taps;
+};
+
+static void *xsk_ptr(struct netxsk *x, uint64_t off)
+{
+	return page2kva(x->pages[off >> PGSHIFT]) + PGOFF(off);
+}
+
+static struct xsk_desc *xsk_desc(struct netxsk *x, uint64_t ring_off,
+                                 uint32_t idx)
+{
+	return xsk_ptr(x, ring_off + (idx & x->mask) * sizeof(struct xsk_desc));
+}
+
+static uint64_t *xsk_addr(struct netxsk *x, uint64_t ring_off, uint32_t idx)
+{
+	return xsk_ptr(x, ring_off + (idx & x->mask) * sizeof(uint64_t));
+}
+
+/* Entries the user has produced for us, at most a ring's worth. */
+static uint32_t xsk_nr_avail(struct netxsk *x, struct xsk_ring *r,
+                             uint32_t cons)
+{
+	uint32_t avail = READ_ONCE(r->prod) - cons;
+
+	/* Pairs with the user's wmb before it advances prod. */
+	rmb();
+	return MIN(avail, x->mask + 1);
+}
+
+/* Slots free for us to produce into.  A user cons that's ahead of us is
+ * garbage; treat the ring as full. */
+static uint32_t xsk_nr_free(struct netxsk *x, struct xsk_ring *r,
+                            uint32_t prod)
+{
+	uint32_t used = prod - READ_ONCE(r->cons);
+
+	return used > x->mask + 1 ? 0 : x->mask + 1 - used;
+}
+
+/* Whether [addr, addr + len) is within one umem frame. */
+static bool xsk_frame_ok(struct netxsk *x, uint64_t addr, uint32_t len)
+{
+	uint64_t umem_sz = (uint64_t)x->nr_frames * x->frame_size;
+
+	if (addr >= umem_sz)
+		return FALSE;
+	return (addr & (x->frame_size - 1)) + len <= x->frame_size;
+}
+
+static void xsk_fire_taps(struct netxsk *x, int filter)
+{
+	struct fd_tap *tap_i;
+
+	spin_lock(&x->tap_lock);
+	SLIST_FOREACH(tap_i, &x->taps, link)
+		fire_tap(tap_i, filter);
+	spin_unlock(&x->tap_lock);
+}
+
+static int xsk_readpage(struct page_map *pm, struct page *pg)
+{
+	/* Every page of the file is in the PM from the start. */
+	return -EIO;
+}
+
+static int xsk_writepage(struct page_map *pm, struct page *pg)
+{
+	return 0;
+}
+
+static void xsk_punch_hole(struct fs_file *f, off64_t begin, off64_t end)
+{
+	error(EINVAL, "can't punch holes in the xsk rings");
+}
+
+static bool xsk_can_grow_to(struct fs_file *f, size_t len)
+{
+	return len <= fs_file_get_length(f);
+}
+
+static struct fs_file_ops xsk_fs_ops = {
+	.readpage = xsk_readpage,
+	.writepage = xsk_writepage,
+	.punch_hole = xsk_punch_hole,
+	.can_grow_to = xsk_can_grow_to,
+};
+
+static bool is_pow2(uint32_t x)
+{
+	return x && !(x & (x - 1));
+}
+
+struct netxsk *xsk_create(uint32_t nr_frames, uint32_t frame_size,
+                          uint32_t ring_size)
+{
+	struct netxsk *x;
+	struct xsk_hdr *hdr;
+	size_t desc_ring_sz, addr_ring_sz, off;
+	int ret;
+
+	if (!is_pow2(frame_size) || frame_size < XSK_MIN_FRAME_SIZE ||
+	    frame_size > XSK_MAX_FRAME_SIZE)
+		error(EINVAL, "xsk: bad frame size %u", frame_size);
+	if (!nr_frames || nr_frames > XSK_MAX_FRAMES)
+		error(EINVAL, "xsk: bad number of frames %u", nr_frames);
+	if (!is_pow2(ring_size) || ring_size > XSK_MAX_RING_SIZE)
+		error(EINVAL, "xsk: bad ring size %u", ring_size);
+
+	desc_ring_sz = ROUNDUP(ring_size * sizeof(struct xsk_desc), PGSIZE);
+	addr_ring_sz = ROUNDUP(ring_size * sizeof(uint64_t), PGSIZE);
+	x = kzmalloc(sizeof(struct netxsk), MEM_WAIT);
+	x->mask = ring_size - 1;
+	x->nr_frames = nr_frames;
+	x->frame_size = frame_size;
+	spinlock_init(&x->rx_lock);
+	qlock_init(&x->tx_qlock);
+	spinlock_init(&x->tap_lock);
+	SLIST_INIT(&x->taps);
+
+	off = PGSIZE + 2 * desc_ring_sz + 2 * addr_ring_sz;
+	x->nr_pages = nr_pages(off + (size_t)nr_frames * frame_size);
+	x->pages = kmalloc(sizeof(struct page *) * x->nr_pages, MEM_WAIT);
+	for (size_t i = 0; i < x->nr_pages; i++) {
+		struct page *pg = kva2page(kpage_zalloc_addr());
+
+		x->pages[i] = pg;
+		atomic_set(&pg->pg_flags, PG_UPTODATE | PG_PAGEMAP);
+		atomic_set(&pg->pg_ext_refs, 1);	/* the PM's ref */
+		sem_init(&pg->pg_sem, 1);
+	}
+
+	hdr = page2kva(x->pages[0]);
+	x->hdr = hdr;
+	hdr->version = XSK_VERSION;
+	hdr->ring_size = ring_size;
+	hdr->nr_frames = nr_frames;
+	hdr->frame_size = frame_size;
+	hdr->rx_off = PGSIZE;
+	hdr->tx_off = hdr->rx_off + desc_ring_sz;
+	hdr->fill_off = hdr->tx_off + desc_ring_sz;
+	hdr->comp_off = hdr->fill_off + addr_ring_sz;
+	hdr->umem_off = hdr->comp_off + addr_ring_sz;
+
+	fs_file_init(&x->file, "xsk", &xsk_fs_ops);
+	fs_file_init_dir(&x->file, 0, 0, &eve, 0600);
+	x->file.dir.length = x->nr_pages * PGSIZE;
+	ret = pm_insert_pages(x->file.pm, 0, x->pages, x->nr_pages);
+	if (ret) {
+		for (size_t i = 0; i < x->nr_pages; i++) {
+			atomic_set(&x->pages[i]->pg_flags, 0);
+			page_decref(x->pages[i]);
+		}
+		cleanup_fs_file(&x->file);
+		kfree(x->pages);
+		kfree(x);
+		error(-ret, "xsk: couldn't build the rings");
+	}
+	return x;
+}
+
+/* The conversation is closed, so no one has it mapped, and the caller waited
+ * out any RCU readers in the rx path. */
+void xsk_destroy(struct netxsk *x)
+{
+	/* Drops the PM's refs, which frees the pages. */
+	cleanup_fs_file(&x->file);
+	kfree(x->pages);
+	kfree(x);
+}
+
+struct fs_file *xsk_mmap(struct netxsk *x, int prot, int flags)
+{
+	if (!(flags & MAP_SHARED)) {
+		set_error(EINVAL, "The xsk rings must be MAP_SHARED");
+		return NULL;
+	}
+	return &x->file;
+}
+
+/* Copies len bytes of bp, which is at least that long, to dst. */
+static void xsk_copy_from_block(void *dst, struct block *bp, size_t len)
+{
+	struct extra_bdata *ebd;
+	size_t amt;
+
+	amt = MIN(len, BHLEN(bp));
+	memcpy(dst, bp->rp, amt);
+	dst += amt;
+	len -= amt;
+	for (int i = 0; i < bp->nr_extra_bufs && len; i++) {
+		ebd = &bp->extra_data[i];
+		if (!ebd->base || !ebd->len)
+			continue;
+		amt = MIN(len, ebd->len);
+		memcpy(dst, (void*)(ebd->base + ebd->off), amt);
+		dst += amt;
+		len -= amt;
+	}
+}
+
+/* Copies up to len bytes of bp into the next fill frame and posts it on the rx
+ * ring.  The caller still owns bp.  Returns FALSE if we dropped it. */
+bool xsk_rx(struct netxsk *x, struct block *bp, size_t len)
+{
+	struct xsk_hdr *hdr = x->hdr;
+	struct xsk_desc *desc;
+	uint64_t addr;
+	bool was_empty;
+
+	len = MIN(len, BLEN(bp));
+	len = MIN(len, x->frame_size);
+	spin_lock(&x->rx_lock);
+	if (!xsk_nr_free(x, &hdr->rx, x->rx_prod)) {
+		hdr->rx_ring_full++;
+		spin_unlock(&x->rx_lock);
+		return FALSE;
+	}
+	if (!xsk_nr_avail(x, &hdr->fill, x->fill_cons)) {
+		hdr->rx_no_fill++;
+		spin_unlock(&x->rx_lock);
+		return FALSE;
+	}
+	addr = READ_ONCE(*xsk_addr(x, hdr->fill_off, x->fill_cons));
+	x->fill_cons++;
+	WRITE_ONCE(hdr->fill.cons, x->fill_cons);
+	/* The user gave us a bad frame; they lose it. */
+	addr &= ~(uint64_t)(x->frame_size - 1);
+	if (!xsk_frame_ok(x, addr, len)) {
+		hdr->bad_descs++;
+		spin_unlock(&x->rx_lock);
+		return FALSE;
+	}
+	xsk_copy_from_block(xsk_ptr(x, hdr->umem_off + addr), bp, len);
+	desc = xsk_desc(x, hdr->rx_off, x->rx_prod);
+	desc->addr = addr;
+	desc->len = len;
+	desc->flags = 0;
+	/* The user must see the frame and desc before the new prod. */
+	wmb();
+	was_empty = READ_ONCE(hdr->rx.cons) == x->rx_prod;
+	x->rx_prod++;
+	WRITE_ONCE(hdr->rx.prod, x->rx_prod);
+	hdr->rx_packets++;
+	spin_unlock(&x->rx_lock);
+	if (was_empty)
+		xsk_fire_taps(x, FDTAP_FILT_READABLE);
+	return TRUE;
+}
+
+/* Sends everything on the tx ring with xmit(), completing each frame once we
+ * have copied it out.  Stops early if the completion ring is full.  Returns
+ * how many frames we sent. */
+size_t xsk_tx(struct netxsk *x, void (*xmit)(struct block *bp, void *arg),
+              void *arg)
+{
+	ERRSTACK(1);
+	struct xsk_hdr *hdr = x->hdr;
+	struct xsk_desc desc;
+	struct block *bp;
+	size_t sent = 0;
+	uint32_t nr;
+
+	qlock(&x->tx_qlock);
+	if (waserror()) {
+		qunlock(&x->tx_qlock);
+		if (sent)
+			xsk_fire_taps(x, FDTAP_FILT_WRITABLE);
+		nexterror();
+	}
+	nr = xsk_nr_avail(x, &hdr->tx, x->tx_cons);
+	nr = MIN(nr, xsk_nr_free(x, &hdr->comp, x->comp_prod));
+	for (uint32_t i = 0; i < nr; i++) {
+		desc = *xsk_desc(x, hdr->tx_off, x->tx_cons);
+		x->tx_cons++;
+		WRITE_ONCE(hdr->tx.cons, x->tx_cons);
+		if (!xsk_frame_ok(x, desc.addr, desc.len)) {
+			hdr->bad_descs++;
+			continue;
+		}
+		bp = block_alloc(desc.len, MEM_WAIT);
+		memcpy(bp->wp, xsk_ptr(x, hdr->umem_off + desc.addr), desc.len);
+		bp->wp += desc.len;
+		/* Copied out, so the frame is theirs again, even if xmit throws. */
+		*xsk_addr(x, hdr->comp_off, x->comp_prod) = desc.addr;
+		wmb();
+		x->comp_prod++;
+		WRITE_ONCE(hdr->comp.prod, x->comp_prod);
+		hdr->tx_packets++;
+		sent++;
+		xmit(bp, arg);
+	}
+	poperror();
+	qunlock(&x->tx_qlock);
+	if (sent)
+		xsk_fire_taps(x, FDTAP_FILT_WRITABLE);
+	return sent;
+}
+
+/* Stat-style text for reads of the xsk file. */
+long xsk_read_stats(struct netxsk *x, void *a, long n, uint32_t offset)
+{
+	struct xsk_hdr *hdr = x->hdr;
+	char *buf;
+	long ret;
+	int len = 0;
+
+	buf = kmalloc(READSTR, MEM_WAIT);
+	len += snprintf(buf + len, READSTR - len, "rx_packets: %lu\n",
+	                READ_ONCE(hdr->rx_packets));
+	len += snprintf(buf + len, READSTR - len, "rx_no_fill: %lu\n",
+	                READ_ONCE(hdr->rx_no_fill));
+	len += snprintf(buf + len, READSTR - len, "rx_ring_full: %lu\n",
+	                READ_ONCE(hdr->rx_ring_full));
+	len += snprintf(buf + len, READSTR - len, "tx_packets: %lu\n",
+	                READ_ONCE(hdr->tx_packets));
+	len += snprintf(buf + len, READSTR - len, "bad_descs: %lu\n",
+	                READ_ONCE(hdr->bad_descs));
+	ret = readstr(offset, a, n, buf);
+	kfree(buf);
+	return ret;
+}
+
+int xsk_tapfd(struct netxsk *x, struct fd_tap *tap, int cmd)
+{
+	#define XSK_LEGAL_TAPS (FDTAP_FILT_READABLE | FDTAP_FILT_WRITABLE)
+
+	if (tap->filter & ~XSK_LEGAL_TAPS) {
+		set_error(ENOSYS, "Unsupported xsk tap %p, must be %p", tap->filter,
+		          XSK_LEGAL_TAPS);
+		return -1;
+	}
+	spin_lock(&x->tap_lock);
+	switch (cmd) {
+	case FDTAP_CMD_ADD:
+		SLIST_INSERT_HEAD(&x->taps, tap, link);
+		break;
+	case FDTAP_CMD_REM:
+		SLIST_REMOVE(&x->taps, tap, fd_tap, link);
+		break;
+	default:
+		spin_unlock(&x->tap_lock);
+		set_error(ENOSYS, "Unsupported xsk tap command %p", cmd);
+		return -1;
+	}
+	spin_unlock(&x->tap_lock);
+	return 0;
+}
@@ -35,6 +35,7 @@
 #include <error.h>
 #include <cpio.h>
 #include <pmap.h>
+#include <pagemap.h>
 #include <smp.h>
 #include <net/ip.h>
 #include <process.h>
@@ -174,6 +175,115 @@ int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
 	return 0;
 }
 
+/* Appends @len bytes of page frag (kmalloc_frag()) to @b as an extra data
+ * buffer, returning a pointer to the frag's data or 0 on failure.  The frag is
+ * counted in the block's length; the caller fills it in.
+ *
+ * Frags come from per-core pages and freeing one just drops a ref on its page,
+ * so this is cheaper than a big kmalloc per packet. */
+void *block_append_frag(struct block *b, size_t len, int mem_flags)
+{
+	void *buf;
+
+	buf = kmalloc_frag(len, mem_flags);
+	if (!buf)
+		return 0;
+	if (block_append_extra(b, (uintptr_t)buf, 0, len, mem_flags)) {
+		kfree(buf);
+		return 0;
+	}
+	return buf;
+}
+
+/* Extra data buffers are either kmalloc buffers (including page frags), page
+ * map pages, which we point to instead of copying them (e.g. splice), or user
+ * pages shared CoW (e.g. big pipe writes).  PM and user pages are page aligned
+ * and have PG_PAGEMAP or PG_COW_BUF, which no kmalloc buffer has. */
+static struct page *ebd_base_to_pm_page(uintptr_t base)
+{
+	struct page *page;
+
+	if (PGOFF(base))
+		return NULL;
+	page = kva2page((void*)base);
+	return page_is_pagemap(page) ? page : NULL;
+}
+
+static struct page *ebd_base_to_cow_page(uintptr_t base)
+{
+	struct page *page;
+
+	if (PGOFF(base))
+		return NULL;
+	page = kva2page((void*)base);
+	return atomic_read(&page->pg_flags) & PG_COW_BUF ? page : NULL;
+}
+
+/* Gets another ref on an extra data buffer, e.g. for a second block pointing to
+ * the same buffer. */
+void block_extra_incref(uintptr_t base)
+{
+	struct page *page = ebd_base_to_pm_page(base);
+
+	if (page)
+		pm_get_page_ext(page);
+	else if ((page = ebd_base_to_cow_page(base)))
+		page_cow_share(page);
+	else
+		kmalloc_incref((void*)base);
+}
+
+/* Drops a ref on an extra data buffer.  This can be called from IRQ context,
+ * e.g. when a NIC is done with a block. */
+void block_extra_decref(uintptr_t base)
+{
+	struct page *page = ebd_base_to_pm_page(base);
+
+	if (page)
+		pm_put_page_ext(page);
+	else if ((page = ebd_base_to_cow_page(base)))
+		page_decref(page);
+	else
+		kfree((void*)base);
+}
+
+/* Appends @len bytes at @off of PM page @page to @b, without copying.  The
+ * block gets its own (external) ref on the page, which it holds until the last
+ * block pointing at the page is freed, even if the page's PM is destroyed.  The
+ * caller needs a ref on the page for the call, e.g. from pm_load_page().
+ *
+ * Returns 0 on success or -1 on error. */
+int block_append_pm_page(struct block *b, struct page *page, uint32_t off,
+                         uint32_t len, int mem_flags)
+{
+	assert(off + len <= PGSIZE);
+	pm_get_page_ext(page);
+	if (block_append_extra(b, (uintptr_t)page2kva(page), off, len,
+	                       mem_flags)) {
+		pm_put_page_ext(page);
+		return -1;
+	}
+	return 0;
+}
+
+/* Allocates a block whose payload of @size bytes is a page frag.  The main body
+ * only has room for headers (via padblock()).  The payload is
+ * b->extra_data[0]; e.g. a NIC can post it for rx and trim the block to the
+ * frame's length when it arrives. */
+struct block *block_alloc_frag(size_t size, int mem_flags)
+{
+	struct block *b;
+
+	b = block_alloc(0, mem_flags);
+	if (!b)
+		return NULL;
+	if (!block_append_frag(b, size, mem_flags)) {
+		freeb(b);
+		return NULL;
+	}
+	return b;
+}
+
 /* There's metadata in each block related to the data payload.  For instance,
  * the TSO mss, the offsets to various headers, whether csums are needed, etc.
  * When you create a new block, like in copyblock, this will copy those bits
@@ -200,12 +310,10 @@ void free_block_extra(struct block *b)
 {
 	struct extra_bdata *ebd;
 
-	/* assuming our release method is kfree, which will change when we support
-	 * user buffers */
 	for (int i = 0; i < b->nr_extra_bufs; i++) {
 		ebd = &b->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			block_extra_decref(ebd->base);
 	}
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
@@ -290,7 +398,8 @@ void checkb(struct block *b, char *msg)
 			panic("checkb %s: ebd %d has no base, but has off %d and len %d",
 			      msg, i, ebd->off, ebd->len);
 		if (ebd->base) {
-			if (!kmalloc_refcnt((void*)ebd->base))
+			if (!ebd_base_to_pm_page(ebd->base) &&
+			    !kmalloc_refcnt((void*)ebd->base))
 				panic("checkb %s: buf %d, base %p has no refcnt!\n", msg, i,
 				      ebd->base);
 			extra_len += ebd->len;
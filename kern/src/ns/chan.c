@@ -37,6 +37,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <syscall.h>
+#include <percpu.h>
 
 struct chan *kern_slash;
 
@@ -62,6 +63,20 @@ struct {
 	struct chan *list;
 } chanalloc;
 
+/* Freed chans go on a small per-core list before the global one, so opens and
+ * closes on different cores don't fight over chanalloc.lock.  Either way, chans
+ * are never given back to the allocator; lookup_fd() counts on that. */
+#define CHAN_PCPU_NR		16
+
+struct chan_pool {
+	unsigned int				nr;
+	struct chan					*free;
+};
+
+static DEFINE_PERCPU(struct chan_pool, chan_pools);
+
+static struct kmem_cache *cname_kcache;
+
 typedef struct Elemlist Elemlist;
 
 struct Elemlist {
@@ -122,6 +137,13 @@ void kstrdup(char **p, char *s)
 	kfree(prev);
 }
 
+void chan_init(void)
+{
+	cname_kcache = kmem_cache_create("cname", sizeof(struct cname),
+	                                 __alignof__(struct cname), 0, NULL, 0, 0,
+	                                 NULL);
+}
+
 void chandevreset(void)
 {
 	int i;
@@ -175,12 +197,25 @@ static void chan_release(struct kref *kref)
 struct chan *newchan(void)
 {
 	struct chan *c;
+	struct chan_pool *pool;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	pool = PERCPU_VARPTR(chan_pools);
+	c = pool->free;
+	if (c) {
+		pool->free = c->next;
+		pool->nr--;
+	}
+	enable_irqsave(&irq_state);
 
-	spin_lock(&(&chanalloc)->lock);
-	c = chanalloc.free;
-	if (c != 0)
-		chanalloc.free = c->next;
-	spin_unlock(&(&chanalloc)->lock);
+	if (c == NULL) {
+		spin_lock(&(&chanalloc)->lock);
+		c = chanalloc.free;
+		if (c != 0)
+			chanalloc.free = c->next;
+		spin_unlock(&(&chanalloc)->lock);
+	}
 
 	if (c == NULL) {
 		c = kzmalloc(sizeof(struct chan), 0);
@@ -220,20 +255,27 @@ struct chan *newchan(void)
 static void __cname_release(struct kref *kref)
 {
 	struct cname *n = container_of(kref, struct cname, ref);
-	kfree(n->s);
-	kfree(n);
+	if (n->s != n->sbuf)
+		kfree(n->s);
+	kmem_cache_free(cname_kcache, n);
 }
 
+/* Most names fit in sbuf, so opens usually get by with one slab alloc. */
 struct cname *newcname(char *s)
 {
 	struct cname *n;
 	int i;
 
-	n = kzmalloc(sizeof(*n), 0);
+	n = kmem_cache_alloc(cname_kcache, MEM_WAIT);
 	i = strlen(s);
 	n->len = i;
-	n->alen = i + CNAMESLOP;
-	n->s = kzmalloc(n->alen, 0);
+	if (i + 1 <= CNAME_INLINE_SZ) {
+		n->alen = CNAME_INLINE_SZ;
+		n->s = n->sbuf;
+	} else {
+		n->alen = i + CNAMESLOP;
+		n->s = kzmalloc(n->alen, MEM_WAIT);
+	}
 	memmove(n->s, s, i + 1);
 	kref_init(&n->ref, __cname_release, 1);
 	return n;
@@ -267,7 +309,8 @@ struct cname *addelem(struct cname *n, char *s)
 		a = n->len + 1 + i + 1 + CNAMESLOP;
 		t = kzmalloc(a, 0);
 		memmove(t, n->s, n->len + 1);
-		kfree(n->s);
+		if (n->s != n->sbuf)
+			kfree(n->s);
 		n->s = t;
 		n->alen = a;
 	}
@@ -282,6 +325,10 @@ struct cname *addelem(struct cname *n, char *s)
 
 void chanfree(struct chan *c)
 {
+	struct chan_pool *pool;
+	int8_t irq_state = 0;
+	bool pooled = FALSE;
+
 	c->flag = CFREE;
 
 	if (c->umh != NULL) {
@@ -309,6 +356,18 @@ void chanfree(struct chan *c)
 	c->bufused = 0;
 	c->ateof = 0;
 
+	disable_irqsave(&irq_state);
+	pool = PERCPU_VARPTR(chan_pools);
+	if (pool->nr < CHAN_PCPU_NR) {
+		c->next = pool->free;
+		pool->free = c;
+		pool->nr++;
+		pooled = TRUE;
+	}
+	enable_irqsave(&irq_state);
+	if (pooled)
+		return;
+
 	spin_lock(&(&chanalloc)->lock);
 	c->next = chanalloc.free;
 	chanalloc.free = c;
@@ -407,6 +466,60 @@ struct mhead *newmhead(struct chan *from)
 	return mh;
 }
 
+/* Negative cache of mount lookups.  Nearly every element of a walk asks if
+ * something is mounted on it, and the answer is almost always no.  Entries are
+ * stamped with the pgrp's mnt_gen, which cmount() and cunmount() bump, so any
+ * mount change invalidates all of them.
+ *
+ * Entries are written without a lock, so each has its own seq counter.  A
+ * writer that finds an entry busy just doesn't bother caching. */
+static struct mnt_miss *mnt_miss_slot(struct pgrp *pg, int type, int dev,
+                                      struct qid qid)
+{
+	return &pg->mnt_miss[(qid.path ^ (type << 4) ^ dev) & (MNT_MISS_NR - 1)];
+}
+
+/* Returns TRUE if we know nothing is mounted on (type, dev, qid). */
+static bool mnt_miss_lookup(struct pgrp *pg, int type, int dev, struct qid qid)
+{
+	struct mnt_miss *mm = mnt_miss_slot(pg, type, dev, qid);
+	seq_ctr_t seq;
+	bool hit;
+
+	seq = READ_ONCE(mm->seq);
+	if (seq_is_locked(seq))
+		return FALSE;
+	rmb();
+	hit = (mm->gen == READ_ONCE(pg->mnt_gen)) && (mm->path == qid.path) &&
+	      (mm->type == type) && (mm->dev == dev);
+	rmb();
+	return hit && !seqctr_retry(seq, READ_ONCE(mm->seq));
+}
+
+/* gen is the mnt_gen from when we found nothing, read under the ns rlock. */
+static void mnt_miss_insert(struct pgrp *pg, uint32_t gen, int type, int dev,
+                            struct qid qid)
+{
+	struct mnt_miss *mm = mnt_miss_slot(pg, type, dev, qid);
+	seq_ctr_t seq = READ_ONCE(mm->seq);
+
+	if (seq_is_locked(seq) ||
+	    !__sync_bool_compare_and_swap(&mm->seq, seq, seq + 1))
+		return;
+	mm->gen = gen;
+	mm->type = type;
+	mm->dev = dev;
+	mm->path = qid.path;
+	wmb();
+	WRITE_ONCE(mm->seq, seq + 2);
+}
+
+/* Caller holds the ns wlock and changed the mount table. */
+static void mnt_gen_bump(struct pgrp *pg)
+{
+	WRITE_ONCE(pg->mnt_gen, pg->mnt_gen + 1);
+}
+
 int cmount(struct chan *new, struct chan *old, int flag, char *spec)
 {
 	ERRSTACK(1);
@@ -452,7 +565,8 @@ int cmount(struct chan *new, struct chan *old, int flag, char *spec)
 		error(EEXIST, ERROR_FIXME);
 
 	pg = current->pgrp;
-	wlock(&pg->ns);
+	br_wlock(&pg->ns);
+	mnt_gen_bump(pg);
 
 	l = &MOUNTH(pg, old->qid);
 	for (m = *l; m; m = m->hash) {
@@ -481,7 +595,7 @@ int cmount(struct chan *new, struct chan *old, int flag, char *spec)
 		wunlock(&m->lock);
 		nexterror();
 	}
-	wunlock(&pg->ns);
+	br_wunlock(&pg->ns);
 
 	nm = newmount(m, new, flag, spec);
 	if (mh != NULL && mh->mount != NULL) {
@@ -541,7 +655,8 @@ void cunmount(struct chan *mnt, struct chan *mounted)
 	 */
 
 	pg = current->pgrp;
-	wlock(&pg->ns);
+	br_wlock(&pg->ns);
+	mnt_gen_bump(pg);
 
 	l = &MOUNTH(pg, mnt->qid);
 	for (m = *l; m; m = m->hash) {
@@ -551,14 +666,14 @@ void cunmount(struct chan *mnt, struct chan *mounted)
 	}
 
 	if (m == 0) {
-		wunlock(&pg->ns);
+		br_wunlock(&pg->ns);
 		error(ENOENT, ERROR_FIXME);
 	}
 
 	wlock(&m->lock);
 	if (mounted == 0) {
 		*l = m->hash;
-		wunlock(&pg->ns);
+		br_wunlock(&pg->ns);
 		mountfree(m->mount);
 		m->mount = NULL;
 		cclose(m->from);
@@ -579,18 +694,18 @@ void cunmount(struct chan *mnt, struct chan *mounted)
 				*l = m->hash;
 				cclose(m->from);
 				wunlock(&m->lock);
-				wunlock(&pg->ns);
+				br_wunlock(&pg->ns);
 				putmhead(m);
 				return;
 			}
 			wunlock(&m->lock);
-			wunlock(&pg->ns);
+			br_wunlock(&pg->ns);
 			return;
 		}
 		p = &f->next;
 	}
 	wunlock(&m->lock);
-	wunlock(&pg->ns);
+	br_wunlock(&pg->ns);
 	error(ENOENT, ERROR_FIXME);
 }
 
@@ -619,10 +734,15 @@ static bool is_mount_point(struct chan *c)
 	int dev = c->dev;
 	struct qid qid = c->qid;
 
+	uint32_t gen;
+
 	if (!current)
 		return false;
 	pg = current->pgrp;
-	rlock(&pg->ns);
+	if (mnt_miss_lookup(pg, type, dev, qid))
+		return false;
+	br_rlock(&pg->ns);
+	gen = pg->mnt_gen;
 	for (m = MOUNTH(pg, qid); m; m = m->hash) {
 		rlock(&m->lock);
 		if (!m->from) {
@@ -631,12 +751,13 @@ static bool is_mount_point(struct chan *c)
 		}
 		if (eqchantdqid(m->from, type, dev, qid, 1)) {
 			runlock(&m->lock);
-			runlock(&pg->ns);
+			br_runlock(&pg->ns);
 			return true;
 		}
 		runlock(&m->lock);
 	}
-	runlock(&pg->ns);
+	br_runlock(&pg->ns);
+	mnt_miss_insert(pg, gen, type, dev, qid);
 	return false;
 }
 
@@ -646,11 +767,15 @@ findmount(struct chan **cp,
 {
 	struct pgrp *pg;
 	struct mhead *m;
+	uint32_t gen;
 
 	if (!current)
 		return 0;
 	pg = current->pgrp;
-	rlock(&pg->ns);
+	if (mnt_miss_lookup(pg, type, dev, qid))
+		return 0;
+	br_rlock(&pg->ns);
+	gen = pg->mnt_gen;
 	for (m = MOUNTH(pg, qid); m; m = m->hash) {
 		rlock(&m->lock);
 		if (m->from == NULL) {
@@ -659,7 +784,7 @@ findmount(struct chan **cp,
 			continue;
 		}
 		if (eqchantdqid(m->from, type, dev, qid, 1)) {
-			runlock(&pg->ns);
+			br_runlock(&pg->ns);
 			if (mp != NULL) {
 				kref_get(&m->ref, 1);
 				if (*mp != NULL)
@@ -676,7 +801,8 @@ findmount(struct chan **cp,
 		runlock(&m->lock);
 	}
 
-	runlock(&pg->ns);
+	br_runlock(&pg->ns);
+	mnt_miss_insert(pg, gen, type, dev, qid);
 	return 0;
 }
 
@@ -696,9 +822,9 @@ struct chan *undomount(struct chan *c, struct cname *name)
 	if (!current)
 		return c;
 	pg = current->pgrp;
-	rlock(&pg->ns);
+	br_rlock(&pg->ns);
 	if (waserror()) {
-		runlock(&pg->ns);
+		br_runlock(&pg->ns);
 		nexterror();
 	}
 
@@ -727,7 +853,7 @@ struct chan *undomount(struct chan *c, struct cname *name)
 		}
 	}
 	poperror();
-	runlock(&pg->ns);
+	br_runlock(&pg->ns);
 	return c;
 }
 
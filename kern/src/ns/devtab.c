@@ -15,12 +15,14 @@
 #include <alarm.h>
 #include <event.h>
 #include <umem.h>
+#include <completion.h>
 
 void devtabreset()
 {
 	ERRSTACK(1);
 	volatile int i;
 
+	chan_init();
 	if (waserror()) {
 		panic("A devtab reset (probably %p) failed!", devtab[i].reset);
 		poperror();
@@ -33,10 +35,33 @@ void devtabreset()
 	poperror();
 }
 
+static struct completion async_inits;
+
+static void __devtab_async_init(void *arg)
+{
+	ERRSTACK(1);
+	struct dev *dev = arg;
+
+	if (waserror())
+		panic("A devtab init (%s, async) failed!", dev->name);
+	dev->init();
+	poperror();
+	completion_complete(&async_inits, 1);
+}
+
+/* Devices with init_async run as ktasks, spread over the other cores, while
+ * core 0 runs the rest in order. */
 void devtabinit()
 {
 	ERRSTACK(1);
 	volatile int i;
+	int nr_async = 0;
+	uint32_t coreid = 0;
+
+	for (i = 0; &devtab[i] < __devtabend; i++)
+		if (devtab[i].init && devtab[i].init_async)
+			nr_async++;
+	completion_init(&async_inits, nr_async);
 
 	if (waserror()) {
 		panic("A devtab init (probably %p) failed!", devtab[i].init);
@@ -47,10 +72,18 @@ void devtabinit()
 		/* if we have errors, check the align of struct dev and objdump */
 		printd("i %d, '%s', dev %p, init %p\n", i, devtab[i].name,
 				&devtab[i], devtab[i].init);
-		if (devtab[i].init)
-			devtab[i].init();
+		if (!devtab[i].init)
+			continue;
+		if (devtab[i].init_async) {
+			coreid = num_cores > 1 ? coreid % (num_cores - 1) + 1 : 0;
+			ktask_on(coreid, devtab[i].name, __devtab_async_init,
+			         &devtab[i]);
+			continue;
+		}
+		devtab[i].init();
 	}
 	poperror();
+	completion_wait(&async_inits);
 }
 
 void devtabshutdown()
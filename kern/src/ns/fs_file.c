@@ -221,15 +221,38 @@ size_t fs_file_stat(struct fs_file *f, uint8_t *m_buf, size_t m_buf_sz)
 	return ret;
 }
 
+/* Writes only bump mtime and ctime if they are older than this, like Linux's
+ * coarse timestamps.  That lets concurrent writes skip the qlock. */
+#define FSF_WRITE_TIME_GRAIN_NSEC	1000000
+
+static bool __time_is_fresh(struct timespec *t, uint64_t now_ns)
+{
+	uint64_t t_ns = READ_ONCE(t->tv_sec) * 1000000000ULL +
+	                READ_ONCE(t->tv_nsec);
+
+	return now_ns - t_ns < FSF_WRITE_TIME_GRAIN_NSEC;
+}
+
 /* Helper: update file metadata after a write */
 static void write_metadata(struct fs_file *f, off64_t offset,
                            bool always_update_len)
 {
+	uint64_t now_ns = epoch_nsec();
+	struct timespec now = nsec2timespec(now_ns);
+
+	/* Lockless peek, for overwrites of a dirty file, e.g. many pwrites to a
+	 * database file.  Only writes past the end change the length, and
+	 * FSF_DIRTY never gets cleared. */
+	if (!always_update_len && (offset <= READ_ONCE(f->dir.length)) &&
+	    (READ_ONCE(f->flags) & FSF_DIRTY) &&
+	    __time_is_fresh(&f->dir.mtime, now_ns) &&
+	    __time_is_fresh(&f->dir.ctime, now_ns))
+		return;
 	qlock(&f->qlock);
 	f->flags |= FSF_DIRTY;
 	if (always_update_len || (offset > f->dir.length))
 		WRITE_ONCE(f->dir.length, offset);
-	__set_acmtime(f, FSF_MTIME | FSF_CTIME);
+	__set_acmtime_to(f, FSF_MTIME | FSF_CTIME, &now);
 	qunlock(&f->qlock);
 }
 
@@ -347,15 +370,18 @@ void fs_file_truncate(struct fs_file *f, off64_t to)
 
 /* Standard read.  We sync with write, in that once the length is set, we'll
  * attempt to read those bytes. */
+/* Reads grab up to this many pages from the page cache at a time. */
+#define FSF_READ_BATCH_PGS		16
+
 size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
                     off64_t offset)
 {
 	ERRSTACK(1);
-	struct page *page;
-	size_t copy_amt, pg_off, pg_idx, total_remaining;
+	struct page *pgs[FSF_READ_BATCH_PGS];
+	size_t copy_amt, pg_off, pg_idx, total_remaining, nr_pgs, len;
 	volatile size_t so_far = 0;		/* volatile for waserror */
 	const uint8_t *buf_end = buf + count;
-	int error;
+	ssize_t nr_got;
 
 	if (waserror()) {
 		if (so_far) {
@@ -367,30 +393,89 @@ size_t fs_file_read(struct fs_file *f, uint8_t *buf, size_t count,
 	while (buf < buf_end) {
 		/* Check early, so we don't load pages beyond length needlessly.  The
 		 * PM/FSF op might just create zeroed pages when asked. */
+		len = fs_file_get_length(f);
+		if (offset + so_far >= len)
+			break;
+		pg_off = PGOFF(offset + so_far);
+		pg_idx = LA2PPN(offset + so_far);
+		nr_pgs = MIN(DIV_ROUND_UP(pg_off + (buf_end - buf), PGSIZE),
+		             nr_pages(len) - pg_idx);
+		nr_pgs = MIN(nr_pgs, FSF_READ_BATCH_PGS);
+		nr_got = pm_load_pages(f->pm, pg_idx, nr_pgs, pgs);
+		if (nr_got < 0)
+			error(-nr_got, "read pm_load_pages failed");
+		for (int i = 0; i < nr_got; i++) {
+			copy_amt = MIN(PGSIZE - pg_off, buf_end - buf);
+			/* Lockless peak.  Check the len so we don't read beyond EOF.  We
+			 * have a page, but we don't necessarily have access to all of
+			 * it.  It could have shrunk since we got the batch. */
+			len = fs_file_get_length(f);
+			total_remaining = len > offset + so_far ? len - (offset + so_far)
+			                                        : 0;
+			if (copy_amt > total_remaining) {
+				copy_amt = total_remaining;
+				buf_end = buf + copy_amt;
+			}
+			memcpy_to_safe(buf, page2kva(pgs[i]) + pg_off, copy_amt);
+			buf += copy_amt;
+			so_far += copy_amt;
+			pg_off = 0;
+			pm_put_page(pgs[i]);
+		}
+	}
+	if (so_far)
+		set_acmtime_noperm(f, FSF_ATIME);
+	poperror();
+	return so_far;
+}
+
+/* Like fs_file_read(), but returns a block of up to count bytes that points at
+ * the file's pages instead of copying them.  The block holds refs on the pages
+ * until it is freed, so it is safe to hand to a device, e.g. a NIC, that needs
+ * the data after the file is gone.  The data can still change underneath the
+ * block, e.g. if someone writes or truncates the file.
+ *
+ * The block has no body, just the extra data, so the receiver can still
+ * padblock() headers in front of it. */
+struct block *fs_file_bread(struct fs_file *f, size_t count, off64_t offset)
+{
+	ERRSTACK(1);
+	struct block *b;
+	struct page *page;
+	size_t amt, pg_off, pg_idx, total_remaining;
+	volatile size_t so_far = 0;		/* volatile for waserror */
+	int error;
+
+	b = block_alloc(0, MEM_WAIT);
+	if (waserror()) {
+		if (so_far) {
+			poperror();
+			return b;
+		}
+		freeb(b);
+		nexterror();
+	}
+	block_add_extd(b, DIV_ROUND_UP(PGOFF(offset) + count, PGSIZE), MEM_WAIT);
+	while (so_far < count) {
 		if (offset + so_far >= fs_file_get_length(f))
 			break;
 		pg_off = PGOFF(offset + so_far);
 		pg_idx = LA2PPN(offset + so_far);
 		error = pm_load_page(f->pm, pg_idx, &page);
 		if (error)
-			error(-error, "read pm_load_page failed");
-		copy_amt = MIN(PGSIZE - pg_off, buf_end - buf);
-		/* Lockless peak.  Check the len so we don't read beyond EOF.  We have a
-		 * page, but we don't necessarily have access to all of it. */
+			error(-error, "bread pm_load_page failed");
+		amt = MIN(PGSIZE - pg_off, count - so_far);
 		total_remaining = fs_file_get_length(f) - (offset + so_far);
-		if (copy_amt > total_remaining) {
-			copy_amt = total_remaining;
-			buf_end = buf + copy_amt;
-		}
-		memcpy_to_safe(buf, page2kva(page) + pg_off, copy_amt);
-		buf += copy_amt;
-		so_far += copy_amt;
+		amt = MIN(amt, total_remaining);
+		/* We presized the ebds, so this can't fail. */
+		block_append_pm_page(b, page, pg_off, amt, MEM_WAIT);
+		so_far += amt;
 		pm_put_page(page);
 	}
 	if (so_far)
 		set_acmtime_noperm(f, FSF_ATIME);
 	poperror();
-	return so_far;
+	return b;
 }
 
 size_t fs_file_write(struct fs_file *f, const uint8_t *buf, size_t count,
@@ -47,7 +47,7 @@ void closepgrp(struct pgrp *p)
 {
 	struct mhead **h, **e, *f, *next;
 
-	wlock(&p->ns);
+	br_wlock(&p->ns);
 	p->pgrpid = -1;
 
 	e = &p->mnthash[MNTHASH];
@@ -62,7 +62,8 @@ void closepgrp(struct pgrp *p)
 			putmhead(f);
 		}
 	}
-	wunlock(&p->ns);
+	br_wunlock(&p->ns);
+	br_destroy(&p->ns);
 	kfree(p);
 }
 
@@ -79,9 +80,11 @@ struct pgrp *newpgrp(void)
 	p = kzmalloc(sizeof(struct pgrp), MEM_WAIT);
 	kref_init(&p->ref, freepgrp, 1);
 	p->pgrpid = NEXT_ID(pgrpid);
+	/* the zeroed mnt_miss entries are stamped with gen 0 */
+	p->mnt_gen = 1;
 	p->progmode = 0644;
 	qlock_init(&p->debug);
-	rwinit(&p->ns);
+	br_init(&p->ns);
 	qlock_init(&p->nsh);
 	return p;
 }
@@ -116,9 +119,9 @@ void pgrpcpy(struct pgrp *to, struct pgrp *from)
 	struct mount *n, *m, **link, *order;
 	struct mhead *f, **tom, **l, *mh;
 
-	wlock(&from->ns);
+	br_wlock(&from->ns);
 	if (waserror()) {
-		wunlock(&from->ns);
+		br_wunlock(&from->ns);
 		nexterror();
 	}
 	order = 0;
@@ -160,7 +163,7 @@ void pgrpcpy(struct pgrp *to, struct pgrp *from)
 	to->nodevs = from->nodevs;
 
 	poperror();
-	wunlock(&from->ns);
+	br_wunlock(&from->ns);
 }
 
 struct mount *newmount(struct mhead *mh, struct chan *to, int flag, char *spec)
@@ -86,6 +86,16 @@ struct queue {
 	void *wake_data;
 
 	char err[ERRMAX];
+
+	/* Qspsc ring, see qspsc_push().  Each side gets its own cacheline. */
+	struct block **ring;
+	unsigned long ring_head __attribute__((aligned(ARCH_CL_SIZE)));
+	size_t ring_out;			/* bytes popped from the ring */
+	size_t ring_read;			/* bytes read by the fast path */
+	uint32_t cons_busy;
+	unsigned long ring_tail __attribute__((aligned(ARCH_CL_SIZE)));
+	size_t ring_in;				/* bytes pushed into the ring */
+	uint32_t prod_busy;
 };
 
 enum {
@@ -96,6 +106,8 @@ enum {
 	QIO_JUST_ONE_BLOCK = (1 << 3),	/* when qbreading, just get one block */
 	QIO_NON_BLOCK = (1 << 4),		/* throw EAGAIN instead of blocking */
 	QIO_DONT_KICK = (1 << 5),		/* don't kick when waking */
+	QIO_MSG_FITS = (1 << 6),		/* Qmsg: only take a message that fits */
+	QSPSC_RING_SZ = 256,			/* blocks in a Qspsc ring, power of 2 */
 };
 
 unsigned int qiomaxatomic = Maxatomic;
@@ -105,6 +117,8 @@ static ssize_t __qbwrite(struct queue *q, struct block *b, int flags);
 static struct block *__qbread(struct queue *q, size_t len, int qio_flags,
                               int mem_flags);
 static bool qwait_and_ilock(struct queue *q, int qio_flags);
+static int notempty(void *a);
+static size_t enqueue_blist(struct queue *q, struct block *b);
 
 /* Helper: fires a wake callback, sending 'filter' */
 static void qwake_cb(struct queue *q, int filter)
@@ -113,6 +127,205 @@ static void qwake_cb(struct queue *q, int filter)
 		q->wake_cb(q, q->wake_data, filter);
 }
 
+/* Qspsc queues have a lock-free ring of blocks in front of the locked list.
+ * The ring has one producer and one consumer at a time.  Each side claims its
+ * end with a CAS that never spins, and anyone who fails to claim, or who needs
+ * something more than moving whole blocks, takes the q->lock and uses the list.
+ * That's how we handle multiple producers: the ring is only for whoever gets
+ * there first.
+ *
+ * Blocks on the list are always older than the blocks in the ring.  Anyone on
+ * the locked path first drains the ring onto the list, which claims the
+ * consumer side while holding the lock.  The fast reader only takes from the
+ * ring when the list is empty, and it holds the consumer claim while doing so,
+ * so it can't race with a drain.  The fast reader holds the claim with irqs
+ * disabled, so that a drainer can spin on it.
+ *
+ * Neither fast path holds a lock that the other side sees, so the wakeups use
+ * store, mb(), load on both sides.  The producer stores the tail, then looks at
+ * the head: if the consumer had emptied the ring up to our block, the reader
+ * might be sleeping or waiting on a tap.  The consumer stores ring_out, then
+ * looks at qlen(): if our read took the queue from full to not full, we wake
+ * the writers.  At least one side will see the other's store.  The locked paths
+ * can't make that edge decision for other producers or consumers, so they wake
+ * whenever the other side could be waiting.
+ *
+ * qputback(), qaddlist(), and pullupqueue() muck with the list without the
+ * lock, and don't know about the ring.  Don't use them on Qspsc queues. */
+
+/* Helper: pushes b into the ring.  Caller has the producer claim. */
+static bool qspsc_push(struct queue *q, struct block *b)
+{
+	unsigned long tail = q->ring_tail;
+
+	if (tail - READ_ONCE(q->ring_head) >= QSPSC_RING_SZ)
+		return FALSE;
+	q->ring[tail % QSPSC_RING_SZ] = b;
+	q->ring_in += BLEN(b);
+	wmb();	/* the slot and ring_in are visible before the tail */
+	WRITE_ONCE(q->ring_tail, tail + 1);
+	return TRUE;
+}
+
+/* Helper: returns the oldest block in the ring, leaving it in place.  Caller
+ * has the consumer claim. */
+static struct block *qspsc_peek(struct queue *q)
+{
+	unsigned long head = q->ring_head;
+
+	if (head == READ_ONCE(q->ring_tail))
+		return NULL;
+	rmb();	/* read the slot after seeing the tail */
+	return q->ring[head % QSPSC_RING_SZ];
+}
+
+/* Helper: pops the block from qspsc_peek().  Caller has the consumer claim. */
+static void qspsc_pop(struct queue *q, struct block *b)
+{
+	q->ring_out += BLEN(b);
+	rwmb();	/* done with the slot before the producer can reuse it */
+	WRITE_ONCE(q->ring_head, q->ring_head + 1);
+}
+
+static bool qspsc_has_blocks(struct queue *q)
+{
+	return q->ring && (READ_ONCE(q->ring_head) != READ_ONCE(q->ring_tail));
+}
+
+/* Helper: moves the ring's blocks to the end of the list.  Caller holds the
+ * q->lock, with irqs disabled. */
+static void qspsc_drain(struct queue *q)
+{
+	struct block *b;
+
+	if (!qspsc_has_blocks(q))
+		return;
+	/* The fast reader holds the claim for a short stretch with irqs off. */
+	while (!atomic_cas_u32(&q->cons_busy, 0, 1))
+		cpu_relax();
+	while ((b = qspsc_peek(q))) {
+		qspsc_pop(q, b);
+		enqueue_blist(q, b);
+	}
+	wmb();
+	WRITE_ONCE(q->cons_busy, 0);
+}
+
+/* Helper: after a read consumed amt bytes from q, returns TRUE if the read took
+ * q from unwritable to writable.  This is only precise for the single
+ * consumer. */
+static bool qspsc_read_made_writable(struct queue *q, size_t amt)
+{
+	int now;
+
+	mb();	/* our consumption before looking at the producer's ring_in */
+	now = qlen(q);
+	return q->limit && (now + amt >= q->limit) && (now < q->limit);
+}
+
+/* Fast path for __qbwrite.  Returns TRUE if we wrote b, with its length in
+ * *ret, FALSE if the caller needs to use the locked path. */
+static bool qspsc_try_write(struct queue *q, struct block *b, int qio_flags,
+                            ssize_t *ret)
+{
+	unsigned long old_tail;
+	size_t blen = BLEN(b);
+	bool was_empty;
+
+	if (b->next || (q->state & Qclosed))
+		return FALSE;
+	/* The locked path handles writes that would drop or throw.  Writes that
+	 * would block just sleep after queueing, which our caller does. */
+	if ((qio_flags & QIO_LIMIT) && (qlen(q) >= q->limit) &&
+	    ((qio_flags & (QIO_DROP_OVERFLOW | QIO_NON_BLOCK)) ||
+	     (q->state & Qdropoverflow)))
+		return FALSE;
+	if (!atomic_cas_u32(&q->prod_busy, 0, 1))
+		return FALSE;
+	old_tail = q->ring_tail;
+	if (!qspsc_push(q, b)) {
+		WRITE_ONCE(q->prod_busy, 0);
+		return FALSE;
+	}
+	wmb();
+	WRITE_ONCE(q->prod_busy, 0);
+	mb();	/* our tail before looking at the consumer's head */
+	/* If bfirst is set, the reader has blocks and isn't waiting.  It'll drain
+	 * ours before it could sleep. */
+	was_empty = (READ_ONCE(q->ring_head) == old_tail) && !READ_ONCE(q->bfirst);
+	if (q->kick && (was_empty || (q->state & Qkick)))
+		q->kick(q->arg);
+	if (was_empty) {
+		rendez_wakeup(&q->rr);
+		qwake_cb(q, FDTAP_FILT_READABLE);
+	}
+	*ret = blen;
+	return TRUE;
+}
+
+/* Fast path for __qbread.  Returns TRUE if we read something, with the blist in
+ * *real_ret, FALSE if the caller needs to use the locked path.  That includes
+ * when the ring is empty, since the locked path handles blocking, closed
+ * queues, and errors.
+ *
+ * We only move whole blocks out of the ring.  Splitting a block needs the
+ * locked path. */
+static bool qspsc_try_read(struct queue *q, size_t len, int qio_flags,
+                           struct block **real_ret)
+{
+	struct block *ret = NULL, *ret_last = NULL, *b;
+	size_t blen, amt = 0;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	if (!atomic_cas_u32(&q->cons_busy, 0, 1)) {
+		enable_irqsave(&irq_state);
+		return FALSE;
+	}
+	/* The CAS is a full barrier: a drain that moved blocks onto the list
+	 * finished before we got the claim.  If there is a list, it goes first. */
+	if (READ_ONCE(q->bfirst))
+		goto out_release;
+	while ((b = qspsc_peek(q))) {
+		blen = BLEN(b);
+		if ((q->state & Qcoalesce) && (blen == 0)) {
+			qspsc_pop(q, b);
+			freeb(b);
+			continue;
+		}
+		/* Qmsg: just return the first block, like __try_qbread. */
+		if (!(q->state & Qmsg) && (blen > len))
+			break;
+		if ((q->state & Qmsg) && (qio_flags & QIO_MSG_FITS) && (blen > len))
+			break;
+		qspsc_pop(q, b);
+		if (ret_last)
+			ret_last->next = b;
+		else
+			ret = b;
+		ret_last = b;
+		amt += blen;
+		if ((q->state & Qmsg) || (qio_flags & QIO_JUST_ONE_BLOCK))
+			break;
+		len -= blen;
+	}
+	q->ring_read += amt;
+out_release:
+	wmb();
+	WRITE_ONCE(q->cons_busy, 0);
+	enable_irqsave(&irq_state);
+	if (!ret)
+		return FALSE;
+	if (qspsc_read_made_writable(q, amt)) {
+		if (q->kick && !(qio_flags & QIO_DONT_KICK))
+			q->kick(q->arg);
+		rendez_wakeup(&q->wr);
+		qwake_cb(q, FDTAP_FILT_WRITABLE);
+	}
+	*real_ret = ret;
+	return TRUE;
+}
+
 void ixsummary(void)
 {
 	debugging ^= 1;
@@ -320,7 +533,7 @@ struct block *pullupblock(struct block *bp, int n)
 			ebd->off += seglen;
 			bp->extra_len -= seglen;
 			if (ebd->len == 0) {
-				kfree((void *)ebd->base);
+				block_extra_decref(ebd->base);
 				ebd->off = 0;
 				ebd->base = 0;
 			}
@@ -583,7 +796,7 @@ struct block *adjustblock(struct block *bp, int len)
 	for (; i < bp->nr_extra_bufs; i++) {
 		ebd = &bp->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			block_extra_decref(ebd->base);
 		ebd->base = ebd->off = ebd->len = 0;
 	}
 	QDEBUG checkb(bp, "adjustblock 4");
@@ -720,6 +933,7 @@ static int __try_qbread(struct queue *q, size_t len, int qio_flags,
 	struct block *ret, *ret_last, *first;
 	size_t blen;
 	bool was_unwritable = FALSE;
+	bool pass_on;
 
 	if (qio_flags & QIO_CAN_ERR_SLEEP) {
 		if (!qwait_and_ilock(q, qio_flags)) {
@@ -730,6 +944,7 @@ static int __try_qbread(struct queue *q, size_t len, int qio_flags,
 		first = q->bfirst;
 	} else {
 		spin_lock_irqsave(&q->lock);
+		qspsc_drain(q);
 		first = q->bfirst;
 		if (!first) {
 			spin_unlock_irqsave(&q->lock);
@@ -752,6 +967,13 @@ static int __try_qbread(struct queue *q, size_t len, int qio_flags,
 	/* Qmsg: just return the first block.  Be careful, since our caller might
 	 * not read all of the block and thus drop bytes.  Similar to SOCK_DGRAM. */
 	if (q->state & Qmsg) {
+		if ((qio_flags & QIO_MSG_FITS) && (blen > len)) {
+			spin_unlock_irqsave(&q->lock);
+			/* We might have been the reader the writer woke */
+			if (qio_flags & QIO_CAN_ERR_SLEEP)
+				rendez_wakeup(&q->rr);
+			return QBR_FAIL;
+		}
 		ret = pop_first_block(q);
 		goto out_ok;
 	}
@@ -800,7 +1022,18 @@ out_ok:
 	/* Don't wake them up or fire tap if we didn't drain enough. */
 	if (!qwritable(q))
 		was_unwritable = FALSE;
+	/* Other readers might be asleep, waiting on the wakeup we got.  Only a
+	 * reader that can sleep could have gotten it. */
+	pass_on = (qio_flags & QIO_CAN_ERR_SLEEP) && notempty(q);
 	spin_unlock_irqsave(&q->lock);
+	if (pass_on)
+		rendez_wakeup(&q->rr);
+	/* Qspsc: producers can come and go without the lock, so we can't catch the
+	 * edge.  See qspsc_push(). */
+	if (q->ring) {
+		mb();
+		was_unwritable = q->limit && qwritable(q);
+	}
 	if (was_unwritable) {
 		if (q->kick && !(qio_flags & QIO_DONT_KICK))
 			q->kick(q->arg);
@@ -827,6 +1060,8 @@ static struct block *__qbread(struct queue *q, size_t len, int qio_flags,
 	struct block *ret = 0;
 	struct block *volatile spare = 0;	/* volatile for the waserror */
 
+	if (q->ring && qspsc_try_read(q, len, qio_flags, &ret))
+		return ret;
 	/* __try_qbread can throw, based on qio flags. */
 	if ((qio_flags & QIO_CAN_ERR_SLEEP) && waserror()) {
 		if (spare)
@@ -879,6 +1114,14 @@ struct block *qget(struct queue *q)
 	return __qbread(q, SIZE_MAX, QIO_JUST_ONE_BLOCK, MEM_ATOMIC);
 }
 
+/* Like qget(), but for Qmsg queues: only gets the next message if it is at most
+ * len bytes.  Batched readers use this to fill their buffer without ever
+ * truncating a message. */
+struct block *qget_fits(struct queue *q, size_t len)
+{
+	return __qbread(q, len, QIO_JUST_ONE_BLOCK | QIO_MSG_FITS, MEM_ATOMIC);
+}
+
 /* Throw away the next 'len' bytes in the queue returning the number actually
  * discarded.
  *
@@ -943,8 +1186,7 @@ struct block *packblock(struct block *bp)
 /* Add an extra_data entry to newb at newb_idx pointing to b's body, starting at
  * body_rp, for up to len.  Returns the len consumed.
  *
- * The base is 'b', so that we can kfree it later.  This currently ties us to
- * using kfree for the release method for all extra_data.
+ * The base is 'b', so that we can kfree it later (see block_extra_decref()).
  *
  * It is possible to have a body size that is 0, if there is no offset, and
  * b->wp == b->rp.  This will have an extra data entry of 0 length. */
@@ -980,7 +1222,7 @@ static size_t point_to_buf(struct block *b, unsigned int b_idx, uint32_t b_off,
 	assert(b_idx < b->nr_extra_bufs);
 	assert(newb_idx < newb->nr_extra_bufs);
 
-	kmalloc_incref((void*)b_ebd->base);
+	block_extra_incref(b_ebd->base);
 	n_ebd->base = b_ebd->base;
 	n_ebd->off = b_ebd->off + b_off;
 	n_ebd->len = MIN(b_ebd->len - b_off, len);
@@ -1097,6 +1339,7 @@ struct block *qclone(struct queue *q, int header_len, int len, uint32_t offset)
 	do {
 		/* TODO: RCU: protecting the q list (b->next) (need read lock) */
 		spin_lock_irqsave(&q->lock);
+		qspsc_drain(q);
 		ret = __blist_clone_to(q->bfirst, newb, len, offset);
 		spin_unlock_irqsave(&q->lock);
 		if (ret)
@@ -1118,6 +1361,7 @@ struct block *qcopy_old(struct queue *q, int len, uint32_t offset)
 	nb = block_alloc(len, MEM_WAIT);
 
 	spin_lock_irqsave(&q->lock);
+	qspsc_drain(q);
 
 	/* go to offset */
 	b = q->bfirst;
@@ -1189,6 +1433,12 @@ struct queue *qopen(int limit, int msg, void (*kick) (void *), void *arg)
 	q->arg = arg;
 	q->state = msg;
 	q->eof = 0;
+	if (msg & Qspsc) {
+		/* The ring is just an optimization; we can run without it. */
+		q->ring = kzmalloc(sizeof(struct block *) * QSPSC_RING_SZ, 0);
+		if (!q->ring)
+			q->state &= ~Qspsc;
+	}
 
 	return q;
 }
@@ -1215,7 +1465,7 @@ static int notempty(void *a)
 {
 	struct queue *q = a;
 
-	return (q->state & Qclosed) || q->bfirst != 0;
+	return (q->state & Qclosed) || q->bfirst != 0 || qspsc_has_blocks(q);
 }
 
 /* Block, waiting for the queue to be non-empty or closed.  Returns with
@@ -1225,6 +1475,7 @@ static bool qwait_and_ilock(struct queue *q, int qio_flags)
 {
 	while (1) {
 		spin_lock_irqsave(&q->lock);
+		qspsc_drain(q);
 		if (q->bfirst != NULL)
 			return TRUE;
 		if (q->state & Qclosed) {
@@ -1254,8 +1505,12 @@ static bool qwait_and_ilock(struct queue *q, int qio_flags)
 		 * sleep.  Since we saw there was no data, the next writer will see (or
 		 * already saw) no data, and then the writer decides to rendez_wake,
 		 * which will grab the rendez lock.  If the writer already did that,
-		 * then we'll see notempty when we do our check-again. */
-		rendez_sleep(&q->rr, notempty, q);
+		 * then we'll see notempty when we do our check-again.
+		 *
+		 * Readers sleep exclusively, so a writer only wakes one of us.  If
+		 * that reader leaves data behind, it wakes the next one.  See
+		 * __try_qbread(). */
+		rendez_sleep_excl(&q->rr, notempty, q);
 	}
 }
 
@@ -1306,7 +1561,7 @@ static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
 		if (!ebd->len) {
 			/* we don't actually have to decref here.  it's also done in
 			 * freeb().  this is the earliest we can free. */
-			kfree((void*)ebd->base);
+			block_extra_decref(ebd->base);
 			ebd->base = ebd->off = 0;
 		}
 		to += copy_amt;
@@ -1449,6 +1704,68 @@ size_t qread_nonblock(struct queue *q, void *va, size_t len)
 	return read_all_blocks(blist, va, len);
 }
 
+/* Like read_all_blocks(), but scatters the blocks into the iovecs. */
+static size_t read_all_blocks_iov(struct block *b, struct iovec *iov,
+                                  int iovcnt)
+{
+	size_t sofar = 0, off = 0, amt;
+	struct block *next;
+	int idx = 0;
+
+	while (b) {
+		if (!BLEN(b)) {
+			next = b->next;
+			freeb(b);
+			b = next;
+			continue;
+		}
+		if (off == iov[idx].iov_len) {
+			idx++;
+			off = 0;
+			/* Qmsg can give us more than we asked for.  The rest of the
+			 * message is dropped, like with a short read(). */
+			if (idx == iovcnt) {
+				freeblist(b);
+				break;
+			}
+			continue;
+		}
+		amt = read_from_block(b, iov[idx].iov_base + off,
+		                      iov[idx].iov_len - off);
+		off += amt;
+		sofar += amt;
+	}
+	return sofar;
+}
+
+/* Reads up to the total length of the iovecs from q.  We pull the whole blist
+ * out of q at once, then scatter it, without concatenating the blocks. */
+size_t qreadv(struct queue *q, struct iovec *iov, int iovcnt)
+{
+	size_t len = iov_length(iov, iovcnt);
+	struct block *blist;
+
+	if (!len)
+		return 0;
+	blist = __qbread(q, len, QIO_CAN_ERR_SLEEP, MEM_WAIT);
+	if (!blist)
+		return 0;
+	return read_all_blocks_iov(blist, iov, iovcnt);
+}
+
+size_t qreadv_nonblock(struct queue *q, struct iovec *iov, int iovcnt)
+{
+	size_t len = iov_length(iov, iovcnt);
+	struct block *blist;
+
+	if (!len)
+		return 0;
+	blist = __qbread(q, len, QIO_CAN_ERR_SLEEP | QIO_NON_BLOCK, MEM_WAIT);
+	if (!blist)
+		return 0;
+	return read_all_blocks_iov(blist, iov, iovcnt);
+}
+
 /* This is the rendez wake condition for writers. */
 static int qwriter_should_wake(void *a)
 {
@@ -1489,8 +1806,13 @@ static ssize_t __qbwrite(struct queue *q, struct block *b, int qio_flags)
 		(*q->bypass) (q->arg, b);
 		return ret;
 	}
+	if (q->ring && qspsc_try_write(q, b, qio_flags, &ret))
+		goto out_flow_control;
 	spin_lock_irqsave(&q->lock);
-	was_unreadable = q->dlen == 0;
+	/* Qspsc: our blocks go after the ring's.  We can't tell if the reader is
+	 * waiting for someone else's block, so we always wake. */
+	qspsc_drain(q);
+	was_unreadable = q->ring || (q->dlen == 0);
 	if (q->state & Qclosed) {
 		spin_unlock_irqsave(&q->lock);
 		freeblist(b);
@@ -1532,6 +1854,9 @@ static ssize_t __qbwrite(struct queue *q, struct block *b, int qio_flags)
 		rendez_wakeup(&q->rr);
 		qwake_cb(q, FDTAP_FILT_READABLE);
 	}
+	if (q->ring)
+		mb();	/* our enqueue before checking the reader's ring_out */
+out_flow_control:
 	/*
 	 *  flow control, wait for queue to get below the limit
 	 *  before allowing the process to continue and queue
@@ -1590,9 +1915,9 @@ ssize_t qibwrite(struct queue *q, struct block *b)
 	return __qbwrite(q, b, 0);
 }
 
-/* Helper, allocs a block and copies [from, from + len) into it.  Returns the
- * block on success, 0 on failure. */
-static struct block *build_block(void *from, size_t len, int mem_flags)
+/* Helper, allocs a block with len bytes of data, which the caller fills in at
+ * *buf.  Returns the block on success, 0 on failure. */
+static struct block *build_empty_block(size_t len, int mem_flags, void **buf)
 {
 	struct block *b;
 	void *ext_buf;
@@ -1613,7 +1938,6 @@ static struct block *build_block(void *from, size_t len, int mem_flags)
 		kfree(b);
 		return 0;
 	}
-	memcpy(ext_buf, from, len);
 	if (block_add_extd(b, 1, mem_flags)) {
 		kfree(ext_buf);
 		kfree(b);
@@ -1623,25 +1947,64 @@ static struct block *build_block(void *from, size_t len, int mem_flags)
 	b->extra_data[0].off = 0;
 	b->extra_data[0].len = len;
 	b->extra_len += len;
+	*buf = ext_buf;
 #else
 	b = block_alloc(len, mem_flags);
 	if (!b)
 		return 0;
-	memmove(b->wp, from, len);
+	*buf = b->wp;
 	b->wp += len;
 #endif
 	return b;
 }
 
-static ssize_t __qwrite(struct queue *q, void *vp, size_t len, int mem_flags,
-                        int qio_flags)
+/* Helper, allocs a block and copies [from, from + len) into it.  Returns the
+ * block on success, 0 on failure. */
+static struct block *build_block(void *from, size_t len, int mem_flags)
+{
+	struct block *b;
+	void *buf;
+
+	b = build_empty_block(len, mem_flags, &buf);
+	if (b)
+		memcpy(buf, from, len);
+	return b;
+}
+
+/* Helper: copies len bytes out of the iovecs, starting at iov[*idx] + *off, and
+ * advances *idx and *off. */
+static void gather_from_iov(void *to, struct iovec *iov, int iovcnt, int *idx,
+                            size_t *off, size_t len)
+{
+	size_t amt;
+
+	while (len) {
+		assert(*idx < iovcnt);
+		amt = MIN(iov[*idx].iov_len - *off, len);
+		memcpy(to, iov[*idx].iov_base + *off, amt);
+		to += amt;
+		len -= amt;
+		*off += amt;
+		if (*off == iov[*idx].iov_len) {
+			(*idx)++;
+			*off = 0;
+		}
+	}
+}
+
+/* Writes the contents of the iovecs to q.  Small iovecs are gathered into
+ * blocks of up to Maxatomic, so a writev of many small buffers is only a few
+ * __qbwrites.  Qmsg queues get one block, like a single write. */
+static ssize_t __qwrite(struct queue *q, struct iovec *iov, int iovcnt,
+                        int mem_flags, int qio_flags)
 {
 	ERRSTACK(1);
-	size_t n;
+	size_t n, len = iov_length(iov, iovcnt);
 	volatile size_t sofar = 0;	/* volatile for the waserror */
 	struct block *b;
-	uint8_t *p = vp;
-	void *ext_buf;
+	void *buf;
+	int idx = 0;
+	size_t off = 0;
 
 	/* Only some callers can throw.  Others might be in a context where waserror
 	 * isn't safe. */
@@ -1657,9 +2020,10 @@ static ssize_t __qwrite(struct queue *q, void *vp, size_t len, int mem_flags,
 		/* This is 64K, the max amount per single block.  Still a good value? */
 		if (n > Maxatomic)
 			n = Maxatomic;
-		b = build_block(p + sofar, n, mem_flags);
+		b = build_empty_block(n, mem_flags, &buf);
 		if (!b)
 			break;
+		gather_from_iov(buf, iov, iovcnt, &idx, &off, n);
 		if (__qbwrite(q, b, qio_flags) < 0)
 			break;
 		sofar += n;
@@ -1672,18 +2036,35 @@ out_ok:
 
 ssize_t qwrite(struct queue *q, void *vp, int len)
 {
-	return __qwrite(q, vp, len, MEM_WAIT, QIO_CAN_ERR_SLEEP | QIO_LIMIT);
+	struct iovec iov = {vp, len};
+
+	return __qwrite(q, &iov, 1, MEM_WAIT, QIO_CAN_ERR_SLEEP | QIO_LIMIT);
 }
 
 ssize_t qwrite_nonblock(struct queue *q, void *vp, int len)
 {
-	return __qwrite(q, vp, len, MEM_WAIT, QIO_CAN_ERR_SLEEP | QIO_LIMIT |
+	struct iovec iov = {vp, len};
+
+	return __qwrite(q, &iov, 1, MEM_WAIT, QIO_CAN_ERR_SLEEP | QIO_LIMIT |
 	                                      QIO_NON_BLOCK);
 }
 
 ssize_t qiwrite(struct queue *q, void *vp, int len)
 {
-	return __qwrite(q, vp, len, MEM_ATOMIC, 0);
+	struct iovec iov = {vp, len};
+
+	return __qwrite(q, &iov, 1, MEM_ATOMIC, 0);
+}
+
+ssize_t qwritev(struct queue *q, struct iovec *iov, int iovcnt)
+{
+	return __qwrite(q, iov, iovcnt, MEM_WAIT, QIO_CAN_ERR_SLEEP | QIO_LIMIT);
+}
+
+ssize_t qwritev_nonblock(struct queue *q, struct iovec *iov, int iovcnt)
+{
+	return __qwrite(q, iov, iovcnt, MEM_WAIT, QIO_CAN_ERR_SLEEP | QIO_LIMIT |
+	                                          QIO_NON_BLOCK);
 }
 
 /*
@@ -1692,7 +2073,17 @@ ssize_t qiwrite(struct queue *q, void *vp, int len)
  */
 void qfree(struct queue *q)
 {
+	struct block *b;
+
 	qclose(q);
+	if (q->ring) {
+		/* A racing write could have snuck in after qclose()'s drain. */
+		while ((b = qspsc_peek(q))) {
+			qspsc_pop(q, b);
+			freeb(b);
+		}
+		kfree(q->ring);
+	}
 	kfree(q);
 }
 
@@ -1712,6 +2103,7 @@ void qclose(struct queue *q)
 	q->state |= Qclosed;
 	q->state &= ~Qdropoverflow;
 	q->err[0] = 0;
+	qspsc_drain(q);
 	bfirst = q->bfirst;
 	q->bfirst = 0;
 	q->dlen = 0;
@@ -1721,7 +2113,7 @@ void qclose(struct queue *q)
 	freeblist(bfirst);
 
 	/* wake up readers/writers */
-	rendez_wakeup(&q->rr);
+	rendez_wakeup_all(&q->rr);
 	rendez_wakeup(&q->wr);
 	qwake_cb(q, FDTAP_FILT_HANGUP);
 }
@@ -1744,7 +2136,7 @@ void qhangup(struct queue *q, char *msg)
 	spin_unlock_irqsave(&q->lock);
 
 	/* wake up readers/writers */
-	rendez_wakeup(&q->rr);
+	rendez_wakeup_all(&q->rr);
 	rendez_wakeup(&q->wr);
 	qwake_cb(q, FDTAP_FILT_HANGUP);
 }
@@ -1776,12 +2168,19 @@ void qreopen(struct queue *q)
  */
 int qlen(struct queue *q)
 {
-	return q->dlen;
+	size_t ring_out;
+
+	if (!q->ring)
+		return q->dlen;
+	/* ring_out first, so we never see more out of the ring than went in. */
+	ring_out = READ_ONCE(q->ring_out);
+	rmb();
+	return q->dlen + (READ_ONCE(q->ring_in) - ring_out);
 }
 
 size_t q_bytes_read(struct queue *q)
 {
-	return q->bytes_read;
+	return q->bytes_read + q->ring_read;
 }
 
 /*
@@ -1801,7 +2200,7 @@ int qwindow(struct queue *q)
 {
 	int l;
 
-	l = q->limit - q->dlen;
+	l = q->limit - qlen(q);
 	if (l < 0)
 		l = 0;
 	return l;
@@ -1812,7 +2211,7 @@ int qwindow(struct queue *q)
  */
 int qcanread(struct queue *q)
 {
-	return q->bfirst != 0;
+	return q->bfirst != 0 || qspsc_has_blocks(q);
 }
 
 /*
@@ -1880,6 +2279,7 @@ void qflush(struct queue *q)
 
 	/* mark it */
 	spin_lock_irqsave(&q->lock);
+	qspsc_drain(q);
 	bfirst = q->bfirst;
 	q->bfirst = 0;
 	q->dlen = 0;
@@ -1905,9 +2305,14 @@ int qstate(struct queue *q)
 
 void qdump(struct queue *q)
 {
-	if (q)
-		printk("q=%p bfirst=%p blast=%p dlen=%d limit=%d state=#%x\n",
-			   q, q->bfirst, q->blast, q->dlen, q->limit, q->state);
+	if (!q)
+		return;
+	printk("q=%p bfirst=%p blast=%p dlen=%d limit=%d state=#%x\n",
+		   q, q->bfirst, q->blast, q->dlen, q->limit, q->state);
+	if (q->ring)
+		printk("\tring head %lu tail %lu, in %lu out %lu read %lu\n",
+		       q->ring_head, q->ring_tail, q->ring_in, q->ring_out,
+		       q->ring_read);
 }
 
 /* On certain wakeup events, qio will call func(q, data, filter), where filter
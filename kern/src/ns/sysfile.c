@@ -47,6 +47,7 @@ enum {
 	DIRREADSIZE=8192,	/* Just read a lot. Memory is cheap, lots of bandwidth,
 				 * and RPCs are very expensive. At the same time,
 				 * let's not yet exceed a common MSIZE. */
+	SPLICE_CHUNK_SZ = 64 * 1024,	/* per bread/bwrite; 16 pages */
 };
 
 int newfd(struct chan *c, int low_fd, int oflags, bool must_use_low)
@@ -708,6 +709,9 @@ static long rread(int fd, void *va, long n, int64_t * offp)
 		error(EINVAL, ERROR_FIXME);
 
 	dir = c->qid.type & QTDIR;
+	/* Directory reads are stateful, see below */
+	if (dir && offp)
+		error(EISDIR, "can't pread a directory");
 
 	/* kdirent hack: userspace is expecting kdirents, but all of 9ns
 	 * produces Ms.  Just save up what we don't use and append the
@@ -750,25 +754,29 @@ static long rread(int fd, void *va, long n, int64_t * offp)
 			off = *offp;
 		if (off < 0)
 			error(EINVAL, ERROR_FIXME);
-		if (off == 0) {
-			if (offp == NULL) {
+		/* Positional reads (pread) leave the chan's offset alone, so
+		 * concurrent preads on one chan don't contend on anything here. */
+		if (offp) {
+			n = devtab[c->type].read(c, va, n, off);
+		} else {
+			if (off == 0) {
 				spin_lock(&c->lock);
 				c->offset = 0;
 				c->dri = 0;
 				spin_unlock(&c->lock);
+				unionrewind(c);
 			}
-			unionrewind(c);
-		}
-		if (! c->ateof) {
-			n = devtab[c->type].read(c, va, n, off);
-			if (n == 0 && dir)
-				c->ateof = 1;
-		} else {
-			n = 0;
+			if (! c->ateof) {
+				n = devtab[c->type].read(c, va, n, off);
+				if (n == 0 && dir)
+					c->ateof = 1;
+			} else {
+				n = 0;
+			}
+			spin_lock(&c->lock);
+			c->offset += n;
+			spin_unlock(&c->lock);
 		}
-		spin_lock(&c->lock);
-		c->offset += n;
-		spin_unlock(&c->lock);
 	}
 
 	/* dirty kdirent hack */
@@ -826,6 +834,73 @@ long syspread(int fd, void *va, long n, int64_t off)
 	return rread(fd, va, n, &off);
 }
 
+/* Helper for devices without a readv: one read per iovec, stopping at the first
+ * short read.  As with qwrite, an error after we got something is a short
+ * read. */
+static long readv_by_reads(struct chan *c, struct iovec *iov, int iovcnt,
+                           int64_t off)
+{
+	ERRSTACK(1);
+	volatile long sofar = 0;
+	long n;
+
+	if (waserror()) {
+		if (sofar) {
+			poperror();
+			return sofar;
+		}
+		nexterror();
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (!iov[i].iov_len)
+			continue;
+		n = devtab[c->type].read(c, iov[i].iov_base, iov[i].iov_len,
+		                         off + sofar);
+		sofar += n;
+		if (n < iov[i].iov_len)
+			break;
+	}
+	poperror();
+	return sofar;
+}
+
+long sysreadv(int fd, struct iovec *iov, int iovcnt)
+{
+	ERRSTACK(2);
+	struct chan *c;
+	int64_t off;
+	long n;
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	c = fdtochan(&current->open_files, fd, O_READ, 1, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	/* Directory reads need rread()'s kdirent conversion, one at a time. */
+	if (c->qid.type & QTDIR)
+		error(EISDIR, "can't readv a directory");
+	spin_lock(&c->lock);
+	off = c->offset;
+	spin_unlock(&c->lock);
+	if (off < 0)
+		error(EINVAL, ERROR_FIXME);
+	if (devtab[c->type].readv)
+		n = devtab[c->type].readv(c, iov, iovcnt, off);
+	else
+		n = readv_by_reads(c, iov, iovcnt, off);
+	spin_lock(&c->lock);
+	c->offset += n;
+	spin_unlock(&c->lock);
+	poperror();
+	cclose(c);
+	poperror();
+	return n;
+}
+
 int sysremove(char *path)
 {
 	ERRSTACK(2);
@@ -1146,6 +1221,188 @@ long syspwrite(int fd, void *va, long n, int64_t off)
 	return rwrite(fd, va, n, &off);
 }
 
+/* Helper for devices without a writev, like readv_by_reads(). */
+static long writev_by_writes(struct chan *c, struct iovec *iov, int iovcnt,
+                             int64_t off)
+{
+	ERRSTACK(1);
+	volatile long sofar = 0;
+	long n;
+
+	if (waserror()) {
+		if (sofar) {
+			poperror();
+			return sofar;
+		}
+		nexterror();
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (!iov[i].iov_len)
+			continue;
+		n = devtab[c->type].write(c, iov[i].iov_base, iov[i].iov_len,
+		                          off + sofar);
+		sofar += n;
+		if (n < iov[i].iov_len)
+			break;
+	}
+	poperror();
+	return sofar;
+}
+
+long syswritev(int fd, struct iovec *iov, int iovcnt)
+{
+	ERRSTACK(3);
+	struct chan *c;
+	struct dir *dir;
+	int64_t off;
+	long n = iov_length(iov, iovcnt);
+	long m;
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	c = fdtochan(&current->open_files, fd, O_WRITE, 1, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	if (c->qid.type & QTDIR)
+		error(EISDIR, ERROR_FIXME);
+	/* Same offset handling as rwrite() */
+	if (c->flag & O_APPEND) {
+		dir = chandirstat(c);
+		if (!dir)
+			error(EFAIL, "internal error: stat error in append write");
+		spin_lock(&c->lock);
+		c->offset = dir->length;
+		spin_unlock(&c->lock);
+		kfree(dir);
+	}
+	spin_lock(&c->lock);
+	off = c->offset;
+	c->offset += n;
+	spin_unlock(&c->lock);
+	if (waserror()) {
+		spin_lock(&c->lock);
+		c->offset -= n;
+		spin_unlock(&c->lock);
+		nexterror();
+	}
+	if (off < 0)
+		error(EINVAL, ERROR_FIXME);
+	if (devtab[c->type].writev)
+		m = devtab[c->type].writev(c, iov, iovcnt, off);
+	else
+		m = writev_by_writes(c, iov, iovcnt, off);
+	poperror();
+	if (m < n) {
+		spin_lock(&c->lock);
+		c->offset -= n - m;
+		spin_unlock(&c->lock);
+	}
+	poperror();
+	cclose(c);
+	poperror();
+	return m;
+}
+
+static void splice_unadvance(struct chan *c_in, struct chan *c_out, long amt)
+{
+	spin_lock(&c_in->lock);
+	c_in->offset -= amt;
+	spin_unlock(&c_in->lock);
+	spin_lock(&c_out->lock);
+	c_out->offset -= amt;
+	spin_unlock(&c_out->lock);
+}
+
+/* Moves up to len bytes from fd_in to fd_out, at and advancing both of their
+ * offsets, without a trip through userspace.  The data moves as blocks: bread()
+ * from fd_in and bwrite() to fd_out.  For page-cache-backed files, such as
+ * tmpfs or kfs, bread() gives us blocks that point at the file's pages, and
+ * qio-backed chans (pipes, conversations' data files) queue the blocks as is,
+ * so the data is never copied until it reaches the NIC or a reader.  Other
+ * chans' devbread() and devbwrite() copy, but still save the user copies.
+ *
+ * Returns the amount moved, or -1 on error with nothing moved. */
+long syssplice(int fd_in, int fd_out, long len)
+{
+	ERRSTACK(5);
+	struct chan *c_in, *c_out;
+	struct block *b;
+	int64_t off_in, off_out;
+	volatile long sofar = 0;
+	long amt, n, m;
+
+	if (waserror()) {
+		poperror();
+		return -1;
+	}
+	if (len < 0)
+		error(EINVAL, "negative splice length %ld", len);
+	c_in = fdtochan(&current->open_files, fd_in, O_READ, 1, 1);
+	if (waserror()) {
+		cclose(c_in);
+		nexterror();
+	}
+	c_out = fdtochan(&current->open_files, fd_out, O_WRITE, 1, 1);
+	if (waserror()) {
+		cclose(c_out);
+		nexterror();
+	}
+	if ((c_in->qid.type & QTDIR) || (c_out->qid.type & QTDIR))
+		error(EISDIR, "can't splice directories");
+	if (c_out->flag & O_APPEND)
+		error(EINVAL, "can't splice to an O_APPEND file");
+	if (waserror()) {
+		/* Errors after making progress are reported as a short splice. */
+		if (!sofar)
+			nexterror();
+		goto out;
+	}
+	while (sofar < len) {
+		amt = MIN(len - sofar, SPLICE_CHUNK_SZ);
+		spin_lock(&c_in->lock);
+		off_in = c_in->offset;
+		spin_unlock(&c_in->lock);
+		b = devtab[c_in->type].bread(c_in, amt, off_in);
+		n = blocklen(b);
+		if (!n) {
+			freeblist(b);
+			break;
+		}
+		spin_lock(&c_in->lock);
+		c_in->offset += n;
+		spin_unlock(&c_in->lock);
+		spin_lock(&c_out->lock);
+		off_out = c_out->offset;
+		c_out->offset += n;
+		spin_unlock(&c_out->lock);
+		if (waserror()) {
+			splice_unadvance(c_in, c_out, n);
+			nexterror();
+		}
+		/* bwrite consumes the block, even on error. */
+		m = devtab[c_out->type].bwrite(c_out, b, off_out);
+		poperror();
+		if (m < n) {
+			splice_unadvance(c_in, c_out, n - m);
+			sofar += m;
+			break;
+		}
+		sofar += n;
+	}
+out:
+	poperror();
+	poperror();
+	cclose(c_out);
+	poperror();
+	cclose(c_in);
+	poperror();
+	return sofar;
+}
+
 int syswstat(char *path, uint8_t * buf, int n)
 {
 	ERRSTACK(2);
@@ -1602,32 +1859,79 @@ void *kread_whole_file(struct file_or_chan *file)
 
 /* Process-related File management functions */
 
+/* Fd arrays that grew past fd_array.  lookup_fd() could still be looking at an
+ * old one, so they are freed after an RCU grace period. */
+struct fd_array_rcu {
+	struct rcu_head				rcu;
+	int							nr_files;
+	struct file_desc			fd[];
+};
+
+static struct file_desc *fd_array_alloc(int nr_files)
+{
+	struct fd_array_rcu *fa;
+
+	fa = kzmalloc(sizeof(struct fd_array_rcu) +
+	              nr_files * sizeof(struct file_desc), 0);
+	if (!fa)
+		return NULL;
+	fa->nr_files = nr_files;
+	return fa->fd;
+}
+
+/* The size of fds, which came from fdt.  We can't use max_files locklessly,
+ * since it might not go with the fds we saw. */
+static int fd_array_size(struct fd_table *fdt, struct file_desc *fds)
+{
+	if (fds == fdt->fd_array)
+		return NR_OPEN_FILES_DEFAULT;
+	return container_of(fds, struct fd_array_rcu, fd[0])->nr_files;
+}
+
+static void fd_array_free(struct file_desc *fd)
+{
+	kfree_rcu(container_of(fd, struct fd_array_rcu, fd[0]), rcu);
+}
+
 /* Given any FD, get the appropriate object, 0 o/w. Set incref if you want a
  * reference count (which is a 9ns thing, you can't use the pointer if you
- * didn't incref). */
+ * didn't incref).
+ *
+ * This doesn't grab the fdt lock, so that processes doing IO on many cores
+ * don't fight over it.  Chans are never freed, only recycled by chanfree(), so
+ * we can always try to get a ref, but the chan might have been closed and
+ * reused while we looked.  Once we have a ref, if the FD still points at the
+ * chan, it's ours. */
 void *lookup_fd(struct fd_table *fdt, int fd, bool incref)
 {
-	void *retval = 0;
+	struct file_desc *fds;
+	struct chan *c;
 
 	if (fd < 0)
 		return 0;
-	spin_lock(&fdt->lock);
-	if (fdt->closed) {
-		spin_unlock(&fdt->lock);
-		return 0;
-	}
-	if (fd < fdt->max_fdset) {
-		if (GET_BITMASK_BIT(fdt->open_fds->fds_bits, fd)) {
-			/* while max_files and max_fdset might not line up, we should never
-			 * have a valid fdset higher than files */
-			assert(fd < fdt->max_files);
-			retval = fdt->fd[fd].fd_chan;
-			if (incref)
-				chan_incref((struct chan*)retval);
+	rcu_read_lock();
+	while (1) {
+		fds = rcu_dereference(fdt->fd);
+		if (READ_ONCE(fdt->closed) || (fd >= fd_array_size(fdt, fds))) {
+			c = 0;
+			break;
 		}
+		c = rcu_dereference(fds[fd].fd_chan);
+		if (!c || !incref)
+			break;
+		if (kref_get_not_zero(&c->ref, 1)) {
+			if (READ_ONCE(rcu_dereference(fdt->fd)[fd].fd_chan) == c)
+				break;
+			/* Can't cclose in an RCU read section, it might block */
+			rcu_read_unlock();
+			cclose(c);
+			rcu_read_lock();
+		}
+		/* Lost a race with close: we'll see the new fd_chan, or 0 */
+		cpu_relax();
 	}
-	spin_unlock(&fdt->lock);
-	return retval;
+	rcu_read_unlock();
+	return c;
 }
 
 /* Grow the vfs fd set */
@@ -1649,7 +1953,7 @@ static int grow_fd_set(struct fd_table *open_files)
 	n = open_files->max_files + NR_OPEN_FILES_DEFAULT;
 	if (n > NR_FILE_DESC_MAX)
 		return -EMFILE;
-	nfd = kzmalloc(n * sizeof(struct file_desc), 0);
+	nfd = fd_array_alloc(n);
 	if (nfd == NULL)
 		return -ENOMEM;
 
@@ -1658,13 +1962,13 @@ static int grow_fd_set(struct fd_table *open_files)
 	memmove(nfd, ofd, open_files->max_files * sizeof(struct file_desc));
 
 	/* Update the array and the maxes for both max_files and max_fdset */
-	open_files->fd = nfd;
+	rcu_assign_pointer(open_files->fd, nfd);
 	open_files->max_files = n;
 	open_files->max_fdset = n;
 
 	/* Only free the old one if it wasn't pointing to open_files->fd_array */
 	if (ofd != open_files->fd_array)
-		kfree(ofd);
+		fd_array_free(ofd);
 	return 0;
 }
 
@@ -1686,8 +1990,8 @@ static void free_fd_set(struct fd_table *open_files)
 		kfree(free_me);
 
 		free_me = open_files->fd;
-		open_files->fd = open_files->fd_array;
-		kfree(free_me);
+		rcu_assign_pointer(open_files->fd, open_files->fd_array);
+		fd_array_free(free_me);
 	}
 }
 
@@ -1780,8 +2084,8 @@ int insert_obj_fdt(struct fd_table *fdt, void *obj, int low_fd, int fd_flags,
 	assert(slot < fdt->max_files &&
 	       fdt->fd[slot].fd_chan == 0);
 	chan_incref((struct chan*)obj);
-	fdt->fd[slot].fd_chan = obj;
 	fdt->fd[slot].fd_flags = fd_flags;
+	rcu_assign_pointer(fdt->fd[slot].fd_chan, obj);
 	spin_unlock(&fdt->lock);
 	return slot;
 }
@@ -1830,8 +2134,8 @@ void close_fdt(struct fd_table *fdt, bool cloexec)
 	/* it's just a hint, we can build back up from being 0 */
 	fdt->hint_min_fd = 0;
 	if (!cloexec) {
+		WRITE_ONCE(fdt->closed, TRUE);
 		free_fd_set(fdt);
-		fdt->closed = TRUE;
 	}
 	spin_unlock(&fdt->lock);
 	/* We go through some hoops to close/decref outside the lock.  Nice for not
@@ -1880,8 +2184,8 @@ void clone_fdt(struct fd_table *src, struct fd_table *dst)
 			chan = src->fd[i].fd_chan;
 			assert(i < dst->max_files && dst->fd[i].fd_chan == 0);
 			SET_BITMASK_BIT(dst->open_fds->fds_bits, i);
-			dst->fd[i].fd_chan = chan;
 			chan_incref(chan);
+			rcu_assign_pointer(dst->fd[i].fd_chan, chan);
 		}
 	}
 	dst->hint_min_fd = src->hint_min_fd;
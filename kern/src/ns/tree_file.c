@@ -11,6 +11,18 @@
 #include <stdio.h>
 #include <assert.h>
 #include <error.h>
+#include <hash.h>
+#include <time.h>
+
+/* Caller holds the lru_lock.  Negative entries never become positive, so the
+ * flag is stable. */
+static void __lru_account(struct walk_cache *wc, struct tree_file *tf,
+                          int amt)
+{
+	wc->nr_lru += amt;
+	if (tf->flags & TF_F_NEGATIVE)
+		wc->nr_lru_neg += amt;
+}
 
 /* Adds to the LRU if it was not on it.
  *
@@ -24,10 +36,12 @@ static void __add_to_lru(struct tree_file *tf)
 	tf->flags |= TF_F_ON_LRU;
 	spin_lock(&wc->lru_lock);
 	list_add_tail(&tf->lru, &wc->lru);
+	__lru_account(wc, tf, 1);
 	spin_unlock(&wc->lru_lock);
 }
 
-/* Removes from the LRU if it was on it.
+/* Removes from the LRU if it was on it.  The TF might be in use; we only yank
+ * those lazily.
  *
  * Caller holds the TF lock or o/w knows it has the only ref to tf. */
 static void __remove_from_lru(struct tree_file *tf)
@@ -36,10 +50,10 @@ static void __remove_from_lru(struct tree_file *tf)
 
 	if (!(tf->flags & TF_F_ON_LRU))
 		return;
-	assert(kref_refcnt(&tf->kref) == 0);
 	tf->flags &= ~TF_F_ON_LRU;
 	spin_lock(&wc->lru_lock);
 	list_del(&tf->lru);
+	__lru_account(wc, tf, -1);
 	spin_unlock(&wc->lru_lock);
 }
 
@@ -64,12 +78,26 @@ static void __remove_from_parent_list(struct tree_file *parent,
  * got the ref, false if we lost and the file was disconnected. */
 bool tf_kref_get(struct tree_file *tf)
 {
+	/* Fast path, for files that are in use (kref > 0), which are not on the LRU
+	 * and have been used before.  We just need to not race with a disconnect,
+	 * which sets the flag and then checks the kref.  Our atomic incref is a
+	 * full barrier before our check of the flag, so either they see our ref or
+	 * we see their flag. */
+	if ((ACCESS_ONCE(tf->flags) & TF_F_HAS_BEEN_USED) &&
+	    kref_get_not_zero(&tf->kref, 1)) {
+		if (!(ACCESS_ONCE(tf->flags) & TF_F_DISCONNECTED))
+			return true;
+		tf_kref_put(tf);
+		return false;
+	}
+	/* Resurrecting from 0 leaves the TF on the LRU, so we don't touch the list
+	 * lock.  HAS_BEEN_USED is the LRU's reference bit.  The pruner will yank
+	 * the TF if it is still in use when the clock hand gets to it. */
 	spin_lock(&tf->lifetime);
 	if (tf->flags & TF_F_DISCONNECTED) {
 		spin_unlock(&tf->lifetime);
 		return false;
 	}
-	__remove_from_lru(tf);
 	__kref_get(&tf->kref, 1);
 	tf->flags |= TF_F_HAS_BEEN_USED;
 	spin_unlock(&tf->lifetime);
@@ -117,14 +145,13 @@ static void tf_release(struct kref *kref)
 	spin_lock(&tf->lifetime);
 	if (kref_refcnt(&tf->kref) > 0) {
 		/* Someone resurrected after we decreffed to 0. */
-		assert(!(tf->flags & TF_F_ON_LRU));
 		spin_unlock(&tf->lifetime);
 		return;
 	}
 	if (!(tf->flags & (TF_F_DISCONNECTED | TF_F_IS_ROOT))) {
-		/* It's possible that we paused before locking, then another thread
-		 * upped, downed, and put it on the LRU list already.  The helper deals
-		 * with that. */
+		/* Usually we're still on the LRU from the last time we hit 0.  If the
+		 * pruner yanked us while we were in use, we go back on at the tail.
+		 * The helper deals with both. */
 		__add_to_lru(tf);
 		spin_unlock(&tf->lifetime);
 		return;
@@ -146,12 +173,23 @@ static unsigned long hash_string(const char *name)
 	return hash;
 }
 
+/* Children are hashed by name and parent, so that common names (e.g. Makefile)
+ * in different directories are spread out. */
+static unsigned long wc_hash(struct tree_file *parent, const char *name,
+                             unsigned int nr_bits)
+{
+	return hash_long(hash_string(name) ^ (unsigned long)parent, nr_bits);
+}
+
 static void wc_init(struct walk_cache *wc)
 {
 	spinlock_init(&wc->lru_lock);
 	INIT_LIST_HEAD(&wc->lru);
+	wc->nr_lru = 0;
+	wc->nr_lru_neg = 0;
 	spinlock_init(&wc->ht_lock);
 	wc->ht = wc->static_ht;
+	wc->ht_seq = 0;
 	hash_init_hh(&wc->hh);
 	for (int i = 0; i < wc->hh.nr_hash_lists; i++)
 		INIT_HLIST_HEAD(&wc->ht[i]);
@@ -167,16 +205,31 @@ static void wc_destroy(struct walk_cache *wc)
 }
 
 /* Looks up the child of parent named 'name' in the walk cache hash table.
- * Caller needs to hold an rcu read lock. */
+ * Caller needs to hold an rcu read lock.
+ *
+ * A concurrent resize moves entries between tables, and we could follow a moved
+ * entry into the wrong chain.  Any match we find is still correct (we check
+ * parent and name), but a miss could be bogus, so we retry misses if the table
+ * changed. */
 static struct tree_file *wc_lookup_child(struct tree_file *parent,
                                          const char *name)
 {
 	struct walk_cache *wc = &parent->tfs->wc;
-	unsigned long hash_val = hash_string(name);
-	struct hlist_head *bucket;
+	unsigned long hash_str = hash_string(name);
+	struct hlist_head *bucket, *ht;
+	unsigned int nr_bits;
 	struct tree_file *i;
-
-	bucket = &wc->ht[hash_val % wc->hh.nr_hash_bits];
+	seq_ctr_t seq;
+
+retry:
+	seq = ACCESS_ONCE(wc->ht_seq);
+	rmb();	/* read seq before the table */
+	/* The resizer publishes the new table before the new size, so reading the
+	 * size first means the table is at least that big. */
+	nr_bits = ACCESS_ONCE(wc->hh.nr_hash_bits);
+	rmb();
+	ht = rcu_dereference(wc->ht);
+	bucket = &ht[hash_long(hash_str ^ (unsigned long)parent, nr_bits)];
 	hlist_for_each_entry_rcu(i, bucket, hash) {
 		/* Note 'i' is an rcu protected pointer.  That deref is safe.  i->parent
 		 * is also a pointer that in general we want to protect.  In this case,
@@ -190,25 +243,70 @@ static struct tree_file *wc_lookup_child(struct tree_file *parent,
 		if (!strcmp(tree_file_to_name(i), name))
 			return i;
 	}
+	if (seqctr_retry(seq, ACCESS_ONCE(wc->ht_seq)))
+		goto retry;
 	return NULL;
 }
 
-/* Caller should hold the parent's qlock */
+/* Grows the hash table, if it needs it.  Returns the old table, which the
+ * caller frees after an RCU grace period, or NULL.  Caller holds the ht_lock.
+ *
+ * Readers run concurrently.  We move entries while the old table is still
+ * published, then publish the new table, then the new size.  The seq_ctr
+ * tells readers their misses might be bogus. */
+static struct hlist_head *__wc_try_resize(struct walk_cache *wc)
+{
+	struct hlist_head *new_ht, *old_ht;
+	struct hlist_node *temp;
+	struct tree_file *i;
+	unsigned int old_nr_lists, new_nr_bits;
+
+	if (!hash_needs_more(&wc->hh))
+		return NULL;
+	new_nr_bits = wc->hh.nr_hash_bits + 1;
+	new_ht = kmalloc(sizeof(struct hlist_head) << new_nr_bits, MEM_ATOMIC);
+	if (!new_ht)
+		return NULL;
+	for (int j = 0; j < (1 << new_nr_bits); j++)
+		INIT_HLIST_HEAD(&new_ht[j]);
+	old_ht = wc->ht;
+	old_nr_lists = wc->hh.nr_hash_lists;
+	__seq_start_write(&wc->ht_seq);
+	for (int j = 0; j < old_nr_lists; j++) {
+		hlist_for_each_entry_safe(i, temp, &old_ht[j], hash) {
+			hlist_del_rcu(&i->hash);
+			hlist_add_head_rcu(&i->hash,
+			                   &new_ht[wc_hash(i->parent, tree_file_to_name(i),
+			                                   new_nr_bits)]);
+		}
+	}
+	rcu_assign_pointer(wc->ht, new_ht);
+	wmb();	/* new table before the new size */
+	hash_incr_nr_lists(&wc->hh);
+	hash_reset_load_limit(&wc->hh);
+	__seq_end_write(&wc->ht_seq);
+	return old_ht;
+}
+
+/* Caller should hold the parent's qlock.  We might block. */
 static void wc_insert_child(struct tree_file *parent, struct tree_file *child)
 {
 	struct walk_cache *wc = &parent->tfs->wc;
-	unsigned long hash_val = hash_string(tree_file_to_name(child));
-	struct hlist_head *bucket;
+	struct hlist_head *bucket, *old_ht;
 
 	assert(child->parent == parent);	/* catch bugs from our callers */
-	/* TODO: consider bucket locks and/or growing the HT.  Prob need a seq_ctr
-	 * in the WC, used on the read side during resizing.  Removal probably would
-	 * need something other than the bucket lock too (confusion about which
-	 * bucket during the op). */
 	spin_lock(&wc->ht_lock);
-	bucket = &wc->ht[hash_val % wc->hh.nr_hash_bits];
+	bucket = &wc->ht[wc_hash(parent, tree_file_to_name(child),
+	                         wc->hh.nr_hash_bits)];
 	hlist_add_head_rcu(&child->hash, bucket);
+	wc->hh.nr_items++;
+	old_ht = __wc_try_resize(wc);
 	spin_unlock(&wc->ht_lock);
+	if (old_ht && old_ht != wc->static_ht) {
+		/* Readers could still be in the old table's buckets. */
+		synchronize_rcu();
+		kfree(old_ht);
+	}
 }
 
 /* Caller should hold the parent's qlock */
@@ -219,6 +317,7 @@ static void wc_remove_child(struct tree_file *parent, struct tree_file *child)
 	assert(child->parent == parent);	/* catch bugs from our callers */
 	spin_lock(&wc->ht_lock);
 	hlist_del_rcu(&child->hash);
+	wc->hh.nr_items--;
 	spin_unlock(&wc->ht_lock);
 }
 
@@ -374,6 +473,14 @@ static void __unlink_child(struct tree_file *parent, struct tree_file *child)
 	__disconnect_child(parent, child);
 }
 
+/* Negative entries from a TFS with a neg_ttl expire, after which lookups treat
+ * them like a cache miss and go to the backend. */
+static bool tf_neg_is_stale(struct tree_file *tf)
+{
+	return tree_file_is_negative(tf) && tf->tfs->neg_ttl_nsec &&
+	       nsec() >= tf->neg_expiry;
+}
+
 /* Talks to the backend and ensures a tree_file for the child exists, either
  * positive or negative.  Throws an error; doesn't return NULL.
  *
@@ -392,13 +499,17 @@ static struct tree_file *lookup_child_entry(struct tree_file *parent,
 
 	qlock(&parent->file.qlock);
 	child = wc_lookup_child(parent, name);
-	if (child) {
+	if (child && !tf_neg_is_stale(child)) {
 		/* Since we last looked, but before we qlocked, someone else added our
 		 * entry. */
 		rcu_read_lock();
 		qunlock(&parent->file.qlock);
 		return child;
 	}
+	/* Same as create: concurrent RCU readers that still see the old negative
+	 * will treat it as a miss or a failure. */
+	if (child)
+		__disconnect_child(parent, child);
 	child = tree_file_alloc(parent->tfs, parent, name);
 	if (waserror()) {
 		/* child wasn't fully created, so freeing it may be tricky, esp on the
@@ -409,6 +520,8 @@ static struct tree_file *lookup_child_entry(struct tree_file *parent,
 	}
 	parent->tfs->tf_ops.lookup(parent, child);
 	poperror();
+	if (tree_file_is_negative(child) && parent->tfs->neg_ttl_nsec)
+		child->neg_expiry = nsec() + parent->tfs->neg_ttl_nsec;
 	__link_child(parent, child);
 	rcu_read_lock();
 	qunlock(&parent->file.qlock);
@@ -526,7 +639,7 @@ struct walkqid *tree_file_walk(struct tree_file *from, char **name,
 			continue;
 		}
 		next = wc_lookup_child(at, name[i]);
-		if (!next) {
+		if (!next || tf_neg_is_stale(next)) {
 			/* TFSs with no backend have the entire tree in the WC HT. */
 			if (!tfs->tf_ops.lookup) {
 				if (i == 0)
@@ -671,6 +784,43 @@ struct tree_file *tree_file_create(struct tree_file *parent, const char *name,
 	return child;
 }
 
+/* Adds a child that the backend told us about on its own, e.g. in a directory
+ * listing that came with the children's metadata, as if we had looked it up.
+ * prime() fills in the child, like the lookup op, and can throw.  Names that
+ * are already in the tree are left alone, other than negative entries, which
+ * the backend just told us are wrong. */
+void tree_file_prime_child(struct tree_file *parent, const char *name,
+                           void (*prime)(struct tree_file *child, void *arg),
+                           void *arg)
+{
+	ERRSTACK(1);
+	struct tree_file *child;
+
+	qlock(&parent->file.qlock);
+	/* Don't add children to a directory that is being removed */
+	if (!parent->can_have_children) {
+		qunlock(&parent->file.qlock);
+		return;
+	}
+	child = wc_lookup_child(parent, name);
+	if (child && !tree_file_is_negative(child)) {
+		qunlock(&parent->file.qlock);
+		return;
+	}
+	if (child)
+		__disconnect_child(parent, child);
+	child = tree_file_alloc(parent->tfs, parent, name);
+	if (waserror()) {
+		__tf_free(child);
+		qunlock(&parent->file.qlock);
+		nexterror();
+	}
+	prime(child, arg);
+	poperror();
+	__link_child(parent, child);
+	qunlock(&parent->file.qlock);
+}
+
 /* Most tree devices will use this for their create op. */
 void tree_chan_create(struct chan *c, char *name, int omode, uint32_t perm,
                       char *ext)
@@ -973,6 +1123,17 @@ size_t tree_chan_read(struct chan *c, void *ubuf, size_t n, off64_t offset)
 	return fs_file_read(&tf->file, ubuf, n, offset);
 }
 
+/* Blocks point at the file's pages, so bread() consumers, e.g. splice, don't
+ * copy the file. */
+struct block *tree_chan_bread(struct chan *c, size_t n, off64_t offset)
+{
+	struct tree_file *tf = chan_to_tree_file(c);
+
+	if (tree_file_is_dir(tf))
+		return devbread(c, n, offset);
+	return fs_file_bread(&tf->file, n, offset);
+}
+
 size_t tree_chan_write(struct chan *c, void *ubuf, size_t n, off64_t offset)
 {
 	struct tree_file *tf = chan_to_tree_file(c);
@@ -1034,6 +1195,7 @@ void tfs_init(struct tree_filesystem *tfs)
 {
 	wc_init(&tfs->wc);
 	qlock_init(&tfs->rename_mtx);
+	tfs->neg_ttl_nsec = 0;
 	tfs->root = tree_file_alloc(tfs, NULL, ".");
 	tfs->root->flags |= TF_F_IS_ROOT;
 	assert(!(tfs->root->flags & TF_F_ON_LRU));
@@ -1191,45 +1353,85 @@ static void dump_tf(struct tree_file *tf, int tabs)
 void __tfs_dump(struct tree_filesystem *tfs)
 {
 	dump_tf(tfs->root, 0);
+	printk("LRU: %lu entries, %lu negative\n", tfs->wc.nr_lru,
+	       tfs->wc.nr_lru_neg);
 }
 
-/* Runs a callback on every non-negative TF on the LRU list, for a given
- * snapshot of the LRU list.  The CB returns true if it wants us to attempt to
- * free the TF.  One invariant is that we can never remove a TF from the tree
- * while it is dirty; it is the job of the CB to maintain that.  Note the CB can
- * run on a TF as soon as that TF was linked to the parent (see lookup).
+/* The LRU is a CLOCK: the hand is the head of the list, and we rotate entries
+ * we look at to the tail.  A pass looks at no more than 4x the entries it can
+ * take, and never more than one revolution, so it is bounded no matter how big
+ * the tree is.  Caller holds the lru_lock. */
+static size_t __lru_scan_budget(struct walk_cache *wc, size_t max_tfs)
+{
+	if (max_tfs > wc->nr_lru / 4)
+		return wc->nr_lru;
+	return max_tfs * 4;
+}
+
+/* Runs a callback on up to max_tfs unused, non-negative TFs from the LRU's
+ * clock hand.  The CB returns true if it wants us to attempt to free the TF.
+ * One invariant is that we can never remove a TF from the tree while it is
+ * dirty; it is the job of the CB to maintain that.  Note the CB can run on a TF
+ * as soon as that TF was linked to the parent (see lookup).  Returns the number
+ * of TFs we freed.
+ *
+ * Lookups don't take the LRU lock.  Resurrected TFs stay on the LRU, with
+ * HAS_BEEN_USED as their reference bit.  When the hand gets to a TF:
+ * - in use (kref > 0): we yank it, and it goes back on when it hits 0 again.
+ * - referenced: second chance.  We clear the bit and move on.
+ * - otherwise, it is a victim.
  *
  * The work list is a list of strong refs.  We need to keep one in case the file
  * is disconnected while we're running our CBs.  Since we incref, we yank from
- * the LRU list.  We could design the rest of the TF code so that we stay on the
- * LRU list throughout, but I like the invariant of "kref == 0 IFF on LRU".
+ * the LRU list.
  *
  * Since we're only on one list at a time ('wc->lru' or 'work'), we can use the
  * lru list_head in the TF.  We know that so long as we hold our kref on a TF,
  * no one will attempt to put it back on the LRU list. */
-void tfs_lru_for_each(struct tree_filesystem *tfs, bool cb(struct tree_file *),
-                      size_t max_tfs)
+size_t tfs_lru_for_each(struct tree_filesystem *tfs,
+                        bool cb(struct tree_file *), size_t max_tfs)
 {
 	struct list_head work = LIST_HEAD_INIT(work);
 	struct walk_cache *wc = &tfs->wc;
 	struct tree_file *tf, *temp, *parent;
-	size_t nr_tfs = 0;
+	size_t nr_tfs = 0, nr_freed = 0, nr_scan;
 
 	/* We can have multiple LRU workers in flight, though a given TF will be on
 	 * only one CB list at a time. */
 	spin_lock(&wc->lru_lock);
-	list_for_each_entry_safe(tf, temp, &wc->lru, lru) {
+	for (nr_scan = __lru_scan_budget(wc, max_tfs);
+	     nr_scan && nr_tfs < max_tfs && !list_empty(&wc->lru);
+	     nr_scan--) {
+		tf = list_first_entry(&wc->lru, struct tree_file, lru);
 		/* lockless peak at the flag.  once it's NEGATIVE, it never goes back */
-		if (tree_file_is_negative(tf))
+		if (tree_file_is_negative(tf)) {
+			list_move_tail(&tf->lru, &wc->lru);
 			continue;
+		}
 		/* Normal lock order is TF -> LRU.  Best effort is fine for LRU. */
-		if (!spin_trylock(&tf->lifetime))
+		if (!spin_trylock(&tf->lifetime)) {
+			list_move_tail(&tf->lru, &wc->lru);
 			continue;
+		}
 		/* Can't be disconnected and on LRU */
 		assert(!(tf->flags & TF_F_DISCONNECTED));
 		assert((tf->flags & TF_F_ON_LRU));
+		if (kref_refcnt(&tf->kref) > 0) {
+			tf->flags &= ~TF_F_ON_LRU;
+			list_del(&tf->lru);
+			__lru_account(wc, tf, -1);
+			spin_unlock(&tf->lifetime);
+			continue;
+		}
+		if (tf->flags & TF_F_HAS_BEEN_USED) {
+			tf->flags &= ~TF_F_HAS_BEEN_USED;
+			spin_unlock(&tf->lifetime);
+			list_move_tail(&tf->lru, &wc->lru);
+			continue;
+		}
 		tf->flags &= ~TF_F_ON_LRU;
 		list_del(&tf->lru);
+		__lru_account(wc, tf, -1);
 		__kref_get(&tf->kref, 1);
 		/* The 'used' bit is the what allows us to detect a user in between our
 		 * callback and the disconnection/freeing.  It's a moot point if the CB
@@ -1237,8 +1439,7 @@ void tfs_lru_for_each(struct tree_filesystem *tfs, bool cb(struct tree_file *),
 		tf->flags &= ~TF_F_HAS_BEEN_USED;
 		spin_unlock(&tf->lifetime);
 		list_add_tail(&tf->lru, &work);
-		if (++nr_tfs >= max_tfs)
-			break;
+		nr_tfs++;
 	}
 	spin_unlock(&wc->lru_lock);
 
@@ -1298,28 +1499,41 @@ void tfs_lru_for_each(struct tree_filesystem *tfs, bool cb(struct tree_file *),
 		/* We could decref, but instead we can directly free.  We know the ref
 		 * == 1 and it is disconnected.  Directly freeing bypasses call_rcu. */
 		__tf_free(tf);
+		nr_freed++;
 	}
+	return nr_freed;
 }
 
-/* Does a one-cycle 'clock' algorithm to detect use.  On a given pass, we either
- * clear HAS_BEEN_USED xor we remove it.  For negative entries, that bit is used
- * when we look at an entry (use it), compared to positive entries, which is
- * used when we get a reference.  (we never get refs on negatives). */
-void tfs_lru_prune_neg(struct tree_filesystem *tfs)
+/* Runs the same clock as tfs_lru_for_each(), for up to max_tfs negative
+ * entries.  On a given pass, we either clear HAS_BEEN_USED xor we remove it.
+ * For negative entries, that bit is used when we look at an entry (use it),
+ * compared to positive entries, which is used when we get a reference.  (we
+ * never get refs on negatives). */
+void tfs_lru_prune_neg(struct tree_filesystem *tfs, size_t max_tfs)
 {
 	struct list_head work = LIST_HEAD_INIT(work);
 	struct walk_cache *wc = &tfs->wc;
 	struct tree_file *tf, *temp, *parent;
+	size_t nr_tfs = 0, nr_scan;
 
 	spin_lock(&wc->lru_lock);
-	list_for_each_entry_safe(tf, temp, &wc->lru, lru) {
-		if (!tree_file_is_negative(tf))
+	for (nr_scan = __lru_scan_budget(wc, max_tfs);
+	     nr_scan && nr_tfs < max_tfs && !list_empty(&wc->lru);
+	     nr_scan--) {
+		tf = list_first_entry(&wc->lru, struct tree_file, lru);
+		if (!tree_file_is_negative(tf)) {
+			list_move_tail(&tf->lru, &wc->lru);
 			continue;
-		if (!spin_trylock(&tf->lifetime))
+		}
+		if (!spin_trylock(&tf->lifetime)) {
+			list_move_tail(&tf->lru, &wc->lru);
 			continue;
-		if (tf->flags & TF_F_HAS_BEEN_USED) {
+		}
+		/* Stale entries go regardless of use; they're useless. */
+		if ((tf->flags & TF_F_HAS_BEEN_USED) && !tf_neg_is_stale(tf)) {
 			tf->flags &= ~TF_F_HAS_BEEN_USED;
 			spin_unlock(&tf->lifetime);
+			list_move_tail(&tf->lru, &wc->lru);
 			continue;
 		}
 		rcu_read_lock();	/* holding a spinlock, but just to be clear. */
@@ -1328,6 +1542,7 @@ void tfs_lru_prune_neg(struct tree_filesystem *tfs)
 		if (!canqlock(&parent->file.qlock)) {
 			rcu_read_unlock();
 			spin_unlock(&tf->lifetime);
+			list_move_tail(&tf->lru, &wc->lru);
 			continue;
 		}
 		__remove_from_parent_list(parent, tf);
@@ -1337,8 +1552,10 @@ void tfs_lru_prune_neg(struct tree_filesystem *tfs)
 		 * invariant since we have the only ref and are about to free the TF. */
 		tf->flags &= ~TF_F_ON_LRU;
 		list_del(&tf->lru);
+		__lru_account(wc, tf, -1);
 		spin_unlock(&tf->lifetime);
 		list_add_tail(&tf->lru, &work);
+		nr_tfs++;
 	}
 	spin_unlock(&wc->lru_lock);
 	/* Now we have a list of refs that are all unlinked (but actually not
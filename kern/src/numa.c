@@ -0,0 +1,292 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * NUMA memory placement, see numa.h.
+ *
+ * This follows the plan in arena.c: base_arena is set up before we know about
+ * NUMA, and it stays node 0's base.  Once we've parsed the SRAT, we move the
+ * free memory of every other node out of base_arena and into that node's own
+ * base arena, and give each node a kpages arena on top of its base.  Node 0's
+ * kpages arena is kpages_arena.
+ *
+ * Memory that was already allocated when we split things up stays with
+ * base_arena forever, so a little of node N's memory might get handed out as
+ * node 0's.  That's early boot stuff, so it's not much.
+ *
+ * kpages from a node's arena must go back to that arena, so allocations record
+ * the node in the first page's struct page.  That's why only the kpages_*()
+ * functions (and upage_alloc()) use the nodes: slabs, jumbos, and contiguous
+ * allocations still come from kpages_arena and base_arena. */
+
+#include <numa.h>
+#include <arena.h>
+#include <kmalloc.h>
+#include <acpi.h>
+#include <pmap.h>
+#include <page_alloc.h>
+#include <process.h>
+#include <mm.h>
+#include <bitops.h>
+#include <arch/topology.h>
+#include <stdio.h>
+#include <string.h>
+
+int numa_nr_nodes;
+unsigned long numa_mem_nodes;
+struct numa_node numa_nodes[NUMA_MAX_NODES];
+
+/* Largest chunk we move from base_arena to a node at a time */
+#define NUMA_CARVE_MAX			(1UL << 30)
+
+/* Moves the free memory in [addr, addr + len) from base_arena to dom's base.
+ * We halve the chunk size every time base_arena can't give us one, until we
+ * can't even get a page. */
+static void carve_range(int dom, uint64_t addr, uint64_t len, void *arg)
+{
+	int nr_nodes = *(int*)arg;
+	struct numa_node *node;
+	uintptr_t start, end;
+	size_t size;
+	void *kva;
+
+	if (dom <= 0 || dom >= nr_nodes)
+		return;
+	node = &numa_nodes[dom];
+	start = ROUNDUP(addr, PGSIZE);
+	end = ROUNDDOWN(MIN(addr + len, max_paddr), PGSIZE);
+	if (start >= end)
+		return;
+	size = MIN(1UL << LOG2_DOWN(end - start), NUMA_CARVE_MAX);
+	while (size >= PGSIZE) {
+		kva = arena_xalloc(base_arena, size, PGSIZE, 0, 0, KADDR(start),
+		                   KADDR_NOCHECK(end), MEM_ATOMIC);
+		if (!kva) {
+			size >>= 1;
+			continue;
+		}
+		arena_add(node->base, kva, size, MEM_WAIT);
+		node->nr_bytes += size;
+	}
+}
+
+/* Call after topology_init(), while we're still the only core. */
+void numa_init(void)
+{
+	int nr_nodes = cpu_topology_info.num_numa;
+	char name[ARENA_NAME_SZ];
+	struct numa_node *node;
+	void *pg;
+
+	if (nr_nodes <= 1)
+		return;
+	if (nr_nodes > NUMA_MAX_NODES) {
+		warn("%d NUMA nodes, only using %d", nr_nodes, NUMA_MAX_NODES);
+		nr_nodes = NUMA_MAX_NODES;
+	}
+	numa_nodes[0].base = base_arena;
+	numa_nodes[0].kpages = kpages_arena;
+	for (int i = 1; i < nr_nodes; i++) {
+		pg = arena_alloc(base_arena, PGSIZE, MEM_WAIT);
+		snprintf(name, sizeof(name), "base_%d", i);
+		numa_nodes[i].base = arena_builder(pg, name, PGSIZE, NULL, NULL, NULL,
+		                                   0);
+	}
+	acpi_srat_foreach_mem(carve_range, &nr_nodes);
+	for (int i = 1; i < nr_nodes; i++) {
+		node = &numa_nodes[i];
+		/* No memory (or none we could move); allocs skip these nodes */
+		if (!node->nr_bytes)
+			continue;
+		pg = arena_alloc(node->base, PGSIZE, MEM_WAIT);
+		snprintf(name, sizeof(name), "kpages_%d", i);
+		node->kpages = arena_builder(pg, name, PGSIZE, arena_alloc,
+		                             arena_free, node->base, 8 * PGSIZE);
+		numa_mem_nodes |= 1UL << i;
+	}
+	if (!numa_mem_nodes) {
+		printk("NUMA: %d nodes, but all memory is on node 0\n", nr_nodes);
+		return;
+	}
+	numa_mem_nodes |= 1;
+	numa_nodes[0].nr_bytes = arena_amt_free(base_arena);
+	for (int i = 0; i < nr_nodes; i++)
+		printk("NUMA: node %d: %lu MB free\n", i,
+		       numa_nodes[i].nr_bytes >> 20);
+	/* This turns on the node arenas for kpages_alloc() and friends */
+	numa_nr_nodes = nr_nodes;
+}
+
+int numa_local_node(void)
+{
+	int node;
+
+	if (!numa_nr_nodes)
+		return 0;
+	node = cpu_topology_info.core_list[core_id_early()].numa_id;
+	return (node >= 0) && (node < numa_nr_nodes) ? node : 0;
+}
+
+/* Narrows nodes down to the ones with memory and picks the first node to
+ * try: pref, unless it isn't in nodes. */
+static int pick_pref(unsigned long *nodes, int pref)
+{
+	*nodes &= numa_mem_nodes;
+	if (!*nodes)
+		*nodes = numa_mem_nodes;
+	if (pref == NUMA_NODE_LOCAL)
+		pref = numa_local_node();
+	if (!(*nodes & (1UL << pref)))
+		pref = __ffs(*nodes);
+	return pref;
+}
+
+static void *node_alloc(int node, size_t size, int flags)
+{
+	void *ret = arena_alloc(numa_nodes[node].kpages, size, flags);
+
+	if (ret)
+		kva2page(ret)->pg_node = node;
+	return ret;
+}
+
+/* Allocates from pref if we can, otherwise from the other nodes in nodes.
+ * Everyone gets a try without blocking before we'll wait on pref.
+ *
+ * We could try the others in order of SLIT distance.  For now, it's just in
+ * order of node ID. */
+void *numa_kpages_alloc(unsigned long nodes, int pref, size_t size, int flags)
+{
+	void *ret;
+
+	if (!numa_nr_nodes)
+		return arena_alloc(kpages_arena, size, flags);
+	pref = pick_pref(&nodes, pref);
+	ret = node_alloc(pref, size, flags | MEM_ATOMIC);
+	for (int i = 0; !ret && i < numa_nr_nodes; i++) {
+		if ((i != pref) && (nodes & (1UL << i)))
+			ret = node_alloc(i, size, flags | MEM_ATOMIC);
+	}
+	if (!ret && !(flags & MEM_ATOMIC))
+		ret = node_alloc(pref, size, flags);
+	return ret;
+}
+
+static size_t node_alloc_batch(int node, void **addrs, size_t size, size_t nr,
+                               int flags)
+{
+	size_t got;
+
+	got = arena_alloc_batch(numa_nodes[node].kpages, addrs, size, nr, flags);
+	for (size_t i = 0; i < got; i++)
+		kva2page(addrs[i])->pg_node = node;
+	return got;
+}
+
+size_t numa_kpages_alloc_batch(unsigned long nodes, int pref, void **addrs,
+                               size_t size, size_t nr, int flags)
+{
+	size_t got;
+
+	if (!numa_nr_nodes)
+		return arena_alloc_batch(kpages_arena, addrs, size, nr, flags);
+	pref = pick_pref(&nodes, pref);
+	got = node_alloc_batch(pref, addrs, size, nr, flags | MEM_ATOMIC);
+	for (int i = 0; got < nr && i < numa_nr_nodes; i++) {
+		if ((i != pref) && (nodes & (1UL << i)))
+			got += node_alloc_batch(i, addrs + got, size, nr - got,
+			                        flags | MEM_ATOMIC);
+	}
+	if (got < nr && !(flags & MEM_ATOMIC))
+		got += node_alloc_batch(pref, addrs + got, size, nr - got, flags);
+	return got;
+}
+
+void numa_kpages_free(void *addr, size_t size)
+{
+	if (!numa_nr_nodes) {
+		arena_free(kpages_arena, addr, size);
+		return;
+	}
+	arena_free(numa_nodes[kva2page(addr)->pg_node].kpages, addr, size);
+}
+
+/* Frees runs of addrs from the same node together. */
+void numa_kpages_free_batch(void **addrs, size_t size, size_t nr)
+{
+	size_t i, j;
+	int node;
+
+	if (!numa_nr_nodes) {
+		arena_free_batch(kpages_arena, addrs, size, nr);
+		return;
+	}
+	for (i = 0; i < nr; i = j) {
+		node = kva2page(addrs[i])->pg_node;
+		for (j = i + 1; j < nr; j++) {
+			if (kva2page(addrs[j])->pg_node != node)
+				break;
+		}
+		arena_free_batch(numa_nodes[node].kpages, &addrs[i], size, j - i);
+	}
+}
+
+/* Returns 0 or -EINVAL.  Readers don't lock, so we set nodes before mode: a
+ * reader that sees the new mode with the old nodes gets something sane (see
+ * mpol_pick()). */
+int mpol_set(struct mempolicy *mpol, int mode, unsigned long nodes)
+{
+	unsigned long valid = numa_nr_nodes ? numa_mem_nodes : 1;
+
+	switch (mode) {
+	case MPOL_DEFAULT:
+		nodes = 0;
+		break;
+	case MPOL_BIND:
+	case MPOL_INTERLEAVE:
+		if (!nodes || (nodes & ~valid))
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+	WRITE_ONCE(mpol->nodes, nodes);
+	wmb();
+	WRITE_ONCE(mpol->mode, mode);
+	return 0;
+}
+
+/* Returns the n'th set bit of mask. */
+static int nth_node(unsigned long mask, unsigned long n)
+{
+	while (n--)
+		mask &= mask - 1;
+	return __ffs(mask);
+}
+
+/* Picks where a page of p's goes for numa_kpages_alloc().  vmr is optional; if
+ * it has a policy, that overrides p's.  Interleaving goes by va (a page always
+ * lands on the same node), or round-robin if you don't have one. */
+void mpol_pick(struct proc *p, struct vm_region *vmr, uintptr_t va,
+               unsigned long *nodes, int *pref)
+{
+	struct mempolicy *mpol = &p->mpol;
+	unsigned long mask, idx;
+	int mode;
+
+	if (vmr && READ_ONCE(vmr->vm_mpol.mode) != MPOL_DEFAULT)
+		mpol = &vmr->vm_mpol;
+	mode = READ_ONCE(mpol->mode);
+	rmb();
+	mask = READ_ONCE(mpol->nodes);
+	*pref = NUMA_NODE_LOCAL;
+	if (!numa_nr_nodes || (mode == MPOL_DEFAULT) || !mask) {
+		*nodes = numa_mem_nodes;
+		return;
+	}
+	*nodes = mask;
+	if (mode == MPOL_INTERLEAVE) {
+		/* Racy, but it's just a hint */
+		idx = va ? va >> PGSHIFT : p->mpol_ilv_next++;
+		*pref = nth_node(mask, idx % hweight_long(mask));
+	}
+}
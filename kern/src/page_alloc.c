@@ -9,6 +9,9 @@
 #include <pmap.h>
 #include <kmalloc.h>
 #include <arena.h>
+#include <numa.h>
+#include <zpool.h>
+#include <latency.h>
 
 /* Helper, allocates a free page. */
 static struct page *get_a_free_page(void)
@@ -21,6 +24,37 @@ static struct page *get_a_free_page(void)
 	return kva2page(addr);
 }
 
+/* Allocates a page for p's memory at va in vmr, following their memory
+ * policy.  vmr and va are optional.  Zeroed pages come from the zero pool if
+ * we can. */
+error_t upage_alloc_vmr(struct proc *p, struct vm_region *vmr, uintptr_t va,
+                        page_t **page, bool zero)
+{
+	unsigned long nodes;
+	int pref;
+	void *addr;
+	uint64_t start;
+
+	mpol_pick(p, vmr, va, &nodes, &pref);
+	if (zero) {
+		start = read_tsc();
+		addr = zpool_get(nodes, pref);
+		if (!addr) {
+			addr = numa_kpages_alloc(nodes, pref, PGSIZE, MEM_ATOMIC);
+			if (!addr)
+				return -ENOMEM;
+			memset(addr, 0, PGSIZE);
+		}
+		lat_record(LAT_ZERO_PAGE, read_tsc() - start);
+	} else {
+		addr = numa_kpages_alloc(nodes, pref, PGSIZE, MEM_ATOMIC);
+		if (!addr)
+			return -ENOMEM;
+	}
+	*page = kva2page(addr);
+	return 0;
+}
+
 /**
  * @brief Allocates a physical page from a pool of unused physical memory.
  *
@@ -34,14 +68,7 @@ static struct page *get_a_free_page(void)
  */
 error_t upage_alloc(struct proc *p, page_t **page, bool zero)
 {
-	struct page *pg = get_a_free_page();
-
-	if (!pg)
-		return -ENOMEM;
-	*page = pg;
-	if (zero)
-		memset(page2kva(*page), 0, PGSIZE);
-	return 0;
+	return upage_alloc_vmr(p, NULL, 0, page, zero);
 }
 
 error_t kpage_alloc(page_t **page)
@@ -67,22 +94,26 @@ void *kpage_alloc_addr(void)
 
 void *kpage_zalloc_addr(void)
 {
-	void *retval = kpage_alloc_addr();
+	void *retval = zpool_get(numa_mem_nodes, NUMA_NODE_LOCAL);
+
+	if (retval)
+		return retval;
+	retval = kpage_alloc_addr();
 	if (retval)
 		memset(retval, 0, PGSIZE);
 	return retval;
 }
 
-/* Helper function for allocating from the kpages_arena.  This may be useful
- * later since we might send the caller to a different NUMA domain. */
+/* Helper function for allocating from the kpages arenas.  With NUMA, we try
+ * the caller's node first (see numa.c). */
 void *kpages_alloc(size_t size, int flags)
 {
-	return arena_alloc(kpages_arena, size, flags);
+	return numa_kpages_alloc(numa_mem_nodes, NUMA_NODE_LOCAL, size, flags);
 }
 
 void *kpages_zalloc(size_t size, int flags)
 {
-	void *ret = arena_alloc(kpages_arena, size, flags);
+	void *ret = kpages_alloc(size, flags);
 
 	if (!ret)
 		return NULL;
@@ -92,7 +123,23 @@ void *kpages_zalloc(size_t size, int flags)
 
 void kpages_free(void *addr, size_t size)
 {
-	arena_free(kpages_arena, addr, size);
+	numa_kpages_free(addr, size);
+}
+
+/* Batched versions of kpages_alloc and kpages_free.  For sizes up to the
+ * kpages qcache_max (8 pages), these refill and drain the per-core magazines in
+ * bulk, so a caller that needs a bunch of pages (e.g. populating a VMR) only
+ * leaves the core when the magazines run dry.  Returns the number of
+ * allocations, which is less than @nr only on failure. */
+size_t kpages_alloc_batch(void **addrs, size_t size, size_t nr, int flags)
+{
+	return numa_kpages_alloc_batch(numa_mem_nodes, NUMA_NODE_LOCAL, addrs, size,
+	                               nr, flags);
+}
+
+void kpages_free_batch(void **addrs, size_t size, size_t nr)
+{
+	numa_kpages_free_batch(addrs, size, nr);
 }
 
 /* Returns naturally aligned, contiguous pages of amount PGSIZE << order.  Linux
@@ -109,10 +156,47 @@ void free_cont_pages(void *buf, size_t order)
 	arena_xfree(kpages_arena, buf, PGSIZE << order);
 }
 
-/* Frees the page */
+static void __jumbo_piece_decref(struct page *page);
+
+/* Anonymous pages are shared copy-on-write after a fork.  pg_cow_refs counts
+ * the PTEs pointing at the page other than the first one, so the usual, single
+ * owner case is 0.  PTEs of a shared page are read-only. */
+void page_cow_share(struct page *page)
+{
+	atomic_inc(&page->pg_cow_refs);
+}
+
+/* Drops one share of a CoW page.  Returns TRUE if some other PTE still has it,
+ * FALSE if there were no other sharers, in which case the caller's ref is the
+ * last one. */
+bool page_cow_unshare(struct page *page)
+{
+	long old;
+
+	do {
+		old = atomic_read(&page->pg_cow_refs);
+		if (!old)
+			return FALSE;
+	} while (!atomic_cas(&page->pg_cow_refs, old, old - 1));
+	return TRUE;
+}
+
+bool page_is_cow_shared(struct page *page)
+{
+	return atomic_read(&page->pg_cow_refs) > 0;
+}
+
+/* Frees the page, unless it is still shared CoW. */
 void page_decref(page_t *page)
 {
 	assert(!page_is_pagemap(page));
+	if (page_cow_unshare(page))
+		return;
+	atomic_and(&page->pg_flags, ~PG_COW_BUF);
+	if (atomic_read(&page->pg_flags) & PG_JUMBO) {
+		__jumbo_piece_decref(page);
+		return;
+	}
 	kpages_free(page2kva(page), PGSIZE);
 }
 
@@ -142,7 +226,8 @@ static void *__jumbo_pml2_alloc(struct arena *a, size_t size, int flags)
 
 static struct arena *jumbo_pml2_arena;
 
-/* Just for example; we could add qcaches too.  Do this after kmalloc_init(). */
+/* Backs jumbo user mappings (see mm.c).  We could add qcaches too.  Do this
+ * after kmalloc_init(). */
 void jumbo_arena_init(void)
 {
 	jumbo_pml2_arena = arena_create("jumbo_pml2", NULL, 0, PML2_PTE_REACH,
@@ -160,3 +245,30 @@ void jumbo_page_free(void *buf, size_t nr)
 {
 	arena_free(jumbo_pml2_arena, buf, nr * PML2_PTE_REACH);
 }
+
+/* Splits a single jumbo page (from jumbo_page_alloc) into its PGSIZE pieces,
+ * each of which can be page_decref'd on its own.  This is for when a jumbo
+ * mapping gets broken up into regular PTEs.  The jumbo goes back to the arena
+ * once the last piece is decref'd. */
+void jumbo_page_split(void *buf)
+{
+	struct page *head = kva2page(buf);
+	size_t nr_pieces = PML2_PTE_REACH >> PGSHIFT;
+
+	assert(!((uintptr_t)buf & (PML2_PTE_REACH - 1)));
+	atomic_set(&head->pg_jumbo_refs, nr_pieces);
+	for (size_t i = 0; i < nr_pieces; i++)
+		atomic_or(&head[i].pg_flags, PG_JUMBO);
+}
+
+static void __jumbo_piece_decref(struct page *page)
+{
+	struct page *head = pa2page(ROUNDDOWN(page2pa(page), PML2_PTE_REACH));
+	size_t nr_pieces = PML2_PTE_REACH >> PGSHIFT;
+
+	if (!atomic_sub_and_test(&head->pg_jumbo_refs, 1))
+		return;
+	for (size_t i = 0; i < nr_pieces; i++)
+		atomic_and(&head[i].pg_flags, ~PG_JUMBO);
+	jumbo_page_free(page2kva(head), 1);
+}
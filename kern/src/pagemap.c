@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <pagemap.h>
 #include <rcu.h>
+#include <kmalloc.h>
 
 void pm_add_vmr(struct page_map *pm, struct vm_region *vmr)
 {
@@ -93,46 +94,68 @@ void pm_init(struct page_map *pm, struct page_map_operations *op, void *host)
 	radix_tree_init(&pm->pm_tree);
 	pm->pm_num_pages = 0;
 	pm->pm_op = op;
+	pm->pm_ra_hint = PM_RA_NORMAL;
+	pm->pm_evict_idx = 0;
 	qlock_init(&pm->pm_qlock);
 	spinlock_init(&pm->pm_lock);
 	TAILQ_INIT(&pm->pm_vmrs);
 }
 
-/* Looks up the index'th page in the page map, returning a refcnt'd reference
- * that need to be dropped with pm_put_page, or 0 if it was not in the map. */
-static struct page *pm_find_page(struct page_map *pm, unsigned long index)
+/* Gets a slot ref on the page in tree_slot, if there is one.  Hold the RCU read
+ * lock, which protects tree_slot.
+ *
+ * We're syncing with removal.  The deal is that if we grab the page (and we'd
+ * only do that if the page != 0), we up the slot ref and clear removal.  A
+ * remover will only remove it if removal is still set.  If we grab and release
+ * while removal is in progress, even though we no longer hold the ref, we have
+ * unset removal.  Also, to prevent removal where we get a page well before the
+ * removal process, the removal won't even bother when the slot refcnt is
+ * upped. */
+static struct page *__pm_slot_get_page_ref(void **tree_slot)
 {
-	void **tree_slot;
 	void *old_slot_val, *slot_val;
-	struct page *page = 0;
+	struct page *page;
 
-	/* We use rcu to protect our radix walk, specifically the tree_slot pointer.
-	 * We get our own 'pm refcnt' on the slot itself, which doesn't need RCU. */
-	rcu_read_lock();
-	/* We're syncing with removal.  The deal is that if we grab the page (and
-	 * we'd only do that if the page != 0), we up the slot ref and clear
-	 * removal.  A remover will only remove it if removal is still set.  If we
-	 * grab and release while removal is in progress, even though we no longer
-	 * hold the ref, we have unset removal.  Also, to prevent removal where we
-	 * get a page well before the removal process, the removal won't even bother
-	 * when the slot refcnt is upped. */
-	tree_slot = radix_lookup_slot(&pm->pm_tree, index);
-	if (!tree_slot)
-		goto out;
 	do {
 		old_slot_val = ACCESS_ONCE(*tree_slot);
 		slot_val = old_slot_val;
 		page = pm_slot_get_page(slot_val);
 		if (!page)
-			goto out;
+			return NULL;
 		slot_val = pm_slot_inc_refcnt(slot_val);	/* not a page kref */
 	} while (!atomic_cas_ptr(tree_slot, old_slot_val, slot_val));
 	assert(page->pg_tree_slot == tree_slot);
-out:
+	/* Read first, so hot pages don't bounce the flags' cacheline around */
+	if (!(atomic_read(&page->pg_flags) & PG_REFERENCED))
+		atomic_or(&page->pg_flags, PG_REFERENCED);
+	return page;
+}
+
+/* Looks up the index'th page in the page map, returning a refcnt'd reference
+ * that need to be dropped with pm_put_page, or 0 if it was not in the map. */
+static struct page *pm_find_page(struct page_map *pm, unsigned long index)
+{
+	void **tree_slot;
+	struct page *page = 0;
+
+	/* We use rcu to protect our radix walk, specifically the tree_slot pointer.
+	 * We get our own 'pm refcnt' on the slot itself, which doesn't need RCU. */
+	rcu_read_lock();
+	tree_slot = radix_lookup_slot(&pm->pm_tree, index);
+	if (tree_slot)
+		page = __pm_slot_get_page_ref(tree_slot);
 	rcu_read_unlock();
 	return page;
 }
 
+/* Frees a page that is no longer in the PM.  Pieces of a jumbo page need to
+ * keep PG_JUMBO, so page_decref() gives them back to the jumbo. */
+static void pm_free_page(struct page *page)
+{
+	atomic_and(&page->pg_flags, PG_JUMBO);	/* catch bugs */
+	page_decref(page);
+}
+
 /* Attempts to insert the page into the page_map, returns 0 for success, or an
  * error code if there was one already (EEXIST) or we ran out of memory
  * (ENOMEM).
@@ -157,6 +180,8 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	slot_val = pm_slot_inc_refcnt(slot_val);
 	/* passing the page ref from the caller to the slot */
 	slot_val = pm_slot_set_page(slot_val, page);
+	/* So the insert doesn't hit the slab allocator while we hold the qlock */
+	radix_preload(&pm->pm_tree, MEM_WAIT);
 	qlock(&pm->pm_qlock);
 	ret = radix_insert(&pm->pm_tree, index, slot_val, &tree_slot);
 	if (ret) {
@@ -169,6 +194,48 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	return 0;
 }
 
+/* Inserts nr pages at [index, index + nr), all or nothing: EEXIST if any of the
+ * slots are taken, ENOMEM if we ran out of memory.  Same deal with the refs as
+ * pm_insert_page(): on success, each page's ref becomes a slot ref.  This is
+ * for FSs that fill a whole range at once, e.g. with a jumbo page. */
+int pm_insert_pages(struct page_map *pm, unsigned long index,
+                    struct page **pgs, size_t nr)
+{
+	void **tree_slot;
+	void *slot_val;
+	int ret = 0;
+	size_t i;
+
+	radix_preload(&pm->pm_tree, MEM_WAIT);
+	qlock(&pm->pm_qlock);
+	for (i = 0; i < nr; i++) {
+		if (radix_lookup(&pm->pm_tree, index + i)) {
+			qunlock(&pm->pm_qlock);
+			return -EEXIST;
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		pgs[i]->pg_mapping = pm;
+		pgs[i]->pg_index = index + i;
+		slot_val = pm_slot_inc_refcnt(0);
+		slot_val = pm_slot_set_page(slot_val, pgs[i]);
+		ret = radix_insert(&pm->pm_tree, index + i, slot_val, &tree_slot);
+		if (ret)
+			break;
+		pgs[i]->pg_tree_slot = tree_slot;
+	}
+	if (ret) {
+		/* No one could have found these; lookups of them need the qlock */
+		while (i--)
+			radix_delete(&pm->pm_tree, index + i);
+		qunlock(&pm->pm_qlock);
+		return ret;
+	}
+	pm->pm_num_pages += nr;
+	qunlock(&pm->pm_qlock);
+	return 0;
+}
+
 /* Decrefs the PM slot ref (usage of a PM page).  The PM's page ref remains. */
 void pm_put_page(struct page *page)
 {
@@ -181,6 +248,59 @@ void pm_put_page(struct page *page)
 	atomic_add((atomic_t*)tree_slot, -(1UL << PM_REFCNT_SHIFT));
 }
 
+/* External refs are for users that hold on to a PM page for an unbounded
+ * amount of time, from contexts that can't block, such as a block in a network
+ * queue that points at the page (splice).  Those users can't hold a slot ref:
+ * the slot goes away in pm_destroy, which could happen while the NIC still has
+ * the page.
+ *
+ * pg_ext_refs has one ref for the PM itself, plus one per external user.  The
+ * PM will not remove a page with external users (we treat them like slot
+ * refs), but pm_destroy drops the PM's ref and orphans the page.  Whoever
+ * drops the last ext ref frees the page.  Orphaned pages keep PG_PAGEMAP, so
+ * the block code knows to put them with pm_put_page_ext().
+ *
+ * You need to hold a slot ref or an ext ref to get an ext ref.  That way, once
+ * a remover yanks the page from its slot and sees no ext refs, no one can get
+ * one. */
+void pm_get_page_ext(struct page *page)
+{
+	assert(page_is_pagemap(page));
+	assert(atomic_read(&page->pg_ext_refs) > 0);
+	atomic_inc(&page->pg_ext_refs);
+}
+
+static void pm_free_orphan(struct page *page)
+{
+	pm_free_page(page);
+}
+
+/* Safe to call from IRQ context. */
+void pm_put_page_ext(struct page *page)
+{
+	if (atomic_sub_and_test(&page->pg_ext_refs, 1))
+		pm_free_orphan(page);
+}
+
+static bool pm_page_has_ext_refs(struct page *page)
+{
+	return atomic_read(&page->pg_ext_refs) > 1;
+}
+
+/* Tells the FS the first time someone uses a page it read ahead.  Losing the
+ * CAS to some other flag change just means we miss a hit. */
+static void pm_check_readahead(struct page_map *pm, struct page *page)
+{
+	long flags = atomic_read(&page->pg_flags);
+
+	if (!(flags & PG_READAHEAD))
+		return;
+	if (!atomic_cas(&page->pg_flags, flags, flags & ~PG_READAHEAD))
+		return;
+	if (pm->pm_op->readahead_hit)
+		pm->pm_op->readahead_hit(pm, page);
+}
+
 /* Makes sure the index'th page of the mapped object is loaded in the page cache
  * and returns its location via **pp.
  *
@@ -191,12 +311,17 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	int error;
 
 	page = pm_find_page(pm, index);
+	/* The FS might want to fill the whole neighborhood.  If it can't, we just
+	 * load the one page. */
+	if (!page && pm->pm_op->populate && !pm->pm_op->populate(pm, index))
+		page = pm_find_page(pm, index);
 	while (!page) {
 		if (kpage_alloc(&page))
 			return -ENOMEM;
 		/* important that UP_TO_DATE is not set.  once we put it in the PM,
 		 * others can find it, and we still need to fill it. */
 		atomic_set(&page->pg_flags, PG_LOCKED | PG_PAGEMAP);
+		atomic_set(&page->pg_ext_refs, 1);	/* the PM's ref */
 		/* The sem needs to be initted before anyone can try to lock it, meaning
 		 * before it is in the page cache.  We also want it locked preemptively,
 		 * by setting signals = 0. */
@@ -223,6 +348,7 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	assert(pm_slot_check_refcnt(*page->pg_tree_slot));
 	assert(pm_slot_get_page(*page->pg_tree_slot) == page);
 	if (atomic_read(&page->pg_flags) & PG_UPTODATE) {
+		pm_check_readahead(pm, page);
 		*pp = page;
 		printd("pm %p FOUND page %p, addr %p, idx %d\n", pm, page,
 		       page2kva(page), index);
@@ -234,6 +360,7 @@ int pm_load_page(struct page_map *pm, unsigned long index, struct page **pp)
 	 * clobber newer writes) */
 	if (atomic_read(&page->pg_flags) & PG_UPTODATE) {
 		unlock_page(page);
+		pm_check_readahead(pm, page);
 		*pp = page;
 		return 0;
 	}
@@ -249,6 +376,50 @@ load_locked_page:
 	return 0;
 }
 
+/* For readahead: if the index'th page isn't in the page map yet, this inserts a
+ * new page that is locked and not up to date, and returns it with a slot ref.
+ * Returns NULL if the page was already there or we're out of memory.
+ *
+ * The caller fills the page, sets PG_UPTODATE, then unlocks and puts it.
+ * Anyone who finds the page in the meantime blocks in pm_load_page().  If the
+ * caller can't fill it, it just unlocks it, and pm_load_page() will readpage()
+ * it later. */
+struct page *pm_grab_new_page(struct page_map *pm, unsigned long index)
+{
+	struct page *page;
+	void *slot_val;
+
+	/* Racy peek, so we don't allocate for pages we already have */
+	rcu_read_lock();
+	slot_val = radix_lookup(&pm->pm_tree, index);
+	rcu_read_unlock();
+	if (slot_val)
+		return NULL;
+	if (kpage_alloc(&page))
+		return NULL;
+	atomic_set(&page->pg_flags, PG_LOCKED | PG_PAGEMAP);
+	atomic_set(&page->pg_ext_refs, 1);	/* the PM's ref */
+	sem_init(&page->pg_sem, 0);
+	if (pm_insert_page(pm, index, page)) {
+		atomic_set(&page->pg_flags, 0);
+		page_decref(page);
+		return NULL;
+	}
+	return page;
+}
+
+/* Racy peek: whether the index'th page is in the PM, uptodate or not.  Pages
+ * that are in the PM but not uptodate are being loaded. */
+bool pm_has_page(struct page_map *pm, unsigned long index)
+{
+	void *slot_val;
+
+	rcu_read_lock();
+	slot_val = radix_lookup(&pm->pm_tree, index);
+	rcu_read_unlock();
+	return slot_val != NULL;
+}
+
 int pm_load_page_nowait(struct page_map *pm, unsigned long index,
                         struct page **pp)
 {
@@ -264,6 +435,68 @@ int pm_load_page_nowait(struct page_map *pm, unsigned long index,
 	return 0;
 }
 
+/* Like pm_load_page_nowait(), for up to nr pages starting at index.  Stops at
+ * the first page that isn't in the cache and uptodate, and returns how many
+ * pages it got, each with a slot ref.
+ *
+ * Consecutive indexes share a radix leaf, so we only walk the tree once per
+ * leaf, not once per page. */
+size_t pm_load_pages_nowait(struct page_map *pm, unsigned long index,
+                            size_t nr, struct page **pps)
+{
+	void **tree_slot = NULL;
+	struct page *page;
+	size_t i;
+
+	rcu_read_lock();
+	for (i = 0; i < nr; i++) {
+		if (!tree_slot || !((index + i) % NR_RNODE_SLOTS))
+			tree_slot = radix_lookup_slot(&pm->pm_tree, index + i);
+		else
+			tree_slot++;
+		if (!tree_slot)
+			break;
+		page = __pm_slot_get_page_ref(tree_slot);
+		if (!page)
+			break;
+		if (!(atomic_read(&page->pg_flags) & PG_UPTODATE)) {
+			pm_put_page(page);
+			break;
+		}
+		pps[i] = page;
+	}
+	rcu_read_unlock();
+	return i;
+}
+
+/* Loads up to nr consecutive pages starting at index, returning how many we
+ * got (each with a slot ref) or a -error if we couldn't get the first one.
+ *
+ * Pages already in the cache come in batches from pm_load_pages_nowait().  For
+ * a miss, we pm_load_page() it; FSs that read in bulk (e.g. readahead) will
+ * fill the pages after it too, which the next batch picks up. */
+ssize_t pm_load_pages(struct page_map *pm, unsigned long index, size_t nr,
+                      struct page **pps)
+{
+	size_t nr_got = 0, nr_batch;
+	int error;
+
+	while (nr_got < nr) {
+		nr_batch = pm_load_pages_nowait(pm, index + nr_got, nr - nr_got,
+		                                pps + nr_got);
+		for (size_t i = nr_got; i < nr_got + nr_batch; i++)
+			pm_check_readahead(pm, pps[i]);
+		nr_got += nr_batch;
+		if (nr_got == nr)
+			break;
+		error = pm_load_page(pm, index + nr_got, &pps[nr_got]);
+		if (error)
+			return nr_got ? nr_got : error;
+		nr_got++;
+	}
+	return nr_got;
+}
+
 static bool vmr_has_page_idx(struct vm_region *vmr, unsigned long pg_idx)
 {
 	unsigned long nr_pgs = (vmr->vm_end - vmr->vm_base) >> PGSHIFT;
@@ -343,11 +576,18 @@ static bool __remove_or_zero_cb(void **slot, unsigned long tree_idx, void *arg)
 		memset(page2kva(page), 0, PGSIZE);
 		return false;
 	}
+	/* Ext refs can only come from slot refs or other ext refs, so once we
+	 * yanked the page, this check is stable.  Put it back, just like the VMR
+	 * case in __flush_unused_cb. */
+	if (pm_page_has_ext_refs(page)) {
+		WRITE_ONCE(*slot, old_slot_val);
+		memset(page2kva(page), 0, PGSIZE);
+		return false;
+	}
 	/* We yanked the page out.  The radix tree still has an item until we return
 	 * true, but this is fine.  Future lock-free lookups will now fail (since
 	 * the page is 0), and insertions will block on the write lock. */
-	atomic_set(&page->pg_flags, 0);	/* cause/catch bugs */
-	page_decref(page);
+	pm_free_page(page);
 	return true;
 }
 
@@ -421,31 +661,59 @@ static void shootdown_vmrs(struct page_map *pm)
 	spin_unlock(&pm->pm_lock);
 }
 
-/* Send any queued WBs that haven't been sent yet. */
-static void flush_queued_writebacks(struct page_map *pm)
+/* A run of contiguous dirty pages, collected during the radix walk.  The walk
+ * is in index order, so anything that doesn't extend the run ends it. */
+struct pm_wb_batch {
+	struct page_map				*pm;
+	struct page					*pgs[PM_WB_BATCH_PAGES];
+	size_t						nr;
+};
+
+/* Send any queued WBs that haven't been sent yet.  If the writeback fails, we
+ * redirty the pages, so a later writeback can try again. */
+static void flush_queued_writebacks(struct pm_wb_batch *wb)
 {
-	/* TODO (WB) */
+	struct page_map *pm = wb->pm;
+	int ret;
+
+	if (!wb->nr)
+		return;
+	if (pm->pm_op->writepages) {
+		ret = pm->pm_op->writepages(pm, wb->pgs, wb->nr);
+		if (ret) {
+			for (int i = 0; i < wb->nr; i++)
+				atomic_or(&wb->pgs[i]->pg_flags, PG_DIRTY);
+		}
+	} else {
+		for (int i = 0; i < wb->nr; i++) {
+			if (pm->pm_op->writepage(pm, wb->pgs[i]))
+				atomic_or(&wb->pgs[i]->pg_flags, PG_DIRTY);
+		}
+	}
+	wb->nr = 0;
 }
 
-/* Batches up pages to be written back, preferably as one big op.  If we have a
- * bunch outstanding, we'll send them. */
-static void queue_writeback(struct page_map *pm, struct page *page)
+/* Batches up pages to be written back, preferably as one big op.  If the page
+ * doesn't extend the current run or the batch is full, we send what we have.
+ * We hold the PM qlock, so the pages can't be removed before we flush. */
+static void queue_writeback(struct pm_wb_batch *wb, struct page *page)
 {
-	/* TODO (WB): add a bulk op (instead of only writepage()), collect extents,
-	 * and send them to the device.  Probably do something similar for reads. */
-	pm->pm_op->writepage(pm, page);
+	if (wb->nr && (wb->nr == PM_WB_BATCH_PAGES ||
+	               wb->pgs[wb->nr - 1]->pg_index + 1 != page->pg_index))
+		flush_queued_writebacks(wb);
+	wb->pgs[wb->nr++] = page;
 }
 
 static bool __writeback_cb(void **slot, unsigned long tree_idx, void *arg)
 {
-	struct page_map *pm = arg;
+	struct pm_wb_batch *wb = arg;
 	struct page *page = pm_slot_get_page(*slot);
 
 	/* We're qlocked, so all items should have pages. */
 	assert(page);
 	if (atomic_read(&page->pg_flags) & PG_DIRTY) {
 		atomic_and(&page->pg_flags, ~PG_DIRTY);
-		queue_writeback(pm, page);
+		queue_writeback(wb, page);
 	}
 	return false;
 }
@@ -454,22 +722,46 @@ static bool __writeback_cb(void **slot, unsigned long tree_idx, void *arg)
  * not.  All the dirty bits get cleared too, before writing back. */
 void pm_writeback_pages(struct page_map *pm)
 {
+	struct pm_wb_batch wb = {.pm = pm, .nr = 0};
+
 	qlock(&pm->pm_qlock);
 	mark_and_clear_dirty_ptes(pm);
 	shootdown_vmrs(pm);
-	radix_for_each_slot(&pm->pm_tree, __writeback_cb, pm);
-	flush_queued_writebacks(pm);
+	radix_for_each_slot(&pm->pm_tree, __writeback_cb, &wb);
+	flush_queued_writebacks(&wb);
 	qunlock(&pm->pm_qlock);
 }
 
+/* Control for __flush_unused_cb.  Eviction scans are on a budget, and give
+ * referenced pages a second chance. */
+struct pm_flush_ctl {
+	struct page_map				*pm;
+	bool						evict;
+	size_t						budget;		/* pages to look at */
+	size_t						nr_freed;
+	unsigned long				next_idx;	/* where the next scan resumes */
+};
+
 static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
 {
-	struct page_map *pm = arg;
+	struct pm_flush_ctl *ctl = arg;
+	struct page_map *pm = ctl->pm;
 	struct page *page = pm_slot_get_page(*slot);
 	void *old_slot_val, *slot_val;
+	int ret;
 
 	/* We're qlocked, so all items should have pages. */
 	assert(page);
+	if (ctl->evict) {
+		if (!ctl->budget)
+			return false;
+		ctl->budget--;
+		ctl->next_idx = tree_idx + 1;
+		if (atomic_read(&page->pg_flags) & PG_REFERENCED) {
+			atomic_and(&page->pg_flags, ~PG_REFERENCED);
+			return false;
+		}
+	}
 	old_slot_val = ACCESS_ONCE(*slot);
 	slot_val = old_slot_val;
 	/* Under any contention, we just skip it */
@@ -489,7 +781,7 @@ static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
 	 * the VMR; we just know it was possible.  (currently).  Also, we need to do
 	 * this check after removing the page from the PM slot, since the mm
 	 * faulting code (hpf) will attempt a non-blocking PM lookup. */
-	if (pm_has_vmr_with_page(pm, tree_idx)) {
+	if (pm_has_vmr_with_page(pm, tree_idx) || pm_page_has_ext_refs(page)) {
 		slot_val = pm_slot_set_page(slot_val, page);
 		/* No one should be writing to it.  We hold the qlock, and any readers
 		 * should not have increffed while the page was NULL. */
@@ -504,11 +796,21 @@ static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
 		 * which isn't a big deal.  Just do it before freeing and before
 		 * unlocking the PM; we don't want someone to load the page from the
 		 * backing store and get an old value. */
-		pm->pm_op->writepage(pm, page);
+		if (ctl->evict)
+			atomic_or(&page->pg_flags, PG_RECLAIM);
+		ret = pm->pm_op->writepage(pm, page);
+		atomic_and(&page->pg_flags, ~PG_RECLAIM);
+		if (ret) {
+			/* The page is still the only copy of its data.  Put it back, like
+			 * the VMR case, and don't bother with it on the next pass. */
+			atomic_or(&page->pg_flags, PG_REFERENCED);
+			WRITE_ONCE(*slot, old_slot_val);
+			return false;
+		}
 	}
 	/* All clear - the page is unused and (now) clean. */
-	atomic_set(&page->pg_flags, 0);	/* catch bugs */
-	page_decref(page);
+	pm_free_page(page);
+	ctl->nr_freed++;
 	return true;
 }
 
@@ -519,9 +821,39 @@ static bool __flush_unused_cb(void **slot, unsigned long tree_idx, void *arg)
  * shootdowns or anything.  At least for now. */
 void pm_free_unused_pages(struct page_map *pm)
 {
+	struct pm_flush_ctl ctl = {.pm = pm, .evict = false};
+
+	qlock(&pm->pm_qlock);
+	radix_for_each_slot(&pm->pm_tree, __flush_unused_cb, &ctl);
+	qunlock(&pm->pm_qlock);
+}
+
+/* For memory pressure: looks at up to nr of the PM's pages and frees the unused
+ * ones that haven't been touched since the last time we looked, returning how
+ * many we freed.  Dirty pages get written back first, with PG_RECLAIM set, so
+ * the FS can tell eviction from a sync.  If writepage fails, the page stays.
+ *
+ * Like pm_free_unused_pages(), this skips anything mapped in a VMR.
+ *
+ * Each call picks up where the last one ran out of budget, wrapping around at
+ * the end of the file, so that repeated small passes sweep the whole PM like a
+ * clock hand instead of hammering the first nr pages. */
+size_t pm_evict_cold_pages(struct page_map *pm, size_t nr)
+{
+	struct pm_flush_ctl ctl = {.pm = pm, .evict = true, .budget = nr};
+	unsigned long start;
+
 	qlock(&pm->pm_qlock);
-	radix_for_each_slot(&pm->pm_tree, __flush_unused_cb, pm);
+	start = pm->pm_evict_idx;
+	radix_for_each_slot_in_range(&pm->pm_tree, start, ULONG_MAX,
+	                             __flush_unused_cb, &ctl);
+	if (ctl.budget && start)
+		radix_for_each_slot_in_range(&pm->pm_tree, 0, start,
+		                             __flush_unused_cb, &ctl);
+	/* Leftover budget means we looked at everything; start over next time. */
+	pm->pm_evict_idx = ctl.budget ? 0 : ctl.next_idx;
 	qunlock(&pm->pm_qlock);
+	return ctl.nr_freed;
 }
 
 static bool __destroy_cb(void **slot, unsigned long tree_idx, void *arg)
@@ -530,8 +862,8 @@ static bool __destroy_cb(void **slot, unsigned long tree_idx, void *arg)
 
 	/* Should be no users or need to sync */
 	assert(pm_slot_check_refcnt(*slot) == 0);
-	atomic_set(&page->pg_flags, 0);	/* catch bugs */
-	page_decref(page);
+	/* Blocks could still point at the page.  The last of them frees it. */
+	pm_put_page_ext(page);
 	return true;
 }
 
@@ -259,6 +259,10 @@ page_t *page_lookup(pgdir_t pgdir, void *va, pte_t *pte_store)
 		return 0;
 	if (pte_store)
 		*pte_store = pte;
+	/* User jumbos are PTSIZE; give them the page within the jumbo */
+	if (pte_is_jumbo(pte))
+		return pa2page(pte_get_paddr(pte) +
+		               ROUNDDOWN((uintptr_t)va % PTSIZE, PGSIZE));
 	return pa2page(pte_get_paddr(pte));
 }
 
@@ -10,9 +10,202 @@
 #include <smp.h>
 #include <kprof.h>
 #include <init.h>
+#include <percpu.h>
+#include <kthread.h>
 
 spinlock_t output_lock = SPINLOCK_INITIALIZER_IRQSAVE;
 
+/* when tracing, we short-circuit the main lock call, so as not to clobber the
+ * results as we print. */
+static void output_lock_acquire(int8_t *irq_state)
+{
+	#ifdef CONFIG_TRACE_LOCKS
+	disable_irqsave(irq_state);
+	__spin_lock(&output_lock);
+	#else
+	spin_lock_irqsave(&output_lock);
+	#endif
+}
+
+static void output_lock_release(int8_t *irq_state)
+{
+	#ifdef CONFIG_TRACE_LOCKS
+	__spin_unlock(&output_lock);
+	enable_irqsave(irq_state);
+	#else
+	spin_unlock_irqsave(&output_lock);
+	#endif
+}
+
+#ifdef CONFIG_PRINTK_BUFFERED
+
+/* Per-core printk rings.  A printk formats into its core's ring, with IRQs
+ * disabled, and the printk_drain ktask writes the rings out to the console.
+ * That way, cores don't wait on each other (or the serial port) to printk.
+ * Each ring has one producer, its core, and the consumers sync with the
+ * output_lock.
+ *
+ * Nothing gets dropped: a core that fills its ring drains it itself, the slow
+ * way.  Anything that can't trust the ktask to run prints synchronously:
+ * booting, printks from a fault handler, and panics (printk_emergency()). */
+#define PRINTK_RING_SZ			(16 * 1024)	/* power of two */
+#define PRINTK_RING_MASK		(PRINTK_RING_SZ - 1)
+#define PRINTK_DRAIN_USEC		5000
+
+struct printk_ring {
+	uint32_t					prod;	/* published, read by drainers */
+	uint32_t					wpos;	/* producer's working position */
+	uint32_t					cons;
+	char						buf[PRINTK_RING_SZ];
+};
+
+static DEFINE_PERCPU(struct printk_ring, printk_rings);
+static bool printk_async;
+static bool printk_sync_forever;
+
+/* Caller holds the output_lock. */
+static void __printk_ring_drain(struct printk_ring *r)
+{
+	uint32_t prod, cons, idx, len;
+
+	cons = r->cons;
+	prod = READ_ONCE(r->prod);
+	rmb();	/* read prod before the data, pairs with the producer's wmb */
+	while (cons != prod) {
+		idx = cons & PRINTK_RING_MASK;
+		len = MIN(prod - cons, PRINTK_RING_SZ - idx);
+		cputbuf(&r->buf[idx], len);
+		cons += len;
+	}
+	mb();	/* done reading the data before the producer can reuse it */
+	WRITE_ONCE(r->cons, cons);
+}
+
+static void printk_ring_drain(struct printk_ring *r)
+{
+	int8_t irq_state = 0;
+
+	output_lock_acquire(&irq_state);
+	__printk_ring_drain(r);
+	output_lock_release(&irq_state);
+}
+
+struct printk_ring_put {
+	struct printk_ring			*r;
+	int							cnt;
+};
+
+static void printk_ring_putch(int ch, struct printk_ring_put **rpp)
+{
+	struct printk_ring_put *rp = *rpp;
+	struct printk_ring *r = rp->r;
+
+	if (r->wpos - READ_ONCE(r->cons) == PRINTK_RING_SZ) {
+		/* Full: flush what we have, including this message so far */
+		wmb();
+		WRITE_ONCE(r->prod, r->wpos);
+		printk_ring_drain(r);
+	}
+	r->buf[r->wpos++ & PRINTK_RING_MASK] = ch;
+	rp->cnt++;
+}
+
+static int vcprintf_buffered(const char *fmt, va_list ap)
+{
+	struct printk_ring_put rp, *rpp = &rp;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	rp.r = PERCPU_VARPTR(printk_rings);
+	rp.cnt = 0;
+	vprintfmt((void*)printk_ring_putch, (void*)&rpp, fmt, ap);
+	wmb();	/* write the data before publishing it */
+	WRITE_ONCE(rp.r->prod, rp.r->wpos);
+	enable_irqsave(&irq_state);
+	return rp.cnt;
+}
+
+static bool printk_can_buffer(struct per_cpu_info *pcpui)
+{
+	return printk_async && !booting && !printk_sync_forever &&
+	       !ktrap_depth(pcpui);
+}
+
+/* Writes out everything that's been printk'd so far, e.g. before waiting on
+ * console input. */
+void printk_flush(void)
+{
+	int8_t irq_state = 0;
+
+	output_lock_acquire(&irq_state);
+	for (int i = 0; i < num_cores; i++)
+		__printk_ring_drain(_PERCPU_VARPTR(printk_rings, i));
+	output_lock_release(&irq_state);
+}
+
+/* From here on, printks are synchronous.  We try to get out what is buffered
+ * first, but if someone has the output lock (maybe we panicked while printing),
+ * it's not worth the deadlock. */
+void printk_emergency(void)
+{
+	int8_t irq_state = 0;
+
+	printk_sync_forever = TRUE;
+	disable_irqsave(&irq_state);
+	if (spin_trylock(&output_lock)) {
+		for (int i = 0; i < num_cores; i++)
+			__printk_ring_drain(_PERCPU_VARPTR(printk_rings, i));
+		spin_unlock(&output_lock);
+	}
+	enable_irqsave(&irq_state);
+}
+
+static void printk_drain_ktask(void *arg)
+{
+	struct printk_ring *r;
+
+	while (1) {
+		for (int i = 0; i < num_cores; i++) {
+			r = _PERCPU_VARPTR(printk_rings, i);
+			if (READ_ONCE(r->prod) != READ_ONCE(r->cons))
+				printk_ring_drain(r);
+		}
+		kthread_usleep(PRINTK_DRAIN_USEC);
+	}
+}
+
+void printk_drain_init(void)
+{
+	ktask("printk_drain", printk_drain_ktask, NULL);
+	printk_async = TRUE;
+}
+
+#else
+
+static int vcprintf_buffered(const char *fmt, va_list ap)
+{
+	panic("printk isn't buffered");
+}
+
+static bool printk_can_buffer(struct per_cpu_info *pcpui)
+{
+	return FALSE;
+}
+
+void printk_flush(void)
+{
+}
+
+void printk_emergency(void)
+{
+}
+
+void printk_drain_init(void)
+{
+}
+
+#endif /* CONFIG_PRINTK_BUFFERED */
+
 void putch(int ch, int **cnt)
 {
 	cputchar(ch);
@@ -61,17 +254,11 @@ int vcprintf(const char *fmt, va_list ap)
 		pcpui = &per_cpu_info[0];
 	else
 		pcpui = &per_cpu_info[core_id()];
-	/* lock all output.  this will catch any printfs at line granularity.  when
-	 * tracing, we short-circuit the main lock call, so as not to clobber the
-	 * results as we print. */
-	if (!ktrap_depth(pcpui)) {
-		#ifdef CONFIG_TRACE_LOCKS
-		disable_irqsave(&irq_state);
-		__spin_lock(&output_lock);
-		#else
-		spin_lock_irqsave(&output_lock);
-		#endif
-	}
+	if (printk_can_buffer(pcpui))
+		return vcprintf_buffered(fmt, ap);
+	/* lock all output.  this will catch any printfs at line granularity. */
+	if (!ktrap_depth(pcpui))
+		output_lock_acquire(&irq_state);
 
 	// do the buffered printf
 	vprintfmt((void*)buffered_putch, (void*)&cntp, fmt, ap);
@@ -79,14 +266,8 @@ int vcprintf(const char *fmt, va_list ap)
 	// write out remaining chars in the buffer
 	buffered_putch(-1,&cntp);
 
-	if (!ktrap_depth(pcpui)) {
-		#ifdef CONFIG_TRACE_LOCKS
-		__spin_unlock(&output_lock);
-		enable_irqsave(&irq_state);
-		#else
-		spin_unlock_irqsave(&output_lock);
-		#endif
-	}
+	if (!ktrap_depth(pcpui))
+		output_lock_release(&irq_state);
 
 	return cnt;
 }
@@ -16,7 +16,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <time.h>
-#include <hashtable.h>
+#include <rhashtable.h>
 #include <slab.h>
 #include <sys/queue.h>
 #include <monitor.h>
@@ -26,6 +26,8 @@
 #include <ros/procinfo.h>
 #include <init.h>
 #include <rcu.h>
+#include <sysc_ring.h>
+#include <latency.h>
 
 struct kmem_cache *proc_cache;
 
@@ -36,47 +38,128 @@ static uint32_t try_get_pcoreid(struct proc *p, uint32_t vcoreid);
 static uint32_t get_pcoreid(struct proc *p, uint32_t vcoreid);
 static void __proc_free(struct kref *kref);
 static bool scp_is_vcctx_ready(struct preempt_data *vcpd);
-static void save_vc_fp_state(struct preempt_data *vcpd);
-static void restore_vc_fp_state(struct preempt_data *vcpd);
+static void save_vc_fp_state(struct proc *p, uint32_t vcoreid);
+static void restore_vc_fp_state(struct proc *p, uint32_t vcoreid);
 
 /* PID management. */
 #define PID_MAX 32767 // goes from 0 to 32767, with 0 reserved
 static DECL_BITMASK(pid_bmask, PID_MAX + 1);
 spinlock_t pid_bmask_lock = SPINLOCK_INITIALIZER;
-struct hashtable *pid_hash;
-spinlock_t pid_hash_lock; // initialized in proc_init
+struct rhashtable pid_hash;
 
-/* Finds the next free entry (zero) entry in the pid_bitmask.  Set means busy.
- * PID 0 is reserved (in proc_init).  A return value of 0 is a failure (and
- * you'll also see a warning, for now).  Consider doing this with atomics. */
-static pid_t get_free_pid(void)
+static uint32_t pid_hash_key(const void *key)
 {
-	static pid_t next_free_pid = 1;
-	pid_t my_pid = 0;
+	return *(const pid_t*)key;
+}
+
+static uint32_t pid_hash_obj(const void *obj)
+{
+	return ((const struct proc*)obj)->pid;
+}
+
+static bool pid_key_eq(const void *key, const void *obj)
+{
+	return *(const pid_t*)key == ((const struct proc*)obj)->pid;
+}
+
+static const struct rhashtable_params pid_hash_params = {
+	.node_offset = offsetof(struct proc, pid_link),
+	.hash_key = pid_hash_key,
+	.hash_obj = pid_hash_obj,
+	.key_eq = pid_key_eq,
+	.min_bits = 7,
+};
+
+/* Each core grabs PIDs from the bitmask a batch at a time, and gives them back a
+ * batch at a time, so that creating and destroying processes only takes the
+ * bitmask lock once per batch.  Freed PIDs go back to the bitmask, not to the
+ * core's allocation batch: PIDs still go around the whole PID space before
+ * being reused, like they did before the caches.
+ *
+ * The caches are touched with irqs disabled, since __proc_free() can run from
+ * a kref_put() in IRQ context. */
+#define PID_CACHE_SZ 16
+
+struct pid_cache {
+	pid_t alloc[PID_CACHE_SZ];
+	unsigned int alloc_idx;
+	unsigned int nr_alloc;
+	pid_t freed[PID_CACHE_SZ];
+	unsigned int nr_freed;
+};
 
-	spin_lock(&pid_bmask_lock);
-	// atomically (can lock for now, then change to atomic_and_return
-	FOR_CIRC_BUFFER(next_free_pid, PID_MAX + 1, i) {
-		// always points to the next to test
-		next_free_pid = (next_free_pid + 1) % (PID_MAX + 1);
+static DEFINE_PERCPU(struct pid_cache, pid_caches);
+
+/* Finds up to 'want' free entries (zero) in the pid_bitmask, in order, and
+ * marks them busy.  Set means busy.  PID 0 is reserved (in proc_init).  Hold
+ * the pid_bmask_lock. */
+static unsigned int __grab_free_pids(pid_t *pids, unsigned int want)
+{
+	static pid_t next_free_pid = 1;
+	pid_t i = next_free_pid;
+	unsigned int nr = 0;
+
+	for (int left = PID_MAX + 1; left > 0 && nr < want; ) {
+		/* Skip full bytes.  PID_MAX + 1 is a multiple of 8. */
+		if (i % 8 == 0 && pid_bmask[i / 8] == 0xff) {
+			i = (i + 8) % (PID_MAX + 1);
+			left -= 8;
+			continue;
+		}
 		if (!GET_BITMASK_BIT(pid_bmask, i)) {
 			SET_BITMASK_BIT(pid_bmask, i);
-			my_pid = i;
-			break;
+			pids[nr++] = i;
 		}
+		i = (i + 1) % (PID_MAX + 1);
+		left--;
+	}
+	next_free_pid = i;
+	return nr;
+}
+
+/* Returns a free PID from this core's cache, refilling it if needed.  A return
+ * value of 0 is a failure (and you'll also see a warning, for now).  We can
+ * fail while other cores have PIDs cached, but only when we're within a few
+ * batches of running out anyway. */
+static pid_t get_free_pid(void)
+{
+	struct pid_cache *pc;
+	int8_t irq_state = 0;
+	pid_t my_pid = 0;
+
+	disable_irqsave(&irq_state);
+	pc = PERCPU_VARPTR(pid_caches);
+	if (pc->alloc_idx == pc->nr_alloc) {
+		spin_lock(&pid_bmask_lock);
+		pc->nr_alloc = __grab_free_pids(pc->alloc, PID_CACHE_SZ);
+		spin_unlock(&pid_bmask_lock);
+		pc->alloc_idx = 0;
 	}
-	spin_unlock(&pid_bmask_lock);
+	if (pc->alloc_idx < pc->nr_alloc)
+		my_pid = pc->alloc[pc->alloc_idx++];
+	enable_irqsave(&irq_state);
 	if (!my_pid)
 		warn("Shazbot!  Unable to find a PID!  You need to deal with this!\n");
 	return my_pid;
 }
 
-/* Return a pid to the pid bitmask */
+/* Return a pid to the pid bitmask, eventually. */
 static void put_free_pid(pid_t pid)
 {
-	spin_lock(&pid_bmask_lock);
-	CLR_BITMASK_BIT(pid_bmask, pid);
-	spin_unlock(&pid_bmask_lock);
+	struct pid_cache *pc;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	pc = PERCPU_VARPTR(pid_caches);
+	pc->freed[pc->nr_freed++] = pid;
+	if (pc->nr_freed == PID_CACHE_SZ) {
+		spin_lock(&pid_bmask_lock);
+		for (int i = 0; i < PID_CACHE_SZ; i++)
+			CLR_BITMASK_BIT(pid_bmask, pc->freed[i]);
+		spin_unlock(&pid_bmask_lock);
+		pc->nr_freed = 0;
+	}
+	enable_irqsave(&irq_state);
 }
 
 /* 'resume' is the time int ticks of the most recent onlining.  'total' is the
@@ -105,6 +188,31 @@ uint64_t vcore_account_gettotal(struct proc *p, uint32_t vcoreid)
 	return vc->total_ticks;
 }
 
+/* Counts a kmsg against whatever vcore is on the calling pcore.  The owning
+ * proc can't go away under us, since only this core clears it. */
+void vcore_account_kmsg(void)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	struct proc *p = pcpui->owning_proc;
+
+	if (p)
+		p->vcore_stats[pcpui->owning_vcoreid].nr_kmsgs++;
+}
+
+/* Fills in vs with a (racy) snapshot of vcoreid's stats, including the time
+ * it's been online so far, if it is online now. */
+void vcore_get_stats(struct proc *p, uint32_t vcoreid, struct vcore_stats *vs)
+{
+	struct vcore *vc = &p->procinfo->vcoremap[vcoreid];
+	uint64_t ticks = vc->total_ticks;
+
+	*vs = p->vcore_stats[vcoreid];
+	if (vc->valid)
+		ticks += read_tsc() - vc->resume_ticks;
+	vs->online_ns = tsc2nsec(ticks);
+	vs->nr_preempts = vc->nr_preempts_done;
+}
+
 /* While this could be done with just an assignment, this gives us the
  * opportunity to check for bad transitions.  Might compile these out later, so
  * we shouldn't rely on them for sanity checking from userspace.  */
@@ -178,63 +286,103 @@ int __proc_set_state(struct proc *p, uint32_t state)
 
 /* Returns a pointer to the proc with the given pid, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0).  The
+ * lookup is lockless: procs are freed after an RCU grace period, so p's kref is
+ * still there while we're in the read section, even if p is being freed. */
 struct proc *pid2proc(pid_t pid)
 {
-	spin_lock(&pid_hash_lock);
-	struct proc *p = hashtable_search(pid_hash, (void*)(long)pid);
+	struct proc *p;
+
+	rcu_read_lock();
+	p = rhashtable_lookup(&pid_hash, &pid);
 	if (p)
 		if (!kref_get_not_zero(&p->p_kref, 1))
 			p = 0;
-	spin_unlock(&pid_hash_lock);
+	rcu_read_unlock();
 	return p;
 }
 
+struct pid_nth_walk {
+	unsigned int n;
+	struct proc *p;
+};
+
+static void pid_nth_cb(void *item, void *opaque)
+{
+	struct proc *p = item;
+	struct pid_nth_walk *w = opaque;
+
+	if (w->p)
+		return;
+	/* if this process is not valid, it doesn't count, so continue */
+	if (!kref_get_not_zero(&p->p_kref, 1))
+		return;
+	/* this one counts */
+	if (!w->n) {
+		printd("pid_nth: at end, p %p\n", p);
+		w->p = p;
+		return;
+	}
+	kref_put(&p->p_kref);
+	w->n--;
+}
+
 /* Used by devproc for successive reads of the proc table.
  * Returns a pointer to the nth proc, or 0 if there is none.
  * This uses get_not_zero, since it is possible the refcnt is 0, which means the
- * process is dying and we should not have the ref (and thus return 0).  We need
- * to lock to protect us from getting p, (someone else removes and frees p),
- * then get_not_zero() on p.
- * Don't push the locking into the hashtable without dealing with this. */
+ * process is dying and we should not have the ref (and thus return 0). */
 struct proc *pid_nth(unsigned int n)
 {
-	struct proc *p;
-	spin_lock(&pid_hash_lock);
-	if (!hashtable_count(pid_hash)) {
-		spin_unlock(&pid_hash_lock);
-		return NULL;
-	}
-	struct hashtable_itr *iter = hashtable_iterator(pid_hash);
-	p = hashtable_iterator_value(iter);
-
-	while (p) {
-		/* if this process is not valid, it doesn't count,
-		 * so continue
-		 */
-
-		if (kref_get_not_zero(&p->p_kref, 1)) {
-			/* this one counts */
-			if (! n){
-				printd("pid_nth: at end, p %p\n", p);
-				break;
-			}
-			kref_put(&p->p_kref);
-			n--;
-		}
-		if (!hashtable_iterator_advance(iter)) {
-			p = NULL;
-			break;
-		}
-		p = hashtable_iterator_value(iter);
+	struct pid_nth_walk w = {.n = n, .p = NULL};
+
+	rhashtable_for_each(&pid_hash, pid_nth_cb, &w);
+	return w.p;
+}
+
+struct proc_snapshot_walk {
+	struct proc_snapshot *ps;
+	size_t nr;
+	size_t max;
+};
+
+static void proc_snapshot_cb(void *item, void *opaque)
+{
+	struct proc *p = item;
+	struct proc_snapshot_walk *w = opaque;
+	struct proc_snapshot *ps;
+	struct vcore *vc;
+	uint64_t ticks = 0, now = read_tsc();
+
+	if (w->nr == w->max)
+		return;
+	/* No ref: p can't be freed while we hold its bucket lock, even if it is
+	 * dying.  Dying procs are still processes, as far as a monitor cares. */
+	ps = &w->ps[w->nr++];
+	ps->pid = p->pid;
+	ps->ppid = p->ppid;
+	ps->state = READ_ONCE(p->state);
+	ps->num_vcores = READ_ONCE(p->procinfo->num_vcores);
+	for (int i = 0; i < p->procinfo->max_vcores; i++) {
+		vc = &p->procinfo->vcoremap[i];
+		ticks += vc->total_ticks;
+		if (vc->valid)
+			ticks += now - vc->resume_ticks;
 	}
+	ps->cpu_ns = tsc2nsec(ticks);
+	ps->vm_bytes = READ_ONCE(p->vm_bytes);
+	strlcpy(ps->progname, p->progname, sizeof(ps->progname));
+}
 
-	spin_unlock(&pid_hash_lock);
-	kfree(iter);
-	return p;
+/* Fills in up to max snapshots, one per process, in one pass over the
+ * pid_hash.  Returns how many we filled in.  Processes that come or go during
+ * the walk may or may not show up.  Like the other hash walks, this can't
+ * block, and the stats are racy. */
+size_t proc_get_snapshots(struct proc_snapshot *ps, size_t max)
+{
+	struct proc_snapshot_walk w = {.ps = ps, .nr = 0, .max = max};
+
+	rhashtable_for_each(&pid_hash, proc_snapshot_cb, &w);
+	return w.nr;
 }
 
 /* Performs any initialization related to processes, such as create the proc
@@ -250,10 +398,7 @@ void proc_init(void)
 				       0, NULL);
 	/* Init PID mask and hash.  pid 0 is reserved. */
 	SET_BITMASK_BIT(pid_bmask, 0);
-	spinlock_init(&pid_hash_lock);
-	spin_lock(&pid_hash_lock);
-	pid_hash = create_hashtable(100, __generic_hash, __generic_eq);
-	spin_unlock(&pid_hash_lock);
+	rhashtable_init(&pid_hash, &pid_hash_params);
 	schedule_init();
 
 	atomic_init(&num_envs, 0);
@@ -316,6 +461,7 @@ void proc_init_procinfo(struct proc* p)
 	p->procinfo->num_vcores = 0;
 	p->procinfo->is_mcp = FALSE;
 	p->procinfo->coremap_seqctr = SEQCTR_INITIALIZER;
+	urandom_read(p->procinfo->rand_seed, sizeof(p->procinfo->rand_seed));
 	/* It's a bug in the kernel if we let them ask for more than max */
 	for (int i = 0; i < p->procinfo->max_vcores; i++) {
 		TAILQ_INSERT_TAIL(&p->inactive_vcs, &p->procinfo->vcoremap[i], list);
@@ -328,6 +474,7 @@ void proc_init_procdata(struct proc *p)
 	/* processes can't go into vc context on vc 0 til they unset this.  This is
 	 * for processes that block before initing uthread code (like rtld). */
 	atomic_set(&p->procdata->vcore_preempt_data[0].flags, VC_SCP_NOVCCTX);
+	sysc_ring_init(p);
 }
 
 static void proc_open_stdfds(struct proc *p)
@@ -400,10 +547,18 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	cv_init(&p->child_wait);
 	p->state = PROC_CREATED; /* shouldn't go through state machine for init */
 	p->env_flags = 0;
-	spinlock_init(&p->vmr_lock);
+	spin_rwlock_init(&p->vmr_lock);
 	spinlock_init(&p->pte_lock);
 	TAILQ_INIT(&p->vm_regions); /* could init this in the slab */
+	p->vm_tree = RB_ROOT;
 	p->vmr_history = 0;
+	p->jumbo_policy = parent ? parent->jumbo_policy : MM_JUMBO_MADVISE;
+	p->fault_around = parent ? parent->fault_around : MM_FAULT_AROUND_DEFAULT;
+	if (parent)
+		p->mpol = parent->mpol;
+	else
+		mpol_set(&p->mpol, MPOL_DEFAULT, 0);
+	p->mpol_ilv_next = 0;
 	/* Initialize the vcore lists, we'll build the inactive list so that it
 	 * includes all vcores when we initialize procinfo.  Do this before initing
 	 * procinfo. */
@@ -413,6 +568,8 @@ error_t proc_alloc(struct proc **pp, struct proc *parent, int flags)
 	/* Init procinfo/procdata.  Procinfo's argp/argb are 0'd */
 	proc_init_procinfo(p);
 	proc_init_procdata(p);
+	p->vcore_stats = kzmalloc(sizeof(struct vcore_stats) *
+	                          p->procinfo->max_vcores, MEM_WAIT);
 
 	/* Initialize the generic sysevent ring buffer */
 	SHARED_RING_INIT(&p->procdata->syseventring);
@@ -462,9 +619,7 @@ void __proc_ready(struct proc *p)
 	/* Tell the ksched about us.  TODO: do we need to worry about the ksched
 	 * doing stuff to us before we're added to the pid_hash? */
 	__sched_proc_register(p);
-	spin_lock(&pid_hash_lock);
-	hashtable_insert(pid_hash, (void*)(long)p->pid, p);
-	spin_unlock(&pid_hash_lock);
+	rhashtable_insert(&pid_hash, p);
 }
 
 /* Creates a process from the specified file, argvs, and envps. */
@@ -492,10 +647,14 @@ static int __cb_assert_no_pg(struct proc *p, pte_t pte, void *va, void *arg)
 /* This is called by kref_put(), once the last reference to the process is
  * gone.  Don't call this otherwise (it will panic).  It will clean up the
  * address space and deallocate any other used memory. */
+static void __proc_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(proc_cache, container_of(head, struct proc, rcu));
+}
+
 static void __proc_free(struct kref *kref)
 {
 	struct proc *p = container_of(kref, struct proc, p_kref);
-	void *hash_ret;
 	physaddr_t pa;
 
 	printd("[PID %d] freeing proc: %d\n", current ? current->pid : 0, p->pid);
@@ -516,11 +675,8 @@ static void __proc_free(struct kref *kref)
 	/* now we'll finally decref files for the file-backed vmrs */
 	unmap_and_destroy_vmrs(p);
 	/* Remove us from the pid_hash and give our PID back (in that order). */
-	spin_lock(&pid_hash_lock);
-	hash_ret = hashtable_remove(pid_hash, (void*)(long)p->pid);
-	spin_unlock(&pid_hash_lock);
 	/* might not be in the hash/ready, if we failed during proc creation */
-	if (hash_ret)
+	if (rhashtable_remove(&pid_hash, p))
 		put_free_pid(p->pid);
 	else
 		printd("[kernel] pid %d not in the PID hash in %s\n", p->pid,
@@ -537,11 +693,15 @@ static void __proc_free(struct kref *kref)
 	env_pagetable_free(p);
 	arch_pgdir_clear(&p->env_pgdir);
 	p->env_cr3 = 0;
+	/* The ksched can still be tracking a dying proc's cores until the last
+	 * ref is gone (e.g. __core_request()). */
+	corealloc_proc_free(p);
+	kfree(p->vcore_stats);
 
 	atomic_dec(&num_envs);
 
-	/* Dealloc the struct proc */
-	kmem_cache_free(proc_cache, p);
+	/* Dealloc the struct proc, once pid2proc can't be looking at it */
+	call_rcu(&p->rcu, __proc_free_rcu);
 }
 
 /* Whether or not actor can control target.  TODO: do something reasonable here.
@@ -580,13 +740,16 @@ static void __set_proc_current(struct proc *p)
 	/* If the process wasn't here, then we need to load its address space. */
 	if (p != pcpui->cur_proc) {
 		proc_incref(p, 1);
+		proc_tlb_mark_core(p);
 		lcr3(p->env_cr3);
 		/* This is "leaving the process context" of the previous proc.  The
 		 * previous lcr3 unloaded the previous proc's context.  This should
 		 * rarely happen, since we usually proactively leave process context,
 		 * but this is the fallback. */
-		if (pcpui->cur_proc)
+		if (pcpui->cur_proc) {
+			proc_tlb_unmark_core(pcpui->cur_proc);
 			proc_decref(pcpui->cur_proc);
+		}
 		pcpui->cur_proc = p;
 	}
 }
@@ -608,6 +771,17 @@ static bool scp_is_vcctx_ready(struct preempt_data *vcpd)
  *
  * Since it always returns, it will never "eat" your reference (old
  * documentation talks about this a bit). */
+/* Records how long p waited to run after the ksched heard it woke up. */
+static void __note_proc_wakeup(struct proc *p, int lat_event)
+{
+	uint64_t woke = p->ksched_data.wakeup_tsc;
+
+	if (!woke)
+		return;
+	p->ksched_data.wakeup_tsc = 0;
+	lat_record(lat_event, read_tsc() - woke);
+}
+
 void proc_run_s(struct proc *p)
 {
 	uint32_t coreid = core_id();
@@ -622,6 +796,7 @@ void proc_run_s(struct proc *p)
 			return;
 		case (PROC_RUNNABLE_S):
 			__proc_set_state(p, PROC_RUNNING_S);
+			__note_proc_wakeup(p, LAT_SCP_WAKEUP);
 			/* SCPs don't have full vcores, but they act like they have vcore 0.
 			 * We map the vcore, since we will want to know where this process
 			 * is running, even if it is only in RUNNING_S.  We can use the
@@ -643,7 +818,7 @@ void proc_run_s(struct proc *p)
 			assert(!pcpui->owning_proc);
 			pcpui->owning_proc = p;
 			pcpui->owning_vcoreid = 0;
-			restore_vc_fp_state(vcpd);
+			restore_vc_fp_state(p, 0);
 			/* similar to the old __startcore, start them in vcore context if
 			 * they have notifs and aren't already in vcore context.  o/w, start
 			 * them wherever they were before (could be either vc ctx or not) */
@@ -716,6 +891,7 @@ static void __send_bulkp_events(struct proc *p)
 void __proc_run_m(struct proc *p)
 {
 	struct vcore *vc_i;
+	struct kmsg_batch kb;
 	switch (p->state) {
 		case (PROC_WAITING):
 		case (PROC_DYING):
@@ -729,18 +905,21 @@ void __proc_run_m(struct proc *p)
 			if (p->procinfo->num_vcores) {
 				__send_bulkp_events(p);
 				__proc_set_state(p, PROC_RUNNING_M);
+				__note_proc_wakeup(p, LAT_MCP_WAKEUP);
 				/* Up the refcnt, to avoid the n refcnt upping on the
 				 * destination cores.  Keep in sync with __startcore */
 				proc_incref(p, p->procinfo->num_vcores * 2);
 				/* Send kernel messages to all online vcores (which were added
 				 * to the list and mapped in __proc_give_cores()), making them
 				 * turn online */
+				kmsg_batch_init(&kb);
 				TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-					send_kernel_message(vc_i->pcoreid, __startcore, (long)p,
-					                    (long)vcore2vcoreid(p, vc_i),
-					                    (long)vc_i->nr_preempts_sent,
-					                    KMSG_ROUTINE);
+					kmsg_batch_add(&kb, vc_i->pcoreid, __startcore, (long)p,
+					               (long)vcore2vcoreid(p, vc_i),
+					               (long)vc_i->nr_preempts_sent,
+					               KMSG_ROUTINE);
 				}
+				kmsg_batch_flush(&kb);
 			} else {
 				warn("Tried to proc_run() an _M with no vcores!");
 			}
@@ -984,7 +1163,7 @@ int proc_change_to_m(struct proc *p)
 			/* Copy uthread0's context to VC 0's uthread slot */
 			copy_current_ctx_to(&vcpd->uthread_ctx);
 			clear_owning_proc(core_id());	/* so we don't restart */
-			save_vc_fp_state(vcpd);
+			save_vc_fp_state(p, 0);
 			/* Userspace needs to not fuck with notif_disabled before
 			 * transitioning to _M. */
 			if (vcpd->notif_disabled) {
@@ -1042,7 +1221,7 @@ uint32_t __proc_change_to_s(struct proc *p, uint32_t *pc_arr)
 	assert(current_ctx);
 	copy_current_ctx_to(&p->scp_ctx);
 	clear_owning_proc(core_id());	/* so we don't restart */
-	save_vc_fp_state(vcpd);
+	save_vc_fp_state(p, 0);
 	/* sending death, since it's not our job to save contexts or anything in
 	 * this case. */
 	num_revoked = __proc_take_allcores(p, pc_arr, FALSE);
@@ -1081,7 +1260,13 @@ static uint32_t get_pcoreid(struct proc *p, uint32_t vcoreid)
 	return try_get_pcoreid(p, vcoreid);
 }
 
-/* Saves the FP state of the calling core into VCPD.  Pairs with
+/* Unique per save: the core ID and how many saves that core has done */
+static uint64_t fpu_save_seq(struct per_cpu_info *pcpui)
+{
+	return ((uint64_t)core_id() << 48) | pcpui->nr_fpu_saves;
+}
+
+/* Saves the FP state of the calling core into vcoreid's VCPD.  Pairs with
  * restore_vc_fp_state().  On x86, the best case overhead of the flags:
  *		FNINIT: 36 ns
  *		FXSAVE: 46 ns
@@ -1091,30 +1276,55 @@ static uint32_t get_pcoreid(struct proc *p, uint32_t vcoreid)
  *		Excess flagged FXRSTR: 42 ns
  * If we don't do it, we'll need to initialize every VCPD at process creation
  * time with a good FPU state (x86 control words are initialized as 0s, like the
- * rest of VCPD). */
-static void save_vc_fp_state(struct preempt_data *vcpd)
+ * rest of VCPD).
+ *
+ * The kernel doesn't use the FPU, so until this core loads some other FPU state,
+ * the registers still match what we saved.  If the vcore comes back here first,
+ * restore_vc_fp_state() can skip the restore, which is the expensive half (an
+ * XRSTOR of all of the AVX state).  That's common: SCPs that block and get
+ * restarted, and MCP vcores that yield and come back to an idle core.
+ *
+ * We know it's our save if the vcore's fpu_save_seq (which userspace can't
+ * write) is still the one we gave it.  The seqs are unique per core, so a save
+ * on another core doesn't look like ours.  Note that this means changes
+ * userspace makes to preempt_anc aren't always loaded, but userspace never had
+ * a reason to change it. */
+static void save_vc_fp_state(struct proc *p, uint32_t vcoreid)
 {
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	struct preempt_data *vcpd = &p->procdata->vcore_preempt_data[vcoreid];
+	struct vcore *vc = vcoreid2vcore(p, vcoreid);
+
 	save_fp_state(&vcpd->preempt_anc);
 	vcpd->rflags |= VC_FPU_SAVED;
+	pcpui->fpu_vc = vc;
+	pcpui->nr_fpu_saves++;
+	vc->fpu_save_seq = fpu_save_seq(pcpui);
 }
 
 /* Conditionally restores the FP state from VCPD.  If the state was not valid,
  * we don't bother restoring and just initialize the FPU. */
-static void restore_vc_fp_state(struct preempt_data *vcpd)
+static void restore_vc_fp_state(struct proc *p, uint32_t vcoreid)
 {
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	struct preempt_data *vcpd = &p->procdata->vcore_preempt_data[vcoreid];
+	struct vcore *vc = vcoreid2vcore(p, vcoreid);
+
 	if (vcpd->rflags & VC_FPU_SAVED) {
-		restore_fp_state(&vcpd->preempt_anc);
+		if ((pcpui->fpu_vc != vc) || (vc->fpu_save_seq != fpu_save_seq(pcpui)))
+			restore_fp_state(&vcpd->preempt_anc);
 		vcpd->rflags &= ~VC_FPU_SAVED;
 	} else {
 		init_fp_state();
 	}
+	/* The user will run and change the registers */
+	pcpui->fpu_vc = NULL;
 }
 
 /* Helper for SCPs, saves the core's FPU state into the VCPD vc0 slot */
 void __proc_save_fpu_s(struct proc *p)
 {
-	struct preempt_data *vcpd = &p->procdata->vcore_preempt_data[0];
-	save_vc_fp_state(vcpd);
+	save_vc_fp_state(p, 0);
 }
 
 /* Helper: saves the SCP's GP tf state and unmaps vcore 0.  This does *not* save
@@ -1506,6 +1716,22 @@ bool proc_preempt_core(struct proc *p, uint32_t pcoreid, uint64_t usec)
 	return retval;
 }
 
+/* Warns p that pcoreid will be preempted in usec, unless p yields it first.
+ * Returns FALSE if p isn't running on pcoreid. */
+bool proc_preempt_warn_core(struct proc *p, uint32_t pcoreid, uint64_t usec)
+{
+	uint64_t warn_time = read_tsc() + usec2tsc(usec);
+	bool retval = FALSE;
+
+	spin_lock(&p->proc_lock);
+	if (p->state == PROC_RUNNING_M && is_mapped_vcore(p, pcoreid)) {
+		__proc_preempt_warn(p, get_vcoreid(p, pcoreid), warn_time);
+		retval = TRUE;
+	}
+	spin_unlock(&p->proc_lock);
+	return retval;
+}
+
 /* Warns and preempts all from p.  No delaying / alarming, or anything.  The
  * warning will be for u usec from now. */
 void proc_preempt_all(struct proc *p, uint64_t usec)
@@ -1792,6 +2018,12 @@ uint32_t __proc_take_allcores(struct proc *p, uint32_t *pc_arr, bool preempt)
  * calling. */
 void __map_vcore(struct proc *p, uint32_t vcoreid, uint32_t pcoreid)
 {
+	struct vcore_stats *vs = &p->vcore_stats[vcoreid];
+
+	/* pcoreid is still the old one from the last time it was mapped */
+	if (vs->nr_runs && p->procinfo->vcoremap[vcoreid].pcoreid != pcoreid)
+		vs->nr_migrations++;
+	vs->nr_runs++;
 	p->procinfo->vcoremap[vcoreid].pcoreid = pcoreid;
 	p->procinfo->vcoremap[vcoreid].valid = TRUE;
 	p->procinfo->pcoremap[pcoreid].vcoreid = vcoreid;
@@ -1853,10 +2085,14 @@ uintptr_t switch_to(struct proc *new_p)
 	/* If we aren't the proc already, then switch to it */
 	if (old_proc != new_p) {
 		pcpui->cur_proc = new_p;				/* uncounted ref */
-		if (new_p)
+		if (new_p) {
+			proc_tlb_mark_core(new_p);
 			lcr3(new_p->env_cr3);
-		else
+		} else {
 			lcr3(boot_cr3);
+		}
+		if (old_proc)
+			proc_tlb_unmark_core(old_proc);
 	}
 	ret = (uintptr_t)old_proc;
 	if (is_ktask(kth)) {
@@ -1887,54 +2123,63 @@ void switch_back(struct proc *new_p, uintptr_t old_ret)
 	old_proc = (struct proc*)old_ret;
 	if (old_proc != new_p) {
 		pcpui->cur_proc = old_proc;
-		if (old_proc)
+		if (old_proc) {
+			proc_tlb_mark_core(old_proc);
 			lcr3(old_proc->env_cr3);
-		else
+		} else {
 			lcr3(boot_cr3);
+		}
+		if (new_p)
+			proc_tlb_unmark_core(new_p);
 	}
 }
 
-/* Will send a TLB shootdown message to every vcore in the main address space
- * (aka, all vcores for now).  The message will take the start and end virtual
- * addresses as well, in case we want to be more clever about how much we
- * shootdown and batching our messages.  Should do the sanity about rounding up
- * and down in this function too.
+/* p->tlb_cores tracks every core that might have p's TLB entries: cores that
+ * have p's cr3 loaded.  That includes vcores, kthreads running syscalls for p,
+ * switch_to(), etc.  Mark a core before loading p's cr3, and unmark it after
+ * loading some other cr3 (which flushes p's entries).
  *
- * Would be nice to have a broadcast kmsg at this point.  Note this may send a
- * message to the calling core (interrupting it, possibly while holding the
- * proc_lock).  We don't need to process routine messages since it's an
- * immediate message. */
+ * The ordering is what lets proc_tlbshootdown() skip unmarked cores.  The
+ * shootdown writes its PTEs, then reads tlb_cores.  The mark is a LOCK'd write
+ * before the lcr3 (which serializes), so if the shootdown doesn't see the mark,
+ * the core's page walks will see the new PTEs. */
+void proc_tlb_mark_core(struct proc *p)
+{
+	core_set_setcpu_atomic(&p->tlb_cores, core_id());
+}
+
+void proc_tlb_unmark_core(struct proc *p)
+{
+	core_set_clearcpu_atomic(&p->tlb_cores, core_id());
+}
+
+/* Shoots down the TLB entries for [start, end) of p's address space on every
+ * core that might have them, and only those cores.  end == 0 means flush
+ * everything.  The calling core flushes directly, if necessary.  Everyone else
+ * gets one IMMEDIATE message, so we don't need to process routine messages.
+ *
+ * Callers that change many PTEs should batch their ranges (see tlb_gather in
+ * mm.c) instead of calling this for every little change. */
 void proc_tlbshootdown(struct proc *p, uintptr_t start, uintptr_t end)
 {
-	/* TODO: need a better way to find cores running our address space.  we can
-	 * have kthreads running syscalls, async calls, processes being created. */
-	struct vcore *vc_i;
-	/* TODO: we might be able to avoid locking here in the future (we must hit
-	 * all online, and we can check __mapped).  it'll be complicated. */
-	spin_lock(&p->proc_lock);
-	switch (p->state) {
-		case (PROC_RUNNING_S):
-			tlbflush();
-			break;
-		case (PROC_RUNNING_M):
-			/* TODO: (TLB) sanity checks and rounding on the ranges.
-			 *
-			 * We need to make sure that once a core that was online has been
-			 * removed from the online list, then it must receive a TLB flush
-			 * (abandon_core()) before running the process again.  Either that,
-			 * or make other decisions about who to TLB-shootdown. */
-			TAILQ_FOREACH(vc_i, &p->online_vcs, list) {
-				send_kernel_message(vc_i->pcoreid, __tlbshootdown, start, end,
-				                    0, KMSG_IMMEDIATE);
-			}
-			break;
-		default:
-			/* TODO: til we fix shootdowns, there are some odd cases where we
-			 * have the address space loaded, but the state is in transition. */
-			if (p == current)
-				tlbflush();
+	int coreid = core_id();
+	unsigned long nr_ipis = 0;
+
+	/* Our PTE writes must be visible before we check tlb_cores.  See
+	 * proc_tlb_mark_core(). */
+	mb();
+	for (int i = 0; i < num_cores; i++) {
+		if (!core_set_getcpu(&p->tlb_cores, i))
+			continue;
+		if (i == coreid) {
+			__tlbshootdown(coreid, start, end, 0);
+			continue;
+		}
+		send_kernel_message(i, __tlbshootdown, start, end, 0, KMSG_IMMEDIATE);
+		nr_ipis++;
 	}
-	spin_unlock(&p->proc_lock);
+	p->nr_tlb_shootdowns++;
+	p->nr_tlb_ipis += nr_ipis;
 }
 
 /* Helper, used by __startcore and __set_curctx, which sets up cur_ctx to run a
@@ -1996,7 +2241,7 @@ static void __set_curctx_to_vcoreid(struct proc *p, uint32_t vcoreid,
 	 * Note this can cause a GP fault on x86 if the state is corrupt.  In lieu
 	 * of reading in the huge FP state and mucking with mxcsr_mask, we should
 	 * handle this like a KPF on user code. */
-	restore_vc_fp_state(vcpd);
+	restore_vc_fp_state(p, vcoreid);
 	/* cur_ctx was built above (in actual_ctx), now use it */
 	pcpui->cur_ctx = &pcpui->actual_ctx;
 	/* this cur_ctx will get run when the kernel returns / idles */
@@ -2087,7 +2332,7 @@ int proc_change_to_vcore(struct proc *p, uint32_t new_vcoreid,
 		/* need to set up the calling vcore's ctx so that it'll get restarted by
 		 * __startcore, to make the caller look like it was preempted. */
 		copy_current_ctx_to(&caller_vcpd->vcore_ctx);
-		save_vc_fp_state(caller_vcpd);
+		save_vc_fp_state(p, caller_vcoreid);
 	}
 	/* Mark our core as preempted (for userspace recovery).  Userspace checks
 	 * this in handle_indirs, and it needs to check the mbox regardless of
@@ -2164,6 +2409,7 @@ void __startcore(uint32_t srcid, long a0, long a1, long a2)
 	 * with __proc_give_cores() and __proc_run_m(). */
 	if (!pcpui->cur_proc) {
 		pcpui->cur_proc = p_to_run;	/* install the ref to cur_proc */
+		proc_tlb_mark_core(p_to_run);
 		lcr3(p_to_run->env_cr3);	/* load the page tables to match cur_proc */
 	} else {
 		proc_decref(p_to_run);		/* can't install, decref the extra one */
@@ -2215,6 +2461,7 @@ void __notify(uint32_t srcid, long a0, long a1, long a2)
 	if (vcpd->notif_disabled)
 		return;
 	vcpd->notif_disabled = TRUE;
+	p->vcore_stats[vcoreid].nr_notifs++;
 	/* save the old ctx in the uthread slot, build and pop a new one.  Note that
 	 * silly state isn't our business for a notification. */
 	copy_current_ctx_to(&vcpd->uthread_ctx);
@@ -2260,7 +2507,7 @@ void __preempt(uint32_t srcid, long a0, long a1, long a2)
 	 * hold the K_LOCK (preventing userspace from starting a fresh STEALING
 	 * phase concurrently). */
 	if (!(atomic_read(&vcpd->flags) & VC_UTHREAD_STEALING))
-		save_vc_fp_state(vcpd);
+		save_vc_fp_state(p, vcoreid);
 	/* Mark the vcore as preempted and unlock (was locked by the sender). */
 	atomic_or(&vcpd->flags, VC_PREEMPTED);
 	atomic_and(&vcpd->flags, ~VC_K_LOCK);
@@ -2304,12 +2551,26 @@ void __death(uint32_t srcid, long a0, long a1, long a2)
 	clear_owning_proc(coreid);
 }
 
+/* Past this many pages, it's cheaper to flush the whole TLB than to invalidate
+ * page by page. */
+#define TLB_SHOOTDOWN_MAX_PGS	32
+
 /* Kernel message handler, usually sent IMMEDIATE, to shoot down virtual
- * addresses from a0 to a1. */
+ * addresses from a0 to a1.  a1 == 0 means everything.  We might not be in the
+ * address space anymore, in which case this flush was unnecessary, but
+ * harmless. */
 void __tlbshootdown(uint32_t srcid, long a0, long a1, long a2)
 {
-	/* TODO: (TLB) something more intelligent with the range */
-	tlbflush();
+	uintptr_t start = ROUNDDOWN((uintptr_t)a0, PGSIZE);
+	uintptr_t end = ROUNDUP((uintptr_t)a1, PGSIZE);
+
+	if (!end || (end < start) ||
+	    ((end - start) >> PGSHIFT > TLB_SHOOTDOWN_MAX_PGS)) {
+		tlbflush();
+		return;
+	}
+	for (uintptr_t va = start; va < end; va += PGSIZE)
+		invlpg((void*)va);
 }
 
 void print_allpids(void)
@@ -2330,9 +2591,7 @@ void print_allpids(void)
 	printk("     PID Name %-*s State      Parent    \n",
 	       PROC_PROGNAME_SZ - 5, "");
 	printk("------------------------------%s\n", dashes);
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, print_proc_state, NULL);
-	spin_unlock(&pid_hash_lock);
+	rhashtable_for_each(&pid_hash, print_proc_state, NULL);
 }
 
 void proc_get_set(struct process_set *pset)
@@ -2363,9 +2622,7 @@ void proc_get_set(struct process_set *pset)
 		if (!pset->procs)
 			error(-ENOMEM, ERROR_FIXME);
 
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, enum_proc, pset);
-		spin_unlock(&pid_hash_lock);
+		rhashtable_for_each(&pid_hash, enum_proc, pset);
 
 	} while (pset->num_processes == pset->size);
 }
@@ -2478,12 +2735,11 @@ void check_my_owner(void)
 			if (vc_i->pcoreid == core_id()) {
 				/* Immediate message was sent, we should get it when we enable
 				 * interrupts, which should cause us to skip cpu_halt() */
-				if (!STAILQ_EMPTY(&pcpui->immed_amsgs))
+				if (!kmsg_queue_empty(&pcpui->immed_amsgs))
 					continue;
 				printk("Owned pcore (%d) has no owner, by %p, vc %d!\n",
 				       core_id(), p, vcore2vcoreid(p, vc_i));
 				spin_unlock(&p->proc_lock);
-				spin_unlock(&pid_hash_lock);
 				monitor(0);
 			}
 		}
@@ -2491,8 +2747,6 @@ void check_my_owner(void)
 	}
 	assert(!irq_is_enabled());
 	if (!booting && !pcpui->owning_proc) {
-		spin_lock(&pid_hash_lock);
-		hash_for_each(pid_hash, shazbot, NULL);
-		spin_unlock(&pid_hash_lock);
+		rhashtable_for_each(&pid_hash, shazbot, NULL);
 	}
 }
@@ -19,7 +19,16 @@
  * - profiler_control_trace() controls the per-core trace collection.  When it
  *   is disabled, it also flushes the per-core blocks to the central queue.
  * - The collection of mmap and comm samples is independent of trace collection.
- *   Those will occur whenever the profiler is open (refcnt check, for now). */
+ *   Those will occur whenever the profiler is open (refcnt check, for now).
+ * - Traces can be filtered by pid, vcore, and kernel/user before they are
+ *   recorded (prof_pid, prof_vcore, prof_mode).
+ * - In aggregation mode (prof_aggregate), each core hashes traces into a table
+ *   of counts instead of emitting a record per sample.  The table is emitted as
+ *   PROFTYPE_TRACE_AGG64 records when the core's buffer is flushed.  Traces
+ *   that don't fit in the table are emitted as usual.
+ * - In off-CPU mode (prof_offcpu), kthreads that slept in sem_down() emit their
+ *   blocking backtrace and how long they were off the core when they run
+ *   again.  That covers rendez, qio, and anything else built on sems. */
 
 #include <ros/common.h>
 #include <ros/mman.h>
@@ -40,18 +49,54 @@
 #include <err.h>
 #include <core_set.h>
 #include <string.h>
+#include <hash.h>
+#include <fs_file.h>
+#include <pagemap.h>
+#include <kdebug.h>
 #include "profiler.h"
 
 #define PROFILER_MAX_PRG_PATH	256
 
 #define VBE_MAX_SIZE(t) ((8 * sizeof(t) + 6) / 7)
 
+#define PROF_FILTER_ANY			(-2)	/* -1 is the pid of 'no process' */
+#define PROF_MODE_KERN			(1 << 0)
+#define PROF_MODE_USER			(1 << 1)
+
+#define PROF_AGG_MAX_PCS		16
+#define PROF_AGG_MAX_PROBES		16
+
+struct prof_agg_entry {
+	uint64_t hash;				/* 0 means empty */
+	uint64_t info;
+	uint64_t count;
+	uint32_t pid;
+	uint16_t num_traces;
+	bool user;
+	uint64_t trace[PROF_AGG_MAX_PCS];
+};
+
+/* One core's area of #kprof/kpring.  The reader can scribble on the header, so
+ * we keep our own copy of head. */
+struct profiler_ring {
+	struct prof_ring_header *hdr;
+	char *data;
+	size_t size;
+	uint64_t head;
+	uint64_t nr_lost;
+};
+
 /* Do not rely on the contents of the PCPU ctx with IRQs enabled. */
 struct profiler_cpu_context {
 	struct block *block;
 	int cpu;
 	int tracing;
 	size_t dropped_data_cnt;
+	/* Traces come in from NMIs, which can interrupt a flush of the table. */
+	struct prof_agg_entry *agg;
+	bool agg_busy;
+	/* If set, traces go here instead of the queue.  block is just scratch. */
+	struct profiler_ring *ring;
 };
 
 static int profiler_queue_limit = 64 * 1024 * 1024;
@@ -60,6 +105,18 @@ static qlock_t profiler_mtx = QLOCK_INITIALIZER(profiler_mtx);
 static struct kref profiler_kref;
 static struct profiler_cpu_context *profiler_percpu_ctx;
 static struct queue *profiler_queue;
+static int profiler_filter_pid = PROF_FILTER_ANY;
+static int profiler_filter_vcore = PROF_FILTER_ANY;
+static int profiler_mode = PROF_MODE_KERN | PROF_MODE_USER;
+static size_t profiler_agg_nr_entries;
+static bool profiler_tracing;
+static bool profiler_offcpu;
+static uint64_t profiler_offcpu_min_nsec;
+/* The rings are mmapped, so once allocated, they are never freed. */
+static struct profiler_ring *profiler_rings;
+static size_t profiler_ring_pages;
+static bool profiler_ring_on;
+static struct fs_file profiler_ring_file;
 
 static inline struct profiler_cpu_context *profiler_get_cpu_ctx(int cpu)
 {
@@ -109,12 +166,43 @@ static char *profiler_cpu_buffer_write_reserve(
 	return (char *) b->wp;
 }
 
+/* Copies a record into the ring, or drops it if the reader hasn't made room.
+ * A bogus data_tail just looks like a full ring. */
+static void profiler_ring_write(struct profiler_ring *r, const char *rec,
+                                size_t size)
+{
+	struct prof_ring_header *hdr = r->hdr;
+	uint64_t tail = READ_ONCE(hdr->data_tail);
+	size_t off, part;
+
+	if (size > r->size || r->head - tail > r->size - size) {
+		WRITE_ONCE(hdr->nr_lost, ++r->nr_lost);
+		return;
+	}
+	/* Don't write over data until we've seen the reader is done with it. */
+	mb();
+	off = r->head & (r->size - 1);
+	part = MIN(size, r->size - off);
+	memcpy(r->data + off, rec, part);
+	memcpy(r->data, rec + part, size - part);
+	/* The record must be visible before the head that covers it. */
+	wmb();
+	r->head += size;
+	WRITE_ONCE(hdr->data_head, r->head);
+}
+
 /* Helper, paired with write_reserve.  Finalizes the writing into the block's
  * main body of @size bytes.  IRQs must be disabled until after this is called.
- */
+ *
+ * In ring mode, the record goes straight to the ring, and the block stays
+ * empty for the next one. */
 static inline void profiler_cpu_buffer_write_commit(
 	struct profiler_cpu_context *cpu_buf, struct block *b, size_t size)
 {
+	if (cpu_buf->ring) {
+		profiler_ring_write(cpu_buf->ring, (char *) b->wp, size);
+		return;
+	}
 	b->wp += size;
 }
 
@@ -123,11 +211,39 @@ static inline size_t profiler_max_envelope_size(void)
 	return 2 * VBE_MAX_SIZE(uint64_t);
 }
 
+/* The process a kernel trace is charged to, if any. */
+static struct proc *profiler_kernel_trace_proc(struct per_cpu_info *pcpui)
+{
+	if (is_ktask(pcpui->cur_kthread) || !pcpui->cur_proc)
+		return NULL;
+	return pcpui->cur_proc;
+}
+
+static bool profiler_wants_trace(struct proc *p, bool user)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	int filter_pid = READ_ONCE(profiler_filter_pid);
+	int filter_vcore = READ_ONCE(profiler_filter_vcore);
+
+	if (!(READ_ONCE(profiler_mode) & (user ? PROF_MODE_USER : PROF_MODE_KERN)))
+		return FALSE;
+	if (filter_pid != PROF_FILTER_ANY && (p ? p->pid : -1) != filter_pid)
+		return FALSE;
+	/* Kernel traces count for a vcore if the kernel is running on the vcore's
+	 * behalf, e.g. a syscall or page fault. */
+	if (filter_vcore != PROF_FILTER_ANY &&
+	    (!p || pcpui->owning_proc != p ||
+	     pcpui->owning_vcoreid != filter_vcore))
+		return FALSE;
+	return TRUE;
+}
+
 static void profiler_push_kernel_trace64(struct profiler_cpu_context *cpu_buf,
                                          const uintptr_t *trace, size_t count,
                                          uint64_t info)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+	struct proc *p = profiler_kernel_trace_proc(pcpui);
 	size_t size = sizeof(struct proftype_kern_trace64) +
 		count * sizeof(uint64_t);
 	struct block *b;
@@ -149,10 +265,7 @@ static void profiler_push_kernel_trace64(struct profiler_cpu_context *cpu_buf,
 
 		record->info = info;
 		record->tstamp = nsec();
-		if (is_ktask(pcpui->cur_kthread) || !pcpui->cur_proc)
-			record->pid = -1;
-		else
-			record->pid = pcpui->cur_proc->pid;
+		record->pid = p ? p->pid : -1;
 		record->cpu = cpu_buf->cpu;
 		record->num_traces = count;
 		for (size_t i = 0; i < count; i++)
@@ -197,6 +310,195 @@ static void profiler_push_user_trace64(struct profiler_cpu_context *cpu_buf,
 	}
 }
 
+static void profiler_push_branch_stack64(struct profiler_cpu_context *cpu_buf,
+                                         const struct proftype_branch64 *br,
+                                         size_t count, uint64_t info)
+{
+	size_t size = sizeof(struct proftype_branch_stack64) +
+		count * sizeof(struct proftype_branch64);
+	struct block *b;
+	void *resptr, *ptr;
+
+	assert(!irq_is_enabled());
+	resptr = profiler_cpu_buffer_write_reserve(
+	    cpu_buf, size + profiler_max_envelope_size(), &b);
+	ptr = resptr;
+
+	if (likely(ptr)) {
+		struct proftype_branch_stack64 *record;
+
+		ptr = vb_encode_uint64(ptr, PROFTYPE_BRANCH_STACK64);
+		ptr = vb_encode_uint64(ptr, size);
+
+		record = (struct proftype_branch_stack64 *) ptr;
+		ptr += size;
+
+		record->info = info;
+		record->tstamp = nsec();
+		record->cpu = cpu_buf->cpu;
+		record->nr_branches = count;
+		memcpy(record->branches, br, count * sizeof(struct proftype_branch64));
+
+		profiler_cpu_buffer_write_commit(cpu_buf, b, ptr - resptr);
+	}
+}
+
+static void profiler_push_offcpu64(struct profiler_cpu_context *cpu_buf,
+                                   struct proc *p, const uintptr_t *trace,
+                                   size_t count, uint64_t blocked)
+{
+	size_t size = sizeof(struct proftype_offcpu64) + count * sizeof(uint64_t);
+	struct block *b;
+	void *resptr, *ptr;
+
+	assert(!irq_is_enabled());
+	resptr = profiler_cpu_buffer_write_reserve(
+	    cpu_buf, size + profiler_max_envelope_size(), &b);
+	ptr = resptr;
+
+	if (likely(ptr)) {
+		struct proftype_offcpu64 *record;
+
+		ptr = vb_encode_uint64(ptr, PROFTYPE_OFFCPU64);
+		ptr = vb_encode_uint64(ptr, size);
+
+		record = (struct proftype_offcpu64 *) ptr;
+		ptr += size;
+
+		record->tstamp = nsec();
+		record->blocked = blocked;
+		record->pid = p ? p->pid : -1;
+		record->cpu = cpu_buf->cpu;
+		record->num_traces = count;
+		for (size_t i = 0; i < count; i++)
+			record->trace[i] = (uint64_t) trace[i];
+
+		profiler_cpu_buffer_write_commit(cpu_buf, b, ptr - resptr);
+	}
+}
+
+static uint64_t prof_agg_hash(uint64_t info, uint32_t pid, bool user,
+                              const uintptr_t *trace, size_t count)
+{
+	uint64_t hash = (info ^ ((uint64_t)pid << 1) ^ user) * GOLDEN_RATIO_64;
+
+	for (size_t i = 0; i < count; i++)
+		hash = (hash ^ trace[i]) * GOLDEN_RATIO_64;
+	return hash ?: 1;
+}
+
+static bool prof_agg_match(struct prof_agg_entry *ent, uint64_t hash,
+                           uint64_t info, uint32_t pid, bool user,
+                           const uintptr_t *trace, size_t count)
+{
+	if (ent->hash != hash || ent->info != info || ent->pid != pid ||
+	    ent->user != user || ent->num_traces != count)
+		return FALSE;
+	for (size_t i = 0; i < count; i++) {
+		if (ent->trace[i] != trace[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Counts the trace in cpu_buf's table.  Returns FALSE if the caller should
+ * record it normally: the table is full around the trace's slot, or the trace
+ * is too deep. */
+static bool profiler_agg_trace(struct profiler_cpu_context *cpu_buf,
+                               const uintptr_t *trace, size_t count,
+                               uint64_t info, uint32_t pid, bool user)
+{
+	size_t mask = profiler_agg_nr_entries - 1;
+	struct prof_agg_entry *ent;
+	uint64_t hash;
+
+	if (count > PROF_AGG_MAX_PCS)
+		return FALSE;
+	hash = prof_agg_hash(info, pid, user, trace, count);
+	for (size_t i = 0; i < PROF_AGG_MAX_PROBES; i++) {
+		ent = &cpu_buf->agg[(hash + i) & mask];
+		if (!ent->hash) {
+			ent->hash = hash;
+			ent->info = info;
+			ent->count = 1;
+			ent->pid = pid;
+			ent->user = user;
+			ent->num_traces = count;
+			for (size_t j = 0; j < count; j++)
+				ent->trace[j] = trace[j];
+			return TRUE;
+		}
+		if (prof_agg_match(ent, hash, info, pid, user, trace, count)) {
+			ent->count++;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Emits and clears cpu_buf's table.  IRQs must be disabled. */
+static void profiler_agg_flush(struct profiler_cpu_context *cpu_buf)
+{
+	struct prof_agg_entry *ent;
+	struct proftype_trace_agg64 *record;
+	struct block *b;
+	void *resptr, *ptr;
+	uint64_t now = nsec();
+	size_t size;
+
+	WRITE_ONCE(cpu_buf->agg_busy, TRUE);
+	cmb();	/* an NMI that sees !busy finishes before we get here */
+	for (size_t i = 0; i < profiler_agg_nr_entries; i++) {
+		ent = &cpu_buf->agg[i];
+		if (!ent->hash)
+			continue;
+		size = sizeof(struct proftype_trace_agg64) +
+		       ent->num_traces * sizeof(uint64_t);
+		resptr = profiler_cpu_buffer_write_reserve(
+			cpu_buf, size + profiler_max_envelope_size(), &b);
+		ptr = resptr;
+		if (likely(ptr)) {
+			ptr = vb_encode_uint64(ptr, PROFTYPE_TRACE_AGG64);
+			ptr = vb_encode_uint64(ptr, size);
+
+			record = (struct proftype_trace_agg64 *) ptr;
+			ptr += size;
+
+			record->info = ent->info;
+			record->tstamp = now;
+			record->count = ent->count;
+			record->pid = ent->pid;
+			record->cpu = cpu_buf->cpu;
+			record->num_traces = ent->num_traces;
+			record->user = ent->user;
+			for (size_t j = 0; j < ent->num_traces; j++)
+				record->trace[j] = ent->trace[j];
+
+			profiler_cpu_buffer_write_commit(cpu_buf, b, ptr - resptr);
+		}
+		ent->hash = 0;
+	}
+	cmb();
+	WRITE_ONCE(cpu_buf->agg_busy, FALSE);
+}
+
+/* Returns TRUE if the trace was handled by aggregation, including being
+ * dropped. */
+static bool profiler_try_agg(struct profiler_cpu_context *cpu_buf,
+                             const uintptr_t *trace, size_t count,
+                             uint64_t info, struct proc *p, bool user)
+{
+	if (!cpu_buf->agg)
+		return FALSE;
+	/* The flush we interrupted is using the block too */
+	if (READ_ONCE(cpu_buf->agg_busy)) {
+		cpu_buf->dropped_data_cnt++;
+		return TRUE;
+	}
+	return profiler_agg_trace(cpu_buf, trace, count, info, p ? p->pid : -1,
+	                          user);
+}
+
 static void profiler_push_pid_mmap(struct proc *p, uintptr_t addr, size_t msize,
                                    size_t offset, const char *path)
 {
@@ -282,8 +584,118 @@ static void profiler_emit_current_system_status(void)
 	proc_free_set(&pset);
 }
 
+/* Both of these need profiler_mtx and tracing to be off. */
+static void free_agg_tables(void)
+{
+	if (!profiler_percpu_ctx)
+		return;
+	for (int i = 0; i < num_cores; i++) {
+		kfree(profiler_percpu_ctx[i].agg);
+		profiler_percpu_ctx[i].agg = NULL;
+	}
+}
+
+static void alloc_agg_tables(void)
+{
+	if (!profiler_percpu_ctx || !profiler_agg_nr_entries)
+		return;
+	for (int i = 0; i < num_cores; i++)
+		profiler_percpu_ctx[i].agg =
+			kzmalloc(sizeof(struct prof_agg_entry) * profiler_agg_nr_entries,
+			         MEM_WAIT);
+}
+
+static int profiler_ring_readpage(struct page_map *pm, struct page *pg)
+{
+	/* Every page of the file is in the PM from the start. */
+	return -EIO;
+}
+
+static int profiler_ring_writepage(struct page_map *pm, struct page *pg)
+{
+	return 0;
+}
+
+static void profiler_ring_punch_hole(struct fs_file *f, off64_t begin,
+                                     off64_t end)
+{
+	error(EINVAL, "can't punch holes in the profiler ring");
+}
+
+static bool profiler_ring_can_grow_to(struct fs_file *f, size_t len)
+{
+	return len <= fs_file_get_length(f);
+}
+
+static struct fs_file_ops profiler_ring_fs_ops = {
+	.readpage = profiler_ring_readpage,
+	.writepage = profiler_ring_writepage,
+	.punch_hole = profiler_ring_punch_hole,
+	.can_grow_to = profiler_ring_can_grow_to,
+};
+
+/* Builds kpring with a header page and nr_pgs data pages per core.  The PM
+ * holds a ref on every page forever, so mmaps never fault in anything else and
+ * the pages are never reclaimed.  Needs profiler_mtx. */
+static void alloc_rings(size_t nr_pgs)
+{
+	size_t area = (1 + nr_pgs) * PGSIZE;
+	size_t nr_total = (1 + nr_pgs) * num_cores;
+	struct profiler_ring *rings;
+	struct page **pgs;
+	void *kva;
+	int ret;
+
+	rings = kzmalloc(sizeof(struct profiler_ring) * num_cores, MEM_WAIT);
+	pgs = kmalloc(sizeof(struct page *) * nr_total, MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		struct profiler_ring *r = &rings[i];
+
+		kva = kpages_zalloc(area, MEM_WAIT);
+		r->hdr = kva;
+		r->data = kva + PGSIZE;
+		r->size = nr_pgs * PGSIZE;
+		r->hdr->version = PROF_RING_VERSION;
+		r->hdr->core = i;
+		r->hdr->data_offset = PGSIZE;
+		r->hdr->data_size = r->size;
+		for (int j = 0; j < 1 + nr_pgs; j++) {
+			struct page *pg = kva2page(kva + j * PGSIZE);
+
+			pgs[i * (1 + nr_pgs) + j] = pg;
+			atomic_set(&pg->pg_flags, PG_UPTODATE | PG_PAGEMAP);
+			atomic_set(&pg->pg_ext_refs, 1);	/* the PM's ref */
+			sem_init(&pg->pg_sem, 1);
+		}
+	}
+	fs_file_init(&profiler_ring_file, "kpring", &profiler_ring_fs_ops);
+	fs_file_init_dir(&profiler_ring_file, 0, 0, &eve, 0600);
+	profiler_ring_file.dir.length = area * num_cores;
+	ret = pm_insert_pages(profiler_ring_file.pm, 0, pgs, nr_total);
+	kfree(pgs);
+	if (ret) {
+		for (int i = 0; i < num_cores; i++)
+			kpages_free(rings[i].hdr, area);
+		kfree(rings);
+		error(-ret, "Couldn't build the profiler ring");
+	}
+	profiler_ring_pages = nr_pgs;
+	profiler_rings = rings;
+}
+
+/* Needs profiler_mtx and tracing to be off. */
+static void set_ring_mode(bool on)
+{
+	profiler_ring_on = on;
+	if (!profiler_percpu_ctx)
+		return;
+	for (int i = 0; i < num_cores; i++)
+		profiler_percpu_ctx[i].ring = on ? &profiler_rings[i] : NULL;
+}
+
 static void free_cpu_buffers(void)
 {
+	free_agg_tables();
 	kfree(profiler_percpu_ctx);
 	profiler_percpu_ctx = NULL;
 
@@ -321,6 +733,8 @@ static void alloc_cpu_buffers(void)
 
 		b->cpu = i;
 	}
+	alloc_agg_tables();
+	set_ring_mode(profiler_ring_on);
 }
 
 static long profiler_get_checked_value(const char *value, long k, long minval,
@@ -354,6 +768,100 @@ int profiler_configure(struct cmdbuf *cb)
 			cb->f[1], 1024, 16 * 1024, 1024 * 1024);
 		return 1;
 	}
+	if (!strcmp(cb->f[0], "prof_pid")) {
+		if (cb->nf < 2)
+			error(EFAIL, "prof_pid PID|any");
+		WRITE_ONCE(profiler_filter_pid, strcmp(cb->f[1], "any") ?
+		           (int) profiler_get_checked_value(cb->f[1], 1, -1, INT32_MAX)
+		           : PROF_FILTER_ANY);
+		return 1;
+	}
+	if (!strcmp(cb->f[0], "prof_vcore")) {
+		if (cb->nf < 2)
+			error(EFAIL, "prof_vcore VCOREID|any");
+		WRITE_ONCE(profiler_filter_vcore, strcmp(cb->f[1], "any") ?
+		           (int) profiler_get_checked_value(cb->f[1], 1, 0,
+		                                            MAX_NUM_CORES - 1)
+		           : PROF_FILTER_ANY);
+		return 1;
+	}
+	if (!strcmp(cb->f[0], "prof_mode")) {
+		if (cb->nf < 2)
+			error(EFAIL, "prof_mode kernel|user|all");
+		if (!strcmp(cb->f[1], "kernel"))
+			WRITE_ONCE(profiler_mode, PROF_MODE_KERN);
+		else if (!strcmp(cb->f[1], "user"))
+			WRITE_ONCE(profiler_mode, PROF_MODE_USER);
+		else if (!strcmp(cb->f[1], "all"))
+			WRITE_ONCE(profiler_mode, PROF_MODE_KERN | PROF_MODE_USER);
+		else
+			error(EFAIL, "prof_mode kernel|user|all");
+		return 1;
+	}
+	if (!strcmp(cb->f[0], "prof_aggregate")) {
+		size_t nr_entries = 0;
+
+		if (cb->nf < 2)
+			error(EFAIL, "prof_aggregate NR_ENTRIES|off");
+		if (strcmp(cb->f[1], "off")) {
+			nr_entries = (size_t) profiler_get_checked_value(cb->f[1], 1, 64,
+			                                                 1 << 20);
+			if (!IS_PWR2(nr_entries))
+				error(EINVAL, "NR_ENTRIES must be a power of 2");
+		}
+		qlock(&profiler_mtx);
+		if (profiler_tracing) {
+			qunlock(&profiler_mtx);
+			error(EBUSY, "Profiler is running");
+		}
+		free_agg_tables();
+		profiler_agg_nr_entries = nr_entries;
+		alloc_agg_tables();
+		qunlock(&profiler_mtx);
+		return 1;
+	}
+	if (!strcmp(cb->f[0], "prof_ring")) {
+		ERRSTACK(1);
+		size_t nr_pgs = 0;
+
+		if (cb->nf < 2)
+			error(EFAIL, "prof_ring PAGES|off");
+		if (strcmp(cb->f[1], "off")) {
+			nr_pgs = (size_t) profiler_get_checked_value(cb->f[1], 1, 1,
+			                                             1 << 14);
+			if (!IS_PWR2(nr_pgs))
+				error(EINVAL, "PAGES must be a power of 2");
+		}
+		qlock(&profiler_mtx);
+		if (waserror()) {
+			qunlock(&profiler_mtx);
+			nexterror();
+		}
+		if (profiler_tracing)
+			error(EBUSY, "Profiler is running");
+		if (nr_pgs && !profiler_rings)
+			alloc_rings(nr_pgs);
+		if (nr_pgs && nr_pgs != profiler_ring_pages)
+			error(EBUSY, "The ring already has %lu pages per core",
+			      profiler_ring_pages);
+		set_ring_mode(nr_pgs != 0);
+		poperror();
+		qunlock(&profiler_mtx);
+		return 1;
+	}
+	if (!strcmp(cb->f[0], "prof_offcpu")) {
+		if (cb->nf < 2)
+			error(EFAIL, "prof_offcpu MIN_USEC|off");
+		if (!strcmp(cb->f[1], "off")) {
+			WRITE_ONCE(profiler_offcpu, FALSE);
+			return 1;
+		}
+		WRITE_ONCE(profiler_offcpu_min_nsec,
+		           profiler_get_checked_value(cb->f[1], NSEC_PER_USEC, 0,
+		                                      60 * NSEC_PER_SEC));
+		WRITE_ONCE(profiler_offcpu, TRUE);
+		return 1;
+	}
 
 	return 0;
 }
@@ -363,6 +871,12 @@ void profiler_append_configure_usage(char *msgbuf, size_t buflen)
 	const char * const cmds[] = {
 		"prof_qlimit",
 		"prof_cpubufsz",
+		"prof_pid",
+		"prof_vcore",
+		"prof_mode",
+		"prof_aggregate",
+		"prof_ring",
+		"prof_offcpu",
 	};
 
 	for (int i = 0; i < ARRAY_SIZE(cmds); i++) {
@@ -434,6 +948,12 @@ static void profiler_cpu_flush(struct profiler_cpu_context *cpu_buf)
 	int8_t irq_state = 0;
 
 	disable_irqsave(&irq_state);
+	if (cpu_buf->agg && profiler_queue)
+		profiler_agg_flush(cpu_buf);
+	if (cpu_buf->block && cpu_buf->ring) {
+		freeb(cpu_buf->block);
+		cpu_buf->block = NULL;
+	}
 	if (cpu_buf->block && profiler_queue) {
 		qibwrite(profiler_queue, cpu_buf->block);
 
@@ -466,6 +986,10 @@ static void profiler_control_trace(int onoff)
 void profiler_start(void)
 {
 	assert(profiler_queue);
+	/* Keeps prof_aggregate from changing the tables under the tracers */
+	qlock(&profiler_mtx);
+	profiler_tracing = TRUE;
+	qunlock(&profiler_mtx);
 	profiler_control_trace(1);
 	qreopen(profiler_queue);
 }
@@ -474,6 +998,9 @@ void profiler_stop(void)
 {
 	assert(profiler_queue);
 	profiler_control_trace(0);
+	qlock(&profiler_mtx);
+	profiler_tracing = FALSE;
+	qunlock(&profiler_mtx);
 	qhangup(profiler_queue, 0);
 }
 
@@ -495,27 +1022,73 @@ void profiler_trace_data_flush(void)
 	smp_do_in_cores(&cset, profiler_core_flush, NULL);
 }
 
+/* Branch stacks are dropped for aggregated traces. */
 void profiler_push_kernel_backtrace(uintptr_t *pc_list, size_t nr_pcs,
-                                    uint64_t info)
+                                    uint64_t info,
+                                    const struct proftype_branch64 *branches,
+                                    size_t nr_branches)
 {
 	if (kref_get_not_zero(&profiler_kref, 1)) {
 		struct profiler_cpu_context *cpu_buf = profiler_get_cpu_ctx(core_id());
+		struct proc *p = profiler_kernel_trace_proc(this_pcpui_ptr());
 
-		if (profiler_percpu_ctx && cpu_buf->tracing)
+		if (profiler_percpu_ctx && cpu_buf->tracing &&
+		    profiler_wants_trace(p, FALSE) &&
+		    !profiler_try_agg(cpu_buf, pc_list, nr_pcs, info, p, FALSE)) {
 			profiler_push_kernel_trace64(cpu_buf, pc_list, nr_pcs, info);
+			if (nr_branches)
+				profiler_push_branch_stack64(cpu_buf, branches, nr_branches,
+				                             info);
+		}
 		kref_put(&profiler_kref);
 	}
 }
 
 void profiler_push_user_backtrace(uintptr_t *pc_list, size_t nr_pcs,
-                                  uint64_t info)
+                                  uint64_t info,
+                                  const struct proftype_branch64 *branches,
+                                  size_t nr_branches)
 {
 	if (kref_get_not_zero(&profiler_kref, 1)) {
 		struct proc *p = current;
 		struct profiler_cpu_context *cpu_buf = profiler_get_cpu_ctx(core_id());
 
-		if (profiler_percpu_ctx && cpu_buf->tracing)
+		if (profiler_percpu_ctx && cpu_buf->tracing &&
+		    profiler_wants_trace(p, TRUE) &&
+		    !profiler_try_agg(cpu_buf, pc_list, nr_pcs, info, p, TRUE)) {
 			profiler_push_user_trace64(cpu_buf, p, pc_list, nr_pcs, info);
+			if (nr_branches)
+				profiler_push_branch_stack64(cpu_buf, branches, nr_branches,
+				                             info);
+		}
+		kref_put(&profiler_kref);
+	}
+}
+
+/* Called by a kthread that just got a core back after sleeping in sem_down(),
+ * with IRQs disabled.  blocked_tsc is how long it was gone.  Our caller's stack
+ * is still the one it slept on, so that's the trace. */
+void profiler_notify_offcpu(uint64_t blocked_tsc)
+{
+	uintptr_t pcs[MAX_BT_DEPTH];
+	size_t nr_pcs;
+	uint64_t blocked;
+
+	if (!READ_ONCE(profiler_offcpu))
+		return;
+	blocked = tsc2nsec(blocked_tsc);
+	if (blocked < READ_ONCE(profiler_offcpu_min_nsec))
+		return;
+	if (kref_get_not_zero(&profiler_kref, 1)) {
+		struct profiler_cpu_context *cpu_buf = profiler_get_cpu_ctx(core_id());
+		struct proc *p = profiler_kernel_trace_proc(this_pcpui_ptr());
+
+		if (profiler_percpu_ctx && cpu_buf->tracing &&
+		    profiler_wants_trace(p, FALSE)) {
+			nr_pcs = backtrace_list(get_caller_pc(), *(uintptr_t*)read_bp(),
+			                        pcs, MAX_BT_DEPTH);
+			profiler_push_offcpu64(cpu_buf, p, pcs, nr_pcs, blocked);
+		}
 		kref_put(&profiler_kref);
 	}
 }
@@ -530,6 +1103,27 @@ int profiler_read(void *va, int n)
 	return profiler_queue ? qread(profiler_queue, va, n) : 0;
 }
 
+size_t profiler_ring_size(void)
+{
+	return READ_ONCE(profiler_rings) ? fs_file_get_length(&profiler_ring_file)
+	                                 : 0;
+}
+
+/* The devtab mmap for kpring.  The reader needs a shared, writable mapping to
+ * update data_tail. */
+struct fs_file *profiler_ring_mmap(int prot, int flags)
+{
+	if (!READ_ONCE(profiler_rings)) {
+		set_error(ENODEV, "No profiler ring, see prof_ring");
+		return NULL;
+	}
+	if (!(flags & MAP_SHARED)) {
+		set_error(EINVAL, "The profiler ring must be MAP_SHARED");
+		return NULL;
+	}
+	return &profiler_ring_file;
+}
+
 void profiler_notify_mmap(struct proc *p, uintptr_t addr, size_t size, int prot,
                           int flags, struct file_or_chan *foc, size_t offset)
 {
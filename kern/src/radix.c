@@ -11,8 +11,25 @@
 #include <string.h>
 #include <stdio.h>
 #include <rcu.h>
+#include <percpu.h>
+#include <arch/arch.h>
 
 struct kmem_cache *radix_kcache;
+
+/* One insert needs at most one node per level, either to grow the tree or to
+ * fill in a missing interior node, plus one for a new root. */
+#define RADIX_PRELOAD_NR	(DIV_ROUND_UP(sizeof(unsigned long) * 8,         \
+                                          LOG_RNODE_SLOTS) + 1)
+
+/* Per-core stash of rnodes, so inserts made while holding a lock don't need to
+ * go to the slab allocator.  See radix_preload(). */
+struct radix_preload_pool {
+	unsigned int				nr;
+	struct radix_node			*nodes[RADIX_PRELOAD_NR];
+};
+
+static DEFINE_PERCPU(struct radix_preload_pool, radix_preload_pools);
+
 static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
                                               unsigned long key,
                                               bool extend);
@@ -27,6 +44,25 @@ void radix_init(void)
 					 NULL, 0, 0, NULL);
 }
 
+/* Gets a zeroed rnode, preferably from this core's preload pool.  Inserts
+ * can't fail, so if the pool is empty, we block for one. */
+static struct radix_node *__rnode_alloc(void)
+{
+	struct radix_preload_pool *pool;
+	struct radix_node *r_node = NULL;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	pool = PERCPU_VARPTR(radix_preload_pools);
+	if (pool->nr)
+		r_node = pool->nodes[--pool->nr];
+	enable_irqsave(&irq_state);
+	if (!r_node)
+		r_node = kmem_cache_alloc(radix_kcache, MEM_WAIT);
+	memset(r_node, 0, sizeof(struct radix_node));
+	return r_node;
+}
+
 /* Initializes a tree dynamically */
 void radix_tree_init(struct radix_tree *tree)
 {
@@ -71,8 +107,7 @@ int radix_insert(struct radix_tree *tree, unsigned long key, void *item,
 	/* Is the tree tall enough?  if not, it needs to grow a level.  This will
 	 * also create the initial node (upper bound starts at 0). */
 	while (key >= tree->upper_bound) {
-		r_node = kmem_cache_alloc(radix_kcache, MEM_WAIT);
-		memset(r_node, 0, sizeof(struct radix_node));
+		r_node = __rnode_alloc();
 		if (tree->root) {
 			/* tree->root is the old root, now a child of the future root */
 			r_node->items[0] = tree->root;
@@ -213,8 +248,7 @@ static struct radix_node *__radix_lookup_node(struct radix_tree *tree,
 		if (!r_node->items[idx]) {
 			if (!extend)
 				return 0;
-			child_node = kmem_cache_alloc(radix_kcache, MEM_WAIT);
-			memset(child_node, 0, sizeof(struct radix_node));
+			child_node = __rnode_alloc();
 			/* when we are on the last iteration (i == 2), the child will be
 			 * a leaf. */
 			child_node->leaf = (i == 2) ? TRUE : FALSE;
@@ -337,11 +371,53 @@ void radix_for_each_slot(struct radix_tree *tree, radix_cb_t cb, void *arg)
 	radix_for_each_slot_in_range(tree, 0, ULONG_MAX, cb, arg);
 }
 
+/* Helper for gang lookups, same idea as rnode_for_each(), but read-only and in
+ * order.  Returns the total number of results so far. */
+static unsigned int rnode_gang_lookup(struct radix_node *r_node, int depth,
+                                      unsigned long tree_idx,
+                                      unsigned long first, void **results,
+                                      unsigned int nr, unsigned int max_items)
+{
+	void *item;
+
+	tree_idx <<= LOG_RNODE_SLOTS;
+	for (int i = 0; (nr < max_items) && (i < NR_RNODE_SLOTS); i++) {
+		item = rcu_dereference(r_node->items[i]);
+		if (!item)
+			continue;
+		if (!child_overlaps_range(tree_idx + i, depth, first, ULONG_MAX))
+			continue;
+		if (depth > 1)
+			nr = rnode_gang_lookup(item, depth - 1, tree_idx + i, first,
+			                       results, nr, max_items);
+		else
+			results[nr++] = item;
+	}
+	return nr;
+}
+
+/* Fills results with up to max_items items whose keys are >= first, in key
+ * order, and returns how many it found.
+ *
+ * Like radix_lookup(), this is a reader: hold the rcu_read_lock (or the
+ * writer's qlock).  Concurrent inserts and deletes might or might not show
+ * up. */
 int radix_gang_lookup(struct radix_tree *tree, void **results,
                       unsigned long first, unsigned int max_items)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
+	struct radix_node *root;
+	unsigned int depth;
+	seq_ctr_t seq;
+
+	do {
+		seq = ACCESS_ONCE(tree->seq);
+		rmb();
+		root = rcu_dereference(tree->root);
+		depth = tree->depth;
+	} while (seqctr_retry(tree->seq, seq));
+	if (!root || !max_items)
+		return 0;
+	return rnode_gang_lookup(root, depth, 0, first, results, 0, max_items);
 }
 
 
@@ -351,10 +427,39 @@ int radix_grow(struct radix_tree *tree, unsigned long max)
 	return -1; /* TODO! */
 }
 
+/* Fills this core's pool with enough rnodes for any single insert, so that a
+ * radix_insert() right after this (e.g. under a qlock) won't allocate.  If we
+ * block on the qlock, we might run the insert on another core; that's OK, we'll
+ * just eat into that core's pool or allocate.
+ *
+ * Returns 0, or -ENOMEM if we couldn't fill the pool (for !MEM_WAIT).  The
+ * insert will still work, it just might have to block for memory. */
 int radix_preload(struct radix_tree *tree, int flags)
 {
-	panic("Not implemented");
-	return -1; /* TODO! */
+	struct radix_preload_pool *pool;
+	struct radix_node *r_node;
+	int8_t irq_state = 0;
+
+	disable_irqsave(&irq_state);
+	pool = PERCPU_VARPTR(radix_preload_pools);
+	while (pool->nr < RADIX_PRELOAD_NR) {
+		/* The alloc might block, and we might come back on another core. */
+		enable_irqsave(&irq_state);
+		r_node = kmem_cache_alloc(radix_kcache, flags);
+		if (!r_node)
+			return -ENOMEM;
+		disable_irqsave(&irq_state);
+		pool = PERCPU_VARPTR(radix_preload_pools);
+		if (pool->nr < RADIX_PRELOAD_NR) {
+			pool->nodes[pool->nr++] = r_node;
+		} else {
+			enable_irqsave(&irq_state);
+			kmem_cache_free(radix_kcache, r_node);
+			return 0;
+		}
+	}
+	enable_irqsave(&irq_state);
+	return 0;
 }
 
 
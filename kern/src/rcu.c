@@ -70,6 +70,10 @@
  *   being processed in order for a given core.  We could do the barrier in
  *   other ways, but it doesn't seem like a big deal.
  *
+ * - synchronize_rcu_expedited() doesn't have a separate mechanism, like Linux's.
+ *   It asks the GP kthread to run a GP now, and that GP sends an RKM to every
+ *   core that hasn't checked in.
+ *
  * - I kept around some seq counter and locking stuff in rcu_helper.h.  We might
  *   use that in the future.
  */
@@ -93,6 +97,10 @@ extern int rcu_num_lvls;
 /* Controls whether we skip cores when we expedite, which forces tardy cores. */
 static bool rcu_debug_tardy;
 
+/* Number of mgmt ktasks.  Mgmt ktask N lives on core N and runs the CBs of
+ * cores N, N + rcu_nr_mgmt, etc. */
+static int rcu_nr_mgmt = 1;
+
 /* Externed in rcu_tree_helper.c */
 struct rcu_state rcu_state;
 
@@ -194,6 +202,7 @@ static int __call_rcu_rpi(struct rcu_state *rsp, struct rcu_pcpui *rpi,
 	spin_lock_irqsave(&rpi->lock);
 	list_add_tail(&head->link, &rpi->cbs);
 	nr_cbs = ++rpi->nr_cbs;
+	rpi->max_nr_cbs = MAX(rpi->max_nr_cbs, nr_cbs);
 	spin_unlock_irqsave(&rpi->lock);
 	/* rcu_barrier requires that the write to ->nr_cbs be visible before any
 	 * future writes.  unlock orders the write inside, but doesn't prevent other
@@ -272,6 +281,31 @@ void rcu_barrier(void)
 	kfree(b);
 }
 
+/* Like synchronize_rcu(), but the GP kthread starts our GP right away and kicks
+ * any core that doesn't check in for it (see rcu_kick_tardy_cores()).  This
+ * costs an RKM to every core that is busy in the kernel, so it's for rare
+ * writers that can't wait around, not for anything done in bulk. */
+void synchronize_rcu_expedited(void)
+{
+	struct rcu_state *rsp = &rcu_state;
+	struct sync_cb_blob b[1];
+	struct semaphore sem[1];
+
+	if (is_rcu_ktask(current_kthread))
+		panic("Attempted synchronize_rcu_expedited() from an RCU callback!");
+	sem_init(sem, 0);
+	init_rcu_head_on_stack(&b->h);
+	b->sem = sem;
+	/* The GP kthread must see us waiting by the time our CB's GP starts, so
+	 * this needs to happen before call_rcu picks the GP.  The atomic is a full
+	 * barrier. */
+	__sync_fetch_and_add(&rsp->nr_exp_waiters, 1);
+	call_rcu(&b->h, __sync_cb);
+	wake_gp_ktask(rsp, true);
+	sem_down(sem);
+	__sync_fetch_and_sub(&rsp->nr_exp_waiters, 1);
+}
+
 void rcu_force_quiescent_state(void)
 {
 	/* It's unclear if we want to block until the QS has passed */
@@ -399,6 +433,37 @@ static void rcu_report_qs_tardy_cores(struct rcu_state *rsp)
 	}
 }
 
+static void __rcu_kick_kmsg(uint32_t srcid, long a0, long a1, long a2)
+{
+	/* If we're running an RKM, whatever kthread was on this core has finished
+	 * or blocked, and neither can happen in a read-side critical section.  PRKM
+	 * will also report after we return, but we might as well do it now. */
+	rcu_report_qs();
+}
+
+/* Sends an RKM to every core that hasn't checked in.  A core that is busy in
+ * the kernel will check in once its kthread blocks or returns and it runs the
+ * RKM, instead of whenever it happens to get around to it.  We can't report a
+ * QS from an IRQ, since we could have interrupted a read-side critical section,
+ * so an RKM is the best we can do. */
+static void rcu_kick_tardy_cores(struct rcu_state *rsp)
+{
+	struct rcu_node *rnp;
+	unsigned long qsmask;
+	int i;
+
+	rcu_for_each_leaf_node(rsp, rnp) {
+		qsmask = READ_ONCE(rnp->qsmask);
+		for_each_set_bit(i, &qsmask, BITS_PER_LONG) {
+			/* Fake cores are handled by rcu_report_qs_tardy_cores() */
+			if (i + rnp->grplo >= num_cores)
+				continue;
+			send_kernel_message(i + rnp->grplo, __rcu_kick_kmsg, 0, 0, 0,
+			                    KMSG_ROUTINE);
+		}
+	}
+}
+
 static int root_qsmask_empty(void *arg)
 {
 	struct rcu_state *rsp = arg;
@@ -406,6 +471,19 @@ static int root_qsmask_empty(void *arg)
 	return READ_ONCE(rsp->node[0].qsmask) == 0 ? 1 : 0;
 }
 
+static bool should_expedite(struct rcu_state *rsp)
+{
+	return !rsp->gp_expedited && READ_ONCE(rsp->nr_exp_waiters);
+}
+
+/* We also wake up to kick cores if someone wants this GP expedited. */
+static int gp_done_or_expedite(void *arg)
+{
+	struct rcu_state *rsp = arg;
+
+	return root_qsmask_empty(rsp) || should_expedite(rsp) ? 1 : 0;
+}
+
 static void rcu_run_gp(struct rcu_state *rsp)
 {
 	struct rcu_node *rnp;
@@ -416,6 +494,9 @@ static void rcu_run_gp(struct rcu_state *rsp)
 	 * for a GP.  The previous GP is done, thus all cores reported their GP
 	 * already (for the previous GP), and they won't try again until we
 	 * advertise the next GP. */
+	uint64_t start = nsec(), gp_nsec;
+
+	rsp->gp_expedited = false;
 	rcu_for_each_node_breadth_first(rsp, rnp)
 		rnp->qsmask = rnp->qsmaskinit;
 	/* Need the tree set for reporting QSs before advertising the GP */
@@ -432,7 +513,17 @@ static void rcu_run_gp(struct rcu_state *rsp)
 	 * to halt, pause, we start GP, see they haven't halted, etc.  They could
 	 * report the QS after setting the state, but I didn't want to . */
 	do {
-		rendez_sleep_timeout(&rsp->gp_ktask_rv, root_qsmask_empty, rsp,
+		/* Once per GP, and only if someone is in synchronize_rcu_expedited().
+		 * Kicked cores will check in on their own, and it isn't worth sending
+		 * RKMs to a core that is stuck in a long kthread every period. */
+		if (should_expedite(rsp)) {
+			rsp->gp_expedited = true;
+			rsp->nr_exp_gps++;
+			/* Catch anyone who went idle since we started, then kick */
+			rcu_report_qs_remote_cores(rsp);
+			rcu_kick_tardy_cores(rsp);
+		}
+		rendez_sleep_timeout(&rsp->gp_ktask_rv, gp_done_or_expedite, rsp,
 		                     RCU_GP_TARDY_PERIOD);
 		rcu_report_qs_tardy_cores(rsp);
 	} while (!root_qsmask_empty(rsp));
@@ -440,6 +531,12 @@ static void rcu_run_gp(struct rcu_state *rsp)
 	 * can start running.  But no one should touch the tree til gpnum is
 	 * incremented. */
 	WRITE_ONCE(rsp->completed, rsp->gpnum);
+
+	gp_nsec = nsec() - start;
+	rsp->nr_gps++;
+	rsp->gp_total_nsec += gp_nsec;
+	rsp->gp_max_nsec = MAX(rsp->gp_max_nsec, gp_nsec);
+	rsp->gp_last_nsec = gp_nsec;
 }
 
 static int should_wake_ctl(void *arg)
@@ -453,10 +550,11 @@ static void wake_mgmt_ktasks(struct rcu_state *rsp)
 {
 	struct rcu_pcpui *rpi;
 
-	/* TODO: For each mgmt core */
-	rpi = _PERCPU_VARPTR(rcu_pcpui, 0);
-	rpi->mgmt_ktask_ctl = 1;
-	rendez_wakeup(&rpi->mgmt_ktask_rv);
+	for (int i = 0; i < rcu_nr_mgmt; i++) {
+		rpi = _PERCPU_VARPTR(rcu_pcpui, i);
+		rpi->mgmt_ktask_ctl = 1;
+		rendez_wakeup(&rpi->mgmt_ktask_rv);
+	}
 }
 
 static void rcu_gp_ktask(void *arg)
@@ -464,6 +562,9 @@ static void rcu_gp_ktask(void *arg)
 	struct rcu_state *rsp = arg;
 
 	current_kthread->flags |= KTH_IS_RCU_KTASK;
+#ifdef CONFIG_RCU_OFFLOAD_CBS
+	kthread_set_home_core(0);
+#endif
 	while (1) {
 		rendez_sleep_timeout(&rsp->gp_ktask_rv, should_wake_ctl,
 		                     &rsp->gp_ktask_ctl, RCU_GP_MIN_PERIOD);
@@ -525,6 +626,7 @@ static void run_rcu_cbs(struct rcu_state *rsp, int coreid)
 	 * for this core. */
 	spin_lock_irqsave(&rpi->lock);
 	rpi->nr_cbs -= nr_cbs;
+	rpi->nr_cbs_run += nr_cbs;
 	spin_unlock_irqsave(&rpi->lock);
 }
 
@@ -534,12 +636,16 @@ static void rcu_mgmt_ktask(void *arg)
 	struct rcu_state *rsp = rpi->rsp;
 
 	current_kthread->flags |= KTH_IS_RCU_KTASK;
+#ifdef CONFIG_RCU_OFFLOAD_CBS
+	kthread_set_home_core(rpi->coreid);
+#endif
 	while (1) {
 		rendez_sleep(&rpi->mgmt_ktask_rv, should_wake_ctl,
 		             &rpi->mgmt_ktask_ctl);
 		rpi->mgmt_ktask_ctl = 0;
-		/* TODO: given the number of mgmt kthreads, we need to assign cores */
-		for_each_core(i)
+		/* Each core's CBs are always run by the same ktask, in order, which
+		 * rcu_barrier() relies on. */
+		for (int i = rpi->coreid; i < num_cores; i += rcu_nr_mgmt)
 			run_rcu_cbs(rsp, i);
 	};
 }
@@ -564,8 +670,10 @@ void rcu_init_pcpui(struct rcu_state *rsp, struct rcu_pcpui *rpi, int coreid)
 	rpi->nr_cbs = 0;
 	rpi->gp_acked = rsp->completed;
 
-	/* TODO: For each mgmt core only */
-	if (coreid == 0) {
+	rpi->max_nr_cbs = 0;
+	rpi->nr_cbs_run = 0;
+
+	if (coreid < rcu_nr_mgmt) {
 		rendez_init(&rpi->mgmt_ktask_rv);
 		rpi->mgmt_ktask_ctl = 0;
 	}
@@ -588,15 +696,24 @@ void rcu_init(void)
 {
 	struct rcu_state *rsp = &rcu_state;
 	struct rcu_pcpui *rpi;
+	char *name;
 
+#ifdef CONFIG_RCU_OFFLOAD_CBS
+	rcu_nr_mgmt = MAX(MIN(CONFIG_NR_LL_CORES, num_cores), 1);
+#endif
 	rcu_init_geometry();
 	rcu_init_one(rsp);
 	rcu_init_fake_cores(rsp);
 	rcu_dump_rcu_node_tree(rsp);
 
 	ktask("rcu_gp", rcu_gp_ktask, rsp);
-	/* TODO: For each mgmt core */
-	ktask("rcu_mgmt_0", rcu_mgmt_ktask, _PERCPU_VARPTR(rcu_pcpui, 0));
+	for (int i = 0; i < rcu_nr_mgmt; i++) {
+		/* ktask names aren't copied.  Leaking these is fine. */
+		name = kmalloc(16, MEM_WAIT);
+		snprintf(name, 16, "rcu_mgmt_%d", i);
+		ktask(name, rcu_mgmt_ktask,
+		      _PERCPU_VARPTR(rcu_pcpui, i));
+	}
 
 	/* If we have a call_rcu before percpu_init, we might be using the spot in
 	 * the actual __percpu .section.  We'd be core 0, so that'd be OK, since all
@@ -606,3 +723,24 @@ void rcu_init(void)
 		rpi->booted = true;
 	}
 }
+
+void print_rcu_stats(void)
+{
+	struct rcu_state *rsp = &rcu_state;
+	struct rcu_pcpui *rpi;
+	unsigned long nr_gps = READ_ONCE(rsp->nr_gps);
+
+	printk("RCU: gpnum %lu, completed %lu, %d CB ktasks\n",
+	       READ_ONCE(rsp->gpnum), READ_ONCE(rsp->completed), rcu_nr_mgmt);
+	printk("GPs: %lu, last %llu usec, avg %llu usec, max %llu usec\n", nr_gps,
+	       rsp->gp_last_nsec / 1000,
+	       nr_gps ? rsp->gp_total_nsec / nr_gps / 1000 : 0,
+	       rsp->gp_max_nsec / 1000);
+	printk("Expedited GPs: %lu\n", READ_ONCE(rsp->nr_exp_gps));
+	for_each_core(i) {
+		rpi = _PERCPU_VARPTR(rcu_pcpui, i);
+		printk("\tCore %3d: %5u CBs waiting, max %5u, %lu run by mgmt %d\n",
+		       i, READ_ONCE(rpi->nr_cbs), rpi->max_nr_cbs, rpi->nr_cbs_run,
+		       i % rcu_nr_mgmt);
+	}
+}
@@ -14,6 +14,8 @@ int readline(char *buf, size_t buf_l, const char *prompt, ...)
 	if (prompt != NULL)
 		vcprintf(prompt, ap);
 	va_end(ap);
+	/* we echo with cputchar, which goes straight to the console */
+	printk_flush();
 
 	i = 0;
 	echoing = iscons(0);
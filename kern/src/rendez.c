@@ -18,7 +18,8 @@ void rendez_init(struct rendez *rv)
 	cv_init_irqsave(&rv->cv);
 }
 
-void rendez_sleep(struct rendez *rv, int (*cond)(void*), void *arg)
+static void __rendez_sleep(struct rendez *rv, int (*cond)(void*), void *arg,
+                           bool excl)
 {
 	int8_t irq_state = 0;
 	struct cv_lookup_elm cle;
@@ -42,13 +43,30 @@ void rendez_sleep(struct rendez *rv, int (*cond)(void*), void *arg)
 			dereg_abortable_cv(&cle);
 			error(EINTR, "syscall aborted");
 		}
-		cv_wait(&rv->cv);
+		if (excl)
+			cv_wait_excl(&rv->cv);
+		else
+			cv_wait(&rv->cv);
 		cpu_relax();
 	}
 	cv_unlock_irqsave(&rv->cv, &irq_state);
 	dereg_abortable_cv(&cle);
 }
 
+void rendez_sleep(struct rendez *rv, int (*cond)(void*), void *arg)
+{
+	__rendez_sleep(rv, cond, arg, FALSE);
+}
+
+/* Exclusive sleepers are woken one at a time by rendez_wakeup().  If you get
+ * woken and leave the condition true (e.g. there's still data in a queue), call
+ * rendez_wakeup() to pass it along.  Aborts and rendez_wakeup_all() wake
+ * everyone. */
+void rendez_sleep_excl(struct rendez *rv, int (*cond)(void*), void *arg)
+{
+	__rendez_sleep(rv, cond, arg, TRUE);
+}
+
 /* Force a wakeup of all waiters on the rv, including non-timeout users.  For
  * those, they will just wake up, see the condition is still false (probably)
  * and go back to sleep. */
@@ -57,12 +75,13 @@ static void rendez_alarm_handler(struct alarm_waiter *awaiter,
 {
 	struct rendez *rv = (struct rendez*)awaiter->data;
 
-	rendez_wakeup(rv);
+	rendez_wakeup_all(rv);
 }
 
-/* Like sleep, but it will timeout in 'usec' microseconds. */
-void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
-                          uint64_t usec)
+/* Like sleep, but it will timeout in 'usec' microseconds, give or take
+ * 'slack_usec' (late, never early). */
+void rendez_sleep_timeout_slack(struct rendez *rv, int (*cond)(void*),
+                                void *arg, uint64_t usec, uint64_t slack_usec)
 {
 	int8_t irq_state = 0;
 	struct alarm_waiter awaiter;
@@ -87,6 +106,7 @@ void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
 	init_awaiter_irq(&awaiter, rendez_alarm_handler);
 	awaiter.data = rv;
 	set_awaiter_rel(&awaiter, usec);
+	set_awaiter_slack(&awaiter, slack_usec);
 	/* Set our alarm on this cpu's tchain.  Note that when we sleep in cv_wait,
 	 * we could be migrated, and later on we could be unsetting the alarm
 	 * remotely. */
@@ -114,14 +134,36 @@ void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
 	unset_alarm(pcpui_tchain, &awaiter);
 }
 
+void rendez_sleep_timeout(struct rendez *rv, int (*cond)(void*), void *arg,
+                          uint64_t usec)
+{
+	rendez_sleep_timeout_slack(rv, cond, arg, usec, ALARM_SLACK_SLEEP);
+}
+
 /* plan9 rendez returned a pointer to the proc woken up.  we return "true" if we
  * woke someone up. */
 bool rendez_wakeup(struct rendez *rv)
 {
 	int8_t irq_state = 0;
 	bool ret;
+
 	/* The plan9 style "one sleeper, one waker" could get by with a signal here.
-	 * But we want to make sure all potential waiters are woken up. */
+	 * But we want to make sure all potential waiters are woken up, other than
+	 * the extra exclusive ones. */
+	cv_lock_irqsave(&rv->cv, &irq_state);
+	ret = rv->cv.nr_waiters ? TRUE : FALSE;
+	__cv_wakeup(&rv->cv);
+	cv_unlock_irqsave(&rv->cv, &irq_state);
+	return ret;
+}
+
+/* Wakes everyone, including all of the exclusive sleepers.  Use this when the
+ * condition is true for everyone, like when closing a queue. */
+bool rendez_wakeup_all(struct rendez *rv)
+{
+	int8_t irq_state = 0;
+	bool ret;
+
 	cv_lock_irqsave(&rv->cv, &irq_state);
 	ret = rv->cv.nr_waiters ? TRUE : FALSE;
 	__cv_broadcast(&rv->cv);
@@ -0,0 +1,269 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Resizable, concurrent hash table.  See rhashtable.h.
+ *
+ * Lock ordering: resize_lock -> bucket locks.  When a writer holds two bucket
+ * locks, the older table's is first.
+ *
+ * Who can change a chain:
+ * - inserts only go into a table with no future, under its bucket lock.
+ * - removes unlink under the bucket lock.  A remove that doesn't find the
+ *   object grabs the future table's bucket lock before dropping the old one,
+ *   so the object can't move past it.
+ * - moves hold resize_lock and the old and new bucket locks.
+ *
+ * An insert reads tbl->future with the bucket lock held.  The mover sets the
+ * future before it locks any buckets, so either the insert sees the future, or
+ * the mover hasn't gotten to that bucket yet and will move the new entry. */
+
+#include <rhashtable.h>
+#include <kmalloc.h>
+#include <hash.h>
+#include <assert.h>
+#include <stdio.h>
+
+/* Buckets moved per insert or remove during a resize.  We grow at 3/4 full to
+ * twice the size, so a resize finishes long before the new table fills. */
+#define RHT_MOVE_BATCH			4
+
+static struct rhash_node *obj_node(struct rhashtable *ht, void *obj)
+{
+	return obj + ht->p.node_offset;
+}
+
+static void *node_obj(struct rhashtable *ht, struct rhash_node *n)
+{
+	return (void*)n - ht->p.node_offset;
+}
+
+static struct rhash_bucket *tbl_bucket(struct rhash_tbl *tbl, uint32_t hv)
+{
+	return &tbl->buckets[hash_32(hv, tbl->bits)];
+}
+
+static struct rhash_tbl *rht_tbl_alloc(unsigned int bits, int mem_flags)
+{
+	struct rhash_tbl *tbl;
+
+	tbl = kzmalloc(sizeof(struct rhash_tbl) +
+	               (sizeof(struct rhash_bucket) << bits), mem_flags);
+	if (!tbl)
+		return NULL;
+	tbl->bits = bits;
+	for (int i = 0; i < 1 << bits; i++)
+		spinlock_init(&tbl->buckets[i].lock);
+	return tbl;
+}
+
+static void rht_tbl_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct rhash_tbl, rcu));
+}
+
+void rhashtable_init(struct rhashtable *ht,
+                     const struct rhashtable_params *params)
+{
+	ht->p = *params;
+	if (!ht->p.min_bits)
+		ht->p.min_bits = RHT_DEFAULT_MIN_BITS;
+	if (!ht->p.max_bits)
+		ht->p.max_bits = RHT_DEFAULT_MAX_BITS;
+	assert(ht->p.min_bits <= ht->p.max_bits);
+	ht->tbl = rht_tbl_alloc(ht->p.min_bits, MEM_WAIT);
+	atomic_init(&ht->nr_elems, 0);
+	spinlock_init(&ht->resize_lock);
+}
+
+void rhashtable_destroy(struct rhashtable *ht)
+{
+	struct rhash_tbl *tbl, *next;
+
+	for (tbl = ht->tbl; tbl; tbl = next) {
+		next = tbl->future;
+		kfree(tbl);
+	}
+	ht->tbl = NULL;
+}
+
+/* Returns the log2 size to resize tbl to, or 0 if it's fine. */
+static unsigned int rht_new_bits(struct rhashtable *ht, struct rhash_tbl *tbl)
+{
+	unsigned int nr = atomic_read(&ht->nr_elems);
+	unsigned int size = 1 << tbl->bits;
+
+	if (nr > size / 4 * 3 && tbl->bits < ht->p.max_bits)
+		return tbl->bits + 1;
+	if (nr < size / 8 && tbl->bits > ht->p.min_bits)
+		return tbl->bits - 1;
+	return 0;
+}
+
+/* Moves the entries of bucket i of old into new, tail first.  Hold the
+ * resize_lock. */
+static void rht_move_bucket(struct rhashtable *ht, struct rhash_tbl *old,
+                            struct rhash_tbl *new, unsigned int i)
+{
+	struct rhash_bucket *b = &old->buckets[i];
+	struct rhash_bucket *nb;
+	struct rhash_node *n, **pprev;
+
+	spin_lock(&b->lock);
+	while (b->first) {
+		pprev = &b->first;
+		for (n = b->first; n->next; n = n->next)
+			pprev = &n->next;
+		nb = tbl_bucket(new, ht->p.hash_obj(node_obj(ht, n)));
+		spin_lock(&nb->lock);
+		WRITE_ONCE(n->next, nb->first);
+		rcu_assign_pointer(nb->first, n);
+		spin_unlock(&nb->lock);
+		/* A reader that sees n cut from the old chain must find it in the new
+		 * one.  Pairs with the rmb in rhashtable_lookup(). */
+		wmb();
+		WRITE_ONCE(*pprev, NULL);
+	}
+	spin_unlock(&b->lock);
+}
+
+/* Starts a resize if we need one, and moves a batch of buckets if we're in the
+ * middle of one.  Whoever moves the last bucket swaps in the future table. */
+static void rht_maybe_resize(struct rhashtable *ht)
+{
+	struct rhash_tbl *tbl = READ_ONCE(ht->tbl);
+	struct rhash_tbl *new;
+	unsigned int new_bits;
+
+	/* Cheap check, so writers don't all hit the resize_lock. */
+	if (!READ_ONCE(tbl->future) && !rht_new_bits(ht, tbl))
+		return;
+	/* Someone else is resizing: they or a later writer will get to it. */
+	if (!spin_trylock(&ht->resize_lock))
+		return;
+	tbl = ht->tbl;
+	if (!tbl->future) {
+		new_bits = rht_new_bits(ht, tbl);
+		if (!new_bits)
+			goto out;
+		new = rht_tbl_alloc(new_bits, MEM_ATOMIC);
+		if (!new)
+			goto out;
+		rcu_assign_pointer(tbl->future, new);
+	}
+	for (int i = 0; i < RHT_MOVE_BATCH && tbl->next_to_move < 1 << tbl->bits;
+	     i++)
+		rht_move_bucket(ht, tbl, tbl->future, tbl->next_to_move++);
+	if (tbl->next_to_move == 1 << tbl->bits) {
+		/* Stale readers and writers will find their way to the future. */
+		rcu_assign_pointer(ht->tbl, tbl->future);
+		call_rcu(&tbl->rcu, rht_tbl_free_rcu);
+	}
+out:
+	spin_unlock(&ht->resize_lock);
+}
+
+void rhashtable_insert(struct rhashtable *ht, void *obj)
+{
+	struct rhash_node *n = obj_node(ht, obj);
+	uint32_t hv = ht->p.hash_obj(obj);
+	struct rhash_tbl *tbl, *future;
+	struct rhash_bucket *b;
+
+	rcu_read_lock();
+	tbl = rcu_dereference(ht->tbl);
+	for (;;) {
+		b = tbl_bucket(tbl, hv);
+		spin_lock(&b->lock);
+		future = READ_ONCE(tbl->future);
+		if (!future)
+			break;
+		spin_unlock(&b->lock);
+		tbl = future;
+	}
+	n->next = b->first;
+	rcu_assign_pointer(b->first, n);
+	spin_unlock(&b->lock);
+	rcu_read_unlock();
+	atomic_inc(&ht->nr_elems);
+	rht_maybe_resize(ht);
+}
+
+bool rhashtable_remove(struct rhashtable *ht, void *obj)
+{
+	struct rhash_node *n = obj_node(ht, obj);
+	uint32_t hv = ht->p.hash_obj(obj);
+	struct rhash_tbl *tbl, *future;
+	struct rhash_bucket *b, *fb;
+	struct rhash_node **pprev;
+	bool found = FALSE;
+
+	rcu_read_lock();
+	tbl = rcu_dereference(ht->tbl);
+	b = tbl_bucket(tbl, hv);
+	spin_lock(&b->lock);
+	for (;;) {
+		for (pprev = &b->first; *pprev; pprev = &(*pprev)->next) {
+			if (*pprev == n) {
+				/* n->next stays put for any readers on n. */
+				WRITE_ONCE(*pprev, n->next);
+				found = TRUE;
+				break;
+			}
+		}
+		future = READ_ONCE(tbl->future);
+		if (found || !future)
+			break;
+		fb = tbl_bucket(future, hv);
+		spin_lock(&fb->lock);
+		spin_unlock(&b->lock);
+		b = fb;
+		tbl = future;
+	}
+	spin_unlock(&b->lock);
+	rcu_read_unlock();
+	if (found) {
+		atomic_dec(&ht->nr_elems);
+		rht_maybe_resize(ht);
+	}
+	return found;
+}
+
+void *rhashtable_lookup(struct rhashtable *ht, const void *key)
+{
+	uint32_t hv = ht->p.hash_key(key);
+	struct rhash_tbl *tbl = rcu_dereference(ht->tbl);
+	struct rhash_node *n;
+
+	do {
+		for (n = rcu_dereference(tbl_bucket(tbl, hv)->first); n;
+		     n = rcu_dereference(n->next)) {
+			if (ht->p.key_eq(key, node_obj(ht, n)))
+				return node_obj(ht, n);
+		}
+		/* Pairs with the wmb in rht_move_bucket(). */
+		rmb();
+		tbl = rcu_dereference(tbl->future);
+	} while (tbl);
+	return NULL;
+}
+
+void rhashtable_for_each(struct rhashtable *ht, void (*f)(void *obj, void *arg),
+                         void *arg)
+{
+	struct rhash_tbl *tbl;
+	struct rhash_bucket *b;
+	struct rhash_node *n;
+
+	/* Holding the resize_lock keeps entries from moving between tables. */
+	spin_lock(&ht->resize_lock);
+	for (tbl = ht->tbl; tbl; tbl = tbl->future) {
+		for (int i = 0; i < 1 << tbl->bits; i++) {
+			b = &tbl->buckets[i];
+			spin_lock(&b->lock);
+			for (n = b->first; n; n = n->next)
+				f(node_obj(ht, n), arg);
+			spin_unlock(&b->lock);
+		}
+	}
+	spin_unlock(&ht->resize_lock);
+}
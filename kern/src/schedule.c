@@ -16,12 +16,33 @@
 #include <alarm.h>
 #include <sys/queue.h>
 #include <arsc_server.h>
-#include <hashtable.h>
+#include <latency.h>
+#include <rhashtable.h>
+#include <kmalloc.h>
 
-/* Process Lists.  'unrunnable' is a holding list for SCPs that are running or
- * waiting or otherwise not considered for sched decisions. */
+/* Process Lists.  'unrunnable' is a holding list for SCPs that are new or
+ * waiting or otherwise not considered for sched decisions.  Running SCPs aren't
+ * on a list. */
 struct proc_list unrunnable_scps = TAILQ_HEAD_INITIALIZER(unrunnable_scps);
-struct proc_list runnable_scps = TAILQ_HEAD_INITIALIZER(runnable_scps);
+
+/* Runnable SCPs are on the run queue of one of the LL cores, usually the one
+ * they last ran on, whose cache they warmed.  An LL core with nothing to run
+ * steals from the longest queue.  Each queue has its own lock, so LL cores
+ * don't serialize on the sched lock to pick SCPs.  The queue lock nests inside
+ * the sched lock and proc locks.  You can put p on a queue while holding either
+ * the sched lock or p's lock, which keeps destroy from missing it. */
+struct scp_runq {
+	spinlock_t					lock;
+	struct proc_list			procs;
+	unsigned int				len;
+	uint64_t					nr_steals;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct scp_runq *scp_runqs;
+static unsigned int nr_scp_runqs;
+
+/* A waking SCP goes elsewhere if its home queue is this much longer */
+#define SCP_AFFINITY_SLACK 2
 /* mcp lists.  we actually could get by with one list and a TAILQ_CONCAT, but
  * I'm expecting to want the flexibility of the pointers later. */
 struct proc_list all_mcps_1 = TAILQ_HEAD_INITIALIZER(all_mcps_1);
@@ -37,6 +58,7 @@ static void switch_lists(struct proc *p, struct proc_list *old,
                          struct proc_list *new);
 static void __run_mcp_ksched(void *arg);	/* don't call directly */
 static uint32_t get_cores_needed(struct proc *p);
+static bool __schedule_scp(void);
 
 /* Locks / sync tools */
 
@@ -66,17 +88,115 @@ struct poke_tracker ksched_poker = POKE_INITIALIZER(__run_mcp_ksched);
 //spinlock_t alloc_lock = SPINLOCK_INITIALIZER;
 spinlock_t sched_lock = SPINLOCK_INITIALIZER;
 
-/* Alarm struct, for our example 'timer tick' */
-struct alarm_waiter ksched_waiter;
+/* Per-LL-core ticks.  Core 0's also runs the MCP ksched.  The ticks only
+ * round-robin SCPs and back up the event-driven MCP ksched, so an LL core with
+ * nothing to round-robin (and for core 0, no MCPs) stops its tick, and whoever
+ * gives it work restarts it.  An idle core with no alarms then takes no timer
+ * IRQs at all, and can sleep deeply.  Only the core itself sets 'stopped';
+ * whoever clears it rearms the tick. */
+struct ll_tick {
+	struct alarm_waiter			waiter;
+	atomic_t					stopped;
+};
+static struct ll_tick *ll_ticks;
+static int nr_mcps;
 
 #define TIMER_TICK_USEC 10000 	/* 10msec */
 
+/* Core requests are handled when they are made (poke_ksched(), wakeups) or when
+ * cores free up, not on the tick.  The tick is a backstop, and for SCP
+ * round-robin and preemption decisions.  MCPs we couldn't satisfy are
+ * 'starved': when cores come back, we kick the ksched to run soon, but only if
+ * there are any. */
+static int nr_starved_mcps;
+static atomic_t ksched_kick_pending;
+
+/* Core shares.  Each MCP is guaranteed its min_cores, and the rest of the CG
+ * cores are split by weight; that's its share.  An MCP can take more than its
+ * share when no one else is starved.  A latency-critical MCP under its share
+ * can take cores away from batch MCPs over their guarantee, by provisioning
+ * them to itself.  Protected by the sched lock. */
+static uint32_t nr_cg_cores;
+static uint32_t total_min_cores;
+
+/* Preemption notices.  When we want a core back from an MCP, we can warn it
+ * (EV_PREEMPT_PENDING) and give it preempt_notice_usec to yield, instead of
+ * preempting it outright.  The alarm preempts it if it doesn't.  Whoever wants
+ * the core is starved meanwhile, so it gets kicked when the core comes back.
+ * One notice per pcore, protected by the sched lock. */
+struct preempt_notice {
+	struct alarm_waiter			waiter;
+	uint64_t					deadline;
+	bool						pending;
+	bool						armed;
+};
+static struct preempt_notice *preempt_notices;
+static uint64_t preempt_notice_usec;
+static uint64_t nr_clean_reclaims;
+static uint64_t nr_forced_reclaims;
+
+/* Histogram of request-to-grant latencies, bucket i is < 2^i usec */
+#define KSCHED_LAT_BUCKETS 20
+static uint64_t ksched_lat_hist[KSCHED_LAT_BUCKETS];
+
 /* Helper: Sets up a timer tick on the calling core to go off 10 msec from now.
  * This assumes the calling core is an LL core, etc. */
-static void set_ksched_alarm(void)
+static void set_ll_tick(void)
 {
-	set_awaiter_rel(&ksched_waiter, TIMER_TICK_USEC);
-	set_alarm(&per_cpu_info[core_id()].tchain, &ksched_waiter);
+	struct alarm_waiter *waiter = &ll_ticks[core_id()].waiter;
+
+	set_awaiter_rel(waiter, TIMER_TICK_USEC);
+	set_alarm(&per_cpu_info[core_id()].tchain, waiter);
+}
+
+/* Whether coreid's tick has anything to do.  Racy reads; see ll_tick_rearm(). */
+static bool ll_tick_needed(uint32_t coreid)
+{
+#ifdef CONFIG_TICKLESS_IDLE
+	if (scp_runqs[coreid].len)
+		return TRUE;
+	return !coreid && nr_mcps;
+#else
+	return TRUE;
+#endif
+}
+
+/* Called at the end of the calling core's tick: rearm it, or stop it if there's
+ * nothing to tick for.  We set stopped before rechecking, so anyone who gave us
+ * work after our check will see it and restart us. */
+static void ll_tick_rearm(void)
+{
+	uint32_t coreid = core_id();
+	struct ll_tick *tick = &ll_ticks[coreid];
+
+	if (!ll_tick_needed(coreid)) {
+		atomic_set(&tick->stopped, TRUE);
+		mb();
+		if (!ll_tick_needed(coreid))
+			return;
+		/* Someone else may have already restarted us */
+		if (!atomic_swap(&tick->stopped, FALSE))
+			return;
+	}
+	set_ll_tick();
+}
+
+static void __restart_ll_tick(uint32_t srcid, long a0, long a1, long a2)
+{
+	set_ll_tick();
+}
+
+/* Restarts coreid's tick, if it stopped.  Call after giving it work. */
+static void ll_tick_kick(uint32_t coreid)
+{
+	/* Order our work before the peek, pairs with the mb in ll_tick_rearm() */
+	mb();
+	if (!atomic_read(&ll_ticks[coreid].stopped))
+		return;
+	if (!atomic_swap(&ll_ticks[coreid].stopped, FALSE))
+		return;
+	/* Alarms are set on the local core, so the target has to do it */
+	send_kernel_message(coreid, __restart_ll_tick, 0, 0, 0, KMSG_ROUTINE);
 }
 
 /* Need a kmsg to just run the sched, but not to rearm */
@@ -85,6 +205,63 @@ static void __just_sched(uint32_t srcid, long a0, long a1, long a2)
 	run_scheduler();
 }
 
+static void __preempt_notice_expired(struct alarm_waiter *waiter);
+
+static void __kick_mcp_ksched(uint32_t srcid, long a0, long a1, long a2)
+{
+	atomic_set(&ksched_kick_pending, FALSE);
+	poke(&ksched_poker, 0);
+	ll_tick_kick(0);
+}
+
+/* Runs the MCP ksched soon, for callers that can't run it themselves, such as
+ * when they hold a proc lock.  At most one kick is in flight at a time. */
+static void kick_mcp_ksched(void)
+{
+	if (atomic_swap(&ksched_kick_pending, TRUE))
+		return;
+	send_kernel_message(0, __kick_mcp_ksched, 0, 0, 0, KMSG_ROUTINE);
+}
+
+/* Notes that p has asked for cores.  Only the oldest unmet request counts.
+ * This is racy, but at worst we'll mismeasure a request. */
+static void note_core_request(struct proc *p)
+{
+	if (!p->ksched_data.req_tsc)
+		p->ksched_data.req_tsc = read_tsc();
+}
+
+/* Sched lock is held */
+static void __set_starved(struct proc *p, bool starved)
+{
+	if (p->ksched_data.starved == starved)
+		return;
+	p->ksched_data.starved = starved;
+	nr_starved_mcps += starved ? 1 : -1;
+}
+
+/* Sched lock is held.  p doesn't want any more cores. */
+static void __clear_core_request(struct proc *p)
+{
+	p->ksched_data.req_tsc = 0;
+	__set_starved(p, FALSE);
+}
+
+/* Sched lock is held.  p just got some cores. */
+static void __note_core_grant(struct proc *p)
+{
+	uint64_t tsc = p->ksched_data.req_tsc;
+	uint64_t usec;
+	int bucket;
+
+	if (!tsc)
+		return;
+	p->ksched_data.req_tsc = 0;
+	usec = tsc2usec(read_tsc() - tsc);
+	bucket = usec ? LOG2_DOWN(usec) + 1 : 0;
+	ksched_lat_hist[MIN(bucket, KSCHED_LAT_BUCKETS - 1)]++;
+}
+
 /* RKM alarm, to run the scheduler tick (not in interrupt context) and reset the
  * alarm.  Note that interrupts will be disabled, but this is not the same as
  * interrupt context.  We're a routine kmsg, which means the core is in a
@@ -98,17 +275,51 @@ static void __ksched_tick(struct alarm_waiter *waiter)
 	 * we'll actually punish the next process because the kernel took too long
 	 * for the previous process.  Ultimately, if we really care, we should
 	 * account for the actual time used. */
-	set_awaiter_rel(&ksched_waiter, TIMER_TICK_USEC);
-	set_alarm(&per_cpu_info[core_id()].tchain, &ksched_waiter);
+	ll_tick_rearm();
+}
+
+/* RKM alarm for LL cores other than core 0, which only need to round-robin
+ * their SCPs.  Core 0's tick does that and the MCP ksched. */
+static void __scp_tick(struct alarm_waiter *waiter)
+{
+	__schedule_scp();
+	ll_tick_rearm();
+}
+
+static void scp_runqs_init(void)
+{
+	nr_scp_runqs = MIN(CONFIG_NR_LL_CORES, num_cores);
+	scp_runqs = kzmalloc(sizeof(struct scp_runq) * nr_scp_runqs, MEM_WAIT);
+	ll_ticks = kzmalloc(sizeof(struct ll_tick) * nr_scp_runqs, MEM_WAIT);
+	for (int i = 0; i < nr_scp_runqs; i++) {
+		spinlock_init(&scp_runqs[i].lock);
+		TAILQ_INIT(&scp_runqs[i].procs);
+		init_awaiter(&ll_ticks[i].waiter, i ? __scp_tick : __ksched_tick);
+		if (i)
+			send_kernel_message(i, __restart_ll_tick, 0, 0, 0, KMSG_ROUTINE);
+	}
 }
 
 void schedule_init(void)
 {
+	scp_runqs_init();
+	preempt_notices = kzmalloc(sizeof(struct preempt_notice) * num_cores,
+	                           MEM_WAIT);
+	for (int i = 0; i < num_cores; i++)
+		init_awaiter(&preempt_notices[i].waiter, __preempt_notice_expired);
 	spin_lock(&sched_lock);
 	assert(!core_id());		/* want the alarm on core0 for now */
-	init_awaiter(&ksched_waiter, __ksched_tick);
-	set_ksched_alarm();
+	set_ll_tick();
 	corealloc_init();
+	for (int i = 0; i < num_cores; i++) {
+		if (is_ll_core(i))
+			continue;
+#ifdef CONFIG_DISABLE_SMT
+		if (i % 2 == 1)
+			continue;
+#endif /* CONFIG_DISABLE_SMT */
+		nr_cg_cores++;
+	}
 	spin_unlock(&sched_lock);
 
 #ifdef CONFIG_ARSC_SERVER
@@ -144,9 +355,109 @@ static void switch_lists(struct proc *p, struct proc_list *old,
 	add_to_list(p, new);
 }
 
+/* Helper: puts p on coreid's run queue.  Hold the sched lock or p's lock. */
+static void scp_runq_push(struct proc *p, uint32_t coreid)
+{
+	struct scp_runq *rq = &scp_runqs[coreid];
+
+	spin_lock(&rq->lock);
+	add_to_list(p, &rq->procs);
+	p->ksched_data.scp_runq = rq;
+	rq->len++;
+	spin_unlock(&rq->lock);
+	ll_tick_kick(coreid);
+}
+
+static void __scp_runq_remove(struct scp_runq *rq, struct proc *p)
+{
+	remove_from_list(p, &rq->procs);
+	p->ksched_data.scp_runq = NULL;
+	rq->len--;
+}
+
+/* Helper: takes the next SCP for coreid to run, stealing one if coreid has
+ * none.  Returns it with a ref, or NULL. */
+static struct proc *scp_runq_pop(uint32_t coreid)
+{
+	struct scp_runq *rq = &scp_runqs[coreid];
+	struct proc *p;
+	int victim = -1;
+	unsigned int victim_len = 0;
+
+	spin_lock(&rq->lock);
+	p = TAILQ_FIRST(&rq->procs);
+	if (p) {
+		__scp_runq_remove(rq, p);
+		/* Destroy would have to take it off our queue before it drops the
+		 * ksched's ref, so we can get our own. */
+		proc_incref(p, 1);
+	}
+	spin_unlock(&rq->lock);
+	if (p)
+		return p;
+	/* Unlocked peeks; we'll recheck */
+	for (int i = 0; i < nr_scp_runqs; i++) {
+		if (scp_runqs[i].len > victim_len) {
+			victim = i;
+			victim_len = scp_runqs[i].len;
+		}
+	}
+	if (victim < 0)
+		return NULL;
+	rq = &scp_runqs[victim];
+	spin_lock(&rq->lock);
+	/* The tail is the one that would have waited the longest */
+	p = TAILQ_LAST(&rq->procs, proc_list);
+	if (p) {
+		__scp_runq_remove(rq, p);
+		proc_incref(p, 1);
+		scp_runqs[coreid].nr_steals++;
+	}
+	spin_unlock(&rq->lock);
+	return p;
+}
+
+static bool scp_runqs_empty(void)
+{
+	for (int i = 0; i < nr_scp_runqs; i++) {
+		if (scp_runqs[i].len)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Picks the run queue for a waking SCP: where it last ran, unless that queue is
+ * a lot longer than the shortest one. */
+static uint32_t scp_pick_core(struct proc *p)
+{
+	uint32_t home = p->ksched_data.scp_core;
+	uint32_t best = 0;
+
+	for (int i = 1; i < nr_scp_runqs; i++) {
+		if (scp_runqs[i].len < scp_runqs[best].len)
+			best = i;
+	}
+	if (home >= nr_scp_runqs)
+		return best;
+	if (scp_runqs[home].len > scp_runqs[best].len + SCP_AFFINITY_SLACK)
+		return best;
+	return home;
+}
+
 /* Removes from whatever list p is on */
 static void remove_from_any_list(struct proc *p)
 {
+	struct scp_runq *rq = p->ksched_data.scp_runq;
+
+	/* Could race with an LL core popping p, so recheck under the lock.  No one
+	 * can push p concurrently; see struct scp_runq. */
+	if (rq) {
+		spin_lock(&rq->lock);
+		if (p->ksched_data.scp_runq == rq)
+			__scp_runq_remove(rq, p);
+		spin_unlock(&rq->lock);
+		return;
+	}
 	if (p->ksched_data.cur_list) {
 		TAILQ_REMOVE(p->ksched_data.cur_list, p, ksched_data.proc_link);
 		p->ksched_data.cur_list = 0;
@@ -168,8 +479,12 @@ void __sched_proc_register(struct proc *p)
 	assert(!proc_is_dying(p));		/* shouldn't be able to happen yet */
 	/* one ref for the proc's existence, cradle-to-grave */
 	proc_incref(p, 1);	/* need at least this OR the 'one for existing' */
-	spin_lock(&sched_lock);
+	/* p isn't on any of our lists yet, and this might block */
 	corealloc_proc_init(p);
+	p->ksched_data.scp_core = -1;
+	p->ksched_data.class = KSCHED_CLASS_BATCH;
+	p->ksched_data.weight = 1;
+	spin_lock(&sched_lock);
 	add_to_list(p, &unrunnable_scps);
 	spin_unlock(&sched_lock);
 }
@@ -190,13 +505,16 @@ void __sched_proc_change_to_m(struct proc *p)
 		printk("[kernel] process needs to specify amt_wanted\n");
 		p->procdata->res_req[RES_CORES].amt_wanted = 1;
 	}
-	/* For now, this should only ever be called on an unrunnable.  It's
-	 * probably a bug, at this stage in development, to do o/w. */
-	remove_from_list(p, &unrunnable_scps);
-	//remove_from_any_list(p); 	/* ^^ instead of this */
+	/* p was running as an SCP, so it shouldn't be on a list, but be safe */
+	remove_from_any_list(p);
 	add_to_list(p, primary_mcps);
+	p->ksched_data.mcp_counted = TRUE;
+	nr_mcps++;
 	spin_unlock(&sched_lock);
-	//poke_ksched(p, RES_CORES);
+	/* We're in the middle of p's change_to_m syscall, which isn't a good place
+	 * to give p its cores.  Have the ksched do it right after. */
+	note_core_request(p);
+	kick_mcp_ksched();
 }
 
 /* Sched callback called when the proc dies.  pc_arr holds the cores the proc
@@ -214,9 +532,20 @@ void __sched_proc_destroy(struct proc *p, uint32_t *pc_arr, uint32_t nr_cores)
 	/* Remove from whatever list we are on (if any - might not be on one if it
 	 * was in the middle of __run_mcp_sched) */
 	remove_from_any_list(p);
+	__set_starved(p, FALSE);
+	if (p->ksched_data.mcp_counted) {
+		p->ksched_data.mcp_counted = FALSE;
+		nr_mcps--;
+	}
+	total_min_cores -= p->ksched_data.min_cores;
+	p->ksched_data.min_cores = 0;
+	for (int i = 0; i < nr_cores; i++)
+		preempt_notices[pc_arr[i]].pending = FALSE;
 	if (nr_cores)
 		__track_core_dealloc_bulk(p, pc_arr, nr_cores);
 	spin_unlock(&sched_lock);
+	if (nr_cores && nr_starved_mcps)
+		kick_mcp_ksched();
 	/* Drop the cradle-to-the-grave reference, jet-li */
 	proc_decref(p);
 }
@@ -230,14 +559,18 @@ void __sched_mcp_wakeup(struct proc *p)
 		return;
 	}
 	/* could try and prioritize p somehow (move it to the front of the list). */
+	p->ksched_data.wakeup_tsc = read_tsc();
 	spin_unlock(&sched_lock);
 	/* note they could be dying at this point too. */
+	note_core_request(p);
 	poke(&ksched_poker, p);
 }
 
 /* ksched callbacks.  p just woke up and is UNLOCKED. */
 void __sched_scp_wakeup(struct proc *p)
 {
+	uint32_t coreid;
+
 	spin_lock(&sched_lock);
 	if (proc_is_dying(p)) {
 		spin_unlock(&sched_lock);
@@ -245,20 +578,25 @@ void __sched_scp_wakeup(struct proc *p)
 	}
 	/* might not be on a list if it is new.  o/w, it should be unrunnable */
 	remove_from_any_list(p);
-	add_to_list(p, &runnable_scps);
+	p->ksched_data.wakeup_tsc = read_tsc();
+	coreid = scp_pick_core(p);
+	scp_runq_push(p, coreid);
 	spin_unlock(&sched_lock);
-	/* we could be on a CG core, and all the mgmt cores could be halted.  if we
-	 * don't tell one of them about the new proc, they will sleep until the
-	 * timer tick goes off. */
-	if (!management_core()) {
-		/* TODO: pick a better core and only send if halted.
-		 *
-		 * ideally, we'd know if a specific mgmt core is sleeping and wake it
-		 * up.  o/w, we could interrupt an already-running mgmt core that won't
-		 * get to our new proc anytime soon.  also, by poking core 0, a
-		 * different mgmt core could remain idle (and this process would sleep)
-		 * until its tick goes off */
-		send_ipi(0, I_POKE_CORE);
+	/* the LL core could be halted.  if we don't tell it about the new proc, it
+	 * will sleep until its timer tick goes off.
+	 *
+	 * TODO: only send if halted.  o/w, we could interrupt an already-running
+	 * LL core that won't get to our new proc anytime soon. */
+	if (coreid != core_id())
+		send_ipi(coreid, I_POKE_CORE);
+}
+
+/* Sched lock is held.  If we had asked for pcoreid back, its MCP obliged. */
+static void __note_yield(uint32_t pcoreid)
+{
+	if (preempt_notices[pcoreid].pending) {
+		preempt_notices[pcoreid].pending = FALSE;
+		nr_clean_reclaims++;
 	}
 }
 
@@ -269,72 +607,98 @@ void __sched_scp_wakeup(struct proc *p)
  * a scheduling decision (or at least plan to). */
 void __sched_put_idle_core(struct proc *p, uint32_t coreid)
 {
+	bool kick;
+
 	spin_lock(&sched_lock);
+	__note_yield(coreid);
 	__track_core_dealloc(p, coreid);
+	kick = nr_starved_mcps;
 	spin_unlock(&sched_lock);
+	/* Someone is waiting for a core; don't make them wait for the tick. */
+	if (kick)
+		kick_mcp_ksched();
 }
 
 /* Callback, bulk interface for put_idle. The proclock is held for this. */
 void __sched_put_idle_cores(struct proc *p, uint32_t *pc_arr, uint32_t num)
 {
+	bool kick;
+
 	spin_lock(&sched_lock);
+	for (int i = 0; i < num; i++)
+		__note_yield(pc_arr[i]);
 	__track_core_dealloc_bulk(p, pc_arr, num);
+	kick = nr_starved_mcps;
 	spin_unlock(&sched_lock);
-	/* could trigger a sched decision here */
+	if (kick)
+		kick_mcp_ksched();
+}
+
+/* Helper: a proc we popped can't run.  Put it back, unless it is dying. */
+static void scp_requeue(struct proc *p, uint32_t coreid)
+{
+	spin_lock(&p->proc_lock);
+	if (!proc_is_dying(p))
+		scp_runq_push(p, coreid);
+	spin_unlock(&p->proc_lock);
+	proc_decref(p);
 }
 
 /* mgmt/LL cores should call this to schedule the calling core and give it to an
- * SCP.  will also prune the dead SCPs from the list.  hold the lock before
- * calling.  returns TRUE if it scheduled a proc. */
+ * SCP.  No need for the sched lock.  returns TRUE if it scheduled a proc. */
 static bool __schedule_scp(void)
 {
-	// TODO: sort out lock ordering (proc_run_s also locks)
-	struct proc *p;
+	struct proc *p, *owner;
 	uint32_t pcoreid = core_id();
 	struct per_cpu_info *pcpui = &per_cpu_info[pcoreid];
+
+	if (pcoreid >= nr_scp_runqs || scp_runqs_empty())
+		return FALSE;
+	p = scp_runq_pop(pcoreid);
+	if (!p)
+		return FALSE;
 	/* if there are any runnables, run them here and put any currently running
-	 * SCP on the tail of the runnable queue. */
-	if ((p = TAILQ_FIRST(&runnable_scps))) {
-		/* someone is currently running, dequeue them */
-		if (pcpui->owning_proc) {
-			spin_lock(&pcpui->owning_proc->proc_lock);
-			/* process might be dying, with a KMSG to clean it up waiting on
-			 * this core.  can't do much, so we'll attempt to restart */
-			if (proc_is_dying(pcpui->owning_proc)) {
-				send_kernel_message(core_id(), __just_sched, 0, 0, 0,
-				                    KMSG_ROUTINE);
-				spin_unlock(&pcpui->owning_proc->proc_lock);
-				return FALSE;
-			}
-			printd("Descheduled %d in favor of %d\n", pcpui->owning_proc->pid,
-			       p->pid);
-			__proc_set_state(pcpui->owning_proc, PROC_RUNNABLE_S);
-			/* Saving FP state aggressively.  Odds are, the SCP was hit by an
-			 * IRQ and has a HW ctx, in which case we must save. */
-			__proc_save_fpu_s(pcpui->owning_proc);
-			__proc_save_context_s(pcpui->owning_proc);
-			vcore_account_offline(pcpui->owning_proc, 0);
-			__seq_start_write(&p->procinfo->coremap_seqctr);
-			__unmap_vcore(p, 0);
-			__seq_end_write(&p->procinfo->coremap_seqctr);
-			spin_unlock(&pcpui->owning_proc->proc_lock);
-			/* round-robin the SCPs (inserts at the end of the queue) */
-			switch_lists(pcpui->owning_proc, &unrunnable_scps, &runnable_scps);
-			clear_owning_proc(pcoreid);
-			/* Note we abandon core.  It's not strictly necessary.  If
-			 * we didn't, the TLB would still be loaded with the old
-			 * one, til we proc_run_s, and the various paths in
-			 * proc_run_s would pick it up.  This way is a bit safer for
-			 * future changes, but has an extra (empty) TLB flush.  */
-			abandon_core();
+	 * SCP on the tail of our run queue. */
+	owner = pcpui->owning_proc;
+	if (owner) {
+		spin_lock(&owner->proc_lock);
+		/* process might be dying, with a KMSG to clean it up waiting on this
+		 * core.  can't do much, so we'll attempt to restart */
+		if (proc_is_dying(owner)) {
+			send_kernel_message(core_id(), __just_sched, 0, 0, 0,
+			                    KMSG_ROUTINE);
+			spin_unlock(&owner->proc_lock);
+			scp_requeue(p, pcoreid);
+			return FALSE;
 		}
-		/* Run the new proc */
-		switch_lists(p, &runnable_scps, &unrunnable_scps);
-		printd("PID of the SCP i'm running: %d\n", p->pid);
-		proc_run_s(p);	/* gives it core we're running on */
-		return TRUE;
+		printd("Descheduled %d in favor of %d\n", owner->pid, p->pid);
+		__proc_set_state(owner, PROC_RUNNABLE_S);
+		/* Saving FP state aggressively.  Odds are, the SCP was hit by an
+		 * IRQ and has a HW ctx, in which case we must save. */
+		__proc_save_fpu_s(owner);
+		__proc_save_context_s(owner);
+		vcore_account_offline(owner, 0);
+		__seq_start_write(&owner->procinfo->coremap_seqctr);
+		__unmap_vcore(owner, 0);
+		__seq_end_write(&owner->procinfo->coremap_seqctr);
+		/* round-robin the SCPs (inserts at the end of the queue).  It's still
+		 * warm here. */
+		scp_runq_push(owner, pcoreid);
+		spin_unlock(&owner->proc_lock);
+		clear_owning_proc(pcoreid);
+		/* Note we abandon core.  It's not strictly necessary.  If
+		 * we didn't, the TLB would still be loaded with the old
+		 * one, til we proc_run_s, and the various paths in
+		 * proc_run_s would pick it up.  This way is a bit safer for
+		 * future changes, but has an extra (empty) TLB flush.  */
+		abandon_core();
 	}
-	return FALSE;
+	/* Run the new proc */
+	printd("PID of the SCP i'm running: %d\n", p->pid);
+	p->ksched_data.scp_core = pcoreid;
+	proc_run_s(p);	/* gives it core we're running on */
+	proc_decref(p);
+	return TRUE;
 }
 
 /* Returns how many new cores p needs.  This doesn't lock the proc, so your
@@ -397,11 +761,13 @@ static void __run_mcp_ksched(void *arg)
 	while (!TAILQ_EMPTY(primary_mcps)) {
 		TAILQ_FOREACH_SAFE(p, primary_mcps, ksched_data.proc_link, temp) {
 			if (p->state == PROC_WAITING) {	/* unlocked peek at the state */
+				__clear_core_request(p);
 				switch_lists(p, primary_mcps, secondary_mcps);
 				continue;
 			}
 			amt_needed = get_cores_needed(p);
 			if (!amt_needed) {
+				__clear_core_request(p);
 				switch_lists(p, primary_mcps, secondary_mcps);
 				continue;
 			}
@@ -449,11 +815,8 @@ void run_scheduler(void)
 	/* MCP scheduling: post work, then poke.  for now, i just want the func to
 	 * run again, so merely a poke is sufficient. */
 	poke(&ksched_poker, 0);
-	if (management_core()) {
-		spin_lock(&sched_lock);
+	if (management_core())
 		__schedule_scp();
-		spin_unlock(&sched_lock);
-	}
 }
 
 /* A process is asking the ksched to look at its resource desires.  The
@@ -465,6 +828,7 @@ void poke_ksched(struct proc *p, unsigned int res_type)
 	 * other structs/flags) */
 	if (!__proc_is_mcp(p))
 		return;
+	note_core_request(p);
 	poke(&ksched_poker, p);
 }
 
@@ -477,9 +841,7 @@ void cpu_bored(void)
 	bool new_proc = FALSE;
 	if (!management_core())
 		return;
-	spin_lock(&sched_lock);
 	new_proc = __schedule_scp();
-	spin_unlock(&sched_lock);
 	/* if we just scheduled a proc, we need to manually restart it, instead of
 	 * returning.  if we return, the core will halt. */
 	if (new_proc) {
@@ -496,7 +858,9 @@ void cpu_bored(void)
  * inappropriate, since we need to know which specific core is now free. */
 void avail_res_changed(int res_type, long change)
 {
-	printk("[kernel] ksched doesn't track any resources yet!\n");
+	/* The only resource we know about is cores: more might satisfy someone */
+	if (res_type == RES_CORES && change > 0 && nr_starved_mcps)
+		kick_mcp_ksched();
 }
 
 /* This deals with a request for more cores.  The amt of new cores needed is
@@ -508,6 +872,175 @@ void avail_res_changed(int res_type, long change)
  * alarmed cores on a list and wait til the alarm goes off to do the full
  * preempt.  and when those cores come in voluntarily, we'd need to know to
  * give them to this proc. */
+/* Helper: calls f on every MCP, including p, which the ksched took off the
+ * lists while it works on it. */
+static void __for_each_mcp(struct proc *p, void (*f)(struct proc *, void *),
+                           void *arg)
+{
+	struct proc *q;
+
+	f(p, arg);
+	TAILQ_FOREACH(q, primary_mcps, ksched_data.proc_link)
+		f(q, arg);
+	TAILQ_FOREACH(q, secondary_mcps, ksched_data.proc_link)
+		f(q, arg);
+}
+
+static void __sum_weight(struct proc *q, void *arg)
+{
+	if (q->state != PROC_WAITING)
+		*(uint64_t*)arg += q->ksched_data.weight;
+}
+
+/* Returns q's share of the cores, with p being the MCP we are working on, i.e.
+ * its guarantee plus its weighted part of the cores no one is guaranteed.
+ * Waiting MCPs don't get a part. */
+static uint32_t __core_share(struct proc *p, struct proc *q)
+{
+	uint64_t total_weight = 0;
+	uint32_t rest = nr_cg_cores - MIN(total_min_cores, nr_cg_cores);
+
+	__for_each_mcp(p, __sum_weight, &total_weight);
+	if (!total_weight)
+		return q->ksched_data.min_cores;
+	return q->ksched_data.min_cores +
+	       rest * q->ksched_data.weight / total_weight;
+}
+
+static uint32_t cores_granted(struct proc *p)
+{
+	return p->procinfo->res_grant[RES_CORES];
+}
+
+struct victim_search {
+	struct proc *p;
+	struct proc *victim;
+	uint32_t victim_excess;
+};
+
+static void __consider_victim(struct proc *q, void *arg)
+{
+	struct victim_search *vs = arg;
+	uint32_t granted = cores_granted(q);
+
+	if (q == vs->p || q->ksched_data.class != KSCHED_CLASS_BATCH)
+		return;
+	if (proc_is_dying(q) || granted <= q->ksched_data.min_cores)
+		return;
+	if (granted - q->ksched_data.min_cores > vs->victim_excess) {
+		vs->victim = q;
+		vs->victim_excess = granted - q->ksched_data.min_cores;
+	}
+}
+
+/* p is out of idle cores and has nr_pending more on the way.  If p is
+ * latency-critical and under its share, provision it a core from the batch MCP
+ * that is the furthest over its guarantee, so the caller will preempt it.
+ * Returns TRUE if it did. */
+static bool __reclaim_batch_core(struct proc *p, uint32_t nr_pending)
+{
+	struct victim_search vs = {.p = p};
+
+	if (p->ksched_data.class != KSCHED_CLASS_LC)
+		return FALSE;
+	if (cores_granted(p) + nr_pending >= __core_share(p, p))
+		return FALSE;
+	__for_each_mcp(p, __consider_victim, &vs);
+	if (!vs.victim)
+		return FALSE;
+	for (int i = 0; i < num_cores; i++) {
+		/* Leave cores the victim provisioned for itself */
+		if (get_alloc_proc(i) == vs.victim && get_prov_proc(i) != vs.victim) {
+			__provision_core(p, i);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Caps amt_needed at p's share, if anyone else is waiting on cores. */
+static uint32_t __limit_to_share(struct proc *p, uint32_t amt_needed)
+{
+	uint32_t share, granted;
+
+	if (nr_starved_mcps - p->ksched_data.starved == 0)
+		return amt_needed;
+	share = __core_share(p, p);
+	granted = cores_granted(p);
+	if (granted >= share)
+		return 0;
+	return MIN(amt_needed, share - granted);
+}
+
+/* Sched lock is held, and we'll unlock it to warn q.  Asks q to yield pcoreid
+ * within the notice period. */
+static void __preempt_with_notice(struct proc *q, uint32_t pcoreid)
+{
+	struct preempt_notice *n = &preempt_notices[pcoreid];
+
+	/* Already asked; the alarm will take care of it */
+	if (n->pending)
+		return;
+	n->pending = TRUE;
+	n->deadline = read_tsc() + usec2tsc(preempt_notice_usec);
+	/* If the alarm is still armed from an older notice, it'll rearm itself
+	 * for the new deadline. */
+	if (!n->armed) {
+		n->armed = TRUE;
+		set_awaiter_abs(&n->waiter, n->deadline);
+		set_alarm(&per_cpu_info[core_id()].tchain, &n->waiter);
+	}
+	proc_incref(q, 1);
+	spin_unlock(&sched_lock);
+	proc_preempt_warn_core(q, pcoreid, preempt_notice_usec);
+	spin_lock(&sched_lock);
+	proc_decref(q);
+}
+
+/* RKM alarm: an MCP didn't yield a core in time, so we take it. */
+static void __preempt_notice_expired(struct alarm_waiter *waiter)
+{
+	struct preempt_notice *n = container_of(waiter, struct preempt_notice,
+	                                        waiter);
+	uint32_t pcoreid = n - preempt_notices;
+	struct proc *q;
+	bool success;
+
+	spin_lock(&sched_lock);
+	if (n->pending && read_tsc() < n->deadline) {
+		set_awaiter_abs(waiter, n->deadline);
+		set_alarm(&per_cpu_info[core_id()].tchain, waiter);
+		spin_unlock(&sched_lock);
+		return;
+	}
+	n->armed = FALSE;
+	if (!n->pending) {
+		spin_unlock(&sched_lock);
+		return;
+	}
+	n->pending = FALSE;
+	q = get_alloc_proc(pcoreid);
+	/* If the core is idle or its owner is now its prov_proc, the ksched will
+	 * sort it out. */
+	if (!q || !get_prov_proc(pcoreid) || get_prov_proc(pcoreid) == q) {
+		spin_unlock(&sched_lock);
+		return;
+	}
+	/* q is valid while it has the core, and needs a ref once we unlock */
+	proc_incref(q, 1);
+	spin_unlock(&sched_lock);
+	success = proc_preempt_core(q, pcoreid, 0);
+	spin_lock(&sched_lock);
+	/* If we failed, q is yielding or dying, and will put the core back. */
+	if (success) {
+		__track_core_dealloc(q, pcoreid);
+		nr_forced_reclaims++;
+	}
+	spin_unlock(&sched_lock);
+	proc_decref(q);
+	kick_mcp_ksched();
+}
+
 static void __core_request(struct proc *p, uint32_t amt_needed)
 {
 	uint32_t nr_to_grant = 0;
@@ -515,8 +1048,10 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 	uint32_t pcoreid;
 	struct proc *proc_to_preempt;
 	bool success;
+	bool ran_out = FALSE;
 	/* we come in holding the ksched lock, and we hold it here to protect
 	 * allocations and provisioning. */
+	amt_needed = __limit_to_share(p, amt_needed);
 	/* get all available cores from their prov_not_alloc list.  the list might
 	 * change when we unlock (new cores added to it, or the entire list emptied,
 	 * but no core allocations will happen (we hold the poke)). */
@@ -526,8 +1061,12 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 		pcoreid = __find_best_core_to_alloc(p);
 		/* If no core is returned, we know that there are no more cores to give
 		 * out, so we exit the loop. */
-		if (pcoreid == -1)
+		if (pcoreid == -1) {
+			if (__reclaim_batch_core(p, nr_to_grant))
+				continue;
+			ran_out = TRUE;
 			break;
+		}
 		/* If the pcore chosen currently has a proc allocated to it, we know
 		 * it must be provisioned to p, but not allocated to it. We need to try
 		 * to preempt. After this block, the core will be track_dealloc'd and
@@ -536,6 +1075,14 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 			proc_to_preempt = get_alloc_proc(pcoreid);
 			/* would break both preemption and maybe the later decref */
 			assert(proc_to_preempt != p);
+			/* With a notice period, we just ask for the core.  p will get it
+			 * (and any others it wants) when it comes back, since it is
+			 * starved til then. */
+			if (preempt_notice_usec) {
+				__preempt_with_notice(proc_to_preempt, pcoreid);
+				ran_out = TRUE;
+				break;
+			}
 			/* need to keep a valid, external ref when we unlock */
 			proc_incref(proc_to_preempt, 1);
 			spin_unlock(&sched_lock);
@@ -554,6 +1101,7 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 				 * to note its dealloc.  we are doing some excessive checking of
 				 * p == prov_proc, but using this helper is a lot clearer. */
 				__track_core_dealloc(proc_to_preempt, pcoreid);
+				nr_forced_reclaims++;
 			} else {
 				/* the preempt failed, which should only happen if the pcore was
 				 * unmapped (could be dying, could be yielding, but NOT
@@ -628,8 +1176,11 @@ static void __core_request(struct proc *p, uint32_t amt_needed)
 			spin_unlock(&p->proc_lock);
 			/* main mcp_ksched wants this held (it came to __core_req held) */
 			spin_lock(&sched_lock);
+			__note_core_grant(p);
 		}
 	}
+	/* If we couldn't give p everything, we'll retry when cores come back */
+	__set_starved(p, ran_out && !proc_is_dying(p));
 	/* note the ksched lock is still held */
 }
 
@@ -657,23 +1208,79 @@ int provision_core(struct proc *p, uint32_t pcoreid)
 	return 0;
 }
 
+void sched_set_preempt_notice(uint64_t usec)
+{
+	spin_lock(&sched_lock);
+	preempt_notice_usec = usec;
+	spin_unlock(&sched_lock);
+}
+
+int sched_set_coreshare(struct proc *p, int class, uint32_t min_cores,
+                        uint32_t weight)
+{
+	spin_lock(&sched_lock);
+	if (total_min_cores - p->ksched_data.min_cores + min_cores > nr_cg_cores) {
+		spin_unlock(&sched_lock);
+		set_errno(EBUSY);
+		return -1;
+	}
+	total_min_cores += min_cores - p->ksched_data.min_cores;
+	p->ksched_data.min_cores = min_cores;
+	p->ksched_data.class = class;
+	p->ksched_data.weight = weight;
+	spin_unlock(&sched_lock);
+	/* A bigger share might get p more cores, or let it take some */
+	poke_ksched(p, RES_CORES);
+	return 0;
+}
+
 /************** Debugging **************/
 void sched_diag(void)
 {
 	struct proc *p;
 	spin_lock(&sched_lock);
-	TAILQ_FOREACH(p, &runnable_scps, ksched_data.proc_link)
-		printk("Runnable _S PID: %d\n", p->pid);
+	for (int i = 0; i < nr_scp_runqs; i++) {
+		spin_lock(&scp_runqs[i].lock);
+		printk("Core %d: %u runnable _Ss, %lu steals, tick %s\n", i,
+		       scp_runqs[i].len, scp_runqs[i].nr_steals,
+		       atomic_read(&ll_ticks[i].stopped) ? "stopped" : "running");
+		TAILQ_FOREACH(p, &scp_runqs[i].procs, ksched_data.proc_link)
+			printk("\tRunnable _S PID: %d\n", p->pid);
+		spin_unlock(&scp_runqs[i].lock);
+	}
 	TAILQ_FOREACH(p, &unrunnable_scps, ksched_data.proc_link)
 		printk("Unrunnable _S PID: %d\n", p->pid);
 	TAILQ_FOREACH(p, primary_mcps, ksched_data.proc_link)
-		printk("Primary MCP PID: %d\n", p->pid);
+		printk("Primary MCP PID: %d, %s, min %u, weight %u\n", p->pid,
+		       p->ksched_data.class == KSCHED_CLASS_LC ? "lc" : "batch",
+		       p->ksched_data.min_cores, p->ksched_data.weight);
 	TAILQ_FOREACH(p, secondary_mcps, ksched_data.proc_link)
-		printk("Secondary MCP PID: %d\n", p->pid);
+		printk("Secondary MCP PID: %d, %s, min %u, weight %u\n", p->pid,
+		       p->ksched_data.class == KSCHED_CLASS_LC ? "lc" : "batch",
+		       p->ksched_data.min_cores, p->ksched_data.weight);
+	printk("Guaranteed %u of %u CG cores\n", total_min_cores, nr_cg_cores);
+	printk("Preempt notice: %lu usec, reclaims: %lu clean, %lu forced\n",
+	       preempt_notice_usec, nr_clean_reclaims, nr_forced_reclaims);
+	printk("Starved MCPs: %d\n", nr_starved_mcps);
 	spin_unlock(&sched_lock);
+	print_ksched_latency();
 	return;
 }
 
+void print_ksched_latency(void)
+{
+	printk("Core request to grant latency:\n");
+	for (int i = 0; i < KSCHED_LAT_BUCKETS; i++) {
+		if (!ksched_lat_hist[i])
+			continue;
+		if (i == KSCHED_LAT_BUCKETS - 1)
+			printk("\t>= %8lu usec: %lu\n", 1UL << (i - 1),
+			       ksched_lat_hist[i]);
+		else
+			printk("\t<  %8lu usec: %lu\n", 1UL << i, ksched_lat_hist[i]);
+	}
+}
+
 void print_resources(struct proc *p)
 {
 	printk("--------------------\n");
@@ -691,9 +1298,7 @@ void print_all_resources(void)
 	{
 		print_resources((struct proc*)item);
 	}
-	spin_lock(&pid_hash_lock);
-	hash_for_each(pid_hash, __print_resources, NULL);
-	spin_unlock(&pid_hash_lock);
+	rhashtable_for_each(&pid_hash, __print_resources, NULL);
 }
 
 void next_core_to_alloc(uint32_t pcoreid)
@@ -59,6 +59,13 @@
  *   a resize operation).  For performance (avoid an occasional cache miss), we
  *   could consider tracking it in the pcpu_cache.  Might save a miss now and
  *   then.
+ * - Why are there multiple depots?  On a NUMA machine, a single depot means
+ *   that a free on one node can refill a magazine that a core on another node
+ *   allocates from, which turns a local allocation into a remote memory access.
+ *   There's one depot per NUMA node, and each pcpu_cache points to its node's
+ *   depot.  A pcpu_cache only steals not-empty mags from another node's depot
+ *   when its own depot runs dry, since a remote hit is still cheaper than going
+ *   to the slab layer.  Empty mags are never stolen; we just make new ones.
  * - Why do we just disable IRQs for the pcpu_cache?  The paper explicitly talks
  *   about using locks instead of disabling IRQs, since disabling IRQs can be
  *   expensive.  First off, we only just disable IRQs when there's 1:1 core to
@@ -69,6 +76,12 @@
  *   the depot during free.  Either approach doesn't require someone else to
  *   grab a pcc lock.
  *
+ * - Do magazines ever shrink?  Yes, but slowly.  If a depot goes
+ *   shrink_timeout_ns without a contended lock acquisition, it drops its
+ *   magsize by one, down to KMC_MAG_MIN_SZ.  The pccs will notice the next time
+ *   they go to the depot during a free.  Mags that have more rounds than the
+ *   new size are fine, per the resize FAQ above.
+ *
  * TODO:
  * - Add reclaim function.
  * - When resizing, do we want to go through the depot and consolidate
@@ -86,13 +99,21 @@
 #include <kmalloc.h>
 #include <hash.h>
 #include <arena.h>
+#include <alloc_prof.h>
+#include <kthread.h>
+#include <rendez.h>
+#include <zpool.h>
+#include <zstore.h>
 
 #define SLAB_POISON ((void*)0xdead1111)
 
 /* Tunables.  I don't know which numbers to pick yet.  Maybe we play with it at
- * runtime.  Though once a mag increases, it'll never decrease. */
+ * runtime.  A depot grows its mags when it sees more than resize_threshold
+ * contended lock acquisitions within resize_timeout_ns, and shrinks them by one
+ * round for every shrink_timeout_ns that passes without any contention. */
 uint64_t resize_timeout_ns = 1000000000;
 unsigned int resize_threshold = 1;
+uint64_t shrink_timeout_ns = 10000000000;
 
 /* Protected by the arenas_and_slabs_lock. */
 struct kmem_cache_tailq all_kmem_caches =
@@ -110,6 +131,23 @@ struct kmem_cache kmem_slab_cache[1];
 struct kmem_cache kmem_bufctl_cache[1];
 struct kmem_cache kmem_magazine_cache[1];
 
+/* Allocation-site profiling hooks, see alloc_prof.h.  We skip qcaches: they
+ * are arena allocations (kmalloc profiles its own large allocs), and they are
+ * hit from within other caches' slab grows. */
+#define KMC_NOPROF_MASK (KMC_NOPROF | KMC_QCACHE)
+
+static inline void kmc_prof_alloc(struct kmem_cache *kc, void *obj)
+{
+	if (unlikely(alloc_prof_rate) && obj && !(kc->flags & KMC_NOPROF_MASK))
+		__alloc_prof_alloc(kc, obj, kc->obj_size);
+}
+
+static inline void kmc_prof_free(struct kmem_cache *kc, void *obj)
+{
+	if (unlikely(alloc_prof_tracking) && !(kc->flags & KMC_NOPROF_MASK))
+		__alloc_prof_free(kc, obj);
+}
+
 static bool __use_bufctls(struct kmem_cache *cp)
 {
 	return cp->flags & __KMC_USE_BUFCTL;
@@ -122,6 +160,21 @@ unsigned int kmc_nr_pcpu_caches(void)
 	return num_cores;
 }
 
+/* One depot per NUMA node.  Caches created before topology_init() only get a
+ * single depot; kmem_cache_numa_init() splits those up once we know the
+ * topology. */
+unsigned int kmc_nr_depots(void)
+{
+	return MAX(cpu_topology_info.num_numa, 1);
+}
+
+static unsigned int kmc_pcpu_cache_node(int pcc_id)
+{
+	if (!cpu_topology_info.num_numa)
+		return 0;
+	return cpu_topology_info.core_list[pcc_id].numa_id;
+}
+
 static struct kmem_pcpu_cache *get_my_pcpu_cache(struct kmem_cache *kc)
 {
 	return &kc->pcpu_caches[core_id()];
@@ -141,12 +194,38 @@ static void unlock_pcu_cache(struct kmem_pcpu_cache *pcc)
 	enable_irqsave(&pcc->irq_state);
 }
 
+/* Helper, shrinks the magazines if the depot hasn't seen contention in a
+ * while.  Hold the depot lock.
+ *
+ * This is the other half of the resize: a cache that had a burst of traffic a
+ * while ago shouldn't keep hoarding objects in big magazines forever.  We only
+ * check the time when the mags are bigger than the minimum, so depots that
+ * never grew don't pay for the clock read.  Note that an idle cache won't
+ * shrink until someone uses it again, but then again an idle cache isn't
+ * moving any mags either. */
+static void __maybe_shrink_depot(struct kmem_depot *depot)
+{
+	uint64_t time;
+
+	if (depot->magsize <= KMC_MAG_MIN_SZ)
+		return;
+	time = nsec();
+	if (time - depot->last_contention < shrink_timeout_ns)
+		return;
+	depot->magsize--;
+	depot->nr_mag_shrinks++;
+	/* Restart the clock, so we shrink one round per timeout period. */
+	depot->last_contention = time;
+}
+
 static void lock_depot(struct kmem_depot *depot)
 {
 	uint64_t time;
 
-	if (spin_trylock_irqsave(&depot->lock))
+	if (spin_trylock_irqsave(&depot->lock)) {
+		__maybe_shrink_depot(depot);
 		return;
+	}
 	/* The lock is contended.  When we finally get the lock, we'll up the
 	 * contention count and see if we've had too many contentions over time.
 	 *
@@ -162,6 +241,8 @@ static void lock_depot(struct kmem_depot *depot)
 	 * might then think the burst wasn't big enough. */
 	time = nsec();
 	spin_lock_irqsave(&depot->lock);
+	depot->nr_contended++;
+	depot->last_contention = time;
 	/* If there are no not-empty mags, we're probably fighting for the lock not
 	 * because the magazines aren't big enough, but because there aren't enough
 	 * mags in the system yet. */
@@ -174,7 +255,10 @@ static void lock_depot(struct kmem_depot *depot)
 	depot->busy_count++;
 	if (depot->busy_count > resize_threshold) {
 		depot->busy_count = 0;
-		depot->magsize = MIN(KMC_MAG_MAX_SZ, depot->magsize + 1);
+		if (depot->magsize < KMC_MAG_MAX_SZ) {
+			depot->magsize++;
+			depot->nr_mag_grows++;
+		}
 		/* That's all we do - the pccs will eventually notice and up their
 		 * magazine sizes. */
 	}
@@ -185,7 +269,7 @@ static void unlock_depot(struct kmem_depot *depot)
 	spin_unlock_irqsave(&depot->lock);
 }
 
-static void depot_init(struct kmem_depot *depot)
+static void depot_init(struct kmem_depot *depot, unsigned int node_id)
 {
 	spinlock_init_irqsave(&depot->lock);
 	SLIST_INIT(&depot->not_empty);
@@ -195,6 +279,24 @@ static void depot_init(struct kmem_depot *depot)
 	depot->nr_empty = 0;
 	depot->busy_count = 0;
 	depot->busy_start = 0;
+	depot->last_contention = 0;
+	depot->nr_contended = 0;
+	depot->nr_mag_grows = 0;
+	depot->nr_mag_shrinks = 0;
+	depot->node_id = node_id;
+	depot->nr_local_hits = 0;
+	depot->nr_remote_hits = 0;
+	depot->nr_misses = 0;
+}
+
+static struct kmem_depot *build_depots(unsigned int nr_depots)
+{
+	struct kmem_depot *depots;
+
+	depots = base_alloc(NULL, sizeof(struct kmem_depot) * nr_depots, MEM_WAIT);
+	for (int i = 0; i < nr_depots; i++)
+		depot_init(&depots[i], i);
+	return depots;
 }
 
 static bool mag_is_empty(struct kmem_magazine *mag)
@@ -213,10 +315,9 @@ static void __swap_mags(struct kmem_pcpu_cache *pcc)
 }
 
 /* Helper, returns a magazine to the depot.  Hold the depot lock. */
-static void __return_to_depot(struct kmem_cache *kc, struct kmem_magazine *mag)
+static void __return_to_depot(struct kmem_depot *depot,
+                              struct kmem_magazine *mag)
 {
-	struct kmem_depot *depot = &kc->depot;
-
 	if (mag_is_empty(mag)) {
 		SLIST_INSERT_HEAD(&depot->empty, mag, link);
 		depot->nr_empty++;
@@ -238,7 +339,7 @@ static void drain_mag(struct kmem_cache *kc, struct kmem_magazine *mag)
 	mag->nr_rounds = 0;
 }
 
-static struct kmem_pcpu_cache *build_pcpu_caches(void)
+static struct kmem_pcpu_cache *build_pcpu_caches(struct kmem_cache *kc)
 {
 	struct kmem_pcpu_cache *pcc;
 
@@ -250,7 +351,10 @@ static struct kmem_pcpu_cache *build_pcpu_caches(void)
 		pcc[i].magsize = KMC_MAG_MIN_SZ;
 		pcc[i].loaded = __kmem_alloc_from_slab(kmem_magazine_cache, MEM_WAIT);
 		pcc[i].prev = __kmem_alloc_from_slab(kmem_magazine_cache, MEM_WAIT);
+		pcc[i].depot = &kc->depots[kmc_pcpu_cache_node(i)];
 		pcc[i].nr_allocs_ever = 0;
+		pcc[i].nr_frees_ever = 0;
+		pcc[i].nr_depot_trips = 0;
 	}
 	return pcc;
 }
@@ -285,6 +389,9 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->priv = priv;
 	kc->nr_cur_alloc = 0;
 	kc->nr_direct_allocs_ever = 0;
+	kc->nr_direct_frees_ever = 0;
+	kc->stat_tsc = read_tsc();
+	kc->stat_nr_allocs = 0;
 	kc->alloc_hash = kc->static_hash;
 	hash_init_hh(&kc->hh);
 	for (int i = 0; i < kc->hh.nr_hash_lists; i++)
@@ -295,10 +402,11 @@ void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	 * assume we're importing from a PGSIZE-aligned source arena. */
 	if ((obj_size > SLAB_LARGE_CUTOFF) || (flags & KMC_NOTOUCH))
 		kc->flags |= __KMC_USE_BUFCTL;
-	depot_init(&kc->depot);
+	kc->nr_depots = kmc_nr_depots();
+	kc->depots = build_depots(kc->nr_depots);
 	/* We do this last, since this will all into the magazine cache - which we
 	 * could be creating on this call! */
-	kc->pcpu_caches = build_pcpu_caches();
+	kc->pcpu_caches = build_pcpu_caches(kc);
 	add_importing_slab(kc->source, kc);
 	qlock(&arenas_and_slabs_lock);
 	TAILQ_INSERT_TAIL(&all_kmem_caches, kc, all_kmc_link);
@@ -316,7 +424,8 @@ static int __mag_ctor(void *obj, void *priv, int flags)
 void kmem_cache_init(void)
 {
 	/* magazine must be first - all caches, including mags, will do a slab alloc
-	 * from the mag cache. */
+	 * from the mag cache.  The slab and bufctl caches are allocated under other
+	 * caches' locks, so they can't call into the allocation profiler. */
 	static_assert(sizeof(struct kmem_magazine) <= SLAB_LARGE_CUTOFF);
 	__kmem_cache_create(kmem_magazine_cache, "kmem_magazine",
 	                    sizeof(struct kmem_magazine),
@@ -328,14 +437,50 @@ void kmem_cache_init(void)
 	                    NULL, NULL, NULL);
 	__kmem_cache_create(kmem_slab_cache, "kmem_slab",
 	                    sizeof(struct kmem_slab),
-	                    __alignof__(struct kmem_slab), 0, base_arena,
+	                    __alignof__(struct kmem_slab), KMC_NOPROF, base_arena,
 	                    NULL, NULL, NULL);
 	__kmem_cache_create(kmem_bufctl_cache, "kmem_bufctl",
 	                    sizeof(struct kmem_bufctl),
-	                    __alignof__(struct kmem_bufctl), 0, base_arena,
+	                    __alignof__(struct kmem_bufctl), KMC_NOPROF, base_arena,
 	                    NULL, NULL, NULL);
 }
 
+/* Caches created before topology_init(), such as the kmalloc caches, have a
+ * single depot.  Once we know the NUMA layout, give them one depot per node
+ * and point each pcpu cache at its node's depot.  Any mags in the old depot
+ * stay with node 0.
+ *
+ * This runs during early boot, before the other cores are up, so no one else
+ * is touching the depots. */
+void kmem_cache_numa_init(void)
+{
+	struct kmem_cache *kc_i;
+	struct kmem_depot *old;
+	unsigned int nr_depots = kmc_nr_depots();
+
+	if (nr_depots == 1)
+		return;
+	qlock(&arenas_and_slabs_lock);
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link) {
+		if (kc_i->nr_depots == nr_depots)
+			continue;
+		assert(kc_i->nr_depots == 1);
+		old = kc_i->depots;
+		kc_i->depots = build_depots(nr_depots);
+		kc_i->depots[0].not_empty = old->not_empty;
+		kc_i->depots[0].empty = old->empty;
+		kc_i->depots[0].nr_not_empty = old->nr_not_empty;
+		kc_i->depots[0].nr_empty = old->nr_empty;
+		kc_i->depots[0].magsize = old->magsize;
+		for (int i = 0; i < kmc_nr_pcpu_caches(); i++)
+			kc_i->pcpu_caches[i].depot =
+				&kc_i->depots[kmc_pcpu_cache_node(i)];
+		kc_i->nr_depots = nr_depots;
+		base_free(NULL, old, sizeof(struct kmem_depot));
+	}
+	qunlock(&arenas_and_slabs_lock);
+}
+
 /* Cache management */
 struct kmem_cache *kmem_cache_create(const char *name, size_t obj_size,
                                      int align, int flags,
@@ -361,28 +506,30 @@ static void drain_pcpu_caches(struct kmem_cache *kc)
 	for (int i = 0; i < kmc_nr_pcpu_caches(); i++) {
 		pcc = &kc->pcpu_caches[i];
 		lock_pcu_cache(pcc);
-		lock_depot(&kc->depot);
-		__return_to_depot(kc, pcc->loaded);
-		__return_to_depot(kc, pcc->prev);
-		unlock_depot(&kc->depot);
+		lock_depot(pcc->depot);
+		__return_to_depot(pcc->depot, pcc->loaded);
+		__return_to_depot(pcc->depot, pcc->prev);
+		unlock_depot(pcc->depot);
 		pcc->loaded = SLAB_POISON;
 		pcc->prev = SLAB_POISON;
 		unlock_pcu_cache(pcc);
 	}
 }
 
-static void depot_destroy(struct kmem_cache *kc)
+static void depot_destroy(struct kmem_cache *kc, struct kmem_depot *depot)
 {
 	struct kmem_magazine *mag_i;
-	struct kmem_depot *depot = &kc->depot;
 
 	lock_depot(depot);
 	while ((mag_i = SLIST_FIRST(&depot->not_empty))) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
 		drain_mag(kc, mag_i);
 		kmem_cache_free(kmem_magazine_cache, mag_i);
 	}
-	while ((mag_i = SLIST_FIRST(&depot->empty)))
+	while ((mag_i = SLIST_FIRST(&depot->empty))) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
 		kmem_cache_free(kmem_magazine_cache, mag_i);
+	}
 	unlock_depot(depot);
 }
 
@@ -407,8 +554,9 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 }
 
 /* Once you call destroy, never use this cache again... o/w there may be weird
- * races, and other serious issues.  */
-void kmem_cache_destroy(struct kmem_cache *cp)
+ * races, and other serious issues.  This is the low-level partner of
+ * __kmem_cache_create(): it does not free the kmem_cache itself. */
+void __kmem_cache_destroy(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
 
@@ -417,7 +565,8 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 	qunlock(&arenas_and_slabs_lock);
 	del_importing_slab(cp->source, cp);
 	drain_pcpu_caches(cp);
-	depot_destroy(cp);
+	for (int i = 0; i < cp->nr_depots; i++)
+		depot_destroy(cp, &cp->depots[i]);
 	spin_lock_irqsave(&cp->cache_lock);
 	assert(TAILQ_EMPTY(&cp->full_slab_list));
 	assert(TAILQ_EMPTY(&cp->partial_slab_list));
@@ -431,6 +580,12 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 		a_slab = next;
 	}
 	spin_unlock_irqsave(&cp->cache_lock);
+	base_free(NULL, cp->depots, sizeof(struct kmem_depot) * cp->nr_depots);
+}
+
+void kmem_cache_destroy(struct kmem_cache *cp)
+{
+	__kmem_cache_destroy(cp);
 	kmem_cache_free(kmem_cache_cache, cp);
 }
 
@@ -555,25 +710,46 @@ static void *__kmem_alloc_from_slab(struct kmem_cache *cp, int flags)
 	return retval;
 }
 
-void *kmem_cache_alloc(struct kmem_cache *kc, int flags)
+/* Helper, grabs a not-empty mag from another node's depot.  Hold the pcc lock,
+ * but not any depot locks. */
+static struct kmem_magazine *__steal_remote_mag(struct kmem_cache *kc,
+                                                struct kmem_depot *local)
 {
-	struct kmem_pcpu_cache *pcc = get_my_pcpu_cache(kc);
-	struct kmem_depot *depot = &kc->depot;
+	struct kmem_depot *remote;
 	struct kmem_magazine *mag;
-	void *ret;
 
-	lock_pcu_cache(pcc);
-try_alloc:
-	if (pcc->loaded->nr_rounds) {
-		ret = pcc->loaded->rounds[pcc->loaded->nr_rounds - 1];
-		pcc->loaded->nr_rounds--;
-		pcc->nr_allocs_ever++;
-		unlock_pcu_cache(pcc);
-		return ret;
+	for (int i = 1; i < kc->nr_depots; i++) {
+		remote = &kc->depots[(local->node_id + i) % kc->nr_depots];
+		/* Racy peek, so we don't bounce the locks of idle nodes */
+		if (!remote->nr_not_empty)
+			continue;
+		lock_depot(remote);
+		mag = SLIST_FIRST(&remote->not_empty);
+		if (mag) {
+			SLIST_REMOVE_HEAD(&remote->not_empty, link);
+			remote->nr_not_empty--;
+			unlock_depot(remote);
+			return mag;
+		}
+		unlock_depot(remote);
 	}
+	return NULL;
+}
+
+/* Helper, makes sure pcc->loaded has rounds, swapping with prev or trading with
+ * the depots.  Returns FALSE if there are no rounds to be had above the slab
+ * layer.  Hold the pcc lock. */
+static bool __pcc_reload_for_alloc(struct kmem_cache *kc,
+                                   struct kmem_pcpu_cache *pcc)
+{
+	struct kmem_depot *depot = pcc->depot;
+	struct kmem_magazine *mag;
+
+	if (pcc->loaded->nr_rounds)
+		return TRUE;
 	if (!mag_is_empty(pcc->prev)) {
 		__swap_mags(pcc);
-		goto try_alloc;
+		return TRUE;
 	}
 	/* Note the lock ordering: pcc -> depot */
 	lock_depot(depot);
@@ -581,15 +757,84 @@ try_alloc:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->not_empty, link);
 		depot->nr_not_empty--;
-		__return_to_depot(kc, pcc->prev);
+		depot->nr_local_hits++;
+		__return_to_depot(depot, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
 		pcc->loaded = mag;
-		goto try_alloc;
+		pcc->nr_depot_trips++;
+		return TRUE;
 	}
 	unlock_depot(depot);
+	mag = __steal_remote_mag(kc, depot);
+	lock_depot(depot);
+	if (mag) {
+		depot->nr_remote_hits++;
+		__return_to_depot(depot, pcc->prev);
+		unlock_depot(depot);
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		pcc->nr_depot_trips++;
+		return TRUE;
+	}
+	depot->nr_misses++;
+	unlock_depot(depot);
+	return FALSE;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *kc, int flags)
+{
+	struct kmem_pcpu_cache *pcc = get_my_pcpu_cache(kc);
+	void *ret;
+
+	lock_pcu_cache(pcc);
+	if (__pcc_reload_for_alloc(kc, pcc)) {
+		ret = pcc->loaded->rounds[pcc->loaded->nr_rounds - 1];
+		pcc->loaded->nr_rounds--;
+		pcc->nr_allocs_ever++;
+		unlock_pcu_cache(pcc);
+		kmc_prof_alloc(kc, ret);
+		return ret;
+	}
+	unlock_pcu_cache(pcc);
+	ret = __kmem_alloc_from_slab(kc, flags);
+	kmc_prof_alloc(kc, ret);
+	return ret;
+}
+
+/* Allocates up to @nr objects into @objs, returning the number allocated.  This
+ * is the same as calling kmem_cache_alloc() @nr times, but it only deals with
+ * the pcc once per magazine instead of once per object.  Like
+ * kmem_cache_alloc(), this only returns less than @nr if the slab layer fails,
+ * e.g. for MEM_ATOMIC. */
+size_t kmem_cache_alloc_batch(struct kmem_cache *kc, void **objs, size_t nr,
+                              int flags)
+{
+	struct kmem_pcpu_cache *pcc = get_my_pcpu_cache(kc);
+	struct kmem_magazine *mag;
+	size_t got = 0, amt;
+
+	lock_pcu_cache(pcc);
+	while (got < nr && __pcc_reload_for_alloc(kc, pcc)) {
+		mag = pcc->loaded;
+		amt = MIN(nr - got, mag->nr_rounds);
+		memcpy(&objs[got], &mag->rounds[mag->nr_rounds - amt],
+		       amt * sizeof(void*));
+		mag->nr_rounds -= amt;
+		pcc->nr_allocs_ever += amt;
+		got += amt;
+	}
 	unlock_pcu_cache(pcc);
-	return __kmem_alloc_from_slab(kc, flags);
+	for (/* got set */; got < nr; got++) {
+		objs[got] = __kmem_alloc_from_slab(kc, flags);
+		if (!objs[got])
+			break;
+	}
+	if (unlikely(alloc_prof_rate)) {
+		for (size_t i = 0; i < got; i++)
+			kmc_prof_alloc(kc, objs[i]);
+	}
+	return got;
 }
 
 /* Returns an object to the slab layer.  Caller must deconstruct the objects.
@@ -616,6 +861,7 @@ static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 	}
 	a_slab->num_busy_obj--;
 	cp->nr_cur_alloc--;
+	cp->nr_direct_frees_ever++;
 	// if it was full, move it to partial
 	if (a_slab->num_busy_obj + 1 == a_slab->num_total_obj) {
 		TAILQ_REMOVE(&cp->full_slab_list, a_slab, link);
@@ -628,27 +874,23 @@ static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 	spin_unlock_irqsave(&cp->cache_lock);
 }
 
-void kmem_cache_free(struct kmem_cache *kc, void *buf)
+/* Helper, makes sure pcc->loaded has room for one more round, swapping with
+ * prev or trading with the depot.  Returns FALSE if the depot has no empty
+ * mags; the caller needs to make one.  Hold the pcc lock. */
+static bool __pcc_reload_for_free(struct kmem_cache *kc,
+                                  struct kmem_pcpu_cache *pcc)
 {
-	struct kmem_pcpu_cache *pcc = get_my_pcpu_cache(kc);
-	struct kmem_depot *depot = &kc->depot;
+	struct kmem_depot *depot = pcc->depot;
 	struct kmem_magazine *mag;
 
-	assert(buf);	/* catch bugs */
-	lock_pcu_cache(pcc);
-try_free:
-	if (pcc->loaded->nr_rounds < pcc->magsize) {
-		pcc->loaded->rounds[pcc->loaded->nr_rounds] = buf;
-		pcc->loaded->nr_rounds++;
-		unlock_pcu_cache(pcc);
-		return;
-	}
+	if (pcc->loaded->nr_rounds < pcc->magsize)
+		return TRUE;
 	/* The paper checks 'is empty' here.  But we actually just care if it has
 	 * room left, not that prev is completely empty.  This could be the case due
 	 * to magazine resize. */
 	if (pcc->prev->nr_rounds < pcc->magsize) {
 		__swap_mags(pcc);
-		goto try_free;
+		return TRUE;
 	}
 	lock_depot(depot);
 	/* Here's where the resize magic happens.  We'll start using it for the next
@@ -658,13 +900,34 @@ try_free:
 	if (mag) {
 		SLIST_REMOVE_HEAD(&depot->empty, link);
 		depot->nr_empty--;
-		__return_to_depot(kc, pcc->prev);
+		__return_to_depot(depot, pcc->prev);
 		unlock_depot(depot);
 		pcc->prev = pcc->loaded;
 		pcc->loaded = mag;
-		goto try_free;
+		pcc->nr_depot_trips++;
+		return TRUE;
 	}
 	unlock_depot(depot);
+	return FALSE;
+}
+
+/* kmem_cache_free(), minus the profiling hook, for callers that already did
+ * it. */
+static void __kmem_cache_free(struct kmem_cache *kc, void *buf)
+{
+	struct kmem_pcpu_cache *pcc = get_my_pcpu_cache(kc);
+	struct kmem_depot *depot = pcc->depot;
+	struct kmem_magazine *mag;
+
+	lock_pcu_cache(pcc);
+try_free:
+	if (__pcc_reload_for_free(kc, pcc)) {
+		pcc->loaded->rounds[pcc->loaded->nr_rounds] = buf;
+		pcc->loaded->nr_rounds++;
+		pcc->nr_frees_ever++;
+		unlock_pcu_cache(pcc);
+		return;
+	}
 	/* Need to unlock, in case we end up calling back into ourselves. */
 	unlock_pcu_cache(pcc);
 	/* don't want to wait on a free.  if this fails, we can still just give it
@@ -684,6 +947,71 @@ try_free:
 	__kmem_free_to_slab(kc, buf);
 }
 
+void kmem_cache_free(struct kmem_cache *kc, void *buf)
+{
+	assert(buf);	/* catch bugs */
+	kmc_prof_free(kc, buf);
+	__kmem_cache_free(kc, buf);
+}
+
+/* Frees @nr objects from @objs, the batched partner of
+ * kmem_cache_alloc_batch(). */
+void kmem_cache_free_batch(struct kmem_cache *kc, void **objs, size_t nr)
+{
+	struct kmem_pcpu_cache *pcc = get_my_pcpu_cache(kc);
+	struct kmem_magazine *mag;
+	size_t done = 0, amt;
+
+	if (unlikely(alloc_prof_tracking)) {
+		for (size_t i = 0; i < nr; i++)
+			kmc_prof_free(kc, objs[i]);
+	}
+	lock_pcu_cache(pcc);
+	while (done < nr) {
+		if (!__pcc_reload_for_free(kc, pcc)) {
+			/* __kmem_cache_free() knows how to get more mags.  Once it has one,
+			 * we can go back to bulk frees. */
+			unlock_pcu_cache(pcc);
+			__kmem_cache_free(kc, objs[done++]);
+			lock_pcu_cache(pcc);
+			continue;
+		}
+		mag = pcc->loaded;
+		amt = MIN(nr - done, pcc->magsize - mag->nr_rounds);
+		memcpy(&mag->rounds[mag->nr_rounds], &objs[done], amt * sizeof(void*));
+		mag->nr_rounds += amt;
+		pcc->nr_frees_ever += amt;
+		done += amt;
+	}
+	unlock_pcu_cache(pcc);
+}
+
+/* Sums up kc's counters.  We peek at the pcpu caches without their locks, so
+ * the totals can be a little off while the cache is busy. */
+void kmem_cache_get_stats(struct kmem_cache *kc, struct kmem_cache_stats *st)
+{
+	struct kmem_pcpu_cache *pcc;
+	size_t nr_mag_ops = 0;
+
+	memset(st, 0, sizeof(struct kmem_cache_stats));
+	for (int i = 0; i < kmc_nr_pcpu_caches(); i++) {
+		pcc = &kc->pcpu_caches[i];
+		st->nr_allocs += READ_ONCE(pcc->nr_allocs_ever);
+		st->nr_frees += READ_ONCE(pcc->nr_frees_ever);
+		st->nr_depot_trips += READ_ONCE(pcc->nr_depot_trips);
+	}
+	nr_mag_ops = st->nr_allocs + st->nr_frees;
+	/* Each mag from the depot was for an op (or batch) the pcc couldn't do.
+	 * Ops that failed over to the slab layer were never mag ops. */
+	st->nr_mag_hits = nr_mag_ops - MIN(nr_mag_ops, st->nr_depot_trips);
+	st->nr_slab_allocs = READ_ONCE(kc->nr_direct_allocs_ever);
+	st->nr_slab_frees = READ_ONCE(kc->nr_direct_frees_ever);
+	st->nr_allocs += st->nr_slab_allocs;
+	st->nr_frees += st->nr_slab_frees;
+	for (int i = 0; i < kc->nr_depots; i++)
+		st->nr_contended += READ_ONCE(kc->depots[i].nr_contended);
+}
+
 /* Back end: internal functions */
 /* When this returns, the cache has at least one slab in the empty list.  If
  * page_alloc fails, there are some serious issues.  This only grows by one slab
@@ -753,18 +1081,198 @@ static bool kmem_cache_grow(struct kmem_cache *cp)
 
 /* This deallocs every slab from the empty list.  TODO: think a bit more about
  * this.  We can do things like not free all of the empty lists to prevent
- * thrashing.  See 3.4 in the paper. */
-void kmem_cache_reap(struct kmem_cache *cp)
+ * thrashing.  See 3.4 in the paper.
+ *
+ * Returns the amount of memory given back to the source. */
+size_t kmem_cache_reap(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
+	size_t amt = 0;
 
 	// Destroy all empty slabs.  Refer to the notes about the while loop
 	spin_lock_irqsave(&cp->cache_lock);
 	a_slab = TAILQ_FIRST(&cp->empty_slab_list);
 	while (a_slab) {
 		next = TAILQ_NEXT(a_slab, link);
+		TAILQ_REMOVE(&cp->empty_slab_list, a_slab, link);
 		kmem_slab_destroy(cp, a_slab);
+		amt += __use_bufctls(cp) ? cp->import_amt : PGSIZE;
 		a_slab = next;
 	}
 	spin_unlock_irqsave(&cp->cache_lock);
+	return amt;
+}
+
+/* Memory-pressure reclaim.
+ *
+ * Idle magazines sit in the depots forever: nothing gives their objects back to
+ * the slab layer, so their slabs never empty.  When the base arenas get low,
+ * a ktask drains every depot's magazines and then reaps the empty slabs.  We
+ * leave the pcpu caches' loaded and prev mags alone; those are the working
+ * set, and we'd have to interrupt the cores to get at them.
+ *
+ * Arena qcaches are slabs too, and the pages we free from the other slabs often
+ * land in kpages's qcaches, so we do the qcaches after the regular caches.  The
+ * magazine cache goes last, since the drains free a lot of magazines. */
+struct kmem_reclaim_stats kmem_reclaim_stats;
+/* Reclaim when less than this percent of the base arenas is free. */
+unsigned int kmem_reclaim_low_pct = 5;
+/* How often the ktask checks the watermark on its own. */
+uint64_t kmem_reclaim_period_usec = 1000000;
+
+static struct rendez kmem_reclaim_rv;
+static bool kmem_reclaim_ready;
+static bool kmem_reclaim_poked;
+
+/* Pulls all of the mags out of kc's depots, giving their objects back to the
+ * slab layer.  Returns the number of mags freed. */
+static size_t kmem_cache_trim_depots(struct kmem_cache *kc)
+{
+	struct kmem_mag_slist not_empty, empty;
+	struct kmem_magazine *mag;
+	size_t nr_mags = 0;
+
+	for (int i = 0; i < kc->nr_depots; i++) {
+		struct kmem_depot *depot = &kc->depots[i];
+
+		lock_depot(depot);
+		not_empty = depot->not_empty;
+		empty = depot->empty;
+		SLIST_INIT(&depot->not_empty);
+		SLIST_INIT(&depot->empty);
+		depot->nr_not_empty = 0;
+		depot->nr_empty = 0;
+		unlock_depot(depot);
+		/* Freeing mags can call back into the depots (the mag cache's), so we
+		 * do it outside the lock. */
+		while ((mag = SLIST_FIRST(&not_empty))) {
+			SLIST_REMOVE_HEAD(&not_empty, link);
+			drain_mag(kc, mag);
+			kmem_cache_free(kmem_magazine_cache, mag);
+			nr_mags++;
+		}
+		while ((mag = SLIST_FIRST(&empty))) {
+			SLIST_REMOVE_HEAD(&empty, link);
+			kmem_cache_free(kmem_magazine_cache, mag);
+			nr_mags++;
+		}
+	}
+	return nr_mags;
+}
+
+/* Amount of memory allocated out of the base arenas.  Hold the
+ * arenas_and_slabs_lock. */
+static size_t __base_amt_alloc(void)
+{
+	struct arena *a_i;
+	size_t amt = 0;
+
+	TAILQ_FOREACH(a_i, &all_arenas, next) {
+		if (a_i->is_base)
+			amt += a_i->amt_alloc_segs;
+	}
+	return amt;
+}
+
+static bool __base_mem_is_low(void)
+{
+	struct arena *a_i;
+	size_t total = 0, alloc = 0;
+
+	TAILQ_FOREACH(a_i, &all_arenas, next) {
+		if (!a_i->is_base)
+			continue;
+		total += a_i->amt_total_segs;
+		alloc += a_i->amt_alloc_segs;
+	}
+	return (total - alloc) < total / 100 * kmem_reclaim_low_pct;
+}
+
+/* Runs one pass of reclaim, returning how much memory went back to the base
+ * arenas.  That is less than what the slabs freed if the arenas in between
+ * hold on to it.  The zero page pools go first, so their pages get trimmed from
+ * the kpages magazines with everything else.  We also ask the compressed page
+ * store to evict cold pages; that happens in its own ktask, and we'll trim
+ * whatever it frees on our next pass. */
+size_t kmem_reclaim(void)
+{
+	struct kmem_cache *kc_i;
+	size_t before, after, nr_mags = 0, slab_amt = 0;
+	uint64_t start = nsec();
+
+	qlock(&arenas_and_slabs_lock);
+	before = __base_amt_alloc();
+	zpool_drain();
+	zstore_reclaim_poke();
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link) {
+		if ((kc_i->flags & KMC_QCACHE) || (kc_i == kmem_magazine_cache))
+			continue;
+		nr_mags += kmem_cache_trim_depots(kc_i);
+		slab_amt += kmem_cache_reap(kc_i);
+	}
+	TAILQ_FOREACH(kc_i, &all_kmem_caches, all_kmc_link) {
+		if (!(kc_i->flags & KMC_QCACHE))
+			continue;
+		nr_mags += kmem_cache_trim_depots(kc_i);
+		slab_amt += kmem_cache_reap(kc_i);
+	}
+	nr_mags += kmem_cache_trim_depots(kmem_magazine_cache);
+	slab_amt += kmem_cache_reap(kmem_magazine_cache);
+	after = __base_amt_alloc();
+
+	kmem_reclaim_stats.nr_passes++;
+	kmem_reclaim_stats.last_bytes = before > after ? before - after : 0;
+	kmem_reclaim_stats.total_bytes += kmem_reclaim_stats.last_bytes;
+	kmem_reclaim_stats.last_nr_mags = nr_mags;
+	kmem_reclaim_stats.last_slab_bytes = slab_amt;
+	kmem_reclaim_stats.last_nsec = nsec() - start;
+	qunlock(&arenas_and_slabs_lock);
+	return before > after ? before - after : 0;
+}
+
+static int kmem_reclaim_was_poked(void *arg)
+{
+	return READ_ONCE(kmem_reclaim_poked);
+}
+
+static void kmem_reclaim_ktask(void *arg)
+{
+	bool low;
+
+	while (1) {
+		rendez_sleep_timeout(&kmem_reclaim_rv, kmem_reclaim_was_poked, NULL,
+		                     kmem_reclaim_period_usec);
+		/* Post-and-poke: clear before we look, so a poke during our pass
+		 * gets another pass. */
+		if (READ_ONCE(kmem_reclaim_poked)) {
+			WRITE_ONCE(kmem_reclaim_poked, FALSE);
+			low = TRUE;
+		} else {
+			qlock(&arenas_and_slabs_lock);
+			low = __base_mem_is_low();
+			qunlock(&arenas_and_slabs_lock);
+		}
+		if (low)
+			kmem_reclaim();
+	}
+}
+
+void kmem_reclaim_init(void)
+{
+	rendez_init(&kmem_reclaim_rv);
+	ktask("kmem_reclaim", kmem_reclaim_ktask, NULL);
+	kmem_reclaim_ready = TRUE;
+}
+
+/* Asks the reclaim ktask to run a pass.  Safe from IRQ context and with arena
+ * locks held. */
+void kmem_reclaim_poke(void)
+{
+	/* Under pressure, every import pokes us.  One wakeup per pass is plenty. */
+	if (!kmem_reclaim_ready || READ_ONCE(kmem_reclaim_poked))
+		return;
+	/* Racy, but it's just a stat */
+	kmem_reclaim_stats.nr_pokes++;
+	WRITE_ONCE(kmem_reclaim_poked, TRUE);
+	rendez_wakeup(&kmem_reclaim_rv);
 }
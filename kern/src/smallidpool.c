@@ -11,6 +11,8 @@
 #include <atomic.h>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <smp.h>
 
 struct u16_pool *create_u16_pool(unsigned int size)
 {
@@ -31,9 +33,95 @@ struct u16_pool *create_u16_pool(unsigned int size)
 		id->check[i] = 0xfe;
 	}
 	id->tos = 0;
+	id->pcpu = NULL;
 	return id;
 }
 
+struct u16_pool *create_u16_pool_pcpu(unsigned int size)
+{
+	struct u16_pool *id = create_u16_pool(size);
+
+	if (!id)
+		return NULL;
+	id->pcpu = kmalloc_align(sizeof(struct u16_pcpu_cache) * num_cores,
+	                         MEM_WAIT, ARCH_CL_SIZE);
+	for_each_core(i) {
+		spinlock_init_irqsave(&id->pcpu[i].lock);
+		id->pcpu[i].nr = 0;
+	}
+	return id;
+}
+
+/* Moves up to U16_PCPU_BATCH IDs from the stack to pc.  Hold pc's lock. */
+static void __pcpu_refill(struct u16_pool *id, struct u16_pcpu_cache *pc)
+{
+	unsigned int nr;
+
+	spin_lock_irqsave(&id->lock);
+	nr = MIN(U16_PCPU_BATCH, id->size - id->tos);
+	memcpy(pc->ids, &id->ids[id->tos], nr * sizeof(uint16_t));
+	id->tos += nr;
+	spin_unlock_irqsave(&id->lock);
+	pc->nr = nr;
+}
+
+/* Moves U16_PCPU_BATCH IDs from pc to the stack.  Hold pc's lock. */
+static void __pcpu_flush(struct u16_pool *id, struct u16_pcpu_cache *pc)
+{
+	spin_lock_irqsave(&id->lock);
+	for (int i = 0; i < U16_PCPU_BATCH; i++)
+		id->ids[--id->tos] = pc->ids[--pc->nr];
+	spin_unlock_irqsave(&id->lock);
+}
+
+/* Called when the stack is empty.  It's slow, but only happens when the pool is
+ * nearly exhausted. */
+static int __pcpu_steal(struct u16_pool *id)
+{
+	struct u16_pcpu_cache *pc;
+	int v = -1;
+
+	for_each_core(i) {
+		pc = &id->pcpu[i];
+		spin_lock_irqsave(&pc->lock);
+		if (pc->nr)
+			v = pc->ids[--pc->nr];
+		spin_unlock_irqsave(&pc->lock);
+		if (v >= 0)
+			break;
+	}
+	return v;
+}
+
+/* We might migrate after picking our core's cache, but the cache's lock keeps
+ * that safe.  We'd just be using someone else's cache for a bit. */
+static int __get_u16_pcpu(struct u16_pool *id)
+{
+	struct u16_pcpu_cache *pc = &id->pcpu[core_id()];
+	int v = -1;
+
+	spin_lock_irqsave(&pc->lock);
+	if (!pc->nr)
+		__pcpu_refill(id, pc);
+	if (pc->nr)
+		v = pc->ids[--pc->nr];
+	spin_unlock_irqsave(&pc->lock);
+	if (v < 0)
+		v = __pcpu_steal(id);
+	return v;
+}
+
+static void __put_u16_pcpu(struct u16_pool *id, int v)
+{
+	struct u16_pcpu_cache *pc = &id->pcpu[core_id()];
+
+	spin_lock_irqsave(&pc->lock);
+	if (pc->nr == U16_PCPU_CACHE_SZ)
+		__pcpu_flush(id, pc);
+	pc->ids[pc->nr++] = v;
+	spin_unlock_irqsave(&pc->lock);
+}
+
 /* Returns an unused u16, or -1 on failure (pool full or corruption).
  *
  * The invariant is that the stackpointer (TOS) will always point to the next
@@ -42,14 +130,21 @@ struct u16_pool *create_u16_pool(unsigned int size)
  * slots to push.  The last valid slot is when TOS == size - 1. */
 int get_u16(struct u16_pool *id)
 {
-	uint16_t v;
-	spin_lock_irqsave(&id->lock);
-	if (id->tos == id->size) {
+	int v;
+
+	if (id->pcpu) {
+		v = __get_u16_pcpu(id);
+		if (v < 0)
+			return -1;
+	} else {
+		spin_lock_irqsave(&id->lock);
+		if (id->tos == id->size) {
+			spin_unlock_irqsave(&id->lock);
+			return -1;
+		}
+		v = id->ids[id->tos++];
 		spin_unlock_irqsave(&id->lock);
-		return -1;
 	}
-	v = id->ids[id->tos++];
-	spin_unlock_irqsave(&id->lock);
 	/* v is ours, we can freely read and write its check field */
 	if (id->check[v] != 0xfe) {
 		printk("BAD! %d is already allocated (0x%x)\n", v, id->check[v]);
@@ -67,6 +162,10 @@ void put_u16(struct u16_pool *id, int v)
 		return;
 	}
 	id->check[v] = 0xfe;
+	if (id->pcpu) {
+		__put_u16_pcpu(id, v);
+		return;
+	}
 	spin_lock_irqsave(&id->lock);
 	id->ids[--id->tos] = v;
 	spin_unlock_irqsave(&id->lock);
@@ -21,11 +21,28 @@
 #include <core_set.h>
 #include <completion.h>
 #include <rcu.h>
+#include <sort.h>
+#include <zpool.h>
+
+/* smp_do_in_cores() fans out along a tree: each core forwards the work to up to
+ * SMP_FANOUT children before doing its own part, so the caller only sends a
+ * few IPIs.  The cores are sorted by topology, and each subtree is a
+ * contiguous range of them, so subtrees stay within a socket when they can.
+ * Completion is combined back up the same tree: a node is done when it and its
+ * children are, and the root's completion wakes the caller. */
+#define SMP_FANOUT 4
+
+struct smp_tree_node {
+	atomic_t pending;			/* this node and children not done yet */
+	int parent;
+	uint32_t coreid;
+};
 
 struct all_cpu_work {
 	struct completion comp;
 	void (*func)(void *);
 	void *opaque;
+	struct smp_tree_node *nodes;
 };
 
 struct per_cpu_info per_cpu_info[MAX_NUM_CORES];
@@ -76,6 +93,10 @@ static void __attribute__((noreturn)) __smp_idle(void *arg)
 		process_routine_kmsg();
 		try_run_proc();
 		cpu_bored();		/* call out to the ksched */
+		/* Nothing to do, so zero some pages for faults.  This enables IRQs
+		 * for a bit, so we check for work again before halting. */
+		if (zpool_idle_refill())
+			continue;
 		/* cpu_halt() atomically turns on interrupts and halts the core.
 		 * Important to do this, since we could have a RKM come in via an
 		 * interrupt right while PRKM is returning, and we wouldn't catch
@@ -112,12 +133,11 @@ void smp_percpu_init(void)
 	 * they clear it, either in anticipation of being a user-backing kthread or
 	 * to handle an RKM. */
 	kthread->flags = KTH_KTASK_FLAGS;
-	per_cpu_info[coreid].spare = 0;
+	per_cpu_info[coreid].nr_kth_cache = 0;
 	/* Init relevant lists */
-	spinlock_init_irqsave(&per_cpu_info[coreid].immed_amsg_lock);
-	STAILQ_INIT(&per_cpu_info[coreid].immed_amsgs);
-	spinlock_init_irqsave(&per_cpu_info[coreid].routine_amsg_lock);
-	STAILQ_INIT(&per_cpu_info[coreid].routine_amsgs);
+	kmsg_queue_init(&per_cpu_info[coreid].immed_amsgs);
+	kmsg_queue_init(&per_cpu_info[coreid].routine_amsgs);
+	atomic_init(&per_cpu_info[coreid].kmsg_ipi_pending, FALSE);
 	/* Initialize the per-core timer chain */
 	init_timer_chain(&per_cpu_info[coreid].tchain, set_pcpu_alarm_interrupt);
 	/* Init generic tracing ring */
@@ -146,6 +166,7 @@ void __set_cpu_state(struct per_cpu_info *pcpui, int state)
 	assert(!irq_is_enabled());
 	/* TODO: could put in an option to enable/disable state tracking. */
 	now_ticks = read_tsc();
+	__seq_start_write(&pcpui->state_seq);
 	pcpui->state_ticks[pcpui->cpu_state] += now_ticks - pcpui->last_tick_cnt;
 	/* TODO: if the state was user, we could account for the vcore's time,
 	 * similar to the total_ticks in struct vcore.  the difference is that the
@@ -153,6 +174,7 @@ void __set_cpu_state(struct per_cpu_info *pcpui, int state)
 	 * something like vcore->user_ticks. */
 	pcpui->cpu_state = state;
 	pcpui->last_tick_cnt = now_ticks;
+	__seq_end_write(&pcpui->state_seq);
 }
 
 void reset_cpu_state_ticks(int coreid)
@@ -170,6 +192,27 @@ void reset_cpu_state_ticks(int coreid)
 	}
 }
 
+/* Reads coreid's ticks in each state, up to now, without bothering the core.
+ * The counts only go up, except when someone resets them.  A reset isn't
+ * synchronized with us, so the caller should expect the occasional odd value
+ * around one. */
+void get_cpu_state_ticks(int coreid, uint64_t *ticks)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
+	seq_ctr_t seq;
+	int state;
+
+	do {
+		seq = ACCESS_ONCE(pcpui->state_seq);
+		rmb();
+		for (int i = 0; i < NR_CPU_STATES; i++)
+			ticks[i] = ACCESS_ONCE(pcpui->state_ticks[i]);
+		state = ACCESS_ONCE(pcpui->cpu_state);
+		ticks[state] += read_tsc() - ACCESS_ONCE(pcpui->last_tick_cnt);
+		rmb();
+	} while (seqctr_retry(seq, ACCESS_ONCE(pcpui->state_seq)));
+}
+
 /* PCPUI Trace Rings: */
 
 static void pcpui_trace_kmsg_handler(void *event, void *data)
@@ -244,12 +287,65 @@ void pcpui_tr_reset_and_clear_all(void)
 		trace_ring_reset_and_clear(&per_cpu_info[i].traces);
 }
 
+static void smp_do_core_work(uint32_t srcid, long a0, long a1, long a2);
+
+/* Node idx is responsible for the nodes (idx, end).  Splits them into up to
+ * SMP_FANOUT contiguous ranges and sends the work to the first node of each. */
+static void smp_tree_fan_out(struct all_cpu_work *acw, int idx, int end)
+{
+	int nr_kids = MIN(end - idx - 1, SMP_FANOUT);
+	int lo = idx + 1, span;
+	struct kmsg_batch kb;
+
+	/* Before any kid can finish */
+	atomic_set(&acw->nodes[idx].pending, 1 + nr_kids);
+	kmsg_batch_init(&kb);
+	for (int k = 0; k < nr_kids; k++) {
+		span = (end - lo) / (nr_kids - k);
+		acw->nodes[lo].parent = idx;
+		kmsg_batch_add(&kb, acw->nodes[lo].coreid, smp_do_core_work,
+		               (long)acw, lo, lo + span, KMSG_ROUTINE);
+		lo += span;
+	}
+	kmsg_batch_flush(&kb);
+}
+
+/* Node idx finished something: its own work or a whole child subtree.  Whoever
+ * finishes a node last passes it up to the parent.  Once the root is done, the
+ * caller can free the nodes, so don't touch them after that. */
+static void smp_tree_done(struct all_cpu_work *acw, int idx)
+{
+	while (atomic_sub_and_test(&acw->nodes[idx].pending, 1)) {
+		if (!idx) {
+			completion_complete(&acw->comp, 1);
+			return;
+		}
+		idx = acw->nodes[idx].parent;
+	}
+}
+
 static void smp_do_core_work(uint32_t srcid, long a0, long a1, long a2)
 {
 	struct all_cpu_work *acw = (struct all_cpu_work *) a0;
+	int idx = a1;
 
+	smp_tree_fan_out(acw, idx, a2);
 	acw->func(acw->opaque);
-	completion_complete(&acw->comp, 1);
+	smp_tree_done(acw, idx);
+}
+
+static int smp_topo_cmp(const void *a, const void *b)
+{
+	struct core_info *ca = &cpu_topology_info.core_list[*(uint32_t*)a];
+	struct core_info *cb = &cpu_topology_info.core_list[*(uint32_t*)b];
+
+	if (ca->numa_id != cb->numa_id)
+		return ca->numa_id - cb->numa_id;
+	if (ca->socket_id != cb->socket_id)
+		return ca->socket_id - cb->socket_id;
+	if (ca->cpu_id != cb->cpu_id)
+		return ca->cpu_id - cb->cpu_id;
+	return *(uint32_t*)a - *(uint32_t*)b;
 }
 
 void smp_do_in_cores(const struct core_set *cset, void (*func)(void *),
@@ -257,20 +353,32 @@ void smp_do_in_cores(const struct core_set *cset, void (*func)(void *),
 {
 	int cpu = core_id();
 	struct all_cpu_work acw;
+	uint32_t *order;
+	int nr = 0;
 
 	memset(&acw, 0, sizeof(acw));
-	completion_init(&acw.comp, core_set_remote_count(cset));
+	completion_init(&acw.comp, 1);
 	acw.func = func;
 	acw.opaque = opaque;
-
+	/* Node 0 is us, even if we're not in cset; we're the root of the tree */
+	acw.nodes = kmalloc(sizeof(struct smp_tree_node) * num_cores,
+	                    MEM_WAIT);
+	order = kmalloc(sizeof(uint32_t) * num_cores, MEM_WAIT);
 	for (int i = 0; i < num_cores; i++) {
-		if (core_set_getcpu(cset, i)) {
-			if (i == cpu)
-				func(opaque);
-			else
-				send_kernel_message(i, smp_do_core_work, (long) &acw, 0, 0,
-									KMSG_ROUTINE);
-		}
+		if (core_set_getcpu(cset, i) && i != cpu)
+			order[nr++] = i;
 	}
+	sort(order, nr, sizeof(uint32_t), smp_topo_cmp);
+	acw.nodes[0].coreid = cpu;
+	for (int i = 0; i < nr; i++)
+		acw.nodes[i + 1].coreid = order[i];
+	kfree(order);
+
+	/* Get the others going before we do our part */
+	smp_tree_fan_out(&acw, 0, nr + 1);
+	if (core_set_getcpu(cset, cpu))
+		func(opaque);
+	smp_tree_done(&acw, 0);
 	completion_wait(&acw.comp);
+	kfree(acw.nodes);
 }
@@ -1,9 +1,20 @@
 // Basic string routines.  Not hardware optimized, but not shabby.
+//
+// On x86, memcpy and memset use rep movsb/stosb when the CPU has ERMS, and big
+// copies use non-temporal stores.  The cpu_feats are set during boot, so early
+// callers get the generic loops.
 
 #include <stdio.h>
 #include <string.h>
 #include <ros/memlayout.h>
 #include <assert.h>
+#include <cpu_feat.h>
+
+/* Below this, rep movsb's startup cost loses to the loops, unless the CPU has
+ * FSRM. */
+#define STRING_ERMS_MIN			64
+/* Copies this big blow out the cache anyway, so don't bother filling it. */
+#define MEMCPY_NT_MIN			(1 << 20)
 
 int
 strlen(const char *s)
@@ -228,6 +239,10 @@ memset(void *v, int c, size_t _n)
 
 	if (n == 0) return NULL; // zra: complain here?
 
+#ifdef CONFIG_X86
+	if (n >= STRING_ERMS_MIN && cpu_has_feat(CPU_FEAT_X86_ERMS))
+		return memset_erms(v, c, n);
+#endif
 	p = v;
 
     while (n > 0 && ((uintptr_t)p & (sizeof(long)-1)))
@@ -262,6 +277,13 @@ memcpy(void* dst, const void* src, size_t _n)
 	size_t n = _n;
 	int align = sizeof(long)-1;
 
+#ifdef CONFIG_X86
+	if (n >= MEMCPY_NT_MIN)
+		return memcpy_nt(dst, src, n);
+	if (cpu_has_feat(CPU_FEAT_X86_ERMS) &&
+	    (n >= STRING_ERMS_MIN || cpu_has_feat(CPU_FEAT_X86_FSRM)))
+		return memcpy_erms(dst, src, n);
+#endif
 	s = src;
 	d = dst;
 
@@ -295,6 +317,13 @@ void *
 memmove(void *dst, const void *src, size_t _n)
 {
 #ifdef CONFIG_X86
+	/* Copying forwards is fine unless dst starts inside src. */
+	if ((uintptr_t)dst - (uintptr_t)src >= _n) {
+		if (_n >= MEMCPY_NT_MIN)
+			return memcpy_nt(dst, src, _n);
+		if (_n >= STRING_ERMS_MIN && cpu_has_feat(CPU_FEAT_X86_ERMS))
+			return memcpy_erms(dst, src, _n);
+	}
 	bcopy(src, dst, _n);
 	return dst;
 #else
@@ -323,6 +352,14 @@ memcmp(const void *v1, const void *v2, size_t n)
 	const uint8_t *s1 = (const uint8_t *) v1;
 	const uint8_t *s2 = (const uint8_t *) v2;
 
+	/* Skip the equal words, then find the differing byte. */
+	if ((((uintptr_t)s1 | (uintptr_t)s2) & (sizeof(long)-1)) == 0) {
+		while (n >= sizeof(long) && *(const long*)s1 == *(const long*)s2) {
+			s1 += sizeof(long);
+			s2 += sizeof(long);
+			n -= sizeof(long);
+		}
+	}
 	while (n-- > 0) {
 		if (*s1 != *s2)
 			return (int) *s1 - (int) *s2;
@@ -0,0 +1,221 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Syscall submission rings for MCPs (see ros/sysc_ring.h).
+ *
+ * Ring syscalls are run by poller ktasks, which live on one of the LL cores so
+ * they don't steal the MCP's cores.  A poller grabs one sysc at a time and runs
+ * it like any other syscall, so SC_DONE and the ev_q events work as usual.  If
+ * there's more work behind the one it took, it starts another poller first.
+ * That poller runs on the same core, so it only gets going if the first one
+ * blocks (or finishes), which is how we keep the ring moving around syscalls
+ * that block, without a kthread per syscall when they don't.
+ *
+ * The last poller hangs around for a little while after the ring goes empty,
+ * then asks for a kick and exits.
+ *
+ * Only a subset of the syscalls can come from the ring: anything that messes
+ * with the calling context, vcores or the process lifecycle expects to be run
+ * from a trap on one of the proc's cores. */
+
+#include <assert.h>
+#include <atomic.h>
+#include <kthread.h>
+#include <process.h>
+#include <smp.h>
+#include <stdio.h>
+#include <syscall.h>
+#include <sysc_ring.h>
+#include <umem.h>
+
+#define SYSC_RING_MAX_POLLERS	8
+#define SYSC_RING_POLL_USEC		50
+#define SYSC_RING_IDLE_POLLS	20
+
+static bool sysc_ring_allowed(unsigned int num)
+{
+	switch (num) {
+	case SYS_null:
+	case SYS_block:
+	case SYS_nanosleep:
+	case SYS_read:
+	case SYS_write:
+	case SYS_openat:
+	case SYS_close:
+	case SYS_fstat:
+	case SYS_stat:
+	case SYS_lstat:
+	case SYS_fcntl:
+	case SYS_access:
+	case SYS_llseek:
+	case SYS_link:
+	case SYS_unlink:
+	case SYS_symlink:
+	case SYS_readlink:
+	case SYS_mkdir:
+	case SYS_rmdir:
+	case SYS_wstat:
+	case SYS_fwstat:
+	case SYS_rename:
+	case SYS_readv:
+	case SYS_writev:
+	case SYS_splice:
+	case SYS_pread:
+	case SYS_pwrite:
+	case SYS_fd2path:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static struct sysc_ring *proc_sysc_ring(struct proc *p)
+{
+	return &p->procdata->sysc_ring;
+}
+
+static bool sysc_ring_has_work(struct proc *p)
+{
+	return READ_ONCE(proc_sysc_ring(p)->prod) != READ_ONCE(p->sysc_ring_cons);
+}
+
+/* Returns the next sysc, or NULL if the ring is empty.  Our cons is the real
+ * one; the ring's copy is just for userspace to see which slots it can reuse.
+ * *more tells the caller if there's work behind this one. */
+static struct syscall *sysc_ring_pop(struct proc *p, bool *more)
+{
+	struct sysc_ring *sr = proc_sysc_ring(p);
+	struct syscall *sysc = NULL;
+	uint32_t prod;
+
+	spin_lock(&p->sysc_ring_lock);
+	prod = READ_ONCE(sr->prod);
+	if (prod - p->sysc_ring_cons > SYSC_RING_SZ) {
+		/* userspace scribbled on prod; drop whatever it thinks it queued */
+		p->sysc_ring_cons = prod;
+	} else if (prod != p->sysc_ring_cons) {
+		rmb();	/* read the slot after prod */
+		sysc = READ_ONCE(sr->sq[p->sysc_ring_cons & SYSC_RING_MASK]);
+		p->sysc_ring_cons++;
+		*more = prod != p->sysc_ring_cons;
+	}
+	WRITE_ONCE(sr->cons, p->sysc_ring_cons);
+	spin_unlock(&p->sysc_ring_lock);
+	return sysc;
+}
+
+static void sysc_ring_run(struct proc *p, struct syscall *sysc)
+{
+	if (!is_user_rwaddr(sysc, sizeof(struct syscall))) {
+		printk("[kernel] bad user addr %p (+%p) in the sysc ring (user bug)\n",
+		       sysc, sizeof(struct syscall));
+		return;
+	}
+	if (!sysc_ring_allowed(READ_ONCE(sysc->num))) {
+		fail_sysc(sysc, p, ENOSYS);
+		return;
+	}
+	run_local_syscall(sysc);
+}
+
+static void sysc_ring_poller(void *arg);
+
+static void sysc_ring_start_poller(struct proc *p)
+{
+	struct sysc_ring *sr = proc_sysc_ring(p);
+
+	if (atomic_fetch_and_add(&p->sysc_ring_pollers, 1) >=
+	    SYSC_RING_MAX_POLLERS) {
+		atomic_dec(&p->sysc_ring_pollers);
+		return;
+	}
+	WRITE_ONCE(sr->flags, sr->flags & ~SYSC_RING_NEED_KICK);
+	proc_incref(p, 1);
+	ktask("sysc_ring", sysc_ring_poller, p);
+}
+
+/* Called by an idle poller.  Returns TRUE if it should exit.  If we're the last
+ * one, we ask for a kick before going, and then check for work that userspace
+ * queued before it could see the flag. */
+static bool sysc_ring_poller_exit(struct proc *p)
+{
+	struct sysc_ring *sr = proc_sysc_ring(p);
+
+	if (atomic_read(&p->sysc_ring_pollers) > 1) {
+		atomic_dec(&p->sysc_ring_pollers);
+		return TRUE;
+	}
+	WRITE_ONCE(sr->flags, sr->flags | SYSC_RING_NEED_KICK);
+	mb();	/* write the flag before reading prod, pairs with userspace */
+	if (sysc_ring_has_work(p)) {
+		WRITE_ONCE(sr->flags, sr->flags & ~SYSC_RING_NEED_KICK);
+		return FALSE;
+	}
+	atomic_dec(&p->sysc_ring_pollers);
+	return TRUE;
+}
+
+static void sysc_ring_poller(void *arg)
+{
+	struct proc *p = arg;
+	struct syscall *sysc;
+	uintptr_t old_proc;
+	unsigned int idle = 0;
+	bool more = FALSE;
+
+	kthread_set_home_core(p->pid % MAX(MIN(CONFIG_NR_LL_CORES, num_cores),
+	                                   1));
+	old_proc = switch_to(p);
+	while (!proc_is_dying(p)) {
+		sysc = sysc_ring_pop(p, &more);
+		if (!sysc) {
+			if (idle++ < SYSC_RING_IDLE_POLLS) {
+				kthread_usleep(SYSC_RING_POLL_USEC);
+				continue;
+			}
+			if (sysc_ring_poller_exit(p))
+				goto out;
+			idle = 0;
+			continue;
+		}
+		idle = 0;
+		if (more)
+			sysc_ring_start_poller(p);
+		sysc_ring_run(p, sysc);
+	}
+	atomic_dec(&p->sysc_ring_pollers);
+out:
+	switch_back(p, old_proc);
+	proc_decref(p);
+}
+
+/* Called on every syscall trap.  If the ring has work and no one is polling,
+ * the pollers went idle before userspace queued it. */
+void sysc_ring_poke(struct proc *p)
+{
+	if (!__proc_is_mcp(p) || !sysc_ring_has_work(p))
+		return;
+	if (atomic_read(&p->sysc_ring_pollers))
+		return;
+	sysc_ring_start_poller(p);
+}
+
+int sysc_ring_kick(struct proc *p)
+{
+	if (!__proc_is_mcp(p)) {
+		set_error(EINVAL, "only MCPs can use the syscall ring");
+		return -1;
+	}
+	sysc_ring_start_poller(p);
+	return 0;
+}
+
+/* Called when procdata is (re)initialized.  There are no pollers yet, so the
+ * first submission needs a kick. */
+void sysc_ring_init(struct proc *p)
+{
+	spinlock_init(&p->sysc_ring_lock);
+	p->sysc_ring_cons = 0;
+	atomic_init(&p->sysc_ring_pollers, 0);
+	p->procdata->sysc_ring.flags = SYSC_RING_NEED_KICK;
+}
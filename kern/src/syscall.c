@@ -27,6 +27,7 @@
 #include <bitmask.h>
 #include <smp.h>
 #include <arsc_server.h>
+#include <sysc_ring.h>
 #include <event.h>
 #include <kprof.h>
 #include <termios.h>
@@ -167,15 +168,237 @@ static bool should_strace(struct proc *p, struct syscall *sysc)
 		return FALSE;
 	/* TOCTTOU concerns - sysc is __user. */
 	sysc_num = ACCESS_ONCE(sysc->num);
+	/* Filter first, so untraced syscalls don't count as drops. */
+	if (sysc_num >= MAX_SYSCALL_NR)
+		return FALSE;
+	if (!test_bit(sysc_num, p->strace->trace_set))
+		return FALSE;
+	if (p->strace->binary)
+		return TRUE;
 	if (qfull(p->strace->q)) {
 		if (p->strace->drop_overflow || !sysc_can_block(sysc_num)) {
 			atomic_inc(&p->strace->nr_drops);
 			return FALSE;
 		}
 	}
-	if (sysc_num > MAX_SYSCALL_NR)
-		return FALSE;
-	return test_bit(sysc_num, p->strace->trace_set);
+	return TRUE;
+}
+
+/* Binary strace: instead of formatting text and writing it to the qio, we put
+ * fixed-size records in per-core rings, and the strace_bin reader drains them.
+ * Each core is the only producer for its ring and there's only one reader, so
+ * we just need the indexes and barriers.  Syscalls don't run in IRQ context and
+ * we don't block while filling in a record, so the core's ring is ours.
+ *
+ * If the reader falls behind, we drop records rather than wait. */
+#define STRACE_BIN_RING_SZ		(64 * 1024)
+#define STRACE_BIN_POLL_USEC	10000
+
+struct strace_bin_ring {
+	struct trace_ring			tr;
+	unsigned long				prod;
+	unsigned long				cons __attribute__((aligned(ARCH_CL_SIZE)));
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct systrace_bin_record *strace_bin_get_slot(struct strace_bin_ring *r)
+{
+	if (r->prod - READ_ONCE(r->cons) >= r->tr.tr_max)
+		return NULL;
+	return __get_tr_slot_overwrite(&r->tr, r->prod);
+}
+
+static void strace_bin_commit(struct strace_bin_ring *r)
+{
+	wmb();	/* write the record before the reader can see it */
+	WRITE_ONCE(r->prod, r->prod + 1);
+}
+
+static void systrace_start_bin(struct kthread *kthread, struct proc *p,
+                               struct syscall *sysc)
+{
+	struct strace_bin_ring *r = &p->strace->bin_rings[core_id()];
+	struct systrace_bin_record *rec;
+
+	rec = strace_bin_get_slot(r);
+	if (!rec) {
+		atomic_inc(&p->strace->nr_drops);
+		return;
+	}
+	rec->start_tsc = read_tsc();
+	rec->end_tsc = 0;
+	rec->syscallno = ACCESS_ONCE(sysc->num);
+	rec->args[0] = sysc->arg0;
+	rec->args[1] = sysc->arg1;
+	rec->args[2] = sysc->arg2;
+	rec->args[3] = sysc->arg3;
+	rec->args[4] = sysc->arg4;
+	rec->args[5] = sysc->arg5;
+	rec->retval = 0;
+	rec->pid = p->pid;
+	rec->coreid = core_id();
+	rec->vcoreid = proc_get_vcoreid(p);
+	rec->err = 0;
+	rec->flags = 0;
+	kthread->strace_bin_tsc = rec->start_tsc;
+	kthread->strace_bin_num = rec->syscallno;
+	strace_bin_commit(r);
+	p->strace->appx_nr_sysc++;
+}
+
+/* We might be on a different core than the entry, so we use this core's ring.
+ * The records have timestamps, so the reader can sort it out. */
+static void systrace_finish_bin(struct kthread *kthread, long retval)
+{
+	struct proc *p = current;
+	struct strace_bin_ring *r = &p->strace->bin_rings[core_id()];
+	struct systrace_bin_record *rec;
+
+	uint64_t start_tsc = kthread->strace_bin_tsc;
+
+	kthread->strace_bin_tsc = 0;
+	rec = strace_bin_get_slot(r);
+	if (!rec) {
+		atomic_inc(&p->strace->nr_drops);
+		return;
+	}
+	rec->start_tsc = start_tsc;
+	rec->end_tsc = read_tsc();
+	rec->syscallno = kthread->strace_bin_num;
+	memset(rec->args, 0, sizeof(rec->args));
+	rec->retval = retval;
+	rec->pid = p->pid;
+	rec->coreid = core_id();
+	rec->vcoreid = proc_get_vcoreid(p);
+	rec->err = get_errno();
+	rec->flags = SYSTR_BIN_EXIT;
+	strace_bin_commit(r);
+}
+
+static void strace_bin_free_rings(struct strace_bin_ring *rings)
+{
+	for_each_core(i) {
+		if (rings[i].tr.tr_buf)
+			kpages_free(rings[i].tr.tr_buf, STRACE_BIN_RING_SZ);
+	}
+	kfree(rings);
+}
+
+/* Throws.  Starts binary tracing for the opener of strace_bin. */
+void strace_bin_open(struct strace *s)
+{
+	struct strace_bin_ring *rings;
+	void *buf;
+
+	if (!s->bin_rings) {
+		rings = kzmalloc_align(sizeof(struct strace_bin_ring) * num_cores,
+		                       MEM_WAIT, ARCH_CL_SIZE);
+		for_each_core(i) {
+			buf = kpages_alloc(STRACE_BIN_RING_SZ, MEM_WAIT);
+			trace_ring_init(&rings[i].tr, buf, STRACE_BIN_RING_SZ,
+			                sizeof(struct systrace_bin_record));
+		}
+		/* Once set, the rings stay until the strace is freed, so syscalls
+		 * that started before a close can still finish their records. */
+		if (!atomic_cas_ptr((void**)&s->bin_rings, 0, rings))
+			strace_bin_free_rings(rings);
+	}
+	spin_lock(&s->lock);
+	if (s->tracing) {
+		spin_unlock(&s->lock);
+		error(EBUSY, "Process is already being traced");
+	}
+	/* Skip anything left over from a previous reader */
+	for_each_core(i)
+		s->bin_rings[i].cons = READ_ONCE(s->bin_rings[i].prod);
+	s->binary = TRUE;
+	s->tracing = TRUE;
+	spin_unlock(&s->lock);
+}
+
+void strace_bin_close(struct strace *s)
+{
+	spin_lock(&s->lock);
+	s->tracing = FALSE;
+	s->binary = FALSE;
+	spin_unlock(&s->lock);
+}
+
+/* Copies out as many whole records as fit in n, one ring at a time. */
+static size_t strace_bin_drain(struct strace *s, uint8_t *va, size_t n)
+{
+	size_t rec_sz = sizeof(struct systrace_bin_record);
+	struct strace_bin_ring *r;
+	unsigned long prod;
+	size_t amt = 0;
+
+	for_each_core(i) {
+		r = &s->bin_rings[i];
+		prod = READ_ONCE(r->prod);
+		rmb();	/* read prod before the records */
+		while ((r->cons != prod) && (amt + rec_sz <= n)) {
+			memcpy(va + amt, __get_tr_slot_overwrite(&r->tr, r->cons), rec_sz);
+			amt += rec_sz;
+			mb();	/* finish reading the record before the producer reuses it */
+			WRITE_ONCE(r->cons, r->cons + 1);
+		}
+	}
+	return amt;
+}
+
+static int strace_bin_ready(void *arg)
+{
+	struct strace *s = arg;
+
+	if (READ_ONCE(s->bin_hungup))
+		return TRUE;
+	for_each_core(i) {
+		if (READ_ONCE(s->bin_rings[i].prod) != s->bin_rings[i].cons)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Throws.  Blocks until there are records or the traced procs are gone, at
+ * which point we return 0.  The producers don't wake us, so they stay out of
+ * the rendez lock; we just poll. */
+size_t strace_bin_read(struct strace *s, void *va, size_t n)
+{
+	ERRSTACK(1);
+	size_t amt;
+
+	if (n < sizeof(struct systrace_bin_record))
+		error(EINVAL, "strace_bin reads need at least %lu bytes",
+		      sizeof(struct systrace_bin_record));
+	qlock(&s->bin_qlock);
+	if (waserror()) {
+		qunlock(&s->bin_qlock);
+		nexterror();
+	}
+	while (!(amt = strace_bin_drain(s, va, n))) {
+		if (READ_ONCE(s->bin_hungup)) {
+			set_errstr("# Traced ~%lu syscs, Dropped %lu", s->appx_nr_sysc,
+			           atomic_read(&s->nr_drops));
+			break;
+		}
+		rendez_sleep_timeout(&s->bin_rv, strace_bin_ready, s,
+		                     STRACE_BIN_POLL_USEC);
+	}
+	poperror();
+	qunlock(&s->bin_qlock);
+	return amt;
+}
+
+/* Called when the last traced proc goes away. */
+void strace_bin_hangup(struct strace *s)
+{
+	WRITE_ONCE(s->bin_hungup, TRUE);
+	rendez_wakeup(&s->bin_rv);
+}
+
+void strace_bin_free(struct strace *s)
+{
+	if (s->bin_rings)
+		strace_bin_free_rings(s->bin_rings);
 }
 
 /* Helper, copies len bytes from u_data to the trace->data, if there's room. */
@@ -233,6 +456,8 @@ static bool systrace_has_error(struct systrace_record *trace)
 	case SYS_exec:
 	case SYS_munmap:
 	case SYS_mprotect:
+	case SYS_madvise:
+	case SYS_mbind:
 	case SYS_notify:
 	case SYS_self_notify:
 	case SYS_send_event:
@@ -273,6 +498,11 @@ static bool systrace_has_error(struct systrace_record *trace)
 	case SYS_vmm_ctl:
 	case SYS_read:
 	case SYS_write:
+	case SYS_readv:
+	case SYS_writev:
+	case SYS_splice:
+	case SYS_pread:
+	case SYS_pwrite:
 	case SYS_openat:
 	case SYS_fcntl:
 	case SYS_readlink:
@@ -301,8 +531,13 @@ static void systrace_start_trace(struct kthread *kthread, struct syscall *sysc)
 	struct systrace_record *trace;
 
 	kthread->strace = 0;
+	kthread->strace_bin_tsc = 0;
 	if (!should_strace(p, sysc))
 		return;
+	if (p->strace && p->strace->binary && !systrace_loud) {
+		systrace_start_bin(kthread, p, sysc);
+		return;
+	}
 	/* TODO: consider a block_alloc and qpass, though note that we actually
 	 * write the same trace in twice (entry and exit). */
 	trace = kpages_alloc(SYSTR_BUF_SZ, MEM_ATOMIC);
@@ -413,6 +648,8 @@ static void systrace_finish_trace(struct kthread *kthread, long retval)
 	struct proc *p = current;
 	struct systrace_record *trace;
 
+	if (kthread->strace_bin_tsc)
+		systrace_finish_bin(kthread, retval);
 	if (!kthread->strace)
 		return;
 	trace = kthread->strace;
@@ -450,9 +687,13 @@ static void systrace_finish_trace(struct kthread *kthread, long retval)
 
 #ifdef CONFIG_SYSCALL_STRING_SAVING
 
+/* The string buffer stays with the kthread until the kthread is freed, so we
+ * only kmalloc once per kthread, not once per syscall. */
 static void alloc_sysc_str(struct kthread *kth)
 {
-	kth->name = kmalloc(SYSCALL_STRLEN, MEM_ATOMIC);
+	if (!kth->sysc_str)
+		kth->sysc_str = kmalloc(SYSCALL_STRLEN, MEM_ATOMIC);
+	kth->name = kth->sysc_str;
 	if (!kth->name)
 		return;
 	kth->name[0] = 0;
@@ -460,10 +701,7 @@ static void alloc_sysc_str(struct kthread *kth)
 
 static void free_sysc_str(struct kthread *kth)
 {
-	char *str = kth->name;
-
 	kth->name = 0;
-	kfree(str);
 }
 
 #define sysc_save_str(...)                                                     \
@@ -502,6 +740,15 @@ static void finish_sysc(struct syscall *sysc, struct proc *p, long retval)
 	atomic_and(&sysc->flags, ~SC_K_LOCK);
 }
 
+/* Completes sysc with err, without running it.  The caller checked the sysc's
+ * address and has p's address space loaded. */
+void fail_sysc(struct syscall *sysc, struct proc *p, int err)
+{
+	sysc->err = err;
+	sysc->errstr[0] = '\0';
+	finish_sysc(sysc, p, -1);
+}
+
 /* Helper that "finishes" the current async syscall.  This should be used with
  * care when we are not using the normal syscall completion path.
  *
@@ -691,6 +938,13 @@ static int sys_null(void)
 
 /* Diagnostic function: blocks the kthread/syscall, to help userspace test its
  * async I/O handling. */
+/* Starts a poller for the syscall ring, for when the ring says it needs a
+ * kick.  See sysc_ring.c. */
+static int sys_sysc_ring_kick(struct proc *p)
+{
+	return sysc_ring_kick(p);
+}
+
 static int sys_block(struct proc *p, unsigned long usec)
 {
 	sysc_save_str("block for %lu usec", usec);
@@ -1161,6 +1415,9 @@ static int sys_exec(struct proc *p, char *path, size_t path_l,
 	p->procinfo->program_end = 0;
 	/* When we destroy our memory regions, accessing cur_sysc would PF */
 	pcpui->cur_kthread->sysc = 0;
+	/* Same goes for the tap table, which taps surviving exec could touch */
+	p->tap_slots = NULL;
+	p->nr_tap_slots = 0;
 	unmap_and_destroy_vmrs(p);
 	/* close the CLOEXEC ones */
 	close_fdt(&p->open_files, TRUE);
@@ -1399,6 +1656,17 @@ static intreg_t sys_mprotect(struct proc *p, void *addr, size_t len, int prot)
 	return mprotect(p, (uintptr_t)addr, len, prot);
 }
 
+static intreg_t sys_madvise(struct proc *p, void *addr, size_t len, int advice)
+{
+	return madvise(p, (uintptr_t)addr, len, advice);
+}
+
+static intreg_t sys_mbind(struct proc *p, void *addr, size_t len, int mode,
+                          unsigned long nodes)
+{
+	return mbind(p, (uintptr_t)addr, len, mode, nodes);
+}
+
 static intreg_t sys_munmap(struct proc *p, void *addr, size_t len)
 {
 	return munmap(p, (uintptr_t)addr, len);
@@ -1715,6 +1983,16 @@ static int sys_vmm_ctl(struct proc *p, int cmd, unsigned long arg1,
 		vmm->flags = arg1;
 		ret = 0;
 		break;
+	case VMM_CTL_HARVEST_AD:
+		/* arg1 gpa, arg2 len, arg3 bitmap, arg4 VMM_HARVEST_ type */
+		ret = vmm_harvest_ad(p, arg1, arg2, (void*)arg3, arg4);
+		break;
+	case VMM_CTL_GET_GPC_STATE:
+	case VMM_CTL_SET_GPC_STATE:
+		/* arg1 guest_pcoreid, arg2 struct vmm_gpc_state */
+		vmm_gpc_state(p, arg1, (void*)arg2, cmd == VMM_CTL_SET_GPC_STATE);
+		ret = 0;
+		break;
 	default:
 		error(EINVAL, "Bad vmm_ctl cmd %d", cmd);
 	}
@@ -1785,6 +2063,108 @@ static intreg_t sys_write(struct proc *p, int fd, const void *buf, size_t len)
 	return syswrite(fd, (void*)buf, len);
 }
 
+/* Helper: copies in and checks the user's iovecs.  Returns a kmalloc'd array
+ * on success, which the caller frees with user_memdup_free().  On failure,
+ * returns 0 with errno set. */
+static struct iovec *copy_in_iov(struct proc *p, const struct iovec *u_iov,
+                                 int iovcnt, bool writable)
+{
+	struct iovec *iov;
+	size_t total = 0;
+
+	if (iovcnt <= 0 || iovcnt > UIO_MAXIOV) {
+		set_error(EINVAL, "bad iovcnt %d", iovcnt);
+		return 0;
+	}
+	iov = user_memdup_errno(p, u_iov, iovcnt * sizeof(struct iovec));
+	if (!iov)
+		return 0;
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+		if ((total < iov[i].iov_len) || (total > LONG_MAX)) {
+			set_error(EINVAL, "iovec lengths overflow");
+			goto fail;
+		}
+		if (writable ? !is_user_rwaddr(iov[i].iov_base, iov[i].iov_len)
+		             : !is_user_raddr(iov[i].iov_base, iov[i].iov_len)) {
+			set_error(EFAULT, "bad iov_base %p", iov[i].iov_base);
+			goto fail;
+		}
+	}
+	return iov;
+fail:
+	user_memdup_free(p, iov);
+	return 0;
+}
+
+static intreg_t sys_readv(struct proc *p, int fd, const struct iovec *u_iov,
+                          int iovcnt)
+{
+	struct iovec *iov;
+	intreg_t ret;
+
+	sysc_save_str("readv on fd %d", fd);
+	if (!iovcnt)
+		return 0;
+	iov = copy_in_iov(p, u_iov, iovcnt, TRUE);
+	if (!iov)
+		return -1;
+	ret = sysreadv(fd, iov, iovcnt);
+	user_memdup_free(p, iov);
+	return ret;
+}
+
+static intreg_t sys_writev(struct proc *p, int fd, const struct iovec *u_iov,
+                           int iovcnt)
+{
+	struct iovec *iov;
+	intreg_t ret;
+
+	sysc_save_str("writev on fd %d", fd);
+	if (!iovcnt)
+		return 0;
+	iov = copy_in_iov(p, u_iov, iovcnt, FALSE);
+	if (!iov)
+		return -1;
+	ret = syswritev(fd, iov, iovcnt);
+	user_memdup_free(p, iov);
+	return ret;
+}
+
+/* Positional reads and writes don't use or change the fd's offset, so uthreads
+ * can share an fd for random I/O without serializing. */
+static intreg_t sys_pread(struct proc *p, int fd, void *buf, size_t len,
+                          off64_t off)
+{
+	sysc_save_str("pread on fd %d at %ld", fd, off);
+	if (len > LONG_MAX) {
+		set_error(EINVAL, "pread len %lu too big", len);
+		return -1;
+	}
+	return syspread(fd, buf, len, off);
+}
+
+static intreg_t sys_pwrite(struct proc *p, int fd, const void *buf, size_t len,
+                           off64_t off)
+{
+	sysc_save_str("pwrite on fd %d at %ld", fd, off);
+	if (len > LONG_MAX) {
+		set_error(EINVAL, "pwrite len %lu too big", len);
+		return -1;
+	}
+	return syspwrite(fd, (void*)buf, len, off);
+}
+
+static intreg_t sys_splice(struct proc *p, int fd_in, int fd_out, size_t len)
+{
+	sysc_save_str("splice from fd %d to fd %d", fd_in, fd_out);
+	if (len > LONG_MAX) {
+		set_error(EINVAL, "splice len %lu too big", len);
+		return -1;
+	}
+	return syssplice(fd_in, fd_out, len);
+}
+
 /* Checks args/reads in the path, opens the file (relative to fromfd if the path
  * is not absolute), and inserts it into the process's open file list. */
 static intreg_t sys_openat(struct proc *p, int fromfd, const char *path,
@@ -1833,21 +2213,21 @@ static intreg_t sys_fstat(struct proc *p, int fd, struct kstat *u_stat)
 {
 	struct kstat *kbuf;
 
-	kbuf = kmalloc(sizeof(struct kstat), 0);
+	kbuf = kmalloc_sized(sizeof(struct kstat), 0);
 	if (!kbuf) {
 		set_errno(ENOMEM);
 		return -1;
 	}
 	if (sysfstatakaros(fd, (struct kstat *)kbuf) < 0) {
-		kfree(kbuf);
+		kfree_sized(kbuf, sizeof(struct kstat));
 		return -1;
 	}
 	/* TODO: UMEM: pin the memory, copy directly, and skip the kernel buffer */
 	if (memcpy_to_user_errno(p, u_stat, kbuf, sizeof(struct kstat))) {
-		kfree(kbuf);
+		kfree_sized(kbuf, sizeof(struct kstat));
 		return -1;
 	}
-	kfree(kbuf);
+	kfree_sized(kbuf, sizeof(struct kstat));
 	return 0;
 }
 
@@ -1863,7 +2243,7 @@ static intreg_t stat_helper(struct proc *p, const char *path, size_t path_l,
 
 	if (!t_path)
 		return -1;
-	kbuf = kmalloc(sizeof(struct kstat), 0);
+	kbuf = kmalloc_sized(sizeof(struct kstat), 0);
 	if (!kbuf) {
 		set_errno(ENOMEM);
 		retval = -1;
@@ -1877,7 +2257,7 @@ static intreg_t stat_helper(struct proc *p, const char *path, size_t path_l,
 		retval = -1;
 	/* Fall-through */
 out_with_kbuf:
-	kfree(kbuf);
+	kfree_sized(kbuf, sizeof(struct kstat));
 out_with_path:
 	free_path(p, t_path);
 	return retval;
@@ -2389,6 +2769,8 @@ static int handle_tap_req(struct proc *p, struct fd_tap_req *req)
 			return add_fd_tap(p, req);
 		case (FDTAP_CMD_REM):
 			return remove_fd_tap(p, req->fd);
+		case (FDTAP_CMD_TABLE):
+			return set_fd_tap_table(p, req);
 		default:
 			set_error(ENOSYS, "FD Tap Command %d not supported", req->cmd);
 			return -1;
@@ -2453,8 +2835,11 @@ const struct sys_table_entry syscall_table[] = {
 	[SYS_abort_sysc] = {(syscall_t)sys_abort_sysc, "abort_sysc"},
 	[SYS_abort_sysc_fd] = {(syscall_t)sys_abort_sysc_fd, "abort_sysc_fd"},
 	[SYS_populate_va] = {(syscall_t)sys_populate_va, "populate_va"},
+	[SYS_madvise] = {(syscall_t)sys_madvise, "madvise"},
+	[SYS_mbind] = {(syscall_t)sys_mbind, "mbind"},
 	[SYS_nanosleep] = {(syscall_t)sys_nanosleep, "nanosleep"},
 	[SYS_pop_ctx] = {(syscall_t)sys_pop_ctx, "pop_ctx"},
+	[SYS_sysc_ring_kick] = {(syscall_t)sys_sysc_ring_kick, "sysc_ring_kick"},
 
 	[SYS_read] = {(syscall_t)sys_read, "read"},
 	[SYS_write] = {(syscall_t)sys_write, "write"},
@@ -2490,6 +2875,11 @@ const struct sys_table_entry syscall_table[] = {
 	[SYS_rename] ={(syscall_t)sys_rename, "rename"},
 	[SYS_dup_fds_to] = {(syscall_t)sys_dup_fds_to, "dup_fds_to"},
 	[SYS_tap_fds] = {(syscall_t)sys_tap_fds, "tap_fds"},
+	[SYS_readv] = {(syscall_t)sys_readv, "readv"},
+	[SYS_writev] = {(syscall_t)sys_writev, "writev"},
+	[SYS_splice] = {(syscall_t)sys_splice, "splice"},
+	[SYS_pread] = {(syscall_t)sys_pread, "pread"},
+	[SYS_pwrite] = {(syscall_t)sys_pwrite, "pwrite"},
 };
 const int max_syscall = sizeof(syscall_table)/sizeof(syscall_table[0]);
 
@@ -2570,6 +2960,8 @@ void run_local_syscall(struct syscall *sysc)
  * at least one, it will run it directly. */
 void prep_syscalls(struct proc *p, struct syscall *sysc, unsigned int nr_syscs)
 {
+	/* Pick up anything queued on the syscall ring since its pollers left. */
+	sysc_ring_poke(p);
 	/* Careful with pcpui here, we could have migrated */
 	if (!nr_syscs) {
 		printk("[kernel] No nr_sysc, probably a bug, user!\n");
@@ -2610,6 +3002,10 @@ bool syscall_uses_fd(struct syscall *sysc, int fd)
 	switch (sysc->num) {
 		case (SYS_read):
 		case (SYS_write):
+		case (SYS_readv):
+		case (SYS_writev):
+		case (SYS_pread):
+		case (SYS_pwrite):
 		case (SYS_close):
 		case (SYS_fstat):
 		case (SYS_fcntl):
@@ -2619,6 +3015,10 @@ bool syscall_uses_fd(struct syscall *sysc, int fd)
 			if (sysc->arg0 == fd)
 				return TRUE;
 			return FALSE;
+		case (SYS_splice):
+			if ((sysc->arg0 == fd) || (sysc->arg1 == fd))
+				return TRUE;
+			return FALSE;
 		case (SYS_mmap):
 			/* mmap always has to be special. =) */
 			if (sysc->arg4 == fd)
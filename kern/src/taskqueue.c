@@ -4,11 +4,33 @@
  *
  * Hacked BSD taskqueues.  In lieu of actually running a kproc or something that
  * sleeps on a queue of tasks, we'll just blast out a kmsg.  We can always
- * change the implementation if we need more control. */
+ * change the implementation if we need more control.
+ *
+ * Linux workqueues run out of per-core worker pools, see taskqueue.h.
+ *
+ * Locking: a work item that hasn't started is on its pool's worklist or on its
+ * wq's inactive list.  It only moves onto a worklist with the wq lock held, so
+ * the lock ordering is wq before pool.  Workers take work off their worklist
+ * with just the pool lock.  Once work is off the lists, its pending bit is
+ * clear and it can be queued again, even while it runs.
+ *
+ * Delayed work sits on an IRQ alarm until it's due, and the alarm handler
+ * queues it.  That handler runs with its tchain lock held, so never unset an
+ * alarm with a wq or pool lock held. */
 
 #include <taskqueue.h>
 #include <trap.h>
 #include <kthread.h>
+#include <kmalloc.h>
+#include <percpu.h>
+#include <corerequest.h>
+#include <latency.h>
+#include <smp.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+#include <ns.h>
 
 /* BSD Taskqueue wrappers. */
 static void __tq_wrapper(uint32_t srcid, long a0, long a1, long a2)
@@ -26,91 +48,574 @@ int taskqueue_enqueue(struct taskqueue *queue, struct task *task)
 }
 
 
-/* Linux workqueue wrappers */
-void flush_workqueue(struct workqueue_struct *wq)
+/* Linux workqueues */
+
+#define WQ_POOL_TARGET			4
+#define WQ_POOL_MAX_TARGET		64
+/* Extra workers exit after being idle this long */
+#define WQ_IDLE_USEC			(10 * 1000 * 1000)
+
+struct wq_worker {
+	TAILQ_ENTRY(wq_worker)		link;
+	struct work_struct			*cur_work;
+};
+TAILQ_HEAD(wq_worker_tailq, wq_worker);
+
+struct wq_pool {
+	spinlock_t					lock;
+	int							coreid;
+	struct work_tailq			worklist;
+	struct wq_worker_tailq		workers;
+	struct rendez				rv;			/* idle workers sleep here */
+	unsigned int				nr_pending;
+	unsigned int				nr_workers;	/* including one we're spawning */
+	unsigned int				nr_idle;
+	unsigned int				nr_running;
+	bool						spawning;
+	uint64_t					nr_done;
+	uint64_t					nr_spawned;
+	char						name[WQ_NAME_SZ];
+};
+
+static DEFINE_PERCPU(struct wq_pool, wq_pools);
+static unsigned int wq_pool_target = WQ_POOL_TARGET;
+
+static struct workqueue_struct *system_wq;
+static TAILQ_HEAD(wq_tailq, workqueue_struct) wq_list =
+	TAILQ_HEAD_INITIALIZER(wq_list);
+static spinlock_t wq_list_lock = SPINLOCK_INITIALIZER;
+
+static void wq_worker_ktask(void *arg);
+
+static struct wq_pool *get_pool(int coreid)
 {
+	return _PERCPU_VARPTR(wq_pools, coreid);
 }
 
-void destroy_workqueue(struct workqueue_struct *wq)
+/* Called from rendez_sleep with the CV lock held, so no pool lock. */
+static int pool_has_work(void *arg)
+{
+	struct wq_pool *pool = arg;
+
+	return !TAILQ_EMPTY(&pool->worklist);
+}
+
+/* Makes sure someone will run the pool's work: wakes an idle worker, or spawns
+ * another one if we're under the target.  Spawning is a routine kmsg, so the
+ * new worker won't run until the current one blocks or yields.  Call with the
+ * pool locked. */
+static void __pool_kick(struct wq_pool *pool)
 {
+	if (TAILQ_EMPTY(&pool->worklist))
+		return;
+	if (pool->nr_idle) {
+		rendez_wakeup(&pool->rv);
+		return;
+	}
+	if (pool->spawning || pool->nr_workers >= READ_ONCE(wq_pool_target))
+		return;
+	pool->spawning = TRUE;
+	pool->nr_workers++;
+	pool->nr_spawned++;
+	ktask_on(pool->coreid, pool->name, wq_worker_ktask, pool);
 }
 
-struct workqueue_struct *create_singlethread_workqueue(char *name)
+static void pool_push(struct wq_pool *pool, struct work_struct *work)
 {
-	/* Non-canonical addr on AMD64.  No one should be derefing this. */
-	return (void*)0xf0f0f0f0f0f0f0f0;
+	spin_lock_irqsave(&pool->lock);
+	TAILQ_INSERT_TAIL(&pool->worklist, work, link);
+	work->pool = pool;
+	pool->nr_pending++;
+	__pool_kick(pool);
+	spin_unlock_irqsave(&pool->lock);
 }
 
-static void __wq_wrapper(uint32_t srcid, long a0, long a1, long a2)
+static bool pool_is_idle(struct wq_pool *pool)
 {
-	struct work_struct *work = (struct work_struct*)a0;
-	work->func(work);
+	return READ_ONCE(pool->nr_idle) && !READ_ONCE(pool->nr_pending);
 }
 
-/* Linux callers use jiffies as the unit of delay.  We pretend to be a 1000 HZ
- * machine with 1 msec jiffies. */
-static void __wq_wrapper_delay(uint32_t srcid, long a0, long a1, long a2)
+/* Unbound work goes to an LL core with an idle worker and nothing queued,
+ * preferably ours.  Otherwise it goes to the least loaded LL core.  These are
+ * racy peeks; it's just a hint. */
+static struct wq_pool *pick_unbound_pool(void)
 {
-	struct work_struct *work = (struct work_struct*)a0;
-	unsigned long delay = (unsigned long)a1;
+	struct wq_pool *pool, *best = NULL;
+	unsigned int load, best_load = UINT32_MAX;
 
-	kthread_usleep(delay * 1000);
-	work->func(work);
+	if (is_ll_core(core_id())) {
+		pool = get_pool(core_id());
+		if (pool_is_idle(pool))
+			return pool;
+	}
+	for (int i = 0; i < num_cores && is_ll_core(i); i++) {
+		pool = get_pool(i);
+		if (pool_is_idle(pool))
+			return pool;
+		load = READ_ONCE(pool->nr_pending) + READ_ONCE(pool->nr_running);
+		if (load < best_load) {
+			best = pool;
+			best_load = load;
+		}
+	}
+	return best;
 }
 
-static void send_work(int coreid, struct work_struct *work)
+/* Call with wq locked. */
+static void __wq_activate(struct workqueue_struct *wq, struct work_struct *work)
 {
-	send_kernel_message(coreid, __wq_wrapper, (long)work, 0, 0, KMSG_ROUTINE);
+	struct wq_pool *pool;
+
+	if (wq->flags & WQ_UNBOUND)
+		pool = pick_unbound_pool();
+	else
+		pool = get_pool(work->coreid);
+	wq->nr_active++;
+	pool_push(pool, work);
 }
 
-static void send_work_delay(int coreid, struct delayed_work *work,
-                            unsigned long delay)
+/* Call with wq locked, when work is done (or cancelled) and no longer in
+ * flight.  was_active means it counted against max_active. */
+static void __wq_retire(struct workqueue_struct *wq, bool was_active)
 {
-	send_kernel_message(coreid, __wq_wrapper_delay, (long)work, (long)delay, 0,
-	                    KMSG_ROUTINE);
+	struct work_struct *next;
+
+	if (was_active) {
+		wq->nr_active--;
+		next = TAILQ_FIRST(&wq->inactive);
+		if (next) {
+			TAILQ_REMOVE(&wq->inactive, next, link);
+			next->inactive = FALSE;
+			__wq_activate(wq, next);
+		}
+	}
+	wq->nr_in_flight--;
+	/* Flushers and cancel_sync()ers */
+	rendez_wakeup(&wq->done_rv);
 }
 
-bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+/* Work is pending and its wq and coreid are set. */
+static void __queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	spin_lock_irqsave(&wq->lock);
+	work->queued_at = read_tsc();
+	wq->nr_in_flight++;
+	wq->stats.nr_queued++;
+	if (wq->nr_active < wq->max_active) {
+		__wq_activate(wq, work);
+	} else {
+		work->inactive = TRUE;
+		TAILQ_INSERT_TAIL(&wq->inactive, work, link);
+	}
+	spin_unlock_irqsave(&wq->lock);
+}
+
+static void wq_work_done(struct workqueue_struct *wq, uint64_t queued,
+                         uint64_t start, uint64_t end)
+{
+	struct wq_stats *stats = &wq->stats;
+
+	spin_lock_irqsave(&wq->lock);
+	stats->nr_done++;
+	stats->wait_ticks += start - queued;
+	stats->max_wait_ticks = MAX(stats->max_wait_ticks, start - queued);
+	stats->run_ticks += end - start;
+	stats->max_run_ticks = MAX(stats->max_run_ticks, end - start);
+	__wq_retire(wq, TRUE);
+	spin_unlock_irqsave(&wq->lock);
+}
+
+static void wq_worker_ktask(void *arg)
+{
+	struct wq_pool *pool = arg;
+	struct wq_worker self = {.cur_work = NULL};
+	struct workqueue_struct *wq;
+	struct work_struct *work;
+	void (*func)(struct work_struct *);
+	uint64_t queued, start, end;
+
+	/* ktask_on() started us on the pool's core; stay there when we block. */
+	kthread_set_home_core(pool->coreid);
+	spin_lock_irqsave(&pool->lock);
+	pool->spawning = FALSE;
+	TAILQ_INSERT_TAIL(&pool->workers, &self, link);
+	while (1) {
+		work = TAILQ_FIRST(&pool->worklist);
+		if (!work) {
+			pool->nr_idle++;
+			spin_unlock_irqsave(&pool->lock);
+			rendez_sleep_timeout(&pool->rv, pool_has_work, pool,
+			                     WQ_IDLE_USEC);
+			spin_lock_irqsave(&pool->lock);
+			pool->nr_idle--;
+			/* The last one sticks around, so work doesn't wait on a spawn */
+			if (TAILQ_EMPTY(&pool->worklist) && pool->nr_workers > 1)
+				break;
+			continue;
+		}
+		TAILQ_REMOVE(&pool->worklist, work, link);
+		work->pool = NULL;
+		pool->nr_pending--;
+		pool->nr_running++;
+		self.cur_work = work;
+		wq = work->wq;
+		func = work->func;
+		queued = work->queued_at;
+		clear_bit(WORK_STRUCT_PENDING_BIT, &work->flags);
+		/* In case we block, someone else can take the rest */
+		__pool_kick(pool);
+		spin_unlock_irqsave(&pool->lock);
+
+		start = read_tsc();
+		lat_record(LAT_WORK_WAIT, start - queued);
+		/* func can free work, so we're done touching it (other than comparing
+		 * pointers in self.cur_work) */
+		func(work);
+		end = read_tsc();
+
+		spin_lock_irqsave(&pool->lock);
+		self.cur_work = NULL;
+		pool->nr_running--;
+		pool->nr_done++;
+		spin_unlock_irqsave(&pool->lock);
+		wq_work_done(wq, queued, start, end);
+		/* Let the core's other kernel work in between our items */
+		if (has_routine_kmsg())
+			kthread_yield();
+		spin_lock_irqsave(&pool->lock);
+	}
+	TAILQ_REMOVE(&pool->workers, &self, link);
+	pool->nr_workers--;
+	spin_unlock_irqsave(&pool->lock);
+}
+
+void workqueue_init(void)
+{
+	struct wq_pool *pool;
+
+	for_each_core(i) {
+		pool = get_pool(i);
+		spinlock_init_irqsave(&pool->lock);
+		pool->coreid = i;
+		TAILQ_INIT(&pool->worklist);
+		TAILQ_INIT(&pool->workers);
+		rendez_init(&pool->rv);
+		snprintf(pool->name, sizeof(pool->name), "kworker/%d", i);
+	}
+	system_wq = alloc_workqueue("events", WQ_UNBOUND, 0);
+}
+
+/* max_active <= 0 means the default. */
+struct workqueue_struct *alloc_workqueue(const char *name, int flags,
+                                         int max_active)
+{
+	struct workqueue_struct *wq = kzmalloc(sizeof(struct workqueue_struct),
+	                                       MEM_WAIT);
+
+	strlcpy(wq->name, name, sizeof(wq->name));
+	wq->flags = flags;
+	wq->max_active = max_active > 0 ? MIN(max_active, WQ_MAX_ACTIVE)
+	                                : WQ_DFL_ACTIVE;
+	spinlock_init_irqsave(&wq->lock);
+	TAILQ_INIT(&wq->inactive);
+	rendez_init(&wq->done_rv);
+	spin_lock(&wq_list_lock);
+	TAILQ_INSERT_TAIL(&wq_list, wq, link);
+	spin_unlock(&wq_list_lock);
+	return wq;
+}
+
+static int wq_is_empty(void *arg)
+{
+	struct workqueue_struct *wq = arg;
+
+	return !READ_ONCE(wq->nr_in_flight);
+}
+
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	rendez_sleep(&wq->done_rv, wq_is_empty, wq);
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	flush_workqueue(wq);
+	spin_lock(&wq_list_lock);
+	TAILQ_REMOVE(&wq_list, wq, link);
+	spin_unlock(&wq_list_lock);
+	kfree(wq);
+}
+
+bool queue_work_on(int coreid, struct workqueue_struct *wq,
+                   struct work_struct *work)
 {
-	send_work(core_id(), work);
+	if (test_and_set_bit(WORK_STRUCT_PENDING_BIT, &work->flags))
+		return FALSE;
+	work->wq = wq;
+	work->coreid = coreid;
+	__queue_work(wq, work);
 	return TRUE;
 }
 
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	return queue_work_on(core_id(), wq, work);
+}
+
 bool schedule_work(struct work_struct *work)
 {
-	send_work(0, work);
-	return TRUE;
+	return queue_work(system_wq, work);
+}
+
+/* Takes work off its worklist or its wq's inactive list, if it hasn't started
+ * yet.  Returns TRUE if we got it. */
+static bool __cancel_work(struct work_struct *work)
+{
+	struct workqueue_struct *wq = READ_ONCE(work->wq);
+	struct wq_pool *pool;
+	bool got = FALSE, was_active = FALSE;
+
+	if (!wq || !work_pending(work))
+		return FALSE;
+	spin_lock_irqsave(&wq->lock);
+	/* Only changes from NULL with the wq lock held */
+	pool = work->pool;
+	if (pool) {
+		spin_lock_irqsave(&pool->lock);
+		if (work->pool == pool) {
+			TAILQ_REMOVE(&pool->worklist, work, link);
+			work->pool = NULL;
+			pool->nr_pending--;
+			got = was_active = TRUE;
+		}
+		spin_unlock_irqsave(&pool->lock);
+	} else if (work->inactive) {
+		TAILQ_REMOVE(&wq->inactive, work, link);
+		work->inactive = FALSE;
+		got = TRUE;
+	}
+	if (got) {
+		clear_bit(WORK_STRUCT_PENDING_BIT, &work->flags);
+		wq->stats.nr_cancelled++;
+		__wq_retire(wq, was_active);
+	}
+	spin_unlock_irqsave(&wq->lock);
+	return got;
+}
+
+static bool work_is_running(struct work_struct *work)
+{
+	struct wq_pool *pool;
+	struct wq_worker *i;
+	bool ret = FALSE;
+
+	for_each_core(c) {
+		pool = get_pool(c);
+		if (!READ_ONCE(pool->nr_running))
+			continue;
+		spin_lock_irqsave(&pool->lock);
+		TAILQ_FOREACH(i, &pool->workers, link) {
+			if (i->cur_work == work)
+				ret = TRUE;
+		}
+		spin_unlock_irqsave(&pool->lock);
+		if (ret)
+			break;
+	}
+	return ret;
+}
+
+static int work_is_idle(void *arg)
+{
+	return !work_is_running(arg);
+}
+
+/* Waits until work isn't running anywhere. */
+static void wait_for_work(struct work_struct *work)
+{
+	struct workqueue_struct *wq = READ_ONCE(work->wq);
+
+	if (wq)
+		rendez_sleep(&wq->done_rv, work_is_idle, work);
+}
+
+bool cancel_work(struct work_struct *work)
+{
+	return __cancel_work(work);
+}
+
+bool cancel_work_sync(struct work_struct *work)
+{
+	bool ret = __cancel_work(work);
+
+	wait_for_work(work);
+	return ret;
 }
 
-bool cancel_work(struct work_struct *dwork)
+/* IRQ alarm handler, with the tchain locked. */
+static void __dwork_timer(struct alarm_waiter *waiter,
+                          struct hw_trapframe *hw_tf)
 {
-	return FALSE;
+	struct delayed_work *dwork = container_of(waiter, struct delayed_work,
+	                                          timer);
+
+	__queue_work(dwork->work.wq, &dwork->work);
 }
 
-bool cancel_work_sync(struct work_struct *dwork)
+void __init_delayed_work(struct delayed_work *dwork,
+                         void (*func)(struct work_struct *))
 {
-	return FALSE;
+	INIT_WORK(&dwork->work, func);
+	init_awaiter_irq(&dwork->timer, __dwork_timer);
+	dwork->tchain = NULL;
+}
+
+/* Linux callers use jiffies as the unit of delay.  We pretend to be a 1000 HZ
+ * machine with 1 msec jiffies. */
+static bool queue_delayed_work_on(int coreid, struct workqueue_struct *wq,
+                                  struct delayed_work *dwork,
+                                  unsigned long delay)
+{
+	if (!delay)
+		return queue_work_on(coreid, wq, &dwork->work);
+	if (test_and_set_bit(WORK_STRUCT_PENDING_BIT, &dwork->work.flags))
+		return FALSE;
+	dwork->work.wq = wq;
+	dwork->work.coreid = coreid;
+	dwork->tchain = &per_cpu_info[core_id()].tchain;
+	set_awaiter_rel(&dwork->timer, delay * 1000);
+	set_alarm(dwork->tchain, &dwork->timer);
+	return TRUE;
 }
 
 bool queue_delayed_work(struct workqueue_struct *wq, struct delayed_work *dwork,
                         unsigned long delay)
 {
-	send_work_delay(core_id(), dwork, delay);
-	return TRUE;
+	return queue_delayed_work_on(core_id(), wq, dwork, delay);
 }
 
 bool schedule_delayed_work(struct delayed_work *dwork, unsigned long delay)
 {
-	send_work_delay(0, dwork, delay);
-	return TRUE;
+	return queue_delayed_work(system_wq, dwork, delay);
 }
 
 bool cancel_delayed_work(struct delayed_work *dwork)
 {
-	return FALSE;
+	struct workqueue_struct *wq;
+
+	/* If the alarm already went off, its handler is done and the work is
+	 * queued, running, or done. */
+	if (dwork->tchain && unset_alarm(dwork->tchain, &dwork->timer)) {
+		wq = dwork->work.wq;
+		clear_bit(WORK_STRUCT_PENDING_BIT, &dwork->work.flags);
+		spin_lock_irqsave(&wq->lock);
+		wq->stats.nr_cancelled++;
+		spin_unlock_irqsave(&wq->lock);
+		return TRUE;
+	}
+	return __cancel_work(&dwork->work);
 }
 
 bool cancel_delayed_work_sync(struct delayed_work *dwork)
 {
-	return FALSE;
+	bool ret = cancel_delayed_work(dwork);
+
+	wait_for_work(&dwork->work);
+	return ret;
+}
+
+static const char wqstat_usage[] = "reset|target N";
+
+/* Writes to #kprof/wqstat:
+ * - reset: clears every workqueue's stats
+ * - target N: each pool runs at most N workers */
+void wqstat_ctl(struct cmdbuf *cb)
+{
+	struct workqueue_struct *wq;
+	long target;
+
+	if (cb->nf < 1)
+		error(EINVAL, wqstat_usage);
+	if (!strcmp(cb->f[0], "reset")) {
+		spin_lock(&wq_list_lock);
+		TAILQ_FOREACH(wq, &wq_list, link) {
+			spin_lock_irqsave(&wq->lock);
+			memset(&wq->stats, 0, sizeof(struct wq_stats));
+			spin_unlock_irqsave(&wq->lock);
+		}
+		spin_unlock(&wq_list_lock);
+	} else if (!strcmp(cb->f[0], "target")) {
+		if (cb->nf < 2)
+			error(EINVAL, wqstat_usage);
+		target = strtol(cb->f[1], 0, 0);
+		if (target < 1 || target > WQ_POOL_MAX_TARGET)
+			error(EINVAL, "target must be 1-%d", WQ_POOL_MAX_TARGET);
+		WRITE_ONCE(wq_pool_target, target);
+	} else {
+		error(EINVAL, wqstat_usage);
+	}
+}
+
+static uint64_t avg_usec(uint64_t ticks, uint64_t nr)
+{
+	return nr ? tsc2usec(ticks / nr) : 0;
+}
+
+size_t wqstat_read(void *va, size_t n, off64_t offset)
+{
+	struct workqueue_struct *wq;
+	struct wq_stats stats;
+	struct wq_pool *pool;
+	unsigned int nr_wqs = 0, active, inflight;
+	size_t bufsz;
+	char *buf, *p, *end_p;
+
+	spin_lock(&wq_list_lock);
+	TAILQ_FOREACH(wq, &wq_list, link)
+		nr_wqs++;
+	spin_unlock(&wq_list_lock);
+	/* A few extra, in case some show up in the meantime.  seprintf won't
+	 * overflow either way. */
+	bufsz = (nr_wqs + 8) * 160 + (num_cores + 4) * 96;
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	p = buf;
+	end_p = buf + bufsz;
+	p = seprintf(p, end_p, "Workqueues, pool target %u\n",
+	             READ_ONCE(wq_pool_target));
+	p = seprintf(p, end_p, "%-20s %5s %9s %9s %10s %10s %8s %12s %12s %12s %12s\n",
+	             "name", "bound", "active", "inflight", "queued", "done",
+	             "cancel", "wait(us)", "maxwait(us)", "run(us)",
+	             "maxrun(us)");
+	spin_lock(&wq_list_lock);
+	TAILQ_FOREACH(wq, &wq_list, link) {
+		spin_lock_irqsave(&wq->lock);
+		stats = wq->stats;
+		active = wq->nr_active;
+		inflight = wq->nr_in_flight;
+		spin_unlock_irqsave(&wq->lock);
+		p = seprintf(p, end_p,
+		             "%-20s %5s %4u/%-4u %9u %10lu %10lu %8lu %12lu %12lu %12lu %12lu\n",
+		             wq->name, wq->flags & WQ_UNBOUND ? "no" : "yes", active,
+		             wq->max_active, inflight, stats.nr_queued,
+		             stats.nr_done, stats.nr_cancelled,
+		             avg_usec(stats.wait_ticks, stats.nr_done),
+		             tsc2usec(stats.max_wait_ticks),
+		             avg_usec(stats.run_ticks, stats.nr_done),
+		             tsc2usec(stats.max_run_ticks));
+	}
+	spin_unlock(&wq_list_lock);
+	p = seprintf(p, end_p, "\n%-6s %8s %8s %8s %8s %12s %10s\n", "core",
+	             "workers", "idle", "running", "pending", "done", "spawned");
+	for_each_core(i) {
+		pool = get_pool(i);
+		if (!READ_ONCE(pool->nr_spawned))
+			continue;
+		p = seprintf(p, end_p, "%-6d %8u %8u %8u %8u %12lu %10lu\n", i,
+		             READ_ONCE(pool->nr_workers), READ_ONCE(pool->nr_idle),
+		             READ_ONCE(pool->nr_running), READ_ONCE(pool->nr_pending),
+		             READ_ONCE(pool->nr_done), READ_ONCE(pool->nr_spawned));
+	}
+	n = readstr(offset, va, n, buf);
+	kfree(buf);
+	return n;
 }
@@ -103,14 +103,46 @@ uint64_t nsec2tsc(uint64_t nsec)
 	return mult_shift_64(nsec, nsec_to_cycles_mult, NSEC_TO_CYCLES_SHIFT);
 }
 
+/* Converts a TSC reading to nanoseconds since the UNIX epoch.  The wall clock
+ * could have been set after the reading. */
+uint64_t tsc_to_epoch_nsec(uint64_t tsc)
+{
+	struct proc_global_info *pgi = &__proc_global_info;
+	uint64_t walltime, last;
+	seq_ctr_t seq;
+
+	do {
+		seq = READ_ONCE(pgi->walltime_seq);
+		walltime = pgi->walltime_ns_last;
+		last = pgi->tsc_cycles_last;
+	} while (seqctr_retry(seq, READ_ONCE(pgi->walltime_seq)));
+	if (tsc < last)
+		return walltime - tsc2nsec(last - tsc);
+	return walltime + tsc2nsec(tsc - last);
+}
+
 /*
  * Return nanoseconds since the UNIX epoch, 1st January, 1970.
  */
 uint64_t epoch_nsec(void)
 {
-	uint64_t cycles = read_tsc() - __proc_global_info.tsc_cycles_last;
+	return tsc_to_epoch_nsec(read_tsc());
+}
+
+static spinlock_t walltime_lock = SPINLOCK_INITIALIZER_IRQSAVE;
 
-	return __proc_global_info.walltime_ns_last + tsc2nsec(cycles);
+/* Sets the wall clock to epoch_ns, as of now.  Userspace computes the time
+ * from the same fields, so this changes time for everyone. */
+void set_walltime(uint64_t epoch_ns)
+{
+	struct proc_global_info *pgi = &__proc_global_info;
+
+	spin_lock_irqsave(&walltime_lock);
+	__seq_start_write(&pgi->walltime_seq);
+	pgi->walltime_ns_last = epoch_ns;
+	pgi->tsc_cycles_last = read_tsc();
+	__seq_end_write(&pgi->walltime_seq);
+	spin_unlock_irqsave(&walltime_lock);
 }
 
 void time_init(void)
@@ -119,6 +151,8 @@ void time_init(void)
 
 	__proc_global_info.walltime_ns_last = read_persistent_clock();
 	__proc_global_info.tsc_cycles_last  = read_tsc();
+	__proc_global_info.walltime_ns_boot = __proc_global_info.walltime_ns_last;
+	__proc_global_info.tsc_cycles_boot  = __proc_global_info.tsc_cycles_last;
 
 	cycles_to_nsec_init(__proc_global_info.tsc_freq);
 	nsec_to_cycles_init(__proc_global_info.tsc_freq);
@@ -116,10 +116,88 @@ void kernel_msg_init(void)
 	                                     ARCH_CL_SIZE, 0, NULL, 0, 0, NULL);
 }
 
-uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
-                             long arg2, int type)
+void kmsg_queue_init(struct kmsg_queue *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+static void kmsg_queue_push(struct kmsg_queue *q, struct kernel_message *kmsg)
+{
+	struct kernel_message *prev;
+	int8_t irq_state = 0;
+
+	kmsg->next = NULL;
+	/* Until we link prev, the consumer can't get past it.  Don't let an IRQ
+	 * get in between; its handler could be the consumer. */
+	disable_irqsave(&irq_state);
+	prev = atomic_swap_ptr((void**)&q->tail, kmsg);
+	WRITE_ONCE(prev->next, kmsg);
+	enable_irqsave(&irq_state);
+}
+
+/* Pops the oldest kmsg from q; only q's core can call this.  Returns NULL if q
+ * is empty, or if it's waiting on a sender that is in the middle of a push.  In
+ * that case, the sender will kick us once it is done. */
+static struct kernel_message *kmsg_queue_pop(struct kmsg_queue *q)
+{
+	struct kernel_message *head = q->head;
+	struct kernel_message *next = READ_ONCE(head->next);
+
+	if (head == &q->stub) {
+		if (!next)
+			return NULL;
+		q->head = next;
+		head = next;
+		next = READ_ONCE(next->next);
+	}
+	if (next) {
+		q->head = next;
+		return head;
+	}
+	if (head != READ_ONCE(q->tail))
+		return NULL;
+	/* head is the last one.  Put the stub back behind it, so we can take it. */
+	kmsg_queue_push(q, &q->stub);
+	next = READ_ONCE(head->next);
+	if (next) {
+		q->head = next;
+		return head;
+	}
+	return NULL;
+}
+
+/* Peeks at the oldest kmsg, for debugging.  Racy. */
+static struct kernel_message *kmsg_queue_peek(struct kmsg_queue *q)
+{
+	struct kernel_message *head = READ_ONCE(q->head);
+
+	return head == &q->stub ? READ_ONCE(head->next) : head;
+}
+
+/* Sends dst a kmsg IPI, unless one is already on its way.  dst clears
+ * kmsg_ipi_pending before it looks at its lists, so if we see it set, dst will
+ * see everything we queued before checking. */
+static void kmsg_kick(uint32_t dst)
+{
+	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
+
+	/* The swap is a full barrier, ordering our enqueue before the check */
+	if (atomic_swap(&per_cpu_info[dst].kmsg_ipi_pending, TRUE)) {
+		pcpui->nr_kmsg_ipis_saved++;
+		return;
+	}
+	pcpui->nr_kmsg_ipis++;
+	send_ipi(dst, I_KERNEL_MSG);
+}
+
+/* Queues the kmsg for dst, without an IPI. */
+static void __kmsg_enqueue(uint32_t dst, amr_t pc, long arg0, long arg1,
+                           long arg2, int type)
 {
 	kernel_message_t *k_msg;
+
 	assert(pc);
 	// note this will be freed on the destination core
 	k_msg = kmem_cache_alloc(kernel_msg_cache, 0);
@@ -131,26 +209,50 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
 	k_msg->arg2 = arg2;
 	switch (type) {
 		case KMSG_IMMEDIATE:
-			spin_lock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
-			STAILQ_INSERT_TAIL(&per_cpu_info[dst].immed_amsgs, k_msg, link);
-			spin_unlock_irqsave(&per_cpu_info[dst].immed_amsg_lock);
+			kmsg_queue_push(&per_cpu_info[dst].immed_amsgs, k_msg);
 			break;
 		case KMSG_ROUTINE:
-			spin_lock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
-			STAILQ_INSERT_TAIL(&per_cpu_info[dst].routine_amsgs, k_msg, link);
-			spin_unlock_irqsave(&per_cpu_info[dst].routine_amsg_lock);
+			kmsg_queue_push(&per_cpu_info[dst].routine_amsgs, k_msg);
 			break;
 		default:
 			panic("Unknown type of kernel message!");
 	}
-	/* since we touched memory the other core will touch (the lock), we don't
-	 * need an wmb_f() */
+}
+
+uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
+                             long arg2, int type)
+{
+	__kmsg_enqueue(dst, pc, arg0, arg1, arg2, type);
 	/* if we're sending a routine message locally, we don't want/need an IPI */
-	if ((dst != k_msg->srcid) || (type == KMSG_IMMEDIATE))
-		send_ipi(dst, I_KERNEL_MSG);
+	if ((dst != core_id()) || (type == KMSG_IMMEDIATE))
+		kmsg_kick(dst);
 	return 0;
 }
 
+void kmsg_batch_init(struct kmsg_batch *kb)
+{
+	core_set_init(&kb->dsts);
+}
+
+void kmsg_batch_add(struct kmsg_batch *kb, uint32_t dst, amr_t pc, long arg0,
+                    long arg1, long arg2, int type)
+{
+	__kmsg_enqueue(dst, pc, arg0, arg1, arg2, type);
+	if ((dst != core_id()) || (type == KMSG_IMMEDIATE))
+		core_set_setcpu(&kb->dsts, dst);
+}
+
+/* Sends the IPIs for everything added to kb.  kb is ready for reuse after. */
+void kmsg_batch_flush(struct kmsg_batch *kb)
+{
+	for_each_core(i) {
+		if (!core_set_getcpu(&kb->dsts, i))
+			continue;
+		core_set_clearcpu(&kb->dsts, i);
+		kmsg_kick(i);
+	}
+}
+
 /* Kernel message IPI/IRQ handler.
  *
  * This processes immediate messages, and that's it (it used to handle routines
@@ -163,44 +265,35 @@ uint32_t send_kernel_message(uint32_t dst, amr_t pc, long arg0, long arg1,
 void handle_kmsg_ipi(struct hw_trapframe *hw_tf, void *data)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	struct kernel_message *kmsg_i, *temp;
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->immed_amsgs))
-		return;
-	/* The lock serves as a cmb to force a re-read of the head of the list */
-	spin_lock_irqsave(&pcpui->immed_amsg_lock);
-	STAILQ_FOREACH_SAFE(kmsg_i, &pcpui->immed_amsgs, link, temp) {
-		pcpui_trace_kmsg(pcpui, (uintptr_t)kmsg_i->pc);
-		kmsg_i->pc(kmsg_i->srcid, kmsg_i->arg0, kmsg_i->arg1, kmsg_i->arg2);
-		STAILQ_REMOVE(&pcpui->immed_amsgs, kmsg_i, kernel_message, link);
-		kmem_cache_free(kernel_msg_cache, (void*)kmsg_i);
+	struct kernel_message *kmsg;
+
+	/* Any kmsgs sent after this will send another IPI.  The ones sent before
+	 * are on our lists: immediates we run now, routines before we halt or pop
+	 * to userspace, like any other RKM that came with an IPI. */
+	atomic_set(&pcpui->kmsg_ipi_pending, FALSE);
+	mb();
+	while ((kmsg = kmsg_queue_pop(&pcpui->immed_amsgs))) {
+		pcpui_trace_kmsg(pcpui, (uintptr_t)kmsg->pc);
+		vcore_account_kmsg();
+		kmsg->pc(kmsg->srcid, kmsg->arg0, kmsg->arg1, kmsg->arg2);
+		kmem_cache_free(kernel_msg_cache, (void*)kmsg);
 	}
-	spin_unlock_irqsave(&pcpui->immed_amsg_lock);
 }
 
 bool has_routine_kmsg(void)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[core_id()];
-	/* lockless peek */
-	return !STAILQ_EMPTY(&pcpui->routine_amsgs);
+
+	return !kmsg_queue_empty(&pcpui->routine_amsgs);
 }
 
 /* Helper function, gets the next routine KMSG (RKM).  Returns 0 if the list was
  * empty. */
 static kernel_message_t *get_next_rkmsg(struct per_cpu_info *pcpui)
 {
-	struct kernel_message *kmsg;
-	/* Avoid locking if the list appears empty (lockless peek is okay) */
-	if (STAILQ_EMPTY(&pcpui->routine_amsgs))
-		return 0;
-	/* The lock serves as a cmb to force a re-read of the head of the list.
-	 * IRQs are disabled by our caller. */
-	spin_lock(&pcpui->routine_amsg_lock);
-	kmsg = STAILQ_FIRST(&pcpui->routine_amsgs);
-	if (kmsg)
-		STAILQ_REMOVE_HEAD(&pcpui->routine_amsgs, link);
-	spin_unlock(&pcpui->routine_amsg_lock);
-	return kmsg;
+	/* IRQs are disabled by our caller, and RKMs only run on their core, so we
+	 * are the only consumer. */
+	return kmsg_queue_pop(&pcpui->routine_amsgs);
 }
 
 /* Runs routine kernel messages.  This might not return.  In the past, this
@@ -234,6 +327,7 @@ void process_routine_kmsg(void)
 		 * (change_to), it's not really the rest of the syscall context. */
 		pcpui->cur_kthread->flags = KTH_KTASK_FLAGS;
 		pcpui_trace_kmsg(pcpui, (uintptr_t)msg_cp.pc);
+		vcore_account_kmsg();
 		msg_cp.pc(msg_cp.srcid, msg_cp.arg0, msg_cp.arg1, msg_cp.arg2);
 		/* And if we make it back, be sure to restore the default flags.  If we
 		 * never return, but the kthread exits via some other way (smp_idle()),
@@ -266,11 +360,13 @@ void process_routine_kmsg(void)
 void print_kmsgs(uint32_t coreid)
 {
 	struct per_cpu_info *pcpui = &per_cpu_info[coreid];
-	void __print_kmsgs(struct kernel_msg_list *list, char *type)
+	void __print_kmsgs(struct kmsg_queue *q, char *type)
 	{
 		struct kernel_message *kmsg_i;
 
-		STAILQ_FOREACH(kmsg_i, list, link) {
+		for (kmsg_i = q->head; kmsg_i; kmsg_i = kmsg_i->next) {
+			if (kmsg_i == &q->stub)
+				continue;
 			printk("%s KMSG on %d from %d to run %p(%s)(%p, %p, %p)\n", type,
 			       kmsg_i->dstid, kmsg_i->srcid, kmsg_i->pc,
 			       get_fn_name((long)kmsg_i->pc),
@@ -281,22 +377,32 @@ void print_kmsgs(uint32_t coreid)
 	__print_kmsgs(&pcpui->routine_amsgs, "Routine");
 }
 
+void print_kmsg_ipi_stats(void)
+{
+	uint64_t sent, saved;
+
+	printk("Kmsg IPIs, by sending core:\n");
+	for_each_core(i) {
+		sent = per_cpu_info[i].nr_kmsg_ipis;
+		saved = per_cpu_info[i].nr_kmsg_ipis_saved;
+		if (!sent && !saved)
+			continue;
+		printk("\tCore %3d: %lu sent, %lu saved\n", i, sent, saved);
+	}
+}
+
 /* Debugging stuff */
 void kmsg_queue_stat(void)
 {
 	struct kernel_message *kmsg;
 	bool immed_emp, routine_emp;
 	for (int i = 0; i < num_cores; i++) {
-		spin_lock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		immed_emp = STAILQ_EMPTY(&per_cpu_info[i].immed_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].immed_amsg_lock);
-		spin_lock_irqsave(&per_cpu_info[i].routine_amsg_lock);
-		routine_emp = STAILQ_EMPTY(&per_cpu_info[i].routine_amsgs);
-		spin_unlock_irqsave(&per_cpu_info[i].routine_amsg_lock);
+		immed_emp = kmsg_queue_empty(&per_cpu_info[i].immed_amsgs);
+		routine_emp = kmsg_queue_empty(&per_cpu_info[i].routine_amsgs);
 		printk("Core %d's immed_emp: %d, routine_emp %d\n", i, immed_emp,
                routine_emp);
-		if (!immed_emp) {
-			kmsg = STAILQ_FIRST(&per_cpu_info[i].immed_amsgs);
+		kmsg = kmsg_queue_peek(&per_cpu_info[i].immed_amsgs);
+		if (!immed_emp && kmsg) {
 			printk("Immed msg on core %d:\n", i);
 			printk("\tsrc:  %d\n", kmsg->srcid);
 			printk("\tdst:  %d\n", kmsg->dstid);
@@ -305,8 +411,8 @@ void kmsg_queue_stat(void)
 			printk("\targ1: %p\n", kmsg->arg1);
 			printk("\targ2: %p\n", kmsg->arg2);
 		}
-		if (!routine_emp) {
-			kmsg = STAILQ_FIRST(&per_cpu_info[i].routine_amsgs);
+		kmsg = kmsg_queue_peek(&per_cpu_info[i].routine_amsgs);
+		if (!routine_emp && kmsg) {
 			printk("Routine msg on core %d:\n", i);
 			printk("\tsrc:  %d\n", kmsg->srcid);
 			printk("\tdst:  %d\n", kmsg->dstid);
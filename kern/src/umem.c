@@ -92,6 +92,58 @@ int memcpy_to_user(struct proc *p, void *dest, const void *src, size_t len)
 	return error;
 }
 
+/* Gathers the user's iovecs into dst, which has room for iov_length() bytes.
+ * The iovec array is in the kernel, e.g. from copy_in_iov().  We switch address
+ * spaces once for the whole batch, not once per iovec. */
+int memcpy_from_user_iov(struct proc *p, void *dst, const struct iovec *iov,
+                         int iovcnt)
+{
+	uintptr_t prev = switch_to(p);
+	int error = 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (unlikely(!is_user_raddr(iov[i].iov_base, iov[i].iov_len))) {
+			error = -EFAULT;
+			break;
+		}
+		error = __user_memcpy_bulk(dst, iov[i].iov_base, iov[i].iov_len);
+		if (unlikely(error))
+			break;
+		dst += iov[i].iov_len;
+	}
+	switch_back(p, prev);
+
+	return error;
+}
+
+/* Scatters len bytes of src into the user's iovecs.  len can be less than the
+ * iovecs' total, but not more. */
+int memcpy_to_user_iov(struct proc *p, const struct iovec *iov, int iovcnt,
+                       const void *src, size_t len)
+{
+	uintptr_t prev = switch_to(p);
+	int error = 0;
+	size_t amt;
+
+	for (int i = 0; i < iovcnt && len; i++) {
+		amt = MIN(iov[i].iov_len, len);
+		if (unlikely(!is_user_rwaddr(iov[i].iov_base, amt))) {
+			error = -EFAULT;
+			break;
+		}
+		error = __user_memcpy_bulk(iov[i].iov_base, src, amt);
+		if (unlikely(error))
+			break;
+		src += amt;
+		len -= amt;
+	}
+	if (!error && len)
+		error = -EINVAL;
+	switch_back(p, prev);
+
+	return error;
+}
+
 /* Same as above, but sets errno */
 int memcpy_from_user_errno(struct proc *p, void *dst, const void *src, int len)
 {
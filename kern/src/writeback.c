@@ -0,0 +1,273 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Writeback engine, see writeback.h.
+ *
+ * Every queued wb_file holds a ref from ops->get, which the flusher drops once
+ * it's written back.  A file is on at most one list: dirty, waiting to age, or
+ * sync, wanted now.  The flushers dequeue a file before writing it back, so
+ * anything dirtied during the writeback queues it again.  Bytes count against
+ * the domain until the writeback is done, which is what throttled writers
+ * wait on. */
+
+#include <writeback.h>
+#include <kthread.h>
+#include <pmap.h>
+#include <time.h>
+#include <error.h>
+#include <stdio.h>
+#include <assert.h>
+
+static bool wb_expired(struct wb_file *wf)
+{
+	return tsc2nsec(read_tsc() - wf->dirtied_at) >= WB_EXPIRE_NSEC;
+}
+
+/* Caller holds the lock.  Returns the next file a flusher should write back,
+ * dequeued, and how many of its bytes we took. */
+static struct wb_file *__wb_next_file(struct wb_domain *d, size_t *amt)
+{
+	struct wb_file *wf;
+
+	wf = TAILQ_FIRST(&d->sync);
+	if (wf) {
+		TAILQ_REMOVE(&d->sync, wf, link);
+	} else {
+		wf = TAILQ_FIRST(&d->dirty);
+		if (!wf)
+			return NULL;
+		if (!d->dying && d->nr_dirty < d->bg_thresh && !wb_expired(wf))
+			return NULL;
+		TAILQ_REMOVE(&d->dirty, wf, link);
+	}
+	wf->queued = false;
+	*amt = wf->nr_dirty;
+	wf->nr_dirty = 0;
+	return wf;
+}
+
+static int wb_has_work(void *arg)
+{
+	struct wb_domain *d = arg;
+	struct wb_file *wf = TAILQ_FIRST(&d->dirty);
+
+	if (d->dying || !TAILQ_EMPTY(&d->sync))
+		return true;
+	return wf && (d->nr_dirty >= d->bg_thresh || wb_expired(wf));
+}
+
+static void wb_write_file(struct wb_domain *d, struct wb_file *wf, size_t amt,
+                          bool from_sync)
+{
+	ERRSTACK(1);
+	bool failed = false;
+
+	if (!waserror()) {
+		d->ops->writeback(wf);
+	} else {
+		printk("%s: writeback failed: %s\n", d->name, current_errstr());
+		failed = true;
+	}
+	poperror();
+	spin_lock(&d->lock);
+	d->nr_dirty -= amt;
+	d->nr_written++;
+	if (from_sync) {
+		d->nr_sync_left--;
+		if (failed)
+			d->nr_sync_errors++;
+	}
+	spin_unlock(&d->lock);
+	d->ops->put(wf);
+	rendez_wakeup(&d->rv_throttle);
+	if (from_sync)
+		rendez_wakeup(&d->rv_sync);
+}
+
+static void wb_flusher(void *arg)
+{
+	struct wb_domain *d = arg;
+	struct wb_file *wf;
+	size_t amt;
+	bool from_sync, done;
+
+	while (1) {
+		rendez_sleep_timeout(&d->rv_flush, wb_has_work, d, WB_PERIOD_USEC);
+		while (1) {
+			spin_lock(&d->lock);
+			from_sync = !TAILQ_EMPTY(&d->sync);
+			wf = __wb_next_file(d, &amt);
+			spin_unlock(&d->lock);
+			if (!wf)
+				break;
+			wb_write_file(d, wf, amt, from_sync);
+		}
+		spin_lock(&d->lock);
+		done = d->dying && TAILQ_EMPTY(&d->dirty) && TAILQ_EMPTY(&d->sync);
+		if (done)
+			d->nr_flushers--;
+		spin_unlock(&d->lock);
+		if (done)
+			break;
+	}
+	rendez_wakeup(&d->rv_exit);
+}
+
+/* Each domain may have up to a tenth of memory dirty, and starts writing back
+ * early at half of that. */
+void wb_domain_init(struct wb_domain *d, char *name, struct wb_ops *ops,
+                    unsigned int nr_flushers)
+{
+	d->name = name;
+	d->ops = ops;
+	spinlock_init(&d->lock);
+	TAILQ_INIT(&d->dirty);
+	TAILQ_INIT(&d->sync);
+	d->nr_dirty = 0;
+	d->dirty_limit = max_pmem / 10;
+	d->bg_thresh = d->dirty_limit / 2;
+	d->nr_sync_left = 0;
+	d->nr_sync_errors = 0;
+	d->dying = false;
+	rendez_init(&d->rv_flush);
+	rendez_init(&d->rv_throttle);
+	rendez_init(&d->rv_sync);
+	rendez_init(&d->rv_exit);
+	d->nr_written = 0;
+	d->nr_throttled = 0;
+	d->nr_flushers = nr_flushers;
+	for (int i = 0; i < nr_flushers; i++)
+		ktask(name, wb_flusher, d);
+}
+
+static int wb_flushers_gone(void *arg)
+{
+	struct wb_domain *d = arg;
+
+	return !d->nr_flushers;
+}
+
+/* Writes back everything still queued, then stops the flushers.  No one can be
+ * dirtying files in the domain anymore. */
+void wb_domain_destroy(struct wb_domain *d)
+{
+	spin_lock(&d->lock);
+	d->dying = true;
+	spin_unlock(&d->lock);
+	rendez_wakeup(&d->rv_flush);
+	rendez_sleep(&d->rv_exit, wb_flushers_gone, d);
+	assert(!d->nr_dirty);
+}
+
+void wb_file_init(struct wb_file *wf)
+{
+	wf->queued = false;
+	wf->on_sync = false;
+	wf->nr_dirty = 0;
+}
+
+/* Caller holds the lock and a ref for the queue, which we consume. */
+static void __wb_enqueue(struct wb_domain *d, struct wb_file *wf, bool sync)
+{
+	wf->queued = true;
+	wf->on_sync = sync;
+	wf->dirtied_at = read_tsc();
+	if (sync) {
+		TAILQ_INSERT_TAIL(&d->sync, wf, link);
+		d->nr_sync_left++;
+	} else {
+		TAILQ_INSERT_TAIL(&d->dirty, wf, link);
+	}
+}
+
+/* Caller holds the lock.  Moves a file that's waiting to age to the front of
+ * the line. */
+static void __wb_move_to_sync(struct wb_domain *d, struct wb_file *wf)
+{
+	if (wf->on_sync)
+		return;
+	TAILQ_REMOVE(&d->dirty, wf, link);
+	wf->on_sync = true;
+	TAILQ_INSERT_TAIL(&d->sync, wf, link);
+	d->nr_sync_left++;
+}
+
+static int wb_below_limit(void *arg)
+{
+	struct wb_domain *d = arg;
+
+	return d->nr_dirty < d->dirty_limit;
+}
+
+/* Call after dirtying amt bytes of wf.  Don't hold locks the writeback needs;
+ * this might sleep. */
+void wb_mark_dirty(struct wb_domain *d, struct wb_file *wf, size_t amt)
+{
+	bool extra_ref = false, over_bg, over_limit;
+
+	if (!d->ops->get(wf))
+		return;
+	spin_lock(&d->lock);
+	if (wf->queued)
+		extra_ref = true;
+	else
+		__wb_enqueue(d, wf, false);
+	wf->nr_dirty += amt;
+	d->nr_dirty += amt;
+	over_bg = d->nr_dirty >= d->bg_thresh;
+	over_limit = d->nr_dirty >= d->dirty_limit;
+	if (over_limit)
+		d->nr_throttled++;
+	spin_unlock(&d->lock);
+	if (extra_ref)
+		d->ops->put(wf);
+	if (over_bg)
+		rendez_wakeup(&d->rv_flush);
+	if (over_limit)
+		rendez_sleep_timeout(&d->rv_throttle, wb_below_limit, d,
+		                     WB_THROTTLE_USEC);
+}
+
+/* Queues wf for the next wb_sync(), whether or not it was written to.  This
+ * never sleeps. */
+void wb_queue_file(struct wb_domain *d, struct wb_file *wf)
+{
+	bool extra_ref = false;
+
+	if (!d->ops->get(wf))
+		return;
+	spin_lock(&d->lock);
+	if (wf->queued) {
+		extra_ref = true;
+		__wb_move_to_sync(d, wf);
+	} else {
+		__wb_enqueue(d, wf, true);
+	}
+	spin_unlock(&d->lock);
+	if (extra_ref)
+		d->ops->put(wf);
+}
+
+static int wb_sync_done(void *arg)
+{
+	struct wb_domain *d = arg;
+
+	return !d->nr_sync_left;
+}
+
+/* Writes back every queued file, and waits.  Returns how many writebacks
+ * failed in the meantime, which might include some from a concurrent sync. */
+unsigned long wb_sync(struct wb_domain *d)
+{
+	struct wb_file *wf;
+	unsigned long nr_errors;
+
+	spin_lock(&d->lock);
+	nr_errors = d->nr_sync_errors;
+	while ((wf = TAILQ_FIRST(&d->dirty)))
+		__wb_move_to_sync(d, wf);
+	spin_unlock(&d->lock);
+	rendez_wakeup(&d->rv_flush);
+	rendez_sleep(&d->rv_sync, wb_sync_done, d);
+	return READ_ONCE(d->nr_sync_errors) - nr_errors;
+}
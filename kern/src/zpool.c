@@ -0,0 +1,275 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Pre-zeroed page pools, see zpool.h.
+ *
+ * Each pool is a stack of kvas, so the page a fault gets is the one an idle core
+ * zeroed most recently.  Pages keep the pg_node their node's arena gave them,
+ * so they free back to the right place.
+ *
+ * The pool is pretty small (ZPOOL_MAX_PAGES), since pages in it aren't doing
+ * anything for anyone.  It's enough to soak up bursts of faults; a process that
+ * faults in gigabytes will drain it and zero the rest itself. */
+
+#include <zpool.h>
+#include <numa.h>
+#include <arena.h>
+#include <page_alloc.h>
+#include <pmap.h>
+#include <kmalloc.h>
+#include <slab.h>
+#include <trap.h>
+#include <smp.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <ns.h>
+
+#define ZPOOL_MAX_PAGES			1024
+/* At most 1/ZPOOL_MEM_FRAC of a node's memory sits in its pool */
+#define ZPOOL_MEM_FRAC			256
+/* Pages an idle core zeroes before it checks for other work */
+#define ZPOOL_REFILL_BATCH		8
+#define ZPOOL_DRAIN_BATCH		64
+
+struct zpool {
+	spinlock_t					lock;
+	void						**pages;
+	unsigned int				nr;
+	unsigned int				cap;
+	uint64_t					nr_hits;
+	uint64_t					nr_misses;
+	uint64_t					nr_filled;
+	uint64_t					nr_drained;
+};
+
+static struct zpool zpools[NUMA_MAX_NODES];
+static bool zpool_on;
+
+static int zpool_nr_pools(void)
+{
+	return numa_nr_nodes ? numa_nr_nodes : 1;
+}
+
+/* Call after numa_init(). */
+void zpool_init(void)
+{
+	struct zpool *zp;
+	size_t nr_pgs;
+
+	for (int i = 0; i < zpool_nr_pools(); i++) {
+		zp = &zpools[i];
+		spinlock_init_irqsave(&zp->lock);
+		nr_pgs = numa_nr_nodes ? numa_nodes[i].nr_bytes >> PGSHIFT
+		                       : max_nr_pages;
+		zp->cap = MIN(ZPOOL_MAX_PAGES, nr_pgs / ZPOOL_MEM_FRAC);
+		if (!zp->cap)
+			continue;
+		zp->pages = kmalloc(zp->cap * sizeof(void*), MEM_WAIT);
+	}
+	zpool_on = TRUE;
+}
+
+/* Returns the pool for an allocation that wants one of nodes, starting with
+ * pref, or 0 if the pool can't help. */
+static struct zpool *zpool_pick(unsigned long nodes, int pref)
+{
+	int node = pref == NUMA_NODE_LOCAL ? numa_local_node() : pref;
+
+	if (!READ_ONCE(zpool_on))
+		return NULL;
+	if (numa_nr_nodes && !(nodes & (1UL << node)))
+		return NULL;
+	if (node >= zpool_nr_pools())
+		return NULL;
+	return &zpools[node];
+}
+
+/* Returns a zeroed page from the pool for pref (if it's in nodes), or 0 if the
+ * pool is empty.  Callers fall back to allocating and zeroing a page. */
+void *zpool_get(unsigned long nodes, int pref)
+{
+	struct zpool *zp = zpool_pick(nodes, pref);
+	void *ret = NULL;
+
+	if (!zp)
+		return NULL;
+	spin_lock_irqsave(&zp->lock);
+	if (zp->nr) {
+		ret = zp->pages[--zp->nr];
+		zp->nr_hits++;
+	} else {
+		zp->nr_misses++;
+	}
+	spin_unlock_irqsave(&zp->lock);
+	return ret;
+}
+
+/* Gets up to nr zeroed pages, returning how many we got. */
+size_t zpool_get_batch(unsigned long nodes, int pref, void **addrs, size_t nr)
+{
+	struct zpool *zp = zpool_pick(nodes, pref);
+	size_t got;
+
+	if (!zp)
+		return 0;
+	spin_lock_irqsave(&zp->lock);
+	got = MIN(nr, zp->nr);
+	zp->nr -= got;
+	memcpy(addrs, &zp->pages[zp->nr], got * sizeof(void*));
+	zp->nr_hits += got;
+	if (got < nr)
+		zp->nr_misses++;
+	spin_unlock_irqsave(&zp->lock);
+	return got;
+}
+
+/* Racy, but it's just a hint.  We stop well before kmem reclaim would kick in,
+ * so that we're not refilling the pools as fast as reclaim drains them. */
+static bool node_mem_is_low(int node)
+{
+	struct arena *base = numa_nr_nodes ? numa_nodes[node].base : base_arena;
+
+	return arena_amt_free(base) <
+	       arena_amt_total(base) / 100 * kmem_reclaim_low_pct * 2;
+}
+
+/* Called by idle cores with IRQs disabled.  Zeroes a few pages for our node's
+ * pool, with IRQs enabled while we zero, and returns TRUE if we did anything.
+ * The caller should check for work before calling us again. */
+bool zpool_idle_refill(void)
+{
+	int node = numa_local_node();
+	struct zpool *zp = &zpools[node];
+	void *kva;
+	int i;
+
+	if (!READ_ONCE(zpool_on))
+		return FALSE;
+	/* A node without memory gets pages from another node; no sense zeroing
+	 * those here. */
+	if (numa_nr_nodes && !(numa_mem_nodes & (1UL << node)))
+		return FALSE;
+	for (i = 0; i < ZPOOL_REFILL_BATCH; i++) {
+		if (READ_ONCE(zp->nr) >= zp->cap)
+			break;
+		if (has_routine_kmsg() || node_mem_is_low(node))
+			break;
+		kva = numa_kpages_alloc(1UL << node, node, PGSIZE, MEM_ATOMIC);
+		if (!kva)
+			break;
+		enable_irq();
+		clear_page_nt(kva);
+		disable_irq();
+		spin_lock_irqsave(&zp->lock);
+		if (zp->nr < zp->cap) {
+			zp->pages[zp->nr++] = kva;
+			zp->nr_filled++;
+			kva = NULL;
+		}
+		spin_unlock_irqsave(&zp->lock);
+		/* Someone else filled it (or turned it off) */
+		if (kva) {
+			numa_kpages_free(kva, PGSIZE);
+			break;
+		}
+	}
+	return i > 0;
+}
+
+static size_t __zpool_drain(struct zpool *zp)
+{
+	void *kvas[ZPOOL_DRAIN_BATCH];
+	size_t nr, total = 0;
+
+	do {
+		spin_lock_irqsave(&zp->lock);
+		nr = MIN(zp->nr, ZPOOL_DRAIN_BATCH);
+		zp->nr -= nr;
+		memcpy(kvas, &zp->pages[zp->nr], nr * sizeof(void*));
+		zp->nr_drained += nr;
+		spin_unlock_irqsave(&zp->lock);
+		numa_kpages_free_batch(kvas, PGSIZE, nr);
+		total += nr;
+	} while (nr);
+	return total;
+}
+
+/* Frees every page in the pools, returning how many bytes we freed.  Idle cores
+ * will refill them, unless memory is low. */
+size_t zpool_drain(void)
+{
+	size_t nr = 0;
+
+	for (int i = 0; i < zpool_nr_pools(); i++)
+		nr += __zpool_drain(&zpools[i]);
+	return nr * PGSIZE;
+}
+
+static const char zpool_usage[] = "on|off|drain|reset";
+
+/* Writes to #kprof/zpool:
+ * - on/off: turns the pools on or off.  Off drains them.
+ * - drain: frees the pools' pages
+ * - reset: clears the stats */
+void zpool_ctl(struct cmdbuf *cb)
+{
+	struct zpool *zp;
+
+	if (cb->nf < 1)
+		error(EINVAL, zpool_usage);
+	if (!strcmp(cb->f[0], "on")) {
+		WRITE_ONCE(zpool_on, TRUE);
+	} else if (!strcmp(cb->f[0], "off")) {
+		/* A refill that already checked might leave a few pages behind.
+		 * They'll get used when we turn back on, or freed by reclaim. */
+		WRITE_ONCE(zpool_on, FALSE);
+		zpool_drain();
+	} else if (!strcmp(cb->f[0], "drain")) {
+		zpool_drain();
+	} else if (!strcmp(cb->f[0], "reset")) {
+		for (int i = 0; i < zpool_nr_pools(); i++) {
+			zp = &zpools[i];
+			spin_lock_irqsave(&zp->lock);
+			zp->nr_hits = 0;
+			zp->nr_misses = 0;
+			zp->nr_filled = 0;
+			zp->nr_drained = 0;
+			spin_unlock_irqsave(&zp->lock);
+		}
+	} else {
+		error(EINVAL, zpool_usage);
+	}
+}
+
+size_t zpool_read(void *va, size_t n, off64_t offset)
+{
+	size_t bufsz = (zpool_nr_pools() + 2) * 96;
+	struct zpool *zp;
+	unsigned int nr;
+	uint64_t hits, misses, filled, drained;
+	char *buf, *p, *end_p;
+
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	p = buf;
+	end_p = buf + bufsz;
+	p = seprintf(p, end_p, "Zero page pools: %s\n",
+	             READ_ONCE(zpool_on) ? "on" : "off");
+	p = seprintf(p, end_p, "%4s %6s %6s %12s %12s %12s %12s\n", "node",
+	             "pages", "cap", "hits", "misses", "filled", "drained");
+	for (int i = 0; i < zpool_nr_pools(); i++) {
+		zp = &zpools[i];
+		spin_lock_irqsave(&zp->lock);
+		nr = zp->nr;
+		hits = zp->nr_hits;
+		misses = zp->nr_misses;
+		filled = zp->nr_filled;
+		drained = zp->nr_drained;
+		spin_unlock_irqsave(&zp->lock);
+		p = seprintf(p, end_p, "%4d %6u %6u %12lu %12lu %12lu %12lu\n", i,
+		             nr, zp->cap, hits, misses, filled, drained);
+	}
+	n = readstr(offset, va, n, buf);
+	kfree(buf);
+	return n;
+}
@@ -0,0 +1,416 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Compressed page store, see zstore.h.
+ *
+ * Pages are compressed with raw deflate at its fastest level, with a window of
+ * one page.  There's one compressor, under a qlock; eviction is done by one
+ * ktask, so it's not contended.  Decompression is on the fault path, so each
+ * core has its own inflate stream.  Our kthreads aren't preempted and inflate
+ * doesn't block, so no one else can use the core's stream while we are.
+ *
+ * Compressed pages are carved out of the zstore arena, a ZSTORE_QUANTUM at a
+ * time.  The arena imports a page at a time from kpages_arena and gives the
+ * page back once everything on it is freed. */
+
+#include <zstore.h>
+#include <zlib.h>
+#include <arena.h>
+#include <kmalloc.h>
+#include <slab.h>
+#include <pmap.h>
+#include <smp.h>
+#include <rendez.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <ns.h>
+
+#define ZSTORE_QUANTUM			64
+#define ZSTORE_MAX_LEN			(PGSIZE * 3 / 4)
+#define ZSTORE_WBITS			12	/* one page */
+#define ZSTORE_MEM_LEVEL		5
+
+/* A stored page.  data == 0 means every word of the page was fill. */
+struct zentry {
+	void						*data;
+	size_t						len;
+	unsigned long				fill;
+};
+
+struct zstore_stats {
+	atomic_t					nr_pages;
+	atomic_t					nr_same;
+	atomic_t					nr_bytes;
+	atomic_t					nr_stores;
+	atomic_t					nr_loads;
+	atomic_t					nr_rejects;
+	atomic_t					nr_nomem;
+	atomic_t					nr_passes;
+	atomic_t					nr_evicted;
+};
+
+static struct zstore_stats zstats;
+static bool zstore_on;
+static bool zstore_ready;
+
+static struct arena *zstore_arena;
+static struct kmem_cache *zentry_cache;
+
+static qlock_t zstore_deflate_qlock = QLOCK_INITIALIZER(zstore_deflate_qlock);
+static struct z_stream_s zstore_deflater;
+static uint8_t *zstore_scratch;
+static struct z_stream_s *zstore_inflaters;
+
+static qlock_t zstore_evictors_qlock = QLOCK_INITIALIZER(zstore_evictors_qlock);
+static struct zstore_evictor_tailq zstore_evictors =
+	TAILQ_HEAD_INITIALIZER(zstore_evictors);
+static struct rendez zstore_evict_rv;
+static bool zstore_evict_poked;
+
+static void zstore_evict_ktask(void *arg);
+
+void zstore_init(void)
+{
+	struct z_stream_s *strm;
+	int ret;
+
+	zstore_arena = arena_create("zstore", NULL, 0, ZSTORE_QUANTUM,
+	                            arena_alloc, arena_free, kpages_arena, 0,
+	                            MEM_WAIT);
+	zentry_cache = kmem_cache_create("zstore_entry", sizeof(struct zentry),
+	                                 __alignof__(struct zentry), 0, NULL,
+	                                 NULL, NULL, NULL);
+	zstore_deflater.workspace =
+		kmalloc(zlib_deflate_workspacesize(ZSTORE_WBITS, ZSTORE_MEM_LEVEL),
+		        MEM_WAIT);
+	ret = zlib_deflateInit2(&zstore_deflater, Z_BEST_SPEED, Z_DEFLATED,
+	                        -ZSTORE_WBITS, ZSTORE_MEM_LEVEL,
+	                        Z_DEFAULT_STRATEGY);
+	assert(ret == Z_OK);
+	zstore_scratch = kmalloc(ZSTORE_MAX_LEN, MEM_WAIT);
+	zstore_inflaters = kzmalloc(sizeof(struct z_stream_s) * num_cores,
+	                            MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		strm = &zstore_inflaters[i];
+		strm->workspace = kmalloc(zlib_inflate_workspacesize(), MEM_WAIT);
+		ret = zlib_inflateInit2(strm, -ZSTORE_WBITS);
+		assert(ret == Z_OK);
+	}
+	rendez_init(&zstore_evict_rv);
+	ktask("zstore_evict", zstore_evict_ktask, NULL);
+	zstore_on = TRUE;
+	zstore_ready = TRUE;
+}
+
+bool zstore_is_on(void)
+{
+	return READ_ONCE(zstore_on);
+}
+
+static int zstore_evict_was_poked(void *arg)
+{
+	return READ_ONCE(zstore_evict_poked);
+}
+
+static void zstore_evict_ktask(void *arg)
+{
+	struct zstore_evictor *ze;
+	size_t nr;
+
+	while (1) {
+		rendez_sleep(&zstore_evict_rv, zstore_evict_was_poked, NULL);
+		/* Post-and-poke, like kmem reclaim */
+		WRITE_ONCE(zstore_evict_poked, FALSE);
+		if (!zstore_is_on())
+			continue;
+		nr = 0;
+		qlock(&zstore_evictors_qlock);
+		TAILQ_FOREACH(ze, &zstore_evictors, link)
+			nr += ze->evict(ze);
+		qunlock(&zstore_evictors_qlock);
+		atomic_inc(&zstats.nr_passes);
+		atomic_add(&zstats.nr_evicted, nr);
+	}
+}
+
+/* Called by kmem reclaim, with the arenas_and_slabs_lock held, so we just wake
+ * the ktask.  The pages it frees get trimmed on reclaim's next pass. */
+void zstore_reclaim_poke(void)
+{
+	if (!zstore_ready || !zstore_is_on() || READ_ONCE(zstore_evict_poked))
+		return;
+	WRITE_ONCE(zstore_evict_poked, TRUE);
+	rendez_wakeup(&zstore_evict_rv);
+}
+
+void zstore_register_evictor(struct zstore_evictor *ze)
+{
+	qlock(&zstore_evictors_qlock);
+	TAILQ_INSERT_TAIL(&zstore_evictors, ze, link);
+	qunlock(&zstore_evictors_qlock);
+}
+
+/* Once this returns, the ktask is done calling ze. */
+void zstore_unregister_evictor(struct zstore_evictor *ze)
+{
+	qlock(&zstore_evictors_qlock);
+	TAILQ_REMOVE(&zstore_evictors, ze, link);
+	qunlock(&zstore_evictors_qlock);
+}
+
+struct zstore_map *zstore_map_alloc(int flags)
+{
+	struct zstore_map *zm = kmalloc(sizeof(struct zstore_map), flags);
+
+	if (!zm)
+		return NULL;
+	qlock_init(&zm->qlock);
+	radix_tree_init(&zm->tree);
+	zm->nr_pages = 0;
+	return zm;
+}
+
+static void zentry_free(struct zentry *ze)
+{
+	if (ze->data) {
+		arena_free(zstore_arena, ze->data, ze->len);
+		atomic_add(&zstats.nr_bytes, -ROUNDUP(ze->len, ZSTORE_QUANTUM));
+	} else {
+		atomic_dec(&zstats.nr_same);
+	}
+	atomic_dec(&zstats.nr_pages);
+	kmem_cache_free(zentry_cache, ze);
+}
+
+static bool __zentry_free_cb(void **slot, unsigned long tree_idx, void *arg)
+{
+	struct zstore_map *zm = arg;
+
+	zentry_free(*slot);
+	zm->nr_pages--;
+	return true;
+}
+
+void zstore_map_free(struct zstore_map *zm)
+{
+	if (!zm)
+		return;
+	radix_for_each_slot(&zm->tree, __zentry_free_cb, zm);
+	radix_tree_destroy(&zm->tree);
+	kfree(zm);
+}
+
+/* Drops the stored copies of pages [index, index + nr), e.g. for a truncate. */
+void zstore_drop_range(struct zstore_map *zm, unsigned long index,
+                       unsigned long nr)
+{
+	if (!zm || !nr)
+		return;
+	qlock(&zm->qlock);
+	if (zm->nr_pages)
+		radix_for_each_slot_in_range(&zm->tree, index, index + nr,
+		                             __zentry_free_cb, zm);
+	qunlock(&zm->qlock);
+}
+
+static bool page_is_same_filled(void *kva, unsigned long *fill)
+{
+	unsigned long *words = kva;
+
+	for (int i = 1; i < PGSIZE / sizeof(unsigned long); i++) {
+		if (words[i] != words[0])
+			return FALSE;
+	}
+	*fill = words[0];
+	return TRUE;
+}
+
+/* Compresses kva into the arena.  Returns -ENOSPC if it doesn't shrink enough
+ * to be worth it. */
+static int zstore_compress(struct zentry *ze, void *kva)
+{
+	struct z_stream_s *strm = &zstore_deflater;
+	int ret = 0;
+
+	qlock(&zstore_deflate_qlock);
+	zlib_deflateReset(strm);
+	strm->next_in = kva;
+	strm->avail_in = PGSIZE;
+	strm->next_out = zstore_scratch;
+	strm->avail_out = ZSTORE_MAX_LEN;
+	if (zlib_deflate(strm, Z_FINISH) != Z_STREAM_END) {
+		atomic_inc(&zstats.nr_rejects);
+		ret = -ENOSPC;
+		goto out;
+	}
+	ze->len = strm->total_out;
+	ze->data = arena_alloc(zstore_arena, ze->len, MEM_ATOMIC);
+	if (!ze->data) {
+		atomic_inc(&zstats.nr_nomem);
+		ret = -ENOMEM;
+		goto out;
+	}
+	memcpy(ze->data, zstore_scratch, ze->len);
+	atomic_add(&zstats.nr_bytes, ROUNDUP(ze->len, ZSTORE_QUANTUM));
+out:
+	qunlock(&zstore_deflate_qlock);
+	return ret;
+}
+
+static void zstore_decompress(struct zentry *ze, void *kva)
+{
+	struct z_stream_s *strm = &zstore_inflaters[core_id()];
+	int ret;
+
+	zlib_inflateReset(strm);
+	strm->next_in = ze->data;
+	strm->avail_in = ze->len;
+	strm->next_out = kva;
+	strm->avail_out = PGSIZE;
+	ret = zlib_inflate(strm, Z_FINISH);
+	if (ret != Z_STREAM_END || strm->total_out != PGSIZE)
+		panic("zstore entry %p didn't inflate: %d, %lu bytes", ze, ret,
+		      strm->total_out);
+}
+
+/* Stores a copy of the page at kva as the index'th page of zm, replacing any
+ * copy we already had.  Returns 0 or a -error, in which case the caller still
+ * has the only copy.
+ *
+ * We're called when memory is low, so we don't block for memory. */
+int zstore_store(struct zstore_map *zm, unsigned long index, void *kva)
+{
+	struct zentry *ze, *old;
+	int ret;
+
+	if (!zstore_is_on())
+		return -EOPNOTSUPP;
+	ze = kmem_cache_alloc(zentry_cache, MEM_ATOMIC);
+	if (!ze) {
+		atomic_inc(&zstats.nr_nomem);
+		return -ENOMEM;
+	}
+	ze->data = NULL;
+	ze->len = 0;
+	if (!page_is_same_filled(kva, &ze->fill)) {
+		ret = zstore_compress(ze, kva);
+		if (ret) {
+			kmem_cache_free(zentry_cache, ze);
+			return ret;
+		}
+	}
+	atomic_inc(&zstats.nr_pages);
+	if (!ze->data)
+		atomic_inc(&zstats.nr_same);
+	if (radix_preload(&zm->tree, MEM_ATOMIC)) {
+		atomic_inc(&zstats.nr_nomem);
+		zentry_free(ze);
+		return -ENOMEM;
+	}
+	qlock(&zm->qlock);
+	old = radix_delete(&zm->tree, index);
+	ret = radix_insert(&zm->tree, index, ze, NULL);
+	assert(!ret);
+	if (!old)
+		zm->nr_pages++;
+	qunlock(&zm->qlock);
+	if (old)
+		zentry_free(old);
+	atomic_inc(&zstats.nr_stores);
+	return 0;
+}
+
+/* Fills kva with the index'th page of zm and forgets our copy.  Returns FALSE
+ * if we didn't have the page. */
+bool zstore_load(struct zstore_map *zm, unsigned long index, void *kva)
+{
+	struct zentry *ze;
+	unsigned long *words = kva;
+
+	if (!zm)
+		return FALSE;
+	qlock(&zm->qlock);
+	ze = zm->nr_pages ? radix_delete(&zm->tree, index) : NULL;
+	if (ze)
+		zm->nr_pages--;
+	qunlock(&zm->qlock);
+	if (!ze)
+		return FALSE;
+	if (ze->data) {
+		zstore_decompress(ze, kva);
+	} else {
+		for (int i = 0; i < PGSIZE / sizeof(unsigned long); i++)
+			words[i] = ze->fill;
+	}
+	zentry_free(ze);
+	atomic_inc(&zstats.nr_loads);
+	return TRUE;
+}
+
+static const char zstore_usage[] = "on|off|evict|reset";
+
+/* Writes to #kprof/zstore:
+ * - on/off: turns the store on or off.  Off only stops new stores; pages that
+ *   are already stored come back as they're used.
+ * - evict: runs an eviction pass, even if memory isn't low
+ * - reset: clears the stats */
+void zstore_ctl(struct cmdbuf *cb)
+{
+	if (cb->nf < 1)
+		error(EINVAL, zstore_usage);
+	if (!strcmp(cb->f[0], "on")) {
+		WRITE_ONCE(zstore_on, TRUE);
+	} else if (!strcmp(cb->f[0], "off")) {
+		WRITE_ONCE(zstore_on, FALSE);
+	} else if (!strcmp(cb->f[0], "evict")) {
+		zstore_reclaim_poke();
+	} else if (!strcmp(cb->f[0], "reset")) {
+		/* The page and byte counts are state, not stats */
+		atomic_set(&zstats.nr_stores, 0);
+		atomic_set(&zstats.nr_loads, 0);
+		atomic_set(&zstats.nr_rejects, 0);
+		atomic_set(&zstats.nr_nomem, 0);
+		atomic_set(&zstats.nr_passes, 0);
+		atomic_set(&zstats.nr_evicted, 0);
+	} else {
+		error(EINVAL, zstore_usage);
+	}
+}
+
+size_t zstore_read(void *va, size_t n, off64_t offset)
+{
+	size_t bufsz = 1024;
+	long pages, same, bytes;
+	char *buf, *p, *end_p;
+
+	buf = kzmalloc(bufsz, MEM_WAIT);
+	p = buf;
+	end_p = buf + bufsz;
+	pages = atomic_read(&zstats.nr_pages);
+	same = atomic_read(&zstats.nr_same);
+	bytes = atomic_read(&zstats.nr_bytes);
+	p = seprintf(p, end_p, "Compressed page store: %s\n",
+	             zstore_is_on() ? "on" : "off");
+	p = seprintf(p, end_p, "Pages stored:     %lu (%lu same-filled)\n",
+	             pages, same);
+	p = seprintf(p, end_p, "Compressed bytes: %lu\n", bytes);
+	if (pages > same)
+		p = seprintf(p, end_p, "Ratio:            %lu%%\n",
+		             bytes * 100 / ((pages - same) * PGSIZE));
+	p = seprintf(p, end_p, "Stores:           %lu\n",
+	             atomic_read(&zstats.nr_stores));
+	p = seprintf(p, end_p, "Loads:            %lu\n",
+	             atomic_read(&zstats.nr_loads));
+	p = seprintf(p, end_p, "Rejects:          %lu\n",
+	             atomic_read(&zstats.nr_rejects));
+	p = seprintf(p, end_p, "No memory:        %lu\n",
+	             atomic_read(&zstats.nr_nomem));
+	p = seprintf(p, end_p, "Eviction passes:  %lu\n",
+	             atomic_read(&zstats.nr_passes));
+	p = seprintf(p, end_p, "Pages evicted:    %lu\n",
+	             atomic_read(&zstats.nr_evicted));
+	n = readstr(offset, va, n, buf);
+	kfree(buf);
+	return n;
+}
@@ -0,0 +1,144 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * TCP connection setup rate over loopback: connector threads connect() and
+ * close() as fast as they can, while acceptor threads accept() and close() on
+ * one listening socket.  Every connection clones two convs (one on each end)
+ * and goes through the listener's accept queue, which is what this measures.
+ * Reports accepted connections per second.
+ *
+ * Every connection leaves a conv in Time_wait for a while, so keep the runs
+ * short, or you'll measure how long it takes to find a free conv.
+ *
+ * usage: conn_rate [nr_connectors] [nr_acceptors] [seconds] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/timing.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+#define NR_THREADS_MAX	64
+#define PORT			46000
+
+static int nr_connectors = 4;
+static int nr_acceptors = 2;
+static int run_secs = 2;
+static volatile bool done;
+static int listen_fd;
+
+struct worker {
+	pthread_t					thread;
+	uint64_t					nr_conns;
+};
+
+static struct worker connectors[NR_THREADS_MAX];
+static struct worker acceptors[NR_THREADS_MAX];
+
+static void *connector_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct sockaddr_in sin = {0};
+	int fd;
+
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(PORT);
+	while (!done) {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			handle_error("socket");
+		if (connect(fd, (struct sockaddr*)&sin, sizeof(sin)))
+			handle_error("connect");
+		close(fd);
+		w->nr_conns++;
+	}
+	return NULL;
+}
+
+static void *acceptor_thread(void *arg)
+{
+	struct worker *w = arg;
+	int fd;
+
+	for (;;) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (done)
+				break;
+			handle_error("accept");
+		}
+		close(fd);
+		w->nr_conns++;
+	}
+	return NULL;
+}
+
+static int listening_socket(void)
+{
+	struct sockaddr_in sin = {0};
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		handle_error("socket");
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	sin.sin_port = htons(PORT);
+	if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)))
+		handle_error("bind");
+	if (listen(fd, 1000))
+		handle_error("listen");
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t start, nsecs, total = 0;
+
+	if (argc > 1)
+		nr_connectors = atoi(argv[1]);
+	if (argc > 2)
+		nr_acceptors = atoi(argv[2]);
+	if (argc > 3)
+		run_secs = atoi(argv[3]);
+	if (nr_connectors < 1 || nr_connectors > NR_THREADS_MAX ||
+	    nr_acceptors < 1 || nr_acceptors > NR_THREADS_MAX) {
+		printf("usage: %s [nr_connectors (1-%d)] [nr_acceptors (1-%d)] [seconds]\n",
+		       argv[0], NR_THREADS_MAX, NR_THREADS_MAX);
+		exit(-1);
+	}
+	listen_fd = listening_socket();
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), nr_connectors + nr_acceptors));
+	for (int i = 0; i < nr_acceptors; i++)
+		pthread_create(&acceptors[i].thread, NULL, acceptor_thread,
+		               &acceptors[i]);
+	start = nsec();
+	for (int i = 0; i < nr_connectors; i++)
+		pthread_create(&connectors[i].thread, NULL, connector_thread,
+		               &connectors[i]);
+	sleep(run_secs);
+	done = TRUE;
+	for (int i = 0; i < nr_connectors; i++)
+		pthread_join(connectors[i].thread, NULL);
+	nsecs = nsec() - start;
+	/* Kicks the acceptors out of accept() */
+	close(listen_fd);
+	for (int i = 0; i < nr_acceptors; i++) {
+		pthread_join(acceptors[i].thread, NULL);
+		total += acceptors[i].nr_conns;
+	}
+	printf("%d connectors, %d acceptors: %lu conns/s\n", nr_connectors,
+	       nr_acceptors, total * 1000000000UL / nsecs);
+	return 0;
+}
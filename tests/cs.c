@@ -17,10 +17,13 @@
 #include <ndblib/ndb.h>
 #include <parlib/parlib.h>
 #include <parlib/spinlock.h>
+#include <parlib/timing.h>
+#include <parlib/uthread.h>
 #include <pthread.h>
 #include <ros/common.h>
 #include <signal.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -29,6 +32,7 @@ enum {
 	Nreply = 20,
 	Maxreply = 256,
 	Maxrequest = 128,
+	Ncache = 256,
 	Maxpath = 128,
 	Maxfdata = 8192,
 	Maxhost = 64,    /* maximum host name size */
@@ -129,8 +133,19 @@ static struct job *newjob(void);
 static void freejob(struct job *);
 static void setext(char *, int, char *);
 static void cleanmf(struct mfile *);
+static int cachehit(struct mfile *, char *);
+static void cacheput(struct mfile *, char *);
+static void cacheflush(void);
+static void geninit(void);
 
-spinlock_t dblock = SPINLOCK_INITIALIZER;  /* mutex on database operations */
+/*
+ *  requests run concurrently, each in its own thread.  fid management is
+ *  serialized by mflock, but reads and writes only hold dblock for lookups and
+ *  changes to our state, and not at all for queries that hit in the cache, so
+ *  they don't wait for someone else's dns lookup.
+ */
+uth_mutex_t dblock = UTH_MUTEX_INIT;         /* mutex on database operations */
+uth_mutex_t mflock = UTH_MUTEX_INIT;         /* mutex on mlist and fids */
 spinlock_t netlock = SPINLOCK_INITIALIZER; /* mutex for netinit() */
 
 char *logfile = "cs";
@@ -284,6 +299,7 @@ int main(int argc, char *argv[])
 	netinit(0);
 
 	if (!justsetname) {
+		geninit();
 		mountinit(servefile, mntpt);
 		if (server)
 			evnotify(0);
@@ -431,9 +447,14 @@ static void *job_thread(void *arg)
 {
 	struct mfile *mf;
 	struct job *job = arg;
+	int fidop;
 
-	spinlock_lock(&dblock);
+	/* reads and writes are on fids that their clients already hold */
+	fidop = job->request.type != Tread && job->request.type != Twrite;
+	uth_mutex_lock(&mflock);
 	mf = newfid(job->request.fid);
+	if (!fidop)
+		uth_mutex_unlock(&mflock);
 
 	if (debug)
 		fprintf(stderr, "CS:%F", &job->request);
@@ -481,7 +502,8 @@ static void *job_thread(void *arg)
 		rwstat(job, mf);
 		break;
 	}
-	spinlock_unlock(&dblock);
+	if (fidop)
+		uth_mutex_unlock(&mflock);
 
 	freejob(job);
 
@@ -661,7 +683,7 @@ static void rcreate(struct job *job, struct mfile *mf)
 
 static void rread(struct job *job, struct mfile *mf)
 {
-	int i, n, cnt;
+	int i, n, cnt, rv;
 	long off, toff, clock;
 	struct dir dir;
 	uint8_t buf[Maxfdata];
@@ -703,7 +725,10 @@ static void rread(struct job *job, struct mfile *mf)
 				break; /* got something to return */
 
 			/* try looking up more answers */
-			if (lookup(mf) == 0) {
+			uth_mutex_lock(&dblock);
+			rv = lookup(mf);
+			uth_mutex_unlock(&dblock);
+			if (rv == 0) {
 				/* no more */
 				n = 0;
 				goto send;
@@ -751,24 +776,176 @@ static void cleanmf(struct mfile *mf)
 	mf->nextnet = netlist;
 }
 
+/*
+ *  answers to recent translations, with where the lookup left off.  entries
+ *  go stale after CS_CACHE_TTL seconds, or when our view of the networks
+ *  changes (add, refresh), which also bumps the generation that the dialers'
+ *  own caches watch.
+ */
+struct centry {
+	char *query;
+	char *net;
+	char *host;
+	char *serv;
+	char *rem;
+	struct network *nextnet;
+	int nreply;
+	char *reply[Nreply];
+	uint64_t expire;
+};
+
+static struct centry cache[Ncache];
+static uth_mutex_t cachelock = UTH_MUTEX_INIT;
+static volatile uint64_t *csgen;
+
+static struct centry *cacheslot(char *query)
+{
+	unsigned int h = 0;
+
+	for (; *query; query++)
+		h = h * 31 + *query;
+	return &cache[h % Ncache];
+}
+
+static char *cachedup(char *s)
+{
+	return s ? estrdup(s) : NULL;
+}
+
+static void centryfree(struct centry *e)
+{
+	int i;
+
+	free(e->query);
+	free(e->net);
+	free(e->host);
+	free(e->serv);
+	free(e->rem);
+	for (i = 0; i < e->nreply; i++)
+		free(e->reply[i]);
+	memset(e, 0, sizeof(*e));
+}
+
+/*
+ *  fill in mf from the cache, as if we had just done the lookup
+ */
+static int cachehit(struct mfile *mf, char *query)
+{
+	struct centry *e = cacheslot(query);
+	int i;
+
+	uth_mutex_lock(&cachelock);
+	if (e->query == NULL || strcmp(e->query, query) != 0 ||
+	    read_tsc() >= e->expire) {
+		uth_mutex_unlock(&cachelock);
+		return 0;
+	}
+	cleanmf(mf);
+	mf->net = cachedup(e->net);
+	mf->host = cachedup(e->host);
+	mf->serv = cachedup(e->serv);
+	mf->rem = cachedup(e->rem);
+	for (i = 0; i < e->nreply; i++) {
+		mf->reply[i] = estrdup(e->reply[i]);
+		mf->replylen[i] = strlen(e->reply[i]);
+	}
+	mf->nreply = e->nreply;
+	mf->nextnet = e->nextnet;
+	uth_mutex_unlock(&cachelock);
+	return 1;
+}
+
+static void cacheput(struct mfile *mf, char *query)
+{
+	struct centry *e = cacheslot(query);
+	int i;
+
+	uth_mutex_lock(&cachelock);
+	centryfree(e);
+	e->query = estrdup(query);
+	e->net = cachedup(mf->net);
+	e->host = cachedup(mf->host);
+	e->serv = cachedup(mf->serv);
+	e->rem = cachedup(mf->rem);
+	for (i = 0; i < mf->nreply; i++)
+		e->reply[i] = estrdup(mf->reply[i]);
+	e->nreply = mf->nreply;
+	e->nextnet = mf->nextnet;
+	e->expire = read_tsc() + sec2tsc(CS_CACHE_TTL);
+	uth_mutex_unlock(&cachelock);
+}
+
+static void cacheflush(void)
+{
+	int i;
+
+	uth_mutex_lock(&cachelock);
+	for (i = 0; i < Ncache; i++)
+		centryfree(&cache[i]);
+	uth_mutex_unlock(&cachelock);
+	if (csgen)
+		__sync_fetch_and_add(csgen, 1);
+}
+
+/*
+ *  publish our generation where dialers can map it (see iplib's cscache.c).
+ *  we start from the tsc, so that a new cs invalidates what the old one said.
+ */
+static void geninit(void)
+{
+	char path[Maxpath];
+	uint64_t gen = read_tsc();
+	void *va;
+	int fd;
+
+	cs_gen_path(path, sizeof(path), mntpt);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "CS:can't create %s: %r\n", path);
+		return;
+	}
+	if (pwrite(fd, &gen, sizeof(gen), 0) != sizeof(gen)) {
+		fprintf(stderr, "CS:can't write %s: %r\n", path);
+		close(fd);
+		return;
+	}
+	va = mmap(0, sizeof(gen), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (va == MAP_FAILED) {
+		fprintf(stderr, "CS:can't map %s: %r\n", path);
+		return;
+	}
+	csgen = va;
+}
+
 static void rwrite(struct job *job, struct mfile *mf)
 {
 	int cnt, n;
 	char *err;
 	char *field[4];
 	char curerr[64];
+	char query[Maxrequest];
 
 	err = 0;
 	cnt = job->request.count;
 	if (mf->qid.type & QTDIR) {
 		err = "can't write directory";
-		goto send;
+		goto reply;
 	}
 	if (cnt >= Maxrequest) {
 		err = "request too long";
-		goto send;
+		goto reply;
 	}
 	job->request.data[cnt] = 0;
+
+	/*
+	 *  answers we've found recently don't need the database.  only
+	 *  translations make it into the cache, so this can't be a command.
+	 */
+	if (cachehit(mf, job->request.data))
+		goto reply;
+
+	uth_mutex_lock(&dblock);
 	/*
 	 *  toggle debugging
 	 */
@@ -804,6 +981,7 @@ static void rwrite(struct job *job, struct mfile *mf)
 			job->request.data[cnt - 1] = 0;
 		netadd(job->request.data + 4);
 		readipinterfaces();
+		cacheflush();
 		goto send;
 	}
 
@@ -812,6 +990,7 @@ static void rwrite(struct job *job, struct mfile *mf)
 	 */
 	if (strncmp(job->request.data, "refresh", 7) == 0) {
 		netinit(0 /*1*/);
+		cacheflush();
 		goto send;
 	}
 
@@ -834,6 +1013,7 @@ static void rwrite(struct job *job, struct mfile *mf)
 	/*
 	 *  break up name
 	 */
+	strcpy(query, job->request.data);
 	n = getfields(job->request.data, field, 4, 1, "!");
 	switch (n) {
 	case 1:
@@ -857,8 +1037,12 @@ static void rwrite(struct job *job, struct mfile *mf)
 	if (lookup(mf) == 0) {
 		snprintf(curerr, sizeof(curerr), "%r");
 		err = curerr;
+	} else {
+		cacheput(mf, query);
 	}
 send:
+	uth_mutex_unlock(&dblock);
+reply:
 	job->reply.count = cnt;
 	sendmsg(job, err);
 }
@@ -1552,7 +1736,7 @@ static struct ndbtuple *dnsiplookup(char *host, struct ndbs *s)
 	char buf[Maxreply];
 	struct ndbtuple *t;
 
-	spinlock_unlock(&dblock);
+	uth_mutex_unlock(&dblock);
 
 	/* save the name */
 	snprintf(buf, sizeof(buf), "%s", host);
@@ -1575,7 +1759,7 @@ static struct ndbtuple *dnsiplookup(char *host, struct ndbs *s)
 			werrstr("temporary problem: %s", buf);
 	}
 
-	spinlock_lock(&dblock);
+	uth_mutex_lock(&dblock);
 	return t;
 }
 
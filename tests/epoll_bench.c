@@ -0,0 +1,173 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Epoll scalability benchmark: one event loop (pthread + epoll set) per vcore,
+ * lots of idle FDs, and a writer poking a smaller set of active FDs.  Reports
+ * events per second.
+ *
+ * Then all of the loops add one shared eventfd with EPOLLEXCLUSIVE, and we
+ * count how many loops wake up per poke.  Ideally it's one.
+ *
+ * usage: epoll_bench [nr_loops] [nr_idle] [nr_active] [seconds] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/timing.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+#define NR_LOOPS_MAX	64
+#define EP_MAX_EVENTS	64
+#define NR_EXCL_POKES	1000
+
+static int nr_loops = 4;
+static int nr_idle = 100000;
+static int nr_active = 1000;
+static int run_secs = 5;
+
+static int *active_fds;
+static int shared_fd;
+static volatile bool done;
+static atomic_t nr_events;
+static atomic_t nr_shared_wakes;
+
+struct ev_loop {
+	pthread_t					thread;
+	int							epfd;
+};
+
+static struct ev_loop loops[NR_LOOPS_MAX];
+
+static void add_fd(int epfd, int fd, uint32_t extra)
+{
+	struct epoll_event ep_ev;
+
+	ep_ev.events = EPOLLIN | EPOLLET | extra;
+	ep_ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ep_ev))
+		handle_error("epoll_ctl add");
+}
+
+static int new_efd(void)
+{
+	int fd = eventfd(0, EFD_NONBLOCK);
+
+	if (fd < 0)
+		handle_error("eventfd");
+	return fd;
+}
+
+static void *loop_thread(void *arg)
+{
+	struct ev_loop *loop = arg;
+	struct epoll_event results[EP_MAX_EVENTS];
+	eventfd_t efd_val;
+	int ret;
+
+	while (!done) {
+		ret = epoll_wait(loop->epfd, results, EP_MAX_EVENTS, 100);
+		if (ret < 0)
+			handle_error("epoll_wait");
+		for (int i = 0; i < ret; i++) {
+			/* Could be spurious, and someone else might have drained it */
+			if (eventfd_read(results[i].data.fd, &efd_val))
+				continue;
+			if (results[i].data.fd == shared_fd)
+				atomic_inc(&nr_shared_wakes);
+			else
+				atomic_fetch_and_add(&nr_events, efd_val);
+		}
+	}
+	return NULL;
+}
+
+static void start_loops(void)
+{
+	done = FALSE;
+	for (int i = 0; i < nr_loops; i++)
+		pthread_create(&loops[i].thread, NULL, loop_thread, &loops[i]);
+}
+
+static void stop_loops(void)
+{
+	done = TRUE;
+	for (int i = 0; i < nr_loops; i++)
+		pthread_join(loops[i].thread, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t start, end;
+	long total;
+	int fd;
+
+	if (argc > 1)
+		nr_loops = MIN(atoi(argv[1]), NR_LOOPS_MAX);
+	if (argc > 2)
+		nr_idle = atoi(argv[2]);
+	if (argc > 3)
+		nr_active = atoi(argv[3]);
+	if (argc > 4)
+		run_secs = atoi(argv[4]);
+	if (nr_loops < 1 || nr_active < 1) {
+		printf("Need at least one loop and one active FD\n");
+		exit(-1);
+	}
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), nr_loops + 1));
+
+	/* An FD can be in only one set, unless it's EPOLLEXCLUSIVE, so we deal
+	 * them out. */
+	for (int i = 0; i < nr_loops; i++) {
+		loops[i].epfd = epoll_create(1);
+		if (loops[i].epfd < 0)
+			handle_error("epoll_create");
+	}
+	for (int i = 0; i < nr_idle; i++) {
+		fd = new_efd();
+		add_fd(loops[i % nr_loops].epfd, fd, 0);
+	}
+	active_fds = malloc(sizeof(int) * nr_active);
+	for (int i = 0; i < nr_active; i++) {
+		active_fds[i] = new_efd();
+		add_fd(loops[i % nr_loops].epfd, active_fds[i], 0);
+	}
+	shared_fd = -1;
+
+	printf("%d loops, %d idle FDs, %d active FDs, %d sec\n", nr_loops,
+	       nr_idle, nr_active, run_secs);
+	start_loops();
+	start = nsec();
+	end = start + run_secs * 1000000000ULL;
+	for (int i = 0; nsec() < end; i = (i + 1) % nr_active)
+		eventfd_write(active_fds[i], 1);
+	end = nsec();
+	stop_loops();
+	total = atomic_read(&nr_events);
+	printf("Events: %ld, %llu events/sec\n", total,
+	       total * 1000000000ULL / (end - start));
+
+	shared_fd = new_efd();
+	for (int i = 0; i < nr_loops; i++)
+		add_fd(loops[i].epfd, shared_fd, EPOLLEXCLUSIVE);
+	start_loops();
+	/* Give them a chance to block, so every loop is a candidate */
+	for (int i = 0; i < NR_EXCL_POKES; i++) {
+		uthread_usleep(1000);
+		eventfd_write(shared_fd, 1);
+	}
+	uthread_usleep(100000);
+	stop_loops();
+	printf("EPOLLEXCLUSIVE: %d pokes, %ld wakeups (%ld.%02ld per poke)\n",
+	       NR_EXCL_POKES, atomic_read(&nr_shared_wakes),
+	       atomic_read(&nr_shared_wakes) / NR_EXCL_POKES,
+	       atomic_read(&nr_shared_wakes) * 100 / NR_EXCL_POKES % 100);
+	return 0;
+}
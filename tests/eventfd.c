@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <parlib/parlib.h>
+#include <parlib/efd_shm.h>
 #include <unistd.h>
 #include <pthread.h>
 
@@ -51,6 +52,20 @@ static void *upper_thread(void *arg)
 	return 0;
 }
 
+static struct efd_shm *upper_shm;
+
+/* Signals through the mapping; the main thread is asleep in the kernel, so
+ * this has to ring the doorbell. */
+static void *shm_upper_thread(void *arg)
+{
+	int efd = (int)(long)arg;
+	uthread_sleep(1);
+	if (efd_shm_write(efd, upper_shm, 1))
+		handle_error("shm upper write");
+	upped = TRUE;
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int ret;
@@ -118,5 +133,34 @@ int main(int argc, char **argv)
 		handle_error("largest legal write");
 	close(efd);
 
+	/* Mapped counter */
+	efd = eventfd(0, 0);
+	if (efd < 0)
+		handle_error("open mapped");
+	upper_shm = efd_shm_map(efd);
+	if (!upper_shm)
+		handle_error("efd_shm_map");
+	assert(!efd_shm_try_read(efd, upper_shm, &efd_val));
+	/* The kernel and the mapping see the same counter */
+	if (eventfd_write(efd, 3))
+		handle_error("write mapped");
+	assert(efd_shm_try_read(efd, upper_shm, &efd_val) && efd_val == 3);
+	if (efd_shm_write(efd, upper_shm, 5))
+		handle_error("shm write mapped");
+	assert(!upper_shm->nr_readers);
+	if (eventfd_read(efd, &efd_val))
+		handle_error("read mapped");
+	assert(efd_val == 5);
+	if (pthread_create(&child, &pth_attrs, &shm_upper_thread,
+	                   (void*)(long)efd))
+		handle_error("pth_create failed");
+	upped = FALSE;
+	if (eventfd_read(efd, &efd_val))
+		handle_error("blocking read mapped");
+	cmb();
+	assert(upped && efd_val == 1);
+	efd_shm_unmap(upper_shm);
+	close(efd);
+
 	return 0;
 }
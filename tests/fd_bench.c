@@ -0,0 +1,100 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * FD lookup scalability benchmark: one pthread per vcore, each reading from
+ * its own FD on #cons/null as fast as it can.  Every read goes through
+ * fdtochan(), so this is mostly the cost of the FD lookup plus the syscall.
+ * Runs with 1, 2, 4... threads, up to nr_threads, and reports reads per second.
+ *
+ * usage: fd_bench [nr_threads] [seconds] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <parlib/arch/arch.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/timing.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+#define NR_THREADS_MAX	64
+
+static int nr_threads = 8;
+static int run_secs = 2;
+
+static volatile bool done;
+
+struct reader {
+	pthread_t					thread;
+	int							fd;
+	unsigned long				nr_reads;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct reader readers[NR_THREADS_MAX];
+
+static void *reader_thread(void *arg)
+{
+	struct reader *r = arg;
+	char buf[1];
+
+	while (!done) {
+		if (read(r->fd, buf, sizeof(buf)) < 0)
+			handle_error("read");
+		r->nr_reads++;
+	}
+	return NULL;
+}
+
+static unsigned long run_readers(int nr)
+{
+	unsigned long total = 0;
+
+	done = FALSE;
+	for (int i = 0; i < nr; i++) {
+		readers[i].nr_reads = 0;
+		pthread_create(&readers[i].thread, NULL, reader_thread, &readers[i]);
+	}
+	uthread_sleep(run_secs);
+	done = TRUE;
+	for (int i = 0; i < nr; i++) {
+		pthread_join(readers[i].thread, NULL);
+		total += readers[i].nr_reads;
+	}
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long total, base = 0;
+
+	if (argc > 1)
+		nr_threads = MIN(atoi(argv[1]), NR_THREADS_MAX);
+	if (argc > 2)
+		run_secs = atoi(argv[2]);
+	if (nr_threads < 1 || run_secs < 1) {
+		printf("usage: %s [nr_threads] [seconds]\n", argv[0]);
+		exit(-1);
+	}
+	for (int i = 0; i < nr_threads; i++) {
+		readers[i].fd = open("#cons/null", O_RDONLY);
+		if (readers[i].fd < 0)
+			handle_error("open");
+	}
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), nr_threads));
+
+	for (int nr = 1; ; nr = MIN(nr * 2, nr_threads)) {
+		total = run_readers(nr) / run_secs;
+		if (!base)
+			base = total;
+		printf("%3d threads: %10lu reads/sec, %lu.%02lux of 1 thread\n", nr,
+		       total, total / base, total * 100 / base % 100);
+		if (nr == nr_threads)
+			break;
+	}
+	return 0;
+}
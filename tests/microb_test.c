@@ -14,9 +14,9 @@
  *
  * 		test_time_ns(my_test, 100000);
  *
- * This macro will run your test and print the results.  Pick a loop amount that
- * is reasonable for your operation.  You can also use test_time_us() for longer
- * operations.
+ * This macro will run your test and print the results, with benchutil's
+ * harness.  Pick a loop amount that is reasonable for your operation.  Run with
+ * -f csv or -f json for machine-readable output.
  *
  * Notes:
  * - I went with this style so you could do some prep work before and after the
@@ -39,13 +39,15 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <string.h>
+#include <sys/param.h>
 
 /* OS dependent #incs */
 #include <parlib/parlib.h>
 #include <parlib/vcore.h>
 #include <parlib/timing.h>
 #include <parlib/stdio.h>
+#include <benchutil/harness.h>
 
 static uint32_t __get_pcoreid(void)
 {
@@ -80,56 +82,37 @@ void loop_overhead(unsigned long nr_loops)
     }
 }
 
-/* Runs func(loops) and returns the usec elapsed */
-#define __test_time_us(func, loops)                                            \
-({                                                                             \
-	struct timeval start_tv = {0};                                             \
-	struct timeval end_tv = {0};                                               \
-	if (gettimeofday(&start_tv, 0))                                            \
-		perror("Start time error...");                                         \
-	(func)((loops));                                                           \
-	if (gettimeofday(&end_tv, 0))                                              \
-		perror("End time error...");                                           \
-	((end_tv.tv_sec - start_tv.tv_sec) * 1000000 +                             \
-	 (end_tv.tv_usec - start_tv.tv_usec));                                     \
-})
-
-/* Runs func(loops) and returns the nsec elapsed */
-#define __test_time_ns(func, loops)                                            \
-({                                                                             \
-	(__test_time_us((func), (loops)) * 1000);                                  \
-})
-
-/* Runs func(loops), subtracts the loop overhead, and prints the result */
-#define test_time_us(func, loops)                                              \
-({                                                                             \
-	unsigned long long usec_diff;                                              \
-	usec_diff = __test_time_us((func), (loops)) - nsec_per_loop * loops / 1000;\
-	printf("\"%s\" total: %lluus, per iteration: %lluus\n", #func, usec_diff,  \
-	       usec_diff / (loops));                                               \
-})
-
-/* Runs func(loops), subtracts the loop overhead, and prints the result */
-#define test_time_ns(func, loops)                                              \
-({                                                                             \
-	unsigned long long nsec_diff;                                              \
-	nsec_diff = __test_time_ns((func), (loops)) - nsec_per_loop * (loops);     \
-	printf("\"%s\" total: %lluns, per iteration: %lluns\n", #func, nsec_diff,  \
-	       nsec_diff / (loops));                                               \
-})
+static enum bench_fmt fmt = BENCH_FMT_TEXT;
+
+static void run_loops(void *arg, unsigned int tid, uint64_t nr)
+{
+	void (*func)(unsigned long) = arg;
+
+	func(nr);
+}
+
+/* Runs func in batches of loops / 100, after a warmup, and reports the time per
+ * iteration.  loop_overhead's report is the cost of the loop itself. */
+static void __test_time_ns(const char *name, void (*func)(unsigned long),
+                           unsigned long loops)
+{
+	struct bench_opts opts = {.nr_threads = 1, .warmup_iters = loops / 10,
+	                          .iters = loops, .batch = MAX(loops / 100, 1)};
+	struct bench_result res;
+
+	bench_run(name, &opts, run_loops, func, &res);
+	bench_report(stdout, fmt, &res);
+}
+
+#define test_time_ns(func, loops) __test_time_ns(#func, (func), (loops))
 
 static void microb_test(void)
 {
-	unsigned long long nsec_per_loop;
-	printf("We are %sin MCP mode, running on vcore %d, pcore %d\n",
-	       (in_multi_mode() ? "" : "not "), vcore_id(),
-	       __get_pcoreid());
-	/* We divide the overhead by loops, and later we multiply again, which drops
-	 * off some accuracy at the expense of usability (can do different
-	 * iterations for different tests without worrying about recomputing the
-	 * loop overhead). */
-	nsec_per_loop = __test_time_ns(loop_overhead, 100000) / 100000;
-	printd("Loop overhead per loop: %lluns\n", nsec_per_loop);
+	if (fmt == BENCH_FMT_TEXT)
+		printf("We are %sin MCP mode, running on vcore %d, pcore %d\n",
+		       (in_multi_mode() ? "" : "not "), vcore_id(),
+		       __get_pcoreid());
+	test_time_ns(loop_overhead, 100000);
 
 	/* Add your tests here.  Func name, number of loops */
 	test_time_ns(set_tlsdesc_test , 100000);
@@ -145,8 +128,16 @@ int main(int argc, char** argv)
 {
 	pthread_t child;
 	void *child_ret;
+
+	if (argc > 1 && (argc != 3 || strcmp(argv[1], "-f") ||
+	                 bench_parse_fmt(argv[2], &fmt))) {
+		printf("usage: %s [-f text|csv|json]\n", argv[0]);
+		exit(-1);
+	}
+	bench_report_header(stdout, fmt);
 	microb_test();
-	printf("Spawning worker thread, etc...\n");
+	if (fmt == BENCH_FMT_TEXT)
+		printf("Spawning worker thread, etc...\n");
 	pthread_create(&child, NULL, &worker_thread, NULL);
 	pthread_join(child, &child_ret);
 } 
@@ -0,0 +1,100 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * 9p throughput benchmark: writes and then reads back a file with large I/Os,
+ * and reports MB/sec for each.  Point it at a file on a #mnt-backed mount, e.g.
+ * a 9p server over loopback and one across a 10G link, and compare runs built
+ * with different CONFIG_MNT_RPC_WINDOW values.
+ *
+ * Reads go through the page cache for gtfs mounts, so drop the file from the
+ * cache (or use a fresh file) if you want to measure the wire.
+ *
+ * usage: mnt_bench file [total_mb] [io_kb] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+static size_t total_mb = 256;
+static size_t io_kb = 1024;
+
+static void print_window(void)
+{
+	char buf[32] = {0};
+	int fd;
+
+	fd = open("#vars/mnt_rpc_window!uw", O_RDONLY);
+	if (fd < 0 || read(fd, buf, sizeof(buf) - 1) <= 0)
+		snprintf(buf, sizeof(buf), "?");
+	if (fd >= 0)
+		close(fd);
+	printf("RPC window: %s\n", buf);
+}
+
+static void report(const char *what, size_t bytes, uint64_t ns)
+{
+	printf("%s: %lu MB in %llu msec, %llu MB/sec\n", what, bytes >> 20,
+	       ns / 1000000, (bytes >> 20) * 1000000000ULL / MAX(ns, 1));
+}
+
+int main(int argc, char **argv)
+{
+	size_t io_sz, total, so_far;
+	uint64_t start;
+	char *buf;
+	ssize_t ret;
+	int fd;
+
+	if (argc < 2) {
+		printf("usage: %s file [total_mb] [io_kb]\n", argv[0]);
+		exit(-1);
+	}
+	if (argc > 2)
+		total_mb = atoi(argv[2]);
+	if (argc > 3)
+		io_kb = atoi(argv[3]);
+	io_sz = io_kb << 10;
+	total = total_mb << 20;
+	if (!io_sz || !total) {
+		printf("Need a nonzero size and I/O size\n");
+		exit(-1);
+	}
+	buf = malloc(io_sz);
+	if (!buf)
+		handle_error("malloc");
+	memset(buf, 0xab, io_sz);
+	print_window();
+
+	fd = open(argv[1], O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		handle_error("open");
+	start = nsec();
+	for (so_far = 0; so_far < total; so_far += ret) {
+		ret = pwrite(fd, buf, MIN(io_sz, total - so_far), so_far);
+		if (ret <= 0)
+			handle_error("pwrite");
+	}
+	if (fsync(fd))
+		handle_error("fsync");
+	report("Write", total, nsec() - start);
+
+	start = nsec();
+	for (so_far = 0; so_far < total; so_far += ret) {
+		ret = pread(fd, buf, MIN(io_sz, total - so_far), so_far);
+		if (ret < 0)
+			handle_error("pread");
+		if (!ret)
+			break;
+	}
+	report("Read", so_far, nsec() - start);
+	close(fd);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,396 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Network benchmark suite, with benchutil's harness.  By default, it runs its
+ * own servers in-process and talks to them over loopback.  For a real NIC, run
+ * 'netbench -s' on one machine and 'netbench -H its_addr' on the other.
+ *
+ * The tests:
+ * - tcp_stream: each connection writes 64 KiB chunks into a sink.  ops/sec
+ *   times the chunk size is the throughput.
+ * - tcp_rr_SIZE: each connection sends a request of SIZE bytes, 1 B up to
+ *   64 KiB, and waits for the echo.  Latency is per round trip.
+ * - tcp_crr: connect, a 1 byte round trip, and close.  ops/sec is the
+ *   connection setup rate.
+ * - udp_rr_SIZE: like tcp_rr, with a datagram each way.  There's no
+ *   retransmission, so a lost datagram hangs its thread.
+ *
+ * Each test runs with 1 connection and then with -c connections, one thread
+ * per connection.
+ *
+ * usage: netbench [-f text|csv|json] [-c conns] [-n iters] [-p port]
+ *                 [-H host | -s] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/timing.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <benchutil/harness.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+#define NR_CONNS_MAX		64
+#define STREAM_CHUNK		(64 * 1024)
+#define RR_SIZE_MAX			(64 * 1024)
+#define UDP_SIZE_MAX		8192
+#define NR_UDP_SERVERS		4
+
+/* Port offsets from the base port */
+enum {
+	PORT_SINK,
+	PORT_ECHO,
+};
+
+static enum bench_fmt fmt = BENCH_FMT_TEXT;
+static int base_port = 47000;
+static int nr_conns = 8;
+static uint64_t nr_iters = 10000;
+static struct in_addr server_addr;
+
+static const size_t tcp_rr_sizes[] = {1, 64, 1024, 16384, 65536};
+static const size_t udp_rr_sizes[] = {1, 64, 1024, 8192};
+
+struct conns {
+	size_t						size;
+	int							fds[NR_CONNS_MAX];
+	char						*bufs[NR_CONNS_MAX];
+};
+
+/* Returns FALSE on EOF */
+static bool read_full(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	for (size_t sofar = 0; sofar < len; sofar += ret) {
+		ret = read(fd, buf + sofar, len - sofar);
+		if (ret < 0)
+			handle_error("read");
+		if (ret == 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	for (size_t sofar = 0; sofar < len; sofar += ret) {
+		ret = write(fd, buf + sofar, len - sofar);
+		if (ret <= 0)
+			handle_error("write");
+	}
+}
+
+static void set_sin(struct sockaddr_in *sin, struct in_addr addr, int port)
+{
+	memset(sin, 0, sizeof(struct sockaddr_in));
+	sin->sin_family = AF_INET;
+	sin->sin_addr = addr;
+	sin->sin_port = htons(base_port + port);
+}
+
+static int connect_to(int type, int port)
+{
+	struct sockaddr_in sin;
+	int fd;
+
+	fd = socket(AF_INET, type, 0);
+	if (fd < 0)
+		handle_error("socket");
+	set_sin(&sin, server_addr, port);
+	if (connect(fd, (struct sockaddr*)&sin, sizeof(sin)))
+		handle_error("connect");
+	return fd;
+}
+
+static int listen_on(int type, int port)
+{
+	struct sockaddr_in sin;
+	struct in_addr any = {.s_addr = htonl(INADDR_ANY)};
+	int fd;
+
+	fd = socket(AF_INET, type, 0);
+	if (fd < 0)
+		handle_error("socket");
+	set_sin(&sin, any, port);
+	if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)))
+		handle_error("bind");
+	if (type == SOCK_STREAM && listen(fd, 128))
+		handle_error("listen");
+	return fd;
+}
+
+/* Servers.  TCP requests are a 4 byte length and then that many bytes, which
+ * get echoed back.  The server reads the whole request before replying, so
+ * neither side is ever stuck writing while the other is too. */
+
+static void *tcp_sink_conn(void *arg)
+{
+	int fd = (long)arg;
+	char *buf = malloc(STREAM_CHUNK);
+
+	while (read(fd, buf, STREAM_CHUNK) > 0)
+		;
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static void *tcp_echo_conn(void *arg)
+{
+	int fd = (long)arg;
+	char *buf = malloc(RR_SIZE_MAX);
+	uint32_t len;
+
+	while (read_full(fd, &len, sizeof(len))) {
+		len = ntohl(len);
+		if (len > RR_SIZE_MAX) {
+			fprintf(stderr, "netbench: bad request size %u\n", len);
+			break;
+		}
+		if (!read_full(fd, buf, len))
+			break;
+		write_full(fd, buf, len);
+	}
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+struct acceptor {
+	int							fd;
+	void *(*conn_fn)(void *);
+};
+
+static void *tcp_acceptor(void *arg)
+{
+	struct acceptor *acc = arg;
+	pthread_t child;
+	int fd;
+
+	for (;;) {
+		fd = accept(acc->fd, NULL, NULL);
+		if (fd < 0)
+			handle_error("accept");
+		pthread_create(&child, NULL, acc->conn_fn, (void*)(long)fd);
+		pthread_detach(child);
+	}
+	return NULL;
+}
+
+static void *udp_echo_server(void *arg)
+{
+	int fd = (long)arg;
+	char *buf = malloc(UDP_SIZE_MAX);
+	struct sockaddr_in from;
+	socklen_t from_len;
+	ssize_t ret;
+
+	for (;;) {
+		from_len = sizeof(from);
+		ret = recvfrom(fd, buf, UDP_SIZE_MAX, 0, (struct sockaddr*)&from,
+		               &from_len);
+		if (ret < 0)
+			handle_error("recvfrom");
+		sendto(fd, buf, ret, 0, (struct sockaddr*)&from, from_len);
+	}
+	return NULL;
+}
+
+static void start_servers(void)
+{
+	static struct acceptor sink, echo;
+	pthread_t thread;
+	int udp_fd;
+
+	sink.fd = listen_on(SOCK_STREAM, PORT_SINK);
+	sink.conn_fn = tcp_sink_conn;
+	pthread_create(&thread, NULL, tcp_acceptor, &sink);
+	echo.fd = listen_on(SOCK_STREAM, PORT_ECHO);
+	echo.conn_fn = tcp_echo_conn;
+	pthread_create(&thread, NULL, tcp_acceptor, &echo);
+	udp_fd = listen_on(SOCK_DGRAM, PORT_ECHO);
+	for (int i = 0; i < NR_UDP_SERVERS; i++)
+		pthread_create(&thread, NULL, udp_echo_server, (void*)(long)udp_fd);
+}
+
+/* Clients */
+
+/* Connects nr FDs, or leaves them at -1 if type is 0. */
+static void open_conns(struct conns *c, int nr, int type, int port,
+                       size_t size)
+{
+	c->size = size;
+	for (int i = 0; i < nr; i++) {
+		c->fds[i] = type ? connect_to(type, port) : -1;
+		/* Room for the TCP request's length */
+		c->bufs[i] = calloc(1, size + sizeof(uint32_t));
+		*(uint32_t*)c->bufs[i] = htonl(size);
+	}
+}
+
+static void close_conns(struct conns *c, int nr)
+{
+	for (int i = 0; i < nr; i++) {
+		if (c->fds[i] >= 0)
+			close(c->fds[i]);
+		free(c->bufs[i]);
+	}
+}
+
+static void op_tcp_stream(void *arg, unsigned int tid, uint64_t nr)
+{
+	struct conns *c = arg;
+
+	for (uint64_t i = 0; i < nr; i++)
+		write_full(c->fds[tid], c->bufs[tid], c->size);
+}
+
+static void op_tcp_rr(void *arg, unsigned int tid, uint64_t nr)
+{
+	struct conns *c = arg;
+	char *buf = c->bufs[tid];
+
+	for (uint64_t i = 0; i < nr; i++) {
+		write_full(c->fds[tid], buf, c->size + sizeof(uint32_t));
+		if (!read_full(c->fds[tid], buf + sizeof(uint32_t), c->size))
+			handle_error("tcp_rr EOF");
+	}
+}
+
+static void op_tcp_crr(void *arg, unsigned int tid, uint64_t nr)
+{
+	struct conns *c = arg;
+	char *buf = c->bufs[tid];
+	int fd;
+
+	for (uint64_t i = 0; i < nr; i++) {
+		fd = connect_to(SOCK_STREAM, PORT_ECHO);
+		write_full(fd, buf, c->size + sizeof(uint32_t));
+		if (!read_full(fd, buf + sizeof(uint32_t), c->size))
+			handle_error("tcp_crr EOF");
+		close(fd);
+	}
+}
+
+static void op_udp_rr(void *arg, unsigned int tid, uint64_t nr)
+{
+	struct conns *c = arg;
+
+	for (uint64_t i = 0; i < nr; i++) {
+		if (write(c->fds[tid], c->bufs[tid], c->size) != c->size)
+			handle_error("write");
+		if (read(c->fds[tid], c->bufs[tid], c->size) != c->size)
+			handle_error("read");
+	}
+}
+
+static void run(const char *name, bench_op_t op, int type, int port,
+                size_t size, uint64_t iters)
+{
+	int conn_counts[] = {1, nr_conns};
+	struct bench_opts opts;
+	struct bench_result res;
+	struct conns c;
+	char full_name[64];
+	int nr;
+
+	for (int i = 0; i < COUNT_OF(conn_counts); i++) {
+		nr = conn_counts[i];
+		if (i && nr == conn_counts[0])
+			break;
+		opts.nr_threads = nr;
+		opts.warmup_iters = MAX(iters / 10, 1);
+		opts.iters = iters;
+		opts.batch = 1;
+		open_conns(&c, nr, type, port, size);
+		snprintf(full_name, sizeof(full_name), "%s.c%d", name, nr);
+		bench_run(full_name, &opts, op, &c, &res);
+		bench_report(stdout, fmt, &res);
+		close_conns(&c, nr);
+	}
+}
+
+static void usage(char *prog)
+{
+	printf("usage: %s [-f text|csv|json] [-c conns] [-n iters] [-p port] "
+	       "[-H host | -s]\n", prog);
+	exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+	bool server_only = FALSE;
+	char *host = NULL;
+	char name[32];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:c:n:p:H:s")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (bench_parse_fmt(optarg, &fmt))
+				usage(argv[0]);
+			break;
+		case 'c':
+			nr_conns = atoi(optarg);
+			break;
+		case 'n':
+			nr_iters = atol(optarg);
+			break;
+		case 'p':
+			base_port = atoi(optarg);
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 's':
+			server_only = TRUE;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_conns < 1 || nr_conns > NR_CONNS_MAX || !nr_iters ||
+	    (host && server_only))
+		usage(argv[0]);
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), nr_conns * 2 + 2));
+	if (!host) {
+		start_servers();
+		if (server_only) {
+			for (;;)
+				sleep(1000);
+		}
+		server_addr.s_addr = htonl(INADDR_LOOPBACK);
+	} else if (!inet_aton(host, &server_addr)) {
+		fprintf(stderr, "netbench: bad address %s\n", host);
+		exit(-1);
+	}
+
+	bench_report_header(stdout, fmt);
+	run("tcp_stream", op_tcp_stream, SOCK_STREAM, PORT_SINK, STREAM_CHUNK,
+	    nr_iters / 10);
+	for (int i = 0; i < COUNT_OF(tcp_rr_sizes); i++) {
+		snprintf(name, sizeof(name), "tcp_rr_%lu", tcp_rr_sizes[i]);
+		run(name, op_tcp_rr, SOCK_STREAM, PORT_ECHO, tcp_rr_sizes[i],
+		    nr_iters);
+	}
+	/* crr connects in the op, and only needs the buffers */
+	run("tcp_crr", op_tcp_crr, 0, PORT_ECHO, 1, nr_iters / 10);
+	for (int i = 0; i < COUNT_OF(udp_rr_sizes); i++) {
+		snprintf(name, sizeof(name), "udp_rr_%lu", udp_rr_sizes[i]);
+		run(name, op_udp_rr, SOCK_DGRAM, PORT_ECHO, udp_rr_sizes[i],
+		    nr_iters);
+	}
+	return 0;
+}
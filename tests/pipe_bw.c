@@ -0,0 +1,111 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Pipe bandwidth benchmark: a writer thread pushes page-aligned buffers through
+ * a pipe to a reader thread.  Writes of 64KB or more can share the writer's
+ * pages with the pipe instead of copying them, so compare the small and large
+ * sizes.  -t makes the writer touch its buffer before every write, like a
+ * compressor refilling its output buffer, which costs a CoW fault when the
+ * reader hasn't gotten to the pages yet.
+ *
+ * usage: pipe_bw [-t] [total_MB] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/timing.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+static size_t sizes[] = {4096, 16384, 65536, 262144, 1048576};
+
+static int pipefd[2];
+static size_t total_bytes = 512 << 20;
+static size_t buf_sz;
+static bool touch;
+
+static void *reader_thread(void *arg)
+{
+	char *buf = arg;
+	size_t left = total_bytes;
+	ssize_t ret;
+
+	while (left) {
+		ret = read(pipefd[0], buf, MIN(left, buf_sz));
+		if (ret <= 0)
+			handle_error("read");
+		left -= ret;
+	}
+	return NULL;
+}
+
+static void run_one(size_t sz)
+{
+	pthread_t reader;
+	char *wbuf, *rbuf;
+	size_t left = total_bytes;
+	uint64_t start, nsecs;
+	ssize_t ret;
+
+	buf_sz = sz;
+	wbuf = mmap(0, sz, PROT_READ | PROT_WRITE,
+	            MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+	rbuf = mmap(0, sz, PROT_READ | PROT_WRITE,
+	            MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+	if (wbuf == MAP_FAILED || rbuf == MAP_FAILED)
+		handle_error("mmap");
+	memset(wbuf, 0xab, sz);
+	pthread_create(&reader, NULL, reader_thread, rbuf);
+	start = nsec();
+	while (left) {
+		if (touch)
+			memset(wbuf, left & 0xff, sz);
+		ret = write(pipefd[1], wbuf, MIN(left, sz));
+		if (ret <= 0)
+			handle_error("write");
+		left -= ret;
+	}
+	pthread_join(reader, NULL);
+	nsecs = nsec() - start;
+	printf("%8lu byte writes: %6lu MB/s\n", sz,
+	       (total_bytes >> 20) * 1000000000UL / nsecs);
+	munmap(wbuf, sz);
+	munmap(rbuf, sz);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t")) != -1) {
+		switch (opt) {
+		case 't':
+			touch = TRUE;
+			break;
+		default:
+			printf("usage: %s [-t] [total_MB]\n", argv[0]);
+			exit(-1);
+		}
+	}
+	if (optind < argc)
+		total_bytes = (size_t)atoi(argv[optind]) << 20;
+	if (!total_bytes) {
+		printf("Need at least 1 MB\n");
+		exit(-1);
+	}
+	if (pipe(pipefd))
+		handle_error("pipe");
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), 3));
+	printf("%lu MB per size%s\n", total_bytes >> 20,
+	       touch ? ", touching the buffer between writes" : "");
+	for (int i = 0; i < COUNT_OF(sizes); i++)
+		run_one(sizes[i]);
+	return 0;
+}
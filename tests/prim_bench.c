@@ -0,0 +1,63 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Cycle costs of the user-visible core primitives, with benchutil's harness.
+ * The kernel-internal ones (kmsgs, kthreads, semaphores, blocks and queues)
+ * are the microb_prims ktest.
+ *
+ * - sys_null: a syscall round trip that does nothing in the kernel.
+ * - pthread_yield: with one thread, each yield saves the thread's context,
+ *   drops into vcore context, runs the 2LS, which picks the same thread again,
+ *   and pop_user_ctx()s back into it.
+ *
+ * usage: prim_bench [-f text|csv|json] */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <benchutil/harness.h>
+
+static enum bench_fmt fmt = BENCH_FMT_TEXT;
+
+static void op_sys_null(void *arg, unsigned int tid, uint64_t nr)
+{
+	for (uint64_t i = 0; i < nr; i++)
+		sys_null();
+}
+
+static void op_pthread_yield(void *arg, unsigned int tid, uint64_t nr)
+{
+	for (uint64_t i = 0; i < nr; i++)
+		pthread_yield();
+}
+
+/* One sample per op, so the percentiles are per op, in TSC ticks. */
+static void run(const char *name, bench_op_t op)
+{
+	struct bench_opts opts = BENCH_OPTS_DEFAULT;
+	struct bench_result res;
+	struct bench_hist *h = &res.hist;
+
+	bench_run(name, &opts, op, NULL, &res);
+	bench_report(stdout, fmt, &res);
+	if (fmt == BENCH_FMT_TEXT)
+		printf("\tcycles per op: p50 %lu, p90 %lu, p99 %lu, max %lu\n",
+		       bench_hist_percentile(h, 50.0), bench_hist_percentile(h, 90.0),
+		       bench_hist_percentile(h, 99.0), h->max);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && (argc != 3 || strcmp(argv[1], "-f") ||
+	                 bench_parse_fmt(argv[2], &fmt))) {
+		printf("usage: %s [-f text|csv|json]\n", argv[0]);
+		exit(-1);
+	}
+	bench_report_header(stdout, fmt);
+	run("sys_null", op_sys_null);
+	run("pthread_yield", op_pthread_yield);
+	return 0;
+}
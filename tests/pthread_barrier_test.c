@@ -4,6 +4,8 @@
 #include <parlib/parlib.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <limits.h>
+#include <futex.h>
 
 pthread_barrier_t barrier;
 
@@ -15,13 +17,39 @@ int nr_vcores = 0;
 pthread_t *my_threads;
 void **my_retvals;
 bool run_barriertest = FALSE;
+bool use_futex = FALSE;
+
+/* Bare-bones futex barrier, like what libgomp and glibc do, to exercise the
+ * futex code. */
+struct futex_barrier {
+	int count;
+	int seq;
+};
+struct futex_barrier fbarrier;
+
+static void futex_barrier_wait(struct futex_barrier *fb)
+{
+	int seq = ACCESS_ONCE(fb->seq);
+
+	if (__sync_add_and_fetch(&fb->count, 1) == nr_threads) {
+		fb->count = 0;
+		__sync_add_and_fetch(&fb->seq, 1);
+		futex(&fb->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+		return;
+	}
+	while (ACCESS_ONCE(fb->seq) == seq)
+		futex(&fb->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+}
 
 void *thread(void *arg)
 {	
 	while (!run_barriertest)
 		cpu_relax();
 	for(int i = 0; i < nr_loops; i++) {
-		pthread_barrier_wait(&barrier);
+		if (use_futex)
+			futex_barrier_wait(&fbarrier);
+		else
+			pthread_barrier_wait(&barrier);
 	}
 	return (void*)(long)pthread_self()->id;
 }
@@ -37,8 +65,10 @@ int main(int argc, char** argv)
 		nr_loops = strtol(argv[2], 0, 10);
 	if (argc > 3)
 		nr_vcores = strtol(argv[3], 0, 10);
-	printf("Running %d threads for %d iterations on %d vcores\n",
-	       nr_threads, nr_loops, nr_vcores);
+	if (argc > 4)
+		use_futex = strtol(argv[4], 0, 10);
+	printf("Running %d threads for %d iterations on %d vcores, %s barrier\n",
+	       nr_threads, nr_loops, nr_vcores, use_futex ? "futex" : "pthread");
 	nr_threads = MIN(nr_threads, MAX_NR_TEST_THREADS);
 	my_threads = malloc(sizeof(pthread_t) * nr_threads);
 	my_retvals = malloc(sizeof(void*) * nr_threads);
@@ -74,5 +104,4 @@ int main(int argc, char** argv)
 	       nr_threads, nr_loops, nr_vcores);
 	printf("Time to run: %d usec, %f usec per barrier\n", usec_diff,
 	       (float)usec_diff / nr_loops);
-	pthread_barrier_destroy(&barrier);
 } 
@@ -0,0 +1,99 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Spawn latency benchmark: creates, runs and waits on a program over and over,
+ * and reports how long the create took and how long the whole round trip took.
+ * The first spawn is reported separately, since it's the one that parses the
+ * ELF and warms the caches.
+ *
+ * usage: spawn_bench [nr_spawns] [program [args...]] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+static char *default_argv[] = {"/bin/true", NULL};
+
+struct spawn_stats {
+	uint64_t					total;
+	uint64_t					min;
+	uint64_t					max;
+};
+
+static void stats_add(struct spawn_stats *s, uint64_t nsec)
+{
+	s->total += nsec;
+	s->min = MIN(s->min, nsec);
+	s->max = MAX(s->max, nsec);
+}
+
+static void stats_print(const char *what, struct spawn_stats *s, int nr)
+{
+	printf("%-10s avg %8lu usec, min %8lu usec, max %8lu usec\n", what,
+	       s->total / nr / 1000, s->min / 1000, s->max / 1000);
+}
+
+/* Returns the nsec for the create, and puts the full round trip in *total. */
+static uint64_t spawn_one(int argc, char **argv, char **envp, uint64_t *total)
+{
+	uint64_t start, created;
+	pid_t pid;
+	int wstatus;
+
+	start = nsec();
+	pid = create_child_with_stdfds(argv[0], argc, argv, envp);
+	if (pid < 0)
+		handle_error("create_child");
+	created = nsec();
+	if (sys_proc_run(pid))
+		handle_error("proc_run");
+	if (waitpid(pid, &wstatus, 0) != pid)
+		handle_error("waitpid");
+	*total = nsec() - start;
+	return created - start;
+}
+
+int main(int argc, char **argv, char **envp)
+{
+	struct spawn_stats create = {0, UINT64_MAX, 0};
+	struct spawn_stats round_trip = {0, UINT64_MAX, 0};
+	int nr_spawns = 1000;
+	char **child_argv = default_argv;
+	int child_argc = 1;
+	uint64_t first_create, first_total, create_ns, total_ns;
+	uint64_t start;
+
+	if (argc > 1)
+		nr_spawns = atoi(argv[1]);
+	if (argc > 2) {
+		child_argv = &argv[2];
+		child_argc = argc - 2;
+	}
+	if (nr_spawns < 1) {
+		printf("usage: %s [nr_spawns] [program [args...]]\n", argv[0]);
+		exit(-1);
+	}
+
+	first_create = spawn_one(child_argc, child_argv, envp, &first_total);
+	start = nsec();
+	for (int i = 0; i < nr_spawns; i++) {
+		create_ns = spawn_one(child_argc, child_argv, envp, &total_ns);
+		stats_add(&create, create_ns);
+		stats_add(&round_trip, total_ns);
+	}
+	printf("Spawned %s %d times, %lu spawns/sec\n", child_argv[0], nr_spawns,
+	       nr_spawns * 1000000000UL / (nsec() - start));
+	printf("First:     create %8lu usec, round trip %8lu usec\n",
+	       first_create / 1000, first_total / 1000);
+	stats_print("Create:", &create, nr_spawns);
+	stats_print("Round trip:", &round_trip, nr_spawns);
+	return 0;
+}
@@ -17,6 +17,7 @@
 #include <sys/param.h>
 #include <parlib/parlib.h>
 #include <parlib/bitmask.h>
+#include <parlib/timing.h>
 
 struct strace_opts {
 	FILE						*outfile;
@@ -29,6 +30,7 @@ struct strace_opts {
 	bool						raw_output;
 	bool						with_time;
 	bool						drop_overflow;
+	bool						binary;
 };
 static struct strace_opts opts;
 
@@ -57,6 +59,8 @@ static struct argp_option argp_opts[] = {
 	},
 	{0, 0, 0, 0, ""},
 	{"drop", 'd', 0, 0, "Drop syscalls on overflow"},
+	{"binary", 'b', 0, 0,
+	 "Binary tracing: less overhead for the traced process, no syscall data.  Always drops on overflow."},
 	{"raw", 'r', 0, 0, "Raw, untranslated output, with timestamps"},
 	{"time", 't', 0, 0, "Print timestamps"},
 	{0, 'h', 0, OPTION_HIDDEN, 0},
@@ -103,6 +107,11 @@ static struct trace_set fd_trace_set = { "fd",
 	 SYS_mmap,
 	 SYS_read,
 	 SYS_write,
+	 SYS_readv,
+	 SYS_writev,
+	 SYS_splice,
+	 SYS_pread,
+	 SYS_pwrite,
 	 SYS_openat,
 	 SYS_close,
 	 SYS_fstat,
@@ -143,6 +152,11 @@ static struct trace_set file_trace_set = { "file",
 	 SYS_mmap,
 	 SYS_read,
 	 SYS_write,
+	 SYS_readv,
+	 SYS_writev,
+	 SYS_splice,
+	 SYS_pread,
+	 SYS_pwrite,
 
 	 /* From 'fd' */
 	 SYS_openat,
@@ -277,6 +291,9 @@ static error_t parse_strace_opt(int key, char *arg, struct argp_state *state)
 	case 'd':
 		s_opts->drop_overflow = TRUE;
 		break;
+	case 'b':
+		s_opts->binary = TRUE;
+		break;
 	case ARGP_KEY_ARG:
 		if (s_opts->pid)
 			argp_error(state, "PID already set, can't launch a process too");
@@ -445,6 +462,68 @@ static void parse_traces(int fd)
 	free(line);
 }
 
+static void print_bin_record(struct systrace_bin_record *rec)
+{
+	bool is_exit = rec->flags & SYSTR_BIN_EXIT;
+	const char *name = "???";
+	uint64_t start, end;
+
+	if (rec->syscallno < __syscall_tbl_sz && __syscall_tbl[rec->syscallno])
+		name = __syscall_tbl[rec->syscallno];
+	fprintf(opts.outfile, "%c ", is_exit ? 'X' : 'E');
+	if (opts.raw_output || opts.with_time) {
+		start = tsc2nsec(rec->start_tsc);
+		end = rec->end_tsc ? tsc2nsec(rec->end_tsc) : 0;
+		fprintf(opts.outfile, "[%7lu.%09lu]-[%7lu.%09lu] ",
+		        start / 1000000000, start % 1000000000,
+		        end / 1000000000, end % 1000000000);
+	}
+	fprintf(opts.outfile, "Syscall %3u (%12s):", rec->syscallno, name);
+	if (!is_exit) {
+		fprintf(opts.outfile,
+		        "(0x%lx, 0x%lx, 0x%lx, 0x%lx, 0x%lx, 0x%lx) ret: --- proc: %u "
+		        "core: %u vcore: %u errno: ---\n",
+		        rec->args[0], rec->args[1], rec->args[2], rec->args[3],
+		        rec->args[4], rec->args[5], rec->pid, rec->coreid,
+		        rec->vcoreid);
+	} else {
+		fprintf(opts.outfile,
+		        " ret: 0x%lx proc: %u core: %u vcore: %u errno: %3d\n",
+		        rec->retval, rec->pid, rec->coreid, rec->vcoreid, rec->err);
+	}
+}
+
+/* The kernel gives us records from one core's ring at a time, so an exit
+ * could come out before its entry if the syscall migrated.  We sort each read
+ * by timestamp, which is usually enough to untangle them. */
+static int bin_record_cmp(const void *a, const void *b)
+{
+	const struct systrace_bin_record *ra = a, *rb = b;
+	uint64_t ta = ra->end_tsc ? ra->end_tsc : ra->start_tsc;
+	uint64_t tb = rb->end_tsc ? rb->end_tsc : rb->start_tsc;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+static void parse_bin_traces(int fd)
+{
+	struct systrace_bin_record *recs;
+	size_t nr_recs = SYSTR_BUF_SZ / sizeof(struct systrace_bin_record);
+	ssize_t ret;
+
+	recs = malloc(nr_recs * sizeof(struct systrace_bin_record));
+	assert(recs);
+	while ((ret = read(fd, recs, nr_recs * sizeof(*recs))) > 0) {
+		ret /= sizeof(*recs);
+		qsort(recs, ret, sizeof(*recs), bin_record_cmp);
+		for (int i = 0; i < ret; i++)
+			print_bin_record(&recs[i]);
+	}
+	if (opts.verbose)
+		fprintf(stderr, "%r\n");
+	free(recs);
+}
+
 int main(int argc, char **argv, char **envp)
 {
 	int fd;
@@ -510,7 +589,8 @@ int main(int argc, char **argv, char **envp)
 		close(fd);
 	}
 
-	snprintf(path, sizeof(path), "/proc/%d/strace", pid);
+	snprintf(path, sizeof(path), "/proc/%d/%s", pid,
+	         opts.binary ? "strace_bin" : "strace");
 	fd = open(path, O_READ);
 	if (!fd) {
 		fprintf(stderr, "open %s: %r\n", path);
@@ -523,6 +603,9 @@ int main(int argc, char **argv, char **envp)
 		sys_proc_run(pid);
 	}
 
-	parse_traces(fd);
+	if (opts.binary)
+		parse_bin_traces(fd);
+	else
+		parse_traces(fd);
 	return 0;
 }
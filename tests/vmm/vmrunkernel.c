@@ -25,6 +25,7 @@
 #include <parlib/alarm.h>
 
 #include <vmm/virtio.h>
+#include <vmm/virtio_balloon.h>
 #include <vmm/virtio_blk.h>
 #include <vmm/virtio_mmio.h>
 #include <vmm/virtio_ids.h>
@@ -76,7 +77,8 @@ static struct virtio_vq_dev cons_vqdev = {
 	.name = "console",
 	.dev_id = VIRTIO_ID_CONSOLE,
 	.dev_feat =
-	(1ULL << VIRTIO_F_VERSION_1) | (1 << VIRTIO_RING_F_INDIRECT_DESC),
+	(1ULL << VIRTIO_F_VERSION_1) | (1 << VIRTIO_RING_F_INDIRECT_DESC) |
+	(1ULL << VIRTIO_RING_F_EVENT_IDX),
 	.num_vqs = 2,
 	.cfg = &cons_cfg,
 	.cfg_d = &cons_cfg_d,
@@ -102,36 +104,48 @@ static struct virtio_mmio_dev net_mmio_dev = {
 	.poke_guest = virtio_poke_guest,
 };
 
+/* Each queue pair gets its own RX and TX threads.  The driver picks how many
+ * to use, up to this. */
+#define NET_NR_QUEUE_PAIRS 4
+
 static struct virtio_net_config net_cfg = {
-	.max_virtqueue_pairs = 1
+	.max_virtqueue_pairs = NET_NR_QUEUE_PAIRS
 };
 static struct virtio_net_config net_cfg_d = {
-	.max_virtqueue_pairs = 1
+	.max_virtqueue_pairs = NET_NR_QUEUE_PAIRS
 };
 
+/* net_queue_fn() figures out what each queue is for */
+#define NET_VQ(vq_name) \
+{ \
+	.name = vq_name, \
+	.qnum_max = 64, \
+	.srv_fn = net_queue_fn, \
+	.vqdev = &net_vqdev \
+}
+
 static struct virtio_vq_dev net_vqdev = {
 	.name = "network",
 	.dev_id = VIRTIO_ID_NET,
-	.dev_feat = (1ULL << VIRTIO_F_VERSION_1 | 1 << VIRTIO_NET_F_MAC),
+	.dev_feat = (1ULL << VIRTIO_F_VERSION_1 | 1ULL << VIRTIO_NET_F_MAC |
+	             1ULL << VIRTIO_NET_F_CTRL_VQ | 1ULL << VIRTIO_NET_F_MQ |
+	             1ULL << VIRTIO_RING_F_EVENT_IDX),
 
-	.num_vqs = 2,
+	.num_vqs = 2 * NET_NR_QUEUE_PAIRS + 1,
 	.cfg = &net_cfg,
 	.cfg_d = &net_cfg_d,
 	.cfg_sz = sizeof(struct virtio_net_config),
 	.transport_dev = &net_mmio_dev,
 	.vqs = {
-		{
-			.name = "net_receiveq",
-			.qnum_max = 64,
-			.srv_fn = net_receiveq_fn,
-			.vqdev = &net_vqdev
-		},
-		{
-			.name = "net_transmitq",
-			.qnum_max = 64,
-			.srv_fn = net_transmitq_fn,
-			.vqdev = &net_vqdev
-		},
+		NET_VQ("net_receiveq0"),
+		NET_VQ("net_transmitq0"),
+		NET_VQ("net_receiveq1"),
+		NET_VQ("net_transmitq1"),
+		NET_VQ("net_receiveq2"),
+		NET_VQ("net_transmitq2"),
+		NET_VQ("net_receiveq3"),
+		NET_VQ("net_transmitq3"),
+		NET_VQ("net_controlq"),
 	}
 };
 
@@ -139,32 +153,94 @@ static struct virtio_mmio_dev blk_mmio_dev = {
 	.poke_guest = virtio_poke_guest,
 };
 
+/* Each request queue has its own submission and completion threads. */
+#define BLK_NR_QUEUES 4
+
 static struct virtio_blk_config blk_cfg = {
+	.num_queues = BLK_NR_QUEUES
 };
 
 static struct virtio_blk_config blk_cfg_d = {
+	.num_queues = BLK_NR_QUEUES
 };
 
+#define BLK_VQ(vq_name) \
+{ \
+	.name = vq_name, \
+	.qnum_max = 64, \
+	.srv_fn = blk_request, \
+	.vqdev = &blk_vqdev \
+}
+
 static struct virtio_vq_dev blk_vqdev = {
 	.name = "block",
 	.dev_id = VIRTIO_ID_BLOCK,
-	.dev_feat = (1ULL << VIRTIO_F_VERSION_1),
+	.dev_feat = (1ULL << VIRTIO_F_VERSION_1 | 1ULL << VIRTIO_BLK_F_MQ |
+	             1ULL << VIRTIO_RING_F_EVENT_IDX),
 
-	.num_vqs = 1,
+	.num_vqs = BLK_NR_QUEUES,
 	.cfg = &blk_cfg,
 	.cfg_d = &blk_cfg_d,
 	.cfg_sz = sizeof(struct virtio_blk_config),
 	.transport_dev = &blk_mmio_dev,
 	.vqs = {
-		{
-			.name = "blk_request",
-			.qnum_max = 64,
-			.srv_fn = blk_request,
-			.vqdev = &blk_vqdev
-		},
+		BLK_VQ("blk_request0"),
+		BLK_VQ("blk_request1"),
+		BLK_VQ("blk_request2"),
+		BLK_VQ("blk_request3"),
+	}
+};
+
+static struct virtio_mmio_dev balloon_mmio_dev = {
+	.poke_guest = virtio_poke_guest,
+};
+
+static struct virtio_balloon_config balloon_cfg;
+static struct virtio_balloon_config balloon_cfg_d;
+
+#define BALLOON_VQ(vq_name) \
+{ \
+	.name = vq_name, \
+	.qnum_max = 64, \
+	.srv_fn = balloon_queue_fn, \
+	.vqdev = &balloon_vqdev \
+}
+
+static struct virtio_vq_dev balloon_vqdev = {
+	.name = "balloon",
+	.dev_id = VIRTIO_ID_BALLOON,
+	.dev_feat = (1ULL << VIRTIO_F_VERSION_1),
+
+	.num_vqs = 2,
+	.cfg = &balloon_cfg,
+	.cfg_d = &balloon_cfg_d,
+	.cfg_sz = sizeof(struct virtio_balloon_config),
+	.transport_dev = &balloon_mmio_dev,
+	.vqs = {
+		[VIRTIO_BALLOON_INFLATEQ] = BALLOON_VQ("balloon_inflateq"),
+		[VIRTIO_BALLOON_DEFLATEQ] = BALLOON_VQ("balloon_deflateq"),
 	}
 };
 
+/* With --snapshot, we save what changed in guest memory this often */
+#define SNAPSHOT_PERIOD_SEC 60
+
+static void *snapshot_fn(void *arg)
+{
+	int fd = (long)arg;
+	ssize_t ret;
+
+	while (1) {
+		uthread_sleep(SNAPSHOT_PERIOD_SEC);
+		ret = vmm_snapshot_save(vm, fd);
+		if (ret < 0) {
+			perror("Guest memory snapshot failed");
+			return 0;
+		}
+		fprintf(stderr, "Saved %ld dirty guest pages\n", ret);
+	}
+}
+
 /* Parse func: given a line of text, it sets any vnet options */
 static void __parse_vnet_opts(char *_line)
 {
@@ -320,21 +396,16 @@ void *inject_timer(void *args)
 	return 0;
 }
 
-/* This handler must never call __set_alarm after interrupting the guest,
- * otherwise the guest could try to write to the timer msrs and cause a
- * race condition. */
-void timer_alarm_handler(struct alarm_waiter *waiter)
+/* The timer's period, per its initial count and divide config, or 0 if it's
+ * not set up. */
+static uint64_t timer_period(struct vmm_gpcore_init *gpci)
 {
 	uint8_t vector;
 	uint32_t initial_count;
 	uint32_t divide_config_reg;
 	uint32_t multiplier;
-	uint32_t timer_mode;
-	struct guest_thread *gth = (struct guest_thread*)waiter->data;
-	struct vmm_gpcore_init *gpci = gth_to_gpci(gth);
 
 	vector = ((uint32_t *)gpci->vapic_addr)[0x32] & 0xff;
-	timer_mode = (((uint32_t *)gpci->vapic_addr)[0x32] >> 17) & 0x03;
 	initial_count = ((uint32_t *)gpci->vapic_addr)[0x38];
 	divide_config_reg = ((uint32_t *)gpci->vapic_addr)[0x3E];
 
@@ -344,9 +415,27 @@ void timer_alarm_handler(struct alarm_waiter *waiter)
 	              (divide_config_reg & 0x03)) + 1;
 	multiplier &= 0x07;
 
-	if (vector && initial_count && timer_mode == 0x01) {
+	if (!vector || !initial_count)
+		return 0;
+	return (uint64_t)initial_count << multiplier;
+}
+
+/* This handler must never call __set_alarm after interrupting the guest,
+ * otherwise the guest could try to write to the timer msrs and cause a
+ * race condition. */
+void timer_alarm_handler(struct alarm_waiter *waiter)
+{
+	uint32_t timer_mode;
+	uint64_t period;
+	struct guest_thread *gth = (struct guest_thread*)waiter->data;
+	struct vmm_gpcore_init *gpci = gth_to_gpci(gth);
+
+	timer_mode = (((uint32_t *)gpci->vapic_addr)[0x32] >> 17) & 0x03;
+	period = timer_period(gpci);
+
+	if (period && timer_mode == 0x01) {
 		/* This is periodic, we reset the alarm */
-		set_awaiter_rel(waiter, initial_count << multiplier);
+		set_awaiter_rel(waiter, period);
 		__set_alarm(waiter);
 	}
 
@@ -372,6 +461,23 @@ void init_timer_alarms(void)
 	}
 }
 
+/* A restored guest's timers were armed in the VMM that saved it.  We don't
+ * know how much of their periods were left, so they get a whole one. */
+static void restart_timer_alarms(void)
+{
+	struct guest_thread *gth;
+	uint64_t period;
+
+	for (int i = 0; i < vm->nr_gpcs; i++) {
+		gth = gpcid_to_gth(vm, i);
+		period = timer_period(gth_to_gpci(gth));
+		if (!period)
+			continue;
+		set_awaiter_rel(gth->user_data, period);
+		set_alarm(gth->user_data);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	int debug = 0;
@@ -402,6 +508,9 @@ int main(int argc, char **argv)
 	char *initrd = NULL;
 	uint64_t initrd_start = 0, initrd_size = 0;
 	uint64_t kernel_max_address;
+	bool use_balloon = FALSE;
+	int snapshot_fd = -1;
+	char *restore_image = NULL;
 
 	static struct option long_options[] = {
 		{"debug",         no_argument,       0, 'd'},
@@ -411,6 +520,7 @@ int main(int argc, char **argv)
 		{"memstart",      required_argument, 0, 'M'},
 		{"cmdline_extra", required_argument, 0, 'c'},
 		{"greedy",        no_argument,       0, 'g'},
+		{"housekeeping",  required_argument, 0, 'H'},
 		{"initrd",        required_argument, 0, 'i'},
 		{"scp",           no_argument,       0, 's'},
 		{"image_file",    required_argument, 0, 'f'},
@@ -418,6 +528,10 @@ int main(int argc, char **argv)
 		{"net",           required_argument, 0, 'n'},
 		{"num_cores",     required_argument, 0, 'N'},
 		{"smbiostable",   required_argument, 0, 't'},
+		{"balloon",       no_argument,       0, 'b'},
+		{"snapshot",      required_argument, 0, 'S'},
+		{"image",         required_argument, 0, 'I'},
+		{"restore",       required_argument, 0, 'r'},
 		{"help",          no_argument,       0, 'h'},
 		{0, 0, 0, 0}
 	};
@@ -443,7 +557,7 @@ int main(int argc, char **argv)
 		fprintf(stderr, "static initializers are broken\n");
 	memsize = GiB;
 
-	while ((c = getopt_long(argc, argv, "dvi:m:M:c:gsf:k:N:n:t:hR:",
+	while ((c = getopt_long(argc, argv, "dvi:m:M:c:gH:sf:k:N:n:t:hR:bS:I:r:",
 				long_options, &option_index)) != -1) {
 		switch (c) {
 		case 'd':
@@ -468,6 +582,13 @@ int main(int argc, char **argv)
 			}
 			is_greedy = TRUE;
 			break;
+		case 'H':	/* greedy: nr vcores for tasks, not guest pcores */
+			vmm_sched_nr_housekeeping = strtol(optarg, 0, 0);
+			if (vmm_sched_nr_housekeeping < 1) {
+				fprintf(stderr, "Need at least one housekeeping vcore\n");
+				exit(1);
+			}
+			break;
 		case 's':	/* scp */
 			parlib_wants_to_be_mcp = FALSE;
 			if (is_greedy) {
@@ -514,6 +635,22 @@ int main(int argc, char **argv)
 		case 'N':
 			num_pcs = strtoull(optarg, 0, 0);
 			break;
+		case 'b':
+			use_balloon = TRUE;
+			break;
+		case 'S':	/* file to append guest memory snapshots to */
+			snapshot_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644);
+			if (snapshot_fd < 0) {
+				fprintf(stderr, "failed to open file: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'I':	/* where VMCALL_SNAPSHOT saves a VM image */
+			vm->image_path = optarg;
+			break;
+		case 'r':	/* VM image to start from, instead of booting */
+			restore_image = optarg;
+			break;
 		case 'h':
 		default:
 			// Sadly, the getopt_long struct does
@@ -535,7 +672,7 @@ int main(int argc, char **argv)
 	}
 	argc -= optind;
 	argv += optind;
-	if (argc < 1) {
+	if (argc < 1 && !restore_image) {
 		fprintf(stderr, "Usage: %s vmimage [-n (no vmcall printf)]\n", argv[0]);
 		exit(1);
 	}
@@ -557,36 +694,44 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	mmap_memory(vm, memstart, memsize);
+	if (restore_image) {
+		/* Instead of loading a kernel, we pick up where the image left off */
+		if (vmm_image_map(vm, restore_image)) {
+			perror("Unable to map VM image");
+			exit(1);
+		}
+	} else {
+		mmap_memory(vm, memstart, memsize);
 
-	entry = load_elf(argv[0], 0, &kernel_max_address, NULL);
-	if (entry == 0) {
-		fprintf(stderr, "Unable to load kernel %s\n", argv[0]);
-		exit(1);
-	}
+		entry = load_elf(argv[0], 0, &kernel_max_address, NULL);
+		if (entry == 0) {
+			fprintf(stderr, "Unable to load kernel %s\n", argv[0]);
+			exit(1);
+		}
 
-	a = setup_biostables(vm, a, smbiostable);
+		a = setup_biostables(vm, a, smbiostable);
 
-	bp = a;
-	a = init_e820map(vm, bp);
+		bp = a;
+		a = init_e820map(vm, bp);
 
-	if (initrd) {
-		initrd_start = ROUNDUP(kernel_max_address, PGSIZE);
-		fprintf(stderr, "kernel_max_address is %#p; Load initrd @ %#p\n",
-		        kernel_max_address, initrd_start);
-		initrd_size = setup_initrd(initrd, (void *)initrd_start,
-		                           memend - initrd_start + 1);
-		if (initrd_size <= 0) {
-			fprintf(stderr, "Unable to load initrd %s\n", initrd);
-			exit(1);
-		}
+		if (initrd) {
+			initrd_start = ROUNDUP(kernel_max_address, PGSIZE);
+			fprintf(stderr, "kernel_max_address is %#p; Load initrd @ %#p\n",
+			        kernel_max_address, initrd_start);
+			initrd_size = setup_initrd(initrd, (void *)initrd_start,
+			                           memend - initrd_start + 1);
+			if (initrd_size <= 0) {
+				fprintf(stderr, "Unable to load initrd %s\n", initrd);
+				exit(1);
+			}
 
-		bp->hdr.ramdisk_image = initrd_start;
-		bp->hdr.ramdisk_size = initrd_size;
-		bp->hdr.root_dev = 0x100;
-		bp->hdr.type_of_loader = 0xff;
-		fprintf(stderr, "Set bp initrd to %p / %p\n",
-		        initrd_start, initrd_size);
+			bp->hdr.ramdisk_image = initrd_start;
+			bp->hdr.ramdisk_size = initrd_size;
+			bp->hdr.root_dev = 0x100;
+			bp->hdr.type_of_loader = 0xff;
+			fprintf(stderr, "Set bp initrd to %p / %p\n",
+			        initrd_start, initrd_size);
+		}
 	}
 
 	/* The MMIO address of the console device is really the address of an
@@ -598,10 +743,17 @@ int main(int argc, char **argv)
 	uintptr_t virtio_mmio_base_addr_hint;
 	uintptr_t virtio_mmio_base_addr;
 
-	virtio_mmio_base_addr_hint =
-	    ROUNDUP((bp->e820_map[bp->e820_entries - 1].addr +
-	             bp->e820_map[bp->e820_entries - 1].size),
-	             PML4_PTE_REACH);
+	/* A restored guest has no bp, but its e820 map ended at the larger of
+	 * guest RAM or the RESERVED hole.  vmm_image_restore() makes sure the
+	 * devices ended up where they were. */
+	if (restore_image)
+		virtio_mmio_base_addr_hint =
+		    ROUNDUP(MAX(vm->maxphys + 1, _4GiB), PML4_PTE_REACH);
+	else
+		virtio_mmio_base_addr_hint =
+		    ROUNDUP((bp->e820_map[bp->e820_entries - 1].addr +
+		             bp->e820_map[bp->e820_entries - 1].size),
+		             PML4_PTE_REACH);
 
 	/* mmap with prot_none so we don't accidentally mmap something else here.
 	 * We give space for 512 devices right now.
@@ -634,36 +786,58 @@ int main(int argc, char **argv)
 		blk_init_fn(&blk_vqdev, disk_image_file);
 	}
 
+	if (use_balloon) {
+		balloon_mmio_dev.addr =
+			virtio_mmio_base_addr + PGSIZE * VIRTIO_MMIO_BALLOON_DEV;
+		balloon_mmio_dev.vqdev = &balloon_vqdev;
+		vm->virtio_mmio_devices[VIRTIO_MMIO_BALLOON_DEV] = &balloon_mmio_dev;
+	}
+
 	set_vnet_opts(net_opts);
 	vnet_init(vm, &net_vqdev);
 	set_vnet_port_fwds(net_opts);
 
-	/* Set the kernel command line parameters */
-	a += 4096;
-	cmdline = a;
-	a += 4096;
-
-	bp->hdr.cmd_line_ptr = (uintptr_t) cmdline;
-
-	len = snprintf(cmdline, 4096, "%s %s", cmdline_default, cmdline_extra);
-
-	cmdlinesz = 4096 - len;
-	cmdlinep = cmdline + len;
-
-	for (int i = 0; i < VIRTIO_MMIO_MAX_NUM_DEV; i++) {
-		if (vm->virtio_mmio_devices[i] == NULL)
-			continue;
-
-		/* Append all the virtio mmio base addresses. */
+	/* A restored guest already booted with its command line */
+	if (!restore_image) {
+		/* Set the kernel command line parameters */
+		a += 4096;
+		cmdline = a;
+		a += 4096;
+
+		bp->hdr.cmd_line_ptr = (uintptr_t) cmdline;
+
+		len = snprintf(cmdline, 4096, "%s %s", cmdline_default, cmdline_extra);
+
+		cmdlinesz = 4096 - len;
+		cmdlinep = cmdline + len;
+
+		for (int i = 0; i < VIRTIO_MMIO_MAX_NUM_DEV; i++) {
+			if (vm->virtio_mmio_devices[i] == NULL)
+				continue;
+
+			/* Append all the virtio mmio base addresses. */
+
+			/* Since the lower number irqs are no longer being used, the irqs
+			 * can now be assigned starting from 0.
+			 */
+			vm->virtio_mmio_devices[i]->irq = i;
+			len = snprintf(cmdlinep, cmdlinesz,
+			               "\n virtio_mmio.device=1K@0x%llx:%lld",
+			               vm->virtio_mmio_devices[i]->addr,
+			               vm->virtio_mmio_devices[i]->irq);
+			if (len >= cmdlinesz) {
+				fprintf(stderr,
+				        "Too many arguments to the linux command line.");
+				exit(1);
+			}
+			cmdlinesz -= len;
+			cmdlinep += len;
+		}
 
-		/* Since the lower number irqs are no longer being used, the irqs
-		 * can now be assigned starting from 0.
-		 */
-		vm->virtio_mmio_devices[i]->irq = i;
+		/* Set maxcpus to the number of cores we're giving the guest. */
 		len = snprintf(cmdlinep, cmdlinesz,
-		               "\n virtio_mmio.device=1K@0x%llx:%lld",
-		               vm->virtio_mmio_devices[i]->addr,
-		               vm->virtio_mmio_devices[i]->irq);
+		               "\n maxcpus=%lld\n possible_cpus=%lld", vm->nr_gpcs,
+		               vm->nr_gpcs);
 		if (len >= cmdlinesz) {
 			fprintf(stderr, "Too many arguments to the linux command line.");
 			exit(1);
@@ -672,23 +846,31 @@ int main(int argc, char **argv)
 		cmdlinep += len;
 	}
 
-	/* Set maxcpus to the number of cores we're giving the guest. */
-	len = snprintf(cmdlinep, cmdlinesz,
-	               "\n maxcpus=%lld\n possible_cpus=%lld", vm->nr_gpcs,
-	               vm->nr_gpcs);
-	if (len >= cmdlinesz) {
-		fprintf(stderr, "Too many arguments to the linux command line.");
-		exit(1);
-	}
-	cmdlinesz -= len;
-	cmdlinep += len;
-
 	ret = vmm_init(vm, gpcis, vmmflags);
 	assert(!ret);
 	free(gpcis);
 
+	/* These run tasks, which need the VMM */
+	if (use_balloon)
+		balloon_init_fn(vm, &balloon_vqdev);
+	if (snapshot_fd >= 0)
+		vmm_run_task(vm, snapshot_fn, (void*)(long)snapshot_fd);
+
 	init_timer_alarms();
 
+	if (restore_image) {
+		if (vmm_image_restore(vm, restore_image)) {
+			perror("Unable to restore VM image");
+			exit(1);
+		}
+		restart_timer_alarms();
+		fprintf(stderr, "Restore guest: cr3 %p rip %p\n",
+		        gpcid_to_vmtf(vm, 0)->tf_cr3, gpcid_to_vmtf(vm, 0)->tf_rip);
+		for (int i = 0; i < vm->up_gpcs; i++)
+			start_guest_thread(gpcid_to_gth(vm, i));
+		uthread_sleep_forever();
+	}
+
 	setup_paging(vm);
 
 	vm_tf = gpcid_to_vmtf(vm, 0);
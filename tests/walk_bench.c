@@ -0,0 +1,135 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Path walk benchmark: builds a deep directory chain (by default in /tmp, which
+ * is usually tmpfs) and has a few threads stat() the file at the bottom over
+ * and over.  Reports stats per second and nsec per component.
+ *
+ * usage: walk_bench [dir] [depth] [nr_threads] [seconds] */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <parlib/parlib.h>
+#include <parlib/vcore.h>
+#include <parlib/timing.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+#define NR_THREADS_MAX	64
+#define WB_PATH_MAX		4096
+
+static char *root = "/tmp";
+static int depth = 16;
+static int nr_threads = 4;
+static int run_secs = 5;
+
+static char path[WB_PATH_MAX];
+static volatile bool done;
+static atomic_t nr_stats;
+
+static void *stat_thread(void *arg)
+{
+	struct stat st;
+	long nr = 0;
+
+	while (!done) {
+		if (stat(path, &st))
+			handle_error("stat");
+		nr++;
+	}
+	atomic_fetch_and_add(&nr_stats, nr);
+	return NULL;
+}
+
+/* Appends a component to path, returning the old length so we can unwind. */
+static size_t path_push(const char *name)
+{
+	size_t len = strlen(path);
+
+	if (len + strlen(name) + 2 > WB_PATH_MAX) {
+		printf("Path too long, try a smaller depth\n");
+		exit(-1);
+	}
+	strcat(path, "/");
+	strcat(path, name);
+	return len;
+}
+
+static void build_tree(void)
+{
+	char name[16];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s", root);
+	for (int i = 0; i < depth; i++) {
+		snprintf(name, sizeof(name), "wb%d", i);
+		path_push(name);
+		if (mkdir(path, 0755))
+			handle_error("mkdir");
+	}
+	path_push("file");
+	fd = open(path, O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+		handle_error("open");
+	close(fd);
+}
+
+static void destroy_tree(void)
+{
+	char *slash;
+
+	if (unlink(path))
+		perror("unlink");
+	for (int i = 0; i < depth; i++) {
+		slash = strrchr(path, '/');
+		*slash = 0;
+		if (rmdir(path))
+			perror("rmdir");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t threads[NR_THREADS_MAX];
+	uint64_t start, end, total;
+
+	if (argc > 1)
+		root = argv[1];
+	if (argc > 2)
+		depth = atoi(argv[2]);
+	if (argc > 3)
+		nr_threads = MIN(atoi(argv[3]), NR_THREADS_MAX);
+	if (argc > 4)
+		run_secs = atoi(argv[4]);
+	if (depth < 1 || nr_threads < 1) {
+		printf("Need at least one directory and one thread\n");
+		exit(-1);
+	}
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), nr_threads));
+	build_tree();
+
+	printf("%d threads stat()ing %s (depth %d) for %d sec\n", nr_threads,
+	       path, depth, run_secs);
+	done = FALSE;
+	start = nsec();
+	for (int i = 0; i < nr_threads; i++)
+		pthread_create(&threads[i], NULL, stat_thread, NULL);
+	uthread_sleep(run_secs);
+	done = TRUE;
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	end = nsec();
+	total = atomic_read(&nr_stats);
+	printf("Stats: %llu, %llu stats/sec, %llu nsec/component per thread\n",
+	       total, total * 1000000000ULL / (end - start),
+	       (end - start) * nr_threads / MAX(total * (depth + 1), 1));
+	destroy_tree();
+	return 0;
+}
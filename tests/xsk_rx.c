@@ -0,0 +1,151 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Counts frames of one ethertype with mapped rings (see ros/xsk.h): sets up a
+ * conversation's rings, keeps the fill ring topped up, and drains the rx ring,
+ * sleeping in epoll when it runs dry.  Reports frames and bytes per second,
+ * and the kernel's drop counts.
+ *
+ * usage: xsk_rx [dev] [type] [seconds]
+ *
+ * e.g. xsk_rx /net/ether0 0x800 5; type -1 means every frame. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <ros/arch/membar.h>
+#include <ros/xsk.h>
+
+#define handle_error(msg) \
+        do { perror(msg); exit(-1); } while (0)
+
+#define XR_NR_FRAMES	4096
+#define XR_FRAME_SIZE	2048
+#define XR_RING_SIZE	1024
+
+static void *xsk_map;
+static struct xsk_hdr *hdr;
+
+static uint64_t *fill_ring(void)
+{
+	return xsk_map + hdr->fill_off;
+}
+
+static struct xsk_desc *rx_ring(void)
+{
+	return xsk_map + hdr->rx_off;
+}
+
+/* Gives the kernel a frame to receive into. */
+static void fill(uint64_t addr)
+{
+	uint32_t prod = hdr->fill.prod;
+
+	fill_ring()[prod & (hdr->ring_size - 1)] = addr;
+	wmb();
+	hdr->fill.prod = prod + 1;
+}
+
+static int open_conv(const char *dev, int type, char *dir, size_t dir_sz)
+{
+	char path[128], buf[32];
+	int ctl, n;
+
+	snprintf(path, sizeof(path), "%s/clone", dev);
+	ctl = open(path, O_RDWR);
+	if (ctl < 0)
+		handle_error("clone");
+	n = read(ctl, buf, sizeof(buf) - 1);
+	if (n <= 0)
+		handle_error("read clone");
+	buf[n] = 0;
+	snprintf(dir, dir_sz, "%s/%d", dev, atoi(buf));
+	n = snprintf(buf, sizeof(buf), "connect %d", type);
+	if (write(ctl, buf, n) != n)
+		handle_error("connect");
+	n = snprintf(buf, sizeof(buf), "xsk %d %d %d", XR_NR_FRAMES,
+	             XR_FRAME_SIZE, XR_RING_SIZE);
+	if (write(ctl, buf, n) != n)
+		handle_error("xsk");
+	return ctl;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dev = argc > 1 ? argv[1] : "/net/ether0";
+	int type = argc > 2 ? strtol(argv[2], 0, 0) : -1;
+	int secs = argc > 3 ? atoi(argv[3]) : 5;
+	char dir[128], path[160];
+	struct epoll_event ep_ev, results[1];
+	uint64_t nr_frames = 0, nr_bytes = 0, t0, end, usec;
+	uint32_t cons, prod;
+	int ctl, xfd, epfd;
+	size_t len;
+
+	ctl = open_conv(dev, type, dir, sizeof(dir));
+	snprintf(path, sizeof(path), "%s/xsk", dir);
+	xfd = open(path, O_RDWR);
+	if (xfd < 0)
+		handle_error("open xsk");
+	/* The header tells us how big the rest is. */
+	hdr = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, xfd, 0);
+	if (hdr == MAP_FAILED)
+		handle_error("mmap xsk hdr");
+	len = hdr->umem_off + (size_t)hdr->nr_frames * hdr->frame_size;
+	munmap(hdr, PGSIZE);
+	xsk_map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	               xfd, 0);
+	if (xsk_map == MAP_FAILED)
+		handle_error("mmap xsk");
+	hdr = xsk_map;
+
+	epfd = epoll_create(1);
+	if (epfd < 0)
+		handle_error("epoll_create");
+	ep_ev.events = EPOLLIN | EPOLLET;
+	ep_ev.data.fd = xfd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, xfd, &ep_ev))
+		handle_error("epoll_ctl");
+
+	for (int i = 0; i < MIN(hdr->nr_frames, hdr->ring_size); i++)
+		fill((uint64_t)i * hdr->frame_size);
+
+	printf("Receiving on %s for %d sec\n", dir, secs);
+	t0 = read_tsc();
+	end = t0 + sec2tsc(secs);
+	cons = hdr->rx.cons;
+	while (read_tsc() < end) {
+		prod = hdr->rx.prod;
+		rmb();
+		if (cons == prod) {
+			/* Edge triggered: check again after we're armed. */
+			epoll_wait(epfd, results, 1, 100);
+			continue;
+		}
+		for (; cons != prod; cons++) {
+			struct xsk_desc *d = &rx_ring()[cons & (hdr->ring_size - 1)];
+
+			nr_frames++;
+			nr_bytes += d->len;
+			fill(d->addr);
+		}
+		hdr->rx.cons = cons;
+	}
+	usec = tsc2usec(read_tsc() - t0);
+	printf("%lu frames, %lu bytes: %lu frames/sec, %lu MB/s\n", nr_frames,
+	       nr_bytes, nr_frames * 1000000 / usec, nr_bytes / usec);
+	printf("kernel: rx %lu, no fill %lu, ring full %lu, bad descs %lu\n",
+	       hdr->rx_packets, hdr->rx_no_fill, hdr->rx_ring_full,
+	       hdr->bad_descs);
+	munmap(xsk_map, len);
+	close(epfd);
+	close(xfd);
+	close(ctl);
+	return 0;
+}
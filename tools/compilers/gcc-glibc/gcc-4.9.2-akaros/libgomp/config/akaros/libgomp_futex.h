@@ -32,6 +32,7 @@
 
 #pragma GCC visibility push(default)
 #include <futex.h>	/* from parlib's pthread library */
+#include <parlib/vcore.h>
 #pragma GCC visibility pop
 
 static inline void
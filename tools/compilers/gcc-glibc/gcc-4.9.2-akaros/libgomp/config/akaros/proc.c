@@ -0,0 +1,78 @@
+/* Copyright (C) 2005-2014 Free Software Foundation, Inc.
+   Contributed by Richard Henderson <rth@redhat.com>.
+
+   This file is part of the GNU OpenMP Library (libgomp).
+
+   Libgomp is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3, or (at your option)
+   any later version.
+
+   Libgomp is distributed in the hope that it will be useful, but WITHOUT ANY
+   WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+   FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+   more details.
+
+   Under Section 7 of GPL version 3, you are granted additional
+   permissions described in the GCC Runtime Library Exception, version
+   3.1, as published by the Free Software Foundation.
+
+   You should have received a copy of the GNU General Public License and
+   a copy of the GCC Runtime Library Exception along with this program;
+   see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+   <http://www.gnu.org/licenses/>.  */
+
+/* This file contains system specific routines related to counting
+   online processors and dynamic load balancing.  On Akaros, the processors
+   we care about are our vcores: max_vcores() is how many we could get, and
+   num_vcores() is how many the kernel has given us right now.  */
+
+#include "libgomp.h"
+#include <stdlib.h>
+
+/* See libgomp_futex.h for why we push default visibility here.  */
+#pragma GCC visibility push(default)
+#include <parlib/vcore.h>
+#pragma GCC visibility pop
+
+/* At startup, determine the default number of threads: one per vcore we
+   could get.  Teams also follow the vcores we actually get (OMP_DYNAMIC),
+   unless the user says otherwise.  Otherwise a team bigger than our grant
+   has threads waiting for each other's vcores at every barrier.  */
+
+void
+gomp_init_num_threads (void)
+{
+  gomp_global_icv.nthreads_var = max_vcores ();
+  if (!getenv ("OMP_DYNAMIC"))
+    gomp_global_icv.dyn_var = true;
+}
+
+/* When OMP_DYNAMIC is set, at thread launch determine the number of
+   threads we should spawn for this team.  We ask for a vcore per thread,
+   and size the team by what the kernel has granted so far.  Until we're an
+   MCP, there's nothing to go on; the first team's pthreads are what make
+   us an MCP, so it gets the full count.  */
+
+unsigned
+gomp_dynamic_max_threads (void)
+{
+  unsigned nthreads_var = gomp_icv (false)->nthreads_var;
+  unsigned granted;
+
+  if (!in_multi_mode ())
+    return nthreads_var;
+  vcore_request_total (nthreads_var);
+  granted = num_vcores ();
+  if (granted >= nthreads_var)
+    return nthreads_var;
+  return granted ? granted : 1;
+}
+
+int
+omp_get_num_procs (void)
+{
+  return max_vcores ();
+}
+
+ialias (omp_get_num_procs)
@@ -37,11 +37,17 @@
 #endif
 #include "libgomp_futex.h"
 
+/* Spin for a while, then block.  A blocked thread's pthread sleeps on the
+   futex, and if its vcore has nothing else to run, the vcore goes back to the
+   kernel.  We compare against the vcores we have now, not the ones we could
+   have: with more threads than granted vcores, a spinner is burning a vcore
+   that the thread it's waiting on could use.  */
+
 static inline void do_wait (int *addr, int val)
 {
   unsigned long long i, count = gomp_spin_count_var;
 
-  if (__builtin_expect (gomp_managed_threads > gomp_available_cpus, 0))
+  if (__builtin_expect (gomp_managed_threads > num_vcores (), 0))
     count = gomp_throttled_spin_count_var;
   for (i = 0; i < count; i++)
     if (__builtin_expect (*addr != val, 0))
@@ -64,6 +64,7 @@
 # define MAP_POPULATE	0x08000		/* Populate (prefault) pagetables.  */
 # define MAP_NONBLOCK	0x10000		/* Do not block on IO.  */
 # define MAP_STACK	0x20000		/* Allocation is for a stack.  */
+# define MAP_HUGEPAGE	0x40000		/* Akaros: try to use jumbo pages.  */
 #endif
 
 /* Flags to `msync'.  */
@@ -97,6 +98,13 @@
 # define MADV_HWPOISON	  100	/* Poison a page for testing.  */
 #endif
 
+/* Akaros: NUMA memory policies, for sys_mbind() and #proc ctl.  */
+#ifdef __USE_MISC
+# define MPOL_DEFAULT	 0	/* Proc's policy, or the faulting core's node.  */
+# define MPOL_BIND	 1	/* Only these nodes.  */
+# define MPOL_INTERLEAVE 2	/* Spread pages across these nodes.  */
+#endif
+
 /* The POSIX people had to invent similar names for the same things.  */
 #ifdef __USE_XOPEN2K
 # define POSIX_MADV_NORMAL	0 /* No further special treatment.  */
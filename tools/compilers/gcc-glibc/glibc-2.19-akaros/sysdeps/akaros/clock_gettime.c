@@ -2,7 +2,8 @@
  * Barret Rhoden <brho@cs.berkeley.edu>
  * See LICENSE for details.
  *
- * Implementation of glibc's clock_gettime
+ * Implementation of glibc's clock_gettime.  All of it is in userspace, from the
+ * TSC and the parameters in procinfo.
  *
  * TODO:
  * - consider supporting more clocks.
@@ -11,13 +12,26 @@
 #include <time.h>
 #include <sys/time.h>
 #include <parlib/timing.h>
+#include <ros/procinfo.h>
 
 int __clock_gettime(clockid_t clk_id, struct timespec *tp)
 {
-	uint64_t epoch_ns = epoch_nsec();
+	uint64_t ns;
 
-	tp->tv_sec = epoch_ns / 1000000000;
-	tp->tv_nsec = epoch_ns % 1000000000;
+	switch (clk_id) {
+	case CLOCK_MONOTONIC:
+	case CLOCK_MONOTONIC_RAW:
+	case CLOCK_MONOTONIC_COARSE:
+		/* Doesn't jump when someone sets the time */
+		ns = __proc_global_info.walltime_ns_boot +
+		     tsc2nsec(read_tsc() - __proc_global_info.tsc_cycles_boot);
+		break;
+	default:
+		ns = epoch_nsec();
+		break;
+	}
+	tp->tv_sec = ns / 1000000000;
+	tp->tv_nsec = ns % 1000000000;
 	return 0;
 }
 weak_alias(__clock_gettime, clock_gettime)
@@ -46,18 +46,40 @@ void subtract_timespecs(struct timespec *diff, const struct timespec *minuend,
 	diff->tv_sec = minuend->tv_sec - subtrahend->tv_sec - (borrow_amt ? 1 : 0);
 }
 
+/* The kernel changes these when someone sets the time.  Reading them is a
+ * seqlock read, without trapping into the kernel. */
+static void read_walltime(uint64_t *walltime, uint64_t *tsc_last)
+{
+	seq_ctr_t seq;
+
+	do {
+		seq = READ_ONCE(__proc_global_info.walltime_seq);
+		*walltime = __proc_global_info.walltime_ns_last;
+		*tsc_last = __proc_global_info.tsc_cycles_last;
+	} while (seqctr_retry(seq, READ_ONCE(__proc_global_info.walltime_seq)));
+}
+
 /* Declared in parlib/timing.h */
 
 uint64_t epoch_nsec_to_tsc(uint64_t epoch_ns)
 {
-	return nsec2tsc(epoch_ns - __proc_global_info.walltime_ns_last) +
-	       __proc_global_info.tsc_cycles_last;
+	uint64_t walltime, tsc_last;
+
+	read_walltime(&walltime, &tsc_last);
+	if (epoch_ns < walltime)
+		return tsc_last - nsec2tsc(walltime - epoch_ns);
+	return tsc_last + nsec2tsc(epoch_ns - walltime);
 }
 
 uint64_t tsc_to_epoch_nsec(uint64_t tsc)
 {
-	return tsc2nsec(tsc - __proc_global_info.tsc_cycles_last) +
-	       __proc_global_info.walltime_ns_last;
+	uint64_t walltime, tsc_last;
+
+	read_walltime(&walltime, &tsc_last);
+	/* The time could have been set after the TSC was read */
+	if (tsc < tsc_last)
+		return walltime - tsc2nsec(tsc_last - tsc);
+	return walltime + tsc2nsec(tsc - tsc_last);
 }
 
 uint64_t epoch_nsec(void)
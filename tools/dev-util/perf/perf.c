@@ -17,14 +17,20 @@
 #include <errno.h>
 #include <argp.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <ros/profiler_records.h>
+#include <ros/arch/membar.h>
 #include <parlib/parlib.h>
 #include <parlib/timing.h>
 #include <parlib/core_set.h>
 #include "xlib.h"
 #include "perfconv.h"
 #include "perf_core.h"
+#include "perf_top.h"
 
 /* Helpers */
+static int start_process(int argc, char *argv[], const struct core_set *cores);
 static void run_process_and_wait(int argc, char *argv[],
 								 const struct core_set *cores);
 
@@ -33,6 +39,7 @@ static struct perf_context_config perf_cfg = {
 	.perf_file = "#arch/perf",
 	.kpctl_file = "#kprof/kpctl",
 	.kpdata_file = "#kprof/kpdata",
+	.kpring_file = "#kprof/kpring",
 };
 
 static struct perfconv_context *cctx;
@@ -49,8 +56,15 @@ struct perf_opts {
 	bool						verbose;
 	bool						sampling;
 	bool						stat_bignum;
+	bool						stat_mem_bw;
+	bool						stat_power;
 	bool						record_quiet;
 	unsigned long				record_period;
+	unsigned long				record_ring_pages;
+	const char					*record_offcpu;
+	unsigned long				top_delay;
+	unsigned long				top_lines;
+	const char					*top_kernel;
 };
 static struct perf_opts opts;
 
@@ -65,6 +79,7 @@ static int perf_help(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_list(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_record(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_stat(struct perf_cmd *cmd, int argc, char *argv[]);
+static int perf_top(struct perf_cmd *cmd, int argc, char *argv[]);
 static int perf_pmu_caps(struct perf_cmd *cmd, int argc, char *argv[]);
 
 static struct perf_cmd perf_cmds[] = {
@@ -88,6 +103,11 @@ static struct perf_cmd perf_cmds[] = {
 	  .opts = 0,
 	  .func = perf_stat,
 	},
+	{ .name = "top",
+	  .desc = "Shows the hottest functions during command execution",
+	  .opts = 0,
+	  .func = perf_top,
+	},
 	{ .name = "pmu_caps",
 	  .desc = "Shows PMU capabilities",
 	  .opts = "",
@@ -163,7 +183,8 @@ static int perf_pmu_caps(struct perf_cmd *cmd, int argc, char *argv[])
  * will collect perf events, e.g. perf record and perf stat. */
 
 static struct argp_option collect_opts[] = {
-	{"event", 'e', "EVENT", 0, "Event string, e.g. cycles:u:k"},
+	{"event", 'e', "EVENT", 0,
+	 "Event string, e.g. cycles:u:k, :P for PEBS, :b for LBRs"},
 	{"cores", 'C', "CORE_LIST", 0, "List of cores, e.g. 0.2.4:8-19"},
 	{"cpu", 'C', 0, OPTION_ALIAS},
 	{"all-cpus", 'a', 0, 0, "Collect events on all cores (on by default)"},
@@ -264,9 +285,147 @@ static struct argp_option record_opts[] = {
 	{"freq", 'F', "FREQUENCY", 0, "Sampling frequency (assumes cycles)"},
 	{"call-graph", 'g', 0, 0, "Backtrace recording (always on!)"},
 	{"quiet", 'q', 0, 0, "No printing to stdio"},
+	{"ring", 'R', "PAGES", 0,
+	 "Stream samples through a ring of PAGES pages per core"},
+	{"off-cpu", 'O', "USEC", 0,
+	 "Also record kernel blocking of at least USEC usec, weighted by time"},
 	{ 0 }
 };
 
+/* perf record -R: the kernel puts samples in per-core rings in kpring, and a
+ * thread copies them out while the command runs. */
+struct ring_reader {
+	char						*map;
+	size_t						map_sz;
+	size_t						area_sz;
+	int							nr_rings;
+	FILE						*samples;
+	pthread_t					thread;
+	volatile bool				done;
+};
+
+static struct prof_ring_header *ring_hdr(struct ring_reader *rr, int i)
+{
+	return (struct prof_ring_header *) (rr->map + i * rr->area_sz);
+}
+
+/* head only moves past whole records, so [tail, head) is a run of complete
+ * records that we can copy out as is. */
+static void ring_drain(struct ring_reader *rr)
+{
+	for (int i = 0; i < rr->nr_rings; i++) {
+		struct prof_ring_header *hdr = ring_hdr(rr, i);
+		char *data = (char *) hdr + hdr->data_offset;
+		uint64_t head = READ_ONCE(hdr->data_head);
+		uint64_t tail = hdr->data_tail;
+		size_t off, len;
+
+		/* Don't read data from before the head we saw */
+		rmb();
+		while (tail != head) {
+			off = tail & (hdr->data_size - 1);
+			len = hdr->data_size - off;
+			if (len > head - tail)
+				len = head - tail;
+			xfwrite(data + off, len, rr->samples);
+			tail += len;
+		}
+		/* Don't let the kernel overwrite the data until we're done with it */
+		mb();
+		WRITE_ONCE(hdr->data_tail, tail);
+	}
+}
+
+static void *ring_reader_thread(void *arg)
+{
+	struct ring_reader *rr = arg;
+
+	while (!rr->done) {
+		ring_drain(rr);
+		usleep(10000);
+	}
+	return NULL;
+}
+
+static void ring_start(struct ring_reader *rr, unsigned long nr_pgs)
+{
+	char cmd[64];
+	struct stat st;
+	int fd;
+
+	snprintf(cmd, sizeof(cmd), "prof_ring %lu", nr_pgs);
+	perf_configure_profiler(pctx, cmd);
+	fd = xopen(perf_cfg.kpring_file, O_RDWR, 0);
+	if (fstat(fd, &st)) {
+		perror("kpring stat");
+		exit(1);
+	}
+	rr->map_sz = st.st_size;
+	rr->map = mmap(NULL, rr->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+	               0);
+	if (rr->map == MAP_FAILED) {
+		perror("kpring mmap");
+		exit(1);
+	}
+	close(fd);
+	rr->area_sz = ring_hdr(rr, 0)->data_offset + ring_hdr(rr, 0)->data_size;
+	rr->nr_rings = rr->map_sz / rr->area_sz;
+	/* Skip whatever an earlier run left behind */
+	for (int i = 0; i < rr->nr_rings; i++)
+		ring_hdr(rr, i)->data_tail = ring_hdr(rr, i)->data_head;
+	rr->samples = tmpfile();
+	if (!rr->samples) {
+		perror("tmpfile");
+		exit(1);
+	}
+	rr->done = FALSE;
+	if (pthread_create(&rr->thread, NULL, ring_reader_thread, rr)) {
+		perror("ring reader thread");
+		exit(1);
+	}
+}
+
+/* Call after sampling stopped.  Returns the lost sample count. */
+static uint64_t ring_stop(struct ring_reader *rr)
+{
+	uint64_t nr_lost = 0;
+
+	rr->done = TRUE;
+	pthread_join(rr->thread, NULL);
+	ring_drain(rr);
+	for (int i = 0; i < rr->nr_rings; i++)
+		nr_lost += ring_hdr(rr, i)->nr_lost;
+	munmap(rr->map, rr->map_sz);
+	perf_configure_profiler(pctx, "prof_ring off");
+	return nr_lost;
+}
+
+/* The mmap and process records are still in kpdata.  perfconv wants them
+ * before the samples that use them. */
+static FILE *ring_merge_kpdata(struct ring_reader *rr)
+{
+	FILE *merged, *kpdata;
+	char buf[4096];
+	size_t amt;
+
+	merged = tmpfile();
+	if (!merged) {
+		perror("tmpfile");
+		exit(1);
+	}
+	kpdata = xfopen(perf_cfg.kpdata_file, "rb");
+	while ((amt = fread(buf, 1, sizeof(buf), kpdata)))
+		xfwrite(buf, amt, merged);
+	fclose(kpdata);
+	rewind(rr->samples);
+	while ((amt = fread(buf, 1, sizeof(buf), rr->samples)))
+		xfwrite(buf, amt, merged);
+	fclose(rr->samples);
+	fflush(merged);
+	rewind(merged);
+	return merged;
+}
+
 /* In lieu of adaptively changing the period to maintain a set freq, we
  * just assume they want cycles and that the TSC is close to that.
  *
@@ -304,6 +463,15 @@ static error_t parse_record_opt(int key, char *arg, struct argp_state *state)
 	case 'q':
 		p_opts->record_quiet = TRUE;
 		break;
+	case 'O':
+		p_opts->record_offcpu = arg;
+		break;
+	case 'R':
+		p_opts->record_ring_pages = atol(arg);
+		if (!p_opts->record_ring_pages ||
+		    (p_opts->record_ring_pages & (p_opts->record_ring_pages - 1)))
+			argp_error(state, "Ring PAGES must be a power of 2");
+		break;
 	case ARGP_KEY_END:
 		if (!p_opts->events)
 			p_opts->events = "cycles";
@@ -322,10 +490,21 @@ static int perf_record(struct perf_cmd *cmd, int argc, char *argv[])
 {
 	struct argp argp_record = {record_opts, parse_record_opt};
 	struct argp_child children[] = { {&argp_record, 0, 0, 0}, {0} };
+	struct ring_reader rr;
+	uint64_t nr_lost;
+	FILE *infile;
+	char offcpu_cmd[64];
 
 	collect_argp(cmd, argc, argv, children, &opts);
 	opts.sampling = TRUE;
 
+	if (opts.record_ring_pages)
+		ring_start(&rr, opts.record_ring_pages);
+	if (opts.record_offcpu) {
+		snprintf(offcpu_cmd, sizeof(offcpu_cmd), "prof_offcpu %s",
+		         opts.record_offcpu);
+		perf_configure_profiler(pctx, offcpu_cmd);
+	}
 	/* Once a perf event is submitted, it'll start counting and firing the IRQ.
 	 * However, we can control whether or not the samples are collected. */
 	submit_events(&opts);
@@ -333,6 +512,13 @@ static int perf_record(struct perf_cmd *cmd, int argc, char *argv[])
 	run_process_and_wait(opts.cmd_argc, opts.cmd_argv,
 	                     opts.got_cores ? &opts.cores : NULL);
 	perf_stop_sampling(pctx);
+	if (opts.record_offcpu)
+		perf_configure_profiler(pctx, "prof_offcpu off");
+	if (opts.record_ring_pages) {
+		nr_lost = ring_stop(&rr);
+		if (nr_lost && !opts.record_quiet)
+			fprintf(stderr, "Lost %lu samples to full rings\n", nr_lost);
+	}
 	if (opts.verbose)
 		perf_context_show_events(pctx, stdout);
 	/* The events are still counting and firing IRQs.  Let's be nice and turn
@@ -340,7 +526,13 @@ static int perf_record(struct perf_cmd *cmd, int argc, char *argv[])
 	perf_stop_events(pctx);
 	/* Generate the Linux perf file format with the traces which have been
 	 * created during this operation. */
-	perf_convert_trace_data(cctx, perf_cfg.kpdata_file, opts.outfile);
+	if (opts.record_ring_pages) {
+		infile = ring_merge_kpdata(&rr);
+		perf_convert_trace_file(cctx, infile, opts.outfile);
+		fclose(infile);
+	} else {
+		perf_convert_trace_data(cctx, perf_cfg.kpdata_file, opts.outfile);
+	}
 	fclose(opts.outfile);
 	return 0;
 }
@@ -350,6 +542,8 @@ static int perf_record(struct perf_cmd *cmd, int argc, char *argv[])
 static struct argp_option stat_opts[] = {
 	{"big-num", 'B', 0, 0, "Formatting option"},
 	{"output", 'o', "FILE", 0, "Print output to file (default stdout)"},
+	{"mem-bw", 'M', 0, 0, "Report memory bandwidth from the uncore IMCs"},
+	{"power", 'P', 0, 0, "Report energy use from RAPL"},
 	{ 0 }
 };
 
@@ -364,6 +558,12 @@ static error_t parse_stat_opt(int key, char *arg, struct argp_state *state)
 	case 'o':
 		p_opts->outfile = xfopen(arg, "w");
 		break;
+	case 'M':
+		p_opts->stat_mem_bw = TRUE;
+		break;
+	case 'P':
+		p_opts->stat_power = TRUE;
+		break;
 	case ARGP_KEY_END:
 		if (!p_opts->events)
 			p_opts->events = "cache-misses,cache-references,"
@@ -460,6 +660,114 @@ static void stat_print_val(FILE *out, struct stat_val *val,
 	}
 }
 
+/* #arch/uncore and #arch/rapl have a line per socket, "socket N name VAL name
+ * VAL...".  We sum each name over the sockets. */
+#define MAX_SOCKET_VALS			8
+
+struct socket_vals {
+	int							nr;
+	char						*names[MAX_SOCKET_VALS];
+	uint64_t					vals[MAX_SOCKET_VALS];
+};
+
+static void read_socket_vals(const char *path, struct socket_vals *sv)
+{
+	char buf[4096];
+	char *name, *val, *tok_save = 0;
+	int fd, i;
+	ssize_t ret;
+
+	fd = xopen(path, O_RDONLY, 0);
+	ret = read(fd, buf, sizeof(buf) - 1);
+	if (ret < 0) {
+		fprintf(stderr, "Unable to read %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+	buf[ret] = 0;
+	for (name = strtok_r(buf, " \n", &tok_save);
+	     name && (val = strtok_r(NULL, " \n", &tok_save));
+	     name = strtok_r(NULL, " \n", &tok_save)) {
+		if (!strcmp(name, "socket"))
+			continue;
+		for (i = 0; i < sv->nr; i++) {
+			if (!strcmp(name, sv->names[i]))
+				break;
+		}
+		if (i == sv->nr) {
+			if (sv->nr == MAX_SOCKET_VALS)
+				continue;
+			sv->names[sv->nr++] = xstrdup(name);
+			sv->vals[i] = 0;
+		}
+		sv->vals[i] += strtoull(val, 0, 0);
+	}
+}
+
+static uint64_t get_socket_val(struct socket_vals *sv, const char *name)
+{
+	for (int i = 0; i < sv->nr; i++) {
+		if (!strcmp(name, sv->names[i]))
+			return sv->vals[i];
+	}
+	return 0;
+}
+
+static void write_uncore_cmd(int fd, const char *cmd)
+{
+	if (write(fd, cmd, strlen(cmd)) < 0) {
+		fprintf(stderr, "Uncore command '%s' failed: %s\n", cmd,
+		        strerror(errno));
+		exit(1);
+	}
+}
+
+/* Counts CAS reads and writes on IMC counters 0 and 1.  Each is a line. */
+static int start_mem_bw(void)
+{
+	int fd = xopen("#arch/uncore", O_RDWR, 0);
+
+	write_uncore_cmd(fd, "imc 0 0x04 0x03");
+	write_uncore_cmd(fd, "imc 1 0x04 0x0c");
+	write_uncore_cmd(fd, "start");
+	return fd;
+}
+
+static void stop_mem_bw(int fd, struct socket_vals *sv)
+{
+	write_uncore_cmd(fd, "stop");
+	read_socket_vals("#arch/uncore", sv);
+	write_uncore_cmd(fd, "imc 0 off");
+	write_uncore_cmd(fd, "imc 1 off");
+	close(fd);
+}
+
+static void print_mem_bw(FILE *out, struct socket_vals *sv, double secs)
+{
+	uint64_t rd = get_socket_val(sv, "imc0") * 64;
+	uint64_t wr = get_socket_val(sv, "imc1") * 64;
+
+	fprintf(out, "%18llu      %-25s #%9.3f MB/sec\n", rd, "imc-read-bytes",
+	        rd / secs / 1000000);
+	fprintf(out, "%18llu      %-25s #%9.3f MB/sec\n", wr, "imc-write-bytes",
+	        wr / secs / 1000000);
+}
+
+static void print_power(FILE *out, struct socket_vals *before,
+                        struct socket_vals *after, double secs)
+{
+	char name[32];
+	double joules;
+
+	for (int i = 0; i < after->nr; i++) {
+		joules = (after->vals[i] - get_socket_val(before, after->names[i]))
+		         / 1000000.0;
+		snprintf(name, sizeof(name), "energy-%s (J)", after->names[i]);
+		fprintf(out, "%18.3f      %-25s #%9.3f W\n", joules, name,
+		        joules / secs);
+	}
+}
+
 static char *cmd_as_str(int argc, char *const argv[])
 {
 	size_t len = 0;
@@ -500,6 +808,9 @@ static int perf_stat(struct perf_cmd *cmd, int argc, char *argv[])
 	FILE *out;
 	struct timespec start, end, diff;
 	struct stat_val *stat_vals;
+	struct socket_vals mem_bw = {0}, rapl_start = {0}, rapl_end = {0};
+	int uncore_fd = -1;
+	double secs;
 	char *cmd_string;
 
 	collect_argp(cmd, argc, argv, children, &opts);
@@ -510,6 +821,10 @@ static int perf_stat(struct perf_cmd *cmd, int argc, char *argv[])
 	 * the setup/teardown of perf events is also tracked.  Each event (including
 	 * the clock measurement) will roughly account for either the start or stop
 	 * of every other event. */
+	if (opts.stat_mem_bw)
+		uncore_fd = start_mem_bw();
+	if (opts.stat_power)
+		read_socket_vals("#arch/rapl", &rapl_start);
 	clock_gettime(CLOCK_REALTIME, &start);
 	submit_events(&opts);
 	run_process_and_wait(opts.cmd_argc, opts.cmd_argv,
@@ -518,11 +833,20 @@ static int perf_stat(struct perf_cmd *cmd, int argc, char *argv[])
 	subtract_timespecs(&diff, &end, &start);
 	stat_vals = collect_stats(pctx, &diff);
 	perf_stop_events(pctx);
+	if (opts.stat_power)
+		read_socket_vals("#arch/rapl", &rapl_end);
+	if (opts.stat_mem_bw)
+		stop_mem_bw(uncore_fd, &mem_bw);
 	cmd_string = cmd_as_str(opts.cmd_argc, opts.cmd_argv);
 	fprintf(out, "\nPerformance counter stats for '%s':\n\n", cmd_string);
 	free(cmd_string);
 	for (int i = 0; i < pctx->event_count; i++)
 		stat_print_val(out, &stat_vals[i], stat_vals, pctx->event_count + 1);
+	secs = get_seconds(stat_vals, pctx->event_count + 1);
+	if (opts.stat_mem_bw)
+		print_mem_bw(out, &mem_bw, secs);
+	if (opts.stat_power)
+		print_power(out, &rapl_start, &rapl_end, secs);
 	fprintf(out, "\n%8llu.%09llu seconds time elapsed\n\n", diff.tv_sec,
 	        diff.tv_nsec);
 	fclose(out);
@@ -530,10 +854,172 @@ static int perf_stat(struct perf_cmd *cmd, int argc, char *argv[])
 	return 0;
 }
 
-static void run_process_and_wait(int argc, char *argv[],
-								 const struct core_set *cores)
+/**************************** perf top  ************************/
+
+static struct argp_option top_opts[] = {
+	{"count", 'c', "PERIOD", 0, "Sampling period"},
+	{"freq", 'F', "FREQUENCY", 0, "Sampling frequency (assumes cycles)"},
+	{"delay", 'd', "SECS", 0, "Refresh every SECS seconds (default 2)"},
+	{"lines", 'n', "LINES", 0, "Show the top LINES functions (default 20)"},
+	{"kernel", 'k', "ELF", 0, "Kernel ELF, for kernel symbols"},
+	{"output", 'o', "FILE", 0, "Print the report to file (default stdout)"},
+	{"quiet", 'q', 0, 0, "Only print the report at the end"},
+	{ 0 }
+};
+
+static error_t parse_top_opt(int key, char *arg, struct argp_state *state)
 {
-	int pid, status;
+	struct perf_opts *p_opts = state->input;
+
+	switch (key) {
+	case 'c':
+		if (p_opts->record_period)
+			argp_error(state, "Period set.  Only use at most one of -c -F");
+		p_opts->record_period = atol(arg);
+		break;
+	case 'F':
+		if (p_opts->record_period)
+			argp_error(state, "Period set.  Only use at most one of -c -F");
+		p_opts->record_period = freq_to_period(atol(arg));
+		break;
+	case 'd':
+		p_opts->top_delay = atol(arg);
+		if (!p_opts->top_delay)
+			argp_error(state, "Delay must be at least 1 second");
+		break;
+	case 'n':
+		p_opts->top_lines = atol(arg);
+		break;
+	case 'k':
+		p_opts->top_kernel = arg;
+		break;
+	case 'o':
+		p_opts->outfile = xfopen(arg, "w");
+		break;
+	case 'q':
+		p_opts->record_quiet = TRUE;
+		break;
+	case ARGP_KEY_END:
+		if (!p_opts->events)
+			p_opts->events = "cycles";
+		if (!p_opts->outfile)
+			p_opts->outfile = stdout;
+		if (!p_opts->record_period)
+			p_opts->record_period = freq_to_period(1000);
+		if (!p_opts->top_delay)
+			p_opts->top_delay = 2;
+		if (!p_opts->top_lines)
+			p_opts->top_lines = 20;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+/* Reads whatever is in kpdata right now.  Flushes put whole blocks of records
+ * in kpdata, so the length is always a run of whole records.  Reading just that
+ * much keeps us from blocking. */
+static void top_read_kpdata(struct perf_top *top, int fd)
+{
+	struct stat st;
+	char *buf;
+	size_t amt = 0;
+	ssize_t ret;
+
+	if (stat(perf_cfg.kpdata_file, &st) || !st.st_size)
+		return;
+	buf = xmalloc(st.st_size);
+	while (amt < st.st_size) {
+		ret = read(fd, buf + amt, st.st_size - amt);
+		if (ret <= 0)
+			break;
+		amt += ret;
+	}
+	perf_top_process(top, buf, amt);
+	free(buf);
+}
+
+/* After sampling has stopped, kpdata is hung up, so we can read until EOF. */
+static void top_drain_kpdata(struct perf_top *top, int fd)
+{
+	FILE *data = xfdopen(fd, "rb");
+	char *buf = NULL;
+	size_t amt = 0, sz = 0, ret;
+
+	do {
+		if (amt == sz) {
+			sz = sz ? sz * 2 : 65536;
+			buf = realloc(buf, sz);
+			if (!buf) {
+				perror("perf top");
+				exit(1);
+			}
+		}
+		ret = fread(buf + amt, 1, sz - amt, data);
+		amt += ret;
+	} while (ret);
+	perf_top_process(top, buf, amt);
+	free(buf);
+	fclose(data);
+}
+
+/* The kernel counts identical traces (prof_aggregate), and every delay we
+ * flush the counts and show the hottest functions of that interval.  When the
+ * command exits, we print the whole run, with each function's hot path. */
+static int perf_top(struct perf_cmd *cmd, int argc, char *argv[])
+{
+	struct argp argp_top = {top_opts, parse_top_opt};
+	struct argp_child children[] = { {&argp_top, 0, 0, 0}, {0} };
+	struct perf_top *top;
+	int pid, status, kpdata_fd;
+	bool done = FALSE;
+
+	collect_argp(cmd, argc, argv, children, &opts);
+	opts.sampling = TRUE;
+
+	if (!opts.top_kernel)
+		fprintf(stderr, "No kernel ELF (-k), kernel PCs will be [unknown]\n");
+	top = perf_top_create(opts.top_kernel);
+	perf_configure_profiler(pctx, "prof_aggregate 4096");
+	kpdata_fd = xopen(perf_cfg.kpdata_file, O_RDONLY, 0);
+	submit_events(&opts);
+	perf_start_sampling(pctx);
+	pid = start_process(opts.cmd_argc, opts.cmd_argv,
+	                    opts.got_cores ? &opts.cores : NULL);
+	while (!done) {
+		for (int i = 0; i < opts.top_delay * 10; i++) {
+			if (waitpid(pid, &status, WNOHANG) == pid) {
+				done = TRUE;
+				break;
+			}
+			usleep(100000);
+		}
+		if (done)
+			break;
+		perf_configure_profiler(pctx, "flush");
+		top_read_kpdata(top, kpdata_fd);
+		if (!opts.record_quiet) {
+			/* Clear the screen */
+			printf("\033[H\033[2J");
+			perf_top_print(top, stdout, opts.top_lines, FALSE);
+		}
+		perf_top_new_interval(top);
+	}
+	perf_stop_sampling(pctx);
+	perf_stop_events(pctx);
+	top_drain_kpdata(top, kpdata_fd);
+	perf_configure_profiler(pctx, "prof_aggregate off");
+	perf_top_print(top, opts.outfile, opts.top_lines, TRUE);
+	if (opts.outfile != stdout)
+		fclose(opts.outfile);
+	return 0;
+}
+
+/* Starts the command, returning its pid. */
+static int start_process(int argc, char *argv[], const struct core_set *cores)
+{
+	int pid;
 
 	pid = create_child_with_stdfds(argv[0], argc, argv, environ);
 	if (pid < 0) {
@@ -551,7 +1037,15 @@ static void run_process_and_wait(int argc, char *argv[],
 		}
 	}
 	sys_proc_run(pid);
-	waitpid(pid, &status, 0);
+	return pid;
+}
+
+static void run_process_and_wait(int argc, char *argv[],
+								 const struct core_set *cores)
+{
+	int status;
+
+	waitpid(start_process(argc, argv, cores), &status, 0);
 }
 
 static void save_cmdline(int argc, char *argv[])
@@ -246,6 +246,12 @@ static void parse_modifiers(const char *str, struct perf_eventsel *sel)
 		case 'i':
 			PMEV_SET_INVCMSK(sel->ev.event, 1);
 			break;
+		case 'P':
+			sel->ev.flags |= PERFMON_PRECISE_EVENT;
+			break;
+		case 'b':
+			sel->ev.flags |= PERFMON_LBR_EVENT;
+			break;
 		case 'c':
 			if (tok[1] != '=') {
 				fprintf(stderr, "Bad cmask tok %s, ignoring\n", tok);
@@ -599,6 +605,13 @@ void perf_stop_sampling(struct perf_context *pctx)
 	xwrite(pctx->kpctl_fd, disable_str, strlen(disable_str));
 }
 
+/* Sends a command, e.g. prof_ring, to the kernel's profiler. */
+void perf_configure_profiler(struct perf_context *pctx, const char *cmd)
+{
+	ensure_kpctl_is_open(pctx);
+	xwrite(pctx->kpctl_fd, cmd, strlen(cmd));
+}
+
 void perf_context_show_events(struct perf_context *pctx, FILE *file)
 {
 	struct perf_eventsel *sel;
@@ -765,13 +778,18 @@ void perf_convert_trace_data(struct perfconv_context *cctx, const char *input,
 							 FILE *outfile)
 {
 	FILE *infile;
-	size_t ksize;
 
 	infile = xfopen(input, "rb");
+	perf_convert_trace_file(cctx, infile, outfile);
+	fclose(infile);
+}
+
+void perf_convert_trace_file(struct perfconv_context *cctx, FILE *infile,
+							 FILE *outfile)
+{
 	if (xfsize(infile) > 0) {
 		perfconv_add_kernel_mmap(cctx);
 		perfconv_add_kernel_buildid(cctx);
 		perfconv_process_input(cctx, infile, outfile);
 	}
-	fclose(infile);
 }
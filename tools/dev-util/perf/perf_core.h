@@ -45,6 +45,7 @@ struct perf_context_config {
 	const char *perf_file;
 	const char *kpctl_file;
 	const char *kpdata_file;
+	const char *kpring_file;
 };
 
 struct perf_context {
@@ -67,11 +68,14 @@ void perf_context_event_submit(struct perf_context *pctx,
 void perf_stop_events(struct perf_context *pctx);
 void perf_start_sampling(struct perf_context *pctx);
 void perf_stop_sampling(struct perf_context *pctx);
+void perf_configure_profiler(struct perf_context *pctx, const char *cmd);
 uint64_t perf_get_event_count(struct perf_context *pctx, unsigned int idx);
 void perf_context_show_events(struct perf_context *pctx, FILE *file);
 void perf_show_events(const char *rx, FILE *file);
 void perf_convert_trace_data(struct perfconv_context *cctx, const char *input,
 							 FILE *outfile);
+void perf_convert_trace_file(struct perfconv_context *cctx, FILE *infile,
+							 FILE *outfile);
 
 static inline const struct perf_arch_info *perf_context_get_arch_info(
 	const struct perf_context *pctx)
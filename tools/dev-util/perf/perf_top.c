@@ -0,0 +1,426 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * perf top's guts.  We read the same record stream as perfconv, usually the
+ * PROFTYPE_TRACE_AGG64 counts from prof_aggregate, and charge each sample to
+ * the function its PC is in.
+ *
+ * Kernel PCs are looked up in the kernel's ELF, if we were given one.  User PCs
+ * are looked up in whatever the process had mmapped there, from the
+ * PROFTYPE_PID_MMAP64 records.  Each ELF's function symbols are loaded once and
+ * sorted by address.  A symbol has its own struct top_func, so once we find the
+ * symbol, we have the counters.
+ *
+ * Every function also keeps its hottest few caller chains (hot paths), a few
+ * frames deep, for the report at the end. */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gelf.h>
+#include <libelf.h>
+#include <ros/common.h>
+#include <ros/profiler_records.h>
+#include "xlib.h"
+#include "perf_top.h"
+
+#define TOP_PATH_DEPTH			4
+#define TOP_NR_PATHS			8
+
+struct top_func;
+
+struct top_path {
+	struct top_func				*callers[TOP_PATH_DEPTH];
+	int							depth;
+	uint64_t					count;
+};
+
+struct top_func {
+	const char					*dso;
+	const char					*name;
+	uint64_t					count;	/* this interval */
+	uint64_t					total;
+	bool						listed;
+	int							nr_paths;
+	struct top_path				*paths;	/* alloced on the first sample */
+};
+
+struct top_sym {
+	uint64_t					addr;
+	uint64_t					size;
+	struct top_func				func;
+};
+
+struct top_symtab {
+	struct top_symtab			*next;
+	char						*path;
+	bool						is_dyn;
+	struct top_sym				*syms;
+	size_t						nr_syms;
+	/* PCs that aren't in any symbol */
+	struct top_func				unknown;
+};
+
+struct top_map {
+	struct top_map				*next;
+	uint32_t					pid;
+	uint64_t					addr;
+	uint64_t					size;
+	uint64_t					offset;
+	struct top_symtab			*symtab;
+};
+
+struct perf_top {
+	struct top_symtab			*kernel;
+	struct top_symtab			*symtabs;
+	struct top_map				*maps;
+	/* User PCs that aren't in any mmap */
+	struct top_func				unknown;
+	struct top_func				**funcs;
+	size_t						nr_funcs;
+	size_t						max_funcs;
+	uint64_t					count;
+	uint64_t					total;
+};
+
+static int sym_cmp(const void *a, const void *b)
+{
+	const struct top_sym *sa = a, *sb = b;
+
+	if (sa->addr < sb->addr)
+		return -1;
+	return sa->addr > sb->addr;
+}
+
+/* Loads path's function symbols, preferring the full symtab to the dynamic
+ * one.  If we can't read it, every PC in it will be [unknown]. */
+static void symtab_load_elf(struct top_symtab *st)
+{
+	Elf *elf;
+	Elf_Scn *scn = NULL, *sym_scn = NULL;
+	Elf_Data *data;
+	GElf_Ehdr ehdr;
+	GElf_Shdr shdr, sym_shdr;
+	GElf_Sym sym;
+	struct top_sym *ts;
+	const char *name;
+	size_t nr;
+	int fd;
+
+	fd = open(st->path, O_RDONLY);
+	if (fd < 0)
+		return;
+	elf = elf_begin(fd, ELF_C_READ, NULL);
+	if (!elf)
+		goto out_close;
+	if (!gelf_getehdr(elf, &ehdr))
+		goto out_end;
+	st->is_dyn = ehdr.e_type == ET_DYN;
+	while ((scn = elf_nextscn(elf, scn))) {
+		if (!gelf_getshdr(scn, &shdr))
+			continue;
+		if (shdr.sh_type == SHT_SYMTAB ||
+		    (shdr.sh_type == SHT_DYNSYM && !sym_scn)) {
+			sym_scn = scn;
+			sym_shdr = shdr;
+		}
+	}
+	if (!sym_scn || !sym_shdr.sh_entsize)
+		goto out_end;
+	data = elf_getdata(sym_scn, NULL);
+	if (!data)
+		goto out_end;
+	nr = sym_shdr.sh_size / sym_shdr.sh_entsize;
+	st->syms = xzmalloc(nr * sizeof(struct top_sym));
+	for (size_t i = 0; i < nr; i++) {
+		if (!gelf_getsym(data, i, &sym))
+			continue;
+		if (GELF_ST_TYPE(sym.st_info) != STT_FUNC || !sym.st_value)
+			continue;
+		name = elf_strptr(elf, sym_shdr.sh_link, sym.st_name);
+		if (!name)
+			continue;
+		ts = &st->syms[st->nr_syms++];
+		ts->addr = sym.st_value;
+		ts->size = sym.st_size;
+		ts->func.name = xstrdup(name);
+	}
+	qsort(st->syms, st->nr_syms, sizeof(struct top_sym), sym_cmp);
+	/* The funcs point back at the dso's name, so do this after sorting. */
+	for (size_t i = 0; i < st->nr_syms; i++)
+		st->syms[i].func.dso = st->unknown.dso;
+out_end:
+	elf_end(elf);
+out_close:
+	close(fd);
+}
+
+static struct top_symtab *symtab_create(const char *path, const char *dso)
+{
+	struct top_symtab *st = xzmalloc(sizeof(struct top_symtab));
+	const char *slash;
+
+	st->path = xstrdup(path);
+	if (!dso) {
+		slash = strrchr(path, '/');
+		dso = slash ? slash + 1 : path;
+	}
+	st->unknown.dso = xstrdup(dso);
+	st->unknown.name = "[unknown]";
+	symtab_load_elf(st);
+	return st;
+}
+
+static struct top_symtab *symtab_get(struct perf_top *top, const char *path)
+{
+	struct top_symtab *st;
+
+	for (st = top->symtabs; st; st = st->next) {
+		if (!strcmp(st->path, path))
+			return st;
+	}
+	st = symtab_create(path, NULL);
+	st->next = top->symtabs;
+	top->symtabs = st;
+	return st;
+}
+
+/* Returns the function addr is in.  addr is relative to the ELF's vaddrs. */
+static struct top_func *symtab_lookup(struct top_symtab *st, uint64_t addr)
+{
+	size_t lo = 0, hi = st->nr_syms;
+	struct top_sym *ts;
+
+	/* Find the last symbol at or below addr */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (st->syms[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return &st->unknown;
+	ts = &st->syms[lo - 1];
+	if (ts->size && addr >= ts->addr + ts->size)
+		return &st->unknown;
+	return &ts->func;
+}
+
+struct perf_top *perf_top_create(const char *kernel_path)
+{
+	struct perf_top *top = xzmalloc(sizeof(struct perf_top));
+
+	elf_version(EV_CURRENT);
+	top->kernel = symtab_create(kernel_path ? kernel_path : "",
+	                            "[kernel]");
+	top->unknown.dso = "[user]";
+	top->unknown.name = "[unknown]";
+	return top;
+}
+
+static void add_map(struct perf_top *top,
+                    const struct proftype_pid_mmap64 *rec)
+{
+	struct top_map *map = xzmalloc(sizeof(struct top_map));
+
+	map->pid = rec->pid;
+	map->addr = rec->addr;
+	map->size = rec->size;
+	map->offset = rec->offset;
+	map->symtab = symtab_get(top, (const char *) rec->path);
+	map->next = top->maps;
+	top->maps = map;
+}
+
+/* We assume shared objects have their first segment at vaddr 0, file offset 0,
+ * which is how the linker lays them out. */
+static struct top_func *lookup_pc(struct perf_top *top, uint32_t pid,
+                                  bool user, uint64_t pc)
+{
+	struct top_map *map;
+
+	if (!user)
+		return symtab_lookup(top->kernel, pc);
+	for (map = top->maps; map; map = map->next) {
+		if (map->pid != pid || pc < map->addr || pc >= map->addr + map->size)
+			continue;
+		if (map->symtab->is_dyn)
+			pc = pc - map->addr + map->offset;
+		return symtab_lookup(map->symtab, pc);
+	}
+	return &top->unknown;
+}
+
+static void charge_path(struct top_func *func, struct top_func **callers,
+                        int depth, uint64_t count)
+{
+	struct top_path *path;
+
+	if (!func->paths)
+		func->paths = xzmalloc(TOP_NR_PATHS * sizeof(struct top_path));
+	for (int i = 0; i < func->nr_paths; i++) {
+		path = &func->paths[i];
+		if (path->depth == depth &&
+		    !memcmp(path->callers, callers, depth * sizeof(callers[0]))) {
+			path->count += count;
+			return;
+		}
+	}
+	/* Once we're full, new paths only count towards the function. */
+	if (func->nr_paths == TOP_NR_PATHS)
+		return;
+	path = &func->paths[func->nr_paths++];
+	memcpy(path->callers, callers, depth * sizeof(callers[0]));
+	path->depth = depth;
+	path->count = count;
+}
+
+/* Charges count samples to trace[0]'s function.  The other PCs are return
+ * addresses, so we look up the byte before them to find the call. */
+static void charge_trace(struct perf_top *top, uint32_t pid, bool user,
+                         const uint64_t *trace, size_t nr, uint64_t count)
+{
+	struct top_func *func, *callers[TOP_PATH_DEPTH];
+	int depth = 0;
+
+	if (!nr)
+		return;
+	func = lookup_pc(top, pid, user, trace[0]);
+	for (size_t i = 1; i < nr && depth < TOP_PATH_DEPTH; i++)
+		callers[depth++] = lookup_pc(top, pid, user, trace[i] - 1);
+	if (!func->listed) {
+		if (top->nr_funcs == top->max_funcs) {
+			top->max_funcs = top->max_funcs ? top->max_funcs * 2 : 256;
+			top->funcs = realloc(top->funcs,
+			                     top->max_funcs * sizeof(struct top_func *));
+			if (!top->funcs) {
+				perror("perf top");
+				exit(1);
+			}
+		}
+		top->funcs[top->nr_funcs++] = func;
+		func->listed = TRUE;
+	}
+	func->count += count;
+	func->total += count;
+	top->count += count;
+	top->total += count;
+	charge_path(func, callers, depth, count);
+}
+
+void perf_top_process(struct perf_top *top, const char *data, size_t size)
+{
+	const char *end = data + size;
+	uint64_t type, rec_size;
+
+	while (data < end) {
+		data = vb_decode_uint64(data, &type);
+		if (data >= end)
+			break;
+		data = vb_decode_uint64(data, &rec_size);
+		if (data + rec_size > end)
+			break;
+		switch (type) {
+		case PROFTYPE_KERN_TRACE64: {
+			const struct proftype_kern_trace64 *rec = (const void *) data;
+
+			charge_trace(top, rec->pid, FALSE, rec->trace, rec->num_traces,
+			             1);
+			break;
+		}
+		case PROFTYPE_USER_TRACE64: {
+			const struct proftype_user_trace64 *rec = (const void *) data;
+
+			charge_trace(top, rec->pid, TRUE, rec->trace, rec->num_traces, 1);
+			break;
+		}
+		case PROFTYPE_TRACE_AGG64: {
+			const struct proftype_trace_agg64 *rec = (const void *) data;
+
+			charge_trace(top, rec->pid, rec->user, rec->trace,
+			             rec->num_traces, rec->count);
+			break;
+		}
+		case PROFTYPE_PID_MMAP64:
+			add_map(top, (const struct proftype_pid_mmap64 *) data);
+			break;
+		}
+		data += rec_size;
+	}
+}
+
+static int func_cmp_count(const void *a, const void *b)
+{
+	const struct top_func *fa = *(struct top_func **) a;
+	const struct top_func *fb = *(struct top_func **) b;
+
+	if (fa->count > fb->count)
+		return -1;
+	return fa->count < fb->count;
+}
+
+static int func_cmp_total(const void *a, const void *b)
+{
+	const struct top_func *fa = *(struct top_func **) a;
+	const struct top_func *fb = *(struct top_func **) b;
+
+	if (fa->total > fb->total)
+		return -1;
+	return fa->total < fb->total;
+}
+
+static void print_hot_path(FILE *out, struct top_func *func)
+{
+	struct top_path *best = NULL;
+
+	for (int i = 0; i < func->nr_paths; i++) {
+		if (!best || func->paths[i].count > best->count)
+			best = &func->paths[i];
+	}
+	if (!best || !best->depth)
+		return;
+	fprintf(out, "%28s%5.1f%% via", "", best->count * 100.0 / func->total);
+	for (int i = 0; i < best->depth; i++)
+		fprintf(out, "%s%s", i ? " <- " : " ", best->callers[i]->name);
+	fprintf(out, "\n");
+}
+
+/* Prints the top nr_lines functions.  The report is for the whole run, with
+ * each function's hottest caller chain; otherwise it's just this interval. */
+void perf_top_print(struct perf_top *top, FILE *out, size_t nr_lines,
+                    bool report)
+{
+	uint64_t all = report ? top->total : top->count;
+	struct top_func *func;
+	uint64_t count;
+
+	qsort(top->funcs, top->nr_funcs, sizeof(struct top_func *),
+	      report ? func_cmp_total : func_cmp_count);
+	fprintf(out, "%s: %lu samples\n\n", report ? "Total" : "Interval", all);
+	fprintf(out, "%8s %10s  %-16s %s\n", "Overhead", "Samples", "DSO",
+	        "Symbol");
+	for (size_t i = 0; i < min(nr_lines, top->nr_funcs); i++) {
+		func = top->funcs[i];
+		count = report ? func->total : func->count;
+		if (!count)
+			break;
+		fprintf(out, "%7.2f%% %10lu  %-16.16s %s\n", count * 100.0 / all,
+		        count, func->dso, func->name);
+		if (report)
+			print_hot_path(out, func);
+	}
+	fflush(out);
+}
+
+void perf_top_new_interval(struct perf_top *top)
+{
+	for (size_t i = 0; i < top->nr_funcs; i++)
+		top->funcs[i]->count = 0;
+	top->count = 0;
+}
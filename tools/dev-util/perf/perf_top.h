@@ -0,0 +1,20 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * perf top: symbolizes kprof records on the box, instead of converting them for
+ * Linux perf. */
+
+#pragma once
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct perf_top;
+
+struct perf_top *perf_top_create(const char *kernel_path);
+void perf_top_process(struct perf_top *top, const char *data, size_t size);
+void perf_top_print(struct perf_top *top, FILE *out, size_t nr_lines,
+                    bool report);
+void perf_top_new_interval(struct perf_top *top);
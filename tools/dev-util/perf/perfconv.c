@@ -586,6 +586,36 @@ static uint64_t perfconv_get_event_id(struct perfconv_context *cctx,
 	return raw_info;
 }
 
+/* Off-CPU samples aren't from a perf event, so they get their own attr.  Event
+ * IDs are eventsel pointers, which are never 1. */
+#define PERFCONV_OFFCPU_ID		1
+
+static uint64_t perfconv_get_offcpu_id(struct perfconv_context *cctx)
+{
+	struct perf_event_attr attr;
+
+	if (cctx->offcpu_attr_emitted)
+		return PERFCONV_OFFCPU_ID;
+	ZERO_DATA(attr);
+	attr.size = sizeof(attr);
+	attr.mmap = 1;
+	attr.comm = 1;
+	attr.sample_period = 1;
+	/* Closely coupled with struct perf_record_sample_period */
+	attr.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID | PERF_SAMPLE_TIME |
+	                   PERF_SAMPLE_ADDR | PERF_SAMPLE_IDENTIFIER |
+	                   PERF_SAMPLE_CPU | PERF_SAMPLE_PERIOD |
+	                   PERF_SAMPLE_CALLCHAIN;
+	attr.exclude_guest = 1;
+	attr.exclude_hv = 1;
+	attr.exclude_user = 1;
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+	emit_attr(&cctx->attrs, &cctx->attr_ids, &attr, PERFCONV_OFFCPU_ID);
+	cctx->offcpu_attr_emitted = TRUE;
+	return PERFCONV_OFFCPU_ID;
+}
+
 static void emit_static_mmaps(struct perfconv_context *cctx)
 {
 	struct static_mmap64 *mm;
@@ -712,6 +742,78 @@ static void emit_user_trace64(struct perf_record *pr,
 	free(xrec);
 }
 
+/* perf has no notion of a sample's weight here, so we emit the trace once per
+ * count. */
+static void emit_trace_agg64(struct perf_record *pr,
+							 struct perfconv_context *cctx)
+{
+	struct proftype_trace_agg64 *rec = (struct proftype_trace_agg64 *)
+		pr->data;
+	size_t size = sizeof(struct perf_record_sample) +
+		(rec->num_traces - 1) * sizeof(uint64_t);
+	struct perf_record_sample *xrec = xzmalloc(size);
+
+	xrec->header.type = PERF_RECORD_SAMPLE;
+	xrec->header.misc = rec->user ? PERF_RECORD_MISC_USER :
+		PERF_RECORD_MISC_KERNEL;
+	xrec->header.size = size;
+	xrec->ip = rec->trace[0];
+	if (rec->pid == -1) {
+		xrec->pid = -1;
+		xrec->tid = 0;
+	} else {
+		xrec->pid = rec->pid;
+		xrec->tid = rec->pid;
+	}
+	xrec->time = rec->tstamp;
+	xrec->addr = rec->trace[0];
+	xrec->identifier = perfconv_get_event_id(cctx, rec->info);
+	xrec->cpu = rec->cpu;
+	xrec->nr = rec->num_traces - 1;
+	memcpy(xrec->ips, rec->trace + 1, (rec->num_traces - 1) * sizeof(uint64_t));
+
+	for (uint64_t i = 0; i < rec->count; i++)
+		mem_file_write(&cctx->data, xrec, size, 0);
+
+	free(xrec);
+}
+
+/* One sample per sleep, with the nsec it was blocked as the period. */
+static void emit_offcpu64(struct perf_record *pr,
+						  struct perfconv_context *cctx)
+{
+	struct proftype_offcpu64 *rec = (struct proftype_offcpu64 *) pr->data;
+	size_t size = sizeof(struct perf_record_sample_period) +
+		(rec->num_traces - 1) * sizeof(uint64_t);
+	struct perf_record_sample_period *xrec;
+
+	if (!rec->num_traces)
+		return;
+	xrec = xzmalloc(size);
+	xrec->header.type = PERF_RECORD_SAMPLE;
+	xrec->header.misc = PERF_RECORD_MISC_KERNEL;
+	xrec->header.size = size;
+	xrec->ip = rec->trace[0];
+	if (rec->pid == -1) {
+		xrec->pid = -1;
+		xrec->tid = 0;
+	} else {
+		xrec->pid = rec->pid;
+		xrec->tid = rec->pid;
+	}
+	xrec->time = rec->tstamp;
+	xrec->addr = rec->trace[0];
+	xrec->identifier = perfconv_get_offcpu_id(cctx);
+	xrec->cpu = rec->cpu;
+	xrec->period = rec->blocked;
+	xrec->nr = rec->num_traces - 1;
+	memcpy(xrec->ips, rec->trace + 1, (rec->num_traces - 1) * sizeof(uint64_t));
+
+	mem_file_write(&cctx->data, xrec, size, 0);
+
+	free(xrec);
+}
+
 static void emit_new_process(struct perf_record *pr,
 							 struct perfconv_context *cctx)
 {
@@ -780,6 +882,16 @@ void perfconv_process_input(struct perfconv_context *cctx, FILE *input,
 		case PROFTYPE_NEW_PROCESS:
 			emit_new_process(&pr, cctx);
 			break;
+		case PROFTYPE_TRACE_AGG64:
+			emit_trace_agg64(&pr, cctx);
+			break;
+		case PROFTYPE_OFFCPU64:
+			emit_offcpu64(&pr, cctx);
+			break;
+		case PROFTYPE_BRANCH_STACK64:
+			/* perf wants branch stacks in every sample (sample_type), which
+			 * we don't do yet.  They're still in the raw kpdata. */
+			break;
 		default:
 			fprintf(stderr, "Unknown record: type=%lu size=%lu\n", pr.type,
 					pr.size);
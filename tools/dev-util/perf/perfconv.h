@@ -65,6 +65,7 @@ struct perfconv_context {
 	struct perf_header ph;
 	struct perf_headers hdrs;
 	struct mem_file fhdrs, attr_ids, attrs, data, event_types;
+	bool offcpu_attr_emitted;
 };
 
 extern char *cmd_line_save;
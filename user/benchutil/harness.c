@@ -0,0 +1,246 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Benchmark harness.  See benchutil/harness.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <parlib/timing.h>
+#include <benchutil/harness.h>
+
+#define MAX_DOTS_PER_ROW		45
+
+void bench_hist_init(struct bench_hist *h)
+{
+	memset(h, 0, sizeof(struct bench_hist));
+	h->min = UINT64_MAX;
+}
+
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src)
+{
+	for (int i = 0; i < BENCH_HIST_NR_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	dst->min = MIN(dst->min, src->min);
+	dst->max = MAX(dst->max, src->max);
+}
+
+/* The smallest value in bucket b. */
+static uint64_t bucket_min(unsigned int b)
+{
+	unsigned int msb;
+
+	if (b < BENCH_HIST_NR_SUB)
+		return b;
+	msb = b / BENCH_HIST_NR_SUB + BENCH_HIST_SUB_BITS - 1;
+	return (uint64_t)(BENCH_HIST_NR_SUB + b % BENCH_HIST_NR_SUB)
+	       << (msb - BENCH_HIST_SUB_BITS);
+}
+
+static uint64_t bucket_max(unsigned int b)
+{
+	if (b == BENCH_HIST_NR_BUCKETS - 1)
+		return UINT64_MAX;
+	return bucket_min(b + 1) - 1;
+}
+
+uint64_t bench_hist_percentile(const struct bench_hist *h, double pct)
+{
+	uint64_t want = h->count * pct / 100.0;
+	uint64_t sum = 0;
+
+	if (!h->count)
+		return 0;
+	want = MAX(want, 1);
+	for (int b = 0; b < BENCH_HIST_NR_BUCKETS; b++) {
+		sum += h->buckets[b];
+		/* The bucket's bound can be past the largest sample. */
+		if (sum >= want)
+			return MIN(bucket_max(b), h->max);
+	}
+	return h->max;
+}
+
+uint64_t bench_hist_mean(const struct bench_hist *h)
+{
+	return h->count ? h->sum / h->count : 0;
+}
+
+void bench_hist_print(FILE *f, const struct bench_hist *h, bool tsc)
+{
+	uint64_t most = 1, lo, hi;
+	int nr_dots;
+
+	for (int b = 0; b < BENCH_HIST_NR_BUCKETS; b++)
+		most = MAX(most, h->buckets[b]);
+	for (int b = 0; b < BENCH_HIST_NR_BUCKETS; b++) {
+		if (!h->buckets[b])
+			continue;
+		lo = MAX(bucket_min(b), h->min);
+		hi = MIN(bucket_max(b), h->max);
+		if (tsc) {
+			lo = tsc2nsec(lo);
+			hi = tsc2nsec(hi);
+		}
+		fprintf(f, "    [%10lu - %10lu] %9lu: ", lo, hi, h->buckets[b]);
+		nr_dots = h->buckets[b] * MAX_DOTS_PER_ROW / most;
+		for (int i = 0; i < nr_dots; i++)
+			fputc('*', f);
+		fputc('\n', f);
+	}
+}
+
+struct bench_thread {
+	pthread_t					thread;
+	unsigned int				tid;
+	const struct bench_opts		*opts;
+	bench_op_t					op;
+	void						*arg;
+	pthread_barrier_t			*barrier;
+	uint64_t					start;
+	uint64_t					end;
+	/* Each thread's hist is its own allocation, away from everyone else. */
+	struct bench_hist			*hist;
+} __attribute__((aligned(64)));
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *bt = arg;
+	const struct bench_opts *opts = bt->opts;
+	uint64_t batch = MAX(opts->batch, 1);
+	uint64_t nr, t0, t1;
+
+	for (uint64_t i = 0; i < opts->warmup_iters; i += nr) {
+		nr = MIN(batch, opts->warmup_iters - i);
+		bt->op(bt->arg, bt->tid, nr);
+	}
+	if (bt->barrier)
+		pthread_barrier_wait(bt->barrier);
+	bt->start = read_tsc();
+	for (uint64_t i = 0; i < opts->iters; i += nr) {
+		nr = MIN(batch, opts->iters - i);
+		t0 = read_tsc();
+		bt->op(bt->arg, bt->tid, nr);
+		t1 = read_tsc();
+		bench_hist_record(bt->hist, (t1 - t0) / nr);
+	}
+	bt->end = read_tsc();
+	return NULL;
+}
+
+void bench_run(const char *name, const struct bench_opts *opts, bench_op_t op,
+               void *arg, struct bench_result *res)
+{
+	unsigned int nr_threads = MAX(opts->nr_threads, 1);
+	struct bench_thread *bts;
+	pthread_barrier_t barrier;
+	uint64_t start = UINT64_MAX, end = 0;
+
+	bts = calloc(nr_threads, sizeof(struct bench_thread));
+	if (!bts) {
+		perror("bench_run");
+		exit(-1);
+	}
+	if (nr_threads > 1)
+		pthread_barrier_init(&barrier, NULL, nr_threads);
+	for (int i = 0; i < nr_threads; i++) {
+		bts[i].tid = i;
+		bts[i].opts = opts;
+		bts[i].op = op;
+		bts[i].arg = arg;
+		bts[i].barrier = nr_threads > 1 ? &barrier : NULL;
+		bts[i].hist = malloc(sizeof(struct bench_hist));
+		if (!bts[i].hist) {
+			perror("bench_run");
+			exit(-1);
+		}
+		bench_hist_init(bts[i].hist);
+	}
+	if (nr_threads == 1) {
+		bench_thread(&bts[0]);
+	} else {
+		for (int i = 0; i < nr_threads; i++)
+			pthread_create(&bts[i].thread, NULL, bench_thread, &bts[i]);
+		for (int i = 0; i < nr_threads; i++)
+			pthread_join(bts[i].thread, NULL);
+		pthread_barrier_destroy(&barrier);
+	}
+	res->name = name;
+	res->nr_threads = nr_threads;
+	res->nr_ops = (uint64_t)nr_threads * opts->iters;
+	bench_hist_init(&res->hist);
+	for (int i = 0; i < nr_threads; i++) {
+		start = MIN(start, bts[i].start);
+		end = MAX(end, bts[i].end);
+		bench_hist_merge(&res->hist, bts[i].hist);
+		free(bts[i].hist);
+	}
+	res->elapsed_tsc = end - start;
+	free(bts);
+}
+
+int bench_parse_fmt(const char *str, enum bench_fmt *fmt)
+{
+	if (!strcmp(str, "text"))
+		*fmt = BENCH_FMT_TEXT;
+	else if (!strcmp(str, "csv"))
+		*fmt = BENCH_FMT_CSV;
+	else if (!strcmp(str, "json"))
+		*fmt = BENCH_FMT_JSON;
+	else
+		return -1;
+	return 0;
+}
+
+void bench_report_header(FILE *f, enum bench_fmt fmt)
+{
+	if (fmt != BENCH_FMT_CSV)
+		return;
+	fprintf(f, "name,threads,ops,elapsed_ns,ops_per_sec,mean_ns,min_ns,"
+	        "p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+}
+
+void bench_report(FILE *f, enum bench_fmt fmt, const struct bench_result *res)
+{
+	const struct bench_hist *h = &res->hist;
+	uint64_t elapsed_ns = tsc2nsec(res->elapsed_tsc);
+	uint64_t ops_per_sec = 0;
+	uint64_t mean, min, p50, p90, p99, p999, max;
+
+	if (elapsed_ns)
+		ops_per_sec = (double)res->nr_ops * 1000000000.0 / elapsed_ns;
+	mean = tsc2nsec(bench_hist_mean(h));
+	min = h->count ? tsc2nsec(h->min) : 0;
+	p50 = tsc2nsec(bench_hist_percentile(h, 50.0));
+	p90 = tsc2nsec(bench_hist_percentile(h, 90.0));
+	p99 = tsc2nsec(bench_hist_percentile(h, 99.0));
+	p999 = tsc2nsec(bench_hist_percentile(h, 99.9));
+	max = tsc2nsec(h->max);
+	switch (fmt) {
+	case BENCH_FMT_TEXT:
+		fprintf(f, "%s: %u threads, %lu ops in %lu usec, %lu ops/sec\n",
+		        res->name, res->nr_threads, res->nr_ops, elapsed_ns / 1000,
+		        ops_per_sec);
+		fprintf(f, "\tnsec per op: mean %lu, min %lu, p50 %lu, p90 %lu, "
+		        "p99 %lu, p99.9 %lu, max %lu\n", mean, min, p50, p90, p99,
+		        p999, max);
+		break;
+	case BENCH_FMT_CSV:
+		fprintf(f, "%s,%u,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+		        res->name, res->nr_threads, res->nr_ops, elapsed_ns,
+		        ops_per_sec, mean, min, p50, p90, p99, p999, max);
+		break;
+	case BENCH_FMT_JSON:
+		fprintf(f, "{\"name\": \"%s\", \"threads\": %u, \"ops\": %lu, "
+		        "\"elapsed_ns\": %lu, \"ops_per_sec\": %lu, \"mean_ns\": %lu, "
+		        "\"min_ns\": %lu, \"p50_ns\": %lu, \"p90_ns\": %lu, "
+		        "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}\n",
+		        res->name, res->nr_threads, res->nr_ops, elapsed_ns,
+		        ops_per_sec, mean, min, p50, p90, p99, p999, max);
+		break;
+	}
+}
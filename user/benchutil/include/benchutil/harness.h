@@ -0,0 +1,122 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Benchmark harness: runs an op on some threads, untimed for a warmup and then
+ * timed with the TSC, and reports latency percentiles and throughput as text,
+ * CSV or JSON.
+ *
+ * Each thread records its samples into its own histogram, so collecting them
+ * doesn't write to anything shared.  The histograms are merged at the end.
+ *
+ * Usage:
+ *
+ *		void my_op(void *arg, unsigned int tid, uint64_t nr)
+ *		{
+ *			for (uint64_t i = 0; i < nr; i++)
+ *				do_the_thing();
+ *		}
+ *
+ *		struct bench_opts opts = BENCH_OPTS_DEFAULT;
+ *		struct bench_result res;
+ *
+ *		bench_run("thing", &opts, my_op, NULL, &res);
+ *		bench_report_header(stdout, BENCH_FMT_CSV);
+ *		bench_report(stdout, BENCH_FMT_CSV, &res);
+ *
+ * The op runs nr operations at a time.  Each timed call is one sample, whose
+ * latency is the call's time divided by nr, so batching amortizes the cost of
+ * reading the TSC.  For multiple threads, the caller should be an MCP with
+ * enough vcores; with one thread, the op runs in the calling thread. */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+__BEGIN_DECLS
+
+/* Log-linear histogram, a la HdrHistogram: each power of two is split into
+ * BENCH_HIST_NR_SUB linear buckets, so a value is within 1/BENCH_HIST_NR_SUB
+ * (3%) of its bucket's bounds, no matter how large. */
+#define BENCH_HIST_SUB_BITS		5
+#define BENCH_HIST_NR_SUB		(1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_NR_BUCKETS	((64 - BENCH_HIST_SUB_BITS + 1) * \
+                                 BENCH_HIST_NR_SUB)
+
+struct bench_hist {
+	uint64_t					count;
+	uint64_t					sum;
+	uint64_t					min;
+	uint64_t					max;
+	uint64_t					buckets[BENCH_HIST_NR_BUCKETS];
+};
+
+static inline unsigned int bench_hist_bucket(uint64_t val)
+{
+	unsigned int msb;
+
+	if (val < BENCH_HIST_NR_SUB)
+		return val;
+	msb = 63 - __builtin_clzll(val);
+	return (msb - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_NR_SUB +
+	       ((val >> (msb - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_NR_SUB - 1));
+}
+
+static inline void bench_hist_record(struct bench_hist *h, uint64_t val)
+{
+	h->buckets[bench_hist_bucket(val)]++;
+	h->count++;
+	h->sum += val;
+	if (val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+}
+
+void bench_hist_init(struct bench_hist *h);
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src);
+/* pct is a percent, e.g. 99.9.  Returns the largest value in the bucket. */
+uint64_t bench_hist_percentile(const struct bench_hist *h, double pct);
+uint64_t bench_hist_mean(const struct bench_hist *h);
+/* Prints the nonzero buckets as rows of stars, with each value scaled by
+ * tsc2nsec() if tsc is set. */
+void bench_hist_print(FILE *f, const struct bench_hist *h, bool tsc);
+
+struct bench_opts {
+	unsigned int				nr_threads;
+	uint64_t					warmup_iters;	/* per thread, untimed */
+	uint64_t					iters;			/* per thread, timed */
+	uint64_t					batch;			/* iters per sample */
+};
+
+#define BENCH_OPTS_DEFAULT {.nr_threads = 1, .warmup_iters = 1000,		\
+                            .iters = 100000, .batch = 1}
+
+typedef void (*bench_op_t)(void *arg, unsigned int tid, uint64_t nr);
+
+struct bench_result {
+	const char					*name;
+	unsigned int				nr_threads;
+	uint64_t					nr_ops;
+	uint64_t					elapsed_tsc;	/* first start to last end */
+	struct bench_hist			hist;			/* per-op TSC ticks */
+};
+
+void bench_run(const char *name, const struct bench_opts *opts, bench_op_t op,
+               void *arg, struct bench_result *res);
+
+enum bench_fmt {
+	BENCH_FMT_TEXT,
+	BENCH_FMT_CSV,
+	BENCH_FMT_JSON,					/* one object per line */
+};
+
+/* Returns -1 for anything other than "text", "csv" or "json". */
+int bench_parse_fmt(const char *str, enum bench_fmt *fmt);
+/* Prints the CSV column names, and nothing for the other formats. */
+void bench_report_header(FILE *f, enum bench_fmt fmt);
+/* All times are reported in nsec. */
+void bench_report(FILE *f, enum bench_fmt fmt, const struct bench_result *res);
+
+__END_DECLS
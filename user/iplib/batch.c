@@ -0,0 +1,72 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Helpers for batched I/O on a conversation's data file, for message protocols
+ * like UDP.  After a "batch" ctl message, each read of the data file returns as
+ * many messages as fit in the buffer, and each write sends many messages.  In
+ * both directions, every message is preceded by its length, Batchhdrsize bytes,
+ * big-endian.  A message is whatever a single read or write would carry, so
+ * with "headers", each one starts with its own struct udphdr.
+ *
+ * To send, batch_add9() messages to a buffer, then write() it.  A short write
+ * means only the first messages were sent.  To receive, read() a buffer, then
+ * batch_next9() through it. */
+
+#include <stdlib.h>
+
+#include <iplib/iplib.h>
+#include <parlib/parlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Turns batch mode on or off for the conversation whose ctl is ctl_fd.  Returns
+ * 0 on success, -1 on error. */
+int batch9(int ctl_fd, bool on)
+{
+	const char *msg = on ? "batch" : "batch off";
+	ssize_t len = strlen(msg);
+
+	if (write(ctl_fd, msg, len) != len)
+		return -1;
+	return 0;
+}
+
+/* Appends a message, gathered from iov, to the batch in buf, at *off.  Returns
+ * FALSE, without changing anything, if the message doesn't fit. */
+bool batch_add9(void *buf, size_t buf_sz, size_t *off, const struct iovec *iov,
+                int iovcnt)
+{
+	uint8_t *p = buf + *off;
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (len > 0xffff || *off + Batchhdrsize + len > buf_sz)
+		return FALSE;
+	hnputs(p, len);
+	p += Batchhdrsize;
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	*off += Batchhdrsize + len;
+	return TRUE;
+}
+
+/* Gets the next message from the len bytes of a batched read in buf, at *off,
+ * pointing *msg at it.  Returns the message's length, or -1 when there are no
+ * more. */
+ssize_t batch_next9(void *buf, size_t len, size_t *off, void **msg)
+{
+	uint8_t *p = buf + *off;
+	size_t msg_len;
+
+	if (*off + Batchhdrsize > len)
+		return -1;
+	msg_len = nhgets(p);
+	if (*off + Batchhdrsize + msg_len > len)
+		return -1;
+	*msg = p + Batchhdrsize;
+	*off += Batchhdrsize + msg_len;
+	return msg_len;
+}
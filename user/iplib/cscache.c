@@ -0,0 +1,195 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Per-process cache of connection server translations, so that dial9() doesn't
+ * cost a round trip through cs per call.
+ *
+ * An entry is the cs answer ("/net/tcp/clone 10.0.0.1!80") that the last dial
+ * of a dial string connected with, keyed by the net dir and the string.
+ * Entries are good for CS_CACHE_TTL seconds, or until cs's generation changes: cs keeps a
+ * counter in a small file (cs_gen_path()) and bumps it whenever its answers
+ * could change (refresh, add).  We map that file, so checking it is a memory
+ * read.  With no file (no cs, or an older one), we just go by the TTL.
+ *
+ * Callers that find a cached answer that no longer works drop it and ask cs. */
+
+#include <parlib/parlib.h>
+#include <parlib/spinlock.h>
+#include <parlib/timing.h>
+#include <iplib/iplib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define CS_CACHE_NR_ENTS	64
+#define CS_CACHE_KEY_LEN	256
+#define CS_NR_GENS			4
+
+struct cs_cache_ent {
+	bool						valid;
+	char						key[CS_CACHE_KEY_LEN];
+	uint64_t					expire;			/* tsc */
+	uint64_t					gen;
+	struct cs_gen_map			*gm;
+	struct cs_answer			ans;
+};
+
+/* One mapping of cs's generation file per net dir. */
+struct cs_gen_map {
+	char						netdir[NETPATHLEN];
+	volatile uint64_t			*gen;
+	uint64_t					retry;			/* tsc, if we have no gen */
+};
+
+static struct spin_pdr_lock cs_cache_lock = SPINPDR_INITIALIZER;
+static struct cs_cache_ent cs_cache[CS_CACHE_NR_ENTS];
+static struct cs_gen_map cs_gens[CS_NR_GENS];
+static int cs_nr_gens;
+
+/* cs's generation file for the cs serving netdir, named like cs's srv file. */
+void cs_gen_path(char *buf, size_t len, const char *netdir)
+{
+	size_t i;
+	int n;
+
+	n = snprintf(buf, len, "%s", CS_GEN_DIR "/csgen");
+	if (!strcmp(netdir, "/net"))
+		return;
+	for (i = n; i < len - 1 && *netdir; i++, netdir++)
+		buf[i] = *netdir == '/' ? '_' : *netdir;
+	buf[i] = 0;
+}
+
+static volatile uint64_t *cs_map_gen(const char *netdir)
+{
+	char path[NETPATHLEN + sizeof(CS_GEN_DIR) + 8];
+	void *va;
+	int fd;
+
+	cs_gen_path(path, sizeof(path), netdir);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	va = mmap(0, sizeof(uint64_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (va == MAP_FAILED)
+		return NULL;
+	return va;
+}
+
+/* Returns netdir's generation map, adding one if there's room.  Hold the lock.
+ * We never unmap, and there are only a few net dirs, so once we're out of
+ * slots, those net dirs only get the TTL. */
+static struct cs_gen_map *cs_find_gen(const char *netdir)
+{
+	struct cs_gen_map *gm;
+
+	for (int i = 0; i < cs_nr_gens; i++) {
+		if (!strcmp(cs_gens[i].netdir, netdir))
+			return &cs_gens[i];
+	}
+	if (cs_nr_gens == CS_NR_GENS || strlen(netdir) >= NETPATHLEN)
+		return NULL;
+	gm = &cs_gens[cs_nr_gens++];
+	strcpy(gm->netdir, netdir);
+	gm->gen = NULL;
+	gm->retry = 0;
+	return gm;
+}
+
+static uint64_t cs_gen_val(struct cs_gen_map *gm)
+{
+	return gm && gm->gen ? *gm->gen : 0;
+}
+
+/* Builds the key and returns its slot. */
+static struct cs_cache_ent *cs_slot(const char *netdir, const char *dest,
+                                    char *key)
+{
+	unsigned long h = 5381;
+
+	snprintf(key, CS_CACHE_KEY_LEN, "%s %s", netdir, dest);
+	for (char *p = key; *p; p++)
+		h = h * 33 + *p;
+	return &cs_cache[h % CS_CACHE_NR_ENTS];
+}
+
+/* Copies out the answer for dest if we have a fresh one. */
+bool cs_cache_get(const char *netdir, const char *dest, struct cs_answer *ans)
+{
+	char key[CS_CACHE_KEY_LEN];
+	struct cs_cache_ent *e;
+	bool ret = FALSE;
+
+	e = cs_slot(netdir, dest, key);
+	spin_pdr_lock(&cs_cache_lock);
+	if (e->valid && !strcmp(e->key, key)) {
+		if (read_tsc() < e->expire && cs_gen_val(e->gm) == e->gen) {
+			*ans = e->ans;
+			ret = TRUE;
+		} else {
+			e->valid = FALSE;
+		}
+	}
+	spin_pdr_unlock(&cs_cache_lock);
+	return ret;
+}
+
+/* Caches ans for dest.  Answers read before a generation change could be
+ * stale, so callers grab gen (cs_cache_gen()) before asking cs. */
+void cs_cache_put(const char *netdir, const char *dest, struct cs_answer *ans,
+                  uint64_t gen)
+{
+	char key[CS_CACHE_KEY_LEN];
+	struct cs_cache_ent *e;
+
+	e = cs_slot(netdir, dest, key);
+	spin_pdr_lock(&cs_cache_lock);
+	e->valid = TRUE;
+	strcpy(e->key, key);
+	e->gm = cs_find_gen(netdir);
+	e->gen = gen;
+	e->expire = read_tsc() + sec2tsc(CS_CACHE_TTL);
+	e->ans = *ans;
+	spin_pdr_unlock(&cs_cache_lock);
+}
+
+/* Returns cs's current generation for netdir (0 if we can't tell), mapping
+ * cs's file if we haven't yet.  We try that at most once per TTL, since it
+ * costs as much as asking cs. */
+uint64_t cs_cache_gen(const char *netdir)
+{
+	struct cs_gen_map *gm;
+	volatile uint64_t *va;
+	uint64_t gen;
+
+	spin_pdr_lock(&cs_cache_lock);
+	gm = cs_find_gen(netdir);
+	if (gm && !gm->gen && read_tsc() >= gm->retry) {
+		gm->retry = read_tsc() + sec2tsc(CS_CACHE_TTL);
+		spin_pdr_unlock(&cs_cache_lock);
+		va = cs_map_gen(netdir);
+		spin_pdr_lock(&cs_cache_lock);
+		if (va && !gm->gen)
+			gm->gen = va;
+		else if (va)
+			munmap((void*)va, sizeof(uint64_t));
+	}
+	gen = cs_gen_val(gm);
+	spin_pdr_unlock(&cs_cache_lock);
+	return gen;
+}
+
+void cs_cache_drop(const char *netdir, const char *dest)
+{
+	char key[CS_CACHE_KEY_LEN];
+	struct cs_cache_ent *e;
+
+	e = cs_slot(netdir, dest, key);
+	spin_pdr_lock(&cs_cache_lock);
+	if (!strcmp(e->key, key))
+		e->valid = FALSE;
+	spin_pdr_unlock(&cs_cache_lock);
+}
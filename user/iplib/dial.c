@@ -72,11 +72,27 @@ static int call(char *clone, char *dest, int *cfdp, char *dir, char *local,
 	return fd;
 }
 
+/* Calls the address in a cs answer line, "clone dest". */
+static int call_answer(char *line, int *cfdp, char *dir, char *local,
+                       int flags)
+{
+	char *p;
+
+	p = strchr(line, ' ');
+	if (p == 0)
+		return -1;
+	*p++ = 0;
+	return call(line, p, cfdp, dir, local, flags);
+}
+
 int dial9(char *dest, char *local, char *dir, int *cfdp, int flags)
 {
 	char net[128];
 	char netdir[128], csname[NETPATHLEN], *slp;
 	char clone[NAMELEN + 12];
+	char query[128];
+	struct cs_answer ans;
+	uint64_t gen;
 	char *p;
 	int n;
 	int fd;
@@ -112,6 +128,16 @@ int dial9(char *dest, char *local, char *dir, int *cfdp, int flags)
 			return call(clone, p, cfdp, dir, local, flags);
 		}
 	}
+	/* try what worked last time, before bothering cs */
+	if (cs_cache_get(netdir, net, &ans)) {
+		rv = call_answer(ans.line, cfdp, dir, local, flags);
+		if (rv >= 0)
+			return rv;
+		cs_cache_drop(netdir, net);
+	}
+	strcpy(query, net);
+	gen = cs_cache_gen(netdir);
+
 	/* call the connection server */
 	sprintf(csname, "%s/cs", netdir);
 	fd = open(csname, O_RDWR);
@@ -139,14 +165,16 @@ int dial9(char *dest, char *local, char *dir, int *cfdp, int flags)
 	lseek(fd, 0, 0);
 	while ((n = read(fd, net, sizeof(net) - 1)) > 0) {
 		net[n] = 0;
-		p = strchr(net, ' ');
-		if (p == 0)
-			continue;
-		*p++ = 0;
-		rv = call(net, p, cfdp, dir, local, flags);
+		if (n < sizeof(ans.line))
+			strcpy(ans.line, net);
+		else
+			ans.line[0] = 0;
+		rv = call_answer(net, cfdp, dir, local, flags);
 		if (rv >= 0)
 			break;
 	}
 	close(fd);
+	if (rv >= 0 && ans.line[0])
+		cs_cache_put(netdir, query, &ans, gen);
 	return rv;
 }
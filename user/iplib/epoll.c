@@ -10,7 +10,8 @@
  * 	kernel FD that accepts your FD taps.
  * 	- there's no EPOLLONESHOT or level-triggered support.
  * 	- you can only tap one FD at a time, so you can't add the same FD to
- * 	multiple epoll sets.
+ * 	multiple epoll sets, unless every set adds it with EPOLLEXCLUSIVE (and the
+ * 	same events).
  * 	- closing the epoll is a little dangerous, if there are outstanding INDIR
  * 	events.  this will only pop up if you're yielding cores, maybe getting
  * 	preempted, and are unlucky.
@@ -23,8 +24,15 @@
  * 	- If you add a BSD socket FD to an epoll set, you'll get taps on both the
  * 	data FD and the listen FD.
  * 	- If you add the same BSD socket listener to multiple epoll sets, you will
- * 	likely fail.  This is in addition to being able to tap only one FD at a
- * 	time.
+ * 	likely fail, unless you use EPOLLEXCLUSIVE.  This is in addition to being
+ * 	able to tap only one FD at a time.
+ *
+ * EPOLLEXCLUSIVE: FDs shared by several epoll sets (e.g. a listen socket shared
+ * by one event loop per vcore) are tapped once, into a process-wide CEQ.  Its
+ * handler forwards each event to exactly one of the sets, preferring one with a
+ * waiter on the vcore that got the event.  Within a set, only one blocked
+ * epoll_wait() caller is woken per burst of activity, and pollers only take the
+ * set's lock for reading, so they don't serialize on each other.
  * */
 
 #include <sys/epoll.h>
@@ -35,16 +43,24 @@
 #include <parlib/timing.h>
 #include <parlib/slab.h>
 #include <parlib/assert.h>
+#include <parlib/spinlock.h>
 #include <sys/user_fd.h>
 #include <sys/close_cb.h>
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/plan9_helpers.h>
 #include <ros/fs.h>
 
+/* Older toolchain headers might not have it; userspace only cares about the
+ * bit. */
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
 /* Sanity check, so we can ID our own FDs */
 #define EPOLL_UFD_MAGIC 		0xe9011
 
@@ -64,7 +80,11 @@ static struct kmem_cache *ep_alarms_cache;
 struct epoll_ctlr {
 	TAILQ_ENTRY(epoll_ctlr)		link;
 	struct event_queue			*ceq_evq;
-	uth_mutex_t					*mtx;
+	/* Readers are epoll_wait()ers, writers change the set */
+	uth_rwlock_t				*rwlock;
+	/* Hints for where to send EPOLLEXCLUSIVE events */
+	atomic_t					nr_waiters;
+	uint32_t					waiter_vcoreid;
 	struct user_fd				ufd;
 };
 
@@ -82,8 +102,48 @@ struct ep_fd_data {
 	struct epoll_event			ep_event;
 	int							fd;
 	int							filter;
+	bool						excl;
+	/* Deleted, but we left the tap in place in case it comes back */
+	bool						dormant;
+	uint32_t					tap_gen;
+};
+
+/* Lazy deletion: with the kernel's tap table, deleting an FD just turns off
+ * interest in its slot.  Its tap stays put (the kernel removes it on close),
+ * and its ep_fd goes dormant.  Re-adding it with the same events turns interest
+ * back on and checks the ready bits.  Neither takes a syscall, which helps
+ * servers that churn connections or MOD a lot.  Without a table, MOD also goes
+ * through a dormant tap, which saves the REM or at least batches it.
+ *
+ * Since an FD has only one tap, another epoll set can steal a dormant tap.
+ * tap_gens[fd] says who has it: an even number is the tap_gen of a live ep_fd,
+ * and an odd one means that ep_fd (tap_gen + 1) went dormant.  Whoever CASes
+ * an odd gen back to even gets the tap. */
+enum {
+	EP_DEL_UNTAP,		/* plain old untap */
+	EP_DEL_LAZY,		/* go dormant, if possible */
+	EP_DEL_CLOSED,		/* FD is closing, the kernel will untap */
 };
 
+static struct fd_tap_slot *tap_slots;
+static uint32_t *tap_gens;
+
+/* An FD shared by several epoll sets via EPOLLEXCLUSIVE.  These hang off the
+ * user_data of the excl CEQ's events.  ctlrs is protected by excl_lock, since
+ * the handler runs in vcore context.  excl_mtx serializes the adds and dels,
+ * which tap and untap. */
+struct ep_excl_fd {
+	int							fd;
+	int							filter;
+	unsigned int				nr_ctlrs;
+	unsigned int				next;
+	struct epoll_ctlr			**ctlrs;
+};
+
+static struct event_queue *excl_evq;
+static struct spin_pdr_lock excl_lock = SPINPDR_INITIALIZER;
+static uth_mutex_t *excl_mtx;
+
 /* Converts epoll events to FD taps. */
 static int ep_events_to_taps(uint32_t ep_ev)
 {
@@ -154,7 +214,8 @@ static struct event_queue *ep_get_ceq_evq(unsigned int ceq_ring_sz)
 	ceq_evq->ev_mbox->type = EV_MBOX_CEQ;
 	ceq_init(&ceq_evq->ev_mbox->ceq, CEQ_OR, NR_FILE_DESC_MAX, ceq_ring_sz);
 	ceq_evq->ev_flags = EVENT_INDIR | EVENT_SPAM_INDIR | EVENT_WAKEUP;
-	evq_attach_wakeup_ctlr(ceq_evq);
+	/* Any waiter can drain the CEQ, so only wake one of them per event. */
+	evq_attach_wakeup_ctlr_excl(ceq_evq);
 	return ceq_evq;
 }
 
@@ -188,6 +249,229 @@ static void ep_put_alarm_evq(struct event_queue *alarm_evq)
 #endif
 }
 
+/* Sets up the shared tap table.  If the kernel won't take it, we just do
+ * everything with syscalls. */
+static void ep_tap_table_init(void)
+{
+	struct fd_tap_req tap_req = {0};
+	size_t sz = sizeof(struct fd_tap_slot) * NR_FILE_DESC_MAX;
+	size_t gens_sz = sizeof(uint32_t) * NR_FILE_DESC_MAX;
+	void *table, *gens;
+
+	/* The kernel touches a slot when we tap its FD, so we don't populate. */
+	table = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+	             -1, 0);
+	if (table == MAP_FAILED)
+		return;
+	gens = mmap(0, gens_sz, PROT_READ | PROT_WRITE,
+	            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (gens == MAP_FAILED) {
+		munmap(table, sz);
+		return;
+	}
+	tap_req.cmd = FDTAP_CMD_TABLE;
+	tap_req.data = table;
+	tap_req.ev_id = NR_FILE_DESC_MAX;
+	if (sys_tap_fds(&tap_req, 1) != 1) {
+		munmap(table, sz);
+		munmap(gens, gens_sz);
+		return;
+	}
+	tap_gens = gens;
+	tap_slots = table;
+}
+
+/* Call when we just tapped fd, to mark the tap as ours and live. */
+static uint32_t ep_claim_tap_gen(int fd)
+{
+	uint32_t old;
+
+	if (!tap_slots)
+		return 0;
+	do {
+		old = tap_gens[fd];
+	} while (!atomic_cas_u32(&tap_gens[fd], old, (old | 1) + 1));
+	return (old | 1) + 1;
+}
+
+/* Whether ep_fd's dormant tap is still there.  If so, it's live again. */
+static bool ep_fd_reclaim_tap(struct ep_fd_data *ep_fd)
+{
+	/* W/o a table, dormancy doesn't outlast the wrlock, so it's still ours */
+	if (!tap_slots)
+		return TRUE;
+	return atomic_cas_u32(&tap_gens[ep_fd->fd], ep_fd->tap_gen + 1,
+	                      ep_fd->tap_gen);
+}
+
+/* An add failed with EBUSY.  If the tap is dormant in some other set, we take
+ * it away and untap it.  Returns TRUE if it's worth trying again. */
+static bool ep_steal_dormant_tap(int fd)
+{
+	struct fd_tap_req tap_req = {0};
+	uint32_t gen;
+
+	if (!tap_slots || errno != EBUSY)
+		return FALSE;
+	gen = tap_gens[fd];
+	if (!(gen & 1) || !atomic_cas_u32(&tap_gens[fd], gen, gen + 1))
+		return FALSE;
+	tap_req.fd = fd;
+	tap_req.cmd = FDTAP_CMD_REM;
+	sys_tap_fds(&tap_req, 1);
+	return TRUE;
+}
+
+/* Picks which epoll set gets an EPOLLEXCLUSIVE event.  We'd like one with
+ * someone already waiting on it, and ideally on our vcore (the one the kernel
+ * sent the event to), since that waiter is likely cache-hot.  O/w, we spread
+ * events round-robin.  Hold excl_lock. */
+static struct epoll_ctlr *ep_excl_pick(struct ep_excl_fd *xfd)
+{
+	struct epoll_ctlr *ep, *any_waiter = NULL;
+	uint32_t vcoreid = vcore_id();
+
+	for (int i = 0; i < xfd->nr_ctlrs; i++) {
+		ep = xfd->ctlrs[(xfd->next + i) % xfd->nr_ctlrs];
+		if (!atomic_read(&ep->nr_waiters))
+			continue;
+		if (ep->waiter_vcoreid == vcoreid)
+			return ep;
+		if (!any_waiter)
+			any_waiter = ep;
+	}
+	if (any_waiter)
+		return any_waiter;
+	return xfd->ctlrs[xfd->next++ % xfd->nr_ctlrs];
+}
+
+/* ev_handler for excl_evq, runs in vcore context.  Forwards each message, which
+ * is the same as what a tap would have sent, to one of the FD's epoll sets. */
+static void ep_excl_handler(struct event_queue *ev_q)
+{
+	struct ceq *ceq = &ev_q->ev_mbox->ceq;
+	struct event_msg msg;
+	struct ep_excl_fd *xfd;
+	struct epoll_ctlr *ep;
+	struct event_queue *to_evq;
+
+	while (get_ceq_msg(ceq, &msg)) {
+		to_evq = NULL;
+		spin_pdr_lock(&excl_lock);
+		xfd = (struct ep_excl_fd*)ceq->events[msg.ev_type].user_data;
+		if (xfd && xfd->nr_ctlrs) {
+			ep = ep_excl_pick(xfd);
+			to_evq = ep->ceq_evq;
+		}
+		spin_pdr_unlock(&excl_lock);
+		/* Epoll CEQs are never freed (see ep_put_ceq_evq()), so we can use
+		 * to_evq without the lock. */
+		if (to_evq)
+			sys_send_event(to_evq, &msg, vcore_id());
+	}
+}
+
+static void ep_excl_init(void)
+{
+	excl_mtx = uth_mutex_alloc();
+	excl_evq = get_eventq_raw();
+	excl_evq->ev_mbox->type = EV_MBOX_CEQ;
+	ceq_init(&excl_evq->ev_mbox->ceq, CEQ_OR, NR_FILE_DESC_MAX, 128);
+	excl_evq->ev_flags = EVENT_INDIR | EVENT_SPAM_INDIR | EVENT_WAKEUP;
+	excl_evq->ev_handler = ep_excl_handler;
+}
+
+/* Adds ep to the sets sharing fd.  The first one taps the FD for everyone.
+ * They all need to agree on the filter, since there's only one tap. */
+static int ep_excl_add(struct epoll_ctlr *ep, int fd, int filter)
+{
+	struct ceq_event *ceq_ev = &excl_evq->ev_mbox->ceq.events[fd];
+	struct ep_excl_fd *xfd;
+	struct fd_tap_req tap_req = {0};
+	struct epoll_ctlr **new_ctlrs, **old_ctlrs;
+	int ret = -1;
+
+	uth_mutex_lock(excl_mtx);
+	xfd = (struct ep_excl_fd*)ceq_ev->user_data;
+	if (xfd && xfd->filter != filter) {
+		errno = EINVAL;
+		werrstr("EPOLLEXCLUSIVE FD %d already shared with other events", fd);
+		goto out;
+	}
+	if (!xfd) {
+		xfd = malloc(sizeof(struct ep_excl_fd));
+		memset(xfd, 0, sizeof(struct ep_excl_fd));
+		xfd->fd = fd;
+		xfd->filter = filter;
+		tap_req.fd = fd;
+		tap_req.cmd = FDTAP_CMD_ADD;
+		tap_req.filter = filter;
+		tap_req.ev_q = excl_evq;
+		tap_req.ev_id = fd;
+		/* Publish before tapping, so the first event finds it. */
+		spin_pdr_lock(&excl_lock);
+		ceq_ev->user_data = (uint64_t)xfd;
+		spin_pdr_unlock(&excl_lock);
+		if (sys_tap_fds(&tap_req, 1) != 1 &&
+		    (!ep_steal_dormant_tap(fd) || sys_tap_fds(&tap_req, 1) != 1)) {
+			spin_pdr_lock(&excl_lock);
+			ceq_ev->user_data = 0;
+			spin_pdr_unlock(&excl_lock);
+			free(xfd);
+			goto out;
+		}
+		ep_claim_tap_gen(fd);
+	}
+	/* The handler reads ctlrs in vcore context, so we can't realloc under it */
+	new_ctlrs = malloc(sizeof(struct epoll_ctlr*) * (xfd->nr_ctlrs + 1));
+	memcpy(new_ctlrs, xfd->ctlrs, sizeof(struct epoll_ctlr*) * xfd->nr_ctlrs);
+	new_ctlrs[xfd->nr_ctlrs] = ep;
+	spin_pdr_lock(&excl_lock);
+	old_ctlrs = xfd->ctlrs;
+	xfd->ctlrs = new_ctlrs;
+	xfd->nr_ctlrs++;
+	spin_pdr_unlock(&excl_lock);
+	free(old_ctlrs);
+	ret = 0;
+out:
+	uth_mutex_unlock(excl_mtx);
+	return ret;
+}
+
+/* Removes ep from the sets sharing fd.  The last one out untaps. */
+static void ep_excl_del(struct epoll_ctlr *ep, int fd)
+{
+	struct ceq_event *ceq_ev = &excl_evq->ev_mbox->ceq.events[fd];
+	struct ep_excl_fd *xfd;
+	struct fd_tap_req tap_req = {0};
+	bool last = FALSE;
+
+	uth_mutex_lock(excl_mtx);
+	xfd = (struct ep_excl_fd*)ceq_ev->user_data;
+	assert(xfd);
+	spin_pdr_lock(&excl_lock);
+	for (int i = 0; i < xfd->nr_ctlrs; i++) {
+		if (xfd->ctlrs[i] == ep) {
+			xfd->ctlrs[i] = xfd->ctlrs[--xfd->nr_ctlrs];
+			break;
+		}
+	}
+	if (!xfd->nr_ctlrs) {
+		ceq_ev->user_data = 0;
+		last = TRUE;
+	}
+	spin_pdr_unlock(&excl_lock);
+	if (last) {
+		tap_req.fd = fd;
+		tap_req.cmd = FDTAP_CMD_REM;
+		/* Could fail if the FD was already closed, same as for regular taps */
+		sys_tap_fds(&tap_req, 1);
+		free(xfd->ctlrs);
+		free(xfd);
+	}
+	uth_mutex_unlock(excl_mtx);
+}
+
 static void epoll_close(struct user_fd *ufd)
 {
 	struct epoll_ctlr *ep = container_of(ufd, struct epoll_ctlr, ufd);
@@ -208,6 +492,16 @@ static void epoll_close(struct user_fd *ufd)
 		ep_fd_i = (struct ep_fd_data*)ceq_ev_i->user_data;
 		if (!ep_fd_i)
 			continue;
+		if (ep_fd_i->excl) {
+			ep_excl_del(ep, i);
+			free(ep_fd_i);
+			continue;
+		}
+		/* Don't untap it if another set stole it */
+		if (ep_fd_i->dormant && !ep_fd_reclaim_tap(ep_fd_i)) {
+			free(ep_fd_i);
+			continue;
+		}
 		tap_req_i = &tap_reqs[nr_tap_req++];
 		tap_req_i->fd = i;
 		tap_req_i->cmd = FDTAP_CMD_REM;
@@ -224,7 +518,7 @@ static void epoll_close(struct user_fd *ufd)
 	uth_mutex_lock(ctlrs_mtx);
 	TAILQ_REMOVE(&all_ctlrs, ep, link);
 	uth_mutex_unlock(ctlrs_mtx);
-	uth_mutex_free(ep->mtx);
+	uth_rwlock_free(ep->rwlock);
 	free(ep);
 }
 
@@ -232,7 +526,7 @@ static int init_ep_ctlr(struct epoll_ctlr *ep, int size)
 {
 	if (size == 1)
 		size = 128;
-	ep->mtx = uth_mutex_alloc();
+	ep->rwlock = uth_rwlock_alloc();
 	ep->ufd.magic = EPOLL_UFD_MAGIC;
 	ep->ufd.close = epoll_close;
 	/* Size is a hint for the CEQ concurrency.  We can actually handle as many
@@ -241,6 +535,9 @@ static int init_ep_ctlr(struct epoll_ctlr *ep, int size)
 	return 0;
 }
 
+static int __epoll_ctl_del(struct epoll_ctlr *ep, int fd,
+                           struct epoll_event *event, int how);
+
 static void epoll_fd_closed(int fd)
 {
 	struct epoll_ctlr *ep;
@@ -248,9 +545,14 @@ static void epoll_fd_closed(int fd)
 	/* Lockless peek, avoid locking for every close() */
 	if (TAILQ_EMPTY(&all_ctlrs))
 		return;
+	if (fd >= USER_FD_BASE)
+		return;
 	uth_mutex_lock(ctlrs_mtx);
-	TAILQ_FOREACH(ep, &all_ctlrs, link)
-		epoll_ctl(ep->ufd.fd, EPOLL_CTL_DEL, fd, 0);
+	TAILQ_FOREACH(ep, &all_ctlrs, link) {
+		uth_rwlock_wrlock(ep->rwlock);
+		__epoll_ctl_del(ep, fd, 0, EP_DEL_CLOSED);
+		uth_rwlock_unlock(ep->rwlock);
+	}
 	uth_mutex_unlock(ctlrs_mtx);
 }
 
@@ -280,6 +582,8 @@ static void epoll_init(void *arg)
 
 	register_close_cb(&epoll_close_cb);
 	ctlrs_mtx = uth_mutex_alloc();
+	ep_excl_init();
+	ep_tap_table_init();
 	ep_alarms_cache = kmem_cache_create("epoll alarms",
 	                                    sizeof(struct ep_alarm),
 	                                    __alignof__(sizeof(struct ep_alarm)), 0,
@@ -351,12 +655,68 @@ static void fire_existing_events(int fd, int ep_events,
 	}
 }
 
+/* Brings a dormant ep_fd back, whose tap is still in place with the same
+ * filter.  We stand in for fire_existing_events() with the ready bits, which
+ * cover everything that fired since the tap went in.  That's more spurious
+ * events, but no syscall in the common case. */
+static void ep_fd_revive(struct epoll_ctlr *ep, struct ep_fd_data *ep_fd)
+{
+	struct fd_tap_slot *slot;
+	struct event_msg ev_msg[1] = {{0}};
+	uint32_t ready;
+
+	ep_fd->dormant = FALSE;
+	if (!tap_slots) {
+		fire_existing_events(ep_fd->fd, ep_fd->ep_event.events, ep->ceq_evq);
+		return;
+	}
+	slot = &tap_slots[ep_fd->fd];
+	slot->interest = ep_fd->filter;
+	/* Interest on, then check ready; pairs with the kernel's OR then check */
+	mb();
+	ready = atomic_swap_u32(&slot->ready, 0) & ep_fd->filter;
+	if (ready) {
+		ev_msg->ev_type = ep_fd->fd;
+		ev_msg->ev_arg2 = ready;
+		sys_send_event(ep->ceq_evq, ev_msg, vcore_id());
+	}
+}
+
+/* Taps fd into our CEQ.  If there is a dormant tap, we remove it in the same
+ * syscall. */
+static int ep_tap_fd(struct epoll_ctlr *ep, int fd, int filter, bool had_tap)
+{
+	struct fd_tap_req tap_reqs[2] = {{0}};
+	struct fd_tap_req *add_req = &tap_reqs[had_tap ? 1 : 0];
+	int nr_reqs = had_tap ? 2 : 1;
+	int ret;
+
+	if (had_tap) {
+		tap_reqs[0].fd = fd;
+		tap_reqs[0].cmd = FDTAP_CMD_REM;
+	}
+	add_req->fd = fd;
+	add_req->cmd = FDTAP_CMD_ADD;
+	add_req->filter = filter;
+	add_req->ev_q = ep->ceq_evq;
+	add_req->ev_id = fd;	/* using FD as the CEQ ID */
+	ret = sys_tap_fds(tap_reqs, nr_reqs);
+	/* The REM could fail if the kernel already dropped the tap. */
+	if (had_tap && !ret)
+		ret = sys_tap_fds(add_req, 1) + 1;
+	else if (!had_tap && !ret && ep_steal_dormant_tap(fd))
+		ret = sys_tap_fds(add_req, 1);
+	return ret == nr_reqs ? 0 : -1;
+}
+
 static int __epoll_ctl_add_raw(struct epoll_ctlr *ep, int fd,
                                struct epoll_event *event)
 {
 	struct ceq_event *ceq_ev;
 	struct ep_fd_data *ep_fd;
 	struct fd_tap_req tap_req = {0};
+	bool excl = !!(event->events & EPOLLEXCLUSIVE);
+	bool had_tap;
 	int ret, filter;
 
 	ceq_ev = ep_get_ceq_ev(ep, fd);
@@ -366,23 +726,46 @@ static int __epoll_ctl_add_raw(struct epoll_ctlr *ep, int fd,
 		return -1;
 	}
 	ep_fd = (struct ep_fd_data*)ceq_ev->user_data;
-	if (ep_fd) {
+	if (ep_fd && !ep_fd->dormant) {
 		errno = EEXIST;
 		return -1;
 	}
-	tap_req.fd = fd;
-	tap_req.cmd = FDTAP_CMD_ADD;
 	/* EPOLLHUP is implicitly set for all epolls. */
 	filter = ep_events_to_taps(event->events | EPOLLHUP);
-	tap_req.filter = filter;
-	tap_req.ev_q = ep->ceq_evq;
-	tap_req.ev_id = fd;	/* using FD as the CEQ ID */
-	ret = sys_tap_fds(&tap_req, 1);
-	if (ret != 1)
+	had_tap = ep_fd && ep_fd_reclaim_tap(ep_fd);
+	if (had_tap && !excl && filter == ep_fd->filter) {
+		ep_fd->ep_event = *event;
+		ep_fd->ep_event.events |= EPOLLHUP;
+		ep_fd_revive(ep, ep_fd);
+		return 0;
+	}
+	if (excl) {
+		if (had_tap) {
+			tap_req.fd = fd;
+			tap_req.cmd = FDTAP_CMD_REM;
+			sys_tap_fds(&tap_req, 1);
+		}
+		/* Tapped into excl_evq, which forwards to us with the same ev_id */
+		ret = ep_excl_add(ep, fd, filter);
+	} else {
+		ret = ep_tap_fd(ep, fd, filter, had_tap);
+	}
+	if (ret) {
+		/* Either way, the dormant tap is gone */
+		if (ep_fd) {
+			ceq_ev->user_data = 0;
+			free(ep_fd);
+		}
 		return -1;
-	ep_fd = malloc(sizeof(struct ep_fd_data));
+	}
+	if (!ep_fd)
+		ep_fd = malloc(sizeof(struct ep_fd_data));
 	ep_fd->fd = fd;
 	ep_fd->filter = filter;
+	ep_fd->excl = excl;
+	ep_fd->dormant = FALSE;
+	if (!excl)
+		ep_fd->tap_gen = ep_claim_tap_gen(fd);
 	ep_fd->ep_event = *event;
 	ep_fd->ep_event.events |= EPOLLHUP;
 	ceq_ev->user_data = (uint64_t)ep_fd;
@@ -425,7 +808,10 @@ static int __epoll_ctl_add(struct epoll_ctlr *ep, int fd,
 	 * that in event->data. */
 	_sock_lookup_rock_fds(fd, TRUE, &sock_listen_fd, &sock_ctl_fd);
 	if (sock_listen_fd >= 0) {
-		listen_event.events = EPOLLET | EPOLLIN | EPOLLHUP;
+		/* A listen socket shared by several event loops is the main user of
+		 * EPOLLEXCLUSIVE, so it applies to the listen FD too. */
+		listen_event.events = EPOLLET | EPOLLIN | EPOLLHUP |
+		                      (event->events & EPOLLEXCLUSIVE);
 		listen_event.data = event->data;
 		ret = __epoll_ctl_add_raw(ep, sock_listen_fd, &listen_event);
 		if (ret < 0)
@@ -435,7 +821,7 @@ static int __epoll_ctl_add(struct epoll_ctlr *ep, int fd,
 }
 
 static int __epoll_ctl_del_raw(struct epoll_ctlr *ep, int fd,
-                               struct epoll_event *event)
+                               struct epoll_event *event, int how)
 {
 	struct ceq_event *ceq_ev;
 	struct ep_fd_data *ep_fd;
@@ -447,23 +833,38 @@ static int __epoll_ctl_del_raw(struct epoll_ctlr *ep, int fd,
 		return -1;
 	}
 	ep_fd = (struct ep_fd_data*)ceq_ev->user_data;
-	if (!ep_fd) {
+	if (!ep_fd || (ep_fd->dormant && how != EP_DEL_CLOSED)) {
 		errno = ENOENT;
 		return -1;
 	}
 	assert(ep_fd->fd == fd);
-	tap_req.fd = fd;
-	tap_req.cmd = FDTAP_CMD_REM;
-	/* ignoring the return value; we could have failed to remove it if the FD
-	 * has already closed and the kernel removed the tap. */
-	sys_tap_fds(&tap_req, 1);
+	if (ep_fd->excl) {
+		ep_excl_del(ep, fd);
+	} else if (how == EP_DEL_LAZY) {
+		/* Without a table, the tap keeps firing, and get_ep_event_from_msg()
+		 * skips its events. */
+		if (tap_slots) {
+			tap_slots[fd].interest = 0;
+			/* Up for grabs; only we change an even gen */
+			wmb();
+			tap_gens[fd] = ep_fd->tap_gen + 1;
+		}
+		ep_fd->dormant = TRUE;
+		return 0;
+	} else if (how == EP_DEL_UNTAP) {
+		tap_req.fd = fd;
+		tap_req.cmd = FDTAP_CMD_REM;
+		/* ignoring the return value; we could have failed to remove it if the
+		 * FD has already closed and the kernel removed the tap. */
+		sys_tap_fds(&tap_req, 1);
+	}
 	ceq_ev->user_data = 0;
 	free(ep_fd);
 	return 0;
 }
 
 static int __epoll_ctl_del(struct epoll_ctlr *ep, int fd,
-                           struct epoll_event *event)
+                           struct epoll_event *event, int how)
 {
 	int sock_listen_fd, sock_ctl_fd;
 
@@ -480,10 +881,13 @@ static int __epoll_ctl_del(struct epoll_ctlr *ep, int fd,
 		 * deletion was triggered from close callbacks, it's possible for the
 		 * sock_listen_fd to be closed first, which would have triggered an
 		 * epoll_ctl_del.  When we get around to closing the Rock FD, the listen
-		 * FD was already closed. */
-		__epoll_ctl_del_raw(ep, sock_listen_fd, event);
+		 * FD was already closed.
+		 *
+		 * If it's still open on EP_DEL_CLOSED, glibc's socket close_cb is
+		 * about to close it, so EP_DEL_CLOSED is right for it too. */
+		__epoll_ctl_del_raw(ep, sock_listen_fd, event, how);
 	}
-	return __epoll_ctl_del_raw(ep, fd, event);
+	return __epoll_ctl_del_raw(ep, fd, event, how);
 }
 
 int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
@@ -499,14 +903,15 @@ int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 		werrstr("Epoll can't track User FDs");
 		return -1;
 	}
-	uth_mutex_lock(ep->mtx);
+	uth_rwlock_wrlock(ep->rwlock);
 	switch (op) {
 		case (EPOLL_CTL_MOD):
 			/* In lieu of a proper MOD, just remove and readd.  The errors might
 			 * not work out well, and there could be a missed event in the
 			 * middle.  Not sure what the guarantees are, but we can fake a
-			 * poke. (TODO). */
-			ret = __epoll_ctl_del(ep, fd, 0);
+			 * poke. (TODO).  The lazy delete means the readd reuses or at
+			 * least batches the untap. */
+			ret = __epoll_ctl_del(ep, fd, 0, EP_DEL_LAZY);
 			if (ret)
 				break;
 			ret = __epoll_ctl_add(ep, fd, event);
@@ -515,13 +920,14 @@ int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 			ret = __epoll_ctl_add(ep, fd, event);
 			break;
 		case (EPOLL_CTL_DEL):
-			ret = __epoll_ctl_del(ep, fd, event);
+			ret = __epoll_ctl_del(ep, fd, event,
+			                      tap_slots ? EP_DEL_LAZY : EP_DEL_UNTAP);
 			break;
 		default:
 			errno = EINVAL;
 			ret = -1;
 	}
-	uth_mutex_unlock(ep->mtx);
+	uth_rwlock_unlock(ep->rwlock);
 	return ret;
 }
 
@@ -535,7 +941,7 @@ static bool get_ep_event_from_msg(struct epoll_ctlr *ep, struct event_msg *msg,
 	/* should never get a tap FD > size of the epoll set */
 	assert(ceq_ev);
 	ep_fd = (struct ep_fd_data*)ceq_ev->user_data;
-	if (!ep_fd) {
+	if (!ep_fd || ep_fd->dormant) {
 		/* it's possible the FD was unregistered and this was an old
 		 * event sent to this epoll set. */
 		return FALSE;
@@ -557,8 +963,8 @@ static int __epoll_wait_poll(struct epoll_ctlr *ep, struct epoll_event *events,
 		return 0;
 	/* Locking to protect get_ep_event_from_msg, specifically that the ep_fd
 	 * stored at ceq_ev->user_data does not get concurrently removed and
-	 * freed. */
-	uth_mutex_lock(ep->mtx);
+	 * freed.  Pollers only read the set, so they can run in parallel. */
+	uth_rwlock_rdlock(ep->rwlock);
 	for (int i = 0; i < maxevents; i++) {
 retry:
 		if (!uth_check_evqs(&msg, NULL, 1, ep->ceq_evq))
@@ -567,7 +973,7 @@ retry:
 			goto retry;
 		nr_ret++;
 	}
-	uth_mutex_unlock(ep->mtx);
+	uth_rwlock_unlock(ep->rwlock);
 	return nr_ret;
 }
 
@@ -588,7 +994,10 @@ static int __epoll_wait(struct epoll_ctlr *ep, struct epoll_event *events,
 		return nr_ret;
 	if (timeout == 0)
 		return 0;
-	/* From here on down, we're going to block until there is some activity */
+	/* From here on down, we're going to block until there is some activity.
+	 * The waiter hints steer EPOLLEXCLUSIVE events towards us. */
+	ep->waiter_vcoreid = vcore_id();
+	atomic_inc(&ep->nr_waiters);
 	if (timeout != -1) {
 		ep_a = kmem_cache_alloc(ep_alarms_cache, 0);
 		assert(ep_a);
@@ -596,6 +1005,7 @@ static int __epoll_wait(struct epoll_ctlr *ep, struct epoll_event *events,
 		                  timeout * 1000);
 		uth_blockon_evqs(&msg, &which_evq, 2, ep->ceq_evq, ep_a->alarm_evq);
 		if (which_evq == ep_a->alarm_evq) {
+			atomic_dec(&ep->nr_waiters);
 			kmem_cache_free(ep_alarms_cache, ep_a);
 			return 0;
 		}
@@ -609,10 +1019,11 @@ static int __epoll_wait(struct epoll_ctlr *ep, struct epoll_event *events,
 	} else {
 		uth_blockon_evqs(&msg, &which_evq, 1, ep->ceq_evq);
 	}
-	uth_mutex_lock(ep->mtx);
+	atomic_dec(&ep->nr_waiters);
+	uth_rwlock_rdlock(ep->rwlock);
 	if (get_ep_event_from_msg(ep, &msg, &events[0]))
 		nr_ret = 1;
-	uth_mutex_unlock(ep->mtx);
+	uth_rwlock_unlock(ep->rwlock);
 	/* We had to extract one message already as part of the blocking process.
 	 * We might be able to get more. */
 	nr_ret += __epoll_wait_poll(ep, events + nr_ret, maxevents - nr_ret);
@@ -9,6 +9,7 @@
 #pragma once
 
 #include <parlib/common.h>
+#include <sys/uio.h>
 
 __BEGIN_DECLS
 
@@ -229,6 +230,14 @@ enum
 	Udphdrsize=	52,	/* size of a Udphdr */
 };
 
+/*
+ *  length prefix of each message in a batched read or write, see "batch"
+ */
+enum
+{
+	Batchhdrsize=	2,
+};
+
 struct udphdr
 {
 	uint8_t	raddr[IPaddrlen];	/* V6 remote address */
@@ -296,5 +305,26 @@ int reject9(int ctl, char *dir, char *cause);
 int open_data_fd9(char *conv_dir, int flags);
 bool get_port9(char *conv_dir, char *which, uint16_t *port);
 int gettokens(char *s, char **args, int maxargs, char *sep);
+int batch9(int ctl_fd, bool on);
+bool batch_add9(void *buf, size_t buf_sz, size_t *off, const struct iovec *iov,
+                int iovcnt);
+ssize_t batch_next9(void *buf, size_t len, size_t *off, void **msg);
+
+/* Cache of cs answers; see cscache.c */
+#define CS_CACHE_TTL		30			/* seconds */
+#define CS_GEN_DIR			"/lib/ndb"
+#define CS_ANSWER_LEN		128
+
+/* A cs answer line, "/net/tcp/clone 10.0.0.1!80" */
+struct cs_answer {
+	char line[CS_ANSWER_LEN];
+};
+
+void cs_gen_path(char *buf, size_t len, const char *netdir);
+bool cs_cache_get(const char *netdir, const char *dest, struct cs_answer *ans);
+void cs_cache_put(const char *netdir, const char *dest, struct cs_answer *ans,
+                  uint64_t gen);
+uint64_t cs_cache_gen(const char *netdir);
+void cs_cache_drop(const char *netdir, const char *dest);
 
 __END_DECLS
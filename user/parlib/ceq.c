@@ -15,11 +15,12 @@
  * The ring_sz is a rough guess of the number of concurrent events.  It's not a
  * big deal what you pick, but it must be a power of 2.  Otherwise the kernel
  * will probably scribble over your memory.  If you pick a value that is too
- * small, then the ring may overflow, triggering an O(n) scan of the events
- * array (where n is the largest event ID ever seen).  You could make it the
- * nearest power of 2 >= nr_expected_events, for reasonable behavior at the
- * expense of memory.  It'll be very rare for the ring to have more entries than
- * the array has events. */
+ * small, then the ring may overflow, and we'll have to go through the overflow
+ * bitmaps.  That only touches the events that overflowed (and the summary
+ * bitmap, which is one bit per 64 events), but it's slower than the ring.  You
+ * could make it the nearest power of 2 >= nr_expected_events, for reasonable
+ * behavior at the expense of memory.  It'll be very rare for the ring to have
+ * more entries than the array has events. */
 
 #include <parlib/ceq.h>
 #include <parlib/arch/atomic.h>
@@ -30,6 +31,16 @@
 #include <stdio.h>
 #include <sys/mman.h>
 
+static unsigned int ceq_ovf_nr_words(struct ceq *ceq)
+{
+	return DIV_ROUND_UP(ceq->nr_events, CEQ_OVF_WORD_BITS);
+}
+
+static unsigned int ceq_ovf_nr_summaries(struct ceq *ceq)
+{
+	return DIV_ROUND_UP(ceq_ovf_nr_words(ceq), CEQ_OVF_WORD_BITS);
+}
+
 void ceq_init(struct ceq *ceq, uint8_t op, unsigned int nr_events,
               size_t ring_sz)
 {
@@ -43,12 +54,16 @@ void ceq_init(struct ceq *ceq, uint8_t op, unsigned int nr_events,
 	parlib_assert_perror(ceq->events != MAP_FAILED);
 	ceq->nr_events = nr_events;
 	atomic_init(&ceq->max_event_ever, 0);
+	ceq->ovf_bits = calloc(ceq_ovf_nr_words(ceq), sizeof(atomic_t));
+	ceq->ovf_summary = calloc(ceq_ovf_nr_summaries(ceq), sizeof(atomic_t));
+	assert(ceq->ovf_bits && ceq->ovf_summary);
 	assert(IS_PWR2(ring_sz));
 	ceq->ring = malloc(sizeof(int32_t) * ring_sz);
 	memset(ceq->ring, 0xff, sizeof(int32_t) * ring_sz);
 	ceq->ring_sz = ring_sz;
 	ceq->operation = op;
 	ceq->ring_overflowed = FALSE;
+	ceq->overflow_recovery = FALSE;
 	atomic_init(&ceq->prod_idx, 0);
 	atomic_init(&ceq->cons_pub_idx, 0);
 	atomic_init(&ceq->cons_pvt_idx, 0);
@@ -124,6 +139,41 @@ static bool extract_ceq_msg(struct ceq *ceq, int32_t idx, struct event_msg *msg)
 	return TRUE;
 }
 
+/* Helper, finds an overflowed event via the overflow bitmaps and extracts it,
+ * returning TRUE if there was a message.  Hold the u_lock.
+ *
+ * We clear a summary bit before looking at its word, and a word's bit before
+ * extracting the event.  The kernel sets them in the opposite order, so
+ * anything it sets while we're looking will either be seen by us, or will set
+ * the summary bit again (and ring_overflowed) for the next recovery. */
+static bool ceq_recover_one(struct ceq *ceq, struct event_msg *msg)
+{
+	unsigned long summary, bits;
+	unsigned int word_idx, bit;
+
+	for (int i = 0; i < ceq_ovf_nr_summaries(ceq); i++) {
+		while ((summary = atomic_read(&ceq->ovf_summary[i]))) {
+			word_idx = i * CEQ_OVF_WORD_BITS + __builtin_ctzl(summary);
+			__sync_fetch_and_and(&ceq->ovf_summary[i],
+			                     ~(1UL << (word_idx % CEQ_OVF_WORD_BITS)));
+			while ((bits = atomic_read(&ceq->ovf_bits[word_idx]))) {
+				bit = __builtin_ctzl(bits);
+				__sync_fetch_and_and(&ceq->ovf_bits[word_idx], ~(1UL << bit));
+				if (!extract_ceq_msg(ceq, word_idx * CEQ_OVF_WORD_BITS + bit,
+				                     msg))
+					continue;
+				/* There might be more in this word.  Make sure whoever does the
+				 * rest of the recovery looks at it again. */
+				if (atomic_read(&ceq->ovf_bits[word_idx]))
+					__sync_fetch_and_or(&ceq->ovf_summary[i],
+					                    1UL << (word_idx % CEQ_OVF_WORD_BITS));
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
+
 /* Consumer side, returns TRUE on success and fills *msg with the ev_msg.  If
  * the ceq appears empty, it will return FALSE.  Messages may have arrived after
  * we started getting that we do not receive. */
@@ -139,8 +189,9 @@ bool get_ceq_msg(struct ceq *ceq, struct event_msg *msg)
 		 * are dealing with overflow, the kernel could be producing and using
 		 * the ring, and we could have consumers consuming from the ring.
 		 *
-		 * Overall, we need to clear the overflow flag, then check every event.
-		 * If we find an event, we need to make sure the *next* consumer
+		 * Overall, we need to clear the overflow flag, then check every event
+		 * in the overflow bitmaps.  If we find one, we need to make sure the
+		 * *next* consumer
 		 * continues our recovery, hence the overflow_recovery field.  We could
 		 * do the check for recovery immediately, but that adds complexity and
 		 * there's no stated guarantee of CEQ message ordering (you don't have
@@ -155,20 +206,14 @@ bool get_ceq_msg(struct ceq *ceq, struct event_msg *msg)
 			ceq->overflow_recovery = TRUE;
 			wmb();	/* set recovery before clearing overflow */
 			ceq->ring_overflowed = FALSE;
-			ceq->last_recovered = 0;
-			wrmb(); /* clear overflowed before reading event entries */
+			wrmb(); /* clear overflowed before reading the overflow bits */
 		}
-		for (int i = ceq->last_recovered;
-		     i <= atomic_read(&ceq->max_event_ever);
-		     i++) {
-			/* Regardles of whether there's a msg here, we checked it. */
-			ceq->last_recovered++;
-			if (extract_ceq_msg(ceq, i, msg)) {
-				/* We found something.  There might be more, but a future
-				 * consumer will have to deal with it, or verify there isn't. */
-				spin_pdr_unlock((struct spin_pdr_lock*)&ceq->u_lock);
-				return TRUE;
-			}
+		if (ceq_recover_one(ceq, msg)) {
+			/* We found something.  There might be more, but a future consumer
+			 * will have to deal with it, or verify there isn't.  The bits we
+			 * haven't cleared yet remember where we were. */
+			spin_pdr_unlock((struct spin_pdr_lock*)&ceq->u_lock);
+			return TRUE;
 		}
 		ceq->overflow_recovery = FALSE;
 		/* made it to the end, looks like there was no overflow left.  there
@@ -206,4 +251,6 @@ void ceq_cleanup(struct ceq *ceq)
 {
 	munmap(ceq->events, sizeof(struct ceq_event) * ceq->nr_events);
 	free(ceq->ring);
+	free(ceq->ovf_bits);
+	free(ceq->ovf_summary);
 }
@@ -9,11 +9,18 @@
 #include <parlib/spinlock.h>
 #include <stddef.h>
 
-/* The current dymamic tls implementation uses a locked linked list
- * to find the key for a given thread. We should probably find a better way to
- * do this based on a custom lock-free hash table or something. */
-#include <parlib/spinlock.h>
+/* Each thread finds its value for a key by the key's id: the first
+ * NUM_STATIC_KEYS are in an array in the thread's dtls_data, and the rest are
+ * in an array that grows the first time the thread sets a key past the end.
+ * The values for those come from a slab.  Either way, a lookup is an index, not
+ * a search.
+ *
+ * Since the arrays are as big as the biggest id, ids get recycled: when a key
+ * is deleted and the last thread with a value for it exits, the key goes on a
+ * free list for the next dtls_key_create().  No thread has a value for it by
+ * then, so the new owner of the id starts with a clean slate. */
 #include <sys/queue.h>
+#include <string.h>
 
 /* Define some number of static keys, for which the memory containing the keys
  * and the per-thread memory for the values associated with those keys is
@@ -28,6 +35,7 @@ struct dtls_key {
 	int ref_count;
 	bool valid;
 	void (*dtor)(void *);
+	struct dtls_key *next_free;
 };
 
 /* The definition of a dtls_key list and its elements */
@@ -45,6 +53,9 @@ typedef struct dtls_data {
 	struct dtls_list list;
 	/* Memory to hold dtls values for the first NUM_STATIC_KEYS keys */
 	struct dtls_value early_values[NUM_STATIC_KEYS];
+	/* Values for the rest, indexed by id - NUM_STATIC_KEYS */
+	struct dtls_value **values;
+	size_t nr_values;
 } dtls_data_t;
 
 /* A slab of dtls keys (global to all threads) */
@@ -58,6 +69,10 @@ static __thread bool __dtls_initialized;
 static struct dtls_key static_dtls_keys[NUM_STATIC_KEYS];
 static int num_dtls_keys;
 
+/* Keys whose ids are free to reuse */
+static struct spin_pdr_lock free_keys_lock = SPINPDR_INITIALIZER;
+static struct dtls_key *free_keys;
+
 /* Initialize the slab caches for allocating dtls keys and values. */
 int dtls_cache_init(void)
 {
@@ -84,8 +99,20 @@ int dtls_cache_init(void)
 static dtls_key_t __allocate_dtls_key(void)
 {
 	dtls_key_t key;
-	int keyid = __sync_fetch_and_add(&num_dtls_keys, 1);
-
+	int keyid;
+
+	if (free_keys) {
+		spin_pdr_lock(&free_keys_lock);
+		key = free_keys;
+		if (key)
+			free_keys = key->next_free;
+		spin_pdr_unlock(&free_keys_lock);
+		if (key) {
+			key->ref_count = 1;
+			return key;
+		}
+	}
+	keyid = __sync_fetch_and_add(&num_dtls_keys, 1);
 	if (keyid < NUM_STATIC_KEYS) {
 		key = &static_dtls_keys[keyid];
 	} else {
@@ -98,31 +125,64 @@ static dtls_key_t __allocate_dtls_key(void)
 	return key;
 }
 
+/* Keys never go back to the slab, since their ids live on in every thread's
+ * values array. */
 static void __maybe_free_dtls_key(dtls_key_t key)
 {
 	int ref_count = __sync_add_and_fetch(&key->ref_count, -1);
 
-	if (ref_count == 0 && key->id >= NUM_STATIC_KEYS)
-		kmem_cache_free(__dtls_keys_cache, key);
+	if (ref_count)
+		return;
+	spin_pdr_lock(&free_keys_lock);
+	key->next_free = free_keys;
+	free_keys = key;
+	spin_pdr_unlock(&free_keys_lock);
+}
+
+/* Makes sure dtls_data's values array has a slot for idx. */
+static void __grow_dtls_values(struct dtls_data *dtls_data, size_t idx)
+{
+	size_t nr = dtls_data->nr_values ? dtls_data->nr_values * 2 : 8;
+	struct dtls_value **values, **old = dtls_data->values;
+
+	while (nr <= idx)
+		nr *= 2;
+	/* Not realloc: malloc and free can call back into the DTLS, and the old
+	 * array needs to work until the new one is in place. */
+	values = calloc(nr, sizeof(struct dtls_value*));
+	assert(values);
+	memcpy(values, old, dtls_data->nr_values * sizeof(struct dtls_value*));
+	dtls_data->values = values;
+	dtls_data->nr_values = nr;
+	free(old);
 }
 
 static struct dtls_value *__allocate_dtls_value(struct dtls_data *dtls_data,
                                                 struct dtls_key *key)
 {
 	struct dtls_value *v;
+	size_t idx;
 
 	if (key->id < NUM_STATIC_KEYS)
-		v = &dtls_data->early_values[key->id];
-	else
-		v = kmem_cache_alloc(__dtls_values_cache, 0);
+		return &dtls_data->early_values[key->id];
+	idx = key->id - NUM_STATIC_KEYS;
+	if (idx >= dtls_data->nr_values)
+		__grow_dtls_values(dtls_data, idx);
+	v = kmem_cache_alloc(__dtls_values_cache, 0);
 	assert(v);
+	dtls_data->values[idx] = v;
 	return v;
 }
 
-static void __free_dtls_value(struct dtls_value *v)
+static void __free_dtls_value(struct dtls_data *dtls_data,
+                              struct dtls_value *v)
 {
-	if (v->key->id >= NUM_STATIC_KEYS)
-		kmem_cache_free(__dtls_values_cache, v);
+	if (v->key->id < NUM_STATIC_KEYS) {
+		v->key = NULL;
+		return;
+	}
+	dtls_data->values[v->key->id - NUM_STATIC_KEYS] = NULL;
+	kmem_cache_free(__dtls_values_cache, v);
 }
 
 dtls_key_t dtls_key_create(dtls_dtor_t dtor)
@@ -146,18 +206,15 @@ static inline struct dtls_value *__get_dtls(dtls_data_t *dtls_data,
                                             dtls_key_t key)
 {
 	struct dtls_value *v;
+	size_t idx;
 
 	assert(key);
 	if (key->id < NUM_STATIC_KEYS) {
 		v = &dtls_data->early_values[key->id];
-		if (v->key != NULL)
-			return v;
-	} else {
-		TAILQ_FOREACH(v, &dtls_data->list, link)
-			if (v->key == key)
-				return v;
+		return v->key ? v : NULL;
 	}
-	return NULL;
+	idx = key->id - NUM_STATIC_KEYS;
+	return idx < dtls_data->nr_values ? dtls_data->values[idx] : NULL;
 }
 
 static inline void __set_dtls(dtls_data_t *dtls_data, dtls_key_t key,
@@ -179,6 +236,7 @@ static inline void __set_dtls(dtls_data_t *dtls_data, dtls_key_t key,
 static inline void __destroy_dtls(dtls_data_t *dtls_data)
 {
 	struct dtls_value *v, *n;
+	struct dtls_value **values;
 	dtls_key_t key;
 	const void *dtls;
 
@@ -202,15 +260,20 @@ static inline void __destroy_dtls(dtls_data_t *dtls_data)
 		n = TAILQ_NEXT(v, link);
 		TAILQ_REMOVE(&dtls_data->list, v, link);
 		/* Free both the key (which is v->key) and v *after* removing v from the
-		 * list.  It's possible that free() will call back into the DTLS (e.g.
-		 * pthread_getspecific()), and v must be off the list by then.
+		 * list and its slot.  It's possible that free() will call back into the
+		 * DTLS (e.g. pthread_getspecific()), and v must be gone by then.  We
+		 * put the key back last, since someone else could get its id.
 		 *
 		 * For a similar, hilarious bug in glibc, check out:
 		 * https://sourceware.org/bugzilla/show_bug.cgi?id=3317 */
+		__free_dtls_value(dtls_data, v);
 		__maybe_free_dtls_key(key);
-		__free_dtls_value(v);
 		v = n;
 	}
+	values = dtls_data->values;
+	dtls_data->values = NULL;
+	dtls_data->nr_values = 0;
+	free(values);
 }
 
 void set_dtls(dtls_key_t key, const void *dtls)
@@ -0,0 +1,85 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Syscall-free eventfd signalling, see parlib/efd_shm.h and ros/eventfd.h.
+ *
+ * The kernel bumps nr_readers or nr_writers before it checks the counter, and
+ * we CAS the counter (a full barrier) before we check them.  So either the
+ * kernel sees our change, or we see its waiter and ring the doorbell. */
+
+#include <parlib/efd_shm.h>
+#include <parlib/arch/arch.h>
+#include <parlib/arch/atomic.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+struct efd_shm *efd_shm_map(int efd)
+{
+	void *va;
+
+	va = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, efd, 0);
+	if (va == MAP_FAILED)
+		return NULL;
+	return va;
+}
+
+void efd_shm_unmap(struct efd_shm *shm)
+{
+	munmap(shm, PGSIZE);
+}
+
+static int efd_doorbell(int efd)
+{
+	return eventfd_write(efd, 0);
+}
+
+/* Adds value to the counter.  If that would go past the max, this writes to
+ * the FD instead, which blocks or fails with EAGAIN like a normal write. */
+int efd_shm_write(int efd, struct efd_shm *shm, eventfd_t value)
+{
+	atomic_t *counter = (atomic_t*)&shm->counter;
+	uint64_t old;
+
+	if (value == (eventfd_t)-1) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!value)
+		return 0;
+	do {
+		old = atomic_read(counter);
+		if (old > EFD_SHM_MAX_VAL || value > EFD_SHM_MAX_VAL - old)
+			return eventfd_write(efd, value);
+	} while (!atomic_cas(counter, old, old + value));
+	if (ACCESS_ONCE(shm->nr_readers))
+		return efd_doorbell(efd);
+	return 0;
+}
+
+/* Takes the count (or 1, for EFD_SEMAPHORE) without blocking.  Returns FALSE if
+ * the counter was 0. */
+bool efd_shm_try_read(int efd, struct efd_shm *shm, eventfd_t *value)
+{
+	atomic_t *counter = (atomic_t*)&shm->counter;
+	uint64_t old, new;
+
+	do {
+		old = atomic_read(counter);
+		if (!old)
+			return FALSE;
+		new = shm->flags & EFD_SHM_SEMAPHORE ? old - 1 : 0;
+	} while (!atomic_cas(counter, old, new));
+	*value = old - new;
+	if (ACCESS_ONCE(shm->nr_writers))
+		efd_doorbell(efd);
+	return TRUE;
+}
+
+/* Like eventfd_read(), but only traps if the counter is 0.  Then it reads the
+ * FD, which sleeps (or fails with EAGAIN, if the FD is O_NONBLOCK). */
+int efd_shm_read(int efd, struct efd_shm *shm, eventfd_t *value)
+{
+	if (efd_shm_try_read(efd, shm, value))
+		return 0;
+	return eventfd_read(efd, value);
+}
@@ -23,24 +23,45 @@ bool evbitmap_is_empty(struct evbitmap *evbm)
 	return !evbm->check_bits;
 }
 
+/* Returns the first set bit, or -1.  Skips empty words with one load, then
+ * finds the byte within the word, so it doesn't care about endianness. */
+static int evbitmap_find_bit(struct evbitmap *evbm)
+{
+	unsigned long *words = (unsigned long*)evbm->bitmap;
+	uint8_t *byte;
+
+	for (int i = 0; i < EVBITMAP_NR_WORDS; i++) {
+		if (!ACCESS_ONCE(words[i]))
+			continue;
+		byte = (uint8_t*)&words[i];
+		for (int j = 0; j < sizeof(unsigned long); j++) {
+			if (ACCESS_ONCE(byte[j]))
+				return (i * sizeof(unsigned long) + j) * 8 +
+				       __builtin_ctz(byte[j]);
+		}
+	}
+	return -1;
+}
+
 bool get_evbitmap_msg(struct evbitmap *evbm, struct event_msg *ev_msg)
 {
+	int bit;
+
 	if (evbitmap_is_empty(evbm))
 		return FALSE;
 	while (1) {
-		for (int i = 0; i < MAX_NR_EVENT; i++) {
-			if (GET_BITMASK_BIT(evbm->bitmap, i)) {
-				CLR_BITMASK_BIT_ATOMIC(evbm->bitmap, i);
-				/* bit messages are empty except for the type. */
-				memset(ev_msg, 0, sizeof(struct event_msg));
-				ev_msg->ev_type = i;
-				return TRUE;
-			}
+		bit = evbitmap_find_bit(evbm);
+		if (bit >= 0) {
+			CLR_BITMASK_BIT_ATOMIC(evbm->bitmap, bit);
+			/* bit messages are empty except for the type. */
+			memset(ev_msg, 0, sizeof(struct event_msg));
+			ev_msg->ev_type = bit;
+			return TRUE;
 		}
 		/* If we made it here, then the bitmap might be empty. */
 		evbm->check_bits = FALSE;
 		wrmb();	/* check_bits written before we check for it being clear */
-		if (BITMASK_IS_CLEAR(evbm->bitmap, MAX_NR_EVENT))
+		if (evbitmap_find_bit(evbm) < 0)
 			return FALSE;
 		cmb();
 		evbm->check_bits = TRUE;
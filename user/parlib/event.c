@@ -323,6 +323,30 @@ bool extract_one_mbox_msg(struct event_mbox *ev_mbox, struct event_msg *ev_msg)
 	}
 }
 
+/* Attempts to extract up to max messages from an mbox, copying them into msgs.
+ * Returns how many we got.  UCQs hand out a run of slots in one shot; the other
+ * mboxes go one at a time. */
+unsigned int extract_mbox_msgs(struct event_mbox *ev_mbox,
+                               struct event_msg *msgs, unsigned int max)
+{
+	unsigned int nr = 0;
+
+	if (ev_mbox->type == EV_MBOX_UCQ) {
+		while (nr < max) {
+			unsigned int got = get_ucq_msgs(&ev_mbox->ucq, msgs + nr,
+			                                max - nr);
+
+			if (!got)
+				break;
+			nr += got;
+		}
+		return nr;
+	}
+	while (nr < max && extract_one_mbox_msg(ev_mbox, &msgs[nr]))
+		nr++;
+	return nr;
+}
+
 /* Attempts to handle a message.  Returns 1 if we dequeued a msg, 0 o/w. */
 int handle_one_mbox_msg(struct event_mbox *ev_mbox)
 {
@@ -353,6 +377,26 @@ int handle_mbox(struct event_mbox *ev_mbox)
 	return retval;
 }
 
+/* Handles an mbox like handle_mbox(), but hands handler arrays of up to
+ * EV_MBOX_BATCH messages at a time, in the order they came out of the mbox,
+ * instead of running the per-type ev_handlers once per message.  The handler
+ * must return: we already pulled the messages out of the mbox, so anything it
+ * doesn't get to is lost.  Returns 1 if we handled something, 0 o/w. */
+int handle_mbox_batch(struct event_mbox *ev_mbox, handle_event_batch_t handler,
+                      void *data)
+{
+	struct event_msg msgs[EV_MBOX_BATCH];
+	unsigned int nr;
+	int retval = 0;
+
+	assert(ev_mbox);
+	while ((nr = extract_mbox_msgs(ev_mbox, msgs, EV_MBOX_BATCH))) {
+		handler(msgs, nr, data);
+		retval = 1;
+	}
+	return retval;
+}
+
 /* Empty if the UCQ is empty and the bits don't need checked */
 bool mbox_is_empty(struct event_mbox *ev_mbox)
 {
@@ -414,6 +458,13 @@ int handle_events(uint32_t vcoreid)
 void handle_event_q(struct event_queue *ev_q)
 {
 	printd("[event] handling ev_q %08p on vcore %d\n", ev_q, vcore_id());
+	/* The kernel won't alert us again for a COALESCE ev_q til we clear this.
+	 * Clear it before draining, so we don't miss anything that comes in after
+	 * we're done (same as handle_ev_ev() does for INDIRs). */
+	if (ev_q->ev_flags & EVENT_COALESCE) {
+		ev_q->ev_alert_pending = FALSE;
+		wrmb();	/* the pending write must happen before we look in the mbox */
+	}
 	/* If the program wants to handle the ev_q on its own: */
 	if (ev_q->ev_handler) {
 		/* Remember this can't block or page fault */
@@ -606,10 +657,12 @@ struct uth_sleep_ctlr {
 /* Attaches to an event_queue (ev_udata), tracks the uthreads for this evq */
 struct evq_wakeup_ctlr {
 	/* If we ever use a sync_obj, that would replace waiters.  But also note
-	 * that we want a pointer to something other than the uthread, and currently
-	 * we also wake all threads - there's no scheduling decision. */
+	 * that we want a pointer to something other than the uthread, and by
+	 * default we also wake all threads - there's no scheduling decision. */
 	struct wait_link_tailq		waiters;
 	struct spin_pdr_lock		lock;
+	bool						wake_one;
+	struct event_queue			*ev_q;
 };
 
 /* Up to MxN of these, N of them per uthread. */
@@ -667,6 +720,21 @@ void evq_wakeup_handler(struct event_queue *ev_q)
 	struct evq_wait_link *i;
 	assert(ectlr);
 	spin_pdr_lock(&ectlr->lock);
+	if (ectlr->wake_one) {
+		/* Wake the head, and move it to the back so the next wakeup goes to
+		 * someone else.  unlink_ectlr() passes the wakeup along if the head
+		 * didn't drain the mbox. */
+		i = TAILQ_FIRST(&ectlr->waiters);
+		if (i) {
+			TAILQ_REMOVE(&ectlr->waiters, i, link_evq);
+			TAILQ_INSERT_TAIL(&ectlr->waiters, i, link_evq);
+			i->uth_ctlr->check_evqs = TRUE;
+			cmb();	/* order check write before poke (poke has atomic) */
+			poke(&i->uth_ctlr->poker, i->uth_ctlr);
+		}
+		spin_pdr_unlock(&ectlr->lock);
+		return;
+	}
 	/* Note we wake up all sleepers, even though only one is likely to get the
 	 * message.  See the notes in unlink_ectlr() for more info. */
 	TAILQ_FOREACH(i, &ectlr->waiters, link_evq) {
@@ -677,17 +745,32 @@ void evq_wakeup_handler(struct event_queue *ev_q)
 	spin_pdr_unlock(&ectlr->lock);
 }
 
-/* Helper, attaches a wakeup controller to the event queue. */
-void evq_attach_wakeup_ctlr(struct event_queue *ev_q)
+static void __evq_attach_wakeup_ctlr(struct event_queue *ev_q, bool wake_one)
 {
 	struct evq_wakeup_ctlr *ectlr = malloc(sizeof(struct evq_wakeup_ctlr));
 	memset(ectlr, 0, sizeof(struct evq_wakeup_ctlr));
 	spin_pdr_init(&ectlr->lock);
 	TAILQ_INIT(&ectlr->waiters);
+	ectlr->wake_one = wake_one;
+	ectlr->ev_q = ev_q;
 	ev_q->ev_udata = ectlr;
 	ev_q->ev_handler = evq_wakeup_handler;
 }
 
+/* Helper, attaches a wakeup controller to the event queue. */
+void evq_attach_wakeup_ctlr(struct event_queue *ev_q)
+{
+	__evq_attach_wakeup_ctlr(ev_q, FALSE);
+}
+
+/* Like evq_attach_wakeup_ctlr(), but each activity wakes only one of the
+ * uthreads blocked on ev_q.  Use it when any one of them can drain the evq, and
+ * waking the rest would just have them fight over it. */
+void evq_attach_wakeup_ctlr_excl(struct event_queue *ev_q)
+{
+	__evq_attach_wakeup_ctlr(ev_q, TRUE);
+}
+
 void evq_remove_wakeup_ctlr(struct event_queue *ev_q)
 {
 	free(ev_q->ev_udata);
@@ -723,9 +806,16 @@ static void link_uctlr_ectlr(struct uth_sleep_ctlr *uctlr,
 static void unlink_ectlr(struct evq_wait_link *link)
 {
 	struct evq_wakeup_ctlr *ectlr = link->evq_ctlr;
+	bool pass_it_on;
+
 	spin_pdr_lock(&ectlr->lock);
 	TAILQ_REMOVE(&ectlr->waiters, link, link_evq);
+	pass_it_on = ectlr->wake_one && !TAILQ_EMPTY(&ectlr->waiters);
 	spin_pdr_unlock(&ectlr->lock);
+	/* This is the single wake up case from above: we may have been the one
+	 * woken, and we're leaving messages behind. */
+	if (pass_it_on && !mbox_is_empty(ectlr->ev_q->ev_mbox))
+		evq_wakeup_handler(ectlr->ev_q);
 }
 
 /* Helper: polls all evqs once and extracts the first message available.  The
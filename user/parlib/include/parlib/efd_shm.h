@@ -0,0 +1,31 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Syscall-free eventfd signalling.
+ *
+ * Map an eventfd's counter with efd_shm_map(), and efd_shm_write() and
+ * efd_shm_try_read() work on it with atomics.  They only trap into the kernel
+ * when someone is waiting on the other side: a reader asleep in read() or
+ * efd_shm_read(), or anyone who tapped the FD (epoll included).  Taps want to
+ * hear about every change, so a tapped eventfd still costs a syscall per
+ * signal, but its semantics don't change.
+ *
+ * Processes that share an eventfd (e.g. through #srv or fork) can each map it,
+ * and both ends can mix these with plain eventfd_read() and eventfd_write(). */
+
+#pragma once
+
+#include <parlib/common.h>
+#include <ros/eventfd.h>
+#include <sys/eventfd.h>
+
+__BEGIN_DECLS
+
+struct efd_shm *efd_shm_map(int efd);
+void efd_shm_unmap(struct efd_shm *shm);
+
+int efd_shm_write(int efd, struct efd_shm *shm, eventfd_t value);
+bool efd_shm_try_read(int efd, struct efd_shm *shm, eventfd_t *value);
+int efd_shm_read(int efd, struct efd_shm *shm, eventfd_t *value);
+
+__END_DECLS
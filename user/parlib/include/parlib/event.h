@@ -53,6 +53,11 @@ int register_ev_handler(unsigned int ev_type, handle_event_t handler,
 int deregister_ev_handler(unsigned int ev_type, handle_event_t handler,
                           void *data);
 
+/* Batch handlers get an array of messages from one mbox.  They must return. */
+typedef void (*handle_event_batch_t)(struct event_msg *msgs, unsigned int nr,
+                                     void *data);
+#define EV_MBOX_BATCH			16
+
 /* Default event handlers */
 void handle_ev_ev(struct event_msg *ev_msg, unsigned int ev_type, void *data);
 
@@ -61,6 +66,10 @@ void handle_event_q(struct event_queue *ev_q);
 bool extract_one_mbox_msg(struct event_mbox *ev_mbox, struct event_msg *ev_msg);
 int handle_one_mbox_msg(struct event_mbox *ev_mbox);
 int handle_mbox(struct event_mbox *ev_mbox);
+unsigned int extract_mbox_msgs(struct event_mbox *ev_mbox,
+                               struct event_msg *msgs, unsigned int max);
+int handle_mbox_batch(struct event_mbox *ev_mbox, handle_event_batch_t handler,
+                      void *data);
 bool mbox_is_empty(struct event_mbox *ev_mbox);
 void send_self_vc_msg(struct event_msg *ev_msg);
 void handle_vcpd_mbox(uint32_t rem_vcoreid);
@@ -77,6 +86,7 @@ void print_ev_msg(struct event_msg *msg);
  * event queues.  The structs and details are buried in event.c.  We can move
  * some of them here if users need greater control over their evqs. */
 void evq_attach_wakeup_ctlr(struct event_queue *ev_q);
+void evq_attach_wakeup_ctlr_excl(struct event_queue *ev_q);
 void evq_remove_wakeup_ctlr(struct event_queue *ev_q);
 /* Handler, attaches to the ev_q.  Most people won't need this directly. */
 void evq_wakeup_handler(struct event_queue *ev_q);
@@ -58,6 +58,7 @@ int         sys_poke_ksched(int pid, unsigned int res_type);
 int         sys_abort_sysc(struct syscall *sysc);
 int         sys_abort_sysc_fd(int fd);
 int         sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs);
+int         sys_mbind(void *addr, size_t len, int mode, unsigned long nodes);
 
 void		syscall_async(struct syscall *sysc, unsigned long num, ...);
 void        syscall_async_evq(struct syscall *sysc, struct event_queue *evq,
@@ -0,0 +1,16 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Cryptographically secure random bytes without a syscall.  Each vcore has a
+ * ChaCha20 generator, seeded from procinfo and periodically from #random. */
+
+#pragma once
+
+#include <parlib/common.h>
+
+__BEGIN_DECLS
+
+void parlib_random_bytes(void *buf, size_t len);
+uint64_t parlib_random_u64(void);
+
+__END_DECLS
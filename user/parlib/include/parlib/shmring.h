@@ -0,0 +1,41 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Shared memory message rings between processes.
+ *
+ * A ring is a #tmpfs file that both sides mmap, plus an #eventfd doorbell.
+ * Both are posted in #srv, as NAME and NAME.bell, so any process that can see
+ * #srv can attach by name.  Messages are copied into fixed size slots; a ring
+ * has one consumer and either one producer (SPSC) or many (SHMRING_MPSC).
+ *
+ * Producers only ring the doorbell when the consumer said it was going idle,
+ * so a busy consumer never costs a producer a syscall.  shmring_recv_wait()
+ * does that for you and sleeps on the doorbell.  If you'd rather get the
+ * doorbell as an event (say on a CEQ, along with your other FDs), tap
+ * shmring_bell_fd() for FDTAP_FILT_READABLE, then drain the ring and call
+ * shmring_arm() before waiting for the event.  Drain again if arm fails. */
+
+#pragma once
+
+#include <parlib/common.h>
+
+__BEGIN_DECLS
+
+#define SHMRING_MPSC			(1 << 0)
+
+struct shmring;
+
+struct shmring *shmring_create(const char *name, size_t slot_size,
+                               size_t nr_slots, int flags);
+struct shmring *shmring_attach(const char *name);
+void shmring_close(struct shmring *sr);
+int shmring_unlink(const char *name);
+
+int shmring_send(struct shmring *sr, const void *buf, size_t len);
+ssize_t shmring_recv(struct shmring *sr, void *buf, size_t len);
+ssize_t shmring_recv_wait(struct shmring *sr, void *buf, size_t len);
+bool shmring_arm(struct shmring *sr);
+int shmring_bell_fd(struct shmring *sr);
+size_t shmring_slot_size(struct shmring *sr);
+
+__END_DECLS
@@ -25,6 +25,10 @@
  * pointer, and then pass over that data when we return the actual object's
  * address.  This also might fuck with alignment.
  *
+ * In front of the slabs, each cache has per-vcore magazines and a depot of
+ * spare magazines, like the kernel's.  A vcore's magazines are protected by
+ * disabling notifs, not by a lock.
+ *
  * Ported directly from the kernel's slab allocator. */
 
 #pragma once
@@ -33,6 +37,7 @@
 #include <ros/arch/mmu.h>
 #include <sys/queue.h>
 #include <parlib/arch/atomic.h>
+#include <parlib/arch/arch.h>
 #include <parlib/spinlock.h>
 
 __BEGIN_DECLS
@@ -42,6 +47,37 @@ __BEGIN_DECLS
 #define NUM_BUF_PER_SLAB 8
 #define SLAB_LARGE_CUTOFF (PGSIZE / NUM_BUF_PER_SLAB)
 
+#define KMC_MAG_MIN_SZ 8
+#define KMC_MAG_MAX_SZ 62		/* chosen for mag size and caching */
+
+struct kmem_magazine {
+	SLIST_ENTRY(kmem_magazine)	link;
+	unsigned int				nr_rounds;
+	void						*rounds[KMC_MAG_MAX_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+SLIST_HEAD(kmem_mag_slist, kmem_magazine);
+
+/* One per vcore.  Only touched by its vcore, with notifs disabled. */
+struct kmem_pcpu_cache {
+	unsigned int				magsize;
+	struct kmem_magazine		*loaded;
+	struct kmem_magazine		*prev;
+	size_t						nr_allocs_ever;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct kmem_depot {
+	struct spin_pdr_lock		lock;
+	struct kmem_mag_slist		not_empty;
+	struct kmem_mag_slist		empty;
+	unsigned int				magsize;
+	unsigned int				nr_empty;
+	unsigned int				nr_not_empty;
+	unsigned int				busy_count;
+	uint64_t					busy_start;
+	uint64_t					last_contention;
+	size_t						nr_contended;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 struct kmem_slab;
 
 /* Control block for buffers for large-object slabs */
@@ -71,6 +107,8 @@ TAILQ_HEAD(kmem_slab_list, kmem_slab);
 /* Actual cache */
 struct kmem_cache {
 	SLIST_ENTRY(kmem_cache) link;
+	struct kmem_pcpu_cache *pcpu_caches;
+	struct kmem_depot depot;
 	struct spin_pdr_lock cache_lock;
 	const char *name;
 	size_t obj_size;
@@ -0,0 +1,26 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Syscall submission ring for MCPs.  Queue syscalls without trapping; the
+ * kernel's pollers run them and complete them like any async syscall (SC_DONE,
+ * and an event if you give them an ev_q).  For lots of I/O, point them all at
+ * one ev_q with a UCQ mbox and drain that.
+ *
+ * Only I/O-ish syscalls are allowed (see kern/src/sysc_ring.c); the rest fail
+ * with ENOSYS.  SCPs can't use the ring. */
+
+#pragma once
+
+#include <parlib/common.h>
+#include <ros/syscall.h>
+#include <ros/sysc_ring.h>
+#include <ros/event.h>
+
+__BEGIN_DECLS
+
+int sys_sysc_ring_kick(void);
+int sysc_ring_submit(struct syscall *sysc);
+int syscall_ring_evq(struct syscall *sysc, struct event_queue *evq,
+                     unsigned long num, ...);
+
+__END_DECLS
@@ -240,12 +240,32 @@ typedef struct uth_semaphore uth_mutex_t;
 typedef struct uth_recurse_mutex uth_recurse_mutex_t;
 typedef struct uth_cond_var uth_cond_var_t;
 typedef struct uth_rwlock uth_rwlock_t;
+typedef struct uth_brwlock uth_brwlock_t;
+typedef struct uth_seqlock uth_seqlock_t;
+typedef struct uth_barrier uth_barrier_t;
+
+/* Build parlib and its users with UTH_MUTEX_STATS to track contention on
+ * every mutex.  It changes the size of the struct, so it's all or nothing. */
+struct uth_mutex_stats {
+	uint64_t					nr_locks;
+	uint64_t					nr_contended;
+	uint64_t					nr_spin_acquires;
+	uint64_t					nr_blocks;
+	uint64_t					spin_tsc;
+};
 
 struct uth_semaphore {
 	parlib_once_t				once_ctl;
 	unsigned int				count;
 	struct spin_pdr_lock		lock;
 	uth_sync_t					sync_obj;
+	/* Mutexes only, for adaptive spinning */
+	struct uthread				*owner;
+	uint64_t					lock_tsc;
+	uint64_t					hold_tsc;
+#ifdef UTH_MUTEX_STATS
+	struct uth_mutex_stats		stats;
+#endif
 };
 #define UTH_SEMAPHORE_INIT(n) { PARLIB_ONCE_INIT, (n) }
 #define UTH_MUTEX_INIT { PARLIB_ONCE_INIT }
@@ -275,6 +295,41 @@ struct uth_rwlock {
 };
 #define UTH_RWLOCK_INIT { PARLIB_ONCE_INIT }
 
+/* Big-reader rwlock.  Readers only touch their vcore's counter, so they scale,
+ * and writers pay for it by checking every vcore's counter. */
+struct uth_brw_rdcount;
+
+struct uth_brwlock {
+	parlib_once_t				once_ctl;
+	struct uth_brw_rdcount		*rdcounts;
+	bool						has_writer;
+	struct spin_pdr_lock		lock;
+	uth_sync_t					readers;
+	uth_sync_t					writers;
+	uth_sync_t					drainer;
+};
+#define UTH_BRWLOCK_INIT { PARLIB_ONCE_INIT }
+
+/* Writers are serialized by a mutex, so they can block.  Readers retry. */
+struct uth_seqlock {
+	seq_ctr_t					seq;
+	uth_mutex_t					w_mtx;
+};
+#define UTH_SEQLOCK_INIT { SEQCTR_INITIALIZER, UTH_MUTEX_INIT }
+
+/* Combining tree barrier.  Arrivals only contend with the few others at their
+ * node in the tree, and nodes are picked by pcore. */
+struct uth_barrier_node;
+
+struct uth_barrier {
+	unsigned int				nr_threads;
+	unsigned int				nr_leaves;
+	struct uth_barrier_node		*nodes;
+	unsigned int				episode;
+	struct spin_pdr_lock		lock;
+	uth_sync_t					waiters;
+};
+
 void uth_semaphore_init(uth_semaphore_t *sem, unsigned int count);
 void uth_semaphore_destroy(uth_semaphore_t *sem);
 uth_semaphore_t *uth_semaphore_alloc(unsigned int count);
@@ -293,6 +348,9 @@ bool uth_mutex_timed_lock(uth_mutex_t *m, const struct timespec *abs_timeout);
 void uth_mutex_lock(uth_mutex_t *m);
 bool uth_mutex_trylock(uth_mutex_t *m);
 void uth_mutex_unlock(uth_mutex_t *m);
+#ifdef UTH_MUTEX_STATS
+void uth_mutex_get_stats(uth_mutex_t *m, struct uth_mutex_stats *stats);
+#endif
 
 void uth_recurse_mutex_init(uth_recurse_mutex_t *r_m);
 void uth_recurse_mutex_destroy(uth_recurse_mutex_t *r_m);
@@ -331,6 +389,35 @@ void uth_rwlock_wrlock(uth_rwlock_t *rwl);
 bool uth_rwlock_try_wrlock(uth_rwlock_t *rwl);
 void uth_rwlock_unlock(uth_rwlock_t *rwl);
 
+void uth_brwlock_init(uth_brwlock_t *brw);
+void uth_brwlock_destroy(uth_brwlock_t *brw);
+uth_brwlock_t *uth_brwlock_alloc(void);
+void uth_brwlock_free(uth_brwlock_t *brw);
+void uth_brwlock_rdlock(uth_brwlock_t *brw);
+bool uth_brwlock_try_rdlock(uth_brwlock_t *brw);
+void uth_brwlock_rdunlock(uth_brwlock_t *brw);
+void uth_brwlock_wrlock(uth_brwlock_t *brw);
+bool uth_brwlock_try_wrlock(uth_brwlock_t *brw);
+void uth_brwlock_wrunlock(uth_brwlock_t *brw);
+
+/* Returns TRUE for exactly one of the threads, like
+ * PTHREAD_BARRIER_SERIAL_THREAD. */
+void uth_barrier_init(uth_barrier_t *b, unsigned int nr_threads);
+void uth_barrier_destroy(uth_barrier_t *b);
+bool uth_barrier_wait(uth_barrier_t *b);
+
+/* Ex:
+ * do {
+ * 		seq = uth_seqlock_read_begin(sl);
+ * 		read_data_whatever();
+ * } while (uth_seqlock_read_retry(sl, seq));
+ */
+void uth_seqlock_init(uth_seqlock_t *sl);
+seq_ctr_t uth_seqlock_read_begin(uth_seqlock_t *sl);
+bool uth_seqlock_read_retry(uth_seqlock_t *sl, seq_ctr_t seq);
+void uth_seqlock_write_lock(uth_seqlock_t *sl);
+void uth_seqlock_write_unlock(uth_seqlock_t *sl);
+
 /* Called by gcc to see if we are multithreaded. */
 bool uth_2ls_is_multithreaded(void);
 
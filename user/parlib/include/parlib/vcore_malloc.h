@@ -0,0 +1,35 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Per-vcore malloc.  glibc picks its arenas by thread, but our uthreads hop
+ * between vcores, so an MCP's memory gets scattered across arenas and the
+ * arena locks bounce between vcores.  Once you call vcore_malloc_init(),
+ * malloc(), free() and friends go to size-class slab caches instead.  Each
+ * cache has per-vcore magazines (see parlib/slab.h), which are our thread
+ * caches: the fast paths only touch the calling vcore's magazines.  Memory
+ * freed on a different vcore than it was allocated on goes into the freeing
+ * vcore's magazines, and it gets back to the other vcores a magazine at a
+ * time, through the depot.
+ *
+ * Allocations bigger than the largest size class are mmapped.
+ *
+ * This is built on glibc's malloc hooks, which can't be chained, so it is one
+ * way: there's no going back to glibc's malloc.  Call it early, before you have
+ * other threads.  glibc can't free memory it doesn't know about, and we can't
+ * call glibc's free() from within the hook, so blocks that glibc allocated
+ * before vcore_malloc_init() are never reused once they are freed.
+ * malloc_usable_size() and the other glibc introspection functions don't know
+ * about our blocks.
+ *
+ * Pthread programs can use pthread_use_vcore_malloc(). */
+
+#pragma once
+
+#include <parlib/common.h>
+
+__BEGIN_DECLS
+
+void vcore_malloc_init(void);
+bool vcore_malloc_enabled(void);
+
+__END_DECLS
@@ -10,7 +10,11 @@
 #include <parlib/spinlock.h>
 #include <parlib/alarm.h>
 #include <parlib/assert.h>
+#include <parlib/timing.h>
+#include <parlib/arch/arch.h>
 #include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
 
 struct timeout_blob {
 	bool						timed_out;
@@ -62,6 +66,11 @@ static void __uth_semaphore_init(void *arg)
 
 	spin_pdr_init(&sem->lock);
 	__uth_sync_init(&sem->sync_obj);
+	sem->owner = NULL;
+	sem->hold_tsc = 0;
+#ifdef UTH_MUTEX_STATS
+	memset(&sem->stats, 0, sizeof(sem->stats));
+#endif
 	/* If we used a static initializer for a semaphore, count is already set.
 	 * o/w it will be set by _alloc() or _init() (via uth_semaphore_init()). */
 }
@@ -221,29 +230,127 @@ void uth_mutex_free(uth_mutex_t *mtx)
 	uth_semaphore_free(mtx);
 }
 
+/* Adaptive spinning.  Blocking and restarting a uthread costs a trip through
+ * vcore context and the 2LS, which is a lot more than most critical sections.
+ * So if the lockholder is running on a vcore, we spin for a while, hoping it
+ * unlocks soon.  'A while' is twice the mutex's average hold time, bounded
+ * below so we bother at all and above by what a block/wakeup would cost us.  If
+ * the owner isn't running (blocked on a syscall, preempted, etc), spinning
+ * won't help.
+ *
+ * We peek at the owner's uthread without any protection.  If it unlocked and
+ * exited in the meantime, we're reading the state of a freed (but still
+ * mapped) uthread, and the worst that happens is we spin or block when we
+ * shouldn't have. */
+#define UTH_MTX_SPIN_MIN_NSEC		500
+#define UTH_MTX_SPIN_MAX_NSEC		20000
+
+static uint64_t mtx_spin_min_tsc, mtx_spin_max_tsc;
+
+static void __uth_mutex_note_lock(uth_mutex_t *mtx, bool contended,
+                                  bool spun, uint64_t spin_tsc)
+{
+	mtx->owner = current_uthread;
+	mtx->lock_tsc = read_tsc();
+#ifdef UTH_MUTEX_STATS
+	/* We hold the lock, which protects the stats */
+	mtx->stats.nr_locks++;
+	if (contended)
+		mtx->stats.nr_contended++;
+	if (spun)
+		mtx->stats.nr_spin_acquires++;
+	else if (contended)
+		mtx->stats.nr_blocks++;
+	mtx->stats.spin_tsc += spin_tsc;
+#endif
+}
+
+/* Returns TRUE if we got the lock by spinning.  *spin_tsc is how long we
+ * spun. */
+static bool __uth_mutex_spin(uth_mutex_t *mtx, uint64_t *spin_tsc)
+{
+	struct uthread *owner;
+	uint64_t start, limit, now;
+
+	*spin_tsc = 0;
+	if (!in_multi_mode() || num_vcores() < 2)
+		return FALSE;
+	if (!mtx_spin_max_tsc) {
+		mtx_spin_min_tsc = nsec2tsc(UTH_MTX_SPIN_MIN_NSEC);
+		mtx_spin_max_tsc = nsec2tsc(UTH_MTX_SPIN_MAX_NSEC);
+	}
+	limit = MIN(MAX(ACCESS_ONCE(mtx->hold_tsc) * 2, mtx_spin_min_tsc),
+	            mtx_spin_max_tsc);
+	start = read_tsc();
+	do {
+		if (ACCESS_ONCE(mtx->count) && uth_semaphore_trydown(mtx)) {
+			*spin_tsc = read_tsc() - start;
+			return TRUE;
+		}
+		/* No owner with a zero count is an unlock handing off to a waiter,
+		 * which will be running soon. */
+		owner = ACCESS_ONCE(mtx->owner);
+		if (owner && ACCESS_ONCE(owner->state) != UT_RUNNING)
+			break;
+		cpu_relax();
+		now = read_tsc();
+	} while (now - start < limit);
+	*spin_tsc = read_tsc() - start;
+	return FALSE;
+}
+
 bool uth_mutex_timed_lock(uth_mutex_t *mtx, const struct timespec *abs_timeout)
 {
+	uint64_t spin_tsc;
+
+	assert_can_block();
 	parlib_run_once(&mtx->once_ctl, __uth_mutex_init, mtx);
-	return uth_semaphore_timed_down(mtx, abs_timeout);
+	if (uth_semaphore_trydown(mtx)) {
+		__uth_mutex_note_lock(mtx, FALSE, FALSE, 0);
+		return TRUE;
+	}
+	if (__uth_mutex_spin(mtx, &spin_tsc)) {
+		__uth_mutex_note_lock(mtx, TRUE, TRUE, spin_tsc);
+		return TRUE;
+	}
+	if (!uth_semaphore_timed_down(mtx, abs_timeout))
+		return FALSE;
+	__uth_mutex_note_lock(mtx, TRUE, FALSE, spin_tsc);
+	return TRUE;
 }
 
 void uth_mutex_lock(uth_mutex_t *mtx)
 {
-	parlib_run_once(&mtx->once_ctl, __uth_mutex_init, mtx);
-	uth_semaphore_down(mtx);
+	uth_mutex_timed_lock(mtx, NULL);
 }
 
 bool uth_mutex_trylock(uth_mutex_t *mtx)
 {
 	parlib_run_once(&mtx->once_ctl, __uth_mutex_init, mtx);
-	return uth_semaphore_trydown(mtx);
+	if (!uth_semaphore_trydown(mtx))
+		return FALSE;
+	__uth_mutex_note_lock(mtx, FALSE, FALSE, 0);
+	return TRUE;
 }
 
 void uth_mutex_unlock(uth_mutex_t *mtx)
 {
+	uint64_t held = read_tsc() - mtx->lock_tsc;
+
+	/* Only the owner writes these, so no need for atomics.  The hold time is a
+	 * moving average, weighted 1/8 to the latest. */
+	mtx->hold_tsc = mtx->hold_tsc - mtx->hold_tsc / 8 + held / 8;
+	mtx->owner = NULL;
 	uth_semaphore_up(mtx);
 }
 
+#ifdef UTH_MUTEX_STATS
+void uth_mutex_get_stats(uth_mutex_t *mtx, struct uth_mutex_stats *stats)
+{
+	*stats = mtx->stats;
+}
+#endif
+
 /************** Recursive mutexes **************/
 
 static void __uth_recurse_mutex_init(void *arg)
@@ -731,6 +838,474 @@ void uth_rwlock_unlock(uth_rwlock_t *rwl)
 		uthread_runnable(i);
 }
 
+/************** Big-reader RW Locks **************/
+
+/* Readers bump their vcore's counter, then check for a writer.  Writers set
+ * has_writer, then wait for the sum of the counters to hit 0.  Either the
+ * reader sees the writer or the writer sees the reader (both sides have an mb
+ * between the write and the read).  Readers never write a shared cache line
+ * unless there's a writer around.
+ *
+ * A reader can migrate while it holds the lock, so it might unlock on a
+ * different vcore than it locked on.  That's fine; only the sum matters, and
+ * individual counters can go negative.  We do need atomics for the counters,
+ * but they are all local.
+ *
+ * Writers are preferred: once a writer sets has_writer, new readers block.  The
+ * writer blocks on 'drainer' until the old readers leave, and the last one out
+ * wakes it. */
+struct uth_brw_rdcount {
+	atomic_t					nr;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static void __uth_brwlock_init(void *arg)
+{
+	struct uth_brwlock *brw = (struct uth_brwlock*)arg;
+	int ret;
+
+	ret = posix_memalign((void**)&brw->rdcounts, ARCH_CL_SIZE,
+	                     sizeof(struct uth_brw_rdcount) * max_vcores());
+	assert(!ret);
+	memset(brw->rdcounts, 0, sizeof(struct uth_brw_rdcount) * max_vcores());
+	brw->has_writer = FALSE;
+	spin_pdr_init(&brw->lock);
+	__uth_sync_init(&brw->readers);
+	__uth_sync_init(&brw->writers);
+	__uth_sync_init(&brw->drainer);
+}
+
+void uth_brwlock_init(uth_brwlock_t *brw)
+{
+	__uth_brwlock_init(brw);
+	parlib_set_ran_once(&brw->once_ctl);
+}
+
+void uth_brwlock_destroy(uth_brwlock_t *brw)
+{
+	__uth_sync_destroy(&brw->readers);
+	__uth_sync_destroy(&brw->writers);
+	__uth_sync_destroy(&brw->drainer);
+	free(brw->rdcounts);
+}
+
+uth_brwlock_t *uth_brwlock_alloc(void)
+{
+	struct uth_brwlock *brw;
+
+	brw = malloc(sizeof(struct uth_brwlock));
+	assert(brw);
+	uth_brwlock_init(brw);
+	return brw;
+}
+
+void uth_brwlock_free(uth_brwlock_t *brw)
+{
+	uth_brwlock_destroy(brw);
+	free(brw);
+}
+
+static long __brw_nr_readers(struct uth_brwlock *brw)
+{
+	long sum = 0;
+
+	for (int i = 0; i < max_vcores(); i++)
+		sum += atomic_read(&brw->rdcounts[i].nr);
+	return sum;
+}
+
+/* Bumps our vcore's read count.  We can't migrate in the middle of it. */
+static void __brw_rdcount_add(struct uth_brwlock *brw, long amt)
+{
+	uth_disable_notifs();
+	atomic_fetch_and_add(&brw->rdcounts[vcore_id()].nr, amt);
+	uth_enable_notifs();
+}
+
+/* A reader left while there was a writer.  If it was the last one, wake the
+ * writer waiting on the drain. */
+static void __brw_reader_left(struct uth_brwlock *brw)
+{
+	struct uthread *uth = NULL;
+
+	spin_pdr_lock(&brw->lock);
+	if (!__brw_nr_readers(brw))
+		uth = __uth_sync_get_next(&brw->drainer);
+	spin_pdr_unlock(&brw->lock);
+	if (uth)
+		uthread_runnable(uth);
+}
+
+static bool __brw_fast_rdlock(struct uth_brwlock *brw)
+{
+	__brw_rdcount_add(brw, 1);
+	mb();	/* count write before has_writer read; pairs with wrlock */
+	if (!ACCESS_ONCE(brw->has_writer))
+		return TRUE;
+	__brw_rdcount_add(brw, -1);
+	__brw_reader_left(brw);
+	return FALSE;
+}
+
+static void __brw_rd_cb(struct uthread *uth, void *arg)
+{
+	struct uth_brwlock *brw = (struct uth_brwlock*)arg;
+
+	uthread_has_blocked(uth, UTH_EXT_BLK_MUTEX);
+	__uth_sync_enqueue(uth, &brw->readers);
+	spin_pdr_unlock(&brw->lock);
+}
+
+void uth_brwlock_rdlock(uth_brwlock_t *brw)
+{
+	assert_can_block();
+	parlib_run_once(&brw->once_ctl, __uth_brwlock_init, brw);
+	if (__brw_fast_rdlock(brw))
+		return;
+	spin_pdr_lock(&brw->lock);
+	while (brw->has_writer) {
+		uthread_yield(TRUE, __brw_rd_cb, brw);
+		spin_pdr_lock(&brw->lock);
+	}
+	/* Writers set has_writer while holding the lock, so they'll see this. */
+	__brw_rdcount_add(brw, 1);
+	spin_pdr_unlock(&brw->lock);
+}
+
+bool uth_brwlock_try_rdlock(uth_brwlock_t *brw)
+{
+	assert_can_block();
+	parlib_run_once(&brw->once_ctl, __uth_brwlock_init, brw);
+	return __brw_fast_rdlock(brw);
+}
+
+void uth_brwlock_rdunlock(uth_brwlock_t *brw)
+{
+	__brw_rdcount_add(brw, -1);
+	mb();	/* count write before has_writer read; pairs with wrlock */
+	if (ACCESS_ONCE(brw->has_writer))
+		__brw_reader_left(brw);
+}
+
+static void __brw_wr_cb(struct uthread *uth, void *arg)
+{
+	struct uth_brwlock *brw = (struct uth_brwlock*)arg;
+
+	uthread_has_blocked(uth, UTH_EXT_BLK_MUTEX);
+	__uth_sync_enqueue(uth, &brw->writers);
+	spin_pdr_unlock(&brw->lock);
+}
+
+static void __brw_drain_cb(struct uthread *uth, void *arg)
+{
+	struct uth_brwlock *brw = (struct uth_brwlock*)arg;
+
+	uthread_has_blocked(uth, UTH_EXT_BLK_MUTEX);
+	__uth_sync_enqueue(uth, &brw->drainer);
+	spin_pdr_unlock(&brw->lock);
+}
+
+void uth_brwlock_wrlock(uth_brwlock_t *brw)
+{
+	assert_can_block();
+	parlib_run_once(&brw->once_ctl, __uth_brwlock_init, brw);
+	spin_pdr_lock(&brw->lock);
+	if (brw->has_writer) {
+		/* The old writer hands has_writer to us when it unlocks */
+		uthread_yield(TRUE, __brw_wr_cb, brw);
+		spin_pdr_lock(&brw->lock);
+	} else {
+		brw->has_writer = TRUE;
+	}
+	mb();	/* has_writer write before count reads; pairs with readers */
+	while (__brw_nr_readers(brw)) {
+		uthread_yield(TRUE, __brw_drain_cb, brw);
+		spin_pdr_lock(&brw->lock);
+	}
+	spin_pdr_unlock(&brw->lock);
+}
+
+/* Hands the lock to the next writer, or if there are none, lets the readers
+ * go.  Caller holds the spinlock. */
+static void __brw_release_writer(struct uth_brwlock *brw,
+                                 struct uth_tailq *restartees)
+{
+	struct uthread *uth;
+
+	uth = __uth_sync_get_next(&brw->writers);
+	if (uth) {
+		TAILQ_INSERT_TAIL(restartees, uth, sync_next);
+		return;
+	}
+	brw->has_writer = FALSE;
+	while ((uth = __uth_sync_get_next(&brw->readers)))
+		TAILQ_INSERT_TAIL(restartees, uth, sync_next);
+}
+
+bool uth_brwlock_try_wrlock(uth_brwlock_t *brw)
+{
+	struct uth_tailq restartees = TAILQ_HEAD_INITIALIZER(restartees);
+	struct uthread *i, *safe;
+	bool ret = TRUE;
+
+	assert_can_block();
+	parlib_run_once(&brw->once_ctl, __uth_brwlock_init, brw);
+	spin_pdr_lock(&brw->lock);
+	if (brw->has_writer) {
+		spin_pdr_unlock(&brw->lock);
+		return FALSE;
+	}
+	brw->has_writer = TRUE;
+	mb();	/* has_writer write before count reads; pairs with readers */
+	if (__brw_nr_readers(brw)) {
+		/* Readers might have blocked on us in the meantime */
+		__brw_release_writer(brw, &restartees);
+		ret = FALSE;
+	}
+	spin_pdr_unlock(&brw->lock);
+	TAILQ_FOREACH_SAFE(i, &restartees, sync_next, safe)
+		uthread_runnable(i);
+	return ret;
+}
+
+void uth_brwlock_wrunlock(uth_brwlock_t *brw)
+{
+	struct uth_tailq restartees = TAILQ_HEAD_INITIALIZER(restartees);
+	struct uthread *i, *safe;
+
+	spin_pdr_lock(&brw->lock);
+	__brw_release_writer(brw, &restartees);
+	spin_pdr_unlock(&brw->lock);
+	TAILQ_FOREACH_SAFE(i, &restartees, sync_next, safe)
+		uthread_runnable(i);
+}
+
+/************** Seq Locks **************/
+
+/* Readers never write anything.  A writer might block while it holds the
+ * lock, so instead of spinning on an odd seq, readers wait on the writer's
+ * mutex. */
+void uth_seqlock_init(uth_seqlock_t *sl)
+{
+	sl->seq = SEQCTR_INITIALIZER;
+	uth_mutex_init(&sl->w_mtx);
+}
+
+seq_ctr_t uth_seqlock_read_begin(uth_seqlock_t *sl)
+{
+	seq_ctr_t seq;
+
+	while (seq_is_locked(seq = ACCESS_ONCE(sl->seq))) {
+		if (in_vcore_context()) {
+			cpu_relax();
+			continue;
+		}
+		uth_mutex_lock(&sl->w_mtx);
+		uth_mutex_unlock(&sl->w_mtx);
+	}
+	rmb();	/* don't want future reads to come before our seq read */
+	return seq;
+}
+
+bool uth_seqlock_read_retry(uth_seqlock_t *sl, seq_ctr_t seq)
+{
+	return seqctr_retry(seq, ACCESS_ONCE(sl->seq));
+}
+
+void uth_seqlock_write_lock(uth_seqlock_t *sl)
+{
+	uth_mutex_lock(&sl->w_mtx);
+	sl->seq++;
+	wmb();	/* seq write before the protected writes */
+}
+
+void uth_seqlock_write_unlock(uth_seqlock_t *sl)
+{
+	wmb();	/* protected writes before the seq write */
+	sl->seq++;
+	uth_mutex_unlock(&sl->w_mtx);
+}
+
+/************** Barriers **************/
+
+/* Combining tree barrier.  Each node expects a fixed number of arrivals:
+ * UTH_BARRIER_FANIN threads for a leaf, or one per child for the inner nodes.
+ * Whoever fills a node moves up to its parent, and whoever fills the root
+ * releases everyone by bumping the episode.
+ *
+ * Threads pick their leaf by pcore, so threads on nearby pcores combine first,
+ * and if their leaf is already full for this episode, they try the next one.
+ * There are exactly nr_threads leaf slots, so everyone gets one.  Nodes tag
+ * their count with the episode, so they don't need to be reset; a count from
+ * an old episode is 0.
+ *
+ * Waiters spin if all of the threads could be running right now, and block
+ * otherwise: if there are more threads than vcores, or if a vcore was
+ * preempted, the stragglers might not be running until we yield. */
+#define UTH_BARRIER_FANIN		4
+#define UTH_BARRIER_SPIN_CHECK	1024
+#define UTH_BARRIER_MAX_SPINS	(1 << 16)
+
+struct uth_barrier_node {
+	atomic_t					state;	/* episode << 32 | count */
+	unsigned int				expected;
+	int							parent;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+enum {
+	BARRIER_NODE_FULL,
+	BARRIER_NODE_JOINED,
+	BARRIER_NODE_COMPLETED,
+};
+
+struct barrier_junk {
+	struct uth_barrier			*b;
+	unsigned int				episode;
+};
+
+void uth_barrier_init(uth_barrier_t *b, unsigned int nr_threads)
+{
+	unsigned int level_sz, level_start, nr_nodes, next_start;
+	unsigned int nr_kids, nr_below;
+	int ret;
+
+	assert(nr_threads);
+	b->nr_threads = nr_threads;
+	b->nr_leaves = DIV_ROUND_UP(nr_threads, UTH_BARRIER_FANIN);
+	nr_nodes = 0;
+	for (level_sz = b->nr_leaves; level_sz > 1;
+	     level_sz = DIV_ROUND_UP(level_sz, UTH_BARRIER_FANIN))
+		nr_nodes += level_sz;
+	nr_nodes++;		/* root */
+	ret = posix_memalign((void**)&b->nodes, ARCH_CL_SIZE,
+	                     sizeof(struct uth_barrier_node) * nr_nodes);
+	assert(!ret);
+	memset(b->nodes, 0, sizeof(struct uth_barrier_node) * nr_nodes);
+	/* Each level is contiguous, leaves first.  nr_below is how many arrivals
+	 * the level gets, i.e. threads for leaves, nodes below for the rest. */
+	level_start = 0;
+	level_sz = b->nr_leaves;
+	nr_below = nr_threads;
+	while (1) {
+		next_start = level_start + level_sz;
+		for (int i = 0; i < level_sz; i++) {
+			nr_kids = MIN(UTH_BARRIER_FANIN, nr_below - i * UTH_BARRIER_FANIN);
+			b->nodes[level_start + i].expected = nr_kids;
+			b->nodes[level_start + i].parent = level_sz == 1 ? -1 :
+			                           next_start + i / UTH_BARRIER_FANIN;
+		}
+		if (level_sz == 1)
+			break;
+		nr_below = level_sz;
+		level_start = next_start;
+		level_sz = DIV_ROUND_UP(level_sz, UTH_BARRIER_FANIN);
+	}
+	b->episode = 0;
+	spin_pdr_init(&b->lock);
+	__uth_sync_init(&b->waiters);
+}
+
+void uth_barrier_destroy(uth_barrier_t *b)
+{
+	__uth_sync_destroy(&b->waiters);
+	free(b->nodes);
+}
+
+static int __barrier_arrive(struct uth_barrier_node *node, unsigned int episode)
+{
+	unsigned long old, new;
+	unsigned int count;
+
+	do {
+		old = atomic_read(&node->state);
+		count = (old >> 32) == episode ? old & 0xffffffff : 0;
+		if (count == node->expected)
+			return BARRIER_NODE_FULL;
+		new = ((unsigned long)episode << 32) | (count + 1);
+	} while (!atomic_cas(&node->state, old, new));
+	return count + 1 == node->expected ? BARRIER_NODE_COMPLETED
+	                                   : BARRIER_NODE_JOINED;
+}
+
+static void __barrier_release(struct uth_barrier *b, unsigned int episode)
+{
+	uth_sync_t restartees;
+
+	spin_pdr_lock(&b->lock);
+	b->episode = episode + 1;
+	__uth_sync_init(&restartees);
+	__uth_sync_swap(&restartees, &b->waiters);
+	spin_pdr_unlock(&b->lock);
+	__uth_sync_wake_all(&restartees);
+}
+
+static bool __barrier_spin_ok(struct uth_barrier *b)
+{
+	if (!in_multi_mode() || b->nr_threads > num_vcores())
+		return FALSE;
+	for (int i = 0; i < max_vcores(); i++) {
+		if (vcore_is_mapped(i) && vcore_is_preempted(i))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void __barrier_cb(struct uthread *uth, void *arg)
+{
+	struct barrier_junk *junk = (struct barrier_junk*)arg;
+	struct uth_barrier *b = junk->b;
+
+	uthread_has_blocked(uth, UTH_EXT_BLK_MUTEX);
+	spin_pdr_lock(&b->lock);
+	/* We lost the race with the release, and shouldn't sleep */
+	if (b->episode != junk->episode) {
+		spin_pdr_unlock(&b->lock);
+		uthread_runnable(uth);
+		return;
+	}
+	__uth_sync_enqueue(uth, &b->waiters);
+	spin_pdr_unlock(&b->lock);
+}
+
+bool uth_barrier_wait(uth_barrier_t *b)
+{
+	unsigned int episode = ACCESS_ONCE(b->episode);
+	struct uth_barrier_node *node;
+	struct barrier_junk junk;
+	unsigned int leaf;
+	int ret = BARRIER_NODE_FULL;
+
+	assert_can_block();
+	cmb();	/* read the episode before we arrive and let it change */
+	leaf = in_multi_mode() ? get_pcoreid() / UTH_BARRIER_FANIN : 0;
+	for (int i = 0; i < b->nr_leaves; i++) {
+		node = &b->nodes[(leaf + i) % b->nr_leaves];
+		ret = __barrier_arrive(node, episode);
+		if (ret != BARRIER_NODE_FULL)
+			break;
+	}
+	assert(ret != BARRIER_NODE_FULL);
+	while (ret == BARRIER_NODE_COMPLETED) {
+		if (node->parent < 0) {
+			__barrier_release(b, episode);
+			return TRUE;
+		}
+		node = &b->nodes[node->parent];
+		ret = __barrier_arrive(node, episode);
+		assert(ret != BARRIER_NODE_FULL);
+	}
+	for (int i = 0; ACCESS_ONCE(b->episode) == episode; i++) {
+		if (!(i % UTH_BARRIER_SPIN_CHECK) &&
+		    (i >= UTH_BARRIER_MAX_SPINS || !__barrier_spin_ok(b))) {
+			junk.b = b;
+			junk.episode = episode;
+			uthread_yield(TRUE, __barrier_cb, &junk);
+			break;
+		}
+		cpu_relax();
+	}
+	return FALSE;
+}
+
 
 /************** Default Sync Obj Implementation **************/
 
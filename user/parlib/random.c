@@ -0,0 +1,119 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Per-vcore ChaCha20 random number generator.
+ *
+ * The kernel gives each process (and each forked child) a fresh seed in
+ * procinfo.  Each vcore's key starts as the keystream of that seed, with the
+ * vcoreid as the nonce, so only the first use on each vcore has any overhead.
+ * Every PARLIB_RAND_RESEED_BYTES, a vcore mixes in bytes from #random/urandom,
+ * which is the only time we make syscalls.
+ *
+ * Like the kernel's urandom, every call first replaces the vcore's key and then
+ * makes its output with a per-call key, so we only need notifs disabled for a
+ * single block, and a uthread that blocks or faults on buf doesn't matter. */
+
+#include <parlib/random.h>
+#include <parlib/uthread.h>
+#include <parlib/vcore.h>
+#include <parlib/arch/arch.h>
+#include <ros/chacha.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PARLIB_RAND_RESEED_BYTES	(1ULL << 30)
+
+struct vc_rand {
+	uint32_t					key[CHACHA_KEY_WORDS];
+	uint64_t					nr_bytes;
+	pid_t						pid;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct vc_rand vc_rands[MAX_NUM_CORES];
+
+/* Best effort: if the app has no FDs left or no #random, we just keep going
+ * with the key we have. */
+static void read_kernel_seed(uint32_t seed[CHACHA_KEY_WORDS])
+{
+	int fd;
+
+	memset(seed, 0, CHACHA_KEY_WORDS * sizeof(uint32_t));
+	fd = open("#random/urandom", O_RDONLY);
+	if (fd < 0)
+		return;
+	read(fd, seed, CHACHA_KEY_WORDS * sizeof(uint32_t));
+	close(fd);
+}
+
+/* Called with notifs disabled. */
+static void __vc_rand_init(struct vc_rand *vr, uint32_t vcoreid)
+{
+	uint32_t seed[CHACHA_KEY_WORDS];
+	uint32_t block[CHACHA_BLOCK_WORDS];
+
+	memcpy(seed, __procinfo.rand_seed, sizeof(seed));
+	chacha20_block(seed, 0, vcoreid, block);
+	memcpy(vr->key, block, sizeof(vr->key));
+	vr->nr_bytes = 0;
+	vr->pid = __procinfo.pid;
+	memset(block, 0, sizeof(block));
+	memset(seed, 0, sizeof(seed));
+}
+
+static void vc_rand_reseed(void)
+{
+	uint32_t seed[CHACHA_KEY_WORDS];
+	struct vc_rand *vr;
+
+	read_kernel_seed(seed);
+	uth_disable_notifs();
+	vr = &vc_rands[vcore_id()];
+	for (int i = 0; i < CHACHA_KEY_WORDS; i++)
+		vr->key[i] ^= seed[i];
+	vr->nr_bytes = 0;
+	uth_enable_notifs();
+	memset(seed, 0, sizeof(seed));
+}
+
+void parlib_random_bytes(void *buf, size_t len)
+{
+	uint32_t block[CHACHA_BLOCK_WORDS];
+	uint32_t key[CHACHA_KEY_WORDS];
+	struct vc_rand *vr;
+	uint8_t *p = buf;
+	bool reseed;
+	size_t amt;
+
+	uth_disable_notifs();
+	vr = &vc_rands[vcore_id()];
+	/* Covers both the first use and a fork, which copied our keys. */
+	if (vr->pid != __procinfo.pid)
+		__vc_rand_init(vr, vcore_id());
+	chacha20_block(vr->key, 0, 0, block);
+	memcpy(vr->key, block, sizeof(vr->key));
+	vr->nr_bytes += len;
+	reseed = vr->nr_bytes > PARLIB_RAND_RESEED_BYTES;
+	uth_enable_notifs();
+	memcpy(key, block + CHACHA_KEY_WORDS, sizeof(key));
+
+	for (uint64_t ctr = 0; len; ctr++) {
+		chacha20_block(key, ctr, 0, block);
+		amt = MIN(CHACHA_BLOCK_SIZE, len);
+		memcpy(p, block, amt);
+		p += amt;
+		len -= amt;
+	}
+	memset(block, 0, sizeof(block));
+	memset(key, 0, sizeof(key));
+	if (reseed)
+		vc_rand_reseed();
+}
+
+uint64_t parlib_random_u64(void)
+{
+	uint64_t ret;
+
+	parlib_random_bytes(&ret, sizeof(ret));
+	return ret;
+}
@@ -0,0 +1,393 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Shared memory message rings, see parlib/shmring.h.
+ *
+ * The first page of the mapping is the header; slots start at the next page.
+ * Slots work like Vyukov's bounded queue: each has a seq, which is the ring
+ * position a producer may fill it at, or that position + 1 once it is full.
+ * The consumer empties it and bumps seq by a lap.  Producers claim positions
+ * by CASing head (or just writing it, for SPSC), and the lone consumer owns
+ * tail.  Neither side ever trusts the other with more than the slots: a bad
+ * seq or len just looks like an empty ring or a short message. */
+
+#include <parlib/shmring.h>
+#include <parlib/parlib.h>
+#include <parlib/arch/arch.h>
+#include <parlib/arch/atomic.h>
+#include <ros/arch/membar.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define SHMRING_MAGIC			0x73687267	/* "shrg" */
+#define SHMRING_NAME_LEN		64
+#define SHMRING_MAX_MAP			(1UL << 30)
+
+struct shmring_hdr {
+	uint32_t					magic;
+	uint32_t					flags;
+	uint32_t					slot_size;
+	uint32_t					stride;
+	uint64_t					nr_slots;
+	uint64_t					map_len;
+	uint64_t					head __attribute__((aligned(ARCH_CL_SIZE)));
+	uint64_t					tail __attribute__((aligned(ARCH_CL_SIZE)));
+	/* Set by the consumer when it is about to sleep */
+	uint32_t					waiting __attribute__((aligned(ARCH_CL_SIZE)));
+};
+
+struct shmring_slot {
+	uint64_t					seq;
+	uint32_t					len;
+	uint32_t					pad;
+	uint8_t						data[];
+};
+
+struct shmring {
+	struct shmring_hdr			*hdr;
+	void						*slots;
+	/* Our copies of the geometry, so the other side can't change them */
+	uint32_t					flags;
+	uint32_t					slot_size;
+	uint32_t					stride;
+	uint64_t					mask;
+	size_t						map_len;
+	int							bell_fd;
+};
+
+static struct shmring_slot *slot_at(struct shmring *sr, uint64_t pos)
+{
+	return sr->slots + (pos & sr->mask) * sr->stride;
+}
+
+static int srv_path(char *buf, size_t len, const char *name, const char *ext)
+{
+	int ret;
+
+	ret = snprintf(buf, len, "#srv/%s%s", name, ext);
+	if (ret < 0 || ret >= len) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+/* Posts fd's chan in #srv as name + ext. */
+static int srv_post(const char *name, const char *ext, int fd)
+{
+	char path[SHMRING_NAME_LEN + 16];
+	char num[16];
+	int srv_fd, ret;
+
+	if (srv_path(path, sizeof(path), name, ext))
+		return -1;
+	srv_fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (srv_fd < 0)
+		return -1;
+	ret = snprintf(num, sizeof(num), "%d", fd);
+	ret = write(srv_fd, num, ret);
+	close(srv_fd);
+	if (ret < 0) {
+		unlink(path);
+		return -1;
+	}
+	return 0;
+}
+
+static int srv_open(const char *name, const char *ext)
+{
+	char path[SHMRING_NAME_LEN + 16];
+
+	if (srv_path(path, sizeof(path), name, ext))
+		return -1;
+	return open(path, O_RDWR);
+}
+
+static void shmring_set_geometry(struct shmring *sr, struct shmring_hdr *hdr)
+{
+	sr->hdr = hdr;
+	sr->slots = (void*)hdr + PGSIZE;
+	sr->flags = hdr->flags;
+	sr->slot_size = hdr->slot_size;
+	sr->stride = hdr->stride;
+	sr->mask = hdr->nr_slots - 1;
+	sr->map_len = hdr->map_len;
+}
+
+/* Creates a ring with nr_slots (a power of two) messages of up to slot_size
+ * bytes each, and posts it in #srv as name.  Returns 0 and sets errno on
+ * failure; EEXIST means someone already has that name. */
+struct shmring *shmring_create(const char *name, size_t slot_size,
+                               size_t nr_slots, int flags)
+{
+	struct shmring *sr;
+	struct shmring_hdr *hdr;
+	size_t stride, map_len;
+	int fd;
+
+	stride = ROUNDUP(sizeof(struct shmring_slot) + slot_size, ARCH_CL_SIZE);
+	if (!slot_size || slot_size > UINT32_MAX / 2 || !IS_PWR2(nr_slots) ||
+	    nr_slots > SHMRING_MAX_MAP / stride || strlen(name) >= SHMRING_NAME_LEN
+	    || strchr(name, '/') || (flags & ~SHMRING_MPSC)) {
+		errno = EINVAL;
+		return 0;
+	}
+	map_len = ROUNDUP(PGSIZE + nr_slots * stride, PGSIZE);
+	sr = malloc(sizeof(struct shmring));
+	if (!sr)
+		return 0;
+	/* Every attach of #tmpfs is a new filesystem, so the name doesn't matter.
+	 * The file goes away when the last chan does. */
+	fd = open("#tmpfs/shmring", O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd < 0)
+		goto out_free;
+	if (ftruncate(fd, map_len))
+		goto out_close;
+	hdr = mmap(0, map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	           fd, 0);
+	if (hdr == MAP_FAILED)
+		goto out_close;
+	hdr->magic = SHMRING_MAGIC;
+	hdr->flags = flags;
+	hdr->slot_size = slot_size;
+	hdr->stride = stride;
+	hdr->nr_slots = nr_slots;
+	hdr->map_len = map_len;
+	shmring_set_geometry(sr, hdr);
+	for (uint64_t i = 0; i < nr_slots; i++)
+		slot_at(sr, i)->seq = i;
+	sr->bell_fd = eventfd(0, 0);
+	if (sr->bell_fd < 0)
+		goto out_unmap;
+	if (srv_post(name, "", fd))
+		goto out_bell;
+	if (srv_post(name, ".bell", sr->bell_fd)) {
+		shmring_unlink(name);
+		goto out_bell;
+	}
+	close(fd);
+	return sr;
+
+out_bell:
+	close(sr->bell_fd);
+out_unmap:
+	munmap(hdr, map_len);
+out_close:
+	close(fd);
+out_free:
+	free(sr);
+	return 0;
+}
+
+/* Attaches to a ring someone posted as name.  Returns 0 and sets errno on
+ * failure. */
+struct shmring *shmring_attach(const char *name)
+{
+	struct shmring *sr;
+	struct shmring_hdr *hdr;
+	struct stat st;
+	size_t map_len;
+	int fd;
+
+	sr = malloc(sizeof(struct shmring));
+	if (!sr)
+		return 0;
+	fd = srv_open(name, "");
+	if (fd < 0)
+		goto out_free;
+	hdr = mmap(0, PGSIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		goto out_close;
+	map_len = hdr->map_len;
+	if (hdr->magic != SHMRING_MAGIC || fstat(fd, &st) ||
+	    map_len > st.st_size || map_len > SHMRING_MAX_MAP ||
+	    !IS_PWR2(hdr->nr_slots) || hdr->stride % ARCH_CL_SIZE ||
+	    hdr->stride < sizeof(struct shmring_slot) + hdr->slot_size ||
+	    PGSIZE + hdr->nr_slots * hdr->stride > map_len) {
+		munmap(hdr, PGSIZE);
+		errno = EINVAL;
+		goto out_close;
+	}
+	munmap(hdr, PGSIZE);
+	hdr = mmap(0, map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	           fd, 0);
+	if (hdr == MAP_FAILED)
+		goto out_close;
+	shmring_set_geometry(sr, hdr);
+	/* It could have changed between the mappings */
+	if (sr->map_len != map_len || (uint64_t)sr->stride * (sr->mask + 1) >
+	    map_len - PGSIZE) {
+		errno = EINVAL;
+		goto out_unmap;
+	}
+	sr->bell_fd = srv_open(name, ".bell");
+	if (sr->bell_fd < 0)
+		goto out_unmap;
+	close(fd);
+	return sr;
+
+out_unmap:
+	munmap(hdr, map_len);
+out_close:
+	close(fd);
+out_free:
+	free(sr);
+	return 0;
+}
+
+void shmring_close(struct shmring *sr)
+{
+	munmap(sr->hdr, sr->map_len);
+	close(sr->bell_fd);
+	free(sr);
+}
+
+/* Removes name from #srv.  Anyone attached keeps working, and the memory goes
+ * away when the last of them closes. */
+int shmring_unlink(const char *name)
+{
+	char path[SHMRING_NAME_LEN + 16];
+	int ret = 0;
+
+	if (srv_path(path, sizeof(path), name, ".bell"))
+		return -1;
+	if (unlink(path) && errno != ENOENT)
+		ret = -1;
+	srv_path(path, sizeof(path), name, "");
+	if (unlink(path))
+		ret = -1;
+	return ret;
+}
+
+/* Rings the doorbell, if the consumer is waiting for it.  Our slot's seq must
+ * be visible before we read waiting; the consumer sets waiting and then checks
+ * the slots, so one of us sees the other. */
+static void shmring_ring(struct shmring *sr)
+{
+	wrmb();
+	if (READ_ONCE(sr->hdr->waiting) && atomic_swap_u32(&sr->hdr->waiting, 0))
+		eventfd_write(sr->bell_fd, 1);
+}
+
+/* Copies len bytes into the ring.  Returns 0, or -1 with EAGAIN if the ring is
+ * full or EMSGSIZE if len is more than a slot holds. */
+int shmring_send(struct shmring *sr, const void *buf, size_t len)
+{
+	struct shmring_hdr *hdr = sr->hdr;
+	struct shmring_slot *slot;
+	uint64_t pos, seq;
+
+	if (len > sr->slot_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	pos = READ_ONCE(hdr->head);
+	for (;;) {
+		slot = slot_at(sr, pos);
+		seq = READ_ONCE(slot->seq);
+		if (seq == pos) {
+			if (!(sr->flags & SHMRING_MPSC)) {
+				WRITE_ONCE(hdr->head, pos + 1);
+				break;
+			}
+			if (__sync_bool_compare_and_swap(&hdr->head, pos, pos + 1))
+				break;
+		} else if ((int64_t)(seq - pos) < 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		/* Someone else got pos */
+		cpu_relax();
+		pos = READ_ONCE(hdr->head);
+	}
+	memcpy(slot->data, buf, len);
+	slot->len = len;
+	wmb();	/* fill the slot before publishing it */
+	WRITE_ONCE(slot->seq, pos + 1);
+	shmring_ring(sr);
+	return 0;
+}
+
+static bool shmring_empty(struct shmring *sr)
+{
+	uint64_t pos = sr->hdr->tail;
+
+	return READ_ONCE(slot_at(sr, pos)->seq) != pos + 1;
+}
+
+/* Copies the next message into buf.  Returns its length, or -1 with EAGAIN if
+ * the ring is empty or EMSGSIZE if buf is too small, in which case the message
+ * stays put.  Only one thread (in one process) may receive from a ring. */
+ssize_t shmring_recv(struct shmring *sr, void *buf, size_t len)
+{
+	struct shmring_hdr *hdr = sr->hdr;
+	struct shmring_slot *slot;
+	uint64_t pos = hdr->tail;
+	uint32_t msg_len;
+
+	slot = slot_at(sr, pos);
+	if (READ_ONCE(slot->seq) != pos + 1) {
+		errno = EAGAIN;
+		return -1;
+	}
+	rmb();	/* read seq before the contents */
+	msg_len = MIN(READ_ONCE(slot->len), sr->slot_size);
+	if (msg_len > len) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	memcpy(buf, slot->data, msg_len);
+	rwmb();	/* done with the slot before handing it back */
+	WRITE_ONCE(slot->seq, pos + sr->mask + 1);
+	WRITE_ONCE(hdr->tail, pos + 1);
+	return msg_len;
+}
+
+/* Tells producers we're going idle, so the next send rings the doorbell.
+ * Returns FALSE if the ring already has a message, in which case drain it
+ * instead of waiting.  Extra rings are possible, so doorbell waiters must
+ * handle finding an empty ring. */
+bool shmring_arm(struct shmring *sr)
+{
+	WRITE_ONCE(sr->hdr->waiting, 1);
+	wrmb();
+	if (!shmring_empty(sr)) {
+		WRITE_ONCE(sr->hdr->waiting, 0);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Like shmring_recv(), but sleeps on the doorbell while the ring is empty. */
+ssize_t shmring_recv_wait(struct shmring *sr, void *buf, size_t len)
+{
+	eventfd_t ignored;
+	ssize_t ret;
+
+	for (;;) {
+		ret = shmring_recv(sr, buf, len);
+		if (ret >= 0 || errno != EAGAIN)
+			return ret;
+		if (!shmring_arm(sr))
+			continue;
+		if (eventfd_read(sr->bell_fd, &ignored))
+			return -1;
+	}
+}
+
+int shmring_bell_fd(struct shmring *sr)
+{
+	return sr->bell_fd;
+}
+
+size_t shmring_slot_size(struct shmring *sr)
+{
+	return sr->slot_size;
+}
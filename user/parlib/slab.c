@@ -10,6 +10,16 @@
  * objects, so we use the same style for small objects: store the pointer to the
  * controlling bufctl at the top of the slab object.  Fix this with TODO (BUF).
  *
+ * Unlike the kernel, objects in the slabs are constructed: we run the ctor when
+ * we grow a slab and the dtor when we destroy it.  So the magazines hold
+ * constructed objects too, and draining a magazine is just a free to the slab.
+ *
+ * The magazine layer is the kernel's, minus NUMA.  The kernel protects its
+ * pcpu caches by disabling IRQs; we disable notifs.  That keeps our uthread on
+ * its vcore and keeps vcore context from running on that vcore.  If the vcore
+ * gets preempted in the middle, it is restarted as a whole (see
+ * handle_vc_preempt()), so no one else ever sees a half-done magazine op.
+ *
  * Ported directly from the kernel's slab allocator. */
 
 #include <parlib/slab.h>
@@ -17,19 +27,170 @@
 #include <parlib/assert.h>
 #include <parlib/parlib.h>
 #include <parlib/stdio.h>
+#include <parlib/uthread.h>
+#include <parlib/timing.h>
 #include <sys/mman.h>
 #include <sys/param.h>
 
+/* Tunables, same as the kernel's.  The depot grows its mags when it sees more
+ * than resize_threshold contended lock acquisitions within resize_timeout_ns,
+ * and shrinks them by one round for every shrink_timeout_ns that passes without
+ * any contention. */
+uint64_t resize_timeout_ns = 1000000000;
+unsigned int resize_threshold = 1;
+uint64_t shrink_timeout_ns = 10000000000;
+
 struct kmem_cache_list kmem_caches;
 struct spin_pdr_lock kmem_caches_lock;
 
 /* Backend/internal functions, defined later.  Grab the lock before calling
  * these. */
 static void kmem_cache_grow(struct kmem_cache *cp);
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp);
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf);
 
 /* Cache of the kmem_cache objects, needed for bootstrapping */
 struct kmem_cache kmem_cache_cache;
 struct kmem_cache *kmem_slab_cache, *kmem_bufctl_cache;
+static struct kmem_cache kmem_magazine_cache;
+
+static uint64_t kmc_nsec(void)
+{
+	return tsc2nsec(read_tsc());
+}
+
+/* Our uthread can't migrate while notifs are disabled, so we look up our vcore
+ * after disabling them.  Callers must refetch their pcc every time they lock,
+ * since we may have moved while it was unlocked. */
+static struct kmem_pcpu_cache *lock_my_pcpu_cache(struct kmem_cache *kc)
+{
+	uth_disable_notifs();
+	return &kc->pcpu_caches[vcore_id()];
+}
+
+static void unlock_pcpu_cache(struct kmem_pcpu_cache *pcc)
+{
+	uth_enable_notifs();
+}
+
+/* Helper, shrinks the magazines if the depot hasn't seen contention in a
+ * while.  Hold the depot lock. */
+static void __maybe_shrink_depot(struct kmem_depot *depot)
+{
+	uint64_t time;
+
+	if (depot->magsize <= KMC_MAG_MIN_SZ)
+		return;
+	time = kmc_nsec();
+	if (time - depot->last_contention < shrink_timeout_ns)
+		return;
+	depot->magsize--;
+	/* Restart the clock, so we shrink one round per timeout period. */
+	depot->last_contention = time;
+}
+
+/* See the kernel's lock_depot() for how we decide to grow the magazines. */
+static void lock_depot(struct kmem_depot *depot)
+{
+	uint64_t time;
+
+	if (spin_pdr_trylock(&depot->lock)) {
+		__maybe_shrink_depot(depot);
+		return;
+	}
+	time = kmc_nsec();
+	spin_pdr_lock(&depot->lock);
+	depot->nr_contended++;
+	depot->last_contention = time;
+	if (!depot->nr_not_empty)
+		return;
+	if (time - depot->busy_start > resize_timeout_ns) {
+		depot->busy_count = 0;
+		depot->busy_start = time;
+	}
+	depot->busy_count++;
+	if (depot->busy_count > resize_threshold) {
+		depot->busy_count = 0;
+		if (depot->magsize < KMC_MAG_MAX_SZ)
+			depot->magsize++;
+	}
+}
+
+static void unlock_depot(struct kmem_depot *depot)
+{
+	spin_pdr_unlock(&depot->lock);
+}
+
+static void depot_init(struct kmem_depot *depot)
+{
+	spin_pdr_init(&depot->lock);
+	SLIST_INIT(&depot->not_empty);
+	SLIST_INIT(&depot->empty);
+	depot->magsize = KMC_MAG_MIN_SZ;
+	depot->nr_not_empty = 0;
+	depot->nr_empty = 0;
+	depot->busy_count = 0;
+	depot->busy_start = 0;
+	depot->last_contention = 0;
+	depot->nr_contended = 0;
+}
+
+static bool mag_is_empty(struct kmem_magazine *mag)
+{
+	return mag->nr_rounds == 0;
+}
+
+/* Helper, swaps the loaded and previous mags.  Hold the pcc lock. */
+static void __swap_mags(struct kmem_pcpu_cache *pcc)
+{
+	struct kmem_magazine *temp;
+
+	temp = pcc->prev;
+	pcc->prev = pcc->loaded;
+	pcc->loaded = temp;
+}
+
+/* Helper, returns a magazine to the depot.  Hold the depot lock. */
+static void __return_to_depot(struct kmem_depot *depot,
+                              struct kmem_magazine *mag)
+{
+	if (mag_is_empty(mag)) {
+		SLIST_INSERT_HEAD(&depot->empty, mag, link);
+		depot->nr_empty++;
+	} else {
+		SLIST_INSERT_HEAD(&depot->not_empty, mag, link);
+		depot->nr_not_empty++;
+	}
+}
+
+/* Helper, gives the contents of the magazine back to the slab layer. */
+static void drain_mag(struct kmem_cache *kc, struct kmem_magazine *mag)
+{
+	for (int i = 0; i < mag->nr_rounds; i++)
+		__kmem_free_to_slab(kc, mag->rounds[i]);
+	mag->nr_rounds = 0;
+}
+
+static size_t pcpu_caches_size(void)
+{
+	return ROUNDUP(sizeof(struct kmem_pcpu_cache) * max_vcores(), PGSIZE);
+}
+
+static struct kmem_pcpu_cache *build_pcpu_caches(void)
+{
+	struct kmem_pcpu_cache *pcc;
+
+	pcc = mmap(0, pcpu_caches_size(), PROT_READ | PROT_WRITE,
+	           MAP_POPULATE | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	assert(pcc != MAP_FAILED);
+	for (int i = 0; i < max_vcores(); i++) {
+		pcc[i].magsize = KMC_MAG_MIN_SZ;
+		pcc[i].loaded = __kmem_alloc_from_slab(&kmem_magazine_cache);
+		pcc[i].prev = __kmem_alloc_from_slab(&kmem_magazine_cache);
+		pcc[i].nr_allocs_ever = 0;
+	}
+	return pcc;
+}
 
 static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
                                 size_t obj_size, int align, int flags,
@@ -51,6 +212,10 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	kc->dtor = dtor;
 	kc->priv = priv;
 	kc->nr_cur_alloc = 0;
+	depot_init(&kc->depot);
+	/* We do this last, since this will call into the magazine cache - which we
+	 * could be creating on this call! */
+	kc->pcpu_caches = build_pcpu_caches();
 	
 	/* put in cache list based on it's size */
 	struct kmem_cache *i, *prev = NULL;
@@ -69,10 +234,25 @@ static void __kmem_cache_create(struct kmem_cache *kc, const char *name,
 	spin_pdr_unlock(&kmem_caches_lock);
 }
 
+static int __mag_ctor(void *obj, void *priv, int flags)
+{
+	struct kmem_magazine *mag = (struct kmem_magazine*)obj;
+
+	mag->nr_rounds = 0;
+	return 0;
+}
+
 static void kmem_cache_init(void *arg)
 {
 	spin_pdr_init(&kmem_caches_lock);
 	SLIST_INIT(&kmem_caches);
+	/* The magazine cache must be first - all caches, including mags, will do a
+	 * slab alloc from the mag cache. */
+	parlib_static_assert(sizeof(struct kmem_magazine) <= SLAB_LARGE_CUTOFF);
+	__kmem_cache_create(&kmem_magazine_cache, "kmem_magazine",
+	                    sizeof(struct kmem_magazine),
+	                    __alignof__(struct kmem_magazine), 0, __mag_ctor, NULL,
+	                    NULL);
 	/* We need to call the __ version directly to bootstrap the global
 	 * kmem_cache_cache. */
 	__kmem_cache_create(&kmem_cache_cache, "kmem_cache",
@@ -137,12 +317,40 @@ static void kmem_slab_destroy(struct kmem_cache *cp, struct kmem_slab *a_slab)
 	}
 }
 
+/* Helper during destruction.  No one should be touching the allocator anymore.
+ * We hand the pccs' mags to the depot, then drain the depot into the slabs. */
+static void drain_magazines(struct kmem_cache *kc)
+{
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_magazine *mag_i;
+
+	lock_depot(depot);
+	for (int i = 0; i < max_vcores(); i++) {
+		__return_to_depot(depot, kc->pcpu_caches[i].loaded);
+		__return_to_depot(depot, kc->pcpu_caches[i].prev);
+	}
+	while ((mag_i = SLIST_FIRST(&depot->not_empty))) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		drain_mag(kc, mag_i);
+		SLIST_INSERT_HEAD(&depot->empty, mag_i, link);
+	}
+	unlock_depot(depot);
+	/* Freeing the mags can call back into the depot of the magazine cache, so
+	 * we do it unlocked.  We never destroy the magazine cache. */
+	while ((mag_i = SLIST_FIRST(&depot->empty))) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		kmem_cache_free(&kmem_magazine_cache, mag_i);
+	}
+	munmap(kc->pcpu_caches, pcpu_caches_size());
+}
+
 /* Once you call destroy, never use this cache again... o/w there may be weird
  * races, and other serious issues.  */
 void kmem_cache_destroy(struct kmem_cache *cp)
 {
 	struct kmem_slab *a_slab, *next;
 
+	drain_magazines(cp);
 	spin_pdr_lock(&cp->cache_lock);
 	assert(TAILQ_EMPTY(&cp->full_slab_list));
 	assert(TAILQ_EMPTY(&cp->partial_slab_list));
@@ -162,8 +370,8 @@ void kmem_cache_destroy(struct kmem_cache *cp)
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
-/* Front end: clients of caches use these */
-void *kmem_cache_alloc(struct kmem_cache *cp, int flags)
+/* Returns a constructed object from the slab layer. */
+static void *__kmem_alloc_from_slab(struct kmem_cache *cp)
 {
 	void *retval = NULL;
 	spin_pdr_lock(&cp->cache_lock);
@@ -209,7 +417,8 @@ static inline struct kmem_bufctl *buf2bufctl(void *buf, size_t offset)
 	return *((struct kmem_bufctl**)(buf + offset));
 }
 
-void kmem_cache_free(struct kmem_cache *cp, void *buf)
+/* Returns a constructed object to the slab layer. */
+static void __kmem_free_to_slab(struct kmem_cache *cp, void *buf)
 {
 	struct kmem_slab *a_slab;
 	struct kmem_bufctl *a_bufctl;
@@ -244,6 +453,112 @@ void kmem_cache_free(struct kmem_cache *cp, void *buf)
 	spin_pdr_unlock(&cp->cache_lock);
 }
 
+/* Helper, makes sure pcc->loaded has rounds, swapping with prev or trading with
+ * the depot.  Returns FALSE if there are no rounds to be had above the slab
+ * layer.  Hold the pcc lock. */
+static bool __pcc_reload_for_alloc(struct kmem_cache *kc,
+                                   struct kmem_pcpu_cache *pcc)
+{
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_magazine *mag;
+
+	if (pcc->loaded->nr_rounds)
+		return TRUE;
+	if (!mag_is_empty(pcc->prev)) {
+		__swap_mags(pcc);
+		return TRUE;
+	}
+	/* Note the lock ordering: pcc -> depot */
+	lock_depot(depot);
+	mag = SLIST_FIRST(&depot->not_empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->not_empty, link);
+		depot->nr_not_empty--;
+		__return_to_depot(depot, pcc->prev);
+		unlock_depot(depot);
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		return TRUE;
+	}
+	unlock_depot(depot);
+	return FALSE;
+}
+
+/* Front end: clients of caches use these */
+void *kmem_cache_alloc(struct kmem_cache *kc, int flags)
+{
+	struct kmem_pcpu_cache *pcc = lock_my_pcpu_cache(kc);
+	void *ret;
+
+	if (__pcc_reload_for_alloc(kc, pcc)) {
+		ret = pcc->loaded->rounds[pcc->loaded->nr_rounds - 1];
+		pcc->loaded->nr_rounds--;
+		pcc->nr_allocs_ever++;
+		unlock_pcpu_cache(pcc);
+		return ret;
+	}
+	unlock_pcpu_cache(pcc);
+	return __kmem_alloc_from_slab(kc);
+}
+
+/* Helper, makes sure pcc->loaded has room for one more round, swapping with
+ * prev or trading with the depot.  Returns FALSE if the depot has no empty
+ * mags; the caller needs to make one.  Hold the pcc lock. */
+static bool __pcc_reload_for_free(struct kmem_cache *kc,
+                                  struct kmem_pcpu_cache *pcc)
+{
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_magazine *mag;
+
+	if (pcc->loaded->nr_rounds < pcc->magsize)
+		return TRUE;
+	if (pcc->prev->nr_rounds < pcc->magsize) {
+		__swap_mags(pcc);
+		return TRUE;
+	}
+	lock_depot(depot);
+	/* Pick up any resize for the next magazine. */
+	pcc->magsize = depot->magsize;
+	mag = SLIST_FIRST(&depot->empty);
+	if (mag) {
+		SLIST_REMOVE_HEAD(&depot->empty, link);
+		depot->nr_empty--;
+		__return_to_depot(depot, pcc->prev);
+		unlock_depot(depot);
+		pcc->prev = pcc->loaded;
+		pcc->loaded = mag;
+		return TRUE;
+	}
+	unlock_depot(depot);
+	return FALSE;
+}
+
+void kmem_cache_free(struct kmem_cache *kc, void *buf)
+{
+	struct kmem_depot *depot = &kc->depot;
+	struct kmem_pcpu_cache *pcc;
+	struct kmem_magazine *mag;
+
+	assert(buf);	/* catch bugs */
+try_free:
+	pcc = lock_my_pcpu_cache(kc);
+	if (__pcc_reload_for_free(kc, pcc)) {
+		pcc->loaded->rounds[pcc->loaded->nr_rounds] = buf;
+		pcc->loaded->nr_rounds++;
+		unlock_pcpu_cache(pcc);
+		return;
+	}
+	/* Need to unlock, in case we end up calling back into ourselves. */
+	unlock_pcpu_cache(pcc);
+	mag = kmem_cache_alloc(&kmem_magazine_cache, 0);
+	assert(mag->nr_rounds == 0);
+	lock_depot(depot);
+	SLIST_INSERT_HEAD(&depot->empty, mag, link);
+	depot->nr_empty++;
+	unlock_depot(depot);
+	goto try_free;
+}
+
 /* Back end: internal functions */
 /* When this returns, the cache has at least one slab in the empty list.  If
  * page_alloc fails, there are some serious issues.  This only grows by one slab
@@ -360,6 +675,12 @@ void print_kmem_cache(struct kmem_cache *cp)
 	printf("Slab Empty: 0x%08x\n", cp->empty_slab_list);
 	printf("Current Allocations: %d\n", cp->nr_cur_alloc);
 	spin_pdr_unlock(&cp->cache_lock);
+	lock_depot(&cp->depot);
+	printf("Magsize: %d\n", cp->depot.magsize);
+	printf("Depot not-empty mags: %d\n", cp->depot.nr_not_empty);
+	printf("Depot empty mags: %d\n", cp->depot.nr_empty);
+	printf("Depot contended: %lu\n", cp->depot.nr_contended);
+	unlock_depot(&cp->depot);
 }
 
 void print_kmem_slab(struct kmem_slab *slab)
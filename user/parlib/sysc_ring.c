@@ -0,0 +1,67 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Syscall submission ring, see parlib/sysc_ring.h. */
+
+#include <parlib/sysc_ring.h>
+#include <parlib/parlib.h>
+#include <parlib/spinlock.h>
+#include <ros/procdata.h>
+#include <ros/arch/membar.h>
+#include <stdarg.h>
+#include <errno.h>
+
+/* Producers on different vcores share prod */
+static struct spin_pdr_lock sysc_ring_lock = SPINPDR_INITIALIZER;
+
+int sys_sysc_ring_kick(void)
+{
+	return ros_syscall(SYS_sysc_ring_kick, 0, 0, 0, 0, 0, 0);
+}
+
+/* Puts an already filled-in sysc on the ring.  Returns 0, or -1 with EBUSY if
+ * the ring is full, in which case you can wait for some completions or just
+ * trap. */
+int sysc_ring_submit(struct syscall *sysc)
+{
+	struct sysc_ring *sr = &__procdata.sysc_ring;
+	uint32_t prod;
+
+	spin_pdr_lock(&sysc_ring_lock);
+	prod = sr->prod;
+	if (prod - READ_ONCE(sr->cons) >= SYSC_RING_SZ) {
+		spin_pdr_unlock(&sysc_ring_lock);
+		errno = EBUSY;
+		return -1;
+	}
+	sr->sq[prod & SYSC_RING_MASK] = sysc;
+	wmb();	/* fill the slot before publishing it */
+	WRITE_ONCE(sr->prod, prod + 1);
+	spin_pdr_unlock(&sysc_ring_lock);
+	/* Write prod before reading the flag.  The kernel's last poller sets the
+	 * flag and then checks prod, so one of us sees the other. */
+	mb();
+	if (READ_ONCE(sr->flags) & SYSC_RING_NEED_KICK)
+		sys_sysc_ring_kick();
+	return 0;
+}
+
+/* Like syscall_async_evq(), but through the ring.  evq can be 0. */
+int syscall_ring_evq(struct syscall *sysc, struct event_queue *evq,
+                     unsigned long num, ...)
+{
+	va_list args;
+
+	sysc->num = num;
+	atomic_set(&sysc->flags, evq ? SC_UEVENT : 0);
+	sysc->ev_q = evq;
+	va_start(args, num);
+	sysc->arg0 = va_arg(args, long);
+	sysc->arg1 = va_arg(args, long);
+	sysc->arg2 = va_arg(args, long);
+	sysc->arg3 = va_arg(args, long);
+	sysc->arg4 = va_arg(args, long);
+	sysc->arg5 = va_arg(args, long);
+	va_end(args);
+	return sysc_ring_submit(sysc);
+}
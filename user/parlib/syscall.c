@@ -178,6 +178,12 @@ int sys_tap_fds(struct fd_tap_req *tap_reqs, size_t nr_reqs)
 	return ros_syscall(SYS_tap_fds, tap_reqs, nr_reqs, 0, 0, 0, 0);
 }
 
+/* Sets the NUMA memory policy (MPOL_*) for [addr, addr + len). */
+int sys_mbind(void *addr, size_t len, int mode, unsigned long nodes)
+{
+	return ros_syscall(SYS_mbind, addr, len, mode, nodes, 0, 0);
+}
+
 void syscall_async(struct syscall *sysc, unsigned long num, ...)
 {
 	va_list args;
@@ -9,7 +9,6 @@
 #include <parlib/arch/atomic.h>
 #include <parlib/arch/arch.h>
 #include <parlib/ucq.h>
-#include <parlib/spinlock.h>
 #include <sys/mman.h>
 #include <parlib/assert.h>
 #include <parlib/stdio.h>
@@ -33,8 +32,7 @@ void ucq_init_raw(struct ucq *ucq, uintptr_t pg1, uintptr_t pg2)
 	ucq->prod_overflow = FALSE;
 	atomic_set(&ucq->nr_extra_pgs, 0);
 	atomic_set(&ucq->spare_pg, pg2);
-	parlib_static_assert(sizeof(struct spin_pdr_lock) <= sizeof(ucq->u_lock));
-	spin_pdr_init((struct spin_pdr_lock*)(&ucq->u_lock));
+	atomic_set(&ucq->u_nr_pins, 0);
 	ucq->ucq_ready = TRUE;
 }
 
@@ -63,102 +61,141 @@ void ucq_free_pgs(struct ucq *ucq)
 	munmap((void*)pg2, PGSIZE);
 }
 
-/* Consumer side, returns TRUE on success and fills *msg with the ev_msg.  If
- * the ucq appears empty, it will return FALSE.  Messages may have arrived after
- * we started getting that we do not receive. */
-bool get_ucq_msg(struct ucq *ucq, struct event_msg *msg)
+/* Helper: moves cons_idx from the bad slot 'bad_idx' to the next page and
+ * recycles the old page.  Returns when cons_idx has moved on, either by us or by
+ * someone else.
+ *
+ * There's no lock.  Any consumer that sees the bad slot tries to fix it, and
+ * the one that wins the CAS on cons_idx owns the old page.  The danger is
+ * touching a page that someone else already recycled (or munmapped), so a
+ * consumer 'pins' the ucq (u_nr_pins) before it reads the page header, then
+ * makes sure cons_idx is still bad_idx.  If it is, the old page is the current
+ * consumer page, and no one will recycle it until we unpin.  The winner unpins
+ * too, then waits for the other pinners to drop theirs, which they'll do once
+ * they see the CAS failed.
+ *
+ * Pinners only touch the ucq until they know the page is safe, so a stale
+ * pinner after the winner is done doesn't hurt anything. */
+static void ucq_swap_cons_page(struct ucq *ucq, uintptr_t bad_idx)
 {
-	uintptr_t my_idx;
 	struct ucq_page *old_page, *other_page;
+	uintptr_t next_pg;
+
+	atomic_inc(&ucq->u_nr_pins);
+	/* Pairs with the winner's unpinned check: either it sees our pin, or we see
+	 * the new cons_idx. */
+	mb();
+	if (atomic_read(&ucq->cons_idx) != bad_idx) {
+		atomic_dec(&ucq->u_nr_pins);
+		return;
+	}
+	old_page = (struct ucq_page*)PTE_ADDR(bad_idx);
+	/* We need to wait and make sure the kernel has posted the next page.  Worst
+	 * case, we know that the kernel is working on it, since prod_idx !=
+	 * cons_idx.  No one can move cons_idx until it's posted. */
+	while (!(next_pg = ACCESS_ONCE(old_page->header.cons_next_pg)))
+		cpu_relax();
+	assert(!PGOFF(next_pg));
+	if (!atomic_cas(&ucq->cons_idx, bad_idx, next_pg)) {
+		atomic_dec(&ucq->u_nr_pins);
+		return;
+	}
+	/* Side note: at this point, any *new* consumers coming in will grab slots
+	 * based off the new counter index (cons_idx) */
+	atomic_dec(&ucq->u_nr_pins);
+	/* Now free up the old page.  Need to make sure all other consumers are done
+	 * with their slots.  We spin til enough are done, like an inverted refcnt.
+	 * We also need anyone who pinned the old page to see that they lost. */
+	while ((atomic_read(&old_page->header.nr_cons) < NR_MSG_PER_PAGE) ||
+	       atomic_read(&ucq->u_nr_pins)) {
+		/* spinning on userspace here, specifically, another vcore and we
+		 * don't know who it is.  This will spin a bit, then make sure they
+		 * aren't preeempted */
+		cpu_relax_any();
+	}
+	/* Now the page is done.  0 its metadata and give it up. */
+	old_page->header.cons_next_pg = 0;
+	atomic_set(&old_page->header.nr_cons, 0);
+	/* We want to "free" the page.  We'll try and set it as the spare.  If there
+	 * is already a spare, we'll free that one. */
+	other_page = (struct ucq_page*)atomic_swap(&ucq->spare_pg, (long)old_page);
+	assert(!PGOFF(other_page));
+	if (other_page) {
+		munmap(other_page, PGSIZE);
+		atomic_dec(&ucq->nr_extra_pgs);
+	}
+}
+
+/* Consumer side, fills msgs[] with up to max ev_msgs and returns how many we
+ * got.  If the ucq appears empty, it will return 0.  Messages may have arrived
+ * after we started getting that we do not receive.
+ *
+ * Safe to call from any number of vcores at once.  Consumers claim slots with a
+ * CAS on cons_idx, and page swaps are lock-free too (ucq_swap_cons_page()).  We
+ * claim as many slots as we can in one CAS, but never past the end of the page
+ * or past the producer. */
+unsigned int get_ucq_msgs(struct ucq *ucq, struct event_msg *msgs,
+                          unsigned int max)
+{
+	uintptr_t my_idx, prod_idx;
+	long nr;
 	struct msg_container *my_msg;
-	struct spin_pdr_lock *ucq_lock = (struct spin_pdr_lock*)(&ucq->u_lock);
 
+	assert(max);
 	do {
-loop_top:
 		cmb();
 		my_idx = atomic_read(&ucq->cons_idx);
+		prod_idx = atomic_read(&ucq->prod_idx);
 		/* The ucq is empty if the consumer and producer are on the same 'next'
 		 * slot. */
-		if (my_idx == atomic_read(&ucq->prod_idx))
-			return FALSE;
-		/* Is the slot we want good?  If not, we're going to need to try and
-		 * move on to the next page.  If it is, we bypass all of this and try to
-		 * CAS on us getting my_idx. */
-		if (slot_is_good(my_idx))
-			goto claim_slot;
-		/* Slot is bad, let's try and fix it */
-		spin_pdr_lock(ucq_lock);
-		/* Reread the idx, in case someone else fixed things up while we
-		 * were waiting/fighting for the lock */
-		my_idx = atomic_read(&ucq->cons_idx);
-		if (slot_is_good(my_idx)) {
-			/* Someone else fixed it already, let's just try to get out */
-			spin_pdr_unlock(ucq_lock);
-			/* Make sure this new slot has a producer (ucq isn't empty) */
-			if (my_idx == atomic_read(&ucq->prod_idx))
-				return FALSE;
-			goto claim_slot;
+		if (my_idx == prod_idx)
+			return 0;
+		/* Is the slot we want good?  If not, we're going to need to move on to
+		 * the next page, then try again.  If it is, we try to CAS on us getting
+		 * my_idx and maybe a few more. */
+		if (!slot_is_good(my_idx)) {
+			ucq_swap_cons_page(ucq, my_idx);
+			continue;
 		}
-		/* At this point, the slot is bad, and all other possible consumers are
-		 * spinning on the lock.  Time to fix things up: Set the counter to the
-		 * next page, and free the old one. */
-		/* First, we need to wait and make sure the kernel has posted the next
-		 * page.  Worst case, we know that the kernel is working on it, since
-		 * prod_idx != cons_idx */
-		old_page = (struct ucq_page*)PTE_ADDR(my_idx);
-		while (!old_page->header.cons_next_pg)
-			cpu_relax();
-		/* Now set the counter to the next page */
-		assert(!PGOFF(old_page->header.cons_next_pg));
-		atomic_set(&ucq->cons_idx, old_page->header.cons_next_pg);
-		/* Side note: at this point, any *new* consumers coming in will grab
-		 * slots based off the new counter index (cons_idx) */
-		/* Now free up the old page.  Need to make sure all other consumers are
-		 * done.  We spin til enough are done, like an inverted refcnt. */
-		while (atomic_read(&old_page->header.nr_cons) < NR_MSG_PER_PAGE) {
-			/* spinning on userspace here, specifically, another vcore and we
-			 * don't know who it is.  This will spin a bit, then make sure they
-			 * aren't preeempted */
-			cpu_relax_any();
-		}
-		/* Now the page is done.  0 its metadata and give it up. */
-		old_page->header.cons_next_pg = 0;
-		atomic_set(&old_page->header.nr_cons, 0);
-		/* We want to "free" the page.  We'll try and set it as the spare.  If
-		 * there is already a spare, we'll free that one. */
-		other_page = (struct ucq_page*)atomic_swap(&ucq->spare_pg,
-		                                           (long)old_page);
-		assert(!PGOFF(other_page));
-		if (other_page) {
-			munmap(other_page, PGSIZE);
-			atomic_dec(&ucq->nr_extra_pgs);
-		}
-		/* All fixed up, unlock.  Other consumers may lock and check to make
-		 * sure things are done. */
-		spin_pdr_unlock(ucq_lock);
-		/* Now that everything is fixed, try again from the top */
-		goto loop_top;
-claim_slot:
-		cmb();	/* so we can goto claim_slot */
+		nr = MIN(max, NR_MSG_PER_PAGE - PGOFF(my_idx));
+		/* If the producer moved on to another page, everything left on our page
+		 * was handed out to producers.  O/w, don't pass it.  It might have moved
+		 * since we read cons_idx, so nr < 1 means our read was stale. */
+		if (PTE_ADDR(prod_idx) == PTE_ADDR(my_idx))
+			nr = MIN(nr, (long)PGOFF(prod_idx) - (long)PGOFF(my_idx));
+		if (nr < 1)
+			continue;
 		/* If we're still here, my_idx is good, and we'll try to claim it.  If
 		 * we fail, we need to repeat the whole process. */
-	} while (!atomic_cas(&ucq->cons_idx, my_idx, my_idx + 1));
-	assert(slot_is_good(my_idx));
-	/* Now we have a good slot that we can consume */
-	my_msg = slot2msg(my_idx);
-	/* linux would put an rmb_depends() here */
-	/* Wait til the msg is ready (kernel sets this flag) */
-	while (!my_msg->ready)
-		cpu_relax();
-	rmb();	/* order the ready read before the contents */
-	/* Copy out */
-	*msg = my_msg->ev_msg;
-	/* Unset this for the next usage of the container */
-	my_msg->ready = FALSE;
-	wmb();	/* post the ready write before incrementing */
+		if (atomic_cas(&ucq->cons_idx, my_idx, my_idx + nr))
+			break;
+	} while (1);
+	/* Now we have good slots that we can consume */
+	for (long i = 0; i < nr; i++) {
+		assert(slot_is_good(my_idx + i));
+		my_msg = slot2msg(my_idx + i);
+		/* linux would put an rmb_depends() here */
+		/* Wait til the msg is ready (kernel sets this flag) */
+		while (!my_msg->ready)
+			cpu_relax();
+		rmb();	/* order the ready read before the contents */
+		/* Copy out */
+		msgs[i] = my_msg->ev_msg;
+		/* Unset this for the next usage of the container */
+		my_msg->ready = FALSE;
+	}
+	wmb();	/* post the ready writes before incrementing */
 	/* Increment nr_cons, showing we're done */
-	atomic_inc(&((struct ucq_page*)PTE_ADDR(my_idx))->header.nr_cons);
-	return TRUE;
+	atomic_fetch_and_add(&((struct ucq_page*)PTE_ADDR(my_idx))->header.nr_cons,
+	                     nr);
+	return nr;
+}
+
+/* Consumer side, returns TRUE on success and fills *msg with the ev_msg.  If
+ * the ucq appears empty, it will return FALSE. */
+bool get_ucq_msg(struct ucq *ucq, struct event_msg *msg)
+{
+	return get_ucq_msgs(ucq, msg, 1) ? TRUE : FALSE;
 }
 
 bool ucq_is_empty(struct ucq *ucq)
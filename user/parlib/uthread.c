@@ -31,6 +31,8 @@ static void handle_vc_preempt(struct event_msg *ev_msg, unsigned int ev_type,
                               void *data);
 static void handle_vc_indir(struct event_msg *ev_msg, unsigned int ev_type,
                             void *data);
+static void handle_vc_preempt_pending(struct event_msg *ev_msg,
+                                      unsigned int ev_type, void *data);
 static void __ros_uth_syscall_blockon(struct syscall *sysc);
 
 /* Helper, initializes a fresh uthread to be thread0. */
@@ -108,6 +110,7 @@ void uthread_mcp_init()
 	 * that yielding vcores do not miss the preemption messages. */
 	register_ev_handler(EV_VCORE_PREEMPT, handle_vc_preempt, 0);
 	register_ev_handler(EV_CHECK_MSGS, handle_vc_indir, 0);
+	register_ev_handler(EV_PREEMPT_PENDING, handle_vc_preempt_pending, 0);
 	preempt_ev_q = get_eventq_slim();	/* small ev_q, mostly a vehicle for flags */
 	preempt_ev_q->ev_flags = EVENT_IPI | EVENT_SPAM_PUBLIC | EVENT_VCORE_APPRO |
 							 EVENT_VCORE_MUST_RUN | EVENT_WAKEUP;
@@ -117,6 +120,9 @@ void uthread_mcp_init()
 	 * INDIRs, we could consider using separate ones. */
 	register_kevent_q(preempt_ev_q, EV_VCORE_PREEMPT);
 	register_kevent_q(preempt_ev_q, EV_CHECK_MSGS);
+	/* The kernel warns a vcore before it takes its core, if it is set up to,
+	 * and then we have a chance to yield cleanly. */
+	register_kevent_q(preempt_ev_q, EV_PREEMPT_PENDING);
 	printd("[user] registered %08p (flags %08p) for preempt messages\n",
 	       preempt_ev_q, preempt_ev_q->ev_flags);
 	/* Get ourselves into _M mode.  Could consider doing this elsewhere... */
@@ -1090,6 +1096,15 @@ out_we_returned:
 	ev_we_returned(were_handling_remotes);
 }
 
+/* The kernel wants one of our cores back soon.  The message's job is to get the
+ * vcore into vc ctx: uthread_vcore_entry() checks for a pending preempt after
+ * handling events, and yields cleanly, with the 2LS's preempt_pending op.
+ * Yielding from here could leave other events unhandled. */
+static void handle_vc_preempt_pending(struct event_msg *ev_msg,
+                                      unsigned int ev_type, void *data)
+{
+}
+
 /* This handles a preemption message.  When this is done, either we recovered,
  * or recovery *for our message* isn't needed. */
 static void handle_vc_preempt(struct event_msg *ev_msg, unsigned int ev_type,
@@ -0,0 +1,259 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Per-vcore malloc, see parlib/vcore_malloc.h.
+ *
+ * Every block has a struct vm_hdr in front of it.  The tag tells us which
+ * cache the block came from, or whether it was mmapped or is an aligned block
+ * carved out of a bigger one.
+ *
+ * We need to tell our blocks from the ones glibc handed out before we took
+ * over.  glibc keeps a chunk's size right before the pointer it returns, in the
+ * same spot as our tag.  Sizes are multiples of MALLOC_ALIGNMENT (16 on 64 bit)
+ * and the flags are in the low three bits, so bit 3 of a glibc size is never
+ * set.  Ours always is. */
+
+#include <parlib/vcore_malloc.h>
+#include <parlib/slab.h>
+#include <parlib/parlib.h>
+#include <parlib/assert.h>
+#include <ros/arch/membar.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <malloc.h>
+#include <string.h>
+#include <errno.h>
+
+struct vm_hdr {
+	size_t						len;
+	uintptr_t					tag;
+};
+
+#define VM_TAG					0x8
+#define VM_KIND_SHIFT			4
+
+/* Our size classes are powers of two, including the header: 32 bytes to 32 KB.
+ * Anything bigger gets its own mmap. */
+#define VM_MIN_SHIFT			5
+#define VM_MAX_SHIFT			15
+#define VM_NR_CLASSES			(VM_MAX_SHIFT - VM_MIN_SHIFT + 1)
+#define VM_MAX_CLASS_SZ			(1UL << VM_MAX_SHIFT)
+
+/* Kinds that aren't size classes.  For these, the header's len is the mmap's
+ * length, or how far back the real block starts. */
+#define VM_KIND_MMAP			0xfe
+#define VM_KIND_ALIGNED			0xff
+
+static const char *vm_cache_names[VM_NR_CLASSES] = {
+	"vcore_malloc-32", "vcore_malloc-64", "vcore_malloc-128",
+	"vcore_malloc-256", "vcore_malloc-512", "vcore_malloc-1024",
+	"vcore_malloc-2048", "vcore_malloc-4096", "vcore_malloc-8192",
+	"vcore_malloc-16384", "vcore_malloc-32768",
+};
+
+static struct kmem_cache *vm_caches[VM_NR_CLASSES];
+static bool vm_enabled;
+
+static struct vm_hdr *ptr_hdr(void *ptr)
+{
+	return ptr - sizeof(struct vm_hdr);
+}
+
+static uintptr_t vm_tag(unsigned int kind)
+{
+	return (kind << VM_KIND_SHIFT) | VM_TAG;
+}
+
+static bool vm_owns(void *ptr)
+{
+	return ptr_hdr(ptr)->tag & VM_TAG;
+}
+
+static unsigned int vm_kind(void *ptr)
+{
+	return ptr_hdr(ptr)->tag >> VM_KIND_SHIFT;
+}
+
+/* Smallest class that holds total bytes. */
+static unsigned int vm_class(size_t total)
+{
+	if (total <= 1UL << VM_MIN_SHIFT)
+		return 0;
+	return (64 - __builtin_clzl(total - 1)) - VM_MIN_SHIFT;
+}
+
+static size_t vm_class_size(unsigned int class)
+{
+	return 1UL << (class + VM_MIN_SHIFT);
+}
+
+static void *vm_alloc(size_t size)
+{
+	struct vm_hdr *hdr;
+	size_t total, len;
+	unsigned int class;
+
+	if (size > SIZE_MAX - sizeof(struct vm_hdr) - PGSIZE) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	total = size + sizeof(struct vm_hdr);
+	if (total <= VM_MAX_CLASS_SZ) {
+		class = vm_class(total);
+		hdr = kmem_cache_alloc(vm_caches[class], 0);
+		hdr->len = 0;
+		hdr->tag = vm_tag(class);
+		return hdr + 1;
+	}
+	len = ROUNDUP(total, PGSIZE);
+	hdr = mmap(0, len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+	           -1, 0);
+	if (hdr == MAP_FAILED) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	hdr->len = len;
+	hdr->tag = vm_tag(VM_KIND_MMAP);
+	return hdr + 1;
+}
+
+static void vm_free(void *ptr)
+{
+	struct vm_hdr *hdr;
+	unsigned int kind;
+
+	if (!ptr)
+		return;
+	/* glibc's, from before we took over.  See the header. */
+	if (!vm_owns(ptr))
+		return;
+	hdr = ptr_hdr(ptr);
+	kind = vm_kind(ptr);
+	switch (kind) {
+	case VM_KIND_ALIGNED:
+		vm_free(ptr - hdr->len);
+		break;
+	case VM_KIND_MMAP:
+		munmap(hdr, hdr->len);
+		break;
+	default:
+		assert(kind < VM_NR_CLASSES);
+		kmem_cache_free(vm_caches[kind], hdr);
+		break;
+	}
+}
+
+static size_t vm_usable_size(void *ptr)
+{
+	struct vm_hdr *hdr = ptr_hdr(ptr);
+
+	if (!vm_owns(ptr))
+		return malloc_usable_size(ptr);
+	switch (vm_kind(ptr)) {
+	case VM_KIND_ALIGNED:
+		return vm_usable_size(ptr - hdr->len) - hdr->len;
+	case VM_KIND_MMAP:
+		return hdr->len - sizeof(struct vm_hdr);
+	default:
+		return vm_class_size(vm_kind(ptr)) - sizeof(struct vm_hdr);
+	}
+}
+
+static void *vm_realloc(void *ptr, size_t size)
+{
+	size_t old_size;
+	void *new;
+
+	if (!ptr)
+		return vm_alloc(size);
+	if (!size) {
+		vm_free(ptr);
+		return NULL;
+	}
+	old_size = vm_usable_size(ptr);
+	if (size <= old_size)
+		return ptr;
+	new = vm_alloc(size);
+	if (!new)
+		return NULL;
+	memcpy(new, ptr, MIN(old_size, size));
+	vm_free(ptr);
+	return new;
+}
+
+static void *vm_memalign(size_t align, size_t size)
+{
+	uintptr_t raw, aligned;
+	struct vm_hdr *hdr;
+
+	if (align <= sizeof(struct vm_hdr))
+		return vm_alloc(size);
+	/* Like glibc, round up alignments that aren't a power of two. */
+	if (align & (align - 1))
+		align = 1UL << (64 - __builtin_clzl(align));
+	if (size > SIZE_MAX - align) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	raw = (uintptr_t)vm_alloc(size + align);
+	if (!raw)
+		return NULL;
+	aligned = ROUNDUP(raw, align);
+	if (aligned == raw)
+		return (void*)raw;
+	/* Both are 16 byte aligned, so there's room for a header in between. */
+	hdr = ptr_hdr((void*)aligned);
+	hdr->len = aligned - raw;
+	hdr->tag = vm_tag(VM_KIND_ALIGNED);
+	return (void*)aligned;
+}
+
+static void *vm_malloc_hook(size_t size, const void *caller)
+{
+	return vm_alloc(size);
+}
+
+static void vm_free_hook(void *ptr, const void *caller)
+{
+	vm_free(ptr);
+}
+
+static void *vm_realloc_hook(void *ptr, size_t size, const void *caller)
+{
+	return vm_realloc(ptr, size);
+}
+
+static void *vm_memalign_hook(size_t align, size_t size, const void *caller)
+{
+	return vm_memalign(align, size);
+}
+
+static void __vcore_malloc_init(void *arg)
+{
+	/* The tag trick needs glibc's 16 byte chunk alignment. */
+	parlib_static_assert(sizeof(size_t) == 8);
+	for (int i = 0; i < VM_NR_CLASSES; i++)
+		vm_caches[i] = kmem_cache_create(vm_cache_names[i], vm_class_size(i),
+		                                 sizeof(struct vm_hdr), 0, NULL, NULL,
+		                                 NULL);
+	/* Anything glibc allocates until the malloc hook is in is just a foreign
+	 * block to us, so that one goes last. */
+	__free_hook = vm_free_hook;
+	__realloc_hook = vm_realloc_hook;
+	__memalign_hook = vm_memalign_hook;
+	wmb();
+	__malloc_hook = vm_malloc_hook;
+	vm_enabled = TRUE;
+}
+
+void vcore_malloc_init(void)
+{
+	static parlib_once_t once = PARLIB_ONCE_INIT;
+
+	parlib_run_once(&once, __vcore_malloc_init, NULL);
+}
+
+bool vcore_malloc_enabled(void)
+{
+	return vm_enabled;
+}
@@ -4,6 +4,8 @@
 #include <parlib/uthread.h>
 #include <parlib/parlib.h>
 #include <parlib/assert.h>
+#include <parlib/arch/arch.h>
+#include <parlib/arch/atomic.h>
 #include <stdio.h>
 #include <errno.h>
 #include <parlib/slab.h>
@@ -14,41 +16,95 @@ static inline int futex_wake(int *uaddr, int count);
 static inline int futex_wait(int *uaddr, int val, uint64_t ms_timeout);
 static void *timer_thread(void *arg);
 
+struct futex_bucket;
+
 struct futex_element {
   TAILQ_ENTRY(futex_element) link;
   struct uthread *uthread;
   int *uaddr;
+  /* Changes on a requeue, protected by both buckets' locks */
+  struct futex_bucket *bucket;
   uint64_t us_timeout;
   struct alarm_waiter awaiter;
   bool timedout;
 };
 TAILQ_HEAD(futex_queue, futex_element);
 
-struct futex_data {
+/* Waiters are hashed by address into buckets, each with its own lock, so
+ * wakers only scan (and contend with) waiters that are likely on their
+ * futex. */
+#define NR_FUTEX_BUCKETS 256
+
+struct futex_bucket {
   struct mcs_pdr_lock lock;
   struct futex_queue queue;
-};
-static struct futex_data __futex;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct futex_bucket __futex_buckets[NR_FUTEX_BUCKETS];
 
 static inline void futex_init(void *arg)
 {
-  mcs_pdr_init(&__futex.lock);
-  TAILQ_INIT(&__futex.queue);
+  for (int i = 0; i < NR_FUTEX_BUCKETS; i++) {
+    mcs_pdr_init(&__futex_buckets[i].lock);
+    TAILQ_INIT(&__futex_buckets[i].queue);
+  }
+}
+
+static struct futex_bucket *futex_hash(int *uaddr)
+{
+  uint64_t x = (uintptr_t)uaddr >> 2;
+
+  /* Futexes are often in nearby words, so mix the bits up a little */
+  x ^= x >> 13;
+  x *= 0x9e3779b97f4a7c15ULL;
+  return &__futex_buckets[(x >> 32) % NR_FUTEX_BUCKETS];
+}
+
+/* Locks one or two buckets, in address order. */
+static void futex_lock_two(struct futex_bucket *b1, struct futex_bucket *b2)
+{
+  if (b1 == b2) {
+    mcs_pdr_lock(&b1->lock);
+    return;
+  }
+  if (b1 > b2) {
+    struct futex_bucket *temp = b1;
+
+    b1 = b2;
+    b2 = temp;
+  }
+  mcs_pdr_lock(&b1->lock);
+  mcs_pdr_lock(&b2->lock);
+}
+
+static void futex_unlock_two(struct futex_bucket *b1, struct futex_bucket *b2)
+{
+  mcs_pdr_unlock(&b1->lock);
+  if (b1 != b2)
+    mcs_pdr_unlock(&b2->lock);
 }
 
 static void __futex_timeout(struct alarm_waiter *awaiter) {
   struct futex_element *__e = NULL;
   struct futex_element *e = (struct futex_element*)awaiter->data;
+  struct futex_bucket *b;
   //printf("timeout fired: %p\n", e->uaddr);
 
   // Atomically remove the timed-out element from the futex queue if we won the
-  // race against actually completing.
-  mcs_pdr_lock(&__futex.lock);
-  TAILQ_FOREACH(__e, &__futex.queue, link)
+  // race against actually completing.  A requeue can move it to another bucket
+  // until we have its bucket locked.
+  while (1) {
+    b = ACCESS_ONCE(e->bucket);
+    mcs_pdr_lock(&b->lock);
+    if (e->bucket == b)
+      break;
+    mcs_pdr_unlock(&b->lock);
+  }
+  TAILQ_FOREACH(__e, &b->queue, link)
     if (__e == e) break;
   if (__e != NULL)
-    TAILQ_REMOVE(&__futex.queue, e, link);
-  mcs_pdr_unlock(&__futex.lock);
+    TAILQ_REMOVE(&b->queue, e, link);
+  mcs_pdr_unlock(&b->lock);
 
   // If we removed it, restart it outside the lock
   if (__e != NULL) {
@@ -72,7 +128,7 @@ static void __futex_block(struct uthread *uthread, void *arg) {
   e->timedout = false;
 
   // Insert the futex element into the queue
-  TAILQ_INSERT_TAIL(&__futex.queue, e, link);
+  TAILQ_INSERT_TAIL(&e->bucket->queue, e, link);
 
   // Set an alarm for the futex timeout if applicable
   if(e->us_timeout != (uint64_t)-1) {
@@ -87,19 +143,22 @@ static void __futex_block(struct uthread *uthread, void *arg) {
   uthread_has_blocked(uthread, UTH_EXT_BLK_MUTEX);
 
   // Unlock the pdr_lock 
-  mcs_pdr_unlock(&__futex.lock);
+  mcs_pdr_unlock(&e->bucket->lock);
 }
 
 static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout)
 {
+  struct futex_bucket *b = futex_hash(uaddr);
+
   // Atomically do the following...
-  mcs_pdr_lock(&__futex.lock);
+  mcs_pdr_lock(&b->lock);
   // If the value of *uaddr matches val
   if(*uaddr == val) {
     //printf("wait: %p, %d\n", uaddr, us_timeout);
     // Create a new futex element and initialize it.
     struct futex_element e;
     e.uaddr = uaddr;
+    e.bucket = b;
     e.us_timeout = us_timeout;
     // Yield the uthread...
     // We set the remaining properties of the futex element, set the timeout
@@ -126,40 +185,41 @@ static inline int futex_wait(int *uaddr, int val, uint64_t us_timeout)
       return -1;
     }
   } else {
-      mcs_pdr_unlock(&__futex.lock);
+      mcs_pdr_unlock(&b->lock);
+      errno = EAGAIN;
+      return -1;
   }
   return 0;
 }
 
-static inline int futex_wake(int *uaddr, int count)
+// Pulls up to count waiters on uaddr out of its bucket and onto q.  Caller
+// holds the bucket lock.  Returns how many we got.
+static int __futex_dequeue(struct futex_bucket *b, int *uaddr, int count,
+                           struct futex_queue *q)
 {
-  int max = count;
-  struct futex_element *e,*n = NULL;
-  struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+  struct futex_element *e, *n;
+  int nr = 0;
 
-  // Atomically grab all relevant futex blockers
-  // from the global futex queue
-  mcs_pdr_lock(&__futex.lock);
-  e = TAILQ_FIRST(&__futex.queue);
-  while(e != NULL) {
-    if(count > 0) {
-      n = TAILQ_NEXT(e, link);
-      if(e->uaddr == uaddr) {
-        TAILQ_REMOVE(&__futex.queue, e, link);
-        TAILQ_INSERT_TAIL(&q, e, link);
-        count--;
-      }
-      e = n;
+  for (e = TAILQ_FIRST(&b->queue); e && nr < count; e = n) {
+    n = TAILQ_NEXT(e, link);
+    if (e->uaddr == uaddr) {
+      TAILQ_REMOVE(&b->queue, e, link);
+      TAILQ_INSERT_TAIL(q, e, link);
+      nr++;
     }
-    else break;
   }
-  mcs_pdr_unlock(&__futex.lock);
+  return nr;
+}
 
-  // Unblock them outside the lock
-  e = TAILQ_FIRST(&q);
+// Unblocks everyone on q.  Call this outside the bucket locks.
+static void __futex_wake_queue(struct futex_queue *q)
+{
+  struct futex_element *e, *n;
+
+  e = TAILQ_FIRST(q);
   while(e != NULL) {
     n = TAILQ_NEXT(e, link);
-    TAILQ_REMOVE(&q, e, link);
+    TAILQ_REMOVE(q, e, link);
     // Cancel the timeout if one was set
     if(e->us_timeout != (uint64_t)-1) {
       // Try and unset the alarm.  If this fails, then we have already
@@ -175,11 +235,134 @@ static inline int futex_wake(int *uaddr, int count)
         e->awaiter.data = NULL;
       }
     }
-    //printf("wake: %p\n", uaddr);
+    //printf("wake: %p\n", e->uaddr);
     uthread_runnable(e->uthread);
     e = n;
   }
-  return max-count;
+}
+
+static inline int futex_wake(int *uaddr, int count)
+{
+  struct futex_bucket *b = futex_hash(uaddr);
+  struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+  int nr;
+
+  // Atomically grab all relevant futex blockers from the bucket
+  mcs_pdr_lock(&b->lock);
+  nr = __futex_dequeue(b, uaddr, count, &q);
+  mcs_pdr_unlock(&b->lock);
+  // Unblock them outside the lock
+  __futex_wake_queue(&q);
+  return nr;
+}
+
+// Wakes up to nr_wake waiters on uaddr and moves up to nr_requeue of the rest
+// to uaddr2.  If cmp, only if *uaddr == val3.
+static int futex_requeue(int *uaddr, int nr_wake, int nr_requeue, int *uaddr2,
+                         bool cmp, int val3)
+{
+  struct futex_bucket *b1 = futex_hash(uaddr);
+  struct futex_bucket *b2 = futex_hash(uaddr2);
+  struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+  struct futex_queue moved = TAILQ_HEAD_INITIALIZER(moved);
+  struct futex_element *e;
+  int nr, nr_moved;
+
+  futex_lock_two(b1, b2);
+  if (cmp && *uaddr != val3) {
+    futex_unlock_two(b1, b2);
+    errno = EAGAIN;
+    return -1;
+  }
+  nr = __futex_dequeue(b1, uaddr, nr_wake, &q);
+  nr_moved = __futex_dequeue(b1, uaddr, nr_requeue, &moved);
+  TAILQ_FOREACH(e, &moved, link) {
+    e->uaddr = uaddr2;
+    e->bucket = b2;
+  }
+  TAILQ_CONCAT(&b2->queue, &moved, link);
+  futex_unlock_two(b1, b2);
+  __futex_wake_queue(&q);
+  // Linux returns the number requeued too, but only for CMP_REQUEUE
+  return cmp ? nr + nr_moved : nr;
+}
+
+static int futex_atomic_op(int *uaddr, int encoded_op, int *oldval)
+{
+  int op = (encoded_op >> 28) & 7;
+  int cmp = (encoded_op >> 24) & 15;
+  int oparg = (encoded_op << 8) >> 20;	/* sign extend the 12 bits */
+  int cmparg = (encoded_op << 20) >> 20;
+  int old, new;
+
+  if ((encoded_op >> 28) & FUTEX_OP_OPARG_SHIFT)
+    oparg = 1 << (oparg & 31);
+  do {
+    old = ACCESS_ONCE(*uaddr);
+    switch (op) {
+      case FUTEX_OP_SET:
+        new = oparg;
+        break;
+      case FUTEX_OP_ADD:
+        new = old + oparg;
+        break;
+      case FUTEX_OP_OR:
+        new = old | oparg;
+        break;
+      case FUTEX_OP_ANDN:
+        new = old & ~oparg;
+        break;
+      case FUTEX_OP_XOR:
+        new = old ^ oparg;
+        break;
+      default:
+        errno = ENOSYS;
+        return -1;
+    }
+  } while (!atomic_cas_u32((uint32_t*)uaddr, old, new));
+  *oldval = old;
+  switch (cmp) {
+    case FUTEX_OP_CMP_EQ:
+      return old == cmparg;
+    case FUTEX_OP_CMP_NE:
+      return old != cmparg;
+    case FUTEX_OP_CMP_LT:
+      return old < cmparg;
+    case FUTEX_OP_CMP_LE:
+      return old <= cmparg;
+    case FUTEX_OP_CMP_GT:
+      return old > cmparg;
+    case FUTEX_OP_CMP_GE:
+      return old >= cmparg;
+    default:
+      errno = ENOSYS;
+      return -1;
+  }
+}
+
+// Atomically does the op on uaddr2, wakes up to nr_wake on uaddr, and if the
+// old value of uaddr2 passes the op's comparison, wakes up to nr_wake2 on
+// uaddr2.
+static int futex_wake_op(int *uaddr, int nr_wake, int nr_wake2, int *uaddr2,
+                         int encoded_op)
+{
+  struct futex_bucket *b1 = futex_hash(uaddr);
+  struct futex_bucket *b2 = futex_hash(uaddr2);
+  struct futex_queue q = TAILQ_HEAD_INITIALIZER(q);
+  int oldval, cmp_ret, nr;
+
+  futex_lock_two(b1, b2);
+  cmp_ret = futex_atomic_op(uaddr2, encoded_op, &oldval);
+  if (cmp_ret < 0) {
+    futex_unlock_two(b1, b2);
+    return -1;
+  }
+  nr = __futex_dequeue(b1, uaddr, nr_wake, &q);
+  if (cmp_ret)
+    nr += __futex_dequeue(b2, uaddr2, nr_wake2, &q);
+  futex_unlock_two(b1, b2);
+  __futex_wake_queue(&q);
+  return nr;
 }
 
 int futex(int *uaddr, int op, int val,
@@ -187,25 +370,29 @@ int futex(int *uaddr, int op, int val,
           int *uaddr2, int val3)
 {
   static parlib_once_t once = PARLIB_ONCE_INIT;
+  int val2 = (int)(uintptr_t)timeout;
 
   parlib_run_once(&once, futex_init, NULL);
   // Round to the nearest micro-second
   uint64_t us_timeout = (uint64_t)-1;
-  assert(uaddr2 == NULL);
-  assert(val3 == 0);
-  if(timeout != NULL) {
-    us_timeout = timeout->tv_sec*1000000L + timeout->tv_nsec/1000L;
-    assert(us_timeout > 0);
-  }
-  switch(op) {
+  switch(op & FUTEX_CMD_MASK) {
     case FUTEX_WAIT:
+      if(timeout != NULL) {
+        us_timeout = timeout->tv_sec*1000000L + timeout->tv_nsec/1000L;
+        assert(us_timeout > 0);
+      }
       return futex_wait(uaddr, val, us_timeout);
     case FUTEX_WAKE:
       return futex_wake(uaddr, val);
+    case FUTEX_REQUEUE:
+      return futex_requeue(uaddr, val, val2, uaddr2, FALSE, 0);
+    case FUTEX_CMP_REQUEUE:
+      return futex_requeue(uaddr, val, val2, uaddr2, TRUE, val3);
+    case FUTEX_WAKE_OP:
+      return futex_wake_op(uaddr, val, val2, uaddr2, val3);
     default:
       errno = ENOSYS;
       return -1;
   }
   return -1;
 }
-
@@ -4,11 +4,42 @@
 
 __BEGIN_DECLS
 
+/* Same numbers as Linux, so linuxemu can pass them straight through */
 enum {
-	FUTEX_WAIT,
-	FUTEX_WAKE
+	FUTEX_WAIT = 0,
+	FUTEX_WAKE = 1,
+	FUTEX_REQUEUE = 3,
+	FUTEX_CMP_REQUEUE = 4,
+	FUTEX_WAKE_OP = 5,
 };
 
+/* We're always process-private, and we only do relative timeouts */
+#define FUTEX_PRIVATE_FLAG		128
+#define FUTEX_CLOCK_REALTIME	256
+#define FUTEX_CMD_MASK			~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
+
+/* FUTEX_WAKE_OP encoding, in val3 */
+#define FUTEX_OP_SET		0	/* uaddr2 = oparg; */
+#define FUTEX_OP_ADD		1	/* uaddr2 += oparg; */
+#define FUTEX_OP_OR			2	/* uaddr2 |= oparg; */
+#define FUTEX_OP_ANDN		3	/* uaddr2 &= ~oparg; */
+#define FUTEX_OP_XOR		4	/* uaddr2 ^= oparg; */
+#define FUTEX_OP_OPARG_SHIFT	8	/* Use (1 << oparg) as the operand */
+
+#define FUTEX_OP_CMP_EQ		0	/* if (oldval == cmparg) wake */
+#define FUTEX_OP_CMP_NE		1	/* if (oldval != cmparg) wake */
+#define FUTEX_OP_CMP_LT		2	/* if (oldval < cmparg) wake */
+#define FUTEX_OP_CMP_LE		3	/* if (oldval <= cmparg) wake */
+#define FUTEX_OP_CMP_GT		4	/* if (oldval > cmparg) wake */
+#define FUTEX_OP_CMP_GE		5	/* if (oldval >= cmparg) wake */
+
+#define FUTEX_OP(op, oparg, cmp, cmparg)                                       \
+	(((op & 0xf) << 28) | ((cmp & 0xf) << 24) | ((oparg & 0xfff) << 12) |      \
+	 (cmparg & 0xfff))
+
+/* For FUTEX_REQUEUE, FUTEX_CMP_REQUEUE, and FUTEX_WAKE_OP, 'timeout' is
+ * actually val2, like in Linux: the max number of waiters to requeue or to
+ * wake on uaddr2. */
 int futex(int *uaddr, int op, int val, const struct timespec *timeout,
           int *uaddr2, int val3);
 
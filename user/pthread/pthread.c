@@ -19,6 +19,9 @@
 #include <parlib/arch/trap.h>
 #include <parlib/ros_debug.h>
 #include <parlib/stdio.h>
+#include <parlib/vcore_malloc.h>
+#include <parlib/timing.h>
+#include <parlib/vcore_tick.h>
 #include <sys/fork_cb.h>
 
 /* TODO: eventually, we probably want to split this into the pthreads interface
@@ -42,10 +45,62 @@ bool need_tls = TRUE;
 static uint64_t fork_generation;
 #define INIT_FORK_GENERATION 1
 
+/* Work-stealing scheduler, see pthread_use_worksteal().  Each vcore has a
+ * Chase-Lev deque of runnable threads.  The vcore pushes and pops at the
+ * bottom, with notifs disabled so its vcore context can't cut in.  Idle vcores
+ * steal from the top of everyone else's deque, including offline vcores, so
+ * nothing gets stranded by a preemption.  Wakeups go onto the waker's vcore,
+ * where the wakee's data is likely warm.  The ready_queue is still used when a
+ * deque is full, and for threads from an old fork generation.  We don't track
+ * the active_queue, since that's another global lock per block. */
+#define PTH_DEQUE_SZ			256
+
+struct pth_deque {
+	atomic_t					top;
+	atomic_t					bottom;
+	struct pthread_tcb			*slots[PTH_DEQUE_SZ];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static bool pth_worksteal;
+static struct pth_deque *pth_deques;
+
+/* Stack cache.  Default-sized stacks aren't munmapped when their thread exits.
+ * Each vcore keeps a few 'hot' ones, with whatever pages the last thread
+ * faulted in, and pthread_create() on that vcore grabs them without a syscall.
+ * Past that, stacks go on a global 'cold' list after we drop everything but
+ * their top pages, and past that we munmap them.  Every stack has a PROT_NONE
+ * guard page below its bottom, which stays put while it's cached.  New stacks
+ * only commit their top PTHREAD_STACK_POP_PAGES; the rest faults in. */
+#define PTH_STACK_CACHE_HOT		8
+#define PTH_STACK_CACHE_COLD	128
+#define PTHREAD_STACK_POP_PAGES	4
+#define PTHREAD_STACK_GUARD		PGSIZE
+
+struct pth_stack_cache {
+	unsigned int				nr;
+	void						*stacktops[PTH_STACK_CACHE_HOT];
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+static struct pth_stack_cache *pth_stack_caches;
+static struct spin_pdr_lock cold_stack_lock = SPINPDR_INITIALIZER;
+static unsigned int nr_cold_stacks;
+static void *cold_stacks[PTH_STACK_CACHE_COLD];
+
 /* Array of per-vcore structs to manage waiting on syscalls and handling
  * overflow.  Init'd in pth_init(). */
 struct sysc_mgmt *sysc_mgmt = 0;
 
+/* Syscall completion polling, see pthread_sysc_poll().  An idle vcore spins on
+ * its syscall ev_q's UCQ for up to this many ticks before it yields.  0 is off.
+ * */
+static uint64_t pth_sysc_poll_tsc;
+
+/* Time slicing, see pthread_use_timeslice().  pth_slice_tsc is 0 when it's off.
+ * pth_slice_used tells vcores to turn their ticks back off. */
+static uint64_t pth_slice_tsc;
+static uint64_t pth_slice_usec;
+static bool pth_slice_used;
+
 /* Helper / local functions */
 static int get_next_pid(void);
 static inline void pthread_exit_no_cleanup(void *ret);
@@ -87,12 +142,285 @@ static void __pthread_free_stack(struct pthread_tcb *pt);
 static int __pthread_allocate_stack(struct pthread_tcb *pt);
 static void __pth_yield_cb(struct uthread *uthread, void *junk);
 
+/* Every path that makes a thread PTH_RUNNABLE goes through here, so the slicer
+ * knows how long it has been waiting. */
+static inline void pth_set_runnable(struct pthread_tcb *pthread)
+{
+	pthread->state = PTH_RUNNABLE;
+	if (pth_slice_tsc)
+		pthread->ready_tsc = read_tsc();
+}
+
+/* A ready thread's deadline is when it became runnable, plus a number of slices
+ * that shrinks with its priority: one slice for PTHREAD_PRIO_MAX, up to eight
+ * for PTHREAD_PRIO_MIN (the default).  Batch work still gets its turn; it's
+ * just willing to wait longer for it. */
+static uint64_t pth_deadline(struct pthread_tcb *pthread)
+{
+	return pthread->ready_tsc +
+	       pth_slice_tsc * (PTHREAD_PRIO_MAX + 1 - pthread->prio);
+}
+
+/* Owner only: pushes onto vcoreid's deque.  Returns FALSE if it's full. */
+static bool pth_deque_push(uint32_t vcoreid, struct pthread_tcb *pthread)
+{
+	struct pth_deque *dq = &pth_deques[vcoreid];
+	long b = atomic_read(&dq->bottom);
+	long t = atomic_read(&dq->top);
+
+	if (b - t >= PTH_DEQUE_SZ)
+		return FALSE;
+	dq->slots[b % PTH_DEQUE_SZ] = pthread;
+	wmb();	/* slot write before thieves can see it */
+	atomic_set(&dq->bottom, b + 1);
+	return TRUE;
+}
+
+/* Owner only: pops from the bottom of vcoreid's deque. */
+static struct pthread_tcb *pth_deque_pop(uint32_t vcoreid)
+{
+	struct pth_deque *dq = &pth_deques[vcoreid];
+	struct pthread_tcb *pthread;
+	long b = atomic_read(&dq->bottom) - 1;
+	long t;
+
+	atomic_set(&dq->bottom, b);
+	mb();	/* bottom write before top read; pairs with pth_deque_steal() */
+	t = atomic_read(&dq->top);
+	if (t > b) {
+		atomic_set(&dq->bottom, b + 1);
+		return NULL;
+	}
+	pthread = dq->slots[b % PTH_DEQUE_SZ];
+	if (t == b) {
+		/* Last one, race with thieves for it */
+		if (!atomic_cas(&dq->top, t, t + 1))
+			pthread = NULL;
+		atomic_set(&dq->bottom, b + 1);
+	}
+	return pthread;
+}
+
+/* Anyone: steals from the top of vcoreid's deque.  Can fail spuriously if we
+ * lose a race. */
+static struct pthread_tcb *pth_deque_steal(uint32_t vcoreid)
+{
+	struct pth_deque *dq = &pth_deques[vcoreid];
+	struct pthread_tcb *pthread;
+	long t = atomic_read(&dq->top);
+	long b;
+
+	mb();	/* top read before bottom read; pairs with pth_deque_pop() */
+	b = atomic_read(&dq->bottom);
+	if (t >= b)
+		return NULL;
+	pthread = dq->slots[t % PTH_DEQUE_SZ];
+	if (!atomic_cas(&dq->top, t, t + 1))
+		return NULL;
+	return pthread;
+}
+
+static long pth_deque_depth(uint32_t vcoreid)
+{
+	struct pth_deque *dq = &pth_deques[vcoreid];
+
+	return MAX(atomic_read(&dq->bottom) - atomic_read(&dq->top), 0);
+}
+
+/* Pushes a PTH_RUNNABLE thread onto our vcore's deque, or the ready_queue if
+ * that's full.  Caller has notifs disabled. */
+static void __pth_ws_enqueue(struct pthread_tcb *pthread)
+{
+	if (pth_deque_push(vcore_id(), pthread))
+		return;
+	mcs_pdr_lock(&queue_lock);
+	TAILQ_INSERT_TAIL(&ready_queue, pthread, tq_next);
+	threads_ready++;
+	mcs_pdr_unlock(&queue_lock);
+}
+
+/* Tries our deque, then everyone else's, starting with our neighbor. */
+static struct pthread_tcb *pth_ws_get_thread(uint32_t vcoreid)
+{
+	struct pthread_tcb *pthread;
+	uint32_t nr_vcores = max_vcores();
+
+	pthread = pth_deque_pop(vcoreid);
+	for (int i = 1; !pthread && i < nr_vcores; i++)
+		pthread = pth_deque_steal((vcoreid + i) % nr_vcores);
+	return pthread;
+}
+
+/* Helper: the current generation's thread on the ready_queue with the
+ * earliest deadline, or NULL.  This is O(n), but slicing is for apps with a
+ * handful of threads per vcore.  Caller holds the queue_lock. */
+static struct pthread_tcb *__pth_earliest_deadline(void)
+{
+	struct pthread_tcb *pthread, *best = NULL;
+	uint64_t dl, best_dl = UINT64_MAX;
+
+	TAILQ_FOREACH(pthread, &ready_queue, tq_next) {
+		if (pthread->fork_generation < fork_generation)
+			continue;
+		dl = pth_deadline(pthread);
+		if (dl < best_dl) {
+			best = pthread;
+			best_dl = dl;
+		}
+	}
+	return best;
+}
+
+/* Helper: gets the first thread of the current fork generation from the
+ * ready_queue, or NULL.  With time slicing, 'first' is by deadline. */
+static struct pthread_tcb *pth_fifo_get_thread(void)
+{
+	struct pthread_tcb *new_thread;
+
+	/* Lockless peek; the WS scheduler usually has nothing here */
+	if (pth_worksteal && TAILQ_EMPTY(&ready_queue))
+		return NULL;
+	mcs_pdr_lock(&queue_lock);
+	if (pth_slice_tsc) {
+		new_thread = __pth_earliest_deadline();
+	} else {
+		TAILQ_FOREACH(new_thread, &ready_queue, tq_next) {
+			if (new_thread->fork_generation < fork_generation)
+				continue;
+			break;
+		}
+	}
+	if (new_thread) {
+		TAILQ_REMOVE(&ready_queue, new_thread, tq_next);
+		threads_ready--;
+		if (!pth_worksteal) {
+			TAILQ_INSERT_TAIL(&active_queue, new_thread, tq_next);
+			threads_active++;
+		}
+	}
+	mcs_pdr_unlock(&queue_lock);
+	return new_thread;
+}
+
+/* Helper: takes the thread sysc's completion woke, for an idle vcore to run
+ * right away.  It skips the run queues, unlike restart_thread(). */
+static struct pthread_tcb *pth_sysc_direct(struct syscall *sysc)
+{
+	struct uthread *ut_restartee = (struct uthread*)sysc->u_data;
+	struct pthread_tcb *pthread = (struct pthread_tcb*)ut_restartee;
+
+	assert(ut_restartee);
+	assert(pthread->state == PTH_BLK_SYSC);
+	assert(ut_restartee->sysc == sysc);	/* set in uthread.c */
+	ut_restartee->sysc = 0;	/* so we don't 'reblock' on this later */
+	pthread->state = PTH_RUNNABLE;
+	if (!pth_worksteal) {
+		mcs_pdr_lock(&queue_lock);
+		TAILQ_INSERT_TAIL(&active_queue, pthread, tq_next);
+		threads_active++;
+		mcs_pdr_unlock(&queue_lock);
+	}
+	return pthread;
+}
+
+/* Helper: an idle vcore spins on its syscall ev_q for a little while instead of
+ * yielding, since the kernel round trip of yielding and getting woken up is
+ * often longer than the syscall.  Returns FALSE if nothing happened and we
+ * should yield.  o/w, *direct is the thread whose syscall completed, or NULL if
+ * some other work (an event, a ready thread) showed up. */
+static bool pth_sysc_spin(uint32_t vcoreid, struct pthread_tcb **direct)
+{
+	struct ucq *ucq = &sysc_mgmt[vcoreid].ev_q->ev_mbox->ucq;
+	uint64_t end = read_tsc() + pth_sysc_poll_tsc;
+	struct event_msg msg;
+
+	*direct = NULL;
+	do {
+		/* The INDIR the kernel sent along with the msg will find an
+		 * empty UCQ, which is fine. */
+		if (get_ucq_msg(ucq, &msg)) {
+			assert(msg.ev_type == EV_SYSCALL);
+			*direct = pth_sysc_direct(msg.ev_arg3);
+			return TRUE;
+		}
+		if (vcpd_of(vcoreid)->notif_pending || READ_ONCE(threads_ready))
+			return TRUE;
+		cpu_relax();
+	} while (read_tsc() < end);
+	return FALSE;
+}
+
+/* Helper: decides whether to kick cur off its vcore.  On a tick, we do if
+ * anyone else is waiting.  Between ticks (we're here for an event, often the
+ * wakeup of another thread), only a higher priority thread cuts in.  With work
+ * stealing, that's just threads on the ready_queue, not the deques. */
+static bool pth_should_preempt(struct pthread_tcb *cur)
+{
+	struct pthread_tcb *pthread;
+	bool ticked = vcore_tick_poll() > 0;
+	bool ret = FALSE;
+
+	if (TAILQ_EMPTY(&ready_queue) &&
+	    !(pth_worksteal && pth_deque_depth(vcore_id())))
+		return FALSE;
+	if (ticked)
+		return TRUE;
+	mcs_pdr_lock(&queue_lock);
+	TAILQ_FOREACH(pthread, &ready_queue, tq_next) {
+		if (pthread->prio > cur->prio &&
+		    pthread->fork_generation >= fork_generation) {
+			ret = TRUE;
+			break;
+		}
+	}
+	mcs_pdr_unlock(&queue_lock);
+	return ret;
+}
+
+/* Helper: puts current_uthread at the back of the ready_queue.  Even with work
+ * stealing, since our deque would just hand it right back. */
+static void pth_preempt_current(void)
+{
+	struct pthread_tcb *pthread;
+
+	pthread = (struct pthread_tcb*)stop_current_uthread();
+	__pthread_generic_yield(pthread);
+	pth_set_runnable(pthread);
+	mcs_pdr_lock(&queue_lock);
+	TAILQ_INSERT_TAIL(&ready_queue, pthread, tq_next);
+	threads_ready++;
+	mcs_pdr_unlock(&queue_lock);
+}
+
+/* Threads from an old fork generation never run again, but the FIFO scheduler
+ * leaves them on the ready_queue, so we do too. */
+static bool pth_ws_old_generation(struct pthread_tcb *pthread)
+{
+	if (pthread->fork_generation >= fork_generation)
+		return FALSE;
+	mcs_pdr_lock(&queue_lock);
+	TAILQ_INSERT_TAIL(&ready_queue, pthread, tq_next);
+	threads_ready++;
+	mcs_pdr_unlock(&queue_lock);
+	return TRUE;
+}
+
 /* Called from vcore entry.  Options usually include restarting whoever was
  * running there before or running a new thread.  Events are handled out of
  * event.c (table of function pointers, stuff like that). */
 static void __attribute__((noreturn)) pth_sched_entry(void)
 {
 	uint32_t vcoreid = vcore_id();
+
+	if (pth_slice_tsc) {
+		/* Turns on this vcore's tick, o/w it's cheap */
+		vcore_tick_enable(pth_slice_usec);
+		if (current_uthread &&
+		    pth_should_preempt((struct pthread_tcb*)current_uthread))
+			pth_preempt_current();
+	} else if (pth_slice_used) {
+		vcore_tick_disable();
+	}
 	if (current_uthread) {
 		/* Prep the pthread to run any pending posix signal handlers registered
          * via pthread_kill once it is restored. */
@@ -109,20 +437,17 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 	do {
 		handle_events(vcoreid);
 		__check_preempt_pending(vcoreid);
-		mcs_pdr_lock(&queue_lock);
-		TAILQ_FOREACH(new_thread, &ready_queue, tq_next) {
-			if (new_thread->fork_generation < fork_generation)
+		new_thread = NULL;
+		if (pth_worksteal) {
+			new_thread = pth_ws_get_thread(vcoreid);
+			if (new_thread && pth_ws_old_generation(new_thread))
 				continue;
-			break;
 		}
+		if (!new_thread)
+			new_thread = pth_fifo_get_thread();
 		if (new_thread) {
-			TAILQ_REMOVE(&ready_queue, new_thread, tq_next);
 			assert(new_thread->state == PTH_RUNNABLE);
 			new_thread->state = PTH_RUNNING;
-			TAILQ_INSERT_TAIL(&active_queue, new_thread, tq_next);
-			threads_active++;
-			threads_ready--;
-			mcs_pdr_unlock(&queue_lock);
 			/* If you see what looks like the same uthread running in multiple
 			 * places, your list might be jacked up.  Turn this on. */
 			printd("[P] got uthread %08p on vc %d state %08p flags %08p\n",
@@ -131,11 +456,16 @@ static void __attribute__((noreturn)) pth_sched_entry(void)
 			       ((struct uthread*)new_thread)->flags);
 			break;
 		}
-		mcs_pdr_unlock(&queue_lock);
+		/* Maybe a syscall is about to complete.  Whoever it woke runs
+		 * here, without going through the run queues. */
+		if (pth_sysc_poll_tsc && pth_sysc_spin(vcoreid, &new_thread)) {
+			if (!new_thread)
+				continue;
+			new_thread->state = PTH_RUNNING;
+			break;
+		}
 		/* no new thread, try to yield */
 		printd("[P] No threads, vcore %d is yielding\n", vcore_id());
-		/* TODO: you can imagine having something smarter here, like spin for a
-		 * bit before yielding. */
 		vcore_yield(FALSE);
 	} while (1);
 	/* Prep the pthread to run any pending posix signal handlers registered
@@ -175,11 +505,20 @@ static void pth_thread_runnable(struct uthread *uthread)
 		default:
 			panic("Odd state %d for pthread %08p\n", pthread->state, pthread);
 	}
-	pthread->state = PTH_RUNNABLE;
+	pth_set_runnable(pthread);
+	if (pth_worksteal) {
+		/* Keeps us on this vcore until we're done with its deque */
+		uth_disable_notifs();
+		__pth_ws_enqueue(pthread);
+		vcore_request_more(pth_deque_depth(vcore_id()));
+		uth_enable_notifs();
+		return;
+	}
 	/* Insert the newly created thread into the ready queue of threads.
 	 * It will be removed from this queue later when vcore_entry() comes up */
 	mcs_pdr_lock(&queue_lock);
-	/* Again, GIANT WARNING: if you change this, change batch wakeup code */
+	/* Again, GIANT WARNING: if you change this, change batch wakeup code
+	 * (pth_handle_syscalls()) */
 	TAILQ_INSERT_TAIL(&ready_queue, pthread, tq_next);
 	threads_ready++;
 	mcs_pdr_unlock(&queue_lock);
@@ -247,6 +586,56 @@ static void pth_handle_syscall(struct event_msg *ev_msg, unsigned int ev_type,
 	restart_thread(sysc);
 }
 
+/* Batch version of pth_handle_syscall(), for our per-vcore syscall ev_qs.
+ * Under load, a vcore gets a pile of completions per INDIR, and we'd rather
+ * grab the queue_lock and poke the vcore request code once for the lot.  This
+ * is a batch wakeup: keep it in sync with pth_thread_runnable(). */
+static void pth_handle_syscalls(struct event_msg *msgs, unsigned int nr,
+                                void *data)
+{
+	struct pthread_queue restartees = TAILQ_HEAD_INITIALIZER(restartees);
+	struct syscall *sysc;
+	struct uthread *ut_restartee;
+	struct pthread_tcb *pthread;
+	unsigned int nr_restartees = 0;
+
+	assert(in_vcore_context());
+	for (unsigned int i = 0; i < nr; i++) {
+		assert(msgs[i].ev_type == EV_SYSCALL);
+		sysc = msgs[i].ev_arg3;
+		assert(sysc);
+		ut_restartee = (struct uthread*)sysc->u_data;
+		pthread = (struct pthread_tcb*)ut_restartee;
+		assert(ut_restartee);
+		assert(pthread->state == PTH_BLK_SYSC);
+		assert(ut_restartee->sysc == sysc);	/* set in uthread.c */
+		ut_restartee->sysc = 0;	/* so we don't 'reblock' on this later */
+		pth_set_runnable(pthread);
+		TAILQ_INSERT_TAIL(&restartees, pthread, tq_next);
+		nr_restartees++;
+	}
+	if (!nr_restartees)
+		return;
+	if (pth_worksteal) {
+		while ((pthread = TAILQ_FIRST(&restartees))) {
+			TAILQ_REMOVE(&restartees, pthread, tq_next);
+			__pth_ws_enqueue(pthread);
+		}
+		vcore_request_more(pth_deque_depth(vcore_id()));
+		return;
+	}
+	mcs_pdr_lock(&queue_lock);
+	TAILQ_CONCAT(&ready_queue, &restartees, tq_next);
+	threads_ready += nr_restartees;
+	mcs_pdr_unlock(&queue_lock);
+	vcore_request_more(threads_ready);
+}
+
+static void pth_handle_sysc_evq(struct event_queue *ev_q)
+{
+	handle_mbox_batch(ev_q->ev_mbox, pth_handle_syscalls, NULL);
+}
+
 /* This will be called from vcore context, after the current thread has yielded
  * and is trying to block on sysc.  Need to put it somewhere were we can wake it
  * up when the sysc is done.  For now, we'll have the kernel send us an event
@@ -400,11 +789,22 @@ static void pth_thread_bulk_runnable(uth_sync_t *wakees)
 	struct uthread *uth_i;
 	struct pthread_tcb *pth_i;
 
+	if (pth_worksteal) {
+		uth_disable_notifs();
+		while ((uth_i = __uth_sync_get_next(wakees))) {
+			pth_i = (struct pthread_tcb*)uth_i;
+			pth_set_runnable(pth_i);
+			__pth_ws_enqueue(pth_i);
+		}
+		vcore_request_more(pth_deque_depth(vcore_id()));
+		uth_enable_notifs();
+		return;
+	}
 	/* Amortize the lock grabbing over all restartees */
 	mcs_pdr_lock(&queue_lock);
 	while ((uth_i = __uth_sync_get_next(wakees))) {
 		pth_i = (struct pthread_tcb*)uth_i;
-		pth_i->state = PTH_RUNNABLE;
+		pth_set_runnable(pth_i);
 		TAILQ_INSERT_TAIL(&ready_queue, pth_i, tq_next);
 		threads_ready++;
 	}
@@ -421,6 +821,63 @@ void pthread_need_tls(bool need)
 	need_tls = need;
 }
 
+/* Switches between the default FIFO scheduler (one global ready queue) and the
+ * work-stealing one (per-vcore deques).  Work stealing scales better with lots
+ * of vcores and keeps woken threads near their wakers, but it gives up on
+ * global FIFO order.  Call this before creating any threads, while we're still
+ * an SCP. */
+void pthread_use_worksteal(bool on)
+{
+	int ret;
+
+	assert(!in_multi_mode());
+	assert(!threads_ready && atomic_read(&threads_total) <= 1);
+	if (on && !pth_deques) {
+		ret = posix_memalign((void**)&pth_deques, __alignof__(struct pth_deque),
+		                     sizeof(struct pth_deque) * max_vcores());
+		assert(!ret);
+		memset(pth_deques, 0, sizeof(struct pth_deque) * max_vcores());
+	}
+	pth_worksteal = on;
+}
+
+/* Idle vcores spin on their syscall ev_qs for up to usecs before yielding, and
+ * run a thread whose syscall completes while they spin directly.  This trades
+ * idle cores for syscall completion latency; it's for apps that own their
+ * cores and block on short syscalls.  0 turns it off (the default).  You can
+ * call this any time. */
+void pthread_sysc_poll(uint64_t usecs)
+{
+	WRITE_ONCE(pth_sysc_poll_tsc, usecs ? usec2tsc(usecs) : 0);
+}
+
+/* Turns on preemptive time slicing with a slice of usecs, or turns it off for 0
+ * (the default).  Each vcore runs a tick (vcore_tick.h); when it goes off, the
+ * running thread goes to the back of the ready_queue if anyone is waiting.  A
+ * ready thread with a higher priority (pthread_setschedparam()) doesn't wait
+ * for the tick: it cuts in the next time the vcore handles an event, such as
+ * the one that woke it.
+ *
+ * With the FIFO scheduler, vcores pick the ready thread with the earliest
+ * deadline (see pth_deadline()) instead of the oldest one.  Work stealing still
+ * slices, but keeps its deque order.  You can call this any time. */
+void pthread_use_timeslice(uint64_t usecs)
+{
+	WRITE_ONCE(pth_slice_usec, usecs);
+	if (usecs)
+		WRITE_ONCE(pth_slice_used, TRUE);
+	WRITE_ONCE(pth_slice_tsc, usecs ? usec2tsc(usecs) : 0);
+}
+
+/* Switches malloc over to parlib's per-vcore allocator, for good.  Call this
+ * early, before creating any threads.  See parlib/vcore_malloc.h. */
+void pthread_use_vcore_malloc(void)
+{
+	assert(!in_multi_mode());
+	assert(!threads_ready && atomic_read(&threads_total) <= 1);
+	vcore_malloc_init();
+}
+
 /* Pthread interface stuff and helpers */
 
 int pthread_attr_init(pthread_attr_t *a)
@@ -440,25 +897,113 @@ int pthread_attr_destroy(pthread_attr_t *a)
 	return 0;
 }
 
+/* Drops the pages of a cached stack, other than the top ones, like an
+ * madvise(MADV_DONTNEED).  Mapping fresh anonymous memory over them does the
+ * trick, and the guard page and the VA range stay ours. */
+static void __pthread_release_stack(void *stacktop)
+{
+	size_t len = PTHREAD_STACK_SIZE - PTHREAD_STACK_POP_PAGES * PGSIZE;
+	void *ret;
+
+	ret = mmap(stacktop - PTHREAD_STACK_SIZE, len,
+	           PROT_READ | PROT_WRITE | PROT_EXEC,
+	           MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0);
+	assert(ret != MAP_FAILED);
+}
+
+/* Tries to cache a default-sized stack.  Returns FALSE if we're full. */
+static bool __pthread_cache_stack(void *stacktop)
+{
+	struct pth_stack_cache *sc;
+	bool cached = FALSE;
+
+	/* We're usually in vcore context (thread exit), but not always */
+	uth_disable_notifs();
+	sc = &pth_stack_caches[vcore_id()];
+	if (sc->nr < PTH_STACK_CACHE_HOT) {
+		sc->stacktops[sc->nr++] = stacktop;
+		cached = TRUE;
+	}
+	uth_enable_notifs();
+	if (cached)
+		return TRUE;
+	if (ACCESS_ONCE(nr_cold_stacks) >= PTH_STACK_CACHE_COLD)
+		return FALSE;
+	__pthread_release_stack(stacktop);
+	spin_pdr_lock(&cold_stack_lock);
+	if (nr_cold_stacks < PTH_STACK_CACHE_COLD) {
+		cold_stacks[nr_cold_stacks++] = stacktop;
+		cached = TRUE;
+	}
+	spin_pdr_unlock(&cold_stack_lock);
+	return cached;
+}
+
+/* Returns the top of a cached default-sized stack, or 0. */
+static void *__pthread_get_cached_stack(void)
+{
+	struct pth_stack_cache *sc;
+	void *stacktop = 0;
+
+	uth_disable_notifs();
+	sc = &pth_stack_caches[vcore_id()];
+	if (sc->nr)
+		stacktop = sc->stacktops[--sc->nr];
+	uth_enable_notifs();
+	if (stacktop || !ACCESS_ONCE(nr_cold_stacks))
+		return stacktop;
+	spin_pdr_lock(&cold_stack_lock);
+	if (nr_cold_stacks)
+		stacktop = cold_stacks[--nr_cold_stacks];
+	spin_pdr_unlock(&cold_stack_lock);
+	return stacktop;
+}
+
 static void __pthread_free_stack(struct pthread_tcb *pt)
 {
-	int ret = munmap(pt->stacktop - pt->stacksize, pt->stacksize);
+	int ret;
+
+	/* thread0's stack came from the kernel, with no guard page */
+	if (pt->id == 0) {
+		ret = munmap(pt->stacktop - pt->stacksize, pt->stacksize);
+		assert(!ret);
+		return;
+	}
+	if (pt->stacksize == PTHREAD_STACK_SIZE &&
+	    __pthread_cache_stack(pt->stacktop))
+		return;
+	ret = munmap(pt->stacktop - pt->stacksize - PTHREAD_STACK_GUARD,
+	             pt->stacksize + PTHREAD_STACK_GUARD);
 	assert(!ret);
 }
 
 static int __pthread_allocate_stack(struct pthread_tcb *pt)
 {
-	int force_a_page_fault;
+	size_t nr_pop_pgs;
+	void *stackbot;
+
 	assert(pt->stacksize);
-	void* stackbot = mmap(0, pt->stacksize,
-	                      PROT_READ | PROT_WRITE | PROT_EXEC,
-	                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (pt->stacksize == PTHREAD_STACK_SIZE) {
+		pt->stacktop = __pthread_get_cached_stack();
+		if (pt->stacktop)
+			return 0;
+	}
+	stackbot = mmap(0, pt->stacksize + PTHREAD_STACK_GUARD,
+	                PROT_READ | PROT_WRITE | PROT_EXEC,
+	                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
 	if (stackbot == MAP_FAILED)
 		return -1; // errno set by mmap
-	pt->stacktop = stackbot + pt->stacksize;
+	if (mprotect(stackbot, PTHREAD_STACK_GUARD, PROT_NONE)) {
+		munmap(stackbot, pt->stacksize + PTHREAD_STACK_GUARD);
+		return -1;
+	}
+	pt->stacktop = stackbot + PTHREAD_STACK_GUARD + pt->stacksize;
 	/* Want the top of the stack populated, but not the rest of the stack;
 	 * that'll grow on demand (up to pt->stacksize) */
-	force_a_page_fault = ACCESS_ONCE(*(int*)(pt->stacktop - sizeof(int)));
+	nr_pop_pgs = MIN(PTHREAD_STACK_POP_PAGES, ROUNDUP(pt->stacksize, PGSIZE) /
+	                                          PGSIZE);
+	ros_syscall(SYS_populate_va, pt->stacktop - nr_pop_pgs * PGSIZE,
+	            nr_pop_pgs, 0, 0, 0, 0);
 	return 0;
 }
 
@@ -559,6 +1104,11 @@ void pth_sched_init(void)
 	                     sizeof(struct pthread_tcb));
 	assert(!ret);
 	memset(t, 0, sizeof(struct pthread_tcb));	/* aggressively 0 for bugs */
+	ret = posix_memalign((void**)&pth_stack_caches,
+	                     __alignof__(struct pth_stack_cache),
+	                     sizeof(struct pth_stack_cache) * max_vcores());
+	assert(!ret);
+	memset(pth_stack_caches, 0, sizeof(struct pth_stack_cache) * max_vcores());
 	t->id = get_next_pid();
 	t->fork_generation = fork_generation;
 	t->stacksize = USTACK_NUM_PAGES * PGSIZE;
@@ -597,6 +1147,7 @@ void pth_sched_init(void)
 		sysc_mgmt[i].ev_q->ev_flags = EVENT_IPI | EVENT_INDIR |
 		                              EVENT_SPAM_INDIR | EVENT_WAKEUP;
 		sysc_mgmt[i].ev_q->ev_vcore = i;
+		sysc_mgmt[i].ev_q->ev_handler = pth_handle_sysc_evq;
 		sysc_mgmt[i].ev_q->ev_mbox->type = EV_MBOX_UCQ;
 		ucq_init_raw(&sysc_mgmt[i].ev_q->ev_mbox->ucq,
 		             mmap_block + (2 * i    ) * PGSIZE, 
@@ -648,7 +1199,7 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	struct uth_thread_attr uth_attr = {0};
 	struct pthread_tcb *parent;
 	struct pthread_tcb *pthread;
-	int ret;
+	int ret, prio;
 
 	/* For now, unconditionally become an mcp when creating a pthread (if not
 	 * one already). This may change in the future once we support 2LSs in an
@@ -665,12 +1216,18 @@ int __pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	pthread->id = get_next_pid();
 	pthread->fork_generation = fork_generation;
 	SLIST_INIT(&pthread->cr_stack);
+	if (parent)
+		pthread->prio = parent->prio;
 	/* Respect the attributes */
 	if (attr) {
 		if (attr->stacksize)					/* don't set a 0 stacksize */
 			pthread->stacksize = attr->stacksize;
 		if (attr->detachstate == PTHREAD_CREATE_DETACHED)
 			uth_attr.detached = TRUE;
+		if (attr->sched_inherit == PTHREAD_EXPLICIT_SCHED) {
+			prio = MAX(attr->sched_priority, PTHREAD_PRIO_MIN);
+			pthread->prio = MIN(prio, PTHREAD_PRIO_MAX);
+		}
 	}
 	/* allocate a stack */
 	if (__pthread_allocate_stack(pthread))
@@ -704,6 +1261,8 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
  * active queue is keeping us honest.  Need to export for sem and friends. */
 void __pthread_generic_yield(struct pthread_tcb *pthread)
 {
+	if (pth_worksteal)
+		return;
 	mcs_pdr_lock(&queue_lock);
 	threads_active--;
 	TAILQ_REMOVE(&active_queue, pthread, tq_next);
@@ -1079,127 +1638,28 @@ int pthread_once(pthread_once_t *once_control, void (*init_routine)(void))
 int pthread_barrier_init(pthread_barrier_t *b,
                          const pthread_barrierattr_t *a, int count)
 {
-	b->total_threads = count;
-	b->sense = 0;
-	atomic_set(&b->count, count);
-	spin_pdr_init(&b->lock);
-	__uth_sync_init(&b->waiters);
-	b->nr_waiters = 0;
+	if (count <= 0)
+		return EINVAL;
+	uth_barrier_init(&b->ub, count);
 	return 0;
 }
 
-struct barrier_junk {
-	pthread_barrier_t				*b;
-	int								ls;
-};
-
-/* Helper for spinning sync, returns TRUE if it is okay to keep spinning.
- *
- * Alternatives include:
- * 		old_count <= num_vcores() (barrier code, pass in old_count as *state,
- * 		                           but this only works if every awake pthread
- * 		                           will belong to the barrier).
- * 		just spin for a bit       (use *state to track spins)
- * 		FALSE                     (always is safe)
- * 		etc...
- * 'threads_ready' isn't too great since sometimes it'll be non-zero when it is
- * about to become 0.  We really want "I have no threads waiting to run that
- * aren't going to run on their on unless this core yields instead of spins". */
-/* TODO: consider making this a 2LS op */
-static inline bool safe_to_spin(unsigned int *state)
-{
-	return (*state)++ % PTHREAD_BARRIER_SPINS;
-}
-
-/* Callback/bottom half of barrier. */
-static void __pth_barrier_cb(struct uthread *uthread, void *junk)
-{
-	pthread_barrier_t *b = ((struct barrier_junk*)junk)->b;
-	int ls = ((struct barrier_junk*)junk)->ls;
-
-	uthread_has_blocked(uthread, UTH_EXT_BLK_MUTEX);
-	/* TODO: if we used a trylock, we could bail as soon as we see sense */
-	spin_pdr_lock(&b->lock);
-	/* If sense is ls (our free value), we lost the race and shouldn't sleep */
-	if (b->sense == ls) {
-		spin_pdr_unlock(&b->lock);
-		uthread_runnable(uthread);
-		return;
-	}
-	/* otherwise, we sleep */
-	__uth_sync_enqueue(uthread, &b->waiters);
-	b->nr_waiters++;
-	spin_pdr_unlock(&b->lock);
-}
-
-/* We assume that the same threads participating in the barrier this time will
- * also participate next time.  Imagine a thread stopped right after its fetch
- * and add - we know it is coming through eventually.  We finish and change the
- * sense, which should allow the delayed thread to eventually break through.
- * But if another n threads come in first, we'll set the sense back to the old
- * value, thereby catching the delayed thread til the next barrier. 
+/* The real work is in parlib's uth_barrier, which spins while every thread
+ * could be on a vcore and blocks otherwise.
  *
- * A note on preemption: if any thread gets preempted and it is never dealt
- * with, eventually we deadlock, with all threads waiting on the last one to
- * enter (and any stragglers from one run will be the last in the next run).
- * One way or another, we need to handle preemptions.  The current 2LS requests
- * an IPI for a preempt, so we'll be fine.  Any other strategies will need to
- * consider how barriers work.  Any time we sleep, we'll be okay (since that
- * frees up our core to handle preemptions/run other threads. */
+ * We assume that the same threads participating in the barrier this time will
+ * also participate next time.  A note on preemption: if any thread gets
+ * preempted and it is never dealt with, eventually we deadlock, with all
+ * threads waiting on the last one to enter.  The current 2LS requests an IPI
+ * for a preempt, and waiters stop spinning once they see a preempted vcore. */
 int pthread_barrier_wait(pthread_barrier_t *b)
 {
-	unsigned int spin_state = 0;
-	int ls = !b->sense;	/* when b->sense is the value we read, then we're free*/
-	uth_sync_t restartees;
-	struct uthread *uth_i;
-	struct barrier_junk local_junk;
-	
-	long old_count = atomic_fetch_and_add(&b->count, -1);
-
-	if (old_count == 1) {
-		/* TODO: we might want to grab the lock right away, so a few short
-		 * circuit faster? */
-		atomic_set(&b->count, b->total_threads);
-		/* we still need to maintain ordering btw count and sense, in case
-		 * another thread doesn't sleep (if we wrote sense first, they could
-		 * break out, race around, and muck with count before it is time) */
-		/* wmb(); handled by the spin lock */
-		spin_pdr_lock(&b->lock);
-		/* Sense is only protected in addition to decisions to sleep */
-		b->sense = ls;	/* set to free everyone */
-		/* All access to nr_waiters is protected by the lock */
-		if (!b->nr_waiters) {
-			spin_pdr_unlock(&b->lock);
-			return PTHREAD_BARRIER_SERIAL_THREAD;
-		}
-		__uth_sync_init(&restartees);
-		__uth_sync_swap(&restartees, &b->waiters);
-		b->nr_waiters = 0;
-		spin_pdr_unlock(&b->lock);
-		__uth_sync_wake_all(&restartees);
-		return PTHREAD_BARRIER_SERIAL_THREAD;
-	} else {
-		/* Spin if there are no other threads to run.  No sense sleeping */
-		do {
-			if (b->sense == ls)
-				return 0;
-			cpu_relax();
-		} while (safe_to_spin(&spin_state));
-
-		/* Try to sleep, when we wake/return, we're free to go */
-		local_junk.b = b;
-		local_junk.ls = ls;
-		uthread_yield(TRUE, __pth_barrier_cb, &local_junk);
-		// assert(b->sense == ls);
-		return 0;
-	}
+	return uth_barrier_wait(&b->ub) ? PTHREAD_BARRIER_SERIAL_THREAD : 0;
 }
 
 int pthread_barrier_destroy(pthread_barrier_t *b)
 {
-	assert(!b->nr_waiters);
-	__uth_sync_destroy(&b->waiters);
-	/* Free any locks (if we end up using an MCS) */
+	uth_barrier_destroy(&b->ub);
 	return 0;
 }
 
@@ -1255,8 +1715,9 @@ int pthread_setspecific(pthread_key_t key, const void *value)
 }
 
 
-/* Scheduling Stuff.  Actually, these don't tell the 2LS anything - they just
- * pretend to muck with attrs and params, as expected by pthreads apps. */
+/* Scheduling Stuff.  The only thing the 2LS uses is the priority, and only
+ * with time slicing on (pthread_use_timeslice()).  The rest just pretends to
+ * muck with attrs and params, as expected by pthreads apps. */
 
 int pthread_attr_setschedparam(pthread_attr_t *attr,
                                const struct sched_param *param)
@@ -1324,17 +1785,23 @@ int pthread_attr_getinheritsched(const pthread_attr_t *attr,
 	return 0;
 }
 
+/* We ignore the policy.  The priority takes effect the next time thread
+ * becomes runnable. */
 int pthread_setschedparam(pthread_t thread, int policy,
                            const struct sched_param *param)
 {
+	if (param->sched_priority < PTHREAD_PRIO_MIN ||
+	    param->sched_priority > PTHREAD_PRIO_MAX)
+		return EINVAL;
+	WRITE_ONCE(thread->prio, param->sched_priority);
 	return 0;
 }
 
 int pthread_getschedparam(pthread_t thread, int *policy,
                            struct sched_param *param)
 {
-	/* Faking {FIFO, 0}.  It's up to the 2LS to do whatever it wants. */
+	/* Faking FIFO.  It's up to the 2LS to do whatever it wants. */
 	*policy = SCHED_FIFO;
-	param->sched_priority = 0;
+	param->sched_priority = READ_ONCE(thread->prio);
 	return 0;
 }
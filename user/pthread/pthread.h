@@ -47,6 +47,8 @@ struct pthread_tcb {
 	void *(*start_routine)(void*);
 	void *arg;
 	struct pthread_cleanup_stack cr_stack;
+	int prio;
+	uint64_t ready_tsc;
 };
 typedef struct pthread_tcb* pthread_t;
 TAILQ_HEAD(pthread_queue, pthread_tcb);
@@ -58,9 +60,13 @@ struct sysc_mgmt {
 	struct event_queue 			*ev_q;
 };
 
+/* sched_priority range for pthread_setschedparam().  Only matters with time
+ * slicing on; see pthread_use_timeslice(). */
+#define PTHREAD_PRIO_MIN 0
+#define PTHREAD_PRIO_MAX 7
+
 #define PTHREAD_ONCE_INIT PARLIB_ONCE_INIT
 #define PTHREAD_BARRIER_SERIAL_THREAD 12345
-#define PTHREAD_BARRIER_SPINS 100 // totally arbitrary
 #define PTHREAD_PROCESS_PRIVATE 0
 #define PTHREAD_PROCESS_SHARED 1
 
@@ -98,12 +104,7 @@ typedef void * pthread_rwlockattr_t;
 
 typedef struct
 {
-	int							total_threads;
-	volatile int				sense;	/* state of barrier, flips btw runs */
-	atomic_t					count;
-	struct spin_pdr_lock		lock;
-	uth_sync_t					waiters;
-	int							nr_waiters;
+	uth_barrier_t				ub;
 } pthread_barrier_t;
 
 /* Detach state.  */
@@ -135,6 +136,10 @@ typedef dtls_key_t pthread_key_t;
 
 /* Akaros pthread extensions / hacks */
 void pthread_need_tls(bool need);			/* default is TRUE */
+void pthread_use_worksteal(bool on);		/* default is FALSE */
+void pthread_use_vcore_malloc(void);		/* default is glibc's malloc */
+void pthread_sysc_poll(uint64_t usecs);		/* default is 0, off */
+void pthread_use_timeslice(uint64_t usecs);	/* default is 0, off */
 void pthread_mcp_init(void);
 void __pthread_generic_yield(struct pthread_tcb *pthread);
 
@@ -392,6 +392,213 @@ bool test_rwlock(void)
 	return TRUE;
 }
 
+static uth_mutex_t spin_mtx = UTH_MUTEX_INIT;
+static unsigned long spin_counter;
+
+#define NR_MTX_LOOPS 10000
+
+static void *mtx_hammer(void *arg)
+{
+	for (int i = 0; i < NR_MTX_LOOPS; i++) {
+		uth_mutex_lock(&spin_mtx);
+		spin_counter++;
+		/* Every so often, block while holding, so waiters stop spinning */
+		if (!(i % 1000))
+			uthread_usleep(100);
+		uth_mutex_unlock(&spin_mtx);
+	}
+	return 0;
+}
+
+/* Short critical sections, so lockers on other vcores mostly get it by
+ * spinning.  Either way, it needs to still be a mutex. */
+bool test_mutex_spin(void)
+{
+	#define NR_HAMMERS 8
+	struct uth_join_request joinees[NR_HAMMERS];
+	void *retvals[NR_HAMMERS];
+
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), NR_HAMMERS));
+	for (int i = 0; i < NR_HAMMERS; i++) {
+		joinees[i].uth = uthread_create(mtx_hammer, NULL);
+		joinees[i].retval_loc = &retvals[i];
+	}
+	uthread_join_arr(joinees, NR_HAMMERS);
+	UT_ASSERT_FMT("Expected %d increments, got %lu",
+	              spin_counter == NR_HAMMERS * NR_MTX_LOOPS,
+	              NR_HAMMERS * NR_MTX_LOOPS, spin_counter);
+	UT_ASSERT(!spin_mtx.owner);
+	UT_ASSERT(spin_mtx.count == 1);
+#ifdef UTH_MUTEX_STATS
+	struct uth_mutex_stats stats;
+
+	uth_mutex_get_stats(&spin_mtx, &stats);
+	UT_ASSERT(stats.nr_locks == NR_HAMMERS * NR_MTX_LOOPS);
+	UT_ASSERT(stats.nr_spin_acquires + stats.nr_blocks == stats.nr_contended);
+#endif
+	return TRUE;
+}
+
+static uth_brwlock_t brw = UTH_BRWLOCK_INIT;
+static uth_seqlock_t seql = UTH_SEQLOCK_INIT;
+/* Writers keep these equal; readers check that they are */
+static unsigned long pair_a, pair_b;
+
+#define NR_RW_LOOPS 2000
+
+static void *brw_reader(void *arg)
+{
+	for (int i = 0; i < NR_RW_LOOPS; i++) {
+		uth_brwlock_rdlock(&brw);
+		if (ACCESS_ONCE(pair_a) != ACCESS_ONCE(pair_b)) {
+			uth_brwlock_rdunlock(&brw);
+			return (void*)1;
+		}
+		/* Sometimes block while holding, to migrate and to make writers wait */
+		if (!(i % 500))
+			uthread_usleep(100);
+		uth_brwlock_rdunlock(&brw);
+	}
+	return 0;
+}
+
+static void *brw_writer(void *arg)
+{
+	for (int i = 0; i < NR_RW_LOOPS / 10; i++) {
+		uth_brwlock_wrlock(&brw);
+		pair_a++;
+		cmb();
+		pair_b++;
+		uth_brwlock_wrunlock(&brw);
+		if (uth_brwlock_try_wrlock(&brw))
+			uth_brwlock_wrunlock(&brw);
+	}
+	return 0;
+}
+
+bool test_brwlock(void)
+{
+	#define NR_BRW_THREADS 8
+	struct uth_join_request joinees[NR_BRW_THREADS];
+	void *retvals[NR_BRW_THREADS];
+
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), NR_BRW_THREADS));
+	pair_a = pair_b = 0;
+	for (int i = 0; i < NR_BRW_THREADS; i++) {
+		joinees[i].uth = uthread_create(i % 4 ? brw_reader : brw_writer, NULL);
+		joinees[i].retval_loc = &retvals[i];
+	}
+	uthread_join_arr(joinees, NR_BRW_THREADS);
+	for (int i = 0; i < NR_BRW_THREADS; i++)
+		UT_ASSERT_FMT("Thread %d saw a torn write", retvals[i] == 0, i);
+	UT_ASSERT(pair_a == NR_BRW_THREADS / 4 * NR_RW_LOOPS / 10);
+	UT_ASSERT(uth_brwlock_try_rdlock(&brw));
+	uth_brwlock_rdunlock(&brw);
+	return TRUE;
+}
+
+static void *seq_reader(void *arg)
+{
+	unsigned long a, b;
+	seq_ctr_t seq;
+
+	for (int i = 0; i < NR_RW_LOOPS; i++) {
+		do {
+			seq = uth_seqlock_read_begin(&seql);
+			a = ACCESS_ONCE(pair_a);
+			b = ACCESS_ONCE(pair_b);
+		} while (uth_seqlock_read_retry(&seql, seq));
+		if (a != b)
+			return (void*)1;
+	}
+	return 0;
+}
+
+static void *seq_writer(void *arg)
+{
+	for (int i = 0; i < NR_RW_LOOPS / 10; i++) {
+		uth_seqlock_write_lock(&seql);
+		pair_a++;
+		/* Readers have to wait out a blocked writer */
+		if (!(i % 50))
+			uthread_usleep(100);
+		pair_b++;
+		uth_seqlock_write_unlock(&seql);
+	}
+	return 0;
+}
+
+bool test_seqlock(void)
+{
+	struct uth_join_request joinees[NR_BRW_THREADS];
+	void *retvals[NR_BRW_THREADS];
+
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), NR_BRW_THREADS));
+	pair_a = pair_b = 0;
+	for (int i = 0; i < NR_BRW_THREADS; i++) {
+		joinees[i].uth = uthread_create(i % 4 ? seq_reader : seq_writer, NULL);
+		joinees[i].retval_loc = &retvals[i];
+	}
+	uthread_join_arr(joinees, NR_BRW_THREADS);
+	for (int i = 0; i < NR_BRW_THREADS; i++)
+		UT_ASSERT_FMT("Thread %d saw a torn write", retvals[i] == 0, i);
+	UT_ASSERT(!seq_is_locked(seql.seq));
+	return TRUE;
+}
+
+static uth_barrier_t bar;
+static atomic_t nr_serial;
+static atomic_t bar_phase[NR_BRW_THREADS];
+
+#define NR_BAR_LOOPS 1000
+
+/* Every thread bumps its phase once per round.  After the barrier, no one can
+ * be more than one round ahead of us. */
+static void *bar_thread(void *arg)
+{
+	long id = (long)arg;
+
+	for (int i = 0; i < NR_BAR_LOOPS; i++) {
+		atomic_inc(&bar_phase[id]);
+		if (uth_barrier_wait(&bar))
+			atomic_inc(&nr_serial);
+		for (int j = 0; j < NR_BRW_THREADS; j++) {
+			if (atomic_read(&bar_phase[j]) < i + 1)
+				return (void*)1;
+		}
+		if (!(i % 100))
+			uthread_usleep(100);
+	}
+	return 0;
+}
+
+bool test_barrier(void)
+{
+	struct uth_join_request joinees[NR_BRW_THREADS];
+	void *retvals[NR_BRW_THREADS];
+
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), NR_BRW_THREADS));
+	uth_barrier_init(&bar, NR_BRW_THREADS);
+	atomic_set(&nr_serial, 0);
+	for (long i = 0; i < NR_BRW_THREADS; i++) {
+		atomic_set(&bar_phase[i], 0);
+		joinees[i].uth = uthread_create(bar_thread, (void*)i);
+		joinees[i].retval_loc = &retvals[i];
+	}
+	uthread_join_arr(joinees, NR_BRW_THREADS);
+	for (int i = 0; i < NR_BRW_THREADS; i++)
+		UT_ASSERT_FMT("Thread %d got through early", retvals[i] == 0, i);
+	UT_ASSERT_FMT("Expected %d serial threads, got %ld",
+	              atomic_read(&nr_serial) == NR_BAR_LOOPS, NR_BAR_LOOPS,
+	              atomic_read(&nr_serial));
+	uth_barrier_destroy(&bar);
+	return TRUE;
+}
+
 /* <--- End definition of test cases ---> */
 
 struct utest utests[] = {
@@ -406,6 +613,10 @@ struct utest utests[] = {
 	UTEST_REG(cv_timeout),
 	UTEST_REG(cv_recurse_timeout),
 	UTEST_REG(rwlock),
+	UTEST_REG(mutex_spin),
+	UTEST_REG(brwlock),
+	UTEST_REG(seqlock),
+	UTEST_REG(barrier),
 };
 int num_utests = sizeof(utests) / sizeof(struct utest);
 
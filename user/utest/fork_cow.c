@@ -0,0 +1,106 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Copy-on-write fork tests: parent and child share anonymous memory until one
+ * of them writes, and neither sees the other's writes. */
+
+#include <utest/utest.h>
+#include <parlib/arch/arch.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
+
+TEST_SUITE("FORK_COW");
+
+/* <--- Begin definition of test cases ---> */
+
+#define COW_NR_PGS			64
+#define COW_SZ				(COW_NR_PGS * PGSIZE)
+
+static char *cow_buf;
+
+static bool cow_buf_is(char c)
+{
+	for (int i = 0; i < COW_SZ; i += PGSIZE) {
+		if (cow_buf[i] != c)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int wait_child(pid_t pid)
+{
+	int wstatus;
+
+	if (waitpid(pid, &wstatus, 0) != pid)
+		return -1;
+	return WEXITSTATUS(wstatus);
+}
+
+bool test_child_writes(void)
+{
+	pid_t pid;
+
+	cow_buf = mmap(0, COW_SZ, PROT_READ | PROT_WRITE,
+	               MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+	UT_ASSERT(cow_buf != MAP_FAILED);
+	memset(cow_buf, 'p', COW_SZ);
+	pid = fork();
+	UT_ASSERT(pid >= 0);
+	if (!pid) {
+		if (!cow_buf_is('p'))
+			exit(1);
+		memset(cow_buf, 'c', COW_SZ);
+		exit(cow_buf_is('c') ? 0 : 2);
+	}
+	UT_ASSERT_FMT("child failed", wait_child(pid) == 0);
+	UT_ASSERT(cow_buf_is('p'));
+	return TRUE;
+}
+
+/* The parent writes while the child is still around, and the child won't look
+ * until after the parent is done. */
+bool test_parent_writes(void)
+{
+	int pipefd[2];
+	char c = 0;
+	pid_t pid;
+
+	UT_ASSERT(!pipe(pipefd));
+	memset(cow_buf, 'p', COW_SZ);
+	pid = fork();
+	UT_ASSERT(pid >= 0);
+	if (!pid) {
+		close(pipefd[1]);
+		if (read(pipefd[0], &c, 1) != 1)
+			exit(1);
+		exit(cow_buf_is('p') ? 0 : 2);
+	}
+	close(pipefd[0]);
+	memset(cow_buf, 'q', COW_SZ);
+	UT_ASSERT(write(pipefd[1], &c, 1) == 1);
+	close(pipefd[1]);
+	UT_ASSERT_FMT("child saw our writes", wait_child(pid) == 0);
+	UT_ASSERT(cow_buf_is('q'));
+	munmap(cow_buf, COW_SZ);
+	return TRUE;
+}
+
+/* <--- End definition of test cases ---> */
+
+struct utest utests[] = {
+	UTEST_REG(child_writes),
+	UTEST_REG(parent_writes),
+};
+int num_utests = sizeof(utests) / sizeof(struct utest);
+
+int main(int argc, char *argv[])
+{
+	char **whitelist = &argv[1];
+	int whitelist_len = argc - 1;
+
+	RUN_TEST_SUITE(utests, num_utests, whitelist, whitelist_len);
+}
@@ -56,10 +56,79 @@ bool test_pf(void)
 	return TRUE;
 }
 
+/* MADV_DONTNEED drops anonymous pages: the next touch gets a zeroed page. */
+bool test_madv_dontneed(void)
+{
+	size_t len = 4 * PGSIZE;
+	char *addr;
+
+	addr = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+	            0);
+	UT_ASSERT(addr != MAP_FAILED);
+	memset(addr, 0xab, len);
+	UT_ASSERT(!madvise(addr + PGSIZE, 2 * PGSIZE, MADV_DONTNEED));
+	UT_ASSERT(addr[0] == (char)0xab);
+	UT_ASSERT(addr[PGSIZE] == 0);
+	UT_ASSERT(addr[3 * PGSIZE - 1] == 0);
+	UT_ASSERT(addr[3 * PGSIZE] == (char)0xab);
+	munmap(addr, len);
+	return TRUE;
+}
+
+/* The rest of the advice is hints; it just needs to not break the mapping. */
+bool test_madv_hints(void)
+{
+	int fd;
+	char *addr;
+	char c;
+
+	fd = open("hello.txt", O_READ);
+	UT_ASSERT(fd >= 0);
+	addr = mmap(0, 4096, PROT_READ, MAP_SHARED, fd, 0);
+	UT_ASSERT(addr != MAP_FAILED);
+	c = addr[0];
+	UT_ASSERT(!madvise(addr, 4096, MADV_RANDOM));
+	UT_ASSERT(!madvise(addr, 4096, MADV_SEQUENTIAL));
+	UT_ASSERT(!madvise(addr, 4096, MADV_WILLNEED));
+	UT_ASSERT(!madvise(addr, 4096, MADV_DONTNEED));
+	UT_ASSERT(addr[0] == c);
+	UT_ASSERT(!madvise(addr, 4096, MADV_NORMAL));
+	UT_ASSERT(madvise(addr + 1, 4096, MADV_NORMAL) == -1);
+	munmap(addr, 4096);
+	close(fd);
+	return TRUE;
+}
+
+/* Node 0 always exists, even without NUMA. */
+bool test_mbind(void)
+{
+	size_t len = 16 * PGSIZE;
+	char *addr;
+
+	addr = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+	            -1, 0);
+	UT_ASSERT(addr != MAP_FAILED);
+	UT_ASSERT(!sys_mbind(addr, len / 2, MPOL_BIND, 1));
+	UT_ASSERT(!sys_mbind(addr + len / 2, len / 2, MPOL_INTERLEAVE, 1));
+	memset(addr, 0xab, len);
+	UT_ASSERT(!sys_mbind(addr, len, MPOL_DEFAULT, 0));
+	UT_ASSERT(sys_mbind(addr, len, MPOL_BIND, 0) == -1);
+	UT_ASSERT(errno == EINVAL);
+	UT_ASSERT(sys_mbind(addr, len, MPOL_INTERLEAVE + 1, 1) == -1);
+	UT_ASSERT(sys_mbind(addr + 1, len, MPOL_DEFAULT, 0) == -1);
+	for (size_t i = 0; i < len; i++)
+		UT_ASSERT(addr[i] == (char)0xab);
+	munmap(addr, len);
+	return TRUE;
+}
+
 /* <--- End definition of test cases ---> */
 
 struct utest utests[] = {
 	UTEST_REG(pf),
+	UTEST_REG(madv_dontneed),
+	UTEST_REG(madv_hints),
+	UTEST_REG(mbind),
 };
 int num_utests = sizeof(utests) / sizeof(struct utest);
 
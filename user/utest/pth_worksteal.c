@@ -0,0 +1,92 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Tests for the work-stealing pthread scheduler.  It has to be picked before
+ * any threads exist, so it gets its own suite. */
+
+#include <utest/utest.h>
+#include <pthread.h>
+#include <parlib/vcore.h>
+#include <parlib/arch/atomic.h>
+
+TEST_SUITE("PTH_WORKSTEAL");
+
+/* <--- Begin definition of test cases ---> */
+
+#define NR_WS_THREADS		200
+#define NR_WS_YIELDS		100
+
+static atomic_t nr_yields;
+static pthread_mutex_t ws_mtx = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long ws_counter;
+
+static void *yielder(void *arg)
+{
+	for (int i = 0; i < NR_WS_YIELDS; i++) {
+		pthread_yield();
+		atomic_inc(&nr_yields);
+	}
+	return NULL;
+}
+
+/* Lots of threads bouncing through the deques; each of them needs to run to
+ * completion exactly once. */
+bool test_ws_yield_storm(void)
+{
+	pthread_t threads[NR_WS_THREADS];
+
+	atomic_set(&nr_yields, 0);
+	for (int i = 0; i < NR_WS_THREADS; i++)
+		UT_ASSERT(!pthread_create(&threads[i], NULL, yielder, NULL));
+	for (int i = 0; i < NR_WS_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	UT_ASSERT_FMT("Expected %d yields, got %d",
+	              atomic_read(&nr_yields) == NR_WS_THREADS * NR_WS_YIELDS,
+	              NR_WS_THREADS * NR_WS_YIELDS, atomic_read(&nr_yields));
+	return TRUE;
+}
+
+static void *locker(void *arg)
+{
+	for (int i = 0; i < NR_WS_YIELDS; i++) {
+		pthread_mutex_lock(&ws_mtx);
+		ws_counter++;
+		pthread_mutex_unlock(&ws_mtx);
+	}
+	return NULL;
+}
+
+/* Mutex handoffs wake threads onto the unlocker's vcore, and the others have
+ * to steal them. */
+bool test_ws_mutex_wakeups(void)
+{
+	pthread_t threads[NR_WS_THREADS];
+
+	ws_counter = 0;
+	for (int i = 0; i < NR_WS_THREADS; i++)
+		UT_ASSERT(!pthread_create(&threads[i], NULL, locker, NULL));
+	for (int i = 0; i < NR_WS_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	UT_ASSERT_FMT("Expected %d increments, got %lu",
+	              ws_counter == NR_WS_THREADS * NR_WS_YIELDS,
+	              NR_WS_THREADS * NR_WS_YIELDS, ws_counter);
+	return TRUE;
+}
+
+/* <--- End definition of test cases ---> */
+
+struct utest utests[] = {
+	UTEST_REG(ws_yield_storm),
+	UTEST_REG(ws_mutex_wakeups),
+};
+int num_utests = sizeof(utests) / sizeof(struct utest);
+
+int main(int argc, char *argv[])
+{
+	// Run test suite passing it all the args as whitelist of what tests to run.
+	char **whitelist = &argv[1];
+	int whitelist_len = argc - 1;
+
+	pthread_use_worksteal(TRUE);
+	RUN_TEST_SUITE(utests, num_utests, whitelist, whitelist_len);
+}
@@ -0,0 +1,71 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * parlib random tests: outputs don't repeat, and a forked child doesn't get
+ * its parent's stream. */
+
+#include <utest/utest.h>
+#include <parlib/random.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+TEST_SUITE("RANDOM");
+
+/* <--- Begin definition of test cases ---> */
+
+#define RAND_BUF_SZ			1000
+
+bool test_random_differs(void)
+{
+	static uint8_t a[RAND_BUF_SZ], b[RAND_BUF_SZ];
+	static const uint8_t zeros[RAND_BUF_SZ];
+
+	parlib_random_bytes(a, sizeof(a));
+	parlib_random_bytes(b, sizeof(b));
+	UT_ASSERT(memcmp(a, zeros, sizeof(a)));
+	UT_ASSERT(memcmp(a, b, sizeof(a)));
+	UT_ASSERT(parlib_random_u64() != parlib_random_u64());
+	return TRUE;
+}
+
+bool test_random_fork(void)
+{
+	uint64_t parent, child;
+	int pipefd[2];
+	int wstatus;
+	pid_t pid;
+
+	UT_ASSERT(!pipe(pipefd));
+	pid = fork();
+	UT_ASSERT(pid >= 0);
+	if (!pid) {
+		child = parlib_random_u64();
+		exit(write(pipefd[1], &child, sizeof(child)) == sizeof(child) ? 0 : 1);
+	}
+	parent = parlib_random_u64();
+	UT_ASSERT(read(pipefd[0], &child, sizeof(child)) == sizeof(child));
+	UT_ASSERT(waitpid(pid, &wstatus, 0) == pid);
+	close(pipefd[0]);
+	close(pipefd[1]);
+	UT_ASSERT_FMT("parent and child both got %llx", parent != child, parent);
+	return TRUE;
+}
+
+/* <--- End definition of test cases ---> */
+
+struct utest utests[] = {
+	UTEST_REG(random_differs),
+	UTEST_REG(random_fork),
+};
+int num_utests = sizeof(utests) / sizeof(struct utest);
+
+int main(int argc, char *argv[])
+{
+	char **whitelist = &argv[1];
+	int whitelist_len = argc - 1;
+
+	RUN_TEST_SUITE(utests, num_utests, whitelist, whitelist_len);
+}
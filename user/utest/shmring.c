@@ -0,0 +1,147 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Shared memory ring tests.  Both ends are in this process, but attach goes
+ * through #srv just like it would from another process. */
+
+#include <utest/utest.h>
+#include <parlib/shmring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+TEST_SUITE("SHMRING");
+
+/* <--- Begin definition of test cases ---> */
+
+#define NR_SLOTS			16
+#define NR_PRODUCERS		4
+#define NR_MSGS				10000
+
+static void ring_name(char *buf, size_t len, const char *test)
+{
+	snprintf(buf, len, "shmring-%s-%d", test, getpid());
+}
+
+bool test_shmring_basic(void)
+{
+	struct shmring *prod, *cons;
+	char name[64], buf[64];
+	int i;
+
+	ring_name(name, sizeof(name), "basic");
+	cons = shmring_create(name, 64, NR_SLOTS, 0);
+	UT_ASSERT(cons);
+	prod = shmring_attach(name);
+	UT_ASSERT(prod);
+	UT_ASSERT(shmring_slot_size(prod) == 64);
+
+	UT_ASSERT(shmring_recv(cons, buf, sizeof(buf)) == -1);
+	UT_ASSERT(errno == EAGAIN);
+	for (i = 0; i < NR_SLOTS; i++)
+		UT_ASSERT(!shmring_send(prod, &i, sizeof(i)));
+	UT_ASSERT(shmring_send(prod, &i, sizeof(i)) == -1);
+	UT_ASSERT(errno == EAGAIN);
+	UT_ASSERT(shmring_send(prod, buf, 65) == -1);
+	UT_ASSERT(errno == EMSGSIZE);
+	for (i = 0; i < NR_SLOTS; i++) {
+		UT_ASSERT(shmring_recv(cons, buf, sizeof(buf)) == sizeof(int));
+		UT_ASSERT(*(int*)buf == i);
+	}
+	UT_ASSERT(shmring_recv(cons, buf, sizeof(buf)) == -1);
+
+	UT_ASSERT(!shmring_unlink(name));
+	UT_ASSERT(!shmring_attach(name));
+	/* Still works after the unlink */
+	UT_ASSERT(!shmring_send(prod, "hi", 3));
+	UT_ASSERT(shmring_recv(cons, buf, 2) == -1);
+	UT_ASSERT(errno == EMSGSIZE);
+	UT_ASSERT(shmring_recv(cons, buf, sizeof(buf)) == 3);
+	UT_ASSERT(!strcmp(buf, "hi"));
+	shmring_close(prod);
+	shmring_close(cons);
+	return TRUE;
+}
+
+bool test_shmring_name_taken(void)
+{
+	struct shmring *sr;
+	char name[64];
+
+	ring_name(name, sizeof(name), "taken");
+	sr = shmring_create(name, 8, NR_SLOTS, 0);
+	UT_ASSERT(sr);
+	UT_ASSERT(!shmring_create(name, 8, NR_SLOTS, 0));
+	UT_ASSERT(!shmring_create("odd", 8, NR_SLOTS - 1, 0));
+	shmring_unlink(name);
+	shmring_close(sr);
+	return TRUE;
+}
+
+static char mpsc_name[64];
+
+static void *mpsc_producer(void *arg)
+{
+	struct shmring *sr = shmring_attach(mpsc_name);
+	long id = (long)arg;
+	uint64_t msg;
+
+	assert(sr);
+	for (uint64_t i = 0; i < NR_MSGS; i++) {
+		msg = (id << 32) | i;
+		while (shmring_send(sr, &msg, sizeof(msg)))
+			pthread_yield();
+	}
+	shmring_close(sr);
+	return NULL;
+}
+
+/* Each producer's messages show up in order, and the consumer sleeps on the
+ * doorbell when it gets ahead. */
+bool test_shmring_mpsc(void)
+{
+	pthread_t threads[NR_PRODUCERS];
+	uint64_t next[NR_PRODUCERS] = {0};
+	struct shmring *sr;
+	uint64_t msg, id;
+
+	ring_name(mpsc_name, sizeof(mpsc_name), "mpsc");
+	sr = shmring_create(mpsc_name, sizeof(msg), NR_SLOTS, SHMRING_MPSC);
+	UT_ASSERT(sr);
+	for (long i = 0; i < NR_PRODUCERS; i++)
+		pthread_create(&threads[i], NULL, mpsc_producer, (void*)i);
+	for (int i = 0; i < NR_PRODUCERS * NR_MSGS; i++) {
+		UT_ASSERT(shmring_recv_wait(sr, &msg, sizeof(msg)) == sizeof(msg));
+		id = msg >> 32;
+		UT_ASSERT(id < NR_PRODUCERS);
+		UT_ASSERT_FMT("producer %llu sent %llu, expected %llu",
+		              (msg & 0xffffffff) == next[id], id, msg & 0xffffffff,
+		              next[id]);
+		next[id]++;
+	}
+	for (int i = 0; i < NR_PRODUCERS; i++)
+		pthread_join(threads[i], NULL);
+	UT_ASSERT(shmring_recv(sr, &msg, sizeof(msg)) == -1);
+	shmring_unlink(mpsc_name);
+	shmring_close(sr);
+	return TRUE;
+}
+
+/* <--- End definition of test cases ---> */
+
+struct utest utests[] = {
+	UTEST_REG(shmring_basic),
+	UTEST_REG(shmring_name_taken),
+	UTEST_REG(shmring_mpsc),
+};
+int num_utests = sizeof(utests) / sizeof(struct utest);
+
+int main(int argc, char *argv[])
+{
+	char **whitelist = &argv[1];
+	int whitelist_len = argc - 1;
+
+	RUN_TEST_SUITE(utests, num_utests, whitelist, whitelist_len);
+}
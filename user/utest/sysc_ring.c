@@ -0,0 +1,129 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Syscall ring tests: submissions complete without traps, blocking syscalls
+ * don't hold up the rest of the ring, and completions show up on an ev_q. */
+
+#include <utest/utest.h>
+#include <parlib/sysc_ring.h>
+#include <parlib/event.h>
+#include <parlib/timing.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+TEST_SUITE("SYSC_RING");
+
+/* <--- Begin definition of test cases ---> */
+
+#define NR_RING_SYSCS		(SYSC_RING_SZ * 4)
+#define NR_BLOCKERS			8
+#define BLOCK_USEC			20000
+
+static void wait_for_sysc(struct syscall *sysc)
+{
+	while (!(atomic_read(&sysc->flags) & SC_DONE))
+		cpu_relax();
+}
+
+/* More than a ring's worth, so we wrap and sometimes find the ring full. */
+bool test_ring_null(void)
+{
+	static struct syscall syscs[NR_RING_SYSCS];
+
+	pthread_mcp_init();
+	for (int i = 0; i < NR_RING_SYSCS; i++) {
+		while (syscall_ring_evq(&syscs[i], 0, SYS_null)) {
+			UT_ASSERT(errno == EBUSY);
+			wait_for_sysc(&syscs[i - SYSC_RING_SZ / 2]);
+		}
+	}
+	for (int i = 0; i < NR_RING_SYSCS; i++) {
+		wait_for_sysc(&syscs[i]);
+		UT_ASSERT_FMT("sysc %d returned %ld", syscs[i].retval == 0, i,
+		              syscs[i].retval);
+	}
+	return TRUE;
+}
+
+bool test_ring_not_allowed(void)
+{
+	struct syscall sysc;
+
+	pthread_mcp_init();
+	UT_ASSERT(!syscall_ring_evq(&sysc, 0, SYS_getpcoreid));
+	wait_for_sysc(&sysc);
+	UT_ASSERT(sysc.retval == -1);
+	UT_ASSERT(sysc.err == ENOSYS);
+	return TRUE;
+}
+
+/* Serially, these would take NR_BLOCKERS * BLOCK_USEC. */
+bool test_ring_blocking(void)
+{
+	struct syscall syscs[NR_BLOCKERS];
+	uint64_t start, usec;
+
+	pthread_mcp_init();
+	start = nsec();
+	for (int i = 0; i < NR_BLOCKERS; i++)
+		UT_ASSERT(!syscall_ring_evq(&syscs[i], 0, SYS_block, BLOCK_USEC));
+	for (int i = 0; i < NR_BLOCKERS; i++)
+		wait_for_sysc(&syscs[i]);
+	usec = (nsec() - start) / 1000;
+	UT_ASSERT_FMT("%d blockers took %llu usec", usec < BLOCK_USEC * 4,
+	              NR_BLOCKERS, usec);
+	return TRUE;
+}
+
+bool test_ring_evq(void)
+{
+	static const char msg[] = "sysc ring";
+	char path[] = "/tmp/sysc_ring_XXXXXX";
+	struct event_queue *ev_q;
+	struct event_msg ev_msg;
+	struct syscall sysc;
+	char buf[sizeof(msg)];
+	int fd;
+
+	pthread_mcp_init();
+	fd = mkstemp(path);
+	UT_ASSERT(fd >= 0);
+	unlink(path);
+	ev_q = get_eventq(EV_MBOX_UCQ);
+	ev_q->ev_flags = 0;
+
+	UT_ASSERT(!syscall_ring_evq(&sysc, ev_q, SYS_write, fd, msg,
+	                            sizeof(msg)));
+	while (!extract_one_mbox_msg(ev_q->ev_mbox, &ev_msg))
+		cpu_relax();
+	UT_ASSERT(ev_msg.ev_type == EV_SYSCALL);
+	UT_ASSERT(ev_msg.ev_arg3 == &sysc);
+	UT_ASSERT(atomic_read(&sysc.flags) & SC_DONE);
+	UT_ASSERT(sysc.retval == sizeof(msg));
+
+	UT_ASSERT(pread(fd, buf, sizeof(buf), 0) == sizeof(msg));
+	UT_ASSERT(!memcmp(buf, msg, sizeof(msg)));
+	close(fd);
+	put_eventq(ev_q);
+	return TRUE;
+}
+
+/* <--- End definition of test cases ---> */
+
+struct utest utests[] = {
+	UTEST_REG(ring_null),
+	UTEST_REG(ring_not_allowed),
+	UTEST_REG(ring_blocking),
+	UTEST_REG(ring_evq),
+};
+int num_utests = sizeof(utests) / sizeof(struct utest);
+
+int main(int argc, char *argv[])
+{
+	char **whitelist = &argv[1];
+	int whitelist_len = argc - 1;
+
+	RUN_TEST_SUITE(utests, num_utests, whitelist, whitelist_len);
+}
@@ -0,0 +1,243 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * UCQ consumer tests.  We play the kernel's part with a single producer, so we
+ * can control how many messages and pages there are, and drain from pthreads
+ * that each have their own vcore. */
+
+#include <utest/utest.h>
+#include <pthread.h>
+#include <parlib/ucq.h>
+#include <parlib/spinlock.h>
+#include <parlib/arch/atomic.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+
+TEST_SUITE("UCQ");
+
+/* <--- Begin definition of test cases ---> */
+
+#define NR_DRAINERS_MAX		8
+#define NR_DRAIN_MSGS		(NR_MSG_PER_PAGE * 500)
+
+/* Single-producer version of the kernel's send_ucq_msg(). */
+static void ucq_send(struct ucq *ucq, struct event_msg *msg)
+{
+	uintptr_t my_slot = atomic_read(&ucq->prod_idx);
+	struct ucq_page *old_page, *new_page;
+	struct msg_container *my_msg;
+
+	if (!slot_is_good(my_slot)) {
+		old_page = (struct ucq_page*)PTE_ADDR(my_slot);
+		new_page = (struct ucq_page*)atomic_swap(&ucq->spare_pg, 0);
+		if (!new_page) {
+			atomic_inc(&ucq->nr_extra_pgs);
+			new_page = mmap(0, PGSIZE, PROT_READ | PROT_WRITE,
+			                MAP_ANONYMOUS | MAP_POPULATE | MAP_PRIVATE, -1, 0);
+			assert(new_page != MAP_FAILED);
+		}
+		new_page->header.cons_next_pg = 0;
+		atomic_set(&new_page->header.nr_cons, 0);
+		wmb();
+		old_page->header.cons_next_pg = (uintptr_t)new_page;
+		my_slot = (uintptr_t)new_page;
+	}
+	atomic_set(&ucq->prod_idx, my_slot + 1);
+	my_msg = slot2msg(my_slot);
+	my_msg->ev_msg = *msg;
+	wmb();
+	my_msg->ready = TRUE;
+}
+
+/* The old consumer, which swapped pages under a lock, for comparison. */
+static struct spin_pdr_lock locked_ucq_lock = SPINPDR_INITIALIZER;
+
+static bool get_ucq_msg_locked(struct ucq *ucq, struct event_msg *msg)
+{
+	uintptr_t my_idx;
+	struct ucq_page *old_page, *other_page;
+	struct msg_container *my_msg;
+
+	do {
+loop_top:
+		cmb();
+		my_idx = atomic_read(&ucq->cons_idx);
+		if (my_idx == atomic_read(&ucq->prod_idx))
+			return FALSE;
+		if (slot_is_good(my_idx))
+			goto claim_slot;
+		spin_pdr_lock(&locked_ucq_lock);
+		my_idx = atomic_read(&ucq->cons_idx);
+		if (slot_is_good(my_idx)) {
+			spin_pdr_unlock(&locked_ucq_lock);
+			if (my_idx == atomic_read(&ucq->prod_idx))
+				return FALSE;
+			goto claim_slot;
+		}
+		old_page = (struct ucq_page*)PTE_ADDR(my_idx);
+		while (!old_page->header.cons_next_pg)
+			cpu_relax();
+		atomic_set(&ucq->cons_idx, old_page->header.cons_next_pg);
+		while (atomic_read(&old_page->header.nr_cons) < NR_MSG_PER_PAGE)
+			cpu_relax_any();
+		old_page->header.cons_next_pg = 0;
+		atomic_set(&old_page->header.nr_cons, 0);
+		other_page = (struct ucq_page*)atomic_swap(&ucq->spare_pg,
+		                                           (long)old_page);
+		if (other_page) {
+			munmap(other_page, PGSIZE);
+			atomic_dec(&ucq->nr_extra_pgs);
+		}
+		spin_pdr_unlock(&locked_ucq_lock);
+		goto loop_top;
+claim_slot:
+		cmb();
+	} while (!atomic_cas(&ucq->cons_idx, my_idx, my_idx + 1));
+	my_msg = slot2msg(my_idx);
+	while (!my_msg->ready)
+		cpu_relax();
+	rmb();
+	*msg = my_msg->ev_msg;
+	my_msg->ready = FALSE;
+	wmb();
+	atomic_inc(&((struct ucq_page*)PTE_ADDR(my_idx))->header.nr_cons);
+	return TRUE;
+}
+
+struct drain_ctl {
+	struct ucq					ucq;
+	bool (*get_msg)(struct ucq *ucq, struct event_msg *msg);
+	atomic_t					go;
+	atomic_t					nr_left;
+	uint8_t						*seen;
+};
+
+static void *drainer(void *arg)
+{
+	struct drain_ctl *ctl = arg;
+	struct event_msg msg;
+
+	while (!atomic_read(&ctl->go))
+		cpu_relax();
+	while (atomic_read(&ctl->nr_left) > 0) {
+		if (!ctl->get_msg(&ctl->ucq, &msg)) {
+			cpu_relax();
+			continue;
+		}
+		__sync_fetch_and_add(&ctl->seen[msg.ev_arg2], 1);
+		atomic_dec(&ctl->nr_left);
+	}
+	return NULL;
+}
+
+static void drain_setup(void)
+{
+	parlib_never_yield = TRUE;
+	pthread_mcp_init();
+	vcore_request_total(MIN(max_vcores(), NR_DRAINERS_MAX + 1));
+	parlib_never_vc_request = TRUE;
+}
+
+/* Drains NR_DRAIN_MSGS with nr_drainers threads and returns the nsec it took,
+ * or 0 on error.  If 'concurrent', we produce while they drain, o/w the ucq is
+ * full before they start. */
+static uint64_t drain_ucq(int nr_drainers,
+                          bool (*get_msg)(struct ucq *, struct event_msg *),
+                          bool concurrent)
+{
+	struct drain_ctl *ctl = calloc(1, sizeof(struct drain_ctl));
+	pthread_t threads[NR_DRAINERS_MAX];
+	struct event_msg msg = {0};
+	uint64_t start, end;
+	bool ok = TRUE;
+
+	assert(ctl);
+	ucq_init(&ctl->ucq);
+	ctl->get_msg = get_msg;
+	ctl->seen = calloc(NR_DRAIN_MSGS, 1);
+	assert(ctl->seen);
+	atomic_set(&ctl->nr_left, NR_DRAIN_MSGS);
+	for (int i = 0; i < nr_drainers; i++)
+		pthread_create(&threads[i], NULL, drainer, ctl);
+	if (!concurrent) {
+		for (int i = 0; i < NR_DRAIN_MSGS; i++) {
+			msg.ev_arg2 = i;
+			ucq_send(&ctl->ucq, &msg);
+		}
+	}
+	start = nsec();
+	atomic_set(&ctl->go, 1);
+	if (concurrent) {
+		for (int i = 0; i < NR_DRAIN_MSGS; i++) {
+			msg.ev_arg2 = i;
+			ucq_send(&ctl->ucq, &msg);
+		}
+	}
+	for (int i = 0; i < nr_drainers; i++)
+		pthread_join(threads[i], NULL);
+	end = nsec();
+	for (int i = 0; i < NR_DRAIN_MSGS; i++) {
+		if (ctl->seen[i] != 1) {
+			ok = FALSE;
+			break;
+		}
+	}
+	ok &= ucq_is_empty(&ctl->ucq);
+	/* Every other page was munmapped by the consumers */
+	ucq_free_pgs(&ctl->ucq);
+	free(ctl->seen);
+	free(ctl);
+	return ok ? MAX(end - start, 1) : 0;
+}
+
+/* Every message gets consumed exactly once, while the producer is adding pages
+ * under the consumers' feet.  The consumers spin on the producer, so everyone
+ * needs their own vcore. */
+bool test_ucq_concurrent_drain(void)
+{
+	int nr_drainers;
+
+	drain_setup();
+	nr_drainers = MIN(max_vcores() - 1, NR_DRAINERS_MAX);
+	if (nr_drainers < 2)
+		return TRUE;
+	UT_ASSERT_FMT("Lost or duplicated a message",
+	              drain_ucq(nr_drainers, get_ucq_msg, TRUE));
+	return TRUE;
+}
+
+bool test_ucq_drain_throughput(void)
+{
+	uint64_t lockfree_ns, locked_ns;
+
+	drain_setup();
+	for (int nr = 1; nr <= MIN(max_vcores() - 1, NR_DRAINERS_MAX); nr *= 2) {
+		locked_ns = drain_ucq(nr, get_ucq_msg_locked, FALSE);
+		UT_ASSERT_FMT("Locked consumer lost a message, %d drainers", locked_ns,
+		              nr);
+		lockfree_ns = drain_ucq(nr, get_ucq_msg, FALSE);
+		UT_ASSERT_FMT("Lock-free consumer lost a message, %d drainers",
+		              lockfree_ns, nr);
+		printf("%d drainers: locked %llu msg/msec, lock-free %llu msg/msec\n",
+		       nr, NR_DRAIN_MSGS * 1000000ULL / locked_ns,
+		       NR_DRAIN_MSGS * 1000000ULL / lockfree_ns);
+	}
+	return TRUE;
+}
+
+/* <--- End definition of test cases ---> */
+
+struct utest utests[] = {
+	UTEST_REG(ucq_concurrent_drain),
+	UTEST_REG(ucq_drain_throughput),
+};
+int num_utests = sizeof(utests) / sizeof(struct utest);
+
+int main(int argc, char *argv[])
+{
+	// Run test suite passing it all the args as whitelist of what tests to run.
+	char **whitelist = &argv[1];
+	int whitelist_len = argc - 1;
+
+	RUN_TEST_SUITE(utests, num_utests, whitelist, whitelist_len);
+}
@@ -27,6 +27,20 @@ struct linux_stat_amd64 {
 
 #define DUNE_MAX_NUM_SYSCALLS 1024
 
+/* lemu's own vmcall, outside of Linux's syscall numbers, runs a batch of
+ * syscalls in one exit.  rdi points to an array of rsi lemu_batch_entrys, up to
+ * LEMU_BATCH_MAX.  Each entry's ret gets what rax would have gotten.  Returns
+ * how many entries ran; we stop early at one we can't run.  A guest with a few
+ * syscalls that don't depend on each other can save exits this way. */
+#define DUNE_SYS_LEMU_BATCH 1000
+#define LEMU_BATCH_MAX 64
+
+struct lemu_batch_entry {
+	uint64_t num;
+	uint64_t args[6];
+	int64_t ret;
+};
+
 extern struct dune_sys_table_entry dune_syscall_table[];
 
 bool init_linuxemu(void);
@@ -43,3 +43,4 @@ void vnet_port_forward(char *protocol, char *host_port, char *guest_port);
 /***** Glue between virtio and NAT */
 int vnet_transmit_packet(struct iovec *iov, int iovcnt);
 int vnet_receive_packet(struct iovec *iov, int iovcnt);
+int vnet_try_receive_packet(struct iovec *iov, int iovcnt);
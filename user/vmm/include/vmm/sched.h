@@ -34,6 +34,14 @@ struct guest_thread {
 	uth_mutex_t					*halt_mtx;
 	uth_cond_var_t				*halt_cv;
 	unsigned long				nr_vmexits;
+	/* When the guest stopped running, and whether it was for a vmexit.  Time
+	 * off the core is either exit handling or steal (runnable, but someone
+	 * else had the vcore, or the vcore was handling events). */
+	uint64_t					off_core_tsc;
+	bool						in_vmexit;
+	uint64_t					exit_ticks;
+	uint64_t					max_exit_ticks;
+	uint64_t					steal_ticks;
 	struct vmm_gpcore_init		gpci;
 	void						*user_data;
 };
@@ -72,6 +80,9 @@ struct vmm_thread {
 TAILQ_HEAD(vmm_thread_tq, vmm_thread);
 
 extern int vmm_sched_period_usec;
+/* Greedy mode only: the number of vcores that run task threads.  Guest pcores
+ * get their own vcores after these, one-to-one. */
+extern int vmm_sched_nr_housekeeping;
 
 /* Initialize a VMM for a virtual machine, which the caller fills out, except
  * for gths.  This will set **gths in the struct virtual machine.  Do not free()
@@ -68,6 +68,10 @@ struct virtio_vq {
 	// processing the queue
 	uint16_t last_avail;
 
+	// The vq.vring.used->idx the last time we decided whether or not to
+	// interrupt the driver, for VIRTIO_RING_F_EVENT_IDX
+	uint16_t last_used_irq;
+
 	// The service function that processes buffers for this queue
 	void *(*srv_fn)(void *arg);
 
@@ -78,3 +78,13 @@ struct virtio_balloon_stat {
 	uint16_t tag;
 	uint64_t val;
 } __attribute__((packed));
+
+/* The guest's inflateq and deflateq, in that order */
+#define VIRTIO_BALLOON_INFLATEQ	0
+#define VIRTIO_BALLOON_DEFLATEQ	1
+
+struct virtual_machine;
+struct virtio_vq_dev;
+
+void *balloon_queue_fn(void *_vq);
+void balloon_init_fn(struct virtual_machine *vm, struct virtio_vq_dev *vqdev);
@@ -35,6 +35,14 @@ void *virtio_check_pointer(struct virtio_vq *vq, uint64_t addr,
 // Based on add_used in Linux's lguest.c
 void virtio_add_used_desc(struct virtio_vq *vq, uint32_t head, uint32_t len);
 
+// Returns TRUE if the driver has made descriptors available that we haven't
+// pulled yet.  virtio_next_avail_vq_desc won't block if this is TRUE.
+bool virtio_vq_has_avail(struct virtio_vq *vq);
+
+// Returns TRUE if the driver wants an interrupt for the used descriptors added
+// since the last time we asked.  Honors VIRTIO_RING_F_EVENT_IDX.
+bool virtio_vq_needs_irq(struct virtio_vq *vq);
+
 // Waits for the next available descriptor chain and writes the addresses
 // and sizes of the buffers it describes to an iovec to make them easy to use.
 // Based on wait_for_vq_desc in Linux lguest.c
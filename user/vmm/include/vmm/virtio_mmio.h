@@ -221,6 +221,11 @@ struct virtio_mmio_dev {
 
 	// Destination the interrupt is routed to.
 	uint32_t dest;
+
+	// Used-buffer interrupts we sent, and ones we skipped because the driver
+	// didn't want them.  Updated atomically; the queues run in parallel.
+	uint64_t nr_irqs_injected;
+	uint64_t nr_irqs_suppressed;
 };
 
 // Sets the VIRTIO_MMIO_INT_VRING bit in the interrupt status
@@ -231,6 +236,15 @@ void virtio_mmio_set_vring_irq(struct virtio_mmio_dev *mmio_dev);
 // register for the device
 void virtio_mmio_set_cfg_irq(struct virtio_mmio_dev *mmio_dev);
 
+// Tells the driver about new used buffers on vq, unless it asked us not to.
+// Call this once after adding a batch of used descriptors, from the thread
+// that added them.
+void virtio_mmio_notify_vq(struct virtio_vq *vq);
+
+// Validates vq's vring, marks it ready, and starts its service thread, like
+// the driver writing 0x1 to QueueReady.  Also for restoring a VM image.
+void virtio_mmio_start_vq(struct virtual_machine *vm, struct virtio_vq *vq);
+
 // virtio_mmio_rd and virtio_mmio_wr:
 // Used to read and write to the mmio device registers.
 // - gpa is the guest physical address that the driver tried to write to.
@@ -246,3 +246,5 @@ struct virtio_net_ctrl_mq {
 void virtio_net_set_mac(struct virtio_vq_dev *vqdev, uint8_t *guest_mac);
 void *net_receiveq_fn(void *_vq);
 void *net_transmitq_fn(void *_vq);
+void *net_ctrlq_fn(void *_vq);
+void *net_queue_fn(void *_vq);
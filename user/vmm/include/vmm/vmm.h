@@ -39,6 +39,7 @@ enum {
 	VIRTIO_MMIO_CONSOLE_DEV,
 	VIRTIO_MMIO_NETWORK_DEV,
 	VIRTIO_MMIO_BLOCK_DEV,
+	VIRTIO_MMIO_BALLOON_DEV,
 
 	/* This should always be the last entry. */
 	VIRTIO_MMIO_MAX_NUM_DEV,
@@ -82,6 +83,8 @@ struct virtual_machine {
 	bool						halt_exit;
 	/* Override for vmcall (vthreads) */
 	bool (*vmcall)(struct guest_thread *gth, struct vm_trapframe *);
+	/* Where VMCALL_SNAPSHOT saves a VM image.  If unset, the vmcall fails. */
+	char						*image_path;
 };
 
 struct elf_aux {
@@ -99,6 +102,7 @@ int msrio(struct guest_thread *vm_thread, struct vmm_gpcore_init *gpci,
           uint32_t opcode);
 int do_ioapic(struct guest_thread *vm_thread, uint64_t gpa,
               int destreg, uint64_t *regp, int store);
+void *ioapic_state(size_t *len);
 bool handle_vmexit(struct guest_thread *gth);
 int __apic_access(struct guest_thread *vm_thread, uint64_t gpa, int destreg,
                   uint64_t *regp, int store);
@@ -166,6 +170,16 @@ void *setup_biostables(struct virtual_machine *vm,
 void *populate_stack(uintptr_t *stack, int argc, char *argv[],
                          int envc, char *envp[],
                          int auxc, struct elf_aux auxv[]);
+int guest_ram_ranges(struct virtual_machine *vm, uintptr_t *starts,
+                     size_t *lens);
+long vmm_harvest_ad(uintptr_t gpa, size_t len, uint8_t *bitmap, int which);
+/* Snapshots of guest memory */
+ssize_t vmm_snapshot_save(struct virtual_machine *vm, int fd);
+ssize_t vmm_snapshot_restore(struct virtual_machine *vm, int fd);
+/* VM images, to start guests without booting them */
+int vmm_image_save(struct virtual_machine *vm, const char *path);
+int vmm_image_map(struct virtual_machine *vm, const char *path);
+int vmm_image_restore(struct virtual_machine *vm, const char *path);
 /* For vthreads */
 struct guest_thread *create_guest_thread(struct virtual_machine *vm,
                                          unsigned int gpcoreid,
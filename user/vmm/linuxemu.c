@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <vmm/vmm.h>
@@ -36,9 +37,14 @@ static uth_mutex_t *fd_table_lock;
 
 static FILE *lemu_global_logfile;
 
-//Records the open fds of files opened with linuxemu
+//Records the paths of files opened with linuxemu, by fd, so we can resolve
+//paths relative to them.  We keep the length, since we use these a lot.
 // TODO: Make this a dynamic array in the future
-char *openfd_filenames[DUNE_NR_FILE_DESC];
+struct lemu_fd_path {
+	char *path;
+	size_t len;
+};
+static struct lemu_fd_path fd_paths[DUNE_NR_FILE_DESC];
 
 void init_lemu_logging(int log_level)
 {
@@ -83,76 +89,64 @@ bool is_absolute_path(const char *path)
 // This function will allocate memory for the string absolute_path, it is the
 // caller's responsibility to free this memory when it is done
 //
-// If path is an absolute path already, we ignore fd and retrun a copy of path
-// in absolute_path
+// If path is an absolute path already, or fd is AT_FDCWD, we ignore fd and
+// return a copy of path in absolute_path.  Our cwd is the guest's.
 bool get_absolute_path_from_fd(int fd, const char *path, char **absolute_path)
 {
+	struct lemu_fd_path *fdp;
+	size_t len1, len2;
+	bool slash;
+
 	if (!path) {
 		fprintf(stderr, "get_absolute_path_from_fd: suffix is null.\n");
 		return false;
 	}
 
-	if (fd >= DUNE_NR_FILE_DESC) {
-		fprintf(stderr, "get_absolute_path_from_fd: fd too large.\n");
-		return false;
-	}
-
-	int len1 = strlen(path);
-
+	len1 = strlen(path);
 	if (len1 == 0) {
 		fprintf(stderr, "get_absolute_path_from_fd: suffix is empty.\n");
 		return false;
 	}
 
-	if (is_absolute_path(path)) {
-		*absolute_path = calloc(sizeof(char), len1 + 1);
+	if (is_absolute_path(path) || fd == AT_FDCWD) {
+		*absolute_path = strdup(path);
 		if (!(*absolute_path)) {
 			fprintf(stderr,
 			        "get_absolute_path_from_fd: couldn't allocate memory.\n");
 			return false;
 		}
-		strcpy(*absolute_path, path);
 		return true;
 	}
 
-	uth_mutex_lock(fd_table_lock);
-	if (!openfd_filenames[fd]) {
-		uth_mutex_unlock(fd_table_lock);
-		fprintf(stderr, "get_absolute_path_from_fd: no file open at fd.\n");
+	if (fd < 0 || fd >= DUNE_NR_FILE_DESC) {
+		fprintf(stderr, "get_absolute_path_from_fd: bad fd %d.\n", fd);
 		return false;
 	}
 
-	int len2 = strlen(openfd_filenames[fd]);
-
-	if (len2 == 0) {
+	uth_mutex_lock(fd_table_lock);
+	fdp = &fd_paths[fd];
+	len2 = fdp->len;
+	if (!len2) {
 		uth_mutex_unlock(fd_table_lock);
-		fprintf(stderr,
-		        "get_absolute_path_from_fd: prefix has length 0, fd was probably not open.\n");
+		fprintf(stderr, "get_absolute_path_from_fd: no file open at fd.\n");
 		return false;
 	}
 
 	// Add space for an extra slash and a null terminator
-	int total_len = len1 + len2 + 2;
-
-	*absolute_path = calloc(sizeof(char), total_len);
-
+	slash = fdp->path[len2 - 1] != '/';
+	*absolute_path = malloc(len2 + slash + len1 + 1);
 	if (!(*absolute_path)) {
 		uth_mutex_unlock(fd_table_lock);
 		fprintf(stderr,
 		        "get_absolute_path_from_fd: couldn't allocate memory.\n");
 		return false;
 	}
-
-	strcat(*absolute_path, openfd_filenames[fd]);
+	memcpy(*absolute_path, fdp->path, len2);
 	uth_mutex_unlock(fd_table_lock);
 
-	// Add a slash if we don't have one
-	if ((*absolute_path)[len2 - 1] != '/')
-		strcat(*absolute_path, "/");
-
-	strcat(*absolute_path, path);
-
-	fprintf(stderr, "Constructed full path \"%s\"\n", *absolute_path);
+	if (slash)
+		(*absolute_path)[len2] = '/';
+	memcpy(*absolute_path + len2 + slash, path, len1 + 1);
 	return true;
 }
 
@@ -212,39 +206,49 @@ int convert_open_flags_atol(int flags)
 // values in the fd table as NULL
 bool update_fd_map(int fd, const char *path)
 {
-	int len = 0;
+	struct lemu_fd_path *fdp;
+	size_t len = 0;
+	char *old = NULL, *new = NULL;
 
-	if (fd >= DUNE_NR_FILE_DESC)
+	if (fd < 0 || fd >= DUNE_NR_FILE_DESC)
 		return false;
 
-	if (path)
+	// Allocate outside the lock
+	if (path) {
 		len = strlen(path);
-
-	uth_mutex_lock(fd_table_lock);
-
-	// If there was a file here before, free the string
-	// Potential optimization would be to only free when
-	// we need to grow the size of the string.
-	if (openfd_filenames[fd]) {
-		free(openfd_filenames[fd]);
-		openfd_filenames[fd] = NULL;
-	}
-	// If we have a new file to put here, allocate memory
-	// and copy it in.
-	if (len) {
-		openfd_filenames[fd] = (char*) calloc(sizeof(char), len + 1);
-		if (!openfd_filenames[fd]) {
-			uth_mutex_unlock(fd_table_lock);
-			panic("update_fd_map could not allocate memory\n");
-			return false;
+		if (len) {
+			new = strdup(path);
+			if (!new)
+				panic("update_fd_map could not allocate memory\n");
 		}
-		strcpy(openfd_filenames[fd], path);
 	}
 
+	uth_mutex_lock(fd_table_lock);
+	fdp = &fd_paths[fd];
+	old = fdp->path;
+	fdp->path = new;
+	fdp->len = len;
 	uth_mutex_unlock(fd_table_lock);
+
+	free(old);
 	return true;
 }
 
+// Gives newfd the same path as oldfd, for dup and dup2
+static void dup_fd_map(int oldfd, int newfd)
+{
+	char *path = NULL;
+
+	if (oldfd < 0 || oldfd >= DUNE_NR_FILE_DESC)
+		return;
+	uth_mutex_lock(fd_table_lock);
+	if (fd_paths[oldfd].path)
+		path = strdup(fd_paths[oldfd].path);
+	uth_mutex_unlock(fd_table_lock);
+	update_fd_map(newfd, path);
+	free(path);
+}
+
 void convert_stat_akaros_to_linux(struct stat *si_akaros,
                                   struct linux_stat_amd64 *si)
 {
@@ -429,6 +433,7 @@ bool dune_sys_dup(struct vm_trapframe *tf)
 		          "ERROR %d\n", err);
 		tf->tf_rax = -err;
 	} else {
+		dup_fd_map((int) tf->tf_rdi, retval);
 		lemuprint(tf->tf_guest_pcoreid, tf->tf_rax, false,
 		          "SUCCESS %d\n", retval);
 		tf->tf_rax = retval;
@@ -446,6 +451,8 @@ bool dune_sys_dup2(struct vm_trapframe *tf)
 		          "ERROR %d\n", err);
 		tf->tf_rax = -err;
 	} else {
+		if (retval != (int) tf->tf_rdi)
+			dup_fd_map((int) tf->tf_rdi, retval);
 		lemuprint(tf->tf_guest_pcoreid, tf->tf_rax, false,
 		          "SUCCESS %d\n", retval);
 		tf->tf_rax = retval;
@@ -1497,6 +1504,62 @@ void lemuprint(const uint32_t tid, uint64_t syscall_number,
 }
 
 
+static dune_syscall_t lemu_get_call(uint64_t num)
+{
+	if (num >= DUNE_MAX_NUM_SYSCALLS) {
+		fprintf(stderr, "System call %d is out of range\n", num);
+		return NULL;
+	}
+	if (dune_syscall_table[num].call == NULL) {
+		fprintf(stderr, "System call #%d (%s) is not implemented\n",
+		        num, dune_syscall_table[num].name);
+		return NULL;
+	}
+	return dune_syscall_table[num].call;
+}
+
+// Runs the guest's array of syscalls in one exit.  The handlers only look at
+// the syscall number and argument registers, so we give each one a copy of
+// the trapframe with its entry's values.
+static bool dune_sys_lemu_batch(struct vm_trapframe *tf)
+{
+	struct lemu_batch_entry *ents = (struct lemu_batch_entry *) tf->tf_rdi;
+	size_t nr = tf->tf_rsi;
+	struct vm_trapframe btf;
+	dune_syscall_t call;
+	size_t i;
+
+	if (nr > LEMU_BATCH_MAX) {
+		tf->tf_rax = -EINVAL;
+		return true;
+	}
+	for (i = 0; i < nr; i++) {
+		// No batches within batches
+		if (ents[i].num == DUNE_SYS_LEMU_BATCH)
+			break;
+		call = lemu_get_call(ents[i].num);
+		if (!call)
+			break;
+		btf = *tf;
+		btf.tf_rax = ents[i].num;
+		btf.tf_rdi = ents[i].args[0];
+		btf.tf_rsi = ents[i].args[1];
+		btf.tf_rdx = ents[i].args[2];
+		btf.tf_r10 = ents[i].args[3];
+		btf.tf_r8 = ents[i].args[4];
+		btf.tf_r9 = ents[i].args[5];
+		lemuprint(tf->tf_guest_pcoreid, btf.tf_rax, false,
+		          "batched(%d, %p, %p, %p, %p, %p, %p);\n", btf.tf_rax,
+		          btf.tf_rdi, btf.tf_rsi, btf.tf_rdx, btf.tf_r10, btf.tf_r8,
+		          btf.tf_r9);
+		if (!call(&btf))
+			break;
+		ents[i].ret = btf.tf_rax;
+	}
+	tf->tf_rax = i;
+	return true;
+}
+
 /* TODO: have an array which classifies syscall args
  * and "special" system calls (ones with weird return
  * values etc.). For some cases, we don't even do a system
@@ -1506,19 +1569,16 @@ void lemuprint(const uint32_t tid, uint64_t syscall_number,
 bool
 linuxemu(struct guest_thread *gth, struct vm_trapframe *tf)
 {
-	bool ret = false;
+	dune_syscall_t call;
 
-	if (tf->tf_rax >= DUNE_MAX_NUM_SYSCALLS) {
-		fprintf(stderr, "System call %d is out of range\n", tf->tf_rax);
-		return false;
+	if (tf->tf_rax == DUNE_SYS_LEMU_BATCH) {
+		tf->tf_rip += 3;
+		return dune_sys_lemu_batch(tf);
 	}
 
-
-	if (dune_syscall_table[tf->tf_rax].call == NULL) {
-		fprintf(stderr, "System call #%d (%s) is not implemented\n",
-		        tf->tf_rax, dune_syscall_table[tf->tf_rax].name);
+	call = lemu_get_call(tf->tf_rax);
+	if (!call)
 		return false;
-	}
 
 	lemuprint(tf->tf_guest_pcoreid, tf->tf_rax,
 	          false, "vmcall(%d, %p, %p, %p, %p, %p, %p);\n", tf->tf_rax,
@@ -1527,5 +1587,5 @@ linuxemu(struct guest_thread *gth, struct vm_trapframe *tf)
 
 	tf->tf_rip += 3;
 
-	return (dune_syscall_table[tf->tf_rax].call)(tf);
+	return call(tf);
 }
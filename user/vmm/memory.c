@@ -12,6 +12,7 @@
 #include <err.h>
 #include <vmm/util.h>
 #include <parlib/ros_debug.h>
+#include <parlib/parlib.h>
 #include <fcntl.h>
 
 
@@ -108,6 +109,14 @@ void checkmemaligned(uintptr_t memstart, size_t memsize)
 // as it does not have the RESERVED restrictions. Dune-style code can use this,
 // however, by setting memstart to 4 GiB. This code can be called multiple
 // times with more ranges. It does not check for overlaps.
+//
+// Guest RAM gets jumbo pages where the kernel can find them.  The kernel keeps
+// the EPT in lockstep with our page tables, so the guest gets 2 MB EPT entries
+// too.  We populate it all now, instead of taking an EPT fault per page later.
+// checkmemaligned() makes sure the regions are jumbo aligned.
+#define GUEST_RAM_MAP_FLAGS \
+	(MAP_POPULATE | MAP_HUGEPAGE | MAP_ANONYMOUS | MAP_PRIVATE)
+
 void mmap_memory(struct virtual_machine *vm, uintptr_t memstart, size_t memsize)
 {
 	void *r1, *r2;
@@ -130,8 +139,8 @@ void mmap_memory(struct virtual_machine *vm, uintptr_t memstart, size_t memsize)
 
 		r1size = memstart < RESERVED ? RESERVED - memstart : 0;
 		r2 = mmap((void *)r2start, memsize - r1size,
-		          PROT_READ | PROT_WRITE | PROT_EXEC,
-		          MAP_POPULATE | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		          PROT_READ | PROT_WRITE | PROT_EXEC, GUEST_RAM_MAP_FLAGS, -1,
+		          0);
 		if (r2 != (void *)r2start) {
 			fprintf(stderr,
 			        "High region: Could not mmap 0x%lx bytes at 0x%lx\n",
@@ -143,8 +152,7 @@ void mmap_memory(struct virtual_machine *vm, uintptr_t memstart, size_t memsize)
 	}
 
 	r1 = mmap((void *)memstart, r1size,
-	              PROT_READ | PROT_WRITE | PROT_EXEC,
-	              MAP_POPULATE | MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	              PROT_READ | PROT_WRITE | PROT_EXEC, GUEST_RAM_MAP_FLAGS, -1, 0);
 	if (r1 != (void *)memstart) {
 		fprintf(stderr, "Low region: Could not mmap 0x%lx bytes at 0x%lx\n",
 		        memsize, memstart);
@@ -159,6 +167,39 @@ done:
 		vm->maxphys = memstart + memsize - 1;
 }
 
+/* Guest RAM is [minphys, maxphys], minus the RESERVED hole below 4 GiB (see
+ * mmap_memory()).  Fills in up to two ranges and returns how many. */
+int guest_ram_ranges(struct virtual_machine *vm, uintptr_t *starts,
+                     size_t *lens)
+{
+	uintptr_t end = vm->maxphys + 1;
+	int nr = 0;
+
+	if (!vm->maxphys)
+		return 0;
+	if (vm->minphys < RESERVED) {
+		starts[nr] = vm->minphys;
+		lens[nr] = MIN(end, RESERVED) - vm->minphys;
+		nr++;
+	}
+	if (end > _4GiB) {
+		starts[nr] = MAX(vm->minphys, _4GiB);
+		lens[nr] = end - starts[nr];
+		nr++;
+	}
+	return nr;
+}
+
+/* Collects and clears the guest's accessed or dirty bits for [gpa, gpa + len)
+ * into bitmap, one bit per page.  which is VMM_HARVEST_ACCESSED or
+ * VMM_HARVEST_DIRTY.  Our own accesses to guest memory count too.
+ *
+ * Returns how many pages had the bit, or -1 on error. */
+long vmm_harvest_ad(uintptr_t gpa, size_t len, uint8_t *bitmap, int which)
+{
+	return syscall(SYS_vmm_ctl, VMM_CTL_HARVEST_AD, gpa, len, bitmap, which);
+}
+
 bool mmap_file(const char *path, uintptr_t memstart, size_t memsize,
                uint64_t protections, size_t offset)
 {
@@ -63,18 +63,18 @@
  *   it comes to getting the packet to us, not the actual network's broadcast
  *   domain.
  *
- * - Why is the RX path single threaded?  So it's possible to rewrite
- *   __poll_inbound() such that readv() is not called while holding the rx_mtx.
- *   To do so, we pop the first item off the inbound_todo list (so we have the
- *   ref), do the read, then put it back on the list if it hasn't been drained
- *   to empty.  The main issue, apart from being more complicated, is that since
+ * - How does the RX path handle multiple receive queues?  Each virtio-net
+ *   receive queue has its own thread calling vnet_receive_packet(), and
+ *   __poll_inbound() does not call readv() while holding the rx_mtx.  We pop
+ *   the first item off the inbound_todo list (so we have the ref), do the read,
+ *   then put it back on the list if it hasn't been drained to empty.  Since
  *   we're unlocking and relocking, any invariant that we had before calling
- *   __poll_inbound needs to be rechecked.  Specifically, we would need to check
+ *   __poll_inbound needs to be rechecked.  Specifically, we need to check
  *   __poll_injection *after* returning from __poll_inbound.  Otherwise we could
- *   sleep with a packet waiting to be injected.  Whoops!  That could have been
- *   dealt with, but it's subtle.  There also might be races with FD taps
- *   firing, the fdtap_watcher not putting items on the list, and the thread
- *   then not putting it on the list.  Specifically:
+ *   sleep with a packet waiting to be injected.  So vnet_receive_packet() only
+ *   sleeps after a pass where it never dropped the lock.  There's also a race
+ *   with FD taps firing, the fdtap_watcher not putting items on the list, and
+ *   the thread then not putting it on the list.  Specifically:
  *   	fdtap_watcher:							__poll_inbound:
  *   	-------------------------------------------------------
  *   											yanks map off list
@@ -92,7 +92,13 @@
  *   											lock mtx
  *   											clear "on inbound"
  *   											unlock + sleep on CV
- *   The FD has data, but we lost the event, and we'll never read it.
+ *   The FD has data, but we lost the event, and we'll never read it.  To
+ *   avoid that, the fdtap_watcher sets rx_pending for maps that are already
+ *   "on inbound", and __poll_inbound keeps the map if it sees rx_pending.
+ *
+ *   Packets from one conversation could be read by different threads, and
+ *   thus land on different receive queues, so the guest might see them out of
+ *   order.  TCP copes.
  *
  * - Why is the fdtap_watcher its own thread?  You can't kick a CV from vcore
  *   context, since you almost always want to hold the MTX while kicking the CV
@@ -145,6 +151,7 @@
 #include <parlib/event.h>
 #include <parlib/spinlock.h>
 #include <parlib/kref.h>
+#include <parlib/slab.h>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -198,6 +205,7 @@ struct ip_nat_map {
 	/* These fields are protected by the rx mutex */
 	TAILQ_ENTRY(ip_nat_map)		inbound;
 	bool						is_on_inbound;
+	bool						rx_pending;
 };
 
 #define NR_VNET_HASH 128
@@ -213,14 +221,19 @@ struct ip_nat_map_tailq map_hash_fd[NR_VNET_HASH];
 struct ip_nat_map_tailq inbound_todo = TAILQ_HEAD_INITIALIZER(inbound_todo);
 
 /* buf_pkt: tracks a packet, used for injecting packets (usually synthetic
- * responses) into the guest via receive_packet. */
+ * responses) into the guest via receive_packet.  They come from a slab, and the
+ * buffer is big enough for any of our synthetic packets. */
+#define BPKT_BUF_SZ 1024
+
 struct buf_pkt {
 	STAILQ_ENTRY(buf_pkt)		next;
-	uint8_t						*buf;
 	size_t						sz;
+	uint8_t						buf[BPKT_BUF_SZ];
 };
 STAILQ_HEAD(buf_pkt_stailq, buf_pkt);
 
+static struct kmem_cache *bpkt_cache;
+
 struct buf_pkt_stailq inject_pkts = STAILQ_HEAD_INITIALIZER(inject_pkts);
 uth_mutex_t *rx_mtx;
 uth_cond_var_t *rx_cv;
@@ -320,6 +333,7 @@ static struct ip_nat_map *create_map(uint8_t protocol, uint16_t guest_port,
 	map->is_static = is_static;
 	map->is_stale = FALSE;
 	map->is_on_inbound = FALSE;
+	map->rx_pending = FALSE;
 
 	switch (protocol) {
 	case IP_UDPPROTO:
@@ -431,39 +445,48 @@ static struct buf_pkt *zalloc_bpkt(size_t size)
 {
 	struct buf_pkt *bpkt;
 
-	bpkt = malloc(sizeof(struct buf_pkt));
+	assert(size <= BPKT_BUF_SZ);
+	bpkt = kmem_cache_alloc(bpkt_cache, 0);
 	assert(bpkt);
 	bpkt->sz = size;
-	bpkt->buf = malloc(bpkt->sz);
-	assert(bpkt->buf);
+	/* Only the parts we'll use; the builders expect zeros */
 	memset(bpkt->buf, 0, bpkt->sz);
 	return bpkt;
 }
 
 static void free_bpkt(struct buf_pkt *bpkt)
 {
-	free(bpkt->buf);
-	free(bpkt);
+	kmem_cache_free(bpkt_cache, bpkt);
 }
 
-/* Queues a buf_pkt, which the rx thread will inject when it wakes. */
+/* Queues a buf_pkt, which an rx thread will inject when it wakes.  Only one
+ * rx thread needs to wake up per packet. */
 static void inject_buf_pkt(struct buf_pkt *bpkt)
 {
 	uth_mutex_lock(rx_mtx);
 	STAILQ_INSERT_TAIL(&inject_pkts, bpkt, next);
 	uth_mutex_unlock(rx_mtx);
-	uth_cond_var_broadcast(rx_cv);
+	uth_cond_var_signal(rx_cv);
 }
 
-/* Helper for xsum_update, mostly for paranoia with integer promotion and
+/* Helper for the xsum updaters, mostly for paranoia with integer promotion and
  * cleanly keeping variables as u16. */
 static uint16_t ones_comp(uint16_t x)
 {
 	return ~x;
 }
 
-/* IP checksum updater.  If you change amt bytes in a packet from old to new,
- * this updates the xsum at xsum_off in the iov.
+static uint32_t xsum_fold(uint32_t xsum)
+{
+	while (xsum >> 16)
+		xsum = (xsum & 0xffff) + (xsum >> 16);
+	return xsum;
+}
+
+/* Incremental IP checksum updates.  If you change amt bytes in a packet from
+ * old to new, xsum_delta() adds that change to delta.  Once you've made all of
+ * your changes, xsum_apply() updates the xsum at xsum_off in the iov.  That way
+ * we only touch each xsum once per packet, no matter how many fields changed.
  *
  * Assumes a few things:
  * - there's a 16 byte xsum at xsum_off
@@ -474,31 +497,38 @@ static uint16_t ones_comp(uint16_t x)
  * sensible nhgets() (just byte accesses, not assuming u16 alignment).
  *
  * See RFC 1624 for the math.  I opted for Eqn 3, instead of 4, since I didn't
- * want to deal with subtraction underflow / carry / etc.  Also note that we
- * need to do the intermediate carry before doing the one's comp.  That wasn't
- * clear from the RFC either.  RFC 1141 didn't need to do that, since they
- * didn't complement the intermediate HC (xsum). */
-static void xsum_update(struct iovec *iov, int iovcnt, size_t xsum_off,
-                        uint8_t *old, uint8_t *new, size_t amt)
+ * want to deal with subtraction underflow / carry / etc.  For each short:
+ * HC' = ~(~HC + ~m + m') (' == new, ~ == ones-comp).  One's complement addition
+ * is associative, so we can sum up all of the (~m + m') first.  Also note that
+ * we need to do the carry before doing the one's comp.  That wasn't clear from
+ * the RFC either.  RFC 1141 didn't need to do that, since they didn't
+ * complement the intermediate HC (xsum). */
+static uint32_t xsum_delta(uint32_t delta, uint8_t *old, uint8_t *new,
+                           size_t amt)
+{
+	assert(amt % 2 == 0);
+	for (int i = 0; i < amt / 2; i++, old += 2, new += 2)
+		delta = xsum_fold(delta + ones_comp(nhgets(old)) + nhgets(new));
+	return delta;
+}
+
+static void xsum_apply(struct iovec *iov, int iovcnt, size_t xsum_off,
+                       uint32_t delta)
 {
 	uint32_t xsum;
 
-	assert(amt % 2 == 0);
 	xsum = iov_get_be16(iov, iovcnt, xsum_off);
-	/* for each short: HC' = ~(~HC + ~m + m') (' == new, ~ == ones-comp) */
-	for (int i = 0; i < amt / 2; i++, old += 2, new += 2) {
-		xsum = ones_comp(xsum) + ones_comp(nhgets(old)) + nhgets(new);
-		/* Need to deal with the carry for any additions, before the outer ~()
-		 * operation.  (Not mentioned in the RFC, determined manually...) */
-		while (xsum >> 16)
-			xsum = (xsum & 0xffff) + (xsum >> 16);
-		/* Yes, next time around the loop we ones comp right back.  Not worth
-		 * optimizing. */
-		xsum = ones_comp(xsum);
-	}
-	iov_put_be16(iov, iovcnt, xsum_off, xsum);
+	xsum = xsum_fold(ones_comp(xsum) + delta);
+	iov_put_be16(iov, iovcnt, xsum_off, ones_comp(xsum));
 }
 
+/* Accumulated xsum changes for a packet.  l3 is for the IPv4 header.  l4 is for
+ * the TCP or UDP xsum, which also covers the addresses (pseudo-header). */
+struct xsum_fixup {
+	uint32_t					l3;
+	uint32_t					l4;
+};
+
 static void snoop_on_virtio(void)
 {
 	int ret;
@@ -658,6 +688,8 @@ static void *fdtap_watcher(void *arg)
 			TAILQ_INSERT_TAIL(&inbound_todo, map, inbound);
 			uth_cond_var_broadcast(rx_cv);
 		} else {
+			/* It might be off the list, in the middle of a readv */
+			map->rx_pending = TRUE;
 			kref_put(&map->kref);
 		}
 		uth_mutex_unlock(rx_mtx);
@@ -714,6 +746,9 @@ void vnet_init(struct virtual_machine *vm, struct virtio_vq_dev *vqdev)
 	virtio_net_set_mac(vqdev, guest_eth_addr);
 	rx_mtx = uth_mutex_alloc();
 	rx_cv = uth_cond_var_alloc();
+	bpkt_cache = kmem_cache_create("vnet buf pkts", sizeof(struct buf_pkt),
+	                               __alignof__(struct buf_pkt), 0, NULL, NULL,
+	                               NULL);
 	if (vnet_snoop)
 		snoop_on_virtio();
 	init_map_lookup(vm);
@@ -1058,21 +1093,21 @@ static void handle_arp_tx(struct iovec *iov, int iovcnt)
 	inject_buf_pkt(bpkt);
 }
 
-/* Helper for protocols: updates an xsum, given a port number change */
-static void xsum_changed_port(struct iovec *iov, int iovcnt, size_t xsum_off,
-                              uint16_t old_port, uint16_t new_port)
+/* Helper for protocols: accumulates the L4 xsum change for a port change */
+static void xsum_changed_port(struct xsum_fixup *fix, uint16_t old_port,
+                              uint16_t new_port)
 {
 	uint16_t old_port_be, new_port_be;
 
 	/* xsum update expects to work on big endian */
 	hnputs(&old_port_be, old_port);
 	hnputs(&new_port_be, new_port);
-	xsum_update(iov, iovcnt, xsum_off, (uint8_t*)&old_port_be,
-	            (uint8_t*)&new_port_be, 2);
+	fix->l4 = xsum_delta(fix->l4, (uint8_t*)&old_port_be,
+	                     (uint8_t*)&new_port_be, 2);
 }
 
 static struct ip_nat_map *handle_udp_tx(struct iovec *iov, int iovcnt,
-                                        size_t udp_off)
+                                        size_t udp_off, struct xsum_fixup *fix)
 {
 	uint16_t src_port, dst_port;
 	struct ip_nat_map *map;
@@ -1090,14 +1125,13 @@ static struct ip_nat_map *handle_udp_tx(struct iovec *iov, int iovcnt,
 	map = get_map_by_tuple(IP_UDPPROTO, src_port);
 	if (!map)
 		return NULL;
-	xsum_changed_port(iov, iovcnt, udp_off + UDP_OFF_XSUM, src_port,
-	                  map->host_port);
+	xsum_changed_port(fix, src_port, map->host_port);
 	iov_put_be16(iov, iovcnt, udp_off + UDP_OFF_SRC_PORT, map->host_port);
 	return map;
 }
 
 static struct ip_nat_map *handle_tcp_tx(struct iovec *iov, int iovcnt,
-                                        size_t tcp_off)
+                                        size_t tcp_off, struct xsum_fixup *fix)
 {
 	uint16_t src_port, dst_port;
 	struct ip_nat_map *map;
@@ -1111,14 +1145,14 @@ static struct ip_nat_map *handle_tcp_tx(struct iovec *iov, int iovcnt,
 	map = get_map_by_tuple(IP_TCPPROTO, src_port);
 	if (!map)
 		return NULL;
-	xsum_changed_port(iov, iovcnt, tcp_off + TCP_OFF_XSUM, src_port,
-	                  map->host_port);
+	xsum_changed_port(fix, src_port, map->host_port);
 	iov_put_be16(iov, iovcnt, tcp_off + TCP_OFF_SRC_PORT, map->host_port);
 	return map;
 }
 
 static struct ip_nat_map *handle_icmp_tx(struct iovec *iov, int iovcnt,
-                                         size_t icmp_off)
+                                         size_t icmp_off,
+                                         struct xsum_fixup *fix)
 {
 	/* TODO: we could respond to pings sent to us (router_ip).  For anything
 	 * else, we'll need to work with the bypass (if possible, maybe ID it with
@@ -1126,34 +1160,31 @@ static struct ip_nat_map *handle_icmp_tx(struct iovec *iov, int iovcnt,
 	return NULL;
 }
 
-/* Some protocols (like TCP and UDP) need to adjust their xsums whenever an IPv4
- * address changes. */
-static void ipv4_proto_changed_addr(struct iovec *iov, int iovcnt,
-                                    uint8_t protocol, size_t proto_hdr_off,
-                                    uint8_t *old_addr, uint8_t *new_addr)
+/* Applies the accumulated xsum changes for a packet.  Some protocols (like TCP
+ * and UDP) need to adjust their xsums whenever an IPv4 address changes. */
+static void ipv4_apply_fixup(struct iovec *iov, int iovcnt, size_t ip_off,
+                             uint8_t protocol, size_t proto_hdr_off,
+                             struct xsum_fixup *fix)
 {
+	xsum_apply(iov, iovcnt, ip_off + IPV4_OFF_XSUM, fix->l3);
 	switch (protocol) {
 	case IP_UDPPROTO:
-		xsum_update(iov, iovcnt, proto_hdr_off + UDP_OFF_XSUM, old_addr,
-		            new_addr, IPV4_ADDR_LEN);
+		xsum_apply(iov, iovcnt, proto_hdr_off + UDP_OFF_XSUM, fix->l4);
 		break;
 	case IP_TCPPROTO:
-		xsum_update(iov, iovcnt, proto_hdr_off + TCP_OFF_XSUM, old_addr,
-		            new_addr, IPV4_ADDR_LEN);
+		xsum_apply(iov, iovcnt, proto_hdr_off + TCP_OFF_XSUM, fix->l4);
 		break;
 	}
 }
 
-/* Helper, changes a packet's IP address, updating xsums.  'which' controls
- * whether we're changing the src or dst address. */
+/* Helper, changes a packet's IP address, accumulating the xsum changes in fix.
+ * 'which' controls whether we're changing the src or dst address. */
 static void ipv4_change_addr(struct iovec *iov, int iovcnt, size_t ip_off,
-                             uint8_t protocol, uint8_t proto_hdr_off,
-                             uint8_t *old_addr, uint8_t *new_addr, size_t which)
+                             struct xsum_fixup *fix, uint8_t *old_addr,
+                             uint8_t *new_addr, size_t which)
 {
-	xsum_update(iov, iovcnt, ip_off + IPV4_OFF_XSUM, old_addr, new_addr,
-	            IPV4_ADDR_LEN);
-	ipv4_proto_changed_addr(iov, iovcnt, protocol, proto_hdr_off, old_addr,
-	                        new_addr);
+	fix->l3 = xsum_delta(fix->l3, old_addr, new_addr, IPV4_ADDR_LEN);
+	fix->l4 = xsum_delta(fix->l4, old_addr, new_addr, IPV4_ADDR_LEN);
 	iov_memcpy_to(iov, iovcnt, ip_off + which, new_addr, IPV4_ADDR_LEN);
 }
 
@@ -1180,6 +1211,7 @@ static void handle_ipv4_tx(struct iovec *iov, int iovcnt)
 	uint8_t protocol;
 	size_t proto_hdr_off;
 	struct ip_nat_map *map;
+	struct xsum_fixup fix = {0};
 	uint8_t src_addr[IPV4_ADDR_LEN];
 	uint8_t dst_addr[IPV4_ADDR_LEN];
 
@@ -1193,13 +1225,13 @@ static void handle_ipv4_tx(struct iovec *iov, int iovcnt)
 	proto_hdr_off = ipv4_get_proto_off(iov, iovcnt, ip_off);
 	switch (protocol) {
 	case IP_UDPPROTO:
-		map = handle_udp_tx(iov, iovcnt, proto_hdr_off);
+		map = handle_udp_tx(iov, iovcnt, proto_hdr_off, &fix);
 		break;
 	case IP_TCPPROTO:
-		map = handle_tcp_tx(iov, iovcnt, proto_hdr_off);
+		map = handle_tcp_tx(iov, iovcnt, proto_hdr_off, &fix);
 		break;
 	case IP_ICMPPROTO:
-		map = handle_icmp_tx(iov, iovcnt, proto_hdr_off);
+		map = handle_icmp_tx(iov, iovcnt, proto_hdr_off, &fix);
 		break;
 	}
 	/* If the protocol handler already dealt with it (e.g. via emulation), we
@@ -1218,14 +1250,15 @@ static void handle_ipv4_tx(struct iovec *iov, int iovcnt)
 	 * that the *host's* IP stack recognizes the connection (necessary for
 	 * host-initiated connections via static maps). */
 	if (!memcmp(dst_addr, guest_v4_router, IPV4_ADDR_LEN)) {
-		ipv4_change_addr(iov, iovcnt, ip_off, protocol, proto_hdr_off,
-		                 dst_addr, loopback_v4_addr, IPV4_OFF_DST);
-		ipv4_change_addr(iov, iovcnt, ip_off, protocol, proto_hdr_off,
-		                 src_addr, loopback_v4_addr, IPV4_OFF_SRC);
+		ipv4_change_addr(iov, iovcnt, ip_off, &fix, dst_addr,
+		                 loopback_v4_addr, IPV4_OFF_DST);
+		ipv4_change_addr(iov, iovcnt, ip_off, &fix, src_addr,
+		                 loopback_v4_addr, IPV4_OFF_SRC);
 	} else {
-		ipv4_change_addr(iov, iovcnt, ip_off, protocol, proto_hdr_off,
-		                 src_addr, host_v4_addr, IPV4_OFF_SRC);
+		ipv4_change_addr(iov, iovcnt, ip_off, &fix, src_addr, host_v4_addr,
+		                 IPV4_OFF_SRC);
 	}
+	ipv4_apply_fixup(iov, iovcnt, ip_off, protocol, proto_hdr_off, &fix);
 	/* We didn't change the size of the packet, just a few fields.  So we
 	 * shouldn't need to worry about iov[] being too big.  This is different
 	 * than the receive case, where the guest should give us an MTU-sized iov.
@@ -1293,20 +1326,22 @@ static size_t __poll_injection(struct iovec *iov, int iovcnt)
 }
 
 static void handle_udp_rx(struct iovec *iov, int iovcnt, size_t len,
-                          struct ip_nat_map *map, size_t udp_off)
+                          struct ip_nat_map *map, size_t udp_off,
+                          struct xsum_fixup *fix)
 {
 	assert(len >= udp_off + UDP_HDR_LEN);
-	xsum_changed_port(iov, iovcnt, udp_off + UDP_OFF_XSUM,
+	xsum_changed_port(fix,
 	                  iov_get_be16(iov, iovcnt, udp_off + UDP_OFF_DST_PORT),
 	                  map->guest_port);
 	iov_put_be16(iov, iovcnt, udp_off + UDP_OFF_DST_PORT, map->guest_port);
 }
 
 static void handle_tcp_rx(struct iovec *iov, int iovcnt, size_t len,
-                          struct ip_nat_map *map, size_t tcp_off)
+                          struct ip_nat_map *map, size_t tcp_off,
+                          struct xsum_fixup *fix)
 {
 	assert(len >= tcp_off + TCP_HDR_LEN);
-	xsum_changed_port(iov, iovcnt, tcp_off + TCP_OFF_XSUM,
+	xsum_changed_port(fix,
 	                  iov_get_be16(iov, iovcnt, tcp_off + TCP_OFF_DST_PORT),
 	                  map->guest_port);
 	iov_put_be16(iov, iovcnt, tcp_off + TCP_OFF_DST_PORT, map->guest_port);
@@ -1330,6 +1365,7 @@ static void handle_ipv4_rx(struct iovec *iov, int iovcnt, size_t len,
 	size_t ip_off = ETH_HDR_LEN;
 	uint8_t protocol;
 	size_t proto_hdr_off;
+	struct xsum_fixup fix = {0};
 	uint8_t src_addr[IPV4_ADDR_LEN];
 	uint8_t dst_addr[IPV4_ADDR_LEN];
 
@@ -1337,10 +1373,10 @@ static void handle_ipv4_rx(struct iovec *iov, int iovcnt, size_t len,
 	proto_hdr_off = ipv4_get_proto_off(iov, iovcnt, ip_off);
 	switch (map->protocol) {
 	case IP_UDPPROTO:
-		handle_udp_rx(iov, iovcnt, len, map, proto_hdr_off);
+		handle_udp_rx(iov, iovcnt, len, map, proto_hdr_off, &fix);
 		break;
 	case IP_TCPPROTO:
-		handle_tcp_rx(iov, iovcnt, len, map, proto_hdr_off);
+		handle_tcp_rx(iov, iovcnt, len, map, proto_hdr_off, &fix);
 		break;
 	default:
 		panic("Bad proto %d on map for conv FD %d\n", map->protocol,
@@ -1353,8 +1389,8 @@ static void handle_ipv4_rx(struct iovec *iov, int iovcnt, size_t len,
 	/* If the src was the host (loopback), the guest thinks the remote is
 	 * ROUTER_IP. */
 	if (!memcmp(src_addr, loopback_v4_addr, IPV4_ADDR_LEN)) {
-		ipv4_change_addr(iov, iovcnt, ip_off, map->protocol, proto_hdr_off,
-		                 src_addr, guest_v4_router, IPV4_OFF_SRC);
+		ipv4_change_addr(iov, iovcnt, ip_off, &fix, src_addr,
+		                 guest_v4_router, IPV4_OFF_SRC);
 	}
 	/* Interesting case.  If we rewrite it to guest_v4_router, when the guest
 	 * responds, *that* packet will get rewritten to loopback.  If we ignore it,
@@ -1364,8 +1400,9 @@ static void handle_ipv4_rx(struct iovec *iov, int iovcnt, size_t len,
 		fprintf(stderr, "VNET received packet from host_v4_addr.  Not translating, the guest cannot respond!\n");
 	}
 	/* Regardless, the dst changes from HOST_IP/loopback to GUEST_IP */
-	ipv4_change_addr(iov, iovcnt, ip_off, map->protocol, proto_hdr_off,
-	                 dst_addr, guest_v4_addr, IPV4_OFF_DST);
+	ipv4_change_addr(iov, iovcnt, ip_off, &fix, dst_addr, guest_v4_addr,
+	                 IPV4_OFF_DST);
+	ipv4_apply_fixup(iov, iovcnt, ip_off, map->protocol, proto_hdr_off, &fix);
 	/* Note we did the incremental xsum for the IP header, but also do a final
 	 * xsum.  We need the final xsum in case the kernel's networking stack
 	 * messed up the header. */
@@ -1414,18 +1451,21 @@ static size_t handle_rx(struct iovec *iov, int iovcnt, size_t len,
  * success and returning the amount.  0 means 'nothing there.'
  *
  * Notes on concurrency:
- * - The inbound_todo list is protected by the rx_mtx.  Since we're readv()ing
- *   while holding the mtx (because we're in a FOREACH), we're single threaded
- *   in the RX path.
+ * - The inbound_todo list is protected by the rx_mtx.  We pull the map off the
+ *   list and readv() without the mtx, so multiple RX threads can read from
+ *   different convs at once.  The map stays 'is_on_inbound' while it's off the
+ *   list, and we hold its ref.  The caller needs to recheck its invariants if
+ *   we set *unlocked.
  * - The inbound_todo list is filled by another thread that puts maps on the
  *   list whenever their FD tap fires.
  * - The maps on the inbound_todo list are refcounted.  It's possible for them
  *   to be reaped and removed from the mapping lookup, but the mapping would
  *   stay around until we drained all of the packets from the inbound conv. */
-static size_t __poll_inbound(struct iovec *iov, int iovcnt)
+static size_t __poll_inbound(struct iovec *iov, int iovcnt, bool *unlocked)
 {
-	struct ip_nat_map *i, *temp;
+	struct ip_nat_map *map;
 	ssize_t pkt_sz = 0;
+	int err;
 	struct iovec iov_copy[iovcnt];
 
 	/* We're going to readv ETH_HDR_LEN bytes into the iov.  To do so, we'll use
@@ -1433,38 +1473,73 @@ static size_t __poll_inbound(struct iovec *iov, int iovcnt)
 	 * the same memory (minus the stripping). */
 	memcpy(iov_copy, iov, sizeof(struct iovec) * iovcnt);
 	iov_strip_bytes(iov_copy, iovcnt, ETH_HDR_LEN);
-	TAILQ_FOREACH_SAFE(i, &inbound_todo, inbound, temp) {
-		pkt_sz = readv(i->host_data_fd, iov_copy, iovcnt);
-		if (pkt_sz > 0) {
-			i->is_stale = FALSE;
-			return handle_rx(iov, iovcnt, pkt_sz + ETH_HDR_LEN, i);
-		}
-		parlib_assert_perror(errno == EAGAIN);
-		TAILQ_REMOVE(&inbound_todo, i, inbound);
-		i->is_on_inbound = FALSE;
-		kref_put(&i->kref);
+	map = TAILQ_FIRST(&inbound_todo);
+	if (!map)
+		return 0;
+	/* It stays "on inbound", so the watcher won't add it back. */
+	TAILQ_REMOVE(&inbound_todo, map, inbound);
+	map->rx_pending = FALSE;
+	*unlocked = TRUE;
+	uth_mutex_unlock(rx_mtx);
+	pkt_sz = readv(map->host_data_fd, iov_copy, iovcnt);
+	err = errno;
+	uth_mutex_lock(rx_mtx);
+	if (pkt_sz > 0 || map->rx_pending) {
+		/* Might have more; at the tail, so other convs get a turn */
+		TAILQ_INSERT_TAIL(&inbound_todo, map, inbound);
+		/* Other RX threads might have gone to sleep while it was gone */
+		uth_cond_var_signal(rx_cv);
+		if (pkt_sz <= 0)
+			return 0;
+		map->is_stale = FALSE;
+		return handle_rx(iov, iovcnt, pkt_sz + ETH_HDR_LEN, map);
 	}
+	errno = err;
+	parlib_assert_perror(errno == EAGAIN);
+	map->is_on_inbound = FALSE;
+	kref_put(&map->kref);
 	return 0;
 }
 
-/* virtio-net calls this when it wants us to fill iov with a packet. */
-int vnet_receive_packet(struct iovec *iov, int iovcnt)
+static int __vnet_receive_packet(struct iovec *iov, int iovcnt, bool can_block)
 {
 	size_t rx_amt;
+	bool unlocked;
 
 	uth_mutex_lock(rx_mtx);
 	while (1) {
 		rx_amt = __poll_injection(iov, iovcnt);
 		if (rx_amt)
 			break;
-		rx_amt = __poll_inbound(iov, iovcnt);
+		unlocked = FALSE;
+		rx_amt = __poll_inbound(iov, iovcnt, &unlocked);
 		if (rx_amt)
 			break;
+		/* If we dropped the lock, anything could have shown up */
+		if (unlocked)
+			continue;
+		if (!can_block)
+			break;
 		uth_cond_var_wait(rx_cv, rx_mtx);
 	}
 	uth_mutex_unlock(rx_mtx);
+	if (!rx_amt)
+		return 0;
 	iov_trim_len_to(iov, iovcnt, rx_amt);
 	if (vnet_snoop)
 		writev(snoop_fd, iov, iovcnt);
 	return rx_amt;
 }
+
+/* virtio-net calls this when it wants us to fill iov with a packet. */
+int vnet_receive_packet(struct iovec *iov, int iovcnt)
+{
+	return __vnet_receive_packet(iov, iovcnt, TRUE);
+}
+
+/* Like vnet_receive_packet(), but returns 0 instead of blocking.  virtio-net
+ * uses this to fill several buffers before interrupting the guest. */
+int vnet_try_receive_packet(struct iovec *iov, int iovcnt)
+{
+	return __vnet_receive_packet(iov, iovcnt, FALSE);
+}
@@ -7,6 +7,7 @@
 #include <vmm/sched.h>
 #include <vmm/vmm.h>
 #include <vmm/vthread.h>
+#include <vmm/virtio_mmio.h>
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -17,8 +18,10 @@
 #include <parlib/ros_debug.h>
 #include <parlib/vcore_tick.h>
 #include <parlib/slab.h>
+#include <parlib/tsc-compat.h>
 
 int vmm_sched_period_usec = 1000;
+int vmm_sched_nr_housekeeping = 1;
 
 /* For now, we only have one VM managed by the 2LS.  If we ever expand that,
  * we'll need something analogous to current_uthread, so the 2LS knows which VM
@@ -36,6 +39,8 @@ static atomic_t nr_unblk_guests;
 /* Global evq for all syscalls.  Could make this per vcore or whatever. */
 static struct event_queue *sysc_evq;
 static struct kmem_cache *task_thread_cache;
+/* Greedy mode: round-robin for waking housekeeping vcores */
+static atomic_t hk_wake_idx;
 
 static void vmm_sched_init(void);
 static void vmm_sched_entry(void);
@@ -80,11 +85,23 @@ static bool sched_is_greedy(void)
 	return parlib_never_yield;
 }
 
+/* In greedy mode, vcores [0, nr_housekeeping) run tasks, and the rest are
+ * dedicated to one guest pcore (and its controller) each. */
 static unsigned int sched_nr_greedy_cores(void)
 {
 	if (!current_vm)
-		return 1;
-	return current_vm->nr_gpcs + 1;
+		return vmm_sched_nr_housekeeping;
+	return current_vm->nr_gpcs + vmm_sched_nr_housekeeping;
+}
+
+static bool vcore_is_housekeeping(uint32_t vcoreid)
+{
+	return vcoreid < vmm_sched_nr_housekeeping;
+}
+
+static int vcore_to_gpcid(uint32_t vcoreid)
+{
+	return vcoreid - vmm_sched_nr_housekeeping;
 }
 
 static void restart_thread(struct syscall *sysc)
@@ -235,8 +252,36 @@ static bool try_to_get_vcores(void)
 	return FALSE;
 }
 
+/* Called whenever a guest stops running, for any reason.  If it is already off
+ * core, we keep the older stamp. */
+static void stats_guest_off_core(struct guest_thread *gth, bool vmexit)
+{
+	if (gth->off_core_tsc)
+		return;
+	gth->off_core_tsc = read_tsc();
+	gth->in_vmexit = vmexit;
+}
+
+static void stats_guest_on_core(struct guest_thread *gth)
+{
+	uint64_t delta;
+
+	if (!gth->off_core_tsc)
+		return;
+	delta = read_tsc() - gth->off_core_tsc;
+	gth->off_core_tsc = 0;
+	if (gth->in_vmexit) {
+		gth->exit_ticks += delta;
+		gth->max_exit_ticks = MAX(gth->max_exit_ticks, delta);
+	} else {
+		gth->steal_ticks += delta;
+	}
+}
+
 static void stats_run_vth(struct vmm_thread *vth)
 {
+	if (vth->type == VMM_THREAD_GUEST)
+		stats_guest_on_core((struct guest_thread*)vth);
 	vth->nr_runs++;
 	if (vth->prev_vcoreid != vcore_id()) {
 		vth->prev_vcoreid = vcore_id();
@@ -253,7 +298,7 @@ static struct vmm_thread *sched_pick_thread_greedy(void)
 		stats_run_vth((struct vmm_thread*)current_uthread);
 		run_current_uthread();
 	}
-	if (vcore_id() == 0) {
+	if (vcore_is_housekeeping(vcore_id())) {
 		spin_pdr_lock(&queue_lock);
 		vth = __pop_first(&rnbl_tasks);
 		spin_pdr_unlock(&queue_lock);
@@ -265,10 +310,10 @@ static struct vmm_thread *sched_pick_thread_greedy(void)
 	 * - cleared when we run it (race free, we're the only runners)
 	 * - if we take an interrupt, we'll just run_current_uthread and not check
 	 * - if we vmexit, we'll run the buddy directly */
-	assert(vcore_id() <= current_vm->nr_gpcs);
-	vth = greedy_rnbl_guests[vcore_id() - 1];
+	assert(vcore_to_gpcid(vcore_id()) < current_vm->nr_gpcs);
+	vth = greedy_rnbl_guests[vcore_to_gpcid(vcore_id())];
 	if (vth)
-		greedy_rnbl_guests[vcore_id() - 1] = NULL;
+		greedy_rnbl_guests[vcore_to_gpcid(vcore_id())] = NULL;
 	return vth;
 }
 
@@ -297,13 +342,18 @@ static void __attribute__((noreturn)) vmm_sched_entry(void)
 {
 	struct vmm_thread *vth;
 
+	/* If we interrupted a guest, e.g. for an event, it is off core until we
+	 * run it again.  That's steal time. */
+	if (current_uthread &&
+	    ((struct vmm_thread*)current_uthread)->type == VMM_THREAD_GUEST)
+		stats_guest_off_core((struct guest_thread*)current_uthread, FALSE);
 	if (sched_is_greedy()) {
 		vth = sched_pick_thread_greedy();
 		if (!vth) {
 			/* sys_halt_core will return, but we need to restart the vcore.  We
 			 * might have woke due to an event, and we'll need to handle_events
 			 * and other things dealt with by uthreads. */
-			if (vcore_id() == 0)
+			if (vcore_is_housekeeping(vcore_id()))
 				sys_halt_core(0);
 			/* In greedy mode, yield will abort and we'll just restart */
 			vcore_yield_or_restart();
@@ -330,6 +380,8 @@ static void vmm_thread_paused(struct uthread *uth)
 	/* The thread stopped for some reason, usually a preemption.  We'd like to
 	 * just run it whenever we get a chance.  Note that it didn't become
 	 * 'blocked' - it's still runnable. */
+	if (((struct vmm_thread*)uth)->type == VMM_THREAD_GUEST)
+		stats_guest_off_core((struct guest_thread*)uth, FALSE);
 	enqueue_vmm_thread((struct vmm_thread*)uth);
 }
 
@@ -439,6 +491,7 @@ static void vmm_thread_refl_vm_fault(struct uthread *uth)
 	struct ctlr_thread *cth = gth->buddy;
 
 	gth->nr_vmexits++;
+	stats_guest_off_core(gth, TRUE);
 	/* The ctlr starts frm the top every time we get a new fault. */
 	cth->uthread.flags |= UTHREAD_SAVED;
 	init_user_ctx(&cth->uthread.u_ctx, (uintptr_t)&__ctlr_entry,
@@ -566,6 +619,7 @@ static void ev_handle_diag(struct event_msg *ev_msg, unsigned int ev_type,
 	struct virtual_machine *vm = current_vm;
 	struct guest_thread *gth;
 	struct ctlr_thread *cth;
+	struct virtio_mmio_dev *mmio_dev;
 	bool reset = FALSE;
 
 	if (ev_msg && (ev_msg->ev_arg1 == 1))
@@ -581,15 +635,34 @@ static void ev_handle_diag(struct event_msg *ev_msg, unsigned int ev_type,
 		        ((struct vmm_thread*)gth)->nr_runs,
 		        ((struct vmm_thread*)cth)->nr_runs,
 		        gth->nr_vmexits);
+		fprintf(stderr, "\t        %llu usec in vmexits (max %llu usec), %llu usec steal\n",
+		        tsc2usec(gth->exit_ticks), tsc2usec(gth->max_exit_ticks),
+		        tsc2usec(gth->steal_ticks));
 		if (reset) {
 		    ((struct vmm_thread*)gth)->nr_resched = 0;
 		    ((struct vmm_thread*)gth)->nr_runs = 0;
 		    ((struct vmm_thread*)cth)->nr_runs = 0;
 		    gth->nr_vmexits = 0;
+		    gth->exit_ticks = 0;
+		    gth->max_exit_ticks = 0;
+		    gth->steal_ticks = 0;
 		}
 	}
 	fprintf(stderr, "\n\tNr unblocked gpc %lu, Nr unblocked tasks %lu\n",
 	        atomic_read(&nr_unblk_guests), atomic_read(&nr_unblk_tasks));
+	fprintf(stderr, "\nVIRTIO IRQs:\n---------------\n");
+	for (int i = 0; i < VIRTIO_MMIO_MAX_NUM_DEV; i++) {
+		mmio_dev = vm->virtio_mmio_devices[i];
+		if (!mmio_dev)
+			continue;
+		fprintf(stderr, "\t%-8s: %lu injected, %lu suppressed\n",
+		        mmio_dev->vqdev->name, mmio_dev->nr_irqs_injected,
+		        mmio_dev->nr_irqs_suppressed);
+		if (reset) {
+			mmio_dev->nr_irqs_injected = 0;
+			mmio_dev->nr_irqs_suppressed = 0;
+		}
+	}
 }
 
 int vmm_init(struct virtual_machine *vm, struct vmm_gpcore_init *gpcis,
@@ -632,6 +705,8 @@ int vmm_init(struct virtual_machine *vm, struct vmm_gpcore_init *gpcis,
 	uthread_mcp_init();
 	register_ev_handler(EV_FREE_APPLE_PIE, ev_handle_diag, NULL);
 	if (sched_is_greedy()) {
+		if (vmm_sched_nr_housekeeping < 1)
+			return -1;
 		greedy_rnbl_guests = calloc(vm->nr_gpcs, sizeof(struct vmm_thread *));
 		assert(greedy_rnbl_guests);
 		vcore_request_total(sched_nr_greedy_cores());
@@ -749,6 +824,8 @@ static void greedy_mark_guest_runnable(struct vmm_thread *vth)
 
 static void enqueue_vmm_thread(struct vmm_thread *vth)
 {
+	unsigned long hk_vcoreid;
+
 	switch (vth->type) {
 	case VMM_THREAD_GUEST:
 	case VMM_THREAD_CTLR:
@@ -764,8 +841,11 @@ static void enqueue_vmm_thread(struct vmm_thread *vth)
 		spin_pdr_lock(&queue_lock);
 		TAILQ_INSERT_TAIL(&rnbl_tasks, vth, tq_next);
 		spin_pdr_unlock(&queue_lock);
-		if (sched_is_greedy())
-			vcore_wake(0, false);
+		/* The guests' vcores never run tasks, so poke a housekeeper. */
+		if (sched_is_greedy()) {
+			hk_vcoreid = atomic_fetch_and_add(&hk_wake_idx, 1);
+			vcore_wake(hk_vcoreid % vmm_sched_nr_housekeeping, false);
+		}
 		break;
 	default:
 		panic("Bad vmm_thread type %p\n", vth->type);
@@ -0,0 +1,586 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Incremental snapshots of guest memory, and whole VM images (below).
+ *
+ * Each save writes the pages that were dirtied since the last save, which the
+ * kernel tracks for us with the EPT's dirty bits (VMM_CTL_HARVEST_AD).  The
+ * first save is relative to the zeroed memory mmap_memory() gave us, so pages
+ * the guest never wrote are never written out.  Appending saves to the same
+ * file gives a chain; restoring replays the whole chain in order.
+ *
+ * A save of a running guest is fuzzy: the guest can write pages while we copy
+ * them.  Those pages show up in the next save.  For a consistent snapshot, stop
+ * the guest pcores first.  This is only memory; CPU and device state are up to
+ * the caller.
+ *
+ * The file is a series of records: a header, then nr_pages of page data for
+ * the guest memory at gpa.  A record with nr_pages == 0 ends a save. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <vmm/vmm.h>
+#include <vmm/virtio_mmio.h>
+#include <parlib/bitmask.h>
+#include <parlib/parlib.h>
+#include <parlib/uthread.h>
+
+#define SNAP_MAGIC			0x70616e73756d6d76ULL	/* 'vmmusnap' */
+
+struct snap_rec {
+	uint64_t					magic;
+	uint64_t					gpa;
+	uint64_t					nr_pages;
+};
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Returns 0 on success, 1 on EOF before anything was read, -1 on error. */
+static int read_all(int fd, void *buf, size_t len)
+{
+	size_t amt = 0;
+	ssize_t ret;
+
+	while (amt < len) {
+		ret = read(fd, buf + amt, len - amt);
+		if (ret < 0)
+			return -1;
+		if (!ret) {
+			if (!amt)
+				return 1;
+			errno = EIO;
+			return -1;
+		}
+		amt += ret;
+	}
+	return 0;
+}
+
+static int write_rec(int fd, uintptr_t gpa, size_t nr_pages)
+{
+	struct snap_rec rec = {SNAP_MAGIC, gpa, nr_pages};
+
+	if (write_all(fd, &rec, sizeof(rec)))
+		return -1;
+	return write_all(fd, (void*)gpa, nr_pages * PGSIZE);
+}
+
+/* Writes the pages in [start, start + len) whose bits are set, merging runs of
+ * pages into one record. */
+static ssize_t save_range(int fd, uintptr_t start, size_t len, uint8_t *bitmap)
+{
+	size_t nr_pgs = len >> PGSHIFT;
+	size_t run = 0, total = 0;
+
+	for (size_t i = 0; i <= nr_pgs; i++) {
+		if (i < nr_pgs && GET_BITMASK_BIT(bitmap, i)) {
+			run++;
+			continue;
+		}
+		if (!run)
+			continue;
+		if (write_rec(fd, start + ((i - run) << PGSHIFT), run))
+			return -1;
+		total += run;
+		run = 0;
+	}
+	return total;
+}
+
+/* Appends the pages the guest (or we) dirtied since the last save to fd.
+ * Returns how many pages we wrote, or -1 on error. */
+ssize_t vmm_snapshot_save(struct virtual_machine *vm, int fd)
+{
+	uintptr_t starts[2];
+	size_t lens[2];
+	int nr_ranges = guest_ram_ranges(vm, starts, lens);
+	uint8_t *bitmap;
+	ssize_t ret, total = 0;
+	struct snap_rec end = {SNAP_MAGIC, 0, 0};
+
+	for (int i = 0; i < nr_ranges; i++) {
+		bitmap = calloc(1, BYTES_FOR_BITMASK(lens[i] >> PGSHIFT));
+		if (!bitmap)
+			return -1;
+		ret = vmm_harvest_ad(starts[i], lens[i], bitmap, VMM_HARVEST_DIRTY);
+		if (ret > 0)
+			ret = save_range(fd, starts[i], lens[i], bitmap);
+		free(bitmap);
+		if (ret < 0)
+			return -1;
+		total += ret;
+	}
+	if (write_all(fd, &end, sizeof(end)))
+		return -1;
+	return total;
+}
+
+static bool gpa_is_ram(struct virtual_machine *vm, uintptr_t gpa, size_t len)
+{
+	uintptr_t starts[2];
+	size_t lens[2];
+	int nr_ranges = guest_ram_ranges(vm, starts, lens);
+
+	for (int i = 0; i < nr_ranges; i++) {
+		if (gpa >= starts[i] && len <= lens[i] &&
+		    gpa - starts[i] <= lens[i] - len)
+			return true;
+	}
+	return false;
+}
+
+/* Replays every save in fd into guest memory, which must already be mapped,
+ * and returns how many pages we read, or -1 on error.  Afterwards, the next
+ * save only has what changed after the restore. */
+ssize_t vmm_snapshot_restore(struct virtual_machine *vm, int fd)
+{
+	struct snap_rec rec;
+	uintptr_t starts[2];
+	size_t lens[2];
+	int nr_ranges;
+	uint8_t *bitmap;
+	ssize_t total = 0;
+	int ret;
+
+	while (1) {
+		ret = read_all(fd, &rec, sizeof(rec));
+		if (ret == 1)
+			break;
+		if (ret)
+			return -1;
+		if (rec.magic != SNAP_MAGIC || PGOFF(rec.gpa) ||
+		    rec.nr_pages > SIZE_MAX >> PGSHIFT) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (!rec.nr_pages)
+			continue;
+		if (!gpa_is_ram(vm, rec.gpa, rec.nr_pages << PGSHIFT)) {
+			errno = EINVAL;
+			return -1;
+		}
+		ret = read_all(fd, (void*)rec.gpa, rec.nr_pages << PGSHIFT);
+		if (ret) {
+			if (ret == 1)
+				errno = EIO;
+			return -1;
+		}
+		total += rec.nr_pages;
+	}
+	/* We just dirtied everything we restored */
+	nr_ranges = guest_ram_ranges(vm, starts, lens);
+	for (int i = 0; i < nr_ranges; i++) {
+		bitmap = calloc(1, BYTES_FOR_BITMASK(lens[i] >> PGSHIFT));
+		if (!bitmap)
+			return -1;
+		vmm_harvest_ad(starts[i], lens[i], bitmap, VMM_HARVEST_DIRTY);
+		free(bitmap);
+	}
+	return total;
+}
+
+/* VM images: everything we need to start a guest where another one left off,
+ * without booting it.
+ *
+ * The image is a header page, then guest memory, then the state of the guest
+ * pcores and devices.  Restoring maps guest memory from the image with
+ * MAP_PRIVATE, so it's copy-on-write: we only read in the pages the guest
+ * touches, and guests restored from the same image share the pages they don't
+ * write.
+ *
+ * We save an image when the guest asks for it with VMCALL_SNAPSHOT, e.g.
+ * once it's warmed up and ready to serve.  That gpc is stopped in its vmcall,
+ * and the others would not be, so we only do this for guests with one gpc.
+ * The devices are not stopped either: the guest should quiesce its I/O first.
+ *
+ * A restored guest needs the same devices as the saved one, i.e. the same
+ * vmrunkernel command line.  The device backends are not in the image: the
+ * NAT forgets its connections, and the block devices' files should be the
+ * way they were when the image was saved. */
+
+#define VMIMAGE_MAGIC		0x6567616d696d6d76ULL	/* 'vmmimage' */
+/* The low 1 MB, for the BIOS tables, and up to two ranges of guest RAM */
+#define VMIMAGE_MAX_RANGES	3
+
+struct vmimage_range {
+	uint64_t					gpa;
+	uint64_t					len;
+	uint64_t					off;
+};
+
+struct vmimage_hdr {
+	uint64_t					magic;
+	uint64_t					minphys;
+	uint64_t					maxphys;
+	uint64_t					state_off;
+	uint32_t					nr_gpcs;
+	uint32_t					nr_ranges;
+	uint32_t					nr_devs;
+	uint32_t					ioapic_sz;
+	struct vmimage_range		ranges[VMIMAGE_MAX_RANGES];
+};
+
+struct vmimage_vq {
+	uint64_t					desc;
+	uint64_t					avail;
+	uint64_t					used;
+	uint32_t					num;
+	uint32_t					qready;
+	uint16_t					last_used_irq;
+	uint16_t					padding[3];
+};
+
+/* Followed by num_vqs vmimage_vqs and cfg_sz bytes of config space */
+struct vmimage_dev {
+	uint32_t					idx;
+	uint32_t					dev_id;
+	uint64_t					addr;
+	uint64_t					irq;
+	uint64_t					dri_feat;
+	uint32_t					dev_feat_sel;
+	uint32_t					dri_feat_sel;
+	uint32_t					qsel;
+	uint32_t					isr;
+	uint32_t					cfg_gen;
+	uint32_t					dest;
+	uint8_t						status;
+	uint8_t						vec;
+	uint8_t						padding[2];
+	uint32_t					num_vqs;
+	uint64_t					cfg_sz;
+};
+
+static int vmimage_fmt_err(const char *msg)
+{
+	errno = EINVAL;
+	werrstr("Bad VM image: %s", msg);
+	return -1;
+}
+
+static void vmimage_fill_hdr(struct virtual_machine *vm,
+                             struct vmimage_hdr *hdr)
+{
+	uintptr_t starts[2];
+	size_t lens[2], ioapic_sz;
+	int nr_ranges = guest_ram_ranges(vm, starts, lens);
+	uint64_t off = PGSIZE;
+
+	hdr->magic = VMIMAGE_MAGIC;
+	hdr->minphys = vm->minphys;
+	hdr->maxphys = vm->maxphys;
+	hdr->nr_gpcs = vm->nr_gpcs;
+	/* setup_biostables() maps [PGSIZE, MiB) */
+	hdr->ranges[0].gpa = PGSIZE;
+	hdr->ranges[0].len = MiB - PGSIZE;
+	hdr->nr_ranges = 1;
+	for (int i = 0; i < nr_ranges; i++) {
+		hdr->ranges[hdr->nr_ranges].gpa = starts[i];
+		hdr->ranges[hdr->nr_ranges].len = lens[i];
+		hdr->nr_ranges++;
+	}
+	for (int i = 0; i < hdr->nr_ranges; i++) {
+		hdr->ranges[i].off = off;
+		off += hdr->ranges[i].len;
+	}
+	hdr->state_off = off;
+	for (int i = 0; i < VIRTIO_MMIO_MAX_NUM_DEV; i++) {
+		if (vm->virtio_mmio_devices[i])
+			hdr->nr_devs++;
+	}
+	ioapic_state(&ioapic_sz);
+	hdr->ioapic_sz = ioapic_sz;
+}
+
+static int save_gpc(int fd, struct guest_thread *gth)
+{
+	struct vmm_gpcore_init *gpci = gth_to_gpci(gth);
+	struct vmm_gpc_state st;
+	uint64_t fp_saved = !!(gth->uthread.flags & UTHREAD_FPSAVED);
+
+	if (syscall(SYS_vmm_ctl, VMM_CTL_GET_GPC_STATE, gth->gpc_id, &st))
+		return -1;
+	if (write_all(fd, gth_to_vmtf(gth), sizeof(struct vm_trapframe)) ||
+	    write_all(fd, &st, sizeof(st)) ||
+	    write_all(fd, &fp_saved, sizeof(fp_saved)) ||
+	    write_all(fd, &gth->uthread.as, sizeof(struct ancillary_state)) ||
+	    write_all(fd, gpci->vapic_addr, PGSIZE) ||
+	    write_all(fd, gpci->posted_irq_desc, PGSIZE))
+		return -1;
+	return 0;
+}
+
+static int save_dev(int fd, int idx, struct virtio_mmio_dev *mmio_dev)
+{
+	struct virtio_vq_dev *vqdev = mmio_dev->vqdev;
+	struct vmimage_dev rec = {
+		.idx = idx,
+		.dev_id = vqdev->dev_id,
+		.addr = mmio_dev->addr,
+		.irq = mmio_dev->irq,
+		.dri_feat = vqdev->dri_feat,
+		.dev_feat_sel = mmio_dev->dev_feat_sel,
+		.dri_feat_sel = mmio_dev->dri_feat_sel,
+		.qsel = mmio_dev->qsel,
+		.isr = mmio_dev->isr,
+		.cfg_gen = mmio_dev->cfg_gen,
+		.dest = mmio_dev->dest,
+		.status = mmio_dev->status,
+		.vec = mmio_dev->vec,
+		.num_vqs = vqdev->num_vqs,
+		.cfg_sz = vqdev->cfg ? vqdev->cfg_sz : 0,
+	};
+	struct vmimage_vq vq_rec = {0};
+	struct virtio_vq *vq;
+
+	if (write_all(fd, &rec, sizeof(rec)))
+		return -1;
+	for (int i = 0; i < vqdev->num_vqs; i++) {
+		vq = &vqdev->vqs[i];
+		vq_rec.desc = (uintptr_t)vq->vring.desc;
+		vq_rec.avail = (uintptr_t)vq->vring.avail;
+		vq_rec.used = (uintptr_t)vq->vring.used;
+		vq_rec.num = vq->vring.num;
+		vq_rec.qready = vq->qready;
+		vq_rec.last_used_irq = vq->last_used_irq;
+		if (write_all(fd, &vq_rec, sizeof(vq_rec)))
+			return -1;
+	}
+	return write_all(fd, vqdev->cfg, rec.cfg_sz);
+}
+
+/* Saves an image of vm to path.  The gpcs must be stopped, e.g. in a vmexit
+ * handler.  Whatever is in their vm_trapframes is where the restored guest
+ * starts.  Returns 0 on success, -1 with errno set o/w. */
+int vmm_image_save(struct virtual_machine *vm, const char *path)
+{
+	struct vmimage_hdr *hdr;
+	struct vmimage_range *range;
+	void *ioapic;
+	size_t ioapic_sz;
+	int fd, ret = -1;
+
+	if (vm->nr_gpcs != 1) {
+		errno = EINVAL;
+		werrstr("VM images need a guest with one gpc, had %d", vm->nr_gpcs);
+		return -1;
+	}
+	/* Rest of the page is zero, so the header is a whole page */
+	hdr = calloc(1, PGSIZE);
+	if (!hdr)
+		return -1;
+	vmimage_fill_hdr(vm, hdr);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out_hdr;
+	if (write_all(fd, hdr, PGSIZE))
+		goto out_fd;
+	for (int i = 0; i < hdr->nr_ranges; i++) {
+		range = &hdr->ranges[i];
+		if (write_all(fd, (void*)range->gpa, range->len))
+			goto out_fd;
+	}
+	for (int i = 0; i < vm->nr_gpcs; i++) {
+		if (save_gpc(fd, gpcid_to_gth(vm, i)))
+			goto out_fd;
+	}
+	ioapic = ioapic_state(&ioapic_sz);
+	if (write_all(fd, ioapic, ioapic_sz))
+		goto out_fd;
+	for (int i = 0; i < VIRTIO_MMIO_MAX_NUM_DEV; i++) {
+		if (!vm->virtio_mmio_devices[i])
+			continue;
+		if (save_dev(fd, i, vm->virtio_mmio_devices[i]))
+			goto out_fd;
+	}
+	ret = 0;
+out_fd:
+	close(fd);
+out_hdr:
+	free(hdr);
+	return ret;
+}
+
+static int read_hdr(int fd, struct vmimage_hdr *hdr)
+{
+	struct vmimage_range *range;
+	uint64_t off = PGSIZE;
+
+	if (read_all(fd, hdr, sizeof(*hdr)))
+		return vmimage_fmt_err("short header");
+	if (hdr->magic != VMIMAGE_MAGIC)
+		return vmimage_fmt_err("bad magic");
+	if (hdr->nr_ranges > VMIMAGE_MAX_RANGES)
+		return vmimage_fmt_err("too many memory ranges");
+	for (int i = 0; i < hdr->nr_ranges; i++) {
+		range = &hdr->ranges[i];
+		if (PGOFF(range->gpa) || PGOFF(range->len) || range->off != off)
+			return vmimage_fmt_err("bad memory range");
+		off += range->len;
+	}
+	if (hdr->state_off != off)
+		return vmimage_fmt_err("bad state offset");
+	return 0;
+}
+
+/* Maps guest memory from the image at path, instead of mmap_memory().  Returns
+ * 0 on success, -1 with errno set o/w. */
+int vmm_image_map(struct virtual_machine *vm, const char *path)
+{
+	struct vmimage_hdr hdr;
+	struct vmimage_range *range;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = read_hdr(fd, &hdr);
+	close(fd);
+	if (ret)
+		return -1;
+	for (int i = 0; i < hdr.nr_ranges; i++) {
+		range = &hdr.ranges[i];
+		if (!mmap_file(path, range->gpa, range->len,
+		               PROT_READ | PROT_WRITE | PROT_EXEC, range->off)) {
+			errno = ENOMEM;
+			werrstr("Could not map guest memory at %p", range->gpa);
+			return -1;
+		}
+	}
+	vm->minphys = hdr.minphys;
+	vm->maxphys = hdr.maxphys;
+	return 0;
+}
+
+static int restore_gpc(int fd, struct guest_thread *gth)
+{
+	struct vmm_gpcore_init *gpci = gth_to_gpci(gth);
+	struct vm_trapframe vm_tf;
+	struct vmm_gpc_state st;
+	uint64_t fp_saved;
+
+	if (read_all(fd, &vm_tf, sizeof(vm_tf)) ||
+	    read_all(fd, &st, sizeof(st)) ||
+	    read_all(fd, &fp_saved, sizeof(fp_saved)))
+		return vmimage_fmt_err("short gpc state");
+	if (vm_tf.tf_guest_pcoreid != gth->gpc_id)
+		return vmimage_fmt_err("gpcs out of order");
+	if (syscall(SYS_vmm_ctl, VMM_CTL_SET_GPC_STATE, gth->gpc_id, &st))
+		return -1;
+	*gth_to_vmtf(gth) = vm_tf;
+	if (read_all(fd, &gth->uthread.as, sizeof(struct ancillary_state)) ||
+	    read_all(fd, gpci->vapic_addr, PGSIZE) ||
+	    read_all(fd, gpci->posted_irq_desc, PGSIZE))
+		return vmimage_fmt_err("short gpc state");
+	if (fp_saved)
+		gth->uthread.flags |= UTHREAD_FPSAVED;
+	return 0;
+}
+
+static int restore_dev(struct virtual_machine *vm, int fd)
+{
+	struct vmimage_dev rec;
+	struct vmimage_vq vq_rec;
+	struct virtio_mmio_dev *mmio_dev;
+	struct virtio_vq_dev *vqdev;
+	struct virtio_vq *vq;
+
+	if (read_all(fd, &rec, sizeof(rec)))
+		return vmimage_fmt_err("short device state");
+	if (rec.idx >= VIRTIO_MMIO_MAX_NUM_DEV ||
+	    !vm->virtio_mmio_devices[rec.idx])
+		return vmimage_fmt_err("the guest had a device we don't");
+	mmio_dev = vm->virtio_mmio_devices[rec.idx];
+	vqdev = mmio_dev->vqdev;
+	if (rec.dev_id != vqdev->dev_id || rec.addr != mmio_dev->addr ||
+	    rec.num_vqs != vqdev->num_vqs ||
+	    rec.cfg_sz != (vqdev->cfg ? vqdev->cfg_sz : 0))
+		return vmimage_fmt_err("the guest's device differs from ours");
+	mmio_dev->irq = rec.irq;
+	vqdev->dri_feat = rec.dri_feat;
+	mmio_dev->dev_feat_sel = rec.dev_feat_sel;
+	mmio_dev->dri_feat_sel = rec.dri_feat_sel;
+	mmio_dev->qsel = rec.qsel;
+	mmio_dev->isr = rec.isr;
+	mmio_dev->cfg_gen = rec.cfg_gen;
+	mmio_dev->dest = rec.dest;
+	mmio_dev->status = rec.status;
+	mmio_dev->vec = rec.vec;
+	for (int i = 0; i < vqdev->num_vqs; i++) {
+		vq = &vqdev->vqs[i];
+		if (read_all(fd, &vq_rec, sizeof(vq_rec)))
+			return vmimage_fmt_err("short vq state");
+		vq->vring.desc = (void*)vq_rec.desc;
+		vq->vring.avail = (void*)vq_rec.avail;
+		vq->vring.used = (void*)vq_rec.used;
+		vq->vring.num = vq_rec.num;
+		vq->last_used_irq = vq_rec.last_used_irq;
+		if (!vq_rec.qready)
+			continue;
+		/* Buffers the device had taken off the avail ring, but not yet put
+		 * on the used ring, were in flight in the old VMM.  Take them again.
+		 * Our devices use their buffers in order. */
+		vq->last_avail = vq->vring.used->idx;
+		virtio_mmio_start_vq(vm, vq);
+	}
+	if (read_all(fd, vqdev->cfg, rec.cfg_sz))
+		return vmimage_fmt_err("short config space");
+	return 0;
+}
+
+/* Restores the gpcs and devices from the image at path, after mapping its
+ * memory with vmm_image_map() and setting up the same devices with
+ * vmm_init().  Returns 0 on success, -1 with errno set o/w. */
+int vmm_image_restore(struct virtual_machine *vm, const char *path)
+{
+	struct vmimage_hdr hdr;
+	void *ioapic;
+	size_t ioapic_sz;
+	int fd, ret = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (read_hdr(fd, &hdr))
+		goto out;
+	if (hdr.nr_gpcs != vm->nr_gpcs) {
+		vmimage_fmt_err("the guest had a different number of gpcs");
+		goto out;
+	}
+	if (lseek(fd, hdr.state_off, SEEK_SET) < 0)
+		goto out;
+	for (int i = 0; i < vm->nr_gpcs; i++) {
+		if (restore_gpc(fd, gpcid_to_gth(vm, i)))
+			goto out;
+	}
+	ioapic = ioapic_state(&ioapic_sz);
+	if (hdr.ioapic_sz != ioapic_sz || read_all(fd, ioapic, ioapic_sz)) {
+		vmimage_fmt_err("bad IOAPIC state");
+		goto out;
+	}
+	for (int i = 0; i < hdr.nr_devs; i++) {
+		if (restore_dev(vm, fd))
+			goto out;
+	}
+	vm->up_gpcs = vm->nr_gpcs;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
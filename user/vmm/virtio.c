@@ -15,6 +15,7 @@
 #include <vmm/virtio.h>
 #include <vmm/virtio_ids.h>
 #include <vmm/virtio_config.h>
+#include <vmm/virtio_net.h>
 
 // Returns NULL if the features are valid, otherwise returns
 // an error string describing what part of validation failed
@@ -36,9 +37,17 @@ const char *virtio_validate_feat(struct virtio_vq_dev *vqdev, uint64_t feat)
 			// There is no "mandatory" feature bit that we always want to have,
 			// either the device can set its own MAC Address (as it does now)
 			// or the driver can set it using a controller thread.
+			if ((feat & ((uint64_t)1 << VIRTIO_NET_F_MQ)) &&
+			    !(feat & ((uint64_t)1 << VIRTIO_NET_F_CTRL_VQ)))
+				return "VIRTIO_NET_F_MQ requires VIRTIO_NET_F_CTRL_VQ.\n"
+				       "  See virtio-v1.0-cs04 s5.1.3.1.";
 			break;
 		case VIRTIO_ID_BLOCK:
 			break;
+		case VIRTIO_ID_BALLOON:
+			// We don't offer DEFLATE_ON_OOM or STATS_VQ, and the rest are
+			// independent.
+			break;
 		case 0:
 			return "Invalid device id (0x0)! On the MMIO transport, this value indicates that the device is a system memory map with placeholder devices at static, well known addresses. In any case, this is not something you validate features for.";
 		default:
@@ -0,0 +1,212 @@
+/* Copyright (c) 2026 The Regents of the University of California
+ * See LICENSE for details.
+ *
+ * Virtio balloon, sized by the guest's working set.
+ *
+ * The guest gives us pages on the inflateq, and we hand them back to the host
+ * with MADV_DONTNEED.  When it takes them back on the deflateq, there's nothing
+ * to do: the next touch faults in a zeroed page.
+ *
+ * How big the balloon should be comes from the EPT's accessed bits.  Every
+ * BALLOON_PERIOD_SEC, we harvest them (VMM_CTL_HARVEST_AD) and age each page
+ * that wasn't touched.  Pages that sat for BALLOON_IDLE_PERIODS are idle.  The
+ * pages in the balloon are idle too, since they aren't even mapped.  We aim to
+ * leave the guest 1/BALLOON_RESERVE_FRAC of its RAM as idle slack, and move the
+ * balloon halfway to that target each period, so a guest that starts touching
+ * more memory gets it back soon.
+ *
+ * Guest RAM starts out in jumbo pages, which only have one accessed bit for
+ * all 2 MB.  Ballooning breaks those up, so the estimate gets finer as we go.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <parlib/bitmask.h>
+#include <parlib/uthread.h>
+#include <vmm/vmm.h>
+#include <vmm/virtio.h>
+#include <vmm/virtio_mmio.h>
+#include <vmm/virtio_balloon.h>
+
+int debug_virtio_balloon;
+
+#define DPRINTF(fmt, ...)                                                      \
+	do {                                                                       \
+	if (debug_virtio_balloon) {                                                \
+		fprintf(stderr, "virtio_balloon: " fmt, ##__VA_ARGS__);                \
+	}                                                                          \
+	} while (0)
+
+#define BALLOON_PERIOD_SEC		10
+#define BALLOON_IDLE_PERIODS	3
+#define BALLOON_RESERVE_FRAC	16
+
+static struct virtual_machine *balloon_vm;
+
+static bool pfn_is_ram(uint64_t pfn)
+{
+	uintptr_t starts[2];
+	size_t lens[2];
+	int nr_ranges = guest_ram_ranges(balloon_vm, starts, lens);
+	uintptr_t gpa = pfn << VIRTIO_BALLOON_PFN_SHIFT;
+
+	for (int i = 0; i < nr_ranges; i++) {
+		if (gpa >= starts[i] && gpa - starts[i] < lens[i])
+			return true;
+	}
+	return false;
+}
+
+/* Gives the pages in pfns back to the host, one madvise per run of pages */
+static void balloon_inflate(struct virtio_vq *vq, uint32_t *pfns, size_t nr)
+{
+	uint64_t start = 0, run = 0;
+
+	for (size_t i = 0; i <= nr; i++) {
+		if (i < nr && !pfn_is_ram(pfns[i])) {
+			VIRTIO_DRI_WARNX(vq->vqdev, "Bad PFN 0x%x", pfns[i]);
+			continue;
+		}
+		if (i < nr && run && pfns[i] == start + run) {
+			run++;
+			continue;
+		}
+		if (run && madvise((void*)(start << VIRTIO_BALLOON_PFN_SHIFT),
+		                   run << VIRTIO_BALLOON_PFN_SHIFT, MADV_DONTNEED))
+			perror("virtio_balloon: madvise");
+		if (i < nr) {
+			start = pfns[i];
+			run = 1;
+		}
+	}
+}
+
+/* Services both queues.  Each buffer is an array of 32 bit PFNs. */
+void *balloon_queue_fn(void *_vq)
+{
+	struct virtio_vq *vq = _vq;
+	bool inflate = vq == &vq->vqdev->vqs[VIRTIO_BALLOON_INFLATEQ];
+	uint32_t head, olen, ilen;
+	struct iovec *iov;
+
+	iov = malloc(vq->qnum_max * sizeof(struct iovec));
+	if (!iov)
+		VIRTIO_DEV_ERRX(vq->vqdev, "Could not allocate the iovs");
+	while (1) {
+		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
+		if (ilen)
+			VIRTIO_DRI_ERRX(vq->vqdev,
+			                "Device-writable buffer in the balloon's queue");
+		for (int i = 0; i < olen; i++) {
+			if (inflate)
+				balloon_inflate(vq, iov[i].iov_base,
+				                iov[i].iov_len / sizeof(uint32_t));
+		}
+		virtio_add_used_desc(vq, head, 0);
+		virtio_mmio_notify_vq(vq);
+	}
+	free(iov);
+	return 0;
+}
+
+struct balloon_wss {
+	struct virtio_vq_dev		*vqdev;
+	uintptr_t					starts[2];
+	size_t						lens[2];
+	int							nr_ranges;
+	size_t						nr_pages;
+	/* Periods since each page was last touched, saturating */
+	uint8_t						*ages;
+	uint8_t						*bitmap;
+};
+
+/* Harvests the accessed bits and returns how many pages are idle */
+static size_t balloon_age_pages(struct balloon_wss *wss)
+{
+	uint8_t *age = wss->ages;
+	size_t nr_pgs, nr_idle = 0;
+
+	for (int i = 0; i < wss->nr_ranges; i++) {
+		nr_pgs = wss->lens[i] >> PGSHIFT;
+		memset(wss->bitmap, 0, BYTES_FOR_BITMASK(nr_pgs));
+		if (vmm_harvest_ad(wss->starts[i], wss->lens[i], wss->bitmap,
+		                   VMM_HARVEST_ACCESSED) < 0) {
+			perror("virtio_balloon: harvest");
+			return 0;
+		}
+		for (size_t j = 0; j < nr_pgs; j++, age++) {
+			if (GET_BITMASK_BIT(wss->bitmap, j))
+				*age = 0;
+			else if (*age < UINT8_MAX)
+				(*age)++;
+			if (*age >= BALLOON_IDLE_PERIODS)
+				nr_idle++;
+		}
+	}
+	return nr_idle;
+}
+
+static void balloon_set_target(struct balloon_wss *wss, size_t nr_idle)
+{
+	struct virtio_mmio_dev *mmio_dev = wss->vqdev->transport_dev;
+	struct virtio_balloon_config *cfg = wss->vqdev->cfg;
+	size_t actual = ACCESS_ONCE(cfg->actual);
+	size_t reserve = wss->nr_pages / BALLOON_RESERVE_FRAC;
+	size_t slack = nr_idle > actual ? nr_idle - actual : 0;
+	size_t target;
+
+	if (slack > reserve)
+		target = actual + (slack - reserve) / 2;
+	else
+		target = actual - MIN(actual, (reserve - slack + 1) / 2);
+	DPRINTF("idle %lu, actual %lu, target %lu\n", nr_idle, actual, target);
+	if (target == cfg->num_pages)
+		return;
+	cfg->num_pages = target;
+	mmio_dev->cfg_gen++;
+	virtio_mmio_set_cfg_irq(mmio_dev);
+	mmio_dev->poke_guest(mmio_dev->vec, mmio_dev->dest);
+}
+
+static void *balloon_wss_fn(void *arg)
+{
+	struct balloon_wss *wss = arg;
+	struct virtio_mmio_dev *mmio_dev = wss->vqdev->transport_dev;
+	size_t nr_idle;
+
+	while (1) {
+		uthread_sleep(BALLOON_PERIOD_SEC);
+		/* Keep aging before the driver shows up, so we have a head start */
+		nr_idle = balloon_age_pages(wss);
+		if (!(ACCESS_ONCE(mmio_dev->status) & VIRTIO_CONFIG_S_DRIVER_OK))
+			continue;
+		balloon_set_target(wss, nr_idle);
+	}
+	return 0;
+}
+
+/* Call after the guest's memory is mapped */
+void balloon_init_fn(struct virtual_machine *vm, struct virtio_vq_dev *vqdev)
+{
+	struct balloon_wss *wss;
+	size_t max_len = 0;
+
+	balloon_vm = vm;
+	wss = calloc(1, sizeof(struct balloon_wss));
+	if (!wss)
+		VIRTIO_DEV_ERRX(vqdev, "Could not allocate the balloon");
+	wss->vqdev = vqdev;
+	wss->nr_ranges = guest_ram_ranges(vm, wss->starts, wss->lens);
+	for (int i = 0; i < wss->nr_ranges; i++) {
+		wss->nr_pages += wss->lens[i] >> PGSHIFT;
+		max_len = MAX(max_len, wss->lens[i]);
+	}
+	wss->ages = calloc(wss->nr_pages, 1);
+	wss->bitmap = malloc(BYTES_FOR_BITMASK(max_len >> PGSHIFT));
+	if (!wss->ages || !wss->bitmap)
+		VIRTIO_DEV_ERRX(vqdev, "Could not allocate the balloon's page ages");
+	vmm_run_task(vm, balloon_wss_fn, wss);
+}
@@ -5,12 +5,20 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <string.h>
+#include <parlib/parlib.h>
+#include <parlib/event.h>
+#include <parlib/uthread.h>
+#include <vmm/sched.h>
 #include <vmm/virtio.h>
 #include <vmm/virtio_blk.h>
 #include <vmm/virtio_mmio.h>
 
 int debug_virtio_blk;
 
+/* Max requests in flight per virtqueue.  Each one has its own disk FD. */
+#define BLK_MAX_INFLIGHT	16
+
 #define DPRINTF(fmt, ...)                                                      \
 	do {                                                                       \
 	if (debug_virtio_blk) {                                                    \
@@ -19,7 +27,28 @@ int debug_virtio_blk;
 	} while (0)
 
 /* TODO(ganshun): multiple disks */
-static int diskfd;
+static struct blk_queue *blk_queues;
+
+/* Each in-flight request gets its own FD for the disk, so that we can lseek and
+ * then readv/writev without racing with other requests for the file offset. */
+struct blk_req {
+	struct syscall				sysc;
+	int							fd;
+	uint32_t					head;
+	struct iovec				iov[3];
+	struct blk_req				*next;
+};
+
+/* Per-virtqueue state.  blk_request() pulls descriptors from the guest and
+ * submits async syscalls, and blk_completer() reaps them from the evq. */
+struct blk_queue {
+	struct virtio_vq			*vq;
+	struct event_queue			*evq;
+	uth_mutex_t					mtx;
+	uth_cond_var_t				free_cv;
+	struct blk_req				*free_reqs;
+	struct blk_req				reqs[BLK_MAX_INFLIGHT];
+};
 
 void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename)
 {
@@ -27,10 +56,7 @@ void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename)
 	struct virtio_blk_config *cfg_d = vqdev->cfg_d;
 	uint64_t len;
 	struct stat stat_result;
-
-	diskfd = open(filename, O_RDWR);
-	if (diskfd < 0)
-		VIRTIO_DEV_ERRX(vqdev, "Could not open disk image file %s", filename);
+	struct blk_queue *bq;
 
 	if (stat(filename, &stat_result) == -1)
 		VIRTIO_DEV_ERRX(vqdev, "Could not stat file %s", filename);
@@ -38,6 +64,118 @@ void blk_init_fn(struct virtio_vq_dev *vqdev, const char *filename)
 
 	cfg->capacity = len;
 	cfg_d->capacity = len;
+
+	blk_queues = calloc(vqdev->num_vqs, sizeof(struct blk_queue));
+	if (!blk_queues)
+		VIRTIO_DEV_ERRX(vqdev, "Could not allocate the block queues");
+	for (int i = 0; i < vqdev->num_vqs; i++) {
+		bq = &blk_queues[i];
+		bq->vq = &vqdev->vqs[i];
+		uth_mutex_init(&bq->mtx);
+		uth_cond_var_init(&bq->free_cv);
+		/* Every syscall we submit on it will post an EV_SYSCALL */
+		bq->evq = get_eventq(EV_MBOX_UCQ);
+		bq->evq->ev_flags = EVENT_INDIR | EVENT_SPAM_INDIR | EVENT_WAKEUP;
+		evq_attach_wakeup_ctlr(bq->evq);
+		for (int j = 0; j < BLK_MAX_INFLIGHT; j++) {
+			bq->reqs[j].fd = open(filename, O_RDWR);
+			if (bq->reqs[j].fd < 0)
+				VIRTIO_DEV_ERRX(vqdev, "Could not open disk image file %s",
+				                filename);
+			bq->reqs[j].next = bq->free_reqs;
+			bq->free_reqs = &bq->reqs[j];
+		}
+	}
+}
+
+static struct blk_req *get_free_req(struct blk_queue *bq)
+{
+	struct blk_req *req;
+
+	uth_mutex_lock(&bq->mtx);
+	while (!bq->free_reqs)
+		uth_cond_var_wait(&bq->free_cv, &bq->mtx);
+	req = bq->free_reqs;
+	bq->free_reqs = req->next;
+	uth_mutex_unlock(&bq->mtx);
+	return req;
+}
+
+static void put_free_req(struct blk_queue *bq, struct blk_req *req)
+{
+	uth_mutex_lock(&bq->mtx);
+	req->next = bq->free_reqs;
+	bq->free_reqs = req;
+	uth_mutex_unlock(&bq->mtx);
+	uth_cond_var_signal(&bq->free_cv);
+}
+
+static void blk_hexdump(struct iovec *iov)
+{
+	char *pf = "";
+
+	for (int i = 0; i < iov->iov_len; i += 2) {
+		uint8_t *p = (uint8_t *)iov->iov_base + i;
+
+		fprintf(stderr, "%s%02x", pf, *(p + 1));
+		fprintf(stderr, "%02x", *p);
+		fprintf(stderr, " ");
+		pf = ((i + 2) % 16) ? " " : "\n";
+	}
+}
+
+/* Fills in the status for a finished request and puts it on the used ring.
+ * The caller interrupts the guest. */
+static void blk_complete(struct blk_queue *bq, struct blk_req *req)
+{
+	struct virtio_blk_outhdr *out = req->iov[0].iov_base;
+	uint8_t *status = req->iov[2].iov_base;
+	int64_t ret = req->sysc.retval;
+	size_t wlen = sizeof(*status);
+
+	if (out->type & VIRTIO_BLK_T_OUT) {
+		if (ret >= 0 && ret == req->iov[1].iov_len)
+			*status = VIRTIO_BLK_S_OK;
+		else
+			*status = VIRTIO_BLK_S_IOERR;
+	} else {
+		if (ret >= 0) {
+			wlen += ret;
+			*status = VIRTIO_BLK_S_OK;
+			// Hexdump for debugging.
+			if (debug_virtio_blk)
+				blk_hexdump(&req->iov[1]);
+		} else {
+			*status = VIRTIO_BLK_S_IOERR;
+		}
+	}
+	virtio_add_used_desc(bq->vq, req->head, wlen);
+}
+
+/* Reaps finished syscalls for a queue.  We block for the first one, then grab
+ * whatever else is done, so that a burst of completions gets one interrupt. */
+static void *blk_completer(void *arg)
+{
+	struct blk_queue *bq = arg;
+	struct event_msg msg;
+	struct blk_req *req;
+	int nr_done;
+
+	for (;;) {
+		uth_blockon_evqs(&msg, NULL, 1, bq->evq);
+		nr_done = 0;
+		do {
+			assert(msg.ev_type == EV_SYSCALL);
+			req = container_of((struct syscall*)msg.ev_arg3, struct blk_req,
+			                   sysc);
+			blk_complete(bq, req);
+			put_free_req(bq, req);
+			nr_done++;
+		} while (uth_check_evqs(&msg, NULL, 1, bq->evq));
+		DPRINTF("%s: completed %d requests\n", bq->vq->name, nr_done);
+		virtio_mmio_notify_vq(bq->vq);
+	}
+	return 0;
 }
 
 void *blk_request(void *_vq)
@@ -47,14 +185,13 @@ void *blk_request(void *_vq)
 	assert(vq != NULL);
 
 	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+	struct blk_queue *bq = &blk_queues[vq - vq->vqdev->vqs];
+	struct blk_req *req;
 	struct iovec *iov;
 	uint32_t head;
 	uint32_t olen, ilen;
 	struct virtio_blk_outhdr *out;
 	uint64_t offset;
-	int64_t ret;
-	size_t wlen;
-	uint8_t *status;
 	struct virtio_blk_config *cfg = vq->vqdev->cfg;
 
 	if (vq->qready != 0x1)
@@ -71,7 +208,12 @@ void *blk_request(void *_vq)
 		VIRTIO_DEV_ERRX(vq->vqdev,
 		                "malloc returned null trying to allocate iov.\n");
 
+	vmm_run_task(((struct vmm_thread*)current_uthread)->vm, blk_completer, bq);
+
 	for (;;) {
+		/* Wait for a slot first, so we don't hold a descriptor we can't
+		 * submit. */
+		req = get_free_req(bq);
 		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
 		/* There are always three iovecs.
 		 * The first is the header.
@@ -80,8 +222,7 @@ void *blk_request(void *_vq)
 		 */
 		assert(olen + ilen == 3);
 
-		status = iov[2].iov_base;
-		if (!status)
+		if (!iov[2].iov_base)
 			VIRTIO_DEV_ERRX(vq->vqdev, "no room for status\n");
 
 		out = iov[0].iov_base;
@@ -89,50 +230,25 @@ void *blk_request(void *_vq)
 			VIRTIO_DEV_ERRX(vq->vqdev, "Flush not supported.\n");
 
 		offset = out->sector * 512;
-		if (lseek64(diskfd, offset, SEEK_SET) != offset)
+		if (lseek64(req->fd, offset, SEEK_SET) != offset)
 			VIRTIO_DEV_ERRX(vq->vqdev, "Bad seek at sector %llu\n",
 			                out->sector);
 
+		req->head = head;
+		memcpy(req->iov, iov, sizeof(req->iov));
+		/* The kernel posts to the evq when it's done, even if it finishes
+		 * before returning to us. */
 		if (out->type & VIRTIO_BLK_T_OUT) {
 
 			if ((offset + iov[1].iov_len) > (cfg->capacity * 512))
 				VIRTIO_DEV_ERRX(vq->vqdev, "write past end of file!\n");
 
-			ret = writev(diskfd, &iov[1], 1);
-
-			if (ret >= 0 && ret == iov[1].iov_len)
-				*status = VIRTIO_BLK_S_OK;
-			else
-				*status = VIRTIO_BLK_S_IOERR;
-			wlen = sizeof(*status);
+			syscall_async_evq(&req->sysc, bq->evq, SYS_writev, req->fd,
+			                  &req->iov[1], 1);
 		} else {
-			ret = readv(diskfd, &iov[1], 1);
-			if (ret >= 0) {
-				wlen = sizeof(*status) + ret;
-				*status = VIRTIO_BLK_S_OK;
-			} else {
-				wlen = sizeof(*status);
-				*status = VIRTIO_BLK_S_IOERR;
-			}
-
-			// Hexdump for debugging.
-			if (debug_virtio_blk && ret >= 0) {
-				char *pf = "";
-
-				for (int i = 0; i < iov[olen].iov_len; i += 2) {
-					uint8_t *p = (uint8_t *)iov[olen].iov_base + i;
-
-					fprintf(stderr, "%s%02x", pf, *(p + 1));
-					fprintf(stderr, "%02x", *p);
-					fprintf(stderr, " ");
-					pf = ((i + 2) % 16) ? " " : "\n";
-				}
-			}
+			syscall_async_evq(&req->sysc, bq->evq, SYS_readv, req->fd,
+			                  &req->iov[1], 1);
 		}
-
-		virtio_add_used_desc(vq, head, wlen);
-		virtio_mmio_set_vring_irq(dev);
-		dev->poke_guest(dev->vec, dev->dest);
 	}
 	return 0;
 }
@@ -41,7 +41,6 @@ void *cons_receiveq_fn(void *_vq) // host -> guest
 	uint32_t i, j;
 	int num_read;
 	struct iovec *iov;
-	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
 
 	if (!vq)
 		errx(1,
@@ -94,12 +93,7 @@ void *cons_receiveq_fn(void *_vq) // host -> guest
 
 		// Poke the guest however the mmio transport prefers
 		// NOTE: assuming that the mmio transport was used for now.
-		virtio_mmio_set_vring_irq(dev);
-		if (dev->poke_guest)
-			dev->poke_guest(dev->vec, dev->dest);
-		else
-			VIRTIO_DEV_ERRX(vq->vqdev,
-				"The host MUST provide a way for device interrupts to be sent to the guest. The 'poke_guest' function pointer on the vq->vqdev->transport_dev (assumed to be a struct virtio_mmio_dev) was not set.");
+		virtio_mmio_notify_vq(vq);
 	}
 	free(iov);
 	return 0;
@@ -112,7 +106,6 @@ void *cons_transmitq_fn(void *_vq) // guest -> host
 	uint32_t olen, ilen;
 	uint32_t i, j;
 	struct iovec *iov;
-	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
 
 	if (!vq)
 		errx(1,
@@ -155,13 +148,8 @@ void *cons_transmitq_fn(void *_vq) // guest -> host
 		virtio_add_used_desc(vq, head, 0);
 
 		// Poke the guest however the mmio transport prefers
-		// NOTE: assuming that the mmio transport was used for now
-		virtio_mmio_set_vring_irq(dev);
-		if (dev->poke_guest)
-			dev->poke_guest(dev->vec, dev->dest);
-		else
-			VIRTIO_DEV_ERRX(vq->vqdev,
-				"The host MUST provide a way for device interrupts to be sent to the guest. The 'poke_guest' function pointer on the vq->vqdev->transport_dev (assumed to be a struct virtio_mmio_dev) was not set.");
+		// NOTE: assuming that the mmio transport was used for now.
+		virtio_mmio_notify_vq(vq);
 	}
 	free(iov);
 	return 0;
@@ -130,6 +130,34 @@ void virtio_add_used_desc(struct virtio_vq *vq, uint32_t head, uint32_t len)
 	vq->vring.used->idx++;
 }
 
+bool virtio_vq_has_avail(struct virtio_vq *vq)
+{
+	return vq->last_avail != ACCESS_ONCE(vq->vring.avail->idx);
+}
+
+// Decides whether or not the driver wants to hear about new used descriptors.
+// Without VIRTIO_RING_F_EVENT_IDX, the driver sets VRING_AVAIL_F_NO_INTERRUPT
+// when it doesn't want any (e.g. it's polling).  With EVENT_IDX, it tells us
+// the used idx it wants an interrupt at, and we only interrupt if we crossed
+// that idx since the last time we checked.
+//
+// Only call this from the thread that adds used descriptors to the vq.
+bool virtio_vq_needs_irq(struct virtio_vq *vq)
+{
+	uint16_t old_idx = vq->last_used_irq;
+	uint16_t new_idx = vq->vring.used->idx;
+
+	vq->last_used_irq = new_idx;
+	// The driver's reads of used->idx and our read of its flags / used_event
+	// need to be ordered with our used ring writes.  See virtio-v1.0-cs04
+	// s3.2.1.4 Sending Used Buffer Notifications.
+	mb();
+	if (vq->vqdev->dri_feat & (1ULL << VIRTIO_RING_F_EVENT_IDX))
+		return vring_need_event(ACCESS_ONCE(vring_used_event(&vq->vring)),
+		                        new_idx, old_idx);
+	return !(ACCESS_ONCE(vq->vring.avail->flags) & VRING_AVAIL_F_NO_INTERRUPT);
+}
+
 // Based on wait_for_vq_desc in Linux's'lguest.c, which came with
 // the following comment:
 /*
@@ -160,8 +188,11 @@ uint32_t virtio_next_avail_vq_desc(struct virtio_vq *vq, struct iovec iov[],
 
 		// We're about to wait on the eventfd, so we need to tell the guest
 		// that we want a notification when it adds new buffers for
-		// us to process.
+		// us to process.  With EVENT_IDX, the driver ignores the flags and
+		// notifies us when it adds the buffer at avail_event.
 		vq->vring.used->flags &= ~VRING_USED_F_NO_NOTIFY;
+		if (vq->vqdev->dri_feat & (1ULL << VIRTIO_RING_F_EVENT_IDX))
+			vring_avail_event(&vq->vring) = vq->last_avail;
 
 		// If the guest added an available buffer while we were unsetting
 		// the VRING_USED_F_NO_NOTIFY flag, we'll break out here and process
@@ -50,12 +50,50 @@
 
 void virtio_mmio_set_vring_irq(struct virtio_mmio_dev *mmio_dev)
 {
-	mmio_dev->isr |= VIRTIO_MMIO_INT_VRING;
+	/* Multiqueue devices have a service thread per queue */
+	__sync_fetch_and_or(&mmio_dev->isr, VIRTIO_MMIO_INT_VRING);
 }
 
 void virtio_mmio_set_cfg_irq(struct virtio_mmio_dev *mmio_dev)
 {
-	mmio_dev->isr |= VIRTIO_MMIO_INT_CONFIG;
+	__sync_fetch_and_or(&mmio_dev->isr, VIRTIO_MMIO_INT_CONFIG);
+}
+
+void virtio_mmio_notify_vq(struct virtio_vq *vq)
+{
+	struct virtio_mmio_dev *mmio_dev = vq->vqdev->transport_dev;
+
+	if (!virtio_vq_needs_irq(vq)) {
+		__sync_fetch_and_add(&mmio_dev->nr_irqs_suppressed, 1);
+		return;
+	}
+	if (!mmio_dev->poke_guest)
+		VIRTIO_DEV_ERRX(vq->vqdev,
+			"The host MUST provide a way for device interrupts to be sent to the guest. The 'poke_guest' function pointer on the vq->vqdev->transport_dev (assumed to be a struct virtio_mmio_dev) was not set.");
+	__sync_fetch_and_add(&mmio_dev->nr_irqs_injected, 1);
+	virtio_mmio_set_vring_irq(mmio_dev);
+	mmio_dev->poke_guest(mmio_dev->vec, mmio_dev->dest);
+}
+
+void virtio_mmio_start_vq(struct virtual_machine *vm, struct virtio_vq *vq)
+{
+	// Check that the host actually provided a service function
+	if (!vq->srv_fn) {
+		VIRTIO_DEV_ERRX(vq->vqdev,
+			"The host must provide a service function for each queue on the device before the driver writes 0x1 to QueueReady. No service function found for queue %s."
+			, vq->name);
+	}
+
+	virtio_check_vring(vq);
+
+	vq->eventfd = eventfd(0, 0);
+	vq->qready = 0x1;
+
+	vq->srv_th = vmm_run_task(vm, vq->srv_fn, vq);
+	if (!vq->srv_th) {
+		VIRTIO_DEV_ERRX(vq->vqdev,
+			"vm_run_task failed when trying to start service thread after driver wrote 0x1 to QueueReady.");
+	}
 }
 
 static void virtio_mmio_reset_cfg(struct virtio_mmio_dev *mmio_dev)
@@ -127,6 +165,7 @@ static void virtio_mmio_reset(struct virtio_mmio_dev *mmio_dev)
 
 		mmio_dev->vqdev->vqs[i].qready = 0;
 		mmio_dev->vqdev->vqs[i].last_avail = 0;
+		mmio_dev->vqdev->vqs[i].last_used_irq = 0;
 	}
 
 	virtio_mmio_reset_cfg(mmio_dev);
@@ -553,27 +592,8 @@ void virtio_mmio_wr(struct virtual_machine *vm,
 					// the vring the driver provided, set up an eventfd for the
 					// queue, set qready on the queue to 0x1, and then launch
 					// the service thread for the queue.
-
-					// Check that the host actually provided a service function
-					if (!mmio_dev->vqdev->vqs[mmio_dev->qsel].srv_fn) {
-						VIRTIO_DEV_ERRX(mmio_dev->vqdev,
-							"The host must provide a service function for each queue on the device before the driver writes 0x1 to QueueReady. No service function found for queue %u."
-							, mmio_dev->qsel);
-					}
-
-					virtio_check_vring(&mmio_dev->vqdev->vqs[mmio_dev->qsel]);
-
-					mmio_dev->vqdev->vqs[mmio_dev->qsel].eventfd = eventfd(0, 0);
-					mmio_dev->vqdev->vqs[mmio_dev->qsel].qready = 0x1;
-
-					mmio_dev->vqdev->vqs[mmio_dev->qsel].srv_th =
-							vmm_run_task(vm,
-									mmio_dev->vqdev->vqs[mmio_dev->qsel].srv_fn,
-									&mmio_dev->vqdev->vqs[mmio_dev->qsel]);
-					if (!mmio_dev->vqdev->vqs[mmio_dev->qsel].srv_th) {
-						VIRTIO_DEV_ERRX(mmio_dev->vqdev,
-							"vm_run_task failed when trying to start service thread after driver wrote 0x1 to QueueReady.");
-					}
+					virtio_mmio_start_vq(vm,
+					                &mmio_dev->vqdev->vqs[mmio_dev->qsel]);
 				} else if (mmio_dev->vqdev->vqs[mmio_dev->qsel].qready == 0x1
 					       && *value == 0x0) {
 					// Driver is trying to revoke QueueReady while the queue is
@@ -627,7 +647,7 @@ void virtio_mmio_wr(struct virtual_machine *vm,
 				VIRTIO_DRI_ERRX(mmio_dev->vqdev,
 					"Attempt to set undefined bits in InterruptACK register.\n"
 					"  See virtio-v1.0-cs04 s4.2.2.1 MMIO Device Register Layout");
-			mmio_dev->isr &= ~(*value);
+			__sync_fetch_and_and(&mmio_dev->isr, ~(*value));
 			break;
 
 		// Device status
@@ -35,8 +35,35 @@
 #include <vmm/net.h>
 #include <parlib/iovec.h>
 #include <iplib/iplib.h>
+#include <parlib/uthread.h>
 
 #define VIRTIO_HEADER_SIZE	12
+/* Max packets we'll give the guest before interrupting it */
+#define NET_RX_BATCH		32
+
+/* How many queue pairs the driver told us to use, with VIRTIO_NET_CTRL_MQ.
+ * Receive queues past that sleep on active_pairs_cv.  There's only one net
+ * device per VMM. */
+static unsigned int active_pairs = 1;
+static uth_mutex_t active_pairs_mtx = UTH_MUTEX_INIT;
+static uth_cond_var_t active_pairs_cv = UTH_COND_VAR_INIT;
+
+static unsigned int vq_pair_idx(struct virtio_vq *vq)
+{
+	return (vq - vq->vqdev->vqs) / 2;
+}
+
+static void wait_for_active_pair(struct virtio_vq *vq)
+{
+	unsigned int pair = vq_pair_idx(vq);
+
+	if (pair < ACCESS_ONCE(active_pairs))
+		return;
+	uth_mutex_lock(&active_pairs_mtx);
+	while (pair >= active_pairs)
+		uth_cond_var_wait(&active_pairs_cv, &active_pairs_mtx);
+	uth_mutex_unlock(&active_pairs_mtx);
+}
 
 void virtio_net_set_mac(struct virtio_vq_dev *vqdev, uint8_t *guest_mac)
 {
@@ -48,6 +75,10 @@ void virtio_net_set_mac(struct virtio_vq_dev *vqdev, uint8_t *guest_mac)
 
 /* net_receiveq_fn receives packets for the guest through the virtio networking
  * device and the _vq virtio queue.
+ *
+ * When packets are arriving faster than the guest takes them, we fill several
+ * buffers and send one interrupt for the batch.  We never block while holding
+ * back used buffers, o/w the guest could wait forever.
  */
 void *net_receiveq_fn(void *_vq)
 {
@@ -55,6 +86,7 @@ void *net_receiveq_fn(void *_vq)
 	uint32_t head;
 	uint32_t olen, ilen;
 	int num_read;
+	int nr_unnotified = 0;
 	struct iovec *iov;
 	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
 	struct virtio_net_hdr_v1 *net_header;
@@ -81,6 +113,12 @@ void *net_receiveq_fn(void *_vq)
 	}
 
 	for (;;) {
+		if (nr_unnotified && (!virtio_vq_has_avail(vq) ||
+		                      vq_pair_idx(vq) >= ACCESS_ONCE(active_pairs))) {
+			virtio_mmio_notify_vq(vq);
+			nr_unnotified = 0;
+		}
+		wait_for_active_pair(vq);
 		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
 		if (olen) {
 			free(iov);
@@ -96,7 +134,14 @@ void *net_receiveq_fn(void *_vq)
 		assert(iov[0].iov_len >= VIRTIO_HEADER_SIZE);
 		iov_strip_bytes(iov, ilen, VIRTIO_HEADER_SIZE);
 
-		num_read = vnet_receive_packet(iov, ilen);
+		num_read = vnet_try_receive_packet(iov, ilen);
+		if (!num_read) {
+			if (nr_unnotified) {
+				virtio_mmio_notify_vq(vq);
+				nr_unnotified = 0;
+			}
+			num_read = vnet_receive_packet(iov, ilen);
+		}
 		if (num_read < 0) {
 			free(iov);
 			VIRTIO_DEV_ERRX(vq->vqdev,
@@ -115,8 +160,10 @@ void *net_receiveq_fn(void *_vq)
 		net_header->gso_type = VIRTIO_NET_HDR_GSO_NONE;
 		virtio_add_used_desc(vq, head, num_read + VIRTIO_HEADER_SIZE);
 
-		virtio_mmio_set_vring_irq(dev);
-		dev->poke_guest(dev->vec, dev->dest);
+		if (++nr_unnotified >= NET_RX_BATCH) {
+			virtio_mmio_notify_vq(vq);
+			nr_unnotified = 0;
+		}
 	}
 	return 0;
 }
@@ -159,8 +206,108 @@ void *net_transmitq_fn(void *_vq)
 
 		virtio_add_used_desc(vq, head, 0);
 
-		virtio_mmio_set_vring_irq(dev);
-		dev->poke_guest(dev->vec, dev->dest);
+		virtio_mmio_notify_vq(vq);
+	}
+	return 0;
+}
+
+/* Handles a VIRTIO_NET_CTRL_MQ command, returning the ack. */
+static virtio_net_ctrl_ack net_ctrl_mq(struct virtio_vq *vq, uint8_t cmd,
+                                       struct iovec *iov, uint32_t olen)
+{
+	struct virtio_net_config *cfg = vq->vqdev->cfg;
+	struct virtio_net_ctrl_mq mq;
+
+	if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET)
+		return VIRTIO_NET_ERR;
+	if (!iov_has_bytes(iov, olen, sizeof(struct virtio_net_ctrl_hdr) +
+	                              sizeof(mq)))
+		return VIRTIO_NET_ERR;
+	iov_memcpy_from(iov, olen, sizeof(struct virtio_net_ctrl_hdr), &mq,
+	                sizeof(mq));
+	if (mq.virtqueue_pairs < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+	    mq.virtqueue_pairs > cfg->max_virtqueue_pairs)
+		return VIRTIO_NET_ERR;
+	uth_mutex_lock(&active_pairs_mtx);
+	active_pairs = mq.virtqueue_pairs;
+	uth_mutex_unlock(&active_pairs_mtx);
+	uth_cond_var_broadcast(&active_pairs_cv);
+	return VIRTIO_NET_OK;
+}
+
+/* net_ctrlq_fn handles commands from the driver on the control virtqueue.  The
+ * only one we support is setting the number of queue pairs.
+ *
+ * See virtio-v1.0-cs04 s5.1.6.5 Control Virtqueue
+ */
+void *net_ctrlq_fn(void *_vq)
+{
+	struct virtio_vq *vq = _vq;
+	uint32_t head;
+	uint32_t olen, ilen;
+	struct iovec *iov;
+	struct virtio_mmio_dev *dev = vq->vqdev->transport_dev;
+	struct virtio_net_ctrl_hdr hdr;
+	virtio_net_ctrl_ack ack;
+
+	iov = malloc(vq->qnum_max * sizeof(struct iovec));
+	assert(iov != NULL);
+
+	if (!dev->poke_guest) {
+		free(iov);
+		VIRTIO_DEV_ERRX(vq->vqdev,
+		                "The 'poke_guest' function pointer was not set.");
+	}
+
+	for (;;) {
+		head = virtio_next_avail_vq_desc(vq, iov, &olen, &ilen);
+		if (!iov_has_bytes(iov, olen, sizeof(hdr)) ||
+		    !iov_has_bytes(&iov[olen], ilen, sizeof(ack))) {
+			free(iov);
+			VIRTIO_DRI_ERRX(vq->vqdev,
+				"The driver's control command needs a header and an ack buffer.\n"
+				"  See virtio-v1.0-cs04 s5.1.6.5 Control Virtqueue");
+		}
+		iov_memcpy_from(iov, olen, 0, &hdr, sizeof(hdr));
+		switch (hdr.class) {
+		case VIRTIO_NET_CTRL_MQ:
+			ack = net_ctrl_mq(vq, hdr.cmd, iov, olen);
+			break;
+		default:
+			ack = VIRTIO_NET_ERR;
+		}
+		/* The ack is the last byte the driver gave us */
+		iov_memcpy_to(&iov[olen], ilen, iov_get_len(&iov[olen], ilen) - 1,
+		              &ack, sizeof(ack));
+		virtio_add_used_desc(vq, head, sizeof(ack));
+
+		virtio_mmio_notify_vq(vq);
 	}
 	return 0;
 }
+
+/* net_queue_fn is the service function for every queue of a multiqueue net
+ * device.  Which queue is which depends on whether the driver negotiated
+ * VIRTIO_NET_F_MQ: with it, the queues are receiveq1, transmitq1, ...,
+ * receiveqN, transmitqN, controlq, for N = max_virtqueue_pairs.  Without it,
+ * the controlq is right after the first pair.  Every queue gets its own
+ * thread, so the pairs run in parallel.
+ *
+ * See virtio-v1.0-cs04 s5.1.2 Virtqueues
+ */
+void *net_queue_fn(void *_vq)
+{
+	struct virtio_vq *vq = _vq;
+	struct virtio_vq_dev *vqdev = vq->vqdev;
+	struct virtio_net_config *cfg = vqdev->cfg;
+	unsigned int idx = vq - vqdev->vqs;
+	unsigned int ctrl_idx = 2;
+
+	if (vqdev->dri_feat & (1ULL << VIRTIO_NET_F_MQ))
+		ctrl_idx = 2 * cfg->max_virtqueue_pairs;
+	if ((vqdev->dri_feat & (1ULL << VIRTIO_NET_F_CTRL_VQ)) && idx == ctrl_idx)
+		return net_ctrlq_fn(vq);
+	if (idx % 2 == 0)
+		return net_receiveq_fn(vq);
+	return net_transmitq_fn(vq);
+}
@@ -239,6 +239,26 @@ static bool handle_vmcall_get_tscfreq(struct guest_thread *gth)
 	return TRUE;
 }
 
+/* Saves a VM image, which resumes after the vmcall returning 1, like a fork.
+ * The guest that asked gets 0, or -1 if we couldn't save it. */
+static bool handle_vmcall_snapshot(struct guest_thread *gth)
+{
+	struct vm_trapframe *vm_tf = gth_to_vmtf(gth);
+	struct virtual_machine *vm = gth_to_vm(gth);
+	int ret = -1;
+
+	if (vm->image_path) {
+		vm_tf->tf_rip += 3;
+		vm_tf->tf_rax = 1;
+		ret = vmm_image_save(vm, vm->image_path);
+		vm_tf->tf_rip -= 3;
+		if (ret)
+			perror("VM image save failed");
+	}
+	vm_tf->tf_rax = ret;
+	return TRUE;
+}
+
 static bool handle_vmcall(struct guest_thread *gth)
 {
 	struct vm_trapframe *vm_tf = gth_to_vmtf(gth);
@@ -258,6 +278,9 @@ static bool handle_vmcall(struct guest_thread *gth)
 	case VMCALL_GET_TSCFREQ:
 		retval = handle_vmcall_get_tscfreq(gth);
 		break;
+	case VMCALL_SNAPSHOT:
+		retval = handle_vmcall_snapshot(gth);
+		break;
 	case VMCALL_TRACE_TF:
 		trace_printf("  rax  0x%016lx\n",      vm_tf->tf_r11);
 		trace_printf("  rbx  0x%016lx\n",      vm_tf->tf_rbx);
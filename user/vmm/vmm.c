@@ -32,10 +32,17 @@ int vmm_interrupt_guest(struct virtual_machine *vm, unsigned int gpcoreid,
 		        VMX_POSTED_OUTSTANDING_NOTIF - 1);
 		return -1;
 	}
+	SET_BITMASK_BIT_ATOMIC(gpci->posted_irq_desc, vector);
+	/* Fast path, like the kernel's IPI-IRQ: if OUTSTANDING_NOTIF is already
+	 * set, whoever set it will poke the guest and kick the CV, and our vector
+	 * will get delivered with theirs.  Hardware clears notif before reading
+	 * the vectors, and the atomic orders our vector write before this read.
+	 * This way a burst of device completions costs one poke. */
+	if (GET_BITMASK_BIT(gpci->posted_irq_desc, VMX_POSTED_OUTSTANDING_NOTIF))
+		return 0;
 	/* Syncing with halting guest threads.  The Mutex protects changes to the
 	 * posted irq descriptor. */
 	uth_mutex_lock(gth->halt_mtx);
-	SET_BITMASK_BIT_ATOMIC(gpci->posted_irq_desc, vector);
 	/* Atomic op provides the mb() btw writing the vector and mucking with
 	 * OUTSTANDING_NOTIF.
 	 *